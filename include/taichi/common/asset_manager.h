@@ -14,15 +14,17 @@
 #include <map>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <iostream>
 
 TC_NAMESPACE_BEGIN
 
 class AssetManager {
 public:
-    // Note: this is not thread safe!
+    // Assets may be inserted and looked up from several threads at once, e.g. by textures loading concurrently
     template <typename T>
     std::shared_ptr<T> get_asset_(int id) {
+        std::lock_guard<std::mutex> _(mut);
         assert_info(id_to_asset.find(id) != id_to_asset.end(), "Asset not found");
         auto ptr = id_to_asset[id];
         assert_info(!ptr.expired(), "Asset has been expired");
@@ -31,6 +33,7 @@ public:
 
     template <typename T>
     int insert_asset_(const std::shared_ptr<T> &ptr) {
+        std::lock_guard<std::mutex> _(mut);
         if (asset_to_id.find(ptr.get()) != asset_to_id.end()) {
             int existing_id = asset_to_id.find(ptr.get())->second;
             assert_info(id_to_asset[existing_id].expired(), "Asset already exists");
@@ -56,6 +59,7 @@ public:
     int counter = 0;
     std::map<void *, int> asset_to_id;
     std::map<int, std::weak_ptr<void>> id_to_asset;
+    std::mutex mut;
 
     static AssetManager &get_instance() {
         static AssetManager manager;
@@ -88,6 +88,14 @@ public:
         return data.find(key) != data.end();
     }
 
+    std::vector<std::string> get_keys() const {
+        std::vector<std::string> keys;
+        for (auto &kv : data) {
+            keys.push_back(kv.first);
+        }
+        return keys;
+    }
+
     std::vector<std::string> get_string_arr(std::string key) const {
         std::string str = get_string(key);
         std::vector<std::string> strs = split_string(str, ",");
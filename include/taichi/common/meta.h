@@ -17,9 +17,62 @@
 #include <functional>
 #include <memory>
 #include <iostream>
+#include <chrono>
+#include <mutex>
+#include <vector>
 
 TC_NAMESPACE_BEGIN
 
+// Time spent on initialization outside of any task: every registration at load time, and every table built
+// lazily on first use. Heavy tables should be built lazily, so that short jobs do not pay for what they never use.
+class StartupProfile {
+public:
+    struct Record {
+        // "registration" or "table"
+        std::string category;
+        std::string name;
+        double seconds;
+    };
+
+    // Adds a record of the time from its construction to its destruction
+    class Scope {
+    public:
+        Scope(const std::string &category, const std::string &name)
+                : category(category), name(name), start(std::chrono::steady_clock::now()) {}
+
+        ~Scope() {
+            add(category, name, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+
+    private:
+        std::string category, name;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    static void add(const std::string &category, const std::string &name, double seconds) {
+        std::lock_guard<std::mutex> _(get_mutex());
+        get_records_().push_back(Record{category, name, seconds});
+    }
+
+    // In order of initialization
+    static std::vector<Record> get_records() {
+        std::lock_guard<std::mutex> _(get_mutex());
+        return get_records_();
+    }
+
+private:
+    // Function-local, as records are added during static initialization
+    static std::vector<Record> &get_records_() {
+        static std::vector<Record> records;
+        return records;
+    }
+
+    static std::mutex &get_mutex() {
+        static std::mutex mut;
+        return mut;
+    }
+};
+
 template <typename T>
 std::shared_ptr<T> create_instance(const std::string &alias);
 
@@ -157,6 +210,7 @@ extern TC_IMPLEMENTATION_HOLDER_NAME(T) *TC_IMPLEMENTATION_HOLDER_PTR(T);
     class InterfaceInjector_##class_name {\
         public:\
         InterfaceInjector_##class_name(const std::string &name) {\
+            StartupProfile::Scope _("registration", base_alias);\
             InterfaceHolder::get_instance()->register_registration_method(base_alias, [&](void *m) {\
                 ((pybind11::module *)m)->def("create_" base_alias, \
                     static_cast<std::shared_ptr<class_name>(*)(const std::string &name)>(&create_instance<class_name>)); \
@@ -174,6 +228,7 @@ extern TC_IMPLEMENTATION_HOLDER_NAME(T) *TC_IMPLEMENTATION_HOLDER_PTR(T);
     class ImplementationInjector_##base_class_name##class_name {\
         public:\
         ImplementationInjector_##base_class_name##class_name() {\
+            StartupProfile::Scope _("registration", std::string(#base_class_name "::") + alias);\
             TC_IMPLEMENTATION_HOLDER_NAME(base_class_name)::get_instance()->insert<class_name>(alias);\
         }\
     } ImplementationInjector_##base_class_name##class_name##instance;
@@ -0,0 +1,208 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/system/memory.h>
+#include <algorithm>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Fixed-size blocks for objects of type T that are created and destroyed one at a time, e.g. rigid bodies,
+// contacts, shapes or particles. Blocks are carved from slabs that grow with the pool and are only released at
+// exit, so there is no capacity limit and no call into malloc per object.
+// Each thread keeps its own free list: allocations and frees touch no lock until a thread runs out of blocks,
+// or has too many, and then moves a batch from or to a list shared by all threads. A block freed on another
+// thread than the one that allocated it simply joins the free list of the freeing thread.
+// There is one pool per type, for the whole process; slabs are accounted to the memory tag (see memory.h) of
+// the thread that grows the pool.
+template <typename T>
+class PoolAllocator {
+public:
+    static const std::size_t block_alignment = alignof(T) > alignof(void *) ? alignof(T) : alignof(void *);
+    static const std::size_t block_size =
+            ((sizeof(T) > sizeof(void *) ? sizeof(T) : sizeof(void *)) + block_alignment - 1) / block_alignment *
+            block_alignment;
+    // Blocks moved between a thread and the shared list at a time
+    static const std::size_t batch_size = 64;
+
+    // Storage for one T, never null
+    static void *allocate() {
+        Cache &cache = get_cache();
+        if (cache.free.head == nullptr) {
+            cache.shared.take(cache.free, batch_size);
+        }
+        return cache.free.pop();
+    }
+
+    static void deallocate(void *ptr) {
+        if (ptr == nullptr) {
+            return;
+        }
+        Cache &cache = get_cache();
+        cache.free.push(ptr);
+        if (cache.free.count >= 2 * batch_size) {
+            cache.shared.give(cache.free, batch_size);
+        }
+    }
+
+    template <typename... Args>
+    static T *create(Args &&... args) {
+        void *ptr = allocate();
+        try {
+            return new (ptr) T(std::forward<Args>(args)...);
+        } catch (...) {
+            deallocate(ptr);
+            throw;
+        }
+    }
+
+    static void destroy(T *t) {
+        if (t != nullptr) {
+            t->~T();
+            deallocate(t);
+        }
+    }
+
+    // Blocks in all the slabs, whether in use or free
+    static std::size_t get_capacity() {
+        Shared &shared = get_shared();
+        std::lock_guard<std::mutex> _(shared.mutex);
+        return shared.capacity;
+    }
+
+private:
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    struct FreeList {
+        FreeBlock *head = nullptr;
+        std::size_t count = 0;
+
+        void push(void *ptr) {
+            FreeBlock *block = static_cast<FreeBlock *>(ptr);
+            block->next = head;
+            head = block;
+            count++;
+        }
+
+        void *pop() {
+            FreeBlock *block = head;
+            head = block->next;
+            count--;
+            return block;
+        }
+
+        // Moves up to n blocks to list
+        void move_to(FreeList &list, std::size_t n) {
+            for (; n > 0 && head != nullptr; n--) {
+                list.push(pop());
+            }
+        }
+    };
+
+    struct Shared {
+        std::mutex mutex;
+        FreeList free;
+        std::vector<char *> slabs;
+        std::size_t capacity = 0;
+
+        // Moves n blocks to list, growing the pool as needed
+        void take(FreeList &list, std::size_t n) {
+            std::lock_guard<std::mutex> _(mutex);
+            if (free.count < n) {
+                grow(std::max(n, capacity));
+            }
+            free.move_to(list, n);
+        }
+
+        void give(FreeList &list, std::size_t n) {
+            std::lock_guard<std::mutex> _(mutex);
+            list.move_to(free, n);
+        }
+
+        // Doubles the pool up to slabs of a megabyte; blocks of a slab come out in address order
+        void grow(std::size_t num_blocks) {
+            num_blocks = std::max(batch_size, std::min(num_blocks, std::max(batch_size, (1 << 20) / block_size)));
+            const std::size_t alignment = std::max(block_alignment, (std::size_t)tc_cache_line_size);
+            char *slab = static_cast<char *>(aligned_malloc(num_blocks * block_size, alignment));
+            if (slab == nullptr) {
+                throw std::bad_alloc();
+            }
+            slabs.push_back(slab);
+            capacity += num_blocks;
+            for (std::size_t i = num_blocks; i-- > 0;) {
+                free.push(slab + i * block_size);
+            }
+        }
+
+        ~Shared() {
+            for (auto slab : slabs) {
+                aligned_free(slab);
+            }
+        }
+    };
+
+    struct Cache {
+        Shared &shared;
+        FreeList free;
+
+        explicit Cache(Shared &shared) : shared(shared) {}
+
+        // Blocks of exiting threads go back to the shared list
+        ~Cache() {
+            shared.give(free, free.count);
+        }
+    };
+
+    static Shared &get_shared() {
+        static Shared shared;
+        return shared;
+    }
+
+    static Cache &get_cache() {
+        // The shared list is constructed first, so that it outlives the caches of all threads
+        static thread_local Cache cache(get_shared());
+        return cache;
+    }
+};
+
+template <typename T>
+const std::size_t PoolAllocator<T>::block_alignment;
+
+template <typename T>
+const std::size_t PoolAllocator<T>::block_size;
+
+template <typename T>
+const std::size_t PoolAllocator<T>::batch_size;
+
+// Within the body of class T, makes new and delete of T take blocks of PoolAllocator<T>. Objects of derived
+// classes of another size fall back to the global operators.
+#define TC_POOL_ALLOCATED(T)                                                 \
+    static void *operator new(std::size_t size) {                            \
+        if (size != sizeof(T)) {                                             \
+            return ::operator new(size);                                     \
+        }                                                                    \
+        return ::taichi::PoolAllocator<T>::allocate();                       \
+    }                                                                        \
+    static void operator delete(void *ptr, std::size_t size) {               \
+        if (size != sizeof(T)) {                                             \
+            ::operator delete(ptr);                                          \
+        } else {                                                             \
+            ::taichi::PoolAllocator<T>::deallocate(ptr);                     \
+        }                                                                    \
+    }
+
+TC_NAMESPACE_END
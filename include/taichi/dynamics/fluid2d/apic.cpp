@@ -27,8 +27,7 @@ void APICLiquid::initialize_solver(const Config &config) {
 }
 
 void APICLiquid::rasterize() {
-    rasterize_component<Particle::get_affine_velocity<0>>(u, u_count);
-    rasterize_component<Particle::get_affine_velocity<1>>(v, v_count);
+    rasterize_velocity<Particle::get_affine_velocity<0>, Particle::get_affine_velocity<1>>();
 }
 
 void APICLiquid::sample_c()
@@ -52,20 +51,29 @@ Vector2 APICLiquid::sample_c(Vector2 & pos, Array<real> & val) {
 
 void APICLiquid::substep(real delta_t) {
     Time::Timer _("substep");
+    update_velocity_weights();
     apply_external_forces(delta_t);
     mark_cells();
-    rasterize();
+    if (narrow_band > 0) {
+        rasterize_narrow_band(delta_t);
+    } else {
+        rasterize();
+    }
     if (t == 0.0f)
         compute_liquid_levelset();
     else {
         advect_liquid_levelset(delta_t);
     }
     simple_extrapolate();
+    apply_viscosity(delta_t);
     TIME(project(delta_t));
     simple_extrapolate();
     apply_boundary_condition();
     sample_c();
     advect(delta_t);
+    if (narrow_band > 0) {
+        EulerLiquid::advect(delta_t);
+    }
     t += delta_t;
 }
 
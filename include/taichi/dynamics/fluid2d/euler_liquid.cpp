@@ -31,7 +31,8 @@ void EulerLiquid::initialize_solver(const Config &config)
     width = config.get("simulation_width", 64);
     height = config.get("simulation_height", 64);
     kernel_size = config.get("kernel_size", 1);
-    cfl = config.get("cfl", 0.1f);
+    // Substeps are at least a thousandth of the frame
+    time_stepper.initialize(config, 0.1f, 0.001f);
     u = Array<real>(width + 1, height, 0.0f, Vector2(0.0f, 0.5f));
     u_weight = Array<real>(width + 1, height, 0.0f, Vector2(0.0f, 0.5f));
     v = Array<real>(width, height + 1, 0.0f, Vector2(0.5f, 0.0f));
@@ -41,6 +42,14 @@ void EulerLiquid::initialize_solver(const Config &config)
     maximum_iterations = config.get("maximum_iterations", 300);
     tolerance = config.get("tolerance", 1e-4f);
     theta_threshold = config.get("theta_threshold", 0.1f);
+    pressure_solver = config.get("pressure_solver", std::string("micpcg"));
+    assert_info(pressure_solver == "cg" || pressure_solver == "micpcg" || pressure_solver == "mgpcg",
+                "'pressure_solver' has to be 'cg', 'micpcg' or 'mgpcg' instead of " + pressure_solver);
+    warm_start = config.get("warm_start", true);
+    multigrid_smoothing_iterations = config.get("multigrid_smoothing_iterations", 2);
+    num_threads = config.get("num_threads", 1);
+    viscosity = config.get("viscosity", 0.0f);
+    viscosity_tolerance = config.get("viscosity_tolerance", 1e-5f);
     initialize_pressure_solver();
     liquid_levelset.initialize(width, height, Vector2(0.5f, 0.5f));
     t = 0;
@@ -171,37 +180,19 @@ void EulerLiquid::simple_extrapolate() {
 
 void EulerLiquid::step(real delta_t)
 {
-    real simulation_time = 0.0f;
-    while (simulation_time < delta_t - eps) {
-        real purpose_dt = get_dt_with_cfl_1() * cfl;
-        real thres = 0.001f;
-        if (purpose_dt < delta_t * thres) {
-            purpose_dt = delta_t * thres;
-            printf("substep dt too small, clamp.\n");
-            Particle fastest;
-            real avg = 0;
-            for (auto &p : particles) {
-                if (length(p.velocity) > length(fastest.velocity)) {
-                    fastest = p;
-                }
-                avg += abs(p.velocity.x) + abs(p.velocity.y);
-            }
-            printf("Fastest particle:\n");
-            P(fastest.position);
-            P(fastest.velocity);
-            avg /= particles.size() * 2;
-            P(avg);
-        }
-        real dt = std::min(delta_t - simulation_time, purpose_dt);
+    time_stepper.begin_frame(delta_t);
+    real remaining = delta_t;
+    while (remaining > eps) {
+        const real dt = time_stepper.get_substep(remaining, get_max_grid_speed(), length(gravity));
         substep(dt);
-        simulation_time += dt;
+        remaining = dt < remaining ? remaining - dt : 0.0f;
     }
+    step_substeps.push_back(time_stepper.get_num_substeps());
     //compute_liquid_levelset();
 }
 
 void EulerLiquid::compute_liquid_levelset()
 {
-    error("error");
     liquid_levelset.reset(1e7f); // Do not use INF here, otherwise interpolation will get NAN...
     for (auto &p : particles) {
         for (auto &ind : liquid_levelset.get_rasterization_region(p.position, 3)) {
@@ -227,41 +218,7 @@ void EulerLiquid::advect_liquid_levelset(real delta_t) {
 }
 
 void EulerLiquid::rebuild_levelset(LevelSet2D &levelset, real band) {
-    // Actually, we use a brute-force initialization here
-    Array<real> old = levelset;
-    levelset.reset(band);
-    auto update = [&](const Index2D &a, const Index2D &b) {
-        real phi_0 = old[a], phi_1 = old[b];
-        if (phi_0 * phi_1 > 0) {
-            return;
-        }
-        // Free surface detected
-        real p = std::abs(phi_0 / (phi_1 - phi_0));
-        Vector2 pos = lerp(p, Vector2(a.i, a.j), Vector2(b.i, b.j));
-        for (int i = std::max(0, int(floor(a.i - band)));
-             i <= std::min(levelset.get_width() - 1, int(b.i + band)); i++) {
-            for (int j = std::max(0, int(floor(a.j - band)));
-                 j <= std::min(levelset.get_height() - 1, int(b.j + band)); j++) {
-                real l = length(Vector2(i, j) - pos);
-                levelset[i][j] = std::min(levelset[i][j], l);
-            }
-        }
-    };
-    for (auto &ind : old.get_region()) {
-        if (ind.i > 0) {
-            const Index2D a = ind.neighbour(-1, 0);
-            const Index2D b = ind;
-            update(a, b);
-        }
-        if (ind.j > 0) {
-            const Index2D a = ind.neighbour(0, -1);
-            const Index2D b = ind;
-            update(a, b);
-        }
-    }
-    for (auto &ind : levelset.get_region()) {
-        levelset[ind] *= sgn(old[ind]);
-    }
+    levelset.redistance(band, num_threads);
 }
 
 
@@ -319,8 +276,8 @@ void EulerLiquid::advect(real delta_t) {
     }
     */
     Array<real> new_u = advect(u, delta_t), new_v = advect(v, delta_t);
-    u = new_u;
-    v = new_v;
+    u.swap(new_u);
+    v.swap(new_v);
 }
 
 void EulerLiquid::apply_external_forces(real delta_t) {
@@ -346,12 +303,12 @@ bool EulerLiquid::inside(int x, int y) {
 }
 
 void EulerLiquid::update_velocity_weights() {
-    for (auto &ind : u.get_region()) {
+    parallel_for(u.get_region(), num_threads, [&](const Index2D &ind) {
         u_weight[ind] = LevelSet2D::fraction_outside(boundary_levelset[ind], boundary_levelset[ind.neighbour(Vector2i(0, 1))]);
-    }
-    for (auto &ind : v.get_region()) {
+    });
+    parallel_for(v.get_region(), num_threads, [&](const Index2D &ind) {
         v_weight[ind] = LevelSet2D::fraction_outside(boundary_levelset[ind], boundary_levelset[ind.neighbour(Vector2i(1, 0))]);
-    }
+    });
 }
 
 void EulerLiquid::prepare_for_pressure_solve() {
@@ -359,7 +316,6 @@ void EulerLiquid::prepare_for_pressure_solve() {
     Ay = 0;
     Ad = 0;
     E = 0;
-    particles.clear();
     const real theta_threshold = 0.01f;
     Array<char> boundary_cell(width, height, false);
     for (int i = 0; i < width; i++) {
@@ -392,8 +348,8 @@ void EulerLiquid::prepare_for_pressure_solve() {
         real vel_weight;
 
         neighbour_phi = liquid_levelset.sample(ind.get_pos() - Vector2(1, 0));
+        vel_weight = u_weight[ind];
         if (neighbour_phi < 0 || boundary_cell[i][j] || boundary_cell[i - 1][j]) {
-            vel_weight = u_weight[ind];
             lhs += vel_weight;
         }
         else {
@@ -402,8 +358,8 @@ void EulerLiquid::prepare_for_pressure_solve() {
         }
 
         neighbour_phi = liquid_levelset.sample(ind.get_pos() + Vector2(1, 0));
+        vel_weight = u_weight[ind.neighbour(Vector2i(1, 0))];
         if (neighbour_phi < 0 || boundary_cell[i][j] || boundary_cell[i + 1][j]) {
-            vel_weight = u_weight[ind.neighbour(Vector2i(1, 0))];
             lhs += vel_weight;
             Ax[i][j] -= vel_weight;
         }
@@ -413,8 +369,8 @@ void EulerLiquid::prepare_for_pressure_solve() {
         }
 
         neighbour_phi = liquid_levelset.sample(ind.get_pos() - Vector2(0, 1));
+        vel_weight = v_weight[ind];
         if (neighbour_phi < 0 || boundary_cell[i][j] || boundary_cell[i][j - 1]) {
-            vel_weight = v_weight[ind];
             lhs += vel_weight;
         }
         else {
@@ -424,8 +380,8 @@ void EulerLiquid::prepare_for_pressure_solve() {
 
 
         neighbour_phi = liquid_levelset.sample(ind.get_pos() + Vector2(0, 1));
+        vel_weight = v_weight[ind.neighbour(Vector2i(0, 1))];
         if (neighbour_phi < 0 || boundary_cell[i][j] || boundary_cell[i][j + 1]) {
-            vel_weight = v_weight[ind.neighbour(Vector2i(0, 1))];
             lhs += vel_weight;
             Ay[i][j] -= vel_weight;
         }
@@ -441,6 +397,13 @@ void EulerLiquid::prepare_for_pressure_solve() {
         printf("Warning: Non diagonally dominant matrix found!\n");
     }
 
+    if (pressure_solver == "mgpcg") {
+        build_multigrid_preconditioner();
+    }
+    if (pressure_solver != "micpcg") {
+        return;
+    }
+
     real tao = 0.97f, sigma = 0.25f;
 
     for (auto &ind : cell_types.get_region()) {
@@ -471,8 +434,7 @@ void EulerLiquid::prepare_for_pressure_solve() {
     }
 }
 
-EulerLiquid::Array<real> EulerLiquid::apply_A(const Array<real> &x) {
-    Array<real> y(width, height);
+void EulerLiquid::apply_A(const Array<real> &x, Array<real> &y) {
     for (int i = 0; i < width; i++) {
         for (int j = 0; j < height; j++) {
             if (Ad[i][j] > 0) {
@@ -493,44 +455,55 @@ EulerLiquid::Array<real> EulerLiquid::apply_A(const Array<real> &x) {
             }
         }
     }
-    return y;
 }
 
-
-EulerLiquid::Array<real> EulerLiquid::solve_pressure_naive() {
+void EulerLiquid::solve_pressure() {
     static int total_count = 0;
     int count = 0;
-    Array<real> r = get_rhs(), z, s;
-    z = apply_preconditioner(r);
-    s = z;
-#define CH(v) if (!v.is_normal()) printf("Abnormal value doring CG: %s [Ln %d]\n", #v, __LINE__);
-    pressure = 0;
-    double sigma = z.dot_double(r);
-    double zs;
-
-    for (count = 0; count < maximum_iterations; count++){
-        z = apply_A(s);
-        zs = z.dot_double(s);
-        double alpha = sigma / max(1e-6, zs);
-        pressure = pressure.add((real)alpha, s);
-        r = r.add(-(real)alpha, z);
-        if (r.abs_max() < tolerance) break;
-        z = apply_preconditioner(r);
-        double sigma_new = z.dot_double(r);
-        double beta = sigma_new / sigma;
-        s = z.add((real)beta, s);
-        sigma = sigma_new;
+    Array<real> &r = cg_r, &z = cg_z, &s = cg_s;
+    get_rhs(r);
+    if (warm_start) {
+        // The last solution is only meaningful on the current fluid cells
+        for (auto &ind : pressure.get_region()) {
+            if (Ad[ind] <= 0) {
+                pressure[ind] = 0;
+            }
+        }
+        apply_A(pressure, z);
+        r -= z;
+    } else {
+        pressure = 0;
+    }
+    if (r.abs_max(num_threads) >= tolerance) {
+        apply_preconditioner(r, z);
+        s = z;
+        double sigma = z.dot_double(r, num_threads);
+        double zs;
+
+        for (count = 0; count < maximum_iterations; count++) {
+            apply_A(s, z);
+            zs = z.dot_double(s, num_threads);
+            double alpha = sigma / max(1e-6, zs);
+            pressure.axpy((real)alpha, s, num_threads);
+            r.axpy(-(real)alpha, z, num_threads);
+            if (r.abs_max(num_threads) < tolerance) break;
+            apply_preconditioner(r, z);
+            double sigma_new = z.dot_double(r, num_threads);
+            double beta = sigma_new / sigma;
+            s.xpay(z, (real)beta, num_threads);
+            sigma = sigma_new;
+        }
     }
     total_count += count;
     printf("t = %f, iterated %d times, avg = %f\n", t, count, total_count / t);
-    return pressure;
 }
 
 void EulerLiquid::project(real delta_t) {
     update_volume_controller();
     apply_boundary_condition();
     prepare_for_pressure_solve();
-    p = solve_pressure_naive();
+    solve_pressure();
+    p = pressure;
     if (!(p.is_normal())) {
         printf("Abnormal pressure!!!!!\n");
     }
@@ -560,6 +533,7 @@ void EulerLiquid::substep(real delta_t) {
     update_velocity_weights();
     apply_external_forces(delta_t);
     mark_cells();
+    apply_viscosity(delta_t);
     project(delta_t);
     simple_extrapolate();
     advect(delta_t);
@@ -602,16 +576,16 @@ void EulerLiquid::apply_pressure(const Array<real> &p) {
 }
 
 void EulerLiquid::apply_boundary_condition() {
-    for (auto &ind : u.get_region()) {
+    parallel_for(u.get_region(), num_threads, [&](const Index2D &ind) {
         if (u_weight[ind] == 0.0f) {
             u[ind] = 0.0f;
         }
-    }
-    for (auto &ind : v.get_region()) {
+    });
+    parallel_for(v.get_region(), num_threads, [&](const Index2D &ind) {
         if (v_weight[ind] == 0.0f) {
             v[ind] = 0.0f;
         }
-    }
+    });
 }
 
 real EulerLiquid::get_current_time() {
@@ -632,7 +606,20 @@ LevelSet2D EulerLiquid::get_liquid_levelset() {
 }
 
 
-EulerLiquid::Array<real> EulerLiquid::apply_preconditioner(const Array<real> &r) {
+void EulerLiquid::apply_preconditioner(const Array<real> &r, Array<real> &z) {
+    if (pressure_solver == "micpcg") {
+        apply_mic_preconditioner(r, z);
+    } else if (pressure_solver == "mgpcg") {
+        MultigridLevel &fine = multigrid_levels[0];
+        fine.b = r;
+        multigrid_vcycle(0);
+        z = fine.x;
+    } else {
+        z = r;
+    }
+}
+
+void EulerLiquid::apply_mic_preconditioner(const Array<real> &r, Array<real> &z) {
     q = 0;
     z = 0;
     assert_info(E.is_normal(), "Abnormal E!\n");
@@ -662,11 +649,158 @@ EulerLiquid::Array<real> EulerLiquid::apply_preconditioner(const Array<real> &r)
             }
         }
     }
-    return z;
 }
 
-EulerLiquid::Array<real> EulerLiquid::get_rhs() {
-    Array<real> r(width, height, 0);
+// Piecewise constant aggregation: the coarse operator of a level is the Galerkin product P^T A P of the
+// finer one, halved. As in MultigridPoissonSolver2D (which restricts by summing and prolongates
+// without a 0.5 factor), this compensates the underestimated coarse correction of constant prolongation.
+// Couplings to cells without a degree of freedom are dropped, so that every level is symmetric.
+void EulerLiquid::build_multigrid_preconditioner() {
+    MultigridLevel &fine = multigrid_levels[0];
+    fine.Ad = Ad;
+    fine.Ax = Ax;
+    fine.Ay = Ay;
+    for (int i = 0; i < width; i++) {
+        for (int j = 0; j < height; j++) {
+            if (Ad[i][j] <= 0) {
+                fine.Ad[i][j] = 0;
+            }
+            if (Ad[i][j] <= 0 || i == width - 1 || Ad[i + 1][j] <= 0) {
+                fine.Ax[i][j] = 0;
+            }
+            if (Ad[i][j] <= 0 || j == height - 1 || Ad[i][j + 1] <= 0) {
+                fine.Ay[i][j] = 0;
+            }
+        }
+    }
+    for (int l = 1; l < (int)multigrid_levels.size(); l++) {
+        const MultigridLevel &f = multigrid_levels[l - 1];
+        MultigridLevel &c = multigrid_levels[l];
+        const int fw = f.Ad.get_width(), fh = f.Ad.get_height();
+        c.Ad = 0;
+        c.Ax = 0;
+        c.Ay = 0;
+        for (int i = 0; i < fw; i++) {
+            for (int j = 0; j < fh; j++) {
+                if (f.Ad[i][j] <= 0) {
+                    continue;
+                }
+                real &diag = c.Ad[i / 2][j / 2];
+                diag += f.Ad[i][j];
+                // Couplings inside an aggregate go to the diagonal (twice, as A is symmetric),
+                // the others to the coarse off-diagonals
+                if (i % 2 == 0) {
+                    diag += 2 * f.Ax[i][j];
+                } else if (i + 1 < fw) {
+                    c.Ax[i / 2][j / 2] += f.Ax[i][j];
+                }
+                if (j % 2 == 0) {
+                    diag += 2 * f.Ay[i][j];
+                } else if (j + 1 < fh) {
+                    c.Ay[i / 2][j / 2] += f.Ay[i][j];
+                }
+            }
+        }
+        const int cw = c.Ad.get_width(), ch = c.Ad.get_height();
+        for (int i = 0; i < cw; i++) {
+            for (int j = 0; j < ch; j++) {
+                // An aggregate with a singular block (e.g. an enclosed pocket) gets no correction
+                if (c.Ad[i][j] <= 1e-6f) {
+                    c.Ad[i][j] = 0;
+                }
+                c.Ad[i][j] *= 0.5f;
+                c.Ax[i][j] *= 0.5f;
+                c.Ay[i][j] *= 0.5f;
+            }
+        }
+        for (int i = 0; i < cw; i++) {
+            for (int j = 0; j < ch; j++) {
+                if (c.Ad[i][j] == 0 || i == cw - 1 || c.Ad[i + 1][j] == 0) {
+                    c.Ax[i][j] = 0;
+                }
+                if (c.Ad[i][j] == 0 || j == ch - 1 || c.Ad[i][j + 1] == 0) {
+                    c.Ay[i][j] = 0;
+                }
+            }
+        }
+    }
+}
+
+// Red-black Gauss-Seidel; the reversed order makes post-smoothing the adjoint of pre-smoothing,
+// which keeps the V-cycle symmetric, as CG needs.
+void EulerLiquid::multigrid_smooth(int level, int iterations, bool reversed) {
+    MultigridLevel &m = multigrid_levels[level];
+    const int w = m.Ad.get_width(), h = m.Ad.get_height();
+    for (int k = 0; k < iterations; k++) {
+        for (int c = 0; c < 2; c++) {
+            const int color = reversed ? 1 - c : c;
+            for (int i = 0; i < w; i++) {
+                for (int j = (i + color) % 2; j < h; j += 2) {
+                    if (m.Ad[i][j] == 0) {
+                        continue;
+                    }
+                    real t = m.b[i][j];
+                    if (0 < i)
+                        t -= m.Ax[i - 1][j] * m.x[i - 1][j];
+                    if (i < w - 1)
+                        t -= m.Ax[i][j] * m.x[i + 1][j];
+                    if (0 < j)
+                        t -= m.Ay[i][j - 1] * m.x[i][j - 1];
+                    if (j < h - 1)
+                        t -= m.Ay[i][j] * m.x[i][j + 1];
+                    m.x[i][j] = t / m.Ad[i][j];
+                }
+            }
+        }
+    }
+}
+
+void EulerLiquid::multigrid_vcycle(int level) {
+    MultigridLevel &m = multigrid_levels[level];
+    m.x = 0;
+    if (level == (int)multigrid_levels.size() - 1) {
+        for (int k = 0; k < 20; k++) {
+            multigrid_smooth(level, 1, false);
+            multigrid_smooth(level, 1, true);
+        }
+        return;
+    }
+    multigrid_smooth(level, multigrid_smoothing_iterations, false);
+    const int w = m.Ad.get_width(), h = m.Ad.get_height();
+    MultigridLevel &c = multigrid_levels[level + 1];
+    c.b = 0;
+    for (int i = 0; i < w; i++) {
+        for (int j = 0; j < h; j++) {
+            if (m.Ad[i][j] == 0) {
+                continue;
+            }
+            real t = m.b[i][j] - m.Ad[i][j] * m.x[i][j];
+            if (0 < i)
+                t -= m.Ax[i - 1][j] * m.x[i - 1][j];
+            if (i < w - 1)
+                t -= m.Ax[i][j] * m.x[i + 1][j];
+            if (0 < j)
+                t -= m.Ay[i][j - 1] * m.x[i][j - 1];
+            if (j < h - 1)
+                t -= m.Ay[i][j] * m.x[i][j + 1];
+            if (c.Ad[i / 2][j / 2] != 0) {
+                c.b[i / 2][j / 2] += t;
+            }
+        }
+    }
+    multigrid_vcycle(level + 1);
+    for (int i = 0; i < w; i++) {
+        for (int j = 0; j < h; j++) {
+            if (m.Ad[i][j] != 0) {
+                m.x[i][j] += c.x[i / 2][j / 2];
+            }
+        }
+    }
+    multigrid_smooth(level, multigrid_smoothing_iterations, true);
+}
+
+void EulerLiquid::get_rhs(Array<real> &r) {
+    r = 0;
     real correction = get_volume_correction();
     for (auto &ind : cell_types.get_region()) {
         if (Ad[ind] > 0) {
@@ -678,42 +812,132 @@ EulerLiquid::Array<real> EulerLiquid::get_rhs() {
             r[ind] = rhs + correction;
         }
     }
-    return r;
 }
 
-void EulerLiquid::apply_viscosity(real delta_t) {
-    //static real tmp[2048][2048];
-    //for (int i = 1; i < width; i++) {
-    //    for (int j = 1; j < height - 1; j++) {
-    //        real sum = u[i][j] * 4;
-    //        sum -= u[i - 1][j];
-    //        sum -= u[i + 1][j];
-    //        sum -= u[i][j - 1];
-    //        sum -= u[i][j + 1];
-    //        tmp[i][j] = sum;
-    //    }
-    //}
-    //for (int i = 1; i < width; i++) {
-    //    for (int j = 1; j < height - 1; j++) {
-    //        u[i][j] -= viscosity * delta_t * tmp[i][j];
-    //    }
-    //}
-    //for (int i = 1; i < width - 1; i++) {
-    //    for (int j = 1; j < height; j++) {
-    //        real sum = v[i][j] * 4;
-    //        sum -= v[i - 1][j];
-    //        sum -= v[i + 1][j];
-    //        sum -= v[i][j - 1];
-    //        sum -= v[i][j + 1];
-    //        tmp[i][j] = sum;
-    //    }
-    //}
-    //for (int i = 1; i < width - 1; i++) {
-    //    for (int j = 1; j < height; j++) {
-    //        v[i][j] -= viscosity * delta_t * tmp[i][j];
-    //    }
-    //}
+// Solved for are the faces with some liquid next to them. Their neighbours are either solved for too,
+// solid (kept at their velocity, as are the domain walls at zero) or in the air (traction free).
+void EulerLiquid::build_viscosity_system(ViscositySystem &sys, const Array<real> &vel, const Array<real> &weight,
+                                         int axis, real alpha) {
+    const int w = vel.get_width(), h = vel.get_height();
+    if (sys.Ad.get_width() != w || sys.Ad.get_height() != h) {
+        const Vector2 offset = vel.get_storage_offset();
+        for (Array<real> *arr : {&sys.Ad, &sys.Ax, &sys.Ay, &sys.b, &sys.r, &sys.z, &sys.s, &sys.q}) {
+            *arr = Array<real>(w, h, 0.0f, offset);
+        }
+    }
+    auto solved = [&](int i, int j) {
+        if (weight[i][j] <= 0) {
+            return false;
+        }
+        const int ci = i - (axis == 0), cj = j - (axis == 1);
+        return (cell_types.inside(i, j) && cell_types[i][j] == CellType::WATER) ||
+               (cell_types.inside(ci, cj) && cell_types[ci][cj] == CellType::WATER);
+    };
+    Array<char> unknown(w, h, 0);
+    parallel_for(0, w, num_threads, [&](int i) {
+        for (int j = 0; j < h; j++) {
+            unknown[i][j] = solved(i, j);
+        }
+    });
+    parallel_for(0, w, num_threads, [&](int i) {
+        for (int j = 0; j < h; j++) {
+            sys.b[i][j] = vel[i][j];
+            sys.Ax[i][j] = (i + 1 < w && unknown[i][j] && unknown[i + 1][j]) ? -alpha : 0.0f;
+            sys.Ay[i][j] = (j + 1 < h && unknown[i][j] && unknown[i][j + 1]) ? -alpha : 0.0f;
+            if (!unknown[i][j]) {
+                sys.Ad[i][j] = 1;
+                continue;
+            }
+            real diag = 1;
+            const int neighbours[4][2] = {{i - 1, j}, {i + 1, j}, {i, j - 1}, {i, j + 1}};
+            for (auto &n : neighbours) {
+                if (n[0] < 0 || n[0] >= w || n[1] < 0 || n[1] >= h) {
+                    diag += alpha;
+                } else if (unknown[n[0]][n[1]]) {
+                    diag += alpha;
+                } else if (weight[n[0]][n[1]] <= 0) {
+                    diag += alpha;
+                    sys.b[i][j] += alpha * vel[n[0]][n[1]];
+                }
+            }
+            sys.Ad[i][j] = diag;
+        }
+    });
+}
 
+void EulerLiquid::apply_viscosity_operator(const ViscositySystem &sys, const Array<real> &x, Array<real> &y) {
+    const int w = x.get_width(), h = x.get_height();
+    parallel_for(0, w, num_threads, [&](int i) {
+        const real *ad = sys.Ad[i], *ax = sys.Ax[i], *ay = sys.Ay[i], *xc = x[i];
+        real *yc = y[i];
+        for (int j = 0; j < h; j++) {
+            yc[j] = ad[j] * xc[j];
+        }
+        for (int j = 0; j + 1 < h; j++) {
+            yc[j] += ay[j] * xc[j + 1];
+            yc[j + 1] += ay[j] * xc[j];
+        }
+        if (i > 0) {
+            const real *axl = sys.Ax[i - 1], *xl = x[i - 1];
+            for (int j = 0; j < h; j++) {
+                yc[j] += axl[j] * xl[j];
+            }
+        }
+        if (i + 1 < w) {
+            const real *xr = x[i + 1];
+            for (int j = 0; j < h; j++) {
+                yc[j] += ax[j] * xr[j];
+            }
+        }
+    }, 8);
+}
+
+int EulerLiquid::solve_viscosity(ViscositySystem &sys, Array<real> &vel) {
+    Array<real> &r = sys.r, &z = sys.z, &s = sys.s, &q = sys.q;
+    apply_viscosity_operator(sys, vel, q);
+    r = sys.b;
+    r -= q;
+    const real threshold = viscosity_tolerance * std::max(1.0f, sys.b.abs_max(num_threads));
+    if (r.abs_max(num_threads) < threshold) {
+        return 0;
+    }
+    // Jacobi preconditioning
+    auto precondition = [&]() {
+        for (auto &ind : z.get_region()) {
+            z[ind] = r[ind] / sys.Ad[ind];
+        }
+    };
+    precondition();
+    s = z;
+    double sigma = z.dot_double(r, num_threads);
+    int count;
+    for (count = 0; count < maximum_iterations; count++) {
+        apply_viscosity_operator(sys, s, q);
+        double alpha = sigma / max(1e-30, q.dot_double(s, num_threads));
+        vel.axpy((real)alpha, s, num_threads);
+        r.axpy(-(real)alpha, q, num_threads);
+        if (r.abs_max(num_threads) < threshold) {
+            count++;
+            break;
+        }
+        precondition();
+        double sigma_new = z.dot_double(r, num_threads);
+        double beta = sigma_new / sigma;
+        s.xpay(z, (real)beta, num_threads);
+        sigma = sigma_new;
+    }
+    return count;
+}
+
+void EulerLiquid::apply_viscosity(real delta_t) {
+    if (viscosity <= 0) {
+        return;
+    }
+    const real alpha = viscosity * delta_t;
+    build_viscosity_system(viscosity_systems[0], u, u_weight, 0, alpha);
+    build_viscosity_system(viscosity_systems[1], v, v_weight, 1, alpha);
+    solve_viscosity(viscosity_systems[0], u);
+    solve_viscosity(viscosity_systems[1], v);
 }
 
 int EulerLiquid::count_water_cells() {
@@ -797,8 +1021,28 @@ void EulerLiquid::initialize_pressure_solver() {
     E = Array<real>(width, height);
     p = Array<real>(width, height, 0.0f);
     q = Array<real>(width, height);
-    z = Array<real>(width, height);
+    cg_r = Array<real>(width, height);
+    cg_z = Array<real>(width, height);
+    cg_s = Array<real>(width, height);
     water_cell_index = Array<int>(width, height);
+    multigrid_levels.clear();
+    if (pressure_solver == "mgpcg") {
+        int w = width, h = height;
+        while (true) {
+            multigrid_levels.push_back(MultigridLevel());
+            MultigridLevel &level = multigrid_levels.back();
+            level.Ad = Array<real>(w, h, 0.0f);
+            level.Ax = Array<real>(w, h, 0.0f);
+            level.Ay = Array<real>(w, h, 0.0f);
+            level.x = Array<real>(w, h, 0.0f);
+            level.b = Array<real>(w, h, 0.0f);
+            if (w * h <= 64) {
+                break;
+            }
+            w = (w + 1) / 2;
+            h = (h + 1) / 2;
+        }
+    }
 }
 
 Vector2 EulerLiquid::clamp_particle_position(Vector2 pos) {
@@ -817,12 +1061,11 @@ real EulerLiquid::get_dt_with_cfl_1()
 
 real EulerLiquid::get_max_grid_speed()
 {
-    real maximum_speed = 0;
-    for (auto &vel : u)
-        maximum_speed = max(abs(vel), maximum_speed);
-    for (auto &vel : v)
-        maximum_speed = max(abs(vel), maximum_speed);
-    return maximum_speed;
+    auto max_speed = [](real a, real b) { return max(a, b); };
+    return max(parallel_reduce(u.get_region(), num_threads, 0.0f,
+                               [&](const Index2D &ind) { return abs(u[ind]); }, max_speed),
+               parallel_reduce(v.get_region(), num_threads, 0.0f,
+                               [&](const Index2D &ind) { return abs(v[ind]); }, max_speed));
 }
 
 EulerLiquid::Array<real> EulerLiquid::get_density()
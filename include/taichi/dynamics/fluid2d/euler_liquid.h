@@ -16,6 +16,7 @@
 #include <taichi/visualization/image_buffer.h>
 #include <taichi/math/stencils.h>
 #include <taichi/math/levelset_2d.h>
+#include <taichi/dynamics/time_stepping.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -25,20 +26,33 @@ protected:
     Array<real> Ad, Ax, Ay, E;
     Array<int> water_cell_index;
     void apply_pressure(const Array<real> &p);
-    Array<real> apply_A(const Array<real> &x);
-    Array<real> apply_preconditioner(const Array<real> &x);
-    Array<real> get_rhs();
+    void apply_A(const Array<real> &x, Array<real> &y);
+    // z = M^-1 r, for the preconditioner selected by "pressure_solver"
+    void apply_preconditioner(const Array<real> &r, Array<real> &z);
+    void apply_mic_preconditioner(const Array<real> &r, Array<real> &z);
+    void get_rhs(Array<real> &r);
     void apply_boundary_condition();
     real volume_correction_factor;
     real levelset_band;
+    int num_threads;
+    // Kinematic viscosity, in cells^2 per unit time. Zero skips the viscosity solve.
+    real viscosity;
+    real viscosity_tolerance;
     bool supersampling;
-    real cfl;
+    // "cfl" (0.1 by default) and the other limits of the substeps
+    CFLTimeStepper time_stepper;
     Array<real> u_weight;
     Array<real> v_weight;
     LevelSet2D liquid_levelset;
 
     int width, height;
-    Array<real> pressure, q, z;
+    Array<real> pressure, q;
+    // Work arrays of the pressure CG, allocated once
+    Array<real> cg_r, cg_z, cg_s;
+    // "cg" (no preconditioner), "micpcg" (modified incomplete Cholesky) or "mgpcg" (multigrid V-cycle)
+    std::string pressure_solver;
+    // Start each solve from the pressure of the previous substep
+    bool warm_start;
     real target_water_cells;
     real last_water_cells;
     real integrate_water_cells_difference;
@@ -51,6 +65,15 @@ protected:
     int maximum_iterations;
     LevelSet2D boundary_levelset;
     Array<real> density;
+
+    // One level of the multigrid preconditioner. Level 0 is the pressure system, and every coarser
+    // level aggregates 2x2 cells of the finer one. Ax (Ay) couples a cell with its +x (+y) neighbour.
+    struct MultigridLevel {
+        Array<real> Ad, Ax, Ay;
+        Array<real> x, b;
+    };
+    std::vector<MultigridLevel> multigrid_levels;
+    int multigrid_smoothing_iterations;
     std::vector<Config> sources;
 
     const Vector2 supersample_positions[9]
@@ -82,10 +105,35 @@ protected:
 
     virtual void prepare_for_pressure_solve();
 
-    virtual Array<real> solve_pressure_naive();
+    // Solves for pressure with the preconditioned CG, in place
+    virtual void solve_pressure();
+
+    void build_multigrid_preconditioner();
+
+    void multigrid_smooth(int level, int iterations, bool reversed);
+
+    void multigrid_vcycle(int level);
 
     virtual void project(real delta_t);
 
+    // The implicit viscosity system (I - viscosity * delta_t * L) x = b of one velocity component.
+    // Faces that are not solved for (outside the liquid or solid) have identity rows.
+    struct ViscositySystem {
+        Array<real> Ad, Ax, Ay, b;
+        // Work arrays of the CG
+        Array<real> r, z, s, q;
+    };
+    ViscositySystem viscosity_systems[2];
+
+    void build_viscosity_system(ViscositySystem &sys, const Array<real> &vel, const Array<real> &weight,
+                                int axis, real alpha);
+
+    void apply_viscosity_operator(const ViscositySystem &sys, const Array<real> &x, Array<real> &y);
+
+    // Solves for vel in place, starting from it. Returns the number of iterations.
+    int solve_viscosity(ViscositySystem &sys, Array<real> &vel);
+
+    // Backward Euler viscosity, so that the step is not limited by it
     virtual void apply_viscosity(real delta_t);
 
     int count_water_cells();
@@ -8,7 +8,9 @@
 *******************************************************************************/
 
 #include "flip_liquid.h"
-#include <taichi/nearest_neighbour/point_cloud.h>
+#include <taichi/system/threading.h>
+#include <algorithm>
+#include <limits>
 
 TC_NAMESPACE_BEGIN
 
@@ -31,6 +33,8 @@ void FLIPLiquid::initialize_solver(const Config &config)
     advection_order = config.get("advection_order", 2);
     correction_strength = config.get("correction_strength", 0.1f);
     correction_neighbours = config.get("correction_neighbours", 5);
+    narrow_band = config.get("narrow_band", 0.0f);
+    narrow_band_particles_per_cell = config.get("narrow_band_particles_per_cell", 4);
     u_backup = Array<real>(width + 1, height, 0.0f, Vector2(0.0f, 0.5f));
     v_backup = Array<real>(width, height + 1, 0.0f, Vector2(0.5f, 0.0f));
     u_count = Array<real>(width + 1, height, 0.0f);
@@ -80,14 +84,52 @@ void FLIPLiquid::apply_external_forces(real delta_t) {
 }
 
 void FLIPLiquid::rasterize() {
-    rasterize_component<Particle::get_velocity<0>>(u, u_count);
-    rasterize_component<Particle::get_velocity<1>>(v, v_count);
+    rasterize_velocity<Particle::get_velocity<0>, Particle::get_velocity<1>>();
+}
+
+void FLIPLiquid::rasterize_narrow_band(real delta_t) {
+    // u and v still have the velocity advected at the end of the last substep
+    EulerLiquid::apply_external_forces(delta_t);
+    backup_velocity_field();
+    rasterize();
+    // Only within the liquid, the faces of the air being extrapolated to as before
+    parallel_for(0, width + 1, num_threads, [&](int i) {
+        for (int j = 0; j <= height; j++) {
+            if (j < height && u_count[i][j] == 0 && liquid_levelset.sample(Vector2(i, j + 0.5f)) < 0) {
+                u[i][j] = u_backup[i][j];
+            }
+            if (i < width && v_count[i][j] == 0 && liquid_levelset.sample(Vector2(i + 0.5f, j)) < 0) {
+                v[i][j] = v_backup[i][j];
+            }
+        }
+    }, 16);
+}
+
+void FLIPLiquid::compute_narrow_band_levelset() {
+    const LevelSet2D advected = liquid_levelset;
+    compute_liquid_levelset();
+    // Particles reach down to narrow_band, so their level set is negative a cell above that
+    const real depth = 1 - narrow_band;
+    for (auto &ind : liquid_levelset.get_region()) {
+        if (advected[ind] < depth) {
+            liquid_levelset[ind] = std::min(liquid_levelset[ind], advected[ind]);
+        }
+    }
+}
+
+void FLIPLiquid::rebuild_levelset(LevelSet2D &levelset, real band) {
+    EulerLiquid::rebuild_levelset(levelset, std::max(band, narrow_band + 1));
 }
 
 void FLIPLiquid::step(real delta_t)
 {
     EulerLiquid::step(delta_t);
     correct_particle_positions(delta_t);
+    reseed();
+}
+
+void FLIPLiquid::add_particle(Particle &particle) {
+    particles.push_back(particle);
 }
 
 void FLIPLiquid::backup_velocity_field() {
@@ -96,91 +138,276 @@ void FLIPLiquid::backup_velocity_field() {
 }
 
 void FLIPLiquid::substep(real delta_t) {
+    update_velocity_weights();
     apply_external_forces(delta_t);
     mark_cells();
-    rasterize();
+    if (narrow_band > 0) {
+        rasterize_narrow_band(delta_t);
+    } else {
+        rasterize();
+    }
     backup_velocity_field();
     apply_boundary_condition();
-    compute_liquid_levelset();
+    if (narrow_band > 0) {
+        compute_narrow_band_levelset();
+    } else {
+        compute_liquid_levelset();
+    }
     simple_extrapolate();
+    apply_viscosity(delta_t);
     project(delta_t);
     simple_extrapolate();
     advect(delta_t);
+    if (narrow_band > 0) {
+        advect_liquid_levelset(delta_t);
+        EulerLiquid::advect(delta_t);
+    }
     t += delta_t;
 }
 
 void FLIPLiquid::reseed() {
+    if (narrow_band <= 0) {
+        return;
+    }
+    // Particles below the band, and those that left the liquid, which APICLiquid advects rather than rebuilds
+    // from the particles
+    particles.erase(std::remove_if(particles.begin(), particles.end(), [&](const Particle &p) {
+        const real phi = liquid_levelset.sample(p.position);
+        return phi < -narrow_band || phi > 1;
+    }), particles.end());
+    bin_particles();
+    // Cells less than a cell deep are left to the particles, as seeding them would add volume at the surface
+    for (int i = 0; i < width; i++) {
+        for (int j = 0; j < height; j++) {
+            const Vector2 center(i + 0.5f, j + 0.5f);
+            const real phi = liquid_levelset.sample(center);
+            if (phi >= -1.0f || phi < -narrow_band || boundary_levelset.sample(center) < 0) {
+                continue;
+            }
+            const int count = bin_offsets[i * height + j + 1] - bin_offsets[i * height + j];
+            for (int k = count; k < narrow_band_particles_per_cell; k++) {
+                const Vector2 position = center + position_noise();
+                particles.push_back(Particle(position, EulerLiquid::sample_velocity(position, u, v)));
+            }
+        }
+    }
 }
 
-void FLIPLiquid::correct_particle_positions(real delta_t, bool clear_c)
-{
+// Pushes apart particles closer than range: each pair is pushed once for each of the two particles that has the
+// other among its correction_neighbours - 1 nearest ones, as the nearest-neighbour scatter this replaces did.
+// Particles are binned by range, and each gathers its own displacement from the bins around it, in two passes:
+// the first finds the distance to the farthest of its nearest ones, the second sums over the pairs.
+void FLIPLiquid::correct_particle_positions(real delta_t, bool clear_c) {
     if (correction_strength == 0.0f && !clear_c) {
         return;
     }
-    NearestNeighbour2D nn;
-    real range = 0.5f;
-    std::vector<Vector2> positions;
-    for (auto &p : particles) {
-        positions.push_back(p.position);
-    }
-    nn.initialize(positions);
-    std::vector<Vector2> delta_pos(particles.size());
-    for (int i = 0; i < (int)particles.size(); i++) {
-        delta_pos[i] = Vector2(0);
-        auto &p = particles[i];
-        std::vector<int> neighbour_index;
-        std::vector<real> neighbour_dist;
-        nn.query_n(p.position, correction_neighbours, neighbour_index, neighbour_dist);
-        for (auto nei_index : neighbour_index) {
-            if (nei_index == -1) {
-                break;
+    const real range = 0.5f;
+    // Affine velocities are cleared for particles with no other one within this
+    const real isolation_distance = std::sqrt(1.5f);
+    const int max_neighbours = 32;
+    const int num_neighbours = std::min(correction_neighbours - 1, max_neighbours);
+    bin_particles(range);
+    const int num_particles = (int)particles.size();
+    auto for_each_nearby = [&](int k, real search_range, const auto &f) {
+        const Vector2 &pos = particles[k].position;
+        const int reach = (int)std::ceil(search_range / range);
+        const int bx = clamp((int)std::floor(pos.x / range), 0, bins_x - 1);
+        const int by = clamp((int)std::floor(pos.y / range), 0, bins_y - 1);
+        const int y_begin = std::max(0, by - reach), y_end = std::min(bins_y, by + reach + 1);
+        for (int x = std::max(0, bx - reach); x < std::min(bins_x, bx + reach + 1); x++) {
+            const int end = bin_offsets[x * bins_y + y_end];
+            for (int n = bin_offsets[x * bins_y + y_begin]; n < end; n++) {
+                if (n != k) {
+                    f(n, pos - particles[n].position);
+                }
+            }
+        }
+    };
+    // Squared distance to the farthest of the nearest other particles of each, or range squared if fewer are
+    // within range
+    std::vector<real> neighbour_dist2(num_particles);
+    parallel_for(0, num_particles, num_threads, [&](int k) {
+        real nearest[max_neighbours];
+        int num_nearest = 0;
+        real nearest_other = std::numeric_limits<real>::infinity();
+        for_each_nearby(k, clear_c ? std::max(range, isolation_distance) : range, [&](int n, const Vector2 &d) {
+            const real dist2 = dot(d, d);
+            nearest_other = std::min(nearest_other, dist2);
+            if (dist2 >= range * range || (num_nearest == num_neighbours &&
+                                           (num_nearest == 0 || dist2 >= nearest[num_nearest - 1]))) {
+                return;
             }
-            auto &nei = particles[nei_index];
-            real dist = length(p.position - nei.position);
-            Vector2 dir = (p.position - nei.position) / dist;
-            if (dist > 1e-4f && dist < range) {
-                real a = correction_strength * delta_t * pow(1 - dist / range, 2);
-                delta_pos[i] += a * dir;
-                delta_pos[nei_index] -= a * dir;
+            int i = num_nearest < num_neighbours ? num_nearest++ : num_nearest - 1;
+            while (i > 0 && nearest[i - 1] > dist2) {
+                nearest[i] = nearest[i - 1];
+                i--;
             }
+            nearest[i] = dist2;
+        });
+        if (num_neighbours <= 0) {
+            neighbour_dist2[k] = -1;
+        } else {
+            neighbour_dist2[k] = num_nearest == num_neighbours ? nearest[num_nearest - 1] : range * range;
         }
-        if (clear_c && (neighbour_index.size() <= 1 || neighbour_dist[1] > 1.5f)) {
-            p.c[0] = p.c[1] = Vector2(0.0f);
+        if (clear_c && (num_neighbours <= 0 || nearest_other > isolation_distance * isolation_distance)) {
+            particles[k].c[0] = particles[k].c[1] = Vector2(0.0f);
         }
+    }, 256);
+    if (correction_strength == 0.0f) {
+        return;
     }
-    for (int i = 0; i < (int)particles.size(); i++) {
-        particles[i].position += delta_pos[i];
-        clamp_particle(particles[i]);
-    }
+    std::vector<Vector2> delta_pos(num_particles);
+    parallel_for(0, num_particles, num_threads, [&](int k) {
+        Vector2 delta(0.0f);
+        for_each_nearby(k, range, [&](int n, const Vector2 &d) {
+            const real dist2 = dot(d, d);
+            const int pushes = (dist2 <= neighbour_dist2[k]) + (dist2 <= neighbour_dist2[n]);
+            if (pushes == 0 || dist2 >= range * range || dist2 <= 1e-8f) {
+                return;
+            }
+            const real dist = std::sqrt(dist2);
+            const real a = correction_strength * delta_t * (1 - dist / range) * (1 - dist / range);
+            delta += (pushes * a / dist) * d;
+        });
+        delta_pos[k] = delta;
+    }, 256);
+    parallel_for(0, num_particles, num_threads, [&](int k) {
+        particles[k].position += delta_pos[k];
+        clamp_particle(particles[k]);
+    }, 256);
 }
 
-template<real(*T)(const Fluid::Particle &, const Vector2 &)>
-void FLIPLiquid::rasterize_component(Array<real> & val, Array<real> & count)
-{
-    val = 0;
-    count = 0;
-    real inv_kernel_size = 1.0f / kernel_size;
-    int extent = (kernel_size + 1) / 2;
-    for (auto &p : particles) {
-        for (auto &ind : val.get_rasterization_region(p.position, extent)) {
-            Vector2 delta_pos = ind.get_pos() - p.position;
-            real weight = kernel(inv_kernel_size * delta_pos);
-            val[ind] += weight * T(p, delta_pos);
-            count[ind] += weight;
+void FLIPLiquid::bin_particles(real bin_size) {
+    const int num_particles = (int)particles.size();
+    bins_x = std::max(1, (int)std::ceil(width / bin_size));
+    bins_y = std::max(1, (int)std::ceil(height / bin_size));
+    const int num_bins = bins_x * bins_y;
+    std::vector<int> destination(num_particles);
+    parallel_for(0, num_particles, num_threads, [&](int k) {
+        const Vector2 &pos = particles[k].position;
+        // Particles on (or past) the domain boundary go to the boundary bins
+        int i = clamp((int)std::floor(pos.x / bin_size), 0, bins_x - 1);
+        int j = clamp((int)std::floor(pos.y / bin_size), 0, bins_y - 1);
+        destination[k] = i * bins_y + j;
+    }, 1024);
+    // Counting sort over contiguous chunks of the particles: each chunk counts its particles per bin, and
+    // takes the slots after those of the same bin in earlier chunks, which keeps the sort stable
+    const int num_chunks = std::max(1, std::min(num_threads, num_particles / 4096));
+    std::vector<std::vector<int>> counts(num_chunks);
+    auto chunk_begin = [&](int chunk) {
+        return (int)((int64)num_particles * chunk / num_chunks);
+    };
+    parallel_for(0, num_chunks, num_threads, [&](int chunk) {
+        counts[chunk].assign(num_bins, 0);
+        for (int k = chunk_begin(chunk); k < chunk_begin(chunk + 1); k++) {
+            counts[chunk][destination[k]]++;
         }
-    }
-    for (auto ind : val.get_region()) {
-        if (count[ind] > 0) {
-            val[ind] /= count[ind];
+    }, 1);
+    bin_offsets.assign(num_bins + 1, 0);
+    for (int b = 0; b < num_bins; b++) {
+        int offset = bin_offsets[b];
+        for (int chunk = 0; chunk < num_chunks; chunk++) {
+            const int count = counts[chunk][b];
+            // Now the first slot of the chunk in the bin
+            counts[chunk][b] = offset;
+            offset += count;
         }
+        bin_offsets[b + 1] = offset;
     }
+    parallel_for(0, num_chunks, num_threads, [&](int chunk) {
+        for (int k = chunk_begin(chunk); k < chunk_begin(chunk + 1); k++) {
+            destination[k] = counts[chunk][destination[k]]++;
+        }
+    }, 1);
+    // Reordering the particles themselves makes every column of cells of a tile a contiguous range,
+    // and keeps the advection after cache friendly
+    sorted_particles.resize(num_particles);
+    parallel_for(0, num_particles, num_threads, [&](int k) {
+        sorted_particles[destination[k]] = particles[k];
+    }, 1024);
+    particles.swap(sorted_particles);
 }
 
+// A tile owns the u and v nodes (i, j) with i in [x_begin, x_end) and j in [y_begin, y_end).
+// It splats the particles of its cells and of a halo around them, and keeps the contributions to
+// its own nodes, so tiles can run concurrently. Every node sums its particles in bin order,
+// whatever the number of threads. Single-threaded, the whole grid is one tile and nothing is binned.
+template<real(*U)(const Fluid::Particle &, const Vector2 &), real(*V)(const Fluid::Particle &, const Vector2 &)>
+void FLIPLiquid::rasterize_velocity() {
+    const real inv_kernel_size = 1.0f / kernel_size;
+    const int extent = (kernel_size + 1) / 2;
+    // A node is reached from cells up to extent away (one more with a storage offset of 0.5)
+    const int halo = extent;
+    // Nodes go up to width (u) and height (v)
+    const int tile_size = num_threads > 1 ? 32 : std::max(width, height) + 1;
+    const int tiles_x = width / tile_size + 1, tiles_y = height / tile_size + 1;
+    const bool binned = tiles_x * tiles_y > 1;
+    if (binned) {
+        bin_particles();
+    }
+    parallel_for(0, tiles_x * tiles_y, num_threads, [&](int t) {
+        const int x_begin = t / tiles_y * tile_size, y_begin = t % tiles_y * tile_size;
+        const int x_end = x_begin + tile_size, y_end = y_begin + tile_size;
+        auto owned = [&](const Index2D &ind) {
+            return x_begin <= ind.i && ind.i < x_end && y_begin <= ind.j && ind.j < y_end;
+        };
+        auto splat = [&](const Particle &p) {
+            for (auto &ind : u.get_rasterization_region(p.position, extent)) {
+                if (owned(ind)) {
+                    Vector2 delta_pos = ind.get_pos() - p.position;
+                    real weight = kernel(inv_kernel_size * delta_pos);
+                    u[ind] += weight * U(p, delta_pos);
+                    u_count[ind] += weight;
+                }
+            }
+            for (auto &ind : v.get_rasterization_region(p.position, extent)) {
+                if (owned(ind)) {
+                    Vector2 delta_pos = ind.get_pos() - p.position;
+                    real weight = kernel(inv_kernel_size * delta_pos);
+                    v[ind] += weight * V(p, delta_pos);
+                    v_count[ind] += weight;
+                }
+            }
+        };
+        for (int i = x_begin; i < std::min(x_end, width + 1); i++) {
+            for (int j = y_begin; j < std::min(y_end, height + 1); j++) {
+                if (j < height) {
+                    u[i][j] = u_count[i][j] = 0;
+                }
+                if (i < width) {
+                    v[i][j] = v_count[i][j] = 0;
+                }
+            }
+        }
+        if (binned) {
+            const int cy_begin = std::max(0, y_begin - halo), cy_end = std::min(height, y_end + halo);
+            for (int cx = std::max(0, x_begin - halo); cx < std::min(width, x_end + halo); cx++) {
+                const int end = bin_offsets[cx * bins_y + cy_end];
+                for (int k = bin_offsets[cx * bins_y + cy_begin]; k < end; k++) {
+                    splat(particles[k]);
+                }
+            }
+        } else {
+            for (auto &p : particles) {
+                splat(p);
+            }
+        }
+        for (int i = x_begin; i < std::min(x_end, width + 1); i++) {
+            for (int j = y_begin; j < std::min(y_end, height + 1); j++) {
+                if (j < height && u_count[i][j] > 0) {
+                    u[i][j] /= u_count[i][j];
+                }
+                if (i < width && v_count[i][j] > 0) {
+                    v[i][j] /= v_count[i][j];
+                }
+            }
+        }
+    }, 1);
+}
 
-template void FLIPLiquid::rasterize_component<Fluid::Particle::get_velocity<0>>(Array<real> &val, Array<real> &count);
-template void FLIPLiquid::rasterize_component<Fluid::Particle::get_velocity<1>>(Array<real> &val, Array<real> &count);
-template void FLIPLiquid::rasterize_component<Fluid::Particle::get_affine_velocity<0>>(Array<real> &val, Array<real> &count);
-template void FLIPLiquid::rasterize_component<Fluid::Particle::get_affine_velocity<1>>(Array<real> &val, Array<real> &count);
+template void FLIPLiquid::rasterize_velocity<Fluid::Particle::get_velocity<0>, Fluid::Particle::get_velocity<1>>();
+template void FLIPLiquid::rasterize_velocity<Fluid::Particle::get_affine_velocity<0>,
+                                              Fluid::Particle::get_affine_velocity<1>>();
 
 TC_IMPLEMENTATION(Fluid, FLIPLiquid, "flip_liquid");
 
@@ -24,6 +24,16 @@ protected:
     int advection_order;
     real correction_strength;
     int correction_neighbours;
+    // Particles are only kept within narrow_band cells of the liquid surface, 0 keeping them everywhere. The
+    // liquid below is carried by the grid velocity and the liquid level set, which are advected themselves.
+    real narrow_band;
+    // The particles reseed() tops the cells of the band up to
+    int narrow_band_particles_per_cell;
+    // After bin_particles(bin_size), bin (i, j) of the bins_x * bins_y squares of that size has the particles
+    // [bin_offsets[b], bin_offsets[b + 1]), b = i * bins_y + j
+    std::vector<int> bin_offsets;
+    int bins_x, bins_y;
+    std::vector<Particle> sorted_particles;
 
     void clamp_particle(Particle &p);
 
@@ -37,13 +47,29 @@ protected:
 
     virtual void rasterize();
 
-    template <real(*T)(const Particle &, const Vector2 &)>
-    void rasterize_component(Array<real> &val, Array<real> &count);
+    // rasterize(), with the faces no particle reaches keeping the grid velocity, under gravity
+    void rasterize_narrow_band(real delta_t);
+
+    // The particles' level set within the band, and the advected one below it
+    void compute_narrow_band_levelset();
+
+    // Redistances within narrow_band + 1 at least, for the depth of the particles to be known
+    virtual void rebuild_levelset(LevelSet2D &levelset, real band);
+
+    // Stable counting sort of the particles by bin, in parallel; bins of 1 are the cells
+    void bin_particles(real bin_size = 1);
+
+    // Bins the particles, then computes u and v in one pass over tiles of nodes, each tile taking
+    // the particles from the bins around it. U and V give what a particle carries to a node at delta_pos.
+    template <real(*U)(const Particle &, const Vector2 &), real(*V)(const Particle &, const Vector2 &)>
+    void rasterize_velocity();
 
     virtual void backup_velocity_field();
 
     virtual void substep(real delta_t);
 
+    // With a narrow band, removes the particles below it, and seeds its cells with fewer than
+    // narrow_band_particles_per_cell, at the grid velocity
     void reseed();
 
     void correct_particle_positions(real delta_t, bool clear_c = false);
@@ -54,6 +80,8 @@ public:
 
     virtual void step(real delta_t);
 
+    virtual void add_particle(Particle &particle);
+
 };
 
 TC_NAMESPACE_END
@@ -10,6 +10,7 @@
 #pragma once
 #include <taichi/dynamics/fluid2d/flip_liquid.h>
 #include <taichi/nearest_neighbour/point_cloud.h>
+#include <taichi/math/jump_flooding.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -18,24 +19,27 @@ protected:
     real ambient_temp;
     real buoyancy;
     real conduction;
-    Array temperature;
-    Array temperature_backup;
-    Array temperature_count;
+    Array<real> temperature;
+    Array<real> temperature_backup;
+    Array<real> temperature_count;
     real source_temperature;
     real temperature_flip_alpha;
     std::string visualization;
     virtual void initialize(const Config &config) override {
         FLIPLiquid::initialize(Config(config).set("initializer", "full"));
 
-        temperature = Array(width, height);
-        temperature_backup = Array(width, height);
-        temperature_count = Array(width, height);
+        temperature = Array<real>(width, height);
+        temperature_backup = Array<real>(width, height);
+        temperature_count = Array<real>(width, height);
 
         buoyancy = config.get("bouyancy", 0.1f);
         conduction = config.get("conduction", 0.0f);
         visualization = config.get("visualization", "");
         source_temperature = config.get("source_temperature", ambient_temp);
         temperature_flip_alpha = config.get("temperature_flip_alpha", 0.97f);
+        extrapolation = config.get("extrapolation", "jump_flooding");
+        assert_info(extrapolation == "jump_flooding" || extrapolation == "kd_tree",
+                    "Unknown extrapolation " + extrapolation);
         gravity = Vector2(0, 0.5f * height);
         ambient_temp = 200;
 
@@ -80,20 +84,57 @@ protected:
         resample_temperature(delta_t);
         t += delta_t;
     }
-    virtual void voronoi_extrapolate(Array &val, const Array &weight) {
-        NearestNeighbour2D voronoi;
+    // Closest-sample filling of the grid: "jump_flooding" (default), or "kd_tree" for the kd-tree
+    // queries, which are exact and are kept to validate against
+    std::string extrapolation;
+    // Fills every cell with weight == 0 with the value of the closest cell with weight > 0
+    virtual void voronoi_extrapolate(Array<real> &val, const Array<real> &weight) {
         std::vector<Vector2> points;
         std::vector<real> values;
+        if (extrapolation == "kd_tree") {
+            NearestNeighbour2D voronoi;
+            for (auto ind : val.get_region()) {
+                if (weight[ind] > 0) {
+                    points.push_back(Vector2(real(ind.i), real(ind.j)));
+                    values.push_back(val[ind]);
+                }
+            }
+            if (points.empty()) {
+                return;
+            }
+            voronoi.initialize(points, num_threads);
+            std::vector<Vector2> queries;
+            for (auto ind : val.get_region()) {
+                if (weight[ind] == 0) {
+                    queries.push_back(Vector2(real(ind.i), real(ind.j)));
+                }
+            }
+            std::vector<int> closest;
+            std::vector<real> _;
+            voronoi.query_batch(queries, 1, closest, _, num_threads);
+            int k = 0;
+            for (auto ind : val.get_region()) {
+                if (weight[ind] == 0) {
+                    val[ind] = values[closest[k++]];
+                }
+            }
+            return;
+        }
+        Array2D<int> closest(val.get_width(), val.get_height(), -1, val.get_storage_offset());
         for (auto ind : val.get_region()) {
             if (weight[ind] > 0) {
-                points.push_back(Vector2(real(ind.i), real(ind.j)));
+                closest[ind] = (int)points.size();
+                points.push_back(ind.get_pos());
                 values.push_back(val[ind]);
             }
         }
-        voronoi.initialize(points);
+        if (points.empty()) {
+            return;
+        }
+        jump_flood(closest, points, num_threads);
         for (auto ind : val.get_region()) {
             if (weight[ind] == 0) {
-                val[ind] = values[voronoi.query_index(Vector2(real(ind.i), real(ind.j)))];
+                val[ind] = values[closest[ind]];
             }
         }
     }
@@ -102,27 +143,49 @@ protected:
         voronoi_extrapolate(v, v_count);
         voronoi_extrapolate(temperature, temperature_count);
     }
+    // Takes the velocity of the closest particle at every face
     virtual void voronoi_rasterize() {
-        NearestNeighbour2D voronoi[2];
-        std::vector<Vector2> points[2];
-        std::vector<real> values[2];
-        for (int k = 0; k < 2; k++) {
-            for (int i = 0; i < (int)particles.size(); i++) {
-                points[k].push_back(particles[i].position);
-                values[k].push_back(particles[i].velocity[k]);
-            }
-            voronoi[k].initialize(points[k]);
+        if (particles.empty()) {
+            return;
         }
-        for (int i = 0; i < width + 1; i++) {
-            for (int j = 0; j < height; j++) {
-                u[i][j] = values[0][voronoi[0].query_index(Vector2((real)i, j + 0.5f))];
+        if (extrapolation == "kd_tree") {
+            std::vector<Vector2> points;
+            for (auto &p : particles) {
+                points.push_back(p.position);
+            }
+            NearestNeighbour2D voronoi;
+            voronoi.initialize(points, num_threads);
+            for (auto ind : u.get_region()) {
+                u[ind] = particles[voronoi.query_index(ind.get_pos())].velocity.x;
+            }
+            for (auto ind : v.get_region()) {
+                v[ind] = particles[voronoi.query_index(ind.get_pos())].velocity.y;
             }
+            return;
         }
-        for (int i = 0; i < width; i++) {
-            for (int j = 0; j < height + 1; j++) {
-                v[i][j] = values[1][voronoi[1].query_index(Vector2(i + 0.5f, (real)j))];
+        voronoi_rasterize_component(u, 0);
+        voronoi_rasterize_component(v, 1);
+    }
+    // Seeds every face with the closest of the particles nearest to it, then jump floods
+    void voronoi_rasterize_component(Array<real> &val, int k) {
+        std::vector<Vector2> points(particles.size());
+        Array2D<int> closest(val.get_width(), val.get_height(), -1, val.get_storage_offset());
+        const Vector2 offset = val.get_storage_offset();
+        for (int i = 0; i < (int)particles.size(); i++) {
+            const Vector2 pos = particles[i].position;
+            points[i] = pos;
+            const int x = clamp((int)std::round(pos.x - offset.x), 0, val.get_width() - 1);
+            const int y = clamp((int)std::round(pos.y - offset.y), 0, val.get_height() - 1);
+            int &c = closest[x][y];
+            const Vector2 node = Vector2(real(x), real(y)) + offset;
+            if (c == -1 || length(pos - node) < length(points[c] - node)) {
+                c = i;
             }
         }
+        jump_flood(closest, points, num_threads);
+        for (auto ind : val.get_region()) {
+            val[ind] = particles[closest[ind]].velocity[k];
+        }
     }
     void rasterize_temperature() {
         temperature = 0;
@@ -137,7 +200,7 @@ protected:
                     if (!temperature.inside(nx, ny)) {
                         continue;
                     }
-                    real weight = kernel(p.position - vec2(nx + 0.5f, ny + 0.5f));
+                    real weight = kernel(p.position - Vector2(nx + 0.5f, ny + 0.5f));
                     temperature[nx][ny] += weight * p.temperature;
                     temperature_count[nx][ny] += weight;
                 }
@@ -154,7 +217,7 @@ protected:
     }
     void diffuse_temperature(real delta_t) {
         real exchange = conduction * delta_t;
-        Array new_temperature = temperature;
+        Array<real> new_temperature = temperature;
         for (auto ind : temperature.get_region()) {
             for (auto d : neighbour4) {
                 auto nei = ind.neighbour(d);
@@ -165,7 +228,7 @@ protected:
                 }
             }
         }
-        temperature = new_temperature;
+        temperature.swap(new_temperature);
     }
 
     void resample_temperature(real delta_t) {
@@ -66,6 +66,14 @@ public:
 
     virtual void add_particle(Particle &particle) {}
 
+    // add_particle at each of the n positions, with the velocities unless they are null
+    void add_particles(const Vector2 *positions, const Vector2 *velocities, int n) {
+        for (int i = 0; i < n; i++) {
+            Particle particle(positions[i], velocities ? velocities[i] : Vector2(0));
+            add_particle(particle);
+        }
+    }
+
     virtual std::vector<Particle> get_particles() {
         return std::vector<Particle>();
     }
@@ -82,8 +90,14 @@ public:
 
     virtual Array<real> get_pressure() { return Array<real>(0, 0); }
 
+    // The substeps of every step(), for fluids choosing their own
+    std::vector<int> get_step_substeps() const {
+        return step_substeps;
+    }
+
 protected:
     std::vector<Particle> particles;
+    std::vector<int> step_substeps;
 };
 
 TC_INTERFACE(Fluid);
@@ -0,0 +1,87 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/dynamics/simulation3d.h>
+#include <taichi/system/threading.h>
+#include <memory>
+#include <string>
+
+TC_NAMESPACE_BEGIN
+
+// What a frame is rendered from, snapshotted right after the simulation step that produced it
+struct PipelineFrame {
+    int index = -1;
+    real time = 0.0f;
+    std::vector<RenderParticle> particles;
+    bool has_volume = false;
+    SparseVolume volume;
+    Array2D<Vector3> image;
+};
+
+// Steps a simulation and renders its frames, rendering frame n on a background thread while frame n + 1 is
+// simulated. The render state is snapshotted into one of two frames, so step() only waits for the render of
+// frame n - 1 when it is slower than the simulation of frame n + 1. The threads are split between the stages by
+// render_ratio, as each stage alone would not keep them all busy while the other runs.
+//
+// Config: num_threads (total), render_ratio (0.5), width and height of the images, output (a printf pattern of
+// the frame index for the PNG images, none if empty), first_frame (0), the index of the first frame, exposure (1)
+// and gamma (2.2) for the images, preview_budget (render from at most this many splats, see
+// get_preview_particles, if positive), volume_output (a pattern for the sparse volumes, see export_volume, none if
+// empty), volume_threshold (0) and compress (true).
+class FramePipeline {
+public:
+    FramePipeline(std::shared_ptr<Simulation3D> simulation, std::shared_ptr<ParticleRenderer> renderer);
+
+    void initialize(const Config &config);
+
+    // Steps the simulation by t, then queues the render of the new frame
+    void step(real t);
+
+    // Blocks until every queued frame is rendered and written, rethrowing what rendering threw, if anything
+    void wait();
+
+    int get_num_frames() const {
+        return num_frames;
+    }
+
+    int get_simulation_threads() const {
+        return simulation_threads;
+    }
+
+    int get_render_threads() const {
+        return render_threads;
+    }
+
+    // Waits for the rendering, as frames refer to the pipeline
+    ~FramePipeline();
+
+private:
+    void render(PipelineFrame &frame);
+
+    std::shared_ptr<Simulation3D> simulation;
+    std::shared_ptr<ParticleRenderer> renderer;
+    int simulation_threads, render_threads;
+    Vector2i res;
+    std::string output, volume_output;
+    real exposure, gamma;
+    int preview_budget;
+    real volume_threshold;
+    bool compress;
+    int first_frame;
+    int num_frames = 0;
+    PipelineFrame frames[2];
+    // The render of frames[i], if queued
+    std::shared_ptr<AsyncTask> renders[2];
+    std::shared_ptr<VolumeExporter> volume_exporter;
+    AsyncExecutor executor;
+};
+
+TC_NAMESPACE_END
@@ -24,6 +24,7 @@ void MPM::initialize(const Config &config_) {
     this->h = config.get_real("delta_x");
     this->kill_at_boundary = config.get("kill_at_boundary", true);
     this->strength_dt_mul = config.get("strength_dt_mul", 1.0f);
+    this->num_threads = config.get("num_threads", 1);
     t = 0.0f;
     t_int = 0;
     requested_t = 0.0f;
@@ -40,6 +41,9 @@ void MPM::initialize(const Config &config_) {
     grid.initialize(res, &scheduler);
     particle_collision = config.get("particle_collision", true);
     position_noise = config.get("position_noise", 0.5f);
+    adaptive_sampling_interval = config.get("adaptive_sampling_interval", 0);
+    min_particles_per_cell = config.get("min_particles_per_cell", 2);
+    max_particles_per_cell = config.get("max_particles_per_cell", 8);
     if (async) {
         maximum_delta_t = config.get("maximum_delta_t", 1e-1f);
     } else {
@@ -52,6 +56,10 @@ void MPM::initialize(const Config &config_) {
 
 void MPM::substep() {
     scheduler.update_particle_groups();
+    if (adaptive_sampling_interval > 0 && substep_counter % adaptive_sampling_interval == 0) {
+        adapt_particle_sampling();
+    }
+    substep_counter++;
     scheduler.reset_particle_states();
 
     grid.reset();
@@ -89,7 +97,7 @@ void MPM::substep() {
     } else {
         // Sync
         t_int_increment = 1;
-        scheduler.states = 2;
+        scheduler.activate_all();
         for (auto &p : particles) {
             p->state = MPMParticle::UPDATING;
             p->march_interval = 1;
@@ -100,13 +108,14 @@ void MPM::substep() {
 
     scheduler.update();
 
-    for (auto &p : scheduler.get_active_particles()) {
+    parallel_for_each_active_particle([&](Particle *p) {
         if (async) {
             // p->pos += (old_t_int - p->last_update) * base_delta_t * p->v;
             // p->last_update = old_t_int;
         }
         p->calculate_kernels();
-    }
+    });
+    kernel_calc_counter += scheduler.get_active_particles().size();
 
     rasterize();
     estimate_volume();
@@ -132,28 +141,169 @@ void MPM::substep() {
 }
 
 void MPM::kill_outside_particles() {
-    // TODO: accelerate here
-    std::vector<Particle *> new_particles;
-    for (auto &p : particles) {
-        bool killed = false;
-        if (p->state == MPMParticle::UPDATING) {
-            for (int i = 0; i < 2; i++) {
-                if (p->pos[i] < 1.0f || p->pos[i] > res[i] - 1.0f) {
-                    if (!kill_at_boundary) {
-                        p->pos[i] = clamp(p->pos.x, 1.0f, res[i] - 1.0f);
-                    } else {
-                        killed = true;
+    if (!kill_at_boundary) {
+        parallel_for(0, (int)particles.size(), num_threads, [&](int i) {
+            Particle *p = particles[i];
+            if (p->state == MPMParticle::UPDATING) {
+                for (int d = 0; d < 2; d++) {
+                    p->pos[d] = clamp(p->pos[d], 1.0f, res[d] - 1.0f);
+                }
+            }
+        });
+        return;
+    }
+    auto outside = [&](const Particle *p) {
+        return is_outside(p);
+    };
+    auto killed = std::stable_partition(particles.begin(), particles.end(), [&](const Particle *p) {
+        return !outside(p);
+    });
+    if (killed == particles.end()) {
+        return;
+    }
+    scheduler.remove_particles(outside);
+    // Their slots are reused by the particles added next
+    for (auto p = killed; p != particles.end(); p++) {
+        (*p)->destroy(particle_arena);
+    }
+    particles.erase(killed, particles.end());
+}
+
+// b (of the second particle) is merged into a, as a particle at their center of mass
+static void merge_particle(MPMParticle *a, const MPMParticle *b) {
+    const real mass = a->mass + b->mass, w = b->mass / mass;
+    const Vector2 pos = (1 - w) * a->pos + w * b->pos;
+    const Vector2 v = (1 - w) * a->v + w * b->v;
+    // The relative motion of the two becomes affine motion, which keeps the angular momentum
+    a->b = (1 - w) * (a->b + glm::outerProduct(a->v - v, a->pos - pos)) +
+           w * (b->b + glm::outerProduct(b->v - v, b->pos - pos));
+    a->merge_state(*b, w);
+    a->dg_e = (1 - w) * a->dg_e + w * b->dg_e;
+    a->dg_p = (1 - w) * a->dg_p + w * b->dg_p;
+    a->vol = (a->vol == -1.0f || b->vol == -1.0f) ? -1.0f : a->vol + b->vol;
+    a->pos = pos;
+    a->v = v;
+    a->mass = mass;
+}
+
+void MPM::adapt_particle_sampling() {
+    const int block_size = mpm2d_grid_block_size;
+    // The mass add_particle gives
+    const real nominal_mass = 1.0f / res[0] / res[0];
+    const std::vector<Vector2i> &blocks = scheduler.occupied_blocks;
+    // Per block, the particles merged into others, and the parents and positions of new particles
+    std::vector<std::vector<Particle *>> merged(blocks.size());
+    std::vector<std::vector<std::pair<Particle *, Vector2>>> children(blocks.size());
+    // Every block only touches its own particles, which stay in it
+    ThreadedTaskManager::run((int)blocks.size(), num_threads, [&](int b) {
+        const std::vector<Particle *> &group = scheduler.particle_groups[scheduler.get_block_index(blocks[b])];
+        const Vector2i origin = blocks[b] * block_size;
+        auto get_cell = [&](const Particle *p) {
+            int i = clamp(int(p->pos.x) - origin.x, 0, block_size - 1);
+            int j = clamp(int(p->pos.y) - origin.y, 0, block_size - 1);
+            return i * block_size + j;
+        };
+        std::vector<int> cell_begin(block_size * block_size + 1, 0);
+        for (auto p : group) {
+            cell_begin[get_cell(p) + 1]++;
+        }
+        for (int c = 0; c < block_size * block_size; c++) {
+            cell_begin[c + 1] += cell_begin[c];
+        }
+        std::vector<int> cursor(cell_begin.begin(), cell_begin.end() - 1);
+        std::vector<Particle *> cell_particles(group.size());
+        for (auto p : group) {
+            cell_particles[cursor[get_cell(p)]++] = p;
+        }
+        std::vector<std::pair<real, std::pair<int, int>>> pairs;
+        std::vector<char> used;
+        for (int c = 0; c < block_size * block_size; c++) {
+            Particle **cell = cell_particles.data() + cell_begin[c];
+            int count = cell_begin[c + 1] - cell_begin[c];
+            if (count > max_particles_per_cell) {
+                // Closest pairs first
+                pairs.clear();
+                for (int i = 0; i < count; i++) {
+                    for (int j = i + 1; j < count; j++) {
+                        if (cell[i]->last_update == cell[j]->last_update && cell[i]->has_same_material(*cell[j])) {
+                            const Vector2 d = cell[i]->pos - cell[j]->pos;
+                            pairs.push_back({glm::dot(d, d), {i, j}});
+                        }
                     }
                 }
+                std::sort(pairs.begin(), pairs.end());
+                used.assign(count, 0);
+                for (auto &pair : pairs) {
+                    if (count <= max_particles_per_cell) {
+                        break;
+                    }
+                    Particle *p = cell[pair.second.first], *q = cell[pair.second.second];
+                    if (used[pair.second.first] || used[pair.second.second] ||
+                        p->mass + q->mass > 2 * nominal_mass) {
+                        continue;
+                    }
+                    merge_particle(p, q);
+                    used[pair.second.first] = used[pair.second.second] = 1;
+                    merged[b].push_back(q);
+                    count--;
+                }
+            } else if (count > 0 && count < min_particles_per_cell) {
+                // Heaviest first
+                std::sort(cell, cell + count, [](const Particle *p, const Particle *q) {
+                    return p->mass > q->mass || (p->mass == q->mass && p->id < q->id);
+                });
+                for (int i = 0; i < count && count + i < min_particles_per_cell; i++) {
+                    Particle *p = cell[i];
+                    if (p->mass < nominal_mass) {
+                        break;
+                    }
+                    // Along the largest stretch, with both halves kept in the block
+                    Matrix2 u, sig, v;
+                    svd(p->dg_e * p->dg_p, u, sig, v);
+                    Vector2 d = 0.25f * u[sig[1][1] > sig[0][0] ? 1 : 0];
+                    real scale = 1.0f;
+                    for (int k = 0; k < 2; k++) {
+                        if (d[k] != 0) {
+                            const real room = std::min(p->pos[k] - origin[k], origin[k] + block_size - p->pos[k]);
+                            scale = std::min(scale, 0.99f * room / std::abs(d[k]));
+                        }
+                    }
+                    d *= std::max(scale, 0.0f);
+                    p->mass *= 0.5f;
+                    if (p->vol != -1.0f) {
+                        p->vol *= 0.5f;
+                    }
+                    p->pos -= d;
+                    children[b].push_back({p, p->pos + 2.0f * d});
+                }
             }
         }
-        if (!killed) {
-            new_particles.push_back(p);
-        } else {
-            delete p;
+    });
+    // The merged particles go first, so that the new ones reuse their slots of the arena
+    std::vector<Particle *> removed;
+    for (auto &block_merged : merged) {
+        removed.insert(removed.end(), block_merged.begin(), block_merged.end());
+    }
+    if (!removed.empty()) {
+        std::sort(removed.begin(), removed.end());
+        auto is_removed = [&](const Particle *p) {
+            return std::binary_search(removed.begin(), removed.end(), p);
+        };
+        particles.erase(std::remove_if(particles.begin(), particles.end(), is_removed), particles.end());
+        scheduler.remove_particles(is_removed);
+        for (auto p : removed) {
+            p->destroy(particle_arena);
+        }
+    }
+    for (auto &block_children : children) {
+        for (auto &child : block_children) {
+            Particle *p = child.first->duplicate(particle_arena);
+            p->id = MPMParticle::instance_count++;
+            p->pos = child.second;
+            particles.push_back(p);
+            scheduler.insert_particle(p);
         }
     }
-    particles.swap(new_particles);
 }
 
 void MPM::step(real delta_t) {
@@ -169,53 +319,81 @@ void MPM::step(real delta_t) {
     P(kernel_calc_counter);
 }
 
+// Every particle sits in the group of an occupied block, whether or not the block is active,
+// so the splat goes over the occupied blocks rather than the active ones.
+// This is a distance to the nearest particle, which the rasterized mass does not give; grid.mass
+// also only holds the particles of the last substep's active blocks when stepping asynchronously.
 void MPM::compute_material_levelset() {
     material_levelset.reset(std::numeric_limits<real>::infinity());
-    for (auto &p : particles) {
-        for (auto &ind : material_levelset.get_rasterization_region(p->pos, 3)) {
-            Vector2 delta_pos = ind.get_pos() - p->pos;
-            material_levelset[ind] = std::min(material_levelset[ind], length(delta_pos) - 0.8f);
+    parallel_for_each_block_colored(scheduler.occupied_blocks, [&](const std::vector<Particle *> &group) {
+        for (auto &p : group) {
+            for (auto &ind : material_levelset.get_rasterization_region(p->pos, 3)) {
+                Vector2 delta_pos = ind.get_pos() - p->pos;
+                material_levelset[ind] = std::min(material_levelset[ind], length(delta_pos) - 0.8f);
+            }
         }
-    }
-    for (auto &ind : material_levelset.get_region()) {
-        if (material_levelset[ind] < 0.5f) {
-            if (levelset.sample(ind.get_pos(), t) < 0)
-                material_levelset[ind] = -0.5f;
+    });
+    const Vector2 storage_offset = material_levelset.get_storage_offset();
+    parallel_for(0, material_levelset.get_width(), num_threads, [&](int i) {
+        for (int j = 0; j < material_levelset.get_height(); j++) {
+            if (material_levelset[i][j] < 0.5f) {
+                if (levelset.sample(Vector2((real)i, (real)j) + storage_offset, t) < 0)
+                    material_levelset[i][j] = -0.5f;
+            }
         }
-    }
+    });
 }
 
 void MPM::particle_collision_resolution() {
     if (levelset.levelset0) {
-        for (auto &p : scheduler.get_active_particles()) {
+        parallel_for_each_active_particle([&](Particle *p) {
             if (p->state == MPMParticle::UPDATING)
                 p->resolve_collision(levelset, t);
-        }
+        });
     }
 }
 
+// Gathers from the grid and writes to its own particle only
 void MPM::estimate_volume() {
-    for (auto &p : particles) {
+    parallel_for(0, (int)particles.size(), num_threads, [&](int i) {
+        Particle *p = particles[i];
         if (p->state != MPMParticle::INACTIVE && p->vol == -1.0f) {
             real rho = 0.0f;
             for (auto &ind : get_bounded_rasterization_region(p->pos)) {
-                real weight = p->get_cache_w(ind);
                 rho += grid.mass[ind] / h / h;
             }
             p->vol = p->mass / rho;
         }
-    }
+    });
 }
 
 void MPM::add_particle(std::shared_ptr<MPMParticle> p) {
     // WTH???
     p->mass = 1.0f / res[0] / res[0];
     p->pos += position_noise * Vector2(rand() - 0.5f, rand() - 0.5f);
-    Particle *p_direct = p->duplicate();
+    Particle *p_direct = p->duplicate(particle_arena);
     particles.push_back(p_direct);
     scheduler.insert_particle(p_direct);
 }
 
+void MPM::add_particles(const std::vector<std::shared_ptr<MPMParticle>> &new_particles) {
+    particles.reserve(particles.size() + new_particles.size());
+    for (auto &p : new_particles) {
+        add_particle(p);
+    }
+}
+
+void MPM::add_particles(const MPMParticle &prototype, const Vector2 *positions, const Vector2 *velocities,
+                        int n) {
+    particles.reserve(particles.size() + n);
+    std::shared_ptr<MPMParticle> p(prototype.duplicate());
+    for (int i = 0; i < n; i++) {
+        p->pos = positions[i];
+        p->v = velocities ? velocities[i] : prototype.v;
+        add_particle(p);
+    }
+}
+
 void MPM::add_particle(EPParticle p) {
     add_particle(std::make_shared<EPParticle>(p));
 }
@@ -232,6 +410,13 @@ std::vector<std::shared_ptr<MPMParticle>> MPM::get_particles() {
     return particles;
 }
 
+void MPM::get_particle_states(Vector2 *positions, Vector2 *velocities) const {
+    for (int i = 0; i < (int)particles.size(); i++) {
+        positions[i] = particles[i]->pos;
+        velocities[i] = particles[i]->v;
+    }
+}
+
 real MPM::get_current_time() {
     return t;
 }
@@ -241,16 +426,18 @@ LevelSet2D MPM::get_material_levelset() {
 }
 
 void MPM::rasterize() {
-    for (auto &p : scheduler.get_active_particles()) {
-        if (!is_normal(p->pos)) {
-            p->print();
-        }
-        for (auto &ind : get_bounded_rasterization_region(p->pos)) {
-            real weight = p->get_cache_w(ind);
-            grid.mass[ind] += weight * p->mass;
-            grid.velocity[ind] += weight * p->mass * (p->v + (3.0f) * p->b * (Vector2(ind.i, ind.j) - p->pos));
+    parallel_for_each_active_block_colored([&](const std::vector<Particle *> &group) {
+        for (auto &p : group) {
+            if (!is_normal(p->pos)) {
+                p->print();
+            }
+            for (auto &ind : get_bounded_rasterization_region(p->pos)) {
+                real weight = p->get_cache_w(ind);
+                grid.mass[ind] += weight * p->mass;
+                grid.velocity[ind] += weight * p->mass * (p->v + (3.0f) * p->b * (Vector2(ind.i, ind.j) - p->pos));
+            }
         }
-    }
+    });
     grid.normalize_velocity();
 }
 
@@ -259,10 +446,10 @@ void MPM::resample(real grid_delta_t) {
     real alpha_delta_t = 1; // pow(flip_alpha, delta_t / flip_alpha_stride);
     if (apic)
         alpha_delta_t = 0.0f;
-    for (auto &p : scheduler.get_active_particles()) {
+    parallel_for_each_active_particle([&](Particle *p) {
         // Update particles with state UPDATING only
         if (p->state != MPMParticle::UPDATING)
-            continue;
+            return;
         real delta_t = base_delta_t * (t_int - p->last_update);
         Vector2 v = Vector2(0, 0), bv = Vector2(0, 0);
         Matrix2 cdg(0.0f);
@@ -294,24 +481,26 @@ void MPM::resample(real grid_delta_t) {
         p->dg_cache = dg;
 
         p->plasticity();
-    }
+    });
 }
 
 void MPM::apply_deformation_force(real delta_t) {
-    for (auto &p : scheduler.get_active_particles()) {
+    parallel_for_each_active_particle([&](Particle *p) {
         p->calculate_force();
-    }
-    for (auto &p : scheduler.get_active_particles()) {
-        for (auto &ind : get_bounded_rasterization_region(p->pos)) {
-            real mass = grid.mass[ind];
-            if (mass == 0.0f) { // NO NEED for eps here
-                continue;
+    });
+    parallel_for_each_active_block_colored([&](const std::vector<Particle *> &group) {
+        for (auto &p : group) {
+            for (auto &ind : get_bounded_rasterization_region(p->pos)) {
+                real mass = grid.mass[ind];
+                if (mass == 0.0f) { // NO NEED for eps here
+                    continue;
+                }
+                Vector2 gw = p->get_cache_gw(ind);
+                Vector2 force = p->tmp_force * gw;
+                grid.velocity[ind] += delta_t / mass * force;
             }
-            Vector2 gw = p->get_cache_gw(ind);
-            Vector2 force = p->tmp_force * gw;
-            grid.velocity[ind] += delta_t / mass * force;
         }
-    }
+    });
 }
 
 TC_NAMESPACE_END
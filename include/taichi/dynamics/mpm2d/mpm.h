@@ -18,6 +18,7 @@
 #include <taichi/math/dynamic_levelset_2d.h>
 #include <taichi/visual/texture.h>
 #include <taichi/visualization/image_buffer.h>
+#include <taichi/system/threading.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -27,6 +28,9 @@ class MPM : public Unit {
 protected:
     Vector2i res;
     Grid grid;
+    // Owns the particles, consecutive in memory in the order they were added except where the slots of removed
+    // ones are reused
+    MemoryArena particle_arena;
     std::vector<Particle *> particles;
 
     real flip_alpha;
@@ -53,6 +57,13 @@ protected:
     bool async;
     bool apic;
     bool kill_at_boundary;
+    int num_threads;
+    // Substeps between adaptive resamplings of the particles, 0 to disable
+    int adaptive_sampling_interval;
+    // Cells with particles are split below and merged above these counts
+    int min_particles_per_cell;
+    int max_particles_per_cell;
+    int64 substep_counter = 0;
     Array2D<Vector4> debug_blocks;
 
     void compute_material_levelset();
@@ -67,6 +78,48 @@ protected:
         return Region2D(x_min, x_max, y_min, y_max);
     }
 
+    // Visits the particle groups of `blocks` one 2x2 parity class at a time.
+    // Blocks of the same parity are two blocks apart, so stencils reaching at most
+    // block_size / 2 - 1 nodes past their block (the (block_size + 3)^2 footprint of the
+    // rasterization kernel, or the radius-3 splat of the material level set) never overlap, and
+    // `target` can scatter to the grid without synchronization. The result does not depend on
+    // num_threads.
+    template <typename T>
+    void parallel_for_each_block_colored(const std::vector<Vector2i> &blocks, const T &target) {
+        std::vector<int> colored_blocks;
+        for (int color = 0; color < 4; color++) {
+            colored_blocks.clear();
+            for (auto &block : blocks) {
+                const int index = scheduler.get_block_index(block);
+                if ((block.x & 1) * 2 + (block.y & 1) == color && !scheduler.particle_groups[index].empty()) {
+                    colored_blocks.push_back(index);
+                }
+            }
+            ThreadedTaskManager::run((int)colored_blocks.size(), num_threads, [&](int i) {
+                target(scheduler.particle_groups[colored_blocks[i]]);
+            });
+        }
+    }
+
+    template <typename T>
+    void parallel_for_each_active_block_colored(const T &target) {
+        parallel_for_each_block_colored(scheduler.get_active_blocks(), target);
+    }
+
+    // `target` receives the particle
+    template <typename T>
+    void parallel_for_each_active_particle(const T &target) {
+        const std::vector<Particle *> &active_particles = scheduler.get_active_particles();
+        ThreadedTaskManager::run((int)active_particles.size(), num_threads, [&](int i) {
+            target(active_particles[i]);
+        });
+    }
+
+    bool is_outside(const Particle *p) const {
+        return p->state == MPMParticle::UPDATING &&
+               (p->pos.x < 1.0f || p->pos.x > res[0] - 1.0f || p->pos.y < 1.0f || p->pos.y > res[1] - 1.0f);
+    }
+
     void particle_collision_resolution();
 
     void estimate_volume();
@@ -77,6 +130,11 @@ protected:
 
     void resample(real grid_delta_t);
 
+    // Merges the closest particles of cells with more than max_particles_per_cell, and splits those of cells
+    // with fewer than min_particles_per_cell along their largest stretch. Mass, momentum and the affine
+    // angular momentum are conserved, and particle masses stay within [1/2, 2] of the seeded one.
+    void adapt_particle_sampling();
+
     virtual void substep();
 
 public:
@@ -94,8 +152,22 @@ public:
 
     void add_particle(DPParticle p);
 
+    // add_particle for each of `new_particles`
+    void add_particles(const std::vector<std::shared_ptr<MPMParticle>> &new_particles);
+
+    // Copies of `prototype`, which carries the material, at each of the n positions, with the velocities
+    // unless they are null
+    void add_particles(const MPMParticle &prototype, const Vector2 *positions, const Vector2 *velocities, int n);
+
     std::vector<std::shared_ptr<Particle>> get_particles();
 
+    int get_num_particles() const {
+        return (int)particles.size();
+    }
+
+    // Into arrays of get_num_particles() elements, in the order of get_particles()
+    void get_particle_states(Vector2 *positions, Vector2 *velocities) const;
+
     real get_current_time();
 
     void set_levelset(const DynamicLevelSet2D &levelset) {
@@ -112,6 +184,8 @@ public:
         return mpm2d_grid_block_size;
     }
 
+    // Removes the updating particles within one cell of the domain boundary, or clamps them when
+    // kill_at_boundary is off. Survivors keep their order.
     void kill_outside_particles();
 
     bool test() const override;
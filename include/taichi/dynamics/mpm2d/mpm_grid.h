@@ -50,8 +50,9 @@ public:
         velocity_backup = velocity;
     }
 
+    // Nodes outside the scheduler's active grid points have no mass
     void normalize_velocity() {
-        for (auto &ind : velocity.get_region()) {
+        for (auto &ind : scheduler->get_active_grid_points()) {
             if (mass[ind] > 0) { // Do not use EPS here!!
                 velocity[ind] /= mass[ind];
             } else {
@@ -62,7 +63,7 @@ public:
     }
 
     void apply_external_force(Vector2 acc, real delta_t) {
-        for (auto &ind : mass.get_region()) {
+        for (auto &ind : scheduler->get_active_grid_points()) {
             if (mass[ind] > 0) // Do not use EPS here!!
                 velocity[ind] += acc * delta_t;
         }
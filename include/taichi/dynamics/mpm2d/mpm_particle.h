@@ -17,6 +17,7 @@
 #include <taichi/math/qr_svd.h>
 #include <taichi/math/levelset_2d.h>
 #include <taichi/math/dynamic_levelset_2d.h>
+#include <taichi/system/memory.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -61,7 +62,6 @@ struct MPMParticle {
     }
 
     void calculate_kernels() {
-        kernel_calc_counter++;
         Vector2 fpos = glm::fract(pos);
         real i_w[4], i_dw[4], j_w[4], j_dw[4];
         for (int i = -1; i < 3; i++) {
@@ -125,6 +125,18 @@ struct MPMParticle {
     }
 
     virtual MPMParticle *duplicate() const = 0;
+
+    // A copy living in `arena`, which owns it from then on
+    virtual MPMParticle *duplicate(MemoryArena &arena) const = 0;
+
+    // Gives a particle of `arena` back to it, for a later duplicate of the same type to reuse
+    virtual void destroy(MemoryArena &arena) = 0;
+
+    // Whether o has the same constitutive model and parameters, so that the two can be merged
+    virtual bool has_same_material(const MPMParticle &o) const = 0;
+
+    // Blends the per-particle state of the model with that of o, which gets the weight w
+    virtual void merge_state(const MPMParticle &o, real w) {}
 };
 
 
@@ -221,6 +233,20 @@ struct EPParticle : MPMParticle {
     MPMParticle *duplicate() const override {
         return new EPParticle(*this);
     }
+
+    MPMParticle *duplicate(MemoryArena &arena) const override {
+        return arena.create<EPParticle>(*this);
+    }
+
+    void destroy(MemoryArena &arena) override {
+        arena.destroy(this);
+    }
+
+    bool has_same_material(const MPMParticle &o) const override {
+        const EPParticle *e = dynamic_cast<const EPParticle *>(&o);
+        return e != nullptr && e->theta_c == theta_c && e->theta_s == theta_s && e->hardening == hardening &&
+               e->mu_0 == mu_0 && e->lambda_0 == lambda_0;
+    }
 };
 
 // Sand particle
@@ -297,6 +323,27 @@ struct DPParticle : MPMParticle {
     MPMParticle *duplicate() const override {
         return new DPParticle(*this);
     }
+
+    MPMParticle *duplicate(MemoryArena &arena) const override {
+        return arena.create<DPParticle>(*this);
+    }
+
+    void destroy(MemoryArena &arena) override {
+        arena.destroy(this);
+    }
+
+    bool has_same_material(const MPMParticle &o) const override {
+        const DPParticle *d = dynamic_cast<const DPParticle *>(&o);
+        return d != nullptr && d->h_0 == h_0 && d->h_1 == h_1 && d->h_2 == h_2 && d->h_3 == h_3 &&
+               d->lambda_0 == lambda_0 && d->mu_0 == mu_0;
+    }
+
+    void merge_state(const MPMParticle &o, real w) override {
+        const DPParticle &d = static_cast<const DPParticle &>(o);
+        alpha = (1 - w) * alpha + w * d.alpha;
+        q = (1 - w) * q + w * d.q;
+        phi_f = (1 - w) * phi_f + w * d.phi_f;
+    }
 };
 
 TC_NAMESPACE_END
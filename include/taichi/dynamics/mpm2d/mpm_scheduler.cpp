@@ -8,73 +8,71 @@
 *******************************************************************************/
 
 #include "mpm_scheduler.h"
+#include <algorithm>
 
 TC_NAMESPACE_BEGIN
 
 template<typename T> using Array = Array2D<T>;
 
+// Only neighbourhood blocks are written. Expanding to states beyond them would only mark
+// empty blocks that no particle reaches.
 void MPMScheduler::expand(bool expand_vel, bool expand_state) {
-    Array<int> new_states;
-    Array<int> old_states;
-    if (expand_state) {
-        old_states = states;
+    std::vector<Vector4> new_min_max_vel;
+    std::vector<int> new_states;
+    for (auto &block : neighbourhood_blocks) {
+        Vector4 vel(1e30f, 1e30f, -1e30f, -1e30f);
+        bool active_neighbour = false;
+        for (int dx = -1; dx <= 1; dx++) {
+            for (int dy = -1; dy <= 1; dy++) {
+                const Vector2i neighbour(block.x + dx, block.y + dy);
+                if (!states.inside(neighbour)) {
+                    continue;
+                }
+                const Vector4 &v = min_max_vel[neighbour];
+                vel[0] = std::min(vel[0], v[0]);
+                vel[1] = std::min(vel[1], v[1]);
+                vel[2] = std::max(vel[2], v[2]);
+                vel[3] = std::max(vel[3], v[3]);
+                active_neighbour = active_neighbour || states[neighbour] != 0;
+            }
+        }
+        new_min_max_vel.push_back(vel);
+        // 1: buffer, 2: updating
+        const int old_state = states[block];
+        new_states.push_back((active_neighbour ? 1 : old_state) + old_state);
     }
-    Array<Vector4> new_min_max_vel;
-    new_min_max_vel.initialize(res, Vector4(1e30f, 1e30f, -1e30f, -1e30f));
-    min_max_vel_expanded = Vector4(1e30f, 1e30f, -1e30f, -1e30f);
-    new_states.initialize(res, 0);
-
-    auto update = [&](const Index2D ind, int dx, int dy,
-                      const Array<Vector4> &min_max_vel, Array<Vector4> &new_min_max_vel,
-                      const Array<int> &states, Array<int> &new_states) -> void {
+    for (int i = 0; i < (int)neighbourhood_blocks.size(); i++) {
+        const Vector2i &block = neighbourhood_blocks[i];
         if (expand_vel) {
-            auto &tmp = new_min_max_vel[ind.neighbour(dx, dy)];
-            tmp[0] = std::min(tmp[0], min_max_vel[ind][0]);
-            tmp[1] = std::min(tmp[1], min_max_vel[ind][1]);
-            tmp[2] = std::max(tmp[2], min_max_vel[ind][2]);
-            tmp[3] = std::max(tmp[3], min_max_vel[ind][3]);
+            min_max_vel_expanded[block] = new_min_max_vel[i];
         }
         if (expand_state) {
-            if (states[ind])
-                new_states[ind.neighbour(dx, dy)] = 1;
-        }
-    };
-
-    // Expand x
-    for (auto &ind : states.get_region()) {
-        for (int dx = -1; dx <= 1; dx++) {
-            if (0 <= ind.i + dx && ind.i + dx < states.get_width())
-                update(ind, dx, 0, min_max_vel, new_min_max_vel, states, new_states);
+            states[block] = new_states[i];
         }
     }
-    // Expand y
-    for (auto &ind : states.get_region()) {
-        for (int dy = -1; dy <= 1; dy++) {
-            if (0 <= ind.j + dy && ind.j + dy < states.get_height())
-                update(ind, 0, dy, new_min_max_vel, min_max_vel_expanded, new_states, states);
-        }
-    }
-    if (expand_state) {
-        states += old_states;
-    } // 1: buffer, 2: updating
 }
 
 void MPMScheduler::update() {
-    // Use <= here since grid_res = sim_res + 1
+    active_blocks.clear();
+    for (auto &block : neighbourhood_blocks) {
+        if (states[block] != 0) {
+            active_blocks.push_back(block);
+        }
+    }
+    // Nodes on the upper boundary (grid_res = sim_res + 1) belong to the last block
     active_particles.clear();
     active_grid_points.clear();
-    for (int i = 0; i <= sim_res[0]; i++) {
-        for (int j = 0; j <= sim_res[1]; j++) {
-            if (states[i / mpm2d_grid_block_size][j / mpm2d_grid_block_size] != 0) {
+    for (auto &block : active_blocks) {
+        const int i_begin = block.x * mpm2d_grid_block_size, j_begin = block.y * mpm2d_grid_block_size;
+        const int i_end = block.x == res[0] - 1 ? sim_res[0] + 1 : i_begin + mpm2d_grid_block_size;
+        const int j_end = block.y == res[1] - 1 ? sim_res[1] + 1 : j_begin + mpm2d_grid_block_size;
+        for (int i = i_begin; i < i_end; i++) {
+            for (int j = j_begin; j < j_end; j++) {
                 active_grid_points.push_back(Vector2i(i, j));
             }
         }
-    }
-    for (auto &ind : states.get_region()) {
-        if (states[ind] != 0) {
-            for (auto &p : particle_groups[res[1] * ind.i + ind.j]) {
-                active_particles.push_back(p);
-            }
+        for (auto &p : particle_groups[get_block_index(block)]) {
+            active_particles.push_back(p);
         }
     }
     update_particle_states();
@@ -82,15 +80,15 @@ void MPMScheduler::update() {
 
 int64 MPMScheduler::update_max_dt_int(int64 t_int) {
     int64 ret = 1LL << 60;
-    for (auto &ind : max_dt_int.get_region()) {
-        int64 this_step_limit = std::min(max_dt_int_cfl[ind], max_dt_int_strength[ind]);
+    for (auto &block : neighbourhood_blocks) {
+        int64 this_step_limit = std::min(max_dt_int_cfl[block], max_dt_int_strength[block]);
         int64 allowed_multiplier = 1;
-        if (t_int % max_dt_int[ind] == 0) {
+        if (t_int % max_dt_int[block] == 0) {
             allowed_multiplier = 2;
         }
-        max_dt_int[ind] = std::min(max_dt_int[ind] * allowed_multiplier, this_step_limit);
-        if (has_particle(ind)) {
-            ret = std::min(ret, max_dt_int[ind]);
+        max_dt_int[block] = std::min(max_dt_int[block] * allowed_multiplier, this_step_limit);
+        if (has_particle(block)) {
+            ret = std::min(ret, max_dt_int[block]);
         }
     }
     return ret;
@@ -98,16 +96,54 @@ int64 MPMScheduler::update_max_dt_int(int64 t_int) {
 
 void MPMScheduler::update_particle_groups() {
     // Remove all updating particles, and then re-insert them
-    for (auto &ind : states.get_region()) {
-        if (states[ind] == 0) {
-            continue;
-        }
-        particle_groups[res[1] * ind.i + ind.j].clear();
-        updated[ind] = 1;
+    for (auto &block : active_blocks) {
+        particle_groups[get_block_index(block)].clear();
+        updated[block] = 1;
     }
     for (auto &p : active_particles) {
         insert_particle(p);
     }
+    remove_empty_blocks();
+    if (occupancy_changed) {
+        update_neighbourhood();
+    }
+}
+
+void MPMScheduler::remove_empty_blocks() {
+    // Emptied blocks go back to the state of never occupied ones
+    auto emptied = std::remove_if(occupied_blocks.begin(), occupied_blocks.end(), [&](const Vector2i &block) {
+        if (has_particle(block)) {
+            return false;
+        }
+        min_max_vel[block] = Vector4(1e30f, 1e30f, -1e30f, -1e30f);
+        return true;
+    });
+    if (emptied != occupied_blocks.end()) {
+        occupied_blocks.erase(emptied, occupied_blocks.end());
+        occupancy_changed = true;
+    }
+}
+
+void MPMScheduler::update_neighbourhood() {
+    for (auto &block : neighbourhood_blocks) {
+        in_neighbourhood[block] = 0;
+    }
+    neighbourhood_blocks.clear();
+    for (auto &block : occupied_blocks) {
+        for (int dx = -1; dx <= 1; dx++) {
+            for (int dy = -1; dy <= 1; dy++) {
+                const Vector2i neighbour(block.x + dx, block.y + dy);
+                if (states.inside(neighbour) && !in_neighbourhood[neighbour]) {
+                    in_neighbourhood[neighbour] = 1;
+                    neighbourhood_blocks.push_back(neighbour);
+                }
+            }
+        }
+    }
+    std::sort(neighbourhood_blocks.begin(), neighbourhood_blocks.end(), [&](const Vector2i &a, const Vector2i &b) {
+        return get_block_index(a) < get_block_index(b);
+    });
+    occupancy_changed = false;
 }
 
 void MPMScheduler::insert_particle(Particle *p) {
@@ -116,21 +152,25 @@ void MPMScheduler::insert_particle(Particle *p) {
     if (states.inside(x, y)) {
         int index = res[1] * x + y;
         particle_groups[index].push_back(p);
+        if (particle_groups[index].size() == 1) {
+            occupied_blocks.push_back(Vector2i(x, y));
+            occupancy_changed = true;
+        }
         updated[x][y] = 1;
     }
 }
 
 void MPMScheduler::update_dt_limits(real t) {
-    for (auto &ind : states.get_region()) {
+    for (auto &block : neighbourhood_blocks) {
         // Update those blocks needing an update
-        if (!updated[ind]) {
+        if (!updated[block]) {
             continue;
         }
-        updated[ind] = 0;
-        max_dt_int_strength[ind] = 1LL << 60;
-        max_dt_int_cfl[ind] = 1LL << 60;
-        min_max_vel[ind] = Vector4(1e30f, 1e30f, -1e30f, -1e30f);
-        for (auto &p : particle_groups[res[1] * ind.i + ind.j]) {
+        updated[block] = 0;
+        max_dt_int_strength[block] = 1LL << 60;
+        max_dt_int_cfl[block] = 1LL << 60;
+        min_max_vel[block] = Vector4(1e30f, 1e30f, -1e30f, -1e30f);
+        for (auto &p : particle_groups[get_block_index(block)]) {
             int64 march_interval;
             int64 allowed_t_int_inc = (int64)(strength_dt_mul * p->get_allowed_dt() / base_delta_t);
             if (allowed_t_int_inc <= 0) {
@@ -139,9 +179,9 @@ void MPMScheduler::update_dt_limits(real t) {
             }
             march_interval = get_largest_pot(allowed_t_int_inc);
             p->march_interval = march_interval;
-            max_dt_int_strength[ind] = std::min(max_dt_int_strength[ind],
-                                                march_interval);
-            auto &tmp = min_max_vel[ind];
+            max_dt_int_strength[block] = std::min(max_dt_int_strength[block],
+                                                  march_interval);
+            auto &tmp = min_max_vel[block];
             tmp[0] = std::min(tmp[0], p->v.x);
             tmp[1] = std::min(tmp[1], p->v.y);
             tmp[2] = std::max(tmp[2], p->v.x);
@@ -151,11 +191,9 @@ void MPMScheduler::update_dt_limits(real t) {
     // Expand velocity
     expand(true, false);
 
-    for (auto &ind : min_max_vel.get_region()) {
-        real block_vel = std::max(
-                min_max_vel_expanded[ind][2] - min_max_vel_expanded[ind][0],
-                min_max_vel_expanded[ind][3] - min_max_vel_expanded[ind][1]
-        ) + 1e-7f;
+    for (auto &block : neighbourhood_blocks) {
+        const Vector4 &vel = min_max_vel_expanded[block];
+        real block_vel = std::max(vel[2] - vel[0], vel[3] - vel[1]) + 1e-7f;
         if (block_vel < 0) {
             // Blocks with no particles
             continue;
@@ -167,15 +205,17 @@ void MPMScheduler::update_dt_limits(real t) {
         }
         real block_absolute_vel = 1e-7f;
         for (int i = 0; i < 4; i++) {
-            block_absolute_vel = std::max(block_absolute_vel, std::abs(min_max_vel_expanded[ind][i]));
+            block_absolute_vel = std::max(block_absolute_vel, std::abs(vel[i]));
         }
-        real last_distance = levelset->sample(Vector2(ind.get_pos() * real(mpm2d_grid_block_size)), t);
+        // Sampled at the block center
+        const Vector2 center((real)block.x + 0.5f, (real)block.y + 0.5f);
+        real last_distance = levelset->sample(center * real(mpm2d_grid_block_size), t);
         if (last_distance < LevelSet2D::INF) {
             real distance2boundary = std::max(last_distance - real(mpm2d_grid_block_size) * 0.75f, 0.5f);
             int64 boundary_limit = int64(cfl * distance2boundary / block_absolute_vel / base_delta_t);
             cfl_limit = std::min(cfl_limit, boundary_limit);
         }
-        max_dt_int_cfl[ind] = get_largest_pot(cfl_limit);
+        max_dt_int_cfl[block] = get_largest_pot(cfl_limit);
     }
 }
 
@@ -306,21 +346,24 @@ void MPMScheduler::reset_particle_states() {
     }
 }
 
+// Blocks outside the neighbourhood hold no particles and do not constrain their neighbours
 void MPMScheduler::enforce_smoothness(int64 t_int_increment) {
-    Array<int64> new_max_dt_int = max_dt_int;
-    for (auto &ind : states.get_region()) {
-        if (states[ind] != 0) {
-            for (int dx = -1; dx <= 1; dx++) {
-                for (int dy = -1; dy <= 1; dy++) {
-                    auto neighbour_ind = ind.neighbour(dx, dy);
-                    if (max_dt_int.inside(neighbour_ind)) {
-                        new_max_dt_int[ind] = std::min(new_max_dt_int[ind], max_dt_int[neighbour_ind] * 2);
-                    }
+    std::vector<int64> new_max_dt_int(active_blocks.size());
+    for (int i = 0; i < (int)active_blocks.size(); i++) {
+        const Vector2i &block = active_blocks[i];
+        new_max_dt_int[i] = max_dt_int[block];
+        for (int dx = -1; dx <= 1; dx++) {
+            for (int dy = -1; dy <= 1; dy++) {
+                const Vector2i neighbour(block.x + dx, block.y + dy);
+                if (max_dt_int.inside(neighbour) && in_neighbourhood[neighbour]) {
+                    new_max_dt_int[i] = std::min(new_max_dt_int[i], max_dt_int[neighbour] * 2);
                 }
             }
         }
     }
-    max_dt_int = new_max_dt_int;
+    for (int i = 0; i < (int)active_blocks.size(); i++) {
+        max_dt_int[active_blocks[i]] = new_max_dt_int[i];
+    }
 }
 
 TC_NAMESPACE_END
@@ -9,6 +9,7 @@
 
 #pragma once
 
+#include <algorithm>
 #include "mpm_utils.h"
 #include "mpm_particle.h"
 #include <taichi/math/array_2d.h>
@@ -34,6 +35,16 @@ public:
     Vector2i sim_res;
     std::vector<Particle *> active_particles;
     std::vector<Vector2i> active_grid_points;
+    // Blocks holding particles, in no particular order
+    std::vector<Vector2i> occupied_blocks;
+    // Occupied blocks and their 8 neighbours, in row-major order. Only these blocks are ever
+    // scheduled: any other block is empty and no particle stencil reaches its nodes, so it keeps
+    // states == 0 and its time step limits are left alone.
+    std::vector<Vector2i> neighbourhood_blocks;
+    Array<int> in_neighbourhood;
+    bool occupancy_changed;
+    // Neighbourhood blocks with states != 0 as of the last update(), in row-major order
+    std::vector<Vector2i> active_blocks;
     DynamicLevelSet2D *levelset;
     real base_delta_t;
     real cfl, strength_dt_mul;
@@ -51,6 +62,11 @@ public:
 
         states.initialize(res, 0);
         updated.initialize(res, 1);
+        in_neighbourhood.initialize(res, 0);
+        occupied_blocks.clear();
+        neighbourhood_blocks.clear();
+        active_blocks.clear();
+        occupancy_changed = false;
         particle_groups.resize(res[0] * res[1]);
         for (int i = 0; i < res[0] * res[1]; i++) {
             particle_groups[i] = std::vector<Particle *>();
@@ -63,8 +79,22 @@ public:
         max_dt_int.initialize(res, 1);
     }
 
+    int get_block_index(const Vector2i &block) const {
+        return res[1] * block.x + block.y;
+    }
+
     void reset() {
-        states = 0;
+        for (auto &block : active_blocks) {
+            states[block] = 0;
+        }
+    }
+
+    // Synchronous stepping: every neighbourhood block is updating
+    void activate_all() {
+        reset();
+        for (auto &block : neighbourhood_blocks) {
+            states[block] = 2;
+        }
     }
 
     bool has_particle(const Index2D &ind) {
@@ -82,15 +112,36 @@ public:
     int64 update_max_dt_int(int64 t_int);
 
     void set_time(int64 t_int) {
-        for (auto &ind : states.get_region()) {
-            if (t_int % max_dt_int[ind] == 0) {
-                states[ind] = 1;
+        for (auto &block : neighbourhood_blocks) {
+            if (t_int % max_dt_int[block] == 0) {
+                states[block] = 1;
             }
         }
     }
 
     void update_particle_groups();
 
+    // Rebuilds neighbourhood_blocks from occupied_blocks
+    void update_neighbourhood();
+
+    // Drops blocks that lost all their particles from occupied_blocks
+    void remove_empty_blocks();
+
+    // Forgets every particle p with dead(p) in one pass over the occupied blocks
+    template <typename T>
+    void remove_particles(const T &dead) {
+        for (auto &block : occupied_blocks) {
+            auto &group = particle_groups[get_block_index(block)];
+            group.erase(std::remove_if(group.begin(), group.end(), dead), group.end());
+        }
+        active_particles.erase(std::remove_if(active_particles.begin(), active_particles.end(), dead),
+                               active_particles.end());
+        remove_empty_blocks();
+        if (occupancy_changed) {
+            update_neighbourhood();
+        }
+    }
+
     void insert_particle(Particle *p);
 
     void update_dt_limits(real t);
@@ -111,6 +162,10 @@ public:
         return active_grid_points;
     }
 
+    const std::vector<Vector2i> &get_active_blocks() const {
+        return active_blocks;
+    }
+
     void visualize(const Vector4 &debug_input, Array<Vector4> &debug_blocks) const;
 
     void print_limits();
@@ -11,12 +11,49 @@
 
 #include <taichi/common/meta.h>
 #include <taichi/math/array_3d.h>
+#include <taichi/system/profiler.h>
+#include <taichi/system/solver_statistics.h>
 
 TC_NAMESPACE_BEGIN
 class PoissonSolver3D : public Unit {
 protected:
     typedef Array3D<float> Array;
     int maximum_iterations;
+    // Receives the timings of the solver phases, if set
+    Profiler *profiler = nullptr;
+    // The phases since the last solve, which go into its statistics and then into profiler
+    Profiler solve_profiler;
+    SolverStatistics statistics;
+    // JSON lines file the statistics of every solve are appended to, unless empty
+    std::string statistics_log;
+    double solve_start_time = 0;
+
+    void begin_solve(const std::string &solver, double tolerance);
+
+    // The max norm of the residual, initially and after every iteration
+    void add_residual(double residual);
+
+    void end_solve();
+
+    // Collects the statistics of a run() from construction to destruction
+    class StatisticsScope {
+    protected:
+        PoissonSolver3D &solver;
+
+    public:
+        StatisticsScope(PoissonSolver3D &solver, const std::string &name, double tolerance) : solver(solver) {
+            solver.begin_solve(name, tolerance);
+        }
+
+        StatisticsScope(const StatisticsScope &) = delete;
+
+        StatisticsScope &operator=(const StatisticsScope &) = delete;
+
+        ~StatisticsScope() {
+            solver.end_solve();
+        }
+    };
+
 public:
     typedef unsigned char CellType;
     typedef Array3D<CellType> BCArray;
@@ -27,6 +64,19 @@ public:
     void initialize(const Config &config);
     virtual void run(const Array &b, Array &x, float tolerance) {};
     virtual void set_boundary_condition(const BCArray &boundary) {};
+
+    void set_profiler(Profiler *profiler) {
+        this->profiler = profiler;
+    }
+
+    // Of the last run()
+    const SolverStatistics &get_statistics() const {
+        return statistics;
+    }
+
+    void set_statistics_log(const std::string &fn) {
+        statistics_log = fn;
+    }
 };
 
 TC_INTERFACE(PoissonSolver3D);
@@ -12,6 +12,12 @@
 
 #include <taichi/common/meta.h>
 #include <taichi/visualization/particle_visualization.h>
+#include <taichi/io/particle_exporter.h>
+#include <taichi/io/volume_exporter.h>
+#include <taichi/io/simulation_cache.h>
+#include <taichi/system/profiler.h>
+#include <taichi/system/solver_statistics.h>
+#include <memory>
 #include <vector>
 #include <taichi/math/dynamic_levelset_3d.h>
 
@@ -22,6 +28,13 @@ protected:
     real current_t = 0.0f;
     int num_threads;
     DynamicLevelSet3D levelset;
+    std::shared_ptr<ParticleExporter> particle_exporter;
+    std::shared_ptr<VolumeExporter> volume_exporter;
+    Profiler profiler;
+    // Of every linear solve since the last reset_profile
+    std::vector<SolverStatistics> solver_statistics;
+    // The substeps of every step() since the last reset_profile, for simulators choosing their own
+    std::vector<int> step_substeps;
 public:
     Simulation3D() {}
 
@@ -31,6 +44,12 @@ public:
 
     virtual void initialize(const Config &config) override {
         num_threads = config.get_int("num_threads");
+        profiler.enabled = config.get("profile", true);
+    }
+
+    // For the parallel loops of later steps; solvers created by initialize keep their own
+    virtual void set_num_threads(int num_threads) {
+        this->num_threads = num_threads;
     }
 
     virtual void add_particles(const Config &config) {
@@ -46,12 +65,107 @@ public:
         return std::vector<RenderParticle>();
     }
 
+    // At most budget splats standing for get_render_particles(), for previews (see bin_render_particles)
+    virtual std::vector<RenderParticle> get_preview_particles(int budget) const {
+        return bin_render_particles(get_render_particles(), budget, num_threads);
+    }
+
+    // Copies the fields requested in frame.fields straight from simulation storage
+    virtual void get_particle_frame(ParticleFrame &frame) const {
+        error("no impl");
+    }
+
+    // Snapshots the particles and writes them on a background thread (see ParticleExporter).
+    // Only the snapshot is paid for here; earlier frames may still be in flight.
+    void export_particles(const std::string &fn, int fields, bool compress) {
+        if (!particle_exporter) {
+            particle_exporter = std::make_shared<ParticleExporter>();
+        }
+        ParticleFrame frame;
+        frame.fields = fields | ParticleFrame::POSITION;
+        get_particle_frame(frame);
+        particle_exporter->write(fn, std::move(frame), compress);
+    }
+
+    // Blocks until every exported frame is on disk
+    void wait_for_particle_export() {
+        if (particle_exporter) {
+            particle_exporter->wait();
+        }
+    }
+
+    // The scalar fields (e.g. density and temperature), keeping the tiles where some field differs
+    // from its background by more than threshold
+    virtual void get_sparse_volume(SparseVolume &volume, real threshold) const {
+        error("no impl");
+    }
+
+    // Like export_particles, for get_sparse_volume; the file can be loaded by the "voxel" VolumeMaterial
+    void export_volume(const std::string &fn, real threshold, bool compress) {
+        if (!volume_exporter) {
+            volume_exporter = std::make_shared<VolumeExporter>();
+        }
+        SparseVolume volume;
+        get_sparse_volume(volume, threshold);
+        volume_exporter->write(fn, std::move(volume), compress);
+    }
+
+    // Blocks until every exported volume is on disk
+    void wait_for_volume_export() {
+        if (volume_exporter) {
+            volume_exporter->wait();
+        }
+    }
+
+    // Appends the particles and, with_volume, the sparse volume (see export_volume) to a simulation cache
+    void write_cache_frame(SimulationCacheWriter &cache, int fields, bool with_volume, real threshold) {
+        ParticleFrame frame;
+        frame.fields = fields | ParticleFrame::POSITION;
+        get_particle_frame(frame);
+        if (!with_volume) {
+            cache.write(frame);
+            return;
+        }
+        SparseVolume volume;
+        get_sparse_volume(volume, threshold);
+        cache.write(frame, &volume);
+    }
+
+    // Per-phase timings accumulated since the last reset_profile
+    std::vector<ProfilerRecord> get_profile() const {
+        return profiler.get_records();
+    }
+
+    std::vector<SolverStatistics> get_solver_statistics() const {
+        return solver_statistics;
+    }
+
+    std::vector<int> get_step_substeps() const {
+        return step_substeps;
+    }
+
+    void reset_profile() {
+        profiler.clear();
+        solver_statistics.clear();
+        step_substeps.clear();
+    }
+
     virtual void set_levelset(const DynamicLevelSet3D &levelset) {
         this->levelset = levelset;
     }
 
     virtual void update(const Config &config) {}
 
+    // Writes everything needed to continue the run, except the level set
+    virtual void save_checkpoint(const std::string &fn) const {
+        error("no impl");
+    }
+
+    // Restores a checkpoint into a freshly constructed simulator; call set_levelset separately
+    virtual void load_checkpoint(const std::string &fn) {
+        error("no impl");
+    }
+
     virtual bool test() const override {
         return true;
     };
@@ -0,0 +1,92 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/dynamics/simulation3d.h>
+#include <exception>
+#include <memory>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Many small simulations, e.g. of a parameter study, stepped together in one process instead of a process each.
+// A step() of the batch is a single ThreadPool job over the simulations, balanced by the pool's work stealing,
+// so the threads are shared instead of oversubscribed. Simulations run their own parallel loops with
+// threads_per_simulation threads, nested in the job; with the default of 1 the pool only spreads whole simulations.
+// Level sets are as set before the steps; nothing updates them in between.
+//
+// Config: num_threads (total) and threads_per_simulation (1).
+class SimulationBatch {
+public:
+    struct Statistics {
+        int64 steps = 0;
+        // Seconds in Simulation3D::step, in total and of the last step
+        double step_time = 0, last_step_time = 0;
+        real current_time = 0;
+        // Whether a step threw; the simulation is not stepped again
+        bool failed = false;
+    };
+
+    void initialize(const Config &config);
+
+    // Returns the index of the simulation in the batch
+    int add(std::shared_ptr<Simulation3D> simulation);
+
+    // Steps every simulation by t, num_steps times. Simulations advance concurrently, each in order, and one
+    // failing does not stop the others.
+    void step(real t, int num_steps = 1);
+
+    int get_num_simulations() const {
+        return (int)simulations.size();
+    }
+
+    std::shared_ptr<Simulation3D> get_simulation(int i) const {
+        return simulations[i].simulation;
+    }
+
+    Statistics get_statistics(int i) const {
+        return simulations[i].statistics;
+    }
+
+    std::vector<Statistics> get_all_statistics() const;
+
+    // Rethrows what a failed simulation threw
+    void rethrow(int i) const;
+
+    // Of the last step(): its seconds, the simulation steps per second, and the fraction of num_threads kept busy
+    // stepping simulations
+    double get_wall_time() const {
+        return wall_time;
+    }
+
+    double get_throughput() const;
+
+    double get_utilization() const;
+
+protected:
+    struct Entry {
+        std::shared_ptr<Simulation3D> simulation;
+        Statistics statistics;
+        std::exception_ptr error;
+    };
+
+    int num_threads = 1;
+    int threads_per_simulation = 1;
+    std::vector<Entry> simulations;
+    double wall_time = 0;
+    // Of the last step()
+    int64 last_steps = 0;
+    double last_busy_time = 0;
+
+    // The simulations to step, in the order they are issued
+    std::vector<int> get_schedule() const;
+};
+
+TC_NAMESPACE_END
@@ -0,0 +1,83 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/meta.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+TC_NAMESPACE_BEGIN
+
+// Substeps of a frame for grid simulators, from a CFL target: the largest dt over which nothing moves more than
+// cfl cells, neither at the largest speed nor by the largest acceleration from rest (a dt^2 / 2 <= cfl). With
+// max_dt_growth, dt grows by at most that factor per substep, so that it eases back up after violent phases;
+// it shrinks at once. What is left of a frame is split into equal substeps, instead of ending it with a sliver.
+//
+// Config: cfl, max_dt_growth (0 for none), min_dt_fraction (of the frame, which bounds the substep count) and
+// max_dt. Speeds and accelerations are in cells per unit time.
+class CFLTimeStepper {
+public:
+    void initialize(const Config &config, real default_cfl, real default_min_dt_fraction = 0.0f) {
+        cfl = config.get("cfl", default_cfl);
+        max_dt_growth = config.get("max_dt_growth", 0.0f);
+        min_dt_fraction = config.get("min_dt_fraction", default_min_dt_fraction);
+        max_dt = config.get("max_dt", std::numeric_limits<real>::infinity());
+    }
+
+    // Adaptive if cfl is positive; otherwise frames are single steps
+    bool is_adaptive() const {
+        return cfl > 0;
+    }
+
+    void begin_frame(real frame_dt) {
+        this->frame_dt = frame_dt;
+        num_substeps = 0;
+    }
+
+    // Of the next substep, with remaining time left in the frame
+    real get_substep(real remaining, real max_speed, real max_acceleration) {
+        real dt = max_dt;
+        if (max_speed > 0) {
+            dt = std::min(dt, cfl / max_speed);
+        }
+        if (max_acceleration > 0) {
+            dt = std::min(dt, std::sqrt(2 * cfl / max_acceleration));
+        }
+        if (max_dt_growth > 0 && last_dt > 0) {
+            dt = std::min(dt, last_dt * max_dt_growth);
+        }
+        dt = std::max(dt, min_dt_fraction * frame_dt);
+        // The limit, rather than the step cut to fit the frame, is what the next one may grow from
+        last_dt = dt;
+        num_substeps++;
+        if (!(dt < remaining)) {
+            return remaining;
+        }
+        // Up to 0.1% over the limit, so that rounding does not add a substep
+        return remaining / std::max(real(1), std::ceil(remaining / dt - 1e-3f));
+    }
+
+    // Of the frame so far
+    int get_num_substeps() const {
+        return num_substeps;
+    }
+
+private:
+    real cfl = 0;
+    real max_dt_growth = 0;
+    real min_dt_fraction = 0;
+    real max_dt = std::numeric_limits<real>::infinity();
+    real frame_dt = 0;
+    real last_dt = 0;
+    int num_substeps = 0;
+};
+
+TC_NAMESPACE_END
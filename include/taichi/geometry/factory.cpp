@@ -11,44 +11,94 @@
 
 TC_NAMESPACE_BEGIN
 
+template <typename T>
+std::function<std::vector<T>(const std::vector<Vector2> &)> batch_function(const std::function<T(Vector2)> *f) {
+    return [f](const std::vector<Vector2> &points) {
+        std::vector<T> values(points.size());
+        for (int i = 0; i < (int)points.size(); i++) {
+            values[i] = (*f)(points[i]);
+        }
+        return values;
+    };
+}
+
 std::vector<Triangle> Mesh3D::generate(const Vector2i res,
     const Function23 *surf, const Function23 *norm, const Function22 *uv,
     bool smooth_normal) {
-    const Vector2 dp = Vector2(1.0) / Vector2(res);
+    assert_info(surf != nullptr, "Surface function can not be null");
+    BatchedFunction23 batched_surf = batch_function(surf), batched_norm;
+    BatchedFunction22 batched_uv;
+    if (norm) {
+        batched_norm = batch_function(norm);
+    }
+    if (uv) {
+        batched_uv = batch_function(uv);
+    }
+    return generate_batched(res, &batched_surf, norm ? &batched_norm : nullptr, uv ? &batched_uv : nullptr,
+                            smooth_normal);
+}
 
+std::vector<Triangle> Mesh3D::generate_batched(const Vector2i res,
+    const BatchedFunction23 *surf, const BatchedFunction23 *norm, const BatchedFunction22 *uv,
+    bool smooth_normal) {
     assert_info(surf != nullptr, "Surface function can not be null");
+    Array2D<Vector3> vertices(res + Vector2i(1));
+    Array2D<Vector3> normals(res + Vector2i(1), Vector3(1, 0, 0));
+    Array2D<Vector2> uvs(res + Vector2i(1));
 
-    auto get_normal_at = [&](const Vector2 &p) -> Vector3 {
-        if (norm) {
-            return normalized((*norm)(p));
-        }
-        else if (smooth_normal) {
-            Vector3 u = normalized((*surf)(p + dp * Vector2(1, 0)) - (*surf)(p + dp * Vector2(-1, 0)));
-            Vector3 v = normalized((*surf)(p + dp * Vector2(0, 1)) - (*surf)(p + dp * Vector2(0, -1)));
-            return normalized(cross(u, v));
-        }
-        else {
-            // Useless value
-            return Vector3(1, 0, 0);
+    // Points of the grid, padded by `pad` cells on every side
+    auto get_points = [&](int pad) {
+        std::vector<Vector2> points;
+        points.reserve((res[0] + 1 + 2 * pad) * (res[1] + 1 + 2 * pad));
+        for (int i = -pad; i < res[0] + 1 + pad; i++) {
+            for (int j = -pad; j < res[1] + 1 + pad; j++) {
+                points.push_back(Vector2(i, j) / Vector2(res));
+            }
         }
+        return points;
+    };
+    auto check_size = [](size_t size, size_t expected) {
+        assert_info(size == expected, "Batched function returned " + std::to_string(size) + " values for " +
+                                      std::to_string(expected) + " points");
     };
-    auto get_uv_at = [&](const Vector2 &p) -> Vector2 {
-        if (uv) {
-            return (*uv)(p);
+    const std::vector<Vector2> points = get_points(0);
+    // Smooth normals without a normal function are by central differences, which need the surface one cell
+    // beyond the grid
+    const bool pad_surface = smooth_normal && !norm;
+    const int padded_height = res[1] + 3;
+    const std::vector<Vector2> surface_points = pad_surface ? get_points(1) : points;
+    std::vector<Vector3> surface = (*surf)(surface_points);
+    check_size(surface.size(), surface_points.size());
+    auto surface_at = [&](int i, int j) -> Vector3 {
+        return pad_surface ? surface[(i + 1) * padded_height + j + 1] : surface[i * (res[1] + 1) + j];
+    };
+    for (int i = 0; i < res[0] + 1; i++) {
+        for (int j = 0; j < res[1] + 1; j++) {
+            vertices[i][j] = surface_at(i, j);
         }
-        else {
-            return p;
+    }
+    if (norm && smooth_normal) {
+        std::vector<Vector3> values = (*norm)(points);
+        check_size(values.size(), points.size());
+        for (int i = 0; i < res[0] + 1; i++) {
+            for (int j = 0; j < res[1] + 1; j++) {
+                normals[i][j] = normalized(values[i * (res[1] + 1) + j]);
+            }
         }
-    };
-    Array2D<Vector3> vertices(res + Vector2i(1));
-    Array2D<Vector3> normals(res + Vector2i(1));
-    Array2D<Vector2> uvs(res + Vector2i(1));
+    } else if (smooth_normal) {
+        for (int i = 0; i < res[0] + 1; i++) {
+            for (int j = 0; j < res[1] + 1; j++) {
+                Vector3 u = normalized(surface_at(i + 1, j) - surface_at(i - 1, j));
+                Vector3 v = normalized(surface_at(i, j + 1) - surface_at(i, j - 1));
+                normals[i][j] = normalized(cross(u, v));
+            }
+        }
+    }
+    std::vector<Vector2> uv_values = uv ? (*uv)(points) : points;
+    check_size(uv_values.size(), points.size());
     for (int i = 0; i < res[0] + 1; i++) {
         for (int j = 0; j < res[1] + 1; j++) {
-            Vector2 p = Vector2(i, j) / Vector2(res);
-            vertices[i][j] = (*surf)(p);
-            normals[i][j] = get_normal_at(p);
-            uvs[i][j] = get_uv_at(p);
+            uvs[i][j] = uv_values[i * (res[1] + 1) + j];
         }
     }
     std::vector<Triangle> triangles;
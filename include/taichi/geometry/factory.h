@@ -20,12 +20,21 @@ TC_NAMESPACE_BEGIN
 
 typedef std::function<Vector3(Vector2)> Function23;
 typedef std::function<Vector2(Vector2)> Function22;
+// Evaluate all points at once, e.g. in a single call into Python
+typedef std::function<std::vector<Vector3>(const std::vector<Vector2> &)> BatchedFunction23;
+typedef std::function<std::vector<Vector2>(const std::vector<Vector2> &)> BatchedFunction22;
+
 class Mesh3D {
 public:
     // norm and uv can be null
     static std::vector<Triangle> generate(const Vector2i res,
         const Function23 *surf, const Function23 *norm, const Function22 *uv,
         bool smooth_normal);
+
+    // Each function is called once, with all the points it is needed at
+    static std::vector<Triangle> generate_batched(const Vector2i res,
+        const BatchedFunction23 *surf, const BatchedFunction23 *norm, const BatchedFunction22 *uv,
+        bool smooth_normal);
 };
 
 
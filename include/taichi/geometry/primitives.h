@@ -32,6 +32,8 @@ public:
     int triangle_id;
     Vector3 geometry_normal;
     real u, v;
+    // A cone around the ray, for filtering texture lookups: its width at orig, and its growth per unit distance
+    real cone_width = 0, cone_spread = 0;
 
     const static real DIST_INFINITE;
 };
@@ -83,7 +85,11 @@ struct Triangle {
     }
 
     Triangle get_transformed(const Matrix4 &transform) const {
-        const Matrix4 normal_transform = glm::transpose(glm::inverse(transform));
+        return get_transformed(transform, glm::transpose(glm::inverse(transform)));
+    }
+
+    // With normal_transform the inverse transpose of transform, for many triangles to share
+    Triangle get_transformed(const Matrix4 &transform, const Matrix4 &normal_transform) const {
         return Triangle(
             multiply_matrix4(transform, v[0], 1.0f),
             multiply_matrix4(transform, v[0] + v10, 1.0f),
@@ -169,6 +175,53 @@ struct Triangle {
     }
 };
 
+// What ray intersection needs of a triangle, 40 bytes against the 172 of Triangle, for acceleration structures to
+// keep; the shading attributes stay with the scene's triangles, indexed by id
+struct IntersectionTriangle {
+    Vector3 v0, e1, e2;
+    int id;
+
+    IntersectionTriangle() {}
+
+    IntersectionTriangle(const Vector3 &v0, const Vector3 &v1, const Vector3 &v2, int id)
+        : v0(v0), e1(v1 - v0), e2(v2 - v0), id(id) {}
+
+    explicit IntersectionTriangle(const Triangle &triangle)
+        : v0(triangle.v[0]), e1(triangle.v10), e2(triangle.v20), id(triangle.id) {}
+
+    Vector3 get_vertex(int k) const {
+        return k == 0 ? v0 : v0 + (k == 1 ? e1 : e2);
+    }
+
+    // Möller-Trumbore; updates t_far and the barycentric u and v if the ray hits within (t_near, t_far)
+    bool intersect(const Vector3 &orig, const Vector3 &dir, real t_near, real &t_far, real &u, real &v) const {
+        const Vector3 p = cross(dir, e2);
+        const real det = dot(e1, p);
+        if (det == 0.0f) {
+            return false;
+        }
+        const real inv_det = 1.0f / det;
+        const Vector3 s = orig - v0;
+        const real hit_u = dot(s, p) * inv_det;
+        if (hit_u < 0.0f || hit_u > 1.0f) {
+            return false;
+        }
+        const Vector3 q = cross(s, e1);
+        const real hit_v = dot(dir, q) * inv_det;
+        if (hit_v < 0.0f || hit_u + hit_v > 1.0f) {
+            return false;
+        }
+        const real dist = dot(e2, q) * inv_det;
+        if (dist <= t_near || dist >= t_far) {
+            return false;
+        }
+        t_far = dist;
+        u = hit_u;
+        v = hit_v;
+        return true;
+    }
+};
+
 class BoundingBox {
 public:
     Vector3 lower_boundary;
@@ -180,6 +233,15 @@ class Instance {
     int id;
 };
 
+// How geometry may change once its acceleration structure is built. Fixed geometry never does. Deformable
+// geometry may move and deform, with its BVH refit, which is fast but degrades under large deformations;
+// that of dynamic geometry is rebuilt.
+enum class GeometryMode {
+    fixed,
+    deformable,
+    dynamic
+};
+
 
 TC_NAMESPACE_END
 
@@ -0,0 +1,42 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/meta.h>
+#include <taichi/math/array_2d.h>
+
+TC_NAMESPACE_BEGIN
+
+// Per pixel averages over the first hits of its camera rays, to guide denoising. Pixels whose rays miss have
+// albedo 1, normal 0 and depth 0.
+struct FeatureBuffers {
+    Array2D<Vector3> albedo;
+    Array2D<Vector3> normal;
+    Array2D<real> depth;
+
+    bool empty() const {
+        return albedo.get_width() == 0;
+    }
+};
+
+// Filters the noise out of renders, guided by their feature buffers
+class Denoiser : public Unit {
+public:
+    void initialize(const Config &config) override {
+    }
+
+    virtual Array2D<Vector3> apply(const Array2D<Vector3> &color, const FeatureBuffers &features) {
+        return color;
+    }
+};
+
+TC_INTERFACE(Denoiser);
+
+TC_NAMESPACE_END
@@ -11,6 +11,9 @@
 
 #include <taichi/common/meta.h>
 #include <taichi/math/array_2d.h>
+#include <string>
+#include <thread>
+#include <vector>
 
 TC_NAMESPACE_BEGIN
 
@@ -21,6 +24,33 @@ public:
     }
 
     virtual Array2D<Vector3> apply(const Array2D<Vector3> &inp) { return Array2D<Vector3>(0, 0); }
+
+    // Like apply(), but into oup, whose storage is reused when it already has the resolution of inp
+    virtual void apply_to(const Array2D<Vector3> &inp, Array2D<Vector3> &oup) {
+        oup = apply(inp);
+    }
+
+    // Tone maps a frame sequence from image files into PNGs, reusing the output and the tone mapper's buffers
+    // from frame to frame, and reading each frame while the one before it is tone mapped
+    void apply_sequence(const std::vector<std::string> &inputs, const std::vector<std::string> &outputs) {
+        assert_info(inputs.size() == outputs.size(), "Each input frame needs an output file name");
+        Array2D<Vector3> frame, next, oup;
+        if (!inputs.empty()) {
+            frame.load(inputs[0]);
+        }
+        for (int f = 0; f < (int)inputs.size(); f++) {
+            std::thread reader;
+            if (f + 1 < (int)inputs.size()) {
+                reader = std::thread([&] { next.load(inputs[f + 1]); });
+            }
+            apply_to(frame, oup);
+            oup.write(outputs[f]);
+            if (reader.joinable()) {
+                reader.join();
+            }
+            frame.swap(next);
+        }
+    }
 };
 
 TC_INTERFACE(ToneMapper);
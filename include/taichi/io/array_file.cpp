@@ -0,0 +1,265 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include "array_file.h"
+#include <cstdio>
+#include <cstring>
+
+#ifndef _WIN64
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+TC_NAMESPACE_BEGIN
+
+namespace array_file {
+
+static const char magic[8] = {'T', 'C', 'A', 'R', 'R', 'A', 'Y', 0};
+// Bytes per read or write call
+static const int64 chunk_size = 16 << 20;
+
+ArrayFileHeader make_header(int dim, const Vector3i &res, const Vector3 &storage_offset, const char *element_type,
+                            uint32_t element_size, int brick_size) {
+    ArrayFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, magic, sizeof(magic));
+    header.version = ArrayFileHeader::current_version;
+    header.byte_order = ArrayFileHeader::byte_order_mark;
+    header.dim = dim;
+    header.element_size = element_size;
+    assert_info(std::strlen(element_type) < sizeof(header.element_type), "Element type name too long");
+    std::strcpy(header.element_type, element_type);
+    for (int a = 0; a < 3; a++) {
+        header.res[a] = res[a];
+        header.storage_offset[a] = storage_offset[a];
+    }
+    header.data_offset = ArrayFileHeader::data_alignment;
+    header.brick_size = brick_size;
+    if (brick_size > 0) {
+        assert_info(dim == 3, "Only 3D arrays can be bricked");
+        const Vector3i bricks = get_brick_res(header);
+        header.data_size = (uint64)bricks.x * bricks.y * bricks.z * get_brick_bytes(header);
+    } else {
+        header.data_size = (uint64)res.x * res.y * res.z * element_size;
+    }
+    return header;
+}
+
+Vector3i get_brick_res(const ArrayFileHeader &header) {
+    const int b = header.brick_size;
+    return Vector3i((header.res[0] + b - 1) / b, (header.res[1] + b - 1) / b, (header.res[2] + b - 1) / b);
+}
+
+uint64 get_brick_bytes(const ArrayFileHeader &header) {
+    const uint64 b = (uint64)header.brick_size;
+    const uint64 alignment = ArrayFileHeader::data_alignment;
+    return (b * b * b * header.element_size + alignment - 1) / alignment * alignment;
+}
+
+void write(const std::string &fn, const ArrayFileHeader &header, const void *data, int num_threads) {
+    const char *bytes = static_cast<const char *>(data);
+    const int num_chunks = (int)((header.data_size + chunk_size - 1) / chunk_size);
+    std::vector<char> head(header.data_offset, 0);
+    std::memcpy(&head[0], &header, sizeof(header));
+#ifndef _WIN64
+    const int fd = ::open(fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert_info(fd >= 0, "Can not open " + fn + " for writing");
+    const uint64 total = header.data_offset + header.data_size;
+    assert_info(ftruncate(fd, (off_t)total) == 0, "Can not resize " + fn);
+    auto write_all = [&](const char *p, uint64 size, uint64 offset) {
+        while (size > 0) {
+            const ssize_t written = pwrite(fd, p, size, (off_t)offset);
+            assert_info(written > 0, "Can not write " + fn);
+            p += written;
+            size -= written;
+            offset += written;
+        }
+    };
+    write_all(&head[0], head.size(), 0);
+    // Chunks go to disjoint ranges of the file, so the threads need no locking
+    parallel_for(0, num_chunks, num_threads, [&](int c) {
+        const uint64 begin = (uint64)c * chunk_size;
+        const uint64 size = std::min<uint64>(chunk_size, header.data_size - begin);
+        write_all(bytes + begin, size, header.data_offset + begin);
+    }, 1);
+    assert_info(::close(fd) == 0, "Can not write " + fn);
+#else
+    FILE *f = std::fopen(fn.c_str(), "wb");
+    assert_info(f != nullptr, "Can not open " + fn + " for writing");
+    bool ok = std::fwrite(&head[0], 1, head.size(), f) == head.size();
+    for (int c = 0; c < num_chunks && ok; c++) {
+        const uint64 begin = (uint64)c * chunk_size;
+        const size_t size = (size_t)std::min<uint64>(chunk_size, header.data_size - begin);
+        ok = std::fwrite(bytes + begin, 1, size, f) == size;
+    }
+    ok = std::fclose(f) == 0 && ok;
+    assert_info(ok, "Can not write " + fn);
+#endif
+}
+
+void write_bricks(const std::string &fn, const ArrayFileHeader &header,
+                  const std::function<void(int64, char *)> &fill, int num_threads) {
+    const uint64 brick_bytes = get_brick_bytes(header);
+    const int64 num_bricks = (int64)(header.data_size / brick_bytes);
+    // Whole bricks per chunk
+    const int64 bricks_per_chunk = std::max<int64>(1, chunk_size / (int64)brick_bytes);
+    const int num_chunks = (int)((num_bricks + bricks_per_chunk - 1) / bricks_per_chunk);
+    std::vector<char> head(header.data_offset, 0);
+    std::memcpy(&head[0], &header, sizeof(header));
+    auto fill_chunk = [&](int c, std::vector<char> &buffer) {
+        const int64 begin = c * bricks_per_chunk, end = std::min(num_bricks, begin + bricks_per_chunk);
+        buffer.assign((end - begin) * brick_bytes, 0);
+        for (int64 b = begin; b < end; b++) {
+            fill(b, &buffer[(b - begin) * brick_bytes]);
+        }
+        return header.data_offset + begin * brick_bytes;
+    };
+#ifndef _WIN64
+    const int fd = ::open(fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert_info(fd >= 0, "Can not open " + fn + " for writing");
+    assert_info(ftruncate(fd, (off_t)(header.data_offset + header.data_size)) == 0, "Can not resize " + fn);
+    auto write_all = [&](const char *p, uint64 size, uint64 offset) {
+        while (size > 0) {
+            const ssize_t written = pwrite(fd, p, size, (off_t)offset);
+            assert_info(written > 0, "Can not write " + fn);
+            p += written;
+            size -= written;
+            offset += written;
+        }
+    };
+    write_all(&head[0], head.size(), 0);
+    parallel_for(0, num_chunks, num_threads, [&](int c) {
+        std::vector<char> buffer;
+        const uint64 offset = fill_chunk(c, buffer);
+        write_all(&buffer[0], buffer.size(), offset);
+    }, 1);
+    assert_info(::close(fd) == 0, "Can not write " + fn);
+#else
+    FILE *f = std::fopen(fn.c_str(), "wb");
+    assert_info(f != nullptr, "Can not open " + fn + " for writing");
+    bool ok = std::fwrite(&head[0], 1, head.size(), f) == head.size();
+    std::vector<char> buffer;
+    for (int c = 0; c < num_chunks && ok; c++) {
+        fill_chunk(c, buffer);
+        ok = std::fwrite(&buffer[0], 1, buffer.size(), f) == buffer.size();
+    }
+    ok = std::fclose(f) == 0 && ok;
+    assert_info(ok, "Can not write " + fn);
+#endif
+}
+
+bool read_header(const std::string &fn, ArrayFileHeader &header) {
+    FILE *f = std::fopen(fn.c_str(), "rb");
+    if (f == nullptr) {
+        return false;
+    }
+    const bool complete = std::fread(&header, sizeof(header), 1, f) == 1;
+    std::fclose(f);
+    assert_info(complete && std::memcmp(header.magic, magic, sizeof(magic)) == 0, fn + " is not an array file");
+    assert_info(header.byte_order == ArrayFileHeader::byte_order_mark, fn + " is of another byte order");
+    assert_info(header.version == ArrayFileHeader::current_version,
+                fn + " is of array file version " + std::to_string(header.version) + " instead of " +
+                std::to_string(ArrayFileHeader::current_version));
+    return true;
+}
+
+void check_header(const ArrayFileHeader &header, const std::string &fn, int dim, const char *element_type,
+                  uint32_t element_size, bool bricked) {
+    assert_info(header.dim == dim,
+                fn + " has " + std::to_string(header.dim) + " dimensions instead of " + std::to_string(dim));
+    assert_info(std::strncmp(header.element_type, element_type, sizeof(header.element_type)) == 0 &&
+                header.element_size == element_size,
+                fn + " has elements of " + std::string(header.element_type, strnlen(header.element_type,
+                sizeof(header.element_type))) + " instead of " + element_type);
+    if (!bricked) {
+        assert_info(header.brick_size == 0, fn + " is bricked, to be opened as a PagedArray3D");
+        assert_info(header.data_size == (uint64)header.res[0] * header.res[1] * header.res[2] * element_size &&
+                    header.data_offset % ArrayFileHeader::data_alignment == 0, fn + " has an invalid header");
+        return;
+    }
+    assert_info(header.brick_size > 0, fn + " is not bricked");
+    const Vector3i bricks = get_brick_res(header);
+    assert_info(header.data_size == (uint64)bricks.x * bricks.y * bricks.z * get_brick_bytes(header) &&
+                header.data_offset % ArrayFileHeader::data_alignment == 0, fn + " has an invalid header");
+}
+
+void read_data(const std::string &fn, const ArrayFileHeader &header, void *data, int num_threads) {
+    char *bytes = static_cast<char *>(data);
+    const int num_chunks = (int)((header.data_size + chunk_size - 1) / chunk_size);
+#ifndef _WIN64
+    const int fd = ::open(fn.c_str(), O_RDONLY);
+    assert_info(fd >= 0, "Can not open " + fn);
+    // Each thread reads into (and first touches) the pages of its chunks
+    parallel_for(0, num_chunks, num_threads, [&](int c) {
+        uint64 offset = (uint64)c * chunk_size;
+        uint64 size = std::min<uint64>(chunk_size, header.data_size - offset);
+        char *p = bytes + offset;
+        while (size > 0) {
+            const ssize_t read = pread(fd, p, size, (off_t)(header.data_offset + offset));
+            assert_info(read > 0, "Unexpected end of " + fn);
+            p += read;
+            offset += read;
+            size -= read;
+        }
+    }, 1);
+    ::close(fd);
+#else
+    FILE *f = std::fopen(fn.c_str(), "rb");
+    assert_info(f != nullptr, "Can not open " + fn);
+    bool ok = _fseeki64(f, (int64)header.data_offset, SEEK_SET) == 0;
+    for (int c = 0; c < num_chunks && ok; c++) {
+        const uint64 begin = (uint64)c * chunk_size;
+        const size_t size = (size_t)std::min<uint64>(chunk_size, header.data_size - begin);
+        ok = std::fread(bytes + begin, 1, size, f) == size;
+    }
+    std::fclose(f);
+    assert_info(ok, "Unexpected end of " + fn);
+#endif
+}
+
+}
+
+MappedFile::MappedFile(const std::string &fn) {
+#ifndef _WIN64
+    const int fd = ::open(fn.c_str(), O_RDONLY);
+    assert_info(fd >= 0, "Can not open " + fn);
+    struct stat st;
+    assert_info(fstat(fd, &st) == 0, "Can not stat " + fn);
+    size = (uint64)st.st_size;
+    if (size > 0) {
+        void *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        assert_info(p != MAP_FAILED, "Can not map " + fn);
+        data = static_cast<const char *>(p);
+    }
+    // The mapping stays valid without the descriptor
+    ::close(fd);
+#else
+    FILE *f = std::fopen(fn.c_str(), "rb");
+    assert_info(f != nullptr, "Can not open " + fn);
+    _fseeki64(f, 0, SEEK_END);
+    size = (uint64)_ftelli64(f);
+    _fseeki64(f, 0, SEEK_SET);
+    copy.resize(size);
+    assert_info(size == 0 || std::fread(&copy[0], 1, size, f) == size, "Can not read " + fn);
+    std::fclose(f);
+    data = copy.data();
+#endif
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN64
+    if (data != nullptr) {
+        munmap(const_cast<char *>(data), size);
+    }
+#endif
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,359 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <taichi/common/util.h>
+#include <taichi/math/array_2d.h>
+#include <taichi/math/array_3d.h>
+#include <taichi/system/threading.h>
+
+TC_NAMESPACE_BEGIN
+
+// Array files (.tca): a header describing the array, padding, then the values of Array2D or Array3D in their
+// storage order, as they are in memory. The data starts on a page boundary, so that a mapped file can be used
+// in place, as a read-only MappedArray2D or MappedArray3D.
+// 3D arrays can instead be stored in bricks of brick_size^3 values, each padded to data_alignment, for
+// PagedArray3D (see paged_array.h); other readers refuse them.
+// All fields are little-endian; readers refuse files of other versions, element types or byte orders.
+struct ArrayFileHeader {
+    static const int current_version = 1;
+    static const uint32_t byte_order_mark = 0x01020304u;
+    static const int data_alignment = 4096;
+
+    // "TCARRAY" and a zero
+    char magic[8];
+    uint32_t version;
+    // As written, 0x01020304
+    uint32_t byte_order;
+    // 2 or 3
+    int32_t dim;
+    uint32_t element_size;
+    // Of ArrayFileType<T>, e.g. "f32x3"
+    char element_type[16];
+    // Width, height and, in 3D, depth
+    int32_t res[3];
+    float storage_offset[3];
+    uint64 data_offset;
+    uint64 data_size;
+    // 0 for arrays in storage order
+    int32_t brick_size;
+    char reserved[44];
+};
+
+static_assert(sizeof(ArrayFileHeader) == 128, "ArrayFileHeader should be 128 bytes");
+
+// Element types that can be stored, by name
+template <typename T>
+struct ArrayFileType;
+
+#define TC_ARRAY_FILE_TYPE(T, type_name)       \
+    template <>                                \
+    struct ArrayFileType<T> {                  \
+        static const char *name() {            \
+            return type_name;                  \
+        }                                      \
+    };
+
+TC_ARRAY_FILE_TYPE(float, "f32")
+TC_ARRAY_FILE_TYPE(double, "f64")
+TC_ARRAY_FILE_TYPE(int, "i32")
+TC_ARRAY_FILE_TYPE(unsigned char, "u8")
+TC_ARRAY_FILE_TYPE(Vector2, "f32x2")
+TC_ARRAY_FILE_TYPE(Vector3, "f32x3")
+TC_ARRAY_FILE_TYPE(Vector4, "f32x4")
+TC_ARRAY_FILE_TYPE(Vector2i, "i32x2")
+TC_ARRAY_FILE_TYPE(Vector3i, "i32x3")
+
+#undef TC_ARRAY_FILE_TYPE
+
+namespace array_file {
+
+// Fills in everything but the magic, from the arguments
+ArrayFileHeader make_header(int dim, const Vector3i &res, const Vector3 &storage_offset, const char *element_type,
+                            uint32_t element_size, int brick_size = 0);
+
+// Of bricked arrays
+Vector3i get_brick_res(const ArrayFileHeader &header);
+
+uint64 get_brick_bytes(const ArrayFileHeader &header);
+
+// Writes the header and data_size bytes of data, in chunks written by num_threads threads
+void write(const std::string &fn, const ArrayFileHeader &header, const void *data, int num_threads);
+
+// Writes the header and the bricks of a bricked array, each filled in by fill(brick, data) in a zeroed buffer of
+// get_brick_bytes(header), by num_threads threads
+void write_bricks(const std::string &fn, const ArrayFileHeader &header,
+                  const std::function<void(int64, char *)> &fill, int num_threads);
+
+// False if the file can not be opened. Fails on files that are not array files.
+bool read_header(const std::string &fn, ArrayFileHeader &header);
+
+// Reads header.data_size bytes of data, in chunks read by num_threads threads
+void read_data(const std::string &fn, const ArrayFileHeader &header, void *data, int num_threads);
+
+// Fails unless the header is of dim dimensions of element_type, in storage order or bricked
+void check_header(const ArrayFileHeader &header, const std::string &fn, int dim, const char *element_type,
+                  uint32_t element_size, bool bricked = false);
+
+}
+
+// A read-only mapping of a whole file, or on platforms without mmap, a copy of it in memory
+class MappedFile {
+public:
+    explicit MappedFile(const std::string &fn);
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile();
+
+    const char *get_data() const {
+        return data;
+    }
+
+    uint64 get_size() const {
+        return size;
+    }
+
+private:
+    const char *data = nullptr;
+    uint64 size = 0;
+    std::vector<char> copy;
+};
+
+template <typename T>
+void write_array_file(const std::string &fn, const Array2D<T> &arr, int num_threads = 1) {
+    const ArrayFileHeader header =
+            array_file::make_header(2, Vector3i(arr.get_width(), arr.get_height(), 1),
+                                    Vector3(arr.get_storage_offset(), 0.0f), ArrayFileType<T>::name(), sizeof(T));
+    array_file::write(fn, header, arr.get_size() ? &arr.get_data()[0] : nullptr, num_threads);
+}
+
+template <typename T>
+void write_array_file(const std::string &fn, const Array3D<T> &arr, int num_threads = 1) {
+    const ArrayFileHeader header = array_file::make_header(
+            3, Vector3i(arr.get_width(), arr.get_height(), arr.get_depth()), arr.get_storage_offset(),
+            ArrayFileType<T>::name(), sizeof(T));
+    array_file::write(fn, header, arr.get_size() ? &arr.get_data()[0] : nullptr, num_threads);
+}
+
+// False if the file can not be opened
+template <typename T>
+bool read_array_file(const std::string &fn, Array2D<T> &arr, int num_threads = 1) {
+    ArrayFileHeader header;
+    if (!array_file::read_header(fn, header)) {
+        return false;
+    }
+    array_file::check_header(header, fn, 2, ArrayFileType<T>::name(), sizeof(T));
+    arr.allocate(header.res[0], header.res[1], Vector2(header.storage_offset[0], header.storage_offset[1]));
+    array_file::read_data(fn, header, arr.get_size() ? &arr.get_data()[0] : nullptr, num_threads);
+    return true;
+}
+
+template <typename T>
+bool read_array_file(const std::string &fn, Array3D<T> &arr, int num_threads = 1) {
+    ArrayFileHeader header;
+    if (!array_file::read_header(fn, header)) {
+        return false;
+    }
+    array_file::check_header(header, fn, 3, ArrayFileType<T>::name(), sizeof(T));
+    arr.allocate(header.res[0], header.res[1], header.res[2],
+                 Vector3(header.storage_offset[0], header.storage_offset[1], header.storage_offset[2]));
+    array_file::read_data(fn, header, arr.get_size() ? &arr.get_data()[0] : nullptr, num_threads);
+    return true;
+}
+
+// The values of an array file in place, without reading them: pages are read as they are touched.
+// Indexing and sampling are as those of Array2D.
+template <typename T>
+class MappedArray2D {
+protected:
+    std::shared_ptr<MappedFile> file;
+    const T *data = nullptr;
+    int width = 0, height = 0;
+    Vector2 storage_offset;
+
+public:
+    MappedArray2D() {}
+
+    explicit MappedArray2D(const std::string &fn) {
+        open(fn);
+    }
+
+    void open(const std::string &fn) {
+        ArrayFileHeader header;
+        assert_info(array_file::read_header(fn, header), "Can not open " + fn);
+        array_file::check_header(header, fn, 2, ArrayFileType<T>::name(), sizeof(T));
+        file = std::make_shared<MappedFile>(fn);
+        data = reinterpret_cast<const T *>(file->get_data() + header.data_offset);
+        width = header.res[0];
+        height = header.res[1];
+        storage_offset = Vector2(header.storage_offset[0], header.storage_offset[1]);
+    }
+
+    int get_width() const {
+        return width;
+    }
+
+    int get_height() const {
+        return height;
+    }
+
+    int get_size() const {
+        return width * height;
+    }
+
+    Vector2 get_storage_offset() const {
+        return storage_offset;
+    }
+
+    const T *operator[](int i) const {
+        return data + (int64)i * height;
+    }
+
+    const T &get(int i, int j) const {
+        return data[(int64)i * height + j];
+    }
+
+    T sample(real x, real y) const {
+        x = clamp(x - storage_offset.x, 0.f, width - 1.f - eps);
+        y = clamp(y - storage_offset.y, 0.f, height - 1.f - eps);
+        const int x_i = clamp(int(x), 0, width - 2);
+        const int y_i = clamp(int(y), 0, height - 2);
+        const real x_r = x - x_i, y_r = y - y_i;
+        return lerp(x_r, lerp(y_r, get(x_i, y_i), get(x_i, y_i + 1)),
+                    lerp(y_r, get(x_i + 1, y_i), get(x_i + 1, y_i + 1)));
+    }
+
+    T sample(const Vector2 &v) const {
+        return sample(v.x, v.y);
+    }
+
+    // A copy in memory
+    Array2D<T> to_array() const {
+        Array2D<T> arr(width, height, uninitialized, storage_offset);
+        std::copy(data, data + get_size(), arr.get_data().begin());
+        return arr;
+    }
+};
+
+template <typename T>
+class MappedArray3D {
+protected:
+    std::shared_ptr<MappedFile> file;
+    const T *data = nullptr;
+    int width = 0, height = 0, depth = 0;
+    Vector3 storage_offset;
+
+public:
+    struct ConstAccessor2D {
+        const T *data;
+        int depth;
+
+        const T *operator[](int j) const {
+            return data + (int64)j * depth;
+        }
+    };
+
+    MappedArray3D() {}
+
+    explicit MappedArray3D(const std::string &fn) {
+        open(fn);
+    }
+
+    void open(const std::string &fn) {
+        ArrayFileHeader header;
+        assert_info(array_file::read_header(fn, header), "Can not open " + fn);
+        array_file::check_header(header, fn, 3, ArrayFileType<T>::name(), sizeof(T));
+        file = std::make_shared<MappedFile>(fn);
+        data = reinterpret_cast<const T *>(file->get_data() + header.data_offset);
+        width = header.res[0];
+        height = header.res[1];
+        depth = header.res[2];
+        storage_offset = Vector3(header.storage_offset[0], header.storage_offset[1], header.storage_offset[2]);
+    }
+
+    int get_width() const {
+        return width;
+    }
+
+    int get_height() const {
+        return height;
+    }
+
+    int get_depth() const {
+        return depth;
+    }
+
+    int64 get_size() const {
+        return (int64)width * height * depth;
+    }
+
+    Vector3 get_storage_offset() const {
+        return storage_offset;
+    }
+
+    Region3D get_region() const {
+        return Region3D(0, width, 0, height, 0, depth, storage_offset);
+    }
+
+    ConstAccessor2D operator[](int i) const {
+        return ConstAccessor2D{data + (int64)i * height * depth, depth};
+    }
+
+    const T &operator[](const Index3D &ind) const {
+        return get(ind.i, ind.j, ind.k);
+    }
+
+    const T &get(int i, int j, int k) const {
+        return data[((int64)i * height + j) * depth + k];
+    }
+
+    T sample(real x, real y, real z) const {
+        x = clamp(x - storage_offset.x, 0.f, width - 1.f - eps);
+        y = clamp(y - storage_offset.y, 0.f, height - 1.f - eps);
+        z = clamp(z - storage_offset.z, 0.f, depth - 1.f - eps);
+        const int x_i = clamp(int(x), 0, width - 2);
+        const int y_i = clamp(int(y), 0, height - 2);
+        const int z_i = clamp(int(z), 0, depth - 2);
+        const real x_r = x - x_i, y_r = y - y_i, z_r = z - z_i;
+        return lerp(z_r,
+                    lerp(x_r, lerp(y_r, get(x_i, y_i, z_i), get(x_i, y_i + 1, z_i)),
+                         lerp(y_r, get(x_i + 1, y_i, z_i), get(x_i + 1, y_i + 1, z_i))),
+                    lerp(x_r, lerp(y_r, get(x_i, y_i, z_i + 1), get(x_i, y_i + 1, z_i + 1)),
+                         lerp(y_r, get(x_i + 1, y_i, z_i + 1), get(x_i + 1, y_i + 1, z_i + 1))));
+    }
+
+    T sample(const Vector3 &v) const {
+        return sample(v.x, v.y, v.z);
+    }
+
+    T sample_relative_coord(const Vector3 &v) const {
+        return sample(v.x * width, v.y * height, v.z * depth);
+    }
+
+    // A copy in memory, with the x slabs copied (and first touched) by num_threads threads
+    Array3D<T> to_array(int num_threads = 1) const {
+        Array3D<T> arr(width, height, depth, uninitialized, storage_offset);
+        const int64 slab = (int64)height * depth;
+        T *out = get_size() ? &arr.get_data()[0] : nullptr;
+        parallel_for(0, width, num_threads, [&](int i) {
+            std::copy(data + i * slab, data + (i + 1) * slab, out + i * slab);
+        });
+        return arr;
+    }
+};
+
+TC_NAMESPACE_END
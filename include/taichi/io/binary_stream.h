@@ -10,38 +10,334 @@
 #pragma once
 
 #include <taichi/common/meta.h>
+#include <taichi/math/array_1d.h>
+#include <taichi/math/array_2d.h>
+#include <taichi/math/array_3d.h>
 #include <cstdio>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 TC_NAMESPACE_BEGIN
 
-class BinaryFileStreamInput final {
+// Types written as their bytes. glm vectors and matrices are, though their copy constructors keep them from
+// being trivially copyable; structs of those can opt in with TC_BINARY_POD.
+template <typename T>
+struct is_binary_pod : std::integral_constant<bool, std::is_trivially_copyable<T>::value> {};
+
+#define TC_BINARY_POD_TEMPLATE(G)                          \
+    template <typename T, glm::precision P>                \
+    struct is_binary_pod<glm::G<T, P>> : std::true_type {};
+
+TC_BINARY_POD_TEMPLATE(tvec1)
+TC_BINARY_POD_TEMPLATE(tvec2)
+TC_BINARY_POD_TEMPLATE(tvec3)
+TC_BINARY_POD_TEMPLATE(tvec4)
+TC_BINARY_POD_TEMPLATE(tmat2x2)
+TC_BINARY_POD_TEMPLATE(tmat3x3)
+TC_BINARY_POD_TEMPLATE(tmat4x4)
+TC_BINARY_POD_TEMPLATE(tquat)
+
+#undef TC_BINARY_POD_TEMPLATE
+
+// Within TC_NAMESPACE
+#define TC_BINARY_POD(T) \
+    template <>          \
+    struct is_binary_pod<T> : std::true_type {};
+
+// Whether T has a member `void write(Stream &os) const`, used instead of its bytes
+template <typename T, typename Stream, typename = void>
+struct has_binary_write : std::false_type {};
+
+template <typename T, typename Stream>
+struct has_binary_write<T, Stream, decltype(void(std::declval<const T &>().write(std::declval<Stream &>())))>
+        : std::true_type {};
+
+// Whether T has a member `void read(Stream &is)`
+template <typename T, typename Stream, typename = void>
+struct has_binary_read : std::false_type {};
+
+template <typename T, typename Stream>
+struct has_binary_read<T, Stream, decltype(void(std::declval<T &>().read(std::declval<Stream &>())))>
+        : std::true_type {};
+
+// operator<< for streams with write_raw(data, size), over
+//   - types with a write member (e.g. MPM3Particles),
+//   - binary PODs, as their bytes,
+//   - std::vector, std::string, std::pair, Array1D, Array2D and Array3D of those, with their sizes first.
+// Vectors and arrays of PODs go from their storage to the stream in a single write_raw.
+template <typename Stream>
+class BinaryOutputStream {
+public:
+    template <typename T>
+    Stream &operator<<(const T &t) {
+        put(t);
+        return self();
+    }
+
 private:
-    FILE *f;
+    Stream &self() {
+        return *static_cast<Stream *>(this);
+    }
+
+    template <typename T>
+    void put(const T &t) {
+        put(t, has_binary_write<T, Stream>());
+    }
+
+    template <typename T>
+    void put(const T &t, std::true_type) {
+        t.write(self());
+    }
+
+    template <typename T>
+    void put(const T &t, std::false_type) {
+        static_assert(is_binary_pod<T>::value,
+                      "Not serializable: give it a write member, or declare it TC_BINARY_POD if it is plain data");
+        self().write_raw(&t, sizeof(t));
+    }
+
+    template <typename T>
+    void put_elements(const T *data, std::size_t n) {
+        if (is_binary_pod<T>::value) {
+            self().write_raw(data, sizeof(T) * n);
+        } else {
+            for (std::size_t i = 0; i < n; i++) {
+                put(data[i]);
+            }
+        }
+    }
+
+    template <typename T, typename A>
+    void put(const std::vector<T, A> &vec) {
+        put(uint64(vec.size()));
+        put_elements(vec.data(), vec.size());
+    }
+
+    void put(const std::string &str) {
+        put(uint64(str.size()));
+        self().write_raw(str.data(), str.size());
+    }
+
+    template <typename A, typename B>
+    void put(const std::pair<A, B> &p) {
+        put(p.first);
+        put(p.second);
+    }
+
+    template <typename T>
+    void put(const Array1D<T> &arr) {
+        put(arr.size);
+        put_elements(arr.get_data().data(), arr.size);
+    }
+
+    template <typename T>
+    void put(const Array2D<T> &arr) {
+        put(arr.get_width());
+        put(arr.get_height());
+        put_elements(arr.get_data().data(), (std::size_t)arr.get_size());
+    }
+
+    template <typename T>
+    void put(const Array3D<T> &arr) {
+        put(arr.get_width());
+        put(arr.get_height());
+        put(arr.get_depth());
+        put_elements(arr.get_data().data(), (std::size_t)arr.get_size());
+    }
+};
+
+// operator>> and read<T>() for streams with read_raw(data, size), for the types of BinaryOutputStream
+template <typename Stream>
+class BinaryInputStream {
 public:
-    BinaryFileStreamInput(const std::string &fn) {
-        f = std::fopen(fn.c_str(), "rb");
+    template <typename T>
+    Stream &operator>>(T &t) {
+        get(t);
+        return self();
+    }
+
+    template <typename T>
+    T read() {
+        T t;
+        get(t);
+        return t;
+    }
+
+private:
+    Stream &self() {
+        return *static_cast<Stream *>(this);
+    }
+
+    template <typename T>
+    void get(T &t) {
+        get(t, has_binary_read<T, Stream>());
+    }
+
+    template <typename T>
+    void get(T &t, std::true_type) {
+        t.read(self());
+    }
+
+    template <typename T>
+    void get(T &t, std::false_type) {
+        static_assert(is_binary_pod<T>::value,
+                      "Not serializable: give it a read member, or declare it TC_BINARY_POD if it is plain data");
+        self().read_raw(&t, sizeof(t));
     }
 
-    template<typename T>
-    BinaryFileStreamInput operator >> (const T &t) {
+    template <typename T>
+    void get_elements(T *data, std::size_t n) {
+        if (is_binary_pod<T>::value) {
+            self().read_raw(data, sizeof(T) * n);
+        } else {
+            for (std::size_t i = 0; i < n; i++) {
+                get(data[i]);
+            }
+        }
     }
 
-    BinaryFileStreamInput() {
+    template <typename T, typename A>
+    void get(std::vector<T, A> &vec) {
+        vec.resize(read<uint64>());
+        get_elements(vec.data(), vec.size());
+    }
+
+    void get(std::string &str) {
+        str.resize(read<uint64>());
+        self().read_raw(&str[0], str.size());
+    }
+
+    template <typename A, typename B>
+    void get(std::pair<A, B> &p) {
+        get(p.first);
+        get(p.second);
+    }
+
+    template <typename T>
+    void get(Array1D<T> &arr) {
+        arr = Array1D<T>(read<int>());
+        get_elements(arr.data.data(), arr.size);
+    }
+
+    template <typename T>
+    void get(Array2D<T> &arr) {
+        const int width = read<int>();
+        const int height = read<int>();
+        arr.allocate(width, height);
+        get_elements(arr.get_data().data(), (std::size_t)arr.get_size());
+    }
+
+    template <typename T>
+    void get(Array3D<T> &arr) {
+        const int width = read<int>();
+        const int height = read<int>();
+        const int depth = read<int>();
+        arr.allocate(width, height, depth);
+        get_elements(arr.get_data().data(), (std::size_t)arr.get_size());
+    }
+};
+
+// Binary files, through a buffer of buffer_size bytes. With compress, the buffer is written as zlib blocks
+// (see compression.h) whenever it fills up, and the reader has to be opened with compress as well.
+class BinaryFileStreamInput final : public BinaryInputStream<BinaryFileStreamInput> {
+private:
+    FILE *f;
+    std::string fn;
+    bool compress;
+    std::vector<char> buffer;
+    std::size_t position = 0, filled = 0;
+
+    // Reads the next block into the buffer
+    void refill();
+
+public:
+    BinaryFileStreamInput(const std::string &fn, std::size_t buffer_size = 16 << 20, bool compress = false);
+
+    BinaryFileStreamInput(const BinaryFileStreamInput &) = delete;
+
+    BinaryFileStreamInput &operator=(const BinaryFileStreamInput &) = delete;
+
+    void read_raw(void *data, std::size_t size);
+
+    // Continues reading at byte offset of the file; uncompressed streams only
+    void seek(uint64 offset);
+
+    uint64 get_file_size();
+
+    ~BinaryFileStreamInput() {
         std::fclose(f);
     }
 };
 
-class BinaryFileStreamOutput final {
+class BinaryFileStreamOutput final : public BinaryOutputStream<BinaryFileStreamOutput> {
 private:
     FILE *f;
+    std::string fn;
+    bool compress;
+    std::vector<char> buffer;
+    std::size_t filled = 0;
+    // Bytes handed to write_raw so far
+    uint64 written = 0;
+
+    // Writes out and empties the buffer; false on errors
+    bool write_buffer();
+
 public:
-    BinaryFileStreamOutput(const std::string &fn) {
-        f = std::fopen(fn.c_str(), "wb");
+    BinaryFileStreamOutput(const std::string &fn, std::size_t buffer_size = 16 << 20, bool compress = false);
+
+    BinaryFileStreamOutput(const BinaryFileStreamOutput &) = delete;
+
+    BinaryFileStreamOutput &operator=(const BinaryFileStreamOutput &) = delete;
+
+    void write_raw(const void *data, std::size_t size);
+
+    // The offset in the file of the next byte written, for uncompressed streams
+    uint64 tell() const {
+        return written;
     }
 
-    BinaryFileStreamOutput() {
-        std::fclose(f);
+    // Writes out the buffer (as a block, if compressed)
+    void flush();
+
+    // Flushes and closes the file; errors are reported here rather than in the destructor
+    void close();
+
+    ~BinaryFileStreamOutput();
+};
+
+// The same interface over a byte buffer, e.g. for messages between processes
+class BinaryMemoryStreamOutput final : public BinaryOutputStream<BinaryMemoryStreamOutput> {
+public:
+    std::vector<char> data;
+
+    void write_raw(const void *ptr, std::size_t size) {
+        const char *bytes = static_cast<const char *>(ptr);
+        data.insert(data.end(), bytes, bytes + size);
+    }
+};
+
+class BinaryMemoryStreamInput final : public BinaryInputStream<BinaryMemoryStreamInput> {
+private:
+    const std::vector<char> &data;
+    std::size_t position = 0;
+
+public:
+    BinaryMemoryStreamInput(const std::vector<char> &data) : data(data) {}
+
+    bool eof() const {
+        return position == data.size();
+    }
+
+    void read_raw(void *ptr, std::size_t size) {
+        assert_info(position + size <= data.size(), "Unexpected end of binary stream");
+        if (size > 0) {
+            std::memcpy(ptr, data.data() + position, size);
+        }
+        position += size;
     }
 };
 
-TC_NAMESPACE_END
\ No newline at end of file
+TC_NAMESPACE_END
@@ -0,0 +1,82 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/io/binary_stream.h>
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// zlib stream of num_scalars scalars of scalar_size bytes, with byte k of every scalar grouped together
+// first, which makes float arrays far more compressible
+void compress_shuffled(const char *data, std::size_t num_scalars, std::size_t scalar_size,
+                       std::vector<char> &compressed);
+
+// Inverse of compress_shuffled; false if the stream is corrupted or does not hold exactly that many bytes
+bool decompress_shuffled(const char *compressed, std::size_t compressed_size, std::size_t num_scalars,
+                         std::size_t scalar_size, char *data);
+
+// Writes n elements as chunks of chunk_size elements, each a uint64 byte count followed by the raw data
+// or, if compress, by its compress_shuffled stream. Elements are shuffled as scalars, so that e.g. all
+// x-exponents of Vector3s end up next to each other.
+template <typename T>
+void write_chunked(BinaryFileStreamOutput &os, const T *data, std::size_t n, int chunk_size, bool compress) {
+    const std::size_t scalar_size = sizeof(T) % sizeof(real) == 0 ? sizeof(real) : sizeof(T);
+    std::vector<char> compressed;
+    for (std::size_t begin = 0; begin < n; begin += chunk_size) {
+        const std::size_t count = std::min(n - begin, (std::size_t)chunk_size);
+        const char *raw = reinterpret_cast<const char *>(data + begin);
+        if (!compress) {
+            os << uint64(count * sizeof(T));
+            os.write_raw(raw, count * sizeof(T));
+            continue;
+        }
+        compress_shuffled(raw, count * sizeof(T) / scalar_size, scalar_size, compressed);
+        os << uint64(compressed.size());
+        os.write_raw(compressed.data(), compressed.size());
+    }
+}
+
+// Reads n elements written by write_chunked with the same chunk_size
+template <typename T>
+void read_chunked(BinaryFileStreamInput &is, T *data, std::size_t n, int chunk_size, bool compressed) {
+    const std::size_t scalar_size = sizeof(T) % sizeof(real) == 0 ? sizeof(real) : sizeof(T);
+    std::vector<char> stored;
+    for (std::size_t begin = 0; begin < n; begin += chunk_size) {
+        const std::size_t count = std::min(n - begin, (std::size_t)chunk_size);
+        char *raw = reinterpret_cast<char *>(data + begin);
+        uint64 stored_size = is.read<uint64>();
+        if (!compressed) {
+            assert_info(stored_size == count * sizeof(T), "Corrupted chunk");
+            is.read_raw(raw, count * sizeof(T));
+            continue;
+        }
+        stored.resize(stored_size);
+        is.read_raw(stored.data(), stored_size);
+        assert_info(decompress_shuffled(stored.data(), stored_size, count * sizeof(T) / scalar_size, scalar_size, raw),
+                    "Corrupted chunk");
+    }
+}
+
+template <typename T>
+void write_chunked(BinaryFileStreamOutput &os, const std::vector<T> &data, int chunk_size, bool compress) {
+    write_chunked(os, data.data(), data.size(), chunk_size, compress);
+}
+
+// Resizes data to n first
+template <typename T>
+void read_chunked(BinaryFileStreamInput &is, std::vector<T> &data, std::size_t n, int chunk_size, bool compressed) {
+    data.resize(n);
+    read_chunked(is, data.data(), n, chunk_size, compressed);
+}
+
+TC_NAMESPACE_END
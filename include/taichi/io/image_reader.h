@@ -12,6 +12,8 @@
 #include <taichi/math/linalg.h>
 #include <taichi/image/image_buffer.h>
 #include <taichi/common/meta.h>
+#include <string>
+#include <vector>
 
 TC_NAMESPACE_BEGIN
 
@@ -21,6 +23,24 @@ public:
     virtual Array2D<Vector4> read(const std::string &filepath) {
         return Array2D<Vector4>(0, 0);
     }
+
+    virtual Array2D<Vector3> read_rgb(const std::string &filepath) {
+        auto rgba = read(filepath);
+        Array2D<Vector3> img(rgba.get_width(), rgba.get_height());
+        for (auto &ind : img.get_region()) {
+            img[ind] = Vector3(rgba[ind]);
+        }
+        return img;
+    }
+
+    // Reads a set of files that belong together, e.g. the exposures of a bracket
+    virtual std::vector<Array2D<Vector3>> read_all(const std::vector<std::string> &filepaths) {
+        std::vector<Array2D<Vector3>> images;
+        for (auto &filepath : filepaths) {
+            images.push_back(read_rgb(filepath));
+        }
+        return images;
+    }
 };
 
 TC_INTERFACE(ImageReader);
@@ -0,0 +1,30 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/math/linalg.h>
+#include <taichi/math/array_2d.h>
+#include <string>
+
+TC_NAMESPACE_BEGIN
+
+// The scale of the image to divide by for an average luminance of 0.18 of that of white, as of write_output
+real get_image_exposure_scale(const Array2D<Vector3> &image, int num_threads);
+
+// PNG of the image divided by scale, clamped to [0, 1] and raised to 1 / gamma. Quantized by comparing against
+// the 256 thresholds of the 8-bit values, which is what rounding down pow(x, 1 / gamma) gives, without pow.
+void write_ldr_image(const std::string &fn, const Array2D<Vector3> &image, real scale, real gamma,
+                     int num_threads);
+
+// OpenEXR of the linear values, as half or full floats, ZIP compressed in blocks of 16 scanlines, which are
+// compressed in parallel
+void write_exr_image(const std::string &fn, const Array2D<Vector3> &image, bool half, int num_threads);
+
+TC_NAMESPACE_END
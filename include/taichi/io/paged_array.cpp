@@ -0,0 +1,119 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include "paged_array.h"
+#include <taichi/system/memory.h>
+
+#ifndef _WIN64
+#include <sys/mman.h>
+#endif
+
+TC_NAMESPACE_BEGIN
+
+static int get_paged_array_tag() {
+    static const int tag = MemoryAccounting::get_tag("paged_array");
+    return tag;
+}
+
+// Advice on a brick of the mapping; ignored where bricks are not whole pages
+static void advise(const char *data, uint64 size, bool needed) {
+#ifndef _WIN64
+    madvise(const_cast<char *>(data), size, needed ? MADV_WILLNEED : MADV_DONTNEED);
+#endif
+}
+
+PagedBricks::PagedBricks(std::shared_ptr<MappedFile> file, const ArrayFileHeader &header, int64 budget)
+        : file(file), num_faults(0) {
+    data = file->get_data() + header.data_offset;
+    brick_bytes = array_file::get_brick_bytes(header);
+    brick_res = array_file::get_brick_res(header);
+    const int64 num_bricks = (int64)brick_res.x * brick_res.y * brick_res.z;
+    assert_info(file->get_size() >= header.data_offset + header.data_size, "Truncated array file");
+    states.reset(new std::atomic<unsigned char>[num_bricks]);
+    for (int64 i = 0; i < num_bricks; i++) {
+        states[i].store(absent, std::memory_order_relaxed);
+    }
+    set_budget(budget);
+}
+
+PagedBricks::~PagedBricks() {
+    MemoryAccounting::add(get_paged_array_tag(), -num_resident * (int64)brick_bytes);
+}
+
+void PagedBricks::set_budget(int64 bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int64 i = 0; i < num_resident; i++) {
+        release(ring[i]);
+    }
+    MemoryAccounting::add(get_paged_array_tag(), -num_resident * (int64)brick_bytes);
+    capacity = std::max<int64>(min_resident_bricks, bytes / (int64)brick_bytes);
+    ring.assign(capacity, 0);
+    num_resident = 0;
+    hand = 0;
+    num_faults = 0;
+}
+
+void PagedBricks::access(int64 brick) {
+    if (states[brick].load(std::memory_order_relaxed) == resident) {
+        states[brick].store(referenced, std::memory_order_relaxed);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (states[brick].load(std::memory_order_relaxed) != absent) {
+        // Made resident by another thread meanwhile
+        states[brick].store(referenced, std::memory_order_relaxed);
+        return;
+    }
+    num_faults.fetch_add(1, std::memory_order_relaxed);
+    make_resident(brick, referenced);
+    const Vector3i b((int)(brick / ((int64)brick_res.y * brick_res.z)), (int)(brick / brick_res.z % brick_res.y),
+                     (int)(brick % brick_res.z));
+    for (int a = 0; a < 3; a++) {
+        for (int d = -1; d <= 1; d += 2) {
+            Vector3i n = b;
+            n[a] += d;
+            if (n[a] < 0 || n[a] >= brick_res[a]) {
+                continue;
+            }
+            const int64 neighbour = ((int64)n.x * brick_res.y + n.y) * brick_res.z + n.z;
+            if (states[neighbour].load(std::memory_order_relaxed) == absent) {
+                // Not referenced, so evicted first if never accessed
+                make_resident(neighbour, resident);
+            }
+        }
+    }
+}
+
+void PagedBricks::make_resident(int64 brick, State state) {
+    if (num_resident < capacity) {
+        ring[num_resident++] = brick;
+        MemoryAccounting::add(get_paged_array_tag(), (int64)brick_bytes);
+    } else {
+        while (true) {
+            int64 &victim = ring[hand];
+            hand = (hand + 1) % capacity;
+            if (states[victim].load(std::memory_order_relaxed) == referenced) {
+                states[victim].store(resident, std::memory_order_relaxed);
+                continue;
+            }
+            release(victim);
+            victim = brick;
+            break;
+        }
+    }
+    states[brick].store(state, std::memory_order_relaxed);
+    advise(data + brick * brick_bytes, brick_bytes, true);
+}
+
+void PagedBricks::release(int64 brick) {
+    states[brick].store(absent, std::memory_order_relaxed);
+    advise(data + brick * brick_bytes, brick_bytes, false);
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,293 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <taichi/io/array_file.h>
+
+TC_NAMESPACE_BEGIN
+
+// The bricks of a mapped bricked array file, with the set of those kept resident bounded by a budget. A brick
+// becomes resident when first accessed, and then its six neighbours are prefetched as well; over the budget,
+// bricks are evicted by the CLOCK (second chance) approximation of LRU, as in the TextureCache.
+// The mapping stays whole, so residency is only advice to the kernel: an evicted brick still accessed by another
+// thread is read again from the file, and hits are a relaxed load. On platforms without mmap the file is in
+// memory anyway, and the budget has no effect.
+class PagedBricks {
+public:
+    // Bricks prefetched with one, which the budget holds at least
+    static constexpr int min_resident_bricks = 7;
+
+    PagedBricks(std::shared_ptr<MappedFile> file, const ArrayFileHeader &header, int64 budget);
+
+    PagedBricks(const PagedBricks &) = delete;
+
+    PagedBricks &operator=(const PagedBricks &) = delete;
+
+    ~PagedBricks();
+
+    const char *get_brick(int64 brick) {
+        if (states[brick].load(std::memory_order_relaxed) != referenced) {
+            access(brick);
+        }
+        return data + brick * brick_bytes;
+    }
+
+    // Drops all bricks
+    void set_budget(int64 bytes);
+
+    int64 get_budget() const {
+        return capacity * (int64)brick_bytes;
+    }
+
+    int64 get_resident_bytes() const {
+        return num_resident * (int64)brick_bytes;
+    }
+
+    // Bricks made resident on access, not counting prefetches, since the last set_budget()
+    int64 get_num_faults() const {
+        return num_faults.load(std::memory_order_relaxed);
+    }
+
+protected:
+    enum State : unsigned char {
+        absent = 0,
+        resident = 1,
+        // Resident and accessed since the CLOCK hand last passed
+        referenced = 2,
+    };
+
+    std::shared_ptr<MappedFile> file;
+    const char *data;
+    uint64 brick_bytes;
+    Vector3i brick_res;
+    std::unique_ptr<std::atomic<unsigned char>[]> states;
+    std::mutex mutex;
+    // The resident bricks, num_resident of capacity
+    std::vector<int64> ring;
+    int64 capacity = 0;
+    int64 num_resident = 0;
+    // Of the CLOCK
+    int64 hand = 0;
+    std::atomic<int64> num_faults;
+
+    void access(int64 brick);
+
+    // Called with the mutex held
+    void make_resident(int64 brick, State state);
+
+    void release(int64 brick);
+};
+
+// A read-only Array3D too large for memory, in a bricked array file written by write_paged_array_file, mapped
+// and read in place brick by brick (see PagedBricks). Copies share the bricks and their budget.
+// Indexing and sampling are as those of Array3D; iterating get_region() goes brick by brick.
+template <typename T>
+class PagedArray3D {
+protected:
+    std::shared_ptr<PagedBricks> bricks;
+    int width = 0, height = 0, depth = 0;
+    Vector3 storage_offset;
+    int brick_size = 0;
+    int brick_shift = 0, brick_mask = 0;
+    Vector3i brick_res;
+
+    const T *get_brick(int i, int j, int k) const {
+        const int64 brick = ((int64)(i >> brick_shift) * brick_res.y + (j >> brick_shift)) * brick_res.z +
+                            (k >> brick_shift);
+        return reinterpret_cast<const T *>(bricks->get_brick(brick));
+    }
+
+    int get_offset(int i, int j, int k) const {
+        return ((((i & brick_mask) << brick_shift) + (j & brick_mask)) << brick_shift) + (k & brick_mask);
+    }
+
+public:
+    static const int default_brick_size = 16;
+    static constexpr int64 default_budget = 256LL << 20;
+
+    struct ConstAccessor1D {
+        const PagedArray3D *arr;
+        int i, j;
+
+        const T &operator[](int k) const {
+            return arr->get(i, j, k);
+        }
+    };
+
+    struct ConstAccessor2D {
+        const PagedArray3D *arr;
+        int i;
+
+        ConstAccessor1D operator[](int j) const {
+            return ConstAccessor1D{arr, i, j};
+        }
+    };
+
+    PagedArray3D() {}
+
+    explicit PagedArray3D(const std::string &fn, int64 budget = default_budget) {
+        open(fn, budget);
+    }
+
+    void open(const std::string &fn, int64 budget = default_budget) {
+        ArrayFileHeader header;
+        assert_info(array_file::read_header(fn, header), "Can not open " + fn);
+        array_file::check_header(header, fn, 3, ArrayFileType<T>::name(), sizeof(T), true);
+        brick_size = header.brick_size;
+        assert_info((brick_size & (brick_size - 1)) == 0, fn + " has bricks of a size not a power of two");
+        brick_shift = 0;
+        while ((1 << brick_shift) < brick_size) {
+            brick_shift++;
+        }
+        brick_mask = brick_size - 1;
+        brick_res = array_file::get_brick_res(header);
+        bricks = std::make_shared<PagedBricks>(std::make_shared<MappedFile>(fn), header, budget);
+        width = header.res[0];
+        height = header.res[1];
+        depth = header.res[2];
+        storage_offset = Vector3(header.storage_offset[0], header.storage_offset[1], header.storage_offset[2]);
+    }
+
+    int get_width() const {
+        return width;
+    }
+
+    int get_height() const {
+        return height;
+    }
+
+    int get_depth() const {
+        return depth;
+    }
+
+    int64 get_size() const {
+        return (int64)width * height * depth;
+    }
+
+    int get_brick_size() const {
+        return brick_size;
+    }
+
+    Vector3 get_storage_offset() const {
+        return storage_offset;
+    }
+
+    Region3D get_region() const {
+        return Region3D(0, width, 0, height, 0, depth, storage_offset, brick_size);
+    }
+
+    bool inside(int x, int y, int z) const {
+        return 0 <= x && x < width && 0 <= y && y < height && 0 <= z && z < depth;
+    }
+
+    PagedBricks &get_bricks() const {
+        return *bricks;
+    }
+
+    ConstAccessor2D operator[](int i) const {
+        return ConstAccessor2D{this, i};
+    }
+
+    const T &operator[](const Index3D &ind) const {
+        return get(ind.i, ind.j, ind.k);
+    }
+
+    const T &get(int i, int j, int k) const {
+        return get_brick(i, j, k)[get_offset(i, j, k)];
+    }
+
+    T sample(real x, real y, real z) const {
+        x = clamp(x - storage_offset.x, 0.f, width - 1.f - eps);
+        y = clamp(y - storage_offset.y, 0.f, height - 1.f - eps);
+        z = clamp(z - storage_offset.z, 0.f, depth - 1.f - eps);
+        const int x_i = clamp(int(x), 0, width - 2);
+        const int y_i = clamp(int(y), 0, height - 2);
+        const int z_i = clamp(int(z), 0, depth - 2);
+        const real x_r = x - x_i, y_r = y - y_i, z_r = z - z_i;
+        T v[2][2][2];
+        if ((x_i & brick_mask) != brick_mask && (y_i & brick_mask) != brick_mask &&
+            (z_i & brick_mask) != brick_mask) {
+            // All eight in one brick
+            const T *brick = get_brick(x_i, y_i, z_i);
+            const int offset = get_offset(x_i, y_i, z_i);
+            for (int a = 0; a < 2; a++) {
+                for (int b = 0; b < 2; b++) {
+                    for (int c = 0; c < 2; c++) {
+                        v[a][b][c] = brick[offset + (((a << brick_shift) + b) << brick_shift) + c];
+                    }
+                }
+            }
+        } else {
+            for (int a = 0; a < 2; a++) {
+                for (int b = 0; b < 2; b++) {
+                    for (int c = 0; c < 2; c++) {
+                        v[a][b][c] = get(x_i + a, y_i + b, z_i + c);
+                    }
+                }
+            }
+        }
+        return lerp(z_r, lerp(x_r, lerp(y_r, v[0][0][0], v[0][1][0]), lerp(y_r, v[1][0][0], v[1][1][0])),
+                    lerp(x_r, lerp(y_r, v[0][0][1], v[0][1][1]), lerp(y_r, v[1][0][1], v[1][1][1])));
+    }
+
+    T sample(const Vector3 &v) const {
+        return sample(v.x, v.y, v.z);
+    }
+
+    T sample_relative_coord(const Vector3 &v) const {
+        return sample(v.x * width, v.y * height, v.z * depth);
+    }
+};
+
+namespace array_file {
+
+// Source is an Array3D<T>, a MappedArray3D<T> or a PagedArray3D<T>
+template <typename T, typename Source>
+void write_paged(const std::string &fn, const Source &arr, int brick_size, int num_threads) {
+    assert_info(brick_size > 0 && (brick_size & (brick_size - 1)) == 0, "Brick size should be a power of two");
+    const Vector3i res(arr.get_width(), arr.get_height(), arr.get_depth());
+    const ArrayFileHeader header =
+            make_header(3, res, arr.get_storage_offset(), ArrayFileType<T>::name(), sizeof(T), brick_size);
+    const Vector3i bricks = get_brick_res(header);
+    write_bricks(fn, header, [&](int64 brick, char *data) {
+        T *values = reinterpret_cast<T *>(data);
+        const Vector3i lower = brick_size * Vector3i((int)(brick / ((int64)bricks.y * bricks.z)),
+                                                     (int)(brick / bricks.z % bricks.y), (int)(brick % bricks.z));
+        const Vector3i upper = glm::min(lower + Vector3i(brick_size), res);
+        for (int i = lower.x; i < upper.x; i++) {
+            for (int j = lower.y; j < upper.y; j++) {
+                for (int k = lower.z; k < upper.z; k++) {
+                    values[((i - lower.x) * brick_size + (j - lower.y)) * brick_size + (k - lower.z)] =
+                            arr.get(i, j, k);
+                }
+            }
+        }
+    }, num_threads);
+}
+
+}
+
+// Writes a bricked array file for PagedArray3D. Each thread reads brick_size x slabs of the source at a time,
+// so that a MappedArray3D larger than memory can be converted.
+template <typename T>
+void write_paged_array_file(const std::string &fn, const Array3D<T> &arr,
+                            int brick_size = PagedArray3D<T>::default_brick_size, int num_threads = 1) {
+    array_file::write_paged<T>(fn, arr, brick_size, num_threads);
+}
+
+template <typename T>
+void write_paged_array_file(const std::string &fn, const MappedArray3D<T> &arr,
+                            int brick_size = PagedArray3D<T>::default_brick_size, int num_threads = 1) {
+    array_file::write_paged<T>(fn, arr, brick_size, num_threads);
+}
+
+TC_NAMESPACE_END
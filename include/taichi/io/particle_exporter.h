@@ -0,0 +1,95 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/math/linalg.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Particle data copied out of a simulator, in simulation coordinates
+struct ParticleFrame {
+    enum Field {
+        POSITION = 1,
+        VELOCITY = 2,
+        STATE = 4,
+        COLOR = 8,
+    };
+
+    // Bitmask of Field; only the requested arrays are filled
+    int fields = POSITION;
+    real time = 0.0f;
+    std::vector<Vector3> position;
+    std::vector<Vector3> velocity;
+    std::vector<int> state;
+    std::vector<Vector3> color;
+
+    int size() const {
+        return (int)position.size();
+    }
+};
+
+// Writes ParticleFrames on a background thread, so that simulation only pays for the copy.
+// write() blocks only when max_queued_frames frames are already waiting for the disk.
+//
+// File layout (all little-endian):
+//   uint64 magic "TCPFRAME", int version, int fields, int compressed, int chunk_size,
+//   uint64 num_particles, real time,
+//   then for each present field (position, velocity, state, color), for each chunk of chunk_size
+//   particles: uint64 byte count, followed by the raw data or, if compressed, a zlib
+//   stream of the chunk with its bytes shuffled by significance.
+class ParticleExporter {
+public:
+    static const int version = 1;
+
+    ParticleExporter(int chunk_size = 1 << 20, int max_queued_frames = 2);
+
+    ParticleExporter(const ParticleExporter &) = delete;
+
+    ParticleExporter &operator=(const ParticleExporter &) = delete;
+
+    void write(const std::string &fn, ParticleFrame &&frame, bool compress = false);
+
+    // Blocks until every queued frame is on disk
+    void wait();
+
+    ~ParticleExporter();
+
+private:
+    struct Task {
+        std::string fn;
+        ParticleFrame frame;
+        bool compress;
+    };
+
+    void writer_loop();
+
+    void write_frame(const Task &task) const;
+
+    int chunk_size;
+    int max_queued_frames;
+    std::deque<Task> tasks;
+    // Frames queued or being written
+    int num_pending = 0;
+    bool stopping = false;
+    std::mutex mut;
+    std::condition_variable task_available, task_done;
+    std::thread writer;
+};
+
+// Reads a file written by ParticleExporter
+bool read_particle_frame(const std::string &fn, ParticleFrame &frame);
+
+TC_NAMESPACE_END
@@ -0,0 +1,137 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/io/binary_stream.h>
+#include <taichi/io/particle_exporter.h>
+#include <taichi/io/volume_exporter.h>
+#include <limits>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// The particle blocks and volume tiles of one frame of a SimulationCache
+struct SimulationCacheEntry {
+    // Block coordinates, or tile coordinates
+    Vector3i coord;
+    // Particles of a block
+    int count;
+    uint64 offset;
+    uint64 size;
+};
+
+TC_BINARY_POD(SimulationCacheEntry)
+
+// The frames of a shot in one file, for simulation caches that have to be written fast and read in parts.
+//
+// Particles are bucketed into cubic blocks of block_size (in simulation coordinates; 8 matches the blocks of
+// the MPM3D scheduler), and their positions quantized to 16 bits per axis within their block. Each block, and
+// each tile of a SparseVolume, is delta-encoded against the block or tile at the same place in the previous
+// frame (positions by difference, floats by XOR of their bits), except on keyframes, and compressed on its
+// own. Compression runs on num_threads threads. Particles of a block keep their order, so the deltas stay
+// small as long as the simulator keeps particles in order from frame to frame; otherwise they only compress
+// worse.
+//
+// File layout (all little-endian):
+//   uint64 magic "TCSCACHE", int version, real block_size, int keyframe_interval
+//   frames, each:
+//     real time, int fields, int keyframe, uint64 num_particles, the blocks (a vector of entries),
+//     int has_volume, and if so Vector3i res, Vector3 storage_offset, the channels and their backgrounds,
+//     and the tiles (a vector of entries),
+//     then the compressed blocks and tiles, at the offsets of their entries
+//   the index: uint64 num_frames, then for each frame real time, int keyframe, uint64 offset
+//   uint64 offset of the index, uint64 magic
+// A block is its positions as 16-bit x, y and z planes, then velocities, states and colors as requested by
+// fields. A tile is the tile_volume values of each channel.
+class SimulationCacheWriter {
+public:
+    static const int version = 1;
+
+    SimulationCacheWriter(const std::string &fn, real block_size = 8.0f, int keyframe_interval = 16,
+                          int num_threads = 1);
+
+    SimulationCacheWriter(const SimulationCacheWriter &) = delete;
+
+    SimulationCacheWriter &operator=(const SimulationCacheWriter &) = delete;
+
+    // Appends a frame; volume may be null
+    void write(const ParticleFrame &frame, const SparseVolume *volume = nullptr);
+
+    int get_num_frames() const {
+        return (int)index.size();
+    }
+
+    // Writes the index; without it the file can not be read
+    void close();
+
+    ~SimulationCacheWriter();
+
+    struct IndexEntry {
+        real time;
+        int keyframe;
+        uint64 offset;
+    };
+
+    // Decoded blocks, by block, and tiles, by tile index, of the previous frame
+    struct DeltaState {
+        int fields = 0;
+        std::unordered_map<int64, std::vector<char>> blocks;
+        bool has_volume = false;
+        Vector3i res;
+        std::vector<std::string> channels;
+        std::unordered_map<int64, std::vector<char>> tiles;
+    };
+
+private:
+    std::unique_ptr<BinaryFileStreamOutput> os;
+    real block_size;
+    int keyframe_interval;
+    int num_threads;
+    std::vector<IndexEntry> index;
+    DeltaState previous;
+};
+
+TC_BINARY_POD(SimulationCacheWriter::IndexEntry)
+
+class SimulationCacheReader {
+public:
+    explicit SimulationCacheReader(const std::string &fn, int num_threads = 1);
+
+    int get_num_frames() const {
+        return (int)index.size();
+    }
+
+    real get_frame_time(int frame) const {
+        return index[frame].time;
+    }
+
+    real get_block_size() const {
+        return block_size;
+    }
+
+    // Frame frame, decoding only the blocks and tiles that overlap [lower, upper] and the same blocks and tiles
+    // of the frames back to its keyframe. Particles come out block by block, and only those within [lower, upper].
+    // The volume keeps the overlapping tiles. Either may be null.
+    void read(int frame, ParticleFrame *particles, SparseVolume *volume = nullptr,
+              const Vector3 &lower = Vector3(-std::numeric_limits<real>::infinity()),
+              const Vector3 &upper = Vector3(std::numeric_limits<real>::infinity()));
+
+private:
+    std::string fn;
+    std::unique_ptr<BinaryFileStreamInput> is;
+    real block_size;
+    int num_threads;
+    std::vector<SimulationCacheWriter::IndexEntry> index;
+};
+
+TC_NAMESPACE_END
@@ -0,0 +1,118 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/math/array_3d.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Scalar fields on one grid, keeping only the tiles of tile_size^3 cells where some channel differs
+// from its background value; every other cell is at the background.
+struct SparseVolume {
+    static const int tile_size = 8;
+    static const int tile_volume = tile_size * tile_size * tile_size;
+
+    Vector3i res = Vector3i(0);
+    Vector3 storage_offset = Vector3(0.5f);
+    real time = 0.0f;
+    std::vector<std::string> channels;
+    std::vector<real> backgrounds;
+    // Linear index (tx * tiles.y + ty) * tiles.z + tz of every occupied tile, in increasing order
+    std::vector<int> tiles;
+    // Per channel, the tile_volume values of every occupied tile, (dx * tile_size + dy) * tile_size + dz
+    // within a tile. Cells of boundary tiles beyond res hold the background.
+    std::vector<std::vector<real>> values;
+
+    Vector3i get_tile_res() const {
+        return (res + Vector3i(tile_size - 1)) / tile_size;
+    }
+
+    int get_num_tiles() const {
+        return (int)tiles.size();
+    }
+
+    // -1 if there is no such channel
+    int get_channel(const std::string &name) const {
+        for (int c = 0; c < (int)channels.size(); c++) {
+            if (channels[c] == name) {
+                return c;
+            }
+        }
+        return -1;
+    }
+
+    // Keeps the tiles where some field differs from its background by more than threshold.
+    // The fields must share their resolution; the result does not depend on num_threads.
+    void from_arrays(const std::vector<std::string> &channels, const std::vector<const Array3D<real> *> &fields,
+                     const std::vector<real> &backgrounds, real threshold, int num_threads = 1);
+
+    // The dense field of a channel
+    void to_array(int channel, Array3D<real> &field, int num_threads = 1) const;
+};
+
+// Writes SparseVolumes on a background thread, like ParticleExporter; the simulation only pays for
+// picking out the occupied tiles.
+//
+// File layout (all little-endian):
+//   uint64 magic "TCSPVOLM", int version, int compressed, int tile_size, int chunk_tiles,
+//   Vector3i res, Vector3 storage_offset, real time, int num_channels,
+//   then for each channel its name (uint64 length, characters) and real background,
+//   uint64 num_tiles, the tile indices as chunks of chunk_tiles ints, and for each channel its values
+//   as chunks of chunk_tiles tiles. A chunk is a uint64 byte count, followed by the raw data or, if
+//   compressed, a zlib stream of the chunk with its bytes shuffled by significance.
+class VolumeExporter {
+public:
+    static const int version = 1;
+
+    VolumeExporter(int chunk_tiles = 4096, int max_queued_frames = 2);
+
+    VolumeExporter(const VolumeExporter &) = delete;
+
+    VolumeExporter &operator=(const VolumeExporter &) = delete;
+
+    void write(const std::string &fn, SparseVolume &&volume, bool compress = true);
+
+    // Blocks until every queued volume is on disk
+    void wait();
+
+    ~VolumeExporter();
+
+private:
+    struct Task {
+        std::string fn;
+        SparseVolume volume;
+        bool compress;
+    };
+
+    void writer_loop();
+
+    void write_volume(const Task &task) const;
+
+    int chunk_tiles;
+    int max_queued_frames;
+    std::deque<Task> tasks;
+    // Volumes queued or being written
+    int num_pending = 0;
+    bool stopping = false;
+    std::mutex mut;
+    std::condition_variable task_available, task_done;
+    std::thread writer;
+};
+
+// Reads a file written by VolumeExporter
+bool read_sparse_volume(const std::string &fn, SparseVolume &volume);
+
+TC_NAMESPACE_END
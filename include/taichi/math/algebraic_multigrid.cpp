@@ -0,0 +1,248 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+// Eigen's headers go before taichi's, whose error() macro they would hit
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <taichi/math/algebraic_multigrid.h>
+#include <taichi/system/threading.h>
+
+TC_NAMESPACE_BEGIN
+
+// Rows are aggregated in chunks of this size, independently, so that the aggregates
+// do not depend on the thread count
+const int aggregation_chunk_size = 4096;
+
+int AlgebraicMultigrid::aggregate(const SparseMatrix &A, std::vector<int> &aggregates) const {
+    const int n = A.get_num_rows();
+    const int *row_offsets = A.get_row_offsets(), *columns = A.get_column_indices();
+    const real *values = A.get_values();
+    std::vector<real> diagonal(n);
+    parallel_for(0, n, num_threads, [&](int i) {
+        diagonal[i] = std::abs(A.get(i, i));
+    }, 1024);
+    const int num_chunks = (n + aggregation_chunk_size - 1) / aggregation_chunk_size;
+    std::vector<int> num_aggregates(num_chunks + 1, 0);
+    aggregates.assign(n, -1);
+    parallel_for(0, num_chunks, num_threads, [&](int c) {
+        const int begin = c * aggregation_chunk_size, end = std::min(n, begin + aggregation_chunk_size);
+        auto for_each_strong = [&](int i, const std::function<void(int)> &f) {
+            for (int k = row_offsets[i]; k < row_offsets[i + 1]; k++) {
+                const int j = columns[k];
+                if (j != i && begin <= j && j < end &&
+                    std::abs(values[k]) >= strength_threshold * std::sqrt(diagonal[i] * diagonal[j])) {
+                    f(j);
+                }
+            }
+        };
+        int count = 0;
+        // Phase 1: rows whose strong neighbours are all free make aggregates with them
+        for (int i = begin; i < end; i++) {
+            if (aggregates[i] != -1) {
+                continue;
+            }
+            bool free = true, has_neighbours = false;
+            for_each_strong(i, [&](int j) {
+                has_neighbours = true;
+                free = free && aggregates[j] == -1;
+            });
+            if (free && has_neighbours) {
+                aggregates[i] = count;
+                for_each_strong(i, [&](int j) {
+                    aggregates[j] = count;
+                });
+                count++;
+            }
+        }
+        // Phase 2: the remaining rows join an aggregate of phase 1 they are strongly connected to
+        std::vector<int> phase_1(aggregates.begin() + begin, aggregates.begin() + end);
+        for (int i = begin; i < end; i++) {
+            if (aggregates[i] != -1) {
+                continue;
+            }
+            for_each_strong(i, [&](int j) {
+                if (aggregates[i] == -1 && phase_1[j - begin] != -1) {
+                    aggregates[i] = phase_1[j - begin];
+                }
+            });
+        }
+        // Phase 3: what's left makes aggregates with its free strong neighbours
+        for (int i = begin; i < end; i++) {
+            if (aggregates[i] != -1) {
+                continue;
+            }
+            aggregates[i] = count;
+            for_each_strong(i, [&](int j) {
+                if (aggregates[j] == -1) {
+                    aggregates[j] = count;
+                }
+            });
+            count++;
+        }
+        num_aggregates[c + 1] = count;
+    }, 1);
+    for (int c = 0; c < num_chunks; c++) {
+        num_aggregates[c + 1] += num_aggregates[c];
+    }
+    parallel_for(0, n, num_threads, [&](int i) {
+        aggregates[i] += num_aggregates[i / aggregation_chunk_size];
+    }, 1024);
+    return num_aggregates[num_chunks];
+}
+
+void AlgebraicMultigrid::setup(const SparseMatrix &A, int num_threads) {
+    assert_info(!A.is_symmetric(), "AMG needs non-symmetric storage");
+    assert_info(A.get_num_rows() == A.get_num_cols(), "AMG needs a square matrix");
+    this->num_threads = num_threads;
+    levels.clear();
+    coarsest_inverse.clear();
+    levels.push_back(Level());
+    levels.back().A = A;
+    while (true) {
+        const int l = (int)levels.size() - 1;
+        const SparseMatrix &fine = levels[l].A;
+        const int n = fine.get_num_rows();
+        const int *row_offsets = fine.get_row_offsets();
+        const real *values = fine.get_values();
+
+        // Damped Jacobi, with rho(D^-1 A) bounded by Gershgorin's theorem
+        Level &level = levels[l];
+        level.inv_diagonal.resize(n);
+        std::vector<real> row_bounds(n);
+        parallel_for(0, n, num_threads, [&](int i) {
+            const real diagonal = fine.get(i, i);
+            real sum = 0;
+            for (int k = row_offsets[i]; k < row_offsets[i + 1]; k++) {
+                sum += std::abs(values[k]);
+            }
+            level.inv_diagonal[i] = diagonal != 0 ? 1.0f / diagonal : 0.0f;
+            row_bounds[i] = diagonal != 0 ? sum / std::abs(diagonal) : 0.0f;
+        }, 1024);
+        const real rho = std::max(1e-6f, *std::max_element(row_bounds.begin(), row_bounds.end()));
+        level.smoother_weight = 4.0f / (3.0f * rho);
+        level.x.assign(n, 0.0f);
+        level.b.assign(n, 0.0f);
+        level.r.assign(n, 0.0f);
+        if (n <= coarsest_size || (int)levels.size() == max_levels) {
+            break;
+        }
+
+        std::vector<int> aggregates;
+        const int num_aggregates = aggregate(fine, aggregates);
+        if (num_aggregates == n) {
+            break;
+        }
+        // The tentative prolongation, smoothed by P = (I - omega D^-1 A) P_0
+        const int *columns = fine.get_column_indices();
+        const int num_chunks = std::max(1, std::min(num_threads, n / 1024));
+        std::vector<SparseMatrixBuilder> tentative(num_chunks, SparseMatrixBuilder(n, num_aggregates));
+        std::vector<SparseMatrixBuilder> smoother(num_chunks, SparseMatrixBuilder(n, n));
+        parallel_for(0, num_chunks, num_threads, [&](int c) {
+            for (int i = (int)((int64)n * c / num_chunks); i < (int)((int64)n * (c + 1) / num_chunks); i++) {
+                tentative[c].insert(i, aggregates[i], 1.0f);
+                const real scale = level.smoother_weight * level.inv_diagonal[i];
+                for (int k = row_offsets[i]; k < row_offsets[i + 1]; k++) {
+                    smoother[c].insert(i, columns[k], (columns[k] == i ? 1.0f : 0.0f) - scale * values[k]);
+                }
+            }
+        }, 1);
+        for (int c = 1; c < num_chunks; c++) {
+            tentative[0].append(tentative[c]);
+            smoother[0].append(smoother[c]);
+        }
+        level.P = smoother[0].build(false, num_threads).product(tentative[0].build(false, num_threads), num_threads);
+        level.R = level.P.transpose(num_threads);
+        SparseMatrix coarse = level.R.product(fine.product(level.P, num_threads), num_threads);
+        levels.push_back(Level());
+        levels.back().A = coarse;
+    }
+
+    // Pseudo-inverse of the coarsest matrix, discarding the null space (e.g. all-Neumann problems)
+    const SparseMatrix &coarsest = levels.back().A;
+    const int n = coarsest.get_num_rows();
+    if (n > coarsest_size) {
+        // Could not coarsen further: smoothing only
+        return;
+    }
+    Eigen::MatrixXd dense = Eigen::MatrixXd::Zero(n, n);
+    for (int i = 0; i < n; i++) {
+        for (int k = coarsest.get_row_offsets()[i]; k < coarsest.get_row_offsets()[i + 1]; k++) {
+            dense(i, coarsest.get_column_indices()[k]) = coarsest.get_values()[k];
+        }
+    }
+    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eigen(dense);
+    const Eigen::VectorXd &eigenvalues = eigen.eigenvalues();
+    const double threshold = 1e-7 * eigenvalues.cwiseAbs().maxCoeff();
+    Eigen::VectorXd inv_eigenvalues(n);
+    for (int i = 0; i < n; i++) {
+        inv_eigenvalues[i] = std::abs(eigenvalues[i]) > threshold ? 1.0 / eigenvalues[i] : 0.0;
+    }
+    Eigen::MatrixXd inverse = eigen.eigenvectors() * inv_eigenvalues.asDiagonal() * eigen.eigenvectors().transpose();
+    coarsest_inverse.resize((size_t)n * n);
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            coarsest_inverse[(size_t)i * n + j] = (real)inverse(i, j);
+        }
+    }
+}
+
+void AlgebraicMultigrid::cycle(int l) {
+    Level &level = levels[l];
+    const int n = level.A.get_num_rows();
+    auto smooth = [&](int steps) {
+        for (int s = 0; s < steps; s++) {
+            level.A.multiply(level.x.data(), level.r.data(), num_threads);
+            parallel_for(0, n, num_threads, [&](int i) {
+                level.x[i] += level.smoother_weight * level.inv_diagonal[i] * (level.b[i] - level.r[i]);
+            }, 1024);
+        }
+    };
+    if (l == (int)levels.size() - 1) {
+        if (coarsest_inverse.empty()) {
+            smooth(20);
+            return;
+        }
+        parallel_for(0, n, num_threads, [&](int i) {
+            const real *row = &coarsest_inverse[(size_t)i * n];
+            real sum = 0;
+            for (int j = 0; j < n; j++) {
+                sum += row[j] * level.b[j];
+            }
+            level.x[i] = sum;
+        }, 16);
+        return;
+    }
+    Level &coarse = levels[l + 1];
+    smooth(smoothing_steps);
+    level.A.multiply(level.x.data(), level.r.data(), num_threads);
+    parallel_for(0, n, num_threads, [&](int i) {
+        level.r[i] = level.b[i] - level.r[i];
+    }, 1024);
+    level.R.multiply(level.r.data(), coarse.b.data(), num_threads);
+    std::fill(coarse.x.begin(), coarse.x.end(), 0.0f);
+    cycle(l + 1);
+    level.P.multiply(coarse.x.data(), level.r.data(), num_threads);
+    parallel_for(0, n, num_threads, [&](int i) {
+        level.x[i] += level.r[i];
+    }, 1024);
+    smooth(smoothing_steps);
+}
+
+void AlgebraicMultigrid::run(const real *b, real *x) {
+    assert_info(is_setup(), "AMG is not set up");
+    Level &finest = levels[0];
+    std::copy(b, b + finest.b.size(), finest.b.begin());
+    std::copy(x, x + finest.x.size(), finest.x.begin());
+    cycle(0);
+    std::copy(finest.x.begin(), finest.x.end(), x);
+}
+
+TC_NAMESPACE_END
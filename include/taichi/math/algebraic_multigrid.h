@@ -0,0 +1,72 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <taichi/math/sparse.h>
+
+TC_NAMESPACE_BEGIN
+
+// Smoothed aggregation algebraic multigrid, for symmetric positive (semi-)definite matrices
+// like those of Poisson problems. Aggregates of strongly connected rows give the piecewise constant
+// prolongation, which is smoothed by a damped Jacobi step; the coarse matrices are R A P with R = P^T.
+// The V-cycle uses damped Jacobi pre- and post-smoothing, so it is symmetric and can precondition CG.
+// Setup and cycles are parallel, with results independent of the thread count.
+class AlgebraicMultigrid {
+protected:
+    struct Level {
+        SparseMatrix A, P, R;
+        std::vector<real> inv_diagonal;
+        // Damped Jacobi weight, 4 / (3 rho(D^-1 A))
+        real smoother_weight;
+        std::vector<real> x, b, r;
+    };
+
+    std::vector<Level> levels;
+    // Pseudo-inverse of the coarsest matrix, dense and row-major
+    std::vector<real> coarsest_inverse;
+    int num_threads = 1;
+
+    // Aggregate of every row, from 0 to the returned number of aggregates
+    int aggregate(const SparseMatrix &A, std::vector<int> &aggregates) const;
+
+    void cycle(int level);
+
+public:
+    // -a_ij >= strength_threshold * sqrt(a_ii a_jj) makes a strong connection
+    real strength_threshold = 0.02f;
+    // Matrices with at most this many rows are inverted densely
+    int coarsest_size = 256;
+    int max_levels = 20;
+    // Jacobi steps before and after the coarse correction
+    int smoothing_steps = 2;
+
+    AlgebraicMultigrid() {}
+
+    // Builds the hierarchy of A, which must have non-symmetric storage
+    void setup(const SparseMatrix &A, int num_threads = 1);
+
+    bool is_setup() const {
+        return !levels.empty();
+    }
+
+    int get_num_levels() const {
+        return (int)levels.size();
+    }
+
+    int get_num_rows() const {
+        return levels.empty() ? 0 : levels[0].A.get_num_rows();
+    }
+
+    // One V-cycle for A x = b, from the initial guess x
+    void run(const real *b, real *x);
+};
+
+TC_NAMESPACE_END
@@ -11,6 +11,7 @@
 
 #include <taichi/math/math_util.h>
 #include <taichi/math/linalg.h>
+#include <taichi/system/memory.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -19,7 +20,7 @@ struct Array1D {
 private:
 public:
     int size;
-    std::vector<T> data;
+    AlignedVector<T> data;
 
     Array1D(int size);
 
@@ -61,7 +62,7 @@ public:
         return size * sizeof(T);
     }
 
-    const std::vector<T> &get_data() const {
+    const AlignedVector<T> &get_data() const {
         return this->data;
     }
 
@@ -72,7 +73,7 @@ public:
 
 template <typename T>
 Array1D<T>::Array1D(int size) : size(size) {
-    data = std::vector<T>(size);
+    data = AlignedVector<T>(size);
     // memcpy(&data[0], this->data, this->get_data_size());
 }
 
@@ -11,6 +11,8 @@
 
 #include "math_util.h"
 #include "linalg.h"
+#include <taichi/system/memory.h>
+#include <taichi/system/threading.h>
 #include <cstring>
 #include <cstdio>
 #include <string>
@@ -144,17 +146,109 @@ public:
     Index2D end() {
         return index_end;
     }
+
+    Vector2i get_lower() const {
+        return Vector2i(x[0], y[0]);
+    }
+
+    Vector2i get_upper() const {
+        return Vector2i(x[1], y[1]);
+    }
+
+    Vector2 get_storage_offset() const {
+        return storage_offset;
+    }
 };
 
+// target(const Index2D &) for every index of region, in parallel over its rows of equal i, which grain_size is in
+// (0 to pick one). Within a row, indices are visited in the order of the region's own iteration.
+template <typename T>
+inline void parallel_for(const Region2D &region, int num_threads, const T &target, int grain_size = 0) {
+    const Vector2i lower = region.get_lower(), upper = region.get_upper();
+    const Vector2 storage_offset = region.get_storage_offset();
+    parallel_for(lower.x, upper.x, num_threads, [&](int i) {
+        Index2D ind(lower.x, upper.x, lower.y, upper.y, storage_offset);
+        ind.i = i;
+        for (ind.j = lower.y; ind.j < upper.y; ind.j++) {
+            target(ind);
+        }
+    }, grain_size);
+}
+
+// The combination of f(const Index2D &) over region; see parallel_reduce over ranges
+template <typename R, typename F, typename C>
+inline R parallel_reduce(const Region2D &region, int num_threads, const R &init, const F &f, const C &combine,
+                         bool deterministic = false) {
+    const Vector2i lower = region.get_lower(), upper = region.get_upper();
+    const Vector2 storage_offset = region.get_storage_offset();
+    return parallel_reduce(lower.x, upper.x, num_threads, init, [&](int i) {
+        Index2D ind(lower.x, upper.x, lower.y, upper.y, storage_offset);
+        ind.i = i;
+        R acc = init;
+        for (ind.j = lower.y; ind.j < upper.y; ind.j++) {
+            acc = combine(acc, f(ind));
+        }
+        return acc;
+    }, combine, deterministic);
+}
+
 template <typename T>
 struct Array2D {
 protected:
     Region2D region;
-    std::vector<T> data;
-    typedef typename std::vector<T>::iterator iterator;
+    // Cache line aligned, and only initialized by initialize() or fill()
+    UninitializedVector<T> data;
+    typedef typename UninitializedVector<T>::iterator iterator;
     int size;
     int width, height;
     Vector2 storage_offset = Vector2(0.5f, 0.5f); // defualt : center storage
+
+    // Runs f(begin, end) in parallel over the storage of every column, as parallel_for(0, width) splits the work
+    template <typename F>
+    void for_each_column(int num_threads, const F &f) const {
+        parallel_for(0, width, num_threads, [&](int i) {
+            f(i * height, (i + 1) * height);
+        });
+    }
+
+    static const int max_reduce_chunks = 256;
+
+    // The combination of f(n) over every cell, from init, which combine must leave unchanged. Partial results
+    // over at most max_reduce_chunks chunks of columns, kept on the stack as in parallel_reduce, each in four
+    // interleaved lanes so that the loop vectorizes, are combined in a fixed order, so that the result does not
+    // depend on num_threads and nothing is allocated.
+    template <typename R, typename F, typename C>
+    R reduce(int num_threads, const R &init, const F &f, const C &combine) const {
+        const int chunk_size = std::max(1, (width + max_reduce_chunks - 1) / max_reduce_chunks);
+        const int num_chunks = (width + chunk_size - 1) / chunk_size;
+        R partial[max_reduce_chunks];
+        parallel_for(0, num_chunks, num_threads, [&](int c) {
+            R lanes[4] = {init, init, init, init};
+            const int end = std::min(width, (c + 1) * chunk_size) * height;
+            int n = c * chunk_size * height;
+            for (; n + 4 <= end; n += 4) {
+                for (int l = 0; l < 4; l++) {
+                    lanes[l] = combine(lanes[l], f(n + l));
+                }
+            }
+            for (; n < end; n++) {
+                lanes[0] = combine(lanes[0], f(n));
+            }
+            partial[c] = combine(combine(lanes[0], lanes[1]), combine(lanes[2], lanes[3]));
+        }, 1);
+        R result = init;
+        for (int c = 0; c < num_chunks; c++) {
+            result = combine(result, partial[c]);
+        }
+        return result;
+    }
+
+    // The sum of f(n) over every cell, as reduce does it
+    template <typename R, typename F>
+    R reduce(int num_threads, const F &f) const {
+        return reduce<R>(num_threads, R(0), f, [](const R &a, const R &b) { return a + b; });
+    }
+
 public:
     template <typename P>
     friend Array2D<T> operator*(const P &b, const Array2D<T> &a);
@@ -167,21 +261,38 @@ public:
         return region;
     }
 
-    void initialize(Vector2i resolution, T init = T(0), Vector2 storage_offset = Vector2(0.5f, 0.5f)) {
-        initialize(resolution.x, resolution.y, init, storage_offset);
+    // With num_threads > 1, the columns are first touched by the threads parallel_for(0, width) gives them
+    void initialize(Vector2i resolution, T init = T(0), Vector2 storage_offset = Vector2(0.5f, 0.5f),
+                    int num_threads = 1) {
+        initialize(resolution.x, resolution.y, init, storage_offset, num_threads);
+    }
+
+    void initialize(int width, int height, T init = T(0), Vector2 storage_offset = Vector2(0.5f, 0.5f),
+                    int num_threads = 1) {
+        allocate(width, height, storage_offset);
+        fill(init, num_threads);
     }
 
-    void initialize(int width, int height, T init = T(0), Vector2 storage_offset = Vector2(0.5f, 0.5f)) {
+    // Like initialize(), but leaves the values of trivial types uninitialized
+    void allocate(int width, int height, Vector2 storage_offset = Vector2(0.5f, 0.5f)) {
         //assert_info(width >= 2, "dim must be at least 2");
         //assert_info(height >= 2, "dim must be at least 2");
         this->width = width;
         this->height = height;
         region = Region2D(0, width, 0, height, storage_offset);
         size = width * height;
-        data = std::vector<T>(size, init);
+        // Drop the old storage first, so that resize() does not copy it
+        UninitializedVector<T>().swap(data);
+        data.resize(size);
         this->storage_offset = storage_offset;
     }
 
+    void fill(T value, int num_threads = 1) {
+        for_each_column(num_threads, [&](int begin, int end) {
+            std::fill(data.begin() + begin, data.begin() + end, value);
+        });
+    }
+
     Array2D<T> same_shape(T init) const {
         return Array2D<T>(width, height, init, storage_offset);
     }
@@ -190,6 +301,10 @@ public:
         return Array2D<T>(width, height);
     }
 
+    Array2D<T> same_shape(UninitializedTag) const {
+        return Array2D<T>(width, height, uninitialized, storage_offset);
+    }
+
     Array2D(int width, int height, T init = T(0), Vector2 storage_offset = Vector2(0.5f, 0.5f)) {
         initialize(width, height, init, storage_offset);
     }
@@ -198,9 +313,17 @@ public:
         initialize(res.x, res.y, init, storage_offset);
     }
 
-    Array2D(const Array2D<T> &arr) : Array2D(arr.width, arr.height) {
-        this->data = arr.data;
-        this->storage_offset = arr.storage_offset;
+    Array2D(int width, int height, UninitializedTag, Vector2 storage_offset = Vector2(0.5f, 0.5f)) {
+        allocate(width, height, storage_offset);
+    }
+
+    Array2D(const Array2D<T> &arr) : Array2D() {
+        *this = arr;
+    }
+
+    // Moves and swaps take over the storage, so e.g. a backup buffer can be swapped in instead of copied
+    Array2D(Array2D<T> &&arr) : Array2D() {
+        swap(arr);
     }
 
     template <typename P>
@@ -260,6 +383,32 @@ public:
         return *this;
     }
 
+    Array2D<T> &operator=(Array2D<T> &&arr) {
+        swap(arr);
+        return *this;
+    }
+
+    void swap(Array2D<T> &arr) {
+        std::swap(region, arr.region);
+        data.swap(arr.data);
+        std::swap(size, arr.size);
+        std::swap(width, arr.width);
+        std::swap(height, arr.height);
+        std::swap(storage_offset, arr.storage_offset);
+    }
+
+    void operator+=(const T &a) {
+        for (int i = 0; i < size; i++) {
+            data[i] += a;
+        }
+    }
+
+    void operator-=(const T &a) {
+        for (int i = 0; i < size; i++) {
+            data[i] -= a;
+        }
+    }
+
     Array2D<T> &operator=(const T &a) {
         for (int i = 0; i < size; i++) {
             data[i] = a;
@@ -288,22 +437,18 @@ public:
         return width == arr.width && height == arr.height;
     }
 
-    T dot(const Array2D<T> &b) const {
-        T sum = 0;
+    T dot(const Array2D<T> &b, int num_threads = 1) const {
         assert(same_dim(b));
-        for (int i = 0; i < size; i++) {
-            sum += this->data[i] * b.data[i];
-        }
-        return sum;
+        return reduce<T>(num_threads, [&](int n) {
+            return this->data[n] * b.data[n];
+        });
     }
 
-    double dot_double(const Array2D<T> &b) const {
-        double sum = 0;
+    double dot_double(const Array2D<T> &b, int num_threads = 1) const {
         assert(same_dim(b));
-        for (int i = 0; i < size; i++) {
-            sum += this->data[i] * b.data[i];
-        }
-        return sum;
+        return reduce<double>(num_threads, [&](int n) {
+            return (double)(this->data[n] * b.data[n]);
+        });
     }
 
 
@@ -317,9 +462,58 @@ public:
     }
 
     void add_in_place(T alpha, const Array2D<T> &b) {
-        for (int i = 0; i < size; i++) {
-            data[i] += alpha * b.data[i];
-        }
+        axpy(alpha, b);
+    }
+
+    // The in-place updates of Krylov solvers, fused into one pass that allocates nothing
+
+    // this += alpha * x
+    void axpy(T alpha, const Array2D<T> &x, int num_threads = 1) {
+        assert(same_dim(x));
+        for_each_column(num_threads, [&](int begin, int end) {
+            T *y_data = &data[0];
+            const T *x_data = &x.data[0];
+            for (int n = begin; n < end; n++) {
+                y_data[n] += alpha * x_data[n];
+            }
+        });
+    }
+
+    // this = x + alpha * this
+    void xpay(const Array2D<T> &x, T alpha, int num_threads = 1) {
+        assert(same_dim(x));
+        for_each_column(num_threads, [&](int begin, int end) {
+            T *y_data = &data[0];
+            const T *x_data = &x.data[0];
+            for (int n = begin; n < end; n++) {
+                y_data[n] = x_data[n] + alpha * y_data[n];
+            }
+        });
+    }
+
+    // Copies arr, which has the same shape, converting every value to T (e.g. between float and double)
+    template <typename S>
+    void assign_converted(const Array2D<S> &arr, int num_threads = 1) {
+        assert(width == arr.get_width() && height == arr.get_height());
+        for_each_column(num_threads, [&](int begin, int end) {
+            T *o_data = &data[0];
+            const S *x_data = &arr.get_data()[0];
+            for (int n = begin; n < end; n++) {
+                o_data[n] = T(x_data[n]);
+            }
+        });
+    }
+
+    // this = alpha * x + beta * y
+    void assign_sum(T alpha, const Array2D<T> &x, T beta, const Array2D<T> &y, int num_threads = 1) {
+        assert(same_dim(x) && same_dim(y));
+        for_each_column(num_threads, [&](int begin, int end) {
+            T *o_data = &data[0];
+            const T *x_data = &x.data[0], *y_data = &y.data[0];
+            for (int n = begin; n < end; n++) {
+                o_data[n] = alpha * x_data[n] + beta * y_data[n];
+            }
+        });
     }
 
     T *operator[](int i) {
@@ -351,36 +545,28 @@ public:
         (*this)[ind] = t;
     }
 
-    T abs_sum() const {
-        T ret = 0;
-        for (int i = 0; i < size; i++) {
-            ret += std::abs(data[i]);
-        }
-        return ret;
+    T abs_sum(int num_threads = 1) const {
+        return reduce<T>(num_threads, [&](int n) {
+            return std::abs(data[n]);
+        });
     }
 
-    T abs_max() const {
-        T ret(0);
-        for (int i = 0; i < size; i++) {
-            ret = std::max(ret, abs(data[i]));
-        }
-        return ret;
+    T abs_max(int num_threads = 1) const {
+        return reduce<T>(num_threads, T(0), [&](int n) {
+            return abs(data[n]);
+        }, [](const T &a, const T &b) { return std::max(a, b); });
     }
 
-    T min() const {
-        T ret = std::numeric_limits<T>::max();
-        for (int i = 0; i < size; i++) {
-            ret = std::min(ret, data[i]);
-        }
-        return ret;
+    T min(int num_threads = 1) const {
+        return reduce<T>(num_threads, std::numeric_limits<T>::max(), [&](int n) {
+            return data[n];
+        }, [](const T &a, const T &b) { return std::min(a, b); });
     }
 
-    T max() const {
-        T ret = std::numeric_limits<T>::min();
-        for (int i = 0; i < size; i++) {
-            ret = std::max(ret, data[i]);
-        }
-        return ret;
+    T max(int num_threads = 1) const {
+        return reduce<T>(num_threads, std::numeric_limits<T>::lowest(), [&](int n) {
+            return data[n];
+        }, [](const T &a, const T &b) { return std::max(a, b); });
     }
 
     void print_abs_max_pos() const {
@@ -557,7 +743,12 @@ public:
         return out;
     }
 
-    const std::vector<T> &get_data() const {
+    const UninitializedVector<T> &get_data() const {
+        return this->data;
+    }
+
+    // For views of the storage, e.g. from Python; they dangle once the array is reallocated
+    UninitializedVector<T> &get_data() {
         return this->data;
     }
 
@@ -11,24 +11,73 @@
 
 #include "math_util.h"
 #include "linalg.h"
+#include <taichi/system/memory.h>
+#include <taichi/system/threading.h>
 #include <cstring>
 #include <cstdio>
 #include <string>
 #include <vector>
 #include <iterator>
+#include <type_traits>
 
 TC_NAMESPACE_BEGIN
 
 class Index3D {
 private:
     int x[2], y[2], z[2];
+    // With brick_size > 1, cells are visited brick by brick, bricks being aligned to multiples of brick_size.
+    // (bi, bj, bk) is the origin of the current brick.
+    int brick_size = 1;
+    int bi, bj, bk;
+
+    int brick_origin(int a) const {
+        return (a >= 0 ? a / brick_size : -((brick_size - 1 - a) / brick_size)) * brick_size;
+    }
+
+    void next_in_bricks() {
+        k++;
+        if (k < std::min(bk + brick_size, z[1])) {
+            return;
+        }
+        k = std::max(bk, z[0]);
+        j++;
+        if (j < std::min(bj + brick_size, y[1])) {
+            return;
+        }
+        j = std::max(bj, y[0]);
+        i++;
+        if (i < std::min(bi + brick_size, x[1])) {
+            return;
+        }
+        bk += brick_size;
+        if (bk >= z[1]) {
+            bk = brick_origin(z[0]);
+            bj += brick_size;
+            if (bj >= y[1]) {
+                bj = brick_origin(y[0]);
+                bi += brick_size;
+                if (bi >= x[1]) {
+                    // The end, as in to_end()
+                    i = x[1];
+                    j = y[0];
+                    k = z[0];
+                    return;
+                }
+            }
+        }
+        i = std::max(bi, x[0]);
+        j = std::max(bj, y[0]);
+        k = std::max(bk, z[0]);
+    }
+
 public:
     int i, j, k;
     Vector3 storage_offset;
 
     Index3D() {}
 
-    Index3D(int x0, int x1, int y0, int y1, int z0, int z1, Vector3 storage_offset = Vector3(0.5f, 0.5f, 0.5f)) {
+    Index3D(int x0, int x1, int y0, int y1, int z0, int z1, Vector3 storage_offset = Vector3(0.5f, 0.5f, 0.5f),
+            int brick_size = 1) {
         x[0] = x0;
         x[1] = x1;
         y[0] = y0;
@@ -39,6 +88,10 @@ public:
         j = y[0];
         k = z[0];
         this->storage_offset = storage_offset;
+        this->brick_size = brick_size;
+        bi = brick_origin(x0);
+        bj = brick_origin(y0);
+        bk = brick_origin(z0);
     }
 
     Index3D(int i, int j, int k) {
@@ -49,6 +102,10 @@ public:
 
 
     void next() {
+        if (brick_size > 1) {
+            next_in_bricks();
+            return;
+        }
         k++;
         if (k == z[1]) {
             k = z[0];
@@ -131,15 +188,17 @@ private:
 public:
     Region3D() {}
 
-    Region3D(int x0, int x1, int y0, int y1, int z0, int z1, Vector3 storage_offset = Vector3(0.5f, 0.5f, 0.5f)) {
+    // With brick_size > 1, iteration goes brick by brick (see Index3D)
+    Region3D(int x0, int x1, int y0, int y1, int z0, int z1, Vector3 storage_offset = Vector3(0.5f, 0.5f, 0.5f),
+             int brick_size = 1) {
         x[0] = x0;
         x[1] = x1;
         y[0] = y0;
         y[1] = y1;
         z[0] = z0;
         z[1] = z1;
-        index_begin = Index3D(x0, x1, y0, y1, z0, z1, storage_offset);
-        index_end = Index3D(x0, x1, y0, y1, z0, z1, storage_offset).to_end();
+        index_begin = Index3D(x0, x1, y0, y1, z0, z1, storage_offset, brick_size);
+        index_end = Index3D(x0, x1, y0, y1, z0, z1, storage_offset, brick_size).to_end();
         this->storage_offset = storage_offset;
     }
 
@@ -158,75 +217,303 @@ public:
     Index3D end() {
         return index_end;
     }
+
+    Vector3i get_lower() const {
+        return Vector3i(x[0], y[0], z[0]);
+    }
+
+    Vector3i get_upper() const {
+        return Vector3i(x[1], y[1], z[1]);
+    }
+
+    Vector3 get_storage_offset() const {
+        return storage_offset;
+    }
 };
 
+// target(const Index3D &) for every index of region, in parallel over its rows of equal (i, j), which grain_size
+// is in (0 to pick one). Rows are visited along k, also for regions of bricked arrays.
 template <typename T>
+inline void parallel_for(const Region3D &region, int num_threads, const T &target, int grain_size = 0) {
+    const Vector3i lower = region.get_lower(), upper = region.get_upper();
+    const Vector3 storage_offset = region.get_storage_offset();
+    const int num_columns = std::max(0, upper.y - lower.y);
+    parallel_for(0, std::max(0, upper.x - lower.x) * num_columns, num_threads, [&](int row) {
+        Index3D ind(lower.x, upper.x, lower.y, upper.y, lower.z, upper.z, storage_offset);
+        ind.i = lower.x + row / num_columns;
+        ind.j = lower.y + row % num_columns;
+        for (ind.k = lower.z; ind.k < upper.z; ind.k++) {
+            target(ind);
+        }
+    }, grain_size);
+}
+
+// The combination of f(const Index3D &) over region; see parallel_reduce over ranges
+template <typename R, typename F, typename C>
+inline R parallel_reduce(const Region3D &region, int num_threads, const R &init, const F &f, const C &combine,
+                         bool deterministic = false) {
+    const Vector3i lower = region.get_lower(), upper = region.get_upper();
+    const Vector3 storage_offset = region.get_storage_offset();
+    const int num_columns = std::max(0, upper.y - lower.y);
+    return parallel_reduce(0, std::max(0, upper.x - lower.x) * num_columns, num_threads, init, [&](int row) {
+        Index3D ind(lower.x, upper.x, lower.y, upper.y, lower.z, upper.z, storage_offset);
+        ind.i = lower.x + row / num_columns;
+        ind.j = lower.y + row % num_columns;
+        R acc = init;
+        for (ind.k = lower.z; ind.k < upper.z; ind.k++) {
+            acc = combine(acc, f(ind));
+        }
+        return acc;
+    }, combine, deterministic);
+}
+
+// Storage orders of Array3D
+
+// Row-major: (i, j, k) is at (i * height + j) * depth + k, and operator[] gives raw rows
+struct LinearLayout3D {
+    static const int brick_size = 1;
+};
+
+// Bricks of brick_size^3 cells, themselves row-major, with the cells of every brick row-major too.
+// The resolution is padded to whole bricks. Most 7-point stencil, trilinear and particle transfer
+// neighbours then share a brick, and pages. Regions of such arrays iterate brick by brick.
+template <int brick_size_>
+struct BrickLayout3D {
+    static_assert(brick_size_ >= 2 && (brick_size_ & (brick_size_ - 1)) == 0, "brick_size must be a power of 2");
+    static const int brick_size = brick_size_;
+};
+
+constexpr int array_3d_log2(int n) {
+    return n <= 1 ? 0 : 1 + array_3d_log2(n / 2);
+}
+
+// With a BrickLayout3D, operator[](i)[j][k] goes through accessor objects instead of raw rows, and get_data()
+// is in brick order; code taking raw pointers into the storage needs the default LinearLayout3D.
+template <typename T, typename Layout = LinearLayout3D>
 struct Array3D {
 protected:
+    static const int brick_size = Layout::brick_size;
+    static const int brick_shift = array_3d_log2(brick_size);
+    static const bool linear = brick_size == 1;
+
     Region3D region;
-    std::vector<T> data;
-    typedef typename std::vector<T>::iterator iterator;
+    // Cache line aligned, and only initialized by initialize() or fill()
+    UninitializedVector<T> data;
+    typedef typename UninitializedVector<T>::iterator iterator;
     int size;
     int width, height, depth;
     int stride;
+    // With bricks, the storage index of (i, j, k) is x_offsets[i] + y_offsets[j] + z_offsets[k]
+    std::vector<int> x_offsets, y_offsets, z_offsets;
     Vector3 storage_offset = Vector3(0.5f, 0.5f, 0.5f); // defualt : center storage
-    struct Accessor2D {
+
+    struct LinearAccessor2D {
         T *data;
         int offset;
 
-        Accessor2D(T *data, int offset) : data(data), offset(offset) {}
+        LinearAccessor2D(Array3D *arr, int i) : data(&arr->data[0] + i * arr->stride), offset(arr->depth) {}
 
-        T *operator[](int i) const {
-            return data + offset * i;
+        T *operator[](int j) const {
+            return data + offset * j;
         }
     };
 
-    struct ConstAccessor2D {
+    struct ConstLinearAccessor2D {
         const T *data;
         int offset;
 
-        ConstAccessor2D(const T *data, int offset) : data(data), offset(offset) {}
+        ConstLinearAccessor2D(const Array3D *arr, int i) : data(&arr->data[0] + i * arr->stride), offset(arr->depth) {}
 
-        const T *operator[](int i) const {
-            return data + offset * i;
+        const T *operator[](int j) const {
+            return data + offset * j;
         }
     };
 
+    template <typename A, typename R>
+    struct BrickAccessor1D {
+        A *arr;
+        int i, j;
+
+        R &operator[](int k) const {
+            return arr->data[arr->get_storage_index(i, j, k)];
+        }
+    };
+
+    template <typename A, typename R>
+    struct BrickAccessor2D {
+        A *arr;
+        int i;
+
+        BrickAccessor2D(A *arr, int i) : arr(arr), i(i) {}
+
+        BrickAccessor1D<A, R> operator[](int j) const {
+            return BrickAccessor1D<A, R>{arr, i, j};
+        }
+    };
+
+    typedef typename std::conditional<linear, LinearAccessor2D, BrickAccessor2D<Array3D, T>>::type Accessor2D;
+    typedef typename std::conditional<linear, ConstLinearAccessor2D,
+                                      BrickAccessor2D<const Array3D, const T>>::type ConstAccessor2D;
+
+    // Runs f(n) for the storage index n of every cell, skipping the padding of bricks
+    template <typename F>
+    void for_each_storage_index(const F &f) const {
+        if (linear) {
+            for (int n = 0; n < size; n++) {
+                f(n);
+            }
+            return;
+        }
+        for (int i = 0; i < width; i++) {
+            for (int j = 0; j < height; j++) {
+                for (int k = 0; k < depth; k++) {
+                    f(get_storage_index(i, j, k));
+                }
+            }
+        }
+    }
+
+    // Runs f(begin, end) in parallel over the storage of every x slab (of bricks, with a BrickLayout3D),
+    // which is how parallel_for(0, width) splits the work
+    template <typename F>
+    void for_each_slab(int num_threads, const F &f) const {
+        const int num_slabs = linear ? width : (width + brick_size - 1) / brick_size;
+        const int64 slab_size = num_slabs == 0 ? 0 : (int64)data.size() / num_slabs;
+        parallel_for(0, num_slabs, num_threads, [&](int i) {
+            f(i * slab_size, (i + 1) * slab_size);
+        });
+    }
+
+    static const int max_reduce_chunks = 256;
+
+    // The combination of f(n) over every cell, from init, which combine must leave unchanged. Partial results
+    // over at most max_reduce_chunks chunks of x slices, kept on the stack as in parallel_reduce, each in four
+    // interleaved lanes so that the loop vectorizes, are combined in a fixed order, so that the result does not
+    // depend on num_threads and nothing is allocated.
+    template <typename R, typename F, typename C>
+    R reduce(int num_threads, const R &init, const F &f, const C &combine) const {
+        const int chunk_size = std::max(1, (width + max_reduce_chunks - 1) / max_reduce_chunks);
+        const int num_chunks = (width + chunk_size - 1) / chunk_size;
+        R partial[max_reduce_chunks];
+        parallel_for(0, num_chunks, num_threads, [&](int c) {
+            R lanes[4] = {init, init, init, init};
+            const int first = c * chunk_size, last = std::min(width, (c + 1) * chunk_size);
+            if (linear) {
+                const int end = last * stride;
+                int n = first * stride;
+                for (; n + 4 <= end; n += 4) {
+                    for (int l = 0; l < 4; l++) {
+                        lanes[l] = combine(lanes[l], f(n + l));
+                    }
+                }
+                for (; n < end; n++) {
+                    lanes[0] = combine(lanes[0], f(n));
+                }
+            } else {
+                for (int i = first; i < last; i++) {
+                    for (int j = 0; j < height; j++) {
+                        for (int k = 0; k < depth; k++) {
+                            lanes[0] = combine(lanes[0], f(get_storage_index(i, j, k)));
+                        }
+                    }
+                }
+            }
+            partial[c] = combine(combine(lanes[0], lanes[1]), combine(lanes[2], lanes[3]));
+        }, 1);
+        R result = init;
+        for (int c = 0; c < num_chunks; c++) {
+            result = combine(result, partial[c]);
+        }
+        return result;
+    }
+
+    // The sum of f(n) over every cell, as reduce does it
+    template <typename R, typename F>
+    R reduce(int num_threads, const F &f) const {
+        return reduce<R>(num_threads, R(0), f, [](const R &a, const R &b) { return a + b; });
+    }
+
 public:
 
     int get_size() const {
         return size;
     }
 
+    // Where (i, j, k) is in get_data()
+    int get_storage_index(int i, int j, int k) const {
+        if (linear) {
+            return i * stride + j * depth + k;
+        }
+        return x_offsets[i] + y_offsets[j] + z_offsets[k];
+    }
+
     const Region3D &get_region() const {
         return region;
     }
 
-    void initialize(const Vector3i &resolution, T init = T(0), Vector3 storage_offset = Vector3(0.5f, 0.5f, 0.5f)) {
-        initialize(resolution.x, resolution.y, resolution.z, init, storage_offset);
+    // With num_threads > 1, the x slabs are first touched by the threads parallel_for(0, width) gives them
+    void initialize(const Vector3i &resolution, T init = T(0), Vector3 storage_offset = Vector3(0.5f, 0.5f, 0.5f),
+                    int num_threads = 1) {
+        initialize(resolution.x, resolution.y, resolution.z, init, storage_offset, num_threads);
+    }
+
+    void initialize(int width, int height, int depth, T init = T(0),
+                    Vector3 storage_offset = Vector3(0.5f, 0.5f, 0.5f), int num_threads = 1) {
+        allocate(width, height, depth, storage_offset);
+        fill(init, num_threads);
     }
 
-    void
-    initialize(int width, int height, int depth, T init = T(0), Vector3 storage_offset = Vector3(0.5f, 0.5f, 0.5f)) {
+    // Like initialize(), but leaves the values of trivial types uninitialized
+    void allocate(int width, int height, int depth, Vector3 storage_offset = Vector3(0.5f, 0.5f, 0.5f)) {
         //assert_info(width >= 2, "dim must be at least 2");
         //assert_info(height >= 2, "dim must be at least 2");
         //assert_info(depth >= 2, "dim must be at least 2");
         this->width = width;
         this->height = height;
         this->depth = depth;
-        region = Region3D(0, width, 0, height, 0, depth, storage_offset);
+        region = Region3D(0, width, 0, height, 0, depth, storage_offset, brick_size);
         size = width * height * depth;
         stride = height * depth;
-        data = std::vector<T>(size, init);
+        const int bricks_x = (width + brick_size - 1) / brick_size;
+        const int bricks_y = (height + brick_size - 1) / brick_size;
+        const int bricks_z = (depth + brick_size - 1) / brick_size;
+        const int brick_cells = brick_size * brick_size * brick_size, mask = brick_size - 1;
+        // Drop the old storage first, so that resize() does not copy it
+        UninitializedVector<T>().swap(data);
+        data.resize(linear ? size : bricks_x * bricks_y * bricks_z * brick_cells);
+        if (!linear) {
+            x_offsets.resize(width);
+            y_offsets.resize(height);
+            z_offsets.resize(depth);
+            for (int i = 0; i < width; i++) {
+                x_offsets[i] = (i >> brick_shift) * bricks_y * bricks_z * brick_cells + ((i & mask) << (2 * brick_shift));
+            }
+            for (int j = 0; j < height; j++) {
+                y_offsets[j] = (j >> brick_shift) * bricks_z * brick_cells + ((j & mask) << brick_shift);
+            }
+            for (int k = 0; k < depth; k++) {
+                z_offsets[k] = (k >> brick_shift) * brick_cells + (k & mask);
+            }
+        }
         this->storage_offset = storage_offset;
     }
 
-    Array3D<T> same_shape(T init) const {
-        return Array3D<T>(width, height, depth, init, storage_offset);
+    void fill(T value, int num_threads = 1) {
+        for_each_slab(num_threads, [&](int64 begin, int64 end) {
+            std::fill(data.begin() + begin, data.begin() + end, value);
+        });
+    }
+
+    Array3D same_shape(T init) const {
+        return Array3D(width, height, depth, init, storage_offset);
     }
 
-    Array3D<T> same_shape() const {
-        return Array3D<T>(width, height, depth, T(0), storage_offset);
+    Array3D same_shape() const {
+        return Array3D(width, height, depth, T(0), storage_offset);
+    }
+
+    Array3D same_shape(UninitializedTag) const {
+        return Array3D(width, height, depth, uninitialized, storage_offset);
     }
 
     Array3D(const Vector3i &resolution, T init = T(0), Vector3 storage_offset = Vector3(0.5f, 0.5f, 0.5f)) {
@@ -237,57 +524,104 @@ public:
         initialize(width, height, depth, init, storage_offset);
     }
 
-    Array3D(const Array3D<T> &arr) : Array3D(arr.width, arr.height, arr.depth) {
-        this->data = arr.data;
-        this->storage_offset = arr.storage_offset;
+    Array3D(const Vector3i &resolution, UninitializedTag, Vector3 storage_offset = Vector3(0.5f, 0.5f, 0.5f)) {
+        allocate(resolution.x, resolution.y, resolution.z, storage_offset);
+    }
+
+    Array3D(int width, int height, int depth, UninitializedTag,
+            Vector3 storage_offset = Vector3(0.5f, 0.5f, 0.5f)) {
+        allocate(width, height, depth, storage_offset);
+    }
+
+    Array3D(const Array3D &arr) : Array3D() {
+        *this = arr;
     }
 
-    Array3D<T> operator+(const Array3D<T> &b) const {
-        Array3D<T> o(width, height, depth);
+    // Moves and swaps take over the storage, so e.g. a backup buffer can be swapped in instead of copied
+    Array3D(Array3D &&arr) : Array3D() {
+        swap(arr);
+    }
+
+    Array3D operator+(const Array3D &b) const {
+        Array3D o(width, height, depth);
         assert(same_dim(b));
-        for (int i = 0; i < size; i++) {
+        for (int i = 0; i < (int)data.size(); i++) {
             o.data[i] = data[i] + b.data[i];
         }
         return o;
     }
 
-    Array3D<T> operator-(const Array3D<T> &b) const {
-        Array3D<T> o(width, height, depth);
+    Array3D operator-(const Array3D &b) const {
+        Array3D o(width, height, depth);
         assert(same_dim(b));
-        for (int i = 0; i < size; i++) {
+        for (int i = 0; i < (int)data.size(); i++) {
             o.data[i] = data[i] - b.data[i];
         }
         return o;
     }
 
-    void operator+=(const Array3D<T> &b) {
+    void operator+=(const Array3D &b) {
         assert(same_dim(b));
-        for (int i = 0; i < size; i++) {
+        for (int i = 0; i < (int)data.size(); i++) {
             data[i] = data[i] + b.data[i];
         }
     }
 
-    void operator-=(const Array3D<T> &b) {
+    void operator-=(const Array3D &b) {
         assert(same_dim(b));
-        for (int i = 0; i < size; i++) {
+        for (int i = 0; i < (int)data.size(); i++) {
             data[i] = data[i] - b.data[i];
         }
     }
 
-    Array3D<T> &operator=(const Array3D<T> &arr) {
+    Array3D &operator=(const Array3D &arr) {
         this->width = arr.width;
         this->height = arr.height;
         this->depth = arr.depth;
         this->size = arr.size;
         this->stride = arr.stride;
+        this->x_offsets = arr.x_offsets;
+        this->y_offsets = arr.y_offsets;
+        this->z_offsets = arr.z_offsets;
         this->data = arr.data;
         this->region = arr.region;
         this->storage_offset = arr.storage_offset;
         return *this;
     }
 
-    Array3D<T> &operator=(const T &a) {
-        for (int i = 0; i < size; i++) {
+    Array3D &operator=(Array3D &&arr) {
+        swap(arr);
+        return *this;
+    }
+
+    void swap(Array3D &arr) {
+        std::swap(region, arr.region);
+        data.swap(arr.data);
+        std::swap(size, arr.size);
+        std::swap(width, arr.width);
+        std::swap(height, arr.height);
+        std::swap(depth, arr.depth);
+        std::swap(stride, arr.stride);
+        x_offsets.swap(arr.x_offsets);
+        y_offsets.swap(arr.y_offsets);
+        z_offsets.swap(arr.z_offsets);
+        std::swap(storage_offset, arr.storage_offset);
+    }
+
+    void operator+=(const T &a) {
+        for (int i = 0; i < (int)data.size(); i++) {
+            data[i] += a;
+        }
+    }
+
+    void operator-=(const T &a) {
+        for (int i = 0; i < (int)data.size(); i++) {
+            data[i] -= a;
+        }
+    }
+
+    Array3D &operator=(const T &a) {
+        for (int i = 0; i < (int)data.size(); i++) {
             data[i] = a;
         }
         return *this;
@@ -307,54 +641,99 @@ public:
     }
 
     void reset(T a) {
-        for (int i = 0; i < size; i++) {
+        for (int i = 0; i < (int)data.size(); i++) {
             data[i] = a;
         }
     }
 
-    bool same_dim(const Array3D<T> &arr) const {
+    bool same_dim(const Array3D &arr) const {
         return width == arr.width && height == arr.height && depth == arr.depth;
     }
 
-    T dot(const Array3D<T> &b) const {
-        T sum = 0;
+    T dot(const Array3D &b, int num_threads = 1) const {
         assert(same_dim(b));
-        for (int i = 0; i < size; i++) {
-            sum += this->data[i] * b.data[i];
-        }
-        return sum;
+        return reduce<T>(num_threads, [&](int n) {
+            return this->data[n] * b.data[n];
+        });
     }
 
-    double dot_double(const Array3D<T> &b) const {
-        double sum = 0;
+    double dot_double(const Array3D &b, int num_threads = 1) const {
         assert(same_dim(b));
-        for (int i = 0; i < size; i++) {
-            sum += this->data[i] * b.data[i];
-        }
-        return sum;
+        return reduce<double>(num_threads, [&](int n) {
+            return (double)(this->data[n] * b.data[n]);
+        });
     }
 
-    Array3D<T> add(T alpha, const Array3D<T> &b) const {
+    Array3D add(T alpha, const Array3D &b) const {
         Array3D o(width, height, depth);
         assert(same_dim(b));
-        for (int i = 0; i < size; i++) {
+        for (int i = 0; i < (int)data.size(); i++) {
             o.data[i] = data[i] + alpha * b.data[i];
         }
         return o;
     }
 
-    void add_in_place(T alpha, const Array3D<T> &b) {
-        for (int i = 0; i < size; i++) {
-            data[i] += alpha * b.data[i];
-        }
+    void add_in_place(T alpha, const Array3D &b) {
+        axpy(alpha, b);
+    }
+
+    // The in-place updates of Krylov solvers, fused into one pass that allocates nothing
+
+    // this += alpha * x
+    void axpy(T alpha, const Array3D &x, int num_threads = 1) {
+        assert(same_dim(x));
+        for_each_slab(num_threads, [&](int64 begin, int64 end) {
+            T *y_data = &data[0];
+            const T *x_data = &x.data[0];
+            for (int64 n = begin; n < end; n++) {
+                y_data[n] += alpha * x_data[n];
+            }
+        });
+    }
+
+    // this = x + alpha * this
+    void xpay(const Array3D &x, T alpha, int num_threads = 1) {
+        assert(same_dim(x));
+        for_each_slab(num_threads, [&](int64 begin, int64 end) {
+            T *y_data = &data[0];
+            const T *x_data = &x.data[0];
+            for (int64 n = begin; n < end; n++) {
+                y_data[n] = x_data[n] + alpha * y_data[n];
+            }
+        });
+    }
+
+    // Copies arr, which has the same shape, converting every value to T (e.g. between float and double)
+    template <typename S>
+    void assign_converted(const Array3D<S, Layout> &arr, int num_threads = 1) {
+        assert(width == arr.get_width() && height == arr.get_height() && depth == arr.get_depth());
+        for_each_slab(num_threads, [&](int64 begin, int64 end) {
+            T *o_data = &data[0];
+            const S *x_data = &arr.get_data()[0];
+            for (int64 n = begin; n < end; n++) {
+                o_data[n] = T(x_data[n]);
+            }
+        });
+    }
+
+    // this = alpha * x + beta * y
+    void assign_sum(T alpha, const Array3D &x, T beta, const Array3D &y, int num_threads = 1) {
+        assert(same_dim(x) && same_dim(y));
+        for_each_slab(num_threads, [&](int64 begin, int64 end) {
+            T *o_data = &data[0];
+            const T *x_data = &x.data[0], *y_data = &y.data[0];
+            for (int64 n = begin; n < end; n++) {
+                o_data[n] = alpha * x_data[n] + beta * y_data[n];
+            }
+        });
     }
 
     const Accessor2D operator[](int i) {
-        return Accessor2D(&data[0] + i * stride, depth);
+        return Accessor2D(this, i);
     }
 
     const ConstAccessor2D operator[](int i) const {
-        return ConstAccessor2D(&data[0] + i * stride, depth);
+        return ConstAccessor2D(this, i);
     }
 
     const T &get(int i, int j, int k) const {
@@ -387,44 +766,34 @@ public:
         (*this)[ind] = t;
     }
 
-    T abs_sum() const {
-        T ret = 0;
-        for (int i = 0; i < size; i++) {
-            ret += abs(data[i]);
-        }
-        return ret;
+    T abs_sum(int num_threads = 1) const {
+        return reduce<T>(num_threads, [&](int n) {
+            return abs(data[n]);
+        });
     }
 
-    T sum() const {
-        T ret = 0;
-        for (int i = 0; i < size; i++) {
-            ret += data[i];
-        }
-        return ret;
+    T sum(int num_threads = 1) const {
+        return reduce<T>(num_threads, [&](int n) {
+            return data[n];
+        });
     }
 
-    T abs_max() const {
-        T ret(0);
-        for (int i = 0; i < size; i++) {
-            ret = std::max(ret, abs(data[i]));
-        }
-        return ret;
+    T abs_max(int num_threads = 1) const {
+        return reduce<T>(num_threads, T(0), [&](int n) {
+            return abs(data[n]);
+        }, [](const T &a, const T &b) { return std::max(a, b); });
     }
 
-    T min() const {
-        T ret = std::numeric_limits<T>::max();
-        for (int i = 0; i < size; i++) {
-            ret = std::min(ret, data[i]);
-        }
-        return ret;
+    T min(int num_threads = 1) const {
+        return reduce<T>(num_threads, std::numeric_limits<T>::max(), [&](int n) {
+            return data[n];
+        }, [](const T &a, const T &b) { return std::min(a, b); });
     }
 
-    T max() const {
-        T ret = std::numeric_limits<T>::min();
-        for (int i = 0; i < size; i++) {
-            ret = std::max(ret, data[i]);
-        }
-        return ret;
+    T max(int num_threads = 1) const {
+        return reduce<T>(num_threads, std::numeric_limits<T>::lowest(), [&](int n) {
+            return data[n];
+        }, [](const T &a, const T &b) { return std::max(a, b); });
     }
 
     void print_abs_max_pos() const {
@@ -457,7 +826,7 @@ public:
     }
 
     void set_pattern(int s) {
-        for (int i = 0; i < size; i++) {
+        for (int i = 0; i < (int)data.size(); i++) {
             data[i] = sinf(s * i + 231.0f);
         }
     }
@@ -595,7 +964,12 @@ public:
         return true;
     }
 
-    const std::vector<T> &get_data() const {
+    const UninitializedVector<T> &get_data() const {
+        return this->data;
+    }
+
+    // For views of the storage, e.g. from Python; they dangle once the array is reallocated
+    UninitializedVector<T> &get_data() {
         return this->data;
     }
 
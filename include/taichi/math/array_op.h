@@ -12,11 +12,12 @@
 #include <taichi/math/array_2d.h>
 #include <taichi/math/math_util.h>
 #include <taichi/math/linalg.h>
+#include <taichi/system/threading.h>
 
 TC_NAMESPACE_BEGIN
 
 template <typename T>
-Array2D <T> gaussian_blur_x(const Array2D <T> &arr, real sigma) {
+Array2D <T> gaussian_blur_x(const Array2D <T> &arr, real sigma, int num_threads = 1) {
     if (sigma < 1e-5f) {
         return arr;
     }
@@ -34,19 +35,20 @@ Array2D <T> gaussian_blur_x(const Array2D <T> &arr, real sigma) {
     }
 
     // X dir
-    for (auto &ind : arr.get_region()) {
-        T tot = stencil[0] * arr[ind];
-        for (int k = 1; k <= radius; k++) {
-            tot += stencil[k] * (arr[std::max(0, ind.i - k)][ind.j]
-                                 + arr[std::min(ind.i + k, arr.get_width() - 1)][ind.j]);
+    ThreadedTaskManager::run([&](int i) {
+        for (int j = 0; j < arr.get_height(); j++) {
+            T tot = stencil[0] * arr[i][j];
+            for (int k = 1; k <= radius; k++) {
+                tot += stencil[k] * (arr[std::max(0, i - k)][j] + arr[std::min(i + k, arr.get_width() - 1)][j]);
+            }
+            ret[i][j] = tot;
         }
-        ret[ind] = tot;
-    }
+    }, 0, arr.get_width(), num_threads);
     return ret;
 }
 
 template <typename T>
-Array2D <T> gaussian_blur_y(const Array2D <T> &arr, real sigma) {
+Array2D <T> gaussian_blur_y(const Array2D <T> &arr, real sigma, int num_threads = 1) {
     if (sigma < 1e-5f) {
         return arr;
     }
@@ -64,20 +66,21 @@ Array2D <T> gaussian_blur_y(const Array2D <T> &arr, real sigma) {
     }
 
     // Y dir
-    for (auto &ind : arr.get_region()) {
-        T tot = stencil[0] * arr[ind];
-        for (int k = 1; k <= radius; k++) {
-            tot += stencil[k] * (arr[ind.i][std::max(0, ind.j - k)] +
-                                 arr[ind.i][std::min(ind.j + k, arr.get_height() - 1)]);
+    ThreadedTaskManager::run([&](int i) {
+        for (int j = 0; j < arr.get_height(); j++) {
+            T tot = stencil[0] * arr[i][j];
+            for (int k = 1; k <= radius; k++) {
+                tot += stencil[k] * (arr[i][std::max(0, j - k)] + arr[i][std::min(j + k, arr.get_height() - 1)]);
+            }
+            ret[i][j] = tot;
         }
-        ret[ind] = tot;
-    }
+    }, 0, arr.get_width(), num_threads);
     return ret;
 }
 
 template <typename T>
-Array2D <T> gaussian_blur(const Array2D <T> &arr, real sigma) {
-    return gaussian_blur_x(gaussian_blur_y(arr, sigma), sigma);
+Array2D <T> gaussian_blur(const Array2D <T> &arr, real sigma, int num_threads = 1) {
+    return gaussian_blur_x(gaussian_blur_y(arr, sigma, num_threads), sigma, num_threads);
 }
 
 template <typename T>
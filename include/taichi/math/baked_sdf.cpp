@@ -0,0 +1,144 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/math/baked_sdf.h>
+#include <taichi/system/threading.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+TC_NAMESPACE_BEGIN
+
+void BakedSDF::initialize(const Config &config) {
+    bake(config.get_asset<SDF>("sdf"), config.get("lower", Vector3(-1.0f)), config.get("upper", Vector3(1.0f)),
+         config.get("resolution", 256), config.get("band", 3.0f), config.get("lipschitz", 1.0f),
+         config.get("num_threads", 1));
+}
+
+void BakedSDF::bake(std::shared_ptr<SDF> source, Vector3 lower, Vector3 upper, int resolution, real band,
+                    real lipschitz, int num_threads) {
+    assert_info(source != nullptr, "BakedSDF needs an SDF to bake");
+    assert_info(resolution > 0, "BakedSDF resolution should be positive");
+    const Vector3 extent = upper - lower;
+    assert_info(extent.x > 0 && extent.y > 0 && extent.z > 0, "BakedSDF bounds should not be empty");
+    this->source = source;
+    this->lipschitz = lipschitz;
+    dx = std::max(extent.x, std::max(extent.y, extent.z)) / resolution;
+    inv_dx = 1.0f / dx;
+    for (int i = 0; i < 3; i++) {
+        const int cells = std::max(1, (int)std::ceil(extent[i] * inv_dx - 1e-3f));
+        num_bricks[i] = (cells + brick_size - 1) / brick_size;
+    }
+    this->lower = lower;
+    this->upper = lower + real(brick_size) * dx * Vector3(num_bricks);
+
+    Level finest;
+    finest.res = num_bricks;
+    finest.block_size = brick_size * dx;
+    finest.centers.resize(num_bricks.x * num_bricks.y * num_bricks.z);
+    levels.assign(1, finest);
+    auto eval_centers = [&](Level &level) {
+        ThreadedTaskManager::run([&](int b) {
+            const int k = b % level.res.z, j = b / level.res.z % level.res.y, i = b / level.res.z / level.res.y;
+            level.centers[b] = source->eval(get_block_center(level, i, j, k));
+        }, 0, (int)level.centers.size(), num_threads);
+    };
+    eval_centers(levels[0]);
+
+    // A brick may hold the surface, or distances below band cells, only if its center is that close, give or
+    // take how much the distance may change from there to its corners
+    const real reach = band * dx + lipschitz * std::sqrt(3.0f) * 0.5f * levels[0].block_size;
+    brick_ids.assign(levels[0].centers.size(), -1);
+    std::vector<int> baked;
+    for (int b = 0; b < (int)brick_ids.size(); b++) {
+        if (std::abs(levels[0].centers[b]) <= reach) {
+            brick_ids[b] = (int)baked.size() * brick_samples;
+            baked.push_back(b);
+        }
+    }
+    samples.resize(baked.size() * brick_samples);
+    ThreadedTaskManager::run([&](int t) {
+        const int b = baked[t];
+        const int k = b % num_bricks.z, j = b / num_bricks.z % num_bricks.y, i = b / num_bricks.z / num_bricks.y;
+        const Vector3 corner = lower + real(brick_size) * dx * Vector3(i, j, k);
+        real *s = &samples[brick_ids[b]];
+        for (int x = 0; x <= brick_size; x++) {
+            for (int y = 0; y <= brick_size; y++) {
+                for (int z = 0; z <= brick_size; z++) {
+                    *s++ = source->eval(corner + dx * Vector3(x, y, z));
+                }
+            }
+        }
+    }, 0, (int)baked.size(), num_threads);
+
+    while (levels.back().res != Vector3i(1)) {
+        Level level;
+        level.res = (levels.back().res + Vector3i(1)) / 2;
+        level.block_size = levels.back().block_size * 2;
+        level.centers.resize(level.res.x * level.res.y * level.res.z);
+        eval_centers(level);
+        levels.push_back(std::move(level));
+    }
+}
+
+real BakedSDF::get_lower_bound(const Vector3 &p) const {
+    const Vector3 g = (p - lower) * inv_dx;
+    const int bi = clamp((int)(g.x * (1.0f / brick_size)), 0, num_bricks.x - 1);
+    const int bj = clamp((int)(g.y * (1.0f / brick_size)), 0, num_bricks.y - 1);
+    const int bk = clamp((int)(g.z * (1.0f / brick_size)), 0, num_bricks.z - 1);
+    const int id = brick_ids[(bi * num_bricks.y + bj) * num_bricks.z + bk];
+    if (id != -1) {
+        const Vector3 local = g - real(brick_size) * Vector3(bi, bj, bk);
+        const int i = clamp((int)local.x, 0, brick_size - 1);
+        const int j = clamp((int)local.y, 0, brick_size - 1);
+        const int k = clamp((int)local.z, 0, brick_size - 1);
+        const real fx = clamp(local.x - i, 0.0f, 1.0f), fy = clamp(local.y - j, 0.0f, 1.0f);
+        const real fz = clamp(local.z - k, 0.0f, 1.0f);
+        const int sy = brick_size + 1, sx = sy * sy;
+        const real *s = &samples[id + i * sx + j * sy + k];
+        const real y0 = lerp(fy, lerp(fz, s[0], s[1]), lerp(fz, s[sy], s[sy + 1]));
+        const real y1 = lerp(fy, lerp(fz, s[sx], s[sx + 1]), lerp(fz, s[sx + sy], s[sx + sy + 1]));
+        // The distance at p is at least that at any corner of its cell, less how much it may change to there
+        return lerp(fx, y0, y1) - lipschitz * std::sqrt(3.0f) * dx;
+    }
+    real bound = -std::numeric_limits<real>::infinity();
+    for (int l = 0; l < (int)levels.size(); l++) {
+        const Level &level = levels[l];
+        const int i = bi >> l, j = bj >> l, k = bk >> l;
+        const real center = level.centers[(i * level.res.y + j) * level.res.z + k];
+        bound = std::max(bound, center - lipschitz * length(p - get_block_center(level, i, j, k)));
+    }
+    return bound;
+}
+
+real BakedSDF::march(const Vector3 &orig, const Vector3 &dir, real limit, real threshold, int max_steps) const {
+    // Below this, bounds within baked bricks are mostly interpolation error, so exact steps are larger
+    const real min_bound_step = std::max(threshold, lipschitz * std::sqrt(3.0f) * dx);
+    real dist = 0;
+    for (int i = 0; i < max_steps; i++) {
+        const Vector3 p = orig + dist * dir;
+        // Where the bound is large enough, the surface is farther than it, so no closer than threshold
+        real step = inside(p) ? get_lower_bound(p) : 0;
+        if (step <= min_bound_step) {
+            step = source->eval(p);
+            if (step < threshold) {
+                break;
+            }
+        }
+        dist += step;
+        if (dist > limit) {
+            break;
+        }
+    }
+    return dist;
+}
+
+TC_IMPLEMENTATION(SDF, BakedSDF, "baked");
+
+TC_NAMESPACE_END
@@ -0,0 +1,77 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <taichi/math/sdf.h>
+
+TC_NAMESPACE_BEGIN
+
+// An SDF baked into a narrow band of bricks of brick_size^3 cells, for sphere tracing it with trilinear lookups
+// instead of evaluating it. Bricks hold their (brick_size + 1)^3 corner samples, and are only baked where the
+// surface may come within band cells. Elsewhere, distances at the centers of bricks and of ever coarser blocks
+// of them bound the distance from below, for large steps. The source is assumed to be Lipschitz with constant
+// lipschitz (1 for exact distances); eval() stays exact, and so do steps outside [lower, upper] and the final ones.
+class BakedSDF : public SDF {
+public:
+    static constexpr int brick_size = 8;
+
+    // "sdf" (asset id), "lower", "upper", "resolution" (cells along the longest side), "band" (in cells),
+    // "lipschitz" and "num_threads"
+    void initialize(const Config &config) override;
+
+    void bake(std::shared_ptr<SDF> source, Vector3 lower, Vector3 upper, int resolution, real band,
+              real lipschitz, int num_threads);
+
+    real eval(const Vector3 &p) const override {
+        return source->eval(p);
+    }
+
+    real march(const Vector3 &orig, const Vector3 &dir, real limit, real threshold, int max_steps) const override;
+
+    // A lower bound of eval(p) for p within the bricks: trilinear in baked bricks, from block centers elsewhere
+    real get_lower_bound(const Vector3 &p) const;
+
+    bool inside(const Vector3 &p) const {
+        return lower.x <= p.x && p.x < upper.x && lower.y <= p.y && p.y < upper.y && lower.z <= p.z && p.z < upper.z;
+    }
+
+    int get_num_baked_bricks() const {
+        return (int)samples.size() / brick_samples;
+    }
+
+protected:
+    static constexpr int brick_samples = (brick_size + 1) * (brick_size + 1) * (brick_size + 1);
+
+    // Distances at the centers of blocks of 2^l bricks per side, for level l
+    struct Level {
+        Vector3i res;
+        real block_size;
+        std::vector<real> centers;
+    };
+
+    std::shared_ptr<SDF> source;
+    // Of the bricks, which may extend beyond the bounds baked for
+    Vector3 lower, upper;
+    real dx, inv_dx;
+    real lipschitz;
+    Vector3i num_bricks;
+    // Per brick, by (i * num_bricks.y + j) * num_bricks.z + k, the index of its samples, -1 if not baked
+    std::vector<int> brick_ids;
+    std::vector<real> samples;
+    std::vector<Level> levels;
+
+    Vector3 get_block_center(const Level &level, int i, int j, int k) const {
+        return lower + level.block_size * Vector3(i + 0.5f, j + 0.5f, k + 0.5f);
+    }
+};
+
+TC_NAMESPACE_END
@@ -10,17 +10,68 @@
 #pragma once
 
 #include <taichi/math/linalg.h>
+#include <taichi/system/threading.h>
 #include <vector>
 #include <algorithm>
 #include <numeric>
 
 TC_NAMESPACE_BEGIN
 
+// Walker's alias table (1977) for sampling indices in proportion to weights in constant time: bucket i is i
+// with probability prob[i], and alias[i] otherwise. Built with the sweeping method of Hübschle-Schneider and
+// Sanders ("Parallel Weighted Random Sampling", 2019), whose sweep splits into independent parts, so that it
+// builds in parallel with the same result for any thread count. 8 bytes per element.
+class AliasTable {
+public:
+    std::vector<real> prob;
+    std::vector<int> alias;
+
+    AliasTable() {}
+
+    // The total weight must be positive
+    void initialize(const std::vector<real> &weights, int num_threads = 1);
+
+    void clear() {
+        std::vector<real>().swap(prob);
+        std::vector<int>().swap(alias);
+    }
+
+    int get_num_elements() const {
+        return (int)prob.size();
+    }
+
+    int sample(real r) const {
+        const int n = get_num_elements();
+        // In double, to keep all the bits of r for the choice within the bucket
+        const double x = (double)r * n;
+        const int bucket = std::min((int)x, n - 1);
+        return x - bucket < prob[bucket] ? bucket : alias[bucket];
+    }
+
+    // Branch free, for vectorization
+    void sample_n(const real *r, int count, int *indices) const {
+        const int n = get_num_elements();
+        const real *prob = &this->prob[0];
+        const int *alias = &this->alias[0];
+        for (int i = 0; i < count; i++) {
+            const double x = (double)r[i] * n;
+            const int bucket = std::min((int)x, n - 1);
+            indices[i] = x - bucket < prob[bucket] ? bucket : alias[bucket];
+        }
+    }
+};
+
+// Samples indices with given probabilities from a uniform r in [0, 1), by binary search over the CDF or, once
+// initialized with alias = true, in constant time from an AliasTable.
+// Alias sampling is not monotonic in r, so samples with cdf_out (for inverting warps) need the CDF.
 class DiscreteSampler {
 private:
     std::vector<real> pdf;
     std::vector<real> cdf;
-    bool zero_total_pdf;
+    bool zero_total_pdf = false;
+    bool alias = false;
+    AliasTable alias_table;
+
 public:
     DiscreteSampler() {}
 
@@ -33,7 +84,8 @@ public:
         return (int)pdf.size();
     }
 
-    void initialize(std::vector<real> unnormalized_pdf, bool allow_zero_total_pdf = true) {
+    void initialize(std::vector<real> unnormalized_pdf, bool allow_zero_total_pdf = true, bool alias = false,
+                    int num_threads = 1) {
         //float sum = std::accumulate(unnormalized_pdf.begin(), unnormalized_pdf.end(), 0.0f);
         assert(unnormalized_pdf.size() != 0);
         float sum = 0.0f;
@@ -44,9 +96,8 @@ public:
         }
         if (!allow_zero_total_pdf) {
             assert_info(sum > 0, "Sum of pdf is zero.");
-        } else {
-            zero_total_pdf = sum < 1e-20f;
         }
+        zero_total_pdf = sum < 1e-20f;
         float inv_sum = 1.0f / std::max(sum, 1e-30f);
         this->pdf.resize(unnormalized_pdf.size());
         this->cdf.resize(unnormalized_pdf.size());
@@ -57,6 +108,16 @@ public:
                 cdf[i] += cdf[i - 1];
             }
         }
+        this->alias = alias && !zero_total_pdf;
+        if (this->alias) {
+            alias_table.initialize(pdf, num_threads);
+        } else {
+            alias_table.clear();
+        }
+    }
+
+    bool is_alias() const {
+        return alias;
     }
 
     int sample(real r, real &pdf_out) const {
@@ -64,13 +125,19 @@ public:
             pdf_out = 0.0f;
             return 0;
         }
-        int index = int(std::lower_bound(cdf.begin(), cdf.end(), r) - cdf.begin());
-        index = std::min(index, get_num_elements() - 1);
+        int index;
+        if (alias) {
+            index = alias_table.sample(r);
+        } else {
+            index = int(std::lower_bound(cdf.begin(), cdf.end(), r) - cdf.begin());
+            index = std::min(index, get_num_elements() - 1);
+        }
         pdf_out = pdf[index];
         return index;
     }
 
     int sample(real r, real &pdf_out, real &cdf_out) const {
+        assert_info(!alias, "Alias sampling has no CDF");
         if (zero_total_pdf) {
             pdf_out = 0.0f;
             cdf_out = 0.0f;
@@ -88,6 +155,23 @@ public:
         return sample(r, _);
     }
 
+    // Samples for count uniforms r; pdfs_out may be null
+    void sample_n(const real *r, int count, int *indices, real *pdfs_out = nullptr) const {
+        if (alias) {
+            alias_table.sample_n(r, count, indices);
+        } else {
+            real _;
+            for (int i = 0; i < count; i++) {
+                indices[i] = sample(r[i], _);
+            }
+        }
+        if (pdfs_out != nullptr) {
+            for (int i = 0; i < count; i++) {
+                pdfs_out[i] = zero_total_pdf ? 0.0f : pdf[indices[i]];
+            }
+        }
+    }
+
     real get_pdf(int id) const {
         return pdf[id];
     }
@@ -97,6 +181,75 @@ public:
     }
 };
 
+// Elements of scaled weight n * weight / total <= 1 ("light") fill their buckets up from the current "heavy"
+// element, whose bucket is filled once it is light itself, topped up by the next heavy one. After a light and
+// b heavy buckets the current heavy element has weight left w(a, b) = heavy_sum[b + 1] + light_sum[a] - a - b,
+// so the sweep is a lattice path (a, b) that any part can start at from its number of buckets k: the least a
+// at which the sweep at (a, k - 1 - a) would fill a heavy bucket.
+inline void AliasTable::initialize(const std::vector<real> &weights, int num_threads) {
+    const int n = (int)weights.size();
+    // In double, so that the last heavy bucket is not off by rounding
+    double total = 0;
+    for (int i = 0; i < n; i++) {
+        total += weights[i];
+    }
+    assert_info(n > 0 && total > 0, "Alias tables need a positive total weight");
+    const double scale = n / total;
+    std::vector<int> light, heavy;
+    for (int i = 0; i < n; i++) {
+        (weights[i] * scale <= 1.0 ? light : heavy).push_back(i);
+    }
+    const int num_light = (int)light.size(), num_heavy = (int)heavy.size();
+    std::vector<double> light_sum(num_light + 1, 0.0), heavy_sum(num_heavy + 1, 0.0);
+    for (int i = 0; i < num_light; i++) {
+        light_sum[i + 1] = light_sum[i] + weights[light[i]] * scale;
+    }
+    for (int i = 0; i < num_heavy; i++) {
+        heavy_sum[i + 1] = heavy_sum[i] + weights[heavy[i]] * scale;
+    }
+    auto weight_left = [&](int a, int b) {
+        return heavy_sum[b + 1] + light_sum[a] - a - b;
+    };
+    // Whether the sweep at (a, b) fills the bucket of the current heavy element
+    auto fills_heavy = [&](int a, int b) {
+        return 0 <= b && b < num_heavy && !(a < num_light && weight_left(a, b) > 1);
+    };
+    prob.resize(n);
+    alias.resize(n);
+    const int num_parts = std::max(1, std::min(num_threads * 4, n / 4096));
+    parallel_for(0, num_parts, num_threads, [&](int part) {
+        const int k_begin = (int)((int64)n * part / num_parts), k_end = (int)((int64)n * (part + 1) / num_parts);
+        // Binary search for the start of the sweep
+        int lo = std::max(0, k_begin - num_heavy), hi = std::min(k_begin, num_light);
+        while (lo < hi) {
+            const int mid = (lo + hi) / 2;
+            if (fills_heavy(mid, k_begin - 1 - mid)) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        int a = lo, b = k_begin - lo;
+        for (int k = k_begin; k < k_end; k++) {
+            if (b >= num_heavy) {
+                // No heavy element is left, e.g. for uniform weights: the remaining light ones are full
+                prob[light[a]] = 1;
+                alias[light[a]] = light[a];
+                a++;
+            } else if (!fills_heavy(a, b)) {
+                prob[light[a]] = (real)(weights[light[a]] * scale);
+                alias[light[a]] = heavy[b];
+                a++;
+            } else {
+                const int next = b + 1 < num_heavy ? heavy[b + 1] : heavy[b];
+                prob[heavy[b]] = b + 1 < num_heavy ? (real)std::max(0.0, weight_left(a, b)) : 1.0f;
+                alias[heavy[b]] = next;
+                b++;
+            }
+        }
+    }, 1);
+}
+
 inline void test_discrete_sampler() {
     const int n = 10;
     std::vector<real> p;
@@ -8,6 +8,7 @@
 *******************************************************************************/
 
 #include "dynamic_levelset_3d.h"
+#include <taichi/system/threading.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -16,9 +17,21 @@ void DynamicLevelSet3D::initialize(real _t0, real _t1, const LevelSet3D &_ls0, c
     t1 = _t1;
     levelset0 = std::make_shared<LevelSet3D>(_ls0);
     levelset1 = std::make_shared<LevelSet3D>(_ls1);
+    sparse_levelset0 = sparse_levelset1 = nullptr;
+}
+
+void DynamicLevelSet3D::initialize(real _t0, real _t1, const SparseLevelSet3D &_ls0, const SparseLevelSet3D &_ls1) {
+    t0 = _t0;
+    t1 = _t1;
+    levelset0 = levelset1 = nullptr;
+    sparse_levelset0 = std::make_shared<SparseLevelSet3D>(_ls0);
+    sparse_levelset1 = std::make_shared<SparseLevelSet3D>(_ls1);
 }
 
 Vector3 DynamicLevelSet3D::get_spatial_gradient(const Vector3 &pos, real t) const {
+    if (is_sparse()) {
+        return query(pos, t).normal;
+    }
     Vector3 gxyz0 = levelset0->get_gradient(pos);
     Vector3 gxyz1 = levelset1->get_gradient(pos);
     real gx = lerp((t - t0) / (t1 - t0), gxyz0.x, gxyz1.x);
@@ -32,6 +45,9 @@ Vector3 DynamicLevelSet3D::get_spatial_gradient(const Vector3 &pos, real t) cons
 }
 
 real DynamicLevelSet3D::get_temporal_derivative(const Vector3 &pos, real t) const {
+    if (is_sparse()) {
+        return query(pos, t).temporal_derivative;
+    }
     assert_info(levelset0->inside(pos), "Temporal("
                                         + std::to_string(pos.x) + ", "
                                         + std::to_string(pos.y) + ", "
@@ -42,6 +58,9 @@ real DynamicLevelSet3D::get_temporal_derivative(const Vector3 &pos, real t) cons
 }
 
 real DynamicLevelSet3D::sample(const Vector3 &pos, real t) const {
+    if (is_sparse()) {
+        return query(pos, t).phi;
+    }
     assert_info(levelset0->inside(pos), "Sample("
                                         + std::to_string(pos.x) + ", "
                                         + std::to_string(pos.y) + ", "
@@ -51,9 +70,149 @@ real DynamicLevelSet3D::sample(const Vector3 &pos, real t) const {
     return lerp((t - t0) / (t1 - t0), l1, l2);
 }
 
+// The value and gradient of a level set within a cell, as LevelSet3D::get and get_gradient
+static real sample_cell(const LevelSet3D &ls, int x_i, int y_i, int z_i, real x_r, real y_r, real z_r,
+                        Vector3 &gradient) {
+    real c[2][2][2];
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            for (int k = 0; k < 2; k++) {
+                c[i][j][k] = ls.Array3D<real>::get(x_i + i, y_i + j, z_i + k);
+            }
+        }
+    }
+    return interpolate_cell(c, x_r, y_r, z_r, gradient);
+}
+
+DynamicLevelSet3D::Query DynamicLevelSet3D::interpolate(real l0, const Vector3 &g0, real l1, const Vector3 &g1,
+                                                         real t) const {
+    Query q;
+    const real a = (t - t0) / (t1 - t0);
+    const Vector3 gradient(lerp(a, g0.x, g1.x), lerp(a, g0.y, g1.y), lerp(a, g0.z, g1.z));
+    q.normal = length(gradient) < 1e-10f ? Vector3(1, 0, 0) : normalize(gradient);
+    q.temporal_derivative = (l1 - l0) / (t1 - t0);
+    q.phi = lerp(a, l0, l1);
+    return q;
+}
+
+bool DynamicLevelSet3D::shares_layout() const {
+    if (is_sparse()) {
+        const SparseLevelSet3D &ls0 = *sparse_levelset0, &ls1 = *sparse_levelset1;
+        return ls0.get_width() == ls1.get_width() && ls0.get_height() == ls1.get_height() &&
+               ls0.get_depth() == ls1.get_depth() && ls0.get_storage_offset() == ls1.get_storage_offset();
+    }
+    const LevelSet3D &ls0 = *levelset0, &ls1 = *levelset1;
+    return ls0.get_width() == ls1.get_width() && ls0.get_height() == ls1.get_height() &&
+           ls0.get_depth() == ls1.get_depth() && ls0.get_storage_offset() == ls1.get_storage_offset();
+}
+
+void DynamicLevelSet3D::locate(const Vector3 &pos, Vector3i &cell, Vector3 &fraction) const {
+    const int width = is_sparse() ? sparse_levelset0->get_width() : levelset0->get_width();
+    const int height = is_sparse() ? sparse_levelset0->get_height() : levelset0->get_height();
+    const int depth = is_sparse() ? sparse_levelset0->get_depth() : levelset0->get_depth();
+    const Vector3 offset = is_sparse() ? sparse_levelset0->get_storage_offset() : levelset0->get_storage_offset();
+    const real x = clamp(pos.x - offset.x, 0.f, width - 1.f - eps);
+    const real y = clamp(pos.y - offset.y, 0.f, height - 1.f - eps);
+    const real z = clamp(pos.z - offset.z, 0.f, depth - 1.f - eps);
+    cell = Vector3i(clamp(int(x), 0, width - 2), clamp(int(y), 0, height - 2), clamp(int(z), 0, depth - 2));
+    fraction = Vector3(x - cell.x, y - cell.y, z - cell.z);
+}
+
+DynamicLevelSet3D::Query DynamicLevelSet3D::query(const Vector3 &pos, real t) const {
+    Vector3 g0, g1;
+    if (is_sparse()) {
+        const real l0 = sparse_levelset0->sample(pos, g0);
+        const real l1 = sparse_levelset1->sample(pos, g1);
+        return interpolate(l0, g0, l1, g1, t);
+    }
+    if (!shares_layout()) {
+        Query q;
+        q.phi = sample(pos, t);
+        q.normal = get_spatial_gradient(pos, t);
+        q.temporal_derivative = get_temporal_derivative(pos, t);
+        return q;
+    }
+    assert_info(levelset0->inside(pos), "Query(" + std::to_string(pos.x) + ", " + std::to_string(pos.y) + ", "
+                                        + std::to_string(pos.z) + ")");
+    Vector3i cell;
+    Vector3 r;
+    locate(pos, cell, r);
+    const real l0 = sample_cell(*levelset0, cell.x, cell.y, cell.z, r.x, r.y, r.z, g0);
+    const real l1 = sample_cell(*levelset1, cell.x, cell.y, cell.z, r.x, r.y, r.z, g1);
+    return interpolate(l0, g0, l1, g1, t);
+}
+
+void DynamicLevelSet3D::fetch_window(const Vector3 &lower, const Vector3 &upper, Window &window) const {
+    window.size = Vector3i(0);
+    if (!shares_layout()) {
+        return;
+    }
+    Vector3i last;
+    Vector3 r;
+    locate(lower, window.begin, r);
+    locate(upper, last, r);
+    window.size = last - window.begin + Vector3i(2);
+    window.phi0.resize(window.size.x * window.size.y * window.size.z);
+    window.phi1.resize(window.phi0.size());
+    int n = 0;
+    for (int i = window.begin.x; i < window.begin.x + window.size.x; i++) {
+        for (int j = window.begin.y; j < window.begin.y + window.size.y; j++) {
+            for (int k = window.begin.z; k < window.begin.z + window.size.z; k++) {
+                if (is_sparse()) {
+                    window.phi0[n] = sparse_levelset0->get(i, j, k);
+                    window.phi1[n] = sparse_levelset1->get(i, j, k);
+                } else {
+                    window.phi0[n] = levelset0->Array3D<real>::get(i, j, k);
+                    window.phi1[n] = levelset1->Array3D<real>::get(i, j, k);
+                }
+                n++;
+            }
+        }
+    }
+}
+
+DynamicLevelSet3D::Query DynamicLevelSet3D::query(const Window &window, const Vector3 &pos, real t) const {
+    Vector3i cell;
+    Vector3 r;
+    locate(pos, cell, r);
+    const Vector3i local = cell - window.begin;
+    if (local.x < 0 || local.y < 0 || local.z < 0 || local.x + 1 >= window.size.x ||
+        local.y + 1 >= window.size.y || local.z + 1 >= window.size.z) {
+        return query(pos, t);
+    }
+    const bool inside = is_sparse() ? sparse_levelset0->inside(pos) : levelset0->inside(pos);
+    assert_info(inside, "Query(" + std::to_string(pos.x) + ", " + std::to_string(pos.y) + ", "
+                        + std::to_string(pos.z) + ")");
+    real c0[2][2][2], c1[2][2][2];
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            for (int k = 0; k < 2; k++) {
+                const int n = ((local.x + i) * window.size.y + local.y + j) * window.size.z + local.z + k;
+                c0[i][j][k] = window.phi0[n];
+                c1[i][j][k] = window.phi1[n];
+            }
+        }
+    }
+    Vector3 g0, g1;
+    const real l0 = interpolate_cell(c0, r.x, r.y, r.z, g0);
+    const real l1 = interpolate_cell(c1, r.x, r.y, r.z, g1);
+    return interpolate(l0, g0, l1, g1, t);
+}
+
+void DynamicLevelSet3D::query(const std::vector<Vector3i> &grid_points, real t, std::vector<Query> &results,
+                              int num_threads) const {
+    results.resize(grid_points.size());
+    parallel_for(0, (int)grid_points.size(), num_threads, [&](int i) {
+        const Vector3i &ind = grid_points[i];
+        results[i] = query(Vector3(0.5f + ind[0], 0.5f + ind[1], 0.5f + ind[2]), t);
+    }, 1024);
+}
+
 Array3D<real> DynamicLevelSet3D::rasterize(int width, int height, int depth, real t) {
-    Array3D<real> r0 = levelset0->rasterize(width, height, depth);
-    Array3D<real> r1 = levelset1->rasterize(width, height, depth);
+    Array3D<real> r0 = is_sparse() ? sparse_levelset0->rasterize(width, height, depth)
+                                   : levelset0->rasterize(width, height, depth);
+    Array3D<real> r1 = is_sparse() ? sparse_levelset1->rasterize(width, height, depth)
+                                   : levelset1->rasterize(width, height, depth);
     Array3D<real> out(width, height, depth);
     for (auto &ind : Region3D(0, width, 0, height, 0, depth, Vector3(0.5f, 0.5f, 0.5f))) {
         out[ind] = lerp((t - t0) / (t1 - t0), r0[ind], r1[ind]);
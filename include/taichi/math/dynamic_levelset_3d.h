@@ -12,25 +12,74 @@
 
 #include <limits>
 #include <memory>
+#include <vector>
 #include <taichi/math/levelset_3d.h>
+#include <taichi/math/sparse_levelset_3d.h>
 
 
 TC_NAMESPACE_BEGIN
 
 class DynamicLevelSet3D {
 public:
+    // sample(), get_spatial_gradient() and get_temporal_derivative() at one point
+    struct Query {
+        real phi;
+        Vector3 normal;
+        real temporal_derivative;
+    };
+
+    // The nodes of both level sets within a box, for many queries close to each other
+    struct Window {
+        Vector3i begin, size;
+        std::vector<real> phi0, phi1;
+    };
+
     real t0, t1;
+    // Either the dense level sets or the sparse ones are set
     std::shared_ptr<LevelSet3D> levelset0, levelset1;
+    std::shared_ptr<SparseLevelSet3D> sparse_levelset0, sparse_levelset1;
 
     void initialize(real _t0, real _t1, const LevelSet3D &_ls0, const LevelSet3D &_ls1);
 
+    void initialize(real _t0, real _t1, const SparseLevelSet3D &_ls0, const SparseLevelSet3D &_ls1);
+
+    bool is_sparse() const {
+        return sparse_levelset0 != nullptr;
+    }
+
+    real get_friction() const {
+        return is_sparse() ? sparse_levelset0->friction : levelset0->friction;
+    }
+
     Vector3 get_spatial_gradient(const Vector3 &pos, real t) const;
 
     real get_temporal_derivative(const Vector3 &pos, real t) const;
 
     real sample(const Vector3 &pos, real t) const;
 
+    // From one fetch of the 8 cell corners of both level sets, where they share their layout
+    Query query(const Vector3 &pos, real t) const;
+
+    // query() at the centers of the grid points, i.e. at ind + 0.5, into results
+    void query(const std::vector<Vector3i> &grid_points, real t, std::vector<Query> &results,
+               int num_threads) const;
+
+    // Fetches the nodes of the cells of all positions in [lower, upper]; empty where the level sets differ in layout
+    void fetch_window(const Vector3 &lower, const Vector3 &upper, Window &window) const;
+
+    // query(pos, t), from the window if it holds the cell of pos
+    Query query(const Window &window, const Vector3 &pos, real t) const;
+
     Array3D<real> rasterize(int width, int height, int depth, real t);
+
+protected:
+    bool shares_layout() const;
+
+    // The cell of pos and the position within it, as LevelSet3D::get finds them
+    void locate(const Vector3 &pos, Vector3i &cell, Vector3 &fraction) const;
+
+    // From the values and gradients of both level sets
+    Query interpolate(real l0, const Vector3 &g0, real l1, const Vector3 &g1, real t) const;
 };
 
 TC_NAMESPACE_END
@@ -0,0 +1,98 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <taichi/common/util.h>
+
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+TC_NAMESPACE_BEGIN
+
+// IEEE 754 binary16, for storage only: values are widened to float for arithmetic and
+// rounded to nearest even on store.
+class float16 {
+protected:
+    uint16_t bits;
+
+    static uint32_t float_to_bits(float f) {
+        uint32_t u;
+        std::memcpy(&u, &f, sizeof(u));
+        return u;
+    }
+
+    static float bits_to_float(uint32_t u) {
+        float f;
+        std::memcpy(&f, &u, sizeof(f));
+        return f;
+    }
+
+public:
+    float16() {}
+
+    float16(float f) : bits(from_float(f)) {}
+
+    operator float() const {
+        return to_float(bits);
+    }
+
+    uint16_t get_bits() const {
+        return bits;
+    }
+
+    static uint16_t from_float(float f) {
+#ifdef __F16C__
+        return (uint16_t)_cvtss_sh(f, 0);
+#else
+        uint32_t x = float_to_bits(f);
+        const uint32_t sign = x & 0x80000000u;
+        x ^= sign;
+        uint16_t h;
+        if (x >= (127u + 16) << 23) {
+            // Overflow to infinity; NaNs stay quiet NaNs
+            h = x > 255u << 23 ? 0x7e00 : 0x7c00;
+        } else if (x < 113u << 23) {
+            // Subnormal or zero: let the float adder do the rounding
+            const float magic = bits_to_float(((127u - 15) + (23 - 10) + 1) << 23);
+            h = (uint16_t)(float_to_bits(bits_to_float(x) + magic) - float_to_bits(magic));
+        } else {
+            const uint32_t mantissa_odd = (x >> 13) & 1;
+            x += ((uint32_t)(15 - 127) << 23) + 0xfff + mantissa_odd;
+            h = (uint16_t)(x >> 13);
+        }
+        return h | (uint16_t)(sign >> 16);
+#endif
+    }
+
+    static float to_float(uint16_t h) {
+#ifdef __F16C__
+        return _cvtsh_ss(h);
+#else
+        const uint32_t shifted_exponent = 0x7c00u << 13;
+        uint32_t x = (uint32_t)(h & 0x7fff) << 13;
+        const uint32_t exponent = x & shifted_exponent;
+        x += (127u - 15) << 23;
+        if (exponent == shifted_exponent) {
+            // Infinity or NaN
+            x += (128u - 16) << 23;
+        } else if (exponent == 0) {
+            // Subnormal or zero
+            x += 1 << 23;
+            x = float_to_bits(bits_to_float(x) - bits_to_float(113u << 23));
+        }
+        return bits_to_float(x | (uint32_t)(h & 0x8000) << 16);
+#endif
+    }
+};
+
+TC_NAMESPACE_END
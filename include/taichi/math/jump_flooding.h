@@ -0,0 +1,73 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <limits>
+#include <vector>
+#include <taichi/math/array_2d.h>
+#include <taichi/system/threading.h>
+
+TC_NAMESPACE_BEGIN
+
+// Closest points over a grid by jump flooding: a pass with step 1, then the passes of halving step
+// (1+JFA), O(cells) each and without building a search structure.
+// On input, closest[ind] is the index of a point near the cell, usually the closest of those in it, or -1.
+// On output, it is the index of the point closest to ind.get_pos(), which in practice is exact when
+// the points are cell positions. With points seeded from elsewhere, a point that seeds no cell can't be found,
+// and now and then one marginally farther is picked. Ties go to the smaller index, so the result
+// is deterministic.
+inline void jump_flood(Array2D<int> &closest, const std::vector<Vector2> &points, int num_threads = 1) {
+    const int width = closest.get_width(), height = closest.get_height();
+    const Vector2 offset = closest.get_storage_offset();
+    Array2D<int> next = closest;
+    int max_step = 1;
+    while (max_step * 2 < std::max(width, height)) {
+        max_step *= 2;
+    }
+    std::vector<int> steps{1};
+    for (int step = max_step; step >= 1; step /= 2) {
+        steps.push_back(step);
+    }
+    for (int step : steps) {
+        parallel_for(0, width, num_threads, [&](int i) {
+            for (int j = 0; j < height; j++) {
+                const Vector2 pos = Vector2(real(i), real(j)) + offset;
+                int best = closest[i][j];
+                real best_dist2 = std::numeric_limits<real>::infinity();
+                if (best != -1) {
+                    const Vector2 d = points[best] - pos;
+                    best_dist2 = dot(d, d);
+                }
+                for (int dx = -step; dx <= step; dx += step) {
+                    for (int dy = -step; dy <= step; dy += step) {
+                        const int ni = i + dx, nj = j + dy;
+                        if (ni < 0 || nj < 0 || ni >= width || nj >= height) {
+                            continue;
+                        }
+                        const int candidate = closest[ni][nj];
+                        if (candidate == -1 || candidate == best) {
+                            continue;
+                        }
+                        const Vector2 d = points[candidate] - pos;
+                        const real dist2 = dot(d, d);
+                        if (dist2 < best_dist2 || (dist2 == best_dist2 && candidate < best)) {
+                            best = candidate;
+                            best_dist2 = dist2;
+                        }
+                    }
+                }
+                next[i][j] = best;
+            }
+        });
+        std::swap(closest, next);
+    }
+}
+
+TC_NAMESPACE_END
@@ -9,6 +9,7 @@
 *******************************************************************************/
 
 #include "levelset_2d.h"
+#include <taichi/system/threading.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -70,6 +71,117 @@ real LevelSet2D::get(const Vector2 &pos) const {
     return lerp(y_r, ly0, ly1);
 }
 
+void LevelSet2D::redistance(real band, int num_threads) {
+    const int tile_size = 8;
+    const int tiles_x = (width + tile_size - 1) / tile_size, tiles_y = (height + tile_size - 1) / tile_size;
+    // The closest interface point found for every cell, relative to the cell,
+    // with a border of one cell that never has any
+    const int padded_height = height + 2;
+    std::vector<Vector2> closest((width + 2) * padded_height, Vector2(std::numeric_limits<real>::infinity()));
+    Array2D<char> has_interface(tiles_x, tiles_y, 0), active(tiles_x, tiles_y, 0);
+    // Cells next to a sign change start from the foot of the perpendicular to the line through
+    // their x and y crossings, i.e. at the distance 1 / sqrt(1 / t_x^2 + 1 / t_y^2)
+    parallel_for(0, tiles_x, num_threads, [&](int tx) {
+        for (int i = tx * tile_size; i < std::min(width, (tx + 1) * tile_size); i++) {
+            for (int j = 0; j < height; j++) {
+                const int c = i * height + j;
+                const real phi = data[c];
+                Vector2 inv_t(0.0f);
+                for (int axis = 0; axis < 2; axis++) {
+                    const int stride = axis == 0 ? height : 1, k = axis == 0 ? i : j, n = axis == 0 ? width : height;
+                    real t = 1, side = 0;
+                    for (int s = -1; s <= 1; s += 2) {
+                        if (k + s < 0 || k + s >= n) {
+                            continue;
+                        }
+                        const real other = data[c + s * stride];
+                        if (phi * other > 0) {
+                            continue;
+                        }
+                        // The crossing is at the fraction t of the way to the neighbour
+                        const real t_s = phi == other ? 0.0f : phi / (phi - other);
+                        if (t_s < t) {
+                            t = t_s;
+                            side = (real)s;
+                        }
+                    }
+                    if (side != 0) {
+                        inv_t[axis] = side / std::max(t, 1e-6f);
+                    }
+                }
+                if (inv_t != Vector2(0.0f)) {
+                    closest[(i + 1) * padded_height + j + 1] = inv_t / glm::dot(inv_t, inv_t);
+                    has_interface[tx][j / tile_size] = 1;
+                }
+            }
+        }
+    }, 1);
+
+    // Tiles within band of one with interface cells
+    const int reach = (int)std::ceil(band / tile_size);
+    for (auto &ind : has_interface.get_region()) {
+        if (!has_interface[ind]) {
+            continue;
+        }
+        for (int i = std::max(0, ind.i - reach); i <= std::min(tiles_x - 1, ind.i + reach); i++) {
+            for (int j = std::max(0, ind.j - reach); j <= std::min(tiles_y - 1, ind.j + reach); j++) {
+                active[i][j] = 1;
+            }
+        }
+    }
+
+    // Takes the closest of the 8 neighbours' closest points
+    auto update = [&](int i, int j) {
+        const int c = (i + 1) * padded_height + j + 1;
+        Vector2 best = closest[c];
+        real best_dist2 = glm::dot(best, best);
+        for (int di = -1; di <= 1; di++) {
+            for (int dj = -1; dj <= 1; dj++) {
+                const Vector2 q = closest[c + di * padded_height + dj] + Vector2(real(di), real(dj));
+                const real dist2 = glm::dot(q, q);
+                if (dist2 < best_dist2) {
+                    best = q;
+                    best_dist2 = dist2;
+                }
+            }
+        }
+        closest[c] = best;
+    };
+    std::vector<int> wavefront;
+    for (int sweep = 0; sweep < 4; sweep++) {
+        const int dx = (sweep & 1) ? -1 : 1, dy = (sweep & 2) ? -1 : 1;
+        // Every other tile of a wavefront shares no cell neighbours with the rest, so they can be
+        // swept concurrently
+        for (int k = 0; k < 2 * (tiles_x + tiles_y - 1); k++) {
+            wavefront.clear();
+            const int diagonal = k / 2;
+            for (int s = std::max(0, diagonal - tiles_y + 1) + k % 2; s <= std::min(diagonal, tiles_x - 1); s += 2) {
+                const int tx = dx > 0 ? s : tiles_x - 1 - s;
+                const int ty = dy > 0 ? diagonal - s : tiles_y - 1 - (diagonal - s);
+                if (active[tx][ty]) {
+                    wavefront.push_back(tx * tiles_y + ty);
+                }
+            }
+            parallel_for(0, (int)wavefront.size(), num_threads, [&](int t) {
+                const int tx = wavefront[t] / tiles_y, ty = wavefront[t] % tiles_y;
+                const int x0 = tx * tile_size, x1 = std::min(width, x0 + tile_size);
+                const int y0 = ty * tile_size, y1 = std::min(height, y0 + tile_size);
+                for (int ii = 0; ii < x1 - x0; ii++) {
+                    const int i = dx > 0 ? x0 + ii : x1 - 1 - ii;
+                    for (int jj = 0; jj < y1 - y0; jj++) {
+                        update(i, dy > 0 ? y0 + jj : y1 - 1 - jj);
+                    }
+                }
+            }, 1);
+        }
+    }
+    parallel_for(0, width, num_threads, [&](int i) {
+        for (int j = 0; j < height; j++) {
+            real &phi = data[i * height + j];
+            phi = sgn(phi) * std::min(band, length(closest[(i + 1) * padded_height + j + 1]));
+        }
+    }, 16);
+}
 
 Array2D<real> LevelSet2D::rasterize(int width, int height) {
     for (auto &p : (*this)) {
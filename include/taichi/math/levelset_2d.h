@@ -54,6 +54,13 @@ public:
 
     real get(const Vector2 &pos) const;
 
+    // Makes this a signed distance (in cells) within band of the zero level set, keeping the signs,
+    // and sets |phi| = band farther away. Cells next to the interface locate it from their crossings
+    // of the grid edges, and fast sweeping propagates the closest interface points from there.
+    // Only 8x8 tiles within band of the interface are swept: the tiles of a sweep are visited in
+    // diagonal wavefronts, and those on a wavefront in parallel.
+    void redistance(real band, int num_threads = 1);
+
     static real fraction_outside(real phi_a, real phi_b) {
         return 1.0f - fraction_inside(phi_a, phi_b);
     }
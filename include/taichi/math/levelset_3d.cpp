@@ -8,6 +8,7 @@
 *******************************************************************************/
 
 #include "levelset_3d.h"
+#include <taichi/system/threading.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -161,4 +162,142 @@ Array3D<real> LevelSet3D::rasterize(int width, int height, int depth) {
     return out;
 }
 
+void LevelSet3D::redistance(real band, int num_threads) {
+    const int tile_size = 8;
+    const int tiles_x = (width + tile_size - 1) / tile_size, tiles_y = (height + tile_size - 1) / tile_size,
+            tiles_z = (depth + tile_size - 1) / tile_size;
+    // The closest interface point found for every cell, relative to the cell,
+    // with a border of one cell that never has any
+    const int padded_depth = depth + 2, padded_stride = (height + 2) * padded_depth;
+    std::vector<Vector3> closest((width + 2) * padded_stride, Vector3(std::numeric_limits<real>::infinity()));
+    Array3D<char> has_interface(tiles_x, tiles_y, tiles_z, 0), active(tiles_x, tiles_y, tiles_z, 0);
+    auto padded = [&](int i, int j, int k) {
+        return (i + 1) * padded_stride + (j + 1) * padded_depth + k + 1;
+    };
+    // Cells next to a sign change start from the foot of the perpendicular to the plane through
+    // their x, y and z crossings
+    parallel_for(0, tiles_x, num_threads, [&](int tx) {
+        for (int i = tx * tile_size; i < std::min(width, (tx + 1) * tile_size); i++) {
+            for (int j = 0; j < height; j++) {
+                for (int k = 0; k < depth; k++) {
+                    const int c = i * stride + j * depth + k;
+                    const real phi = data[c];
+                    Vector3 inv_t(0.0f);
+                    for (int axis = 0; axis < 3; axis++) {
+                        const int axis_stride = axis == 0 ? stride : (axis == 1 ? depth : 1);
+                        const int l = axis == 0 ? i : (axis == 1 ? j : k);
+                        const int n = axis == 0 ? width : (axis == 1 ? height : depth);
+                        real t = 1, side = 0;
+                        for (int s = -1; s <= 1; s += 2) {
+                            if (l + s < 0 || l + s >= n) {
+                                continue;
+                            }
+                            const real other = data[c + s * axis_stride];
+                            if (phi * other > 0) {
+                                continue;
+                            }
+                            const real t_s = phi == other ? 0.0f : phi / (phi - other);
+                            if (t_s < t) {
+                                t = t_s;
+                                side = (real)s;
+                            }
+                        }
+                        if (side != 0) {
+                            inv_t[axis] = side / std::max(t, 1e-6f);
+                        }
+                    }
+                    if (inv_t != Vector3(0.0f)) {
+                        closest[padded(i, j, k)] = inv_t / glm::dot(inv_t, inv_t);
+                        has_interface[tx][j / tile_size][k / tile_size] = 1;
+                    }
+                }
+            }
+        }
+    }, 1);
+
+    // Tiles within band of one with interface cells
+    const int reach = (int)std::ceil(band / tile_size);
+    for (auto &ind : has_interface.get_region()) {
+        if (!has_interface[ind]) {
+            continue;
+        }
+        for (int i = std::max(0, ind.i - reach); i <= std::min(tiles_x - 1, ind.i + reach); i++) {
+            for (int j = std::max(0, ind.j - reach); j <= std::min(tiles_y - 1, ind.j + reach); j++) {
+                for (int k = std::max(0, ind.k - reach); k <= std::min(tiles_z - 1, ind.k + reach); k++) {
+                    active[i][j][k] = 1;
+                }
+            }
+        }
+    }
+
+    // Takes the closest of the 26 neighbours' closest points
+    auto update = [&](int i, int j, int k) {
+        const int c = padded(i, j, k);
+        Vector3 best = closest[c];
+        real best_dist2 = glm::dot(best, best);
+        for (int di = -1; di <= 1; di++) {
+            for (int dj = -1; dj <= 1; dj++) {
+                for (int dk = -1; dk <= 1; dk++) {
+                    const Vector3 q = closest[c + di * padded_stride + dj * padded_depth + dk] +
+                                      Vector3(real(di), real(dj), real(dk));
+                    const real dist2 = glm::dot(q, q);
+                    if (dist2 < best_dist2) {
+                        best = q;
+                        best_dist2 = dist2;
+                    }
+                }
+            }
+        }
+        closest[c] = best;
+    };
+    std::vector<Index3D> wavefront;
+    for (int sweep = 0; sweep < 8; sweep++) {
+        const int dx = (sweep & 1) ? -1 : 1, dy = (sweep & 2) ? -1 : 1, dz = (sweep & 4) ? -1 : 1;
+        // The tiles of a plane wavefront of any one parity of (x, y) share no cell neighbours,
+        // so they can be swept concurrently
+        for (int plane = 0; plane < tiles_x + tiles_y + tiles_z - 2; plane++) {
+            for (int parity = 0; parity < 4; parity++) {
+                wavefront.clear();
+                for (int a = parity & 1; a < tiles_x; a += 2) {
+                    for (int b = parity >> 1; b < tiles_y; b += 2) {
+                        const int c = plane - a - b;
+                        if (c < 0 || c >= tiles_z) {
+                            continue;
+                        }
+                        const int tx = dx > 0 ? a : tiles_x - 1 - a;
+                        const int ty = dy > 0 ? b : tiles_y - 1 - b;
+                        const int tz = dz > 0 ? c : tiles_z - 1 - c;
+                        if (active[tx][ty][tz]) {
+                            wavefront.push_back(Index3D(tx, ty, tz));
+                        }
+                    }
+                }
+                parallel_for(0, (int)wavefront.size(), num_threads, [&](int t) {
+                    const Index3D tile = wavefront[t];
+                    const int x0 = tile.i * tile_size, x1 = std::min(width, x0 + tile_size);
+                    const int y0 = tile.j * tile_size, y1 = std::min(height, y0 + tile_size);
+                    const int z0 = tile.k * tile_size, z1 = std::min(depth, z0 + tile_size);
+                    for (int ii = 0; ii < x1 - x0; ii++) {
+                        const int i = dx > 0 ? x0 + ii : x1 - 1 - ii;
+                        for (int jj = 0; jj < y1 - y0; jj++) {
+                            const int j = dy > 0 ? y0 + jj : y1 - 1 - jj;
+                            for (int kk = 0; kk < z1 - z0; kk++) {
+                                update(i, j, dz > 0 ? z0 + kk : z1 - 1 - kk);
+                            }
+                        }
+                    }
+                }, 1);
+            }
+        }
+    }
+    parallel_for(0, width, num_threads, [&](int i) {
+        for (int j = 0; j < height; j++) {
+            for (int k = 0; k < depth; k++) {
+                real &phi = data[i * stride + j * depth + k];
+                phi = sgn(phi) * std::min(band, length(closest[padded(i, j, k)]));
+            }
+        }
+    }, 4);
+}
+
 TC_NAMESPACE_END
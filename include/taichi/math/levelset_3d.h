@@ -15,6 +15,19 @@
 
 TC_NAMESPACE_BEGIN
 
+// The trilinear interpolation of the corner values c[x][y][z] of a cell at (x_r, y_r, z_r) within it, and
+// its gradient, not normalized, with the same operations as LevelSet3D::get and get_gradient
+inline real interpolate_cell(const real c[2][2][2], real x_r, real y_r, real z_r, Vector3 &gradient) {
+    gradient.x = lerp(y_r, lerp(z_r, c[1][0][0] - c[0][0][0], c[1][0][1] - c[0][0][1]),
+                      lerp(z_r, c[1][1][0] - c[0][1][0], c[1][1][1] - c[0][1][1]));
+    gradient.y = lerp(z_r, lerp(x_r, c[0][1][0] - c[0][0][0], c[1][1][0] - c[1][0][0]),
+                      lerp(x_r, c[0][1][1] - c[0][0][1], c[1][1][1] - c[1][0][1]));
+    gradient.z = lerp(x_r, lerp(y_r, c[0][0][1] - c[0][0][0], c[0][1][1] - c[0][1][0]),
+                      lerp(y_r, c[1][0][1] - c[1][0][0], c[1][1][1] - c[1][1][0]));
+    return lerp(x_r, lerp(y_r, lerp(z_r, c[0][0][0], c[0][0][1]), lerp(z_r, c[0][1][0], c[0][1][1])),
+                lerp(y_r, lerp(z_r, c[1][0][0], c[1][0][1]), lerp(z_r, c[1][1][0], c[1][1][1])));
+}
+
 class LevelSet3D : public Array3D<real> {
 public:
     static const real INF;
@@ -57,6 +70,9 @@ public:
 
     real get(const Vector3 &pos) const;
 
+    // As LevelSet2D::redistance, with 8x8x8 tiles swept in plane wavefronts
+    void redistance(real band, int num_threads = 1);
+
     static real fraction_outside(real phi_a, real phi_b) {
         return 1.0f - fraction_inside(phi_a, phi_b);
     }
@@ -125,14 +125,86 @@ inline int sgn(double a) {
     return 0;
 }
 
+// The xorshift128 state of rand(), exposed e.g. for render checkpoints
+struct RandState {
+    unsigned int x = 123456789, y = 362436069, z = 521288629, w = 88675123;
+
+    RandState() {}
+
+    // An independent stream, e.g. of one of many Markov chains
+    explicit RandState(uint64 seed);
+};
+
+inline RandState &get_rand_state() {
+    static RandState state;
+    return state;
+}
+
+inline float rand(RandState &s) {
+    unsigned int t = s.x ^(s.x << 11);
+    s.x = s.y;
+    s.y = s.z;
+    s.z = s.w;
+    return (s.w = (s.w ^ (s.w >> 19)) ^ (t ^ (t >> 8))) * (1.0f / 4294967296.0f);
+}
+
 // inline float frand() { return (float)rand() / (RAND_MAX + 1); }
 inline float rand() {
-    static unsigned int x = 123456789, y = 362436069, z = 521288629, w = 88675123;
-    unsigned int t = x ^(x << 11);
-    x = y;
-    y = z;
-    z = w;
-    return (w = (w ^ (w >> 19)) ^ (t ^ (t >> 8))) * (1.0f / 4294967296.0f);
+    return rand(get_rand_state());
+}
+
+// The SplitMix64 finalizer, a cheap 64-bit mixing function
+inline uint64 hash64(uint64 x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+inline RandState::RandState(uint64 seed) {
+    const uint64 a = hash64(seed * 2 + 1), b = hash64(seed * 2 + 2);
+    x = (unsigned int)a;
+    y = (unsigned int)(a >> 32);
+    z = (unsigned int)b;
+    // xorshift needs a nonzero state
+    w = (unsigned int)(b >> 32) | 1;
+}
+
+// Counter-based random numbers in [0, 1): the same (key, counter) always gives the same value,
+// so that e.g. each cell can draw its own stream regardless of which thread visits it
+inline float counter_rand(uint64 key, uint64 counter) {
+    return (hash64(key ^ hash64(counter + 0x9e3779b97f4a7c15ull)) >> 40) * (1.0f / 16777216.0f);
+}
+
+// The inverse of std::erf on (-1, 1), to single precision ("Approximating the erfinv function", Giles 2010)
+inline float erf_inv(float x) {
+    float w = -std::log(std::max(1e-37f, (1.0f - x) * (1.0f + x))), p;
+    if (w < 5.0f) {
+        w = w - 2.5f;
+        p = 2.81022636e-08f;
+        p = 3.43273939e-07f + p * w;
+        p = -3.5233877e-06f + p * w;
+        p = -4.39150654e-06f + p * w;
+        p = 0.00021858087f + p * w;
+        p = -0.00125372503f + p * w;
+        p = -0.00417768164f + p * w;
+        p = 0.246640727f + p * w;
+        p = 1.50140941f + p * w;
+    } else {
+        w = std::sqrt(w) - 3.0f;
+        p = -0.000200214257f;
+        p = 0.000100950558f + p * w;
+        p = 0.00134934322f + p * w;
+        p = -0.00367342844f + p * w;
+        p = 0.00573950773f + p * w;
+        p = -0.0076224613f + p * w;
+        p = 0.00943887047f + p * w;
+        p = 1.00167406f + p * w;
+        p = 2.83297682f + p * w;
+    }
+    return p * x;
 }
 
 inline Vector3 sample_sphere(float u, float v) {
@@ -0,0 +1,148 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/math/simd.h>
+
+TC_NAMESPACE_BEGIN
+
+// Ken Perlin's improved noise (http://cs.nyu.edu/~perlin/noise/) in single precision, over N points at a time,
+// one per lane of a Vector3N, and the fractal sums of it. The gradients of the corners are looked up from a table
+// instead of branching on the hash, so that everything but the hashing is straight lane arithmetic, which the
+// compiler vectorizes for N = 8 (or 16 with AVX-512). Values are within about [-1, 1], and 0 at integer points.
+class PerlinNoise {
+public:
+    static const int num_lanes = 8;
+
+    template <int N>
+    static VectorN<N> noise(const Vector3N<N> &p) {
+        const Tables &tables = get_tables();
+        const int *perm = tables.perm;
+        int X[N], Y[N], Z[N];
+        VectorN<N> x, y, z;
+        for (int i = 0; i < N; i++) {
+            const real fx = std::floor(p.x.d[i]), fy = std::floor(p.y.d[i]), fz = std::floor(p.z.d[i]);
+            X[i] = (int)fx & 255;
+            Y[i] = (int)fy & 255;
+            Z[i] = (int)fz & 255;
+            x.d[i] = p.x.d[i] - fx;
+            y.d[i] = p.y.d[i] - fy;
+            z.d[i] = p.z.d[i] - fz;
+        }
+        const VectorN<N> u = fade(x), v = fade(y), w = fade(z);
+        // The gradient dot products at the 8 corners, corner dx + 2 * dy + 4 * dz
+        VectorN<N> corners[8];
+        int hash[N];
+        for (int c = 0; c < 8; c++) {
+            const int dx = c & 1, dy = (c >> 1) & 1, dz = c >> 2;
+            for (int i = 0; i < N; i++) {
+                hash[i] = perm[perm[perm[X[i] + dx] + Y[i] + dy] + Z[i] + dz] & 15;
+            }
+            corners[c] = VectorN<N>::gather(tables.grad_x, hash) * (x - VectorN<N>(real(dx))) +
+                         VectorN<N>::gather(tables.grad_y, hash) * (y - VectorN<N>(real(dy))) +
+                         VectorN<N>::gather(tables.grad_z, hash) * (z - VectorN<N>(real(dz)));
+        }
+        return lerp(w, lerp(v, lerp(u, corners[0], corners[1]), lerp(u, corners[2], corners[3])),
+                    lerp(v, lerp(u, corners[4], corners[5]), lerp(u, corners[6], corners[7])));
+    }
+
+    static real noise(const Vector3 &p) {
+        return noise(Vector3N<1>(p)).d[0];
+    }
+
+    // Fractal Brownian motion: octaves of noise, each at lacunarity times the frequency and gain times the
+    // amplitude of the previous one
+    template <int N>
+    static VectorN<N> fbm(const Vector3N<N> &p, int octaves, real lacunarity = 2.0f, real gain = 0.5f) {
+        return fractal_sum(p, octaves, lacunarity, gain, [](const VectorN<N> &n) { return n; });
+    }
+
+    // As fbm, of the absolute values of the octaves, for billowy patterns such as fire or marble veins
+    template <int N>
+    static VectorN<N> turbulence(const Vector3N<N> &p, int octaves, real lacunarity = 2.0f, real gain = 0.5f) {
+        return fractal_sum(p, octaves, lacunarity, gain, [](const VectorN<N> &n) { return abs(n); });
+    }
+
+    // As fbm, of (1 - |noise|)^2, which has sharp ridges where the noise crosses 0, e.g. for mountains
+    template <int N>
+    static VectorN<N> ridged(const Vector3N<N> &p, int octaves, real lacunarity = 2.0f, real gain = 0.5f) {
+        return fractal_sum(p, octaves, lacunarity, gain, [](const VectorN<N> &n) {
+            const VectorN<N> ridge = VectorN<N>(1.0f) - abs(n);
+            return ridge * ridge;
+        });
+    }
+
+private:
+    struct Tables {
+        // The permutation, repeated so that hashes of the corners need no wrapping
+        int perm[512];
+        // Perlin's 12 gradient directions (and 4 of them repeated), by the low 4 bits of the hash
+        real grad_x[16], grad_y[16], grad_z[16];
+
+        Tables() {
+            static const int permutation[256] = {
+                151, 160, 137, 91, 90, 15, 131, 13, 201, 95, 96, 53, 194, 233, 7, 225, 140, 36, 103, 30, 69, 142,
+                8, 99, 37, 240, 21, 10, 23, 190, 6, 148, 247, 120, 234, 75, 0, 26, 197, 62, 94, 252, 219, 203,
+                117, 35, 11, 32, 57, 177, 33, 88, 237, 149, 56, 87, 174, 20, 125, 136, 171, 168, 68, 175, 74, 165,
+                71, 134, 139, 48, 27, 166, 77, 146, 158, 231, 83, 111, 229, 122, 60, 211, 133, 230, 220, 105, 92,
+                41, 55, 46, 245, 40, 244, 102, 143, 54, 65, 25, 63, 161, 1, 216, 80, 73, 209, 76, 132, 187, 208,
+                89, 18, 169, 200, 196, 135, 130, 116, 188, 159, 86, 164, 100, 109, 198, 173, 186, 3, 64, 52, 217,
+                226, 250, 124, 123, 5, 202, 38, 147, 118, 126, 255, 82, 85, 212, 207, 206, 59, 227, 47, 16, 58,
+                17, 182, 189, 28, 42, 223, 183, 170, 213, 119, 248, 152, 2, 44, 154, 163, 70, 221, 153, 101, 155,
+                167, 43, 172, 9, 129, 22, 39, 253, 19, 98, 108, 110, 79, 113, 224, 232, 178, 185, 112, 104, 218,
+                246, 97, 228, 251, 34, 242, 193, 238, 210, 144, 12, 191, 179, 162, 241, 81, 51, 145, 235, 249, 14,
+                239, 107, 49, 192, 214, 31, 181, 199, 106, 157, 184, 84, 204, 176, 115, 121, 50, 45, 127, 4, 150,
+                254, 138, 236, 205, 93, 222, 114, 67, 29, 24, 72, 243, 141, 128, 195, 78, 66, 215, 61, 156, 180
+            };
+            for (int i = 0; i < 256; i++) {
+                perm[i] = perm[256 + i] = permutation[i];
+            }
+            // The reference computes grad(h, x, y, z) = +-u +- v, with u = (h < 8 ? x : y) and
+            // v = (h < 4 ? y : h == 12 || h == 14 ? x : z), signs from the lowest 2 bits of h
+            for (int h = 0; h < 16; h++) {
+                real g[3] = {0, 0, 0};
+                g[h < 8 ? 0 : 1] += (h & 1) ? -1.0f : 1.0f;
+                g[h < 4 ? 1 : (h == 12 || h == 14) ? 0 : 2] += (h & 2) ? -1.0f : 1.0f;
+                grad_x[h] = g[0];
+                grad_y[h] = g[1];
+                grad_z[h] = g[2];
+            }
+        }
+    };
+
+    static const Tables &get_tables() {
+        static const Tables tables;
+        return tables;
+    }
+
+    template <int N>
+    static VectorN<N> fade(const VectorN<N> &t) {
+        return t * t * t * (t * (t * VectorN<N>(6.0f) - VectorN<N>(15.0f)) + VectorN<N>(10.0f));
+    }
+
+    template <int N>
+    static VectorN<N> lerp(const VectorN<N> &t, const VectorN<N> &a, const VectorN<N> &b) {
+        return a + t * (b - a);
+    }
+
+    template <int N, typename F>
+    static VectorN<N> fractal_sum(Vector3N<N> p, int octaves, real lacunarity, real gain, const F &octave) {
+        VectorN<N> sum(0.0f);
+        real amplitude = 1.0f;
+        for (int i = 0; i < octaves; i++) {
+            sum += amplitude * octave(noise(p));
+            p = p * VectorN<N>(lacunarity);
+            amplitude *= gain;
+        }
+        return sum;
+    }
+};
+
+TC_NAMESPACE_END
@@ -27,4 +27,10 @@ void polar_decomp(Matrix2 A, Matrix2 &r, Matrix2 &s);
 
 void polar_decomp(Matrix3 A, Matrix3 &r, Matrix3 &s);
 
+// Decompose n matrices at once, one per SIMD lane (4, 8 or 16 depending on the target).
+// Same conventions as svd(), but the decomposition is iterative, so results differ in the last bits.
+void svd(int n, const Matrix3 *m, Matrix3 *u, Matrix3 *sig, Matrix3 *v);
+
+void polar_decomp(int n, const Matrix3 *A, Matrix3 *r, Matrix3 *s);
+
 TC_NAMESPACE_END
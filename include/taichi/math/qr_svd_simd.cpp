@@ -0,0 +1,36 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#define TC_CPU_DISPATCH_NAMESPACE cpu_baseline
+#include "qr_svd_simd_kernels.h"
+#include <taichi/system/cpu_dispatch.h>
+
+TC_NAMESPACE_BEGIN
+
+TC_DECLARE_CPU_VARIANTS(void, svd_batch, (int n, const Matrix3 *m, Matrix3 *u, Matrix3 *sig, Matrix3 *v))
+
+void svd(int n, const Matrix3 *m, Matrix3 *u, Matrix3 *sig, Matrix3 *v) {
+    static const auto kernel = TC_CPU_VARIANT(svd_batch);
+    kernel(n, m, u, sig, v);
+}
+
+void polar_decomp(int n, const Matrix3 *A, Matrix3 *r, Matrix3 *s) {
+    const int batch_size = 64;
+    Matrix3 u[batch_size], sig[batch_size], v[batch_size];
+    for (int base = 0; base < n; base += batch_size) {
+        const int count = std::min(batch_size, n - base);
+        svd(count, A + base, u, sig, v);
+        for (int k = 0; k < count; k++) {
+            r[base + k] = u[k] * glm::transpose(v[k]);
+            s[base + k] = v[k] * sig[k] * glm::transpose(v[k]);
+        }
+    }
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,12 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+// The AVX2 variant of the kernels of qr_svd_simd.cpp
+#define TC_CPU_DISPATCH_NAMESPACE cpu_avx2
+#include "qr_svd_simd_kernels.h"
@@ -0,0 +1,395 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+// The kernels of qr_svd_simd.cpp, compiled once per CPU target into TC_CPU_DISPATCH_NAMESPACE, see cpu_dispatch.h.
+// Included by qr_svd_simd.cpp and its _avx2 and _avx512 variants only, so without include guard.
+
+#include "qr_svd.h"
+#include <algorithm>
+#include <cmath>
+
+#if !defined(TC_DISABLE_SSE) && defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#ifndef TC_CPU_DISPATCH_NAMESPACE
+#error "Define TC_CPU_DISPATCH_NAMESPACE before including the kernels"
+#endif
+
+TC_NAMESPACE_BEGIN
+
+namespace TC_CPU_DISPATCH_NAMESPACE {
+
+// Batched 3x3 SVD following McAdams et al. 2011, "Computing the Singular Value Decomposition of 3x3
+// matrices with minimal branching and elementary floating point operations": Jacobi eigenanalysis of
+// A^T A gives V, then sorting the columns of AV and a Givens QR gives U and sigma.
+// The same code runs on every lane type below; branches become masked selects.
+
+struct Float1 {
+    static const int width = 1;
+    using Mask = bool;
+    float v;
+
+    Float1() {}
+
+    Float1(float v) : v(v) {}
+
+    static Float1 load(const float *p) {
+        return Float1(*p);
+    }
+
+    void store(float *p) const {
+        *p = v;
+    }
+
+    friend Float1 operator+(Float1 a, Float1 b) { return a.v + b.v; }
+
+    friend Float1 operator-(Float1 a, Float1 b) { return a.v - b.v; }
+
+    friend Float1 operator*(Float1 a, Float1 b) { return a.v * b.v; }
+
+    friend Float1 operator/(Float1 a, Float1 b) { return a.v / b.v; }
+
+    friend Float1 operator-(Float1 a) { return -a.v; }
+
+    friend Mask operator<(Float1 a, Float1 b) { return a.v < b.v; }
+
+    friend Float1 select(Mask m, Float1 a, Float1 b) { return m ? a : b; }
+
+    friend Float1 max(Float1 a, Float1 b) { return std::max(a.v, b.v); }
+
+    friend Float1 sqrt(Float1 a) { return std::sqrt(a.v); }
+
+    friend Float1 rsqrt(Float1 a) { return 1.0f / std::sqrt(a.v); }
+};
+
+#if !defined(TC_DISABLE_SSE) && defined(__SSE2__)
+
+// _mm_rsqrt_ps is only good to 12 bits; one Newton step brings it close to full precision
+#define TC_RSQRT_NEWTON(F, approx)                                              \
+    F y = approx;                                                               \
+    return y * (F(1.5f) - F(0.5f) * a * y * y);
+
+struct Float4 {
+    static const int width = 4;
+    using Mask = __m128;
+    __m128 v;
+
+    Float4() {}
+
+    Float4(__m128 v) : v(v) {}
+
+    Float4(float f) : v(_mm_set1_ps(f)) {}
+
+    static Float4 load(const float *p) {
+        return _mm_load_ps(p);
+    }
+
+    void store(float *p) const {
+        _mm_store_ps(p, v);
+    }
+
+    friend Float4 operator+(Float4 a, Float4 b) { return _mm_add_ps(a.v, b.v); }
+
+    friend Float4 operator-(Float4 a, Float4 b) { return _mm_sub_ps(a.v, b.v); }
+
+    friend Float4 operator*(Float4 a, Float4 b) { return _mm_mul_ps(a.v, b.v); }
+
+    friend Float4 operator/(Float4 a, Float4 b) { return _mm_div_ps(a.v, b.v); }
+
+    friend Float4 operator-(Float4 a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)); }
+
+    friend Mask operator<(Float4 a, Float4 b) { return _mm_cmplt_ps(a.v, b.v); }
+
+    friend Float4 select(Mask m, Float4 a, Float4 b) {
+        return _mm_or_ps(_mm_and_ps(m, a.v), _mm_andnot_ps(m, b.v));
+    }
+
+    friend Float4 max(Float4 a, Float4 b) { return _mm_max_ps(a.v, b.v); }
+
+    friend Float4 sqrt(Float4 a) { return _mm_sqrt_ps(a.v); }
+
+    friend Float4 rsqrt(Float4 a) { TC_RSQRT_NEWTON(Float4, _mm_rsqrt_ps(a.v)) }
+};
+
+#endif
+
+#if !defined(TC_DISABLE_SSE) && defined(__AVX__)
+
+struct Float8 {
+    static const int width = 8;
+    using Mask = __m256;
+    __m256 v;
+
+    Float8() {}
+
+    Float8(__m256 v) : v(v) {}
+
+    Float8(float f) : v(_mm256_set1_ps(f)) {}
+
+    static Float8 load(const float *p) {
+        return _mm256_load_ps(p);
+    }
+
+    void store(float *p) const {
+        _mm256_store_ps(p, v);
+    }
+
+    friend Float8 operator+(Float8 a, Float8 b) { return _mm256_add_ps(a.v, b.v); }
+
+    friend Float8 operator-(Float8 a, Float8 b) { return _mm256_sub_ps(a.v, b.v); }
+
+    friend Float8 operator*(Float8 a, Float8 b) { return _mm256_mul_ps(a.v, b.v); }
+
+    friend Float8 operator/(Float8 a, Float8 b) { return _mm256_div_ps(a.v, b.v); }
+
+    friend Float8 operator-(Float8 a) { return _mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f)); }
+
+    friend Mask operator<(Float8 a, Float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+
+    friend Float8 select(Mask m, Float8 a, Float8 b) { return _mm256_blendv_ps(b.v, a.v, m); }
+
+    friend Float8 max(Float8 a, Float8 b) { return _mm256_max_ps(a.v, b.v); }
+
+    friend Float8 sqrt(Float8 a) { return _mm256_sqrt_ps(a.v); }
+
+    friend Float8 rsqrt(Float8 a) { TC_RSQRT_NEWTON(Float8, _mm256_rsqrt_ps(a.v)) }
+};
+
+#endif
+
+#if !defined(TC_DISABLE_SSE) && defined(__AVX512F__)
+
+struct Float16 {
+    static const int width = 16;
+    using Mask = __mmask16;
+    __m512 v;
+
+    Float16() {}
+
+    Float16(__m512 v) : v(v) {}
+
+    Float16(float f) : v(_mm512_set1_ps(f)) {}
+
+    static Float16 load(const float *p) {
+        return _mm512_load_ps(p);
+    }
+
+    void store(float *p) const {
+        _mm512_store_ps(p, v);
+    }
+
+    friend Float16 operator+(Float16 a, Float16 b) { return _mm512_add_ps(a.v, b.v); }
+
+    friend Float16 operator-(Float16 a, Float16 b) { return _mm512_sub_ps(a.v, b.v); }
+
+    friend Float16 operator*(Float16 a, Float16 b) { return _mm512_mul_ps(a.v, b.v); }
+
+    friend Float16 operator/(Float16 a, Float16 b) { return _mm512_div_ps(a.v, b.v); }
+
+    friend Float16 operator-(Float16 a) { return _mm512_sub_ps(_mm512_setzero_ps(), a.v); }
+
+    friend Mask operator<(Float16 a, Float16 b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ); }
+
+    friend Float16 select(Mask m, Float16 a, Float16 b) { return _mm512_mask_blend_ps(m, b.v, a.v); }
+
+    friend Float16 max(Float16 a, Float16 b) { return _mm512_max_ps(a.v, b.v); }
+
+    friend Float16 sqrt(Float16 a) { return _mm512_sqrt_ps(a.v); }
+
+    friend Float16 rsqrt(Float16 a) { TC_RSQRT_NEWTON(Float16, _mm512_rsqrt14_ps(a.v)) }
+};
+
+#endif
+
+#ifdef TC_RSQRT_NEWTON
+#undef TC_RSQRT_NEWTON
+#endif
+
+#if !defined(TC_DISABLE_SSE) && defined(__AVX512F__)
+using SVDLanes = Float16;
+#elif !defined(TC_DISABLE_SSE) && defined(__AVX__)
+using SVDLanes = Float8;
+#elif !defined(TC_DISABLE_SSE) && defined(__SSE2__)
+using SVDLanes = Float4;
+#else
+using SVDLanes = Float1;
+#endif
+
+// Exact rotations converge quadratically; the approximate ones of McAdams et al. need many more
+// sweeps for badly conditioned matrices
+const int svd_jacobi_sweeps = 4;
+
+// Rotates columns p and q of m by (c, s): m_p' = c m_p + s m_q, m_q' = -s m_p + c m_q
+template <typename F>
+inline void rotate_columns(F m[3][3], int p, int q, F c, F s) {
+    for (int i = 0; i < 3; i++) {
+        F mp = m[i][p], mq = m[i][q];
+        m[i][p] = c * mp + s * mq;
+        m[i][q] = c * mq - s * mp;
+    }
+}
+
+// One Jacobi rotation of the symmetric s in the (p, q) plane, zeroing s[p][q], accumulated into v
+template <typename F>
+inline void jacobi_conjugation(F s[3][3], F v[3][3], int p, int q) {
+    const int r = 3 - p - q;
+    // tan(theta) for the smaller of the two possible angles (Numerical Recipes' Jacobi, without the
+    // division by s[p][q] so that it stays finite when the block is already diagonal)
+    F d = s[p][p] - s[q][q];
+    F two_spq = F(2.0f) * s[p][q];
+    F denominator = max(d, -d) + sqrt(d * d + two_spq * two_spq);
+    F t = select(d < F(0.0f), -two_spq, two_spq) / max(denominator, F(1e-30f));
+    F c = rsqrt(F(1.0f) + t * t);
+    F sn = t * c;
+    F spp = s[p][p], sqq = s[q][q], spq = s[p][q], spr = s[p][r], sqr = s[q][r];
+    F cc = c * c, ss = sn * sn, cs = c * sn;
+    s[p][p] = cc * spp + F(2.0f) * cs * spq + ss * sqq;
+    s[q][q] = ss * spp - F(2.0f) * cs * spq + cc * sqq;
+    s[p][q] = s[q][p] = (cc - ss) * spq - cs * (spp - sqq);
+    s[p][r] = s[r][p] = c * spr + sn * sqr;
+    s[q][r] = s[r][q] = c * sqr - sn * spr;
+    rotate_columns(v, p, q, c, sn);
+}
+
+// Swaps columns p and q of b and v where column q of b is longer, negating one to keep det(v)
+template <typename F>
+inline void sort_columns(F b[3][3], F v[3][3], F rho[3], int p, int q) {
+    auto swap = rho[p] < rho[q];
+    for (int i = 0; i < 3; i++) {
+        F bp = b[i][p], bq = b[i][q];
+        b[i][p] = select(swap, bq, bp);
+        b[i][q] = select(swap, -bp, bq);
+        F vp = v[i][p], vq = v[i][q];
+        v[i][p] = select(swap, vq, vp);
+        v[i][q] = select(swap, -vp, vq);
+    }
+    F rp = rho[p];
+    rho[p] = select(swap, rho[q], rp);
+    rho[q] = select(swap, rp, rho[q]);
+}
+
+// Givens rotation of rows p and q of b zeroing b[q][p], accumulated into u
+template <typename F>
+inline void qr_givens(F b[3][3], F u[3][3], int p, int q) {
+    // Below this the column is treated as zero and left alone; it also keeps ch * ch from underflowing
+    const F eps(1e-18f);
+    F a1 = b[p][p], a2 = b[q][p];
+    F rho = sqrt(a1 * a1 + a2 * a2);
+    auto rotate = eps < rho;
+    F sh = select(rotate, a2, F(0.0f));
+    F ch = select(rotate, max(a1, -a1) + rho, F(1.0f));
+    auto negative = a1 < F(0.0f);
+    F tmp = sh;
+    sh = select(negative, ch, sh);
+    ch = select(negative, tmp, ch);
+    F w = rsqrt(ch * ch + sh * sh);
+    ch = ch * w;
+    sh = sh * w;
+    F c = ch * ch - sh * sh;
+    F s = F(2.0f) * sh * ch;
+    for (int j = 0; j < 3; j++) {
+        F bp = b[p][j], bq = b[q][j];
+        b[p][j] = c * bp + s * bq;
+        b[q][j] = c * bq - s * bp;
+    }
+    rotate_columns(u, p, q, c, s);
+}
+
+// a, u, v: [row][column], sig: the diagonal
+template <typename F>
+void svd_lanes(const F a[3][3], F u[3][3], F sig[3], F v[3][3]) {
+    F s[3][3];
+    for (int i = 0; i < 3; i++) {
+        for (int j = i; j < 3; j++) {
+            s[i][j] = a[0][i] * a[0][j] + a[1][i] * a[1][j] + a[2][i] * a[2][j];
+            s[j][i] = s[i][j];
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            v[i][j] = u[i][j] = F(i == j ? 1.0f : 0.0f);
+        }
+    }
+    for (int sweep = 0; sweep < svd_jacobi_sweeps; sweep++) {
+        jacobi_conjugation(s, v, 0, 1);
+        jacobi_conjugation(s, v, 0, 2);
+        jacobi_conjugation(s, v, 1, 2);
+    }
+    F b[3][3], rho[3];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            b[i][j] = a[i][0] * v[0][j] + a[i][1] * v[1][j] + a[i][2] * v[2][j];
+        }
+    }
+    for (int j = 0; j < 3; j++) {
+        rho[j] = b[0][j] * b[0][j] + b[1][j] * b[1][j] + b[2][j] * b[2][j];
+    }
+    sort_columns(b, v, rho, 0, 1);
+    sort_columns(b, v, rho, 0, 2);
+    sort_columns(b, v, rho, 1, 2);
+    qr_givens(b, u, 0, 1);
+    qr_givens(b, u, 0, 2);
+    qr_givens(b, u, 1, 2);
+    // Same convention as imp_svd: non-negative singular values, with the sign moved into u
+    for (int j = 0; j < 3; j++) {
+        auto negative = b[j][j] < F(0.0f);
+        sig[j] = select(negative, -b[j][j], b[j][j]);
+        for (int i = 0; i < 3; i++) {
+            u[i][j] = select(negative, -u[i][j], u[i][j]);
+        }
+    }
+}
+
+void svd_batch(int n, const Matrix3 *m, Matrix3 *u, Matrix3 *sig, Matrix3 *v) {
+    using F = SVDLanes;
+    const int W = F::width;
+    // Lane transposes: element (row i, column j) of matrix k goes to buffer[i][j][k]
+    alignas(64) float buffer_a[3][3][W], buffer_u[3][3][W], buffer_v[3][3][W], buffer_sig[3][W];
+    for (int base = 0; base < n; base += W) {
+        const int count = std::min(W, n - base);
+        for (int k = 0; k < W; k++) {
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    // Unused lanes decompose the identity
+                    buffer_a[i][j][k] = k < count ? m[base + k][j][i] : real(i == j);
+                }
+            }
+        }
+        F a[3][3], lane_u[3][3], lane_v[3][3], lane_sig[3];
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                a[i][j] = F::load(buffer_a[i][j]);
+            }
+        }
+        svd_lanes(a, lane_u, lane_sig, lane_v);
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                lane_u[i][j].store(buffer_u[i][j]);
+                lane_v[i][j].store(buffer_v[i][j]);
+            }
+            lane_sig[i].store(buffer_sig[i]);
+        }
+        for (int k = 0; k < count; k++) {
+            Matrix3 &out_u = u[base + k], &out_v = v[base + k], &out_sig = sig[base + k];
+            out_sig = Matrix3(0.0f);
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    out_u[j][i] = buffer_u[i][j][k];
+                    out_v[j][i] = buffer_v[i][j][k];
+                }
+                out_sig[i][i] = buffer_sig[i][k];
+            }
+        }
+    }
+}
+
+} // namespace TC_CPU_DISPATCH_NAMESPACE
+
+TC_NAMESPACE_END
@@ -0,0 +1,110 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <taichi/system/threading.h>
+
+TC_NAMESPACE_BEGIN
+
+// Replaces v[i] by the sum of v[0, i) and returns the total, with chunk sums computed in parallel
+inline int exclusive_scan(std::vector<int> &v, int num_threads = 1) {
+    const int n = (int)v.size();
+    const int num_chunks = std::max(1, std::min(num_threads * 4, n / 16384));
+    std::vector<int> chunk_sums(num_chunks + 1, 0);
+    auto chunk_begin = [&](int c) {
+        return (int)((int64)n * c / num_chunks);
+    };
+    parallel_for(0, num_chunks, num_threads, [&](int c) {
+        int sum = 0;
+        for (int i = chunk_begin(c); i < chunk_begin(c + 1); i++) {
+            sum += v[i];
+        }
+        chunk_sums[c + 1] = sum;
+    }, 1);
+    for (int c = 0; c < num_chunks; c++) {
+        chunk_sums[c + 1] += chunk_sums[c];
+    }
+    parallel_for(0, num_chunks, num_threads, [&](int c) {
+        int sum = chunk_sums[c];
+        for (int i = chunk_begin(c); i < chunk_begin(c + 1); i++) {
+            const int count = v[i];
+            v[i] = sum;
+            sum += count;
+        }
+    }, 1);
+    return chunk_sums[num_chunks];
+}
+
+// A key that radix_sort() on 32 bits orders as x, with -0 and 0 equal
+inline uint64 float_sort_key(float x) {
+    x += 0.0f;
+    unsigned int bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    return (bits >> 31) ? ~bits : bits | 0x80000000u;
+}
+
+// Stable LSD radix sort of keys, with values permuted along, on the lowest key_bits bits of the keys.
+// Every pass histograms contiguous chunks in parallel, then scatters them in parallel; passes whose
+// digit is the same for all keys are skipped. The result does not depend on num_threads.
+template <typename V, typename KeyAllocator, typename ValueAllocator>
+inline void radix_sort(std::vector<uint64, KeyAllocator> &keys, std::vector<V, ValueAllocator> &values,
+                       int key_bits = 64, int num_threads = 1) {
+    const int digit_bits = 8, num_buckets = 1 << digit_bits;
+    const int n = (int)keys.size();
+    assert_info((int)values.size() == n, "radix_sort needs one value per key");
+    const int num_chunks = std::max(1, std::min(num_threads * 4, n / 16384));
+    std::vector<uint64, KeyAllocator> sorted_keys(n);
+    std::vector<V, ValueAllocator> sorted_values(n);
+    // offsets[c * num_buckets + d]: where chunk c puts its first key with digit d
+    std::vector<int> offsets(num_chunks * num_buckets);
+    auto chunk_begin = [&](int c) {
+        return (int)((int64)n * c / num_chunks);
+    };
+    for (int shift = 0; shift < key_bits; shift += digit_bits) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        parallel_for(0, num_chunks, num_threads, [&](int c) {
+            int *histogram = &offsets[c * num_buckets];
+            for (int i = chunk_begin(c); i < chunk_begin(c + 1); i++) {
+                histogram[(keys[i] >> shift) & (num_buckets - 1)]++;
+            }
+        }, 1);
+        int total = 0;
+        bool one_bucket = false;
+        for (int d = 0; d < num_buckets; d++) {
+            int bucket_size = 0;
+            for (int c = 0; c < num_chunks; c++) {
+                int count = offsets[c * num_buckets + d];
+                offsets[c * num_buckets + d] = total + bucket_size;
+                bucket_size += count;
+            }
+            one_bucket = one_bucket || bucket_size == n;
+            total += bucket_size;
+        }
+        if (one_bucket) {
+            continue;
+        }
+        parallel_for(0, num_chunks, num_threads, [&](int c) {
+            int *offset = &offsets[c * num_buckets];
+            for (int i = chunk_begin(c); i < chunk_begin(c + 1); i++) {
+                int &o = offset[(keys[i] >> shift) & (num_buckets - 1)];
+                sorted_keys[o] = keys[i];
+                sorted_values[o] = values[i];
+                o++;
+            }
+        }, 1);
+        keys.swap(sorted_keys);
+        values.swap(sorted_values);
+    }
+}
+
+TC_NAMESPACE_END
@@ -21,6 +21,22 @@ public:
 
     virtual real eval(const Vector3 &p) const { return 1; }
 
+    // Sphere traces from orig along the unit vector dir: the distance to the first point where eval() is below
+    // threshold, or the distance reached once beyond limit or after max_steps steps
+    virtual real march(const Vector3 &orig, const Vector3 &dir, real limit, real threshold, int max_steps) const {
+        real dist = 0;
+        for (int i = 0; i < max_steps; i++) {
+            real d = eval(orig + dist * dir);
+            if (d < threshold) {
+                break;
+            }
+            dist += d;
+            if (dist > limit) {
+                break;
+            }
+        }
+        return dist;
+    }
 };
 
 namespace sdf {
@@ -0,0 +1,431 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+#include <taichi/math/math_util.h>
+
+#if !defined(TC_DISABLE_SSE) && !defined(TC_USE_SSE)
+#define TC_USE_SSE
+#endif
+
+#ifdef TC_USE_SSE
+#include <immintrin.h>
+#endif
+
+TC_NAMESPACE_BEGIN
+
+// SIMD counterparts of the glm vectors, for hot kernels that would otherwise need intrinsics at every call site.
+// Conversions to and from glm are explicit, so that glm code keeps its types. With TC_DISABLE_SSE, everything
+// falls back to plain loops over the lanes.
+
+// A Vector3 (dim = 3) or Vector4 (dim = 4) in one 16-byte aligned SSE register, so that arrays of them load with
+// aligned SSE and each operation is a single instruction. Vector3A keeps w at 0, so that dot and length need no
+// masking.
+template <int dim>
+struct alignas(16) VectorA {
+    static_assert(dim == 3 || dim == 4, "VectorA is of 3 or 4 dimensions");
+    typedef typename std::conditional<dim == 3, Vector3, Vector4>::type GLMVector;
+
+    union {
+#ifdef TC_USE_SSE
+        __m128 v;
+#endif
+        real d[4];
+        struct {
+            real x, y, z, w;
+        };
+    };
+
+    VectorA() : VectorA(0.0f) {}
+
+    explicit VectorA(real s) : VectorA(s, s, s, s) {}
+
+    VectorA(real x, real y, real z, real w = 0.0f) {
+#ifdef TC_USE_SSE
+        v = _mm_set_ps(dim == 3 ? 0.0f : w, z, y, x);
+#else
+        d[0] = x;
+        d[1] = y;
+        d[2] = z;
+        d[3] = dim == 3 ? 0.0f : w;
+#endif
+    }
+
+    explicit VectorA(const Vector3 &a) : VectorA(a.x, a.y, a.z, 0.0f) {}
+
+    explicit VectorA(const Vector4 &a) : VectorA(a.x, a.y, a.z, a.w) {}
+
+#ifdef TC_USE_SSE
+    explicit VectorA(__m128 v) : v(v) {}
+#endif
+
+    GLMVector to_glm() const {
+        return to_glm(std::integral_constant<int, dim>());
+    }
+
+    real &operator[](int i) {
+        return d[i];
+    }
+
+    const real &operator[](int i) const {
+        return d[i];
+    }
+
+    VectorA operator+(const VectorA &o) const {
+#ifdef TC_USE_SSE
+        return VectorA(_mm_add_ps(v, o.v));
+#else
+        return map(o, [](real a, real b) { return a + b; });
+#endif
+    }
+
+    VectorA operator-(const VectorA &o) const {
+#ifdef TC_USE_SSE
+        return VectorA(_mm_sub_ps(v, o.v));
+#else
+        return map(o, [](real a, real b) { return a - b; });
+#endif
+    }
+
+    VectorA operator*(const VectorA &o) const {
+#ifdef TC_USE_SSE
+        return VectorA(_mm_mul_ps(v, o.v));
+#else
+        return map(o, [](real a, real b) { return a * b; });
+#endif
+    }
+
+    // w / w of Vector3A would be 0 / 0, so it is divided by 1 instead
+    VectorA operator/(const VectorA &o) const {
+#ifdef TC_USE_SSE
+        return VectorA(_mm_div_ps(v, dim == 3 ? _mm_set_ps(1.0f, o.z, o.y, o.x) : o.v));
+#else
+        VectorA r = map(o, [](real a, real b) { return a / b; });
+        if (dim == 3) {
+            r.w = 0.0f;
+        }
+        return r;
+#endif
+    }
+
+    VectorA operator*(real s) const {
+        return *this * VectorA(s);
+    }
+
+    VectorA operator/(real s) const {
+        return *this * VectorA(1.0f / s);
+    }
+
+    VectorA operator-() const {
+        return VectorA(0.0f) - *this;
+    }
+
+    VectorA &operator+=(const VectorA &o) {
+        return *this = *this + o;
+    }
+
+    VectorA &operator-=(const VectorA &o) {
+        return *this = *this - o;
+    }
+
+    VectorA &operator*=(const VectorA &o) {
+        return *this = *this * o;
+    }
+
+    VectorA &operator*=(real s) {
+        return *this = *this * s;
+    }
+
+    // The lane sum
+    real sum() const {
+#ifdef TC_USE_SSE
+        __m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+        s = _mm_add_ss(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 1, 1, 1)));
+        return _mm_cvtss_f32(s);
+#else
+        return (d[0] + d[2]) + (d[1] + d[3]);
+#endif
+    }
+
+private:
+#ifndef TC_USE_SSE
+    template <typename F>
+    VectorA map(const VectorA &o, const F &f) const {
+        VectorA r;
+        for (int i = 0; i < 4; i++) {
+            r.d[i] = f(d[i], o.d[i]);
+        }
+        return r;
+    }
+#endif
+
+    Vector3 to_glm(std::integral_constant<int, 3>) const {
+        return Vector3(x, y, z);
+    }
+
+    Vector4 to_glm(std::integral_constant<int, 4>) const {
+        return Vector4(x, y, z, w);
+    }
+};
+
+typedef VectorA<3> Vector3A;
+typedef VectorA<4> Vector4A;
+
+template <int dim>
+inline VectorA<dim> operator*(real s, const VectorA<dim> &a) {
+    return a * s;
+}
+
+template <int dim>
+inline real dot(const VectorA<dim> &a, const VectorA<dim> &b) {
+    return (a * b).sum();
+}
+
+template <int dim>
+inline real length(const VectorA<dim> &a) {
+    return std::sqrt(dot(a, a));
+}
+
+template <int dim>
+inline VectorA<dim> normalized(const VectorA<dim> &a) {
+    return a * (1.0f / length(a));
+}
+
+template <int dim>
+inline VectorA<dim> min(const VectorA<dim> &a, const VectorA<dim> &b) {
+#ifdef TC_USE_SSE
+    return VectorA<dim>(_mm_min_ps(a.v, b.v));
+#else
+    return VectorA<dim>(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z), std::min(a.w, b.w));
+#endif
+}
+
+template <int dim>
+inline VectorA<dim> max(const VectorA<dim> &a, const VectorA<dim> &b) {
+#ifdef TC_USE_SSE
+    return VectorA<dim>(_mm_max_ps(a.v, b.v));
+#else
+    return VectorA<dim>(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z), std::max(a.w, b.w));
+#endif
+}
+
+inline Vector3A cross(const Vector3A &a, const Vector3A &b) {
+#ifdef TC_USE_SSE
+    const __m128 a_yzx = _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(3, 0, 2, 1));
+    const __m128 b_yzx = _mm_shuffle_ps(b.v, b.v, _MM_SHUFFLE(3, 0, 2, 1));
+    const __m128 c = _mm_sub_ps(_mm_mul_ps(a.v, b_yzx), _mm_mul_ps(a_yzx, b.v));
+    return Vector3A(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+#else
+    return Vector3A(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+#endif
+}
+
+// N lanes of real for structure-of-arrays kernels, e.g. one particle or grid node per lane. The lanes are
+// aligned to N * sizeof(real) bytes and every operation is a plain loop over them, which the compiler turns into
+// single instructions for N = 4 (SSE) and N = 8 (AVX, with -march=native on AVX machines). Arrays of them need an
+// AlignedVector.
+template <int N>
+struct alignas(N * sizeof(real)) VectorN {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "VectorN needs a power of 2 of lanes");
+    static const int num_lanes = N;
+
+    real d[N];
+
+    VectorN() {}
+
+    VectorN(real s) {
+        for (int i = 0; i < N; i++) {
+            d[i] = s;
+        }
+    }
+
+    // From N consecutive reals, aligned as VectorN
+    static VectorN load(const real *p) {
+        VectorN r;
+        for (int i = 0; i < N; i++) {
+            r.d[i] = p[i];
+        }
+        return r;
+    }
+
+    // p[indices[i]] for every lane i
+    static VectorN gather(const real *p, const int *indices) {
+        VectorN r;
+        for (int i = 0; i < N; i++) {
+            r.d[i] = p[indices[i]];
+        }
+        return r;
+    }
+
+    void store(real *p) const {
+        for (int i = 0; i < N; i++) {
+            p[i] = d[i];
+        }
+    }
+
+    real &operator[](int i) {
+        return d[i];
+    }
+
+    const real &operator[](int i) const {
+        return d[i];
+    }
+
+#define TC_VECTOR_N_OPERATOR(op)                          \
+    VectorN operator op(const VectorN &o) const {         \
+        VectorN r;                                        \
+        for (int i = 0; i < N; i++) {                     \
+            r.d[i] = d[i] op o.d[i];                      \
+        }                                                 \
+        return r;                                         \
+    }                                                     \
+    VectorN &operator op##=(const VectorN &o) {           \
+        for (int i = 0; i < N; i++) {                     \
+            d[i] op##= o.d[i];                            \
+        }                                                 \
+        return *this;                                     \
+    }
+
+    TC_VECTOR_N_OPERATOR(+)
+    TC_VECTOR_N_OPERATOR(-)
+    TC_VECTOR_N_OPERATOR(*)
+    TC_VECTOR_N_OPERATOR(/)
+
+#undef TC_VECTOR_N_OPERATOR
+
+    VectorN operator-() const {
+        return VectorN(0.0f) - *this;
+    }
+
+    // The lane sum, pairwise
+    real sum() const {
+        VectorN s = *this;
+        for (int width = N / 2; width > 0; width /= 2) {
+            for (int i = 0; i < width; i++) {
+                s.d[i] += s.d[i + width];
+            }
+        }
+        return s.d[0];
+    }
+};
+
+template <int N>
+inline VectorN<N> operator*(real s, const VectorN<N> &a) {
+    return VectorN<N>(s) * a;
+}
+
+template <int N>
+inline VectorN<N> min(const VectorN<N> &a, const VectorN<N> &b) {
+    VectorN<N> r;
+    for (int i = 0; i < N; i++) {
+        r.d[i] = a.d[i] < b.d[i] ? a.d[i] : b.d[i];
+    }
+    return r;
+}
+
+template <int N>
+inline VectorN<N> max(const VectorN<N> &a, const VectorN<N> &b) {
+    VectorN<N> r;
+    for (int i = 0; i < N; i++) {
+        r.d[i] = a.d[i] > b.d[i] ? a.d[i] : b.d[i];
+    }
+    return r;
+}
+
+template <int N>
+inline VectorN<N> sqrt(const VectorN<N> &a) {
+    VectorN<N> r;
+    for (int i = 0; i < N; i++) {
+        r.d[i] = std::sqrt(a.d[i]);
+    }
+    return r;
+}
+
+template <int N>
+inline VectorN<N> abs(const VectorN<N> &a) {
+    VectorN<N> r;
+    for (int i = 0; i < N; i++) {
+        r.d[i] = std::abs(a.d[i]);
+    }
+    return r;
+}
+
+// a where mask > 0, and b elsewhere, e.g. with mask = phi of every lane
+template <int N>
+inline VectorN<N> select(const VectorN<N> &mask, const VectorN<N> &a, const VectorN<N> &b) {
+    VectorN<N> r;
+    for (int i = 0; i < N; i++) {
+        r.d[i] = mask.d[i] > 0 ? a.d[i] : b.d[i];
+    }
+    return r;
+}
+
+// N Vector3s, one per lane, as three VectorN of their components
+template <int N>
+struct Vector3N {
+    VectorN<N> x, y, z;
+
+    Vector3N() {}
+
+    Vector3N(const VectorN<N> &x, const VectorN<N> &y, const VectorN<N> &z) : x(x), y(y), z(z) {}
+
+    explicit Vector3N(const Vector3 &a) : x(a.x), y(a.y), z(a.z) {}
+
+    // Of lane i
+    Vector3 get(int i) const {
+        return Vector3(x.d[i], y.d[i], z.d[i]);
+    }
+
+    void set(int i, const Vector3 &a) {
+        x.d[i] = a.x;
+        y.d[i] = a.y;
+        z.d[i] = a.z;
+    }
+
+    Vector3N operator+(const Vector3N &o) const {
+        return Vector3N(x + o.x, y + o.y, z + o.z);
+    }
+
+    Vector3N operator-(const Vector3N &o) const {
+        return Vector3N(x - o.x, y - o.y, z - o.z);
+    }
+
+    Vector3N operator*(const VectorN<N> &s) const {
+        return Vector3N(x * s, y * s, z * s);
+    }
+
+    Vector3N &operator+=(const Vector3N &o) {
+        return *this = *this + o;
+    }
+
+    Vector3N &operator-=(const Vector3N &o) {
+        return *this = *this - o;
+    }
+};
+
+template <int N>
+inline VectorN<N> dot(const Vector3N<N> &a, const Vector3N<N> &b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+template <int N>
+inline Vector3N<N> cross(const Vector3N<N> &a, const Vector3N<N> &b) {
+    return Vector3N<N>(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+}
+
+template <int N>
+inline VectorN<N> length(const Vector3N<N> &a) {
+    return sqrt(dot(a, a));
+}
+
+TC_NAMESPACE_END
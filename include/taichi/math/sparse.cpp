@@ -0,0 +1,264 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#define TC_CPU_DISPATCH_NAMESPACE cpu_baseline
+#include "sparse_kernels.h"
+#include <algorithm>
+#include <taichi/math/sparse.h>
+#include <taichi/system/cpu_dispatch.h>
+#include <taichi/system/threading.h>
+
+TC_NAMESPACE_BEGIN
+
+TC_DECLARE_CPU_VARIANTS(void, sparse_multiply_rows, (const int *row_offsets, const int *columns, const real *vals,
+                                                     bool symmetric, const real *x, real *y, int begin, int end))
+
+real SparseMatrix::get(int i, int j) const {
+    if (symmetric && j < i) {
+        return get(j, i);
+    }
+    const int *row_offsets = get_row_offsets(), *columns = get_column_indices();
+    const int *begin = columns + row_offsets[i], *end = columns + row_offsets[i + 1];
+    const int *it = std::lower_bound(begin, end, j);
+    if (it == end || *it != j) {
+        return 0;
+    }
+    return get_values()[it - columns];
+}
+
+void SparseMatrix::multiply_rows(const real *x, real *y, int begin, int end) const {
+    static const auto kernel = TC_CPU_VARIANT(sparse_multiply_rows);
+    kernel(get_row_offsets(), get_column_indices(), get_values(), symmetric, x, y, begin, end);
+}
+
+void SparseMatrix::multiply(const real *x, real *y, int num_threads) const {
+    const int num_rows = get_num_rows();
+    if (!symmetric) {
+        // In blocks of rows, so that the kernel is called once per block
+        const int block_size = 256;
+        parallel_for(0, (num_rows + block_size - 1) / block_size, num_threads, [&](int k) {
+            multiply_rows(x, y, k * block_size, std::min(num_rows, (k + 1) * block_size));
+        }, 1);
+        return;
+    }
+    std::fill(y, y + num_rows, real(0));
+    if (num_threads <= 1 || num_rows < 1024) {
+        multiply_rows(x, y, 0, num_rows);
+        return;
+    }
+    // The transposed scatter races across threads, so every chunk of rows accumulates into
+    // its own buffer, which covers the rows from the chunk on. The buffers are summed after.
+    const int num_chunks = num_threads;
+    std::vector<int> chunk_begin(num_chunks + 1);
+    for (int c = 0; c <= num_chunks; c++) {
+        chunk_begin[c] = (int)((int64)num_rows * c / num_chunks);
+    }
+    std::vector<std::vector<real>> buffers(num_chunks);
+    parallel_for(0, num_chunks, num_threads, [&](int c) {
+        const int begin = chunk_begin[c];
+        if (c == 0) {
+            multiply_rows(x, y, begin, chunk_begin[1]);
+            return;
+        }
+        buffers[c].assign(num_rows - begin, real(0));
+        // Offsetting the buffer by the chunk begin lets it be indexed by row
+        multiply_rows(x, buffers[c].data() - begin, begin, chunk_begin[c + 1]);
+    }, 1);
+    parallel_for(0, num_rows, num_threads, [&](int i) {
+        for (int c = 1; c < num_chunks && chunk_begin[c] <= i; c++) {
+            y[i] += buffers[c][i - chunk_begin[c]];
+        }
+    }, 1024);
+}
+
+// Rows of the chunks, for the builders filled in parallel
+inline std::vector<int> get_row_chunks(int num_rows, int num_threads) {
+    const int num_chunks = std::max(1, std::min(num_threads, num_rows / 1024));
+    std::vector<int> chunk_begin(num_chunks + 1);
+    for (int c = 0; c <= num_chunks; c++) {
+        chunk_begin[c] = (int)((int64)num_rows * c / num_chunks);
+    }
+    return chunk_begin;
+}
+
+SparseMatrix SparseMatrix::transpose(int num_threads) const {
+    assert_info(!symmetric, "Transposing symmetric storage");
+    const int *row_offsets = get_row_offsets(), *columns = get_column_indices();
+    const real *vals = get_values();
+    const std::vector<int> chunk_begin = get_row_chunks(get_num_rows(), num_threads);
+    const int num_chunks = (int)chunk_begin.size() - 1;
+    std::vector<SparseMatrixBuilder> builders(num_chunks, SparseMatrixBuilder(get_num_cols(), get_num_rows()));
+    parallel_for(0, num_chunks, num_threads, [&](int c) {
+        builders[c].reserve(row_offsets[chunk_begin[c + 1]] - row_offsets[chunk_begin[c]]);
+        for (int i = chunk_begin[c]; i < chunk_begin[c + 1]; i++) {
+            for (int k = row_offsets[i]; k < row_offsets[i + 1]; k++) {
+                builders[c].insert(columns[k], i, vals[k]);
+            }
+        }
+    }, 1);
+    for (int c = 1; c < num_chunks; c++) {
+        builders[0].append(builders[c]);
+    }
+    return builders[0].build(false, num_threads);
+}
+
+SparseMatrix SparseMatrix::product(const SparseMatrix &b, int num_threads) const {
+    assert_info(!symmetric && !b.symmetric, "Multiplying symmetric storage");
+    assert_info(get_num_cols() == b.get_num_rows(), "Dimension mismatch");
+    const int *a_offsets = get_row_offsets(), *a_columns = get_column_indices();
+    const int *b_offsets = b.get_row_offsets(), *b_columns = b.get_column_indices();
+    const real *a_values = get_values(), *b_values = b.get_values();
+    const int num_rows = get_num_rows(), num_cols = b.get_num_cols();
+    const std::vector<int> chunk_begin = get_row_chunks(num_rows, num_threads);
+    const int num_chunks = (int)chunk_begin.size() - 1;
+    // Every chunk computes its rows into its own buffers, which are then copied to the storage.
+    // Rows are compressed and sorted as they are computed, so this needs no triplets.
+    std::vector<std::vector<int>> chunk_columns(num_chunks);
+    std::vector<std::vector<real>> chunk_values(num_chunks);
+    std::vector<int> row_sizes(num_rows);
+    parallel_for(0, num_chunks, num_threads, [&](int c) {
+        // Every row is accumulated densely, over the columns it touches
+        std::vector<real> accumulator(num_cols, 0.0f);
+        std::vector<int> position(num_cols, -1);
+        std::vector<int> touched;
+        for (int i = chunk_begin[c]; i < chunk_begin[c + 1]; i++) {
+            for (int k = a_offsets[i]; k < a_offsets[i + 1]; k++) {
+                const int row = a_columns[k];
+                const real a = a_values[k];
+                for (int l = b_offsets[row]; l < b_offsets[row + 1]; l++) {
+                    const int j = b_columns[l];
+                    if (position[j] != i) {
+                        position[j] = i;
+                        touched.push_back(j);
+                    }
+                    accumulator[j] += a * b_values[l];
+                }
+            }
+            std::sort(touched.begin(), touched.end());
+            for (int j : touched) {
+                chunk_columns[c].push_back(j);
+                chunk_values[c].push_back(accumulator[j]);
+                accumulator[j] = 0.0f;
+            }
+            row_sizes[i] = (int)touched.size();
+            touched.clear();
+        }
+    }, 1);
+    SparseMatrix matrix;
+    EigenMatrix &storage = matrix.storage;
+    storage.resize(num_rows, num_cols);
+    int *row_offsets = storage.outerIndexPtr();
+    row_offsets[0] = 0;
+    for (int i = 0; i < num_rows; i++) {
+        row_offsets[i + 1] = row_offsets[i] + row_sizes[i];
+    }
+    storage.resizeNonZeros(row_offsets[num_rows]);
+    int *columns = storage.innerIndexPtr();
+    real *values = storage.valuePtr();
+    parallel_for(0, num_chunks, num_threads, [&](int c) {
+        const int dst = row_offsets[chunk_begin[c]];
+        std::copy(chunk_columns[c].begin(), chunk_columns[c].end(), columns + dst);
+        std::copy(chunk_values[c].begin(), chunk_values[c].end(), values + dst);
+    }, 1);
+    return matrix;
+}
+
+SparseMatrix SparseMatrixBuilder::build(bool symmetric, int num_threads) const {
+    assert_info(!symmetric || num_rows == num_cols, "Symmetric storage needs a square matrix");
+    SparseMatrix matrix;
+    matrix.symmetric = symmetric;
+    const int num_triplets = (int)triplets.size();
+    const int num_chunks = std::max(1, std::min(num_threads, num_triplets / 4096));
+    std::vector<int> chunk_begin(num_chunks + 1);
+    for (int c = 0; c <= num_chunks; c++) {
+        chunk_begin[c] = (int)((int64)num_triplets * c / num_chunks);
+    }
+    auto kept = [&](const Triplet &t) {
+        return !symmetric || t.j >= t.i;
+    };
+
+    // Step 1: count the triplets of every row, per chunk
+    std::vector<std::vector<int>> counts(num_chunks, std::vector<int>(num_rows + 1, 0));
+    parallel_for(0, num_chunks, num_threads, [&](int c) {
+        for (int k = chunk_begin[c]; k < chunk_begin[c + 1]; k++) {
+            const Triplet &t = triplets[k];
+            assert_info(0 <= t.i && t.i < num_rows && 0 <= t.j && t.j < num_cols, "Index out of range");
+            if (kept(t)) {
+                counts[c][t.i]++;
+            }
+        }
+    }, 1);
+
+    // Step 2: turn the counts into write positions. Chunks are laid out in order within every row,
+    // so the scatter is stable and duplicates get summed in insertion order.
+    std::vector<int> bucket_offsets(num_rows + 1, 0);
+    int total = 0;
+    for (int i = 0; i < num_rows; i++) {
+        bucket_offsets[i] = total;
+        for (int c = 0; c < num_chunks; c++) {
+            const int count = counts[c][i];
+            counts[c][i] = total;
+            total += count;
+        }
+    }
+    bucket_offsets[num_rows] = total;
+
+    // Step 3: scatter to the row buckets
+    std::vector<std::pair<int, real>> buckets(total);
+    parallel_for(0, num_chunks, num_threads, [&](int c) {
+        std::vector<int> &position = counts[c];
+        for (int k = chunk_begin[c]; k < chunk_begin[c + 1]; k++) {
+            const Triplet &t = triplets[k];
+            if (kept(t)) {
+                buckets[position[t.i]++] = std::make_pair(t.j, t.value);
+            }
+        }
+    }, 1);
+    counts.clear();
+
+    // Step 4: sort every row by column and merge duplicates in place
+    std::vector<int> row_sizes(num_rows);
+    parallel_for(0, num_rows, num_threads, [&](int i) {
+        auto begin = buckets.begin() + bucket_offsets[i], end = buckets.begin() + bucket_offsets[i + 1];
+        std::stable_sort(begin, end, [](const std::pair<int, real> &a, const std::pair<int, real> &b) {
+            return a.first < b.first;
+        });
+        auto out = begin;
+        for (auto it = begin; it != end; ++it) {
+            if (out != begin && (out - 1)->first == it->first) {
+                (out - 1)->second += it->second;
+            } else {
+                *out++ = *it;
+            }
+        }
+        row_sizes[i] = (int)(out - begin);
+    }, 256);
+
+    // Step 5: compact into the (compressed) Eigen storage
+    SparseMatrix::EigenMatrix &storage = matrix.storage;
+    storage.resize(num_rows, num_cols);
+    int *row_offsets = storage.outerIndexPtr();
+    row_offsets[0] = 0;
+    for (int i = 0; i < num_rows; i++) {
+        row_offsets[i + 1] = row_offsets[i] + row_sizes[i];
+    }
+    storage.resizeNonZeros(row_offsets[num_rows]);
+    int *columns = storage.innerIndexPtr();
+    real *values = storage.valuePtr();
+    parallel_for(0, num_rows, num_threads, [&](int i) {
+        const int src = bucket_offsets[i], dst = row_offsets[i];
+        for (int k = 0; k < row_sizes[i]; k++) {
+            columns[dst + k] = buckets[src + k].first;
+            values[dst + k] = buckets[src + k].second;
+        }
+    }, 256);
+    return matrix;
+}
+
+TC_NAMESPACE_END
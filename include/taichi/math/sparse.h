@@ -9,56 +9,137 @@
 
 #pragma once
 
+#include <vector>
+#include <Eigen/SparseCore>
 #include <taichi/math/linalg.h>
 #include <taichi/math/array_1d.h>
 
 TC_NAMESPACE_BEGIN
 
+// Compressed sparse row (CSR) matrix. Build it with SparseMatrixBuilder.
+// With symmetric storage, only the upper triangle (j >= i) is stored.
 class SparseMatrix {
-private:
-    struct Entry {
-        int j;
-        real val;
-
-        Entry() {}
+public:
+    // The CSR arrays are those of an Eigen matrix, so Eigen's solvers can take get_eigen_matrix()
+    // without a copy. With symmetric storage, tell them to use the upper triangle,
+    // e.g. Eigen::ConjugateGradient<SparseMatrix::EigenMatrix, Eigen::Upper>.
+    // The direct solvers (SimplicialLDLT, SparseLU...) factor a column-major copy in any case.
+    // (Include Eigen's solver headers before taichi's, whose error() macro they would hit.)
+    typedef Eigen::SparseMatrix<real, Eigen::RowMajor, int> EigenMatrix;
 
-        Entry(int j, real val) : j(j), val(val) {}
-    };
+protected:
+    bool symmetric = false;
+    // Compressed: row i has the entries [row_offsets[i], row_offsets[i + 1]), sorted by column
+    EigenMatrix storage;
 
-    //TODO: This is slow... make some low-level optimizations here...
-    std::vector<std::vector<Entry>> entries;
+    friend class SparseMatrixBuilder;
 
-    int n;
+    void multiply_rows(const real *x, real *y, int begin, int end) const;
 
 public:
+    SparseMatrix() {}
 
-    SparseMatrix(int n) : n(n) {
-        entries.resize(n);
+    int get_num_rows() const {
+        return (int)storage.rows();
     }
 
-    SparseMatrix() {}
+    int get_num_cols() const {
+        return (int)storage.cols();
+    }
 
-    void insert(int i, int j, real value) {
-        for (int k = 0; k < (int)entries[i].size(); k++) {
-            if (entries[i][k].j == j) {
-                entries[i][k].val += value;
-                return;
-            }
-        }
-        entries[i].push_back(Entry(j, value));
+    int get_num_nonzeros() const {
+        return (int)storage.nonZeros();
     }
 
-    void clear() {
-        for (int i = 0; i < n; i++) {
-            entries[i].clear();
-        }
+    bool is_symmetric() const {
+        return symmetric;
     }
 
-    Array1D multiply(const Array1D &x) {
-        Array1D y(x.get_dim());
+    const int *get_row_offsets() const {
+        return storage.outerIndexPtr();
+    }
+
+    const int *get_column_indices() const {
+        return storage.innerIndexPtr();
+    }
 
+    const real *get_values() const {
+        return storage.valuePtr();
+    }
+
+    // For updating values in place, keeping the sparsity pattern
+    real *get_values() {
+        return storage.valuePtr();
+    }
+
+    const EigenMatrix &get_eigen_matrix() const {
+        return storage;
+    }
+
+    // Zero if (i, j) is not stored
+    real get(int i, int j) const;
+
+    // y = A x. x and y must not alias.
+    void multiply(const real *x, real *y, int num_threads = 1) const;
+
+    Array1D<real> multiply(const Array1D<real> &x, int num_threads = 1) const {
+        assert_info(x.size == get_num_cols(), "Dimension mismatch");
+        Array1D<real> y(get_num_rows());
+        multiply(x.data.data(), y.data.data(), num_threads);
         return y;
     }
+
+    // A^T. Non-symmetric storage only.
+    SparseMatrix transpose(int num_threads = 1) const;
+
+    // A B, row by row with a dense accumulator. Non-symmetric storage only.
+    SparseMatrix product(const SparseMatrix &b, int num_threads = 1) const;
+};
+
+// Collects (i, j, value) triplets in any order. Duplicates are summed, in insertion order,
+// when the matrix is built. Builders filled by different threads can be merged with append().
+class SparseMatrixBuilder {
+protected:
+    struct Triplet {
+        int i, j;
+        real value;
+
+        Triplet() {}
+
+        Triplet(int i, int j, real value) : i(i), j(j), value(value) {}
+    };
+
+    int num_rows, num_cols;
+    std::vector<Triplet> triplets;
+
+public:
+    SparseMatrixBuilder(int num_rows, int num_cols) : num_rows(num_rows), num_cols(num_cols) {}
+
+    void reserve(int num_triplets) {
+        triplets.reserve(num_triplets);
+    }
+
+    void insert(int i, int j, real value) {
+        triplets.push_back(Triplet(i, j, value));
+    }
+
+    void append(const SparseMatrixBuilder &other) {
+        assert_info(other.num_rows == num_rows && other.num_cols == num_cols, "Dimension mismatch");
+        triplets.insert(triplets.end(), other.triplets.begin(), other.triplets.end());
+    }
+
+    void clear() {
+        triplets.clear();
+    }
+
+    int get_num_triplets() const {
+        return (int)triplets.size();
+    }
+
+    // Scatters the triplets to their rows, then sorts and compresses every row.
+    // With symmetric storage, triplets below the diagonal are dropped, so either the upper
+    // triangle or the full (symmetric) matrix can be inserted.
+    SparseMatrix build(bool symmetric = false, int num_threads = 1) const;
 };
 
 TC_NAMESPACE_END
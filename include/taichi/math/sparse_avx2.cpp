@@ -1,11 +1,12 @@
 /*******************************************************************************
     Taichi - Physically based Computer Graphics Library
 
-    Copyright (c) 2016 Yuanming Hu <yuanmhu@gmail.com>
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
 
     All rights reserved. Use of this source code is governed by
     the MIT license as written in the LICENSE file.
 *******************************************************************************/
 
-#include "MemoryAllocator.h"
-
+// The AVX2 variant of the kernels of sparse.cpp
+#define TC_CPU_DISPATCH_NAMESPACE cpu_avx2
+#include "sparse_kernels.h"
@@ -0,0 +1,281 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <taichi/math/array_3d.h>
+#include <taichi/system/memory.h>
+
+TC_NAMESPACE_BEGIN
+
+// A 3D grid stored as block_size^3 pages. A dense page table maps block coordinates
+// to pages, so untouched regions cost one pointer per block.
+// Nodes are only accessible through operator[] when their block is allocated.
+template <typename T, int block_size = 8>
+class SparseGrid3D {
+    static_assert((block_size & (block_size - 1)) == 0, "block_size must be a power of two");
+
+public:
+    static const int block_volume = block_size * block_size * block_size;
+
+protected:
+    Vector3i res;
+    Vector3i block_res;
+    T background;
+    std::vector<T *> page_table;
+    std::vector<T *> free_pages;
+    std::vector<Vector3i> allocated_blocks;
+
+    static constexpr int get_block_size_log2(int s = block_size) {
+        return s == 1 ? 0 : 1 + get_block_size_log2(s / 2);
+    }
+
+    static const int block_size_log2 = get_block_size_log2();
+
+    T *new_page() {
+        T *page;
+        if (!free_pages.empty()) {
+            page = free_pages.back();
+            free_pages.pop_back();
+        } else {
+            page = static_cast<T *>(aligned_malloc(sizeof(T) * block_volume));
+            assert_info(page != nullptr, "Out of memory when allocating sparse grid page");
+            std::uninitialized_fill(page, page + block_volume, background);
+            return page;
+        }
+        std::fill(page, page + block_volume, background);
+        return page;
+    }
+
+    static void delete_page(T *page) {
+        for (int i = 0; i < block_volume; i++) {
+            page[i].~T();
+        }
+        aligned_free(page);
+    }
+
+public:
+    SparseGrid3D() {
+        res = Vector3i(0);
+        block_res = Vector3i(0);
+    }
+
+    SparseGrid3D(const SparseGrid3D &) = delete;
+
+    SparseGrid3D &operator=(const SparseGrid3D &) = delete;
+
+    ~SparseGrid3D() {
+        clear();
+    }
+
+    void initialize(const Vector3i &res, T background = T()) {
+        clear();
+        this->res = res;
+        this->background = background;
+        for (int i = 0; i < 3; i++) {
+            block_res[i] = (res[i] + block_size - 1) / block_size;
+        }
+        page_table.assign(block_res.x * block_res.y * block_res.z, nullptr);
+    }
+
+    // Frees every page, including the ones kept for reuse
+    void clear() {
+        for (auto page : page_table) {
+            if (page) {
+                delete_page(page);
+            }
+        }
+        for (auto page : free_pages) {
+            delete_page(page);
+        }
+        std::fill(page_table.begin(), page_table.end(), nullptr);
+        free_pages.clear();
+        allocated_blocks.clear();
+    }
+
+    Vector3i get_res() const {
+        return res;
+    }
+
+    Vector3i get_block_res() const {
+        return block_res;
+    }
+
+    Vector3i get_block_coord(const Vector3i &node) const {
+        return Vector3i(node.x >> block_size_log2, node.y >> block_size_log2, node.z >> block_size_log2);
+    }
+
+    int get_block_id(const Vector3i &block) const {
+        return (block.x * block_res.y + block.y) * block_res.z + block.z;
+    }
+
+    bool inside_blocks(const Vector3i &block) const {
+        return 0 <= block.x && block.x < block_res.x && 0 <= block.y && block.y < block_res.y &&
+               0 <= block.z && block.z < block_res.z;
+    }
+
+    bool inside(int i, int j, int k) const {
+        return 0 <= i && i < res.x && 0 <= j && j < res.y && 0 <= k && k < res.z;
+    }
+
+    bool inside(const Index3D &ind) const {
+        return inside(ind.i, ind.j, ind.k);
+    }
+
+    bool has_block(const Vector3i &block) const {
+        return page_table[get_block_id(block)] != nullptr;
+    }
+
+    bool is_allocated(int i, int j, int k) const {
+        return page_table[get_block_id(get_block_coord(Vector3i(i, j, k)))] != nullptr;
+    }
+
+    // Pages of newly allocated blocks are filled with the background value
+    T *allocate_block(const Vector3i &block) {
+        T *&page = page_table[get_block_id(block)];
+        if (page == nullptr) {
+            page = new_page();
+            allocated_blocks.push_back(block);
+        }
+        return page;
+    }
+
+    void allocate_all() {
+        for (int i = 0; i < block_res.x; i++) {
+            for (int j = 0; j < block_res.y; j++) {
+                for (int k = 0; k < block_res.z; k++) {
+                    allocate_block(Vector3i(i, j, k));
+                }
+            }
+        }
+    }
+
+    // Makes `blocks` exactly the set of allocated blocks. Pages that stay allocated keep
+    // their contents; released pages are recycled by later allocations.
+    void set_allocated_blocks(const std::vector<Vector3i> &blocks) {
+        std::vector<char> keep(page_table.size(), 0);
+        for (auto &block : blocks) {
+            keep[get_block_id(block)] = 1;
+        }
+        for (auto &block : allocated_blocks) {
+            int id = get_block_id(block);
+            if (!keep[id]) {
+                free_pages.push_back(page_table[id]);
+                page_table[id] = nullptr;
+            }
+        }
+        allocated_blocks.clear();
+        for (auto &block : blocks) {
+            T *&page = page_table[get_block_id(block)];
+            if (page == nullptr) {
+                page = new_page();
+            }
+            allocated_blocks.push_back(block);
+        }
+    }
+
+    const std::vector<Vector3i> &get_allocated_blocks() const {
+        return allocated_blocks;
+    }
+
+    int get_num_allocated_blocks() const {
+        return (int)allocated_blocks.size();
+    }
+
+    T *get_page(const Vector3i &block) {
+        return page_table[get_block_id(block)];
+    }
+
+    const T *get_page(const Vector3i &block) const {
+        return page_table[get_block_id(block)];
+    }
+
+    static int get_local_index(int i, int j, int k) {
+        const int mask = block_size - 1;
+        return ((((i & mask) << block_size_log2) + (j & mask)) << block_size_log2) + (k & mask);
+    }
+
+    T &operator()(int i, int j, int k) {
+        return page_table[get_block_id(get_block_coord(Vector3i(i, j, k)))][get_local_index(i, j, k)];
+    }
+
+    const T &operator()(int i, int j, int k) const {
+        return page_table[get_block_id(get_block_coord(Vector3i(i, j, k)))][get_local_index(i, j, k)];
+    }
+
+    T &operator[](const Index3D &ind) {
+        return (*this)(ind.i, ind.j, ind.k);
+    }
+
+    const T &operator[](const Index3D &ind) const {
+        return (*this)(ind.i, ind.j, ind.k);
+    }
+
+    T &operator[](const Vector3i &ind) {
+        return (*this)(ind.x, ind.y, ind.z);
+    }
+
+    const T &operator[](const Vector3i &ind) const {
+        return (*this)(ind.x, ind.y, ind.z);
+    }
+
+    // Returns the background value for nodes in unallocated blocks
+    T get(int i, int j, int k) const {
+        const T *page = page_table[get_block_id(get_block_coord(Vector3i(i, j, k)))];
+        if (page == nullptr) {
+            return background;
+        }
+        return page[get_local_index(i, j, k)];
+    }
+
+    void reset(const T &val) {
+        for (auto &block : allocated_blocks) {
+            reset_block(block, val);
+        }
+    }
+
+    // Region of nodes covered by `block`, clipped to the grid resolution
+    Region3D get_block_region(const Vector3i &block) const {
+        Vector3i begin = block * block_size;
+        Vector3i end = glm::min(begin + Vector3i(block_size), res);
+        return Region3D(begin.x, end.x, begin.y, end.y, begin.z, end.z);
+    }
+
+    void reset_block(const Vector3i &block, const T &val) {
+        T *page = get_page(block);
+        std::fill(page, page + block_volume, val);
+    }
+
+    // f(const Index3D &, T &) for every node of an allocated block that lies inside the grid
+    template <typename F>
+    void for_each_node(const Vector3i &block, const F &f) {
+        T *page = get_page(block);
+        for (auto &ind : get_block_region(block)) {
+            f(ind, page[get_local_index(ind.i, ind.j, ind.k)]);
+        }
+    }
+
+    // The same for every allocated block
+    template <typename F>
+    void for_each_node(const F &f) {
+        for (auto &block : allocated_blocks) {
+            for_each_node(block, f);
+        }
+    }
+
+    size_t get_memory_usage() const {
+        return page_table.size() * sizeof(T *) +
+               (allocated_blocks.size() + free_pages.size()) * block_volume * sizeof(T);
+    }
+};
+
+TC_NAMESPACE_END
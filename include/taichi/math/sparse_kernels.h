@@ -0,0 +1,85 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+// The kernels of sparse.cpp, compiled once per CPU target into TC_CPU_DISPATCH_NAMESPACE, see cpu_dispatch.h.
+// Included by sparse.cpp and its _avx2 and _avx512 variants only, so without include guard.
+
+#include <taichi/math/math_util.h>
+
+#if !defined(TC_DISABLE_SSE) && defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#ifndef TC_CPU_DISPATCH_NAMESPACE
+#error "Define TC_CPU_DISPATCH_NAMESPACE before including the kernels"
+#endif
+
+TC_NAMESPACE_BEGIN
+
+namespace TC_CPU_DISPATCH_NAMESPACE {
+
+// Sum of values[k] * x[columns[k]] over a row
+inline real sparse_dot(const int *columns, const real *values, int n, const real *x) {
+    int k = 0;
+    real sum = 0;
+#if !defined(TC_DISABLE_SSE) && defined(__AVX2__)
+    if (n >= 8) {
+        __m256 acc = _mm256_setzero_ps();
+        for (; k + 8 <= n; k += 8) {
+            __m256i index = _mm256_loadu_si256((const __m256i *)(columns + k));
+            __m256 xs = _mm256_i32gather_ps(x, index, sizeof(real));
+#ifdef __FMA__
+            acc = _mm256_fmadd_ps(_mm256_loadu_ps(values + k), xs, acc);
+#else
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(values + k), xs));
+#endif
+        }
+        __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+        s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+        sum = _mm_cvtss_f32(s);
+    }
+#endif
+    for (; k < n; k++) {
+        sum += values[k] * x[columns[k]];
+    }
+    return sum;
+}
+
+// Non-symmetric: y[begin, end) = A[begin, end) x.
+// Symmetric: y[begin, end) = U[begin, end) x, and the strictly upper part of these rows is also
+// scattered transposed, i.e. y[j] += a_ij x_i for j > i. y must be zero for rows past begin.
+void sparse_multiply_rows(const int *row_offsets, const int *columns, const real *vals, bool symmetric, const real *x,
+                          real *y, int begin, int end) {
+    if (!symmetric) {
+        for (int i = begin; i < end; i++) {
+            const int b = row_offsets[i];
+            y[i] = sparse_dot(columns + b, vals + b, row_offsets[i + 1] - b, x);
+        }
+        return;
+    }
+    for (int i = begin; i < end; i++) {
+        int b = row_offsets[i];
+        const int e = row_offsets[i + 1];
+        real sum = 0;
+        if (b < e && columns[b] == i) {
+            sum = vals[b] * x[i];
+            b++;
+        }
+        const real x_i = x[i];
+        for (int k = b; k < e; k++) {
+            y[columns[k]] += vals[k] * x_i;
+        }
+        y[i] += sum + sparse_dot(columns + b, vals + b, e - b, x);
+    }
+}
+
+} // namespace TC_CPU_DISPATCH_NAMESPACE
+
+TC_NAMESPACE_END
@@ -0,0 +1,237 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include "sparse_levelset_3d.h"
+#include <taichi/system/threading.h>
+
+TC_NAMESPACE_BEGIN
+
+void SparseLevelSet3D::initialize(int width, int height, int depth, Vector3 offset, real band) {
+    TC_MEMORY_TAG("levelset");
+    this->width = width;
+    this->height = height;
+    this->depth = depth;
+    this->storage_offset = offset;
+    this->band = band;
+    brick_res = Vector3i((width + brick_size - 1) / brick_size, (height + brick_size - 1) / brick_size,
+                         (depth + brick_size - 1) / brick_size);
+    far_field.initialize(brick_res + Vector3i(1), LevelSet3D::INF, Vector3(0.0f));
+    brick_ids.initialize(brick_res, -1, Vector3(0.0f));
+    AlignedVector<real>().swap(bricks);
+    brick_positions.clear();
+}
+
+void SparseLevelSet3D::initialize(const LevelSet3D &dense, real band) {
+    initialize(dense.get_width(), dense.get_height(), dense.get_depth(), dense.get_storage_offset(), band);
+    friction = dense.friction;
+    TC_MEMORY_TAG("levelset");
+    auto get_dense = [&](int i, int j, int k) {
+        return dense.Array3D<real>::get(std::min(i, width - 1), std::min(j, height - 1), std::min(k, depth - 1));
+    };
+    for (auto &ind : far_field.get_region()) {
+        far_field[ind] = get_dense(ind.i * brick_size, ind.j * brick_size, ind.k * brick_size);
+    }
+    // Bricks with a node within the band, plus one cell for the interpolation next to it
+    Array3D<char> in_band(brick_res, 0, Vector3(0.0f));
+    parallel_for(0, brick_res.x, 1, [&](int bi) {
+        for (int bj = 0; bj < brick_res.y; bj++) {
+            for (int bk = 0; bk < brick_res.z; bk++) {
+                bool found = false;
+                for (int i = bi * brick_size; i < std::min(width, (bi + 1) * brick_size) && !found; i++) {
+                    for (int j = bj * brick_size; j < std::min(height, (bj + 1) * brick_size) && !found; j++) {
+                        for (int k = bk * brick_size; k < std::min(depth, (bk + 1) * brick_size); k++) {
+                            if (std::abs(dense.Array3D<real>::get(i, j, k)) <= band + 1) {
+                                found = true;
+                                break;
+                            }
+                        }
+                    }
+                }
+                in_band[bi][bj][bk] = found;
+            }
+        }
+    });
+    for (auto &ind : in_band.get_region()) {
+        if (in_band[ind]) {
+            brick_ids[ind] = (int)brick_positions.size();
+            brick_positions.push_back(Vector3i(ind.i, ind.j, ind.k));
+        }
+    }
+    bricks.resize(brick_positions.size() * brick_volume);
+    parallel_for(0, (int)brick_positions.size(), 1, [&](int b) {
+        const Vector3i base = brick_positions[b] * brick_size;
+        real *brick = &bricks[(int64)b * brick_volume];
+        for (int i = 0; i < brick_size; i++) {
+            for (int j = 0; j < brick_size; j++) {
+                for (int k = 0; k < brick_size; k++) {
+                    brick[(i * brick_size + j) * brick_size + k] = get_dense(base.x + i, base.y + j, base.z + k);
+                }
+            }
+        }
+    }, 16);
+}
+
+real SparseLevelSet3D::get_far_field(int i, int j, int k) const {
+    const int bi = i / brick_size, bj = j / brick_size, bk = k / brick_size;
+    const real x_r = real(i % brick_size) / brick_size, y_r = real(j % brick_size) / brick_size,
+            z_r = real(k % brick_size) / brick_size;
+    return lerp(x_r,
+                lerp(y_r, lerp(z_r, far_field.get(bi, bj, bk), far_field.get(bi, bj, bk + 1)),
+                     lerp(z_r, far_field.get(bi, bj + 1, bk), far_field.get(bi, bj + 1, bk + 1))),
+                lerp(y_r, lerp(z_r, far_field.get(bi + 1, bj, bk), far_field.get(bi + 1, bj, bk + 1)),
+                     lerp(z_r, far_field.get(bi + 1, bj + 1, bk), far_field.get(bi + 1, bj + 1, bk + 1))));
+}
+
+template <typename F>
+void SparseLevelSet3D::add_bricks(const F &distance, int num_threads) {
+    const real reach = band + 0.5f * (brick_size - 1) * std::sqrt(3.0f);
+    const int first = (int)brick_positions.size();
+    for (auto &ind : brick_ids.get_region()) {
+        if (brick_ids[ind] >= 0) {
+            continue;
+        }
+        const Vector3 center = Vector3(ind.i, ind.j, ind.k) * real(brick_size) + Vector3(0.5f * (brick_size - 1)) +
+                               storage_offset;
+        if (std::abs(distance(center)) <= reach) {
+            brick_ids[ind] = (int)brick_positions.size();
+            brick_positions.push_back(Vector3i(ind.i, ind.j, ind.k));
+        }
+    }
+    bricks.resize(brick_positions.size() * brick_volume);
+    parallel_for(first, (int)brick_positions.size(), num_threads, [&](int b) {
+        const Vector3i base = brick_positions[b] * brick_size;
+        real *brick = &bricks[(int64)b * brick_volume];
+        for (int i = 0; i < brick_size; i++) {
+            for (int j = 0; j < brick_size; j++) {
+                for (int k = 0; k < brick_size; k++) {
+                    brick[(i * brick_size + j) * brick_size + k] = get_far_field(base.x + i, base.y + j, base.z + k);
+                }
+            }
+        }
+    }, 16);
+}
+
+template <typename F>
+void SparseLevelSet3D::add_distance(const F &distance, int num_threads) {
+    TC_MEMORY_TAG("levelset");
+    // New bricks start from the far field before it changes
+    add_bricks(distance, num_threads);
+    parallel_for(0, (int)brick_positions.size(), num_threads, [&](int b) {
+        const Vector3i base = brick_positions[b] * brick_size;
+        real *brick = &bricks[(int64)b * brick_volume];
+        for (int i = 0; i < brick_size; i++) {
+            for (int j = 0; j < brick_size; j++) {
+                for (int k = 0; k < brick_size; k++) {
+                    real &phi = brick[(i * brick_size + j) * brick_size + k];
+                    phi = std::min(phi, distance(Vector3(base + Vector3i(i, j, k)) + storage_offset));
+                }
+            }
+        }
+    }, 16);
+    for (auto &ind : far_field.get_region()) {
+        const Vector3 pos = Vector3(ind.i, ind.j, ind.k) * real(brick_size) + storage_offset;
+        far_field[ind] = std::min(far_field[ind], distance(pos));
+    }
+}
+
+real SparseLevelSet3D::sample(const Vector3 &pos, Vector3 &gradient) const {
+    assert_info(inside(pos), "LevelSet Query out of Bound! ("
+                             + std::to_string(pos.x) + ", "
+                             + std::to_string(pos.y) + ", "
+                             + std::to_string(pos.z) + ")");
+    const real x = clamp(pos.x - storage_offset.x, 0.f, width - 1.f - eps);
+    const real y = clamp(pos.y - storage_offset.y, 0.f, height - 1.f - eps);
+    const real z = clamp(pos.z - storage_offset.z, 0.f, depth - 1.f - eps);
+    const int x_i = clamp(int(x), 0, width - 2);
+    const int y_i = clamp(int(y), 0, height - 2);
+    const int z_i = clamp(int(z), 0, depth - 2);
+    real c[2][2][2];
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            for (int k = 0; k < 2; k++) {
+                c[i][j][k] = get(x_i + i, y_i + j, z_i + k);
+            }
+        }
+    }
+    return interpolate_cell(c, x - x_i, y - y_i, z - z_i, gradient);
+}
+
+Vector3 SparseLevelSet3D::get_normalized_gradient(const Vector3 &pos) const {
+    Vector3 gradient = get_gradient(pos);
+    if (length(gradient) < 1e-10f)
+        return Vector3(1, 0, 0);
+    else
+        return normalize(gradient);
+}
+
+void SparseLevelSet3D::add_sphere(Vector3 center, real radius, bool inside_out) {
+    add_distance([&](const Vector3 &pos) {
+        return (inside_out ? -1 : 1) * (length(center - pos) - radius);
+    }, 1);
+}
+
+void SparseLevelSet3D::add_plane(real a, real b, real c, real d) {
+    const real coeff = 1.0f / sqrt(a * a + b * b + c * c);
+    add_distance([&](const Vector3 &pos) {
+        return (glm::dot(pos, Vector3(a, b, c)) + d) * coeff;
+    }, 1);
+}
+
+void SparseLevelSet3D::add_cuboid(Vector3 lower_boundry, Vector3 upper_boundry, bool inside_out) {
+    initialize(width, height, depth, storage_offset, band);
+    add_distance([&](const Vector3 &pos) {
+        bool in_cuboid = true;
+        for (int i = 0; i < 3; ++i) {
+            if (!(lower_boundry[i] <= pos[i] && pos[i] <= upper_boundry[i]))
+                in_cuboid = false;
+        }
+        real dist = LevelSet3D::INF;
+        if (in_cuboid) {
+            for (int i = 0; i < 3; ++i) {
+                dist = std::min(dist, std::min(upper_boundry[i] - pos[i], pos[i] - lower_boundry[i]));
+            }
+        } else {
+            Vector3 nearest_p;
+            for (int i = 0; i < 3; ++i) {
+                nearest_p[i] = clamp(pos[i], lower_boundry[i], upper_boundry[i]);
+            }
+            dist = -length(nearest_p - pos);
+        }
+        return inside_out ? dist : -dist;
+    }, 1);
+}
+
+void SparseLevelSet3D::global_increase(real delta) {
+    for (auto &ind : far_field.get_region()) {
+        far_field[ind] += delta;
+    }
+    for (auto &phi : bricks) {
+        phi += delta;
+    }
+}
+
+Array3D<real> SparseLevelSet3D::rasterize(int width, int height, int depth) const {
+    Array3D<real> out(width, height, depth);
+    Vector3 actual_size;
+    if (storage_offset == Vector3(0.0f, 0.0f, 0.0f)) {
+        actual_size = Vector3(this->width - 1, this->height - 1, this->depth - 1);
+    } else {
+        actual_size = Vector3(this->width, this->height, this->depth);
+    }
+    Vector3 scale_factor = actual_size / Vector3(width, height, depth);
+    for (auto &ind : Region3D(0, width, 0, height, 0, depth, Vector3(0.5f, 0.5f, 0.5f))) {
+        out[ind] = get(scale_factor * ind.get_pos());
+        if (std::isnan(out[ind])) {
+            out[ind] = std::numeric_limits<real>::infinity();
+        }
+    }
+    return out;
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,139 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/math/levelset_3d.h>
+#include <taichi/system/memory.h>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// A LevelSet3D stored as a narrow band: bricks of 8x8x8 nodes where the surface is within `band` cells, and
+// elsewhere a far field of the values at every 8th node, interpolated trilinearly. Nodes, positions and
+// queries are as those of a LevelSet3D of the same size and storage offset. Shapes are distance functions, so
+// that a brick needs storing only if the distance at its center is within the band plus its half-diagonal.
+class SparseLevelSet3D {
+public:
+    static const int brick_size = 8;
+    static const int brick_volume = brick_size * brick_size * brick_size;
+
+    real friction = 1.0f;
+
+protected:
+    int width = 0, height = 0, depth = 0;
+    Vector3 storage_offset;
+    real band = 0;
+    Vector3i brick_res;
+    // At the nodes (i, j, k) * brick_size, some beyond the last node
+    Array3D<real> far_field;
+    // Into bricks, in units of brick_volume; -1 for bricks left to the far field
+    Array3D<int> brick_ids;
+    AlignedVector<real> bricks;
+    // Of every stored brick, in brick units
+    std::vector<Vector3i> brick_positions;
+
+    real get_far_field(int i, int j, int k) const;
+
+    // Stores the bricks within the band of `distance` that are not stored yet, from the far field
+    template <typename F>
+    void add_bricks(const F &distance, int num_threads);
+
+    // phi = min(phi, distance(node position)) everywhere
+    template <typename F>
+    void add_distance(const F &distance, int num_threads);
+
+public:
+    SparseLevelSet3D() {}
+
+    // band is in cells
+    SparseLevelSet3D(int width, int height, int depth, Vector3 offset, real band) {
+        initialize(width, height, depth, offset, band);
+    }
+
+    void initialize(int width, int height, int depth, Vector3 offset, real band);
+
+    // The band of a dense level set, e.g. of a voxelized mesh
+    void initialize(const LevelSet3D &dense, real band);
+
+    int get_width() const {
+        return width;
+    }
+
+    int get_height() const {
+        return height;
+    }
+
+    int get_depth() const {
+        return depth;
+    }
+
+    Vector3 get_storage_offset() const {
+        return storage_offset;
+    }
+
+    real get_band() const {
+        return band;
+    }
+
+    int get_num_bricks() const {
+        return (int)(bricks.size() / brick_volume);
+    }
+
+    int64 get_memory_bytes() const {
+        return (int64)(bricks.size() + far_field.get_size()) * sizeof(real) +
+               (int64)brick_ids.get_size() * sizeof(int);
+    }
+
+    bool inside(const Vector3 &pos, real tolerance = 1e-4f) const {
+        return (-tolerance < pos.x && pos.x < width + tolerance &&
+                -tolerance < pos.y && pos.y < height + tolerance &&
+                -tolerance < pos.z && pos.z < depth + tolerance);
+    }
+
+    // The value at node (i, j, k)
+    real get(int i, int j, int k) const {
+        const int id = brick_ids.get(i / brick_size, j / brick_size, k / brick_size);
+        if (id < 0) {
+            return get_far_field(i, j, k);
+        }
+        return bricks[(int64)id * brick_volume +
+                      ((i % brick_size) * brick_size + j % brick_size) * brick_size + k % brick_size];
+    }
+
+    // The value and, not normalized, the gradient at pos, from one fetch of its cell's corners
+    real sample(const Vector3 &pos, Vector3 &gradient) const;
+
+    real get(const Vector3 &pos) const {
+        Vector3 gradient;
+        return sample(pos, gradient);
+    }
+
+    // Note this is not normalized!
+    Vector3 get_gradient(const Vector3 &pos) const {
+        Vector3 gradient;
+        sample(pos, gradient);
+        return gradient;
+    }
+
+    Vector3 get_normalized_gradient(const Vector3 &pos) const;
+
+    void add_sphere(Vector3 center, real radius, bool inside_out = false);
+
+    void add_plane(real a, real b, real c, real d);
+
+    // Replaces the level set, as LevelSet3D::add_cuboid does
+    void add_cuboid(Vector3 lower_boundry, Vector3 upper_boundry, bool inside_out = true);
+
+    void global_increase(real delta);
+
+    Array3D<real> rasterize(int width, int height, int depth) const;
+};
+
+TC_NAMESPACE_END
@@ -0,0 +1,70 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <taichi/common/util.h>
+#include <taichi/system/threading.h>
+
+TC_NAMESPACE_BEGIN
+
+// Runs update(s, u) for every step s in [0, steps) and slab u in [begin, end), for stencils that are repeated
+// over the slabs of a grid and reach one slab each way: Jacobi sweeps between two buffers, the half-sweeps of
+// red-black Gauss-Seidel in place, and so on. The result is that of running the steps one after another, as
+// long as update(s, u) only reads slabs u - 1, u and u + 1 and only writes slab u.
+//
+// Instead of sweeping the whole grid once per step, up to `depth` steps are fused into wavefronts (temporal
+// blocking): step s runs on slab w - s as w advances, so that the slabs a step needs are still in cache from the
+// step before. With threads, [begin, end) is split into one chunk per thread. Each chunk first runs a trapezoid
+// that shrinks by one slab per step on each side shared with another chunk, needing nothing from the others, and
+// then the triangles left between chunks are filled in. Chunks are at least 2 * depth slabs, so depth is
+// lowered if the slabs are too few for num_threads chunks.
+template <typename F>
+void temporal_blocked_for(int begin, int end, int steps, int num_threads, const F &update, int depth = 8) {
+    const int n = end - begin;
+    if (n <= 0 || steps <= 0) {
+        return;
+    }
+    depth = std::max(1, depth);
+    if (num_threads > 1) {
+        depth = std::max(1, std::min(depth, n / (2 * num_threads)));
+    }
+    const int num_chunks = std::max(1, std::min(num_threads, n / (2 * depth)));
+    auto get_chunk_begin = [&](int c) {
+        return begin + (int)((int64)n * c / num_chunks);
+    };
+    for (int first_step = 0; first_step < steps; first_step += depth) {
+        const int pass_steps = std::min(depth, steps - first_step);
+        parallel_for(0, num_chunks, num_threads, [&](int c) {
+            const int lo = get_chunk_begin(c), hi = get_chunk_begin(c + 1);
+            const int shrink_lo = c > 0 ? 1 : 0, shrink_hi = c + 1 < num_chunks ? 1 : 0;
+            for (int w = lo; w < hi + pass_steps - 1; w++) {
+                for (int s = 0; s < pass_steps; s++) {
+                    const int u = w - s;
+                    if (lo + s * shrink_lo <= u && u < hi - s * shrink_hi) {
+                        update(first_step + s, u);
+                    }
+                }
+            }
+        }, 1);
+        if (num_chunks > 1 && pass_steps > 1) {
+            parallel_for(1, num_chunks, num_threads, [&](int c) {
+                const int boundary = get_chunk_begin(c);
+                for (int s = 1; s < pass_steps; s++) {
+                    for (int u = boundary - s; u < boundary + s; u++) {
+                        update(first_step + s, u);
+                    }
+                }
+            }, 1);
+        }
+    }
+}
+
+TC_NAMESPACE_END
@@ -9,64 +9,271 @@
 
 #pragma once
 
+#include <algorithm>
+#include <limits>
+#include <vector>
 #include <taichi/common/meta.h>
+#include <taichi/system/threading.h>
 
 TC_NAMESPACE_BEGIN
 
-#ifdef TC_USE_ANN
-
-class ANNkd_tree;
-
+// Kd-tree over 2D points, with an implicit layout: the points are reordered so that every subtree
+// is a contiguous range, with its splitting point in the middle, and ranges of at most leaf_size
+// points are scanned linearly. Only the split axes are stored besides the points.
+// Queries are const and can be issued from many threads at once.
+// Distances are squared, as with the ANN library this replaces.
 class NearestNeighbour2D {
-public:
-    NearestNeighbour2D();
+protected:
+    static const int leaf_size = 8;
 
-    NearestNeighbour2D(const std::vector<Vector2> &data_points);
+    struct Point {
+        Vector2 position;
+        int index;
+    };
 
-    void clear();
+    // Reordered, with their original indices
+    std::vector<Point> points;
+    // The split axis of the node in the middle of every range
+    std::vector<unsigned char> split_axes;
 
-    void initialize(const std::vector<Vector2> &data_points);
+    // Partitions [begin, end) around its middle point
+    void split(int begin, int end) {
+        Vector2 lower(points[begin].position), upper(points[begin].position);
+        for (int i = begin + 1; i < end; i++) {
+            lower = glm::min(lower, points[i].position);
+            upper = glm::max(upper, points[i].position);
+        }
+        const int axis = (upper.y - lower.y > upper.x - lower.x) ? 1 : 0;
+        const int mid = (begin + end) / 2;
+        std::nth_element(points.begin() + begin, points.begin() + mid, points.begin() + end,
+                         [axis](const Point &a, const Point &b) {
+                             return a.position[axis] < b.position[axis];
+                         });
+        split_axes[mid] = (unsigned char)axis;
+    }
 
-    Vector2 query_point(Vector2 p) const;
+    void build(int begin, int end) {
+        if (end - begin <= leaf_size) {
+            return;
+        }
+        split(begin, end);
+        const int mid = (begin + end) / 2;
+        build(begin, mid);
+        build(mid + 1, end);
+    }
 
-    int query_index(Vector2 p) const;
+    // Keeps the n closest candidates (slots in points), sorted by distance
+    struct Candidates {
+        int n, size = 0;
+        std::pair<real, int> *data;
 
-    void query(Vector2 p, int &index, float &dist) const;
+        Candidates(int n, std::pair<real, int> *data) : n(n), data(data) {}
 
-    void query_n(Vector2 p, int n, std::vector<int> &index, std::vector<float> &dist) const;
+        real worst() const {
+            return size < n ? std::numeric_limits<real>::infinity() : data[n - 1].first;
+        }
 
-    void query_n_index(Vector2 p, int n, std::vector<int> &index) const;
+        void insert(real dist2, int index) {
+            int i = size < n ? size++ : n - 1;
+            while (i > 0 && data[i - 1].first > dist2) {
+                data[i] = data[i - 1];
+                i--;
+            }
+            data[i] = std::make_pair(dist2, index);
+        }
+    };
 
-private:
-    std::vector<Vector2> data_points;
-    std::shared_ptr<ANNkd_tree> ann_kdtree;
-};
+    void search(int begin, int end, Vector2 p, Candidates &candidates) const {
+        if (end - begin <= leaf_size) {
+            for (int i = begin; i < end; i++) {
+                const Vector2 d = points[i].position - p;
+                const real dist2 = dot(d, d);
+                if (dist2 < candidates.worst()) {
+                    candidates.insert(dist2, i);
+                }
+            }
+            return;
+        }
+        const int mid = (begin + end) / 2;
+        const int axis = split_axes[mid];
+        const real diff = p[axis] - points[mid].position[axis];
+        const Vector2 d = points[mid].position - p;
+        const real dist2 = dot(d, d);
+        if (dist2 < candidates.worst()) {
+            candidates.insert(dist2, mid);
+        }
+        if (diff < 0) {
+            search(begin, mid, p, candidates);
+            if (diff * diff < candidates.worst()) {
+                search(mid + 1, end, p, candidates);
+            }
+        } else {
+            search(mid + 1, end, p, candidates);
+            if (diff * diff < candidates.worst()) {
+                search(begin, mid, p, candidates);
+            }
+        }
+    }
 
-#else
+    void search_radius(int begin, int end, Vector2 p, real radius2, std::vector<int> &index,
+                       std::vector<real> &dist) const {
+        if (end - begin <= leaf_size) {
+            for (int i = begin; i < end; i++) {
+                const Vector2 d = points[i].position - p;
+                const real dist2 = dot(d, d);
+                if (dist2 <= radius2) {
+                    index.push_back(points[i].index);
+                    dist.push_back(dist2);
+                }
+            }
+            return;
+        }
+        const int mid = (begin + end) / 2;
+        const int axis = split_axes[mid];
+        const real diff = p[axis] - points[mid].position[axis];
+        const Vector2 d = points[mid].position - p;
+        const real dist2 = dot(d, d);
+        if (dist2 <= radius2) {
+            index.push_back(points[mid].index);
+            dist.push_back(dist2);
+        }
+        if (diff < 0 || diff * diff <= radius2) {
+            search_radius(begin, mid, p, radius2, index, dist);
+        }
+        if (diff >= 0 || diff * diff <= radius2) {
+            search_radius(mid + 1, end, p, radius2, index, dist);
+        }
+    }
+
+    std::pair<real, int> nearest_slot(Vector2 p) const {
+        std::pair<real, int> result;
+        Candidates candidates(1, &result);
+        search(0, size(), p, candidates);
+        return result;
+    }
 
-class NearestNeighbour2D {
 public:
-    NearestNeighbour2D() { error("no impl"); }
+    NearestNeighbour2D() {}
 
-    NearestNeighbour2D(const std::vector<Vector2> &data_points) { error("no impl"); }
+    NearestNeighbour2D(const std::vector<Vector2> &data_points, int num_threads = 1) {
+        initialize(data_points, num_threads);
+    }
 
-    void clear() {}
+    void clear() {
+        points.clear();
+        split_axes.clear();
+    }
 
-    void initialize(const std::vector<Vector2> &data_points) {}
+    int size() const {
+        return (int)points.size();
+    }
 
-    Vector2 query_point(Vector2 p) const { return Vector2(0.0f); }
+    // The top levels are split serially, then their subtrees are built in parallel
+    void initialize(const std::vector<Vector2> &data_points, int num_threads = 1) {
+        assert_info(data_points.size() != 0, "data points empty.");
+        const int n = (int)data_points.size();
+        points.resize(n);
+        for (int i = 0; i < n; i++) {
+            points[i].position = data_points[i];
+            points[i].index = i;
+        }
+        split_axes.assign(n, 0);
+        std::vector<std::pair<int, int>> subtrees(1, std::make_pair(0, n));
+        while ((int)subtrees.size() < num_threads * 4) {
+            std::vector<std::pair<int, int>> next;
+            for (auto &range : subtrees) {
+                if (range.second - range.first <= leaf_size) {
+                    next.push_back(range);
+                    continue;
+                }
+                split(range.first, range.second);
+                const int mid = (range.first + range.second) / 2;
+                next.push_back(std::make_pair(range.first, mid));
+                next.push_back(std::make_pair(mid + 1, range.second));
+            }
+            if (next.size() == subtrees.size()) {
+                break;
+            }
+            subtrees.swap(next);
+        }
+        parallel_for(0, (int)subtrees.size(), num_threads, [&](int i) {
+            build(subtrees[i].first, subtrees[i].second);
+        }, 1);
+    }
 
-    int query_index(Vector2 p) const { return -1; }
+    Vector2 query_point(Vector2 p) const {
+        assert_info(!points.empty(), "No points for NN!");
+        return points[nearest_slot(p).second].position;
+    }
 
-    void query(Vector2 p, int &index, float &dist) const {}
+    int query_index(Vector2 p) const {
+        return points[nearest_slot(p).second].index;
+    }
 
-    void query_n(Vector2 p, int n, std::vector<int> &index, std::vector<float> &dist) const {}
+    void query(Vector2 p, int &index, real &dist) const {
+        auto result = nearest_slot(p);
+        index = points[result.second].index;
+        dist = result.first;
+    }
 
-    void query_n_index(Vector2 p, int n, std::vector<int> &index) const {}
+    // The n closest points, nearest first. Missing ones (n > size()) have index -1 and distance 1e30.
+    void query_n(Vector2 p, int n, std::vector<int> &index, std::vector<real> &dist) const {
+        std::vector<std::pair<real, int>> result(n);
+        Candidates candidates(n, result.data());
+        search(0, size(), p, candidates);
+        index.resize(n);
+        dist.resize(n);
+        for (int i = 0; i < n; i++) {
+            index[i] = i < candidates.size ? points[result[i].second].index : -1;
+            dist[i] = i < candidates.size ? result[i].first : 1e30f;
+        }
+    }
 
-};
+    void query_n_index(Vector2 p, int n, std::vector<int> &index) const {
+        std::vector<real> _;
+        query_n(p, n, index, _);
+    }
 
-#endif
+    // All points within radius, in no particular order
+    void query_radius(Vector2 p, real radius, std::vector<int> &index, std::vector<real> &dist) const {
+        index.clear();
+        dist.clear();
+        search_radius(0, size(), p, radius * radius, index, dist);
+    }
 
-TC_NAMESPACE_END
+    // The n closest points of every query, as by query_n, at [i * n, (i + 1) * n)
+    void query_batch(const std::vector<Vector2> &queries, int n, std::vector<int> &index,
+                     std::vector<real> &dist, int num_threads = 1) const {
+        const int num_queries = (int)queries.size();
+        index.resize((size_t)num_queries * n);
+        dist.resize((size_t)num_queries * n);
+        parallel_for(0, num_queries, num_threads, [&](int q) {
+            std::pair<real, int> local[16];
+            std::vector<std::pair<real, int>> heap;
+            std::pair<real, int> *result = local;
+            if (n > 16) {
+                heap.resize(n);
+                result = heap.data();
+            }
+            Candidates candidates(n, result);
+            search(0, size(), queries[q], candidates);
+            for (int i = 0; i < n; i++) {
+                index[(size_t)q * n + i] = i < candidates.size ? points[result[i].second].index : -1;
+                dist[(size_t)q * n + i] = i < candidates.size ? result[i].first : 1e30f;
+            }
+        }, 64);
+    }
 
+    // All points within radius of every query, as by query_radius
+    void query_batch(const std::vector<Vector2> &queries, real radius, std::vector<std::vector<int>> &index,
+                     std::vector<std::vector<real>> &dist, int num_threads = 1) const {
+        const int num_queries = (int)queries.size();
+        index.resize(num_queries);
+        dist.resize(num_queries);
+        parallel_for(0, num_queries, num_threads, [&](int q) {
+            query_radius(queries[q], radius, index[q], dist[q]);
+        }, 64);
+    }
+};
+
+TC_NAMESPACE_END
@@ -29,6 +29,20 @@ TC_NAMESPACE_BEGIN
 
 namespace py = pybind11;
 
+// For bindings of long-running calls, so that other Python threads run meanwhile. Arguments and results are
+// converted with the GIL held; C++ code calling back into Python acquires it again.
+using release_gil = py::call_guard<py::gil_scoped_release>;
+
+// For Python callables that C++ code copies and calls without the GIL: copies share one reference, which is
+// only dropped with the GIL held. Callers take the GIL around calls.
+inline std::shared_ptr<py::function> hold_py_function(py::object func) {
+    return std::shared_ptr<py::function>(new py::function(py::reinterpret_borrow<py::function>(func)),
+                                         [](py::function *f) {
+                                             py::gil_scoped_acquire acquire;
+                                             delete f;
+                                         });
+}
+
 void export_math(py::module &m);
 
 void export_dynamics(py::module &m);
@@ -39,6 +53,8 @@ void export_misc(py::module &m);
 
 void export_io(py::module &m);
 
+void export_rigid2d(py::module &m);
+
 void export_ndarray(py::module &m);
 
 #define DEFINE_VECTOR_OF_NAMED(x, name) \
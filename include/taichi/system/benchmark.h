@@ -11,6 +11,7 @@
 
 #include <taichi/common/meta.h>
 #include <taichi/system/timer.h>
+#include <taichi/system/profiler.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -30,26 +31,41 @@ TC_NAMESPACE_BEGIN
             returns_time = config.get("returns_time", false);
         }
         virtual real run(int iterations=16) {
+            return run_repeated(1, iterations)[0];
+        }
+        // One setup and warm-up, then the result of run(iterations) for each of the repetitions
+        std::vector<real> run_repeated(int repetitions, int iterations=16) {
             setup();
             for (int i = 0; i < warm_up_iterations; i++) {
                 iterate();
             }
-            double start_t;
-            if (returns_time)
-                start_t = Time::get_time();
-            else
-                start_t = (double)Time::get_cycles();
-            for (int i = 0; i < iterations; i++) {
-                iterate();
+            std::vector<real> results;
+            for (int r = 0; r < repetitions; r++) {
+                double start_t;
+                if (returns_time)
+                    start_t = Time::get_time();
+                else
+                    start_t = (double)Time::get_cycles();
+                for (int i = 0; i < iterations; i++) {
+                    iterate();
+                }
+                double end_t;
+                if (returns_time)
+                    end_t = Time::get_time();
+                else
+                    end_t = (double)Time::get_cycles();
+                real elapsed = (real)(end_t - start_t);
+                results.push_back(elapsed / (iterations * workload));
             }
-            double end_t;
-            if (returns_time)
-                end_t = Time::get_time();
-            else
-                end_t = (double)Time::get_cycles();
-            real elapsed = (real)(end_t - start_t);
             finalize();
-            return elapsed / (iterations * workload);
+            return results;
+        }
+        int64 get_workload() const {
+            return workload;
+        }
+        // Per-phase timings of the last run, for benchmarks that break their iterations down
+        virtual std::vector<ProfilerRecord> get_profile() const {
+            return std::vector<ProfilerRecord>();
         }
         virtual bool test() const override {
             return true;
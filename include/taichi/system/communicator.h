@@ -0,0 +1,35 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <taichi/common/meta.h>
+
+TC_NAMESPACE_BEGIN
+
+// Message passing between the processes of a distributed simulation.
+// Ranks form a line: point-to-point traffic only goes to rank - 1 and rank + 1.
+// Every call is collective, i.e. all ranks must make the same calls in the same order.
+class Communicator : public Unit {
+public:
+    virtual int get_rank() const = 0;
+
+    virtual int get_num_ranks() const = 0;
+
+    // Sends send[0] to rank - 1 and send[1] to rank + 1, and receives from them into recv[0]
+    // and recv[1]. On the first and last rank the missing side is ignored and left empty.
+    virtual void exchange_with_neighbours(const std::vector<char> send[2], std::vector<char> recv[2]) = 0;
+
+    virtual int64 all_reduce_min(int64 val) = 0;
+};
+
+TC_INTERFACE(Communicator);
+
+TC_NAMESPACE_END
@@ -0,0 +1,73 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <string>
+#include <taichi/common/util.h>
+
+TC_NAMESPACE_BEGIN
+
+// Hot kernels are compiled once per CPU target and picked at run time, so that one build runs on every x86-64
+// CPU and still uses AVX2 and AVX-512 where they are available. The rest of the code is compiled for the
+// baseline (SSE2), unless CMake's TC_NATIVE_ARCH builds everything for the building machine.
+//
+// A dispatched kernel lives in a kernels header, included by foo.cpp (baseline) and by foo_avx2.cpp and
+// foo_avx512.cpp, which CMake compiles with those instruction sets enabled. Each includer defines
+// TC_CPU_DISPATCH_NAMESPACE (cpu_baseline, cpu_avx2 or cpu_avx512) first, and the header puts everything it
+// defines into that namespace, so that the variants do not collide. foo.cpp then declares the variants with
+// TC_DECLARE_CPU_VARIANTS and calls the one select_cpu_variant picks.
+//
+// Functions shared with the rest of the build (e.g. inline ones of glm) must be inlined into the variants:
+// the linker keeps one copy of each, which must not be one compiled for a wider instruction set. Likewise the
+// variants must not have static initializers of their own, which run on every CPU.
+enum class CPUTarget {
+    baseline = 0,
+    avx2 = 1,
+    // AVX-512 F, VL, BW and DQ
+    avx512 = 2,
+};
+
+// The best target of the running CPU and OS, capped by the environment variable TC_CPU_TARGET ("baseline",
+// "avx2" or "avx512") if set, e.g. for comparing the variants
+CPUTarget get_cpu_target();
+
+std::string get_cpu_target_name(CPUTarget target);
+
+inline std::string get_cpu_target_name() {
+    return get_cpu_target_name(get_cpu_target());
+}
+
+template <typename F>
+F select_cpu_variant(F baseline, F avx2, F avx512) {
+    switch (get_cpu_target()) {
+        case CPUTarget::avx512:
+            return avx512;
+        case CPUTarget::avx2:
+            return avx2;
+        default:
+            return baseline;
+    }
+}
+
+#define TC_DECLARE_CPU_VARIANTS(return_type, name, parameters) \
+    namespace cpu_baseline {                                   \
+    return_type name parameters;                               \
+    }                                                          \
+    namespace cpu_avx2 {                                       \
+    return_type name parameters;                               \
+    }                                                          \
+    namespace cpu_avx512 {                                     \
+    return_type name parameters;                               \
+    }
+
+// The variant of name for this CPU, looked up once
+#define TC_CPU_VARIANT(name) select_cpu_variant(&cpu_baseline::name, &cpu_avx2::name, &cpu_avx512::name)
+
+TC_NAMESPACE_END
@@ -0,0 +1,82 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <taichi/common/util.h>
+
+TC_NAMESPACE_BEGIN
+
+// Counts of CPU events, in user space. Counters the CPU or kernel does not provide stay 0.
+struct HardwareCounterValues {
+    static const int cache_line_size = 64;
+
+    int64 cycles = 0;
+    int64 instructions = 0;
+    int64 l1d_misses = 0;
+    int64 llc_misses = 0;
+    int64 branch_misses = 0;
+
+    double get_ipc() const {
+        return cycles > 0 ? (double)instructions / cycles : 0.0;
+    }
+
+    // Traffic from DRAM, estimated as one cache line per last level cache miss. Uncore memory controller
+    // counters would be exact, but differ between CPU models.
+    int64 get_dram_bytes() const {
+        return llc_misses * cache_line_size;
+    }
+
+    HardwareCounterValues operator-(const HardwareCounterValues &o) const {
+        HardwareCounterValues d;
+        d.cycles = cycles - o.cycles;
+        d.instructions = instructions - o.instructions;
+        d.l1d_misses = l1d_misses - o.l1d_misses;
+        d.llc_misses = llc_misses - o.llc_misses;
+        d.branch_misses = branch_misses - o.branch_misses;
+        return d;
+    }
+
+    HardwareCounterValues &operator+=(const HardwareCounterValues &o) {
+        cycles += o.cycles;
+        instructions += o.instructions;
+        l1d_misses += o.l1d_misses;
+        llc_misses += o.llc_misses;
+        branch_misses += o.branch_misses;
+        return *this;
+    }
+};
+
+// Process-wide hardware event counts through perf_event groups, Linux only. Threads get counters of their own
+// once they attach, which worker threads of the ThreadPool do when they join a job while counting is on, and
+// reads sum over all attached threads. As with RenderCounters, work running alongside is counted too.
+class HardwareCounters {
+public:
+    static bool is_available();
+
+    static bool is_enabled() {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    // Returns whether counting is on, i.e. false where perf events can not be opened, e.g. when
+    // /proc/sys/kernel/perf_event_paranoid forbids them
+    static bool set_enabled(bool enabled);
+
+    // Counts the calling thread from now on, if counting is enabled; cheap once attached
+    static void attach_thread();
+
+    // Totals of all attached threads, including exited ones
+    static HardwareCounterValues read();
+
+private:
+    static std::atomic<bool> enabled;
+};
+
+TC_NAMESPACE_END
@@ -0,0 +1,315 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <typeindex>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Cache line size on all the x86 CPUs we target
+const int tc_cache_line_size = 64;
+
+// Bytes allocated through aligned_malloc, and reported by other allocators, per subsystem tag. Allocations
+// are accounted to the innermost TC_MEMORY_TAG scope of the allocating thread, or to "untagged" outside of
+// any, and their frees to the same tag, wherever they happen.
+class MemoryAccounting {
+public:
+    static const int max_num_tags = 256;
+
+    struct Record {
+        std::string name;
+        int64 current;
+        // Since the last reset_peaks()
+        int64 peak;
+        int64 num_allocations;
+    };
+
+    // The tag of that name, registered on first use
+    static int get_tag(const std::string &name);
+
+    static int get_current_tag();
+
+    // Negative bytes for frees
+    static void add(int tag, int64 bytes);
+
+    // Of the tags used so far
+    static std::vector<Record> get_records();
+
+    static int64 get_current_bytes();
+
+    static int64 get_peak_bytes();
+
+    static void reset_peaks();
+
+    static void print();
+
+    class Scope {
+    protected:
+        int previous_tag;
+
+    public:
+        explicit Scope(int tag);
+
+        Scope(const Scope &) = delete;
+
+        Scope &operator=(const Scope &) = delete;
+
+        ~Scope();
+    };
+};
+
+#define TC_MEMORY_TAG_NAME_(prefix, line) prefix##line
+#define TC_MEMORY_TAG_NAME(prefix, line) TC_MEMORY_TAG_NAME_(prefix, line)
+#define TC_MEMORY_TAG(name)                                                                                  \
+    static const int TC_MEMORY_TAG_NAME(tc_memory_tag_, __LINE__) = MemoryAccounting::get_tag(name);         \
+    MemoryAccounting::Scope TC_MEMORY_TAG_NAME(tc_memory_tag_scope_, __LINE__)(                                \
+            TC_MEMORY_TAG_NAME(tc_memory_tag_, __LINE__))
+
+// Precedes every block of aligned_malloc, so that aligned_free knows what to account
+struct AlignedBlockHeader {
+    int64 size;
+    int32_t tag;
+    // From the start of the underlying allocation to the block
+    int32_t offset;
+};
+
+static_assert(sizeof(AlignedBlockHeader) == 16, "AlignedBlockHeader should take 16 bytes");
+
+inline void *aligned_malloc(std::size_t size, std::size_t alignment = tc_cache_line_size) {
+    void *ptr = nullptr;
+    // The header takes a whole alignment unit, or more for alignments below its size
+    const std::size_t offset = std::max(alignment, sizeof(AlignedBlockHeader));
+    alignment = std::max(alignment, sizeof(void *));
+#ifdef _WIN64
+    ptr = _aligned_malloc(size + offset, alignment);
+#else
+    if (posix_memalign(&ptr, alignment, size + offset) != 0) {
+        ptr = nullptr;
+    }
+#endif
+    if (ptr == nullptr) {
+        return nullptr;
+    }
+    char *block = static_cast<char *>(ptr) + offset;
+    AlignedBlockHeader *header = reinterpret_cast<AlignedBlockHeader *>(block) - 1;
+    header->size = (int64)size;
+    header->tag = MemoryAccounting::get_current_tag();
+    header->offset = (int32_t)offset;
+    MemoryAccounting::add(header->tag, header->size);
+    return block;
+}
+
+inline void aligned_free(void *ptr) {
+    if (ptr == nullptr) {
+        return;
+    }
+    AlignedBlockHeader *header = static_cast<AlignedBlockHeader *>(ptr) - 1;
+    MemoryAccounting::add(header->tag, -header->size);
+    ptr = static_cast<char *>(ptr) - header->offset;
+#ifdef _WIN64
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+// STL allocator returning `alignment`-byte aligned storage, so that SIMD loads
+// on the first element of a std::vector never straddle a cache line.
+template <typename T, std::size_t alignment = tc_cache_line_size>
+class AlignedAllocator {
+public:
+    typedef T value_type;
+    typedef T *pointer;
+    typedef const T *const_pointer;
+    typedef T &reference;
+    typedef const T &const_reference;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    template <typename U>
+    struct rebind {
+        typedef AlignedAllocator<U, alignment> other;
+    };
+
+    AlignedAllocator() {}
+
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, alignment> &) {}
+
+    T *allocate(std::size_t n) {
+        void *ptr = aligned_malloc(n * sizeof(T), alignment);
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T *>(ptr);
+    }
+
+    void deallocate(T *ptr, std::size_t) {
+        aligned_free(ptr);
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, alignment> &) const {
+        return true;
+    }
+
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, alignment> &) const {
+        return false;
+    }
+};
+
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+// AlignedAllocator whose resize() default-initializes instead of value-initializing, so that elements of
+// trivial types are left untouched until first written. That lets the thread that will work on a page
+// be the one to first touch it, which places the page on its NUMA node.
+template <typename T, std::size_t alignment = tc_cache_line_size>
+class UninitializedAllocator : public AlignedAllocator<T, alignment> {
+public:
+    template <typename U>
+    struct rebind {
+        typedef UninitializedAllocator<U, alignment> other;
+    };
+
+    UninitializedAllocator() {}
+
+    template <typename U>
+    UninitializedAllocator(const UninitializedAllocator<U, alignment> &) {}
+
+    template <typename U>
+    void construct(U *ptr) {
+        ::new (static_cast<void *>(ptr)) U;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U *ptr, Args &&... args) {
+        ::new (static_cast<void *>(ptr)) U(std::forward<Args>(args)...);
+    }
+
+    template <typename U>
+    bool operator==(const UninitializedAllocator<U, alignment> &) const {
+        return true;
+    }
+
+    template <typename U>
+    bool operator!=(const UninitializedAllocator<U, alignment> &) const {
+        return false;
+    }
+};
+
+template <typename T>
+using UninitializedVector = std::vector<T, UninitializedAllocator<T>>;
+
+// Selects the constructors that allocate without initializing, e.g. Array3D(res, uninitialized)
+struct UninitializedTag {};
+
+const UninitializedTag uninitialized = UninitializedTag();
+
+// Bump allocator for many small objects with a common lifetime, e.g. the particles of a simulator.
+// Objects are laid out in allocation order in large chunks and never move, so pointers stay valid
+// until clear(), which releases everything at once. Objects must be trivially destructible.
+// A single object can be given back with destroy(), which keeps its slot on a free list of its type for
+// the next create() of that type, so that a simulator removing and adding objects does not grow the arena.
+class MemoryArena {
+protected:
+    std::vector<char *> chunks;
+    std::size_t chunk_size;
+    // Bump pointer into the last chunk
+    char *head = nullptr, *tail = nullptr;
+    std::size_t allocated_bytes = 0;
+    // Slots of destroyed objects, per type
+    std::unordered_map<std::type_index, std::vector<void *>> free_slots;
+
+public:
+    explicit MemoryArena(std::size_t chunk_size = 1 << 20) : chunk_size(chunk_size) {}
+
+    MemoryArena(const MemoryArena &) = delete;
+
+    MemoryArena &operator=(const MemoryArena &) = delete;
+
+    ~MemoryArena() {
+        clear();
+    }
+
+    void *allocate(std::size_t size, std::size_t alignment = alignof(std::max_align_t)) {
+        std::size_t padding = (alignment - reinterpret_cast<std::uintptr_t>(head) % alignment) % alignment;
+        if (head == nullptr || padding + size > std::size_t(tail - head)) {
+            // Oversized requests get a chunk of their own
+            const std::size_t new_chunk_size = std::max(chunk_size, size + alignment);
+            char *chunk = static_cast<char *>(aligned_malloc(new_chunk_size, tc_cache_line_size));
+            if (chunk == nullptr) {
+                throw std::bad_alloc();
+            }
+            chunks.push_back(chunk);
+            head = chunk;
+            tail = chunk + new_chunk_size;
+            padding = (alignment - reinterpret_cast<std::uintptr_t>(head) % alignment) % alignment;
+        }
+        void *ptr = head + padding;
+        head += padding + size;
+        allocated_bytes += size;
+        return ptr;
+    }
+
+    template <typename T, typename... Args>
+    T *create(Args &&... args) {
+        static_assert(std::is_trivially_destructible<T>::value,
+                      "MemoryArena never runs destructors");
+        auto slots = free_slots.find(std::type_index(typeid(T)));
+        if (slots != free_slots.end() && !slots->second.empty()) {
+            void *slot = slots->second.back();
+            slots->second.pop_back();
+            allocated_bytes += sizeof(T);
+            return new (slot) T(std::forward<Args>(args)...);
+        }
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // T has to be the dynamic type of the object, as its slot is reused only by create<T>()
+    template <typename T>
+    void destroy(T *ptr) {
+        assert_info(typeid(*ptr) == typeid(T), "MemoryArena::destroy needs the dynamic type of the object");
+        ptr->~T();
+        free_slots[std::type_index(typeid(T))].push_back(ptr);
+        allocated_bytes -= sizeof(T);
+    }
+
+    // Invalidates every object of the arena
+    void clear() {
+        for (auto chunk : chunks) {
+            aligned_free(chunk);
+        }
+        chunks.clear();
+        head = tail = nullptr;
+        allocated_bytes = 0;
+        free_slots.clear();
+    }
+
+    // Of the live objects
+    std::size_t get_allocated_bytes() const {
+        return allocated_bytes;
+    }
+};
+
+TC_NAMESPACE_END
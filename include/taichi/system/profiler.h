@@ -0,0 +1,138 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <taichi/common/util.h>
+#include <taichi/system/hardware_counters.h>
+#include <taichi/system/timer.h>
+#include <taichi/system/tracer.h>
+
+TC_NAMESPACE_BEGIN
+
+// Wall-clock statistics of one named phase. Times are in seconds; bytes is an estimate of the
+// memory traffic, summed over all calls. hardware sums the hardware counters over the calls made while
+// HardwareCounters were enabled.
+struct ProfilerRecord {
+    std::string name;
+    int64 count = 0;
+    double total = 0, max = 0;
+    uint64 bytes = 0;
+    HardwareCounterValues hardware;
+
+    double get_mean() const {
+        return count == 0 ? 0.0 : total / count;
+    }
+};
+
+// Accumulates per-phase timings of a simulator, e.g. the stages of a substep.
+// A scope costs a name lookup and two clock reads, cheap enough to leave on in production runs.
+class Profiler {
+protected:
+    // In order of first use
+    std::vector<ProfilerRecord> records;
+    std::map<std::string, int> record_ids;
+
+public:
+    bool enabled = true;
+
+    ProfilerRecord &get_record(const std::string &name) {
+        auto it = record_ids.find(name);
+        if (it == record_ids.end()) {
+            it = record_ids.insert(std::make_pair(name, (int)records.size())).first;
+            records.emplace_back();
+            records.back().name = name;
+        }
+        return records[it->second];
+    }
+
+    void add(const std::string &name, double elapsed, uint64 bytes = 0,
+             const HardwareCounterValues &hardware = HardwareCounterValues()) {
+        ProfilerRecord &record = get_record(name);
+        record.count++;
+        record.total += elapsed;
+        record.max = std::max(record.max, elapsed);
+        record.bytes += bytes;
+        record.hardware += hardware;
+    }
+
+    // Adds the records of other, e.g. to fold the profile of one solve into that of a whole run
+    void merge(const Profiler &other) {
+        for (auto &other_record : other.records) {
+            ProfilerRecord &record = get_record(other_record.name);
+            record.count += other_record.count;
+            record.total += other_record.total;
+            record.max = std::max(record.max, other_record.max);
+            record.bytes += other_record.bytes;
+            record.hardware += other_record.hardware;
+        }
+    }
+
+    const std::vector<ProfilerRecord> &get_records() const {
+        return records;
+    }
+
+    void clear() {
+        records.clear();
+        record_ids.clear();
+    }
+
+    void print() const {
+        for (auto &record : records) {
+            printf("%-24s count %8lld  total %10.3f ms  mean %9.3f ms  max %9.3f ms  %10.1f MB\n",
+                   record.name.c_str(), (long long)record.count, record.total * 1e3, record.get_mean() * 1e3,
+                   record.max * 1e3, record.bytes * 1e-6);
+        }
+    }
+
+    // Times the enclosing block as the phase `name`, which also goes on the Tracer timeline
+    class Scope {
+    protected:
+        Profiler &profiler;
+        const char *name;
+        uint64 bytes;
+        double start_time;
+        Tracer::Scope trace;
+        bool count_hardware;
+        HardwareCounterValues start_hardware;
+
+    public:
+        Scope(Profiler &profiler, const char *name, uint64 bytes = 0)
+                : profiler(profiler), name(name), bytes(bytes), trace(name) {
+            start_time = profiler.enabled ? Time::get_time() : 0;
+            count_hardware = profiler.enabled && HardwareCounters::is_enabled();
+            if (count_hardware) {
+                HardwareCounters::attach_thread();
+                start_hardware = HardwareCounters::read();
+            }
+        }
+
+        Scope(const Scope &) = delete;
+
+        Scope &operator=(const Scope &) = delete;
+
+        // For traffic that is only known once the phase has run
+        void add_bytes(uint64 bytes) {
+            this->bytes += bytes;
+        }
+
+        ~Scope() {
+            if (profiler.enabled) {
+                profiler.add(name, Time::get_time() - start_time, bytes,
+                             count_hardware ? HardwareCounters::read() - start_hardware : HardwareCounterValues());
+            }
+        }
+    };
+};
+
+TC_NAMESPACE_END
@@ -0,0 +1,107 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <taichi/common/util.h>
+
+TC_NAMESPACE_BEGIN
+
+enum class RenderCounter {
+    // Camera rays queried by path tracers
+    primary_rays,
+    // All closest hit queries through SceneGeometry, primary rays included
+    closest_hit_rays,
+    // Visibility queries through SceneGeometry
+    shadow_rays,
+    paths,
+    // Summed over paths, for their average length
+    path_vertices,
+    // ImageAccumulator::accumulate() calls
+    splats,
+    russian_roulette_terminations,
+    num_counters
+};
+
+// Work done over some time, e.g. a stage of a render. Rates are per second of that time.
+struct RenderStatistics {
+    int64 primary_rays = 0;
+    int64 secondary_rays = 0;
+    int64 shadow_rays = 0;
+    int64 paths = 0;
+    int64 path_vertices = 0;
+    int64 splats = 0;
+    int64 russian_roulette_terminations = 0;
+    double seconds = 0;
+
+    int64 get_rays() const {
+        return primary_rays + secondary_rays + shadow_rays;
+    }
+
+    double get_rays_per_second() const {
+        return get_rate(get_rays());
+    }
+
+    double get_paths_per_second() const {
+        return get_rate(paths);
+    }
+
+    double get_splats_per_second() const {
+        return get_rate(splats);
+    }
+
+    double get_average_path_length() const {
+        return paths > 0 ? (double)path_vertices / paths : 0.0;
+    }
+
+    double get_rate(int64 count) const {
+        return seconds > 0 ? count / seconds : 0.0;
+    }
+
+    RenderStatistics operator-(const RenderStatistics &o) const;
+
+    RenderStatistics &operator+=(const RenderStatistics &o);
+
+    // One line of rates, as Time::FPSCounter prints FPS
+    void print(const std::string &name) const;
+};
+
+// Process-wide counters of rendering work. Every thread adds to counters of its own without contention, and
+// reads sum over all threads, so they are exact once the counting threads are done. Renderers running at
+// the same time count together.
+class RenderCounters {
+public:
+    static void add(RenderCounter counter, int64 n = 1) {
+        std::atomic<int64> &value = get_local().values[(int)counter];
+        // Only this thread writes its counters
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    // The counts so far, with seconds since the process started counting
+    static RenderStatistics get_statistics();
+
+private:
+    struct Local {
+        std::atomic<int64> values[(int)RenderCounter::num_counters];
+
+        Local();
+
+        // Leaves its counts to the process-wide totals
+        ~Local();
+    };
+
+    static Local &get_local() {
+        thread_local Local local;
+        return local;
+    }
+};
+
+TC_NAMESPACE_END
@@ -0,0 +1,82 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <taichi/system/profiler.h>
+
+TC_NAMESPACE_BEGIN
+
+// What one solve of an iterative solver did. Times are in seconds, bytes estimate the memory traffic.
+struct SolverStatistics {
+    std::string solver;
+    int iterations = 0;
+    bool converged = false;
+    double tolerance = 0;
+    // Max norm of the residual, initially and after every iteration
+    std::vector<double> residual_history;
+    double solve_time = 0;
+    // The phases since the previous solve, e.g. "boundary_setup", "krylov" and "mg_level_N" for the
+    // V-cycle levels, each excluding the coarser ones
+    std::vector<ProfilerRecord> phases;
+
+    uint64 get_bytes() const {
+        uint64 bytes = 0;
+        for (auto &phase : phases) {
+            bytes += phase.bytes;
+        }
+        return bytes;
+    }
+
+    std::string to_json() const {
+        auto number = [](double x) {
+            char buffer[32];
+            snprintf(buffer, sizeof(buffer), "%.9g", x);
+            return std::string(buffer);
+        };
+        auto quote = [](const std::string &s) {
+            std::string quoted = "\"";
+            for (char c : s) {
+                if (c == '"' || c == '\\') {
+                    quoted += '\\';
+                }
+                quoted += c;
+            }
+            return quoted + "\"";
+        };
+        std::string json = "{\"solver\": " + quote(solver) + ", \"iterations\": " + std::to_string(iterations) +
+                           ", \"converged\": " + (converged ? "true" : "false") + ", \"tolerance\": " +
+                           number(tolerance) + ", \"solve_time\": " + number(solve_time) + ", \"bytes\": " +
+                           std::to_string(get_bytes()) + ", \"residual_history\": [";
+        for (int i = 0; i < (int)residual_history.size(); i++) {
+            json += (i ? ", " : "") + number(residual_history[i]);
+        }
+        json += "], \"phases\": {";
+        for (int i = 0; i < (int)phases.size(); i++) {
+            const ProfilerRecord &phase = phases[i];
+            json += (i ? ", " : "") + quote(phase.name) + ": {\"count\": " + std::to_string(phase.count) +
+                    ", \"total\": " + number(phase.total) + ", \"max\": " + number(phase.max) + ", \"bytes\": " +
+                    std::to_string(phase.bytes) + "}";
+        }
+        return json + "}}";
+    }
+
+    // Appends to_json() as one line of the JSON lines file fn
+    void append_to_log(const std::string &fn) const {
+        FILE *f = fopen(fn.c_str(), "a");
+        assert_info(f != nullptr, "Can not open solver statistics log " + fn);
+        fprintf(f, "%s\n", to_json().c_str());
+        fclose(f);
+    }
+};
+
+TC_NAMESPACE_END
@@ -10,8 +10,13 @@
 #pragma once
 #include <taichi/common/util.h>
 
+#include <algorithm>
 #include <atomic>
+#include <condition_variable>
+#include <exception>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include <vector>
 
@@ -48,11 +53,116 @@ public:
     }
 };
 
+// A value that many threads add to at once, without locks. Copies are not atomic, and only for containers.
+template <typename T>
+struct RelaxedAtomic {
+    std::atomic<T> value;
+
+    RelaxedAtomic(T value = T(0)) : value(value) {}
+
+    RelaxedAtomic(const RelaxedAtomic &o) : value(o.value.load(std::memory_order_relaxed)) {}
+
+    RelaxedAtomic &operator=(const RelaxedAtomic &o) {
+        value.store(o.value.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        return *this;
+    }
+
+    void add(T delta) {
+        T old = value.load(std::memory_order_relaxed);
+        while (!value.compare_exchange_weak(old, old + delta, std::memory_order_relaxed)) {
+        }
+    }
+
+    operator T() const {
+        return value.load(std::memory_order_relaxed);
+    }
+};
+
+// Process-wide pool of persistent worker threads.
+// A job over [begin, end) is split into one contiguous range per participating thread.
+// Participants consume their range grain_size indices at a time and, once it is empty,
+// steal the upper half of the largest remaining range. The calling thread always
+// participates; idle workers join any running job with a free slot, so nested jobs
+// are spread over idle workers and never create extra threads.
+class ThreadPool {
+public:
+    // body(begin, end) is invoked once per grain
+    using RangeFunction = std::function<void(int, int)>;
+
+    struct Statistics {
+        int64 jobs = 0;
+        int64 grains = 0;
+        int64 steals = 0;
+        int num_workers = 0;
+        // Seconds spent inside job bodies, summed over workers and callers
+        double busy_time = 0;
+        // Seconds since the pool was created or the statistics were reset
+        double wall_time = 0;
+
+        // Fraction of the (num_workers + 1) threads kept busy over wall_time
+        double get_utilization() const {
+            return wall_time > 0 ? busy_time / (wall_time * (num_workers + 1)) : 0.0;
+        }
+
+        void print() const;
+    };
+
+    static ThreadPool &get_instance();
+
+    // Blocks until body has been applied to all of [begin, end) by up to num_threads threads.
+    // grain_size <= 0 picks a grain that gives each thread about 32 grains.
+    void run(int begin, int end, int num_threads, const RangeFunction &body, int grain_size = 0);
+
+    // Pins worker i to core (i + 1) % hardware_concurrency, leaving core 0 to the caller.
+    // Only has an effect on Linux.
+    void set_core_pinning(bool pinning);
+
+    // When disabled, jobs issued from inside a job body run serially on the issuing thread
+    void set_nested_parallelism(bool enabled);
+
+    Statistics get_statistics() const;
+
+    void reset_statistics();
+
+    ~ThreadPool();
+
+private:
+    struct Slot;
+    struct Job;
+
+    ThreadPool();
+
+    void grow(int num_workers);
+
+    void work_on(Job &job, int slot);
+
+    void worker_loop(int id);
+
+    void pin_worker(int id);
+
+    Job *find_open_job() const;
+
+    std::vector<std::thread> workers;
+    mutable std::mutex mut;
+    std::condition_variable job_available, job_finished;
+    // Jobs that are still running, innermost last
+    std::vector<Job *> jobs;
+    bool stopping = false;
+    bool core_pinning = false;
+    std::atomic<bool> nested_parallelism;
+
+    std::atomic<int64> num_grains;
+    std::atomic<int64> num_steals;
+    std::atomic<int64> busy_nanoseconds;
+    int64 num_jobs = 0;
+    double statistics_start_time;
+};
+
 class ThreadedTaskManager {
 public:
     template <typename T>
-    void static run(const T &target, int begin, int end, int num_threads) {
-        if (num_threads == 1) {
+    void static run(const T &target, int begin, int end, int num_threads, int grain_size) {
+        if (num_threads <= 1 || end - begin <= 1) {
             // Single-threading
             for (int i = begin; i < end; i++) {
                 target(i);
@@ -60,28 +170,18 @@ public:
         }
         else {
             // Multi-threading
-            std::vector<std::thread *> threads;
-            std::vector<int> end_points;
-            for (int i = 0; i < num_threads; i++) {
-                end_points.push_back(i * (end - begin) / num_threads + begin);
-            }
-            end_points.push_back(end);
-            for (int i = 0; i < num_threads; i++) {
-                auto func = [&target, i, &end_points]() {
-                    int begin = end_points[i], end = end_points[i + 1];
-                    for (int k = begin; k < end; k++) {
-                        target(k);
-                    }
-                };
-                threads.push_back(new std::thread(func));
-            }
-            for (int i = 0; i < num_threads; i++) {
-                threads[i]->join();
-                delete threads[i];
-            }
+            ThreadPool::get_instance().run(begin, end, num_threads, [&target](int grain_begin, int grain_end) {
+                for (int k = grain_begin; k < grain_end; k++) {
+                    target(k);
+                }
+            }, grain_size);
         }
     }
     template <typename T>
+    void static run(const T &target, int begin, int end, int num_threads) {
+        return run(target, begin, end, num_threads, 0);
+    }
+    template <typename T>
     void static run(const T &target, int end, int num_threads) {
         return run(target, 0, end, num_threads);
     }
@@ -95,4 +195,97 @@ public:
     }
 };
 
-TC_NAMESPACE_END
\ No newline at end of file
+// Work submitted to an AsyncExecutor, for waiting on it or being called back when it is done
+class AsyncTask {
+public:
+    bool is_done() const;
+
+    // Up to timeout seconds, forever if negative; returns is_done()
+    bool wait(double timeout = -1);
+
+    // Waits, then rethrows what the work threw, if anything
+    void get();
+
+    // Called on the executor thread once the work is done, or right away if it already is
+    void add_callback(const std::function<void()> &callback);
+
+private:
+    friend class AsyncExecutor;
+
+    mutable std::mutex mut;
+    std::condition_variable finished;
+    bool done = false;
+    std::exception_ptr error;
+    std::vector<std::function<void()>> callbacks;
+
+    void finish(std::exception_ptr error);
+};
+
+// Runs submitted work in order on a background thread of its own, e.g. the next render stage while the
+// caller writes out the last one. Parallel loops in the work still run on the ThreadPool, with the executor
+// thread as their caller. Work on the same objects should go through the same executor.
+class AsyncExecutor {
+public:
+    AsyncExecutor();
+
+    std::shared_ptr<AsyncTask> submit(const std::function<void()> &work);
+
+    // Does not wait: queued work still runs, and the thread exits after it
+    ~AsyncExecutor();
+
+private:
+    struct Queue;
+
+    std::shared_ptr<Queue> queue;
+};
+
+// Preferred spelling for new code. Lower grain_size when the cost per index varies a lot.
+template <typename T>
+inline void parallel_for(int begin, int end, int num_threads, const T &target, int grain_size = 0) {
+    ThreadedTaskManager::run(target, begin, end, num_threads, grain_size);
+}
+
+// The combination of f(i) over [begin, end), from init, which combine must leave unchanged (e.g. 0 for sums).
+// Otherwise partial results of grains are combined as the grains finish, so non-associative combinations, e.g.
+// of floats, vary from run to run. With deterministic, the partial results are of at most 256 chunks that only
+// depend on the range, and are combined in order, so that results do not depend on num_threads either.
+template <typename R, typename F, typename C>
+inline R parallel_reduce(int begin, int end, int num_threads, const R &init, const F &f, const C &combine,
+                         bool deterministic = false) {
+    if (deterministic) {
+        const int chunk_size = std::max(1, (end - begin + 255) / 256);
+        const int num_chunks = std::max(0, (end - begin + chunk_size - 1) / chunk_size);
+        std::vector<R> partial(num_chunks, init);
+        parallel_for(0, num_chunks, num_threads, [&](int c) {
+            R acc = init;
+            for (int i = begin + c * chunk_size; i < std::min(end, begin + (c + 1) * chunk_size); i++) {
+                acc = combine(acc, f(i));
+            }
+            partial[c] = acc;
+        }, 1);
+        R result = init;
+        for (auto &p : partial) {
+            result = combine(result, p);
+        }
+        return result;
+    }
+    R result = init;
+    if (num_threads <= 1 || end - begin <= 1) {
+        for (int i = begin; i < end; i++) {
+            result = combine(result, f(i));
+        }
+        return result;
+    }
+    std::mutex mut;
+    ThreadPool::get_instance().run(begin, end, num_threads, [&](int grain_begin, int grain_end) {
+        R acc = init;
+        for (int i = grain_begin; i < grain_end; i++) {
+            acc = combine(acc, f(i));
+        }
+        std::lock_guard<std::mutex> _(mut);
+        result = combine(result, acc);
+    });
+    return result;
+}
+
+TC_NAMESPACE_END
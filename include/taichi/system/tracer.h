@@ -0,0 +1,89 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <taichi/common/util.h>
+
+TC_NAMESPACE_BEGIN
+
+// Process-wide timeline of named scopes, per thread, for chrome://tracing or Perfetto. Nesting is by time:
+// a scope contains the scopes its thread entered and left meanwhile. Every thread appends to a buffer of its
+// own, so scopes on different threads do not contend. While disabled, a scope costs one relaxed load.
+class Tracer {
+public:
+    // Longer names are truncated
+    static const int max_name_length = 47;
+
+    struct Event {
+        char name[max_name_length + 1];
+        // Nanoseconds since the process started
+        int64 begin, end;
+    };
+
+    static bool is_enabled() {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    static void set_enabled(bool enabled);
+
+    static int64 get_nanoseconds() {
+        return (int64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - epoch).count();
+    }
+
+    // On the calling thread's timeline, even while disabled
+    static void add_event(const char *name, int64 begin, int64 end);
+
+    // Shown for the calling thread's timeline instead of its number
+    static void set_thread_name(const std::string &name);
+
+    // Drops the events recorded so far
+    static void clear();
+
+    static int64 get_num_events();
+
+    // In the Chrome trace event format, which Perfetto reads as well
+    static void write_chrome_trace(const std::string &filename);
+
+    // Records the enclosing block, if the tracer was enabled when it began
+    class Scope {
+    protected:
+        const char *name;
+        int64 begin;
+
+    public:
+        explicit Scope(const char *name) : name(name) {
+            begin = is_enabled() ? get_nanoseconds() : -1;
+        }
+
+        Scope(const Scope &) = delete;
+
+        Scope &operator=(const Scope &) = delete;
+
+        ~Scope() {
+            if (begin >= 0) {
+                add_event(name, begin, get_nanoseconds());
+            }
+        }
+    };
+
+private:
+    static std::atomic<bool> enabled;
+    static const std::chrono::steady_clock::time_point epoch;
+};
+
+#define TC_TRACE_SCOPE_NAME_(line) tc_trace_scope_##line
+#define TC_TRACE_SCOPE_NAME(line) TC_TRACE_SCOPE_NAME_(line)
+#define TC_TRACE_SCOPE(name) Tracer::Scope TC_TRACE_SCOPE_NAME(__LINE__)(name)
+
+TC_NAMESPACE_END
@@ -23,11 +23,16 @@ struct IntersectionInfo;
 class BSDF {
 protected:
     SurfaceMaterial *material;
+    // If material is in the scene's material table, its compiled form is used instead of its virtual functions
+    const MaterialTable *material_table = nullptr;
+    int material_id = -1;
     Matrix3 world_to_local; // shaded normal
     Matrix3 local_to_world; // shaded normal
     Vector3 geometry_normal;
     bool front;
     Vector2 uv;
+    // Width of the texture lookups of the material, see TextureFootprint
+    real uv_footprint = 0;
 
 public:
     BSDF() {
@@ -58,7 +63,12 @@ public:
     bool is_emissive() const;
 
     bool is_index_matched() const {
-        return material->is_index_matched();
+        return material_id != -1 ? (*material_table)[material_id].index_matched : material->is_index_matched();
+    }
+
+    // The id of the material in the scene's material table, or -1, for grouping shading by material
+    int get_material_id() const {
+        return material_id;
     }
 
     bool is_entering(const Vector3 &in_dir) const {
@@ -0,0 +1,528 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include "ray_intersection.h"
+#include <taichi/system/threading.h>
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <thread>
+#include <vector>
+#if !defined(TC_DISABLE_SSE)
+#include <immintrin.h>
+#endif
+
+TC_NAMESPACE_BEGIN
+
+// A native BVH4, with no dependencies. The binary tree is built top-down with binned SAH, in parallel over
+// subtrees and, for large nodes, over the primitives being binned. It is then collapsed into 4-wide nodes
+// whose child boxes are tested against a ray at once with SSE.
+// Instances are expanded into triangles. update() refits the tree when only deformable instances changed,
+// and rebuilds it when dynamic ones did.
+class BVHRayIntersection : public RayIntersection {
+public:
+    using RayIntersection::query;
+    using RayIntersection::occlude;
+
+    void clear() override;
+
+    void build() override;
+
+    void update() override;
+
+    void query(Ray &ray) override;
+
+    bool occlude(Ray &ray) override;
+
+    void add_triangle(Triangle &triangle) override;
+
+private:
+    static const int num_bins = 16;
+    static const int max_leaf_size = 8;
+    // Nodes with more primitives have their two subtrees built in parallel, or their binning if larger
+    static const int parallel_subtree_size = 4096;
+    static const int parallel_binning_size = 1 << 16;
+
+    struct BoundingBox3 {
+        Vector3 lower, upper;
+
+        BoundingBox3()
+                : lower(std::numeric_limits<float>::max()), upper(std::numeric_limits<float>::lowest()) {}
+
+        void extend(const Vector3 &p) {
+            lower = min(lower, p);
+            upper = max(upper, p);
+        }
+
+        void extend(const BoundingBox3 &b) {
+            lower = min(lower, b.lower);
+            upper = max(upper, b.upper);
+        }
+
+        // Half the surface area, which is all SAH needs
+        real half_area() const {
+            const Vector3 d = max(upper - lower, Vector3(0.0f));
+            return d.x * d.y + d.y * d.z + d.z * d.x;
+        }
+    };
+
+    struct BuildNode {
+        BoundingBox3 bounds;
+        // Of the children for inner nodes, of the primitives in primitive_order for leaves
+        int left, right;
+        int first, count;
+
+        bool is_leaf() const {
+            return count > 0;
+        }
+    };
+
+    // Four children: bounds[0..2] are their lower x, y and z, bounds[3..5] their upper ones.
+    // counts[i] is -1 for empty slots, 0 for inner nodes (children[i] is the node) and otherwise the
+    // number of triangles of a leaf, starting at children[i].
+    struct Node {
+        alignas(16) float bounds[6][4];
+        int children[4];
+        int counts[4];
+    };
+
+    struct Bin {
+        BoundingBox3 bounds;
+        int count = 0;
+    };
+
+    int num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    std::vector<IntersectionTriangle> added_triangles;
+    // Input triangles: those added, then those of the instances
+    std::vector<IntersectionTriangle> triangles;
+    // Build state
+    std::vector<BoundingBox3> primitive_bounds;
+    std::vector<Vector3> centroids;
+    std::vector<int> primitive_order;
+    std::vector<BuildNode> build_nodes;
+    std::atomic<int> num_build_nodes;
+    // The tree, and the triangles in leaf order
+    std::vector<Node> nodes;
+    std::vector<IntersectionTriangle> triangle_data;
+
+    void gather_triangles();
+
+    void build_subtree(int b, int begin, int end, int depth);
+
+    // Into bins[k * num_bins + i], for bin i along axis k
+    void bin_primitives(int begin, int end, const BoundingBox3 &centroid_bounds, Bin *bins) const;
+
+    static int get_bin(real x, real lower, real extent) {
+        return std::min(num_bins - 1, (int)((x - lower) / extent * num_bins));
+    }
+
+    int collapse(int b);
+
+    BoundingBox3 refit(int node);
+
+    void set_child_bounds(Node &node, int i, const BoundingBox3 &bounds) {
+        for (int k = 0; k < 3; k++) {
+            node.bounds[k][i] = bounds.lower[k];
+            node.bounds[3 + k][i] = bounds.upper[k];
+        }
+    }
+
+    // Bit i is set if the ray hits child box i within (t_near, t_far); their entry distances go to t_entry
+    // near[k] and far[k] are the rows of bounds the ray enters and leaves axis k's slab by
+    static int intersect_boxes(const Node &node, const Vector3 &orig, const Vector3 &inv_dir, const int near[3],
+                               const int far[3], real t_near, real t_far, float t_entry[4]);
+
+    template <bool any_hit>
+    bool traverse(Ray &ray, real t_far);
+};
+
+void BVHRayIntersection::clear() {
+    added_triangles.clear();
+    triangles.clear();
+    shapes.clear();
+    instances.clear();
+    nodes.clear();
+    triangle_data.clear();
+}
+
+void BVHRayIntersection::add_triangle(Triangle &triangle) {
+    added_triangles.push_back(IntersectionTriangle(triangle));
+}
+
+void BVHRayIntersection::gather_triangles() {
+    triangles = added_triangles;
+    for (auto &instance : instances) {
+        get_triangles(instance, triangles);
+        instance.modified = false;
+    }
+}
+
+void BVHRayIntersection::bin_primitives(int begin, int end, const BoundingBox3 &centroid_bounds,
+                                        Bin *bins) const {
+    const Vector3 extent = centroid_bounds.upper - centroid_bounds.lower;
+    for (int i = begin; i < end; i++) {
+        const int p = primitive_order[i];
+        for (int k = 0; k < 3; k++) {
+            if (extent[k] <= 0.0f) {
+                continue;
+            }
+            const int bin = get_bin(centroids[p][k], centroid_bounds.lower[k], extent[k]);
+            bins[k * num_bins + bin].bounds.extend(primitive_bounds[p]);
+            bins[k * num_bins + bin].count++;
+        }
+    }
+}
+
+void BVHRayIntersection::build_subtree(int b, int begin, int end, int depth) {
+    const int count = end - begin;
+    BoundingBox3 bounds, centroid_bounds;
+    for (int i = begin; i < end; i++) {
+        bounds.extend(primitive_bounds[primitive_order[i]]);
+        centroid_bounds.extend(centroids[primitive_order[i]]);
+    }
+    build_nodes[b].bounds = bounds;
+    build_nodes[b].first = begin;
+    build_nodes[b].count = count;
+    if (count == 1) {
+        return;
+    }
+
+    Bin bins[3][num_bins];
+    if (count > parallel_binning_size) {
+        const int num_chunks = std::min(num_threads * 4, count / (parallel_binning_size / 16));
+        std::vector<Bin> chunk_bins(num_chunks * 3 * num_bins);
+        parallel_for(0, num_chunks, num_threads, [&](int c) {
+            bin_primitives(begin + (int)((int64)count * c / num_chunks), begin + (int)((int64)count * (c + 1) / num_chunks),
+                           centroid_bounds, &chunk_bins[c * 3 * num_bins]);
+        }, 1);
+        for (int c = 0; c < num_chunks; c++) {
+            for (int k = 0; k < 3; k++) {
+                for (int i = 0; i < num_bins; i++) {
+                    const Bin &bin = chunk_bins[(c * 3 + k) * num_bins + i];
+                    bins[k][i].bounds.extend(bin.bounds);
+                    bins[k][i].count += bin.count;
+                }
+            }
+        }
+    } else {
+        bin_primitives(begin, end, centroid_bounds, &bins[0][0]);
+    }
+
+    // SAH, relative to the cost of intersecting a triangle: a traversal step costs 1
+    const real leaf_cost = (real)count;
+    real best_cost = std::numeric_limits<real>::max();
+    int best_axis = -1, best_split = 0;
+    const Vector3 extent = centroid_bounds.upper - centroid_bounds.lower;
+    for (int k = 0; k < 3; k++) {
+        if (extent[k] <= 0.0f) {
+            continue;
+        }
+        real right_area[num_bins];
+        int right_count[num_bins];
+        BoundingBox3 right;
+        int n = 0;
+        for (int i = num_bins - 1; i > 0; i--) {
+            right.extend(bins[k][i].bounds);
+            n += bins[k][i].count;
+            right_area[i] = right.half_area();
+            right_count[i] = n;
+        }
+        BoundingBox3 left;
+        n = 0;
+        for (int i = 1; i < num_bins; i++) {
+            left.extend(bins[k][i - 1].bounds);
+            n += bins[k][i - 1].count;
+            if (n == 0 || right_count[i] == 0) {
+                continue;
+            }
+            const real cost = 1.0f + (left.half_area() * n + right_area[i] * right_count[i]) / bounds.half_area();
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = k;
+                best_split = i;
+            }
+        }
+    }
+
+    int middle;
+    if (best_axis == -1) {
+        // All centroids coincide
+        if (count <= max_leaf_size) {
+            return;
+        }
+        middle = begin + count / 2;
+    } else {
+        if (best_cost >= leaf_cost && count <= max_leaf_size) {
+            return;
+        }
+        const int k = best_axis;
+        middle = (int)(std::partition(primitive_order.begin() + begin, primitive_order.begin() + end, [&](int p) {
+            return get_bin(centroids[p][k], centroid_bounds.lower[k], extent[k]) < best_split;
+        }) - primitive_order.begin());
+    }
+
+    const int left = num_build_nodes.fetch_add(2);
+    build_nodes[b].left = left;
+    build_nodes[b].right = left + 1;
+    build_nodes[b].count = 0;
+    if (count > parallel_subtree_size) {
+        parallel_for(0, 2, num_threads, [&](int i) {
+            if (i == 0) {
+                build_subtree(left, begin, middle, depth + 1);
+            } else {
+                build_subtree(left + 1, middle, end, depth + 1);
+            }
+        }, 1);
+    } else {
+        build_subtree(left, begin, middle, depth + 1);
+        build_subtree(left + 1, middle, end, depth + 1);
+    }
+}
+
+int BVHRayIntersection::collapse(int b) {
+    // Opens the largest inner child until there are four
+    int children[4] = {build_nodes[b].left, build_nodes[b].right};
+    int num_children = 2;
+    while (num_children < 4) {
+        int largest = -1;
+        real largest_area = -1.0f;
+        for (int i = 0; i < num_children; i++) {
+            const BuildNode &child = build_nodes[children[i]];
+            if (!child.is_leaf() && child.bounds.half_area() > largest_area) {
+                largest = i;
+                largest_area = child.bounds.half_area();
+            }
+        }
+        if (largest == -1) {
+            break;
+        }
+        const BuildNode &child = build_nodes[children[largest]];
+        children[largest] = child.left;
+        children[num_children++] = child.right;
+    }
+    const int n = (int)nodes.size();
+    nodes.push_back(Node());
+    for (int i = 0; i < 4; i++) {
+        set_child_bounds(nodes[n], i, BoundingBox3());
+        nodes[n].children[i] = 0;
+        nodes[n].counts[i] = -1;
+    }
+    for (int i = 0; i < num_children; i++) {
+        const BuildNode &child = build_nodes[children[i]];
+        const int c = child.is_leaf() ? child.first : collapse(children[i]);
+        set_child_bounds(nodes[n], i, child.bounds);
+        nodes[n].children[i] = c;
+        nodes[n].counts[i] = child.is_leaf() ? child.count : 0;
+    }
+    return n;
+}
+
+void BVHRayIntersection::build() {
+    gather_triangles();
+    nodes.clear();
+    const int n = (int)triangles.size();
+    triangle_data.resize(n);
+    if (n == 0) {
+        return;
+    }
+    primitive_bounds.resize(n);
+    centroids.resize(n);
+    primitive_order.resize(n);
+    parallel_for(0, n, num_threads, [&](int i) {
+        BoundingBox3 b;
+        for (int k = 0; k < 3; k++) {
+            b.extend(triangles[i].get_vertex(k));
+        }
+        primitive_bounds[i] = b;
+        centroids[i] = 0.5f * (b.lower + b.upper);
+        primitive_order[i] = i;
+    }, 4096);
+    // A binary tree with leaves of at least one primitive has at most 2n - 1 nodes
+    build_nodes.resize(2 * n);
+    num_build_nodes = 1;
+    build_subtree(0, 0, n, 0);
+
+    const BuildNode &root = build_nodes[0];
+    if (root.is_leaf()) {
+        nodes.push_back(Node());
+        for (int i = 0; i < 4; i++) {
+            set_child_bounds(nodes[0], i, BoundingBox3());
+            nodes[0].children[i] = 0;
+            nodes[0].counts[i] = -1;
+        }
+        set_child_bounds(nodes[0], 0, root.bounds);
+        nodes[0].counts[0] = root.count;
+    } else {
+        nodes.reserve(num_build_nodes / 2 + 1);
+        collapse(0);
+    }
+    parallel_for(0, n, num_threads, [&](int i) {
+        triangle_data[i] = triangles[primitive_order[i]];
+    }, 4096);
+    std::vector<BuildNode>().swap(build_nodes);
+    std::vector<BoundingBox3>().swap(primitive_bounds);
+    std::vector<Vector3>().swap(centroids);
+}
+
+BVHRayIntersection::BoundingBox3 BVHRayIntersection::refit(int n) {
+    BoundingBox3 bounds;
+    for (int i = 0; i < 4; i++) {
+        const int count = nodes[n].counts[i];
+        if (count == -1) {
+            continue;
+        }
+        BoundingBox3 child;
+        if (count == 0) {
+            child = refit(nodes[n].children[i]);
+        } else {
+            for (int j = nodes[n].children[i]; j < nodes[n].children[i] + count; j++) {
+                for (int k = 0; k < 3; k++) {
+                    child.extend(triangle_data[j].get_vertex(k));
+                }
+            }
+        }
+        set_child_bounds(nodes[n], i, child);
+        bounds.extend(child);
+    }
+    return bounds;
+}
+
+void BVHRayIntersection::update() {
+    bool modified = false, rebuild = false;
+    for (auto &instance : instances) {
+        modified = modified || instance.modified;
+        rebuild = rebuild || (instance.modified && instance.mode == GeometryMode::dynamic);
+    }
+    if (rebuild) {
+        build();
+        return;
+    }
+    if (!modified || nodes.empty()) {
+        return;
+    }
+    gather_triangles();
+    parallel_for(0, (int)triangles.size(), num_threads, [&](int i) {
+        triangle_data[i] = triangles[primitive_order[i]];
+    }, 4096);
+    refit(0);
+}
+
+int BVHRayIntersection::intersect_boxes(const Node &node, const Vector3 &orig, const Vector3 &inv_dir,
+                                        const int near[3], const int far[3], real t_near, real t_far,
+                                        float t_entry[4]) {
+#if !defined(TC_DISABLE_SSE)
+    __m128 t_min = _mm_set1_ps(t_near), t_max = _mm_set1_ps(t_far);
+    for (int k = 0; k < 3; k++) {
+        const __m128 o = _mm_set1_ps(orig[k]), d = _mm_set1_ps(inv_dir[k]);
+        t_min = _mm_max_ps(t_min, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[near[k]]), o), d));
+        t_max = _mm_min_ps(t_max, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[far[k]]), o), d));
+    }
+    _mm_storeu_ps(t_entry, t_min);
+    return _mm_movemask_ps(_mm_cmple_ps(t_min, t_max));
+#else
+    int mask = 0;
+    for (int i = 0; i < 4; i++) {
+        real t_min = t_near, t_max = t_far;
+        for (int k = 0; k < 3; k++) {
+            t_min = std::max(t_min, (node.bounds[near[k]][i] - orig[k]) * inv_dir[k]);
+            t_max = std::min(t_max, (node.bounds[far[k]][i] - orig[k]) * inv_dir[k]);
+        }
+        t_entry[i] = t_min;
+        mask |= int(t_min <= t_max) << i;
+    }
+    return mask;
+#endif
+}
+
+template <bool any_hit>
+bool BVHRayIntersection::traverse(Ray &ray, real t_far) {
+    if (nodes.empty()) {
+        return false;
+    }
+    const real t_near = eps * 10;
+    const Vector3 orig = ray.orig, dir = ray.dir;
+    Vector3 inv_dir;
+    int near[3], far[3];
+    for (int k = 0; k < 3; k++) {
+        // Keeps the slab distances finite for axis-parallel rays
+        const real d = std::abs(dir[k]) < 1e-20f ? std::copysign(1e-20f, dir[k]) : dir[k];
+        inv_dir[k] = 1.0f / d;
+        near[k] = d >= 0 ? k : 3 + k;
+        far[k] = d >= 0 ? 3 + k : k;
+    }
+    struct Entry {
+        int child, count;
+        float t;
+    };
+    Entry stack[256];
+    int stack_size = 0;
+    stack[stack_size++] = Entry{0, 0, t_near};
+    int hit = -1;
+    real u = 0, v = 0;
+    while (stack_size) {
+        const Entry entry = stack[--stack_size];
+        if (entry.t > t_far) {
+            continue;
+        }
+        if (entry.count > 0) {
+            for (int i = entry.child; i < entry.child + entry.count; i++) {
+                if (triangle_data[i].intersect(orig, dir, t_near, t_far, u, v)) {
+                    hit = i;
+                    if (any_hit) {
+                        return true;
+                    }
+                }
+            }
+            continue;
+        }
+        const Node &node = nodes[entry.child];
+        float t_entry[4];
+        const int mask = intersect_boxes(node, orig, inv_dir, near, far, t_near, t_far, t_entry);
+        // Pushed far to near, so that the nearest is visited first
+        Entry hits[4];
+        int num_hits = 0;
+        for (int i = 0; i < 4; i++) {
+            if (mask >> i & 1) {
+                Entry e{node.children[i], node.counts[i], t_entry[i]};
+                int j = num_hits++;
+                for (; j > 0 && hits[j - 1].t < e.t; j--) {
+                    hits[j] = hits[j - 1];
+                }
+                hits[j] = e;
+            }
+        }
+        for (int i = 0; i < num_hits; i++) {
+            stack[stack_size++] = hits[i];
+        }
+    }
+    if (hit == -1) {
+        return false;
+    }
+    ray.dist = t_far;
+    ray.u = u;
+    ray.v = v;
+    ray.triangle_id = triangle_data[hit].id;
+    return true;
+}
+
+void BVHRayIntersection::query(Ray &ray) {
+    if (!traverse<false>(ray, Ray::DIST_INFINITE)) {
+        ray.dist = Ray::DIST_INFINITE;
+        ray.triangle_id = -1;
+    }
+}
+
+bool BVHRayIntersection::occlude(Ray &ray) {
+    Ray test = ray;
+    return traverse<true>(test, ray.dist);
+}
+
+TC_IMPLEMENTATION(RayIntersection, BVHRayIntersection, "bvh");
+
+TC_NAMESPACE_END
@@ -12,6 +12,11 @@
 #include <taichi/geometry/primitives.h>
 #include <taichi/visual/sampler.h>
 #include <taichi/common/meta.h>
+#include <algorithm>
+
+#if !defined(TC_DISABLE_SSE) && defined(__AVX__)
+#include <immintrin.h>
+#endif
 
 TC_NAMESPACE_BEGIN
 
@@ -22,6 +27,14 @@ public:
         return Ray(Vector3(0), Vector3(0));
     }
 
+    // The rays of n samples at once: out[k] is what sample(offsets[k], size, *rands[k]) would give, from the same
+    // random numbers, cone included. Cameras may generate them in batches; this falls back to sample() per ray.
+    virtual void generate_rays(int n, const Vector2 *offsets, Vector2 size, StateSequence *const *rands, Ray *out) {
+        for (int k = 0; k < n; k++) {
+            out[k] = sample(offsets[k], size, *rands[k]);
+        }
+    }
+
     Vector3 get_origin() {
         return multiply_matrix4(transform, origin, 1);
     }
@@ -60,6 +73,36 @@ protected:
     Vector2 random_offset(Vector2 offset, Vector2 size, real u, real v) {
         return Vector2(offset.x + u * size.x - 0.5f, offset.y + v * size.y - 0.5f);
     }
+
+    static const int ray_batch_size = 64;
+
+    // normalize(d + x[k] * r + y[k] * u) for k < n, into dx, dy and dz
+    static void get_directions(int n, const real *x, const real *y, const Vector3 &d, const Vector3 &r,
+                               const Vector3 &u, real *dx, real *dy, real *dz) {
+        int k = 0;
+#if !defined(TC_DISABLE_SSE) && defined(__AVX__)
+        real *out[3] = {dx, dy, dz};
+        for (; k + 8 <= n; k += 8) {
+            const __m256 vx = _mm256_loadu_ps(x + k), vy = _mm256_loadu_ps(y + k);
+            __m256 c[3], len2 = _mm256_setzero_ps();
+            for (int i = 0; i < 3; i++) {
+                c[i] = _mm256_add_ps(_mm256_set1_ps(d[i]), _mm256_add_ps(_mm256_mul_ps(vx, _mm256_set1_ps(r[i])),
+                                                                         _mm256_mul_ps(vy, _mm256_set1_ps(u[i]))));
+                len2 = _mm256_add_ps(len2, _mm256_mul_ps(c[i], c[i]));
+            }
+            const __m256 inv_len = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_sqrt_ps(len2));
+            for (int i = 0; i < 3; i++) {
+                _mm256_storeu_ps(out[i] + k, _mm256_mul_ps(c[i], inv_len));
+            }
+        }
+#endif
+        for (; k < n; k++) {
+            const Vector3 v = normalize(d + x[k] * r + y[k] * u);
+            dx[k] = v.x;
+            dy[k] = v.y;
+            dz[k] = v.z;
+        }
+    }
 };
 
 TC_INTERFACE(Camera);
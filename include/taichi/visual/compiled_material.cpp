@@ -0,0 +1,103 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/visual/compiled_material.h>
+
+TC_NAMESPACE_BEGIN
+
+MicrofacetDistribution get_microfacet_distribution(const std::string &name) {
+    if (name == "ggx") {
+        return MicrofacetDistribution::ggx;
+    } else if (name == "beckmann") {
+        return MicrofacetDistribution::beckmann;
+    }
+    error("Unknown microfacet distribution " + name);
+    return MicrofacetDistribution::ggx;
+}
+
+const MicrofacetAlbedo &MicrofacetAlbedo::get(MicrofacetDistribution distribution) {
+    // Built on first use, once per distribution
+    static const MicrofacetAlbedo ggx(MicrofacetDistribution::ggx);
+    static const MicrofacetAlbedo beckmann(MicrofacetDistribution::beckmann);
+    return distribution == MicrofacetDistribution::beckmann ? beckmann : ggx;
+}
+
+MicrofacetAlbedo::MicrofacetAlbedo(MicrofacetDistribution distribution) {
+    // Importance sampled with stratified samples, as rendering samples the lobe
+    const int strata = 32;
+    MicrofacetModel model;
+    model.distribution = distribution;
+    model.f0 = 1;
+    albedo.resize(resolution * resolution);
+    average_albedo.resize(resolution);
+    for (int j = 0; j < resolution; j++) {
+        const real roughness = std::max(1e-3f, real(j) / (resolution - 1));
+        for (int i = 0; i < resolution; i++) {
+            const real cos_theta = std::max(1e-3f, real(i) / (resolution - 1));
+            const Vector3 in(std::sqrt(1 - cos_theta * cos_theta), 0, cos_theta);
+            double sum = 0;
+            for (int k = 0; k < strata * strata; k++) {
+                const real u = (k % strata + 0.5f) / strata, v = (k / strata + 0.5f) / strata;
+                Vector3 out, f;
+                real pdf;
+                SurfaceEvent event;
+                MicrofacetLobe::sample(Vector3(1.0f), roughness, model, in, u, v, out, f, pdf, event);
+                if (pdf > 0) {
+                    sum += f.x * out.z / pdf;
+                }
+            }
+            albedo[j * resolution + i] = std::min(1.0f, real(sum / (strata * strata)));
+        }
+        // E_avg = 2 int_0^1 E(mu) mu dmu, by the trapezoidal rule
+        double average = 0;
+        for (int i = 0; i + 1 < resolution; i++) {
+            const real mu0 = real(i) / (resolution - 1), mu1 = real(i + 1) / (resolution - 1);
+            average += (albedo[j * resolution + i] * mu0 + albedo[j * resolution + i + 1] * mu1) * (mu1 - mu0);
+        }
+        average_albedo[j] = std::min(1.0f, real(average));
+    }
+}
+
+real MicrofacetAlbedo::get_albedo(real cos_theta, real roughness) const {
+    const real x = clamp(cos_theta, 0.0f, 1.0f) * (resolution - 1);
+    const real y = clamp(roughness, 0.0f, 1.0f) * (resolution - 1);
+    const int i = std::min((int)x, resolution - 2), j = std::min((int)y, resolution - 2);
+    const real fx = x - i, fy = y - j;
+    const real *row0 = &albedo[j * resolution + i], *row1 = row0 + resolution;
+    return lerp(fy, lerp(fx, row0[0], row0[1]), lerp(fx, row1[0], row1[1]));
+}
+
+real MicrofacetAlbedo::get_average_albedo(real roughness) const {
+    const real y = clamp(roughness, 0.0f, 1.0f) * (resolution - 1);
+    const int j = std::min((int)y, resolution - 2);
+    return lerp(y - j, average_albedo[j], average_albedo[j + 1]);
+}
+
+int MaterialTable::add(SurfaceMaterial *material) {
+    assert_info(material != nullptr, "Can not compile a null material");
+    auto it = ids.find(material);
+    if (it != ids.end()) {
+        return it->second;
+    }
+    CompiledMaterial compiled;
+    if (!material->compile(*this, compiled)) {
+        compiled = CompiledMaterial();
+    }
+    compiled.material = material;
+    compiled.delta = material->is_delta();
+    compiled.emissive = material->is_emissive();
+    compiled.index_matched = material->is_index_matched();
+    // Nested materials, added by compile(), come first
+    const int id = size();
+    materials.push_back(compiled);
+    ids[material] = id;
+    return id;
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,474 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <taichi/visual/surface_material.h>
+#include <taichi/visual/compiled_texture.h>
+
+TC_NAMESPACE_BEGIN
+
+// Scattering functions of the built-in materials, in local coordinates (shading normal along z).
+// The materials and their compiled forms below share them.
+
+struct DiffuseLobe {
+    static Vector3 sample_direction(const Vector3 &in, real u, real v) {
+        Vector3 normal(0, 0, sgn(in.z));
+        if (abs(in.z) > 1 - eps) {
+            return random_diffuse(normal, u, v);
+        } else {
+            // We do the following other than the above to ensure correlation for MCMC...
+            if (u > v) {
+                std::swap(u, v);
+            }
+            if (v < eps) {
+                v = eps;
+            }
+            u /= v;
+            real y = sqrt(1 - v * v);
+            real phi = u * 2.0f * pi;
+            real r = v / sqrt(in.x * in.x + in.y * in.y), p = in.x * r, q = in.y * r;
+            real c = cos(phi), s = sin(phi);
+            return Vector3(p * c - q * s, q * c + p * s, y * sgn(in.z));
+        }
+    }
+
+    static real probability_density(const Vector3 &in, const Vector3 &out) {
+        if (in.z * out.z < eps) {
+            return 0;
+        }
+        return std::abs(out.z) / pi;
+    }
+
+    static Vector3 evaluate(const Vector3 &color, const Vector3 &in, const Vector3 &out) {
+        return (in.z * out.z > eps ? 1.0f : 0.0f) * color * (1.0f / pi);
+    }
+
+    static void sample(const Vector3 &color, const Vector3 &in_dir, real u, real v, Vector3 &out_dir, Vector3 &f,
+                       real &pdf, SurfaceEvent &event) {
+        out_dir = sample_direction(in_dir, u, v);
+        f = evaluate(color, in_dir, out_dir);
+        event = (int)SurfaceScatteringFlags::non_delta;
+        pdf = out_dir.z / pi;
+    }
+};
+
+struct EmissiveLobe {
+    static real probability_density(const Vector3 &in, const Vector3 &out) {
+        if (in.z * out.z < eps) {
+            return 0;
+        }
+        return out.z / pi;
+    }
+
+    // No division by pi here.
+    static Vector3 evaluate(const Vector3 &color, const Vector3 &in, const Vector3 &out) {
+        return (in.z * out.z > 0 ? 1.0f : 0.0f) * color;
+    }
+
+    static void sample(const Vector3 &color, const Vector3 &in_dir, real u, real v, Vector3 &out_dir, Vector3 &f,
+                       real &pdf, SurfaceEvent &event) {
+        out_dir = random_diffuse(Vector3(0, 0, in_dir.z > 0 ? 1 : -1), u, v);
+        f = evaluate(color, in_dir, out_dir);
+        pdf = probability_density(in_dir, out_dir);
+        event = (int)SurfaceScatteringFlags::emit;
+    }
+};
+
+// Disney "principled" BRDF
+// https://disney-animation.s3.amazonaws.com/library/s2012_pbs_disney_brdf_notes_v2.pdf
+
+enum class MicrofacetDistribution {
+    // a.k.a. Trowbridge-Reitz, described in the paper "Microfacet Models for Refraction through Rough Surfaces"
+    ggx,
+    beckmann,
+};
+
+MicrofacetDistribution get_microfacet_distribution(const std::string &name);
+
+// Directional albedo E(cos_theta, roughness) of MicrofacetLobe with f0 = 1, and its cosine-weighted average
+// E_avg(roughness), tabulated once per distribution, for the energy compensation of "Revisiting Physically
+// Based Shading at Imageworks" (Kulla and Conty 2017)
+class MicrofacetAlbedo {
+public:
+    static const int resolution = 32;
+
+    static const MicrofacetAlbedo &get(MicrofacetDistribution distribution);
+
+    // Bilinear in both, with roughness clamped to [0, 1]
+    real get_albedo(real cos_theta, real roughness) const;
+
+    real get_average_albedo(real roughness) const;
+
+private:
+    explicit MicrofacetAlbedo(MicrofacetDistribution distribution);
+
+    // At cos_theta = i / (resolution - 1) and roughness = j / (resolution - 1), in albedo[j * resolution + i]
+    std::vector<real> albedo;
+    std::vector<real> average_albedo;
+};
+
+// The untextured parameters of MicrofacetLobe
+struct MicrofacetModel {
+    MicrofacetDistribution distribution = MicrofacetDistribution::ggx;
+    real f0 = 0;
+    // Adds the energy lost to single scattering back, if set
+    const MicrofacetAlbedo *albedo = nullptr;
+};
+
+// Microfacet reflection with roughness as the alpha of the distribution, sampled from the normals visible from
+// the incoming direction, which wastes no samples on back-facing microfacets at grazing angles
+struct MicrofacetLobe {
+    static real evaluateD(MicrofacetDistribution distribution, real roughness, const Vector3 &h) {
+        const real cos2 = sqr(h.z);
+        if (distribution == MicrofacetDistribution::beckmann) {
+            if (cos2 < 1e-6f) {
+                return 0.0f;
+            }
+            const real a2 = sqr(roughness);
+            return std::exp((cos2 - 1) / (cos2 * a2)) / (pi * a2 * sqr(cos2));
+        }
+        return sqr(roughness) / std::max(1e-6f, (pi * sqr((sqr(roughness) - 1) * cos2 + 1.0f)));
+    }
+
+    // Smith's Lambda, with the masking G1(w) = 1 / (1 + Lambda(w))
+    static real Lambda(MicrofacetDistribution distribution, real roughness, const Vector3 &w) {
+        const real cos2 = sqr(w.z), sin2 = std::max(0.0f, 1 - cos2);
+        if (sin2 == 0) {
+            return 0.0f;
+        }
+        const real tan2 = sin2 / std::max(1e-12f, cos2);
+        if (distribution == MicrofacetDistribution::beckmann) {
+            // Walter et al.'s rational approximation
+            const real b = 1.0f / (roughness * std::sqrt(tan2));
+            return b < 1.6f ? (1 - 1.259f * b + 0.396f * b * b) / (3.535f * b + 2.181f * b * b) : 0.0f;
+        }
+        return 0.5f * (std::sqrt(1 + sqr(roughness) * tan2) - 1);
+    }
+
+    static real G1(MicrofacetDistribution distribution, real roughness, const Vector3 &w) {
+        return 1.0f / (1.0f + Lambda(distribution, roughness, w));
+    }
+
+    // A normal of the microfacets visible from in (in.z >= 0), i.e. with density G1(in) max(0, in.h) D(h) / in.z,
+    // from "Sampling the GGX Distribution of Visible Normals" (Heitz 2018) and, for Beckmann, the inversion of
+    // "Importance Sampling Microfacet-Based BSDFs using the Distribution of Visible Normals" (Heitz and d'Eon
+    // 2014) as in Mitsuba, which is continuous in u and v for MCMC
+    static Vector3 sample_visible_normal(MicrofacetDistribution distribution, real roughness, const Vector3 &in,
+                                         real u, real v) {
+        const Vector3 stretched = normalized(Vector3(roughness * in.x, roughness * in.y, in.z));
+        if (distribution == MicrofacetDistribution::beckmann) {
+            const Vector2 slope = sample_beckmann_visible_slope(std::acos(clamp(stretched.z, -1.0f, 1.0f)), u, v);
+            const real len_xy = std::sqrt(sqr(stretched.x) + sqr(stretched.y));
+            const real cos_phi = len_xy > 0 ? stretched.x / len_xy : 1.0f;
+            const real sin_phi = len_xy > 0 ? stretched.y / len_xy : 0.0f;
+            const real sx = (cos_phi * slope.x - sin_phi * slope.y) * roughness;
+            const real sy = (sin_phi * slope.x + cos_phi * slope.y) * roughness;
+            return normalized(Vector3(-sx, -sy, 1.0f));
+        }
+        const real len2 = sqr(stretched.x) + sqr(stretched.y);
+        const Vector3 t1 = len2 > 0 ? Vector3(-stretched.y, stretched.x, 0) / std::sqrt(len2) : Vector3(1, 0, 0);
+        const Vector3 t2 = cross(stretched, t1);
+        const real r = std::sqrt(u), phi = 2 * pi * v;
+        const real p1 = r * std::cos(phi), s = 0.5f * (1 + stretched.z);
+        const real p2 = (1 - s) * std::sqrt(std::max(0.0f, 1 - p1 * p1)) + s * r * std::sin(phi);
+        const Vector3 n = p1 * t1 + p2 * t2 + std::sqrt(std::max(0.0f, 1 - p1 * p1 - p2 * p2)) * stretched;
+        return normalized(Vector3(roughness * n.x, roughness * n.y, std::max(1e-6f, n.z)));
+    }
+
+    // Fresnel term: Schlick approx.
+    static real F(real f0, real cos_theta) {
+        real c = 1 - cos_theta;
+        return f0 + (1 - f0) * ((c * c) * (c * c) * c);
+    }
+
+    // Shadowing term: the masking of in only, with Disney's remapped roughness, for GGX, and Smith's separable
+    // masking-shadowing for Beckmann
+    static real G(MicrofacetDistribution distribution, real roughness, const Vector3 &in_dir, const Vector3 &out_dir,
+                  const Vector3 &h) {
+        if (dot(in_dir, h) * in_dir.z < eps) {
+            return 0.0f;
+        }
+        if (distribution == MicrofacetDistribution::beckmann) {
+            return G1(distribution, roughness, in_dir) * G1(distribution, roughness, out_dir);
+        }
+        const real a = 0.5f + roughness * 0.5f;
+        return 2.0f / (1 + std::sqrt(1 + a * a * (sqr(1.0f / std::max(1e-6f, std::abs(in_dir.z))) - 1.0f)));
+    }
+
+    static Vector3 reflect(const Vector3 &in, const Vector3 &_h) {
+        auto h = normalized(_h);
+        return in - 2.0f * (in - dot(in, h) * h);
+    }
+
+    // Of sampling the compensation lobe, cosine-weighted, instead of visible normals: its share 1 - E(in) of the
+    // albedo, as visible normals rarely reach the directions far from the reflection that it adds to
+    static real get_multiple_scattering_probability(real roughness, const MicrofacetModel &model,
+                                                    const Vector3 &in) {
+        return model.albedo != nullptr ? 1 - model.albedo->get_albedo(std::abs(in.z), roughness) : 0.0f;
+    }
+
+    // The result is guarded by evaluate() from penetration. Directions from below are mirrored into the upper
+    // hemisphere and back.
+    static Vector3 sample_direction(real roughness, const MicrofacetModel &model, const Vector3 &in, real u,
+                                    real v) {
+        const real side = in.z < 0 ? -1.0f : 1.0f;
+        const real multiple = get_multiple_scattering_probability(roughness, model, in);
+        if (u < multiple) {
+            return random_diffuse(Vector3(0, 0, side), u / multiple, v);
+        }
+        u = (u - multiple) / (1 - multiple);
+        const Vector3 upper(in.x, in.y, side * in.z);
+        const Vector3 out = reflect(upper, sample_visible_normal(model.distribution, roughness, upper, u, v));
+        return Vector3(out.x, out.y, side * out.z);
+    }
+
+    static real probability_density(real roughness, const MicrofacetModel &model, const Vector3 &in,
+                                    const Vector3 &out) {
+        if (in.z * out.z < eps) {
+            return 0;
+        }
+        const real side = in.z < 0 ? -1.0f : 1.0f;
+        const Vector3 upper_in(in.x, in.y, side * in.z), upper_out(out.x, out.y, side * out.z);
+        const Vector3 h = normalized(upper_in + upper_out);
+        const real multiple = get_multiple_scattering_probability(roughness, model, in);
+        real pdf = multiple * upper_out.z / pi;
+        if (dot(upper_in, h) > 0) {
+            // The density of visible normals times the Jacobian 1 / (4 out.h) of reflection, where out.h = in.h
+            pdf += (1 - multiple) * G1(model.distribution, roughness, upper_in) *
+                   evaluateD(model.distribution, roughness, h) / std::max(1e-6f, 4.0f * upper_in.z);
+        }
+        return pdf;
+    }
+
+    static Vector3 evaluate(const Vector3 &color, real roughness, const MicrofacetModel &model, const Vector3 &in,
+                            const Vector3 &out) {
+        if (in.z * out.z < eps) {
+            return Vector3(0.0f);
+        }
+        const Vector3 h = normalized(in + out);
+        real factor = F(model.f0, std::max(0.0f, dot(in, h))) * G(model.distribution, roughness, in, out, h) *
+                      evaluateD(model.distribution, roughness, h);
+        factor *= 1.0f / (4.0f * std::max(1e-5f, std::abs(in.z)) * std::abs(out.z));
+        if (model.albedo != nullptr) {
+            factor += evaluate_multiple_scattering(*model.albedo, roughness, model.f0, std::abs(in.z),
+                                                   std::abs(out.z));
+        }
+        return color * factor;
+    }
+
+    static void sample(const Vector3 &color, real roughness, const MicrofacetModel &model, const Vector3 &in_dir,
+                       real u, real v, Vector3 &out_dir, Vector3 &f, real &pdf, SurfaceEvent &event) {
+        out_dir = sample_direction(roughness, model, in_dir, u, v);
+        f = evaluate(color, roughness, model, in_dir, out_dir);
+        event = (int)SurfaceScatteringFlags::non_delta;
+        pdf = probability_density(roughness, model, in_dir, out_dir);
+    }
+
+private:
+    // The compensation lobe (1 - E(mu_i)) (1 - E(mu_o)) / (pi (1 - E_avg)), times the average Fresnel of the
+    // light that scatters more than once
+    static real evaluate_multiple_scattering(const MicrofacetAlbedo &albedo, real roughness, real f0,
+                                             real cos_in, real cos_out) {
+        const real average = albedo.get_average_albedo(roughness);
+        if (average >= 1 - 1e-4f) {
+            return 0.0f;
+        }
+        const real lost = (1 - albedo.get_albedo(cos_in, roughness)) * (1 - albedo.get_albedo(cos_out, roughness));
+        // The hemispherical average of Schlick's approximation
+        const real average_fresnel = f0 + (1 - f0) / 21.0f;
+        const real fresnel = sqr(average_fresnel) * average / (1 - average_fresnel * (1 - average));
+        return fresnel * lost / (pi * (1 - average));
+    }
+
+    // A slope of the Beckmann distribution with roughness 1, visible from theta, with the x axis towards it
+    static Vector2 sample_beckmann_visible_slope(real theta, real u, real v) {
+        u = clamp(u, 1e-6f, 1 - 1e-6f);
+        v = clamp(v, 1e-6f, 1 - 1e-6f);
+        if (theta < 1e-4f) {
+            const real r = std::sqrt(-std::log(1 - u)), phi = 2 * pi * v;
+            return Vector2(r * std::cos(phi), r * std::sin(phi));
+        }
+        const real inv_sqrt_pi = 1.0f / std::sqrt(pi);
+        const real tan_theta = std::tan(theta), cot_theta = 1.0f / tan_theta;
+        // Newton-bisection on the CDF of the slope, in the domain of erf
+        real a = -1, c = std::erf(cot_theta);
+        const real fit = 1 + theta * (-0.876f + theta * (0.4265f - 0.0594f * theta));
+        real b = c - (1 + c) * std::pow(1 - u, fit);
+        const real normalization = 1 / (1 + c + inv_sqrt_pi * tan_theta * std::exp(-cot_theta * cot_theta));
+        for (int i = 0; i < 10; i++) {
+            if (!(b >= a && b <= c)) {
+                b = 0.5f * (a + c);
+            }
+            const real x = erf_inv(b);
+            const real value = normalization * (1 + b + inv_sqrt_pi * tan_theta * std::exp(-x * x)) - u;
+            if (std::abs(value) < 1e-5f) {
+                break;
+            }
+            if (value > 0) {
+                c = b;
+            } else {
+                a = b;
+            }
+            b -= value / (normalization * (1 - x * tan_theta));
+        }
+        return Vector2(erf_inv(b), erf_inv(2 * v - 1));
+    }
+};
+
+enum class CompiledMaterialKind {
+    // Any other material, through its virtual functions
+    generic,
+    diffuse,
+    microfacet,
+    emissive,
+    transparent,
+};
+
+// A texture parameter of a material: its value if the texture is constant, and the texture, with graphs of
+// textures compiled, otherwise
+struct MaterialParameter {
+    Vector3 value = Vector3(0.0f);
+    const Texture *texture = nullptr;
+    std::shared_ptr<CompiledTexture> compiled;
+
+    void set(const std::shared_ptr<Texture> &t) {
+        compiled = std::make_shared<CompiledTexture>();
+        compiled->compile(t);
+        Vector4 constant;
+        texture = nullptr;
+        if (compiled->get_constant(constant)) {
+            value = Vector3(constant.x, constant.y, constant.z);
+            compiled = nullptr;
+        } else if (compiled->is_leaf()) {
+            texture = t.get();
+            compiled = nullptr;
+        } else {
+            texture = compiled.get();
+        }
+    }
+
+    Vector3 get(const Vector2 &uv) const {
+        return texture ? texture->sample3(uv) : value;
+    }
+};
+
+// A built-in material with its parameters flattened, or a generic one
+struct CompiledMaterial {
+    CompiledMaterialKind kind = CompiledMaterialKind::generic;
+    SurfaceMaterial *material = nullptr;
+    // The color (of emission for emissive materials), and the mask of transparent ones in color.x
+    MaterialParameter color;
+    // Of microfacet materials, in x
+    MaterialParameter roughness;
+    MicrofacetModel microfacet;
+    // Of transparent materials, the id of the material under the mask
+    int nested = -1;
+    bool delta = false, emissive = false, index_matched = false;
+};
+
+// Materials of a scene compiled into one contiguous table, evaluated by a switch over their kinds, so that
+// the built-in scattering functions are inlined into the callers and materials can be batched by id.
+// Identical (up to the order of floating point operations) to calling the materials themselves.
+class MaterialTable {
+public:
+    void clear() {
+        materials.clear();
+        ids.clear();
+    }
+
+    // The id of a material, compiled (with the materials it nests) the first time
+    int add(SurfaceMaterial *material);
+
+    int size() const {
+        return (int)materials.size();
+    }
+
+    const CompiledMaterial &operator[](int id) const {
+        return materials[id];
+    }
+
+    void sample(int id, const Vector3 &in_dir, real u, real v, Vector3 &out_dir, Vector3 &f, real &pdf,
+                SurfaceEvent &event, const Vector2 &uv) const {
+        const CompiledMaterial &m = materials[id];
+        switch (m.kind) {
+            case CompiledMaterialKind::diffuse:
+                DiffuseLobe::sample(m.color.get(uv), in_dir, u, v, out_dir, f, pdf, event);
+                break;
+            case CompiledMaterialKind::microfacet:
+                MicrofacetLobe::sample(m.color.get(uv), get_roughness(m, uv), m.microfacet, in_dir, u, v, out_dir, f,
+                                       pdf, event);
+                break;
+            case CompiledMaterialKind::emissive:
+                EmissiveLobe::sample(m.color.get(uv), in_dir, u, v, out_dir, f, pdf, event);
+                break;
+            case CompiledMaterialKind::transparent: {
+                real alpha = m.color.get(uv).x;
+                if (u < alpha) {
+                    out_dir = -in_dir;
+                    f = Vector3(alpha) * abs(1.0f / in_dir.z);
+                    pdf = alpha;
+                    event = (int)SurfaceScatteringFlags::delta | (int)SurfaceScatteringFlags::index_matched;
+                } else {
+                    u = (u - alpha) / (1 - alpha);
+                    sample(m.nested, in_dir, u, v, out_dir, f, pdf, event, uv);
+                    f *= 1 - alpha;
+                    pdf *= 1 - alpha;
+                }
+                break;
+            }
+            default:
+                m.material->sample(in_dir, u, v, out_dir, f, pdf, event, uv);
+        }
+    }
+
+    real probability_density(int id, const Vector3 &in, const Vector3 &out, const Vector2 &uv) const {
+        const CompiledMaterial &m = materials[id];
+        switch (m.kind) {
+            case CompiledMaterialKind::diffuse:
+                return DiffuseLobe::probability_density(in, out);
+            case CompiledMaterialKind::microfacet:
+                return MicrofacetLobe::probability_density(get_roughness(m, uv), m.microfacet, in, out);
+            case CompiledMaterialKind::emissive:
+                return EmissiveLobe::probability_density(in, out);
+            case CompiledMaterialKind::transparent:
+                return (1 - m.color.get(uv).x) * probability_density(m.nested, in, out, uv);
+            default:
+                return m.material->probability_density(in, out, uv);
+        }
+    }
+
+    Vector3 evaluate_bsdf(int id, const Vector3 &in, const Vector3 &out, const Vector2 &uv) const {
+        const CompiledMaterial &m = materials[id];
+        switch (m.kind) {
+            case CompiledMaterialKind::diffuse:
+                return DiffuseLobe::evaluate(m.color.get(uv), in, out);
+            case CompiledMaterialKind::microfacet:
+                return MicrofacetLobe::evaluate(m.color.get(uv), get_roughness(m, uv), m.microfacet, in, out);
+            case CompiledMaterialKind::emissive:
+                return EmissiveLobe::evaluate(m.color.get(uv), in, out);
+            case CompiledMaterialKind::transparent:
+                return (1 - m.color.get(uv).x) * evaluate_bsdf(m.nested, in, out, uv);
+            default:
+                return m.material->evaluate_bsdf(in, out, uv);
+        }
+    }
+
+protected:
+    std::vector<CompiledMaterial> materials;
+    std::unordered_map<SurfaceMaterial *, int> ids;
+
+    static real get_roughness(const CompiledMaterial &m, const Vector2 &uv) {
+        return std::max(1e-3f, m.roughness.get(uv).x);
+    }
+};
+
+TC_NAMESPACE_END
@@ -0,0 +1,331 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/visual/compiled_texture.h>
+#include <taichi/common/asset_manager.h>
+
+TC_NAMESPACE_BEGIN
+
+int Texture::compile(TextureGraph &graph) const {
+    return graph.add_leaf(this);
+}
+
+int TextureGraph::compile(const std::shared_ptr<Texture> &texture) {
+    assert_info(texture != nullptr, "Can not compile a null texture");
+    textures.push_back(texture);
+    return texture->compile(*this);
+}
+
+int TextureGraph::add_constant(const Vector4 &value) {
+    Node node;
+    node.type = NodeType::constant;
+    node.value = value;
+    return add(node);
+}
+
+int TextureGraph::add_leaf(const Texture *texture) {
+    Vector4 value;
+    if (texture->get_constant(value)) {
+        return add_constant(value);
+    }
+    Node node;
+    node.type = NodeType::leaf;
+    node.texture = texture;
+    return add(node);
+}
+
+int TextureGraph::add_affine(int child, const Matrix3 &matrix, const Vector3 &offset, bool fract) {
+    if (is_constant(child)) {
+        return child;
+    }
+    Node node;
+    node.type = NodeType::affine;
+    node.a = child;
+    node.matrix = matrix;
+    node.offset = offset;
+    node.fract = fract;
+    const Node &c = nodes[child];
+    if (!fract && c.type == NodeType::affine) {
+        // Sampling the child's child at c.matrix * (matrix * coord + offset) + c.offset
+        node.matrix = c.matrix * matrix;
+        node.offset = c.matrix * offset + c.offset;
+        node.fract = c.fract;
+        node.a = c.a;
+    }
+    return add(node);
+}
+
+int TextureGraph::add_repeat(int child, const Vector3 &repeat) {
+    if (is_constant(child)) {
+        return child;
+    }
+    Node node;
+    node.type = NodeType::repeat;
+    node.a = child;
+    node.repeat = repeat;
+    node.inv_repeat = Vector3(1.0f / repeat.x, 1.0f / repeat.y, 1.0f / repeat.z);
+    return add(node);
+}
+
+int TextureGraph::add_bound(int child, int axis, const Vector2 &bounds, const Vector4 &outside) {
+    if (is_constant(child) && nodes[child].value == outside) {
+        return child;
+    }
+    Node node;
+    node.type = NodeType::bound;
+    node.a = child;
+    node.axis = axis;
+    node.bounds = bounds;
+    node.value = outside;
+    return add(node);
+}
+
+int TextureGraph::add_linear(int a, int b, real alpha, real beta, bool clamp) {
+    Node node;
+    node.type = NodeType::linear;
+    node.a = a;
+    node.b = b;
+    node.alpha = alpha;
+    node.beta = beta;
+    node.clamp = clamp;
+    const int id = add(node);
+    if (is_constant(a) && is_constant(b)) {
+        return add_constant(evaluate(id, Vector3(0.0f)));
+    }
+    return id;
+}
+
+int TextureGraph::add_mul(int a, int b) {
+    if (is_constant(a) && is_constant(b)) {
+        return add_constant(nodes[a].value * nodes[b].value);
+    }
+    Node node;
+    node.type = NodeType::mul;
+    node.a = a;
+    node.b = b;
+    return add(node);
+}
+
+int TextureGraph::add_fract(int child) {
+    if (is_constant(child)) {
+        return add_constant(glm::fract(nodes[child].value));
+    }
+    Node node;
+    node.type = NodeType::fract;
+    node.a = child;
+    return add(node);
+}
+
+real TextureGraph::get_cost(int node) const {
+    const Node &n = nodes[node];
+    switch (n.type) {
+        case NodeType::constant:
+            return constant_cost;
+        case NodeType::leaf:
+            return n.texture->get_cost();
+        case NodeType::baked:
+            return baked_cost;
+        case NodeType::linear:
+        case NodeType::mul:
+            return 2.0f + get_cost(n.a) + get_cost(n.b);
+        default:
+            return 1.0f + get_cost(n.a);
+    }
+}
+
+void TextureGraph::evaluate_batch(int node, const Vector3 *coords, int count, Vector4 *values) const {
+    const Node &n = nodes[node];
+    Vector3 c[batch_size];
+    switch (n.type) {
+        case NodeType::constant:
+            std::fill(values, values + count, n.value);
+            break;
+        case NodeType::leaf:
+            n.texture->sample_n(coords, count, values);
+            break;
+        case NodeType::baked:
+            for (int i = 0; i < count; i++) {
+                values[i] = rasters[n.raster].sample_relative_coord(
+                        (Vector2(coords[i].x, coords[i].y) - n.raster_lower) * n.raster_inv_size);
+            }
+            break;
+        case NodeType::affine:
+            for (int i = 0; i < count; i++) {
+                c[i] = n.matrix * coords[i] + n.offset;
+                if (n.fract) {
+                    c[i] = glm::fract(c[i]);
+                }
+            }
+            evaluate_batch(n.a, c, count, values);
+            break;
+        case NodeType::repeat:
+            for (int i = 0; i < count; i++) {
+                real u = coords[i].x - floor(coords[i].x * n.repeat.x) * n.inv_repeat.x;
+                real v = coords[i].y - floor(coords[i].y * n.repeat.y) * n.inv_repeat.y;
+                real w = coords[i].z - floor(coords[i].z * n.repeat.z) * n.inv_repeat.z;
+                c[i] = Vector3(u * n.repeat.x, v * n.repeat.y, w * n.repeat.z);
+            }
+            evaluate_batch(n.a, c, count, values);
+            break;
+        case NodeType::bound: {
+            // The coordinates inside are evaluated together, and scattered back
+            int inside[batch_size];
+            int num_inside = 0;
+            for (int i = 0; i < count; i++) {
+                if (n.bounds[0] <= coords[i][n.axis] && coords[i][n.axis] < n.bounds[1]) {
+                    c[num_inside] = coords[i];
+                    inside[num_inside++] = i;
+                } else {
+                    values[i] = n.value;
+                }
+            }
+            Vector4 inside_values[batch_size];
+            evaluate_batch(n.a, c, num_inside, inside_values);
+            for (int i = 0; i < num_inside; i++) {
+                values[inside[i]] = inside_values[i];
+            }
+            break;
+        }
+        case NodeType::linear:
+        case NodeType::mul: {
+            Vector4 values_b[batch_size];
+            evaluate_batch(n.a, coords, count, values);
+            evaluate_batch(n.b, coords, count, values_b);
+            for (int i = 0; i < count; i++) {
+                if (n.type == NodeType::mul) {
+                    values[i] *= values_b[i];
+                    continue;
+                }
+                values[i] = n.alpha * values[i] + n.beta * values_b[i];
+                if (n.clamp) {
+                    for (int k = 0; k < 3; k++) {
+                        values[i][k] = taichi::clamp(values[i][k], 0.0f, 1.0f);
+                    }
+                }
+            }
+            break;
+        }
+        default:
+            evaluate_batch(n.a, coords, count, values);
+            for (int i = 0; i < count; i++) {
+                values[i] = glm::fract(values[i]);
+            }
+    }
+}
+
+int TextureGraph::bake(int root, Vector2i resolution, real expected_samples) {
+    int num_baked = 0;
+    if (resolution.x > 0 || resolution.y > 0) {
+        assert_info(resolution.x >= 2 && resolution.y >= 2, "Bake resolution should be at least 2x2");
+        bake(root, Vector3(0.0f, 0.0f, 0.5f), Vector3(1.0f, 1.0f, 0.5f), resolution, expected_samples, num_baked);
+    }
+    return num_baked;
+}
+
+// lower and upper bound the coordinates node is sampled at
+void TextureGraph::bake(int node, Vector3 lower, Vector3 upper, Vector2i resolution, real expected_samples,
+                        int &num_baked) {
+    const Node n = nodes[node];
+    if (n.type == NodeType::constant || n.type == NodeType::baked) {
+        return;
+    }
+    const real cost = get_cost(node);
+    if (lower.z == upper.z && cost > baked_cost &&
+        (real)resolution.x * resolution.y * cost < expected_samples * (cost - baked_cost)) {
+        Array2D<Vector4> raster(resolution.x, resolution.y);
+        const Vector2 size(upper.x - lower.x, upper.y - lower.y);
+        std::vector<Vector3> coords(resolution.y);
+        std::vector<Vector4> values(resolution.y);
+        for (int i = 0; i < resolution.x; i++) {
+            for (int j = 0; j < resolution.y; j++) {
+                const Vector2 p = Vector2(lower.x, lower.y) +
+                                  Vector2((i + 0.5f) / resolution.x, (j + 0.5f) / resolution.y) * size;
+                coords[j] = Vector3(p.x, p.y, lower.z);
+            }
+            evaluate_n(node, coords.data(), resolution.y, values.data());
+            for (int j = 0; j < resolution.y; j++) {
+                raster.set(i, j, values[j]);
+            }
+        }
+        Node &baked = nodes[node];
+        baked.type = NodeType::baked;
+        baked.raster = (int)rasters.size();
+        baked.raster_lower = Vector2(lower.x, lower.y);
+        baked.raster_inv_size = Vector2(size.x > 0 ? 1.0f / size.x : 0.0f, size.y > 0 ? 1.0f / size.y : 0.0f);
+        rasters.push_back(raster);
+        num_baked++;
+        return;
+    }
+    switch (n.type) {
+        case NodeType::affine: {
+            Vector3 l = n.offset, u = n.offset;
+            for (int r = 0; r < 3; r++) {
+                for (int c = 0; c < 3; c++) {
+                    // glm matrices are column-major
+                    const real m = n.matrix[c][r];
+                    l[r] += m * (m > 0 ? lower[c] : upper[c]);
+                    u[r] += m * (m > 0 ? upper[c] : lower[c]);
+                }
+            }
+            if (n.fract) {
+                for (int r = 0; r < 3; r++) {
+                    if (l[r] == u[r]) {
+                        l[r] = u[r] = l[r] - floor(l[r]);
+                    } else {
+                        l[r] = 0;
+                        u[r] = 1;
+                    }
+                }
+            }
+            bake(n.a, l, u, resolution, expected_samples, num_baked);
+            break;
+        }
+        case NodeType::repeat: {
+            Vector3 l(0.0f), u(1.0f);
+            for (int r = 0; r < 3; r++) {
+                if (lower[r] == upper[r]) {
+                    const real x = lower[r] - floor(lower[r] * n.repeat[r]) * n.inv_repeat[r];
+                    l[r] = u[r] = x * n.repeat[r];
+                }
+            }
+            bake(n.a, l, u, resolution, expected_samples, num_baked);
+            break;
+        }
+        case NodeType::bound:
+        case NodeType::fract:
+            bake(n.a, lower, upper, resolution, expected_samples, num_baked);
+            break;
+        case NodeType::linear:
+        case NodeType::mul:
+            bake(n.a, lower, upper, resolution, expected_samples, num_baked);
+            bake(n.b, lower, upper, resolution, expected_samples, num_baked);
+            break;
+        default:
+            break;
+    }
+}
+
+void CompiledTexture::initialize(const Config &config) {
+    Texture::initialize(config);
+    compile(AssetManager::get_asset<Texture>(config.get_int("tex")),
+            Vector2i(config.get("resolution_x", 0), config.get("resolution_y", 0)),
+            config.get("expected_samples", 1e8f));
+}
+
+void CompiledTexture::compile(const std::shared_ptr<Texture> &texture, Vector2i bake_resolution,
+                              real expected_samples) {
+    source = texture;
+    graph = TextureGraph();
+    root = graph.compile(texture);
+    num_baked = graph.bake(root, bake_resolution, expected_samples);
+}
+
+TC_IMPLEMENTATION(Texture, CompiledTexture, "compiled");
+
+TC_NAMESPACE_END
@@ -0,0 +1,228 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <taichi/visual/texture.h>
+
+TC_NAMESPACE_BEGIN
+
+// A graph of textures (see texture_op.cpp) flattened into one array of nodes, evaluated by a switch over their
+// types instead of a chain of virtual sample() calls. Textures add themselves with Texture::compile(), which
+// folds constants and fuses chains of affine coordinate transforms (zooms, rotations, flips).
+// Sub-graphs only sampled at surface uvs can be baked into rasters, as RasterizedTexture does.
+class TextureGraph {
+public:
+    enum class NodeType {
+        constant,
+        // A texture of its own type, through its virtual sample()
+        leaf,
+        baked,
+        // Coordinates c of the child sampled at matrix * c + offset, of which the fractional part if fract
+        affine,
+        // As RepeatedTexture
+        repeat,
+        // As BoundedTexture
+        bound,
+        // alpha * a + beta * b, clamped to [0, 1] if clamp
+        linear,
+        mul,
+        fract,
+    };
+
+    struct Node {
+        NodeType type;
+        // Children
+        int a = -1, b = -1;
+        // Of constants, and of bounds outside
+        Vector4 value;
+        const Texture *texture = nullptr;
+        Matrix3 matrix;
+        Vector3 offset;
+        bool fract = false;
+        Vector3 repeat, inv_repeat;
+        real alpha = 0, beta = 0;
+        bool clamp = false;
+        int axis = 0;
+        Vector2 bounds;
+        // Of baked nodes, the raster, and the map from coordinates to relative raster coordinates
+        int raster = -1;
+        Vector2 raster_lower, raster_inv_size;
+    };
+
+    // Estimated costs of evaluating nodes, in units of about a constant texture's sample()
+    static constexpr real constant_cost = 1.0f;
+    static constexpr real baked_cost = 6.0f;
+
+    // The node of a texture; the graph keeps it alive
+    int compile(const std::shared_ptr<Texture> &texture);
+
+    int add_constant(const Vector4 &value);
+
+    int add_leaf(const Texture *texture);
+
+    int add_affine(int child, const Matrix3 &matrix, const Vector3 &offset, bool fract);
+
+    int add_repeat(int child, const Vector3 &repeat);
+
+    int add_bound(int child, int axis, const Vector2 &bounds, const Vector4 &outside);
+
+    int add_linear(int a, int b, real alpha, real beta, bool clamp);
+
+    int add_mul(int a, int b);
+
+    int add_fract(int child);
+
+    const Node &get_node(int node) const {
+        return nodes[node];
+    }
+
+    // Of evaluating a node, with its descendants
+    real get_cost(int node) const;
+
+    // Bakes the largest sub-graphs under root whose coordinates only vary in x and y when root is sampled at
+    // (u, v, 0.5), u, v in [0, 1], into rasters of the given resolution, where the cost of baking,
+    // resolution^2 * the cost of the sub-graph, is below its saving over expected_samples of root.
+    // Returns the number of sub-graphs baked.
+    int bake(int root, Vector2i resolution, real expected_samples);
+
+    Vector4 evaluate(int node, Vector3 coord) const {
+        while (true) {
+            const Node &n = nodes[node];
+            switch (n.type) {
+                case NodeType::constant:
+                    return n.value;
+                case NodeType::leaf:
+                    return n.texture->sample(coord);
+                case NodeType::baked:
+                    return rasters[n.raster].sample_relative_coord(
+                            (Vector2(coord.x, coord.y) - n.raster_lower) * n.raster_inv_size);
+                case NodeType::affine:
+                    coord = n.matrix * coord + n.offset;
+                    if (n.fract) {
+                        coord = glm::fract(coord);
+                    }
+                    node = n.a;
+                    break;
+                case NodeType::repeat: {
+                    real u = coord.x - floor(coord.x * n.repeat.x) * n.inv_repeat.x;
+                    real v = coord.y - floor(coord.y * n.repeat.y) * n.inv_repeat.y;
+                    real w = coord.z - floor(coord.z * n.repeat.z) * n.inv_repeat.z;
+                    coord = Vector3(u * n.repeat.x, v * n.repeat.y, w * n.repeat.z);
+                    node = n.a;
+                    break;
+                }
+                case NodeType::bound:
+                    if (!(n.bounds[0] <= coord[n.axis] && coord[n.axis] < n.bounds[1])) {
+                        return n.value;
+                    }
+                    node = n.a;
+                    break;
+                case NodeType::linear: {
+                    Vector4 p = n.alpha * evaluate(n.a, coord) + n.beta * evaluate(n.b, coord);
+                    if (n.clamp) {
+                        for (int i = 0; i < 3; i++) {
+                            p[i] = taichi::clamp(p[i], 0.0f, 1.0f);
+                        }
+                    }
+                    return p;
+                }
+                case NodeType::mul:
+                    return evaluate(n.a, coord) * evaluate(n.b, coord);
+                default:
+                    return glm::fract(evaluate(n.a, coord));
+            }
+        }
+    }
+
+    // evaluate() of count coordinates: each node is applied to batch_size coordinates at a time, and leaves are
+    // sampled through Texture::sample_n
+    void evaluate_n(int node, const Vector3 *coords, int count, Vector4 *values) const {
+        for (int i = 0; i < count; i += batch_size) {
+            evaluate_batch(node, coords + i, std::min(batch_size, count - i), values + i);
+        }
+    }
+
+protected:
+    static const int batch_size = 64;
+
+    std::vector<Node> nodes;
+    std::vector<Array2D<Vector4>> rasters;
+    std::vector<std::shared_ptr<Texture>> textures;
+
+    int add(const Node &node) {
+        nodes.push_back(node);
+        return (int)nodes.size() - 1;
+    }
+
+    bool is_constant(int node) const {
+        return nodes[node].type == NodeType::constant;
+    }
+
+    void bake(int node, Vector3 lower, Vector3 upper, Vector2i resolution, real expected_samples, int &num_baked);
+
+    // Of at most batch_size coordinates
+    void evaluate_batch(int node, const Vector3 *coords, int count, Vector4 *values) const;
+};
+
+// A texture evaluated through its compiled graph, optionally with sub-graphs baked (see TextureGraph::bake)
+class CompiledTexture final : public Texture {
+public:
+    // "tex", and to bake, "resolution_x", "resolution_y" and "expected_samples" (default 1e8)
+    void initialize(const Config &config) override;
+
+    void compile(const std::shared_ptr<Texture> &texture, Vector2i bake_resolution = Vector2i(0),
+                 real expected_samples = 1e8f);
+
+    // Whether the graph is just one texture, which is then better sampled itself
+    bool is_leaf() const {
+        return graph.get_node(root).type == TextureGraph::NodeType::leaf;
+    }
+
+    int get_num_baked() const {
+        return num_baked;
+    }
+
+    Vector4 sample(const Vector2 &coord) const override {
+        return graph.evaluate(root, Vector3(coord.x, coord.y, 0.5f));
+    }
+
+    Vector4 sample(const Vector3 &coord) const override {
+        return graph.evaluate(root, coord);
+    }
+
+    void sample_n(const Vector3 *coords, int count, Vector4 *values) const override {
+        graph.evaluate_n(root, coords, count, values);
+    }
+
+    bool get_constant(Vector4 &value) const override {
+        if (graph.get_node(root).type != TextureGraph::NodeType::constant) {
+            return false;
+        }
+        value = graph.get_node(root).value;
+        return true;
+    }
+
+    int compile(TextureGraph &g) const override {
+        return g.compile(source);
+    }
+
+    real get_cost() const override {
+        return graph.get_cost(root);
+    }
+
+protected:
+    std::shared_ptr<Texture> source;
+    TextureGraph graph;
+    int root = -1;
+    int num_baked = 0;
+};
+
+TC_NAMESPACE_END
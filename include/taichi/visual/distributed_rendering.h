@@ -0,0 +1,63 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <taichi/visual/renderer.h>
+
+TC_NAMESPACE_BEGIN
+
+// Renders samples [0, num_chunks * chunk_samples) of a renderer's sample sequence on any number of nodes
+// sharing a directory, in chunks of chunk_samples.
+// Workers claim chunks by exclusively creating chunk_<i>.claim, and publish the accumulations of finished
+// chunks as chunk_<i>.partial, renamed into place once written. Claims older than claim_timeout seconds
+// without a partial image are taken to be of lost workers, and their chunks are claimed and rendered again.
+// Chunks render the same samples wherever they are rendered, so rendering one twice is harmless, and the
+// merged output is that of rendering every sample on one node, up to the order of floating point additions.
+class DistributedRendering {
+public:
+    // chunk_samples must be a multiple of the renderer's get_sample_range_granularity()
+    DistributedRendering(const std::string &directory, long long chunk_samples, int num_chunks,
+                         real claim_timeout = 3600.0f);
+
+    // Renders chunks until every chunk is done or claimed by live workers; returns the number rendered.
+    // The renderer's accumulator is reset for every chunk.
+    int work(Renderer &renderer);
+
+    // Accumulates the partial images published since the last call into the renderer's;
+    // returns whether every chunk is merged
+    bool merge(Renderer &renderer);
+
+    int get_num_merged() const {
+        return num_merged;
+    }
+
+    int get_num_chunks() const {
+        return num_chunks;
+    }
+
+protected:
+    std::string directory;
+    long long chunk_samples;
+    int num_chunks;
+    real claim_timeout;
+    std::vector<bool> merged;
+    int num_merged = 0;
+
+    std::string get_file_name(int chunk, const std::string &extension) const;
+
+    // Whether this worker now owns the chunk
+    bool claim(int chunk);
+
+    void render_chunk(Renderer &renderer, int chunk);
+};
+
+TC_NAMESPACE_END
@@ -9,7 +9,6 @@
 
 #pragma once 
 
-#include <taichi/common/meta.h>
 #include <taichi/common/meta.h>
 #include <taichi/math/linalg.h>
 #include <taichi/math/math_util.h>
@@ -21,6 +20,8 @@
 
 TC_NAMESPACE_BEGIN
 
+class Texture;
+
 class EnvironmentMap : public Unit {
 public:
     virtual void initialize(const Config &config);
@@ -38,17 +39,65 @@ public:
         return sample_illum(direction_to_uv(direction));
     }
 
-    Vector3 sample_illum(const Vector2 &uv) const {
-        return image->sample_relative_coord(uv);
-    }
+    Vector3 sample_illum(const Vector2 &uv) const;
 
+    // Rasterizes the texture again, with the sampler, after it changed, e.g. a sky re-initialized with another
+    // sun position. Not while rendering.
+    void update();
 
 protected:
+    // Of environment maps of textures
+    std::shared_ptr<Texture> texture;
+    int num_threads;
+    bool rgbe;
+    // Null once stored as RGBE
     std::shared_ptr<Array2D<Vector3>> image;
+    // With "rgbe": texels in shared exponent format (Ward, "Real Pixels", 1991), at a third of the memory
+    std::vector<unsigned int> rgbe_texels;
     Vector2i res;
-    DiscreteSampler row_sampler;
-    std::vector<DiscreteSampler> col_samplers;
-    void build_cdfs();
+    // Pixels (i * res[1] + j) in proportion to their luminance times sin(theta), i.e. their solid angle
+    AliasTable pixel_sampler;
+    double total_pixel_weight;
+
+    void build_sampler(int num_threads);
+
+    void rasterize_texture();
+
+    // Flips the image, builds the sampler, and encodes the image as RGBE if asked to
+    void finalize_image();
+
+    Vector3 get_texel(int i, int j) const {
+        if (image) {
+            return (*image)[i][j];
+        }
+        return decode_rgbe(rgbe_texels[i * res[1] + j]);
+    }
+
+    real get_pixel_weight(int i, int j) const {
+        return luminance(get_texel(i, j)) * std::sin(pi * (0.5f + j) / res[1]);
+    }
+
+    static unsigned int encode_rgbe(const Vector3 &color) {
+        const real max_c = std::max(std::max(color.x, color.y), color.z);
+        if (max_c < 1e-32f) {
+            return 0;
+        }
+        int e;
+        const real scale = std::frexp(max_c, &e) * 256.0f / max_c;
+        auto mantissa = [&](real c) {
+            return (unsigned int)std::min(255.0f, std::max(0.0f, c * scale));
+        };
+        return mantissa(color.x) | mantissa(color.y) << 8 | mantissa(color.z) << 16 | (unsigned int)(e + 128) << 24;
+    }
+
+    static Vector3 decode_rgbe(unsigned int rgbe) {
+        const int e = (int)(rgbe >> 24);
+        if (e == 0) {
+            return Vector3(0.0f);
+        }
+        const real f = std::ldexp(1.0f, e - (128 + 8));
+        return Vector3(((rgbe & 255) + 0.5f) * f, ((rgbe >> 8 & 255) + 0.5f) * f, ((rgbe >> 16 & 255) + 0.5f) * f);
+    }
 
     Vector3 uv_to_direction(const Vector2 &uv) const {
         real theta = uv.y * pi;
@@ -67,8 +116,6 @@ protected:
         }
         return Vector2(phi / (2 * pi), theta / pi);
     }
-    real avg_illum;
-
     Matrix4 local2world;
     Matrix4 world2local;
 };
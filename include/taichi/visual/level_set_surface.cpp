@@ -0,0 +1,284 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include "level_set_surface.h"
+#include <taichi/system/threading.h>
+#include <thread>
+
+TC_NAMESPACE_BEGIN
+
+// Visits the cells of the given size within [lower, upper) that the ray crosses in [t_begin, t_end), in order,
+// with the part of the ray in each, until visit returns true
+template <typename F>
+static bool traverse(const Vector3 &orig, const Vector3 &dir, real t_begin, real t_end, real size,
+                     const Vector3i &lower, const Vector3i &upper, const F &visit) {
+    const Vector3 p = orig + t_begin * dir;
+    Vector3i cell, step;
+    Vector3 t_max, t_delta;
+    for (int a = 0; a < 3; a++) {
+        cell[a] = clamp(int(std::floor(p[a] / size)), lower[a], upper[a] - 1);
+        if (dir[a] > 0) {
+            step[a] = 1;
+            t_max[a] = t_begin + ((cell[a] + 1) * size - p[a]) / dir[a];
+            t_delta[a] = size / dir[a];
+        } else if (dir[a] < 0) {
+            step[a] = -1;
+            t_max[a] = t_begin + (cell[a] * size - p[a]) / dir[a];
+            t_delta[a] = -size / dir[a];
+        } else {
+            step[a] = 0;
+            t_max[a] = t_delta[a] = std::numeric_limits<real>::infinity();
+        }
+    }
+    real t = t_begin;
+    while (t < t_end) {
+        int a = t_max.x < t_max.y ? 0 : 1;
+        a = t_max.z < t_max[a] ? 2 : a;
+        const real t_next = std::min(std::max(t_max[a], t), t_end);
+        if (visit(cell, t, t_next)) {
+            return true;
+        }
+        t = t_next;
+        cell[a] += step[a];
+        if (cell[a] < lower[a] || cell[a] >= upper[a]) {
+            break;
+        }
+        t_max[a] += t_delta[a];
+    }
+    return false;
+}
+
+LevelSetSurface::LevelSetSurface(const LevelSet3D &level_set, const Matrix4 &transform) {
+    dense = std::make_shared<LevelSet3D>(level_set);
+    res = Vector3i(level_set.get_width(), level_set.get_height(), level_set.get_depth());
+    storage_offset = level_set.get_storage_offset();
+    initialize(transform);
+}
+
+LevelSetSurface::LevelSetSurface(const SparseLevelSet3D &level_set, const Matrix4 &transform) {
+    sparse = std::make_shared<SparseLevelSet3D>(level_set);
+    res = Vector3i(level_set.get_width(), level_set.get_height(), level_set.get_depth());
+    storage_offset = level_set.get_storage_offset();
+    initialize(transform);
+}
+
+void LevelSetSurface::initialize(const Matrix4 &transform) {
+    this->transform = transform;
+    this->inverse_transform = glm::inverse(transform);
+    for (int a = 0; a < 3; a++) {
+        cell_res[a] = std::max(0, res[a] - 1);
+        brick_res[a] = (cell_res[a] + brick_size - 1) / brick_size;
+        block_res[a] = (brick_res[a] + block_size - 1) / block_size;
+    }
+    const int num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    const int num_bricks = brick_res.x * brick_res.y * brick_res.z;
+    brick_min.resize(num_bricks);
+    brick_max.resize(num_bricks);
+    ThreadedTaskManager::run([&](int b) {
+        const Vector3i brick(b / (brick_res.y * brick_res.z), b / brick_res.z % brick_res.y, b % brick_res.z);
+        real lo = std::numeric_limits<real>::infinity(), hi = -lo;
+        // With the nodes on the far faces, which the brick's last cells interpolate
+        for (int i = brick.x * brick_size; i <= std::min((brick.x + 1) * brick_size, cell_res.x); i++) {
+            for (int j = brick.y * brick_size; j <= std::min((brick.y + 1) * brick_size, cell_res.y); j++) {
+                for (int k = brick.z * brick_size; k <= std::min((brick.z + 1) * brick_size, cell_res.z); k++) {
+                    const real phi = get_node(i, j, k);
+                    lo = std::min(lo, phi);
+                    hi = std::max(hi, phi);
+                }
+            }
+        }
+        brick_min[b] = lo;
+        brick_max[b] = hi;
+    }, 0, num_bricks, num_threads, 16);
+    const int num_blocks = block_res.x * block_res.y * block_res.z;
+    block_min.assign(num_blocks, std::numeric_limits<real>::infinity());
+    block_max.assign(num_blocks, -std::numeric_limits<real>::infinity());
+    for (int b = 0; b < num_bricks; b++) {
+        const Vector3i brick(b / (brick_res.y * brick_res.z), b / brick_res.z % brick_res.y, b % brick_res.z);
+        const int block =
+                ((brick.x / block_size) * block_res.y + brick.y / block_size) * block_res.z + brick.z / block_size;
+        block_min[block] = std::min(block_min[block], brick_min[b]);
+        block_max[block] = std::max(block_max[block], brick_max[b]);
+    }
+}
+
+bool LevelSetSurface::intersect(const Vector3 &world_orig, const Vector3 &world_dir, real t_near,
+                                real &t_far) const {
+    if (block_min.empty()) {
+        return false;
+    }
+    // In grid space, where cell (i, j, k) spans [i, i + 1] x [j, j + 1] x [k, k + 1]; the transform is affine, so
+    // distances along the ray stay those of world space
+    const Vector3 orig = multiply_matrix4(inverse_transform, world_orig, 1.0f) - storage_offset;
+    const Vector3 dir = multiply_matrix4(inverse_transform, world_dir, 0.0f);
+    real t_begin = t_near, t_end = t_far;
+    for (int a = 0; a < 3; a++) {
+        if (dir[a] == 0) {
+            if (orig[a] < 0 || orig[a] > cell_res[a]) {
+                return false;
+            }
+            continue;
+        }
+        real t0 = -orig[a] / dir[a], t1 = (cell_res[a] - orig[a]) / dir[a];
+        if (t0 > t1) {
+            std::swap(t0, t1);
+        }
+        t_begin = std::max(t_begin, t0);
+        t_end = std::min(t_end, t1);
+    }
+    if (!(t_begin < t_end)) {
+        return false;
+    }
+    auto contains_zero = [](const std::vector<real> &lo, const std::vector<real> &hi, const Vector3i &r,
+                            const Vector3i &c) {
+        const int id = (c.x * r.y + c.y) * r.z + c.z;
+        return lo[id] <= 0 && hi[id] >= 0;
+    };
+    return traverse(orig, dir, t_begin, t_end, real(brick_size * block_size), Vector3i(0), block_res,
+                    [&](const Vector3i &block, real block_begin, real block_end) {
+        if (!contains_zero(block_min, block_max, block_res, block)) {
+            return false;
+        }
+        Vector3i brick_lower, brick_upper;
+        for (int a = 0; a < 3; a++) {
+            brick_lower[a] = block[a] * block_size;
+            brick_upper[a] = std::min(brick_lower[a] + block_size, brick_res[a]);
+        }
+        return traverse(orig, dir, block_begin, block_end, real(brick_size), brick_lower, brick_upper,
+                        [&](const Vector3i &brick, real brick_begin, real brick_end) {
+            if (!contains_zero(brick_min, brick_max, brick_res, brick)) {
+                return false;
+            }
+            Vector3i cell_lower, cell_upper;
+            for (int a = 0; a < 3; a++) {
+                cell_lower[a] = brick[a] * brick_size;
+                cell_upper[a] = std::min(cell_lower[a] + brick_size, cell_res[a]);
+            }
+            return traverse(orig, dir, brick_begin, brick_end, 1.0f, cell_lower, cell_upper,
+                            [&](const Vector3i &cell, real cell_begin, real cell_end) {
+                return intersect_cell(cell, orig, dir, cell_begin, cell_end, t_near, t_far);
+            });
+        });
+    });
+}
+
+bool LevelSetSurface::intersect_cell(const Vector3i &cell, const Vector3 &orig, const Vector3 &dir, real t_begin,
+                                     real t_end, real t_near, real &t_far) const {
+    real c[2][2][2];
+    real lo = std::numeric_limits<real>::infinity(), hi = -lo;
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            for (int k = 0; k < 2; k++) {
+                c[i][j][k] = get_node(cell.x + i, cell.y + j, cell.z + k);
+                lo = std::min(lo, c[i][j][k]);
+                hi = std::max(hi, c[i][j][k]);
+            }
+        }
+    }
+    if (lo > 0 || hi < 0) {
+        return false;
+    }
+    // The value at t_begin + u * h as a cubic in u in [0, 3], from its values at u = 0, 1, 2 and 3
+    const real h = (t_end - t_begin) / 3;
+    real f[4];
+    for (int s = 0; s < 4; s++) {
+        const Vector3 p = orig + (t_begin + s * h) * dir - Vector3(cell);
+        Vector3 gradient;
+        f[s] = interpolate_cell(c, clamp(p.x, 0.0f, 1.0f), clamp(p.y, 0.0f, 1.0f), clamp(p.z, 0.0f, 1.0f), gradient);
+    }
+    const real d1 = f[1] - f[0], d2 = f[2] - 2 * f[1] + f[0], d3 = f[3] - 3 * f[2] + 3 * f[1] - f[0];
+    const real a3 = d3 / 6, a2 = (d2 - d3) / 2, a1 = d1 - d2 / 2 + d3 / 3, a0 = f[0];
+    auto cubic = [&](real u) {
+        return ((a3 * u + a2) * u + a1) * u + a0;
+    };
+    // Between its extrema, the cubic is monotonic
+    real splits[4] = {0.0f};
+    int num_splits = 1;
+    auto add_split = [&](real u) {
+        if (0 < u && u < 3) {
+            splits[num_splits++] = u;
+        }
+    };
+    if (std::abs(a3) > 1e-12f) {
+        const real disc = a2 * a2 - 3 * a3 * a1;
+        if (disc > 0) {
+            const real root = std::sqrt(disc);
+            const real u0 = (-a2 - root) / (3 * a3), u1 = (-a2 + root) / (3 * a3);
+            add_split(std::min(u0, u1));
+            add_split(std::max(u0, u1));
+        }
+    } else if (std::abs(a2) > 1e-12f) {
+        add_split(-a1 / (2 * a2));
+    }
+    splits[num_splits++] = 3.0f;
+    for (int s = 0; s + 1 < num_splits; s++) {
+        real u_lo = splits[s], u_hi = splits[s + 1];
+        real f_lo = cubic(u_lo);
+        const real f_hi = cubic(u_hi);
+        if ((f_lo > 0 && f_hi > 0) || (f_lo < 0 && f_hi < 0) || (f_lo == 0 && f_hi == 0)) {
+            continue;
+        }
+        if (f_lo != 0) {
+            for (int iter = 0; iter < 32; iter++) {
+                const real u = 0.5f * (u_lo + u_hi);
+                const real f_mid = cubic(u);
+                if (f_mid != 0 && (f_mid > 0) == (f_lo > 0)) {
+                    u_lo = u;
+                    f_lo = f_mid;
+                } else {
+                    u_hi = u;
+                }
+            }
+        }
+        const real t = t_begin + (f_lo == 0 ? u_lo : 0.5f * (u_lo + u_hi)) * h;
+        if (t_near < t && t < t_far) {
+            t_far = t;
+            return true;
+        }
+    }
+    return false;
+}
+
+Vector3 LevelSetSurface::get_normal(const Vector3 &pos) const {
+    const Vector3 p = multiply_matrix4(inverse_transform, pos, 1.0f) - storage_offset;
+    Vector3i cell;
+    real r[3];
+    for (int a = 0; a < 3; a++) {
+        cell[a] = clamp(int(std::floor(p[a])), 0, std::max(0, cell_res[a] - 1));
+        r[a] = clamp(p[a] - cell[a], 0.0f, 1.0f);
+    }
+    real c[2][2][2];
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            for (int k = 0; k < 2; k++) {
+                c[i][j][k] = get_node(std::min(cell.x + i, res.x - 1), std::min(cell.y + j, res.y - 1),
+                                      std::min(cell.z + k, res.z - 1));
+            }
+        }
+    }
+    Vector3 gradient;
+    interpolate_cell(c, r[0], r[1], r[2], gradient);
+    // Gradients transform by the inverse transpose
+    const Vector3 normal = glm::transpose(Matrix3(inverse_transform)) * gradient;
+    return length(normal) < 1e-20f ? Vector3(0.0f, 1.0f, 0.0f) : normalized(normal);
+}
+
+void LevelSetSurface::get_bounds(Vector3 &lower, Vector3 &upper) const {
+    lower = Vector3(std::numeric_limits<real>::max());
+    upper = Vector3(-std::numeric_limits<real>::max());
+    for (int corner = 0; corner < 8; corner++) {
+        const Vector3 p = storage_offset + Vector3(real((corner >> 2) & 1) * cell_res.x,
+                                                   real((corner >> 1) & 1) * cell_res.y, real(corner & 1) * cell_res.z);
+        const Vector3 q = multiply_matrix4(transform, p, 1.0f);
+        lower = min(lower, q);
+        upper = max(upper, q);
+    }
+}
+
+TC_NAMESPACE_END
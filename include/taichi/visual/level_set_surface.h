@@ -0,0 +1,70 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/math/levelset_3d.h>
+#include <taichi/math/sparse_levelset_3d.h>
+#include <memory>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// The zero isosurface of a level set, e.g. of a liquid or an MPM material, traced without meshing it. The level
+// set is copied, dense or as its narrow band, and placed by transform from its own space, where node (i, j, k)
+// is at (i, j, k) + storage offset as in the simulation.
+//
+// Rays march it in a 3D DDA over a two-level hierarchy of bricks of 8^3 cells and blocks of 4^3 bricks, with
+// the range of their node values: those that do not contain 0 can not contain the surface (trilinear
+// interpolation stays within the range of the corners), and are stepped over whole. Level sets are only
+// distances within their band, so the ranges, unlike distances, give safe steps everywhere. In the cells left,
+// the value along the ray is the cubic of trilinear interpolation, whose first root is bracketed between its
+// extrema and refined by bisection. Normals are those of the interpolated gradient.
+class LevelSetSurface {
+public:
+    static const int brick_size = 8;
+    // In bricks
+    static const int block_size = 4;
+
+    LevelSetSurface(const LevelSet3D &level_set, const Matrix4 &transform);
+
+    LevelSetSurface(const SparseLevelSet3D &level_set, const Matrix4 &transform);
+
+    // Whether the surface is crossed in (t_near, t_far), from either side; the nearest crossing becomes t_far
+    bool intersect(const Vector3 &orig, const Vector3 &dir, real t_near, real &t_far) const;
+
+    // The unit normal at a world position of the surface, pointing out of the negative side
+    Vector3 get_normal(const Vector3 &pos) const;
+
+    // Of the grid, in world space
+    void get_bounds(Vector3 &lower, Vector3 &upper) const;
+
+protected:
+    std::shared_ptr<LevelSet3D> dense;
+    std::shared_ptr<SparseLevelSet3D> sparse;
+    Vector3i res;
+    Vector3 storage_offset;
+    Matrix4 transform, inverse_transform;
+    // Of cells, bricks and blocks
+    Vector3i cell_res, brick_res, block_res;
+    // The lowest and highest node value of every brick and block, by (i * res.y + j) * res.z + k
+    std::vector<real> brick_min, brick_max, block_min, block_max;
+
+    real get_node(int i, int j, int k) const {
+        return dense ? dense->Array3D<real>::get(i, j, k) : sparse->get(i, j, k);
+    }
+
+    void initialize(const Matrix4 &transform);
+
+    // The crossing in (t_near, t_far) within cell, of the ray in grid space
+    bool intersect_cell(const Vector3i &cell, const Vector3 &orig, const Vector3 &dir, real t_begin, real t_end,
+                        real t_near, real &t_far) const;
+};
+
+TC_NAMESPACE_END
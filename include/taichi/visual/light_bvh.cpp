@@ -0,0 +1,185 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/visual/light_bvh.h>
+#include <algorithm>
+
+TC_NAMESPACE_BEGIN
+
+// The smallest cone holding cones a and b
+static void merge_cones(Vector3 axis_a, real theta_a, Vector3 axis_b, real theta_b, Vector3 &axis, real &theta) {
+    if (theta_a < theta_b) {
+        std::swap(axis_a, axis_b);
+        std::swap(theta_a, theta_b);
+    }
+    const real theta_d = std::acos(clamp(dot(axis_a, axis_b), -1.0f, 1.0f));
+    if (std::min(theta_d + theta_b, pi) <= theta_a) {
+        axis = axis_a;
+        theta = theta_a;
+        return;
+    }
+    theta = (theta_a + theta_d + theta_b) * 0.5f;
+    Vector3 ortho = axis_b - dot(axis_a, axis_b) * axis_a;
+    if (theta >= pi || dot(ortho, ortho) < 1e-12f) {
+        axis = axis_a;
+        theta = pi;
+        return;
+    }
+    // Rotate axis_a towards axis_b
+    const real theta_r = theta - theta_a;
+    axis = normalize(std::cos(theta_r) * axis_a + std::sin(theta_r) * normalize(ortho));
+}
+
+void LightBVH::initialize(const std::vector<Triangle> &triangles, const std::vector<real> &powers) {
+    assert_info(triangles.size() == powers.size(), "Every light needs a power");
+    nodes.clear();
+    leaf_of_triangle.clear();
+    std::vector<int> lights;
+    int max_id = -1;
+    for (int i = 0; i < (int)triangles.size(); i++) {
+        if (powers[i] > 0) {
+            lights.push_back(i);
+            max_id = std::max(max_id, triangles[i].id);
+        }
+    }
+    if (lights.empty()) {
+        return;
+    }
+    nodes.reserve(lights.size() * 2 - 1);
+    leaf_of_triangle.assign(max_id + 1, -1);
+    build(lights, 0, (int)lights.size(), triangles, powers, -1);
+}
+
+int LightBVH::build(std::vector<int> &lights, int begin, int end, const std::vector<Triangle> &triangles,
+                    const std::vector<real> &powers, int parent) {
+    const int node_id = (int)nodes.size();
+    nodes.push_back(Node());
+    if (end - begin == 1) {
+        const Triangle &t = triangles[lights[begin]];
+        Node &node = nodes[node_id];
+        node.lower = glm::min(glm::min(t.v[0], t.v[1]), t.v[2]);
+        node.upper = glm::max(glm::max(t.v[0], t.v[1]), t.v[2]);
+        node.power = powers[lights[begin]];
+        node.axis = t.normal;
+        node.theta_o = 0;
+        node.second_child = -1;
+        node.light = lights[begin];
+        node.parent = parent;
+        leaf_of_triangle[t.id] = node_id;
+        return node_id;
+    }
+    // Median split of the centroids along their longest extent
+    Vector3 lower(1e30f), upper(-1e30f);
+    for (int i = begin; i < end; i++) {
+        const Triangle &t = triangles[lights[i]];
+        const Vector3 centroid = (t.v[0] + t.v[1] + t.v[2]) * (1.0f / 3.0f);
+        lower = glm::min(lower, centroid);
+        upper = glm::max(upper, centroid);
+    }
+    const Vector3 extent = upper - lower;
+    const int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+    const int mid = (begin + end) / 2;
+    std::nth_element(lights.begin() + begin, lights.begin() + mid, lights.begin() + end, [&](int a, int b) {
+        const Triangle &ta = triangles[a], &tb = triangles[b];
+        return ta.v[0][axis] + ta.v[1][axis] + ta.v[2][axis] < tb.v[0][axis] + tb.v[1][axis] + tb.v[2][axis];
+    });
+    build(lights, begin, mid, triangles, powers, node_id);
+    const int second_child = build(lights, mid, end, triangles, powers, node_id);
+    const Node &a = nodes[node_id + 1], &b = nodes[second_child];
+    Node &node = nodes[node_id];
+    node.lower = glm::min(a.lower, b.lower);
+    node.upper = glm::max(a.upper, b.upper);
+    node.power = a.power + b.power;
+    merge_cones(a.axis, a.theta_o, b.axis, b.theta_o, node.axis, node.theta_o);
+    node.second_child = second_child;
+    node.light = -1;
+    node.parent = parent;
+    return node_id;
+}
+
+real LightBVH::get_importance(const Node &node, const Vector3 &pos) const {
+    const Vector3 center = (node.lower + node.upper) * 0.5f;
+    const Vector3 d = pos - center;
+    const real dist2 = dot(d, d);
+    const real radius2 = dot(node.upper - node.lower, node.upper - node.lower) * 0.25f;
+    if (dist2 <= radius2) {
+        // Within the bounding sphere, any direction is possible
+        return node.power / std::max(radius2, 1e-20f);
+    }
+    const real dist = std::sqrt(dist2);
+    const real theta = std::acos(clamp(dot(node.axis, d) / dist, -1.0f, 1.0f));
+    const real theta_u = std::asin(std::sqrt(radius2 / dist2));
+    const real theta_prime = std::max(0.0f, theta - node.theta_o - theta_u);
+    if (theta_prime >= pi * 0.5f) {
+        return 0;
+    }
+    return node.power * std::cos(theta_prime) / dist2;
+}
+
+real LightBVH::get_first_child_probability(const Node &node, int node_id, const Vector3 &pos) const {
+    const real a = get_importance(nodes[node_id + 1], pos), b = get_importance(nodes[node.second_child], pos);
+    if (a + b <= 0) {
+        return -1;
+    }
+    return a / (a + b);
+}
+
+int LightBVH::sample(const Vector3 &pos, real r, real &pdf) const {
+    pdf = 0;
+    if (nodes.empty()) {
+        return -1;
+    }
+    real p = 1;
+    int node_id = 0;
+    while (!nodes[node_id].is_leaf()) {
+        const Node &node = nodes[node_id];
+        const real first = get_first_child_probability(node, node_id, pos);
+        if (first < 0) {
+            return -1;
+        }
+        if (r < first) {
+            r = r / first;
+            p *= first;
+            node_id = node_id + 1;
+        } else {
+            r = (r - first) / (1 - first);
+            p *= 1 - first;
+            node_id = node.second_child;
+        }
+        r = std::min(r, 1.0f - 1e-7f);
+    }
+    if (get_importance(nodes[node_id], pos) <= 0) {
+        return -1;
+    }
+    pdf = p;
+    return nodes[node_id].light;
+}
+
+real LightBVH::get_pdf(const Vector3 &pos, int triangle_id) const {
+    if (triangle_id < 0 || triangle_id >= (int)leaf_of_triangle.size() || leaf_of_triangle[triangle_id] == -1) {
+        return 0;
+    }
+    int node_id = leaf_of_triangle[triangle_id];
+    if (get_importance(nodes[node_id], pos) <= 0) {
+        return 0;
+    }
+    real p = 1;
+    while (nodes[node_id].parent != -1) {
+        const int parent = nodes[node_id].parent;
+        const real first = get_first_child_probability(nodes[parent], parent, pos);
+        if (first < 0) {
+            return 0;
+        }
+        p *= node_id == parent + 1 ? first : 1 - first;
+        node_id = parent;
+    }
+    return p;
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,70 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <taichi/geometry/primitives.h>
+
+TC_NAMESPACE_BEGIN
+
+// A BVH over one-sided emissive triangles, for sampling them in proportion to an estimate of their contribution
+// at a shading point (Conty Estevez and Kulla, "Importance Sampling of Many Lights with Adaptive Tree Splitting",
+// 2018). Nodes bound the positions, total power and normal cone of their lights; sampling descends from the root,
+// choosing children by power * cos(bound of the angle to the point outside the cone) / distance^2. Importances
+// are only zero for subtrees facing away from the point, which emit nothing toward it.
+class LightBVH {
+public:
+    LightBVH() {}
+
+    // powers[i] is that of triangles[i]
+    void initialize(const std::vector<Triangle> &triangles, const std::vector<real> &powers);
+
+    bool empty() const {
+        return nodes.empty();
+    }
+
+    // The index of a light among those of initialize(), or -1 if none emits toward pos.
+    // pdf is the discrete probability of the light
+    int sample(const Vector3 &pos, real r, real &pdf) const;
+
+    // Of sample() choosing the light of triangle id at pos
+    real get_pdf(const Vector3 &pos, int triangle_id) const;
+
+protected:
+    struct Node {
+        Vector3 lower, upper;
+        real power;
+        // Normals of the lights are within angle theta_o of axis
+        Vector3 axis;
+        real theta_o;
+        // Children are node + 1 and second_child; leaves hold a light
+        int second_child;
+        int light;
+        int parent;
+
+        bool is_leaf() const {
+            return light != -1;
+        }
+    };
+
+    std::vector<Node> nodes;
+    // Leaves by triangle id, -1 for non-emitting triangles
+    std::vector<int> leaf_of_triangle;
+
+    int build(std::vector<int> &lights, int begin, int end, const std::vector<Triangle> &triangles,
+              const std::vector<real> &powers, int parent);
+
+    real get_importance(const Node &node, const Vector3 &pos) const;
+
+    // Of choosing the first child of a node at pos, or -1 if neither emits toward it
+    real get_first_child_probability(const Node &node, int node_id, const Vector3 &pos) const;
+};
+
+TC_NAMESPACE_END
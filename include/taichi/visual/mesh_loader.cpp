@@ -0,0 +1,400 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/visual/mesh_loader.h>
+#include <taichi/system/threading.h>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+TC_NAMESPACE_BEGIN
+
+static_assert(sizeof(Vector3) == 12 && sizeof(Vector2) == 8 && sizeof(Vector3i) == 12,
+              "Mesh caches hold tightly packed vectors");
+
+// A file mapped read-only into memory
+class MappedFile {
+public:
+    explicit MappedFile(const std::string &filename) {
+        fd = open(filename.c_str(), O_RDONLY);
+        struct stat s;
+        if (fd == -1 || fstat(fd, &s) != 0) {
+            return;
+        }
+        size = (size_t)s.st_size;
+        if (size > 0) {
+            void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            data = p == MAP_FAILED ? nullptr : (const char *)p;
+        }
+    }
+
+    ~MappedFile() {
+        if (data) {
+            munmap((void *)data, size);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    bool is_valid() const {
+        return fd != -1 && (data != nullptr || size == 0);
+    }
+
+    const char *data = nullptr;
+    size_t size = 0;
+
+private:
+    int fd = -1;
+};
+
+static int get_num_threads(int num_threads) {
+    return num_threads > 0 ? num_threads : std::max(1, (int)std::thread::hardware_concurrency());
+}
+
+// FNV-1a over 8 byte words of blocks in parallel, then over the hashes of the blocks
+static uint64 hash_data(const char *data, size_t size, int num_threads) {
+    const uint64 prime = 0x100000001b3ull, basis = 0xcbf29ce484222325ull;
+    const size_t block_size = 1 << 20;
+    const int num_blocks = (int)((size + block_size - 1) / block_size);
+    std::vector<uint64> hashes(num_blocks);
+    ThreadedTaskManager::run([&](int b) {
+        const char *begin = data + b * block_size, *end = data + std::min(size, (b + 1) * block_size);
+        uint64 hash = basis;
+        for (; begin + 8 <= end; begin += 8) {
+            uint64 word;
+            std::memcpy(&word, begin, 8);
+            hash = (hash ^ word) * prime;
+        }
+        for (; begin < end; begin++) {
+            hash = (hash ^ (unsigned char)*begin) * prime;
+        }
+        hashes[b] = hash;
+    }, 0, num_blocks, num_threads);
+    uint64 hash = basis ^ (uint64)size;
+    for (auto h : hashes) {
+        hash = (hash ^ h) * prime;
+    }
+    return hash;
+}
+
+// Statements of a chunk of lines of an OBJ file
+struct ObjChunk {
+    const char *begin, *end;
+    std::vector<Vector3> positions, normals;
+    std::vector<Vector2> uvs;
+    std::vector<Vector3i> corners;
+    // Bits 1, 2, 4 of a corner are set for indices of its position, normal and uv relative to the counts before
+    // the chunk, of which the index is then the offset
+    std::vector<unsigned char> relative;
+};
+
+static const char *skip_space(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+static bool is_digit(char c) {
+    return '0' <= c && c <= '9';
+}
+
+static real parse_real(const char *&p, const char *end) {
+    p = skip_space(p, end);
+    double sign = 1, mantissa = 0;
+    int exponent = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        sign = *p == '-' ? -1 : 1;
+        p++;
+    }
+    for (; p < end && is_digit(*p); p++) {
+        mantissa = mantissa * 10 + (*p - '0');
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && is_digit(*p); p++) {
+            mantissa = mantissa * 10 + (*p - '0');
+            exponent--;
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        int exponent_sign = 1, e = 0;
+        if (p < end && (*p == '-' || *p == '+')) {
+            exponent_sign = *p == '-' ? -1 : 1;
+            p++;
+        }
+        for (; p < end && is_digit(*p); p++) {
+            e = e * 10 + (*p - '0');
+        }
+        exponent += exponent_sign * e;
+    }
+    // Skip anything else of the token
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r') {
+        p++;
+    }
+    return (real)(sign * mantissa * std::pow(10.0, exponent));
+}
+
+// An index of a corner, as tinyobj's fixIndex(): 1-based, or relative to the count so far if negative
+static void parse_index(const char *&p, const char *end, int count, int &index, unsigned char &relative,
+                        unsigned char bit) {
+    int sign = 1, value = 0;
+    bool read = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        sign = *p == '-' ? -1 : 1;
+        p++;
+    }
+    for (; p < end && is_digit(*p); p++) {
+        value = value * 10 + (*p - '0');
+        read = true;
+    }
+    if (read) {
+        value *= sign;
+        if (value < 0) {
+            index = count + value;
+            relative |= bit;
+        } else {
+            index = std::max(value - 1, 0);
+        }
+    }
+    while (p < end && *p != '/' && *p != ' ' && *p != '\t' && *p != '\r') {
+        p++;
+    }
+}
+
+static void parse_chunk(ObjChunk &chunk) {
+    std::vector<Vector3i> face;
+    std::vector<unsigned char> face_relative;
+    const char *p = chunk.begin;
+    while (p < chunk.end) {
+        const char *line_end = (const char *)std::memchr(p, '\n', chunk.end - p);
+        if (line_end == nullptr) {
+            line_end = chunk.end;
+        }
+        p = skip_space(p, line_end);
+        const bool space_1 = p + 1 < line_end && (p[1] == ' ' || p[1] == '\t');
+        const bool space_2 = p + 2 < line_end && (p[2] == ' ' || p[2] == '\t');
+        if (space_1 && p[0] == 'v') {
+            p++;
+            const real x = parse_real(p, line_end), y = parse_real(p, line_end), z = parse_real(p, line_end);
+            chunk.positions.push_back(Vector3(x, y, z));
+        } else if (space_2 && p[0] == 'v' && p[1] == 'n') {
+            p += 2;
+            const real x = parse_real(p, line_end), y = parse_real(p, line_end), z = parse_real(p, line_end);
+            chunk.normals.push_back(Vector3(x, y, z));
+        } else if (space_2 && p[0] == 'v' && p[1] == 't') {
+            p += 2;
+            const real u = parse_real(p, line_end), v = parse_real(p, line_end);
+            chunk.uvs.push_back(Vector2(u, v));
+        } else if (space_1 && p[0] == 'f') {
+            p++;
+            face.clear();
+            face_relative.clear();
+            while ((p = skip_space(p, line_end)) < line_end) {
+                // v, v/t, v//n or v/t/n
+                Vector3i corner(-1);
+                unsigned char relative = 0;
+                parse_index(p, line_end, (int)chunk.positions.size(), corner[0], relative, 1);
+                if (p < line_end && *p == '/') {
+                    p++;
+                    parse_index(p, line_end, (int)chunk.uvs.size(), corner[2], relative, 4);
+                    if (p < line_end && *p == '/') {
+                        p++;
+                        parse_index(p, line_end, (int)chunk.normals.size(), corner[1], relative, 2);
+                    }
+                }
+                face.push_back(corner);
+                face_relative.push_back(relative);
+            }
+            // Fan triangulation
+            for (int k = 2; k < (int)face.size(); k++) {
+                for (int c : {0, k - 1, k}) {
+                    chunk.corners.push_back(face[c]);
+                    chunk.relative.push_back(face_relative[c]);
+                }
+            }
+        }
+        p = line_end + 1;
+    }
+}
+
+static void load_obj(const std::string &filename, const char *data, size_t size, IndexedMesh &mesh,
+                     int num_threads) {
+    // Chunks start after line ends
+    const int num_chunks = std::max(1, (int)std::min((size_t)num_threads * 8, size / (1 << 16)));
+    std::vector<ObjChunk> chunks(num_chunks);
+    const char *begin = data, *end = data + size;
+    for (int c = 0; c < num_chunks; c++) {
+        chunks[c].begin = begin;
+        const char *next = c + 1 == num_chunks ? end : std::max(begin, data + size / num_chunks * (c + 1));
+        if (next < end) {
+            next = (const char *)std::memchr(next, '\n', end - next);
+            next = next ? next + 1 : end;
+        }
+        chunks[c].end = begin = next;
+    }
+    ThreadedTaskManager::run([&](int c) { parse_chunk(chunks[c]); }, 0, num_chunks, num_threads);
+    // Offsets of the chunks in the merged buffers
+    std::vector<Vector3i> offsets(num_chunks + 1, Vector3i(0));
+    std::vector<int> corner_offsets(num_chunks + 1, 0);
+    for (int c = 0; c < num_chunks; c++) {
+        offsets[c + 1] = offsets[c] + Vector3i((int)chunks[c].positions.size(), (int)chunks[c].normals.size(),
+                                               (int)chunks[c].uvs.size());
+        corner_offsets[c + 1] = corner_offsets[c] + (int)chunks[c].corners.size();
+    }
+    const Vector3i counts = offsets[num_chunks];
+    mesh.positions.resize(counts[0]);
+    mesh.normals.resize(counts[1]);
+    mesh.uvs.resize(counts[2]);
+    mesh.corners.resize(corner_offsets[num_chunks]);
+    std::atomic<bool> valid(true);
+    ThreadedTaskManager::run([&](int c) {
+        ObjChunk &chunk = chunks[c];
+        std::copy(chunk.positions.begin(), chunk.positions.end(), mesh.positions.begin() + offsets[c][0]);
+        std::copy(chunk.normals.begin(), chunk.normals.end(), mesh.normals.begin() + offsets[c][1]);
+        std::copy(chunk.uvs.begin(), chunk.uvs.end(), mesh.uvs.begin() + offsets[c][2]);
+        for (int i = 0; i < (int)chunk.corners.size(); i++) {
+            Vector3i corner = chunk.corners[i];
+            for (int k = 0; k < 3; k++) {
+                if (chunk.relative[i] & (1 << k)) {
+                    corner[k] += offsets[c][k];
+                }
+                if (corner[k] < (k == 0 ? 0 : -1) || corner[k] >= counts[k]) {
+                    valid = false;
+                }
+            }
+            mesh.corners[corner_offsets[c] + i] = corner;
+        }
+        // Free as we go
+        chunk = ObjChunk();
+    }, 0, num_chunks, num_threads);
+    assert_info(valid, "Face with vertex index out of range in " + filename);
+}
+
+void load_obj(const std::string &filename, IndexedMesh &mesh, int num_threads) {
+    MappedFile file(filename);
+    assert_info(file.is_valid(), "Can not read mesh file " + filename);
+    load_obj(filename, file.data, file.size, mesh, get_num_threads(num_threads));
+}
+
+struct MeshCacheHeader {
+    static constexpr unsigned int current_magic = 0x4d435431; // "TCM1"
+
+    unsigned int magic;
+    unsigned int header_size;
+    uint64 source_size;
+    uint64 source_hash;
+    // Of positions, normals, uvs and corners
+    int64 counts[4];
+};
+
+static size_t align_16(size_t size) {
+    return (size + 15) / 16 * 16;
+}
+
+// Offsets of the buffers in a cache, and its size at the end
+static void get_cache_layout(const MeshCacheHeader &header, size_t offsets[5]) {
+    const size_t element_sizes[4] = {sizeof(Vector3), sizeof(Vector3), sizeof(Vector2), sizeof(Vector3i)};
+    offsets[0] = align_16(sizeof(MeshCacheHeader));
+    for (int i = 0; i < 4; i++) {
+        offsets[i + 1] = align_16(offsets[i] + (size_t)header.counts[i] * element_sizes[i]);
+    }
+}
+
+static bool read_cache(const std::string &cache_filename, size_t source_size, uint64 source_hash,
+                       IndexedMesh &mesh) {
+    MappedFile cache(cache_filename);
+    MeshCacheHeader header;
+    if (!cache.is_valid() || cache.size < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, cache.data, sizeof(header));
+    if (header.magic != MeshCacheHeader::current_magic || header.header_size != sizeof(header) ||
+        header.source_size != source_size || header.source_hash != source_hash) {
+        return false;
+    }
+    size_t offsets[5];
+    get_cache_layout(header, offsets);
+    if (offsets[4] != cache.size) {
+        return false;
+    }
+    auto read = [&](auto &buffer, int i) {
+        buffer.resize(header.counts[i]);
+        std::memcpy((void *)buffer.data(), cache.data + offsets[i], buffer.size() * sizeof(buffer[0]));
+    };
+    read(mesh.positions, 0);
+    read(mesh.normals, 1);
+    read(mesh.uvs, 2);
+    read(mesh.corners, 3);
+    return true;
+}
+
+static bool write_cache(const std::string &cache_filename, size_t source_size, uint64 source_hash,
+                        const IndexedMesh &mesh) {
+    MeshCacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = MeshCacheHeader::current_magic;
+    header.header_size = sizeof(header);
+    header.source_size = source_size;
+    header.source_hash = source_hash;
+    header.counts[0] = mesh.positions.size();
+    header.counts[1] = mesh.normals.size();
+    header.counts[2] = mesh.uvs.size();
+    header.counts[3] = mesh.corners.size();
+    size_t offsets[5];
+    get_cache_layout(header, offsets);
+    // Written aside and renamed, so that a cache is never seen half written
+    const std::string temp_filename = cache_filename + ".tmp" + std::to_string(getpid());
+    FILE *f = fopen(temp_filename.c_str(), "wb");
+    if (f == nullptr) {
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    auto write = [&](const void *data, size_t size, int i) {
+        ok = ok && fseek(f, (long)offsets[i], SEEK_SET) == 0 && (size == 0 || fwrite(data, size, 1, f) == 1);
+    };
+    write(mesh.positions.data(), mesh.positions.size() * sizeof(Vector3), 0);
+    write(mesh.normals.data(), mesh.normals.size() * sizeof(Vector3), 1);
+    write(mesh.uvs.data(), mesh.uvs.size() * sizeof(Vector2), 2);
+    write(mesh.corners.data(), mesh.corners.size() * sizeof(Vector3i), 3);
+    // Pad to the aligned end
+    ok = ok && (offsets[4] == offsets[3] + mesh.corners.size() * sizeof(Vector3i) ||
+                (fseek(f, (long)offsets[4] - 1, SEEK_SET) == 0 && fputc(0, f) == 0));
+    ok = fclose(f) == 0 && ok;
+    ok = ok && std::rename(temp_filename.c_str(), cache_filename.c_str()) == 0;
+    if (!ok) {
+        std::remove(temp_filename.c_str());
+    }
+    return ok;
+}
+
+void load_obj_cached(const std::string &filename, const std::string &cache_filename, IndexedMesh &mesh,
+                     int num_threads) {
+    num_threads = get_num_threads(num_threads);
+    MappedFile file(filename);
+    assert_info(file.is_valid(), "Can not read mesh file " + filename);
+    const uint64 hash = hash_data(file.data, file.size, num_threads);
+    if (read_cache(cache_filename, file.size, hash, mesh)) {
+        return;
+    }
+    load_obj(filename, file.data, file.size, mesh, num_threads);
+    if (!write_cache(cache_filename, file.size, hash, mesh)) {
+        std::cerr << "Warning: can not write mesh cache " << cache_filename << std::endl;
+    }
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,41 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <taichi/math/linalg.h>
+
+TC_NAMESPACE_BEGIN
+
+// Geometry of an OBJ file, with polygons fanned into triangles as tinyobj does
+struct IndexedMesh {
+    std::vector<Vector3> positions;
+    std::vector<Vector3> normals;
+    std::vector<Vector2> uvs;
+    // Per corner of every triangle, the indices of its position, normal and uv, -1 for no normal or uv
+    std::vector<Vector3i> corners;
+
+    int get_num_triangles() const {
+        return (int)corners.size() / 3;
+    }
+};
+
+// Parses the v, vn, vt and f statements of an OBJ file in parallel, by chunks of lines; other statements are
+// ignored. num_threads = 0 for all cores.
+void load_obj(const std::string &filename, IndexedMesh &mesh, int num_threads = 0);
+
+// As load_obj(), through a binary cache of the mesh: the cache is read if it was written from an OBJ file of the
+// same size and hash, and (re-)written otherwise. The cache holds the buffers of IndexedMesh, 16 byte aligned, after
+// a header, for it to be read or mapped in place. Failures to write the cache are only warned about.
+void load_obj_cached(const std::string &filename, const std::string &cache_filename, IndexedMesh &mesh,
+                     int num_threads = 0);
+
+TC_NAMESPACE_END
@@ -8,12 +8,18 @@
 *******************************************************************************/
 
 #include "ray_intersection.h"
+#include <taichi/system/memory.h>
+#include <algorithm>
+#include <cstring>
 
 TC_NAMESPACE_BEGIN
 
 
 class BruteForceRayIntersection : public RayIntersection {
 public:
+    using RayIntersection::query;
+    using RayIntersection::occlude;
+
     void clear() override;
 
     void build() override;
@@ -22,13 +28,33 @@ public:
 
     void add_triangle(Triangle &triangle) override;
 
+    void add_spheres(const std::vector<Vector4> &spheres, int first_id) override;
+
+    void add_level_set(std::shared_ptr<const LevelSetSurface> surface, int id) override;
+
+    void update() override;
+
 private:
-    std::vector<Triangle> triangles;
+    std::vector<IntersectionTriangle> added_triangles;
+    // Those added, then those of the instances
+    std::vector<IntersectionTriangle> triangles;
 
     // Inherited via RayIntersection
     virtual bool occlude(Ray &ray) override;
 };
 
+// What the callbacks of an Embree user geometry of spheres are passed
+struct SphereGeometry {
+    const Vector4 *spheres;
+    unsigned geom_id;
+};
+
+// And of a level set
+struct LevelSetUserGeometry {
+    const LevelSetSurface *surface;
+    unsigned geom_id;
+};
+
 class EmbreeRayIntersection : public RayIntersection {
 public:
     void clear() override;
@@ -39,41 +65,150 @@ public:
 
     void add_triangle(Triangle &triangle) override;
 
+    // User geometries of rtc_scene, one per set of spheres, built by Embree like its own primitives
+    void add_spheres(const std::vector<Vector4> &spheres, int first_id) override;
+
+    // User geometries of one primitive, marched by the level set
+    void add_level_set(std::shared_ptr<const LevelSetSurface> surface, int id) override;
+
+    // Shapes with a single static instance are transformed into the scene; the others are built once, as
+    // scenes of their own, and instanced. Deformable and dynamic instances are meshes of their own, in a
+    // dynamic scene, where the BVHs of the static geometries are kept by update().
+    void update() override;
+
     virtual bool occlude(Ray &ray) override;
 
+    // In packets of 8 rays where Embree supports rtcIntersect8 (on AVX), of 4 otherwise
+    void query(Ray *rays, int n) override;
+
+    void occlude(Ray *rays, int n, bool *occluded) override;
+
 private:
-    std::vector<Triangle> triangles;
+    std::vector<IntersectionTriangle> triangles;
     RTCDevice rtc_device;
     RTCScene rtc_scene;
-    int geom_id;
+    std::vector<RTCScene> shape_scenes;
+    // Of every geometry (or instance) of rtc_scene, the id of its first triangle
+    std::vector<int> first_triangle_ids;
+    // The geomID of every instance's mesh in rtc_scene, for the deformable and dynamic ones
+    std::vector<unsigned> instance_geometries;
+    // The user data of the sphere geometries, by set
+    std::vector<SphereGeometry> sphere_geometries;
+    std::vector<LevelSetUserGeometry> level_set_geometries;
+    int packet_size;
+
+    // A triangle mesh in scene, with the vertices transformed; returns its geomID
+    unsigned add_mesh(RTCScene scene, const std::vector<Vector3> &vertices, const std::vector<int> &indices,
+                      const Matrix4 *transform, RTCGeometryFlags flags = RTC_GEOMETRY_STATIC);
+
+    void set_vertices(RTCScene scene, unsigned id, const std::vector<Vector3> &vertices, const Matrix4 *transform);
+
+    // The id of the triangle hit, or -1
+    int get_triangle_id(unsigned geom_id, unsigned prim_id, unsigned inst_id) const {
+        if (geom_id == RTC_INVALID_GEOMETRY_ID) {
+            return -1;
+        }
+        return first_triangle_ids[inst_id != RTC_INVALID_GEOMETRY_ID ? inst_id : geom_id] + (int)prim_id;
+    }
+
+    template <int N, typename Packet>
+    void trace_packets(Ray *rays, int n, bool *occluded);
 };
 
 
 void BruteForceRayIntersection::clear() {
+    added_triangles.clear();
     triangles.clear();
+    shapes.clear();
+    instances.clear();
+    sphere_sets.clear();
+    level_sets.clear();
 }
 
 void BruteForceRayIntersection::build() {
+    triangles = added_triangles;
+    for (auto &instance : instances) {
+        get_triangles(instance, triangles);
+        instance.modified = false;
+    }
+}
+
+void BruteForceRayIntersection::update() {
+    // There is no acceleration structure to keep
+    build();
 }
 
 void BruteForceRayIntersection::query(Ray &ray) {
     for (auto &triangle : triangles) {
-        triangle.intersect(ray);
+        if (triangle.intersect(ray.orig, ray.dir, 0.0f, ray.dist, ray.u, ray.v)) {
+            ray.triangle_id = triangle.id;
+        }
+    }
+    for (auto &set : sphere_sets) {
+        for (int i = 0; i < (int)set.spheres.size(); i++) {
+            if (intersect_sphere(set.spheres[i], ray.orig, ray.dir, 0.0f, ray.dist)) {
+                ray.triangle_id = set.first_id + i;
+                ray.u = ray.v = 0.0f;
+            }
+        }
+    }
+    for (auto &level_set : level_sets) {
+        if (level_set.first->intersect(ray.orig, ray.dir, 0.0f, ray.dist)) {
+            ray.triangle_id = level_set.second;
+            ray.u = ray.v = 0.0f;
+        }
     }
 }
 
 void BruteForceRayIntersection::add_triangle(Triangle &triangle) {
-    triangles.push_back(triangle);
+    added_triangles.push_back(IntersectionTriangle(triangle));
+}
+
+void BruteForceRayIntersection::add_spheres(const std::vector<Vector4> &spheres, int first_id) {
+    sphere_sets.push_back(Spheres{spheres, first_id});
+}
+
+void BruteForceRayIntersection::add_level_set(std::shared_ptr<const LevelSetSurface> surface, int id) {
+    level_sets.push_back(std::make_pair(surface, id));
 }
 
 bool BruteForceRayIntersection::occlude(Ray &ray) {
+    real dist = ray.dist, u, v;
+    for (auto &triangle : triangles) {
+        if (triangle.intersect(ray.orig, ray.dir, 0.0f, dist, u, v)) {
+            return true;
+        }
+    }
+    for (auto &set : sphere_sets) {
+        for (auto &sphere : set.spheres) {
+            if (intersect_sphere(sphere, ray.orig, ray.dir, 0.0f, dist)) {
+                return true;
+            }
+        }
+    }
+    for (auto &level_set : level_sets) {
+        if (level_set.first->intersect(ray.orig, ray.dir, 0.0f, dist)) {
+            return true;
+        }
+    }
     return false;
-
 }
 
 void EmbreeRayIntersection::clear() {
     triangles.clear();
+    shapes.clear();
+    instances.clear();
+    first_triangle_ids.clear();
+    instance_geometries.clear();
+    sphere_sets.clear();
+    sphere_geometries.clear();
+    level_sets.clear();
+    level_set_geometries.clear();
     rtcDeleteScene(rtc_scene);
+    for (auto scene : shape_scenes) {
+        rtcDeleteScene(scene);
+    }
+    shape_scenes.clear();
     rtcDeleteDevice(rtc_device);
 }
 
@@ -114,48 +249,319 @@ void error_handler(const RTCError code, const char *str = nullptr) {
     assert(false);
 }
 
+// Embree reports the bytes of its allocations before making them, and of its frees, negated, after them
+bool memory_monitor(const ssize_t bytes, const bool post) {
+    static const int tag = MemoryAccounting::get_tag("embree");
+    MemoryAccounting::add(tag, (int64)bytes);
+    return true;
+}
+
+struct RTCVertex {
+    float x, y, z, a;
+};
+
+struct RTCTriangle {
+    int v[3];
+};
+
+static void sphere_bounds(void *ptr, size_t item, RTCBounds &bounds) {
+    const Vector4 &sphere = ((const SphereGeometry *)ptr)->spheres[item];
+    bounds.lower_x = sphere.x - sphere.w;
+    bounds.lower_y = sphere.y - sphere.w;
+    bounds.lower_z = sphere.z - sphere.w;
+    bounds.upper_x = sphere.x + sphere.w;
+    bounds.upper_y = sphere.y + sphere.w;
+    bounds.upper_z = sphere.z + sphere.w;
+}
+
+static void sphere_intersect(void *ptr, RTCRay &ray, size_t item) {
+    const SphereGeometry &geometry = *(const SphereGeometry *)ptr;
+    const Vector4 &sphere = geometry.spheres[item];
+    const Vector3 orig(ray.org[0], ray.org[1], ray.org[2]), dir(ray.dir[0], ray.dir[1], ray.dir[2]);
+    if (intersect_sphere(sphere, orig, dir, ray.tnear, ray.tfar)) {
+        const Vector3 normal = orig + ray.tfar * dir - Vector3(sphere.x, sphere.y, sphere.z);
+        ray.Ng[0] = normal.x;
+        ray.Ng[1] = normal.y;
+        ray.Ng[2] = normal.z;
+        ray.u = ray.v = 0.0f;
+        ray.geomID = geometry.geom_id;
+        ray.primID = (unsigned)item;
+    }
+}
+
+static void sphere_occluded(void *ptr, RTCRay &ray, size_t item) {
+    const Vector4 &sphere = ((const SphereGeometry *)ptr)->spheres[item];
+    real t_far = ray.tfar;
+    if (intersect_sphere(sphere, Vector3(ray.org[0], ray.org[1], ray.org[2]),
+                         Vector3(ray.dir[0], ray.dir[1], ray.dir[2]), ray.tnear, t_far)) {
+        ray.geomID = 0;
+    }
+}
+
+// The packet versions, one lane at a time, as Embree calls those of the packet size traced
+template <int N, typename Packet>
+static void sphere_intersect_packet(const void *valid, void *ptr, Packet &packet, size_t item) {
+    const SphereGeometry &geometry = *(const SphereGeometry *)ptr;
+    const Vector4 &sphere = geometry.spheres[item];
+    for (int k = 0; k < N; k++) {
+        if (!((const int *)valid)[k]) {
+            continue;
+        }
+        const Vector3 orig(packet.orgx[k], packet.orgy[k], packet.orgz[k]);
+        const Vector3 dir(packet.dirx[k], packet.diry[k], packet.dirz[k]);
+        real t_far = packet.tfar[k];
+        if (intersect_sphere(sphere, orig, dir, packet.tnear[k], t_far)) {
+            const Vector3 normal = orig + t_far * dir - Vector3(sphere.x, sphere.y, sphere.z);
+            packet.tfar[k] = t_far;
+            packet.Ngx[k] = normal.x;
+            packet.Ngy[k] = normal.y;
+            packet.Ngz[k] = normal.z;
+            packet.u[k] = packet.v[k] = 0.0f;
+            packet.geomID[k] = geometry.geom_id;
+            packet.primID[k] = (unsigned)item;
+        }
+    }
+}
+
+template <int N, typename Packet>
+static void sphere_occluded_packet(const void *valid, void *ptr, Packet &packet, size_t item) {
+    const Vector4 &sphere = ((const SphereGeometry *)ptr)->spheres[item];
+    for (int k = 0; k < N; k++) {
+        if (!((const int *)valid)[k]) {
+            continue;
+        }
+        real t_far = packet.tfar[k];
+        if (intersect_sphere(sphere, Vector3(packet.orgx[k], packet.orgy[k], packet.orgz[k]),
+                             Vector3(packet.dirx[k], packet.diry[k], packet.dirz[k]), packet.tnear[k], t_far)) {
+            packet.geomID[k] = 0;
+        }
+    }
+}
+
+static void level_set_bounds(void *ptr, size_t item, RTCBounds &bounds) {
+    Vector3 lower, upper;
+    ((const LevelSetUserGeometry *)ptr)->surface->get_bounds(lower, upper);
+    bounds.lower_x = lower.x;
+    bounds.lower_y = lower.y;
+    bounds.lower_z = lower.z;
+    bounds.upper_x = upper.x;
+    bounds.upper_y = upper.y;
+    bounds.upper_z = upper.z;
+}
+
+static void level_set_intersect(void *ptr, RTCRay &ray, size_t item) {
+    const LevelSetUserGeometry &geometry = *(const LevelSetUserGeometry *)ptr;
+    const Vector3 orig(ray.org[0], ray.org[1], ray.org[2]), dir(ray.dir[0], ray.dir[1], ray.dir[2]);
+    if (geometry.surface->intersect(orig, dir, ray.tnear, ray.tfar)) {
+        const Vector3 normal = geometry.surface->get_normal(orig + ray.tfar * dir);
+        ray.Ng[0] = normal.x;
+        ray.Ng[1] = normal.y;
+        ray.Ng[2] = normal.z;
+        ray.u = ray.v = 0.0f;
+        ray.geomID = geometry.geom_id;
+        ray.primID = (unsigned)item;
+    }
+}
+
+static void level_set_occluded(void *ptr, RTCRay &ray, size_t item) {
+    real t_far = ray.tfar;
+    if (((const LevelSetUserGeometry *)ptr)->surface->intersect(Vector3(ray.org[0], ray.org[1], ray.org[2]),
+                                                                Vector3(ray.dir[0], ray.dir[1], ray.dir[2]),
+                                                                ray.tnear, t_far)) {
+        ray.geomID = 0;
+    }
+}
+
+template <int N, typename Packet>
+static void level_set_intersect_packet(const void *valid, void *ptr, Packet &packet, size_t item) {
+    const LevelSetUserGeometry &geometry = *(const LevelSetUserGeometry *)ptr;
+    for (int k = 0; k < N; k++) {
+        if (!((const int *)valid)[k]) {
+            continue;
+        }
+        const Vector3 orig(packet.orgx[k], packet.orgy[k], packet.orgz[k]);
+        const Vector3 dir(packet.dirx[k], packet.diry[k], packet.dirz[k]);
+        real t_far = packet.tfar[k];
+        if (geometry.surface->intersect(orig, dir, packet.tnear[k], t_far)) {
+            const Vector3 normal = geometry.surface->get_normal(orig + t_far * dir);
+            packet.tfar[k] = t_far;
+            packet.Ngx[k] = normal.x;
+            packet.Ngy[k] = normal.y;
+            packet.Ngz[k] = normal.z;
+            packet.u[k] = packet.v[k] = 0.0f;
+            packet.geomID[k] = geometry.geom_id;
+            packet.primID[k] = (unsigned)item;
+        }
+    }
+}
+
+template <int N, typename Packet>
+static void level_set_occluded_packet(const void *valid, void *ptr, Packet &packet, size_t item) {
+    const LevelSetSurface *surface = ((const LevelSetUserGeometry *)ptr)->surface;
+    for (int k = 0; k < N; k++) {
+        if (!((const int *)valid)[k]) {
+            continue;
+        }
+        real t_far = packet.tfar[k];
+        if (surface->intersect(Vector3(packet.orgx[k], packet.orgy[k], packet.orgz[k]),
+                               Vector3(packet.dirx[k], packet.diry[k], packet.dirz[k]), packet.tnear[k], t_far)) {
+            packet.geomID[k] = 0;
+        }
+    }
+}
+
+void EmbreeRayIntersection::set_vertices(RTCScene scene, unsigned id, const std::vector<Vector3> &vertices,
+                                         const Matrix4 *transform) {
+    RTCVertex *buffer = (RTCVertex *)rtcMapBuffer(scene, id, RTC_VERTEX_BUFFER);
+    for (int i = 0; i < (int)vertices.size(); i++) {
+        const Vector3 v = transform ? multiply_matrix4(*transform, vertices[i], 1.0f) : vertices[i];
+        buffer[i] = RTCVertex{v.x, v.y, v.z, 0.0f};
+    }
+    rtcUnmapBuffer(scene, id, RTC_VERTEX_BUFFER);
+}
+
+unsigned EmbreeRayIntersection::add_mesh(RTCScene scene, const std::vector<Vector3> &vertices,
+                                         const std::vector<int> &indices, const Matrix4 *transform,
+                                         RTCGeometryFlags flags) {
+    unsigned id = rtcNewTriangleMesh(scene, flags, indices.size() / 3, vertices.size(), 1);
+    set_vertices(scene, id, vertices, transform);
+    RTCTriangle *buffer = (RTCTriangle *)rtcMapBuffer(scene, id, RTC_INDEX_BUFFER);
+    std::memcpy(buffer, indices.data(), sizeof(int) * indices.size());
+    rtcUnmapBuffer(scene, id, RTC_INDEX_BUFFER);
+    return id;
+}
+
 void EmbreeRayIntersection::build() {
     _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
     _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
-    int num_triangles = (int)triangles.size(),
-        num_vertices = num_triangles * 3;
-    RTCGeometryFlags geom_flags = RTC_GEOMETRY_STATIC;
 
     rtc_device = rtcNewDevice(NULL);
 
     error_handler(rtcDeviceGetError(rtc_device));
     rtcDeviceSetErrorFunction(rtc_device, error_handler);
-
-    rtc_scene = rtcDeviceNewScene(rtc_device, RTC_SCENE_STATIC, RTC_INTERSECT1);
-    geom_id = rtcNewTriangleMesh(rtc_scene, geom_flags, num_triangles, num_vertices, 1);
-
-    struct RTCVertex {
-        float x, y, z, a;
-    };
-    struct RTCTriangle {
-        int v[3];
+    rtcDeviceSetMemoryMonitorFunction(rtc_device, memory_monitor);
+
+    packet_size = rtcDeviceGetParameter1i(rtc_device, RTC_CONFIG_INTERSECT8) ? 8 : 4;
+    const RTCAlgorithmFlags algorithm_flags =
+            RTCAlgorithmFlags(RTC_INTERSECT1 | (packet_size == 8 ? RTC_INTERSECT8 : RTC_INTERSECT4));
+    bool dynamic = false;
+    for (auto &instance : instances) {
+        dynamic = dynamic || instance.mode != GeometryMode::fixed;
+    }
+    rtc_scene = rtcDeviceNewScene(rtc_device, dynamic ? RTC_SCENE_DYNAMIC : RTC_SCENE_STATIC, algorithm_flags);
+    auto set_first_triangle_id = [&](unsigned geom_id, int first_triangle_id) {
+        if (first_triangle_ids.size() <= geom_id) {
+            first_triangle_ids.resize(geom_id + 1, 0);
+        }
+        first_triangle_ids[geom_id] = first_triangle_id;
     };
 
-    RTCVertex *vertices = (RTCVertex *)rtcMapBuffer(rtc_scene, geom_id, RTC_VERTEX_BUFFER);
-    for (int i = 0; i < num_triangles; i++) {
-        for (int k = 0; k < 3; k++) {
-            *(Vector4 *)(&vertices[i * 3 + k]) = Vector4(triangles[i].v[k], 0);
+    // Triangles added one by one form a mesh of their own, with ids in the order they were added
+    if (!triangles.empty()) {
+        std::vector<Vector3> vertices;
+        std::vector<int> indices;
+        for (auto &triangle : triangles) {
+            for (int k = 0; k < 3; k++) {
+                indices.push_back((int)vertices.size());
+                vertices.push_back(triangle.get_vertex(k));
+            }
         }
+        set_first_triangle_id(add_mesh(rtc_scene, vertices, indices, nullptr), 0);
     }
-    rtcUnmapBuffer(rtc_scene, geom_id, RTC_VERTEX_BUFFER);
 
-    RTCTriangle *triangles = (RTCTriangle *)rtcMapBuffer(rtc_scene, geom_id, RTC_INDEX_BUFFER);
-    for (int i = 0; i < num_triangles; i++) {
-        for (int k = 0; k < 3; k++) {
-            triangles[i].v[k] = i * 3 + k;
+    std::vector<int> num_static_instances(shapes.size(), 0);
+    for (auto &instance : instances) {
+        num_static_instances[instance.shape] += int(instance.mode == GeometryMode::fixed);
+    }
+    shape_scenes.assign(shapes.size(), nullptr);
+    instance_geometries.assign(instances.size(), RTC_INVALID_GEOMETRY_ID);
+    for (int i = 0; i < (int)instances.size(); i++) {
+        Instance &instance = instances[i];
+        const Shape &shape = shapes[instance.shape];
+        instance.modified = false;
+        if (instance.mode != GeometryMode::fixed || num_static_instances[instance.shape] == 1) {
+            const RTCGeometryFlags flags = instance.mode == GeometryMode::fixed ? RTC_GEOMETRY_STATIC :
+                                           instance.mode == GeometryMode::deformable ? RTC_GEOMETRY_DEFORMABLE :
+                                           RTC_GEOMETRY_DYNAMIC;
+            const unsigned id = add_mesh(rtc_scene, get_vertices(instance), shape.indices, &instance.transform, flags);
+            set_first_triangle_id(id, instance.first_triangle_id);
+            instance_geometries[i] = id;
+            continue;
         }
+        RTCScene &shape_scene = shape_scenes[instance.shape];
+        if (shape_scene == nullptr) {
+            shape_scene = rtcDeviceNewScene(rtc_device, RTC_SCENE_STATIC, algorithm_flags);
+            add_mesh(shape_scene, shape.vertices, shape.indices, nullptr);
+            rtcCommit(shape_scene);
+        }
+        const unsigned id = rtcNewInstance2(rtc_scene, shape_scene);
+        // Column major, every column padded to 4 floats, which is the layout of Matrix4
+        alignas(16) float transform[16];
+        for (int i = 0; i < 4; i++) {
+            for (int j = 0; j < 4; j++) {
+                transform[i * 4 + j] = instance.transform[i][j];
+            }
+        }
+        rtcSetTransform2(rtc_scene, id, RTC_MATRIX_COLUMN_MAJOR_ALIGNED16, transform);
+        set_first_triangle_id(id, instance.first_triangle_id);
+    }
+    shape_scenes.erase(std::remove(shape_scenes.begin(), shape_scenes.end(), nullptr), shape_scenes.end());
+
+    // The user data must stay where it is, so it is allocated at once
+    sphere_geometries.resize(sphere_sets.size());
+    for (int i = 0; i < (int)sphere_sets.size(); i++) {
+        const Spheres &set = sphere_sets[i];
+        const unsigned id = rtcNewUserGeometry(rtc_scene, set.spheres.size());
+        sphere_geometries[i] = SphereGeometry{set.spheres.data(), id};
+        rtcSetUserData(rtc_scene, id, &sphere_geometries[i]);
+        rtcSetBoundsFunction(rtc_scene, id, sphere_bounds);
+        rtcSetIntersectFunction(rtc_scene, id, sphere_intersect);
+        rtcSetIntersectFunction4(rtc_scene, id, sphere_intersect_packet<4, RTCRay4>);
+        rtcSetIntersectFunction8(rtc_scene, id, sphere_intersect_packet<8, RTCRay8>);
+        rtcSetOccludedFunction(rtc_scene, id, sphere_occluded);
+        rtcSetOccludedFunction4(rtc_scene, id, sphere_occluded_packet<4, RTCRay4>);
+        rtcSetOccludedFunction8(rtc_scene, id, sphere_occluded_packet<8, RTCRay8>);
+        set_first_triangle_id(id, set.first_id);
+    }
+
+    level_set_geometries.resize(level_sets.size());
+    for (int i = 0; i < (int)level_sets.size(); i++) {
+        const unsigned id = rtcNewUserGeometry(rtc_scene, 1);
+        level_set_geometries[i] = LevelSetUserGeometry{level_sets[i].first.get(), id};
+        rtcSetUserData(rtc_scene, id, &level_set_geometries[i]);
+        rtcSetBoundsFunction(rtc_scene, id, level_set_bounds);
+        rtcSetIntersectFunction(rtc_scene, id, level_set_intersect);
+        rtcSetIntersectFunction4(rtc_scene, id, level_set_intersect_packet<4, RTCRay4>);
+        rtcSetIntersectFunction8(rtc_scene, id, level_set_intersect_packet<8, RTCRay8>);
+        rtcSetOccludedFunction(rtc_scene, id, level_set_occluded);
+        rtcSetOccludedFunction4(rtc_scene, id, level_set_occluded_packet<4, RTCRay4>);
+        rtcSetOccludedFunction8(rtc_scene, id, level_set_occluded_packet<8, RTCRay8>);
+        set_first_triangle_id(id, level_sets[i].second);
     }
-    rtcUnmapBuffer(rtc_scene, geom_id, RTC_INDEX_BUFFER);
 
     rtcCommit(rtc_scene);
     error_handler(rtcDeviceGetError(rtc_device));
 }
 
+void EmbreeRayIntersection::update() {
+    bool modified = false;
+    for (int i = 0; i < (int)instances.size(); i++) {
+        Instance &instance = instances[i];
+        if (!instance.modified) {
+            continue;
+        }
+        // Refit or rebuilt on commit, as chosen by the geometry flags
+        set_vertices(rtc_scene, instance_geometries[i], get_vertices(instance), &instance.transform);
+        rtcUpdateBuffer(rtc_scene, instance_geometries[i], RTC_VERTEX_BUFFER);
+        instance.modified = false;
+        modified = true;
+    }
+    if (modified) {
+        rtcCommit(rtc_scene);
+        error_handler(rtcDeviceGetError(rtc_device));
+    }
+}
+
 void EmbreeRayIntersection::query(Ray &ray) {
     RTCRay rtc_ray;
     *(Vector3 *)rtc_ray.org = ray.orig;
@@ -166,12 +572,13 @@ void EmbreeRayIntersection::query(Ray &ray) {
     rtc_ray.mask = -1;
     rtc_ray.geomID = RTC_INVALID_GEOMETRY_ID;
     rtc_ray.primID = RTC_INVALID_GEOMETRY_ID;
+    rtc_ray.instID = RTC_INVALID_GEOMETRY_ID;
 
     rtcIntersect(rtc_scene, rtc_ray);
     ray.u = rtc_ray.u;
     ray.v = rtc_ray.v;
     ray.dist = rtc_ray.tfar;
-    ray.triangle_id = rtc_ray.primID;
+    ray.triangle_id = get_triangle_id(rtc_ray.geomID, rtc_ray.primID, rtc_ray.instID);
     return;
     Vector3 normal = Vector3(rtc_ray.Ng[0], rtc_ray.Ng[1], rtc_ray.Ng[2]); // What the hell happened to Ng???
     normal /= max_component(abs(normal));
@@ -179,11 +586,18 @@ void EmbreeRayIntersection::query(Ray &ray) {
 }
 
 void EmbreeRayIntersection::add_triangle(Triangle &triangle) {
-    triangles.push_back(triangle);
+    triangles.push_back(IntersectionTriangle(triangle));
+}
+
+void EmbreeRayIntersection::add_spheres(const std::vector<Vector4> &spheres, int first_id) {
+    sphere_sets.push_back(Spheres{spheres, first_id});
+}
+
+void EmbreeRayIntersection::add_level_set(std::shared_ptr<const LevelSetSurface> surface, int id) {
+    level_sets.push_back(std::make_pair(surface, id));
 }
 
 bool EmbreeRayIntersection::occlude(Ray &ray) {
-    assert(false); //TODO
     RTCRay rtc_ray;
     *(Vector3 *)rtc_ray.org = ray.orig;
     *(Vector3 *)rtc_ray.dir = ray.dir;
@@ -193,13 +607,74 @@ bool EmbreeRayIntersection::occlude(Ray &ray) {
     rtc_ray.mask = -1;
     rtc_ray.geomID = RTC_INVALID_GEOMETRY_ID;
     rtc_ray.primID = RTC_INVALID_GEOMETRY_ID;
+    rtc_ray.instID = RTC_INVALID_GEOMETRY_ID;
 
-    rtcIntersect(rtc_scene, rtc_ray);
-    ray.u = rtc_ray.u;
-    ray.v = rtc_ray.v;
-    ray.dist = rtc_ray.tfar;
-    ray.triangle_id = rtc_ray.primID;
-    return false;
+    // Any hit terminates the traversal; geomID is then set to 0
+    rtcOccluded(rtc_scene, rtc_ray);
+    return rtc_ray.geomID == 0;
+}
+
+inline void trace_packet(const int *valid, RTCScene scene, RTCRay4 &packet, bool occlude) {
+    occlude ? rtcOccluded4(valid, scene, packet) : rtcIntersect4(valid, scene, packet);
+}
+
+inline void trace_packet(const int *valid, RTCScene scene, RTCRay8 &packet, bool occlude) {
+    occlude ? rtcOccluded8(valid, scene, packet) : rtcIntersect8(valid, scene, packet);
+}
+
+// Closest hits if occluded is null, as query(Ray &) does, or occlusion below ray.dist, as occlude(Ray &)
+template <int N, typename Packet>
+void EmbreeRayIntersection::trace_packets(Ray *rays, int n, bool *occluded) {
+    for (int begin = 0; begin < n; begin += N) {
+        const int count = std::min(N, n - begin);
+        alignas(32) int valid[N];
+        Packet packet;
+        for (int k = 0; k < N; k++) {
+            valid[k] = k < count ? -1 : 0;
+            const Ray &ray = rays[begin + std::min(k, count - 1)];
+            packet.orgx[k] = ray.orig.x;
+            packet.orgy[k] = ray.orig.y;
+            packet.orgz[k] = ray.orig.z;
+            packet.dirx[k] = ray.dir.x;
+            packet.diry[k] = ray.dir.y;
+            packet.dirz[k] = ray.dir.z;
+            packet.tnear[k] = eps * 10;
+            packet.tfar[k] = occluded ? ray.dist : Ray::DIST_INFINITE;
+            packet.time[k] = 0.0f;
+            packet.mask[k] = (unsigned)-1;
+            packet.geomID[k] = RTC_INVALID_GEOMETRY_ID;
+            packet.primID[k] = RTC_INVALID_GEOMETRY_ID;
+            packet.instID[k] = RTC_INVALID_GEOMETRY_ID;
+        }
+        trace_packet(valid, rtc_scene, packet, occluded != nullptr);
+        for (int k = 0; k < count; k++) {
+            if (occluded) {
+                occluded[begin + k] = packet.geomID[k] == 0;
+            } else {
+                Ray &ray = rays[begin + k];
+                ray.u = packet.u[k];
+                ray.v = packet.v[k];
+                ray.dist = packet.tfar[k];
+                ray.triangle_id = get_triangle_id(packet.geomID[k], packet.primID[k], packet.instID[k]);
+            }
+        }
+    }
+}
+
+void EmbreeRayIntersection::query(Ray *rays, int n) {
+    if (packet_size == 8) {
+        trace_packets<8, RTCRay8>(rays, n, nullptr);
+    } else {
+        trace_packets<4, RTCRay4>(rays, n, nullptr);
+    }
+}
+
+void EmbreeRayIntersection::occlude(Ray *rays, int n, bool *occluded) {
+    if (packet_size == 8) {
+        trace_packets<8, RTCRay8>(rays, n, occluded);
+    } else {
+        trace_packets<4, RTCRay4>(rays, n, occluded);
+    }
 }
 
 TC_IMPLEMENTATION(RayIntersection, BruteForceRayIntersection, "bf");
@@ -10,12 +10,38 @@
 #pragma once
 
 #include "taichi/geometry/primitives.h"
+#include "level_set_surface.h"
 #include <embree2/rtcore.h>
 #include <embree2/rtcore_ray.h>
 #include <taichi/common/meta.h>
 
 TC_NAMESPACE_BEGIN
 
+// As IntersectionTriangle::intersect, for the nearer of the hits in (t_near, t_far), from outside or inside
+inline bool intersect_sphere(const Vector4 &sphere, const Vector3 &orig, const Vector3 &dir, real t_near,
+                             real &t_far) {
+    const Vector3 center(sphere.x, sphere.y, sphere.z);
+    const real inv_a = 1.0f / dot(dir, dir);
+    const Vector3 oc = orig - center;
+    const real b = dot(oc, dir) * inv_a;
+    // From the distance of the center to the ray, which is more accurate than b^2 - c for distant spheres
+    const Vector3 closest = oc - b * dir;
+    const real h = sphere.w * sphere.w - dot(closest, closest);
+    if (h < 0.0f) {
+        return false;
+    }
+    const real root = std::sqrt(h * inv_a);
+    real dist = -b - root;
+    if (dist <= t_near) {
+        dist = -b + root;
+    }
+    if (dist <= t_near || dist >= t_far) {
+        return false;
+    }
+    t_far = dist;
+    return true;
+}
+
 class RayIntersection : public Unit {
 public:
     virtual void clear() = 0;
@@ -24,9 +50,121 @@ public:
 
     virtual void query(Ray &ray) = 0;
 
+    // Whether anything is hit closer than ray.dist, without finding the closest hit. ray is not modified.
     virtual bool occlude(Ray &ray) = 0;
 
+    // Batches of n rays, which are best coherent, e.g. primary rays of neighbouring pixels.
+    // Implementations may trace them as packets; these fall back to one ray at a time.
+    virtual void query(Ray *rays, int n) {
+        for (int i = 0; i < n; i++) {
+            query(rays[i]);
+        }
+    }
+
+    virtual void occlude(Ray *rays, int n, bool *occluded) {
+        for (int i = 0; i < n; i++) {
+            occluded[i] = occlude(rays[i]);
+        }
+    }
+
     virtual void add_triangle(Triangle &triangle) = 0;
+
+    // An indexed triangle mesh in its own space, three indices per triangle; returns its shape id
+    virtual int add_shape(const std::vector<Vector3> &vertices, const std::vector<int> &indices) {
+        shapes.push_back(Shape{vertices, indices});
+        return (int)shapes.size() - 1;
+    }
+
+    // shape, transformed, with triangle ids from first_triangle_id on in the order of the shape's triangles;
+    // returns its instance id. Backends with instancing share the shape between static instances.
+    virtual int add_instance(int shape, const Matrix4 &transform, int first_triangle_id,
+                             GeometryMode mode = GeometryMode::fixed) {
+        assert_info(0 <= shape && shape < (int)shapes.size(), "Unknown shape");
+        instances.push_back(Instance{shape, transform, first_triangle_id, mode, std::vector<Vector3>(), false});
+        return (int)instances.size() - 1;
+    }
+
+    // Spheres, as (center, radius), with ids from first_id on in their order, e.g. simulation particles.
+    // Hits report the ray distance only (u = v = 0). Static; not every backend supports them.
+    virtual void add_spheres(const std::vector<Vector4> &spheres, int first_id) {
+        error("This ray intersection does not support spheres");
+    }
+
+    // The surface of a level set, as one primitive of that id. Hits report the ray distance only (u = v = 0).
+    // Static; not every backend supports them.
+    virtual void add_level_set(std::shared_ptr<const LevelSetSurface> surface, int id) {
+        error("This ray intersection does not support level sets");
+    }
+
+    // Changes to deformable and dynamic instances, made effective by the next update()
+    void set_instance_transform(int instance, const Matrix4 &transform) {
+        get_modifiable_instance(instance).transform = transform;
+    }
+
+    // New vertices of an instance, in the space of its shape and indexed by its indices
+    void set_instance_vertices(int instance, const std::vector<Vector3> &vertices) {
+        Instance &inst = get_modifiable_instance(instance);
+        assert_info(vertices.size() == shapes[inst.shape].vertices.size(), "Instance vertex count changed");
+        inst.vertices = vertices;
+    }
+
+    // Applies the changes since build() or the last update(). Unlike build(), acceleration structures of
+    // everything unchanged are kept.
+    virtual void update() = 0;
+
+protected:
+    struct Shape {
+        std::vector<Vector3> vertices;
+        std::vector<int> indices;
+    };
+
+    struct Instance {
+        int shape;
+        Matrix4 transform;
+        int first_triangle_id;
+        GeometryMode mode;
+        // Set once the vertices of the shape are replaced
+        std::vector<Vector3> vertices;
+        bool modified;
+    };
+
+    struct Spheres {
+        std::vector<Vector4> spheres;
+        int first_id;
+    };
+
+    std::vector<Shape> shapes;
+    std::vector<Instance> instances;
+    // Of backends supporting add_spheres
+    std::vector<Spheres> sphere_sets;
+    // Of backends supporting add_level_set
+    std::vector<std::pair<std::shared_ptr<const LevelSetSurface>, int>> level_sets;
+
+    const std::vector<Vector3> &get_vertices(const Instance &instance) const {
+        return instance.vertices.empty() ? shapes[instance.shape].vertices : instance.vertices;
+    }
+
+    // The instance's transformed triangles
+    void get_triangles(const Instance &instance, std::vector<IntersectionTriangle> &triangles) const {
+        const std::vector<Vector3> &vertices = get_vertices(instance);
+        const std::vector<int> &indices = shapes[instance.shape].indices;
+        for (int i = 0; i < (int)indices.size() / 3; i++) {
+            Vector3 v[3];
+            for (int k = 0; k < 3; k++) {
+                v[k] = multiply_matrix4(instance.transform, vertices[indices[i * 3 + k]], 1.0f);
+            }
+            triangles.push_back(IntersectionTriangle(v[0], v[1], v[2], instance.first_triangle_id + i));
+        }
+    }
+
+private:
+    Instance &get_modifiable_instance(int instance) {
+        assert_info(0 <= instance && instance < (int)instances.size(), "Unknown instance");
+        Instance &inst = instances[instance];
+        assert_info(inst.mode != GeometryMode::fixed, "Static instances can not be modified");
+        inst.modified = true;
+        return inst;
+    }
 };
 
 TC_INTERFACE(RayIntersection);
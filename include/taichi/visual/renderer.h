@@ -13,23 +13,157 @@
 #include <taichi/visual/scene.h>
 #include <taichi/visual/scene_geometry.h>
 #include <taichi/visualization/image_buffer.h>
+#include <taichi/image/denoiser.h>
 #include <taichi/system/timer.h>
+#include <taichi/system/profiler.h>
+#include <taichi/system/render_statistics.h>
+#include <taichi/system/threading.h>
+#include <taichi/io/binary_stream.h>
 #include <taichi/common/meta.h>
+#include <limits>
 
 TC_NAMESPACE_BEGIN
+
+// Of the stages of one render_for() or render_until() call
+struct RenderProgress {
+    int stages = 0;
+    real seconds = 0;
+    // Of all stages so far
+    real samples_per_pixel = 0;
+    real samples_per_second = 0;
+    real rays_per_second = 0;
+    // The work of these stages, see RenderCounters
+    RenderStatistics statistics;
+    // As of the end, or -1 where the renderer has no estimate
+    real relative_error = -1;
+    bool converged = false;
+};
+
 class Renderer : public Unit {
 public:
     virtual void initialize(const Config &config);
     virtual void render_stage() {};
+    // Whether further stages would not improve the output, for renderers with a convergence criterion
+    virtual bool is_converged() const {
+        return false;
+    }
+
+    // render_stage(), with its work counted into the stage and total statistics
+    void render_counted_stage();
+
+    // Whole stages while they are expected to fit in the time budget, at least one, or until converged
+    RenderProgress render_for(real seconds);
+
+    // Stages until the relative error estimate is at most relative_error, or the renderer converged or
+    // ran out of time. Renderers without an error estimate stop only at the time limit.
+    RenderProgress render_until(real relative_error, real max_seconds = std::numeric_limits<real>::infinity());
+
+    // Paths (or photons) traced so far
+    virtual long long get_num_samples() const {
+        return 0;
+    }
+
+    // Of the output, e.g. the RMS per-pixel relative standard error, or -1 if unknown
+    virtual real get_relative_error() {
+        return -1;
+    }
+
+    // For distributed rendering (see DistributedRendering): renderers whose output is an accumulator of
+    // independent samples can render any range of their sample sequence, with bounds that are multiples of
+    // get_sample_range_granularity(), adding to the accumulator exactly what render_stage() would have
+    virtual bool supports_sample_ranges() const {
+        return false;
+    }
+
+    virtual long long get_sample_range_granularity() const {
+        return 1;
+    }
+
+    virtual void render_sample_range(long long begin, long long end) {
+        assert_info(false, "This renderer can not render sample ranges");
+    }
+
+    virtual ImageAccumulator<Vector3> *get_accumulator() {
+        return nullptr;
+    }
+
+    // The radiance along a camera ray, from one path drawing on rand, for renderers that trace a path per
+    // sample; lets others, e.g. MDAS, choose where the samples go
+    virtual Vector3 estimate_radiance(const Ray &ray, StateSequence &rand) {
+        assert_info(false, "This renderer can not estimate the radiance of single rays");
+        return Vector3(0.0f);
+    }
+
+    // After the accumulations of num_samples samples rendered elsewhere are added in
+    virtual void add_external_samples(long long num_samples) {
+    }
+
+    // Per-phase timings accumulated since the last reset_profile, for renderers that record them
+    std::vector<ProfilerRecord> get_profile() const {
+        return profiler.get_records();
+    }
+
+    void reset_profile() {
+        profiler.clear();
+    }
+
+    // Of the last stage, and of all stages so far, through render_counted_stage() and the calls that
+    // render whole stages. Counters are process-wide, so they include the work of renderers running alongside.
+    RenderStatistics get_stage_statistics() const {
+        return stage_statistics;
+    }
+
+    RenderStatistics get_total_statistics() const {
+        return total_statistics;
+    }
+
+    // Checkpoints of the render in progress: a renderer of the same scene and configuration that loads one
+    // continues exactly where the one that saved it stopped
+    void save_checkpoint(const std::string &fn);
+
+    void load_checkpoint(const std::string &fn);
+
     virtual void set_scene(std::shared_ptr<Scene> scene);
+    // After changes to the scene's deformable and dynamic meshes, e.g. between frames of an animation
+    virtual void update_geometry();
     virtual Array2D<Vector3> get_output() { return Array2D<Vector3>(width, height); };
-    virtual void write_output(std::string fn);
+    // Of the first hits of samples_per_pixel camera rays per pixel through sg, for a Denoiser of get_output().
+    // Albedos are one-sample estimates of the reflectance of the BSDF towards the camera, 1 for lights.
+    virtual FeatureBuffers get_features(int samples_per_pixel = 4);
+    // Writes a snapshot of get_output() on a background thread, so that rendering goes on meanwhile: an OpenEXR
+    // file of the radiance (as half floats) if fn ends with .exr, otherwise a PNG exposed for an average of 0.18
+    // and gamma corrected. Writes are done in order; the task is of this one.
+    virtual std::shared_ptr<AsyncTask> write_output(std::string fn);
+
+    // Until the writes of write_output() so far are done, e.g. before exiting
+    void wait_for_output();
 
 protected:
+    // Stops before the stage that would exceed the time limit or once done(), which is checked after
+    // every stage
+    template <typename T>
+    RenderProgress render_stages(real max_seconds, const T &done);
+
+    // The progress of the render, i.e. everything render_stage() changes
+    virtual void write_checkpoint(BinaryFileStreamOutput &os) {
+        assert_info(false, "This renderer can not write checkpoints");
+    }
+
+    virtual void read_checkpoint(BinaryFileStreamInput &is) {
+        assert_info(false, "This renderer can not read checkpoints");
+    }
+
     std::shared_ptr<Camera> camera;
     std::shared_ptr<Scene> scene;
     std::shared_ptr<RayIntersection> ray_intersection;
     std::shared_ptr<SceneGeometry> sg;
+    Profiler profiler;
+    // Printed after every counted stage
+    bool print_statistics = false;
+    RenderStatistics stage_statistics, total_statistics;
+    // Of write_output(), started by the first write
+    std::shared_ptr<AsyncExecutor> output_executor;
+    std::shared_ptr<AsyncTask> last_output;
     int width, height;
     int min_path_length, max_path_length;
     int num_threads;
@@ -50,7 +184,7 @@ public:
     Vector3 trace(Ray &ray) {
         int tri_id = sg->query_hit_triangle_id(ray);
         real temp = 0;
-        if (tri_id != -1) {
+        if (tri_id != -1 && !scene->is_particle(tri_id)) {
             temp = scene->triangles[tri_id].temperature;
         }
         return Vector3(temp);
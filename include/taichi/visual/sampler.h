@@ -36,16 +36,38 @@ public:
             " instead of " + std::to_string(this->cursor)));
     }
 
+    // The next n samples at once, e.g. all of a bounce; sequences with a faster way than n calls of sample()
+    // override it
+    virtual void fill(real *out, int n) {
+        for (int i = 0; i < n; i++) {
+            out[i] = sample();
+        }
+    }
+
+    // Skips n samples, e.g. to keep later ones at fixed dimensions
+    virtual void skip(int n) {
+        real _;
+        for (int i = 0; i < n; i++) {
+            fill(&_, 1);
+        }
+    }
+
     Vector2 next2() {
-        return Vector2((*this)(), (*this)());
+        real u[2];
+        fill(u, 2);
+        return Vector2(u[0], u[1]);
     }
 
     Vector3 next3() {
-        return Vector3((*this)(), (*this)(), (*this)());
+        real u[3];
+        fill(u, 3);
+        return Vector3(u[0], u[1], u[2]);
     }
 
     Vector4 next4() {
-        return Vector4((*this)(), (*this)(), (*this)(), (*this)());
+        real u[4];
+        fill(u, 4);
+        return Vector4(u[0], u[1], u[2], u[3]);
     }
 };
 
@@ -53,28 +75,86 @@ public:
 class Sampler : public Unit {
 public:
     virtual real sample(int d, long long i) const = 0;
+
+    // Dimensions [d, d + n) of sample i at once, for samplers with work to share among the dimensions of a sample
+    virtual void sample(int d, int n, long long i, real *out) const {
+        for (int k = 0; k < n; k++) {
+            out[k] = sample(d + k, i);
+        }
+    }
+
+    // Dimensions per call of the batched sample(); 1 for samplers without shared work, which
+    // RandomStateSequence then queries one dimension at a time
+    virtual int get_batch_size() const {
+        return 1;
+    }
 };
 TC_INTERFACE(Sampler);
 
 class RandomStateSequence : public StateSequence {
 private:
+    static const int max_batch_size = 16;
     std::shared_ptr<Sampler> sampler;
     long long instance;
+    // Dimensions [batch_begin, batch_begin + batch_size) of the instance, for batching samplers
+    real batch[max_batch_size];
+    int batch_begin = 0, batch_size = 0;
 public:
     RandomStateSequence(std::shared_ptr<Sampler> sampler, long long instance) :
-        sampler(sampler), instance(instance) { }
+        sampler(sampler), instance(instance) {
+        assert_info(sampler != nullptr, "null sampler");
+    }
 
     real sample() override {
-        assert_info(sampler != nullptr, "null sampler");
-        real ret = sampler->sample(cursor++, instance);
+        real ret;
+        if (cursor < batch_begin || cursor >= batch_begin + batch_size) {
+            const int size = std::min(sampler->get_batch_size(), (int)max_batch_size);
+            if (size <= 1) {
+                ret = sampler->sample(cursor, instance);
+            } else {
+                batch_begin = cursor;
+                batch_size = size;
+                sampler->sample(batch_begin, batch_size, instance, batch);
+                ret = batch[0];
+            }
+        } else {
+            ret = batch[cursor - batch_begin];
+        }
+        cursor++;
+        return check(ret);
+    }
+
+    void fill(real *out, int n) override {
+        if (batch_begin <= cursor && cursor + n <= batch_begin + batch_size) {
+            std::copy(batch + (cursor - batch_begin), batch + (cursor - batch_begin + n), out);
+        } else if (sampler->get_batch_size() > 1) {
+            sampler->sample(cursor, n, instance, out);
+        } else {
+            for (int i = 0; i < n; i++) {
+                out[i] = sampler->sample(cursor + i, instance);
+            }
+        }
+        cursor += n;
+        for (int i = 0; i < n; i++) {
+            out[i] = check(out[i]);
+        }
+    }
+
+    // Dimensions are independent, so there is nothing to draw
+    void skip(int n) override {
+        cursor += n;
+    }
+
+protected:
+    // Samplers' values are checked with TC_DEBUG_SAMPLERS only, but rounded up ones are always wrapped to 0
+    static real check(real ret) {
+#ifdef TC_DEBUG_SAMPLERS
         assert_info(ret >= 0, "sampler output should be non-neg");
         if (ret > 1 + 1e-5f) {
             printf("Warning: sampler returns value > 1: [%f]", ret);
         }
-        if (ret >= 1) {
-            ret = 0;
-        }
-        return ret;
+#endif
+        return ret >= 1 ? 0 : ret;
     }
 };
 
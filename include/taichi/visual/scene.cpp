@@ -8,85 +8,97 @@
 *******************************************************************************/
 
 #include <taichi/visual/scene.h>
+#include <taichi/visual/scene_geometry.h>
 #include <taichi/visual/surface_material.h>
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
 
-#define TINYOBJLOADER_IMPLEMENTATION
-#include <tiny_obj_loader.h>
+#include <taichi/visual/mesh_loader.h>
+#include <taichi/system/threading.h>
+#include <thread>
 
 TC_NAMESPACE_BEGIN
 
 void Mesh::initialize(const Config &config) {
     transform = Matrix4(1.0f);
+    const std::string mode = config.get("geometry_mode", "static");
+    assert_info(mode == "static" || mode == "deformable" || mode == "dynamic", "Unknown geometry mode " + mode);
+    geometry_mode = mode == "static" ? GeometryMode::fixed :
+                    mode == "deformable" ? GeometryMode::deformable : GeometryMode::dynamic;
     std::string filepath = config.get_string("filename");
-    if (!filepath.empty())
-        load_from_file(filepath);
-}
-
-void Mesh::load_from_file(const std::string &file_path) {
-    std::string inputfile = file_path;
-    tinyobj::attrib_t attrib;
-    std::vector<tinyobj::shape_t> shapes;
-    std::vector<tinyobj::material_t> materials;
-
-    std::string err;
-    bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &err, inputfile.c_str());
-
-    if (!err.empty()) { // `err` may contain warning message.
-        std::cerr << err << std::endl;
-    }
-
-    assert_info(ret, "Loading " + file_path + " failed");
-
-    // Loop over shapes
-    for (size_t s = 0; s < shapes.size(); s++) {
-        // Loop over faces(polygon)
-        size_t index_offset = 0;
-        for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
-            int fv = shapes[s].mesh.num_face_vertices[f];
-
-            // Loop over vertices in the face.
-            assert_info(fv == 3, "Only triangles supported...");
-            int i = (int)vertices.size(), j = i + 1, k = i + 2;
-            bool has_normal = false;
-            for (size_t v = 0; v < fv; v++) {
-                // access to vertex
-                tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-                float vx = attrib.vertices[3 * idx.vertex_index + 0];
-                float vy = attrib.vertices[3 * idx.vertex_index + 1];
-                float vz = attrib.vertices[3 * idx.vertex_index + 2];
-                vertices.push_back(Vector3(vx, vy, vz));
-                if (idx.normal_index != -1) {
-                    float nx = attrib.normals[3 * idx.normal_index + 0];
-                    float ny = attrib.normals[3 * idx.normal_index + 1];
-                    float nz = attrib.normals[3 * idx.normal_index + 2];
-                    has_normal = true;
-                    normals.push_back(Vector3(nx, ny, nz));
-                } else {
-                    // should be consistent
-                    assert(!has_normal);
-                    has_normal = false;
-                }
-                float tx = 0.0f, ty = 0.0f;
-                if (idx.texcoord_index != -1) {
-                    tx = attrib.texcoords[2 * idx.texcoord_index + 0];
-                    ty = attrib.texcoords[2 * idx.texcoord_index + 1];
-                }
-                uvs.push_back(Vector2(tx, ty));
-            }
-            if (!has_normal) {
-                Vector3 *a = &vertices[vertices.size()] - 3;
-                Vector3 generated_normal = cross(a[1] - a[0], a[2] - a[0]);
+    if (!filepath.empty()) {
+        // The binary cache of the OBJ file, "" for none
+        const std::string cache_path = config.get("mesh_cache", true) ?
+                                       config.get("mesh_cache_file", filepath + ".tcmesh") : std::string("");
+        load_from_file(filepath, cache_path, config.get("num_threads", 0));
+    }
+}
+
+void Mesh::load_from_file(const std::string &file_path, const std::string &cache_path, int num_threads) {
+    IndexedMesh mesh;
+    if (cache_path.empty()) {
+        load_obj(file_path, mesh, num_threads);
+    } else {
+        load_obj_cached(file_path, cache_path, mesh, num_threads);
+    }
+    const int num_triangles = mesh.get_num_triangles();
+    vertices.resize(num_triangles * 3);
+    normals.resize(num_triangles * 3);
+    uvs.resize(num_triangles * 3);
+    untransformed_triangles.resize(num_triangles);
+    ThreadedTaskManager::run([&](int t) {
+        const int i = t * 3;
+        bool has_normal = true;
+        for (int v = 0; v < 3; v++) {
+            const Vector3i &corner = mesh.corners[i + v];
+            vertices[i + v] = mesh.positions[corner[0]];
+            has_normal = has_normal && corner[1] != -1;
+            uvs[i + v] = corner[2] != -1 ? mesh.uvs[corner[2]] : Vector2(0.0f);
+        }
+        for (int v = 0; v < 3; v++) {
+            if (has_normal) {
+                normals[i + v] = mesh.normals[mesh.corners[i + v][1]];
+            } else {
+                Vector3 generated_normal = cross(vertices[i + 1] - vertices[i], vertices[i + 2] - vertices[i]);
                 if (length(generated_normal) > 1e-6f) {
                     generated_normal = normalize(generated_normal);
                 }
-                for (size_t v = 0; v < fv; v++) {
-                    normals.push_back(generated_normal);
-                }
+                normals[i + v] = generated_normal;
+            }
+        }
+        untransformed_triangles[t] = Triangle(vertices[i], vertices[i + 1], vertices[i + 2],
+            normals[i], normals[i + 1], normals[i + 2],
+            uvs[i], uvs[i + 1], uvs[i + 2], t);
+    }, 0, num_triangles, num_threads > 0 ? num_threads : std::max(1, (int)std::thread::hardware_concurrency()),
+       1024);
+}
+
+struct Vector3Hash {
+    uint64 operator()(const Vector3 &v) const {
+        uint64 hash = 0;
+        for (int i = 0; i < 3; i++) {
+            // + 0.0f, for -0.0f and 0.0f, which are equal, to hash the same
+            const float x = v[i] + 0.0f;
+            unsigned int bits;
+            std::memcpy(&bits, &x, sizeof(bits));
+            hash = hash * 0x9e3779b97f4a7c15ull ^ bits;
+        }
+        return hash;
+    }
+};
+
+void Mesh::get_indexed_geometry(std::vector<Vector3> &vertices, std::vector<int> &indices) const {
+    vertices.clear();
+    indices.clear();
+    std::unordered_map<Vector3, int, Vector3Hash> vertex_ids;
+    for (auto &t : untransformed_triangles) {
+        for (int k = 0; k < 3; k++) {
+            auto inserted = vertex_ids.insert(std::make_pair(t.v[k], (int)vertices.size()));
+            if (inserted.second) {
+                vertices.push_back(t.v[k]);
             }
-            untransformed_triangles.push_back(Triangle(vertices[i], vertices[j], vertices[k],
-                normals[i], normals[j], normals[k],
-                uvs[i], uvs[j], uvs[k], i / 3));
-            index_offset += fv;
+            indices.push_back(inserted.first->second);
         }
     }
 }
@@ -103,11 +115,80 @@ void Mesh::set_material(std::shared_ptr<SurfaceMaterial> material) {
     }
 }
 
+// Spheres are parametrized by longitude (u) and colatitude (v), with the shading frame along them
+static IntersectionInfo get_sphere_intersection_info(const Vector4 &sphere, SurfaceMaterial *material, Ray &ray) {
+    IntersectionInfo inter;
+    inter.intersected = true;
+    const Vector3 center(sphere.x, sphere.y, sphere.z);
+    const real radius = sphere.w;
+    // Projected back onto the sphere, for the distance along the ray is only so accurate
+    const Vector3 normal = normalized(ray.orig + ray.dist * ray.dir - center);
+    inter.pos = center + radius * normal;
+    const Vector3 to_orig = ray.orig - center;
+    inter.front = dot(to_orig, to_orig) > radius * radius;
+    const real sin_theta = std::sqrt(normal.x * normal.x + normal.z * normal.z);
+    inter.uv = Vector2((std::atan2(normal.z, normal.x) + pi) / (2 * pi),
+                       std::acos(clamp(normal.y, -1.0f, 1.0f)) / pi);
+    inter.tri_coord = Vector2(0.0f);
+    inter.normal = inter.geometry_normal = inter.front ? normal : -normal;
+    inter.material = material;
+    inter.dist = ray.dist;
+    // Along the longitude, or any tangent at the poles
+    Vector3 u = sin_theta > 1e-4f ? Vector3(-normal.z, 0.0f, normal.x) / sin_theta
+                                  : normalized(cross(Vector3(1.0f, 0.0f, 0.0f), normal));
+    const Vector3 v = cross(inter.normal, u);
+    u = cross(v, inter.normal);
+    inter.to_world = Matrix3(u, v, inter.normal);
+    inter.to_local = glm::transpose(inter.to_world);
+    inter.dt_du = Vector2(1.0f / (2 * pi * radius * std::max(sin_theta, 1e-4f)), 0.0f);
+    inter.dt_dv = Vector2(0.0f, 1.0f / (pi * radius));
+    inter.cone_width = ray.cone_width + ray.cone_spread * ray.dist;
+    inter.uv_footprint = inter.cone_width * std::sqrt(std::abs(inter.dt_du.x * inter.dt_dv.y) /
+                                                      std::max(1e-3f, std::abs(dot(ray.dir, inter.normal))));
+    return inter;
+}
+
+// Level sets have no parametrization: uv is 0, with the shading frame around the normal of the gradient
+static IntersectionInfo get_level_set_intersection_info(const LevelSetSurface &surface, SurfaceMaterial *material,
+                                                       Ray &ray) {
+    IntersectionInfo inter;
+    inter.intersected = true;
+    inter.pos = ray.orig + ray.dist * ray.dir;
+    const Vector3 normal = surface.get_normal(inter.pos);
+    inter.front = dot(ray.dir, normal) < 0;
+    inter.uv = Vector2(0.0f);
+    inter.tri_coord = Vector2(0.0f);
+    inter.normal = inter.geometry_normal = inter.front ? normal : -normal;
+    inter.material = material;
+    inter.dist = ray.dist;
+    Vector3 u = std::abs(inter.normal.x) < 0.9f ? Vector3(1.0f, 0.0f, 0.0f) : Vector3(0.0f, 1.0f, 0.0f);
+    const Vector3 v = normalized(cross(inter.normal, u));
+    u = cross(v, inter.normal);
+    inter.to_world = Matrix3(u, v, inter.normal);
+    inter.to_local = glm::transpose(inter.to_world);
+    inter.dt_du = inter.dt_dv = Vector2(0.0f);
+    inter.cone_width = ray.cone_width + ray.cone_spread * ray.dist;
+    inter.uv_footprint = 0;
+    return inter;
+}
+
 IntersectionInfo Scene::get_intersection_info(int triangle_id, Ray &ray) {
     IntersectionInfo inter;
     if (triangle_id == -1) {
         return inter;
     }
+    if (is_level_set(triangle_id)) {
+        const LevelSetGeometry &level_set = get_level_set(triangle_id);
+        inter = get_level_set_intersection_info(*level_set.surface, level_set.material.get(), ray);
+        inter.triangle_id = triangle_id;
+        return inter;
+    }
+    if (is_particle(triangle_id)) {
+        const ParticleSet &set = get_particle_set(triangle_id);
+        inter = get_sphere_intersection_info(set.spheres[triangle_id - set.first_id], set.material.get(), ray);
+        inter.triangle_id = triangle_id;
+        return inter;
+    }
     inter.intersected = true;
     Triangle &t = triangles[triangle_id];
     real coord_u = ray.u, coord_v = ray.v;
@@ -121,8 +202,8 @@ IntersectionInfo Scene::get_intersection_info(int triangle_id, Ray &ray) {
     inter.uv = uv;
     inter.geometry_normal = inter.front ? t.normal : -t.normal;
     inter.normal = inter.front ? normal : -normal;
-    Mesh *mesh = triangle_id_to_mesh[t.id];
     inter.triangle_id = triangle_id;
+    inter.material_id = triangle_material_ids[triangle_id];
     inter.dist = ray.dist;
     // inter.material = mesh->material.get();
     Vector3 u = normalized(t.v[1] - t.v[0]);
@@ -134,6 +215,11 @@ IntersectionInfo Scene::get_intersection_info(int triangle_id, Ray &ray) {
     u = normalized(cross(v, inter.normal));
     inter.to_world = Matrix3(u, v, inter.normal);
     inter.to_local = glm::transpose(inter.to_world);
+    // The cone covers cone_width^2 / |cos| of the surface, which maps to |det(duv)| times that in uv space
+    inter.cone_width = ray.cone_width + ray.cone_spread * ray.dist;
+    const real duv_det = inter.dt_du.x * inter.dt_dv.y - inter.dt_du.y * inter.dt_dv.x;
+    inter.uv_footprint = inter.cone_width *
+                         std::sqrt(std::abs(duv_det) / std::max(1e-3f, std::abs(dot(ray.dir, inter.normal))));
     return inter;
 }
 
@@ -141,27 +227,208 @@ void Scene::add_mesh(std::shared_ptr<Mesh> mesh) {
     meshes.push_back(*mesh);
 }
 
+void Scene::add_particles(const std::vector<RenderParticle> &particles, real radius,
+                          std::shared_ptr<SurfaceMaterial> material) {
+    assert_info(radius > 0, "Particles need a positive radius");
+    assert_info(material != nullptr, "Particles need a material");
+    ParticleSet set;
+    set.spheres.resize(particles.size());
+    const int num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    parallel_for(0, (int)particles.size(), num_threads, [&](int i) {
+        const Vector3 &p = particles[i].position;
+        set.spheres[i] = Vector4(p.x, p.y, p.z, radius);
+    }, 1 << 16);
+    set.material = material;
+    // Numbered by finalize_geometry(), once the triangles are
+    set.first_id = -1;
+    particle_sets.push_back(std::move(set));
+}
+
+void Scene::add_level_set(const LevelSet3D &level_set, const Matrix4 &transform,
+                          std::shared_ptr<SurfaceMaterial> material) {
+    assert_info(material != nullptr, "Level sets need a material");
+    // Numbered by finalize_geometry(), after the particles
+    level_sets.push_back(LevelSetGeometry{std::make_shared<LevelSetSurface>(level_set, transform), material, -1});
+}
+
+void Scene::add_level_set(const SparseLevelSet3D &level_set, const Matrix4 &transform,
+                          std::shared_ptr<SurfaceMaterial> material) {
+    assert_info(material != nullptr, "Level sets need a material");
+    level_sets.push_back(LevelSetGeometry{std::make_shared<LevelSetSurface>(level_set, transform), material, -1});
+}
+
+static bool same_geometry(const Mesh &a, const Mesh &b) {
+    if (a.untransformed_triangles.size() != b.untransformed_triangles.size()) {
+        return false;
+    }
+    for (int i = 0; i < (int)a.untransformed_triangles.size(); i++) {
+        for (int k = 0; k < 3; k++) {
+            if (a.untransformed_triangles[i].v[k] != b.untransformed_triangles[i].v[k]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 void Scene::finalize_geometry() {
+    clear_geometry_cache();
     int triangle_count = 0;
+    // Meshes of every shape, by a hash of the untransformed geometry, to find the meshes sharing one
+    std::unordered_map<uint64, std::vector<std::pair<int, const Mesh *>>> shapes_by_hash;
+    material_table.clear();
+    triangle_mesh_ids.clear();
+    triangle_emissions.clear();
+    triangle_material_ids.clear();
+    std::size_t total = triangles.size();
     for (auto &mesh : meshes) {
-        triangle_id_start[&mesh] = triangle_count;
-        auto sub = mesh.get_triangles();
-        for (int i = 0; i < (int)sub.size(); i++) {
-            sub[i].id = triangle_count + i;
+        total += mesh.untransformed_triangles.size();
+    }
+    triangles.reserve(total);
+    triangle_mesh_ids.reserve(total);
+    triangle_emissions.reserve(total);
+    triangle_material_ids.reserve(total);
+    const int num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    std::vector<uint64> hashes(meshes.size());
+    ThreadedTaskManager::run([&](int m) {
+        uint64 hash = meshes[m].untransformed_triangles.size();
+        for (auto &t : meshes[m].untransformed_triangles) {
+            for (int k = 0; k < 3; k++) {
+                hash = hash * 1000003ull ^ Vector3Hash()(t.v[k]);
+            }
         }
-        triangle_count += (int)sub.size();
-        triangles.insert(triangles.end(), sub.begin(), sub.end());
-        if (mesh.emission > 0) {
-            emissive_triangles.insert(emissive_triangles.end(), sub.begin(), sub.end());
+        hashes[m] = hash;
+    }, 0, (int)meshes.size(), num_threads, 1);
+    // Shape of each mesh; new shapes are indexed in parallel, by the first of their meshes
+    std::vector<int> mesh_shapes(meshes.size());
+    std::vector<int> new_shape_meshes;
+    for (int m = 0; m < (int)meshes.size(); m++) {
+        int shape = -1;
+        // Meshes that may change have shapes of their own
+        for (auto &candidate : shapes_by_hash[hashes[m]]) {
+            if (same_geometry(*candidate.second, meshes[m])) {
+                shape = candidate.first;
+                break;
+            }
+        }
+        if (shape == -1) {
+            shape = (int)(shapes.size() + new_shape_meshes.size());
+            new_shape_meshes.push_back(m);
+            if (meshes[m].geometry_mode == GeometryMode::fixed) {
+                shapes_by_hash[hashes[m]].push_back(std::make_pair(shape, &meshes[m]));
+            }
         }
-        for (auto &tri : sub) {
-            triangle_id_to_mesh[tri.id] = &mesh;
+        mesh_shapes[m] = shape;
+    }
+    const int first_new_shape = (int)shapes.size();
+    shapes.resize(shapes.size() + new_shape_meshes.size());
+    ThreadedTaskManager::run([&](int i) {
+        Shape &shape = shapes[first_new_shape + i];
+        meshes[new_shape_meshes[i]].get_indexed_geometry(shape.vertices, shape.indices);
+    }, 0, (int)new_shape_meshes.size(), num_threads, 1);
+    for (int m = 0; m < (int)meshes.size(); m++) {
+        Mesh &mesh = meshes[m];
+        const int shape = mesh_shapes[m];
+        instances.push_back(Instance{shape, mesh.transform, triangle_count, mesh.geometry_mode});
+        // Transformed in place, with the normal transform computed once per mesh
+        const int count = (int)mesh.untransformed_triangles.size();
+        const Matrix4 normal_transform = glm::transpose(glm::inverse(mesh.transform));
+        triangles.resize(triangle_count + count);
+        ThreadedTaskManager::run([&](int i) {
+            Triangle &t = triangles[triangle_count + i];
+            t = mesh.untransformed_triangles[i].get_transformed(mesh.transform, normal_transform);
+            t.id = triangle_count + i;
+        }, 0, count, num_threads, 4096);
+        if (mesh.emission > 0) {
+            emissive_triangles.insert(emissive_triangles.end(), triangles.begin() + triangle_count, triangles.end());
         }
+        triangle_count += count;
+        triangle_mesh_ids.insert(triangle_mesh_ids.end(), count, m);
+        triangle_emissions.insert(triangle_emissions.end(), count, mesh.emission);
+        triangle_material_ids.insert(triangle_material_ids.end(), count,
+                                     mesh.material ? material_table.add(mesh.material.get()) : -1);
     }
     num_triangles = triangle_count;
+    mesh_revisions.assign(meshes.size(), 0);
+    int particle_count = 0;
+    for (auto &set : particle_sets) {
+        set.first_id = num_triangles + particle_count;
+        particle_count += (int)set.spheres.size();
+    }
+    for (int i = 0; i < (int)level_sets.size(); i++) {
+        level_sets[i].id = num_triangles + particle_count + i;
+    }
     printf("Scene loaded. Triangle count: %d\n", triangle_count);
+    if (particle_count > 0) {
+        printf("Particle count: %d\n", particle_count);
+    }
+    if (!level_sets.empty()) {
+        printf("Level set count: %d\n", (int)level_sets.size());
+    }
 };
 
+void Scene::set_mesh_transform(int mesh, const Matrix4 &transform) {
+    assert_info(0 <= mesh && mesh < (int)meshes.size(), "Unknown mesh");
+    meshes[mesh].transform = transform;
+    instances[mesh].transform = transform;
+    update_mesh(mesh);
+}
+
+void Scene::set_mesh_triangles(int mesh, const std::vector<Triangle> &untransformed_triangles) {
+    assert_info(0 <= mesh && mesh < (int)meshes.size(), "Unknown mesh");
+    assert_info(untransformed_triangles.size() == meshes[mesh].untransformed_triangles.size(),
+                "Mesh triangle count changed");
+    meshes[mesh].untransformed_triangles = untransformed_triangles;
+    update_mesh(mesh);
+}
+
+void Scene::get_instance_vertices(int mesh, std::vector<Vector3> &vertices) const {
+    const Shape &shape = shapes[instances[mesh].shape];
+    const std::vector<Triangle> &mesh_triangles = meshes[mesh].untransformed_triangles;
+    vertices.resize(shape.vertices.size());
+    for (int i = 0; i < (int)mesh_triangles.size(); i++) {
+        for (int k = 0; k < 3; k++) {
+            vertices[shape.indices[i * 3 + k]] = mesh_triangles[i].v[k];
+        }
+    }
+}
+
+void Scene::update_mesh(int mesh) {
+    Mesh &m = meshes[mesh];
+    assert_info(m.geometry_mode != GeometryMode::fixed, "Static meshes can not be changed");
+    const int first = instances[mesh].first_triangle_id;
+    const Matrix4 normal_transform = glm::transpose(glm::inverse(m.transform));
+    for (int i = 0; i < (int)m.untransformed_triangles.size(); i++) {
+        triangles[first + i] = m.untransformed_triangles[i].get_transformed(m.transform, normal_transform);
+        triangles[first + i].id = first + i;
+    }
+    if (m.emission > 0) {
+        emissive_triangles.clear();
+        for (auto &tri : triangles) {
+            if (triangle_emissions[tri.id] > 0) {
+                emissive_triangles.push_back(tri);
+            }
+        }
+        finalize_lighting();
+    }
+    mesh_revisions[mesh]++;
+}
+
+std::shared_ptr<SceneGeometry> Scene::get_geometry(const std::string &ray_intersection_name) {
+    // Held while building, so that renderers set up at once wait for one build
+    std::lock_guard<std::mutex> lock(geometry_cache.mutex);
+    std::shared_ptr<SceneGeometry> &geometry = geometry_cache.geometries[ray_intersection_name];
+    if (geometry == nullptr) {
+        geometry = std::make_shared<SceneGeometry>(this, create_instance<RayIntersection>(ray_intersection_name));
+    }
+    return geometry;
+}
+
+void Scene::clear_geometry_cache() {
+    std::lock_guard<std::mutex> lock(geometry_cache.mutex);
+    geometry_cache.geometries.clear();
+}
+
 void Scene::finalize_lighting() {
     if (!emissive_triangles.empty()) {
         update_emission_cdf();
@@ -12,17 +12,26 @@
 #include <taichi/geometry/primitives.h>
 #include <taichi/visual/camera.h>
 #include <taichi/visual/surface_material.h>
+#include <taichi/visual/compiled_material.h>
 #include <taichi/visual/envmap.h>
 #include <taichi/visual/volume_material.h>
 #include <taichi/physics/physics_constants.h>
 #include <taichi/physics/spectrum.h>
 #include <taichi/math/discrete_sampler.h>
+#include <taichi/visual/light_bvh.h>
+#include <taichi/visual/level_set_surface.h>
+#include <taichi/visualization/particle_visualization.h>
+#include <taichi/system/threading.h>
 
-#include <map>
 #include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
 
 TC_NAMESPACE_BEGIN
 
+class SceneGeometry;
+
 struct Photon {
     Vector3 pos, dir;
     real energy;
@@ -36,7 +45,8 @@ public:
 
     void initialize(const Config &config);
     void set_material(std::shared_ptr<SurfaceMaterial> material);
-    void load_from_file(const std::string &file_path);
+    // Loads an OBJ file, through the binary cache at cache_path unless it is empty. num_threads = 0 for all cores
+    void load_from_file(const std::string &file_path, const std::string &cache_path = "", int num_threads = 0);
     std::vector<Triangle> untransformed_triangles;
     void set_untransformed_triangles(const std::vector<Triangle> &triangles) {
         untransformed_triangles = triangles;
@@ -61,6 +71,10 @@ public:
         }
         return bb;
     }
+    // The untransformed triangles, with equal vertex positions shared: triangle i is
+    // vertices[indices[3i]], vertices[indices[3i + 1]], vertices[indices[3i + 2]]
+    void get_indexed_geometry(std::vector<Vector3> &vertices, std::vector<int> &indices) const;
+
     std::vector<Triangle> get_triangles() {
         std::vector<Triangle> triangles;
         for (auto t : untransformed_triangles) {
@@ -108,6 +122,8 @@ public:
     real initial_temperature;
     std::vector<Face> faces;
     Matrix4 transform;
+    // Meshes that are not fixed may be changed after Scene::finalize(), with Scene::set_mesh_*()
+    GeometryMode geometry_mode = GeometryMode::fixed;
     real emission;
     Vector3 color;
     bool const_temp;
@@ -130,14 +146,48 @@ struct IntersectionInfo {
     Vector2 tri_coord;
     Vector3 pos, normal, geometry_normal;
     SurfaceMaterial *material = nullptr;
+    // In the scene's material table; -1 with material given
+    int material_id = -1;
     Matrix3 to_local;
     Matrix3 to_world;
     real dist;
     int triangle_id;
+    // Of the ray cone at pos, and the width of its footprint in uv space
+    real cone_width = 0;
+    real uv_footprint = 0;
 };
 
 class Scene {
 public:
+    // Geometry of meshes, shared by all meshes with identical untransformed triangles
+    struct Shape {
+        std::vector<Vector3> vertices;
+        std::vector<int> indices;
+    };
+
+    // A mesh, as a transformed shape
+    struct Instance {
+        int shape;
+        Matrix4 transform;
+        int first_triangle_id;
+        GeometryMode mode;
+    };
+
+    // Particles rendered directly as spheres of one material, with ids following those of the triangles
+    struct ParticleSet {
+        // Center and radius
+        std::vector<Vector4> spheres;
+        std::shared_ptr<SurfaceMaterial> material;
+        int first_id;
+    };
+
+    // The surface of a level set, with one id following those of the particles
+    struct LevelSetGeometry {
+        std::shared_ptr<LevelSetSurface> surface;
+        std::shared_ptr<SurfaceMaterial> material;
+        int id;
+    };
+
     Scene() {
         this->envmap_sample_prob = 0.0f;
     }
@@ -161,23 +211,85 @@ public:
 
     void add_mesh(std::shared_ptr<Mesh> mesh);
 
+    // E.g. the render particles of a simulation, as spheres of radius; their colors are not used, so particles
+    // of different looks go in sets of their own. Static, and not supported by the "bvh" ray intersection.
+    void add_particles(const std::vector<RenderParticle> &particles, real radius,
+                       std::shared_ptr<SurfaceMaterial> material);
+
+    // The zero isosurface of a level set, e.g. of a liquid or an MPM material, placed by transform from the
+    // space of the simulation, and ray marched instead of meshed (see LevelSetSurface). Static, and not
+    // supported by the "bvh" ray intersection.
+    void add_level_set(const LevelSet3D &level_set, const Matrix4 &transform,
+                       std::shared_ptr<SurfaceMaterial> material);
+
+    // The same, of a narrow band level set, which is kept as such
+    void add_level_set(const SparseLevelSet3D &level_set, const Matrix4 &transform,
+                       std::shared_ptr<SurfaceMaterial> material);
+
+    bool is_particle(int id) const {
+        return id >= num_triangles && !is_level_set(id);
+    }
+
+    bool is_level_set(int id) const {
+        return !level_sets.empty() && id >= level_sets[0].id;
+    }
+
+    const LevelSetGeometry &get_level_set(int id) const {
+        return level_sets[id - level_sets[0].id];
+    }
+
+    // The set of a particle id
+    const ParticleSet &get_particle_set(int id) const {
+        int i = (int)particle_sets.size() - 1;
+        while (particle_sets[i].first_id > id) {
+            i--;
+        }
+        return particle_sets[i];
+    }
+
     void finalize_geometry();
 
     void finalize_lighting();
 
     void finalize();
 
+    // Moves a deformable or dynamic mesh (by its index in meshes) after finalize()
+    void set_mesh_transform(int mesh, const Matrix4 &transform);
+
+    // Deforms a deformable or dynamic mesh: as many untransformed triangles as before, with the same
+    // vertices shared
+    void set_mesh_triangles(int mesh, const std::vector<Triangle> &untransformed_triangles);
+
+    // Vertices of the shape of an instance, as of the current triangles of its mesh
+    void get_instance_vertices(int mesh, std::vector<Vector3> &vertices) const;
+
+    // Of each mesh, counting its changes after finalize(), for SceneGeometry::update()
+    std::vector<int> mesh_revisions;
+
+    // The geometry of the scene as traced by the ray intersection of that name, built once and shared by the
+    // renderers of the scene until its geometry is finalized again. Changes to meshes are passed on by
+    // SceneGeometry::update() instead.
+    std::shared_ptr<SceneGeometry> get_geometry(const std::string &ray_intersection_name);
+
+    // Releases the geometries kept for get_geometry(); those still in use are kept by their renderers
+    void clear_geometry_cache();
+
+    // Emissions of triangles, and the sums, in parallel; sums are reduced in a fixed order for reproducible
+    // sampling
     void update_light_emission_cdf() {
-        light_total_emission = 0;
-        light_total_area = 0;
-        std::vector<real> emissions;
-        for (auto tri : emissive_triangles) {
-            real e = tri.area * get_mesh_from_triangle_id(tri.id)->emission;
-            light_total_emission += e;
-            light_total_area += tri.area;
-            emissions.push_back(e);
-        }
-        light_emission_sampler.initialize(emissions);
+        const int num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+        const int n = (int)emissive_triangles.size();
+        std::vector<real> emissions(n);
+        parallel_for(0, n, num_threads, [&](int i) {
+            emissions[i] = emissive_triangles[i].area * get_triangle_emission(emissive_triangles[i].id);
+        }, 4096);
+        auto sum = [](real a, real b) { return a + b; };
+        light_total_emission = parallel_reduce(0, n, num_threads, real(0), [&](int i) { return emissions[i]; },
+                                               sum, true);
+        light_total_area = parallel_reduce(0, n, num_threads, real(0),
+                                           [&](int i) { return emissive_triangles[i].area; }, sum, true);
+        light_emission_sampler.initialize(emissions, true, true, num_threads);
+        light_bvh.initialize(emissive_triangles, emissions);
     }
 
     real get_average_emission() const {
@@ -185,21 +297,15 @@ public:
     }
 
     void update_emission_cdf() {
-        emission_cdf.clear();
-        total_emission = 0;
-        for (auto tri : triangles) {
-            real e = tri.area * pow(tri.temperature, 4.0f);
-            emission_cdf.push_back(e);
-            total_emission += e;
-        }
-        real inv_tot = 1.0f / total_emission;
-        for (int i = 0; i < (int)emission_cdf.size() - 1; i++) {
-            emission_cdf[i + 1] += emission_cdf[i];
-        }
-        emission_cdf.push_back(1);
-        for (auto &e : emission_cdf) {
-            e *= inv_tot;
-        }
+        const int num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+        const int n = (int)triangles.size();
+        std::vector<real> emissions(n);
+        parallel_for(0, n, num_threads, [&](int i) {
+            emissions[i] = triangles[i].area * pow(triangles[i].temperature, 4.0f);
+        }, 4096);
+        total_emission = parallel_reduce(0, n, num_threads, real(0), [&](int i) { return emissions[i]; },
+                                         [](real a, real b) { return a + b; }, true);
+        emission_sampler.initialize(emissions, true, true, num_threads);
     }
 
     std::vector<Triangle> &get_triangles() {
@@ -210,6 +316,7 @@ public:
         return triangles[id];
     }
 
+    // Of a triangle or, with an id past them, a particle
     IntersectionInfo get_intersection_info(int triangle_id, Ray &ray);
 
     const Triangle &sample_triangle_light_emission(real r, real &pdf) const {
@@ -236,7 +343,29 @@ public:
 
     real get_triangle_pdf(int id) const {
         return (1 - envmap_sample_prob) * triangles[id].area *
-            get_mesh_from_triangle_id(id)->emission / light_total_emission;
+            get_triangle_emission(id) / light_total_emission;
+    }
+
+    // As above, with triangles chosen by their estimated contribution at pos from the light BVH.
+    // Both triangle and envmap are null if no light emits toward pos
+    void sample_light_source(const Vector3 &pos, real r, real &pdf, const Triangle *&triangle,
+        const EnvironmentMap *&envmap) const {
+        if (r < envmap_sample_prob) {
+            triangle = nullptr;
+            envmap = this->envmap.get();
+            pdf = envmap_sample_prob;
+        }
+        else {
+            real scale = 1 - envmap_sample_prob;
+            int light = light_bvh.sample(pos, (r - envmap_sample_prob) / scale, pdf);
+            triangle = light == -1 ? nullptr : &emissive_triangles[light];
+            envmap = nullptr;
+            pdf *= scale;
+        }
+    }
+
+    real get_triangle_pdf(const Vector3 &pos, int id) const {
+        return (1 - envmap_sample_prob) * light_bvh.get_pdf(pos, id);
     }
 
     real get_environment_map_pdf() const {
@@ -244,10 +373,9 @@ public:
     }
 
     void sample_photon(Photon &p, real r, real delta_t, real weight) {
-        int tid = std::min(int(std::lower_bound(emission_cdf.begin(), emission_cdf.end(), r) - emission_cdf.begin()),
-            (int)triangles.size() - 1);
+        int tid = emission_sampler.sample(r);
         Triangle &t = triangles[tid];
-        Mesh *mesh = triangle_id_to_mesh[tid];
+        const Mesh *mesh = get_mesh_from_triangle_id(tid);
         weight = t.area / total_triangle_area;
         p.dir = random_diffuse(t.normal);
         p.pos = t.sample_point();
@@ -261,7 +389,7 @@ public:
     void recieve_photon(int triangle_id, real energy) {
         int tid = triangle_id;
         Triangle &t = triangles[tid];
-        Mesh *mesh = triangle_id_to_mesh[tid];
+        const Mesh *mesh = get_mesh_from_triangle_id(tid);
         if (!mesh->const_temp)
             t.temperature += energy / t.heat_capacity;
     }
@@ -271,10 +399,10 @@ public:
         return 0.0f;
         /*
         real cooef[3]{ 1 - u - v, u, v };
-        Mesh *mesh = triangle_id_to_mesh[triangle_id];
+        const Mesh *mesh = get_mesh_from_triangle_id(triangle_id);
         real temp = 0;
         for (int i = 0; i < 3; i++) {
-            int vertice_index = mesh->faces[triangle_id - triangle_id_start[mesh]].vert_ind[i];
+            int vertice_index = mesh->faces[triangle_id - get_first_triangle_id(triangle_id)].vert_ind[i];
             temp += mesh->temperature[vertice_index] * cooef[i];
         }
         return temp;
@@ -283,41 +411,80 @@ public:
 
     Vector3 get_coord(int triangle_id, real u, real v) const {
         real cooef[3]{ 1 - u - v, u, v };
-        Mesh *mesh = triangle_id_to_mesh.find(triangle_id)->second;
+        const Mesh *mesh = get_mesh_from_triangle_id(triangle_id);
         Vector3 temp(0);
         for (int i = 0; i < 3; i++) {
-            int vertice_index = mesh->faces[triangle_id - triangle_id_start.find(mesh)->second].vert_ind[i];
+            int vertice_index = mesh->faces[triangle_id - get_first_triangle_id(triangle_id)].vert_ind[i];
             temp += mesh->vertices[vertice_index] * cooef[i];
         }
         return temp;
     }
 
-    Mesh *get_mesh_from_triangle_id(int triangle_id) const {
-        return triangle_id_to_mesh.find(triangle_id)->second;
+    const Mesh *get_mesh_from_triangle_id(int triangle_id) const {
+        return &meshes[triangle_mesh_ids[triangle_id]];
+    }
+
+    // Of the mesh of the triangle
+    int get_first_triangle_id(int triangle_id) const {
+        return instances[triangle_mesh_ids[triangle_id]].first_triangle_id;
     }
 
+    // 0 for particles and level sets
     real get_triangle_emission(int triangle_id) const {
-        return get_mesh_from_triangle_id(triangle_id)->emission;
+        return triangle_id >= num_triangles ? 0.0f : triangle_emissions[triangle_id];
     }
 
     DiscreteSampler light_emission_sampler;
+    LightBVH light_bvh;
     std::shared_ptr<Camera> camera;
     std::vector<Triangle> triangles;
     std::vector<Triangle> emissive_triangles;
-    std::vector<real> emission_cdf;
+    DiscreteSampler emission_sampler;
     real total_emission;
     real light_total_emission;
     real light_total_area;
     std::vector<Mesh> meshes;
-    std::map<int, Mesh *> triangle_id_to_mesh;
-    std::map<Mesh *, int> triangle_id_start;
+    std::vector<Shape> shapes;
+    std::vector<Instance> instances;
+    std::vector<ParticleSet> particle_sets;
+    std::vector<LevelSetGeometry> level_sets;
     int num_triangles;
+    // Per triangle, by triangle id, for hits to be resolved without searching: the index of its mesh in meshes
+    // (and instances), the emission of that mesh, and the id of its material in material_table
+    std::vector<int> triangle_mesh_ids;
+    std::vector<real> triangle_emissions;
+    MaterialTable material_table;
+    std::vector<int> triangle_material_ids;
+
+    // Retransforms the triangles of a changed mesh
+    void update_mesh(int mesh);
+
     real sub_divide_limit;
     real total_triangle_area;
     int resolution_x, resolution_y;
     std::shared_ptr<VolumeMaterial> atmosphere_material;
     std::shared_ptr<EnvironmentMap> envmap;
     real envmap_sample_prob;
+
+private:
+    // Not copied with the scene, whose copies build their own
+    struct GeometryCache {
+        std::mutex mutex;
+        std::map<std::string, std::shared_ptr<SceneGeometry>> geometries;
+
+        GeometryCache() {
+        }
+
+        GeometryCache(const GeometryCache &) {
+        }
+
+        GeometryCache &operator=(const GeometryCache &) {
+            geometries.clear();
+            return *this;
+        }
+    };
+
+    GeometryCache geometry_cache;
 };
 
 TC_NAMESPACE_END
@@ -11,18 +11,40 @@
 
 #include "ray_intersection.h"
 #include "scene.h"
+#include <taichi/system/render_statistics.h>
+#include <mutex>
 
 TC_NAMESPACE_BEGIN
 
-// Generates Intersection Information for scene using ray_intersection
+// Generates Intersection Information for scene using ray_intersection. Those of renderers come from
+// Scene::get_geometry(), which shares one between all renderers of a scene.
 class SceneGeometry {
 public:
-    SceneGeometry(std::shared_ptr<Scene> scene, std::shared_ptr<RayIntersection> ray_intersection) {
+    SceneGeometry(std::shared_ptr<Scene> scene, std::shared_ptr<RayIntersection> ray_intersection)
+            : SceneGeometry(scene.get(), ray_intersection) {
+        scene_owner = scene;
+    }
+
+    // Of a scene that outlives it, e.g. one that keeps it
+    SceneGeometry(Scene *scene, std::shared_ptr<RayIntersection> ray_intersection) {
         this->scene = scene;
         this->ray_intersection = ray_intersection;
-        for (auto &tri : scene->get_triangles()) {
-            ray_intersection->add_triangle(tri);
+        // Meshes sharing geometry are instances of one shape, with their triangle ids those of the scene
+        std::vector<int> shape_ids;
+        for (auto &shape : scene->shapes) {
+            shape_ids.push_back(ray_intersection->add_shape(shape.vertices, shape.indices));
+        }
+        for (auto &instance : scene->instances) {
+            instance_ids.push_back(ray_intersection->add_instance(shape_ids[instance.shape], instance.transform,
+                                                                  instance.first_triangle_id, instance.mode));
         }
+        for (auto &set : scene->particle_sets) {
+            ray_intersection->add_spheres(set.spheres, set.first_id);
+        }
+        for (auto &level_set : scene->level_sets) {
+            ray_intersection->add_level_set(level_set.surface, level_set.id);
+        }
+        mesh_revisions = scene->mesh_revisions;
         rebuild();
     }
 
@@ -30,7 +52,38 @@ public:
         ray_intersection->build();
     }
 
+    // Passes the changes to the scene's meshes since the last update on, updating only their geometry. Nothing
+    // may trace rays through it meanwhile, which includes other renderers sharing it.
+    void update() {
+        std::lock_guard<std::mutex> lock(update_mutex);
+        std::vector<Vector3> vertices;
+        bool modified = false;
+        for (int mesh = 0; mesh < (int)mesh_revisions.size(); mesh++) {
+            if (mesh_revisions[mesh] == scene->mesh_revisions[mesh]) {
+                continue;
+            }
+            scene->get_instance_vertices(mesh, vertices);
+            ray_intersection->set_instance_transform(instance_ids[mesh], scene->instances[mesh].transform);
+            ray_intersection->set_instance_vertices(instance_ids[mesh], vertices);
+            mesh_revisions[mesh] = scene->mesh_revisions[mesh];
+            modified = true;
+        }
+        if (modified) {
+            ray_intersection->update();
+        }
+    }
+
+    std::shared_ptr<RayIntersection> get_ray_intersection() const {
+        return ray_intersection;
+    }
+
+    // Rays traced through every SceneGeometry so far, see RenderCounters
+    static int64 get_num_rays() {
+        return RenderCounters::get_statistics().get_rays();
+    }
+
     int query_hit_triangle_id(Ray &ray) {
+        RenderCounters::add(RenderCounter::closest_hit_rays);
         ray_intersection->query(ray);
         return ray.triangle_id;
     }
@@ -40,14 +93,50 @@ public:
         return scene->get_intersection_info(tri_id, ray);
     }
 
-    IntersectionInfo occlude(Ray &ray) {
-        int tri_id = query_hit_triangle_id(ray);
-        return scene->get_intersection_info(tri_id, ray);
+    // query() for a batch of n rays, traced together
+    void query(Ray *rays, int n, IntersectionInfo *infos) {
+        RenderCounters::add(RenderCounter::closest_hit_rays, n);
+        ray_intersection->query(rays, n);
+        for (int i = 0; i < n; i++) {
+            infos[i] = scene->get_intersection_info(rays[i].triangle_id, rays[i]);
+        }
+    }
+
+    void occlude(Ray *rays, int n, bool *occluded) {
+        RenderCounters::add(RenderCounter::shadow_rays, n);
+        ray_intersection->occlude(rays, n, occluded);
+    }
+
+    // Whether anything is hit closer than ray.dist. Cheaper than query(), for visibility tests.
+    bool occlude(Ray &ray) {
+        RenderCounters::add(RenderCounter::shadow_rays);
+        return ray_intersection->occlude(ray);
+    }
+
+    // Whether the segment from a to b, shortened by (relative) epsilon at b, is unobstructed
+    bool visible(const Vector3 &a, const Vector3 &b, real epsilon = 1e-4f) {
+        Ray ray = get_visibility_ray(a, b, epsilon);
+        return !occlude(ray);
+    }
+
+    // The ray visible(a, b, epsilon) tests, for batches of such tests through occlude()
+    static Ray get_visibility_ray(const Vector3 &a, const Vector3 &b, real epsilon = 1e-4f) {
+        const real dist = length(b - a);
+        Ray ray(a, (b - a) / dist);
+        ray.dist = dist * (1 - epsilon);
+        return ray;
     }
 
 private:
-    std::shared_ptr<Scene> scene;
+    Scene *scene;
+    // Unless the scene keeps it
+    std::shared_ptr<Scene> scene_owner;
     std::shared_ptr<RayIntersection> ray_intersection;
+    // Of every scene instance
+    std::vector<int> instance_ids;
+    // Of the scene's meshes, as of the last update
+    std::vector<int> mesh_revisions;
+    std::mutex update_mutex;
 };
 
 TC_NAMESPACE_END
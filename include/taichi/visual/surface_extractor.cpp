@@ -0,0 +1,318 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include "surface_extractor.h"
+#include <taichi/system/threading.h>
+#include <algorithm>
+#if !defined(TC_DISABLE_SSE)
+#include <immintrin.h>
+#endif
+
+TC_NAMESPACE_BEGIN
+
+namespace {
+
+// Corner c of a cell is at (c & 1, (c >> 1) & 1, c >> 2). Edge e runs along axis a = e / 4 from the corner at 0
+// along a whose coordinates along (a + 1) % 3 and (a + 2) % 3 are the bits of e % 4.
+int get_edge_corner(int e) {
+    const int a = e / 4, u = (a + 1) % 3, v = (a + 2) % 3;
+    return ((e & 1) << u) | (((e >> 1) & 1) << v);
+}
+
+int get_edge(int c0, int c1) {
+    const int a = c0 ^ c1;
+    const int axis = a == 1 ? 0 : (a == 2 ? 1 : 2);
+    const int c = std::min(c0, c1), u = (axis + 1) % 3, v = (axis + 2) % 3;
+    return axis * 4 + ((c >> u) & 1) + ((c >> v) & 1) * 2;
+}
+
+// For each of the 256 sets of inside corners, the triangles of the surface by their cell edges, ending at -1
+struct MarchingCubesTable {
+    static constexpr int max_triangles = 5;
+    signed char triangles[256][max_triangles * 3 + 1];
+
+    // The surface within each face of the cell is a set of segments from where its boundary, walked
+    // counterclockwise from outside the cell, enters the inside to where it next leaves it. Every crossed edge
+    // is entered through on one of its faces and left through on the other, so the segments chain into loops,
+    // which are fanned into triangles.
+    MarchingCubesTable() {
+        StartupProfile::Scope _("table", "marching_cubes");
+        int faces[6][4];
+        for (int a = 0; a < 3; a++) {
+            const int u = (a + 1) % 3, v = (a + 2) % 3;
+            const int square[4][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
+            for (int s = 0; s < 2; s++) {
+                for (int m = 0; m < 4; m++) {
+                    // Counterclockwise about +a on the upper face, and about -a on the lower one
+                    const int *p = square[s ? m : (4 - m) % 4];
+                    faces[a * 2 + s][m] = (s << a) | (p[0] << u) | (p[1] << v);
+                }
+            }
+        }
+        bool flip = false;
+        for (int pass = 0; pass < 2; pass++) {
+            for (int config = 0; config < 256; config++) {
+                int next[12];
+                std::fill(next, next + 12, -1);
+                for (auto &face : faces) {
+                    for (int m = 0; m < 4; m++) {
+                        const int a = face[m], b = face[(m + 1) % 4];
+                        if (((config >> a) & 1) || !((config >> b) & 1)) {
+                            continue;
+                        }
+                        for (int n = 1; n < 4; n++) {
+                            const int c = face[(m + n) % 4], d = face[(m + n + 1) % 4];
+                            if (((config >> c) & 1) && !((config >> d) & 1)) {
+                                next[get_edge(a, b)] = get_edge(c, d);
+                                break;
+                            }
+                        }
+                    }
+                }
+                int n = 0;
+                for (int start = 0; start < 12; start++) {
+                    if (next[start] < 0) {
+                        continue;
+                    }
+                    int loop[12], length = 0;
+                    int e = start;
+                    do {
+                        loop[length++] = e;
+                        const int following = next[e];
+                        next[e] = -1;
+                        e = following;
+                        assert_info(e >= 0, "Open marching cubes loop");
+                    } while (e != start);
+                    for (int i = 1; i + 1 < length; i++) {
+                        assert_info(n < max_triangles * 3, "Marching cubes case with too many triangles");
+                        triangles[config][n++] = (signed char)loop[0];
+                        triangles[config][n++] = (signed char)loop[flip ? i + 1 : i];
+                        triangles[config][n++] = (signed char)loop[flip ? i : i + 1];
+                    }
+                }
+                triangles[config][n] = -1;
+            }
+            // Triangles face outside if the one cutting off corner 0 faces away from it
+            Vector3 p[3];
+            for (int k = 0; k < 3; k++) {
+                const int e = triangles[1][k], c = get_edge_corner(e);
+                p[k] = Vector3(real(c & 1), real((c >> 1) & 1), real(c >> 2));
+                p[k][e / 4] = 0.5f;
+            }
+            if (dot(cross(p[1] - p[0], p[2] - p[0]), Vector3(1.0f)) > 0) {
+                break;
+            }
+            flip = true;
+        }
+    }
+};
+
+const MarchingCubesTable &get_marching_cubes_table() {
+    static MarchingCubesTable table;
+    return table;
+}
+
+// The vertices on the grid edges (node, node + unit along axis) of the nodes of one tile
+struct TileVertices {
+    // By (i * tile_size + j) * tile_size + k) * 3 + axis, of the nodes relative to the tile; -1 without vertex
+    std::vector<int> local;
+    std::vector<Vector3> vertices, normals;
+    int offset = 0;
+};
+
+}
+
+SurfaceExtractor::SurfaceExtractor(Vector3 lower, real dx, int num_threads)
+        : lower(lower), dx(dx), num_threads(num_threads) {
+}
+
+void SurfaceExtractor::extract(const Array3D<real> &phi, real isovalue, std::vector<Vector3> &vertices,
+                               std::vector<Vector3> &normals, std::vector<int> &indices) const {
+    const MarchingCubesTable &table = get_marching_cubes_table();
+    const int width = phi.get_width(), height = phi.get_height(), depth = phi.get_depth();
+    const Vector3i num_tiles((width + tile_size - 1) / tile_size, (height + tile_size - 1) / tile_size,
+                             (depth + tile_size - 1) / tile_size);
+    const int total_tiles = num_tiles.x * num_tiles.y * num_tiles.z;
+    const Vector3 storage_offset = phi.get_storage_offset();
+    const real *data = &phi.get_data()[0];
+    auto get_tile = [&](int i, int j, int k) {
+        return ((i / tile_size) * num_tiles.y + j / tile_size) * num_tiles.z + k / tile_size;
+    };
+    auto get_phi = [&](int i, int j, int k) {
+        return data[phi.get_storage_index(i, j, k)];
+    };
+    // Central differences, one-sided at the boundary
+    auto get_gradient = [&](int i, int j, int k) {
+        const int p[3] = {i, j, k}, res[3] = {width, height, depth};
+        Vector3 gradient;
+        for (int a = 0; a < 3; a++) {
+            int lo[3] = {i, j, k}, hi[3] = {i, j, k};
+            lo[a] = std::max(p[a] - 1, 0);
+            hi[a] = std::min(p[a] + 1, res[a] - 1);
+            gradient[a] = hi[a] == lo[a] ? 0.0f : (get_phi(hi[0], hi[1], hi[2]) - get_phi(lo[0], lo[1], lo[2])) /
+                                                          real(hi[a] - lo[a]);
+        }
+        return gradient;
+    };
+
+    std::vector<TileVertices> tiles(total_tiles);
+    parallel_for(0, total_tiles, num_threads, [&](int t) {
+        TileVertices &tile = tiles[t];
+        const Vector3i base = Vector3i(t / (num_tiles.y * num_tiles.z), (t / num_tiles.z) % num_tiles.y,
+                                       t % num_tiles.z) * tile_size;
+        const Vector3i end(std::min(width, base.x + tile_size), std::min(height, base.y + tile_size),
+                           std::min(depth, base.z + tile_size));
+        for (int i = base.x; i < end.x; i++) {
+            for (int j = base.y; j < end.y; j++) {
+                for (int k = base.z; k < end.z; k++) {
+                    const real phi_a = get_phi(i, j, k);
+                    for (int a = 0; a < 3; a++) {
+                        const Vector3i n(i + (a == 0), j + (a == 1), k + (a == 2));
+                        if (n.x >= width || n.y >= height || n.z >= depth) {
+                            continue;
+                        }
+                        const real phi_b = get_phi(n.x, n.y, n.z);
+                        if ((phi_a < isovalue) == (phi_b < isovalue)) {
+                            continue;
+                        }
+                        if (tile.local.empty()) {
+                            tile.local.resize(tile_size * tile_size * tile_size * 3, -1);
+                        }
+                        const real f = clamp((isovalue - phi_a) / (phi_b - phi_a), 0.0f, 1.0f);
+                        Vector3 pos = Vector3(real(i), real(j), real(k)) + storage_offset;
+                        pos[a] += f;
+                        const Vector3 gradient = lerp(f, get_gradient(i, j, k), get_gradient(n.x, n.y, n.z));
+                        Vector3 normal(0.0f);
+                        if (length(gradient) < 1e-10f) {
+                            normal[a] = phi_b > phi_a ? 1.0f : -1.0f;
+                        } else {
+                            normal = normalize(gradient);
+                        }
+                        tile.local[(((i - base.x) * tile_size + j - base.y) * tile_size + k - base.z) * 3 + a] =
+                                (int)tile.vertices.size();
+                        tile.vertices.push_back(lower + dx * pos);
+                        tile.normals.push_back(normal);
+                    }
+                }
+            }
+        }
+    }, 1);
+    int num_vertices = 0;
+    for (auto &tile : tiles) {
+        tile.offset = num_vertices;
+        num_vertices += (int)tile.vertices.size();
+    }
+    vertices.resize(num_vertices);
+    normals.resize(num_vertices);
+    parallel_for(0, total_tiles, num_threads, [&](int t) {
+        std::copy(tiles[t].vertices.begin(), tiles[t].vertices.end(), vertices.begin() + tiles[t].offset);
+        std::copy(tiles[t].normals.begin(), tiles[t].normals.end(), normals.begin() + tiles[t].offset);
+    }, 16);
+
+    // Cells by their lower nodes, in the tiles of those
+    std::vector<std::vector<int>> tile_indices(total_tiles);
+    parallel_for(0, total_tiles, num_threads, [&](int t) {
+        const Vector3i base = Vector3i(t / (num_tiles.y * num_tiles.z), (t / num_tiles.z) % num_tiles.y,
+                                       t % num_tiles.z) * tile_size;
+        const Vector3i end(std::min(width, base.x + tile_size + 1), std::min(height, base.y + tile_size + 1),
+                           std::min(depth, base.z + tile_size + 1));
+        const Vector3i extent = end - base;
+        if (extent.x < 2 || extent.y < 2 || extent.z < 2) {
+            return;
+        }
+        // Of the nodes of the tile's cells, 1 if inside, by (i * (tile_size + 1) + j) * (tile_size + 1) + k
+        const int stride = tile_size + 1;
+        unsigned char inside[stride * stride * stride];
+        int num_inside = 0;
+        for (int i = 0; i < extent.x; i++) {
+            for (int j = 0; j < extent.y; j++) {
+                const real *row = data + phi.get_storage_index(base.x + i, base.y + j, base.z);
+                unsigned char *out = inside + (i * stride + j) * stride;
+                int k = 0;
+#if !defined(TC_DISABLE_SSE)
+                const __m128 iso = _mm_set1_ps(isovalue);
+                for (; k + 4 <= extent.z; k += 4) {
+                    const int mask = _mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(row + k), iso));
+                    out[k] = (unsigned char)(mask & 1);
+                    out[k + 1] = (unsigned char)((mask >> 1) & 1);
+                    out[k + 2] = (unsigned char)((mask >> 2) & 1);
+                    out[k + 3] = (unsigned char)(mask >> 3);
+                    num_inside += __builtin_popcount(mask);
+                }
+#endif
+                for (; k < extent.z; k++) {
+                    out[k] = (unsigned char)(row[k] < isovalue);
+                    num_inside += out[k];
+                }
+            }
+        }
+        if (num_inside == 0 || num_inside == extent.x * extent.y * extent.z) {
+            return;
+        }
+        std::vector<int> &out = tile_indices[t];
+        for (int i = 0; i < extent.x - 1; i++) {
+            for (int j = 0; j < extent.y - 1; j++) {
+                for (int k = 0; k < extent.z - 1; k++) {
+                    int config = 0;
+                    for (int c = 0; c < 8; c++) {
+                        config |= inside[((i + (c & 1)) * stride + j + ((c >> 1) & 1)) * stride + k + (c >> 2)]
+                                  << c;
+                    }
+                    if (config == 0 || config == 255) {
+                        continue;
+                    }
+                    const signed char *edges = table.triangles[config];
+                    for (int n = 0; edges[n] >= 0; n += 3) {
+                        int ids[3];
+                        for (int v = 0; v < 3; v++) {
+                            const int e = edges[n + v], c = get_edge_corner(e);
+                            const int x = base.x + i + (c & 1), y = base.y + j + ((c >> 1) & 1),
+                                    z = base.z + k + (c >> 2);
+                            const TileVertices &owner = tiles[get_tile(x, y, z)];
+                            const int local = owner.local[(((x % tile_size) * tile_size + y % tile_size) *
+                                                           tile_size + z % tile_size) * 3 + e / 4];
+                            ids[v] = owner.offset + local;
+                        }
+                        const Vector3 area = cross(vertices[ids[1]] - vertices[ids[0]],
+                                                   vertices[ids[2]] - vertices[ids[0]]);
+                        if (area == Vector3(0.0f)) {
+                            continue;
+                        }
+                        out.insert(out.end(), ids, ids + 3);
+                    }
+                }
+            }
+        }
+    }, 1);
+    int num_indices = 0;
+    std::vector<int> index_offsets(total_tiles);
+    for (int t = 0; t < total_tiles; t++) {
+        index_offsets[t] = num_indices;
+        num_indices += (int)tile_indices[t].size();
+    }
+    indices.resize(num_indices);
+    parallel_for(0, total_tiles, num_threads, [&](int t) {
+        std::copy(tile_indices[t].begin(), tile_indices[t].end(), indices.begin() + index_offsets[t]);
+    }, 16);
+}
+
+std::vector<Triangle> SurfaceExtractor::extract_triangles(const Array3D<real> &phi, real isovalue) const {
+    std::vector<Vector3> vertices, normals;
+    std::vector<int> indices;
+    extract(phi, isovalue, vertices, normals, indices);
+    std::vector<Triangle> triangles(indices.size() / 3);
+    parallel_for(0, (int)triangles.size(), num_threads, [&](int i) {
+        const int *v = &indices[i * 3];
+        triangles[i] = Triangle(vertices[v[0]], vertices[v[1]], vertices[v[2]], normals[v[0]], normals[v[1]],
+                                normals[v[2]], Vector2(0.0f), Vector2(0.0f), Vector2(0.0f), i);
+    }, 1024);
+    return triangles;
+}
+
+TC_NAMESPACE_END
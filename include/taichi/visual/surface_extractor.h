@@ -0,0 +1,46 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <taichi/common/meta.h>
+#include <taichi/math/linalg.h>
+#include <taichi/math/array_3d.h>
+#include <taichi/geometry/primitives.h>
+
+TC_NAMESPACE_BEGIN
+
+// Extracts isosurfaces of level sets (or any scalar grids) as triangle meshes by marching cubes, in parallel over
+// 8x8x8 tiles of cells. The inverse of the Voxelizer: node (i, j, k) is at lower + dx * ((i, j, k) + its storage
+// offset), nodes below the isovalue are inside, and triangles face outside. Faces with two diagonal inside nodes
+// always separate them, so that cells sharing a face agree and the surface is closed where it does not reach the
+// boundary of the grid.
+class SurfaceExtractor {
+public:
+    static constexpr int tile_size = 8;
+
+    SurfaceExtractor(Vector3 lower, real dx, int num_threads = 1);
+
+    // Vertices are on grid edges, shared by all triangles of the edge: triangle i is vertices[indices[3i]],
+    // vertices[indices[3i + 1]], vertices[indices[3i + 2]]. Normals are the normalized gradients of phi.
+    // Triangles of zero area are left out.
+    void extract(const Array3D<real> &phi, real isovalue, std::vector<Vector3> &vertices,
+                 std::vector<Vector3> &normals, std::vector<int> &indices) const;
+
+    // The same triangles, e.g. for Mesh::set_untransformed_triangles
+    std::vector<Triangle> extract_triangles(const Array3D<real> &phi, real isovalue) const;
+
+protected:
+    Vector3 lower;
+    real dx;
+    int num_threads;
+};
+
+TC_NAMESPACE_END
@@ -47,6 +47,10 @@ public:
     }
 };
 
+class MaterialTable;
+
+struct CompiledMaterial;
+
 class SurfaceMaterial : public Unit {
 protected:
     std::shared_ptr<VolumeMaterial> internal_material = nullptr;
@@ -101,6 +105,12 @@ public:
         return 0;
     }
 
+    // The parameters of a built-in material, flattened into compiled, with nested materials added to table.
+    // Other materials are left generic.
+    virtual bool compile(MaterialTable &table, CompiledMaterial &compiled) const {
+        return false;
+    }
+
 public:
     static Vector3 reflect(const Vector3 &in) { // Note: in and reflected are both from origin to outside
         return Vector3(-in.x, -in.y, in.z);
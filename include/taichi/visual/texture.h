@@ -12,13 +12,51 @@
 #include <taichi/math/linalg.h>
 #include <taichi/common/meta.h>
 #include <taichi/math/array_2d.h>
+#include <taichi/system/threading.h>
+#include <algorithm>
 
 TC_NAMESPACE_BEGIN
 
+class TextureGraph;
+
+// The footprint of the texture lookups of the current thread, as a width in texture coordinates, for filtered
+// lookups (0 for point lookups). BSDFs set it around material calls, from the ray cone at the shading point:
+//     TextureFootprint footprint(width);
+class TextureFootprint {
+public:
+    explicit TextureFootprint(real width) : previous(current()) {
+        current() = width;
+    }
+
+    ~TextureFootprint() {
+        current() = previous;
+    }
+
+    static real get() {
+        return current();
+    }
+
+private:
+    real previous;
+
+    static real &current() {
+        thread_local real width = 0;
+        return width;
+    }
+};
+
 class Texture : public Unit {
 public:
     virtual void initialize(const Config &config) {}
 
+    // Adds the texture to a graph, returning its node; by default a leaf evaluated by sample()
+    virtual int compile(TextureGraph &graph) const;
+
+    // Of sample(), in units of about a constant texture's (see TextureGraph)
+    virtual real get_cost() const {
+        return 8.0f;
+    }
+
     virtual Vector4 sample(const Vector2 &coord) const { return sample(Vector3(coord.x, coord.y, 0.5f)); }
 
     virtual Vector4 sample(const Vector3 &coord) const {
@@ -26,6 +64,18 @@ public:
         return Vector4(0.0f);
     }
 
+    // sample() of count coordinates, for textures that evaluate several lookups faster together
+    virtual void sample_n(const Vector3 *coords, int count, Vector4 *values) const {
+        for (int i = 0; i < count; i++) {
+            values[i] = sample(coords[i]);
+        }
+    }
+
+    // Whether the texture is the same everywhere, and its value if so
+    virtual bool get_constant(Vector4 &value) const {
+        return false;
+    }
+
     Vector3 sample3(const Vector2 &coord) const {
         Vector4 tmp = sample(coord);
         return Vector3(tmp.x, tmp.y, tmp.z);
@@ -36,12 +86,36 @@ public:
         return Vector3(tmp.x, tmp.y, tmp.z);
     }
 
-    Array2D<Vector4> rasterize(Vector2i res) const {
+    // Samples the centers of the cells of a grid of res cells over [0, 1]^3, with store(i, j, k, value) for each,
+    // through sample_n of up to 256 cells of an x-slice at a time, in parallel over x-slices. Grids with res.z = 1
+    // are sampled at z = 0.5, as sample(Vector2) does.
+    template <typename F>
+    void rasterize(const Vector3i &res, int num_threads, const F &store) const {
+        const int slice = res.y * res.z;
+        const Vector3 inv_res = Vector3(1.0f) / Vector3(res);
+        parallel_for(0, res.x, num_threads, [&](int i) {
+            const int batch = 256;
+            Vector3 coords[batch];
+            Vector4 values[batch];
+            for (int begin = 0; begin < slice; begin += batch) {
+                const int count = std::min(batch, slice - begin);
+                for (int m = 0; m < count; m++) {
+                    const int j = (begin + m) / res.z, k = (begin + m) % res.z;
+                    coords[m] = Vector3(i + 0.5f, j + 0.5f, k + 0.5f) * inv_res;
+                }
+                sample_n(coords, count, values);
+                for (int m = 0; m < count; m++) {
+                    store(i, (begin + m) / res.z, (begin + m) % res.z, values[m]);
+                }
+            }
+        }, 1);
+    }
+
+    Array2D<Vector4> rasterize(Vector2i res, int num_threads = 1) const {
         Array2D<Vector4> image(res);
-        Vector2 inv_res(1.0 / res[0], 1.0 / res[1]);
-        for (auto &ind : image.get_region()) {
-            image[ind] = sample(ind.get_pos() * inv_res);
-        }
+        rasterize(Vector3i(res.x, res.y, 1), num_threads, [&](int i, int j, int k, const Vector4 &value) {
+            image[i][j] = value;
+        });
         return image;
     }
 
@@ -49,13 +123,11 @@ public:
         return rasterize(Vector2i(width, height));
     }
 
-    Array2D<Vector3> rasterize3(Vector2i res) const {
+    Array2D<Vector3> rasterize3(Vector2i res, int num_threads = 1) const {
         Array2D<Vector3> image(res);
-        Vector2 inv_res(1.0 / res[0], 1.0 / res[1]);
-        for (auto &ind : image.get_region()) {
-            Vector4 color = sample(ind.get_pos() * inv_res);
-            image[ind] = Vector3(color.x, color.y, color.z);
-        }
+        rasterize(Vector3i(res.x, res.y, 1), num_threads, [&](int i, int j, int k, const Vector4 &value) {
+            image[i][j] = Vector3(value.x, value.y, value.z);
+        });
         return image;
     }
 
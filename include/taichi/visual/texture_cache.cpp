@@ -0,0 +1,304 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/visual/texture_cache.h>
+#include <taichi/math/array_2d.h>
+#include <taichi/system/memory.h>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+TC_NAMESPACE_BEGIN
+
+// The tile file: this header, then the tiles of every level, finest first, row by row, with texels row by row
+struct TileFileHeader {
+    static constexpr unsigned int current_magic = 0x54435431; // "TCT1"
+
+    unsigned int magic;
+    int tile_size;
+    int width, height;
+    int64 source_mtime;
+};
+
+static std::vector<TiledImage::Level> get_levels(int width, int height) {
+    std::vector<TiledImage::Level> levels;
+    int first_tile = 0;
+    while (true) {
+        TiledImage::Level level;
+        level.width = width;
+        level.height = height;
+        level.tiles_x = (width + TiledImage::tile_size - 1) / TiledImage::tile_size;
+        level.tiles_y = (height + TiledImage::tile_size - 1) / TiledImage::tile_size;
+        level.first_tile = first_tile;
+        first_tile += level.tiles_x * level.tiles_y;
+        levels.push_back(level);
+        if (width == 1 && height == 1) {
+            break;
+        }
+        width = std::max(1, (width + 1) / 2);
+        height = std::max(1, (height + 1) / 2);
+    }
+    return levels;
+}
+
+// A level half the resolution of image, by a 2x2 box filter
+static Array2D<Vector4> downsample(const Array2D<Vector4> &image) {
+    const int width = image.get_width(), height = image.get_height();
+    Array2D<Vector4> result(std::max(1, (width + 1) / 2), std::max(1, (height + 1) / 2));
+    for (int i = 0; i < result.get_width(); i++) {
+        for (int j = 0; j < result.get_height(); j++) {
+            const int i0 = std::min(2 * i, width - 1), i1 = std::min(2 * i + 1, width - 1);
+            const int j0 = std::min(2 * j, height - 1), j1 = std::min(2 * j + 1, height - 1);
+            result[i][j] = 0.25f * (image[i0][j0] + image[i1][j0] + image[i0][j1] + image[i1][j1]);
+        }
+    }
+    return result;
+}
+
+static void write_tile_file(const std::string &filename, const std::string &tile_filename, int64 mtime) {
+    Array2D<Vector4> image;
+    image.load(filename);
+    TileFileHeader header;
+    header.magic = TileFileHeader::current_magic;
+    header.tile_size = TiledImage::tile_size;
+    header.width = image.get_width();
+    header.height = image.get_height();
+    header.source_mtime = mtime;
+    // Written aside and renamed, so that a tile file is never seen half written
+    const std::string temp_filename = tile_filename + ".tmp" + std::to_string(getpid());
+    FILE *f = fopen(temp_filename.c_str(), "wb");
+    assert_info(f != nullptr, "Can not write tile file: " + temp_filename);
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    std::vector<Vector4> tile(TiledImage::tile_texels);
+    for (auto &level : get_levels(header.width, header.height)) {
+        if (level.width != image.get_width() || level.height != image.get_height()) {
+            image = downsample(image);
+        }
+        for (int ty = 0; ty < level.tiles_y; ty++) {
+            for (int tx = 0; tx < level.tiles_x; tx++) {
+                for (int j = 0; j < TiledImage::tile_size; j++) {
+                    for (int i = 0; i < TiledImage::tile_size; i++) {
+                        const int x = std::min(tx * TiledImage::tile_size + i, level.width - 1);
+                        const int y = std::min(ty * TiledImage::tile_size + j, level.height - 1);
+                        tile[j * TiledImage::tile_size + i] = image[x][y];
+                    }
+                }
+                ok = ok && fwrite(&tile[0], sizeof(Vector4), tile.size(), f) == tile.size();
+            }
+        }
+    }
+    ok = fclose(f) == 0 && ok;
+    assert_info(ok, "Failed writing tile file: " + temp_filename);
+    assert_info(std::rename(temp_filename.c_str(), tile_filename.c_str()) == 0,
+                "Can not rename tile file to " + tile_filename);
+}
+
+static bool read_header(int fd, TileFileHeader &header) {
+    return pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+           header.magic == TileFileHeader::current_magic && header.tile_size == TiledImage::tile_size;
+}
+
+std::shared_ptr<TiledImage> TiledImage::open(const std::string &filename, const std::string &tile_filename_) {
+    const std::string tile_filename = tile_filename_.empty() ? filename + ".tiles" : tile_filename_;
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::weak_ptr<TiledImage>> opened;
+    std::lock_guard<std::mutex> lock(mutex);
+    std::shared_ptr<TiledImage> image = opened[tile_filename].lock();
+    if (image) {
+        return image;
+    }
+    struct stat source;
+    assert_info(stat(filename.c_str(), &source) == 0, "Image file not found: " + filename);
+    const int64 mtime = (int64)source.st_mtime;
+    TileFileHeader header;
+    int fd = ::open(tile_filename.c_str(), O_RDONLY);
+    if (fd == -1 || !read_header(fd, header) || header.source_mtime != mtime) {
+        if (fd != -1) {
+            close(fd);
+        }
+        write_tile_file(filename, tile_filename, mtime);
+        fd = ::open(tile_filename.c_str(), O_RDONLY);
+        assert_info(fd != -1 && read_header(fd, header), "Can not read tile file: " + tile_filename);
+    }
+    image = std::shared_ptr<TiledImage>(new TiledImage());
+    image->tile_filename = tile_filename;
+    image->fd = fd;
+    image->levels = get_levels(header.width, header.height);
+    const Level &coarsest = image->levels.back();
+    image->num_tiles = coarsest.first_tile + coarsest.tiles_x * coarsest.tiles_y;
+    image->slots.reset(new std::atomic<int>[image->num_tiles]);
+    for (int i = 0; i < image->num_tiles; i++) {
+        image->slots[i].store(-1, std::memory_order_relaxed);
+    }
+    TextureCache::get_instance().register_image(image.get());
+    opened[tile_filename] = image;
+    return image;
+}
+
+TiledImage::~TiledImage() {
+    TextureCache::get_instance().unregister_image(this);
+    close(fd);
+}
+
+void TiledImage::read_tile(int tile, Vector4 *data) const {
+    const int64 size = TextureCache::tile_bytes;
+    const int64 offset = (int64)sizeof(TileFileHeader) + tile * size;
+    int64 read = 0;
+    while (read < size) {
+        const ssize_t r = pread(fd, (char *)data + read, size - read, offset + read);
+        assert_info(r > 0, "Failed reading tile " + std::to_string(tile) + " from " + tile_filename);
+        read += r;
+    }
+}
+
+Vector4 TiledImage::fetch(int level, int i, int j) const {
+    const Level &l = levels[level];
+    i = clamp(i, 0, l.width - 1);
+    j = clamp(j, 0, l.height - 1);
+    const int tile = l.first_tile + j / tile_size * l.tiles_x + i / tile_size;
+    return TextureCache::get_instance().fetch(*this, tile, j % tile_size * tile_size + i % tile_size);
+}
+
+Vector4 TiledImage::sample(int level, const Vector2 &coord) const {
+    const Level &l = levels[level];
+    // Texel centers are at half integers
+    const real x = clamp(coord.x * l.width - 0.5f, 0.0f, l.width - 1.0f - eps);
+    const real y = clamp(coord.y * l.height - 0.5f, 0.0f, l.height - 1.0f - eps);
+    const int x_i = (int)x, y_i = (int)y;
+    const real x_r = x - x_i, y_r = y - y_i;
+    return lerp(x_r, lerp(y_r, fetch(level, x_i, y_i), fetch(level, x_i, y_i + 1)),
+                lerp(y_r, fetch(level, x_i + 1, y_i), fetch(level, x_i + 1, y_i + 1)));
+}
+
+Vector4 TiledImage::sample(const Vector2 &coord, real footprint) const {
+    const real texels = footprint * std::max(levels[0].width, levels[0].height);
+    const real level = texels > 1 ? std::min(std::log2(texels), get_num_levels() - 1.0f) : 0.0f;
+    const int lower = (int)level;
+    const real t = level - lower;
+    if (t == 0) {
+        return sample(lower, coord);
+    }
+    return lerp(t, sample(lower, coord), sample(lower + 1, coord));
+}
+
+static int get_texture_cache_tag() {
+    static const int tag = MemoryAccounting::get_tag("texture_cache");
+    return tag;
+}
+
+void TextureCache::set_budget(int64 bytes) {
+    assert_info(bytes >= tile_bytes, "Texture cache budget should hold at least a tile");
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &image : images) {
+        for (int i = 0; i < image.second->num_tiles; i++) {
+            image.second->slots[i].store(-1, std::memory_order_relaxed);
+        }
+    }
+    capacity = (int)std::min(bytes / tile_bytes, (int64)std::numeric_limits<int>::max());
+    MemoryAccounting::add(get_texture_cache_tag(), -(int64)num_slots * (int64)sizeof(Slot));
+    slots.clear();
+    slots.resize(capacity);
+    num_slots = 0;
+    hand = 0;
+    num_hits = 0;
+    num_misses = 0;
+}
+
+bool TextureCache::try_fetch(const TiledImage &image, int tile, int texel, Vector4 &value) {
+    const int s = image.slots[tile].load(std::memory_order_acquire);
+    if (s == -1) {
+        return false;
+    }
+    Slot &slot = *slots[s];
+    const unsigned int version = slot.version.load(std::memory_order_acquire);
+    if ((version & 1) || slot.key.load(std::memory_order_relaxed) != get_key(image, tile)) {
+        return false;
+    }
+    value = slot.data[texel];
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.version.load(std::memory_order_relaxed) != version) {
+        return false;
+    }
+    if (!slot.referenced.load(std::memory_order_relaxed)) {
+        slot.referenced.store(true, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+Vector4 TextureCache::fetch(const TiledImage &image, int tile, int texel) {
+    Vector4 value;
+    if (try_fetch(image, tile, texel, value)) {
+        num_hits.fetch_add(1, std::memory_order_relaxed);
+        return value;
+    }
+    num_misses.fetch_add(1, std::memory_order_relaxed);
+    thread_local std::vector<Vector4> buffer(TiledImage::tile_texels);
+    image.read_tile(tile, &buffer[0]);
+    value = buffer[texel];
+    std::lock_guard<std::mutex> lock(mutex);
+    if (image.slots[tile].load(std::memory_order_relaxed) != -1) {
+        // Installed by another thread meanwhile
+        return value;
+    }
+    const int s = get_free_slot();
+    Slot &slot = *slots[s];
+    const unsigned int version = slot.version.load(std::memory_order_relaxed);
+    slot.version.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.key.store(get_key(image, tile), std::memory_order_relaxed);
+    std::copy(buffer.begin(), buffer.end(), slot.data);
+    slot.referenced.store(true, std::memory_order_relaxed);
+    slot.version.store(version + 2, std::memory_order_release);
+    image.slots[tile].store(s, std::memory_order_release);
+    return value;
+}
+
+int TextureCache::get_free_slot() {
+    if (num_slots < capacity) {
+        slots[num_slots].reset(new Slot());
+        MemoryAccounting::add(get_texture_cache_tag(), sizeof(Slot));
+        return num_slots++;
+    }
+    while (true) {
+        const int s = hand;
+        hand = (hand + 1) % capacity;
+        Slot &slot = *slots[s];
+        if (slot.referenced.exchange(false, std::memory_order_relaxed)) {
+            continue;
+        }
+        const uint64 key = slot.key.load(std::memory_order_relaxed);
+        if (key != empty_key) {
+            auto image = images.find((int)(key >> 32));
+            if (image != images.end()) {
+                image->second->slots[key & 0xffffffffu].store(-1, std::memory_order_relaxed);
+            }
+        }
+        return s;
+    }
+}
+
+void TextureCache::register_image(TiledImage *image) {
+    std::lock_guard<std::mutex> lock(mutex);
+    image->id = next_image_id++;
+    images[image->id] = image;
+}
+
+void TextureCache::unregister_image(TiledImage *image) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int i = 0; i < num_slots; i++) {
+        if ((int)(slots[i]->key.load(std::memory_order_relaxed) >> 32) == image->id) {
+            slots[i]->key.store(empty_key, std::memory_order_relaxed);
+            slots[i]->referenced.store(false, std::memory_order_relaxed);
+        }
+    }
+    images.erase(image->id);
+}
+
+TC_NAMESPACE_END
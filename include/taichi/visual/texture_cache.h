@@ -0,0 +1,161 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <taichi/math/linalg.h>
+
+TC_NAMESPACE_BEGIN
+
+// An image mip-mapped and cut into square tiles, stored in a tile file next to it and only read into the
+// TextureCache tile by tile, as sampled. The tile file is written the first time the image is opened (or when it is
+// older than the image), and is shared by every texture opening the same image.
+class TiledImage {
+public:
+    // Texels per side of tiles; a tile of Vector4s is 16KB
+    static constexpr int tile_size = 32;
+    static constexpr int tile_texels = tile_size * tile_size;
+
+    struct Level {
+        int width, height;
+        int tiles_x, tiles_y;
+        // Of the first tile of the level, among those of all levels
+        int first_tile;
+    };
+
+    // tile_filename defaults to filename + ".tiles"
+    static std::shared_ptr<TiledImage> open(const std::string &filename, const std::string &tile_filename = "");
+
+    ~TiledImage();
+
+    int get_num_levels() const {
+        return (int)levels.size();
+    }
+
+    const Level &get_level(int level) const {
+        return levels[level];
+    }
+
+    int get_num_tiles() const {
+        return num_tiles;
+    }
+
+    // A texel of a level, with coordinates clamped to it
+    Vector4 fetch(int level, int i, int j) const;
+
+    // Bilinear in a level, as Array2D::sample_relative_coord
+    Vector4 sample(int level, const Vector2 &coord) const;
+
+    // Trilinear between the levels where a texel is about footprint wide (in relative coordinates);
+    // the full resolution level for footprints below a texel
+    Vector4 sample(const Vector2 &coord, real footprint) const;
+
+    // Reads a tile from the tile file
+    void read_tile(int tile, Vector4 *data) const;
+
+protected:
+    friend class TextureCache;
+
+    std::string tile_filename;
+    int fd = -1;
+    // In the TextureCache
+    int id = -1;
+    std::vector<Level> levels;
+    int num_tiles = 0;
+    // The cache slot of each tile, -1 for tiles not in the cache
+    std::unique_ptr<std::atomic<int>[]> slots;
+
+    TiledImage() {}
+};
+
+// A cache of image tiles within a fixed budget of memory, shared by all TiledImages. Slots are allocated as tiles
+// are first read, up to the budget, and then reused by the CLOCK (second chance) approximation of LRU eviction.
+// Hits are lock free: slots are seqlocks, copied out and validated by their versions. Misses read the tile from
+// disk outside of any lock, and take the lock to install it.
+class TextureCache {
+public:
+    static constexpr int64 tile_bytes = TiledImage::tile_texels * (int64)sizeof(Vector4);
+
+    static TextureCache &get_instance() {
+        static TextureCache cache;
+        return cache;
+    }
+
+    // Drops all tiles; not to be called while images are sampled. The default budget is 1GB
+    void set_budget(int64 bytes);
+
+    int64 get_budget() const {
+        return (int64)capacity * tile_bytes;
+    }
+
+    // Statistics, since the last set_budget()
+    int64 get_num_hits() const {
+        return num_hits.load(std::memory_order_relaxed);
+    }
+
+    int64 get_num_misses() const {
+        return num_misses.load(std::memory_order_relaxed);
+    }
+
+    int get_num_slots() const {
+        return num_slots;
+    }
+
+    Vector4 fetch(const TiledImage &image, int tile, int texel);
+
+    void register_image(TiledImage *image);
+
+    // Frees the slots of an image
+    void unregister_image(TiledImage *image);
+
+protected:
+    struct Slot {
+        // Odd while the slot is being written
+        std::atomic<unsigned int> version;
+        // (image id << 32) | tile, or empty_key
+        std::atomic<uint64> key;
+        std::atomic<bool> referenced;
+        Vector4 data[TiledImage::tile_texels];
+
+        Slot() : version(0), key(empty_key), referenced(false) {}
+    };
+
+    static constexpr uint64 empty_key = ~(uint64)0;
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Slot>> slots;
+    int capacity = 0;
+    int num_slots = 0;
+    // Of the CLOCK
+    int hand = 0;
+    int next_image_id = 0;
+    std::unordered_map<int, TiledImage *> images;
+    std::atomic<int64> num_hits, num_misses;
+
+    TextureCache() : num_hits(0), num_misses(0) {
+        set_budget(1LL << 30);
+    }
+
+    static uint64 get_key(const TiledImage &image, int tile) {
+        return ((uint64)image.id << 32) | (uint64)tile;
+    }
+
+    bool try_fetch(const TiledImage &image, int tile, int texel, Vector4 &value);
+
+    // An empty or evicted slot, called with the mutex held
+    int get_free_slot();
+};
+
+TC_NAMESPACE_END
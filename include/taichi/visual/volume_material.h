@@ -14,6 +14,8 @@
 #include <taichi/visual/sampler.h>
 #include <taichi/geometry/primitives.h>
 
+#include <vector>
+
 TC_NAMESPACE_BEGIN
 
 enum class VolumeEvent {
@@ -90,22 +92,37 @@ protected:
 
 TC_INTERFACE(VolumeMaterial);
 
+// Volumes a path is inside of, innermost on top. The first inline_capacity volumes are kept in the stack itself,
+// so that paths, which construct one each, do not allocate unless they are nested deeper than that.
 class VolumeStack {
-    std::vector<VolumeMaterial const*> stack;
+public:
+    static const int inline_capacity = 8;
+private:
+    VolumeMaterial const *inline_stack[inline_capacity];
+    std::vector<VolumeMaterial const *> overflow;
+    int count;
 public:
     VolumeStack();
-    void push(VolumeMaterial const*vol) {
-        stack.push_back(vol);
+    void push(VolumeMaterial const *vol) {
+        if (count < inline_capacity) {
+            inline_stack[count] = vol;
+        } else {
+            overflow.push_back(vol);
+        }
+        count++;
     }
     void pop() {
-        stack.pop_back();
+        count--;
+        if (count >= inline_capacity) {
+            overflow.pop_back();
+        }
     }
-    VolumeMaterial const* top() {
-        return stack.back();
+    VolumeMaterial const *top() const {
+        return count <= inline_capacity ? inline_stack[count - 1] : overflow.back();
     }
 
     size_t size() const {
-        return stack.size();
+        return (size_t)count;
     }
 };
 
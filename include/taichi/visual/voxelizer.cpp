@@ -8,5 +8,412 @@
 *******************************************************************************/
 
 #include "voxelizer.h"
+#include <taichi/system/threading.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#if !defined(TC_DISABLE_SSE)
+#include <immintrin.h>
+#endif
+
 TC_NAMESPACE_BEGIN
+
+// A triangle prepared for squared distances to points: the closest point is on the plane if the point projects
+// inside all edges, and on the closest edge otherwise
+struct DistanceTriangle {
+    // Origins and vectors of the edges, and their inward normals in the plane
+    Vector3 o[3], e[3], m[3];
+    real inv_e2[3];
+    Vector3 n;
+    // 0 for (nearly) degenerate triangles, which only have edges
+    real inv_n2;
+
+    DistanceTriangle() {}
+
+    explicit DistanceTriangle(const Vector3 v[3]) {
+        n = cross(v[1] - v[0], v[2] - v[0]);
+        real max_e2 = 0;
+        for (int i = 0; i < 3; i++) {
+            o[i] = v[i];
+            e[i] = v[(i + 1) % 3] - v[i];
+            m[i] = cross(n, e[i]);
+            const real e2 = dot(e[i], e[i]);
+            inv_e2[i] = e2 > 0 ? 1.0f / e2 : 0.0f;
+            max_e2 = std::max(max_e2, e2);
+        }
+        // Planes of slivers are too inaccurate to use, and their edges are close enough
+        const real n2 = dot(n, n);
+        inv_n2 = n2 > 1e-8f * max_e2 * max_e2 ? 1.0f / n2 : 0.0f;
+    }
+
+    real get_distance2(const Vector3 &p) const {
+        bool inside = inv_n2 > 0;
+        real d2 = std::numeric_limits<real>::infinity();
+        for (int i = 0; i < 3; i++) {
+            const Vector3 op = p - o[i];
+            const real t = clamp(dot(op, e[i]) * inv_e2[i], 0.0f, 1.0f);
+            const Vector3 d = op - t * e[i];
+            d2 = std::min(d2, dot(d, d));
+            inside = inside && dot(op, m[i]) >= 0;
+        }
+        return inside ? sqr(dot(p - o[0], n)) * inv_n2 : d2;
+    }
+
+#if !defined(TC_DISABLE_SSE)
+    // Of the four points (x, y, z[l])
+    __m128 get_distance2(real x, real y, __m128 z) const {
+        const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+        __m128 d2 = _mm_set1_ps(std::numeric_limits<real>::infinity());
+        __m128 inside = inv_n2 > 0 ? _mm_cmpeq_ps(zero, zero) : zero;
+        for (int i = 0; i < 3; i++) {
+            const real ox = x - o[i].x, oy = y - o[i].y;
+            const __m128 oz = _mm_sub_ps(z, _mm_set1_ps(o[i].z));
+            const __m128 along =
+                    _mm_add_ps(_mm_set1_ps(ox * e[i].x + oy * e[i].y), _mm_mul_ps(oz, _mm_set1_ps(e[i].z)));
+            const __m128 t = _mm_min_ps(one, _mm_max_ps(zero, _mm_mul_ps(along, _mm_set1_ps(inv_e2[i]))));
+            const __m128 dx = _mm_sub_ps(_mm_set1_ps(ox), _mm_mul_ps(t, _mm_set1_ps(e[i].x)));
+            const __m128 dy = _mm_sub_ps(_mm_set1_ps(oy), _mm_mul_ps(t, _mm_set1_ps(e[i].y)));
+            const __m128 dz = _mm_sub_ps(oz, _mm_mul_ps(t, _mm_set1_ps(e[i].z)));
+            d2 = _mm_min_ps(d2, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+            const __m128 side = _mm_add_ps(_mm_set1_ps(ox * m[i].x + oy * m[i].y), _mm_mul_ps(oz, _mm_set1_ps(m[i].z)));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(side, zero));
+        }
+        const __m128 plane = _mm_add_ps(_mm_set1_ps((x - o[0].x) * n.x + (y - o[0].y) * n.y),
+                                        _mm_mul_ps(_mm_sub_ps(z, _mm_set1_ps(o[0].z)), _mm_set1_ps(n.z)));
+        const __m128 plane_d2 = _mm_mul_ps(_mm_mul_ps(plane, plane), _mm_set1_ps(inv_n2));
+        return _mm_or_ps(_mm_and_ps(inside, plane_d2), _mm_andnot_ps(inside, d2));
+    }
+#endif
+};
+
+// A triangle prepared for separating axis tests against cell boxes (Akenine-Moller, "Fast 3D Triangle-Box Overlap
+// Testing"). The axes of the boxes are left to the caller, which only tests boxes overlapping the triangle's
+// bounding box; the rest are the triangle's normal and the crosses of its edges with the axes of the boxes.
+struct BoxTestTriangle {
+    static constexpr int num_axes = 10;
+    Vector3 axes[num_axes];
+    // The projections of the triangle onto the axes, and of the half extents of boxes
+    real lower[num_axes], upper[num_axes], radius[num_axes];
+
+    BoxTestTriangle() {}
+
+    explicit BoxTestTriangle(const Vector3 v[3]) {
+        axes[0] = cross(v[1] - v[0], v[2] - v[0]);
+        for (int i = 0; i < 3; i++) {
+            for (int k = 0; k < 3; k++) {
+                Vector3 unit(0.0f);
+                unit[k] = 1;
+                axes[1 + i * 3 + k] = cross(v[(i + 1) % 3] - v[i], unit);
+            }
+        }
+        for (int a = 0; a < num_axes; a++) {
+            const Vector3 &axis = axes[a];
+            const real p0 = dot(v[0], axis), p1 = dot(v[1], axis), p2 = dot(v[2], axis);
+            lower[a] = std::min(std::min(p0, p1), p2);
+            upper[a] = std::max(std::max(p0, p1), p2);
+            radius[a] = 0.5f * (std::abs(axis.x) + std::abs(axis.y) + std::abs(axis.z));
+        }
+    }
+
+    // Of the unit box centered at c
+    bool overlaps(const Vector3 &c) const {
+        for (int a = 0; a < num_axes; a++) {
+            const real p = dot(c, axes[a]);
+            if (p - radius[a] > upper[a] || p + radius[a] < lower[a]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+#if !defined(TC_DISABLE_SSE)
+    // Of the four boxes centered at (x, y, z[l]), as a mask of four bits
+    int overlaps(real x, real y, __m128 z) const {
+        __m128 separated = _mm_setzero_ps();
+        for (int a = 0; a < num_axes; a++) {
+            const __m128 p =
+                    _mm_add_ps(_mm_set1_ps(x * axes[a].x + y * axes[a].y), _mm_mul_ps(z, _mm_set1_ps(axes[a].z)));
+            const __m128 r = _mm_set1_ps(radius[a]);
+            separated = _mm_or_ps(separated, _mm_cmpgt_ps(_mm_sub_ps(p, r), _mm_set1_ps(upper[a])));
+            separated = _mm_or_ps(separated, _mm_cmplt_ps(_mm_add_ps(p, r), _mm_set1_ps(lower[a])));
+        }
+        return ~_mm_movemask_ps(separated) & 15;
+    }
+#endif
+};
+
+// Orientation of (x1, y1), (x2, y2) about the origin, with ties broken consistently so that points on an edge are
+// in exactly one of the triangles sharing it (as in SDFGen)
+static int orientation(double x1, double y1, double x2, double y2, double &twice_signed_area) {
+    twice_signed_area = y1 * x2 - x1 * y2;
+    if (twice_signed_area > 0) {
+        return 1;
+    } else if (twice_signed_area < 0) {
+        return -1;
+    } else if (y2 > y1) {
+        return 1;
+    } else if (y2 < y1) {
+        return -1;
+    } else if (x1 > x2) {
+        return 1;
+    } else if (x1 < x2) {
+        return -1;
+    } else {
+        return 0;
+    }
+}
+
+// Whether (x0, y0) is in the triangle, with its barycentric coordinates a, b, c
+static bool point_in_triangle_2d(double x0, double y0, double x1, double y1, double x2, double y2, double x3,
+                                 double y3, double &a, double &b, double &c) {
+    x1 -= x0;
+    x2 -= x0;
+    x3 -= x0;
+    y1 -= y0;
+    y2 -= y0;
+    y3 -= y0;
+    const int sign_a = orientation(x2, y2, x3, y3, a);
+    if (sign_a == 0) {
+        return false;
+    }
+    if (orientation(x3, y3, x1, y1, b) != sign_a || orientation(x1, y1, x2, y2, c) != sign_a) {
+        return false;
+    }
+    const double sum = a + b + c;
+    if (sum == 0) {
+        return false;
+    }
+    a /= sum;
+    b /= sum;
+    c /= sum;
+    return true;
+}
+
+Voxelizer::Voxelizer(const std::vector<Triangle> &input, Vector3 lower, real dx, int num_threads)
+        : num_threads(num_threads) {
+    const real inv_dx = 1.0f / dx;
+    triangles.resize(input.size());
+    for (int i = 0; i < (int)input.size(); i++) {
+        GridTriangle &t = triangles[i];
+        for (int k = 0; k < 3; k++) {
+            t.v[k] = (input[i].v[k] - lower) * inv_dx;
+        }
+        t.lower = glm::min(glm::min(t.v[0], t.v[1]), t.v[2]);
+        t.upper = glm::max(glm::max(t.v[0], t.v[1]), t.v[2]);
+    }
+}
+
+// The range of cells at (i, j, k) + offset within dilation of [lower, upper], clamped to the grid.
+// False if there are none
+static bool get_cell_range(const Vector3 &lower, const Vector3 &upper, const Vector3 &dilation, const Vector3 &offset,
+                           const Vector3i &res, Vector3i &first, Vector3i &last) {
+    for (int d = 0; d < 3; d++) {
+        const real f = std::ceil(lower[d] - dilation[d] - offset[d]);
+        const real l = std::floor(upper[d] + dilation[d] - offset[d]);
+        if (f > res[d] - 1 || l < 0 || f > l) {
+            return false;
+        }
+        first[d] = (int)std::max(f, 0.0f);
+        last[d] = (int)std::min(l, res[d] - 1.0f);
+    }
+    return true;
+}
+
+Voxelizer::Bins Voxelizer::bin(const LevelSet3D &levelset, Vector3i tile_cells, Vector3 dilation) const {
+    const Vector3i res(levelset.get_width(), levelset.get_height(), levelset.get_depth());
+    const Vector3 offset = levelset.get_storage_offset();
+    Bins bins;
+    for (int d = 0; d < 3; d++) {
+        bins.num_tiles[d] = (res[d] + tile_cells[d] - 1) / tile_cells[d];
+    }
+    const int num_tiles = bins.num_tiles.x * bins.num_tiles.y * bins.num_tiles.z;
+    const int n = (int)triangles.size();
+    // Tile ranges of the triangles, empty (first > last) for those outside the grid
+    std::vector<Vector3i> first(n, Vector3i(1)), last(n, Vector3i(0));
+    std::vector<std::atomic<int>> counts(num_tiles);
+    for (auto &count : counts) {
+        count.store(0, std::memory_order_relaxed);
+    }
+    auto for_each_tile = [&](int t, const auto &body) {
+        for (int i = first[t].x; i <= last[t].x; i++) {
+            for (int j = first[t].y; j <= last[t].y; j++) {
+                for (int k = first[t].z; k <= last[t].z; k++) {
+                    body((i * bins.num_tiles.y + j) * bins.num_tiles.z + k);
+                }
+            }
+        }
+    };
+    ThreadedTaskManager::run([&](int t) {
+        Vector3i f, l;
+        if (!get_cell_range(triangles[t].lower, triangles[t].upper, dilation, offset, res, f, l)) {
+            return;
+        }
+        for (int d = 0; d < 3; d++) {
+            first[t][d] = f[d] / tile_cells[d];
+            last[t][d] = l[d] / tile_cells[d];
+        }
+        for_each_tile(t, [&](int tile) { counts[tile].fetch_add(1, std::memory_order_relaxed); });
+    }, 0, n, num_threads);
+    bins.begin.resize(num_tiles + 1);
+    bins.begin[0] = 0;
+    for (int i = 0; i < num_tiles; i++) {
+        bins.begin[i + 1] = bins.begin[i] + counts[i].load(std::memory_order_relaxed);
+        counts[i].store(bins.begin[i], std::memory_order_relaxed);
+    }
+    bins.triangles.resize(bins.begin[num_tiles]);
+    ThreadedTaskManager::run([&](int t) {
+        for_each_tile(t, [&](int tile) {
+            bins.triangles[counts[tile].fetch_add(1, std::memory_order_relaxed)] = t;
+        });
+    }, 0, n, num_threads);
+    return bins;
+}
+
+std::vector<unsigned char> Voxelizer::get_inside(const LevelSet3D &levelset) const {
+    const Vector3i res(levelset.get_width(), levelset.get_height(), levelset.get_depth());
+    const Vector3 offset = levelset.get_storage_offset();
+    // Tiles of whole columns along x, of which every triangle before a cell counts
+    const Bins bins = bin(levelset, Vector3i(res.x, tile_size, tile_size), Vector3(1e30f, 0.0f, 0.0f));
+    std::vector<unsigned char> inside((size_t)res.x * res.y * res.z, 0);
+    ThreadedTaskManager::run([&](int tile) {
+        const int ty = tile / bins.num_tiles.z, tz = tile % bins.num_tiles.z;
+        std::vector<real> crossings;
+        for (int j = ty * tile_size; j < std::min(res.y, (ty + 1) * tile_size); j++) {
+            for (int k = tz * tile_size; k < std::min(res.z, (tz + 1) * tile_size); k++) {
+                const real y = j + offset.y, z = k + offset.z;
+                crossings.clear();
+                for (int b = bins.begin[tile]; b < bins.begin[tile + 1]; b++) {
+                    const GridTriangle &t = triangles[bins.triangles[b]];
+                    double u, v, w;
+                    if (t.lower.y <= y && y <= t.upper.y && t.lower.z <= z && z <= t.upper.z &&
+                        point_in_triangle_2d(y, z, t.v[0].y, t.v[0].z, t.v[1].y, t.v[1].z, t.v[2].y, t.v[2].z, u, v,
+                                             w)) {
+                        crossings.push_back((real)(u * t.v[0].x + v * t.v[1].x + w * t.v[2].x));
+                    }
+                }
+                std::sort(crossings.begin(), crossings.end());
+                int crossed = 0;
+                for (int i = 0; i < res.x; i++) {
+                    while (crossed < (int)crossings.size() && crossings[crossed] < i + offset.x) {
+                        crossed++;
+                    }
+                    inside[((size_t)i * res.y + j) * res.z + k] = (unsigned char)(crossed & 1);
+                }
+            }
+        }
+    }, 0, bins.num_tiles.y * bins.num_tiles.z, num_threads);
+    return inside;
+}
+
+void Voxelizer::add_occupancy(LevelSet3D &levelset) const {
+    const Vector3i res(levelset.get_width(), levelset.get_height(), levelset.get_depth());
+    const Vector3 offset = levelset.get_storage_offset();
+    const std::vector<unsigned char> inside = get_inside(levelset);
+    // LevelSet3D::get() samples positions instead
+    const Array3D<real> &grid = levelset;
+    // Boxes of cells overlap bounding boxes within half a cell of their centers
+    const Bins bins = bin(levelset, Vector3i(tile_size), Vector3(0.5f));
+    std::vector<BoxTestTriangle> prepared(triangles.size());
+    ThreadedTaskManager::run([&](int t) { prepared[t] = BoxTestTriangle(triangles[t].v); }, 0, (int)triangles.size(),
+                             num_threads);
+    ThreadedTaskManager::run([&](int tile) {
+        const Vector3i tile_id(tile / (bins.num_tiles.y * bins.num_tiles.z), tile / bins.num_tiles.z % bins.num_tiles.y,
+                               tile % bins.num_tiles.z);
+        const Vector3i begin = tile_id * tile_size, end = glm::min(begin + Vector3i(tile_size), res);
+        unsigned char occupied[tile_size][tile_size][tile_size] = {};
+        for (int b = bins.begin[tile]; b < bins.begin[tile + 1]; b++) {
+            const GridTriangle &t = triangles[bins.triangles[b]];
+            const BoxTestTriangle &test = prepared[bins.triangles[b]];
+            Vector3i first, last;
+            get_cell_range(t.lower, t.upper, Vector3(0.5f), offset, res, first, last);
+            first = glm::max(first, begin);
+            last = glm::min(last, end - Vector3i(1));
+            for (int i = first.x; i <= last.x; i++) {
+                for (int j = first.y; j <= last.y; j++) {
+                    const real x = i + offset.x, y = j + offset.y;
+                    unsigned char *row = occupied[i - begin.x][j - begin.y] - begin.z;
+#if !defined(TC_DISABLE_SSE)
+                    for (int k = first.z; k <= last.z; k += 4) {
+                        const __m128 z = _mm_add_ps(_mm_set1_ps(k + offset.z), _mm_set_ps(3, 2, 1, 0));
+                        const int mask = test.overlaps(x, y, z);
+                        for (int l = 0; l < 4 && k + l <= last.z; l++) {
+                            row[k + l] |= (mask >> l) & 1;
+                        }
+                    }
+#else
+                    for (int k = first.z; k <= last.z; k++) {
+                        row[k] |= (unsigned char)test.overlaps(Vector3(x, y, k + offset.z));
+                    }
+#endif
+                }
+            }
+        }
+        for (int i = begin.x; i < end.x; i++) {
+            for (int j = begin.y; j < end.y; j++) {
+                for (int k = begin.z; k < end.z; k++) {
+                    const bool in = occupied[i - begin.x][j - begin.y][k - begin.z] ||
+                                    inside[((size_t)i * res.y + j) * res.z + k];
+                    levelset.set(i, j, k, std::min(grid.get(i, j, k), in ? -0.5f : 0.5f));
+                }
+            }
+        }
+    }, 0, bins.num_tiles.x * bins.num_tiles.y * bins.num_tiles.z, num_threads);
+}
+
+void Voxelizer::add_signed_distance(LevelSet3D &levelset, real band) const {
+    const Vector3i res(levelset.get_width(), levelset.get_height(), levelset.get_depth());
+    const Vector3 offset = levelset.get_storage_offset();
+    const std::vector<unsigned char> inside = get_inside(levelset);
+    // LevelSet3D::get() samples positions instead
+    const Array3D<real> &grid = levelset;
+    const Bins bins = bin(levelset, Vector3i(tile_size), Vector3(band));
+    std::vector<DistanceTriangle> prepared(triangles.size());
+    ThreadedTaskManager::run([&](int t) { prepared[t] = DistanceTriangle(triangles[t].v); }, 0,
+                             (int)triangles.size(), num_threads);
+    ThreadedTaskManager::run([&](int tile) {
+        const Vector3i tile_id(tile / (bins.num_tiles.y * bins.num_tiles.z), tile / bins.num_tiles.z % bins.num_tiles.y,
+                               tile % bins.num_tiles.z);
+        const Vector3i begin = tile_id * tile_size, end = glm::min(begin + Vector3i(tile_size), res);
+        real distance2[tile_size][tile_size][tile_size];
+        std::fill(&distance2[0][0][0], &distance2[0][0][0] + tile_size * tile_size * tile_size, band * band);
+        for (int b = bins.begin[tile]; b < bins.begin[tile + 1]; b++) {
+            const GridTriangle &t = triangles[bins.triangles[b]];
+            const DistanceTriangle &dt = prepared[bins.triangles[b]];
+            Vector3i first, last;
+            get_cell_range(t.lower, t.upper, Vector3(band), offset, res, first, last);
+            first = glm::max(first, begin);
+            last = glm::min(last, end - Vector3i(1));
+            for (int i = first.x; i <= last.x; i++) {
+                for (int j = first.y; j <= last.y; j++) {
+                    const real x = i + offset.x, y = j + offset.y;
+                    real *row = distance2[i - begin.x][j - begin.y] - begin.z;
+#if !defined(TC_DISABLE_SSE)
+                    for (int k = first.z; k <= last.z; k += 4) {
+                        const __m128 z = _mm_add_ps(_mm_set1_ps(k + offset.z), _mm_set_ps(3, 2, 1, 0));
+                        float d2[4];
+                        _mm_storeu_ps(d2, dt.get_distance2(x, y, z));
+                        for (int l = 0; l < 4 && k + l <= last.z; l++) {
+                            row[k + l] = std::min(row[k + l], d2[l]);
+                        }
+                    }
+#else
+                    for (int k = first.z; k <= last.z; k++) {
+                        row[k] = std::min(row[k], dt.get_distance2(Vector3(x, y, k + offset.z)));
+                    }
+#endif
+                }
+            }
+        }
+        for (int i = begin.x; i < end.x; i++) {
+            for (int j = begin.y; j < end.y; j++) {
+                for (int k = begin.z; k < end.z; k++) {
+                    const real d = std::sqrt(distance2[i - begin.x][j - begin.y][k - begin.z]);
+                    const real phi = inside[((size_t)i * res.y + j) * res.z + k] ? -d : d;
+                    levelset.set(i, j, k, std::min(grid.get(i, j, k), phi));
+                }
+            }
+        }
+    }, 0, bins.num_tiles.x * bins.num_tiles.y * bins.num_tiles.z, num_threads);
+}
+
 TC_NAMESPACE_END
@@ -9,15 +9,54 @@
 
 #pragma once
 
-#include <functional>
+#include <vector>
 #include <taichi/common/meta.h>
 #include <taichi/math/linalg.h>
+#include <taichi/math/levelset_3d.h>
+#include <taichi/geometry/primitives.h>
 
 TC_NAMESPACE_BEGIN
 
-    class Voxelizer {
-    protected:
-    public:
+// Scan-converts triangle meshes into level sets, in parallel over 8x8x8 tiles of cells, each only testing the
+// triangles binned to it. Triangles are given in world space; cell (i, j, k) of a level set is at
+// lower + dx * ((i, j, k) + its storage offset), and distances are in cells, as those of LevelSet3D::add_sphere.
+// Cells are inside if the mesh crosses the line along x through them an odd number of times before them (as in
+// Batty's SDFGen), so meshes should be closed. Results are added as unions, as LevelSet3D::add_sphere does.
+class Voxelizer {
+public:
+    static constexpr int tile_size = 8;
+
+    Voxelizer(const std::vector<Triangle> &triangles, Vector3 lower, real dx, int num_threads = 1);
+
+    // Cells inside the mesh, or whose boxes intersect it, become -0.5, and others 0.5
+    void add_occupancy(LevelSet3D &levelset) const;
+
+    // The exact signed distance to the mesh for cells within band (in cells) of it, and -band or band beyond
+    void add_signed_distance(LevelSet3D &levelset, real band) const;
+
+protected:
+    struct GridTriangle {
+        Vector3 v[3];
+        Vector3 lower, upper;
     };
 
+    // Triangles overlapping tiles, binned by tile: those of tile t are triangles[begin[t]...begin[t + 1]]
+    struct Bins {
+        Vector3i num_tiles;
+        std::vector<int> begin;
+        std::vector<int> triangles;
+    };
+
+    // In grid coordinates, where cell (i, j, k) is at (i, j, k) + storage offset
+    std::vector<GridTriangle> triangles;
+    int num_threads;
+
+    // Bins of tiles of tile_cells cells, of the triangles with cells (of the grid) within dilation (per axis) of
+    // their bounding boxes
+    Bins bin(const LevelSet3D &levelset, Vector3i tile_cells, Vector3 dilation) const;
+
+    // Of cells by (i * height + j) * depth + k, 1 for those inside the mesh
+    std::vector<unsigned char> get_inside(const LevelSet3D &levelset) const;
+};
+
 TC_NAMESPACE_END
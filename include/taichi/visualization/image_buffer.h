@@ -9,30 +9,75 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <taichi/math/linalg.h>
 #include <taichi/math/array_2d.h>
+#include <taichi/physics/physics_constants.h>
 #include <taichi/system/threading.h>
+#include <taichi/system/render_statistics.h>
+#include <taichi/io/binary_stream.h>
 #include <stb_image.h>
 #include <stb_image_write.h>
 
 TC_NAMESPACE_BEGIN
 
+// Per-pixel sums and sample counts of splats from many threads.
+// In locked mode every accumulate() takes a spinlock of its pixel. In per_thread mode every thread splats,
+// without synchronization, into tiles of its own, allocated as they are touched; get_averaged() and
+// get_total() merge them in, so they must not run concurrently with accumulate().
+// Sums of squared intensities (luminance, for colors) are kept along, for error estimates.
 template<typename T>
 class ImageAccumulator {
 public:
-    std::vector<Spinlock> locks;
+    enum class Mode {
+        locked,
+        per_thread
+    };
+
+    static Mode get_mode(const std::string &name) {
+        assert_info(name == "locked" || name == "per_thread", "Unknown image accumulation mode " + name);
+        return name == "locked" ? Mode::locked : Mode::per_thread;
+    }
+
     ImageAccumulator() {}
 
-    ImageAccumulator(int width, int height) : width(width), height(height),
-        buffer(width, height), counter(width, height)
-    {
-        for (int i = 0; i < width * height; i++) {
-            locks.push_back(Spinlock());
+    ImageAccumulator(int width, int height, Mode mode = Mode::locked) : width(width), height(height),
+        mode(mode), buffer(width, height, T(0)), counter(width, height, 0), squares(width, height, 0.0f) {
+        if (mode == Mode::locked) {
+            locks = std::vector<Spinlock>(width * height);
         }
+        tiles_x = (width + tile_size - 1) / tile_size;
+        tiles_y = (height + tile_size - 1) / tile_size;
+    }
+
+    ImageAccumulator(ImageAccumulator &&o) {
+        *this = std::move(o);
+    }
+
+    ImageAccumulator &operator=(ImageAccumulator &&o) {
+        locks = std::move(o.locks);
+        width = o.width;
+        height = o.height;
+        mode = o.mode;
+        buffer.swap(o.buffer);
+        counter.swap(o.counter);
+        squares.swap(o.squares);
+        tiles_x = o.tiles_x;
+        tiles_y = o.tiles_y;
+        id = o.id;
+        layers = std::move(o.layers);
+        // Threads still holding the layers now find them here
+        o.id = next_id();
+        return *this;
     }
 
     Array2D<T> get_averaged(T default_value = T(0)) {
+        merge_layers();
         Array2D<T> result(width, height);
         for (int i = 0; i < width; i++) {
             for (int j = 0; j < height; j++) {
@@ -48,19 +93,99 @@ public:
         return result;
     }
 
+    // The sums, regardless of sample counts
+    const Array2D<T> &get_total() {
+        merge_layers();
+        return buffer;
+    }
+
+    // Of every pixel, the standard error of its mean intensity relative to the mean, which is clamped to
+    // min_intensity from below; infinite for pixels with fewer than two samples
+    Array2D<real> get_relative_errors(real min_intensity) {
+        merge_layers();
+        Array2D<real> result(width, height);
+        for (int i = 0; i < width; i++) {
+            for (int j = 0; j < height; j++) {
+                const int n = counter[i][j];
+                if (n < 2) {
+                    result[i][j] = std::numeric_limits<real>::infinity();
+                    continue;
+                }
+                const real mean = intensity(buffer[i][j]) / n;
+                const real variance = std::max(0.0f, (squares[i][j] - n * mean * mean) / (n - 1));
+                result[i][j] = std::sqrt(variance / n) / std::max(std::abs(mean), min_intensity);
+            }
+        }
+        return result;
+    }
+
     void accumulate(int x, int y, T val) {
+        RenderCounters::add(RenderCounter::splats);
+        const real l = intensity(val);
+        if (mode == Mode::per_thread) {
+            Layer &layer = get_layer();
+            const int t = x / tile_size * tiles_y + y / tile_size;
+            if (!layer.tiles[t]) {
+                layer.tiles[t].reset(new Tile());
+            }
+            const int p = x % tile_size * tile_size + y % tile_size;
+            layer.tiles[t]->counter[p]++;
+            layer.tiles[t]->buffer[p] += val;
+            layer.tiles[t]->squares[p] += l * l;
+            return;
+        }
         int lock_id = x * height + y;
         locks[lock_id].lock();
         counter[x][y] ++;
         buffer[x][y] += val;
+        squares[x][y] += l * l;
         locks[lock_id].unlock();
     }
 
+    // The sums and counts, to be added to an accumulator elsewhere, e.g. on another node
+    void write(BinaryFileStreamOutput &os) {
+        merge_layers();
+        os << width << height;
+        for (int i = 0; i < width; i++) {
+            for (int j = 0; j < height; j++) {
+                os << buffer[i][j] << counter[i][j] << squares[i][j];
+            }
+        }
+    }
+
+    // Adds what write() wrote
+    void accumulate(BinaryFileStreamInput &is) {
+        merge_layers();
+        int w, h;
+        is >> w >> h;
+        assert_info(w == width && h == height, "Accumulated images differ in resolution");
+        for (int i = 0; i < width; i++) {
+            for (int j = 0; j < height; j++) {
+                T b;
+                int c;
+                real s;
+                is >> b >> c >> s;
+                buffer[i][j] += b;
+                counter[i][j] += c;
+                squares[i][j] += s;
+            }
+        }
+    }
+
+    void reset() {
+        merge_layers();
+        buffer = Array2D<T>(width, height, T(0));
+        counter = Array2D<int>(width, height, 0);
+        squares = Array2D<real>(width, height, 0.0f);
+    }
+
     void accumulate(ImageAccumulator<T> &other) {
+        other.merge_layers();
         for (int i = 0; i < width; i++) {
             for (int j = 0; j < height; j++) {
                 counter[i][j] += other.counter[i][j];
                 buffer[i][j] += other.buffer[i][j];
+                squares[i][j] += other.squares[i][j];
             }
         }
     }
@@ -75,9 +200,96 @@ public:
     }
 
 private:
+    static const int tile_size = 32;
+
+    struct Tile {
+        T buffer[tile_size * tile_size];
+        int counter[tile_size * tile_size];
+        real squares[tile_size * tile_size];
+
+        Tile() {
+            std::fill(buffer, buffer + tile_size * tile_size, T(0));
+            std::fill(counter, counter + tile_size * tile_size, 0);
+            std::fill(squares, squares + tile_size * tile_size, 0.0f);
+        }
+    };
+
+    // The tiles of one thread, null until touched
+    struct Layer {
+        std::thread::id thread;
+        std::vector<std::unique_ptr<Tile>> tiles;
+    };
+
+    std::vector<Spinlock> locks;
+    int width = 0, height = 0;
+    Mode mode = Mode::locked;
     Array2D<T> buffer;
     Array2D<int> counter;
-    int width, height;
+    Array2D<real> squares;
+    int tiles_x = 0, tiles_y = 0;
+    // Identifies the accumulator to the threads' caches of their layers; kept when moved
+    uint64 id = next_id();
+    std::mutex layers_lock;
+    std::vector<std::unique_ptr<Layer>> layers;
+
+    static real intensity(real v) {
+        return v;
+    }
+
+    static real intensity(const Vector3 &v) {
+        return luminance(v);
+    }
+
+    static uint64 next_id() {
+        static std::atomic<uint64> counter(1);
+        return counter++;
+    }
+
+    Layer &get_layer() {
+        // The layer of the accumulator this thread last splatted into
+        thread_local uint64 cached_id = 0;
+        thread_local Layer *cached_layer = nullptr;
+        if (cached_id != id) {
+            std::lock_guard<std::mutex> _(layers_lock);
+            const std::thread::id thread = std::this_thread::get_id();
+            cached_layer = nullptr;
+            for (auto &layer : layers) {
+                if (layer->thread == thread) {
+                    cached_layer = layer.get();
+                }
+            }
+            if (cached_layer == nullptr) {
+                layers.push_back(std::unique_ptr<Layer>(new Layer()));
+                layers.back()->thread = thread;
+                layers.back()->tiles.resize(tiles_x * tiles_y);
+                cached_layer = layers.back().get();
+            }
+            cached_id = id;
+        }
+        return *cached_layer;
+    }
+
+    // Adds the tiles of every layer to buffer and counter, and frees them
+    void merge_layers() {
+        for (auto &layer : layers) {
+            for (int t = 0; t < (int)layer->tiles.size(); t++) {
+                if (!layer->tiles[t]) {
+                    continue;
+                }
+                const Tile &tile = *layer->tiles[t];
+                const int x0 = t / tiles_y * tile_size, y0 = t % tiles_y * tile_size;
+                for (int i = x0; i < std::min(x0 + tile_size, width); i++) {
+                    for (int j = y0; j < std::min(y0 + tile_size, height); j++) {
+                        const int p = (i - x0) * tile_size + (j - y0);
+                        counter[i][j] += tile.counter[p];
+                        buffer[i][j] += tile.buffer[p];
+                        squares[i][j] += tile.squares[p];
+                    }
+                }
+                layer->tiles[t].reset();
+            }
+        }
+    }
 };
 
 TC_NAMESPACE_END
@@ -9,9 +9,36 @@
 
 #include "particle_visualization.h"
 #include <taichi/math/array_3d.h>
+#include <taichi/math/radix_sort.h>
 
 TC_NAMESPACE_BEGIN
 
+// Sorts order (which has one entry per key) stably by keys up to num_buckets, and returns where each bucket
+// begins in it. Keys equal to num_buckets are outside of the buckets, and go after begins[num_buckets].
+static std::vector<int> sort_into_buckets(std::vector<uint64> &keys, std::vector<int> &order, int num_buckets,
+                                          int num_threads) {
+    int key_bits = 1;
+    while ((1ll << key_bits) <= num_buckets) {
+        key_bits++;
+    }
+    radix_sort(keys, order, key_bits, num_threads);
+    const int n = (int)keys.size();
+    std::vector<int> begins(num_buckets + 1);
+    // Each run of keys fills the begins of its bucket and of the empty ones before it
+    parallel_for(0, n + 1, num_threads, [&](int i) {
+        const int previous = i == 0 ? -1 : (int)keys[i - 1];
+        const int current = i == n ? num_buckets : (int)keys[i];
+        for (int b = previous + 1; b <= current; b++) {
+            begins[b] = i;
+        }
+    });
+    return begins;
+}
+
+// Particles are self-shadowed through a shadow map along the light, with each particle attenuating the light
+// for those behind it, and splatted onto a pixel each from back to front. Both passes give the result of doing
+// so one particle at a time, with their particles radix sorted, and each shadow map cell or pixel processed in
+// parallel: a particle sees the shadow map cells around it as they are after the particles up to it.
 class ParticleShadowMapRenderer : public ParticleRenderer {
 private:
     Vector3 light_direction;
@@ -29,6 +56,7 @@ public:
         ambient_light = config.get("ambient_light", 0.0f);
         shadowing = config.get("shadowing", 1.0f);
         alpha = config.get("alpha", 1.0f);
+        num_threads = config.get("num_threads", 1);
         light_direction = normalized(light_direction);
         Vector3 u = abs(light_direction.y) > 0.99f ? Vector3(1, 0, 0) :
             normalized(glm::cross(light_direction, Vector3(0, 1, 0)));
@@ -40,63 +68,141 @@ public:
         if (particles.empty()) {
             return;
         }
-        Vector2 uv_lowerbound(2000 * shadow_map_resolution);
-        Vector2 uv_upperbound(-2000 * shadow_map_resolution);
-
-        std::vector <std::pair<real, int>> indices(particles.size());
-        for (int i = 0; i < (int)indices.size(); i++) {
-            indices[i] = std::make_pair(-glm::dot(light_direction, particles[i].position), i);
-            Vector3 transformed_coord = light_transform * particles[i].position;
-            Vector2 uv(transformed_coord.x, transformed_coord.y);
-            uv_lowerbound.x = std::min(uv_lowerbound.x, uv.x);
-            uv_lowerbound.y = std::min(uv_lowerbound.y, uv.y);
-            uv_upperbound.x = std::max(uv_upperbound.x, uv.x);
-            uv_upperbound.y = std::max(uv_upperbound.y, uv.y);
+        const int n = (int)particles.size();
+        const int num_chunks = std::max(1, std::min(num_threads * 4, n / 16384));
+        std::vector<Vector2> uvs(n);
+        std::vector<uint64> keys(n);
+        std::vector<Vector2> lower_bounds(num_chunks), upper_bounds(num_chunks);
+        parallel_for(0, num_chunks, num_threads, [&](int c) {
+            Vector2 uv_lowerbound(2000 * shadow_map_resolution);
+            Vector2 uv_upperbound(-2000 * shadow_map_resolution);
+            for (int i = (int)((int64)n * c / num_chunks); i < (int)((int64)n * (c + 1) / num_chunks); i++) {
+                keys[i] = float_sort_key(-glm::dot(light_direction, particles[i].position));
+                Vector3 transformed_coord = light_transform * particles[i].position;
+                Vector2 uv(transformed_coord.x, transformed_coord.y);
+                uvs[i] = uv;
+                uv_lowerbound.x = std::min(uv_lowerbound.x, uv.x);
+                uv_lowerbound.y = std::min(uv_lowerbound.y, uv.y);
+                uv_upperbound.x = std::max(uv_upperbound.x, uv.x);
+                uv_upperbound.y = std::max(uv_upperbound.y, uv.y);
+            }
+            lower_bounds[c] = uv_lowerbound;
+            upper_bounds[c] = uv_upperbound;
+        }, 1);
+        Vector2 uv_lowerbound = lower_bounds[0], uv_upperbound = upper_bounds[0];
+        for (int c = 1; c < num_chunks; c++) {
+            uv_lowerbound.x = std::min(uv_lowerbound.x, lower_bounds[c].x);
+            uv_lowerbound.y = std::min(uv_lowerbound.y, lower_bounds[c].y);
+            uv_upperbound.x = std::max(uv_upperbound.x, upper_bounds[c].x);
+            uv_upperbound.y = std::max(uv_upperbound.y, upper_bounds[c].y);
+        }
+        std::vector<int> order(n);
+        for (int i = 0; i < n; i++) {
+            order[i] = i;
         }
-        std::sort(indices.begin(), indices.end());
+        radix_sort(keys, order, 32, num_threads);
+        std::vector<int> rank(n);
+        parallel_for(0, n, num_threads, [&](int r) {
+            rank[order[r]] = r;
+        });
+
         Vector2 res = (uv_upperbound - uv_lowerbound) / shadow_map_resolution;
-        Array2D<real> occlusion_buffer((int)std::ceil(res.x) + 1, (int)std::ceil(res.y) + 1, 1.0f);
+        // The cells of the shadow map are not stored, but found from the particles in them
+        const int map_width = (int)std::ceil(res.x) + 1, map_height = (int)std::ceil(res.y) + 1;
+        const int num_cells = map_width * map_height;
+        auto inside_map = [&](const Vector2 &uv) {
+            // As Array2D::inside(uv) would
+            const real tolerance = 1e-4f;
+            return -tolerance <= uv.x && uv.x <= map_width + tolerance && -tolerance <= uv.y &&
+                   uv.y < map_height + tolerance;
+        };
         real shadow_map_scaling = 1.0f / shadow_map_resolution;
-        std::vector<real> occlusion(particles.size());
-
-        for (int i = 0; i < (int)indices.size(); i++) {
-            const int index = indices[i].second;
-            Vector3 transformed_coord = light_transform * particles[index].position;
-            Vector2 uv(transformed_coord.x, transformed_coord.y);
-            uv = shadow_map_scaling * (uv - uv_lowerbound);
-            int int_x = (int)(uv.x);
-            int int_y = (int)(uv.y);
+        // In light order, the cells of the particles, num_cells for those outside
+        parallel_for(0, n, num_threads, [&](int r) {
+            const int index = order[r];
+            Vector2 uv = shadow_map_scaling * (uvs[index] - uv_lowerbound);
+            uvs[index] = uv;
+            keys[r] = inside_map(uv) ? (int)(uv.x) * map_height + (int)(uv.y) : num_cells;
+        });
+        std::vector<int> cell_particles = order;
+        const std::vector<int> cell_begins = sort_into_buckets(keys, cell_particles, num_cells, num_threads);
+        // Per particle in cell order, its rank and the cell value once it has attenuated it
+        std::vector<int> cell_ranks(n);
+        std::vector<real> cell_values(n);
+        parallel_for(0, num_cells, num_threads, [&](int cell) {
+            real value = 1.0f;
+            for (int k = cell_begins[cell]; k < cell_begins[cell + 1]; k++) {
+                const int index = cell_particles[k];
+                value *= (1.0f - shadowing * particles[index].color.w);
+                cell_ranks[k] = rank[index];
+                cell_values[k] = value;
+            }
+        });
+        auto get_cell = [&](int i, int j, int r) {
+            const int cell = clamp(i, 0, map_width - 1) * map_height + clamp(j, 0, map_height - 1);
+            const int *ranks = &cell_ranks[0];
+            const int k = int(std::upper_bound(ranks + cell_begins[cell], ranks + cell_begins[cell + 1], r) - ranks);
+            return k == cell_begins[cell] ? 1.0f : cell_values[k - 1];
+        };
+        std::vector<real> occlusion(n);
+        parallel_for(0, n, num_threads, [&](int index) {
+            const Vector2 uv = uvs[index];
             real occ = 0.0f;
-            if (occlusion_buffer.inside(uv)) {
-                occlusion_buffer[int_x][int_y] *= (1.0f - shadowing * particles[index].color.w);
-                occ = occlusion_buffer.sample(uv);
+            if (inside_map(uv)) {
+                // As Array2D::sample(uv) would, on cells stored at their centers
+                real x = clamp(uv.x - 0.5f, 0.f, map_width - 1.f - eps);
+                real y = clamp(uv.y - 0.5f, 0.f, map_height - 1.f - eps);
+                int x_i = clamp(int(x), 0, map_width - 2);
+                int y_i = clamp(int(y), 0, map_height - 2);
+                real x_r = x - x_i;
+                real y_r = y - y_i;
+                const int r = rank[index];
+                occ = lerp(x_r,
+                           lerp(y_r, get_cell(x_i, y_i, r), get_cell(x_i, y_i + 1, r)),
+                           lerp(y_r, get_cell(x_i + 1, y_i, r), get_cell(x_i + 1, y_i + 1, r)));
             }
             occlusion[index] = std::max(ambient_light, occ);
-        }
+        });
 
-        for (int i = 0; i < (int)indices.size(); i++) {
-            real dist = -glm::dot(camera->get_dir(), particles[i].position - camera->get_origin());
-            indices[i] = std::make_pair(dist, i);
-        }
-        std::sort(indices.begin(), indices.end());
-        for (int i = 0; i < (int)indices.size(); i++) {
-            const int index = indices[i].second;
+        const Vector3 camera_origin = camera->get_origin(), camera_dir = camera->get_dir();
+        parallel_for(0, n, num_threads, [&](int i) {
+            real dist = -glm::dot(camera_dir, particles[i].position - camera_origin);
+            keys[i] = float_sort_key(dist);
+            order[i] = i;
+        });
+        radix_sort(keys, order, 32, num_threads);
+        // In depth order, the pixels of the particles, num_pixels for those behind the camera or outside
+        const int num_pixels = buffer.get_width() * buffer.get_height();
+        parallel_for(0, n, num_threads, [&](int r) {
+            const int index = order[r];
             auto &p = particles[index];
-            real dist = -glm::dot(camera->get_dir(), particles[index].position - camera->get_origin());
+            keys[r] = num_pixels;
+            real dist = -glm::dot(camera_dir, p.position - camera_origin);
             if (dist >= 0) {
-                continue;
+                return;
             }
-            auto direction = normalized(p.position - camera->get_origin());
+            auto direction = normalized(p.position - camera_origin);
             real u, v;
             camera->get_pixel_coordinate(direction, u, v);
             int int_u = (int)(u * buffer.get_width());
             int int_v = (int)(v * buffer.get_height());
             if (buffer.inside(int_u, int_v)) {
-                Vector3 color(p.color.x, p.color.y, p.color.z);
-                real alpha = p.color.w * this->alpha;
-                buffer[int_u][int_v] = lerp(alpha, buffer[int_u][int_v], color * occlusion[index]);
+                keys[r] = int_u * buffer.get_height() + int_v;
             }
-        }
+        });
+        const std::vector<int> pixel_begins = sort_into_buckets(keys, order, num_pixels, num_threads);
+        parallel_for(0, buffer.get_width(), num_threads, [&](int i) {
+            for (int j = 0; j < buffer.get_height(); j++) {
+                const int pixel = i * buffer.get_height() + j;
+                for (int k = pixel_begins[pixel]; k < pixel_begins[pixel + 1]; k++) {
+                    const int index = order[k];
+                    auto &p = particles[index];
+                    Vector3 color(p.color.x, p.color.y, p.color.z);
+                    real alpha = p.color.w * this->alpha;
+                    buffer[i][j] = lerp(alpha, buffer[i][j], color * occlusion[index]);
+                }
+            }
+        });
     }
 };
 
@@ -121,4 +227,72 @@ std::shared_ptr<Texture> rasterize_render_particles(const Config &config, const
     return tex;
 }
 
+std::vector<RenderParticle> bin_render_particles(const std::vector<RenderParticle> &particles, int budget,
+                                                 int num_threads) {
+    assert_info(budget > 0, "The splat budget should be positive");
+    const int n = (int)particles.size();
+    if (n <= budget) {
+        return particles;
+    }
+    num_threads = std::max(1, std::min(num_threads, n));
+    std::vector<Vector3> thread_lower(num_threads, Vector3(1e30f)), thread_upper(num_threads, Vector3(-1e30f));
+    parallel_for(0, num_threads, num_threads, [&](int t) {
+        for (int i = (int64)n * t / num_threads; i < (int64)n * (t + 1) / num_threads; i++) {
+            thread_lower[t] = glm::min(thread_lower[t], particles[i].position);
+            thread_upper[t] = glm::max(thread_upper[t], particles[i].position);
+        }
+    });
+    Vector3 lower = thread_lower[0], upper = thread_upper[0];
+    for (int t = 1; t < num_threads; t++) {
+        lower = glm::min(lower, thread_lower[t]);
+        upper = glm::max(upper, thread_upper[t]);
+    }
+    const Vector3 extent = upper - lower;
+    // Cubic cells, as small as the budget allows: the grid is sized for a full cube first, then refined while
+    // thinner distributions still fit
+    Vector3i dims;
+    auto get_num_cells = [&](real cell_size) {
+        for (int d = 0; d < 3; d++) {
+            dims[d] = std::max(1, (int)std::ceil(extent[d] / cell_size));
+        }
+        return (int64)dims.x * dims.y * dims.z;
+    };
+    const real max_extent = std::max(std::max(extent.x, std::max(extent.y, extent.z)), eps);
+    real cell_size = max_extent / std::cbrt((real)budget);
+    while (get_num_cells(cell_size) > budget) {
+        cell_size *= 1.1f;
+    }
+    // Along a line, cells can be no smaller than this
+    while (cell_size * 0.9f >= max_extent / budget && get_num_cells(cell_size * 0.9f) <= budget) {
+        cell_size *= 0.9f;
+    }
+    const int num_cells = (int)get_num_cells(cell_size);
+    const real inv_cell_size = 1.0f / cell_size;
+    std::vector<uint64> keys(n);
+    std::vector<int> order(n);
+    parallel_for(0, n, num_threads, [&](int i) {
+        const Vector3 g = (particles[i].position - lower) * inv_cell_size;
+        const int x = std::min((int)g.x, dims.x - 1), y = std::min((int)g.y, dims.y - 1);
+        const int z = std::min((int)g.z, dims.z - 1);
+        keys[i] = (uint64)((x * dims.y + y) * dims.z + z);
+        order[i] = i;
+    });
+    std::vector<int> begins = sort_into_buckets(keys, order, num_cells, num_threads);
+    std::vector<int> occupied;
+    for (int c = 0; c < num_cells; c++) {
+        if (begins[c + 1] > begins[c]) {
+            occupied.push_back(c);
+        }
+    }
+    std::vector<RenderParticle> splats(occupied.size());
+    parallel_for(0, (int)occupied.size(), num_threads, [&](int k) {
+        SplatAccumulator splat;
+        for (int i = begins[occupied[k]]; i < begins[occupied[k] + 1]; i++) {
+            splat.add(particles[order[i]]);
+        }
+        splats[k] = splat.get();
+    });
+    return splats;
+}
+
 TC_NAMESPACE_END
@@ -28,20 +28,57 @@ struct RenderParticle {
     }
 };
 
+// Sums particles into one representative splat: positions are averaged, colors averaged by opacity, and
+// opacities composed as if the particles were stacked, 1 - prod(1 - alpha)
+struct SplatAccumulator {
+    Vector3 position_sum = Vector3(0.0f);
+    Vector3 color_sum = Vector3(0.0f);
+    real color_weight = 0;
+    real transparency = 1;
+    int count = 0;
+
+    void add(const RenderParticle &p) {
+        const real weight = std::max(p.color.w, eps);
+        position_sum += p.position;
+        color_sum += weight * Vector3(p.color.x, p.color.y, p.color.z);
+        color_weight += weight;
+        transparency *= 1.0f - p.color.w;
+        count++;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    RenderParticle get() const {
+        return RenderParticle(position_sum / real(count), Vector4(color_sum / color_weight, 1.0f - transparency));
+    }
+};
+
 class ParticleRenderer {
 protected:
     std::shared_ptr<Camera> camera;
+    int num_threads = 1;
 
 public:
     void set_camera(std::shared_ptr<Camera> camera) {
         this->camera = camera;
     }
+
+    void set_num_threads(int num_threads) {
+        this->num_threads = num_threads;
+    }
     virtual void initialize(const Config &config) {};
     virtual void render(Array2D<Vector3> &buffer, const std::vector<RenderParticle> &particles) const {}
 };
 
 std::shared_ptr<Texture> rasterize_render_particles(const Config &config, const std::vector<RenderParticle> &particles);
 
+// At most budget splats, one per occupied cell of a uniform grid over the bounds of particles, in cell order.
+// Particles are returned as they are if there are no more than budget of them.
+std::vector<RenderParticle> bin_render_particles(const std::vector<RenderParticle> &particles, int budget,
+                                                 int num_threads);
+
 TC_INTERFACE(ParticleRenderer)
 
 TC_NAMESPACE_END
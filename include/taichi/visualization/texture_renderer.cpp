@@ -19,10 +19,14 @@ bool TextureRenderer::shared_resources_initialized = false;
 
 TextureRenderer::TextureRenderer(std::shared_ptr<GLWindow> context, int width, int height) : width(width), height(height) {
     texture = unsigned(-1);
+    for (int i = 0; i < num_pixel_buffers; i++) {
+        pixel_buffers[i] = 0;
+    }
+    pixels = nullptr;
+    dirty = false;
     this->context = context;
     auto _ = context->create_context_guard();
     CGL;
-    reset();
     if (!shared_resources_initialized) {
         float vbo_data[]{ -1, -1, 1, -1, -1, 1, -1, 1, 1, -1, 1, 1 };
 
@@ -36,6 +40,7 @@ TextureRenderer::TextureRenderer(std::shared_ptr<GLWindow> context, int width, i
 
     this->width = -1; this->height = -1;
     resize(width, height);
+    reset();
     CGL;
     glGenVertexArrays(1, &vao);
     glBindVertexArray(vao);
@@ -52,11 +57,12 @@ void TextureRenderer::resize(int width, int height)
     if (this->width == width && this->height == height) return;
     this->width = width;
     this->height = height;
-    image.resize(height * width * 4);
+    assert_info(width > 0 && height > 0, "Texture should not be empty");
 
     auto _ = context->create_context_guard();
     if (texture != unsigned(-1)) {
         glDeleteTextures(1, &texture);
+        release_pixel_buffers();
     }
     glGenTextures(1, &texture);
     glActiveTexture(GL_TEXTURE0);
@@ -66,19 +72,70 @@ void TextureRenderer::resize(int width, int height)
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    allocate_pixel_buffers();
+}
+
+void TextureRenderer::allocate_pixel_buffers() {
+    const GLsizeiptr size = (GLsizeiptr)width * height * 4;
+    persistent = GLEW_ARB_buffer_storage != 0;
+    glGenBuffers(num_pixel_buffers, pixel_buffers);
+    for (int i = 0; i < num_pixel_buffers; i++) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixel_buffers[i]);
+        if (persistent) {
+            // Coherent, so that writes are seen by the uploads issued after them without flushing
+            const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, nullptr, flags);
+            mapped[i] = (unsigned char *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+        } else {
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+            mapped[i] = nullptr;
+        }
+        fences[i] = nullptr;
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    CGL;
+    current = 0;
+    acquire_pixel_buffer();
+}
+
+void TextureRenderer::release_pixel_buffers() {
+    for (int i = 0; i < num_pixel_buffers; i++) {
+        if (fences[i]) {
+            glDeleteSync(fences[i]);
+        }
+    }
+    // Deleting the buffers unmaps them
+    glDeleteBuffers(num_pixel_buffers, pixel_buffers);
+    pixels = nullptr;
+}
+
+void TextureRenderer::acquire_pixel_buffer() {
+    // The buffer was last uploaded from num_pixel_buffers frames ago, which has usually completed by now
+    if (fences[current]) {
+        while (glClientWaitSync(fences[current], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {
+        }
+        glDeleteSync(fences[current]);
+        fences[current] = nullptr;
+    }
+    if (persistent) {
+        pixels = mapped[current];
+    } else {
+        // Unsynchronized is safe after the fence, and invalidating spares the driver keeping the old frame
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixel_buffers[current]);
+        pixels = (unsigned char *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, (GLsizeiptr)width * height * 4,
+                                                   GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT |
+                                                   GL_MAP_UNSYNCHRONIZED_BIT);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+    assert_info(pixels != nullptr, "Failed to map pixel buffer");
 }
 
 void TextureRenderer::reset() {
-    if (image.size())
-        memset(&image[0], 0, sizeof(unsigned char) * image.size());
+    memset(get_pixels(), 0, sizeof(unsigned char) * width * height * 4);
 }
 
 void TextureRenderer::set_pixel(int x, int y, vec4 color) {
-    unsigned char *p = &image[0] + 4 * (y * width + x);
-    p[0] = (unsigned char)(clamp(color.r, 0.0f, 1.0f) * 255.0);
-    p[1] = (unsigned char)(clamp(color.g, 0.0f, 1.0f) * 255.0);
-    p[2] = (unsigned char)(clamp(color.b, 0.0f, 1.0f) * 255.0);
-    p[3] = (unsigned char)(clamp(color.a, 0.0f, 1.0f) * 255.0);
+    write_pixel(get_pixels() + 4 * (y * width + x), color);
 }
 
 void TextureRenderer::render() {
@@ -88,8 +145,21 @@ void TextureRenderer::render() {
     glActiveTexture(GL_TEXTURE0);
     CGL;
     glBindTexture(GL_TEXTURE_2D, texture);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, &image[0]);
-    glGenerateMipmap(GL_TEXTURE_2D);
+    if (dirty) {
+        // The upload is only queued, to run from the pixel buffer while the next frame is written to another
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixel_buffers[current]);
+        if (!persistent) {
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glGenerateMipmap(GL_TEXTURE_2D);
+        CGL;
+        current = (current + 1) % num_pixel_buffers;
+        acquire_pixel_buffer();
+        dirty = false;
+    }
     glDisable(GL_DEPTH_TEST);
     CGL;
     glBindVertexArray(vao);
@@ -103,6 +173,10 @@ void TextureRenderer::render() {
 }
 
 TextureRenderer::~TextureRenderer() {
+    auto _ = context->create_context_guard();
+    release_pixel_buffers();
+    glDeleteTextures(1, &texture);
+    glDeleteVertexArrays(1, &vao);
 }
 
 TC_NAMESPACE_END
@@ -17,15 +17,36 @@ TC_NAMESPACE_BEGIN
 
 using glm::vec4;
 
+// Draws an image over the framebuffer. Frames are written straight into a ring of mapped pixel buffer objects
+// (persistently mapped where ARB_buffer_storage is available), so that the upload of one frame overlaps writing
+// the next ones, and writing needs neither the GL context nor a copy.
 class TextureRenderer {
 private:
+    static const int num_pixel_buffers = 3;
     static GLuint program, vbo;
     static bool shared_resources_initialized;
     GLuint vao;
     GLuint texture;
     int width, height;
-    vector<unsigned char> image;
+    GLuint pixel_buffers[num_pixel_buffers];
+    // Signaled once the GL is done uploading from the buffer
+    GLsync fences[num_pixel_buffers];
+    unsigned char *mapped[num_pixel_buffers];
+    bool persistent;
+    int current;
+    // Of the current buffer, which holds the next frame
+    unsigned char *pixels;
+    // Whether the next frame was written to since the last render()
+    bool dirty;
     std::shared_ptr<GLWindow> context;
+
+    void allocate_pixel_buffers();
+
+    void release_pixel_buffers();
+
+    // Waits until the GL no longer reads the current buffer, and maps it
+    void acquire_pixel_buffer();
+
 public:
     TextureRenderer(std::shared_ptr<GLWindow> window, int height, int width);
 
@@ -35,13 +56,28 @@ public:
 
     void set_pixel(int x, int y, vec4 color);
 
+    // RGBA8 rows of the next frame, bottom up, to be written to until the next render() or resize(). The buffer
+    // held a frame from a few renders ago, so all of it should be written.
+    unsigned char *get_pixels() {
+        dirty = true;
+        return pixels;
+    }
+
     template <typename T>
-    void set_texture(Array2D<T> image);
+    void set_texture(const Array2D<T> &image);
 
+    // Uploads the next frame if it was written to, and draws the latest one
     void render();
 
     ~TextureRenderer();
 
+    static void write_pixel(unsigned char *p, const vec4 &color) {
+        p[0] = (unsigned char)(clamp(color.r, 0.0f, 1.0f) * 255.0);
+        p[1] = (unsigned char)(clamp(color.g, 0.0f, 1.0f) * 255.0);
+        p[2] = (unsigned char)(clamp(color.b, 0.0f, 1.0f) * 255.0);
+        p[3] = (unsigned char)(clamp(color.a, 0.0f, 1.0f) * 255.0);
+    }
+
     static Vector4 to_vec4(real dat) {
         return vec4(dat);
     }
@@ -60,13 +96,14 @@ public:
 };
 
 template<typename T>
-inline void TextureRenderer::set_texture(Array2D<T> image)
+inline void TextureRenderer::set_texture(const Array2D<T> &image)
 {
     // assert_info(image.get_width() == width && image.get_height() == height, "Texture size mismatch!");
     resize(image.get_width(), image.get_height());
+    unsigned char *p = get_pixels();
     for (int i = 0; i < width; i++) {
         for (int j = 0; j < height; j++) {
-            set_pixel(i, j, to_vec4(image[i][j]));
+            write_pixel(p + 4 * (j * width + i), to_vec4(image[i][j]));
         }
     }
 }
@@ -34,5 +34,23 @@ def analysis_stride():
     plt.show()
 
 
+# Latency per load against the working set size, with the bandwidth of the STREAM kernels
+def analysis_hierarchy(num_threads=1):
+    x, y = [], []
+    for i in range(10, 29):
+        benchmark = tc.system.Benchmark('memory_latency', working_set_size=2 ** i, workload=2 ** 20,
+                                        returns_time=True)
+        t = benchmark.run(10)
+        x.append(2 ** i)
+        y.append(t * 1e9)
+        print 2 ** i, t * 1e9, 'ns'
+    for kernel in ['copy', 'scale', 'triad']:
+        benchmark = tc.system.Benchmark('stream', kernel=kernel, num_threads=num_threads, returns_time=True)
+        print kernel, 1e-9 / benchmark.run(10), 'GB/s'
+
+    plt.semilogx(x, y, basex=2)
+    plt.show()
+
+
 if __name__ == '__main__':
     analysis_stride()
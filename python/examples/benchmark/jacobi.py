@@ -48,7 +48,7 @@ def analysis_bf():
 
 def analysis_mt():
     cls_methods = {
-        'simd': ['sse_threaded'],
+        'simd': ['sse_threaded', 'sse_temporal'],
     }
     bits = [
         32,
@@ -68,7 +68,7 @@ def analysis_mt():
                 for i in range(4):
                     num_threads = 2 ** i
                     benchmark = tc.system.Benchmark(ins, n=n, warm_up_iterations=0, iteration_method=method,
-                                                    ignore_boundary=8)
+                                                    ignore_boundary=8, num_threads=num_threads)
                     iterations = max(1, int(2e9 / (n ** 3)))
                     t = benchmark.run(iterations)
                     maximum = max(maximum, t)
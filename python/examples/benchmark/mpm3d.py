@@ -0,0 +1,34 @@
+import taichi as tc
+import matplotlib.pyplot as plt
+
+
+def run(resolution, num_threads, iterations, **kwargs):
+    benchmark = tc.system.Benchmark('mpm3d', resolution=resolution, particle_density=8, num_threads=num_threads,
+                                    warm_up_iterations=4, returns_time=True, **kwargs)
+    seconds = benchmark.run(iterations)
+    particles = benchmark.get_workload()
+    print '%2d threads: %d particles, %.3e particles per second' % (num_threads, particles, 1 / seconds)
+    phases = {}
+    for record in benchmark.get_profile():
+        phases[record.name] = particles / record.get_mean()
+        print '    %-20s %.3e particles/s (max %.2f ms)' % (record.name, phases[record.name], record.max * 1e3)
+    return 1 / seconds, phases
+
+
+def analysis_strong_scaling(resolution=64, iterations=16, **kwargs):
+    x, y = [], []
+    for i in range(4):
+        num_threads = 2 ** i
+        particles_per_second, _ = run(resolution, num_threads, iterations, **kwargs)
+        x.append(num_threads)
+        y.append(particles_per_second)
+    plt.semilogx(x, [t / y[0] for t in y], basex=2, label='mpm3d_%d' % resolution)
+    plt.semilogx(x, x, basex=2, linestyle='--', label='ideal')
+    plt.xlabel('# Cores')
+    plt.ylabel('Speedup')
+    plt.legend()
+    plt.show()
+
+
+if __name__ == '__main__':
+    analysis_strong_scaling()
@@ -0,0 +1,20 @@
+import argparse
+import sys
+
+import taichi as tc
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Run the registered benchmarks and report statistics as JSON')
+    parser.add_argument('names', nargs='*', help='benchmarks to run (default: all registered)')
+    parser.add_argument('--repetitions', type=int, default=10)
+    parser.add_argument('--iterations', type=int, default=16)
+    parser.add_argument('--warm-up-iterations', type=int, default=4)
+    parser.add_argument('--output', help='JSON report to write')
+    parser.add_argument('--baseline', help='JSON report of an earlier run, to flag regressions against')
+    parser.add_argument('--tolerance', type=float, default=0.05,
+                        help='relative slowdown of the median over the baseline to flag')
+    args = parser.parse_args()
+    report = tc.system.run_benchmarks(args.names or None, repetitions=args.repetitions, iterations=args.iterations,
+                                      warm_up_iterations=args.warm_up_iterations, baseline=args.baseline,
+                                      output=args.output, tolerance=args.tolerance)
+    sys.exit(1 if report.get('regressions') else 0)
@@ -25,6 +25,7 @@ def create_scene():
 
 
 if __name__ == '__main__':
+    bake_sdf = False
     uw = tc.UnitWatcher(tc.settings.get_asset_path('units/sdf/box_array.cpp'))
 
     while True:
@@ -35,6 +36,12 @@ if __name__ == '__main__':
             uw.update()
             sdf = tc.core.create_sdf('box_array_sdf')
             sdf_id = tc.core.register_sdf(sdf)
+            if bake_sdf:
+                # Sphere traced through a narrow band grid around the boxes near the origin
+                sdf = tc.core.create_sdf('baked')
+                sdf.initialize(config_from_dict({'sdf': sdf_id, 'lower': (-4, -4, -4), 'upper': (4, 4, 4),
+                                                 'resolution': 256, 'num_threads': 8}))
+                sdf_id = tc.core.register_sdf(sdf)
             renderer = tc.Renderer(output_dir='sdf', overwrite=True)
             renderer.initialize(preset='pt_sdf', max_path_length=3, scene=create_scene(), sdf=sdf_id)
             renderer.set_post_processor(tc.post_process.LDRDisplay(bloom_radius=0.0))
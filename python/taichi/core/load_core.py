@@ -2,18 +2,30 @@ import atexit
 import os
 import shutil
 import sys
+import time
 
 from taichi.misc.settings import get_output_directory, get_bin_directory, get_root_directory
 from taichi.misc.util import get_os_name, get_unique_task_id
 
 CREATE_SAND_BOX_ON_WINDOWS = True
 
+load_start_time = time.time()
+
+
+# Copying the library on every import would dominate the startup of short jobs
+def copy_if_newer(src, dst):
+    if os.path.exists(dst) and os.path.getsize(dst) == os.path.getsize(src) and \
+            os.path.getmtime(dst) >= os.path.getmtime(src):
+        return
+    shutil.copy2(src, dst)
+
+
 if get_os_name() == 'osx':
     bin_dir = get_bin_directory()
     if os.path.exists(os.path.join(bin_dir, 'libtaichi_core.dylib')):
         tmp_cwd = os.getcwd()
         os.chdir(bin_dir)
-        shutil.copy('libtaichi_core.dylib', 'taichi_core.so')
+        copy_if_newer('libtaichi_core.dylib', 'taichi_core.so')
         sys.path.append(bin_dir)
         import taichi_core as tc_core
 
@@ -27,7 +39,7 @@ elif get_os_name() == 'linux':
         tmp_cwd = os.getcwd()
         os.chdir(bin_dir)
         sys.path.append(bin_dir)
-        shutil.copy('libtaichi_core.so', 'taichi_core.so')
+        copy_if_newer('libtaichi_core.so', 'taichi_core.so')
         import taichi_core as tc_core
 
         os.chdir(tmp_cwd)
@@ -70,6 +82,9 @@ elif get_os_name() == 'win':
 
     os.chdir(old_wd)
 
+# Seconds to load the core library, static initialization included
+core_load_time = time.time() - load_start_time
+
 def at_startup():
     assert os.path.exists(get_root_directory()), 'Please make sure $TAICHI_ROOT_DIR [' + get_root_directory() + '] exists.'
     output_dir = get_output_directory()
@@ -3,13 +3,19 @@ from taichi.misc.util import *
 
 
 class LevelSet3D:
-    def __init__(self, res, offset=None):
+    # With sparse=True, only a band of `band` cells around the surface is stored at full resolution
+    def __init__(self, res, offset=None, sparse=False, band=8):
         if offset is None:
             offset = Vector(0.5, 0.5, 0.5)
         self.delta_x = 1.0 / min(res)
         self.res = (res[0] + 1, res[1] + 1, res[2] + 1)
-        self.levelset = tc.core.LevelSet3D(int(res[0]) + 1, int(res[1]) + 1, int(res[2]) + 1, offset)
-        self.id = tc.core.register_levelset3d(self.levelset)
+        self.sparse = sparse
+        if sparse:
+            self.levelset = tc.core.SparseLevelSet3D(int(res[0]) + 1, int(res[1]) + 1, int(res[2]) + 1, offset, band)
+            self.id = None
+        else:
+            self.levelset = tc.core.LevelSet3D(int(res[0]) + 1, int(res[1]) + 1, int(res[2]) + 1, offset)
+            self.id = tc.core.register_levelset3d(self.levelset)
 
     def add_sphere(self, center, radius, inside_out=False):
         if type(center) != tc.core.Vector3:
@@ -27,9 +33,41 @@ class LevelSet3D:
             inside_out
         )
 
+    # A (closed) taichi.visual.Mesh, with its transform: the signed distance to it within band of it, or
+    # +-0.5 cells for the cells it occupies if band is None
+    def add_mesh(self, mesh, band=None, num_threads=1):
+        assert not self.sparse, 'Meshes are voxelized into dense level sets; see from_dense'
+        if band is None:
+            tc.core.voxelize_mesh_occupancy(mesh.c, self.levelset, Vector(0, 0, 0), self.delta_x, num_threads)
+        else:
+            tc.core.voxelize_mesh_signed_distance(mesh.c, self.levelset, Vector(0, 0, 0), self.delta_x,
+                                                  band / self.delta_x, num_threads)
+
+    # A sparse copy of a dense LevelSet3D, e.g. of a voxelized mesh, keeping a band of `band` cells
+    @staticmethod
+    def from_dense(dense, band=8):
+        res = (dense.res[0] - 1, dense.res[1] - 1, dense.res[2] - 1)
+        sparse = LevelSet3D(res, sparse=True, band=band)
+        sparse.delta_x = dense.delta_x
+        sparse.levelset.initialize_from_dense(dense.levelset, band)
+        return sparse
+
     def global_increase(self, delta):
         self.levelset.global_increase(delta / self.delta_x)
 
+    # Restores signed distances within band of the surface, e.g. after CSG edits
+    def redistance(self, band, num_threads=1):
+        assert not self.sparse, 'Sparse level sets are not redistanced'
+        self.levelset.redistance(band / self.delta_x, num_threads)
+
+    # The surface phi = isovalue as a taichi.visual.Mesh, in the coordinates of add_sphere etc.
+    def get_mesh(self, material, isovalue=0, num_threads=1):
+        assert not self.sparse, 'Surfaces are extracted from dense level sets'
+        from taichi.visual.mesh import Mesh
+        triangles = tc.core.extract_surface(self.levelset, isovalue / self.delta_x, Vector(0, 0, 0), self.delta_x,
+                                            num_threads)
+        return Mesh(triangles, material=material)
+
     # def get(self, x, y=None):
     #     if y is None:
     #         y = x.y
@@ -2,8 +2,9 @@ import time
 
 from taichi.core import tc_core
 from levelset_3d import LevelSet3D
+from taichi.dynamics.simulation_profile import profile_to_dict
 from taichi.misc.util import *
-from taichi.tools.video import VideoManager
+from taichi.tools.video import VideoManager, FRAME_FN_TEMPLATE
 from taichi.visual.camera import Camera
 from taichi.visual.particle_renderer import ParticleRenderer
 from taichi.visual.post_process import LDRDisplay
@@ -12,8 +13,9 @@ import taichi as tc
 
 
 class MPM3:
-    def __init__(self, **kwargs):
-        self.c = tc_core.create_simulation3d('mpm')
+    # simulator: 'mpm', or 'mpm_cuda' when taichi is built with USE_CUDA
+    def __init__(self, simulator='mpm', **kwargs):
+        self.c = tc_core.create_simulation3d(simulator)
         self.c.initialize(P(**kwargs))
         self.task_id = get_unique_task_id()
         self.directory = tc.get_output_path(self.task_id)
@@ -27,6 +29,9 @@ class MPM3:
                                                   ambient_light=0.01,
                                                   light_direction=(1, 1, 0))
         self.resolution = kwargs['resolution']
+        self.num_threads = kwargs['num_threads']
+        # Frames are rendered from at most this many splats instead of every particle, if positive
+        self.preview_budget = kwargs.get('preview_budget', 0)
         self.frame = 0
 
         dummy_levelset = self.create_levelset()
@@ -36,6 +41,7 @@ class MPM3:
 
         self.levelset_generator = dummy_levelset_generator
         self.start_simulation_time = None
+        self.executor = tc_core.AsyncExecutor()
 
     def add_particles(self, **kwargs):
         self.c.add_particles(P(**kwargs))
@@ -69,13 +75,13 @@ class MPM3:
         self.c.step(step_t)
         print 'Step Time:', time.time() - T, ' (', time.time() - self.start_simulation_time, ')'
         image_buffer = tc_core.Array2DVector3(self.video_manager.width, self.video_manager.height, Vector(0, 0, 0.0))
-        particles = self.c.get_render_particles()
+        if self.preview_budget > 0:
+            particles = self.c.get_preview_particles(self.preview_budget)
+        else:
+            particles = self.c.get_render_particles()
         particles.write(self.directory + '/particles%05d.bin' % self.frame)
-        res = map(float, self.resolution)
         if not camera:
-            camera = Camera('pinhole', origin=(0, res[1] * 0.4, res[2] * 1.4),
-                            look_at=(0, -res[1] * 0.5, 0), up=(0, 1, 0), fov=90,
-                            width=10, height=10)
+            camera = self.get_default_camera()
         self.particle_renderer.set_camera(camera)
         self.particle_renderer.render(image_buffer, particles)
         img = image_buffer_to_ndarray(image_buffer)
@@ -84,6 +90,45 @@ class MPM3:
         self.video_manager.write_frame(img)
         self.frame += 1
 
+    # Steps the simulation in the background, without the visualization of step(), returning a
+    # tc.core.AsyncTask. The simulator must be left alone until it is done.
+    def step_async(self, step_t):
+        t = self.c.get_current_time()
+        self.update_levelset(t, t + step_t)
+        return self.c.step_async(self.executor, step_t)
+
+    # Like frames calls of step(), except that frame n is rendered in the background while frame n + 1 is
+    # simulated, with render_ratio of the threads, and written to the video without being shown
+    def step_pipelined(self, step_t, frames, camera=None, render_ratio=0.5):
+        if not camera:
+            camera = self.get_default_camera()
+        self.particle_renderer.set_camera(camera)
+        pipeline = tc_core.FramePipeline(self.c, self.particle_renderer.c)
+        pipeline.initialize(P(num_threads=self.num_threads, render_ratio=render_ratio,
+                              width=self.video_manager.width, height=self.video_manager.height,
+                              output=os.path.join(self.video_manager.frame_directory, FRAME_FN_TEMPLATE),
+                              first_frame=self.video_manager.frame_counter, exposure=2.0,
+                              preview_budget=self.preview_budget))
+        T = time.time()
+        for i in range(frames):
+            t = self.c.get_current_time()
+            self.update_levelset(t, t + step_t)
+            pipeline.step(step_t)
+        pipeline.wait()
+        print 'Pipelined Time:', time.time() - T, '(', frames, 'frames )'
+        self.c.set_num_threads(self.num_threads)
+        self.particle_renderer.set_num_threads(1)
+        for i in range(frames):
+            self.video_manager.frame_fns.append(FRAME_FN_TEMPLATE % self.video_manager.frame_counter)
+            self.video_manager.frame_counter += 1
+        self.frame += frames
+
+    def get_default_camera(self):
+        res = map(float, self.resolution)
+        return Camera('pinhole', origin=(0, res[1] * 0.4, res[2] * 1.4),
+                      look_at=(0, -res[1] * 0.5, 0), up=(0, 1, 0), fov=90,
+                      width=10, height=10)
+
     def get_directory(self):
         return self.directory
 
@@ -95,3 +140,10 @@ class MPM3:
 
     def test(self):
         return self.c.test()
+
+    def get_profile(self):
+        # Per-phase timings since the last reset_profile, see profile_to_dict
+        return profile_to_dict(self.c.get_profile())
+
+    def reset_profile(self):
+        self.c.reset_profile()
@@ -24,6 +24,8 @@ class NBody:
                                                   ambient_light=0.3,
                                                   light_direction=(1, 3, -3))
         self.step_counter = 0
+        # Frames are rendered from at most this many splats instead of every particle, if positive
+        self.preview_budget = kwargs.get('preview_budget', 0)
 
     def get_output_path(self, path):
         return '/'.join([self.directory, path])
@@ -35,7 +37,10 @@ class NBody:
         self.c.step(step_t)
         print 'Time:', time.time() - T
         image_buffer = tc_core.Array2DVector3(self.video_manager.width, self.video_manager.height, Vector(0, 0, 0.0))
-        particles = self.c.get_render_particles()
+        if self.preview_budget > 0:
+            particles = self.c.get_preview_particles(self.preview_budget)
+        else:
+            particles = self.c.get_render_particles()
         particles.write(self.get_output_path('particles%05d.bin' % self.step_counter))
         camera = Camera('pinhole', origin=(0, 0, 50),
                         look_at=(0, 0, 0), up=(0, 1, 0), fov=70,
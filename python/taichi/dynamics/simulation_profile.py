@@ -0,0 +1,15 @@
+def profile_to_dict(records):
+    # Per-phase timings (seconds) of Simulation3D::get_profile records, keyed by phase name
+    # With tc.core.set_hardware_counters(True), also the hardware counter totals and rates
+    profile = {}
+    for record in records:
+        profile[record.name] = {'count': record.count, 'total': record.total, 'mean': record.get_mean(),
+                                'max': record.max, 'bytes': record.bytes}
+        hardware = record.hardware
+        if hardware.cycles > 0:
+            profile[record.name].update({
+                'cycles': hardware.cycles, 'instructions': hardware.instructions, 'ipc': hardware.get_ipc(),
+                'l1d_misses': hardware.l1d_misses, 'llc_misses': hardware.llc_misses,
+                'branch_misses': hardware.branch_misses,
+                'dram_bandwidth': hardware.get_dram_bytes() / record.total if record.total > 0 else 0})
+    return profile
@@ -2,6 +2,7 @@ import time
 
 import taichi
 from taichi.core import tc_core
+from taichi.dynamics.simulation_profile import profile_to_dict
 from taichi.misc.util import *
 
 
@@ -30,3 +31,31 @@ class Smoke3:
             temperature_tex=temperature.id,
         )
         self.c.update(cfg)
+
+    def get_profile(self):
+        # Per-phase timings since the last reset_profile, see profile_to_dict
+        return profile_to_dict(self.c.get_profile())
+
+    def reset_profile(self):
+        self.c.reset_profile()
+
+    def get_solver_statistics(self):
+        # One dict per pressure solve since the last reset_profile
+        statistics = []
+        for s in self.c.get_solver_statistics():
+            phases = {}
+            for record in s.phases:
+                phases[record.name] = {'count': record.count, 'total': record.total, 'max': record.max,
+                                       'bytes': record.bytes}
+            statistics.append({'solver': s.solver, 'iterations': s.iterations, 'converged': s.converged,
+                               'tolerance': s.tolerance, 'residual_history': list(s.residual_history),
+                               'solve_time': s.solve_time, 'bytes': s.get_bytes(), 'phases': phases})
+        return statistics
+
+    def export_volume(self, fn, threshold=0.0, compress=True):
+        # Density and temperature of the occupied tiles, written to the task directory on a background
+        # thread; loadable with the 'voxel' volume material's sparse_volume
+        self.c.export_volume(os.path.join(self.directory, fn), threshold, compress)
+
+    def wait_for_volume_export(self):
+        self.c.wait_for_volume_export()
@@ -1,41 +1,50 @@
 import math
 
+import numpy as np
 import taichi as tc
 from taichi.misc.util import *
 
 
-def create_mesh_from_functions(res, surface, normal=None, uv=None, smooth=True):
-    surface = tc.core.function23_from_py_obj(surface)
+# With batched=True, the functions take an n*2 array of points and return n*3 (or n*2 for uv) arrays, and
+# each is called once instead of once per point
+def create_mesh_from_functions(res, surface, normal=None, uv=None, smooth=True, batched=False):
+    if batched:
+        function23, function22 = tc.core.batched_function23_from_py_obj, tc.core.batched_function22_from_py_obj
+        generate = tc.core.generate_mesh_batched
+    else:
+        function23, function22 = tc.core.function23_from_py_obj, tc.core.function22_from_py_obj
+        generate = tc.core.generate_mesh
+    surface = function23(surface)
     if normal:
-        normal = tc.core.function23_from_py_obj(normal)
+        normal = function23(normal)
     else:
         normal = None
     if uv:
-        uv = tc.core.function22_from_py_obj
+        uv = function22(uv)
     else:
         uv = None
-    return tc.core.generate_mesh(Vectori(res), surface, normal, uv, smooth)
+    return generate(Vectori(res), surface, normal, uv, smooth)
 
 
 def create_sphere(res=(60, 60), smooth=True):
     res = Vectori(res)
 
     def surface(uv):
-        theta = uv.x * math.pi * 2
-        phi = -uv.y * math.pi
-        return Vector(math.cos(theta) * math.sin(phi), math.cos(phi), math.sin(theta) * math.sin(phi))
+        theta = uv[:, 0] * math.pi * 2
+        phi = -uv[:, 1] * math.pi
+        return np.stack([np.cos(theta) * np.sin(phi), np.cos(phi), np.sin(theta) * np.sin(phi)], axis=1)
 
     # norm = surf
-    return create_mesh_from_functions(res, surface, surface, smooth=smooth)
+    return create_mesh_from_functions(res, surface, surface, smooth=smooth, batched=True)
 
 
 def create_plane(res=(1, 1)):
     res = Vectori(res)
 
     def surface(uv):
-        return Vector(uv.x * 2 - 1, 0, -uv.y * 2 + 1)
+        return np.stack([uv[:, 0] * 2 - 1, np.zeros(len(uv)), -uv[:, 1] * 2 + 1], axis=1)
 
-    return create_mesh_from_functions(res, surface)
+    return create_mesh_from_functions(res, surface, batched=True)
 
 
 def rotate_y(v, r):
@@ -43,29 +52,35 @@ def rotate_y(v, r):
     return Vector(c * v.x + s * v.z, v.y, -s * v.x + c * v.z)
 
 
+# Of arrays of coordinates, rotated by an array of angles, into an n*3 array
+def rotate_y_batched(x, y, z, r):
+    c, s = np.cos(r), np.sin(r)
+    return np.stack([c * x + s * z, y, -s * x + c * z], axis=1)
+
+
 def create_torus(res=(100, 30), inner=0.5, outer=1.0, smooth=True):
     res = Vectori(res)
 
     def surface(uv):
-        theta = uv.x * math.pi * 2
-        phi = uv.y * math.pi * 2
+        theta = uv[:, 0] * math.pi * 2
+        phi = uv[:, 1] * math.pi * 2
         center = (inner + outer) / 2
         radius = outer - center
-        return rotate_y(Vector(center + radius * math.cos(phi), radius * math.sin(phi), 0), theta)
+        return rotate_y_batched(center + radius * np.cos(phi), radius * np.sin(phi), np.zeros(len(uv)), theta)
 
-    return create_mesh_from_functions(res, surface, smooth=smooth)
+    return create_mesh_from_functions(res, surface, smooth=smooth, batched=True)
 
 
 def create_mobius(res, radius, width, loops=1, smooth=True):
     res = Vectori(res)
 
     def surface(uv):
-        theta = uv.x * math.pi * 2
-        t = (uv.y - 0.5) * width
+        theta = uv[:, 0] * math.pi * 2
+        t = (uv[:, 1] - 0.5) * width
         phi = theta * loops
-        return rotate_y(Vector(radius + t * math.cos(phi), t * math.sin(phi), 0), theta)
+        return rotate_y_batched(radius + t * np.cos(phi), t * np.sin(phi), np.zeros(len(uv)), theta)
 
-    return create_mesh_from_functions(res, surface, smooth=smooth)
+    return create_mesh_from_functions(res, surface, smooth=smooth, batched=True)
 
 
 def create_merged(a, b):
@@ -182,32 +182,29 @@ def ndarray_to_array2d(array):
     if array.dtype == np.uint8:
         array = (array * (1 / 255.0)).astype(np.float32)
     assert array.dtype == np.float32
-    array = array.copy()
-    input_ptr = array.ctypes.data_as(ctypes.c_void_p).value
     if len(array.shape) == 2 or array.shape[2] == 1:
-        arr = taichi.core.Array2Dreal(0, 0)
+        arr = taichi.core.Array2Dreal(array.shape[0], array.shape[1])
+        array = array.reshape(array.shape[:2])
     elif array.shape[2] == 3:
-        arr = taichi.core.Array2DVector3(0, 0, taichi.Vector(0, 0, 0))
+        arr = taichi.core.Array2DVector3(array.shape[0], array.shape[1], taichi.Vector(0, 0, 0))
     elif array.shape[2] == 4:
-        arr = taichi.core.Array2DVector4(0, 0, taichi.Vector(0, 0, 0, 0))
+        arr = taichi.core.Array2DVector4(array.shape[0], array.shape[1], taichi.Vector(0, 0, 0, 0))
     else:
         assert False, 'ndarray has to be n*m, n*m*3, or n*m*4'
-    arr.from_ndarray(input_ptr, array.shape[0], array.shape[1])
+    array2d_view(arr)[...] = array
     return arr
 
 
+# A view of the storage of an Array1D, Array2D or Array3D, without copying. Writes go to the array, and
+# the view must not outlive it or be used after the array is resized.
+def array2d_view(arr):
+    return np.asarray(arr)
+
+
 def array2d_to_ndarray(arr):
-    if isinstance(arr, taichi.core.Array2DVector3):
-        ndarray = np.empty((arr.get_width(), arr.get_height(), 3), dtype='float32')
-    elif isinstance(arr, taichi.core.Array2DVector4):
-        ndarray = np.empty((arr.get_width(), arr.get_height(), 4), dtype='float32')
-    elif isinstance(arr, taichi.core.Array2Dreal):
-        ndarray = np.empty((arr.get_width(), arr.get_height()), dtype='float32')
-    else:
-        assert False, 'Array2d must have type real, Vector3, or Vector4'
-    output_ptr = ndarray.ctypes.data_as(ctypes.c_void_p).value
-    arr.to_ndarray(output_ptr)
-    return ndarray
+    assert isinstance(arr, (taichi.core.Array2DVector3, taichi.core.Array2DVector4, taichi.core.Array2Dreal)), \
+        'Array2d must have type real, Vector3, or Vector4'
+    return np.array(arr)
 
 
 def opencv_img_to_taichi_img(img):
@@ -1,4 +1,6 @@
 from unit_watcher import UnitWatcher
-from benchmark import Benchmark
+from benchmark import Benchmark, run_benchmarks, get_memory_report
+from startup import get_startup_report, print_startup_report
 
-__all__ = ['UnitWatcher', 'Benchmark']
\ No newline at end of file
+__all__ = ['UnitWatcher', 'Benchmark', 'run_benchmarks', 'get_memory_report', 'get_startup_report',
+           'print_startup_report']
\ No newline at end of file
@@ -1,7 +1,147 @@
+import datetime
+import json
+import multiprocessing
+import platform
+
+import numpy as np
+
 from taichi.core import unit
+from taichi.misc.settings import get_num_cores
 
 import taichi as tc
 
 @unit("benchmark")
 class Benchmark:
     pass
+
+
+# Configurations of registered benchmarks that can not run on the defaults of their config keys
+def get_default_config(name):
+    if name == 'cache':
+        return {'working_set_size': 2 ** 20, 'workload': 1000000, 'step': 7}
+    if name.startswith('jacobi_bf'):
+        return {'n': 64}
+    if name.startswith('jacobi_serial'):
+        return {'n': 128, 'iteration_method': 'relative_noif_inc_unroll4', 'ignore_boundary': 4}
+    if name.startswith('jacobi_simd'):
+        return {'n': 128, 'iteration_method': 'sse', 'ignore_boundary': 4}
+    if name == 'mpm3d':
+        return {'resolution': 32, 'particle_density': 8, 'num_threads': int(get_num_cores())}
+    return {}
+
+
+# Samples outside the Tukey fences, 1.5 interquartile ranges beyond the quartiles, are dropped
+def reject_outliers(samples):
+    q1, q3 = np.percentile(samples, [25, 75])
+    fence = 1.5 * (q3 - q1)
+    return [s for s in samples if q1 - fence <= s <= q3 + fence]
+
+
+def get_machine_info():
+    return {
+        'node': platform.node(),
+        'system': platform.system(),
+        'release': platform.release(),
+        'machine': platform.machine(),
+        'processor': platform.processor(),
+        'cpu_count': multiprocessing.cpu_count(),
+        'num_threads': int(get_num_cores()),
+        'python': platform.python_version(),
+    }
+
+
+# Bytes per memory tag, current and peak since the last tc.core.reset_memory_peaks()
+def get_memory_report():
+    report = {}
+    for record in tc.core.get_memory_records():
+        if record.peak > 0:
+            report[record.name] = {'current': record.current, 'peak': record.peak}
+    report['total'] = {'current': tc.core.get_current_memory_bytes(), 'peak': tc.core.get_peak_memory_bytes()}
+    return report
+
+
+# Runs a benchmark `repetitions` times after its warm-up. Times are seconds per unit of workload.
+def measure(name, config, repetitions, iterations):
+    config = dict(config)
+    config['returns_time'] = True
+    tc.core.reset_memory_peaks()
+    benchmark = Benchmark(name, **config)
+    samples = list(benchmark.run_repeated(repetitions, iterations))
+    memory = get_memory_report()
+    kept = reject_outliers(samples)
+    median = float(np.median(kept))
+    return {
+        'config': config,
+        'workload': benchmark.get_workload(),
+        'iterations': iterations,
+        'samples': samples,
+        'outliers': len(samples) - len(kept),
+        'median': median,
+        'p95': float(np.percentile(kept, 95)),
+        'mean': float(np.mean(kept)),
+        'stddev': float(np.std(kept)),
+        'throughput': 1.0 / median if median > 0 else 0.0,
+        'memory': memory,
+        'peak_memory': memory['total']['peak'],
+    }
+
+
+# Benchmarks whose median time, or peak memory, grew by more than `tolerance` over the baseline's
+def find_regressions(results, baseline, tolerance):
+    regressions = []
+    for name, result in results.items():
+        old = baseline.get('benchmarks', {}).get(name)
+        if 'median' not in result or not old or 'median' not in old:
+            continue
+        ratio = result['median'] / old['median']
+        result['baseline_ratio'] = ratio
+        if ratio > 1 + tolerance:
+            regressions.append(name)
+        if old.get('peak_memory', 0) > 0:
+            memory_ratio = float(result['peak_memory']) / old['peak_memory']
+            result['baseline_memory_ratio'] = memory_ratio
+            if memory_ratio > 1 + tolerance and name not in regressions:
+                regressions.append(name)
+    return sorted(regressions)
+
+
+# Runs the named benchmarks, or all registered ones, with configs from `configs` or get_default_config.
+# Returns the report, which is also written as JSON to `output` if given. With a `baseline` report file,
+# benchmarks slower than it by more than `tolerance` are listed under 'regressions'.
+def run_benchmarks(names=None, configs=None, repetitions=10, iterations=16, warm_up_iterations=4,
+                   baseline=None, output=None, tolerance=0.05):
+    if names is None:
+        names = tc.core.get_implementation_names('benchmark')
+    configs = configs or {}
+    results = {}
+    for name in names:
+        config = dict(configs.get(name, get_default_config(name)))
+        config.setdefault('warm_up_iterations', warm_up_iterations)
+        try:
+            result = measure(name, config, repetitions, iterations)
+            print '%-32s median %.3e s, p95 %.3e s, %.3e units/s (%d outliers), peak %.1f MB' % (
+                name, result['median'], result['p95'], result['throughput'], result['outliers'],
+                result['peak_memory'] / 2.0 ** 20)
+        except Exception as e:
+            result = {'config': config, 'error': str(e)}
+            print '%-32s failed: %s' % (name, e)
+        results[name] = result
+    report = {
+        'time': datetime.datetime.now().isoformat(),
+        'machine': get_machine_info(),
+        'repetitions': repetitions,
+        'benchmarks': results,
+    }
+    if baseline is not None:
+        with open(baseline) as f:
+            report['regressions'] = find_regressions(results, json.load(f), tolerance)
+        report['baseline'] = baseline
+        report['tolerance'] = tolerance
+        for name in report['regressions']:
+            print 'Regression: %s takes %.1f%% more time and %.1f%% more peak memory than the baseline' % (
+                name, 100 * (results[name]['baseline_ratio'] - 1),
+                100 * (results[name].get('baseline_memory_ratio', 1) - 1))
+    if output is not None:
+        with open(output, 'w') as f:
+            json.dump(report, f, indent=2, sort_keys=True)
+    return report
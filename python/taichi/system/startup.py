@@ -0,0 +1,22 @@
+from taichi.core import tc_core
+from taichi.core import load_core
+
+
+# Startup costs: loading the core library, then every registration and lazily built table so far, in seconds
+def get_startup_report():
+    records = [{'category': r.category, 'name': r.name, 'seconds': r.seconds}
+               for r in tc_core.get_startup_records()]
+    total = {}
+    for r in records:
+        total[r['category']] = total.get(r['category'], 0.0) + r['seconds']
+    return {'core_load': load_core.core_load_time, 'totals': total, 'records': records}
+
+
+# The `top` most expensive records, after the totals
+def print_startup_report(top=20):
+    report = get_startup_report()
+    print 'Core library loaded in %.1f ms' % (report['core_load'] * 1000)
+    for category, seconds in sorted(report['totals'].items()):
+        print '  %-14s %8.3f ms in all' % (category, seconds * 1000)
+    for r in sorted(report['records'], key=lambda r: -r['seconds'])[:top]:
+        print '  %-14s %8.3f ms  %s' % (r['category'], r['seconds'] * 1000, r['name'])
@@ -53,6 +53,15 @@ class FluidSimulator(Simulator):
 
         self.add_particles(samples)
 
+    # positions and velocities are n*2 arrays
+    def add_particle_arrays(self, positions, velocities=None):
+        self.simulator.add_particle_arrays(np.asarray(positions, dtype=np.float32) / self.delta_x, velocities)
+
+    # Copies of the positions and velocities of all particles, as n*2 arrays
+    def get_particle_arrays(self):
+        positions, velocities = self.simulator.get_particle_arrays()
+        return positions * self.delta_x, velocities
+
     def get_levelset_images(self, width, height, color_scheme):
         images = []
         images.append(self.levelset.get_image(width, height, color_scheme['boundary']))
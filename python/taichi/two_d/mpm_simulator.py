@@ -126,6 +126,20 @@ class MPMSimulator(Simulator):
             samples.append(particle)
         self.add_particles(samples)
 
+    # positions and velocities are n*2 arrays, and the material modifiers constants shared by all particles
+    def add_particle_arrays(self, positions, particle_type, velocities=None, **kwargs):
+        particle = self.create_particle(particle_type)
+        self.modify_particle(particle, kwargs, 0, 0)
+        if velocities is not None:
+            velocities = np.asarray(velocities, dtype=np.float32) / self.delta_x
+        self.simulator.add_particle_arrays(particle, np.asarray(positions, dtype=np.float32) / self.delta_x,
+                                           velocities)
+
+    # Copies of the positions and velocities of all particles, as n*2 arrays
+    def get_particle_arrays(self):
+        positions, velocities = self.simulator.get_particle_arrays()
+        return positions * self.delta_x, velocities * self.delta_x
+
     def add_particles(self, particles):
         for p in particles:
             if isinstance(p, tc_core.EPParticle):
@@ -2,7 +2,7 @@ from camera import Camera
 from renderer import Renderer
 from volume_material import VolumeMaterial
 from surface_material import SurfaceMaterial
-from scene import Scene
+from scene import Scene, load_concurrently
 from mesh import Mesh, create_volumetric_block
 from environment_map import EnvironmentMap
 from texture import Texture
@@ -12,4 +12,4 @@ import post_process
 
 __all__ = ['Camera', 'Renderer', 'VolumeMaterial', 'SurfaceMaterial',
            'Scene', 'Mesh', 'EnvironmentMap', 'Texture', 'post_process', 'color255', 'ImageReader',
-           'create_volumetric_block']
+           'create_volumetric_block', 'load_concurrently']
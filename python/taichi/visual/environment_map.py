@@ -11,3 +11,6 @@ class EnvironmentMap:
 
     def set_transform(self, transform):
         self.c.set_transform(transform)
+
+    def update(self):
+        self.c.update()
@@ -1,5 +1,9 @@
 import numpy as np
 
+from taichi.core import tc_core
+from taichi.misc.util import config_from_dict
+from taichi.misc.settings import get_num_cores
+
 
 class LDRDisplay:
     def __init__(self, exposure=1.0, adaptive_exposure=True, bloom_threshold=2, bloom_radius=0.01, gamma=2.2):
@@ -59,3 +63,32 @@ class FilmicToneMapping:
         whiteScale = 1.0 / Uncharted2Tonemap(W)
         img = curr * whiteScale
         return np.power(img.clip(0, 1), 1 / self.gamma)
+
+
+# Denoises renders before another post processor, guided by the feature buffers (albedo, normal and depth of first
+# hits) of the renderer, which are traced once per renderer. Other arguments configure the C++ denoiser.
+class Denoiser:
+    def __init__(self, then=None, name='atrous', feature_samples=4, **kwargs):
+        self.then = then if then is not None else LDRDisplay()
+        self.feature_samples = feature_samples
+        kwargs.setdefault('num_threads', get_num_cores())
+        self.c = tc_core.create_initialized_denoiser(name, config_from_dict(kwargs))
+        self.renderer = None
+        self.features = None
+
+    # renderer is the C++ renderer, and output its get_output()
+    def denoise(self, renderer, output):
+        if self.renderer is not renderer:
+            self.renderer = renderer
+            self.features = renderer.get_features(self.feature_samples)
+        return self.c.apply(output, self.features)
+
+    # After the scene changed, e.g. between frames of an animation
+    def reset_features(self):
+        self.renderer = None
+        self.features = None
+
+    def process(self, img):
+        if self.then is None:
+            return img
+        return self.then.process(img)
@@ -28,6 +28,7 @@ class Renderer(object):
         self.frame = frame
         self.viewer_started = False
         self.viewer_process = None
+        self.executor = None
         try:
             os.mkdir(self.output_dir)
         except Exception as e:
@@ -62,6 +63,13 @@ class Renderer(object):
 
         self.write('img%04d-%06d.png' % (self.frame, stages))
 
+    # Renders the stages in the background, returning a tc.core.AsyncTask to poll, wait on or add callbacks
+    # to. The renderer must be left alone until it is done.
+    def render_async(self, stages=1):
+        if self.executor is None:
+            self.executor = tc_core.AsyncExecutor()
+        return self.c.render_stages_async(self.executor, stages)
+
     def get_full_fn(self, fn):
         return self.output_dir + fn
 
@@ -71,6 +79,8 @@ class Renderer(object):
     # Returns numpy.ndarray
     def get_output(self):
         output = self.c.get_output()
+        if self.post_processor and hasattr(self.post_processor, 'denoise'):
+            output = self.post_processor.denoise(self.c, output)
         output = image_buffer_to_ndarray(output)
 
         if self.post_processor:
@@ -121,6 +131,8 @@ class Renderer(object):
     def __getattr__(self, key):
         return self.c.__getattribute__(key)
 
+    # Renderers of one scene share its acceleration structure, built by the first of them, so that e.g. the
+    # frames of a turntable only pay for it once. scene.clear_geometry_cache() releases it.
     def set_scene(self, scene):
         self.c.set_scene(scene.c)
 
@@ -1,8 +1,34 @@
+import threading
 import traceback
 
 from taichi.core import tc_core
 
 
+def load_concurrently(*loaders):
+    """
+    Calls each loader, e.g. lambda: Mesh('bunny', material=material), on a thread of its own and returns
+    their results in order. Meshes, textures and environment maps load without holding the GIL, so files
+    are read and parsed at the same time. The first exception raised by a loader is raised again.
+    """
+    results = [None] * len(loaders)
+    errors = []
+
+    def run(i):
+        try:
+            results[i] = loaders[i]()
+        except Exception as e:
+            errors.append(e)
+
+    threads = [threading.Thread(target=run, args=(i,)) for i in range(len(loaders))]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    if errors:
+        raise errors[0]
+    return results
+
+
 class Scene:
     def __init__(self):
         self.c = tc_core.create_scene()
@@ -10,6 +36,16 @@ class Scene:
     def add_mesh(self, mesh):
         self.c.add_mesh(mesh.c)
 
+    # Render particles (e.g. of a simulation's get_render_particles()) as spheres of radius and material,
+    # traced directly instead of being meshed or voxelized
+    def add_particles(self, particles, radius, material):
+        self.c.add_particles(particles, radius, material.c)
+
+    # The surface of a level set (dense, or a SparseLevelSet3D), e.g. of a liquid or an MPM material, placed by
+    # transform from simulation space and ray marched directly, so sequences need no meshing per frame
+    def add_level_set(self, level_set, transform, material):
+        self.c.add_level_set(level_set, transform, material.c)
+
     def __getattr__(self, key):
         return self.c.__getattribute__(key)
 
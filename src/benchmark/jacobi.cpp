@@ -11,6 +11,7 @@
 #include <immintrin.h>
 #include <taichi/system/benchmark.h>
 #include <taichi/system/threading.h>
+#include <taichi/math/temporal_blocking.h>
 
 
 #ifndef TC_DISABLE_SSE
@@ -401,6 +402,8 @@ protected:
     int n;
     int ignore;
     int num_threads;
+    // Sweeps per iteration, fused by temporal blocking, for sse_temporal
+    int temporal_steps;
 
     void (JacobiSIMD<T>::*iteration_method)();
 
@@ -415,8 +418,9 @@ public:
         ignore = config.get_int("ignore_boundary");
         std::string method = config.get_string("iteration_method");
         num_threads = config.get("num_threads", 1);
+        temporal_steps = method == "sse_temporal" ? config.get("temporal_steps", 8) : 1;
         assert_info((n & (n - 1)) == 0, "n should be a power of 2");
-        workload = (n - ignore * 2) * (n - ignore * 2) * (n - ignore * 2);
+        workload = (n - ignore * 2) * (n - ignore * 2) * (n - ignore * 2) * temporal_steps;
         for (int i = 0; i < 2; i++)
             data_[i].resize(n * n * n + 32);
         for (int i = 0; i < 2; i++) {
@@ -434,6 +438,8 @@ public:
             iteration_method = &JacobiSIMD<T>::iterate_sse_block;
         } else if (method == "sse_threaded") {
             iteration_method = &JacobiSIMD<T>::iterate_sse_threaded;
+        } else if (method == "sse_temporal") {
+            iteration_method = &JacobiSIMD<T>::iterate_sse_temporal;
         } else if (method == "avx") {
             iteration_method = &JacobiSIMD<T>::iterate_avx;
         } else {
@@ -456,13 +462,17 @@ public:
         Config cfg;
         cfg.set("n", 128);
         cfg.set("iteration_method", this->cfg.get_string("iteration_method"));
-        cfg.set("ignore_boundary", ignore);
+        // An ignored boundary would reach the interior after a few sweeps
+        cfg.set("ignore_boundary", temporal_steps > 1 ? 0 : ignore);
         cfg.set("num_threads", num_threads);
+        cfg.set("temporal_steps", temporal_steps);
         JacobiBruteForce<T> bf;
         JacobiSIMD<T> self;
         bf.initialize(cfg);
         bf.setup();
-        bf.iterate();
+        for (int i = 0; i < temporal_steps; i++) {
+            bf.iterate();
+        }
         self.initialize(cfg);
         self.setup();
         self.iterate();
@@ -523,10 +533,15 @@ public:
         }
     }
 
+    // Slab i of one sweep from src to dst, and its part of the boundary unless ignored
+    void iterate_slab_sse(const T *src, T *dst, int i);
+
     void iterate_sse();
 
     void iterate_sse_threaded();
 
+    void iterate_sse_temporal();
+
     void iterate_sse_prefetch();
 
     void iterate_sse_block();
@@ -670,6 +685,81 @@ void JacobiSIMD<double>::iterate_sse_block() {
     error("not implemented");
 }
 
+template<>
+void JacobiSIMD<float>::iterate_slab_sse(const float *src_, float *dst_, int i) {
+    const int boundary = 4;
+    const int b1 = boundary, b2 = n - boundary;
+    const float *__restrict src = src_;
+    float *__restrict dst = dst_;
+    auto iterate_cell = [&](int j, int k) {
+        const int p = i * n * n + j * n + k;
+        float t = 0;
+        if (i > 0)
+            t += src[p - n * n];
+        if (j > 0)
+            t += src[p - n];
+        if (k > 0)
+            t += src[p - 1];
+        if (i + 1 < n)
+            t += src[p + n * n];
+        if (j + 1 < n)
+            t += src[p + n];
+        if (k + 1 < n)
+            t += src[p + 1];
+        dst[p] = t * (1.0f / 6);
+    };
+    const bool inner_slab = b1 <= i && i < b2;
+    const bool compute_boundary = boundary > ignore;
+    if (!inner_slab && !compute_boundary) {
+        return;
+    }
+    const float one_over_six = float(1) / 6;
+    __m128 plus_i, minus_i, plus_j, minus_j, plus_k, minus_k;
+    __m128 c = _mm_broadcast_ss(&one_over_six);
+    for (int j = 0; j < n; j++) {
+        if (!inner_slab || j < b1 || j >= b2) {
+            for (int k = 0; k < n && compute_boundary; k++) {
+                iterate_cell(j, k);
+            }
+            continue;
+        }
+        for (int k = 0; k < b1 && compute_boundary; k++) {
+            iterate_cell(j, k);
+        }
+        int p_base = i * n * n + j * n;
+        for (int k = b1; k < b2; k += 4) {
+            int p = p_base + k;
+            FUSION_32_SSE
+        }
+        for (int k = b2; k < n && compute_boundary; k++) {
+            iterate_cell(j, k);
+        }
+    }
+}
+
+template<>
+void JacobiSIMD<double>::iterate_slab_sse(const double *src, double *dst, int i) {
+    error("not implemented");
+}
+
+// temporal_steps sweeps, fused into wavefronts over the i slabs, on num_threads threads
+template<>
+void JacobiSIMD<float>::iterate_sse_temporal() {
+    float *buffers[2] = {data[0], data[1]};
+    temporal_blocked_for(0, n, temporal_steps, num_threads, [&](int s, int i) {
+        iterate_slab_sse(buffers[s % 2], buffers[(s + 1) % 2], i);
+    }, temporal_steps);
+    // iterate() swaps the buffers once more
+    if (temporal_steps % 2 == 0) {
+        std::swap(data[0], data[1]);
+    }
+}
+
+template<>
+void JacobiSIMD<double>::iterate_sse_temporal() {
+    error("not implemented");
+}
+
 template<>
 void JacobiSIMD<float>::iterate_avx() {
 #ifdef TC_USE_AVX
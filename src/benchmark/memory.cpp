@@ -0,0 +1,356 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <thread>
+#include <random>
+#include <algorithm>
+#include <taichi/system/benchmark.h>
+#include <taichi/system/threading.h>
+#include <taichi/system/memory.h>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+TC_NAMESPACE_BEGIN
+
+// Memory hierarchy profile: bandwidth (stream, numa, gather_scatter) and latency (memory_latency).
+// Bandwidth benchmarks have bytes as their workload, so that run() reports cycles (or seconds, with
+// returns_time) per byte, the inverse of the bandwidth.
+
+// STREAM copy (a = b), scale (a = s * b) and triad (a = b + s * c) over arrays of n floats, split over threads.
+// Each thread first touches the pages it streams, so that they are on its NUMA node.
+//     kernel:      copy, scale or triad (default triad)
+//     n:           floats per array (default 2^24, 64MB, well beyond the last-level cache)
+//     num_threads: (default 1)
+class StreamBenchmark : public Benchmark {
+protected:
+    std::string kernel;
+    int n;
+    int num_threads;
+    UninitializedVector<float> a, b, c;
+
+    template <typename F>
+    void for_each_range(const F &f) const {
+        // Fixed ranges of whole cache lines, so that each thread keeps to the pages it first touched
+        const int chunks = std::max(num_threads, 1);
+        const int chunk_size = (n / chunks + 15) / 16 * 16;
+        ThreadedTaskManager::run(0, chunks, num_threads, [&](int t) {
+            f(std::min(n, t * chunk_size), std::min(n, (t + 1) * chunk_size));
+        });
+    }
+
+public:
+    void initialize(const Config &config) override {
+        Benchmark::initialize(config);
+        kernel = config.get("kernel", "triad");
+        n = config.get("n", 1 << 24);
+        num_threads = config.get("num_threads", 1);
+        assert_info(kernel == "copy" || kernel == "scale" || kernel == "triad",
+                    "Unknown stream kernel: " + kernel);
+        a.resize(n);
+        b.resize(n);
+        c.resize(kernel == "triad" ? n : 0);
+        // Bytes read and written
+        workload = (int64)n * sizeof(float) * (kernel == "triad" ? 3 : 2);
+    }
+
+protected:
+    void setup() override {
+        const bool triad = kernel == "triad";
+        for_each_range([&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                a[i] = 0.0f;
+                b[i] = 1.0f;
+                if (triad) {
+                    c[i] = 2.0f;
+                }
+            }
+        });
+    }
+
+    void iterate() override {
+        const float s = 3.0f;
+        float *__restrict pa = &a[0];
+        const float *__restrict pb = &b[0];
+        if (kernel == "copy") {
+            for_each_range([&](int begin, int end) {
+                for (int i = begin; i < end; i++) {
+                    pa[i] = pb[i];
+                }
+            });
+        } else if (kernel == "scale") {
+            for_each_range([&](int begin, int end) {
+                for (int i = begin; i < end; i++) {
+                    pa[i] = s * pb[i];
+                }
+            });
+        } else {
+            const float *__restrict pc = &c[0];
+            for_each_range([&](int begin, int end) {
+                for (int i = begin; i < end; i++) {
+                    pa[i] = pb[i] + s * pc[i];
+                }
+            });
+        }
+        dummy = (int)a[n / 2];
+    }
+};
+
+TC_IMPLEMENTATION(Benchmark, StreamBenchmark, "stream");
+
+// Load-to-use latency: a chain of dependent loads through a random cyclic permutation of the cache lines of the
+// working set, so that neither the prefetchers nor out-of-order execution can hide it. Sweeping working_set_size
+// through the cache sizes gives the latency of each level. The workload is the number of loads, so run() reports
+// cycles (or seconds) per load.
+//     working_set_size: bytes, a power of 2 of at least 128 (default 2^20)
+//     workload:         loads per iteration (default 2^20)
+class MemoryLatencyBenchmark : public Benchmark {
+protected:
+    static const int line_size = (int)tc_cache_line_size;
+    struct alignas(line_size) Line {
+        Line *next;
+    };
+    AlignedVector<Line> lines;
+    Line *current;
+
+public:
+    void initialize(const Config &config) override {
+        Benchmark::initialize(config);
+        workload = config.get("workload", 1LL << 20);
+        const int64 working_set_size = config.get("working_set_size", 1LL << 20);
+        assert_info(working_set_size >= 2 * line_size, "working_set_size should be at least two cache lines");
+        assert_info((working_set_size & (working_set_size - 1)) == 0, "working_set_size should be a power of 2");
+        const int n = (int)(working_set_size / line_size);
+        lines.resize(n);
+        // Sattolo's algorithm, for a single cycle through all lines
+        std::vector<int> order(n);
+        for (int i = 0; i < n; i++) {
+            order[i] = i;
+        }
+        std::mt19937 rng(0);
+        for (int i = n - 1; i > 0; i--) {
+            std::swap(order[i], order[std::uniform_int_distribution<int>(0, i - 1)(rng)]);
+        }
+        for (int i = 0; i < n; i++) {
+            lines[order[i]].next = &lines[order[(i + 1) % n]];
+        }
+        current = &lines[0];
+    }
+
+protected:
+    void iterate() override {
+        Line *p = current;
+        for (int64 i = 0; i < workload / 8; i++) {
+            p = p->next;
+            p = p->next;
+            p = p->next;
+            p = p->next;
+            p = p->next;
+            p = p->next;
+            p = p->next;
+            p = p->next;
+        }
+        current = p;
+        dummy = (int)(reinterpret_cast<uintptr_t>(p) & 0xff);
+    }
+};
+
+TC_IMPLEMENTATION(Benchmark, MemoryLatencyBenchmark, "memory_latency");
+
+// Read bandwidth of one thread on CPU read_cpu over n floats first touched by a thread on CPU touch_cpu, which
+// places them on touch_cpu's NUMA node. With both CPUs on one socket the bandwidth is local, and with CPUs on
+// different sockets it is remote. CPU pinning is Linux only; elsewhere both are wherever the scheduler puts them.
+//     touch_cpu: (default 0)
+//     read_cpu:  (default 0)
+//     n:         floats (default 2^24)
+class NUMABandwidthBenchmark : public Benchmark {
+protected:
+    int touch_cpu, read_cpu;
+    int n;
+    UninitializedVector<float> data;
+
+    template <typename F>
+    static void run_on_cpu(int cpu, const F &f) {
+        std::thread thread([&]() {
+#if defined(__linux__)
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+            f();
+        });
+        thread.join();
+    }
+
+public:
+    void initialize(const Config &config) override {
+        Benchmark::initialize(config);
+        touch_cpu = config.get("touch_cpu", 0);
+        read_cpu = config.get("read_cpu", 0);
+        n = config.get("n", 1 << 24);
+        const int num_cpus = (int)std::thread::hardware_concurrency();
+        assert_info(0 <= touch_cpu && touch_cpu < num_cpus && 0 <= read_cpu && read_cpu < num_cpus,
+                    "CPUs should be within [0, " + std::to_string(num_cpus) + ")");
+        data.resize(n);
+        workload = (int64)n * sizeof(float);
+    }
+
+protected:
+    void setup() override {
+        run_on_cpu(touch_cpu, [&]() {
+            for (int i = 0; i < n; i++) {
+                data[i] = 1.0f;
+            }
+        });
+    }
+
+    void iterate() override {
+        float sum = 0;
+        run_on_cpu(read_cpu, [&]() {
+            // Independent partial sums, so that the adds do not limit the bandwidth
+            float s[8] = {0};
+            for (int i = 0; i + 8 <= n; i += 8) {
+                for (int j = 0; j < 8; j++) {
+                    s[j] += data[i + j];
+                }
+            }
+            for (int j = 0; j < 8; j++) {
+                sum += s[j];
+            }
+        });
+        dummy = (int)sum;
+    }
+};
+
+TC_IMPLEMENTATION(Benchmark, NUMABandwidthBenchmark, "numa");
+
+// The grid accesses of MPM transfers: each particle gathers (G2P) or scatters (P2G) the 4x4x4 nodes around it
+// with weights, on a grid of resolution^3 nodes. Particles are processed in x-slabs of 8 nodes, one thread per
+// slab, even slabs before odd ones when scattering so that no two threads write a node at once. The workload is
+// the bytes of node data accessed, 64 * 4 per particle for gathers and twice that (read and write) for scatters.
+//     mode:               gather or scatter (default gather)
+//     resolution:         (default 128)
+//     particles_per_cell: over the whole grid (default 1)
+//     sorted:             particles sorted by cell, as after MPM's sorting, instead of random (default true)
+//     num_threads:        (default 1)
+class GatherScatterBenchmark : public Benchmark {
+protected:
+    static const int slab_size = 8;
+    bool scatter;
+    int resolution;
+    int num_threads;
+    std::vector<float> grid;
+    // Of the particles of each slab, positions in nodes
+    std::vector<std::vector<float>> positions;
+
+    int get_index(int i, int j, int k) const {
+        return (i * resolution + j) * resolution + k;
+    }
+
+    void gather(const std::vector<float> &slab, float &sum) const {
+        for (int p = 0; p + 3 <= (int)slab.size(); p += 3) {
+            const int bx = (int)slab[p] - 1, by = (int)slab[p + 1] - 1, bz = (int)slab[p + 2] - 1;
+            const float fx = slab[p] - bx, fy = slab[p + 1] - by, fz = slab[p + 2] - bz;
+            float s = 0;
+            for (int i = 0; i < 4; i++) {
+                for (int j = 0; j < 4; j++) {
+                    const float *row = &grid[get_index(bx + i, by + j, bz)];
+                    const float w = (fx - i) * (fy - j);
+                    s += w * (row[0] * fz + row[1] * (fz - 1) + row[2] * (fz - 2) + row[3] * (fz - 3));
+                }
+            }
+            sum += s;
+        }
+    }
+
+    void scatter_to_grid(const std::vector<float> &slab) {
+        for (int p = 0; p + 3 <= (int)slab.size(); p += 3) {
+            const int bx = (int)slab[p] - 1, by = (int)slab[p + 1] - 1, bz = (int)slab[p + 2] - 1;
+            const float fx = slab[p] - bx, fy = slab[p + 1] - by, fz = slab[p + 2] - bz;
+            for (int i = 0; i < 4; i++) {
+                for (int j = 0; j < 4; j++) {
+                    float *row = &grid[get_index(bx + i, by + j, bz)];
+                    const float w = (fx - i) * (fy - j) * 1e-6f;
+                    row[0] += w * fz;
+                    row[1] += w * (fz - 1);
+                    row[2] += w * (fz - 2);
+                    row[3] += w * (fz - 3);
+                }
+            }
+        }
+    }
+
+public:
+    void initialize(const Config &config) override {
+        Benchmark::initialize(config);
+        const std::string mode = config.get("mode", "gather");
+        assert_info(mode == "gather" || mode == "scatter", "Unknown gather_scatter mode: " + mode);
+        scatter = mode == "scatter";
+        resolution = config.get("resolution", 128);
+        const real particles_per_cell = config.get("particles_per_cell", 1.0f);
+        const bool sorted = config.get("sorted", true);
+        num_threads = config.get("num_threads", 1);
+        assert_info(resolution >= 2 * slab_size, "resolution should be at least 16");
+        grid.assign((size_t)resolution * resolution * resolution, 1.0f);
+        // Particles stay 1 node away from the grid boundary, so that the stencils are inside
+        const int num_particles = (int)(particles_per_cell * std::pow(real(resolution - 4), 3.0f));
+        const float range = resolution - 4.0f;
+        std::mt19937 rng(0);
+        std::uniform_real_distribution<float> uniform(0.0f, range);
+        positions.assign((resolution + slab_size - 1) / slab_size, std::vector<float>());
+        std::vector<std::vector<std::pair<int, int>>> keys(positions.size());
+        std::vector<std::vector<float>> unsorted(positions.size());
+        for (int p = 0; p < num_particles; p++) {
+            const float x = 1.5f + uniform(rng), y = 1.5f + uniform(rng), z = 1.5f + uniform(rng);
+            const int slab = (int)(x - 1) / slab_size;
+            keys[slab].push_back(std::make_pair(get_index((int)x, (int)y, (int)z), (int)keys[slab].size()));
+            unsorted[slab].insert(unsorted[slab].end(), {x, y, z});
+        }
+        for (int s = 0; s < (int)positions.size(); s++) {
+            if (sorted) {
+                std::sort(keys[s].begin(), keys[s].end());
+            }
+            for (auto &key : keys[s]) {
+                positions[s].insert(positions[s].end(), unsorted[s].begin() + key.second * 3,
+                                    unsorted[s].begin() + key.second * 3 + 3);
+            }
+        }
+        workload = (int64)num_particles * 64 * sizeof(float) * (scatter ? 2 : 1);
+    }
+
+protected:
+    void iterate() override {
+        const int num_slabs = (int)positions.size();
+        if (scatter) {
+            for (int parity = 0; parity < 2; parity++) {
+                ThreadedTaskManager::run((num_slabs + 1 - parity) / 2, num_threads, [&](int s) {
+                    scatter_to_grid(positions[s * 2 + parity]);
+                });
+            }
+            dummy = (int)grid[get_index(resolution / 2, resolution / 2, resolution / 2)];
+        } else {
+            std::vector<float> sums(num_slabs, 0.0f);
+            ThreadedTaskManager::run(num_slabs, num_threads, [&](int s) {
+                gather(positions[s], sums[s]);
+            });
+            float sum = 0;
+            for (auto s : sums) {
+                sum += s;
+            }
+            dummy = (int)sum;
+        }
+    }
+};
+
+TC_IMPLEMENTATION(Benchmark, GatherScatterBenchmark, "gather_scatter");
+
+TC_NAMESPACE_END
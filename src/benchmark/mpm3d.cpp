@@ -0,0 +1,104 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/benchmark.h>
+#include <taichi/dynamics/simulation3d.h>
+#include <taichi/math/levelset_3d.h>
+#include <taichi/common/asset_manager.h>
+#include <taichi/visual/texture.h>
+
+TC_NAMESPACE_BEGIN
+
+// `density` particles per cell inside the box [lower, upper], in normalized coordinates
+class MPM3DBenchmarkBlock : public Texture {
+protected:
+    Vector3 lower, upper;
+    real density;
+public:
+    MPM3DBenchmarkBlock(const Vector3 &lower, const Vector3 &upper, real density)
+            : lower(lower), upper(upper), density(density) {}
+
+    Vector4 sample(const Vector3 &coord) const override {
+        bool inside = lower.x <= coord.x && coord.x < upper.x && lower.y <= coord.y && coord.y < upper.y &&
+                      lower.z <= coord.z && coord.z < upper.z;
+        return Vector4(inside ? density : 0.0f);
+    }
+};
+
+// A block of snow next to a block of elastic material, dropped onto the floor of a closed box.
+// Each iteration is one substep, and the workload is the number of particles, so run() reports
+// cycles (or seconds, with returns_time) per particle per substep.
+// Config keys other than those below are passed on to the simulator, e.g. async or fused_p2g.
+//     resolution:       grid cells per dimension (default 64)
+//     particle_density: particles per cell inside the blocks (default 8)
+//     num_threads:      simulator threads (default 1)
+// get_profile() has the simulator's phase timings over the timed iterations only.
+class MPM3DBenchmark : public Benchmark {
+protected:
+    std::shared_ptr<Simulation3D> simulation;
+    int iteration;
+
+public:
+    void initialize(const Config &config_) override {
+        Benchmark::initialize(config_);
+        Config config = config_;
+        const int n = config.get("resolution", 64);
+        const real particle_density = config.get("particle_density", 8.0f);
+        assert_info(n >= 16, "MPM3D benchmark needs a resolution of at least 16");
+        config.set("resolution", Vector3i(n));
+        config.set("gravity", config.get("gravity", Vector3(0, -10, 0)));
+        config.set("base_delta_t", config.get("base_delta_t", 1e-3f));
+        config.set("num_threads", config.get("num_threads", 1));
+        simulation = create_instance<Simulation3D>("mpm", config);
+
+        LevelSet3D levelset(n + 1, n + 1, n + 1, Vector3(0.5f));
+        levelset.add_cuboid(Vector3(2), Vector3(real(n - 2)), true);
+        DynamicLevelSet3D dynamic_levelset;
+        dynamic_levelset.initialize(0, 1, levelset, levelset);
+        simulation->set_levelset(dynamic_levelset);
+
+        // Snow hardens under compression; the elastic block never yields
+        add_block(Vector3(0.1f, 0.1f, 0.25f), Vector3(0.48f, 0.6f, 0.75f), particle_density,
+                  Config().set("type", "ep"));
+        add_block(Vector3(0.52f, 0.1f, 0.25f), Vector3(0.9f, 0.6f, 0.75f), particle_density,
+                  Config().set("type", "ep").set("hardening", 0.0f).set("theta_c", 1e30f).set("theta_s", 1e30f));
+        workload = (int64)simulation->get_render_particles().size();
+        assert_info(workload > 0, "MPM3D benchmark seeded no particles");
+    }
+
+    std::vector<ProfilerRecord> get_profile() const override {
+        return simulation->get_profile();
+    }
+
+protected:
+    void add_block(const Vector3 &lower, const Vector3 &upper, real density, Config config) {
+        std::shared_ptr<Texture> texture = std::make_shared<MPM3DBenchmarkBlock>(lower, upper, density);
+        config.set("density_tex", AssetManager::insert_asset(texture));
+        simulation->add_particles(config);
+    }
+
+    void setup() override {
+        iteration = 0;
+        if (warm_up_iterations == 0) {
+            simulation->reset_profile();
+        }
+    }
+
+    void iterate() override {
+        simulation->step(-1);
+        iteration++;
+        if (iteration == warm_up_iterations) {
+            simulation->reset_profile();
+        }
+    }
+};
+
+TC_IMPLEMENTATION(Benchmark, MPM3DBenchmark, "mpm3d");
+
+TC_NAMESPACE_END
@@ -38,7 +38,32 @@ public:
             dir + rand_offset.x * tan_half_fov * right * aspect_ratio + rand_offset.y * tan_half_fov * up);
         Vector3 world_orig = multiply_matrix4(transform, origin, 1);
         Vector3 world_dir = normalized(multiply_matrix4(transform, local_dir, 0)); //TODO: why normalize here???
-        return Ray(world_orig, world_dir, 0);
+        Ray ray(world_orig, world_dir, 0);
+        ray.cone_spread = tan_half_fov * size.y;
+        return ray;
+    }
+
+    // The frame is transformed once per batch, and directions are then normalized once, eight at a time
+    void generate_rays(int n, const Vector2 *offsets, Vector2 size, StateSequence *const *rands, Ray *out) override {
+        const Vector3 world_orig = get_origin(), world_dir = get_dir();
+        const Vector3 world_right = multiply_matrix4(transform, right * (tan_half_fov * aspect_ratio), 0);
+        const Vector3 world_up = multiply_matrix4(transform, up * tan_half_fov, 0);
+        real x[ray_batch_size], y[ray_batch_size], dx[ray_batch_size], dy[ray_batch_size], dz[ray_batch_size];
+        for (int begin = 0; begin < n; begin += ray_batch_size) {
+            const int m = std::min(n - begin, int(ray_batch_size));
+            for (int k = 0; k < m; k++) {
+                StateSequence &rand = *rands[begin + k];
+                Vector2 rand_offset = random_offset(offsets[begin + k], size, rand(), rand());
+                x[k] = rand_offset.x;
+                y[k] = rand_offset.y;
+            }
+            get_directions(m, x, y, world_dir, world_right, world_up, dx, dy, dz);
+            for (int k = 0; k < m; k++) {
+                Ray &ray = out[begin + k];
+                ray = Ray(world_orig, Vector3(dx[k], dy[k], dz[k]), 0);
+                ray.cone_spread = tan_half_fov * size.y;
+            }
+        }
     }
 
     void get_pixel_coordinate(Vector3 ray_dir, real &u, real &v) override {
@@ -52,7 +52,38 @@ public:
             (dot(focus - get_origin(), get_dir()) / dot(get_dir(), world_dir));
         Vector2 uv = sample_lens(rand.next2());
         Vector3 orig = get_origin() + aperture * (uv[0] * right + uv[1] * up);
-        return Ray(orig, normalized(focus_point - orig));
+        Ray ray(orig, normalized(focus_point - orig));
+        ray.cone_spread = tan_half_fov * size.y;
+        return ray;
+    }
+
+    // As PinholeCamera::generate_rays(), with each ray then refocused through its lens sample
+    void generate_rays(int n, const Vector2 *offsets, Vector2 size, StateSequence *const *rands, Ray *out) override {
+        const Vector3 world_orig = get_origin(), world_dir = get_dir();
+        const Vector3 world_right = multiply_matrix4(transform, right * (tan_half_fov * aspect_ratio), 0);
+        const Vector3 world_up = multiply_matrix4(transform, up * tan_half_fov, 0);
+        const real focal_distance = dot(focus - world_orig, world_dir);
+        real x[ray_batch_size], y[ray_batch_size], dx[ray_batch_size], dy[ray_batch_size], dz[ray_batch_size];
+        Vector2 lens[ray_batch_size];
+        for (int begin = 0; begin < n; begin += ray_batch_size) {
+            const int m = std::min(n - begin, int(ray_batch_size));
+            for (int k = 0; k < m; k++) {
+                StateSequence &rand = *rands[begin + k];
+                Vector2 rand_offset = random_offset(offsets[begin + k], size, rand(), rand());
+                x[k] = rand_offset.x;
+                y[k] = rand_offset.y;
+                lens[k] = sample_lens(rand.next2());
+            }
+            get_directions(m, x, y, world_dir, world_right, world_up, dx, dy, dz);
+            for (int k = 0; k < m; k++) {
+                const Vector3 d(dx[k], dy[k], dz[k]);
+                const Vector3 focus_point = world_orig + d * (focal_distance / dot(world_dir, d));
+                const Vector3 orig = world_orig + aperture * (lens[k][0] * right + lens[k][1] * up);
+                Ray &ray = out[begin + k];
+                ray = Ray(orig, normalized(focus_point - orig));
+                ray.cone_spread = tan_half_fov * size.y;
+            }
+        }
     }
 
     void get_pixel_coordinate(Vector3 ray_dir, real &u, real &v) override {
@@ -17,11 +17,17 @@ BSDF::BSDF(std::shared_ptr<Scene> const &scene, const IntersectionInfo &inter) {
     world_to_local = Matrix3(inter.to_local);
     local_to_world = Matrix3(inter.to_world);
     geometry_normal = inter.geometry_normal;
-    if (inter.material == nullptr)
-        material = scene->get_mesh_from_triangle_id(inter.triangle_id)->material.get();
-    else
+    if (inter.material != nullptr) {
         material = inter.material;
+    } else if (inter.material_id != -1) {
+        material_table = &scene->material_table;
+        material_id = inter.material_id;
+        material = (*material_table)[material_id].material;
+    } else {
+        material = scene->get_mesh_from_triangle_id(inter.triangle_id)->material.get();
+    }
     uv = inter.uv;
+    uv_footprint = inter.uv_footprint;
     front = inter.front;
 }
 
@@ -33,7 +39,13 @@ BSDF::BSDF(std::shared_ptr<Scene> const &scene, int triangle_id) { // initialize
     local_to_world = Matrix3(u, v, t.normal);
     world_to_local = glm::transpose(local_to_world);
     geometry_normal = t.normal;
-    material = scene->get_mesh_from_triangle_id(triangle_id)->material.get();
+    material_id = scene->triangle_material_ids[triangle_id];
+    if (material_id != -1) {
+        material_table = &scene->material_table;
+        material = (*material_table)[material_id].material;
+    } else {
+        material = scene->get_mesh_from_triangle_id(triangle_id)->material.get();
+    }
     uv = Vector2(0.5f);
 }
 
@@ -41,12 +53,20 @@ void BSDF::sample(const Vector3 &in_dir, real u, real v, Vector3 &out_dir,
     Vector3 &f, real &pdf, SurfaceEvent &event) const {
     const Vector3 in_dir_local = world_to_local * in_dir;
     Vector3 out_dir_local;
-    material->sample(in_dir_local, u, v, out_dir_local, f, pdf, event, uv);
+    TextureFootprint footprint(uv_footprint);
+    if (material_id != -1) {
+        material_table->sample(material_id, in_dir_local, u, v, out_dir_local, f, pdf, event, uv);
+    } else {
+        material->sample(in_dir_local, u, v, out_dir_local, f, pdf, event, uv);
+    }
     out_dir = local_to_world * out_dir_local;
 }
 
 real BSDF::probability_density(const Vector3 &in, const Vector3 &out) const {
-    real pdf = material->probability_density(world_to_local * in, world_to_local * out, uv);
+    const Vector3 in_local = world_to_local * in, out_local = world_to_local * out;
+    TextureFootprint footprint(uv_footprint);
+    real pdf = material_id != -1 ? material_table->probability_density(material_id, in_local, out_local, uv)
+                                 : material->probability_density(in_local, out_local, uv);
     assert_info(pdf >= 0, "PDF should be non-negative: " + std::to_string(pdf));
     return pdf;
 }
@@ -56,19 +76,22 @@ Vector3 BSDF::evaluate(const Vector3 &in, const Vector3 &out) const {
         // for shaded/interpolated normal consistency
         return Vector3(0.0f);
     }
-    Vector3 output = material->evaluate_bsdf(world_to_local * in, world_to_local * out, uv);
+    const Vector3 in_local = world_to_local * in, out_local = world_to_local * out;
+    TextureFootprint footprint(uv_footprint);
+    Vector3 output = material_id != -1 ? material_table->evaluate_bsdf(material_id, in_local, out_local, uv)
+                                       : material->evaluate_bsdf(in_local, out_local, uv);
     assert_info(output.r >= 0 && output.g >= 0 && output.b >= 0, "BSDF should be non-negative.");
     return output;
 }
 
 bool BSDF::is_delta() const {
     assert_info(material != nullptr, "material is empty!");
-    return material->is_delta();
+    return material_id != -1 ? (*material_table)[material_id].delta : material->is_delta();
 }
 
 bool BSDF::is_emissive() const {
     assert_info(material != nullptr, "material is empty!");
-    return material->is_emissive();
+    return material_id != -1 ? (*material_table)[material_id].emissive : material->is_emissive();
 }
 
 TC_NAMESPACE_END
@@ -15,6 +15,7 @@
 #include <taichi/visual/texture.h>
 #include <taichi/visual/envmap.h>
 #include <taichi/image/tone_mapper.h>
+#include <taichi/image/denoiser.h>
 #include <taichi/io/image_reader.h>
 #include <taichi/math/sdf.h>
 #include <taichi/visual/renderer.h>
@@ -27,6 +28,7 @@
 #include <taichi/visual/framebuffer.h>
 #include <taichi/visualization/particle_visualization.h>
 #include <taichi/system/benchmark.h>
+#include <taichi/system/communicator.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -35,6 +37,7 @@ TC_INTERFACE_DEF(Simulation3D, "simulation3d")
 TC_INTERFACE_DEF(Texture, "texture")
 TC_INTERFACE_DEF(EnvironmentMap, "envmap")
 TC_INTERFACE_DEF(ToneMapper, "tone_mapper")
+TC_INTERFACE_DEF(Denoiser, "denoiser")
 TC_INTERFACE_DEF(ImageReader, "image_reader")
 TC_INTERFACE_DEF(SDF, "sdf")
 TC_INTERFACE_DEF(Renderer, "renderer")
@@ -48,5 +51,6 @@ TC_INTERFACE_DEF(Fluid, "fluid")
 TC_INTERFACE_DEF(RayIntersection, "ray_intersection")
 TC_INTERFACE_DEF(ParticleRenderer, "particle_renderer")
 TC_INTERFACE_DEF(Benchmark, "benchmark")
+TC_INTERFACE_DEF(Communicator, "communicator")
 
 TC_NAMESPACE_END
@@ -0,0 +1,291 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/image/denoiser.h>
+#include <taichi/system/threading.h>
+#include <taichi/physics/physics_constants.h>
+#include <vector>
+
+#if !defined(TC_DISABLE_SSE)
+#include <immintrin.h>
+#endif
+
+TC_NAMESPACE_BEGIN
+
+// exp(x) for x <= 0, to about 1e-4 relative: 2^n times a polynomial of 2^f, for x / ln 2 = n + f
+inline real denoiser_exp(real x) {
+    const real y = std::max(x, -80.0f) * 1.44269504f;
+    const real n = std::floor(y);
+    const real f = y - n;
+    const real p = 1 + f * (0.693147f + f * (0.240227f + f * (0.0555041f + f * (0.00961813f + f * 0.00133336f))));
+    return std::ldexp(p, (int)n);
+}
+
+#if !defined(TC_DISABLE_SSE)
+inline __m128 denoiser_exp(__m128 x) {
+    const __m128 y = _mm_mul_ps(_mm_max_ps(x, _mm_set1_ps(-80.0f)), _mm_set1_ps(1.44269504f));
+    // floor(y), from its truncation
+    __m128 n = _mm_cvtepi32_ps(_mm_cvttps_epi32(y));
+    n = _mm_sub_ps(n, _mm_and_ps(_mm_cmpgt_ps(n, y), _mm_set1_ps(1.0f)));
+    const __m128 f = _mm_sub_ps(y, n);
+    __m128 p = _mm_set1_ps(0.00133336f);
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.00961813f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.0555041f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.240227f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.693147f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f));
+    // 2^n, by its exponent bits
+    const __m128i e = _mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(n), _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(e));
+}
+#endif
+
+// The edge-avoiding a-trous wavelet filter of Dammertz et al. (2010), with the luminance weights of SVGF
+// (Schied et al. 2017): passes of a 5x5 B3 spline kernel with taps 2^pass pixels apart, weighted by how alike
+// pixels are in luminance, relative to its standard deviation, and in features. The variance starts as that of
+// 3x3 neighborhoods, and is filtered along, so that luminance edges sharpen as the noise goes. Colors are divided
+// by albedo while filtering, so that textures are kept, and their luminance compared as l / (1 + l), so that
+// fireflies do not dominate. Depths are compared relative to the depth of the pixel, per pixel of tap distance.
+class AtrousDenoiser final : public Denoiser {
+protected:
+    int num_passes;
+    real sigma_luminance, sigma_normal, sigma_depth, sigma_albedo;
+    int num_threads;
+
+    // Buffers by (i * height + j), as Array2D: color, the luminance compared and its variance
+    struct Planes {
+        int width = 0, height = 0;
+        std::vector<float> data[5];
+
+        void resize(int width, int height) {
+            this->width = width;
+            this->height = height;
+            for (auto &plane : data) {
+                plane.resize(width * height);
+            }
+        }
+    };
+
+    // Albedo, normal and depth
+    struct Features {
+        std::vector<float> data[7];
+    };
+
+    struct Weights {
+        real inv_sigma_luminance, inv_normal2, inv_albedo2, inv_depth2;
+    };
+
+public:
+    void initialize(const Config &config) override {
+        num_passes = config.get("num_passes", 5);
+        sigma_luminance = config.get("sigma_luminance", 4.0f);
+        sigma_normal = config.get("sigma_normal", 0.3f);
+        sigma_depth = config.get("sigma_depth", 0.02f);
+        sigma_albedo = config.get("sigma_albedo", 0.1f);
+        num_threads = config.get("num_threads", 1);
+    }
+
+    Array2D<Vector3> apply(const Array2D<Vector3> &color, const FeatureBuffers &features) override {
+        const int width = color.get_width(), height = color.get_height();
+        const bool guided = !features.empty();
+        if (guided) {
+            assert_info(features.albedo.get_width() == width && features.albedo.get_height() == height,
+                        "Feature buffers should be of the resolution of the image");
+        }
+        // Albedos are offset to keep dark ones from amplifying noise
+        const real albedo_offset = 0.01f;
+        Features f;
+        for (auto &plane : f.data) {
+            plane.assign(width * height, 0.0f);
+        }
+        Planes in, out;
+        in.resize(width, height);
+        out.resize(width, height);
+        for (int n = 0; n < width * height; n++) {
+            const int i = n / height, j = n % height;
+            const Vector3 albedo = guided ? features.albedo[i][j] : Vector3(1.0f);
+            for (int k = 0; k < 3; k++) {
+                in.data[k][n] = color[i][j][k] / (albedo[k] + albedo_offset);
+                f.data[k][n] = albedo[k];
+                if (guided) {
+                    f.data[3 + k][n] = features.normal[i][j][k];
+                }
+            }
+            f.data[6][n] = guided ? features.depth[i][j] : 0.0f;
+        }
+        update_luminance(in);
+        ThreadedTaskManager::run([&](int i) {
+            for (int j = 0; j < height; j++) {
+                real sum = 0, sum2 = 0;
+                int count = 0;
+                for (int x = std::max(i - 1, 0); x <= std::min(i + 1, width - 1); x++) {
+                    for (int y = std::max(j - 1, 0); y <= std::min(j + 1, height - 1); y++) {
+                        const real l = in.data[3][x * height + y];
+                        sum += l;
+                        sum2 += l * l;
+                        count++;
+                    }
+                }
+                in.data[4][i * height + j] = std::max(0.0f, sum2 / count - sqr(sum / count));
+            }
+        }, 0, width, num_threads);
+        const Weights weights{1 / sigma_luminance, 1 / (sigma_normal * sigma_normal),
+                              1 / (sigma_albedo * sigma_albedo), 1 / (sigma_depth * sigma_depth)};
+        for (int pass = 0; pass < num_passes; pass++) {
+            filter_pass(in, out, f, 1 << pass, weights);
+            std::swap(in, out);
+            update_luminance(in);
+        }
+        Array2D<Vector3> result(width, height);
+        for (int n = 0; n < width * height; n++) {
+            const int i = n / height, j = n % height;
+            for (int k = 0; k < 3; k++) {
+                result[i][j][k] = in.data[k][n] * (f.data[k][n] + albedo_offset);
+            }
+        }
+        return result;
+    }
+
+protected:
+    static void update_luminance(Planes &planes) {
+        for (int n = 0; n < planes.width * planes.height; n++) {
+            const real l = std::max(0.0f, luminance(Vector3(planes.data[0][n], planes.data[1][n], planes.data[2][n])));
+            planes.data[3][n] = l / (1 + l);
+        }
+    }
+
+    // Weights are below 2^-80 at this far from the mean, in standard deviations, so the deviation is kept above
+    // that of a step of luminance at its precision
+    static constexpr real min_deviation = 1e-4f;
+
+    void filter_pass(const Planes &in, Planes &out, const Features &f, int step, const Weights &weights) const {
+        const int width = in.width, height = in.height;
+        auto filter = [&](int i, int j) {
+            const int n = i * height + j;
+            real sum[3] = {0, 0, 0}, weight_sum = 0, variance_sum = 0;
+            const real depth = f.data[6][n];
+            const real inv_depth = depth > 0 ? 1 / depth : 0;
+            const real inv_deviation =
+                    weights.inv_sigma_luminance / (std::sqrt(in.data[4][n]) + min_deviation);
+            for (int dx = -2; dx <= 2; dx++) {
+                const int x = i + dx * step;
+                if (x < 0 || x >= width) {
+                    continue;
+                }
+                for (int dy = -2; dy <= 2; dy++) {
+                    const int y = j + dy * step;
+                    if (y < 0 || y >= height) {
+                        continue;
+                    }
+                    const int m = x * height + y;
+                    real e = std::abs(in.data[3][m] - in.data[3][n]) * inv_deviation, d;
+                    for (int k = 0; k < 3; k++) {
+                        d = f.data[k][m] - f.data[k][n];
+                        e += d * d * weights.inv_albedo2;
+                        d = f.data[3 + k][m] - f.data[3 + k][n];
+                        e += d * d * weights.inv_normal2;
+                    }
+                    d = (f.data[6][m] - depth) * inv_depth;
+                    e += d * d * weights.inv_depth2 / real((dx * dx + dy * dy) * step * step + 1);
+                    const real w = kernel[dx + 2] * kernel[dy + 2] * denoiser_exp(-e);
+                    for (int k = 0; k < 3; k++) {
+                        sum[k] += w * in.data[k][m];
+                    }
+                    weight_sum += w;
+                    variance_sum += w * w * in.data[4][m];
+                }
+            }
+            for (int k = 0; k < 3; k++) {
+                out.data[k][n] = sum[k] / weight_sum;
+            }
+            out.data[4][n] = variance_sum / (weight_sum * weight_sum);
+        };
+        ThreadedTaskManager::run([&](int i) {
+            int j = 0;
+#if !defined(TC_DISABLE_SSE)
+            // Four pixels of a column at once, where all their taps are within the image
+            for (j = 2 * step; j + 4 + 2 * step <= height; j += 4) {
+                filter4(in, out, f, i, j, step, weights);
+            }
+            for (int y = 0; y < std::min(2 * step, height); y++) {
+                filter(i, y);
+            }
+#endif
+            for (; j < height; j++) {
+                filter(i, j);
+            }
+        }, 0, width, num_threads);
+    }
+
+#if !defined(TC_DISABLE_SSE)
+    void filter4(const Planes &in, Planes &out, const Features &f, int i, int j, int step,
+                 const Weights &weights) const {
+        const int width = in.width, height = in.height;
+        const int n = i * height + j;
+        const __m128 center_l = _mm_loadu_ps(&in.data[3][n]);
+        __m128 center_f[6];
+        for (int k = 0; k < 6; k++) {
+            center_f[k] = _mm_loadu_ps(&f.data[k][n]);
+        }
+        const __m128 depth = _mm_loadu_ps(&f.data[6][n]);
+        const __m128 inv_depth = _mm_and_ps(_mm_div_ps(_mm_set1_ps(1.0f), depth),
+                                            _mm_cmpgt_ps(depth, _mm_setzero_ps()));
+        const __m128 inv_deviation = _mm_div_ps(
+                _mm_set1_ps(weights.inv_sigma_luminance),
+                _mm_add_ps(_mm_sqrt_ps(_mm_loadu_ps(&in.data[4][n])), _mm_set1_ps(min_deviation)));
+        const __m128 albedo_scale = _mm_set1_ps(weights.inv_albedo2);
+        const __m128 normal_scale = _mm_set1_ps(weights.inv_normal2);
+        const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+        __m128 sum[3] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+        __m128 weight_sum = _mm_setzero_ps(), variance_sum = _mm_setzero_ps();
+        auto add_squared = [](__m128 e, __m128 a, __m128 b, __m128 scale) {
+            const __m128 d = _mm_sub_ps(a, b);
+            return _mm_add_ps(e, _mm_mul_ps(_mm_mul_ps(d, d), scale));
+        };
+        for (int dx = -2; dx <= 2; dx++) {
+            const int x = i + dx * step;
+            if (x < 0 || x >= width) {
+                continue;
+            }
+            for (int dy = -2; dy <= 2; dy++) {
+                const int m = x * height + j + dy * step;
+                __m128 e = _mm_mul_ps(_mm_and_ps(_mm_sub_ps(_mm_loadu_ps(&in.data[3][m]), center_l), abs_mask),
+                                      inv_deviation);
+                for (int k = 0; k < 3; k++) {
+                    e = add_squared(e, _mm_loadu_ps(&f.data[k][m]), center_f[k], albedo_scale);
+                    e = add_squared(e, _mm_loadu_ps(&f.data[3 + k][m]), center_f[3 + k], normal_scale);
+                }
+                const __m128 d = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&f.data[6][m]), depth), inv_depth);
+                e = add_squared(e, d, _mm_setzero_ps(),
+                                _mm_set1_ps(weights.inv_depth2 / real((dx * dx + dy * dy) * step * step + 1)));
+                const __m128 w = _mm_mul_ps(_mm_set1_ps(kernel[dx + 2] * kernel[dy + 2]),
+                                            denoiser_exp(_mm_sub_ps(_mm_setzero_ps(), e)));
+                for (int k = 0; k < 3; k++) {
+                    sum[k] = _mm_add_ps(sum[k], _mm_mul_ps(w, _mm_loadu_ps(&in.data[k][m])));
+                }
+                weight_sum = _mm_add_ps(weight_sum, w);
+                variance_sum = _mm_add_ps(variance_sum, _mm_mul_ps(_mm_mul_ps(w, w), _mm_loadu_ps(&in.data[4][m])));
+            }
+        }
+        for (int k = 0; k < 3; k++) {
+            _mm_storeu_ps(&out.data[k][n], _mm_div_ps(sum[k], weight_sum));
+        }
+        _mm_storeu_ps(&out.data[4][n], _mm_div_ps(variance_sum, _mm_mul_ps(weight_sum, weight_sum)));
+    }
+#endif
+
+    static constexpr real kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+};
+
+constexpr real AtrousDenoiser::kernel[5];
+constexpr real AtrousDenoiser::min_deviation;
+
+TC_IMPLEMENTATION(Denoiser, AtrousDenoiser, "atrous");
+
+TC_NAMESPACE_END
@@ -17,6 +17,8 @@ TC_IMPLEMENTATION(EnvironmentMap, EnvironmentMap, "base");
 
 void EnvironmentMap::initialize(const Config &config) {
     set_transform(Matrix4(1.0f));
+    num_threads = config.get("num_threads", 1);
+    rgbe = config.get("rgbe", false);
     if (config.has_key("filepath")) {
         image = std::make_shared<Array2D<Vector3>>(config.get_string("filepath"));
         res[0] = image->get_width();
@@ -25,8 +27,8 @@ void EnvironmentMap::initialize(const Config &config) {
         assert_info(config.has_key("texture"), "Either `filenpath` or `texture` should be specified.");
         res = config.get("res", Vector2i(1024, 512));
         image = std::make_shared<Array2D<Vector3>>(res);
-        Texture *tex = config.get_asset<Texture>("texture").get();
-        *image = tex->rasterize3(res);
+        texture = config.get_asset<Texture>("texture");
+        rasterize_texture();
     }
     /*
     for (int j = 0; j < height; j++) {
@@ -37,12 +39,7 @@ void EnvironmentMap::initialize(const Config &config) {
         }
     }
     */
-    for (int j = 0; j < res[1] - j - 1; j++) {
-        for (int i = 0; i < res[0]; i++)
-            std::swap((*image)[i][j], (*image)[i][res[1] - j - 1]);
-    }
-
-    build_cdfs();
+    finalize_image();
     /*
     P("test");
     P(uv_to_direction(Vector2(0.0f, 0.0f)));
@@ -76,50 +73,87 @@ void EnvironmentMap::initialize(const Config &config) {
     */
 }
 
+void EnvironmentMap::update() {
+    assert_info(texture != nullptr, "Only environment maps of textures can be updated");
+    if (!image) {
+        image = std::make_shared<Array2D<Vector3>>(res);
+    }
+    rasterize_texture();
+    finalize_image();
+}
+
+void EnvironmentMap::rasterize_texture() {
+    texture->rasterize(Vector3i(res[0], res[1], 1), num_threads, [&](int i, int j, int k, const Vector4 &value) {
+        (*image)[i][j] = Vector3(value.x, value.y, value.z);
+    });
+}
+
+void EnvironmentMap::finalize_image() {
+    for (int j = 0; j < res[1] - j - 1; j++) {
+        for (int i = 0; i < res[0]; i++)
+            std::swap((*image)[i][j], (*image)[i][res[1] - j - 1]);
+    }
+
+    build_sampler(num_threads);
+    if (rgbe) {
+        rgbe_texels.resize(res[0] * res[1]);
+        for (int i = 0; i < res[0]; i++) {
+            for (int j = 0; j < res[1]; j++) {
+                rgbe_texels[i * res[1] + j] = encode_rgbe((*image)[i][j]);
+            }
+        }
+        image = nullptr;
+        // Of the pixels as decoded
+        build_sampler(num_threads);
+    }
+}
+
+Vector3 EnvironmentMap::sample_illum(const Vector2 &uv) const {
+    if (image) {
+        return image->sample_relative_coord(uv);
+    }
+    // Bilinear, as Array2D::sample of texels stored at pixel centers
+    const real x = clamp(uv.x * res[0] - 0.5f, 0.0f, res[0] - 1.0f - eps);
+    const real y = clamp(uv.y * res[1] - 0.5f, 0.0f, res[1] - 1.0f - eps);
+    const int x_i = clamp(int(x), 0, res[0] - 2), y_i = clamp(int(y), 0, res[1] - 2);
+    const real x_r = x - x_i, y_r = y - y_i;
+    return lerp(x_r, lerp(y_r, get_texel(x_i, y_i), get_texel(x_i, y_i + 1)),
+                lerp(y_r, get_texel(x_i + 1, y_i), get_texel(x_i + 1, y_i + 1)));
+}
+
+// Directions are uniform in (u, v) within their pixel, i.e. of density 1 / (2 pi^2 sin(theta)) per solid angle
 real EnvironmentMap::pdf(const Vector3 &dir) const {
     Vector2 uv = direction_to_uv(dir);
-    return luminance(image->sample(uv.x, uv.y))
-           / avg_illum * (1.0f / 4 / pi);
+    const int i = clamp(int(uv.x * res[0]), 0, res[0] - 1), j = clamp(int(uv.y * res[1]), 0, res[1] - 1);
+    const real sin_theta = std::max(std::sin(pi * uv.y), 1e-6f);
+    return real(get_pixel_weight(i, j) / total_pixel_weight * res[0] * res[1] / (2 * pi * pi * sin_theta));
 }
 
 Vector3 EnvironmentMap::sample_direction(StateSequence &rand, real &pdf, Vector3 &illum) const {
+    const int pixel = pixel_sampler.sample(rand());
+    const int i = pixel / res[1], j = pixel % res[1];
     Vector2 uv;
-    real row_pdf, row_cdf;
-    real col_pdf, col_cdf;
-    real row_sample = rand();
-    real col_sample = rand();
-    int row = row_sampler.sample(row_sample, row_pdf, row_cdf);
-    int col = col_samplers[row].sample(col_sample, col_pdf, col_cdf);
-    real u = col + 0.5f;// (col_sample - col_cdf) / col_pdf;
-    real v = row + 0.5f;// (row_sample - row_cdf) / row_pdf;
-    uv.x = u / res[0];
-    uv.y = v / res[1];
+    uv.x = (i + rand()) / res[0];
+    uv.y = (j + rand()) / res[1];
     illum = sample_illum(uv);
-    pdf = row_pdf * col_pdf * res[0] * res[1] / sin(pi * (0.5f + row) / res[1]);
-    //P(luminance(illum) / pdf);
+    const real sin_theta = std::max(std::sin(pi * uv.y), 1e-6f);
+    pdf = real(get_pixel_weight(i, j) / total_pixel_weight * res[0] * res[1] / (2 * pi * pi * sin_theta));
     return uv_to_direction(uv);
 }
 
-void EnvironmentMap::build_cdfs() {
-    std::vector<real> row_pdf;
-    avg_illum = 0;
-    real total_weight = 0.0f;
-    for (int j = 0; j < res[1]; j++) {
-        std::vector<real> col_pdf;
-        real scale = sin(pi * (0.5f + j) / res[1]);
-        real total = 0.0f;
-        for (int i = 0; i < res[0]; i++) {
-            real pdf = luminance(image->sample((i + 0.5f) / res[0], (j + 0.5f) / res[1]));
-            avg_illum += pdf * scale;
-            total_weight += scale;
-            total += pdf;
-            col_pdf.push_back(pdf);
+void EnvironmentMap::build_sampler(int num_threads) {
+    std::vector<real> weights(res[0] * res[1]);
+    parallel_for(0, res[0], num_threads, [&](int i) {
+        for (int j = 0; j < res[1]; j++) {
+            weights[i * res[1] + j] = get_pixel_weight(i, j);
         }
-        col_samplers.push_back(DiscreteSampler(col_pdf, true));
-        row_pdf.push_back(total * scale);
+    });
+    total_pixel_weight = 0;
+    for (auto w : weights) {
+        total_pixel_weight += w;
     }
-    row_sampler.initialize(row_pdf);
-    avg_illum /= total_weight;
+    assert_info(total_pixel_weight > 0, "Environment map is black");
+    pixel_sampler.initialize(weights, num_threads);
 }
 
 TC_NAMESPACE_END
@@ -11,9 +11,13 @@
 #include <taichi/math/array_op.h>
 #include <taichi/physics/physics_constants.h>
 #include <taichi/dynamics/poisson_solver2d.h>
+#include <taichi/system/threading.h>
 
 TC_NAMESPACE_BEGIN
 
+// Gradient domain HDR compression (Fattal et al. 2002). The Poisson solver, with its multigrid hierarchy, is kept
+// across calls on images of the same resolution, e.g. frames of an animation, and starts from the solution of the
+// last call.
 class GradientDomainTMO final : public ToneMapper {
 protected:
     real pyramid_sigma;
@@ -21,6 +25,50 @@ protected:
     real s;
     int num_threads;
     int max_solver_iterations;
+    std::shared_ptr<PoissonSolver2D> poisson_solver;
+    // Of the image the solver was set up for, and the solver's, padded for multigrid
+    Vector2i solver_image_res, solver_res;
+    Array2D<real> solution;
+
+    // Calls f(i, j) for every pixel of an image of width x height, in parallel over columns
+    template <typename T>
+    void for_each_pixel(int width, int height, const T &f) const {
+        ThreadedTaskManager::run([&](int i) {
+            for (int j = 0; j < height; j++) {
+                f(i, j);
+            }
+        }, 0, width, num_threads);
+    }
+
+    // Multigrid halves the grid until it has under 8 cells, so images are padded to a multiple of a power of two
+    // that takes them there, with Neumann cells, which have no unknowns and close the image with its own boundary
+    // condition
+    void prepare_solver(int width, int height) {
+        if (poisson_solver && solver_image_res == Vector2i(width, height)) {
+            return;
+        }
+        int m = 1;
+        while (((width + (1 << m) - 1) >> m) * ((height + (1 << m) - 1) >> m) >= 8) {
+            m++;
+        }
+        const int block = 1 << m;
+        solver_image_res = Vector2i(width, height);
+        solver_res = Vector2i((width + block - 1) / block * block, (height + block - 1) / block * block);
+        poisson_solver = create_instance<PoissonSolver2D>("mgpcg");
+        Config cfg;
+        cfg.set("res", solver_res).set("num_threads", num_threads).set("padding", "neumann").
+            set("maximum_iterations", max_solver_iterations).set("warm_start", true);
+        poisson_solver->initialize(cfg);
+        Array2D<PoissonSolver2D::CellType> boundary(solver_res, PoissonSolver2D::NEUMANN);
+        for (int i = 0; i < width; i++) {
+            for (int j = 0; j < height; j++) {
+                boundary[i][j] = PoissonSolver2D::INTERIOR;
+            }
+        }
+        poisson_solver->set_boundary_condition(boundary);
+        solution = Array2D<real>(solver_res, 0.0f);
+    }
+
 public:
     void initialize(const Config &config) override {
         pyramid_sigma = config.get("pyramid_sigma", 1.0f);
@@ -33,100 +81,86 @@ public:
 
     virtual Array2D<Vector3> apply(const Array2D<Vector3> &inp) override {
         int width = inp.get_width(), height = inp.get_height();
-        assert_info(inp.get_width() == inp.get_height(), "only square image supported currently.");
 
         Array2D<real> lum(inp.get_width(), inp.get_height());
         Array2D<real> log_lum(inp.get_width(), inp.get_height());
-        for (auto &ind : inp.get_region()) {
-            lum[ind] = luminance(inp[ind]);
-            log_lum[ind] = std::log(lum[ind] + 1e-4f);
-        }
+        for_each_pixel(width, height, [&](int i, int j) {
+            lum[i][j] = luminance(inp[i][j]);
+            log_lum[i][j] = std::log(lum[i][j] + 1e-4f);
+        });
         std::vector<Array2D<real>> pyramid;
         std::vector<Array2D<real>> phi;
         Array2D<Vector2> G(width, height);
-        Array2D<real> div_G(width, height);
 
         pyramid.push_back(log_lum);
-        int size = inp.get_width();
-        while (size > 32) {
-            size /= 2;
-            auto blurred = gaussian_blur(pyramid.back(), pyramid_sigma);
+        while (std::min(pyramid.back().get_width(), pyramid.back().get_height()) > 32) {
+            auto blurred = gaussian_blur(pyramid.back(), pyramid_sigma, num_threads);
             pyramid.push_back(take_downsampled(blurred, 2));
         }
         phi.resize(pyramid.size());
         for (int k = (int)pyramid.size() - 1; k >= 0; k--) {
-            phi[k] = Array2D<real>(pyramid[k].get_width(), pyramid[k].get_height());
-            Array2D<real> grad_norm(pyramid[k].get_width(), pyramid[k].get_height());
+            const Array2D<real> &level = pyramid[k];
+            const int level_width = level.get_width(), level_height = level.get_height();
+            phi[k] = Array2D<real>(level_width, level_height);
+            Array2D<real> grad_norm(level_width, level_height);
             real scale = std::pow(0.5f, k + 1);
-            for (auto &ind : grad_norm.get_region()) {
+            for_each_pixel(level_width, level_height, [&](int i, int j) {
                 real grad_x = 0, grad_y = 0;
-                if (ind.i > 0) {
-                    grad_x += pyramid[k][ind] - pyramid[k][ind.neighbour(-1, 0)];
+                if (i > 0) {
+                    grad_x += level[i][j] - level[i - 1][j];
                 }
-                if (ind.i < pyramid[k].get_width() - 1) {
-                    grad_x += pyramid[k][ind.neighbour(1, 0)] - pyramid[k][ind];
+                if (i < level_width - 1) {
+                    grad_x += level[i + 1][j] - level[i][j];
                 }
-                if (ind.j > 0) {
-                    grad_y += pyramid[k][ind] - pyramid[k][ind.neighbour(0, -1)];
+                if (j > 0) {
+                    grad_y += level[i][j] - level[i][j - 1];
                 }
-                if (ind.j < pyramid[k].get_height() - 1) {
-                    grad_y += pyramid[k][ind.neighbour(0, 1)] - pyramid[k][ind];
+                if (j < level_height - 1) {
+                    grad_y += level[i][j + 1] - level[i][j];
                 }
                 grad_x *= 0.5;
                 grad_y *= 0.5;
-                grad_norm[ind] = std::hypot(grad_x, grad_y) * scale;
-            }
+                grad_norm[i][j] = std::hypot(grad_x, grad_y) * scale;
+            });
             real avg = grad_norm.get_average();
-            for (auto &ind : phi[k].get_region()) {
-                real norm = std::max(grad_norm[ind], 1e-5f);
-                phi[k][ind] = std::pow(norm / (alpha * avg), beta - 1);
+            for_each_pixel(level_width, level_height, [&](int i, int j) {
+                real norm = std::max(grad_norm[i][j], 1e-5f);
+                phi[k][i][j] = std::pow(norm / (alpha * avg), beta - 1);
                 if (k != (int)pyramid.size() - 1) {
-                    phi[k][ind] *= phi[k + 1].sample(ind.get_pos() * 2.0f);
+                    // Pixel i of a level was taken from pixel 2i of the finer one
+                    phi[k][i][j] *= phi[k + 1].sample((i + 0.5f) * 0.5f + 0.25f, (j + 0.5f) * 0.5f + 0.25f);
                 }
-            }
+            });
         }
-        auto oup = inp;
-        for (auto &ind : G.get_region()) {
-            real grad_x, grad_y;
-            if (ind.i + 1 < width)
-                grad_x = log_lum[ind.neighbour(1, 0)] - log_lum[ind];
-            else
-                grad_x = 0;
-            if (ind.j + 1 < height)
-                grad_y = log_lum[ind.neighbour(0, 1)] - log_lum[ind];
-            else
-                grad_y = 0;
-            G[ind] = Vector2(grad_x, grad_y) * phi[0][ind];
-        }
-        for (auto &ind : div_G.get_region()) {
-            real div_x = G[ind].x, div_y = G[ind].y;
-            if (ind.i > 0)
-                div_x -= G[ind.neighbour(-1, 0)].x;
-            if (ind.j > 0)
-                div_y -= G[ind.neighbour(0, -1)].y;
-            div_G[ind] = -(div_x + div_y);
-        }
-        auto poisson_solver = create_instance<PoissonSolver2D>("mgpcg");
-        Config cfg;
-        cfg.set("res", Vector2i(width, height)).set("num_threads", num_threads).set("padding", "neumann").
-            set("maximum_iterations", max_solver_iterations);
-        poisson_solver->initialize(cfg);
-
-        Array2D<PoissonSolver2D::CellType> boundary(width, height, PoissonSolver2D::INTERIOR);
-        poisson_solver->set_boundary_condition(boundary);
+        for_each_pixel(width, height, [&](int i, int j) {
+            real grad_x = i + 1 < width ? log_lum[i + 1][j] - log_lum[i][j] : 0;
+            real grad_y = j + 1 < height ? log_lum[i][j + 1] - log_lum[i][j] : 0;
+            G[i][j] = Vector2(grad_x, grad_y) * phi[0][i][j];
+        });
+        prepare_solver(width, height);
+        // Zero on the padding
+        Array2D<real> div_G(solver_res, 0.0f);
+        for_each_pixel(width, height, [&](int i, int j) {
+            real div_x = G[i][j].x, div_y = G[i][j].y;
+            if (i > 0)
+                div_x -= G[i - 1][j].x;
+            if (j > 0)
+                div_y -= G[i][j - 1].y;
+            div_G[i][j] = -(div_x + div_y);
+        });
 
-        real avg_div_G = div_G.get_average();
-        for (auto &ind : div_G.get_region()) {
-            div_G[ind] -= avg_div_G;
-        }
+        real avg_div_G = div_G.get_average() * (real(solver_res.x) * solver_res.y / (width * height));
+        for_each_pixel(width, height, [&](int i, int j) {
+            div_G[i][j] -= avg_div_G;
+        });
 
-        Array2D<real> I(width, height);
-        poisson_solver->run(div_G, I, 1e-5f);
-        for (auto &ind : oup.get_region()) {
-            for (int i = 0; i < 3; i++) {
-                oup[ind][i] = std::pow(inp[ind][i] / (lum[ind] + 1e-30f), s) * std::exp(I[ind]);
+        poisson_solver->run(div_G, solution, 1e-5f);
+        auto oup = inp;
+        for_each_pixel(width, height, [&](int i, int j) {
+            for (int c = 0; c < 3; c++) {
+                oup[i][j][c] = std::pow(inp[i][j][c] / (lum[i][j] + 1e-30f), s) * std::exp(solution[i][j]);
             }
-        }
+        });
         return oup;
     }
 };
@@ -9,125 +9,301 @@
 
 #include <taichi/image/tone_mapper.h>
 #include <taichi/math/array_op.h>
-#include <taichi/math/array_3d.h>
 #include <taichi/physics/physics_constants.h>
+#include <taichi/system/threading.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if !defined(TC_DISABLE_SSE) && defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 TC_NAMESPACE_BEGIN
 
-class HETMO final : public ToneMapper {
+// Tone mappers that remap the luminance of pixels through histograms of it. Their buffers are kept from one
+// frame to the next, and all passes run over columns in parallel.
+class HistogramTMO : public ToneMapper {
 protected:
     int num_bins;
+    int num_threads;
+    Array2D<real> lum;
+    std::vector<real> column_max;
+
 public:
     void initialize(const Config &config) override {
         num_bins = config.get_int("num_bins");
+        num_threads = config.get("num_threads", 1);
+        assert_info(num_bins >= 1, "num_bins should be positive");
     }
 
-    virtual Array2D<Vector3> apply(const Array2D<Vector3> &inp) override {
-        int width = inp.get_width(), height = inp.get_height();
-        Array2D<real> lum(inp.get_width(), inp.get_height());
-        for (auto &ind : inp.get_region()) {
-            lum[ind] = luminance(inp[ind]);
+    Array2D<Vector3> apply(const Array2D<Vector3> &inp) override {
+        Array2D<Vector3> oup;
+        apply_to(inp, oup);
+        return oup;
+    }
+
+protected:
+    // Fills lum and returns its maximum
+    real compute_luminance(const Array2D<Vector3> &inp) {
+        const int width = inp.get_width(), height = inp.get_height();
+        if (lum.get_width() != width || lum.get_height() != height) {
+            lum.allocate(width, height);
         }
-        auto scale = num_bins / (1e-30f + lum.max());
-        std::vector<int> cdf(num_bins, 0);
-        for (auto &ind : inp.get_region()) {
-            cdf[std::min(num_bins - 1, (int)(scale * lum[ind]))] += 1;
+        column_max.resize(width);
+        ThreadedTaskManager::run([&](int i) {
+            real m = -std::numeric_limits<real>::infinity();
+            for (int j = 0; j < height; j++) {
+                lum[i][j] = luminance(inp[i][j]);
+                m = std::max(m, lum[i][j]);
+            }
+            column_max[i] = m;
+        }, 0, width, num_threads);
+        return *std::max_element(column_max.begin(), column_max.end());
+    }
+
+    void prepare_output(const Array2D<Vector3> &inp, Array2D<Vector3> &oup) const {
+        if (oup.get_width() != inp.get_width() || oup.get_height() != inp.get_height()) {
+            oup.allocate(inp.get_width(), inp.get_height());
         }
-        for (int i = 0; i < num_bins - 1; i++) {
-            cdf[i + 1] += cdf[i];
+    }
+
+    // Scales a run of pixels to their new luminance
+    static void scale_pixels(const Vector3 *inp, const real *lum, const real *new_lum, Vector3 *oup, int n) {
+        for (int j = 0; j < n; j++) {
+            for (int k = 0; k < 3; k++) {
+                oup[j][k] = inp[j][k] / (lum[j] + 1e-30f) * new_lum[j];
+            }
         }
-        auto oup = inp;
-        for (auto &ind : oup.get_region()) {
-            real new_lum = 1.0f * cdf[std::min(num_bins - 1, (int)(scale * lum[ind]))]
-                / (width * height);
-            for (int i = 0; i < 3; i++) {
-                oup[ind][i] = inp[ind][i] / (lum[ind] + 1e-30f) * new_lum;
+    }
+};
+
+class HETMO final : public HistogramTMO {
+protected:
+    std::vector<int> counts;
+    // The new luminance of each bin
+    std::vector<real> levels;
+
+public:
+    void apply_to(const Array2D<Vector3> &inp, Array2D<Vector3> &oup) override {
+        int width = inp.get_width(), height = inp.get_height();
+        prepare_output(inp, oup);
+        auto scale = num_bins / (1e-30f + compute_luminance(inp));
+        // One histogram per thread, over a contiguous range of columns, summed afterwards
+        const int chunks = std::max(1, std::min(num_threads, width));
+        counts.assign(chunks * num_bins, 0);
+        ThreadedTaskManager::run([&](int t) {
+            int *cdf = &counts[t * num_bins];
+            for (int i = width * t / chunks; i < width * (t + 1) / chunks; i++) {
+                for (int j = 0; j < height; j++) {
+                    cdf[std::max(0, std::min(num_bins - 1, (int)(scale * lum[i][j])))] += 1;
+                }
+            }
+        }, 0, chunks, num_threads, 1);
+        for (int t = 1; t < chunks; t++) {
+            for (int k = 0; k < num_bins; k++) {
+                counts[k] += counts[t * num_bins + k];
             }
         }
-        return oup;
+        for (int i = 0; i < num_bins - 1; i++) {
+            counts[i + 1] += counts[i];
+        }
+        levels.resize(num_bins);
+        for (int k = 0; k < num_bins; k++) {
+            levels[k] = 1.0f * counts[k] / (width * height);
+        }
+        ThreadedTaskManager::run([&](int i) {
+            const real *l = &lum[i][0];
+            real new_lum[8];
+            int j = 0;
+#if !defined(TC_DISABLE_SSE) && defined(__AVX2__)
+            const __m256 vscale = _mm256_set1_ps(scale);
+            const __m256i last = _mm256_set1_epi32(num_bins - 1), zero = _mm256_setzero_si256();
+            for (; j + 8 <= height; j += 8) {
+                __m256i bin = _mm256_cvttps_epi32(_mm256_mul_ps(vscale, _mm256_loadu_ps(l + j)));
+                bin = _mm256_max_epi32(zero, _mm256_min_epi32(last, bin));
+                _mm256_storeu_ps(new_lum, _mm256_i32gather_ps(&levels[0], bin, 4));
+                scale_pixels(&inp[i][j], l + j, new_lum, &oup[i][j], 8);
+            }
+#endif
+            for (; j < height; j++) {
+                new_lum[0] = levels[std::max(0, std::min(num_bins - 1, (int)(scale * l[j])))];
+                scale_pixels(&inp[i][j], l + j, new_lum, &oup[i][j], 1);
+            }
+        }, 0, width, num_threads);
     }
 };
 
 TC_IMPLEMENTATION(ToneMapper, HETMO, "he")
 
-class CLAHETMO final : public ToneMapper {
+// Contrast limited adaptive histogram equalization: each of num_slices^2 tiles equalizes by the histogram of the
+// 3x3 tiles around it, and pixels interpolate between the mappings of the nearest tiles.
+class CLAHETMO final : public HistogramTMO {
 protected:
-    int num_bins;
     int num_slices;
     real contrast_limit;
+    // Per tile, by (i * num_slices + j) * num_bins + k, the counts of its own pixels...
+    std::vector<int> tile_counts;
+    // ... and the exclusive cdf of its neighborhood, which pixels interpolate trilinearly
+    std::vector<real> cdfs;
+    // Per column and per row, the offset of the lower tile to interpolate from within cdfs, the step to the
+    // upper one, and the weight of the upper one
+    std::vector<int> column_offsets, column_steps, row_offsets, row_steps;
+    std::vector<real> column_weights, row_weights;
+
+    // Where Array3D::sample() would interpolate coordinate x of a dimension of n samples
+    static void locate(real x, int n, int &lower, int &step, real &weight) {
+        x = clamp(x - 0.5f, 0.0f, std::max(0.0f, n - 1.0f - eps));
+        lower = std::min((int)x, std::max(0, n - 2));
+        step = lower + 1 < n ? 1 : 0;
+        weight = x - lower;
+    }
+
 public:
     void initialize(const Config &config) override {
-        num_bins = config.get_int("num_bins");
+        HistogramTMO::initialize(config);
         num_slices = config.get_int("num_slices");
         contrast_limit = config.get("contrast_limit", 0.0f);
+        assert_info(num_slices >= 1, "num_slices should be positive");
     }
 
-    virtual Array2D<Vector3> apply(const Array2D<Vector3> &inp) override {
+    void apply_to(const Array2D<Vector3> &inp, Array2D<Vector3> &oup) override {
         int width = inp.get_width(), height = inp.get_height();
         int x_slices = num_slices;
         int y_slices = num_slices;
         int x_slice_size = (int)std::ceil(1.0f * width / num_slices);
         int y_slice_size = (int)std::ceil(1.0f * height / num_slices);
-        Array2D<real> lum(inp.get_width(), inp.get_height());
-        for (auto &ind : inp.get_region()) {
-            lum[ind] = luminance(inp[ind]);
-        }
-        real max_lum = lum.max() + 1e-20f;
+        prepare_output(inp, oup);
+        real max_lum = compute_luminance(inp) + 1e-20f;
         real scale = num_bins / max_lum;
-        Array3D<real> histograms(Vector3i(x_slices, y_slices, num_bins));
-        for (int i = 0; i < x_slices; i++) {
-            for (int j = 0; j < y_slices; j++) {
-                int x_start = std::max(0, (i - 1) * x_slice_size);
-                int x_end = std::min((i + 2) * x_slice_size, width);
-                int y_start = std::max(0, (j - 1) * y_slice_size);
-                int y_end = std::min((j + 2) * y_slice_size, height);
-                std::vector<int> cdf(num_bins, 0);
-                for (int x = x_start; x < x_end; x++) {
-                    for (int y = y_start; y < y_end; y++) {
-                        cdf[std::min(num_bins - 1, (int)(scale * lum[x][y]))] += 1;
-                    }
+
+        // The neighborhoods are unions of tiles, so each pixel is counted once, into the histogram of its own tile
+        tile_counts.assign(x_slices * y_slices * num_bins, 0);
+        ThreadedTaskManager::run([&](int t) {
+            const int i = t / y_slices, j = t % y_slices;
+            int *cdf = &tile_counts[t * num_bins];
+            for (int x = i * x_slice_size; x < std::min((i + 1) * x_slice_size, width); x++) {
+                for (int y = j * y_slice_size; y < std::min((j + 1) * y_slice_size, height); y++) {
+                    cdf[std::max(0, std::min(num_bins - 1, (int)(scale * lum[x][y])))] += 1;
                 }
-                int num_pixels = (x_end - x_start) * (y_end - y_start);
-                int threshold = int(1.0f * num_pixels / num_bins * contrast_limit);
-                int clipped = 0;
-                if (contrast_limit != 0.0f) {
-                    for (int k = 0; k < num_bins; k++) {
-                        if (cdf[k] > threshold) {
-                            clipped += cdf[k] - threshold;
-                            cdf[k] = threshold;
-                        }
-                    }
-                    int gain = clipped / num_bins;
+            }
+        }, 0, x_slices * y_slices, num_threads, 1);
+
+        cdfs.resize(x_slices * y_slices * num_bins);
+        ThreadedTaskManager::run([&](int t) {
+            const int i = t / y_slices, j = t % y_slices;
+            int x_start = std::max(0, (i - 1) * x_slice_size);
+            int x_end = std::min((i + 2) * x_slice_size, width);
+            int y_start = std::max(0, (j - 1) * y_slice_size);
+            int y_end = std::min((j + 2) * y_slice_size, height);
+            std::vector<int> cdf(num_bins, 0);
+            for (int a = std::max(0, i - 1); a <= std::min(x_slices - 1, i + 1); a++) {
+                for (int b = std::max(0, j - 1); b <= std::min(y_slices - 1, j + 1); b++) {
+                    const int *counts = &tile_counts[(a * y_slices + b) * num_bins];
                     for (int k = 0; k < num_bins; k++) {
-                        cdf[k] += gain;
+                        cdf[k] += counts[k];
                     }
                 }
-                for (int k = 0; k < num_bins - 1; k++) {
-                    cdf[k + 1] += cdf[k];
-                }
-                real inv_scale = 1.0f / num_pixels;
-                for (int k = num_bins - 2; k >= 0; k--) {
-                    cdf[k + 1] = cdf[k];
+            }
+            int num_pixels = (x_end - x_start) * (y_end - y_start);
+            int threshold = int(1.0f * num_pixels / num_bins * contrast_limit);
+            int clipped = 0;
+            if (contrast_limit != 0.0f) {
+                for (int k = 0; k < num_bins; k++) {
+                    if (cdf[k] > threshold) {
+                        clipped += cdf[k] - threshold;
+                        cdf[k] = threshold;
+                    }
                 }
-                cdf[0] = 0;
+                int gain = clipped / num_bins;
                 for (int k = 0; k < num_bins; k++) {
-                    histograms[i][j][k] = cdf[k] * inv_scale;
+                    cdf[k] += gain;
                 }
             }
+            real inv_scale = 1.0f / num_pixels;
+            real *out = &cdfs[t * num_bins];
+            int sum = 0;
+            for (int k = 0; k < num_bins; k++) {
+                out[k] = sum * inv_scale;
+                sum += cdf[k];
+            }
+        }, 0, x_slices * y_slices, num_threads, 1);
+
+        column_offsets.resize(width);
+        column_steps.resize(width);
+        column_weights.resize(width);
+        for (int i = 0; i < width; i++) {
+            locate(1.0f * i / width * x_slices, x_slices, column_offsets[i], column_steps[i], column_weights[i]);
+            column_offsets[i] *= y_slices * num_bins;
+            column_steps[i] *= y_slices * num_bins;
+        }
+        row_offsets.resize(height);
+        row_steps.resize(height);
+        row_weights.resize(height);
+        for (int j = 0; j < height; j++) {
+            locate(1.0f * j / height * y_slices, y_slices, row_offsets[j], row_steps[j], row_weights[j]);
+            row_offsets[j] *= num_bins;
+            row_steps[j] *= num_bins;
         }
 
-        auto oup = inp;
-        for (auto &ind : oup.get_region()) {
-            real new_lum = histograms.sample_relative_coord(
-                1.0f * ind.i / width, 1.0f * ind.j / height, lum[ind] / max_lum);
-            for (int i = 0; i < 3; i++) {
-                oup[ind][i] = inp[ind][i] / (lum[ind] + 1e-30f) * new_lum;
+        ThreadedTaskManager::run([&](int i) {
+            const real *l = &lum[i][0];
+            const real *h = &cdfs[0];
+            const int dx = column_steps[i];
+            const real wx = column_weights[i];
+            real new_lum[8];
+            int j = 0;
+#if !defined(TC_DISABLE_SSE) && defined(__AVX2__)
+            const __m256 one = _mm256_set1_ps(1.0f), vmax_lum = _mm256_set1_ps(max_lum);
+            const __m256 vnum_bins = _mm256_set1_ps(real(num_bins)), half = _mm256_set1_ps(0.5f);
+            const __m256 z_max = _mm256_set1_ps(std::max(0.0f, num_bins - 1.0f - eps));
+            const __m256i z_last = _mm256_set1_epi32(std::max(0, num_bins - 2));
+            const __m256i dz = _mm256_set1_epi32(num_bins > 1 ? 1 : 0), vdx = _mm256_set1_epi32(dx);
+            const __m256 x_r = _mm256_set1_ps(wx), x_l = _mm256_sub_ps(one, x_r);
+            const __m256i column = _mm256_set1_epi32(column_offsets[i]);
+            auto lerp8 = [](__m256 wl, __m256 wu, __m256 a, __m256 b) {
+                return _mm256_add_ps(_mm256_mul_ps(wl, a), _mm256_mul_ps(wu, b));
+            };
+            for (; j + 8 <= height; j += 8) {
+                __m256 z = _mm256_sub_ps(_mm256_mul_ps(_mm256_div_ps(_mm256_loadu_ps(l + j), vmax_lum), vnum_bins),
+                                         half);
+                z = _mm256_min_ps(z_max, _mm256_max_ps(_mm256_setzero_ps(), z));
+                const __m256i z_i = _mm256_min_epi32(z_last, _mm256_cvttps_epi32(z));
+                const __m256 z_r = _mm256_sub_ps(z, _mm256_cvtepi32_ps(z_i)), z_l = _mm256_sub_ps(one, z_r);
+                const __m256 y_r = _mm256_loadu_ps(&row_weights[j]), y_l = _mm256_sub_ps(one, y_r);
+                const __m256i dy = _mm256_loadu_si256((const __m256i *)&row_steps[j]);
+                const __m256i o00 = _mm256_add_epi32(_mm256_add_epi32(column, z_i),
+                                                     _mm256_loadu_si256((const __m256i *)&row_offsets[j]));
+                const __m256i o01 = _mm256_add_epi32(o00, dy), o10 = _mm256_add_epi32(o00, vdx);
+                const __m256i o11 = _mm256_add_epi32(o10, dy);
+                __m256 lower = lerp8(x_l, x_r,
+                                     lerp8(y_l, y_r, _mm256_i32gather_ps(h, o00, 4), _mm256_i32gather_ps(h, o01, 4)),
+                                     lerp8(y_l, y_r, _mm256_i32gather_ps(h, o10, 4), _mm256_i32gather_ps(h, o11, 4)));
+                const __m256i p00 = _mm256_add_epi32(o00, dz), p01 = _mm256_add_epi32(o01, dz);
+                const __m256i p10 = _mm256_add_epi32(o10, dz), p11 = _mm256_add_epi32(o11, dz);
+                __m256 upper = lerp8(x_l, x_r,
+                                     lerp8(y_l, y_r, _mm256_i32gather_ps(h, p00, 4), _mm256_i32gather_ps(h, p01, 4)),
+                                     lerp8(y_l, y_r, _mm256_i32gather_ps(h, p10, 4), _mm256_i32gather_ps(h, p11, 4)));
+                _mm256_storeu_ps(new_lum, lerp8(z_l, z_r, lower, upper));
+                scale_pixels(&inp[i][j], l + j, new_lum, &oup[i][j], 8);
             }
-        }
-        return oup;
+#endif
+            for (; j < height; j++) {
+                int z_i, dz;
+                real z_r;
+                locate(l[j] / max_lum * num_bins, num_bins, z_i, dz, z_r);
+                const real *p = h + column_offsets[i] + row_offsets[j] + z_i;
+                const int dy = row_steps[j];
+                const real wy = row_weights[j];
+                new_lum[0] = lerp(z_r,
+                                  lerp(wx, lerp(wy, p[0], p[dy]), lerp(wy, p[dx], p[dx + dy])),
+                                  lerp(wx, lerp(wy, p[dz], p[dy + dz]), lerp(wy, p[dx + dz], p[dx + dy + dz])));
+                scale_pixels(&inp[i][j], l + j, new_lum, &oup[i][j], 1);
+            }
+        }, 0, width, num_threads);
     }
 };
 
 TC_IMPLEMENTATION(ToneMapper, CLAHETMO, "clahe")
 
-TC_NAMESPACE_END
\ No newline at end of file
+TC_NAMESPACE_END
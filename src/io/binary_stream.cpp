@@ -0,0 +1,156 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/io/binary_stream.h>
+#include <taichi/io/compression.h>
+#include <algorithm>
+
+#ifdef _WIN64
+#define tc_fseek _fseeki64
+#define tc_ftell _ftelli64
+#else
+#define tc_fseek fseeko
+#define tc_ftell ftello
+#endif
+
+TC_NAMESPACE_BEGIN
+
+// A compressed block is its uncompressed and compressed sizes, then the compress_shuffled stream.
+// Blocks of whole 4-byte words are shuffled as words, which helps with float data.
+static std::size_t get_block_scalar_size(uint64 size) {
+    return size % 4 == 0 ? 4 : 1;
+}
+
+BinaryFileStreamInput::BinaryFileStreamInput(const std::string &fn, std::size_t buffer_size, bool compress)
+        : fn(fn), compress(compress) {
+    f = std::fopen(fn.c_str(), "rb");
+    assert_info(f != nullptr, "Can not open " + fn + " for reading");
+    buffer.resize(buffer_size);
+}
+
+void BinaryFileStreamInput::refill() {
+    position = 0;
+    if (!compress) {
+        filled = std::fread(buffer.data(), 1, buffer.size(), f);
+        assert_info(filled > 0, "Unexpected end of " + fn);
+        return;
+    }
+    uint64 sizes[2];
+    assert_info(std::fread(sizes, sizeof(sizes), 1, f) == 1, "Unexpected end of " + fn);
+    std::vector<char> compressed(sizes[1]);
+    assert_info(std::fread(compressed.data(), 1, sizes[1], f) == sizes[1], "Unexpected end of " + fn);
+    buffer.resize(std::max(buffer.size(), (std::size_t)sizes[0]));
+    const std::size_t scalar_size = get_block_scalar_size(sizes[0]);
+    assert_info(decompress_shuffled(compressed.data(), compressed.size(), sizes[0] / scalar_size, scalar_size,
+                                    buffer.data()), "Corrupted block in " + fn);
+    filled = sizes[0];
+}
+
+void BinaryFileStreamInput::read_raw(void *data, std::size_t size) {
+    char *bytes = static_cast<char *>(data);
+    while (size > 0) {
+        if (position == filled) {
+            // Large reads skip the buffer
+            if (!compress && size >= buffer.size()) {
+                assert_info(std::fread(bytes, 1, size, f) == size, "Unexpected end of " + fn);
+                return;
+            }
+            refill();
+        }
+        const std::size_t count = std::min(size, filled - position);
+        std::memcpy(bytes, buffer.data() + position, count);
+        position += count;
+        bytes += count;
+        size -= count;
+    }
+}
+
+void BinaryFileStreamInput::seek(uint64 offset) {
+    assert_info(!compress, "Can not seek in compressed streams");
+    assert_info(tc_fseek(f, offset, SEEK_SET) == 0, "Can not seek in " + fn);
+    position = filled = 0;
+}
+
+uint64 BinaryFileStreamInput::get_file_size() {
+    const auto current = tc_ftell(f);
+    assert_info(tc_fseek(f, 0, SEEK_END) == 0, "Can not seek in " + fn);
+    const uint64 size = (uint64)tc_ftell(f);
+    assert_info(tc_fseek(f, current, SEEK_SET) == 0, "Can not seek in " + fn);
+    return size;
+}
+
+BinaryFileStreamOutput::BinaryFileStreamOutput(const std::string &fn, std::size_t buffer_size, bool compress)
+        : fn(fn), compress(compress) {
+    f = std::fopen(fn.c_str(), "wb");
+    assert_info(f != nullptr, "Can not open " + fn + " for writing");
+    buffer.resize(buffer_size);
+}
+
+void BinaryFileStreamOutput::write_raw(const void *data, std::size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    written += size;
+    if (!compress && size >= buffer.size()) {
+        flush();
+        assert_info(std::fwrite(bytes, 1, size, f) == size, "Failed to write " + fn);
+        return;
+    }
+    while (size > 0) {
+        const std::size_t count = std::min(size, buffer.size() - filled);
+        std::memcpy(buffer.data() + filled, bytes, count);
+        filled += count;
+        bytes += count;
+        size -= count;
+        if (filled == buffer.size()) {
+            flush();
+        }
+    }
+}
+
+bool BinaryFileStreamOutput::write_buffer() {
+    bool ok;
+    if (!compress) {
+        ok = std::fwrite(buffer.data(), 1, filled, f) == filled;
+    } else {
+        std::vector<char> compressed;
+        const std::size_t scalar_size = get_block_scalar_size(filled);
+        compress_shuffled(buffer.data(), filled / scalar_size, scalar_size, compressed);
+        const uint64 sizes[2] = {filled, compressed.size()};
+        ok = std::fwrite(sizes, sizeof(sizes), 1, f) == 1 &&
+             std::fwrite(compressed.data(), 1, compressed.size(), f) == compressed.size();
+    }
+    filled = 0;
+    return ok;
+}
+
+void BinaryFileStreamOutput::flush() {
+    if (filled > 0) {
+        assert_info(write_buffer(), "Failed to write " + fn);
+    }
+}
+
+void BinaryFileStreamOutput::close() {
+    if (f != nullptr) {
+        flush();
+        bool failed = std::fclose(f) != 0;
+        f = nullptr;
+        assert_info(!failed, "Failed to finish writing " + fn);
+    }
+}
+
+BinaryFileStreamOutput::~BinaryFileStreamOutput() {
+    if (f != nullptr) {
+        // Errors can not be reported from here; call close() to see them
+        if (filled > 0) {
+            write_buffer();
+        }
+        std::fclose(f);
+    }
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,54 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/io/compression.h>
+#include <cstdlib>
+#include <stb_image.h>
+
+// Compiled with the rest of stb_image_write in visualization/image_buffer.cpp; the result is malloc'ed
+unsigned char *stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality);
+
+TC_NAMESPACE_BEGIN
+
+void compress_shuffled(const char *data, std::size_t num_scalars, std::size_t scalar_size,
+                       std::vector<char> &compressed) {
+    std::vector<char> shuffled(num_scalars * scalar_size);
+    for (std::size_t k = 0; k < scalar_size; k++) {
+        for (std::size_t i = 0; i < num_scalars; i++) {
+            shuffled[k * num_scalars + i] = data[i * scalar_size + k];
+        }
+    }
+    int compressed_size;
+    unsigned char *stream = stbi_zlib_compress(reinterpret_cast<unsigned char *>(shuffled.data()),
+                                               (int)shuffled.size(), &compressed_size, 8);
+    assert_info(stream != nullptr, "Compression failed");
+    compressed.assign(stream, stream + compressed_size);
+    std::free(stream);
+}
+
+bool decompress_shuffled(const char *compressed, std::size_t compressed_size, std::size_t num_scalars,
+                         std::size_t scalar_size, char *data) {
+    int decompressed_size;
+    char *decompressed = stbi_zlib_decode_malloc(compressed, (int)compressed_size, &decompressed_size);
+    if (decompressed == nullptr) {
+        return false;
+    }
+    const bool valid = decompressed_size == int(num_scalars * scalar_size);
+    if (valid) {
+        for (std::size_t k = 0; k < scalar_size; k++) {
+            for (std::size_t i = 0; i < num_scalars; i++) {
+                data[i * scalar_size + k] = decompressed[k * num_scalars + i];
+            }
+        }
+    }
+    std::free(decompressed);
+    return valid;
+}
+
+TC_NAMESPACE_END
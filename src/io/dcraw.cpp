@@ -25,6 +25,7 @@ $Date: 2016/05/10 21:30:43 $
 
 #pragma warning(push, 0)
 #include "dcraw.h"
+#include <taichi/system/threading.h>
 
 #define DCRAW_VERSION "9.27"
 
@@ -74,6 +75,8 @@ typedef unsigned __int64 UINT64;
 #include <unistd.h>
 #include <utime.h>
 #include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 typedef long long INT64;
 typedef unsigned long long UINT64;
 #endif
@@ -150,6 +153,11 @@ int histogram[4][0x2000];
 void(*write_thumb)(), (*write_fun)();
 void(*load_raw)(), (*thumb_load_raw)();
 jmp_buf failure;
+/* Taichi: for the stages that run over blocks of rows in parallel */
+int thread_count = 1;
+/* Taichi: the memory mapping ifp reads from, if any */
+void *ifp_map = nullptr;
+size_t ifp_map_size = 0;
 
 void initialize() {
 #define MM(X) memset(X, 0, sizeof(X));
@@ -4923,24 +4931,33 @@ the work of Keigo Hirakawa, Thomas Parks, and Paul Lee.
 */
 void CLASS ahd_interpolate()
 {
-    int i, j, top, left, row, col, tr, tc, c, d, val, hm[2];
     static const int dir[4] = { -1, 1, -TS, TS };
-    unsigned ldiff[2][4], abdiff[2][4], leps, abeps;
-    ushort(*rgb)[TS][TS][3], (*rix)[3], (*pix)[4];
-    short(*lab)[TS][TS][3], (*lix)[3];
-    char(*homo)[TS][TS], *buffer;
+    char *buffer;
+    int tile_rows, blocks;
 
     if (verbose) fprintf(stderr, _("AHD interpolation...\n"));
 
     cielab(0, 0);
     border_interpolate(5);
-    buffer = (char *)malloc(26 * TS*TS);
+    /* Taichi: rows of tiles are interpolated in parallel, interleaved over
+       blocks that have a buffer each.  Tiles only read the raw channel of
+       pixels, which they leave alone when writing their interior. */
+    tile_rows = height - 5 > 2 ? (height - 8) / (TS - 6) + 1 : 0;
+    blocks = MAX(1, MIN(thread_count, tile_rows));
+    buffer = (char *)malloc((size_t)blocks * 26 * TS*TS);
     merror(buffer, "ahd_interpolate()");
-    rgb = (ushort(*)[TS][TS][3]) buffer;
-    lab = (short(*)[TS][TS][3])(buffer + 12 * TS*TS);
-    homo = (char(*)[TS][TS])   (buffer + 24 * TS*TS);
 
-    for (top = 2; top < height - 5; top += TS - 6)
+    taichi::ThreadedTaskManager::run([&](int block) {
+    int i, j, top, left, row, col, tr, tc, c, d, val, hm[2];
+    unsigned ldiff[2][4], abdiff[2][4], leps, abeps;
+    ushort(*rgb)[TS][TS][3], (*rix)[3], (*pix)[4];
+    short(*lab)[TS][TS][3], (*lix)[3];
+    char(*homo)[TS][TS];
+    rgb = (ushort(*)[TS][TS][3]) (buffer + (size_t)block * 26 * TS*TS);
+    lab = (short(*)[TS][TS][3])((char *)rgb + 12 * TS*TS);
+    homo = (char(*)[TS][TS])   ((char *)rgb + 24 * TS*TS);
+
+    for (top = 2 + block * (TS - 6); top < height - 5; top += blocks * (TS - 6))
         for (left = 2; left < width - 5; left += TS - 6) {
 
             /*  Interpolate green horizontally and vertically:        */
@@ -5014,14 +5031,18 @@ void CLASS ahd_interpolate()
                         for (hm[d] = 0, i = tr - 1; i <= tr + 1; i++)
                             for (j = tc - 1; j <= tc + 1; j++)
                                 hm[d] += homo[d][i][j];
-                    if (hm[0] != hm[1])
-                        FORC3 image[row*width + col][c] = rgb[hm[1] > hm[0]][tr][tc][c];
-                    else
-                        FORC3 image[row*width + col][c] =
+                    d = FC(row, col);
+                    if (hm[0] != hm[1]) {
+                        FORC3 if (c != d) image[row*width + col][c] = rgb[hm[1] > hm[0]][tr][tc][c];
+                    }
+                    else {
+                        FORC3 if (c != d) image[row*width + col][c] =
                         (rgb[0][tr][tc][c] + rgb[1][tr][tc][c]) >> 1;
+                    }
                 }
             }
         }
+    }, 0, blocks, blocks, 1);
     free(buffer);
 }
 #undef TS
@@ -9752,8 +9773,18 @@ void CLASS convert_to_rgb()
             _("Converting to %s colorspace...\n"), name[output_color - 1]);
 
     memset(histogram, 0, sizeof histogram);
-    for (img = image[0], row = 0; row < height; row++)
-        for (col = 0; col < width; col++, img += 4) {
+    /* Taichi: blocks of rows are converted in parallel, each counting into
+       a histogram of its own */
+    int blocks = MAX(1, MIN(thread_count, (int)height));
+    int(*block_histograms)[4][0x2000] = (int(*)[4][0x2000]) calloc(blocks, sizeof histogram);
+    merror(block_histograms, "convert_to_rgb()");
+    taichi::ThreadedTaskManager::run([&](int block) {
+    int row, col, c;
+    ushort *img;
+    float out[3];
+    int(*block_histogram)[0x2000] = block_histograms[block];
+    for (row = height * block / blocks; row < height * (block + 1) / blocks; row++)
+        for (img = image[row * width], col = 0; col < width; col++, img += 4) {
             if (!raw_color) {
                 out[0] = out[1] = out[2] = 0;
                 FORCC{
@@ -9765,8 +9796,14 @@ void CLASS convert_to_rgb()
             }
             else if (document_mode)
                 img[0] = img[fcol(row, col)];
-            FORCC histogram[c][img[c] >> 3]++;
-        }
+            FORCC block_histogram[c][img[c] >> 3]++;
+        }
+    }, 0, blocks, blocks, 1);
+    for (i = 0; i < blocks; i++)
+        for (c = 0; c < 4; c++)
+            for (j = 0; j < 0x2000; j++)
+                histogram[c][j] += block_histograms[i][c][j];
+    free(block_histograms);
     if (colors == 4 && output_color) colors = 3;
     if (document_mode && filters) colors = 1;
 }
@@ -10003,10 +10040,7 @@ void CLASS jpeg_thumb()
 
 void CLASS write_ppm_tiff(DCRawOutput &output)
 {
-    struct tiff_hdr th;
-    uchar *ppm;
-    ushort *ppm2;
-    int c, row, col, soff, rstep, cstep;
+    int c, soff, rstep, cstep;
     int perc, val, total, white = 0x2000;
 
     perc = width * height * 0.01;        /* 99th percentile white level */
@@ -10021,29 +10055,23 @@ void CLASS write_ppm_tiff(DCRawOutput &output)
     iheight = height;
     iwidth = width;
     if (flip & 4) SWAP(height, width);
-    ppm = (uchar *)calloc(width, colors*output_bps / 8);
-    ppm2 = (ushort *)ppm;
-    if (output_tiff) {
-        tiff_head(&th, 1);
-        fwrite(&th, sizeof th, 1, ofp);
-        if (oprof)
-            fwrite(oprof, ntohl(oprof[0]), 1, ofp);
-    }
     soff = flip_index(0, 0);
     cstep = flip_index(0, 1) - soff;
     rstep = flip_index(1, 0) - flip_index(0, width);
     output.initialize(width, height, colors);
-    for (row = 0; row < height; row++, soff += rstep) {
-        for (col = 0; col < width; col++, soff += cstep) {
-            FORCC ppm2[col*colors + c] = curve[image[soff][c]];
-            for (int i = 0; i < colors; i++) {
-                output.data[colors * (row * width + col) + i] = ppm2[col * colors + i] *
-                    (1.0f / (1 << 16));
+    /* Taichi: rows are written in parallel, straight into the output */
+    float *rgb = output.get_rgb_target ? output.get_rgb_target(width, height) : nullptr;
+    taichi::ThreadedTaskManager::run([&](int row) {
+        int c, col, s = soff + row * (width * cstep + rstep);
+        for (col = 0; col < width; col++, s += cstep) {
+            if (rgb) {
+                float *pixel = rgb + 3 * ((size_t)col * height + height - 1 - row);
+                FORC3 pixel[c] = curve[image[s][c < (int)colors ? c : 0]] * (1.0f / (1 << 16));
             }
+            else
+                FORCC output.data[colors * (row * width + col) + c] = curve[image[s][c]] * (1.0f / (1 << 16));
         }
-        //fwrite(ppm, colors*output_bps / 8, width, ofp);
-    }
-    free(ppm);
+    }, 0, height, thread_count);
 }
 
 /*
@@ -10099,10 +10127,48 @@ void CLASS write_ppm_tiff()
 }
 */
 
+/* Taichi: inputs are memory mapped where possible, and read through a
+   stream on the mapping, so that dcraw reads them as it reads files */
+FILE *CLASS open_input(const char *name)
+{
+#if defined(__unix__) || defined(__APPLE__)
+    struct stat st;
+    int fd = open(name, O_RDONLY);
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map != MAP_FAILED) {
+            posix_madvise(map, st.st_size, POSIX_MADV_WILLNEED);
+            FILE *fp = fmemopen(map, st.st_size, "rb");
+            if (fp) {
+                ifp_map = map;
+                ifp_map_size = st.st_size;
+                return fp;
+            }
+            munmap(map, st.st_size);
+        }
+    }
+    else if (fd >= 0)
+        close(fd);
+#endif
+    return fopen(name, "rb");
+}
+
+void CLASS close_input()
+{
+    if (ifp) fclose(ifp);
+    ifp = nullptr;
+#if defined(__unix__) || defined(__APPLE__)
+    if (ifp_map) munmap(ifp_map, ifp_map_size);
+#endif
+    ifp_map = nullptr;
+}
+
 int CLASS dcraw_main(int argc, const char **argv, DCRawOutput &output)
 {
     //initialize();
     int arg, status = 0, quality, i, c;
+    thread_count = output.num_threads;
     int timestamp_only = 0, thumbnail_only = 0, identify_only = 0;
     int user_qual = -1, user_black = -1, user_sat = -1, user_flip = -1;
     int use_fuji_rotate = 1, write_to_stdout = 0, read_from_stdin = 0;
@@ -10261,13 +10327,13 @@ int CLASS dcraw_main(int argc, const char **argv, DCRawOutput &output)
         meta_data = ofname = 0;
         ofp = stdout;
         if (setjmp(failure)) {
-            if (fileno(ifp) > 2) fclose(ifp);
+            close_input();
             if (fileno(ofp) > 2) fclose(ofp);
             status = 1;
             goto cleanup;
         }
         ifname = argv[arg];
-        if (!(ifp = fopen(ifname, "rb"))) {
+        if (!(ifp = open_input(ifname))) {
             perror(ifname);
             continue;
         }
@@ -10396,7 +10462,7 @@ int CLASS dcraw_main(int argc, const char **argv, DCRawOutput &output)
             else
                 printf(_("%s is a %s %s image.\n"), ifname, make, model);
         next:
-            fclose(ifp);
+            close_input();
             continue;
         }
         if (meta_length) {
@@ -10498,30 +10564,13 @@ int CLASS dcraw_main(int argc, const char **argv, DCRawOutput &output)
             write_ext = &(".pgm\0.ppm\0.ppm\0.pam"[colors * 5 - 5]);
         ofname = (char *)malloc(strlen(ifname) + 64);
         merror(ofname, "main()");
-        if (write_to_stdout)
-            strcpy(ofname, _("standard output"));
-        else {
-            strcpy(ofname, ifname);
-            if ((cp = strrchr(ofname, '.'))) *cp = 0;
-            if (multi_out)
-                sprintf(ofname + strlen(ofname), "_%0*d",
-                    snprintf(0, 0, "%d", is_raw - 1), shot_select);
-            if (thumbnail_only)
-                strcat(ofname, ".thumb");
-            strcat(ofname, write_ext);
-            ofp = fopen(ofname, "wb");
-            if (!ofp) {
-                status = 1;
-                perror(ofname);
-                goto cleanup;
-            }
-        }
+        /* Taichi: the image goes to output only, without an output file */
+        strcpy(ofname, _("output"));
         if (verbose)
             fprintf(stderr, _("Writing data to %s ...\n"), ofname);
         //(*write_fun)();
         write_ppm_tiff(output);
-        fclose(ifp);
-        if (ofp != stdout) fclose(ofp);
+        close_input();
     cleanup:
         if (meta_data) free(meta_data);
         if (ofname) free(ofname);
@@ -9,14 +9,24 @@
 
 #pragma once
 
+#include <functional>
+
 struct DCRawOutput {
     int width, height, channels;
     float *data = nullptr;
+    // If set, called with the output size for where to write the first three channels instead of data: columns of
+    // bottom-up pixels of three floats, i.e. the storage of an Array2D<Vector3>. Single channels are replicated.
+    std::function<float *(int width, int height)> get_rgb_target;
+    // For demosaicing, color conversion and output, which run over blocks of rows
+    int num_threads = 1;
+
     void initialize(int width, int height, int channels) {
         this->width = width;
         this->height = height;
         this->channels = channels;
-        data = new float[width * height * channels];
+        if (!get_rgb_target) {
+            data = new float[width * height * channels];
+        }
     }
 };
 
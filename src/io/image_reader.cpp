@@ -12,51 +12,83 @@
 #include <mutex>
 #include <taichi/io/image_reader.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 TC_NAMESPACE_BEGIN
 
-Array2D<Vector4> dcraw_read(const std::string &filepath) {
-    // Single threaded...
+// dcraw keeps its state in globals, so files are decoded one at a time, each by num_threads threads
+void dcraw_decode(const std::string &filepath, DCRawOutput &output, int num_threads) {
     static std::mutex lock;
     std::lock_guard<std::mutex> lock_guard(lock);
-    std::string filepath_non_const = filepath;
+    // dcraw_main() sets argv[argc]
     std::vector<const char *> argv{
         "dcraw.exe",
         "-4",
         "-T",
         "-W",
-        filepath_non_const.c_str()
+        filepath.c_str(),
+        nullptr
     };
-    DCRawOutput output;
-    dcraw_main((int)argv.size(), &argv[0], output);
-    auto img = Array2D<Vector4>(output.width, output.height, Vector4(0.0f));
-    for (auto &ind : img.get_region()) {
-        for (int i = 0; i < output.channels; i++) {
-            img[ind][i] = output.data[output.channels * (ind.j * output.width + ind.i) + i];
-        }
-    }
-    delete[] output.data;
-    img.flip(1);
-    P(output.width);
-    P(output.height);
-    P(img.get_width());
-    P(img.get_height());
-    P(img.get_size());
-    return img;
+    output.num_threads = num_threads;
+    int status = dcraw_main((int)argv.size() - 1, &argv[0], output);
+    assert_info(status == 0, "Raw image decoding failed: " + filepath);
 }
 
 class RawImageReader final : public ImageReader {
+protected:
+    int num_threads;
+
 public:
     void initialize(const Config &config) override {
-
+        num_threads = config.get("num_threads", 1);
     }
 
     Array2D<Vector4> read(const std::string &filepath) override {
-        auto tmp = dcraw_read(filepath);
-        P("read!!");
-        return tmp;
+        DCRawOutput output;
+        dcraw_decode(filepath, output, num_threads);
+        auto img = Array2D<Vector4>(output.width, output.height, Vector4(0.0f));
+        for (auto &ind : img.get_region()) {
+            for (int i = 0; i < output.channels; i++) {
+                img[ind][i] = output.data[output.channels * (ind.j * output.width + ind.i) + i];
+            }
+        }
+        delete[] output.data;
+        img.flip(1);
+        return img;
+    }
+
+    // Decoded straight into the storage of the image
+    Array2D<Vector3> read_rgb(const std::string &filepath) override {
+        Array2D<Vector3> img;
+        DCRawOutput output;
+        output.get_rgb_target = [&](int width, int height) {
+            img.allocate(width, height);
+            return &img[0][0][0];
+        };
+        dcraw_decode(filepath, output, num_threads);
+        return img;
+    }
+
+    std::vector<Array2D<Vector3>> read_all(const std::vector<std::string> &filepaths) override {
+#if defined(__unix__) || defined(__APPLE__)
+        // Have the system read all the files in the background while the first ones are decoded
+        for (auto &filepath : filepaths) {
+            int fd = open(filepath.c_str(), O_RDONLY);
+            if (fd >= 0) {
+#if defined(POSIX_FADV_WILLNEED)
+                posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+                close(fd);
+            }
+        }
+#endif
+        return ImageReader::read_all(filepaths);
     }
 };
 
 TC_IMPLEMENTATION(ImageReader, RawImageReader, "raw");
 
-TC_NAMESPACE_END
\ No newline at end of file
+TC_NAMESPACE_END
@@ -0,0 +1,210 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/io/image_writer.h>
+#include <taichi/physics/physics_constants.h>
+#include <taichi/system/threading.h>
+#include <glm/gtc/packing.hpp>
+#include <stb_image_write.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// Compiled with the rest of stb_image_write in visualization/image_buffer.cpp; the result is malloc'ed
+unsigned char *stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality);
+
+TC_NAMESPACE_BEGIN
+
+real get_image_exposure_scale(const Array2D<Vector3> &image, int num_threads) {
+    const int width = image.get_width(), height = image.get_height();
+    // Summed per column in order, so that the scale does not depend on the thread count, and in double, as
+    // single precision sums of large images lose much of the smaller pixels
+    const Vector3d sum = parallel_reduce(0, width, num_threads, Vector3d(0.0), [&](int i) {
+        Vector3d column(0.0);
+        for (int j = 0; j < height; j++) {
+            column += Vector3d(image[i][j]);
+        }
+        return column;
+    }, [](const Vector3d &a, const Vector3d &b) { return a + b; }, true);
+    return luminance(Vector3(sum / ((double)width * height))) / luminance(Vector3(1.0f)) / 0.18f;
+}
+
+void write_ldr_image(const std::string &fn, const Array2D<Vector3> &image, real scale, real gamma,
+                     int num_threads) {
+    const int width = image.get_width(), height = image.get_height();
+    // Values of at least thresholds[b] (over scale) become b or more
+    real thresholds[256];
+    thresholds[0] = 0;
+    for (int b = 1; b < 256; b++) {
+        thresholds[b] = scale * std::pow(b / 255.0f, gamma);
+    }
+    std::vector<unsigned char> data((std::size_t)width * height * 3);
+    parallel_for(0, height, num_threads, [&](int j) {
+        unsigned char *row = &data[(std::size_t)(height - 1 - j) * width * 3];
+        for (int i = 0; i < width; i++) {
+            const Vector3 &pixel = image[i][j];
+            for (int k = 0; k < 3; k++) {
+                // Binary search for the last threshold not above the value; NaNs become 0
+                int b = 0;
+                for (int step = 128; step > 0; step >>= 1) {
+                    b += thresholds[b + step] <= pixel[k] ? step : 0;
+                }
+                row[i * 3 + k] = (unsigned char)b;
+            }
+        }
+    }, 16);
+    stbi_write_png(fn.c_str(), width, height, 3, data.data(), width * 3);
+}
+
+namespace {
+
+// Little-endian output of the OpenEXR header and offset table
+class EXRBuffer {
+public:
+    std::vector<char> bytes;
+
+    void write(const void *data, std::size_t size) {
+        const char *p = reinterpret_cast<const char *>(data);
+        bytes.insert(bytes.end(), p, p + size);
+    }
+
+    void write_byte(char v) {
+        bytes.push_back(v);
+    }
+
+    void write_int(int32_t v) {
+        write(&v, 4);
+    }
+
+    void write_float(float v) {
+        write(&v, 4);
+    }
+
+    void write_string(const std::string &s) {
+        write(s.c_str(), s.size() + 1);
+    }
+
+    void write_attribute(const std::string &name, const std::string &type, int32_t size) {
+        write_string(name);
+        write_string(type);
+        write_int(size);
+    }
+};
+
+const int exr_block_lines = 16;
+
+}  // namespace
+
+void write_exr_image(const std::string &fn, const Array2D<Vector3> &image, bool half, int num_threads) {
+    const int width = image.get_width(), height = image.get_height();
+    const int pixel_type = half ? 1 : 2, scalar_size = half ? 2 : 4;
+    EXRBuffer header;
+    const int32_t magic = 20000630, version = 2;
+    header.write_int(magic);
+    header.write_int(version);
+    // Channels in alphabetical order, which is also their order in the scanlines
+    const char *channel_names[3] = {"B", "G", "R"};
+    header.write_attribute("channels", "chlist", 3 * 18 + 1);
+    for (auto name : channel_names) {
+        header.write_string(name);
+        header.write_int(pixel_type);
+        // pLinear and reserved
+        header.write_int(0);
+        header.write_int(1);
+        header.write_int(1);
+    }
+    header.write_byte(0);
+    header.write_attribute("compression", "compression", 1);
+    // ZIP_COMPRESSION
+    header.write_byte(3);
+    for (auto window : {"dataWindow", "displayWindow"}) {
+        header.write_attribute(window, "box2i", 16);
+        header.write_int(0);
+        header.write_int(0);
+        header.write_int(width - 1);
+        header.write_int(height - 1);
+    }
+    header.write_attribute("lineOrder", "lineOrder", 1);
+    // INCREASING_Y
+    header.write_byte(0);
+    header.write_attribute("pixelAspectRatio", "float", 4);
+    header.write_float(1.0f);
+    header.write_attribute("screenWindowCenter", "v2f", 8);
+    header.write_float(0.0f);
+    header.write_float(0.0f);
+    header.write_attribute("screenWindowWidth", "float", 4);
+    header.write_float(1.0f);
+    header.write_byte(0);
+
+    const int num_blocks = (height + exr_block_lines - 1) / exr_block_lines;
+    std::vector<std::vector<char>> blocks(num_blocks);
+    parallel_for(0, num_blocks, num_threads, [&](int block) {
+        const int first = block * exr_block_lines, lines = std::min(exr_block_lines, height - first);
+        const std::size_t line_size = (std::size_t)width * 3 * scalar_size, size = line_size * lines;
+        std::vector<char> raw(size);
+        for (int y = first; y < first + lines; y++) {
+            // Scanlines run from the top, the image from the bottom
+            const int j = height - 1 - y;
+            char *line = &raw[(y - first) * line_size];
+            for (int c = 0; c < 3; c++) {
+                char *channel = line + (std::size_t)c * width * scalar_size;
+                for (int i = 0; i < width; i++) {
+                    const float v = image[i][j][2 - c];
+                    if (half) {
+                        const uint16_t h = glm::packHalf1x16(v);
+                        std::memcpy(channel + i * 2, &h, 2);
+                    } else {
+                        std::memcpy(channel + i * 4, &v, 4);
+                    }
+                }
+            }
+        }
+        // ZIP blocks hold the even bytes, then the odd ones, as differences of consecutive bytes
+        std::vector<unsigned char> shuffled(size);
+        const std::size_t half_size = (size + 1) / 2;
+        for (std::size_t k = 0; k < size; k++) {
+            shuffled[(k & 1) ? half_size + k / 2 : k / 2] = (unsigned char)raw[k];
+        }
+        for (std::size_t k = size - 1; k > 0; k--) {
+            shuffled[k] = (unsigned char)(shuffled[k] - shuffled[k - 1] + 128);
+        }
+        int compressed_size;
+        unsigned char *stream = stbi_zlib_compress(shuffled.data(), (int)size, &compressed_size, 8);
+        assert_info(stream != nullptr, "Compression failed");
+        std::vector<char> &out = blocks[block];
+        // Stored uncompressed if that is not smaller, which readers recognize by the size
+        const bool compressed = (std::size_t)compressed_size < size;
+        const int32_t data_size = compressed ? compressed_size : (int32_t)size;
+        out.resize(8 + data_size);
+        std::memcpy(&out[0], &first, 4);
+        std::memcpy(&out[4], &data_size, 4);
+        std::memcpy(&out[8], compressed ? reinterpret_cast<char *>(stream) : raw.data(), data_size);
+        std::free(stream);
+    }, 1);
+
+    uint64 offset = header.bytes.size() + num_blocks * sizeof(uint64);
+    for (auto &block : blocks) {
+        header.write(&offset, sizeof(offset));
+        offset += block.size();
+    }
+    FILE *f = std::fopen(fn.c_str(), "wb");
+    assert_info(f != nullptr, "Can not write image file " + fn);
+    bool written = std::fwrite(header.bytes.data(), 1, header.bytes.size(), f) == header.bytes.size();
+    for (auto &block : blocks) {
+        written = written && std::fwrite(block.data(), 1, block.size(), f) == block.size();
+    }
+    written = std::fclose(f) == 0 && written;
+    assert_info(written, "Can not write image file " + fn);
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,131 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/io/particle_exporter.h>
+#include <taichi/io/compression.h>
+#include <cstdio>
+
+TC_NAMESPACE_BEGIN
+
+const uint64 particle_frame_magic = 0x454d415246504354ull; // "TCPFRAME"
+
+ParticleExporter::ParticleExporter(int chunk_size, int max_queued_frames)
+        : chunk_size(chunk_size), max_queued_frames(max_queued_frames) {
+    assert_info(chunk_size > 0, "chunk_size must be positive");
+    assert_info(max_queued_frames > 0, "max_queued_frames must be positive");
+    writer = std::thread([this]() { writer_loop(); });
+}
+
+void ParticleExporter::write(const std::string &fn, ParticleFrame &&frame, bool compress) {
+    std::unique_lock<std::mutex> lock(mut);
+    task_done.wait(lock, [this]() { return (int)tasks.size() < max_queued_frames; });
+    tasks.push_back(Task{fn, std::move(frame), compress});
+    num_pending++;
+    task_available.notify_one();
+}
+
+void ParticleExporter::wait() {
+    std::unique_lock<std::mutex> lock(mut);
+    task_done.wait(lock, [this]() { return num_pending == 0; });
+}
+
+ParticleExporter::~ParticleExporter() {
+    {
+        std::lock_guard<std::mutex> lock(mut);
+        stopping = true;
+    }
+    task_available.notify_one();
+    writer.join();
+}
+
+void ParticleExporter::writer_loop() {
+    while (true) {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lock(mut);
+            task_available.wait(lock, [this]() { return stopping || !tasks.empty(); });
+            // Frames already handed over are still written when stopping
+            if (tasks.empty()) {
+                return;
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task_done.notify_all();
+        try {
+            write_frame(task);
+        } catch (...) {
+            // There is no caller to rethrow to on this thread; assert_info has already printed the cause
+            fprintf(stderr, "Failed to export particles to %s\n", task.fn.c_str());
+        }
+        {
+            std::lock_guard<std::mutex> lock(mut);
+            num_pending--;
+        }
+        task_done.notify_all();
+    }
+}
+
+void ParticleExporter::write_frame(const Task &task) const {
+    const ParticleFrame &frame = task.frame;
+    int fields = frame.fields;
+    if (frame.velocity.size() != frame.position.size()) {
+        fields &= ~ParticleFrame::VELOCITY;
+    }
+    if (frame.state.size() != frame.position.size()) {
+        fields &= ~ParticleFrame::STATE;
+    }
+    if (frame.color.size() != frame.position.size()) {
+        fields &= ~ParticleFrame::COLOR;
+    }
+    BinaryFileStreamOutput os(task.fn);
+    os << particle_frame_magic << int(version) << fields << int(task.compress) << chunk_size;
+    os << uint64(frame.position.size()) << frame.time;
+    write_chunked(os, frame.position, chunk_size, task.compress);
+    if (fields & ParticleFrame::VELOCITY) {
+        write_chunked(os, frame.velocity, chunk_size, task.compress);
+    }
+    if (fields & ParticleFrame::STATE) {
+        write_chunked(os, frame.state, chunk_size, task.compress);
+    }
+    if (fields & ParticleFrame::COLOR) {
+        write_chunked(os, frame.color, chunk_size, task.compress);
+    }
+    os.close();
+}
+
+bool read_particle_frame(const std::string &fn, ParticleFrame &frame) {
+    BinaryFileStreamInput is(fn);
+    if (is.read<uint64>() != particle_frame_magic || is.read<int>() != ParticleExporter::version) {
+        return false;
+    }
+    int compressed, chunk_size;
+    uint64 num_particles;
+    is >> frame.fields >> compressed >> chunk_size >> num_particles >> frame.time;
+    assert_info(chunk_size > 0, "Corrupted particle frame header");
+    read_chunked(is, frame.position, num_particles, chunk_size, compressed != 0);
+    if (frame.fields & ParticleFrame::VELOCITY) {
+        read_chunked(is, frame.velocity, num_particles, chunk_size, compressed != 0);
+    } else {
+        frame.velocity.clear();
+    }
+    if (frame.fields & ParticleFrame::STATE) {
+        read_chunked(is, frame.state, num_particles, chunk_size, compressed != 0);
+    } else {
+        frame.state.clear();
+    }
+    if (frame.fields & ParticleFrame::COLOR) {
+        read_chunked(is, frame.color, num_particles, chunk_size, compressed != 0);
+    } else {
+        frame.color.clear();
+    }
+    return true;
+}
+
+TC_NAMESPACE_END
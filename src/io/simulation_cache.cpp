@@ -0,0 +1,458 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/io/simulation_cache.h>
+#include <taichi/io/compression.h>
+#include <taichi/system/threading.h>
+#include <algorithm>
+#include <cmath>
+
+TC_NAMESPACE_BEGIN
+
+const uint64 simulation_cache_magic = 0x4548434143534354ull; // "TCSCACHE"
+const int quantization_levels = 65535;
+
+// Scalar sizes of the planes of a block, each holding one scalar per particle
+static std::vector<int> get_block_planes(int fields) {
+    std::vector<int> planes = {2, 2, 2};
+    if (fields & ParticleFrame::VELOCITY) {
+        planes.insert(planes.end(), {4, 4, 4});
+    }
+    if (fields & ParticleFrame::STATE) {
+        planes.push_back(4);
+    }
+    if (fields & ParticleFrame::COLOR) {
+        planes.insert(planes.end(), {4, 4, 4});
+    }
+    return planes;
+}
+
+static int get_particle_bytes(const std::vector<int> &planes) {
+    int bytes = 0;
+    for (int p : planes) {
+        bytes += p;
+    }
+    return bytes;
+}
+
+static int64 get_block_key(const Vector3i &coord) {
+    const int64 bias = 1 << 20;
+    return ((coord.x + bias) << 42) | ((coord.y + bias) << 21) | (coord.z + bias);
+}
+
+// Turns data into its difference from previous (subtraction of 16-bit scalars, XOR of 32-bit ones), or with
+// decode, back. Plane p of data holds count scalars, of previous previous_count; only the scalars of the
+// first min(count, previous_count) particles have a counterpart.
+static void apply_delta(char *data, int count, const char *previous, int previous_count, const std::vector<int> &planes,
+                        bool decode) {
+    const int n = std::min(count, previous_count);
+    for (int p : planes) {
+        if (p == 2) {
+            uint16_t *d = reinterpret_cast<uint16_t *>(data);
+            const uint16_t *prev = reinterpret_cast<const uint16_t *>(previous);
+            for (int i = 0; i < n; i++) {
+                d[i] = decode ? uint16_t(d[i] + prev[i]) : uint16_t(d[i] - prev[i]);
+            }
+        } else {
+            uint32_t *d = reinterpret_cast<uint32_t *>(data);
+            const uint32_t *prev = reinterpret_cast<const uint32_t *>(previous);
+            for (int i = 0; i < n; i++) {
+                d[i] ^= prev[i];
+            }
+        }
+        data += p * count;
+        previous += p * previous_count;
+    }
+}
+
+// Blocks are shuffled as 16-bit scalars, tiles as 32-bit ones
+static void compress_payload(const std::vector<char> &data, int scalar_size, std::vector<char> &compressed) {
+    compress_shuffled(data.data(), data.size() / scalar_size, scalar_size, compressed);
+}
+
+SimulationCacheWriter::SimulationCacheWriter(const std::string &fn, real block_size, int keyframe_interval,
+                                             int num_threads)
+        : block_size(block_size), keyframe_interval(keyframe_interval), num_threads(num_threads) {
+    assert_info(block_size > 0, "block_size must be positive");
+    assert_info(keyframe_interval > 0, "keyframe_interval must be positive");
+    os = std::make_unique<BinaryFileStreamOutput>(fn);
+    *os << simulation_cache_magic << int(version) << block_size << keyframe_interval;
+}
+
+void SimulationCacheWriter::write(const ParticleFrame &frame, const SparseVolume *volume) {
+    assert_info(os != nullptr, "The simulation cache is closed");
+    const int n = frame.size();
+    int fields = ParticleFrame::POSITION;
+    if ((frame.fields & ParticleFrame::VELOCITY) && (int)frame.velocity.size() == n) {
+        fields |= ParticleFrame::VELOCITY;
+    }
+    if ((frame.fields & ParticleFrame::STATE) && (int)frame.state.size() == n) {
+        fields |= ParticleFrame::STATE;
+    }
+    if ((frame.fields & ParticleFrame::COLOR) && (int)frame.color.size() == n) {
+        fields |= ParticleFrame::COLOR;
+    }
+    const bool keyframe = index.size() % keyframe_interval == 0 || fields != previous.fields ||
+                          (volume != nullptr) != previous.has_volume ||
+                          (volume != nullptr && (volume->res != previous.res || volume->channels != previous.channels));
+    DeltaState current;
+    current.fields = fields;
+    current.has_volume = volume != nullptr;
+
+    // Particles, by block, in their order within each block
+    std::vector<Vector3i> coords(n);
+    std::vector<int64> keys(n);
+    parallel_for(0, n, num_threads, [&](int i) {
+        for (int a = 0; a < 3; a++) {
+            coords[i][a] = (int)std::floor(frame.position[i][a] / block_size);
+        }
+        keys[i] = get_block_key(coords[i]);
+    });
+    std::vector<int> order(n);
+    for (int i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return keys[a] < keys[b]; });
+    std::vector<SimulationCacheEntry> blocks;
+    std::vector<int> block_begin;
+    for (int i = 0; i < n; i++) {
+        if (i == 0 || keys[order[i]] != keys[order[i - 1]]) {
+            blocks.push_back(SimulationCacheEntry{coords[order[i]], 0, 0, 0});
+            block_begin.push_back(i);
+        }
+        blocks.back().count++;
+    }
+    const std::vector<int> planes = get_block_planes(fields);
+    const int particle_bytes = get_particle_bytes(planes);
+    std::vector<std::vector<char>> block_data(blocks.size()), block_payloads(blocks.size());
+    parallel_for(0, (int)blocks.size(), num_threads, [&](int b) {
+        const SimulationCacheEntry &block = blocks[b];
+        const std::vector<int> indices(order.begin() + block_begin[b], order.begin() + block_begin[b] + block.count);
+        std::vector<char> &data = block_data[b];
+        data.resize(block.count * particle_bytes);
+        char *out = data.data();
+        auto write_planes = [&](const std::vector<Vector3> &values) {
+            for (int a = 0; a < 3; a++) {
+                for (int i : indices) {
+                    std::memcpy(out, &values[i][a], sizeof(real));
+                    out += sizeof(real);
+                }
+            }
+        };
+        for (int a = 0; a < 3; a++) {
+            const real origin = block.coord[a] * block_size;
+            for (int i : indices) {
+                const real t = (frame.position[i][a] - origin) / block_size;
+                const uint16_t q = (uint16_t)clamp((int)std::lround(t * quantization_levels), 0, quantization_levels);
+                std::memcpy(out, &q, sizeof(q));
+                out += sizeof(q);
+            }
+        }
+        if (fields & ParticleFrame::VELOCITY) {
+            write_planes(frame.velocity);
+        }
+        if (fields & ParticleFrame::STATE) {
+            for (int i : indices) {
+                std::memcpy(out, &frame.state[i], sizeof(int));
+                out += sizeof(int);
+            }
+        }
+        if (fields & ParticleFrame::COLOR) {
+            write_planes(frame.color);
+        }
+        std::vector<char> delta = data;
+        auto prev = previous.blocks.find(get_block_key(block.coord));
+        if (!keyframe && prev != previous.blocks.end()) {
+            apply_delta(delta.data(), block.count, prev->second.data(), (int)prev->second.size() / particle_bytes,
+                        planes, false);
+        }
+        compress_payload(delta, 2, block_payloads[b]);
+    }, 1);
+
+    // Tiles, each the values of all channels
+    std::vector<SimulationCacheEntry> tiles;
+    std::vector<std::vector<char>> tile_data, tile_payloads;
+    if (volume != nullptr) {
+        const Vector3i tile_res = volume->get_tile_res();
+        const int num_tiles = volume->get_num_tiles(), num_channels = (int)volume->channels.size();
+        const int tile_bytes = num_channels * SparseVolume::tile_volume * sizeof(real);
+        tiles.resize(num_tiles);
+        tile_data.resize(num_tiles);
+        tile_payloads.resize(num_tiles);
+        parallel_for(0, num_tiles, num_threads, [&](int t) {
+            const int tile = volume->tiles[t];
+            tiles[t] = SimulationCacheEntry{
+                    Vector3i(tile / (tile_res.y * tile_res.z), tile / tile_res.z % tile_res.y, tile % tile_res.z), 0,
+                    0, 0};
+            std::vector<char> &data = tile_data[t];
+            data.resize(tile_bytes);
+            for (int c = 0; c < num_channels; c++) {
+                std::memcpy(&data[c * SparseVolume::tile_volume * sizeof(real)],
+                            &volume->values[c][t * SparseVolume::tile_volume],
+                            SparseVolume::tile_volume * sizeof(real));
+            }
+            std::vector<char> delta = data;
+            auto prev = previous.tiles.find(tile);
+            if (!keyframe && prev != previous.tiles.end()) {
+                apply_delta(delta.data(), tile_bytes / 4, prev->second.data(), tile_bytes / 4, {4}, false);
+            }
+            compress_payload(delta, 4, tile_payloads[t]);
+        }, 1);
+        current.res = volume->res;
+        current.channels = volume->channels;
+    }
+
+    // The directory, measured first to place the payloads after it
+    auto write_directory = [&](BinaryMemoryStreamOutput &dir) {
+        dir << frame.time << fields << int(keyframe) << uint64(n) << blocks << int(volume != nullptr);
+        if (volume != nullptr) {
+            dir << volume->res << volume->storage_offset << volume->channels << volume->backgrounds << tiles;
+        }
+    };
+    const uint64 frame_offset = os->tell();
+    BinaryMemoryStreamOutput dir;
+    write_directory(dir);
+    uint64 offset = frame_offset + dir.data.size();
+    for (int b = 0; b < (int)blocks.size(); b++) {
+        blocks[b].offset = offset;
+        blocks[b].size = block_payloads[b].size();
+        offset += blocks[b].size;
+    }
+    for (int t = 0; t < (int)tiles.size(); t++) {
+        tiles[t].offset = offset;
+        tiles[t].size = tile_payloads[t].size();
+        offset += tiles[t].size;
+    }
+    dir.data.clear();
+    write_directory(dir);
+    os->write_raw(dir.data.data(), dir.data.size());
+    for (auto &payload : block_payloads) {
+        os->write_raw(payload.data(), payload.size());
+    }
+    for (auto &payload : tile_payloads) {
+        os->write_raw(payload.data(), payload.size());
+    }
+    index.push_back(IndexEntry{frame.time, int(keyframe), frame_offset});
+
+    for (int b = 0; b < (int)blocks.size(); b++) {
+        current.blocks[get_block_key(blocks[b].coord)] = std::move(block_data[b]);
+    }
+    for (int t = 0; t < (int)tiles.size(); t++) {
+        current.tiles[volume->tiles[t]] = std::move(tile_data[t]);
+    }
+    previous = std::move(current);
+}
+
+void SimulationCacheWriter::close() {
+    if (os != nullptr) {
+        const uint64 index_offset = os->tell();
+        *os << index << index_offset << simulation_cache_magic;
+        os->close();
+        os.reset();
+    }
+}
+
+SimulationCacheWriter::~SimulationCacheWriter() {
+    try {
+        close();
+    } catch (...) {
+        // assert_info has already printed the cause
+    }
+}
+
+SimulationCacheReader::SimulationCacheReader(const std::string &fn, int num_threads)
+        : fn(fn), num_threads(num_threads) {
+    is = std::make_unique<BinaryFileStreamInput>(fn, 1 << 20);
+    int file_version, keyframe_interval;
+    assert_info(is->read<uint64>() == simulation_cache_magic, fn + " is not a simulation cache");
+    *is >> file_version >> block_size >> keyframe_interval;
+    assert_info(file_version == SimulationCacheWriter::version,
+                "Unsupported simulation cache version " + std::to_string(file_version));
+    const uint64 size = is->get_file_size();
+    assert_info(size >= 16, fn + " was not closed");
+    is->seek(size - 16);
+    uint64 index_offset, magic;
+    *is >> index_offset >> magic;
+    assert_info(magic == simulation_cache_magic && index_offset < size, fn + " was not closed");
+    is->seek(index_offset);
+    *is >> index;
+}
+
+void SimulationCacheReader::read(int frame, ParticleFrame *particles, SparseVolume *volume, const Vector3 &lower,
+                                 const Vector3 &upper) {
+    assert_info(0 <= frame && frame < get_num_frames(), "No frame " + std::to_string(frame) + " in " + fn);
+    auto overlaps = [&](const Vector3i &coord, real size) {
+        for (int a = 0; a < 3; a++) {
+            if (coord[a] * size > upper[a] || (coord[a] + 1) * size < lower[a]) {
+                return false;
+            }
+        }
+        return true;
+    };
+    int first = frame;
+    while (!index[first].keyframe) {
+        first--;
+    }
+    SimulationCacheWriter::DeltaState state;
+    std::vector<SimulationCacheEntry> blocks, tiles;
+    std::vector<std::vector<char>> block_data, tile_data;
+    std::vector<real> backgrounds;
+    Vector3 storage_offset;
+    real time;
+    for (int f = first; f <= frame; f++) {
+        is->seek(index[f].offset);
+        SimulationCacheWriter::DeltaState current;
+        int keyframe, has_volume;
+        uint64 num_particles;
+        *is >> time >> current.fields >> keyframe >> num_particles >> blocks >> has_volume;
+        current.has_volume = has_volume != 0;
+        tiles.clear();
+        if (current.has_volume) {
+            *is >> current.res >> storage_offset >> current.channels >> backgrounds >> tiles;
+        }
+        const std::vector<int> planes = get_block_planes(current.fields);
+        const int particle_bytes = get_particle_bytes(planes);
+        const int tile_bytes = (int)current.channels.size() * SparseVolume::tile_volume * sizeof(real);
+        if (particles == nullptr) {
+            blocks.clear();
+        }
+        blocks.erase(std::remove_if(blocks.begin(), blocks.end(),
+                                    [&](const SimulationCacheEntry &e) { return !overlaps(e.coord, block_size); }),
+                     blocks.end());
+        const bool with_tiles = current.has_volume && volume != nullptr;
+        if (!with_tiles) {
+            tiles.clear();
+        }
+        tiles.erase(std::remove_if(tiles.begin(), tiles.end(), [&](const SimulationCacheEntry &e) {
+            return !overlaps(e.coord, (real)SparseVolume::tile_size);
+        }), tiles.end());
+        // Payloads are read in file order, then decoded in parallel
+        std::vector<std::vector<char>> block_payloads(blocks.size()), tile_payloads(tiles.size());
+        for (int b = 0; b < (int)blocks.size(); b++) {
+            block_payloads[b].resize(blocks[b].size);
+            is->seek(blocks[b].offset);
+            is->read_raw(block_payloads[b].data(), blocks[b].size);
+        }
+        for (int t = 0; t < (int)tiles.size(); t++) {
+            tile_payloads[t].resize(tiles[t].size);
+            is->seek(tiles[t].offset);
+            is->read_raw(tile_payloads[t].data(), tiles[t].size);
+        }
+        block_data.assign(blocks.size(), std::vector<char>());
+        tile_data.assign(tiles.size(), std::vector<char>());
+        parallel_for(0, (int)blocks.size(), num_threads, [&](int b) {
+            std::vector<char> &data = block_data[b];
+            data.resize(blocks[b].count * particle_bytes);
+            assert_info(decompress_shuffled(block_payloads[b].data(), block_payloads[b].size(), data.size() / 2, 2,
+                                            data.data()), "Corrupted block in " + fn);
+            auto prev = state.blocks.find(get_block_key(blocks[b].coord));
+            if (!keyframe && prev != state.blocks.end()) {
+                apply_delta(data.data(), blocks[b].count, prev->second.data(),
+                            (int)prev->second.size() / particle_bytes, planes, true);
+            }
+        }, 1);
+        const Vector3i tile_res = (current.res + Vector3i(SparseVolume::tile_size - 1)) / SparseVolume::tile_size;
+        auto get_tile_index = [&](const Vector3i &coord) {
+            return (coord.x * tile_res.y + coord.y) * tile_res.z + coord.z;
+        };
+        parallel_for(0, (int)tiles.size(), num_threads, [&](int t) {
+            std::vector<char> &data = tile_data[t];
+            data.resize(tile_bytes);
+            assert_info(decompress_shuffled(tile_payloads[t].data(), tile_payloads[t].size(), data.size() / 4, 4,
+                                            data.data()), "Corrupted tile in " + fn);
+            auto prev = state.tiles.find(get_tile_index(tiles[t].coord));
+            if (!keyframe && prev != state.tiles.end()) {
+                apply_delta(data.data(), tile_bytes / 4, prev->second.data(), tile_bytes / 4, {4}, true);
+            }
+        }, 1);
+        if (f < frame) {
+            for (int b = 0; b < (int)blocks.size(); b++) {
+                current.blocks[get_block_key(blocks[b].coord)] = std::move(block_data[b]);
+            }
+            for (int t = 0; t < (int)tiles.size(); t++) {
+                current.tiles[get_tile_index(tiles[t].coord)] = std::move(tile_data[t]);
+            }
+        }
+        state = std::move(current);
+    }
+
+    if (particles != nullptr) {
+        const int fields = state.fields;
+        particles->fields = fields;
+        particles->time = time;
+        particles->position.clear();
+        particles->velocity.clear();
+        particles->state.clear();
+        particles->color.clear();
+        for (int b = 0; b < (int)blocks.size(); b++) {
+            const int count = blocks[b].count;
+            const char *data = block_data[b].data();
+            auto get_scalar = [&](int plane_offset, int i) {
+                real r;
+                std::memcpy(&r, data + plane_offset + i * sizeof(real), sizeof(real));
+                return r;
+            };
+            const int velocity_offset = 6 * count;
+            const int state_offset = velocity_offset + (fields & ParticleFrame::VELOCITY ? 12 * count : 0);
+            const int color_offset = state_offset + (fields & ParticleFrame::STATE ? 4 * count : 0);
+            for (int i = 0; i < count; i++) {
+                Vector3 pos;
+                for (int a = 0; a < 3; a++) {
+                    uint16_t q;
+                    std::memcpy(&q, data + (a * count + i) * sizeof(q), sizeof(q));
+                    pos[a] = (blocks[b].coord[a] + (real)q / quantization_levels) * block_size;
+                }
+                if (pos.x < lower.x || pos.y < lower.y || pos.z < lower.z || pos.x > upper.x || pos.y > upper.y ||
+                    pos.z > upper.z) {
+                    continue;
+                }
+                particles->position.push_back(pos);
+                if (fields & ParticleFrame::VELOCITY) {
+                    particles->velocity.push_back(Vector3(get_scalar(velocity_offset, i),
+                                                          get_scalar(velocity_offset + 4 * count, i),
+                                                          get_scalar(velocity_offset + 8 * count, i)));
+                }
+                if (fields & ParticleFrame::STATE) {
+                    int s;
+                    std::memcpy(&s, data + state_offset + i * sizeof(int), sizeof(int));
+                    particles->state.push_back(s);
+                }
+                if (fields & ParticleFrame::COLOR) {
+                    particles->color.push_back(Vector3(get_scalar(color_offset, i),
+                                                       get_scalar(color_offset + 4 * count, i),
+                                                       get_scalar(color_offset + 8 * count, i)));
+                }
+            }
+        }
+    }
+
+    if (volume != nullptr) {
+        *volume = SparseVolume();
+        volume->time = time;
+        if (state.has_volume) {
+            const Vector3i tile_res = (state.res + Vector3i(SparseVolume::tile_size - 1)) / SparseVolume::tile_size;
+            volume->res = state.res;
+            volume->storage_offset = storage_offset;
+            volume->channels = state.channels;
+            volume->backgrounds = backgrounds;
+            volume->values.resize(state.channels.size());
+            for (int t = 0; t < (int)tiles.size(); t++) {
+                const Vector3i &coord = tiles[t].coord;
+                volume->tiles.push_back((coord.x * tile_res.y + coord.y) * tile_res.z + coord.z);
+                const real *values = reinterpret_cast<const real *>(tile_data[t].data());
+                for (int c = 0; c < (int)state.channels.size(); c++) {
+                    volume->values[c].insert(volume->values[c].end(), values + c * SparseVolume::tile_volume,
+                                             values + (c + 1) * SparseVolume::tile_volume);
+                }
+            }
+        }
+    }
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,209 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/io/volume_exporter.h>
+#include <taichi/io/compression.h>
+#include <taichi/system/threading.h>
+#include <cmath>
+#include <cstdio>
+
+TC_NAMESPACE_BEGIN
+
+const uint64 sparse_volume_magic = 0x4d4c4f5650534354ull; // "TCSPVOLM"
+
+void SparseVolume::from_arrays(const std::vector<std::string> &channels,
+                               const std::vector<const Array3D<real> *> &fields, const std::vector<real> &backgrounds,
+                               real threshold, int num_threads) {
+    assert_info(!fields.empty(), "A sparse volume needs at least one field");
+    assert_info(channels.size() == fields.size() && backgrounds.size() == fields.size(),
+                "Every field needs a channel name and a background");
+    const int num_channels = (int)fields.size();
+    res = Vector3i(fields[0]->get_width(), fields[0]->get_height(), fields[0]->get_depth());
+    for (auto field : fields) {
+        assert_info(field->get_width() == res.x && field->get_height() == res.y && field->get_depth() == res.z,
+                    "The fields of a sparse volume must share their resolution");
+    }
+    storage_offset = fields[0]->get_storage_offset();
+    this->channels = channels;
+    this->backgrounds = backgrounds;
+    const Vector3i tile_res = get_tile_res();
+    // Tiles are picked per x slab of tiles, then concatenated in order
+    std::vector<std::vector<int>> slab_tiles(tile_res.x);
+    std::vector<std::vector<std::vector<real>>> slab_values(tile_res.x, std::vector<std::vector<real>>(num_channels));
+    parallel_for(0, tile_res.x, num_threads, [&](int tx) {
+        std::vector<std::vector<real>> tile(num_channels, std::vector<real>(tile_volume));
+        for (int ty = 0; ty < tile_res.y; ty++) {
+            for (int tz = 0; tz < tile_res.z; tz++) {
+                bool occupied = false;
+                for (int c = 0; c < num_channels; c++) {
+                    const Array3D<real> &field = *fields[c];
+                    int n = 0;
+                    for (int dx = 0; dx < tile_size; dx++) {
+                        const int i = tx * tile_size + dx;
+                        for (int dy = 0; dy < tile_size; dy++) {
+                            const int j = ty * tile_size + dy;
+                            for (int dz = 0; dz < tile_size; dz++, n++) {
+                                const int k = tz * tile_size + dz;
+                                if (i < res.x && j < res.y && k < res.z) {
+                                    tile[c][n] = field[i][j][k];
+                                    occupied = occupied || std::abs(tile[c][n] - backgrounds[c]) > threshold;
+                                } else {
+                                    tile[c][n] = backgrounds[c];
+                                }
+                            }
+                        }
+                    }
+                }
+                if (!occupied) {
+                    continue;
+                }
+                slab_tiles[tx].push_back((tx * tile_res.y + ty) * tile_res.z + tz);
+                for (int c = 0; c < num_channels; c++) {
+                    slab_values[tx][c].insert(slab_values[tx][c].end(), tile[c].begin(), tile[c].end());
+                }
+            }
+        }
+    }, 1);
+    tiles.clear();
+    values.assign(num_channels, std::vector<real>());
+    for (int tx = 0; tx < tile_res.x; tx++) {
+        tiles.insert(tiles.end(), slab_tiles[tx].begin(), slab_tiles[tx].end());
+        for (int c = 0; c < num_channels; c++) {
+            values[c].insert(values[c].end(), slab_values[tx][c].begin(), slab_values[tx][c].end());
+        }
+    }
+}
+
+void SparseVolume::to_array(int channel, Array3D<real> &field, int num_threads) const {
+    assert_info(0 <= channel && channel < (int)channels.size(), "Invalid sparse volume channel");
+    field.allocate(res.x, res.y, res.z, storage_offset);
+    field.fill(backgrounds[channel], num_threads);
+    const Vector3i tile_res = get_tile_res();
+    const std::vector<real> &channel_values = values[channel];
+    parallel_for(0, (int)tiles.size(), num_threads, [&](int t) {
+        const int tz = tiles[t] % tile_res.z, ty = tiles[t] / tile_res.z % tile_res.y;
+        const int tx = tiles[t] / tile_res.z / tile_res.y;
+        const real *tile = &channel_values[(size_t)t * tile_volume];
+        for (int dx = 0; dx < tile_size; dx++) {
+            const int i = tx * tile_size + dx;
+            for (int dy = 0; dy < tile_size; dy++) {
+                const int j = ty * tile_size + dy;
+                for (int dz = 0; dz < tile_size; dz++) {
+                    const int k = tz * tile_size + dz;
+                    if (i < res.x && j < res.y && k < res.z) {
+                        field[i][j][k] = tile[(dx * tile_size + dy) * tile_size + dz];
+                    }
+                }
+            }
+        }
+    }, 64);
+}
+
+VolumeExporter::VolumeExporter(int chunk_tiles, int max_queued_frames)
+        : chunk_tiles(chunk_tiles), max_queued_frames(max_queued_frames) {
+    assert_info(chunk_tiles > 0, "chunk_tiles must be positive");
+    assert_info(max_queued_frames > 0, "max_queued_frames must be positive");
+    writer = std::thread([this]() { writer_loop(); });
+}
+
+void VolumeExporter::write(const std::string &fn, SparseVolume &&volume, bool compress) {
+    std::unique_lock<std::mutex> lock(mut);
+    task_done.wait(lock, [this]() { return (int)tasks.size() < max_queued_frames; });
+    tasks.push_back(Task{fn, std::move(volume), compress});
+    num_pending++;
+    task_available.notify_one();
+}
+
+void VolumeExporter::wait() {
+    std::unique_lock<std::mutex> lock(mut);
+    task_done.wait(lock, [this]() { return num_pending == 0; });
+}
+
+VolumeExporter::~VolumeExporter() {
+    {
+        std::lock_guard<std::mutex> lock(mut);
+        stopping = true;
+    }
+    task_available.notify_one();
+    writer.join();
+}
+
+void VolumeExporter::writer_loop() {
+    while (true) {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lock(mut);
+            task_available.wait(lock, [this]() { return stopping || !tasks.empty(); });
+            // Volumes already handed over are still written when stopping
+            if (tasks.empty()) {
+                return;
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task_done.notify_all();
+        try {
+            write_volume(task);
+        } catch (...) {
+            // There is no caller to rethrow to on this thread; assert_info has already printed the cause
+            fprintf(stderr, "Failed to export volume to %s\n", task.fn.c_str());
+        }
+        {
+            std::lock_guard<std::mutex> lock(mut);
+            num_pending--;
+        }
+        task_done.notify_all();
+    }
+}
+
+void VolumeExporter::write_volume(const Task &task) const {
+    const SparseVolume &volume = task.volume;
+    BinaryFileStreamOutput os(task.fn);
+    os << sparse_volume_magic << int(version) << int(task.compress) << int(SparseVolume::tile_size) << chunk_tiles;
+    os << volume.res << volume.storage_offset << volume.time << int(volume.channels.size());
+    for (int c = 0; c < (int)volume.channels.size(); c++) {
+        os << volume.channels[c] << volume.backgrounds[c];
+    }
+    os << uint64(volume.tiles.size());
+    write_chunked(os, volume.tiles.data(), volume.tiles.size(), chunk_tiles, task.compress);
+    for (auto &channel_values : volume.values) {
+        write_chunked(os, channel_values.data(), channel_values.size(), chunk_tiles * SparseVolume::tile_volume,
+                      task.compress);
+    }
+    os.close();
+}
+
+bool read_sparse_volume(const std::string &fn, SparseVolume &volume) {
+    BinaryFileStreamInput is(fn);
+    if (is.read<uint64>() != sparse_volume_magic || is.read<int>() != VolumeExporter::version) {
+        return false;
+    }
+    int compressed, tile_size, chunk_tiles, num_channels;
+    is >> compressed >> tile_size >> chunk_tiles;
+    assert_info(tile_size == SparseVolume::tile_size, "Unsupported sparse volume tile size");
+    assert_info(chunk_tiles > 0, "Corrupted sparse volume header");
+    is >> volume.res >> volume.storage_offset >> volume.time >> num_channels;
+    volume.channels.resize(num_channels);
+    volume.backgrounds.resize(num_channels);
+    for (int c = 0; c < num_channels; c++) {
+        is >> volume.channels[c] >> volume.backgrounds[c];
+    }
+    const uint64 num_tiles = is.read<uint64>();
+    volume.tiles.resize(num_tiles);
+    read_chunked(is, volume.tiles.data(), volume.tiles.size(), chunk_tiles, compressed != 0);
+    volume.values.resize(num_channels);
+    for (auto &channel_values : volume.values) {
+        channel_values.resize(num_tiles * SparseVolume::tile_volume);
+        read_chunked(is, channel_values.data(), channel_values.size(), chunk_tiles * SparseVolume::tile_volume,
+                     compressed != 0);
+    }
+    return true;
+}
+
+TC_NAMESPACE_END
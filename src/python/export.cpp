@@ -34,6 +34,7 @@ PYBIND11_PLUGIN(taichi_core) {
     export_visual(m);
     export_io(m);
     export_misc(m);
+    export_rigid2d(m);
 
     return m.ptr();
 }
@@ -8,16 +8,53 @@
 *******************************************************************************/
 
 #include <taichi/python/export.h>
+#include <pybind11/numpy.h>
 #include <taichi/dynamics/fluid2d/fluid.h>
 #include <taichi/dynamics/mpm2d/mpm.h>
 #include <taichi/dynamics/mpm2d/mpm_particle.h>
 #include <taichi/dynamics/simulation3d.h>
+#include <taichi/dynamics/frame_pipeline.h>
+#include <taichi/dynamics/simulation_batch.h>
 #include <taichi/common/asset_manager.h>
+#include <taichi/system/threading.h>
 
 PYBIND11_MAKE_OPAQUE(std::vector<taichi::RenderParticle>);
 
 TC_NAMESPACE_BEGIN
 
+typedef py::array_t<real, py::array::c_style | py::array::forcecast> RealArray;
+
+// The rows of an n x 2 array, laid out as Vector2s
+const Vector2 *get_vector2s(const RealArray &array, ssize_t n, const char *name) {
+    assert_info(array.ndim() == 2 && array.shape(0) == n && array.shape(1) == 2,
+                std::string(name) + " must be an array of shape (" + std::to_string(n) + ", 2)");
+    return reinterpret_cast<const Vector2 *>(array.data());
+}
+
+// Positions and velocities given as n x 2 arrays; velocities may be None
+template <typename T>
+void add_particle_arrays(const T &add, py::object positions, py::object velocities) {
+    RealArray position_array = RealArray::ensure(positions), velocity_array;
+    assert_info((bool)position_array, "positions must be an array");
+    const ssize_t n = position_array.ndim() > 0 ? position_array.shape(0) : 0;
+    const Vector2 *p = get_vector2s(position_array, n, "positions"), *v = nullptr;
+    if (!velocities.is_none()) {
+        velocity_array = RealArray::ensure(velocities);
+        assert_info((bool)velocity_array, "velocities must be an array");
+        v = get_vector2s(velocity_array, n, "velocities");
+    }
+    py::gil_scoped_release release;
+    add(p, v, (int)n);
+}
+
+// Copies, as n x 2 arrays
+py::tuple make_particle_arrays(int n, const std::function<void(Vector2 *, Vector2 *)> &get_states) {
+    py::array_t<real> positions({(ssize_t)n, (ssize_t)2}), velocities({(ssize_t)n, (ssize_t)2});
+    get_states(reinterpret_cast<Vector2 *>(positions.mutable_data()),
+               reinterpret_cast<Vector2 *>(velocities.mutable_data()));
+    return py::make_tuple(positions, velocities);
+}
+
 void export_dynamics(py::module &m) {
     m.def("register_levelset3d", &AssetManager::insert_asset<LevelSet3D>);
 
@@ -56,40 +93,148 @@ void export_dynamics(py::module &m) {
 
     py::class_<Fluid>(m, "Fluid")
             .def(py::init<>())
-            .def("initialize", &Fluid::initialize)
-            .def("step", &Fluid::step)
+            .def("initialize", &Fluid::initialize, release_gil())
+            .def("step", &Fluid::step, release_gil())
             .def("add_particle", &Fluid::add_particle)
             .def("get_current_time", &Fluid::get_current_time)
             .def("get_particles", &Fluid::get_particles)
+            .def("get_step_substeps", &Fluid::get_step_substeps)
+            .def("add_particle_arrays", [](Fluid &fluid, py::object positions, py::object velocities) {
+                add_particle_arrays([&](const Vector2 *p, const Vector2 *v, int n) {
+                    fluid.add_particles(p, v, n);
+                }, positions, velocities);
+            }, py::arg("positions"), py::arg("velocities") = py::none())
+            .def("get_particle_arrays", [](Fluid &fluid) {
+                std::vector<Fluid::Particle> particles = fluid.get_particles();
+                return make_particle_arrays((int)particles.size(), [&](Vector2 *positions, Vector2 *velocities) {
+                    for (int i = 0; i < (int)particles.size(); i++) {
+                        positions[i] = particles[i].position;
+                        velocities[i] = particles[i].velocity;
+                    }
+                });
+            })
             .def("set_levelset", &Fluid::set_levelset)
             .def("get_liquid_levelset", &Fluid::get_liquid_levelset)
             .def("get_density", &Fluid::get_density)
             .def("get_pressure", &Fluid::get_pressure)
             .def("add_source", &Fluid::add_source);
 
+    py::class_<HardwareCounterValues>(m, "HardwareCounterValues")
+            .def_readonly("cycles", &HardwareCounterValues::cycles)
+            .def_readonly("instructions", &HardwareCounterValues::instructions)
+            .def_readonly("l1d_misses", &HardwareCounterValues::l1d_misses)
+            .def_readonly("llc_misses", &HardwareCounterValues::llc_misses)
+            .def_readonly("branch_misses", &HardwareCounterValues::branch_misses)
+            .def("get_ipc", &HardwareCounterValues::get_ipc)
+            .def("get_dram_bytes", &HardwareCounterValues::get_dram_bytes);
+
+    m.def("set_hardware_counters", &HardwareCounters::set_enabled);
+    m.def("read_hardware_counters", &HardwareCounters::read);
+
+    py::class_<ProfilerRecord>(m, "ProfilerRecord")
+            .def_readonly("name", &ProfilerRecord::name)
+            .def_readonly("count", &ProfilerRecord::count)
+            .def_readonly("total", &ProfilerRecord::total)
+            .def_readonly("max", &ProfilerRecord::max)
+            .def_readonly("bytes", &ProfilerRecord::bytes)
+            .def_readonly("hardware", &ProfilerRecord::hardware)
+            .def("get_mean", &ProfilerRecord::get_mean);
+
+    py::class_<SolverStatistics>(m, "SolverStatistics")
+            .def_readonly("solver", &SolverStatistics::solver)
+            .def_readonly("iterations", &SolverStatistics::iterations)
+            .def_readonly("converged", &SolverStatistics::converged)
+            .def_readonly("tolerance", &SolverStatistics::tolerance)
+            .def_readonly("residual_history", &SolverStatistics::residual_history)
+            .def_readonly("solve_time", &SolverStatistics::solve_time)
+            .def_readonly("phases", &SolverStatistics::phases)
+            .def("get_bytes", &SolverStatistics::get_bytes)
+            .def("to_json", &SolverStatistics::to_json);
+
 #define EXPORT_SIMULATOR_3D(SIM) \
         py::class_<SIM, std::shared_ptr<SIM>>(m, #SIM) \
         .def(py::init<>()) \
-        .def("initialize", &SIM::initialize) \
+        .def("initialize", &SIM::initialize, release_gil()) \
         .def("add_particles", &SIM::add_particles) \
-        .def("update", &SIM::update) \
-        .def("step", &SIM::step) \
+        .def("update", &SIM::update, release_gil()) \
+        .def("step", &SIM::step, release_gil()) \
+        .def("set_num_threads", &SIM::set_num_threads) \
+        .def("step_async", [](std::shared_ptr<SIM> sim, AsyncExecutor &executor, real t) { \
+            return executor.submit([sim, t]() { \
+                sim->step(t); \
+            }); \
+        }) \
         .def("get_current_time", &SIM::get_current_time) \
         .def("get_render_particles", &SIM::get_render_particles) \
+        .def("get_preview_particles", &SIM::get_preview_particles) \
         .def("set_levelset", &SIM::set_levelset) \
+        .def("save_checkpoint", &SIM::save_checkpoint, release_gil()) \
+        .def("load_checkpoint", &SIM::load_checkpoint, release_gil()) \
+        .def("export_particles", &SIM::export_particles, release_gil()) \
+        .def("wait_for_particle_export", &SIM::wait_for_particle_export, release_gil()) \
+        .def("export_volume", &SIM::export_volume, release_gil()) \
+        .def("wait_for_volume_export", &SIM::wait_for_volume_export, release_gil()) \
+        .def("write_cache_frame", &SIM::write_cache_frame, release_gil()) \
+        .def("get_profile", &SIM::get_profile) \
+        .def("reset_profile", &SIM::reset_profile) \
+        .def("get_solver_statistics", &SIM::get_solver_statistics) \
+        .def("get_step_substeps", &SIM::get_step_substeps) \
         .def("test", &SIM::test) \
         ;
     EXPORT_SIMULATOR_3D(Simulation3D);
 
+    py::class_<FramePipeline, std::shared_ptr<FramePipeline>>(m, "FramePipeline")
+            .def(py::init<std::shared_ptr<Simulation3D>, std::shared_ptr<ParticleRenderer>>())
+            .def("initialize", &FramePipeline::initialize)
+            .def("step", &FramePipeline::step, release_gil())
+            .def("wait", &FramePipeline::wait, release_gil())
+            .def("get_num_frames", &FramePipeline::get_num_frames)
+            .def("get_simulation_threads", &FramePipeline::get_simulation_threads)
+            .def("get_render_threads", &FramePipeline::get_render_threads);
+
+    py::class_<SimulationBatch::Statistics>(m, "SimulationBatchStatistics")
+            .def_readonly("steps", &SimulationBatch::Statistics::steps)
+            .def_readonly("step_time", &SimulationBatch::Statistics::step_time)
+            .def_readonly("last_step_time", &SimulationBatch::Statistics::last_step_time)
+            .def_readonly("current_time", &SimulationBatch::Statistics::current_time)
+            .def_readonly("failed", &SimulationBatch::Statistics::failed);
+
+    py::class_<SimulationBatch, std::shared_ptr<SimulationBatch>>(m, "SimulationBatch")
+            .def(py::init<>())
+            .def("initialize", &SimulationBatch::initialize)
+            .def("add", &SimulationBatch::add)
+            .def("step", &SimulationBatch::step, py::arg("t"), py::arg("num_steps") = 1, release_gil())
+            .def("get_num_simulations", &SimulationBatch::get_num_simulations)
+            .def("get_simulation", &SimulationBatch::get_simulation)
+            .def("get_statistics", &SimulationBatch::get_statistics)
+            .def("get_all_statistics", &SimulationBatch::get_all_statistics)
+            .def("rethrow", &SimulationBatch::rethrow)
+            .def("get_wall_time", &SimulationBatch::get_wall_time)
+            .def("get_throughput", &SimulationBatch::get_throughput)
+            .def("get_utilization", &SimulationBatch::get_utilization);
+
 #define EXPORT_MPM(SIM) \
     py::class_<SIM>(m, #SIM "Simulator") \
         .def(py::init<>()) \
-        .def("initialize", &SIM::initialize) \
-        .def("step", &SIM::step) \
+        .def("initialize", &SIM::initialize, release_gil()) \
+        .def("step", &SIM::step, release_gil()) \
         .def("test", &SIM::test) \
         .def("add_particle", static_cast<void (SIM::*)(std::shared_ptr<MPMParticle>)>(&SIM::add_particle)) \
+        .def("add_particles", &SIM::add_particles) \
+        .def("kill_outside_particles", &SIM::kill_outside_particles) \
         .def("get_current_time", &SIM::get_current_time) \
         .def("get_particles", &SIM::get_particles) \
+        .def("add_particle_arrays", [](SIM &sim, std::shared_ptr<MPMParticle> prototype, py::object positions, \
+                                       py::object velocities) { \
+            add_particle_arrays([&](const Vector2 *p, const Vector2 *v, int n) { \
+                sim.add_particles(*prototype, p, v, n); \
+            }, positions, velocities); \
+        }, py::arg("prototype"), py::arg("positions"), py::arg("velocities") = py::none()) \
+        .def("get_particle_arrays", [](SIM &sim) { \
+            return make_particle_arrays(sim.get_num_particles(), [&](Vector2 *positions, Vector2 *velocities) { \
+                sim.get_particle_states(positions, velocities); \
+            }); \
+        }) \
         .def("set_levelset", &SIM::set_levelset) \
         .def("get_material_levelset", &SIM::get_material_levelset) \
         .def("get_debug_blocks", &SIM::get_debug_blocks) \
@@ -9,13 +9,26 @@
 
 #include <taichi/python/export.h>
 #include <taichi/io/image_reader.h>
+#include <taichi/io/simulation_cache.h>
 
 TC_NAMESPACE_BEGIN
 
 void export_io(py::module &m) {
     py::class_<ImageReader, std::shared_ptr<ImageReader>>(m, "ImageReader")
             .def("initialize", &ImageReader::initialize)
-            .def("read", &ImageReader::read);
+            .def("read", &ImageReader::read, release_gil())
+            .def("read_rgb", &ImageReader::read_rgb, release_gil())
+            .def("read_all", &ImageReader::read_all, release_gil());
+
+    py::class_<SimulationCacheWriter, std::shared_ptr<SimulationCacheWriter>>(m, "SimulationCacheWriter")
+            .def(py::init<std::string, real, int, int>())
+            .def("get_num_frames", &SimulationCacheWriter::get_num_frames)
+            .def("close", &SimulationCacheWriter::close, release_gil());
+
+    py::class_<SimulationCacheReader, std::shared_ptr<SimulationCacheReader>>(m, "SimulationCacheReader")
+            .def(py::init<std::string, int>())
+            .def("get_num_frames", &SimulationCacheReader::get_num_frames)
+            .def("get_frame_time", &SimulationCacheReader::get_frame_time);
 }
 
 TC_NAMESPACE_END
@@ -14,8 +14,12 @@
 #include <taichi/math/levelset_3d.h>
 #include <taichi/visualization/rgb.h>
 #include <taichi/math/array_op.h>
+#include <taichi/math/array_1d.h>
 #include <taichi/math/dynamic_levelset_2d.h>
 #include <taichi/math/dynamic_levelset_3d.h>
+#include <taichi/math/sparse_levelset_3d.h>
+#include <taichi/io/array_file.h>
+#include <taichi/io/paged_array.h>
 
 PYBIND11_MAKE_OPAQUE(std::vector<int>);
 PYBIND11_MAKE_OPAQUE(std::vector<taichi::real>);
@@ -101,6 +105,56 @@ ndarray_to_array2d_real(Array2D<real> *arr, long long input, int width, int heig
     }
 }
 
+// Views of the storage of arrays of real or of vectors of real, for the buffer protocol: NumPy gets them
+// without copies, with a trailing axis of channels for vectors. Array2D and Array3D are indexed [i][j][k]
+// as in C++, with the last index fastest.
+template <typename T>
+struct ArrayChannels {
+    static const int value = 1;
+};
+
+template <>
+struct ArrayChannels<Vector3> {
+    static const int value = 3;
+};
+
+template <>
+struct ArrayChannels<Vector4> {
+    static const int value = 4;
+};
+
+template <typename T>
+py::buffer_info array_buffer(T *data, std::vector<ssize_t> shape) {
+    const int channels = ArrayChannels<typename T::value_type>::value;
+    std::vector<ssize_t> strides(shape.size());
+    ssize_t stride = sizeof(typename T::value_type);
+    for (int i = (int)shape.size() - 1; i >= 0; i--) {
+        strides[i] = stride;
+        stride *= shape[i];
+    }
+    if (channels > 1) {
+        shape.push_back(channels);
+        strides.push_back(sizeof(real));
+    }
+    return py::buffer_info(data->empty() ? nullptr : &(*data)[0], sizeof(real), py::format_descriptor<real>::format(),
+                           (ssize_t)shape.size(), shape, strides);
+}
+
+template <typename T>
+py::buffer_info array1d_buffer(Array1D<T> &arr) {
+    return array_buffer(&arr.data, {(ssize_t)arr.data.size()});
+}
+
+template <typename T>
+py::buffer_info array2d_buffer(Array2D<T> &arr) {
+    return array_buffer(&arr.get_data(), {arr.get_width(), arr.get_height()});
+}
+
+template <typename T>
+py::buffer_info array3d_buffer(Array3D<T> &arr) {
+    return array_buffer(&arr.get_data(), {arr.get_width(), arr.get_height(), arr.get_depth()});
+}
+
 template<typename T, int channels>
 void array2d_to_ndarray(T *arr, uint64 output) // 'output' is actually a pointer...
 {
@@ -117,46 +171,78 @@ void export_math(py::module &m) {
 
     py::class_<Config>(m, "Config");
 
+    py::class_<Array1D<real>>(m, "Array1Dreal", py::buffer_protocol())
+            .def(py::init<int>())
+            .def_readonly("size", &Array1D<real>::size)
+            .def_buffer(&array1d_buffer<real>);
+
 #define EXPORT_ARRAY_2D_OF(T, C) \
-    py::class_<Array2D<real>>(m, "Array2D" #T)  \
+    py::class_<Array2D<real>>(m, "Array2D" #T, py::buffer_protocol())  \
             .def(py::init<int, int>()) \
+            .def_buffer(&array2d_buffer<T>) \
             .def("to_ndarray", &array2d_to_ndarray<Array2D<T>, C>) \
             .def("get_width", &Array2D<T>::get_width) \
             .def("get_height", &Array2D<T>::get_height) \
             .def("rasterize", &Array2D<T>::rasterize) \
             .def("rasterize_scale", &Array2D<T>::rasterize_scale) \
+            .def("write_array_file", [](const Array2D<T> &arr, const std::string &fn, int num_threads) { \
+                write_array_file(fn, arr, num_threads); \
+            }, release_gil()) \
+            .def("read_array_file", [](Array2D<T> &arr, const std::string &fn, int num_threads) { \
+                return read_array_file(fn, arr, num_threads); \
+            }, release_gil()) \
             .def("from_ndarray", &ndarray_to_array2d_real);
 
     EXPORT_ARRAY_2D_OF(real, 1);
 
 #define EXPORT_ARRAY_3D_OF(T, C) \
-    py::class_<Array3D<real>> PyArray3D##T(m, "Array3D" #T);  \
+    py::class_<Array3D<real>> PyArray3D##T(m, "Array3D" #T, py::buffer_protocol());  \
         PyArray3D##T.def(py::init<int, int, int>()) \
+            .def_buffer(&array3d_buffer<T>) \
             .def("get_width", &Array3D<T>::get_width) \
-            .def("get_height", &Array3D<T>::get_height);
+            .def("get_height", &Array3D<T>::get_height) \
+            .def("get_depth", &Array3D<T>::get_depth) \
+            .def("write_array_file", [](const Array3D<T> &arr, const std::string &fn, int num_threads) { \
+                write_array_file(fn, arr, num_threads); \
+            }, release_gil()) \
+            .def("read_array_file", [](Array3D<T> &arr, const std::string &fn, int num_threads) { \
+                return read_array_file(fn, arr, num_threads); \
+            }, release_gil()) \
+            .def("write_paged_array_file", [](const Array3D<T> &arr, const std::string &fn, int brick_size, \
+                                              int num_threads) { \
+                write_paged_array_file(fn, arr, brick_size, num_threads); \
+            }, release_gil());
 
     EXPORT_ARRAY_3D_OF(real, 1);
 
-    py::class_<Array2D<Vector3>>(m, "Array2DVector3")
+    // Of array files too large for memory, from storage order to bricks for PagedArray3D
+    m.def("convert_to_paged_array_file", [](const std::string &fn, const std::string &paged_fn, int brick_size,
+                                            int num_threads) {
+        write_paged_array_file(paged_fn, MappedArray3D<real>(fn), brick_size, num_threads);
+    }, release_gil());
+
+    py::class_<Array2D<Vector3>>(m, "Array2DVector3", py::buffer_protocol())
             .def(py::init<int, int, Vector3>())
+            .def_buffer(&array2d_buffer<Vector3>)
             .def("get_width", &Array2D<Vector3>::get_width)
             .def("get_height", &Array2D<Vector3>::get_height)
             .def("get_channels", &return_constant<Array2D<Vector3>, 3>)
             .def("from_ndarray", &ndarray_to_image_buffer<Array2D<Vector3>, 3>)
-            .def("read", &Array2D<Vector3>::load)
-            .def("write", &Array2D<Vector3>::write)
+            .def("read", &Array2D<Vector3>::load, release_gil())
+            .def("write", &Array2D<Vector3>::write, release_gil())
             .def("write_to_disk", &Array2D<Vector3>::write_to_disk)
             .def("read_from_disk", &Array2D<Vector3>::read_from_disk)
             .def("rasterize", &Array2D<Vector3>::rasterize)
             .def("rasterize_scale", &Array2D<Vector3>::rasterize_scale)
             .def("to_ndarray", &array2d_to_ndarray<Array2D<Vector3>, 3>);
 
-    py::class_<Array2D<Vector4>>(m, "Array2DVector4")
+    py::class_<Array2D<Vector4>>(m, "Array2DVector4", py::buffer_protocol())
             .def(py::init<int, int, Vector4>())
+            .def_buffer(&array2d_buffer<Vector4>)
             .def("get_width", &Array2D<Vector4>::get_width)
             .def("get_height", &Array2D<Vector4>::get_height)
             .def("get_channels", &return_constant<Array2D<Vector4>, 4>)
-            .def("write", &Array2D<Vector4>::write)
+            .def("write", &Array2D<Vector4>::write, release_gil())
             .def("from_ndarray", &ndarray_to_image_buffer<Array2D<Vector4>, 4>)
             .def("write_to_disk", &Array2D<Vector4>::write_to_disk)
             .def("read_from_disk", &Array2D<Vector4>::read_from_disk)
@@ -182,7 +268,32 @@ void export_math(py::module &m) {
 
     py::class_<DynamicLevelSet3D>(m, "DynamicLevelSet3D")
             .def(py::init<>())
-            .def("initialize", &DynamicLevelSet3D::initialize);
+            .def("initialize", static_cast<void (DynamicLevelSet3D::*)(real, real, const LevelSet3D &,
+                                                                       const LevelSet3D &)>(
+                    &DynamicLevelSet3D::initialize))
+            .def("initialize", static_cast<void (DynamicLevelSet3D::*)(real, real, const SparseLevelSet3D &,
+                                                                       const SparseLevelSet3D &)>(
+                    &DynamicLevelSet3D::initialize))
+            .def("is_sparse", &DynamicLevelSet3D::is_sparse);
+
+    py::class_<SparseLevelSet3D, std::shared_ptr<SparseLevelSet3D>>(m, "SparseLevelSet3D")
+            .def(py::init<int, int, int, Vector3, real>())
+            .def("initialize_from_dense", static_cast<void (SparseLevelSet3D::*)(const LevelSet3D &, real)>(
+                    &SparseLevelSet3D::initialize), release_gil())
+            .def("get_width", &SparseLevelSet3D::get_width)
+            .def("get_height", &SparseLevelSet3D::get_height)
+            .def("get_depth", &SparseLevelSet3D::get_depth)
+            .def("get_num_bricks", &SparseLevelSet3D::get_num_bricks)
+            .def("get_memory_bytes", &SparseLevelSet3D::get_memory_bytes)
+            .def("add_sphere", &SparseLevelSet3D::add_sphere)
+            .def("add_plane", &SparseLevelSet3D::add_plane)
+            .def("add_cuboid", &SparseLevelSet3D::add_cuboid)
+            .def("global_increase", &SparseLevelSet3D::global_increase)
+            .def("get_gradient", &SparseLevelSet3D::get_gradient)
+            .def("rasterize", &SparseLevelSet3D::rasterize)
+            .def("sample", static_cast<real (SparseLevelSet3D::*)(const Vector3 &) const>(&SparseLevelSet3D::get))
+            .def("get_normalized_gradient", &SparseLevelSet3D::get_normalized_gradient)
+            .def_readwrite("friction", &SparseLevelSet3D::friction);
 
     py::class_<LevelSet3D, std::shared_ptr<LevelSet3D>>(m, "LevelSet3D", PyArray3Dreal)
             .def(py::init<int, int, int, Vector3>())
@@ -194,6 +305,7 @@ void export_math(py::module &m) {
             .def("add_plane", &LevelSet3D::add_plane)
             .def("add_cuboid", &LevelSet3D::add_cuboid)
             .def("global_increase", &LevelSet3D::global_increase)
+            .def("redistance", &LevelSet3D::redistance, release_gil())
             .def("get_gradient", &LevelSet3D::get_gradient)
             .def("rasterize", &LevelSet3D::rasterize)
             .def("sample", static_cast<real(LevelSet3D::*)(real, real, real) const>(&LevelSet3D::sample))
@@ -223,9 +335,12 @@ void export_math(py::module &m) {
             .def("rotate_angle_axis", &matrix4_rotate_angle_axis)
             .def("get_ptr_string", &Config::get_ptr_string<Matrix4>);
 
-    m.def("gaussian_blur_x_2d_real", gaussian_blur_x<real>);
-    m.def("gaussian_blur_y_2d_real", gaussian_blur_y<real>);
-    m.def("gaussian_blur_2d_real", gaussian_blur<real>);
+    m.def("gaussian_blur_x_2d_real", gaussian_blur_x<real>, py::arg("arr"), py::arg("sigma"),
+          py::arg("num_threads") = 1);
+    m.def("gaussian_blur_y_2d_real", gaussian_blur_y<real>, py::arg("arr"), py::arg("sigma"),
+          py::arg("num_threads") = 1);
+    m.def("gaussian_blur_2d_real", gaussian_blur<real>, py::arg("arr"), py::arg("sigma"),
+          py::arg("num_threads") = 1);
 
     py::class_<Vector2i>(m, "Vector2i")
             .def(py::init<int, int>())
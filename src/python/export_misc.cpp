@@ -11,10 +11,14 @@
 #include <taichi/python/exception.h>
 #include <taichi/visual/texture.h>
 #include <taichi/image/tone_mapper.h>
+#include <taichi/image/denoiser.h>
 #include <taichi/common/asset_manager.h>
 #include <taichi/math/sdf.h>
 #include <taichi/system/unit_dll.h>
 #include <taichi/system/benchmark.h>
+#include <taichi/system/memory.h>
+#include <taichi/system/threading.h>
+#include <taichi/system/tracer.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -52,6 +56,26 @@ void print_all_units() {
     std::cout << all_units << " units in all." << std::endl;
 }
 
+std::vector<std::string> get_unit_implementation_names(const std::string &interface_name) {
+    auto interfaces = InterfaceHolder::get_instance()->interfaces;
+    assert_info(interfaces.find(interface_name) != interfaces.end(), "Interface [" + interface_name + "] not found!");
+    auto names = interfaces[interface_name]->get_implementation_names();
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+void print_thread_pool_statistics() {
+    ThreadPool::get_instance().get_statistics().print();
+}
+
+void reset_thread_pool_statistics() {
+    ThreadPool::get_instance().reset_statistics();
+}
+
+void set_thread_pool_core_pinning(bool pinning) {
+    ThreadPool::get_instance().set_core_pinning(pinning);
+}
+
 void export_misc(py::module &m) {
     py::register_exception_translator([](std::exception_ptr p) {
         try {
@@ -61,14 +85,49 @@ void export_misc(py::module &m) {
         }
     });
 
+    py::class_<AsyncTask, std::shared_ptr<AsyncTask>>(m, "AsyncTask")
+            .def("is_done", &AsyncTask::is_done)
+            .def("wait", &AsyncTask::wait, py::arg("timeout") = -1.0, release_gil())
+            .def("get", &AsyncTask::get, release_gil())
+            .def("add_callback", [](AsyncTask &task, py::object callback) {
+                auto f = hold_py_function(callback);
+                task.add_callback([f]() {
+                    py::gil_scoped_acquire acquire;
+                    try {
+                        (*f)();
+                    } catch (py::error_already_set &e) {
+                        // Nobody to raise to on the executor thread
+                        e.restore();
+                        PyErr_Print();
+                    }
+                });
+            });
+
+    py::class_<AsyncExecutor, std::shared_ptr<AsyncExecutor>>(m, "AsyncExecutor")
+            .def(py::init<>());
+
     py::class_<ToneMapper, std::shared_ptr<ToneMapper>>(m, "ToneMapper")
             .def("initialize", &ToneMapper::initialize)
-            .def("apply", &ToneMapper::apply);
+            .def("apply", &ToneMapper::apply, release_gil())
+            .def("apply_sequence", &ToneMapper::apply_sequence, release_gil());
+
+    py::class_<FeatureBuffers>(m, "FeatureBuffers")
+            .def_readwrite("albedo", &FeatureBuffers::albedo)
+            .def_readwrite("normal", &FeatureBuffers::normal)
+            .def_readwrite("depth", &FeatureBuffers::depth);
+
+    py::class_<Denoiser, std::shared_ptr<Denoiser>>(m, "Denoiser")
+            .def("initialize", &Denoiser::initialize)
+            .def("apply", &Denoiser::apply, release_gil());
 
     py::class_<Benchmark, std::shared_ptr<Benchmark>>(m, "Benchmark")
-            .def("run", &Benchmark::run)
+            .def("run", &Benchmark::run, release_gil())
             .def("test", &Benchmark::test)
-            .def("initialize", &Benchmark::initialize);
+            .def("initialize", &Benchmark::initialize)
+            .def("run_repeated", &Benchmark::run_repeated, py::arg("repetitions"), py::arg("iterations") = 16,
+                 release_gil())
+            .def("get_workload", &Benchmark::get_workload)
+            .def("get_profile", &Benchmark::get_profile);
 
     py::class_<UnitDLL, std::shared_ptr<UnitDLL>>(m, "UnitDLL")
             .def("open_dll", &UnitDLL::open_dll)
@@ -76,9 +135,36 @@ void export_misc(py::module &m) {
             .def("loaded", &UnitDLL::loaded);
 
     m.def("print_all_units", print_all_units);
+    m.def("get_implementation_names", get_unit_implementation_names);
     m.def("test", test);
     m.def("test_raise_error", test_raise_error);
     m.def("config_from_dict", config_from_py_dict);
+    m.def("print_thread_pool_statistics", print_thread_pool_statistics);
+    m.def("reset_thread_pool_statistics", reset_thread_pool_statistics);
+    m.def("set_thread_pool_core_pinning", set_thread_pool_core_pinning);
+    m.def("set_tracing", &Tracer::set_enabled);
+    m.def("clear_trace", &Tracer::clear);
+    m.def("get_num_trace_events", &Tracer::get_num_events);
+    m.def("write_chrome_trace", &Tracer::write_chrome_trace, release_gil());
+
+    py::class_<MemoryAccounting::Record>(m, "MemoryRecord")
+            .def_readonly("name", &MemoryAccounting::Record::name)
+            .def_readonly("current", &MemoryAccounting::Record::current)
+            .def_readonly("peak", &MemoryAccounting::Record::peak)
+            .def_readonly("num_allocations", &MemoryAccounting::Record::num_allocations);
+
+    m.def("get_memory_records", &MemoryAccounting::get_records);
+    m.def("get_current_memory_bytes", &MemoryAccounting::get_current_bytes);
+    m.def("get_peak_memory_bytes", &MemoryAccounting::get_peak_bytes);
+    m.def("reset_memory_peaks", &MemoryAccounting::reset_peaks);
+    m.def("print_memory_report", &MemoryAccounting::print);
+
+    py::class_<StartupProfile::Record>(m, "StartupRecord")
+            .def_readonly("category", &StartupProfile::Record::category)
+            .def_readonly("name", &StartupProfile::Record::name)
+            .def_readonly("seconds", &StartupProfile::Record::seconds);
+
+    m.def("get_startup_records", &StartupProfile::get_records);
 }
 
 TC_NAMESPACE_END
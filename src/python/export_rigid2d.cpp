@@ -0,0 +1,89 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include "../rigid2d/PhysicsBatch.h"
+#include <taichi/python/export.h>
+#include <pybind11/numpy.h>
+
+TC_NAMESPACE_BEGIN
+
+typedef py::array_t<double, py::array::c_style | py::array::forcecast> DoubleArray;
+
+// Headless rigid2d worlds, for sweeps over many independent scenes
+void export_rigid2d(py::module &m) {
+    py::class_<PhysicsBatch>(m, "RigidBodyBatch")
+            .def(py::init<int>())
+            .def("get_num_worlds", &PhysicsBatch::Size)
+            .def("get_num_objects", &PhysicsBatch::GetNumObjects)
+            .def("set_gravity", [](PhysicsBatch &batch, int w, double gravity) {
+                batch.GetWorld(w).settings.gravity = gravity;
+            })
+            .def("set_iterations", [](PhysicsBatch &batch, int w, int velocity, int position, int step) {
+                Settings &settings = batch.GetWorld(w).settings;
+                settings.velocityIteration = velocity;
+                settings.positionIteration = position;
+                settings.stepIteration = step;
+            })
+            .def("set_sleeping", [](PhysicsBatch &batch, int w, bool sleeping) {
+                batch.GetWorld(w).settings.sleepSwitch = sleeping;
+            })
+            .def("set_continuous", [](PhysicsBatch &batch, int w, bool continuous) {
+                batch.GetWorld(w).settings.continuousSwitch = continuous;
+            })
+            // Return the index of the object in the states of its world
+            .def("add_box", [](PhysicsBatch &batch, int w, double x, double y, double width, double height,
+                               double angle, bool fixed, double friction, double restitution, bool bullet) {
+                Object *object = batch.AddBox(w, Vector2D(x, y, 1), width, height, angle, fixed);
+                object->shapes[0]->friction = friction;
+                object->shapes[0]->restitution = restitution;
+                object->SetBullet(bullet);
+                return batch.GetNumObjects(w) - 1;
+            }, py::arg("world"), py::arg("x"), py::arg("y"), py::arg("width"), py::arg("height"),
+                 py::arg("angle") = 0.0, py::arg("fixed") = false, py::arg("friction") = 2.8,
+                 py::arg("restitution") = 0.6, py::arg("bullet") = false)
+            .def("add_circle", [](PhysicsBatch &batch, int w, double x, double y, double radius, bool fixed,
+                                  double friction, double restitution, bool bullet) {
+                Object *object = batch.AddCircle(w, Vector2D(x, y, 1), radius, fixed);
+                object->shapes[0]->friction = friction;
+                object->shapes[0]->restitution = restitution;
+                object->SetBullet(bullet);
+                return batch.GetNumObjects(w) - 1;
+            }, py::arg("world"), py::arg("x"), py::arg("y"), py::arg("radius"), py::arg("fixed") = false,
+                 py::arg("friction") = 2.8, py::arg("restitution") = 0.6, py::arg("bullet") = false)
+            .def("proceed", &PhysicsBatch::Proceed, py::arg("dt"), py::arg("steps") = 1,
+                 py::arg("num_threads") = 1, release_gil())
+            // Objects x (x, y, angle, vx, vy, angular velocity)
+            .def("get_states", [](PhysicsBatch &batch, int w) {
+                DoubleArray states({(ssize_t)batch.GetNumObjects(w), (ssize_t)PhysicsBatch::stateSize});
+                batch.GetState(w, states.mutable_data());
+                return states;
+            })
+            // Worlds x objects x state, for batches whose worlds have the same number of objects
+            .def("get_all_states", [](PhysicsBatch &batch) {
+                const int n = batch.Size() > 0 ? batch.GetNumObjects(0) : 0;
+                for (int w = 0; w < batch.Size(); w++) {
+                    assert_info(batch.GetNumObjects(w) == n, "Worlds have different numbers of objects");
+                }
+                DoubleArray states({(ssize_t)batch.Size(), (ssize_t)n, (ssize_t)PhysicsBatch::stateSize});
+                for (int w = 0; w < batch.Size(); w++) {
+                    batch.GetState(w, states.mutable_data() + (std::size_t)w * n * PhysicsBatch::stateSize);
+                }
+                return states;
+            })
+            .def("set_states", [](PhysicsBatch &batch, int w, py::object states) {
+                DoubleArray array = DoubleArray::ensure(states);
+                assert_info((bool)array && array.ndim() == 2 && array.shape(0) == batch.GetNumObjects(w) &&
+                            array.shape(1) == PhysicsBatch::stateSize,
+                            "states must be an array of shape (" + std::to_string(batch.GetNumObjects(w)) + ", " +
+                            std::to_string(PhysicsBatch::stateSize) + ")");
+                batch.SetState(w, array.data());
+            });
+}
+
+TC_NAMESPACE_END
@@ -8,16 +8,22 @@
 *******************************************************************************/
 
 #include <taichi/python/export.h>
+#include <pybind11/numpy.h>
 
 #include <taichi/math/sdf.h>
 
 #include <taichi/visual/camera.h>
 #include <taichi/visual/renderer.h>
+#include <taichi/visual/distributed_rendering.h>
 #include <taichi/visual/volume_material.h>
 #include <taichi/visual/surface_material.h>
 #include <taichi/visual/envmap.h>
+#include <taichi/visual/texture_cache.h>
+#include <taichi/visual/voxelizer.h>
+#include <taichi/visual/surface_extractor.h>
 #include <taichi/visualization/particle_visualization.h>
 #include <taichi/common/asset_manager.h>
+#include <taichi/system/threading.h>
 
 #include <taichi/geometry/factory.h>
 #include <taichi/math/levelset_3d.h>
@@ -28,24 +34,48 @@ PYBIND11_MAKE_OPAQUE(std::vector<taichi::Triangle>);
 TC_NAMESPACE_BEGIN
 
 Function23 function23_from_py_obj(py::object func) {
-    return [func](Vector2 p) -> Vector3 {
+    auto f = hold_py_function(func);
+    return [f](Vector2 p) -> Vector3 {
         // TODO: GIL here seems inefficient...
-        PyGILState_STATE state = PyGILState_Ensure();
-        py::function f = py::reinterpret_borrow<py::function>(func);
-        Vector3 ret = f(p).cast<Vector3>();
-        PyGILState_Release(state);
-        return ret;
+        py::gil_scoped_acquire acquire;
+        return (*f)(p).cast<Vector3>();
     };
 }
 
 Function22 function22_from_py_obj(py::object func) {
-    return [func](Vector2 p) -> Vector2 {
+    auto f = hold_py_function(func);
+    return [f](Vector2 p) -> Vector2 {
         // TODO: GIL here seems inefficient...
-        PyGILState_STATE state = PyGILState_Ensure();
-        py::function f = py::reinterpret_borrow<py::function>(func);
-        Vector2 ret = f(p).cast<Vector2>();
-        PyGILState_Release(state);
-        return ret;
+        py::gil_scoped_acquire acquire;
+        return (*f)(p).cast<Vector2>();
+    };
+}
+
+// Batched functions take an n x 2 array of points and return an n x N array, in one call into Python
+template <int N, typename T>
+std::function<std::vector<T>(const std::vector<Vector2> &)> batched_function_from_py_obj(py::object func) {
+    auto f = hold_py_function(func);
+    return [f](const std::vector<Vector2> &points) {
+        py::gil_scoped_acquire acquire;
+        const ssize_t n = (ssize_t)points.size();
+        py::array_t<real> input({n, (ssize_t)2});
+        auto in = input.mutable_unchecked<2>();
+        for (ssize_t i = 0; i < n; i++) {
+            in(i, 0) = points[i].x;
+            in(i, 1) = points[i].y;
+        }
+        auto output = py::array_t<real, py::array::c_style | py::array::forcecast>::ensure((*f)(input));
+        assert_info(output && output.ndim() == 2 && output.shape(0) == n && output.shape(1) == N,
+                    "Batched function must return an array of shape (" + std::to_string(n) + ", " +
+                    std::to_string(N) + ")");
+        auto out = output.template unchecked<2>();
+        std::vector<T> values(n);
+        for (ssize_t i = 0; i < n; i++) {
+            for (int k = 0; k < N; k++) {
+                values[i][k] = out(i, k);
+            }
+        }
+        return values;
     };
 }
 
@@ -62,16 +92,33 @@ void export_visual(py::module &m) {
 
     m.def("function23_from_py_obj", function23_from_py_obj);
     m.def("function22_from_py_obj", function22_from_py_obj);
+    m.def("batched_function23_from_py_obj", batched_function_from_py_obj<3, Vector3>);
+    m.def("batched_function22_from_py_obj", batched_function_from_py_obj<2, Vector2>);
     // TODO: these should registered by iterating over existing interfaces.
     m.def("merge_mesh", merge_mesh);
     m.def("generate_mesh", Mesh3D::generate);
+    m.def("generate_mesh_batched", Mesh3D::generate_batched);
     m.def("rasterize_render_particles", rasterize_render_particles);
     m.def("create_mesh", std::make_shared<Mesh>);
     m.def("create_scene", std::make_shared<Scene>);
+    m.def("set_texture_cache_budget", [](int64 bytes) { TextureCache::get_instance().set_budget(bytes); });
+    // Of a mesh with its transform, into a level set of cells of size dx from lower
+    m.def("voxelize_mesh_occupancy", [](std::shared_ptr<Mesh> mesh, std::shared_ptr<LevelSet3D> levelset,
+                                        Vector3 lower, real dx, int num_threads) {
+        Voxelizer(mesh->get_triangles(), lower, dx, num_threads).add_occupancy(*levelset);
+    }, release_gil());
+    m.def("voxelize_mesh_signed_distance", [](std::shared_ptr<Mesh> mesh, std::shared_ptr<LevelSet3D> levelset,
+                                              Vector3 lower, real dx, real band, int num_threads) {
+        Voxelizer(mesh->get_triangles(), lower, dx, num_threads).add_signed_distance(*levelset, band);
+    }, release_gil());
+    // The isosurface of a level set, or any Array3D, as triangles with nodes at lower + dx * (index + offset)
+    m.def("extract_surface", [](const Array3D<real> &phi, real isovalue, Vector3 lower, real dx, int num_threads) {
+        return SurfaceExtractor(lower, dx, num_threads).extract_triangles(phi, isovalue);
+    }, release_gil());
 
 
     py::class_<Texture, std::shared_ptr<Texture>>(m, "Texture")
-            .def("initialize", &Texture::initialize)
+            .def("initialize", &Texture::initialize, release_gil())
             .def("rasterize", static_cast<Array2D<Vector4>(Texture::*)(int, int) const>(&Texture::rasterize))
             .def("rasterize3", static_cast<Array2D<Vector3>(Texture::*)(int, int) const>(&Texture::rasterize3));
 
@@ -83,30 +130,98 @@ void export_visual(py::module &m) {
             .def("set_internal_material", &SurfaceMaterial::set_internal_material);
 
     py::class_<EnvironmentMap, std::shared_ptr<EnvironmentMap>>(m, "EnvironmentMap")
-            .def("initialize", &EnvironmentMap::initialize)
+            .def("initialize", &EnvironmentMap::initialize, release_gil())
+            .def("update", &EnvironmentMap::update, release_gil())
             .def("set_transform", &EnvironmentMap::set_transform);
 
     py::class_<Mesh, std::shared_ptr<Mesh>>(m, "Mesh")
-            .def("initialize", &Mesh::initialize)
+            .def("initialize", &Mesh::initialize, release_gil())
             .def("set_untransformed_triangles", &Mesh::set_untransformed_triangles)
             .def("set_material", &Mesh::set_material)
             .def_readwrite("transform", &Mesh::transform);
 
     py::class_<Scene, std::shared_ptr<Scene>>(m, "Scene")
             //.def("initialize", &Scene::initialize)
-            .def("finalize", &Scene::finalize)
+            .def("finalize", &Scene::finalize, release_gil())
             .def("add_mesh", &Scene::add_mesh)
+            .def("add_particles", &Scene::add_particles, release_gil())
+            .def("add_level_set", static_cast<void (Scene::*)(const LevelSet3D &, const Matrix4 &,
+                                                              std::shared_ptr<SurfaceMaterial>)>(
+                    &Scene::add_level_set), release_gil())
+            .def("add_level_set", static_cast<void (Scene::*)(const SparseLevelSet3D &, const Matrix4 &,
+                                                              std::shared_ptr<SurfaceMaterial>)>(
+                    &Scene::add_level_set), release_gil())
+            .def("set_mesh_transform", &Scene::set_mesh_transform)
+            .def("set_mesh_triangles", &Scene::set_mesh_triangles)
+            .def("clear_geometry_cache", &Scene::clear_geometry_cache)
             .def("set_atmosphere_material", &Scene::set_atmosphere_material)
             .def("set_environment_map", &Scene::set_environment_map)
             .def("set_camera", &Scene::set_camera);
 
     // Renderers
+    py::class_<RenderStatistics>(m, "RenderStatistics")
+            .def_readonly("primary_rays", &RenderStatistics::primary_rays)
+            .def_readonly("secondary_rays", &RenderStatistics::secondary_rays)
+            .def_readonly("shadow_rays", &RenderStatistics::shadow_rays)
+            .def_readonly("paths", &RenderStatistics::paths)
+            .def_readonly("path_vertices", &RenderStatistics::path_vertices)
+            .def_readonly("splats", &RenderStatistics::splats)
+            .def_readonly("russian_roulette_terminations", &RenderStatistics::russian_roulette_terminations)
+            .def_readonly("seconds", &RenderStatistics::seconds)
+            .def("get_rays", &RenderStatistics::get_rays)
+            .def("get_rays_per_second", &RenderStatistics::get_rays_per_second)
+            .def("get_paths_per_second", &RenderStatistics::get_paths_per_second)
+            .def("get_splats_per_second", &RenderStatistics::get_splats_per_second)
+            .def("get_average_path_length", &RenderStatistics::get_average_path_length)
+            .def("print", &RenderStatistics::print);
+
+    m.def("get_render_statistics", &RenderCounters::get_statistics);
+
+    py::class_<RenderProgress>(m, "RenderProgress")
+            .def_readonly("stages", &RenderProgress::stages)
+            .def_readonly("seconds", &RenderProgress::seconds)
+            .def_readonly("samples_per_pixel", &RenderProgress::samples_per_pixel)
+            .def_readonly("samples_per_second", &RenderProgress::samples_per_second)
+            .def_readonly("rays_per_second", &RenderProgress::rays_per_second)
+            .def_readonly("relative_error", &RenderProgress::relative_error)
+            .def_readonly("converged", &RenderProgress::converged)
+            .def_readonly("statistics", &RenderProgress::statistics);
+
     py::class_<Renderer, std::shared_ptr<Renderer>>(m, "Renderer")
-            .def("initialize", &Renderer::initialize)
-            .def("set_scene", &Renderer::set_scene)
-            .def("render_stage", &Renderer::render_stage)
-            .def("write_output", &Renderer::write_output)
-            .def("get_output", &Renderer::get_output);
+            .def("initialize", &Renderer::initialize, release_gil())
+            .def("set_scene", &Renderer::set_scene, release_gil())
+            .def("update_geometry", &Renderer::update_geometry, release_gil())
+            .def("render_stage", &Renderer::render_counted_stage, release_gil())
+            .def("render_stages_async", [](std::shared_ptr<Renderer> renderer, AsyncExecutor &executor, int stages) {
+                return executor.submit([renderer, stages]() {
+                    for (int i = 0; i < stages; i++) {
+                        renderer->render_counted_stage();
+                    }
+                });
+            })
+            .def("is_converged", &Renderer::is_converged)
+            .def("render_for", &Renderer::render_for, release_gil())
+            .def("render_until", &Renderer::render_until, py::arg("relative_error"),
+                 py::arg("max_seconds") = std::numeric_limits<real>::infinity(), release_gil())
+            .def("get_relative_error", &Renderer::get_relative_error)
+            .def("get_profile", &Renderer::get_profile)
+            .def("reset_profile", &Renderer::reset_profile)
+            .def("get_stage_statistics", &Renderer::get_stage_statistics)
+            .def("get_total_statistics", &Renderer::get_total_statistics)
+            .def("save_checkpoint", &Renderer::save_checkpoint, release_gil())
+            .def("load_checkpoint", &Renderer::load_checkpoint, release_gil())
+            .def("write_output", &Renderer::write_output, release_gil())
+            .def("wait_for_output", &Renderer::wait_for_output, release_gil())
+            .def("get_output", &Renderer::get_output)
+            .def("get_features", &Renderer::get_features, py::arg("samples_per_pixel") = 4, release_gil());
+
+    py::class_<DistributedRendering>(m, "DistributedRendering")
+            .def(py::init<const std::string &, long long, int, real>(), py::arg("directory"),
+                 py::arg("chunk_samples"), py::arg("num_chunks"), py::arg("claim_timeout") = 3600.0f)
+            .def("work", &DistributedRendering::work, release_gil())
+            .def("merge", &DistributedRendering::merge, release_gil())
+            .def("get_num_merged", &DistributedRendering::get_num_merged)
+            .def("get_num_chunks", &DistributedRendering::get_num_chunks);
 
     py::class_<Camera, std::shared_ptr<Camera>>(m, "Camera")
             .def("initialize",
@@ -115,7 +230,8 @@ void export_visual(py::module &m) {
     py::class_<ParticleRenderer, std::shared_ptr<ParticleRenderer>>(m, "ParticleRenderer")
             .def("initialize", &ParticleRenderer::initialize)
             .def("set_camera", &ParticleRenderer::set_camera)
-            .def("render", &ParticleRenderer::render);
+            .def("set_num_threads", &ParticleRenderer::set_num_threads)
+            .def("render", &ParticleRenderer::render, release_gil());
 
     py::class_<SDF, std::shared_ptr<SDF>>(m, "SDF")
             .def("initialize", &SDF::initialize)
@@ -123,6 +239,8 @@ void export_visual(py::module &m) {
 
     py::class_<Function22>(m, "Function22");
     py::class_<Function23>(m, "Function23");
+    py::class_<BatchedFunction22>(m, "BatchedFunction22");
+    py::class_<BatchedFunction23>(m, "BatchedFunction23");
 
 }
 
@@ -15,6 +15,10 @@
 
 TC_NAMESPACE_BEGIN
 
+// num_chains independent visibility chains, each with its own random numbers, trace a stage's photons in
+// parallel. They share the adaptive mutation size: each adapts it within a stage from the shared acceptance
+// statistics plus its own, and these are merged when the stage ends, so no chain waits on another. Photon hits
+// are buffered per chain and gathered in chain order between rounds, so results do not depend on num_threads.
 class AMCMCPPMRenderer : public SPPMRenderer {
 public:
 
@@ -24,66 +28,122 @@ public:
         accepted = 0;
         mutated = 0;
         mutation_strength = 1;
-        mc_initialized = false;
         russian_roulette = config.get("russian_roulette", false);
+        num_chains = config.get("num_chains", num_threads);
+        assert_info(num_chains > 0, "num_chains must be positive");
+        chain_rand_states.clear();
+        for (int c = 0; c < num_chains; c++) {
+            chain_rand_states.push_back(RandState((uint64)c));
+        }
+        chains.assign(num_chains, Chain());
+        for (int c = 0; c < num_chains; c++) {
+            chains[c].current_state = create_new_uniform_state(c);
+        }
     }
 
     void render_stage() override;
 
 protected:
+    void write_checkpoint(BinaryFileStreamOutput &os) override {
+        SPPMRenderer::write_checkpoint(os);
+        os << uniform_count << accepted << mutated << mutation_strength << chain_rand_states;
+        for (auto &chain : chains) {
+            os << chain.initialized;
+            chain.current_state.chain.write(os);
+        }
+    }
+
+    void read_checkpoint(BinaryFileStreamInput &is) override {
+        SPPMRenderer::read_checkpoint(is);
+        std::vector<RandState> rand_states;
+        is >> uniform_count >> accepted >> mutated >> mutation_strength >> rand_states;
+        assert_info((int)rand_states.size() == num_chains, "Checkpoint num_chains mismatch");
+        chain_rand_states = rand_states;
+        for (int c = 0; c < num_chains; c++) {
+            is >> chains[c].initialized;
+            chains[c].current_state.chain.read(is);
+            chains[c].current_state.chain.rand_state = &chain_rand_states[c];
+        }
+    }
 
     struct MCMCState {
         // We only need to store the visibility chain
         AMCMCPPMMarkovChain chain;
     };
 
-    // Current state on the *visibility* chain.
-    MCMCState current_state;
+    struct Chain {
+        // Current state on the *visibility* chain.
+        MCMCState current_state;
+        bool initialized = false;
+        // The ratio of visible part of the PSS hypercube, over the photons of this chain in this stage
+        // Also the normalizer for the visibility chain
+        RunningAverage normalizer;
+        // Of this stage, to be merged into the shared ones
+        int64 uniform_count = 0, accepted = 0, mutated = 0;
+        real mutation_strength = 1;
+        // Of the photons of this round not yet gathered
+        std::vector<PhotonHit> photon_hits;
+    };
+
+    MCMCState create_new_uniform_state(int c) {
+        MCMCState state;
+        state.chain = AMCMCPPMMarkovChain(&chain_rand_states[c]);
+        return state;
+    }
 
-    MCMCState create_new_uniform_state() {
-        return MCMCState();
+    // Photons of chain c in a stage of n
+    void get_chain_photons(int c, int n, int &begin, int &end) const {
+        begin = (int)((int64)n * c / num_chains);
+        end = (int)((int64)n * (c + 1) / num_chains);
     }
 
-    // The ratio of visible part of the PSS hypercube
-    // Also the normalizer for the visibility chain
-    RunningAverage normalizer;
+    // Starts chain c at a visible photon
+    void initialize_chain(int c);
+
+    // n photons of chain c
+    void run_chain(int c, int n);
+
+    int num_chains;
+    // One per chain; never reallocated, since the chains point to them
+    std::vector<RandState> chain_rand_states;
+    std::vector<Chain> chains;
 
+    // Shared by the chains, from the stages so far
     int64 uniform_count;
     int64 accepted;
     int64 mutated;
-
     real mutation_strength;
-    bool mc_initialized;
 };
 
-void AMCMCPPMRenderer::render_stage() {
-    hash_grid.clear_cache();
-    eye_ray_pass();
-    hash_grid.build_grid();
-    // TODO:....
-    normalizer.clear();
-    if (!mc_initialized) {
-        int64 emitted = 0;
-        while (true) {
-            emitted += 1;
-            if (emitted % 100000 == 0) {
-                printf("Warning: having difficulty initializing...\n");
-                std::cout << emitted << " photons emitted without any visible one." << std::endl;
-            }
-            current_state = create_new_uniform_state();
-            auto uniform_state_sequence = MCStateSequence(current_state.chain);
-            bool visible = trace_photon(uniform_state_sequence, 0.0f);
-            normalizer.insert((real)visible, 1);
-            if (visible) {
-                accepted = 1;
-                uniform_count = 1;
-                mc_initialized = true;
-                break;
-            }
+void AMCMCPPMRenderer::initialize_chain(int c) {
+    Chain &chain = chains[c];
+    int64 emitted = 0;
+    while (true) {
+        emitted += 1;
+        if (emitted % 100000 == 0) {
+            printf("Warning: having difficulty initializing...\n");
+            std::cout << emitted << " photons emitted without any visible one." << std::endl;
+        }
+        chain.current_state = create_new_uniform_state(c);
+        auto uniform_state_sequence = MCStateSequence(chain.current_state.chain);
+        bool visible = trace_photon(uniform_state_sequence, chain.photon_hits, 0.0f);
+        chain.normalizer.insert((real)visible, 1);
+        if (visible) {
+            chain.accepted += 1;
+            chain.uniform_count += 1;
+            chain.initialized = true;
+            break;
         }
     }
-    real last_r = 0.0f;
-    for (int64 i = 0; i < num_photons_per_stage; i++) {
+}
+
+void AMCMCPPMRenderer::run_chain(int c, int n) {
+    Chain &chain = chains[c];
+    if (!chain.initialized) {
+        initialize_chain(c);
+    }
+    MCMCState &current_state = chain.current_state;
+    for (int i = 0; i < n; i++) {
         // ----------------------------------------
         // We do 3 MCMC steps here:
         //   1. Mutate the visibility chain
@@ -98,58 +158,106 @@ void AMCMCPPMRenderer::render_stage() {
 
         // Step 2:
         // Mutate the uniform chain, using a completely random new state
-        MCMCState uniform_state = create_new_uniform_state();
+        MCMCState uniform_state = create_new_uniform_state(c);
         auto uniform_state_sequence = MCStateSequence(uniform_state.chain);
 
-        real weight = normalizer.get_average();
+        real weight = chain.normalizer.get_average();
         // The pdf of sampling this point in the PSS hypercube is 1 while
         // the normalization factor for the visibility chain is normalizer.get_average().
         // So we do the corresponding scaling of contribution.
 
-        if (trace_photon(uniform_state_sequence, weight)) {
+        if (trace_photon(uniform_state_sequence, chain.photon_hits, weight)) {
             // Uniform state visible
-            normalizer.insert(1, 1);
+            chain.normalizer.insert(1, 1);
             // Step 3:
             // Always do replica exchange in this case
             current_state = uniform_state;
-            uniform_count += 1;
+            chain.uniform_count += 1;
         } else {
             // Uniform state invisible
-            normalizer.insert(0, 1);
+            chain.normalizer.insert(0, 1);
             // Step 1:
             // Mutate the visibility chain
             MCMCState candidate_state;
-            mutated += 1;
-            candidate_state.chain = current_state.chain.mutate(mutation_strength);
+            chain.mutated += 1;
+            candidate_state.chain = current_state.chain.mutate(chain.mutation_strength);
             auto candidate_state_sequence = MCStateSequence(candidate_state.chain);
-            if (trace_photon(candidate_state_sequence, weight)) {
+            if (trace_photon(candidate_state_sequence, chain.photon_hits, weight)) {
                 current_state = candidate_state;
-                accepted += 1;
+                chain.accepted += 1;
             } else {
                 auto rand = MCStateSequence(current_state.chain);
-                trace_photon(rand, weight);
+                trace_photon(rand, chain.photon_hits, weight);
             }
         }
-        photon_counter += 1;
 
-        // Adaptive MCMC parameter update
-        real r = (real)accepted / (real)mutated;
-        last_r = r;
-        mutation_strength = mutation_strength + (r - 0.234f) / mutated;
-        mutation_strength = std::min(0.5f, std::max(0.0001f, mutation_strength));
+        // Adaptive MCMC parameter update, from the shared statistics and those of this chain
+        const int64 total_mutated = mutated + chain.mutated;
+        if (total_mutated > 0) {
+            real r = (real)(accepted + chain.accepted) / (real)total_mutated;
+            chain.mutation_strength = chain.mutation_strength + (r - 0.234f) / total_mutated;
+            chain.mutation_strength = std::min(0.5f, std::max(0.0001f, chain.mutation_strength));
+        }
+    }
+}
+
+void AMCMCPPMRenderer::render_stage() {
+    hash_grid.clear_cache();
+    eye_ray_pass();
+    hash_grid.build_grid(num_threads);
+    for (auto &chain : chains) {
+        // TODO:....
+        chain.normalizer.clear();
+        chain.uniform_count = chain.accepted = chain.mutated = 0;
+        chain.mutation_strength = mutation_strength;
+    }
+    // In rounds, to bound the memory of the hits
+    const int round_size = 4096;
+    std::vector<int> chain_photons(num_chains);
+    for (int c = 0; c < num_chains; c++) {
+        int begin, end;
+        get_chain_photons(c, num_photons_per_stage, begin, end);
+        chain_photons[c] = end - begin;
+    }
+    const int max_chain_photons = *std::max_element(chain_photons.begin(), chain_photons.end());
+    for (int round_begin = 0; round_begin < max_chain_photons; round_begin += round_size) {
+        ThreadedTaskManager::run([&](int c) {
+            chains[c].photon_hits.clear();
+            run_chain(c, clamp(chain_photons[c] - round_begin, 0, round_size));
+        }, 0, num_chains, num_threads, 1);
+        for (auto &chain : chains) {
+            gather_photons(chain.photon_hits);
+        }
+    }
+    photon_counter += num_photons_per_stage;
+
+    // Merge the statistics of the chains into the shared ones
+    real normalizer = 0.0f, strength = 0.0f;
+    for (auto &chain : chains) {
+        uniform_count += chain.uniform_count;
+        accepted += chain.accepted;
+        mutated += chain.mutated;
+        strength += chain.mutation_strength / num_chains;
+        normalizer += chain.normalizer.get_average() / num_chains;
+        std::vector<PhotonHit>().swap(chain.photon_hits);
     }
+    mutation_strength = strength;
+    real last_r = (real)accepted / (real)std::max(mutated, (int64)1);
 
     P(mutated);
     P(accepted);
     P(last_r);
     P(mutation_strength);
-    P(normalizer.get_average());
+    P(normalizer);
     stages += 1;
 
-    for (auto &ind : image.get_region()) {
-        image[ind] = (1.0f / (pi * radius2[ind]) / photon_counter * flux[ind]
-                      + image_direct_illum[ind] * (1.0f / stages));
-    }
+    update_hit_points();
+    parallel_for(0, width, num_threads, [&](int i) {
+        for (int j = 0; j < height; j++) {
+            image[i][j] = (1.0f / (pi * radius2[i][j]) / photon_counter * flux[i][j]
+                           + image_direct_illum[i][j] * (1.0f / stages));
+        }
+    }, 1);
 }
 
 TC_IMPLEMENTATION(Renderer, AMCMCPPMRenderer, "amcmcppm")
@@ -20,15 +20,23 @@ public:
 
     void render_stage() override {
         int num_samples = width * height / stage_frequency;
+        render_sample_range(sample_count, sample_count + num_samples);
+        sample_count += num_samples;
+    }
+
+    bool supports_sample_ranges() const override {
+        return true;
+    }
+
+    void render_sample_range(long long begin, long long end) override {
         auto func = [&](int i) {
-            auto state_sequence = RandomStateSequence(sampler, sample_count + i);
+            auto state_sequence = RandomStateSequence(sampler, begin + i);
             Path eye_path = trace_eye_path(state_sequence);
             Path light_path = trace_light_path(state_sequence);
             PathContribution pc = connect(eye_path, light_path);
             write_path_contribution(pc);
         };
-        ThreadedTaskManager::run(func, 0, num_samples, num_threads);
-        sample_count += num_samples;
+        ThreadedTaskManager::run(func, 0, (int)(end - begin), num_threads);
     }
 };
 
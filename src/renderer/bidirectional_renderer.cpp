@@ -9,17 +9,53 @@
 
 #include "bidirectional_renderer.h"
 #include <taichi/visual/surface_material.h>
+#include <taichi/math/radix_sort.h>
 
 TC_NAMESPACE_BEGIN
 
+void MergeVertices::build(const std::vector<Path> &all_paths, int max_vertices, int num_threads) {
+    const int num_paths = (int)all_paths.size();
+    auto get_num_prefixes = [&](const Path &path) {
+        return max_vertices < 0 ? (int)path.size() : std::min((int)path.size(), max_vertices);
+    };
+    auto mergeable = [&](const Path &path, int j) {
+        return j >= 1 && !SurfaceEventClassifier::is_delta(path[j].event);
+    };
+    // Vertices of path k begin at offsets[k]
+    std::vector<int> offsets(num_paths);
+    parallel_for(0, num_paths, num_threads, [&](int k) {
+        const Path &path = all_paths[k];
+        int count = 0;
+        for (int j = 0; j < get_num_prefixes(path); j++) {
+            count += (int)mergeable(path, j);
+        }
+        offsets[k] = count;
+    }, 256);
+    resize(exclusive_scan(offsets, num_threads));
+    parallel_for(0, num_paths, num_threads, [&](int k) {
+        const Path &path = all_paths[k];
+        int i = offsets[k];
+        for (int j = 0; j < get_num_prefixes(path); j++) {
+            if (mergeable(path, j)) {
+                positions[i] = path[j].pos;
+                normals[i] = path[j].normal;
+                paths[i] = k;
+                num_vertices[i] = j + 1;
+                i++;
+            }
+        }
+    }, 256);
+}
+
 // Check here for a more understandable version: http://www.ci.i.u-tokyo.ac.jp/~hachisuka/smallpssmlt.cpp
 // TODO: long path sometimes explodes...
 
 void BidirectionalRenderer::initialize(const Config &config) {
     Renderer::initialize(config);
-    this->sampler = create_instance<Sampler>(config.get("sampler", "sobol"));
+    this->sampler = create_instance<Sampler>(config.get("sampler", "sobol"), config);
     this->luminance_clamping = config.get("luminance_clamping", 0.0f);
-    this->buffer = Array2D<Vector3>(width, height);
+    this->accumulator = ImageAccumulator<Vector3>(
+            width, height, ImageAccumulator<Vector3>::get_mode(config.get("image_accumulation", "per_thread")));
     this->max_eye_events = config.get("max_eye_events", 5);
     this->max_light_events = config.get("max_light_events", 5);
     this->max_eye_events = std::min(this->max_eye_events, this->max_path_length + 1);
@@ -47,15 +83,15 @@ void BidirectionalRenderer::trace(Path &path, Ray r, int depth, int max_depth, S
             break;
         } else {
             v.in_dir = -r.dir;
-            bsdf.sample(v.in_dir, rand(), rand(), v.out_dir, v.f, v.pdf, v.event);
+            const Vector2 u = rand.next2();
+            bsdf.sample(v.in_dir, u.x, u.y, v.out_dir, v.f, v.pdf, v.event);
             r = Ray(info.pos + v.out_dir * eps, v.out_dir); // TODO: fix here...
             path.push_back(v);
         }
     }
-    while (depth < max_depth) {
-        rand();
-        rand();
-        depth += 1;
+    // Two dimensions per bounce not taken, so that paths keep theirs at fixed dimensions
+    if (depth < max_depth) {
+        rand.skip(2 * (max_depth - depth));
     }
 }
 
@@ -66,6 +102,7 @@ Path BidirectionalRenderer::trace_eye_path(StateSequence &rand) {
         return result;
     }
     Ray r = camera->sample(Vector2(0, 0), Vector2(1.0f, 1.0f), rand);
+    RenderCounters::add(RenderCounter::primary_rays);
     IntersectionInfo info;
     info.pos = r.orig;
     info.normal = camera->get_dir();
@@ -82,9 +119,11 @@ Path BidirectionalRenderer::trace_light_path(StateSequence &rand) {
         return result;
     }
     real pdf;
-    const Triangle &tri = scene->sample_triangle_light_emission(rand(), pdf);
-    Vector3 pos = tri.sample_point(rand(), rand());
-    Vector3 dir = random_diffuse(tri.normal, rand(), rand());
+    real samples[5];
+    rand.fill(samples, 5);
+    const Triangle &tri = scene->sample_triangle_light_emission(samples[0], pdf);
+    Vector3 pos = tri.sample_point(samples[1], samples[2]);
+    Vector3 dir = random_diffuse(tri.normal, samples[3], samples[4]);
     Ray ray(pos + eps * dir, dir, 0);
 
     IntersectionInfo info;
@@ -109,6 +148,13 @@ Path BidirectionalRenderer::trace_light_path(StateSequence &rand) {
 
 bool BidirectionalRenderer::connectable(int num_eye_vertices, int num_light_vertices,
                                         const Vertex &eye_end, const Vertex &light_end) {
+    // Anything in between occludes; the end on light_end's triangle is excluded
+    return connectable_if_visible(num_eye_vertices, num_light_vertices, eye_end, light_end) &&
+           sg->visible(eye_end.pos, light_end.pos);
+}
+
+bool BidirectionalRenderer::connectable_if_visible(int num_eye_vertices, int num_light_vertices,
+                                                   const Vertex &eye_end, const Vertex &light_end) {
     const Vector3 dir = normalize(light_end.pos - eye_end.pos);
     if ((num_eye_vertices == 1) && (num_light_vertices >= 1)) {
         // Light tracing
@@ -127,80 +173,98 @@ bool BidirectionalRenderer::connectable(int num_eye_vertices, int num_light_vert
             return false;
         }
     }
-    Ray r(eye_end.pos, dir);
-    int tri_id = sg->query_hit_triangle_id(r);
-    return tri_id == light_end.triangle_id; // occluded?
+    return true;
 }
 
-double BidirectionalRenderer::path_pdf(const Path &path,
-                                       const int num_eye_vert_spec, const int num_light_vert_spec) {
-    int path_length = (int)path.size() - 1;
-    double p = 1.0;
-    const int num_eye_vertices = num_eye_vert_spec;
-    const int num_light_vertices = num_light_vert_spec;
-    const int is_vm = ((int)path.size() - 1 == num_eye_vertices + num_light_vertices - 2);
-    for (int i = -1; i <= num_eye_vertices - 2; i++) {
-        if (i == -1) {
-            p = p * camera->get_pixel_scaling();
-        } else if (i == 0) {
-            Vector3 d0 = normalize(path[1].pos - path[0].pos);
-            double c = dot(d0, camera->get_dir());
-            double distance_to_screen = 1.0f / c;
-            distance_to_screen = distance_to_screen * distance_to_screen;
-            p = p / (c / distance_to_screen);
-            // NOTE: above....
-            p = p * direction_to_area(path[0], path[1]);
-            p = p / camera->get_pixel_scaling();
-        } else {
-            Vector3 in_dir = normalize(path[i - 1].pos - path[i].pos);
-            Vector3 out_dir = normalize(path[i + 1].pos - path[i].pos);
-            if (path[i].connected) {
-                p = p * path[i].bsdf.probability_density(in_dir, out_dir);
-            } else {
-                p = p * path[i].pdf;
-            }
-            p = p * direction_to_area(path[i], path[i + 1]);
-        }
+double BidirectionalRenderer::scatter_area_pdf(const Vertex &prev, const Vertex &cur, const Vertex &next) {
+    double p;
+    if (cur.connected) {
+        p = cur.bsdf.probability_density(normalize(prev.pos - cur.pos), normalize(next.pos - cur.pos));
+    } else {
+        p = cur.pdf;
+    }
+    return p * direction_to_area(cur, next);
+}
+
+void BidirectionalRenderer::get_path_pdfs(const Path &path, PathPdfs &pdfs) {
+    const int path_length = (int)path.size() - 1;
+    pdfs.eye.resize(path_length + 1);
+    pdfs.light.resize(path_length + 1);
+    pdfs.merge.resize(path_length + 1);
+    pdfs.delta.resize(path_length + 1);
+    for (int v = 0; v <= path_length; v++) {
+        pdfs.delta[v] = (char)SurfaceEventClassifier::is_delta(path[v].event);
+    }
+    // Eye side: the camera, then the pixel the first segment goes through, then bounces
+    pdfs.eye[0] = camera->get_pixel_scaling();
+    if (path_length >= 1) {
+        Vector3 d0 = normalize(path[1].pos - path[0].pos);
+        double c = dot(d0, camera->get_dir());
+        double distance_to_screen = 1.0f / c;
+        distance_to_screen = distance_to_screen * distance_to_screen;
+        // NOTE: above....
+        pdfs.eye[1] = direction_to_area(path[0], path[1]) / (c / distance_to_screen) / camera->get_pixel_scaling();
+    }
+    for (int v = 2; v <= path_length; v++) {
+        pdfs.eye[v] = scatter_area_pdf(path[v - 2], path[v - 1], path[v]);
+    }
+    // Light side: the point on the light, then the diffuse emission from it, then bounces. No strategy takes
+    // the light pdf of the camera vertex.
+    int id = path[path_length].triangle_id;
+    pdfs.light[path_length] = scene->get_triangle_pdf(id) / scene->get_triangle(id).area;
+    if (path_length >= 2) {
+        Vector3 in_dir = normalize(path[path_length - 1].pos - path[path_length].pos);
+        pdfs.light[path_length - 1] = dot(path[path_length].normal, in_dir) / pi *
+                                      direction_to_area(path[path_length], path[path_length - 1]);
+    }
+    for (int v = path_length - 2; v >= 1; v--) {
+        pdfs.light[v] = scatter_area_pdf(path[v + 2], path[v + 1], path[v]);
     }
-    if (p == 0.0) return p; // Shortcut
-    for (int i = -1; i <= num_light_vertices - 2 - is_vm; i++) {
-        if (i == -1) {
-            // Light sample PDF
-            int id = path[path_length].triangle_id;
-            p = p * scene->get_triangle_pdf(id) / scene->get_triangle(id).area;
-        } else if (i == 0) {
-            Vector3 in_dir = normalize(
-                    path[path_length - 1].pos - path[path_length].pos);
-            p = p * dot(path[path_length].normal, in_dir) / pi;
-            p = p * direction_to_area(path[path_length], path[path_length - 1]);
+    pdfs.light[0] = 0;
+    // Merging at a delta vertex is impossible
+    pdfs.merge[0] = 0;
+    for (int v = 1; v <= path_length; v++) {
+        if (pdfs.delta[v - 1]) {
+            pdfs.merge[v] = 0;
         } else {
-            if (path[path_length - i].connected) {
-                Vector3 in_dir = normalize(
-                        path[path_length - (i - 1)].pos - path[path_length - i].pos);
-                Vector3 out_dir = normalize(
-                        path[path_length - (i + 1)].pos - path[path_length - i].pos);
-                p = p * path[path_length - i].bsdf.probability_density(in_dir, out_dir);
-            } else {
-                p = p * path[path_length - i].pdf;
-            }
-            p = p * direction_to_area(path[path_length - i], path[path_length - (i + 1)]);
+            pdfs.merge[v] = path[v].pdf * direction_to_area(path[v], path[v - 1]) * vm_pdf_constant;
         }
     }
-    if (p == 0.0) return p; // Shortcut
-    if (is_vm) {
-        const Vertex &light_end = path[num_eye_vertices];
-        const Vertex &eye_end = path[num_eye_vertices - 1];
-        if (SurfaceEventClassifier::is_delta(eye_end.event)) p = 0;
-        else {
-            p *= light_end.pdf * direction_to_area(light_end, eye_end) * vm_pdf_constant;
-        }
+    pdfs.eye_products.resize(path_length + 2);
+    pdfs.light_products.resize(path_length + 2);
+    pdfs.eye_products[0] = 1.0;
+    for (int v = 0; v <= path_length; v++) {
+        pdfs.eye_products[v + 1] = pdfs.eye_products[v] * pdfs.eye[v];
+    }
+    pdfs.light_products[path_length + 1] = 1.0;
+    for (int v = path_length; v >= 0; v--) {
+        pdfs.light_products[v] = pdfs.light_products[v + 1] * pdfs.light[v];
     }
-    return p;
+}
+
+double BidirectionalRenderer::path_pdf(const Path &path,
+                                       const int num_eye_vert_spec, const int num_light_vert_spec) {
+    PathPdfs pdfs;
+    get_path_pdfs(path, pdfs);
+    return path_pdf(pdfs, num_eye_vert_spec, num_light_vert_spec);
+}
+
+double BidirectionalRenderer::path_pdf(const PathPdfs &pdfs, const int num_eye_vert_spec,
+                                       const int num_light_vert_spec) {
+    // With merging, the last light vertex is the merged eye vertex
+    const bool is_vm = pdfs.get_path_length() == num_eye_vert_spec + num_light_vert_spec - 2;
+    return pdfs.get_strategy_pdf(num_eye_vert_spec, is_vm);
 }
 
 double BidirectionalRenderer::path_total_pdf(const Path &path,
                                              bool including_connection, int merging_factor) {
-    int path_length = (int)path.size() - 1;
+    PathPdfs pdfs;
+    get_path_pdfs(path, pdfs);
+    return path_total_pdf(pdfs, including_connection, merging_factor);
+}
+
+double BidirectionalRenderer::path_total_pdf(const PathPdfs &pdfs, bool including_connection, int merging_factor) {
+    int path_length = pdfs.get_path_length();
     double vc_pdf(0), vm_pdf(0);
     // We have to calculate all the possibilities...
     // Part I: Vertex Connection
@@ -211,13 +275,13 @@ double BidirectionalRenderer::path_total_pdf(const Path &path,
             if (num_eye_vertices > max_eye_events || num_light_vertices > max_light_events) {
                 continue;
             }
-            if (num_eye_vertices >= 2 && SurfaceEventClassifier::is_delta(path[num_eye_vertices - 1].event)) {
+            if (num_eye_vertices >= 2 && pdfs.delta[num_eye_vertices - 1]) {
                 continue;
             }
-            if (num_light_vertices >= 2 && SurfaceEventClassifier::is_delta(path[num_eye_vertices].event)) {
+            if (num_light_vertices >= 2 && pdfs.delta[num_eye_vertices]) {
                 continue;
             }
-            vc_pdf += path_pdf(path, num_eye_vertices, num_light_vertices);
+            vc_pdf += pdfs.get_strategy_pdf(num_eye_vertices, false);
         }
     }
     // Part II: Vertex Merging
@@ -230,10 +294,10 @@ double BidirectionalRenderer::path_total_pdf(const Path &path,
                 continue;
             }
             // Merging vertex can not be delta
-            if (SurfaceEventClassifier::is_delta(path[num_eye_vertices - 1].event)) {
+            if (pdfs.delta[num_eye_vertices - 1]) {
                 continue;
             }
-            vm_pdf += path_pdf(path, num_eye_vertices, num_light_vertices);
+            vm_pdf += pdfs.get_strategy_pdf(num_eye_vertices, true);
         }
     }
     return vc_pdf + vm_pdf * merging_factor;
@@ -245,9 +309,14 @@ PathContribution BidirectionalRenderer::connect(const Path &eye_path, const Path
     PathContribution result;
     bool specified = (num_eye_vert_spec != -1) && (num_light_vert_spec != -1);
 
+    // Connections passing all other tests, in order; their visibility is then tested in one batch
+    struct Connection {
+        int path_length, num_eye_vertices;
+        real px, py;
+    };
+    std::vector<Connection> connections;
+    std::vector<Ray> rays;
     for (int path_length = min_path_length; path_length <= max_path_length; path_length++) {
-        Path full_path;
-        full_path.resize(path_length + 1);
         for (int num_eye_vertices = 1; num_eye_vertices <= path_length + 1; num_eye_vertices++) {
             const int num_light_vertices = (path_length + 1) - num_eye_vertices;
             if (num_eye_vertices > (int)eye_path.size()) continue;
@@ -266,111 +335,139 @@ PathContribution BidirectionalRenderer::connect(const Path &eye_path, const Path
             } else {
                 const Vertex &eye_end = eye_path[num_eye_vertices - 1];
                 const Vertex &light_end = light_path[num_light_vertices - 1];
-                if (!connectable(num_eye_vertices, num_light_vertices, eye_end, light_end)) {
+                if (!connectable_if_visible(num_eye_vertices, num_light_vertices, eye_end, light_end)) {
                     continue;
                 }
             }
-            for (int i = 0; i < num_eye_vertices; i++) full_path[i] = eye_path[i];
-            for (int i = 0; i < num_light_vertices; i++) full_path[path_length - i] = light_path[i];
+            // The second vertex of the full path
+            const Vertex &next = num_eye_vertices >= 2 ? eye_path[1] : light_path[num_light_vertices - 1];
             real px, py;
-            camera->get_pixel_coordinate(normalized(full_path[1].pos - full_path[0].pos), px, py);
+            camera->get_pixel_coordinate(normalized(next.pos - eye_path[0].pos), px, py);
             if (px < 0 || px > 1 || py < 0 || py > 1) {
                 continue;
             }
-            if (num_eye_vertices > 0) {
-                full_path[num_eye_vertices - 1].connected = true;
-            }
+            connections.push_back(Connection{path_length, num_eye_vertices, px, py});
             if (num_light_vertices > 0) {
-                full_path[num_eye_vertices].connected = true;
-            }
-            Vector3d f = path_throughput(full_path);
-            if (max_component(f) <= 0.0f) {
-                //printf("f\n");
-                continue;
-            }
-            double p = path_pdf(full_path, num_eye_vertices, num_light_vertices);
-            if (p <= 0.0f) {
-                //printf("p\n");
-                continue;
-            }
-            double w = mis_weight(full_path, num_eye_vertices, num_light_vertices, true, merging_factor);
-            if (w <= 0.0f) {
-                //printf("w\n");
-                continue;
+                // Anything in between occludes; the end on light_end's triangle is excluded
+                rays.push_back(SceneGeometry::get_visibility_ray(eye_path[num_eye_vertices - 1].pos,
+                                                                 light_path[num_light_vertices - 1].pos));
             }
+        }
+    }
+    std::unique_ptr<bool[]> occluded(new bool[rays.size()]);
+    if (!rays.empty()) {
+        sg->occlude(&rays[0], (int)rays.size(), occluded.get());
+    }
 
-            Vector3d c = f * double(w / p);
-            if (print_path_policy == "all" ||
-                (print_path_policy == "bright" && max_component(c) > luminance_clamping)) {
-                printf("Abnormal Path: #Eye %d, #Light %d", num_eye_vertices, num_light_vertices);
-                printf("  f = %.10f %.10f %.10f, p = %.10f, c = %.10f, %.10f, %.10f\n", f[0], f[1], f[2], p, c[0],
-                       c[1], c[2]);
-                for (int i = 0; i <= path_length; i++) {
-                    auto &v = full_path[i];
-                    printf("  pos = %f %f %f, normal = %f %f %f\n", v.pos[0], v.pos[1], v.pos[2], v.normal[0],
-                           v.normal[1], v.normal[2]);
-                    auto &b = full_path[i].bsdf;
-                    if (i >= 1 && i < path_length) {
-                        Vector3 in = normalized(full_path[i - 1].pos - full_path[i].pos);
-                        Vector3 out = normalized(full_path[i + 1].pos - full_path[i].pos);
-                        auto p = b.probability_density(in, out);
-                        auto brdf = b.evaluate(in, out);
-                        printf("  #brdf = %s, pdf = %f, evaluate_bsdf = %f %f %f\n", b.get_name().c_str(), p,
-                               brdf.x, brdf.y,
-                               brdf.z);
-                    } else if (i == path_length) {
-                        Vector3 in = normalized(full_path[i - 1].pos - full_path[i].pos);
-                        Vector3 out = normalized(full_path[i].normal);
-                        auto p = b.probability_density(in, out);
-                        auto brdf = b.evaluate(in, out);
-                        printf("  #light brdf = %s, pdf = %f, evaluate_bsdf = %f %f %f\n", b.get_name().c_str(), p,
-                               brdf.x,
-                               brdf.y, brdf.z);
-                    }
+    Path full_path;
+    PathPdfs pdfs;
+    int num_tested = 0;
+    for (auto &connection : connections) {
+        const int path_length = connection.path_length;
+        const int num_eye_vertices = connection.num_eye_vertices;
+        const int num_light_vertices = (path_length + 1) - num_eye_vertices;
+        if (num_light_vertices > 0 && occluded[num_tested++]) {
+            continue;
+        }
+        full_path.resize(path_length + 1);
+        for (int i = 0; i < num_eye_vertices; i++) full_path[i] = eye_path[i];
+        for (int i = 0; i < num_light_vertices; i++) full_path[path_length - i] = light_path[i];
+        const real px = connection.px, py = connection.py;
+        if (num_eye_vertices > 0) {
+            full_path[num_eye_vertices - 1].connected = true;
+        }
+        if (num_light_vertices > 0) {
+            full_path[num_eye_vertices].connected = true;
+        }
+        Vector3d f = path_throughput(full_path);
+        if (max_component(f) <= 0.0f) {
+            //printf("f\n");
+            continue;
+        }
+        // Both the pdf and the weight come from the pdfs of the vertices, evaluated once
+        get_path_pdfs(full_path, pdfs);
+        double p = path_pdf(pdfs, num_eye_vertices, num_light_vertices);
+        if (p <= 0.0f) {
+            //printf("p\n");
+            continue;
+        }
+        double w = mis_weight(pdfs, num_eye_vertices, num_light_vertices, true, merging_factor);
+        if (w <= 0.0f) {
+            //printf("w\n");
+            continue;
+        }
+
+        Vector3d c = f * double(w / p);
+        if (print_path_policy == "all" ||
+            (print_path_policy == "bright" && max_component(c) > luminance_clamping)) {
+            printf("Abnormal Path: #Eye %d, #Light %d", num_eye_vertices, num_light_vertices);
+            printf("  f = %.10f %.10f %.10f, p = %.10f, c = %.10f, %.10f, %.10f\n", f[0], f[1], f[2], p, c[0],
+                   c[1], c[2]);
+            for (int i = 0; i <= path_length; i++) {
+                auto &v = full_path[i];
+                printf("  pos = %f %f %f, normal = %f %f %f\n", v.pos[0], v.pos[1], v.pos[2], v.normal[0],
+                       v.normal[1], v.normal[2]);
+                auto &b = full_path[i].bsdf;
+                if (i >= 1 && i < path_length) {
+                    Vector3 in = normalized(full_path[i - 1].pos - full_path[i].pos);
+                    Vector3 out = normalized(full_path[i + 1].pos - full_path[i].pos);
+                    auto p = b.probability_density(in, out);
+                    auto brdf = b.evaluate(in, out);
+                    printf("  #brdf = %s, pdf = %f, evaluate_bsdf = %f %f %f\n", b.get_name().c_str(), p,
+                           brdf.x, brdf.y,
+                           brdf.z);
+                } else if (i == path_length) {
+                    Vector3 in = normalized(full_path[i - 1].pos - full_path[i].pos);
+                    Vector3 out = normalized(full_path[i].normal);
+                    auto p = b.probability_density(in, out);
+                    auto brdf = b.evaluate(in, out);
+                    printf("  #light brdf = %s, pdf = %f, evaluate_bsdf = %f %f %f\n", b.get_name().c_str(), p,
+                           brdf.x,
+                           brdf.y, brdf.z);
                 }
-                printf("\n");
             }
-            if (print_path_policy != "none" && (abnormal(f) || abnormal(p) || abnormal(c))) {
-                printf("%d - %d\n", num_eye_vertices, num_light_vertices);
-                printf("f = %.10f %.10f %.10f, p = %.10f, c = %.10f, %.10f, %.10f\n", f[0], f[1], f[2], p,
-                       c[0], c[1], c[2]);
-                printf("Abnormal Path: #Eye %d, #Light %d", num_eye_vertices, num_light_vertices);
-                printf("  f = %.10f %.10f %.10f, p = %.10f, c = %.10f, %.10f, %.10f\n", f[0], f[1], f[2], p, c[0],
-                       c[1], c[2]);
-                for (int i = 0; i <= path_length; i++) {
-                    auto &v = full_path[i];
-                    printf("  pos = %f %f %f, normal = %f %f %f\n", v.pos[0], v.pos[1], v.pos[2], v.normal[0],
-                           v.normal[1], v.normal[2]);
-                    auto &b = full_path[i].bsdf;
-                    if (i >= 1 && i < path_length) {
-                        Vector3 in = normalized(full_path[i - 1].pos - full_path[i].pos);
-                        Vector3 out = normalized(full_path[i + 1].pos - full_path[i].pos);
-                        auto p = b.probability_density(in, out);
-                        auto brdf = b.evaluate(in, out);
-                        printf("  #brdf = %s, pdf = %f, evaluate_bsdf = %f %f %f\n", b.get_name().c_str(), p,
-                               brdf.x, brdf.y,
-                               brdf.z);
-                    } else if (i == path_length) {
-                        Vector3 in = normalized(full_path[i - 1].pos - full_path[i].pos);
-                        Vector3 out = normalized(full_path[i].normal);
-                        auto p = b.probability_density(in, out);
-                        auto brdf = b.evaluate(in, out);
-                        printf("  #light brdf = %s, pdf = %f, evaluate_bsdf = %f %f %f\n", b.get_name().c_str(), p,
-                               brdf.x,
-                               brdf.y, brdf.z);
-                    }
+            printf("\n");
+        }
+        if (print_path_policy != "none" && (abnormal(f) || abnormal(p) || abnormal(c))) {
+            printf("%d - %d\n", num_eye_vertices, num_light_vertices);
+            printf("f = %.10f %.10f %.10f, p = %.10f, c = %.10f, %.10f, %.10f\n", f[0], f[1], f[2], p,
+                   c[0], c[1], c[2]);
+            printf("Abnormal Path: #Eye %d, #Light %d", num_eye_vertices, num_light_vertices);
+            printf("  f = %.10f %.10f %.10f, p = %.10f, c = %.10f, %.10f, %.10f\n", f[0], f[1], f[2], p, c[0],
+                   c[1], c[2]);
+            for (int i = 0; i <= path_length; i++) {
+                auto &v = full_path[i];
+                printf("  pos = %f %f %f, normal = %f %f %f\n", v.pos[0], v.pos[1], v.pos[2], v.normal[0],
+                       v.normal[1], v.normal[2]);
+                auto &b = full_path[i].bsdf;
+                if (i >= 1 && i < path_length) {
+                    Vector3 in = normalized(full_path[i - 1].pos - full_path[i].pos);
+                    Vector3 out = normalized(full_path[i + 1].pos - full_path[i].pos);
+                    auto p = b.probability_density(in, out);
+                    auto brdf = b.evaluate(in, out);
+                    printf("  #brdf = %s, pdf = %f, evaluate_bsdf = %f %f %f\n", b.get_name().c_str(), p,
+                           brdf.x, brdf.y,
+                           brdf.z);
+                } else if (i == path_length) {
+                    Vector3 in = normalized(full_path[i - 1].pos - full_path[i].pos);
+                    Vector3 out = normalized(full_path[i].normal);
+                    auto p = b.probability_density(in, out);
+                    auto brdf = b.evaluate(in, out);
+                    printf("  #light brdf = %s, pdf = %f, evaluate_bsdf = %f %f %f\n", b.get_name().c_str(), p,
+                           brdf.x,
+                           brdf.y, brdf.z);
                 }
-                printf("\n");
-                continue;
             }
-            if (max_component(c) <= 0.0) continue;
-            //printf("%d - %d\n", num_eye_vertices, num_light_vertices);
-            result.push_back(Contribution(px, py, path_length, c));
-
-            if (specified && (num_eye_vert_spec == num_eye_vertices) &&
-                (num_light_vert_spec == num_light_vertices))
-                return result;
+            printf("\n");
+            continue;
         }
+        if (max_component(c) <= 0.0) continue;
+        //printf("%d - %d\n", num_eye_vertices, num_light_vertices);
+        result.push_back(Contribution(px, py, path_length, c));
+
+        if (specified && (num_eye_vert_spec == num_eye_vertices) &&
+            (num_light_vert_spec == num_light_vertices))
+            return result;
     }
     return result;
 }
@@ -378,8 +475,16 @@ PathContribution BidirectionalRenderer::connect(const Path &eye_path, const Path
 double
 BidirectionalRenderer::mis_weight(const Path &path, const int num_eye_vert_spec, const int num_light_vert_spec,
                                   bool including_connection, int merging_factor) {
-    const double p_i = path_pdf(path, num_eye_vert_spec, num_light_vert_spec); // TODO: not necessary re-evaluation
-    const double p_all = path_total_pdf(path, including_connection, merging_factor);
+    PathPdfs pdfs;
+    get_path_pdfs(path, pdfs);
+    return mis_weight(pdfs, num_eye_vert_spec, num_light_vert_spec, including_connection, merging_factor);
+}
+
+double
+BidirectionalRenderer::mis_weight(const PathPdfs &pdfs, const int num_eye_vert_spec, const int num_light_vert_spec,
+                                  bool including_connection, int merging_factor) {
+    const double p_i = path_pdf(pdfs, num_eye_vert_spec, num_light_vert_spec);
+    const double p_all = path_total_pdf(pdfs, including_connection, merging_factor);
     if ((p_i == 0.0) || (p_all == 0.0)) {
         return 0.0;
     } else {
@@ -455,9 +560,7 @@ void BidirectionalRenderer::write_path_contribution(const PathContribution &pc,
                 continue;
             }
             int ix = (int)floor(cont.x * width), iy = (int)floor(cont.y * height);
-            output_lock.lock();
-            this->buffer[ix][iy] += width * height * total_scaling * cont.c;
-            output_lock.unlock();
+            accumulator.accumulate(ix, iy, width * height * total_scaling * cont.c);
         }
     }
 }
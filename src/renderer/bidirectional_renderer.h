@@ -41,6 +41,32 @@ public:
 
 typedef std::vector<Vertex> Path;
 
+// Per vertex v of a path x_0..x_L, the area pdfs the MIS weights take for sampling it: from the eye side (by
+// x_{v-1}, or the camera for v = 0), from the light side (by x_{v+1}, or the light for v = L), and of merging it,
+// as light vertex, at x_{v-1}. The pdf of the strategy of s eye vertices is the product of the eye pdfs before v = s
+// and the light pdfs from it on, so with their running products every strategy is evaluated in O(1).
+struct PathPdfs {
+    std::vector<double> eye, light, merge;
+    // eye_products[s] of eye[v] for v < s, light_products[s] of light[v] for v >= s, for s in [0, L + 1]
+    std::vector<double> eye_products, light_products;
+    std::vector<char> delta;
+
+    int get_path_length() const {
+        return (int)eye.size() - 1;
+    }
+
+    double get_strategy_pdf(int num_eye_vertices, bool merging) const {
+        double p = eye_products[num_eye_vertices];
+        if (p == 0.0) return p; // Shortcut
+        p *= light_products[num_eye_vertices];
+        if (p == 0.0) return p;
+        if (merging) {
+            p *= merge[num_eye_vertices];
+        }
+        return p;
+    }
+};
+
 struct Contribution {
     float x, y;
     int path_length;
@@ -52,6 +78,8 @@ struct Contribution {
             x(x), y(y), path_length(path_length), c(c) {}
 };
 
+TC_BINARY_POD(Contribution)
+
 struct PathContribution {
     std::vector<Contribution> contributions;
     real scaling = 1.0f;
@@ -78,8 +106,36 @@ struct PathContribution {
     real get_scaling() const {
         return scaling;
     }
+
+    void write(BinaryFileStreamOutput &os) const {
+        os << contributions << scaling << total_contribution;
+    }
+
+    void read(BinaryFileStreamInput &is) {
+        is >> contributions >> scaling >> total_contribution;
+    }
 };
 
+// The vertices of a set of paths to merge at, in SoA, each standing for a prefix of its path instead of a copy of
+// it: vertex num_vertices[i] - 1 of path paths[i]. These are the non-delta vertices past the first.
+struct MergeVertices {
+    std::vector<Vector3> positions, normals;
+    std::vector<int> paths, num_vertices;
+
+    int size() const {
+        return (int)paths.size();
+    }
+
+    void resize(int n) {
+        positions.resize(n);
+        normals.resize(n);
+        paths.resize(n);
+        num_vertices.resize(n);
+    }
+
+    // Of the prefixes of at most max_vertices vertices (all if negative), in the order of paths and vertices
+    void build(const std::vector<Path> &all_paths, int max_vertices, int num_threads);
+};
 
 class BidirectionalRenderer : public Renderer {
 protected:
@@ -87,13 +143,12 @@ protected:
     int max_light_events;
     int stage_frequency;
 
-    Array2D<Vector3> buffer;
+    ImageAccumulator<Vector3> accumulator;
     std::shared_ptr<Sampler> sampler;
     real luminance_clamping;
     long long sample_count = 0;
     std::string print_path_policy;
     real vm_pdf_constant;
-    Spinlock output_lock;
 
 public:
     virtual void initialize(const Config &config) override;
@@ -106,13 +161,23 @@ public:
 
     bool connectable(int num_eye_vertices, int num_light_vertices, const Vertex &eye_end, const Vertex &light_end);
 
+    // connectable(), but for the visibility between the ends
+    bool connectable_if_visible(int num_eye_vertices, int num_light_vertices, const Vertex &eye_end,
+                                const Vertex &light_end);
+
     Vector3d path_throughput(const Path &path);
 
+    void get_path_pdfs(const Path &path, PathPdfs &pdfs);
+
     double path_pdf(const Path &path, const int num_eye_vert_spec,
                     const int num_light_vert_spec);
 
+    double path_pdf(const PathPdfs &pdfs, const int num_eye_vert_spec, const int num_light_vert_spec);
+
     double path_total_pdf(const Path &path, bool including_connection, int merging_factor);
 
+    double path_total_pdf(const PathPdfs &pdfs, bool including_connection, int merging_factor);
+
 
     PathContribution connect(const Path &eye_path, const Path &light_path,
                              const int num_eye_vert_spec = -1,
@@ -121,15 +186,45 @@ public:
     double mis_weight(const Path &path, const int num_eye_vert_spec, const int num_light_vert_spec,
                       bool including_connection, int merging_factor);
 
+    double mis_weight(const PathPdfs &pdfs, const int num_eye_vert_spec, const int num_light_vert_spec,
+                      bool including_connection, int merging_factor);
+
+    // Area pdf of next, sampled at cur coming from prev: by its bsdf if it is connected, or else as it was sampled
+    double scatter_area_pdf(const Vertex &prev, const Vertex &cur, const Vertex &next);
+
     double geometry_term(const Vertex &e0, const Vertex &e1);
 
     double direction_to_area(const Vertex &current, const Vertex &next);
 
     void write_path_contribution(const PathContribution &pc, const real scaling = 1.0f);
 
+    long long get_num_samples() const override {
+        return sample_count;
+    }
+
+    ImageAccumulator<Vector3> *get_accumulator() override {
+        return &accumulator;
+    }
+
+    void add_external_samples(long long num_samples) override {
+        sample_count += num_samples;
+    }
+
+    void write_checkpoint(BinaryFileStreamOutput &os) override {
+        os << sample_count;
+        accumulator.write(os);
+    }
+
+    void read_checkpoint(BinaryFileStreamInput &is) override {
+        is >> sample_count;
+        accumulator.reset();
+        accumulator.accumulate(is);
+    }
+
     Array2D<Vector3> get_output() override {
         Array2D<Vector3> output(width, height);
         float r = 1.0f / sample_count;
+        const Array2D<Vector3> &buffer = accumulator.get_total();
         for (auto &ind : output.get_region()) {
             output[ind] = buffer[ind] * r;
         }
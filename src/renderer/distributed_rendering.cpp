@@ -0,0 +1,122 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/visual/distributed_rendering.h>
+#include <taichi/io/binary_stream.h>
+#include <cstdio>
+#include <ctime>
+#include <random>
+#include <sys/stat.h>
+
+TC_NAMESPACE_BEGIN
+
+static const int partial_image_magic = 0x54435049;
+
+static bool file_exists(const std::string &fn) {
+    struct stat s;
+    return stat(fn.c_str(), &s) == 0;
+}
+
+// Seconds since the last modification, or -1 if there is no such file
+static double get_file_age(const std::string &fn) {
+    struct stat s;
+    if (stat(fn.c_str(), &s) != 0) {
+        return -1;
+    }
+    return std::difftime(std::time(nullptr), s.st_mtime);
+}
+
+DistributedRendering::DistributedRendering(const std::string &directory, long long chunk_samples, int num_chunks,
+                                           real claim_timeout)
+        : directory(directory), chunk_samples(chunk_samples), num_chunks(num_chunks), claim_timeout(claim_timeout) {
+    assert_info(chunk_samples > 0 && num_chunks > 0, "Distributed rendering needs chunks of samples");
+    merged.assign(num_chunks, false);
+}
+
+std::string DistributedRendering::get_file_name(int chunk, const std::string &extension) const {
+    return directory + "/chunk_" + std::to_string(chunk) + extension;
+}
+
+bool DistributedRendering::claim(int chunk) {
+    const std::string claim_fn = get_file_name(chunk, ".claim");
+    // "x": fails if the file exists, atomically on local and NFSv3+ file systems
+    FILE *f = std::fopen(claim_fn.c_str(), "wx");
+    if (f == nullptr) {
+        if (get_file_age(claim_fn) < claim_timeout || file_exists(get_file_name(chunk, ".partial"))) {
+            return false;
+        }
+        // A lost worker's: the worker removing it first takes the chunk over
+        if (std::remove(claim_fn.c_str()) != 0) {
+            return false;
+        }
+        f = std::fopen(claim_fn.c_str(), "wx");
+        if (f == nullptr) {
+            return false;
+        }
+    }
+    std::fclose(f);
+    return true;
+}
+
+void DistributedRendering::render_chunk(Renderer &renderer, int chunk) {
+    ImageAccumulator<Vector3> *accumulator = renderer.get_accumulator();
+    accumulator->reset();
+    const long long begin = chunk * chunk_samples;
+    renderer.render_sample_range(begin, begin + chunk_samples);
+    // Workers rendering the same chunk write their own temporary files
+    const std::string fn = get_file_name(chunk, ".partial");
+    const std::string temp_fn = fn + "." + std::to_string(std::random_device()()) + ".tmp";
+    {
+        BinaryFileStreamOutput os(temp_fn);
+        os << partial_image_magic << chunk << chunk_samples;
+        accumulator->write(os);
+        os.close();
+    }
+    assert_info(std::rename(temp_fn.c_str(), fn.c_str()) == 0, "Can not publish " + fn);
+}
+
+int DistributedRendering::work(Renderer &renderer) {
+    assert_info(renderer.supports_sample_ranges() && renderer.get_accumulator() != nullptr,
+                "This renderer can not render distributedly");
+    assert_info(chunk_samples % renderer.get_sample_range_granularity() == 0,
+                "chunk_samples must be a multiple of the renderer's sample range granularity");
+    int num_rendered = 0;
+    for (int chunk = 0; chunk < num_chunks; chunk++) {
+        if (file_exists(get_file_name(chunk, ".partial")) || !claim(chunk)) {
+            continue;
+        }
+        render_chunk(renderer, chunk);
+        num_rendered++;
+    }
+    return num_rendered;
+}
+
+bool DistributedRendering::merge(Renderer &renderer) {
+    ImageAccumulator<Vector3> *accumulator = renderer.get_accumulator();
+    assert_info(accumulator != nullptr, "This renderer has no accumulator to merge into");
+    for (int chunk = 0; chunk < num_chunks; chunk++) {
+        const std::string fn = get_file_name(chunk, ".partial");
+        if (merged[chunk] || !file_exists(fn)) {
+            continue;
+        }
+        BinaryFileStreamInput is(fn);
+        int magic, partial_chunk;
+        long long num_samples;
+        is >> magic >> partial_chunk >> num_samples;
+        assert_info(magic == partial_image_magic && partial_chunk == chunk && num_samples == chunk_samples,
+                    fn + " is not a partial image of this rendering");
+        accumulator->accumulate(is);
+        renderer.add_external_samples(num_samples);
+        merged[chunk] = true;
+        num_merged++;
+    }
+    return num_merged == num_chunks;
+}
+
+TC_NAMESPACE_END
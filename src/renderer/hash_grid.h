@@ -9,86 +9,192 @@
 
 #pragma once
 
-#include <functional>
+#include <algorithm>
+#include <cmath>
+#include <vector>
 #include <taichi/math/linalg.h>
+#include <taichi/math/radix_sort.h>
+#include <taichi/system/memory.h>
 
 TC_NAMESPACE_BEGIN
 
+// Values at points, hashed by grid cell. Values are inserted either into every cell within their range, for
+// lookups of one cell, or once into their own cell, for lookups of the 27 cells around the query point,
+// which needs ranges of at most the cell size. The build sorts (cell, value) pairs with a parallel radix sort.
 class HashGrid {
+public:
+    // The most cells a lookup scans
+    static const int max_query_cells = 27;
+
 private:
     real hash_cell_size;
-    std::vector<std::pair<int, int>> cache;
-    std::vector<int *> heads;
-    std::vector<int> cell_count;
-    std::vector<int> built_data;
-    int num_grids;
+    real inv_hash_cell_size;
+    bool insert_once;
+    // A power of two
+    int num_buckets;
+    int bucket_bits;
+    // The (bucket, value) pairs inserted, sorted by bucket once built
+    AlignedVector<uint64> cache_buckets;
+    AlignedVector<int> cache_values;
+    // Values of bucket b are cache_values[bucket_begin[b], bucket_begin[b + 1])
+    AlignedVector<int> bucket_begin;
+
+    Vector3i get_cell(const Vector3 &p) const {
+        Vector3 ip = p * inv_hash_cell_size;
+        return Vector3i((int)std::floor(ip.x), (int)std::floor(ip.y), (int)std::floor(ip.z));
+    }
+
 public:
-    // spatial hash function from smallppm, http://www.ci.i.u-tokyo.ac.jp/~hachisuka/smallppm_exp.cpp
     unsigned int spatial_hash(const int ix, const int iy, const int iz) const {
-        return (unsigned int)((ix * 73856093) ^ (iy * 19349663) ^ (iz * 83492791)) % num_grids;
+        const uint64 key = ((uint64)(unsigned int)ix << 32 | (unsigned int)iy) ^ hash64((unsigned int)iz);
+        return (unsigned int)(hash64(key) & (num_buckets - 1));
     }
 
-    void initialize(const real hash_cell_size, int num_grids) {
+    // num_buckets is rounded up to a power of two
+    void initialize(const real hash_cell_size, int num_buckets, bool insert_once = false) {
+        TC_MEMORY_TAG("hash_grid");
         this->hash_cell_size = hash_cell_size;
-        this->num_grids = num_grids;
-        cell_count.resize(num_grids + 1);
-        heads.resize(num_grids + 1);
+        this->inv_hash_cell_size = 1.0f / hash_cell_size;
+        this->insert_once = insert_once;
+        bucket_bits = 0;
+        while ((1 << bucket_bits) < num_buckets) {
+            bucket_bits++;
+        }
+        this->num_buckets = 1 << bucket_bits;
+        bucket_begin.assign(this->num_buckets + 1, 0);
         clear_cache();
     }
 
     void clear_cache() {
-        cache.clear();
+        cache_buckets.clear();
+        cache_values.clear();
     }
 
-    void build_grid() {
-        memset(&cell_count[0], 0, sizeof(cell_count[0]) * cell_count.size());
-        built_data.resize(cache.size());
-        for (auto p : cache) {
-            cell_count[p.first]++;
+    void build_grid(int num_threads = 1) {
+        TC_MEMORY_TAG("hash_grid");
+        radix_sort(cache_buckets, cache_values, std::max(bucket_bits, 1), num_threads);
+        // Bucket b begins at the first pair with a bucket of at least b; buckets that differ from those of
+        // their predecessors set those beginnings, once each
+        const int n = (int)cache_buckets.size();
+        if (n == 0) {
+            std::fill(bucket_begin.begin(), bucket_begin.end(), 0);
+            return;
         }
-        for (int i = 0; i + 2 < cell_count.size(); i++) {
-            cell_count[i + 1] += cell_count[i];
+        const int num_chunks = std::max(1, std::min(num_threads * 4, n / 16384));
+        parallel_for(0, num_chunks, num_threads, [&](int c) {
+            const int begin = (int)((int64)n * c / num_chunks), end = (int)((int64)n * (c + 1) / num_chunks);
+            for (int i = begin; i < end; i++) {
+                const int previous = i == 0 ? -1 : (int)cache_buckets[i - 1];
+                for (int b = previous + 1; b <= (int)cache_buckets[i]; b++) {
+                    bucket_begin[b] = i;
+                }
+            }
+        }, 1);
+        for (int b = (int)cache_buckets[n - 1] + 1; b <= num_buckets; b++) {
+            bucket_begin[b] = n;
         }
-        heads[0] = &built_data[0];
-        for (int i = (int)cell_count.size() - 1; i > 0; i--) {
-            cell_count[i] = cell_count[i - 1];
-            heads[i] = heads[0] + cell_count[i];
+    }
+
+    // The buckets to scan for values whose range holds p; returns their number
+    int get_query_buckets(const Vector3 &p, int buckets[max_query_cells]) const {
+        const Vector3i u = get_cell(p);
+        if (!insert_once) {
+            buckets[0] = spatial_hash(u.x, u.y, u.z);
+            return 1;
         }
-        cell_count[0] = 0;
-        for (auto p : cache) {
-            built_data[cell_count[p.first]++] = p.second;
+        int num = 0;
+        for (int x = u.x - 1; x <= u.x + 1; x++) {
+            for (int y = u.y - 1; y <= u.y + 1; y++) {
+                for (int z = u.z - 1; z <= u.z + 1; z++) {
+                    const int bucket = spatial_hash(x, y, z);
+                    // Cells sharing a bucket are scanned once
+                    if (std::find(buckets, buckets + num, bucket) == buckets + num) {
+                        buckets[num++] = bucket;
+                    }
+                }
+            }
         }
+        return num;
+    }
+
+    const int *begin(int bucket) const {
+        return cache_values.data() + bucket_begin[bucket];
     }
 
-    int *begin(Vector3 p) const {
-        Vector3 ip = p / hash_cell_size;
-        return begin(spatial_hash((int)ip.x, (int)ip.y, (int)ip.z));
+    const int *end(int bucket) const {
+        return cache_values.data() + bucket_begin[bucket + 1];
     }
 
-    int *end(Vector3 p) const {
-        Vector3 ip = p / hash_cell_size;
-        return end(spatial_hash((int)ip.x, (int)ip.y, (int)ip.z));
+    void insert(const Vector3 &pos, real range, int val) {
+        TC_MEMORY_TAG("hash_grid");
+        if (insert_once) {
+            assert_info(range <= hash_cell_size, "Values inserted once must have ranges within the cell size");
+            const Vector3i u = get_cell(pos);
+            cache_buckets.push_back(spatial_hash(u.x, u.y, u.z));
+            cache_values.push_back(val);
+        } else {
+            push_back_to_all_cells_in_range(pos, range, val);
+        }
     }
 
-    int *begin(int cell) const {
-        return heads[cell];
+    // insert(get_position(i), range, i) for i in [0, n), in parallel, with the pairs in the same order
+    template <typename F>
+    void insert_all(int n, const F &get_position, real range, int num_threads) {
+        if (insert_once) {
+            assert_info(range <= hash_cell_size, "Values inserted once must have ranges within the cell size");
+        }
+        // Pairs of value i begin at offsets[i]
+        std::vector<int> offsets(n);
+        parallel_for(0, n, num_threads, [&](int i) {
+            int bounds[3][2];
+            get_cell_range(get_position(i), range, bounds);
+            offsets[i] = (bounds[0][1] - bounds[0][0] + 1) * (bounds[1][1] - bounds[1][0] + 1) *
+                         (bounds[2][1] - bounds[2][0] + 1);
+        }, 1024);
+        const int first = (int)cache_buckets.size();
+        const int num_pairs = exclusive_scan(offsets, num_threads);
+        TC_MEMORY_TAG("hash_grid");
+        cache_buckets.resize(first + num_pairs);
+        cache_values.resize(first + num_pairs);
+        parallel_for(0, n, num_threads, [&](int i) {
+            int bounds[3][2];
+            get_cell_range(get_position(i), range, bounds);
+            int k = first + offsets[i];
+            for (int x = bounds[0][0]; x <= bounds[0][1]; x++)
+                for (int y = bounds[1][0]; y <= bounds[1][1]; y++)
+                    for (int z = bounds[2][0]; z <= bounds[2][1]; z++) {
+                        cache_buckets[k] = spatial_hash(x, y, z);
+                        cache_values[k++] = i;
+                    }
+        }, 1024);
     }
 
-    int *end(int cell) const {
-        return heads[cell + 1];
+    // The cells insert() puts a value into
+    void get_cell_range(const Vector3 &pos, real range, int bounds[3][2]) const {
+        if (insert_once) {
+            const Vector3i u = get_cell(pos);
+            for (int k = 0; k < 3; k++) {
+                bounds[k][0] = bounds[k][1] = u[k];
+            }
+            return;
+        }
+        for (int k = 0; k < 3; k++) {
+            bounds[k][0] = (int)floor((pos[k] - range) * inv_hash_cell_size);
+            bounds[k][1] = (int)ceil((pos[k] + range) * inv_hash_cell_size);
+        }
     }
 
     void push_back_to_all_cells_in_range(const Vector3 &pos, real range, int val) {
         int bounds[3][2];
         for (int k = 0; k < 3; k++) {
-            bounds[k][0] = (int)floor((pos[k] - range) / hash_cell_size);
-            bounds[k][1] = (int)ceil((pos[k] + range) / hash_cell_size);
+            bounds[k][0] = (int)floor((pos[k] - range) * inv_hash_cell_size);
+            bounds[k][1] = (int)ceil((pos[k] + range) * inv_hash_cell_size);
         }
         for (int x = bounds[0][0]; x <= bounds[0][1]; x++)
             for (int y = bounds[1][0]; y <= bounds[1][1]; y++)
                 for (int z = bounds[2][0]; z <= bounds[2][1]; z++) {
-                    int cell_id = spatial_hash(x, y, z);
-                    cache.push_back(std::make_pair(cell_id, val));
+                    cache_buckets.push_back(spatial_hash(x, y, z));
+                    cache_values.push_back(val);
                 }
     }
 
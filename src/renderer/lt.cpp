@@ -23,34 +23,95 @@ struct PathContribution {
             x(x), y(y), c(c) {}
 };
 
+// Photons are traced in parallel, in batches whose camera connections are tested for visibility together, and
+// splatted into the (per-thread) accumulator
 class LTRenderer : public Renderer {
 protected:
+    // A camera connection, splatted unless its ray is occluded
+    struct CameraConnection {
+        Ray ray;
+        PathContribution contribution;
+        real scale;
+    };
+
+    static const int photons_per_task = 64;
     std::shared_ptr<Sampler> sampler;
-    Array2D<Vector3> buffer;
+    ImageAccumulator<Vector3> accumulator;
     long long photon_counter;
     bool volumetric;
 
 public:
     virtual void initialize(const Config &config) {
         Renderer::initialize(config);
-        this->sampler = create_instance<Sampler>(config.get("sampler", "prand"));
+        this->sampler = create_instance<Sampler>(config.get("sampler", "prand"), config);
         this->volumetric = config.get("volumetric", true);
-        this->buffer.initialize(width, height, Vector3(0.0f));
+        this->accumulator = ImageAccumulator<Vector3>(
+                width, height, ImageAccumulator<Vector3>::get_mode(config.get("image_accumulation", "per_thread")));
         this->photon_counter = 0;
     }
 
     virtual void render_stage() {
-        int num_photons_per_stage = width * height;
-        for (int i = 0; i < num_photons_per_stage; i++) {
-            auto state_sequence = RandomStateSequence(sampler, photon_counter);
-            trace_photon(state_sequence);
-            photon_counter += 1;
-        }
+        const int num_photons_per_stage = width * height;
+        render_sample_range(photon_counter, photon_counter + num_photons_per_stage);
+        photon_counter += num_photons_per_stage;
+    }
+
+    // Photons are independent
+    bool supports_sample_ranges() const override {
+        return true;
+    }
+
+    void render_sample_range(long long begin, long long end) override {
+        const int num_tasks = (int)((end - begin + photons_per_task - 1) / photons_per_task);
+        ThreadedTaskManager::run([&](int t) {
+            std::vector<CameraConnection> connections;
+            const long long task_end = std::min(end, begin + (long long)(t + 1) * photons_per_task);
+            for (long long i = begin + (long long)t * photons_per_task; i < task_end; i++) {
+                auto state_sequence = RandomStateSequence(sampler, i);
+                trace_photon(state_sequence, connections);
+            }
+            const int n = (int)connections.size();
+            std::vector<Ray> rays(n);
+            std::unique_ptr<bool[]> occluded(new bool[n]);
+            for (int k = 0; k < n; k++) {
+                rays[k] = connections[k].ray;
+            }
+            sg->occlude(rays.data(), n, occluded.get());
+            for (int k = 0; k < n; k++) {
+                if (!occluded[k]) {
+                    write_path_contribution(connections[k].contribution, connections[k].scale);
+                }
+            }
+        }, 0, num_tasks, num_threads, 1);
+    }
+
+    long long get_num_samples() const override {
+        return photon_counter;
+    }
+
+    ImageAccumulator<Vector3> *get_accumulator() override {
+        return &accumulator;
+    }
+
+    void add_external_samples(long long num_samples) override {
+        photon_counter += num_samples;
+    }
+
+    void write_checkpoint(BinaryFileStreamOutput &os) override {
+        os << photon_counter;
+        accumulator.write(os);
+    }
+
+    void read_checkpoint(BinaryFileStreamInput &is) override {
+        is >> photon_counter;
+        accumulator.reset();
+        accumulator.accumulate(is);
     }
 
     Array2D<Vector3> get_output() {
         Array2D<Vector3> output(width, height);
         float r = 1.0f / photon_counter;
+        const Array2D<Vector3> &buffer = accumulator.get_total();
         for (auto &ind : output.get_region()) {
             output[ind] = buffer[ind] * r;
         }
@@ -60,31 +121,33 @@ public:
     virtual void write_path_contribution(const PathContribution &cont, real scale = 1.0f) {
         if (0 <= cont.x && cont.x <= 1 - eps && 0 <= cont.y && cont.y <= 1 - eps) {
             int ix = (int)floor(cont.x * width), iy = (int)floor(cont.y * height);
-            this->buffer[ix][iy] += width * height * scale * cont.c;
+            accumulator.accumulate(ix, iy, width * height * scale * cont.c);
         }
     }
 
+    // Queues the connection of pos to the camera, if it is on screen and contributes
     void connect_to_camera(const Vector3 &pos, const Vector3 &normal, const Vector3 &flux,
-                           const BSDF &bsdf, const Vector3 in_dir) {
+                           const BSDF &bsdf, const Vector3 in_dir, std::vector<CameraConnection> &connections) {
         real px, py;
         camera->get_pixel_coordinate(normalized(pos - camera->get_origin()), px, py);
         if (!(px < 0 || px > 1 || py < 0 || py > 1)) {
             Vector3 out_dir = normalized(camera->get_origin() - pos);
+            Vector3 co = bsdf.evaluate(in_dir, out_dir);
+            if (max_component(flux * co) <= 0) {
+                return;
+            }
             auto test_ray = Ray(pos, out_dir);
-            sg->query(test_ray);
             Vector3d d0 = pos - camera->get_origin();
             const double dist2 = dot(d0, d0);
-            if (test_ray.dist > sqrt(dist2) - 1e-4f) {
-                d0 = normalized(d0);
-                const double c = dot(d0, camera->get_dir());
-                real scale = real(abs(dot(d0, normal) / dist2 / (c * c * c)) / camera->get_pixel_scaling());
-                Vector3 co = bsdf.evaluate(in_dir, out_dir);
-                write_path_contribution(PathContribution(px, py, flux * co), scale);
-            }
+            test_ray.dist = real(sqrt(dist2)) - 1e-4f;
+            d0 = normalized(d0);
+            const double c = dot(d0, camera->get_dir());
+            real scale = real(abs(dot(d0, normal) / dist2 / (c * c * c)) / camera->get_pixel_scaling());
+            connections.push_back(CameraConnection{test_ray, PathContribution(px, py, flux * co), scale});
         }
     }
 
-    bool trace_photon(StateSequence &rand) { // returns visibility
+    bool trace_photon(StateSequence &rand, std::vector<CameraConnection> &connections) { // returns visibility
         bool visible = false;
         real pdf;
         const Triangle &tri = scene->sample_triangle_light_emission(rand(), pdf);
@@ -96,7 +159,7 @@ public:
         // constant?
         flux *= Vector3(1.0f / pdf) * tri.area;
         if (min_path_length <= 1) {
-            connect_to_camera(pos, tri.normal, flux, light_bsdf, tri.normal);
+            connect_to_camera(pos, tri.normal, flux, light_bsdf, tri.normal, connections);
         }
         flux = flux * light_bsdf.evaluate(tri.normal, dir) * pi;
         Ray ray(pos + dir * 1e-4f, dir, 0); // TODO: ... 1e-4f
@@ -104,7 +167,6 @@ public:
             IntersectionInfo info = sg->query(ray);
             if (!info.intersected)
                 break;
-            Triangle &tri = scene->triangles[info.triangle_id];
             BSDF bsdf(scene, info);
             Vector3 in_dir = -ray.dir;
             Vector3 out_dir;
@@ -114,9 +176,9 @@ public:
             if (bsdf.is_emissive()) {
                 break;
             }
-            if (!SurfaceEventClassifier::is_delta(event)) {
+            if (!bsdf.is_delta()) {
                 // Connect to camera
-                connect_to_camera(info.pos, info.normal, flux, bsdf, in_dir);
+                connect_to_camera(info.pos, info.normal, flux, bsdf, in_dir, connections);
             }
             bsdf.sample(in_dir, rand(), rand(), out_dir, f, pdf, event);
             Vector3 color = f * bsdf.cos_theta(out_dir) / pdf;
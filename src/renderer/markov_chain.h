@@ -11,6 +11,7 @@
 
 #include <taichi/math/linalg.h>
 #include <taichi/visual/sampler.h>
+#include <taichi/io/binary_stream.h>
 
 #include <vector>
 #include <memory>
@@ -22,13 +23,34 @@ class MarkovChain {
 protected:
     std::vector<real> states;
 public:
+    // Of the chain's own random numbers, shared by its copies, or null for rand()
+    RandState *rand_state = nullptr;
+
+    real next_rand() const {
+        return rand_state ? rand(*rand_state) : rand();
+    }
+
     virtual real get_state(int d) {
         while ((int)states.size() <= d) {
-            states.push_back(rand());
+            states.push_back(next_rand());
         }
         return states[d];
     }
 
+    // E.g. the samples of a RecordingStateSequence, to start at their path
+    void set_states(const std::vector<real> &states) {
+        this->states = states;
+    }
+
+    // For render checkpoints
+    virtual void write(BinaryFileStreamOutput &os) const {
+        os << states;
+    }
+
+    virtual void read(BinaryFileStreamInput &is) {
+        is >> states;
+    }
+
     virtual void print_states() {
         printf("chain = ");
         for (int i = 0; i < (int)states.size(); i++) {
@@ -49,6 +71,21 @@ public:
     }
 };
 
+// Records the samples drawn from another sequence
+class RecordingStateSequence : public StateSequence {
+private:
+    StateSequence &sequence;
+public:
+    std::vector<real> samples;
+
+    RecordingStateSequence(StateSequence &sequence) : sequence(sequence) {}
+
+    real sample() override {
+        cursor++;
+        samples.push_back(sequence());
+        return samples.back();
+    }
+};
 
 template<bool starts_from_screen>
 class PSSMarkovChain : public MarkovChain {
@@ -102,8 +139,12 @@ protected:
 
 class AMCMCPPMMarkovChain : public MarkovChain {
 public:
+    AMCMCPPMMarkovChain(RandState *rand_state = nullptr) {
+        this->rand_state = rand_state;
+    }
+
     AMCMCPPMMarkovChain large_step() const {
-        return AMCMCPPMMarkovChain();
+        return AMCMCPPMMarkovChain(rand_state);
     }
 
     AMCMCPPMMarkovChain mutate(real strength) const {
@@ -116,9 +157,9 @@ public:
 
 protected:
     // TODO: what's the difference between this and the one purposed in the paper?
-    inline static real perturb(const real value, const real strength) {
+    real perturb(const real value, const real strength) const {
         real result;
-        real r = rand();
+        real r = next_rand();
         if (r < 0.5f) {
             r = r * 2.0f;
             result = value + pow(r, 1.0f / strength + 1.0f);
@@ -22,13 +22,16 @@ protected:
     real initial_radius;
     HashGrid hash_grid;
     std::vector<Path> eye_paths;
-    std::vector<Path> eye_paths_for_connection;
+    // Eye vertices to merge with, of eye_paths
+    MergeVertices eye_vertices;
     real radius;
     int n_samples_per_stage;
     Array2D<Vector3> bdpm_image;
     real alpha;
     bool use_vc;
     bool use_vm;
+    // Stores every vertex once in the hash grid, for lookups of the 27 cells around a query
+    bool compact_hash_grid;
     bool shrinking_radius;
 
 public:
@@ -39,6 +42,7 @@ public:
         initial_radius = config.get_float("initial_radius");
         use_vc = config.get("use_vc", true);
         use_vm = config.get("use_vm", true);
+        compact_hash_grid = config.get("compact_hash_grid", false);
         alpha = config.get("alpha", 0.66667f);
         shrinking_radius = config.get("shrinking_radius", true);
         bdpm_image.initialize(width, height, Vector3(0.0f, 0.0f, 0.0f));
@@ -46,109 +50,128 @@ public:
         n_samples_per_stage = width * height / stage_frequency;
     }
 
+    void write_checkpoint(BinaryFileStreamOutput &os) override {
+        BidirectionalRenderer::write_checkpoint(os);
+        os << num_stages;
+    }
+
+    void read_checkpoint(BinaryFileStreamInput &is) override {
+        BidirectionalRenderer::read_checkpoint(is);
+        is >> num_stages;
+    }
+
     PathContribution vertex_merge(const Path &full_light_path) {
         PathContribution pc;
         real radius2 = radius * radius;
+        Path full_path;
+        int candidates[64];
         for (int num_light_vertices = 2; num_light_vertices <= (int)full_light_path.size(); num_light_vertices++) {
-            Path light_path(full_light_path.begin(), full_light_path.begin() + num_light_vertices);
-            Vector3 merging_pos = light_path.back().pos;
-            int *begin = hash_grid.begin(merging_pos), *end = hash_grid.end(merging_pos);
-
-            for (int *eye_path_id_pointer = begin; eye_path_id_pointer < end; eye_path_id_pointer++) {
-                int eye_path_id = *eye_path_id_pointer;
-                Path eye_path = eye_paths[eye_path_id];
-                int path_length = (int)light_path.size() + (int)eye_path.size() - 2;
-                int num_eye_vertices = (int)eye_path.size();
-                Vertex merging_vertex_light = light_path.back();
-                Vertex merging_vertex_eye = eye_path.back();
-                assert_info(light_path.size() >= 1, "light path empty");
-                assert_info(eye_path.size() >= 1, "eye path empty");
-                if (SurfaceEventClassifier::is_delta(merging_vertex_eye.event) ||
-                    SurfaceEventClassifier::is_delta(merging_vertex_light.event)) {
-                    // Do not connect Delta BSDF
-                    continue;
-                }
-                Vector3 v = merging_vertex_eye.pos - merging_vertex_light.pos;
-                if (min_path_length <= path_length && path_length <= max_path_length &&
-                    dot(merging_vertex_eye.normal, merging_vertex_light.normal) > eps && dot(v, v) <= radius2) {
-                    // Screen coordinates
-                    Vector3 camera_direction = normalize(eye_path[1].pos - eye_path[0].pos);
-                    real screen_u, screen_v;
-                    camera->get_pixel_coordinate(camera_direction, screen_u, screen_v);
-                    if (!(0 <= screen_u && screen_u < 1 && 0 <= screen_v && screen_v < 1)) {
-                        continue;
-                    }
-                    screen_u = clamp(screen_u, 0.0f, 1.0f);
-                    screen_v = clamp(screen_v, 0.0f, 1.0f);
-                    eye_path.back().connected = true;
-                    Path full_path;
-                    full_path.resize(
-                            num_eye_vertices + num_light_vertices - 1); // note that last light vertex is deleted
-                    for (int i = 0; i < num_eye_vertices; i++) full_path[i] = eye_path[i];
-                    for (int i = 0; i < num_light_vertices - 1; i++) full_path[path_length - i] = light_path[i];
-
-                    // Evaluateh
-                    Vector3 f = path_throughput(full_path);
-                    if (max_component(f) <= 0.0f) {
-                        //printf("f\n");
-                        continue;
-                    }
-                    double p = path_pdf(full_path, num_eye_vertices, num_light_vertices);
-                    if (p <= 0.0f) {
-                        //printf("p\n");
-                        continue;
+            const Vertex &merging_vertex_light = full_light_path[num_light_vertices - 1];
+            if (SurfaceEventClassifier::is_delta(merging_vertex_light.event)) {
+                // Do not connect Delta BSDF
+                continue;
+            }
+            int buckets[HashGrid::max_query_cells];
+            const int num_buckets = hash_grid.get_query_buckets(merging_vertex_light.pos, buckets);
+            for (int b = 0; b < num_buckets; b++) {
+                const int *begin = hash_grid.begin(buckets[b]), *end = hash_grid.end(buckets[b]);
+                while (begin < end) {
+                    // As in VCM, candidates are culled in batches over the eye vertex arrays
+                    int num_candidates = 0;
+                    for (; begin < end && num_candidates < 64; begin++) {
+                        const int i = *begin;
+                        const int path_length = num_light_vertices + eye_vertices.num_vertices[i] - 2;
+                        Vector3 v = eye_vertices.positions[i] - merging_vertex_light.pos;
+                        if (min_path_length <= path_length && path_length <= max_path_length &&
+                            dot(eye_vertices.normals[i], merging_vertex_light.normal) > eps && dot(v, v) <= radius2) {
+                            candidates[num_candidates++] = i;
+                        }
                     }
-                    double w = mis_weight(full_path, num_eye_vertices, num_light_vertices, use_vc,
-                                          n_samples_per_stage);
-                    if (w <= 0.0f) {
-                        //printf("w\n");
-                        continue;
+                    for (int k = 0; k < num_candidates; k++) {
+                        const int i = candidates[k];
+                        const Path &eye_path = eye_paths[eye_vertices.paths[i]];
+                        const int num_eye_vertices = eye_vertices.num_vertices[i];
+                        const int path_length = num_light_vertices + num_eye_vertices - 2;
+                        // Screen coordinates
+                        Vector3 camera_direction = normalize(eye_path[1].pos - eye_path[0].pos);
+                        real screen_u, screen_v;
+                        camera->get_pixel_coordinate(camera_direction, screen_u, screen_v);
+                        if (!(0 <= screen_u && screen_u < 1 && 0 <= screen_v && screen_v < 1)) {
+                            continue;
+                        }
+                        // Note that the last light vertex is deleted
+                        full_path.resize(num_eye_vertices + num_light_vertices - 1);
+                        for (int j = 0; j < num_eye_vertices; j++) full_path[j] = eye_path[j];
+                        full_path[num_eye_vertices - 1].connected = true;
+                        for (int j = 0; j < num_light_vertices - 1; j++) {
+                            full_path[path_length - j] = full_light_path[j];
+                        }
+                        // Evaluate
+                        Vector3 f = path_throughput(full_path);
+                        if (max_component(f) <= 0.0f) {
+                            continue;
+                        }
+                        double p = path_pdf(full_path, num_eye_vertices, num_light_vertices);
+                        if (p <= 0.0f) {
+                            continue;
+                        }
+                        double w = mis_weight(full_path, num_eye_vertices, num_light_vertices, use_vc,
+                                              n_samples_per_stage);
+                        if (w <= 0.0f) {
+                            continue;
+                        }
+                        Vector3 c = f * float(w / p);
+                        if (max_component(c) <= 0.0) continue;
+                        pc.push_back(Contribution(screen_u, screen_v, path_length, c));
                     }
-                    Vector3 c = f * float(w / p);
-                    if (max_component(c) <= 0.0) continue;
-                    pc.push_back(Contribution(screen_u, screen_v, path_length, c));
                 }
             }
         }
         return pc;
     }
 
+    // Eye paths of the stage, traced in parallel
+    void trace_eye_paths() {
+        Profiler::Scope _(profiler, "eye_paths");
+        eye_paths.resize(n_samples_per_stage);
+        ThreadedTaskManager::run([&](int k) {
+            auto state_sequence = RandomStateSequence(sampler, sample_count * 2 + k);
+            eye_paths[k] = trace_eye_path(state_sequence);
+        }, 0, n_samples_per_stage, num_threads);
+    }
+
+    // The eye vertices to merge with, of prefixes of at most max_vertices vertices (all if negative), and the grid
+    // over them; none without vertex merging
+    void build_eye_vertices(int max_vertices) {
+        Profiler::Scope _(profiler, "merge_build");
+        eye_vertices.build(eye_paths, use_vm ? max_vertices : 0, num_threads);
+        hash_grid.insert_all(eye_vertices.size(), [&](int i) { return eye_vertices.positions[i]; }, radius,
+                             num_threads);
+        hash_grid.build_grid(num_threads);
+    }
+
     virtual void render_stage() override {
         radius = initial_radius * (shrinking_radius ? (real)pow(num_stages + 1.0f, -(1.0f - alpha) / 2.0f) : 1);
         vm_pdf_constant = pi * radius * radius;
-        hash_grid.initialize(radius, width * height * 10 + 7);
-        eye_paths.clear();
-        eye_paths_for_connection.clear();
+        hash_grid.initialize(radius, width * height * 10 + 7, compact_hash_grid);
         // 1. Generate eye paths (importons)
-        for (int k = 0; k < n_samples_per_stage; k++) {
-            auto state_sequence = RandomStateSequence(sampler, sample_count * 2 + k);
-            Path eye_path = trace_eye_path(state_sequence);
-            eye_paths_for_connection.push_back(eye_path);
-            if (use_vm) {
-                // TODO: correct??? more efficient???
-                for (int num_eye_vertices = 2;
-                     num_eye_vertices <= (int)eye_path.size(); num_eye_vertices++) {
-                    Path partial_eye_path(eye_path.begin(), eye_path.begin() + num_eye_vertices);
-                    hash_grid.push_back_to_all_cells_in_range(partial_eye_path.back().pos, radius,
-                                                              (int)eye_paths.size());
-                    eye_paths.push_back(partial_eye_path);
-                }
-            }
-        }
-        hash_grid.build_grid();
+        trace_eye_paths();
+        build_eye_vertices(-1);
 
         // 2. Generate light paths (photons)
-        for (int k = 0; k < n_samples_per_stage; k++) {
-            auto state_sequence = RandomStateSequence(sampler, sample_count * 2 + n_samples_per_stage + k);
-            Path light_path = trace_light_path(state_sequence);
-            if (use_vm) {
-                write_path_contribution(vertex_merge(light_path));
-            }
-            if (use_vc) {
-                write_path_contribution(
-                        connect(eye_paths_for_connection[k], light_path, -1, -1,
-                                (int)use_vm * n_samples_per_stage));
-            }
+        {
+            Profiler::Scope _(profiler, "light_paths");
+            ThreadedTaskManager::run([&](int k) {
+                auto state_sequence = RandomStateSequence(sampler, sample_count * 2 + n_samples_per_stage + k);
+                Path light_path = trace_light_path(state_sequence);
+                if (use_vm) {
+                    write_path_contribution(vertex_merge(light_path));
+                }
+                if (use_vc) {
+                    write_path_contribution(
+                            connect(eye_paths[k], light_path, -1, -1, (int)use_vm * n_samples_per_stage));
+                }
+            }, 0, n_samples_per_stage, num_threads);
         }
 
         sample_count += n_samples_per_stage;
@@ -157,6 +180,8 @@ public:
 
 TC_IMPLEMENTATION(Renderer, UPSRenderer, "ups");
 
+// As in PSSMLT, num_chains independent chains, each with its own random numbers, run in parallel and split the
+// light paths of a stage evenly. Each has a visibility and a contribution chain, and its own normalizers.
 class MCMCUPSRenderer : public UPSRenderer {
 public:
     struct MCMCState {
@@ -177,12 +202,23 @@ public:
         con = 0,
         vis = 1
     };
-    MCMCState states[2];
-    long long accepted;
-    long long mutated;
-    real mutation_strength;
-    RunningAverage normalizers[2];
-    std::vector<PathContribution> all_pcs[2];
+
+    // What a chain keeps within a stage
+    struct ChainStage {
+        MCMCState states[2];
+        RunningAverage normalizers[2];
+        std::vector<PathContribution> all_pcs[2];
+        RunningAverage photon_visibility;
+    };
+
+    int num_chains;
+    // One per chain; never reallocated, since the chains point to them
+    std::vector<RandState> chain_rand_states;
+    std::vector<ChainStage> chain_stages;
+    // Per chain, carried over between stages
+    std::vector<long long> accepted;
+    std::vector<long long> mutated;
+    std::vector<real> mutation_strengths;
     bool use_vis_chain;
     bool use_con_chain;
     bool chain_exchange;
@@ -192,6 +228,12 @@ public:
     real target_mutation_acceptance;
     real large_step_prob;
 
+    // Light paths of chain c in a stage of n
+    void get_chain_mutations(int c, int n, int &begin, int &end) const {
+        begin = (int)((int64)n * c / num_chains);
+        end = (int)((int64)n * (c + 1) / num_chains);
+    }
+
     virtual void initialize(const Config &config) override {
         UPSRenderer::initialize(config);
         large_step_prob = config.get("large_step_prob", 0.3f);
@@ -215,73 +257,74 @@ public:
         mutation_expectation = config.get("mutation_expectation", true);
         target_mutation_acceptance = config.get("target_mutation_acceptance", 0.234f);
         P(target_mutation_acceptance);
-        mutation_strength = 0.001f;
-        accepted = 1;
-        mutated = 1;
-    }
-
-    virtual void render_stage() override {
-        radius = initial_radius * (shrinking_radius ? (real)pow(num_stages + 1.0f, -(1.0f - alpha) / 2.0f) : 1);
-        vm_pdf_constant = pi * radius * radius;
-        hash_grid.initialize(radius, width * height * 10 + 7);
-        eye_paths.clear();
-        eye_paths_for_connection.clear();
-
-        // 1. Generate eye paths (importons)
-        for (int k = 0; k < n_samples_per_stage; k++) {
-            auto state_sequence = RandomStateSequence(sampler, sample_count * 2 + k);
-            Path eye_path = trace_eye_path(state_sequence);
-            eye_paths_for_connection.push_back(eye_path);
-            if (use_vm) {
-                // TODO: correct??? more efficient???
-                for (int num_eye_vertices = 2; num_eye_vertices <= (int)eye_path.size(); num_eye_vertices++) {
-                    if (num_eye_vertices > 2) continue; // NOTE:debug
-                    Path partial_eye_path(eye_path.begin(), eye_path.begin() + num_eye_vertices);
-                    hash_grid.push_back_to_all_cells_in_range(partial_eye_path.back().pos, radius,
-                                                              (int)eye_paths.size());
-                    eye_paths.push_back(partial_eye_path);
-                }
-            }
-        }
-        hash_grid.build_grid();
-
-        for (int i = 0; i < 2; i++) {
-            normalizers[i].set_safe_value(1e-10f);
-            normalizers[i].clear();
-            all_pcs[i].clear();
+        num_chains = config.get("num_chains", num_threads);
+        assert_info(num_chains > 0, "num_chains must be positive");
+        chain_rand_states.clear();
+        for (int c = 0; c < num_chains; c++) {
+            chain_rand_states.push_back(RandState((uint64)c));
         }
-        normalizers[vis].insert(1e-6f, 1e-5f);
+        chain_stages.resize(num_chains);
+        mutation_strengths.assign(num_chains, 0.001f);
+        accepted.assign(num_chains, 1);
+        mutated.assign(num_chains, 1);
+    }
 
+    // The chains start over every stage; only their adaptation and random numbers carry over
+    void write_checkpoint(BinaryFileStreamOutput &os) override {
+        UPSRenderer::write_checkpoint(os);
+        os << accepted << mutated << mutation_strengths << chain_rand_states;
+    }
 
-        // 2. Generate light paths (photons)
+    void read_checkpoint(BinaryFileStreamInput &is) override {
+        UPSRenderer::read_checkpoint(is);
+        std::vector<RandState> rand_states;
+        is >> accepted >> mutated >> mutation_strengths >> rand_states;
+        assert_info((int)rand_states.size() == num_chains, "Checkpoint num_chains mismatch");
+        chain_rand_states = rand_states;
+    }
 
-        // Initialize two chains
+    // Both chains of c start at the same light path with a contribution
+    void initialize_chain(int c) {
+        RandState &rand_state = chain_rand_states[c];
+        ChainStage &stage = chain_stages[c];
         long long initializing_count = 0;
         while (true) {
             initializing_count += 1;
             if (initializing_count % 100000 == 0) {
                 printf("Warning: difficult initilization %lld.\n", initializing_count);
             }
-            auto chain = AMCMCPPMMarkovChain();
+            auto chain = AMCMCPPMMarkovChain(&rand_state);
             auto rand = MCStateSequence(chain);
             auto light_path = trace_light_path(rand);
             auto pc = vertex_merge(light_path);
             if (pc.get_total_contribution() > 0) {
                 // Found... Give is to both chains because we are lazy...
                 for (int i = 0; i < 2; i++) {
-                    states[i].chain = chain;
-                    states[i].pc = pc;
-                    states[i].sc = states[i].p_star(i);
+                    stage.states[i].chain = chain;
+                    stage.states[i].pc = pc;
+                    stage.states[i].sc = stage.states[i].p_star(i);
                 }
                 break;
             }
         }
+    }
 
-        int num_chains = int(use_vis_chain) + int(use_con_chain);
-        RunningAverage photon_visibility;
-        // TODO: deferred writting...
-        for (int k = 0; k < n_samples_per_stage; k++) {
-            MarkovChainTag u = (MarkovChainTag)(int(rand() * 2));
+    // The light paths [begin, end) of the stage, on chain c
+    void run_chain(int c, int begin, int end) {
+        RandState &rand_state = chain_rand_states[c];
+        ChainStage &stage = chain_stages[c];
+        MCMCState *states = stage.states;
+        for (int i = 0; i < 2; i++) {
+            stage.normalizers[i].set_safe_value(1e-10f);
+            stage.normalizers[i].clear();
+            stage.all_pcs[i].clear();
+        }
+        stage.normalizers[vis].insert(1e-6f, 1e-5f);
+        stage.photon_visibility.clear();
+        initialize_chain(c);
+        real &mutation_strength = mutation_strengths[c];
+        for (int k = begin; k < end; k++) {
+            MarkovChainTag u = (MarkovChainTag)(int(rand(rand_state) * 2));
             if (!use_vis_chain && u == vis) {
                 u = con;
             } else if (!use_con_chain && u == con) {
@@ -290,13 +333,13 @@ public:
             MCMCState &previous_state = states[u];
             MCMCState new_state;
             bool is_large_step_done;
-            if (rand() < large_step_probabilities[u]) { // We use large step only on visibility chain
+            if (rand(rand_state) < large_step_probabilities[u]) { // We use large step only on visibility chain
                 // Large step
                 new_state.chain = previous_state.chain.large_step();
                 is_large_step_done = true;
             } else {
                 // Small step (mutation)
-                mutated += 1;
+                mutated[c] += 1;
                 new_state.chain = previous_state.chain.mutate(mutation_strength);
                 is_large_step_done = false;
             }
@@ -304,8 +347,7 @@ public:
             Path light_path = trace_light_path(state_sequence);
             auto pc = vertex_merge(light_path);
             if (use_vc) {
-                auto pc_vc = connect(eye_paths_for_connection[k], light_path, -1, -1,
-                                     (int)use_vm * n_samples_per_stage);
+                auto pc_vc = connect(eye_paths[k], light_path, -1, -1, (int)use_vm * n_samples_per_stage);
                 for (auto &p : pc_vc.contributions) {
                     pc.push_back(p);
                 }
@@ -315,60 +357,60 @@ public:
 
             double a = std::min(1.0, new_state.sc / max(1e-30, previous_state.sc));
             bool is_accepted = false;
-            if (rand() < a) {
+            if (rand(rand_state) < a) {
                 if (!is_large_step_done) {
                     // accepted mutation
-                    accepted += 1;
+                    accepted[c] += 1;
                 }
                 is_accepted = true;
             }
             MCMCState &current_state = is_accepted ? new_state : previous_state;
             if (is_large_step_done) {
                 for (int i = 0; i < 2; i++) {
-                    normalizers[i].insert((real)new_state.p_star(i), 1);
+                    stage.normalizers[i].insert((real)new_state.p_star(i), 1);
                 }
             }
             real current_state_weight = mutation_expectation ? real(a) : real(is_accepted);
             real last_state_weight = 1.0f - current_state_weight;
             if (last_state_weight > 0 && previous_state.sc > 0) {
-                all_pcs[u].push_back(previous_state.pc);
+                stage.all_pcs[u].push_back(previous_state.pc);
                 real p[2] = {0.0f};
                 for (int i = 0; i < 2; i++) {
                     if (markov_chain_mis) {
-                        p[i] = (real)previous_state.p_star(i) / normalizers[i].get_average();
+                        p[i] = (real)previous_state.p_star(i) / stage.normalizers[i].get_average();
                     } else {
                         p[i] = 1.0f;
                     }
                 }
                 auto s = last_state_weight / previous_state.sc * (p[u] / (p[0] + p[1])) * 2;
                 assert_info(is_normal(s), "abnormal scaling");
-                all_pcs[u].back().set_scaling(real(s));
+                stage.all_pcs[u].back().set_scaling(real(s));
             }
             if (current_state_weight > 0 && current_state.sc > 0) {
-                all_pcs[u].push_back(current_state.pc);
+                stage.all_pcs[u].push_back(current_state.pc);
                 real p[2] = {0.0f};
                 for (int i = 0; i < 2; i++) {
                     if (markov_chain_mis) {
-                        p[i] = real(current_state.p_star(i) / normalizers[i].get_average());
+                        p[i] = real(current_state.p_star(i) / stage.normalizers[i].get_average());
                     } else {
                         p[i] = 1.0f;
                     }
                 }
                 auto s = current_state_weight / current_state.sc * (p[u] / (p[0] + p[1])) * 2;
                 assert_info(is_normal(s), "abnormal scaling " + std::to_string(s));
-                all_pcs[u].back().set_scaling(real(s));
+                stage.all_pcs[u].back().set_scaling(real(s));
             }
             if (is_accepted) {
                 states[u] = new_state;
             }
             if (u == vis) {
-                photon_visibility.insert((real)current_state.sc, 1);
+                stage.photon_visibility.insert((real)current_state.sc, 1);
             }
             if (chain_exchange) {
                 // Replica Exchange
                 double r = std::min(1.0, states[vis].p_star(con) /
                                          max(1e-30, states[con].p_star(con)));
-                if (rand() < r) {
+                if (rand(rand_state) < r) {
                     std::swap(states[con], states[vis]);
                     for (int i = 0; i < 2; i++) {
                         states[i].sc = states[i].p_star(i);
@@ -376,23 +418,51 @@ public:
                 }
             }
             // Update mutation_strength
-            real ratio_accepted = (real)accepted / (real)mutated;
-            mutation_strength = mutation_strength + (ratio_accepted - target_mutation_acceptance) / mutated;
+            real ratio_accepted = (real)accepted[c] / (real)mutated[c];
+            mutation_strength = mutation_strength + (ratio_accepted - target_mutation_acceptance) / mutated[c];
             mutation_strength = std::min(10.0f, max(1e-7f, mutation_strength));
         }
-        real ratio_accepted = (real)accepted / (real)mutated;
-        P(ratio_accepted);
-        P(mutated);
-        P(accepted);
-        P(mutation_strength);
-        P(photon_visibility.get_average());
+        // The contributions are only normalized once the stage is over
         for (int u = 0; u < 2; u++) {
-            real b = normalizers[u].get_average();
-            P(b);
-            for (auto &pc : all_pcs[u]) {
+            real b = stage.normalizers[u].get_average();
+            for (auto &pc : stage.all_pcs[u]) {
                 write_path_contribution(pc, b);
             }
+            std::vector<PathContribution>().swap(stage.all_pcs[u]);
         }
+    }
+
+    virtual void render_stage() override {
+        radius = initial_radius * (shrinking_radius ? (real)pow(num_stages + 1.0f, -(1.0f - alpha) / 2.0f) : 1);
+        vm_pdf_constant = pi * radius * radius;
+        hash_grid.initialize(radius, width * height * 10 + 7, compact_hash_grid);
+
+        // 1. Generate eye paths (importons)
+        trace_eye_paths();
+        build_eye_vertices(2); // NOTE:debug, only the first eye vertex is merged at
+
+        // 2. Generate light paths (photons)
+        {
+            Profiler::Scope _(profiler, "light_paths");
+            ThreadedTaskManager::run([&](int c) {
+                int begin, end;
+                get_chain_mutations(c, n_samples_per_stage, begin, end);
+                run_chain(c, begin, end);
+            }, 0, num_chains, num_threads, 1);
+        }
+        long long total_accepted = 0, total_mutated = 0;
+        real photon_visibility = 0;
+        for (int c = 0; c < num_chains; c++) {
+            total_accepted += accepted[c];
+            total_mutated += mutated[c];
+            photon_visibility += chain_stages[c].photon_visibility.get_average() / num_chains;
+        }
+        real ratio_accepted = (real)total_accepted / (real)total_mutated;
+        P(ratio_accepted);
+        P(total_mutated);
+        P(total_accepted);
+        P(mutation_strengths[0]);
+        P(photon_visibility);
         sample_count += n_samples_per_stage;
     }
 };
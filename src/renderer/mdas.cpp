@@ -8,57 +8,422 @@
 *******************************************************************************/
 
 #include <taichi/visual/renderer.h>
+#include <taichi/visual/sampler.h>
+#include <taichi/system/threading.h>
+#include <algorithm>
+#include <cmath>
 
 TC_NAMESPACE_BEGIN
 
 #define TC_MDAS_MAX_DIM 8
 
-struct Node {
-    real bounds[TC_MDAS_MAX_DIM][2];
-    Node *ch[2];
-    real split;
-
-};
-
+// Samples of an integrand over [0, 1]^dim, one per leaf of a kd-tree whose leaves partition the domain.
+// Dimensions 0 and 1 are the image; the others are those the camera and paths draw next, e.g. the lens.
+// Builds split nodes along their dimension of largest extent, and insertions split leaves along the dimension
+// their two samples differ most in, both measured in units of scale[d], e.g. pixels for the image.
 class KDTree {
 public:
+    struct Node {
+        real bounds[TC_MDAS_MAX_DIM][2];
+        // Below and above split along split_dim, or -1 for leaves
+        int ch[2];
+        int split_dim;
+        real split;
+        int parent;
+        // Of leaves
+        int sample;
+        // Luminances of the samples of the subtree
+        int count;
+        double sum, sum2;
+    };
+
+    struct Sample {
+        real x[TC_MDAS_MAX_DIM];
+        Vector3 value;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<Sample> samples;
+
+    void initialize(int dim, const real *scale) {
+        this->dim = dim;
+        std::copy(scale, scale + dim, this->scale);
+        nodes.clear();
+        samples.clear();
+    }
+
+    int get_dim() const {
+        return dim;
+    }
+
+    // Over the samples given, with one node per sample on either side of the median of every split. In
+    // pre-order, the node of the n samples [begin, begin + n) has its children at id + 1 and id + 2 (n / 2), so
+    // subtrees are built in parallel into nodes allocated up front.
+    void build(std::vector<Sample> &&new_samples, int num_threads) {
+        samples = std::move(new_samples);
+        const int n = (int)samples.size();
+        nodes.assign(std::max(2 * n - 1, 0), Node());
+        if (n == 0) {
+            return;
+        }
+        Node &root = nodes[0];
+        for (int d = 0; d < dim; d++) {
+            root.bounds[d][0] = 0;
+            root.bounds[d][1] = 1;
+        }
+        root.parent = -1;
+        order.resize(n);
+        for (int i = 0; i < n; i++) {
+            order[i] = i;
+        }
+        // Enough subtrees for the threads to balance their work
+        std::vector<BuildTask> tasks;
+        split_top(0, 0, n, std::max(1, num_threads * 8), tasks);
+        ThreadedTaskManager::run([&](int t) {
+            build_subtree(tasks[t].id, tasks[t].begin, tasks[t].end);
+        }, 0, (int)tasks.size(), num_threads, 1);
+        order.clear();
+        // Children come after their parents
+        for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+            Node &node = nodes[i];
+            if (node.ch[0] == -1) {
+                const double l = luminance(samples[node.sample].value);
+                node.count = 1;
+                node.sum = l;
+                node.sum2 = l * l;
+            } else {
+                const Node &a = nodes[node.ch[0]], &b = nodes[node.ch[1]];
+                node.count = a.count + b.count;
+                node.sum = a.sum + b.sum;
+                node.sum2 = a.sum2 + b.sum2;
+            }
+        }
+    }
+
+    // Splits leaf between its sample and sample_id, which lies in it, into nodes first_child and
+    // first_child + 1, which have to exist. Insertions into distinct leaves may run in parallel.
+    void insert_new_sample(int leaf, int sample_id, int first_child) {
+        Node &node = nodes[leaf];
+        const real *a = samples[node.sample].x, *b = samples[sample_id].x;
+        int split_dim = 0;
+        real separation = -1;
+        for (int d = 0; d < dim; d++) {
+            const real s = std::abs(a[d] - b[d]) * scale[d];
+            if (s > separation) {
+                separation = s;
+                split_dim = d;
+            }
+        }
+        node.split_dim = split_dim;
+        node.split = (a[split_dim] + b[split_dim]) * 0.5f;
+        // The child the new sample goes to
+        const int new_child = b[split_dim] >= a[split_dim];
+        for (int k = 0; k < 2; k++) {
+            Node &child = nodes[first_child + k];
+            child = node;
+            child.ch[0] = child.ch[1] = -1;
+            child.bounds[split_dim][1 - k] = node.split;
+            child.parent = leaf;
+            child.sample = k == new_child ? sample_id : node.sample;
+            child.count = 0;
+            child.sum = child.sum2 = 0;
+            node.ch[k] = first_child + k;
+        }
+        node.sample = -1;
+    }
+
+    // Adds the sample of a new leaf to its statistics and those of all its ancestors
+    void add_to_ancestors(int leaf, const Vector3 &value) {
+        const double l = luminance(value);
+        for (int node = leaf; node != -1; node = nodes[node].parent) {
+            nodes[node].count++;
+            nodes[node].sum += l;
+            nodes[node].sum2 += l * l;
+        }
+    }
+
+    real get_volume(const Node &node) const {
+        real volume = 1;
+        for (int d = 0; d < dim; d++) {
+            volume *= node.bounds[d][1] - node.bounds[d][0];
+        }
+        return volume;
+    }
+
+private:
+    // The subtree of node id over samples order[begin, end)
+    struct BuildTask {
+        int id, begin, end;
+    };
+
+    int dim;
+    real scale[TC_MDAS_MAX_DIM];
+    // Sample ids, ordered by the build
+    std::vector<int> order;
+
+    // The node id of samples order[begin, end), with its bounds and parent set, and its children laid out
+    void split_node(int id, int begin, int end) {
+        Node &node = nodes[id];
+        if (end - begin == 1) {
+            node.ch[0] = node.ch[1] = -1;
+            node.sample = order[begin];
+            return;
+        }
+        int split_dim = 0;
+        for (int d = 1; d < dim; d++) {
+            if ((node.bounds[d][1] - node.bounds[d][0]) * scale[d] >
+                (node.bounds[split_dim][1] - node.bounds[split_dim][0]) * scale[split_dim]) {
+                split_dim = d;
+            }
+        }
+        const int mid = (begin + end) / 2;
+        auto less = [&](int a, int b) {
+            return samples[a].x[split_dim] < samples[b].x[split_dim];
+        };
+        std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, less);
+        const real below = samples[*std::max_element(order.begin() + begin, order.begin() + mid, less)].x[split_dim];
+        node.split_dim = split_dim;
+        node.split = (below + samples[order[mid]].x[split_dim]) * 0.5f;
+        node.sample = -1;
+        node.ch[0] = id + 1;
+        node.ch[1] = id + 2 * (mid - begin);
+        for (int k = 0; k < 2; k++) {
+            Node &child = nodes[node.ch[k]];
+            std::copy(&node.bounds[0][0], &node.bounds[0][0] + 2 * TC_MDAS_MAX_DIM, &child.bounds[0][0]);
+            child.bounds[split_dim][1 - k] = node.split;
+            child.parent = id;
+        }
+    }
 
-    KDTree() {
+    void split_top(int id, int begin, int end, int num_tasks, std::vector<BuildTask> &tasks) {
+        if (num_tasks <= 1 || end - begin <= 1) {
+            tasks.push_back(BuildTask{id, begin, end});
+            return;
+        }
+        split_node(id, begin, end);
+        const int mid = (begin + end) / 2;
+        split_top(nodes[id].ch[0], begin, mid, num_tasks / 2, tasks);
+        split_top(nodes[id].ch[1], mid, end, num_tasks - num_tasks / 2, tasks);
+    }
 
+    void build_subtree(int id, int begin, int end) {
+        split_node(id, begin, end);
+        if (end - begin > 1) {
+            const int mid = (begin + end) / 2;
+            build_subtree(nodes[id].ch[0], begin, mid);
+            build_subtree(nodes[id].ch[1], mid, end);
+        }
     }
+};
 
-    void insert_new_sample() {
+// The dimensions of a sample point, then those of the sampler's instance past them
+class MDASSequence : public StateSequence {
+public:
+    MDASSequence(const real *point, int dim, std::shared_ptr<Sampler> sampler, long long instance)
+            : point(point), dim(dim), tail(sampler, instance) {
+        tail.skip(dim);
+    }
 
+    real sample() override {
+        const real ret = cursor < dim ? point[cursor] : tail.sample();
+        cursor++;
+        return ret;
     }
 
+private:
+    const real *point;
+    int dim;
+    RandomStateSequence tail;
 };
 
+// Multidimensional adaptive sampling (Hachisuka et al. 2008), over the image and the next dimensions - 2
+// random numbers of each camera sample, e.g. those of the lens. The first stage renders
+// initial_samples_per_pixel stratified samples per pixel; every later one places samples_per_stage new
+// samples, one in each of the leaves with the largest error, i.e. their volume times the contrast
+// (standard deviation over mean luminance) of the samples of their parent. Samples are evaluated by the
+// integrator renderer, one path each, in parallel. The output integrates the piecewise constant
+// reconstruction of the kd-tree over each pixel and the other dimensions; as splits separate samples
+// across the dimension they differ most in, leaves stretch along edges, and the filter with them.
 class MDAS : public Renderer {
 protected:
     int samples_per_stage;
+    int initial_samples_per_pixel;
+    int dimensions;
+    real dimension_scale;
+    real min_intensity;
+    std::shared_ptr<Renderer> integrator;
+    std::shared_ptr<Sampler> sampler;
+    KDTree tree;
+
 public:
     virtual void initialize(const Config &config) override {
-        samples_per_stage = config.get("samples_per_stages", 128);
-
+        assert_info(scene != nullptr, "MDAS needs its scene before initialize()");
+        this->num_threads = config.get("num_threads", 1);
+        this->dimensions = config.get("dimensions", 4);
+        assert_info(2 <= dimensions && dimensions <= TC_MDAS_MAX_DIM,
+                    "dimensions should be in [2, " + std::to_string(TC_MDAS_MAX_DIM) + "]");
+        this->samples_per_stage = config.get("samples_per_stage", width * height);
+        this->initial_samples_per_pixel = config.get("initial_samples_per_pixel", 4);
+        assert_info(samples_per_stage > 0 && initial_samples_per_pixel > 0,
+                    "samples_per_stage and initial_samples_per_pixel should be positive");
+        // The extent of the whole of every non-image dimension, in pixels, when choosing where to split
+        this->dimension_scale = config.get("dimension_scale", 1.0f);
+        this->min_intensity = config.get("adaptive_min_intensity", 0.01f);
+        this->sampler = create_instance<Sampler>(config.get("sampler", "prand"), config);
+        integrator = create_instance<Renderer>(config.get("integrator", "pt"));
+        integrator->set_scene(scene);
+        integrator->initialize(config);
+        real scale[TC_MDAS_MAX_DIM];
+        scale[0] = (real)width;
+        scale[1] = (real)height;
+        std::fill(scale + 2, scale + dimensions, dimension_scale);
+        tree.initialize(dimensions, scale);
     }
 
     void render_stage() override {
+        if (tree.samples.empty()) {
+            render_initial_samples();
+        } else {
+            render_adaptive_samples();
+        }
+    }
+
+    long long get_num_samples() const override {
+        return (long long)tree.samples.size();
+    }
 
+    void update_geometry() override {
+        integrator->update_geometry();
     }
 
-    Array2D<Vector3> get_reconstruction() {
-        return Array2D<Vector3>();
+    FeatureBuffers get_features(int samples_per_pixel) override {
+        return integrator->get_features(samples_per_pixel);
     }
 
+    Array2D<Vector3> get_reconstruction();
+
     virtual Array2D<Vector3> get_output() override {
         return get_reconstruction();
     }
 
 protected:
+    // The value of a sample from the integrator, with its pixel from its image dimensions
+    void evaluate(KDTree::Sample &s, long long instance) {
+        const int px = std::min((int)(s.x[0] * width), width - 1), py = std::min((int)(s.x[1] * height), height - 1);
+        real point[TC_MDAS_MAX_DIM];
+        std::copy(s.x, s.x + dimensions, point);
+        point[0] = clamp(s.x[0] * width - px, 0.0f, 1.0f - 1e-7f);
+        point[1] = clamp(s.x[1] * height - py, 0.0f, 1.0f - 1e-7f);
+        MDASSequence rand(point, dimensions, sampler, instance);
+        const Vector2 size(1.0f / width, 1.0f / height);
+        Ray ray = camera->sample(Vector2(px * size.x, py * size.y), size, rand);
+        s.value = integrator->estimate_radiance(ray, rand);
+        if (!is_normal(s.value)) {
+            s.value = Vector3(0.0f);
+        }
+    }
+
+    void render_initial_samples() {
+        const int n = width * height * initial_samples_per_pixel;
+        std::vector<KDTree::Sample> samples(n);
+        ThreadedTaskManager::run([&](int i) {
+            const int pixel = i / initial_samples_per_pixel;
+            KDTree::Sample &s = samples[i];
+            RandomStateSequence rand(sampler, i);
+            rand.fill(s.x, dimensions);
+            s.x[0] = (pixel / height + s.x[0]) / width;
+            s.x[1] = (pixel % height + s.x[1]) / height;
+            evaluate(s, i);
+        }, 0, n, num_threads);
+        tree.build(std::move(samples), num_threads);
+    }
+
+    void render_adaptive_samples() {
+        std::vector<std::pair<real, int>> errors;
+        errors.reserve(tree.samples.size());
+        for (int i = 0; i < (int)tree.nodes.size(); i++) {
+            const KDTree::Node &node = tree.nodes[i];
+            if (node.ch[0] == -1) {
+                errors.push_back(std::make_pair(-get_error(node), i));
+            }
+        }
+        const int n = std::min(samples_per_stage, (int)errors.size());
+        std::nth_element(errors.begin(), errors.begin() + n - 1, errors.end());
+        const int first_sample = (int)tree.samples.size(), first_node = (int)tree.nodes.size();
+        tree.samples.resize(first_sample + n);
+        tree.nodes.resize(first_node + 2 * n);
+        // New samples are uniform within their leaves
+        ThreadedTaskManager::run([&](int k) {
+            const KDTree::Node &leaf = tree.nodes[errors[k].second];
+            KDTree::Sample &s = tree.samples[first_sample + k];
+            RandomStateSequence rand(sampler, first_sample + k);
+            rand.fill(s.x, dimensions);
+            for (int d = 0; d < dimensions; d++) {
+                s.x[d] = clamp(leaf.bounds[d][0] + s.x[d] * (leaf.bounds[d][1] - leaf.bounds[d][0]),
+                               leaf.bounds[d][0], std::nextafter(leaf.bounds[d][1], leaf.bounds[d][0]));
+            }
+            evaluate(s, first_sample + k);
+            tree.insert_new_sample(errors[k].second, first_sample + k, first_node + 2 * k);
+        }, 0, n, num_threads);
+        for (int k = 0; k < n; k++) {
+            const KDTree::Node &node = tree.nodes[errors[k].second];
+            const int child = tree.nodes[node.ch[0]].sample == first_sample + k ? node.ch[0] : node.ch[1];
+            tree.add_to_ancestors(child, tree.samples[first_sample + k].value);
+        }
+    }
 
+    // Volume times the contrast around the leaf, measured over the samples of its parent
+    real get_error(const KDTree::Node &leaf) const {
+        if (leaf.parent == -1) {
+            return 1;
+        }
+        const KDTree::Node &parent = tree.nodes[leaf.parent];
+        const double mean = parent.sum / parent.count;
+        const double variance = std::max(0.0, parent.sum2 / parent.count - mean * mean);
+        return real(tree.get_volume(leaf) * std::sqrt(variance) / std::max(mean, (double)min_intensity));
+    }
 };
 
+// Rows in parallel, each visiting the leaves that overlap it
+Array2D<Vector3> MDAS::get_reconstruction() {
+    Array2D<Vector3> output(width, height, Vector3(0.0f));
+    if (tree.nodes.empty()) {
+        return output;
+    }
+    ThreadedTaskManager::run([&](int j) {
+        const real y0 = real(j) / height, y1 = real(j + 1) / height;
+        std::vector<int> stack(1, 0);
+        while (!stack.empty()) {
+            const KDTree::Node &node = tree.nodes[stack.back()];
+            stack.pop_back();
+            if (node.bounds[1][1] <= y0 || node.bounds[1][0] >= y1) {
+                continue;
+            }
+            if (node.ch[0] != -1) {
+                stack.push_back(node.ch[0]);
+                stack.push_back(node.ch[1]);
+                continue;
+            }
+            // Of the pixel, and of the whole of the other dimensions
+            real weight = (std::min(node.bounds[1][1], y1) - std::max(node.bounds[1][0], y0)) * width * height;
+            for (int d = 2; d < tree.get_dim(); d++) {
+                weight *= node.bounds[d][1] - node.bounds[d][0];
+            }
+            const Vector3 value = tree.samples[node.sample].value * weight;
+            const int i0 = std::max(0, (int)(node.bounds[0][0] * width));
+            const int i1 = std::min(width - 1, (int)(node.bounds[0][1] * width));
+            for (int i = i0; i <= i1; i++) {
+                const real overlap = std::min(node.bounds[0][1], real(i + 1) / width) -
+                                     std::max(node.bounds[0][0], real(i) / width);
+                if (overlap > 0) {
+                    output[i][j] += value * overlap;
+                }
+            }
+        }
+    }, 0, height, num_threads);
+    return output;
+}
+
 TC_IMPLEMENTATION(Renderer, MDAS, "mdas");
 
 TC_NAMESPACE_END
-
@@ -7,28 +7,44 @@
     the MIT license as written in the LICENSE file.
 *******************************************************************************/
 
+#include <cstdio>
+#include <cstring>
 #include <taichi/math/discrete_sampler.h>
+#include <taichi/io/binary_stream.h>
 
 #include "bidirectional_renderer.h"
 #include "markov_chain.h"
 
 TC_NAMESPACE_BEGIN
 
+static const int normalizer_cache_magic = 0x54434d4e;
+
 class PSSMLTMarkovChain : public MarkovChain {
 public:
     real resolution_x, resolution_y;
 
     PSSMLTMarkovChain() : PSSMLTMarkovChain(0, 0) {}
 
-    PSSMLTMarkovChain(real resolution_x, real resolution_y) : resolution_x(resolution_x), resolution_y(resolution_y) {
-
+    PSSMLTMarkovChain(real resolution_x, real resolution_y, RandState *rand_state = nullptr)
+            : resolution_x(resolution_x), resolution_y(resolution_y) {
+        this->rand_state = rand_state;
     }
 
     PSSMLTMarkovChain large_step() const {
-        PSSMLTMarkovChain result(resolution_x, resolution_y);
+        PSSMLTMarkovChain result(resolution_x, resolution_y, rand_state);
         return result;
     }
 
+    void write(BinaryFileStreamOutput &os) const override {
+        MarkovChain::write(os);
+        os << resolution_x << resolution_y;
+    }
+
+    void read(BinaryFileStreamInput &is) override {
+        MarkovChain::read(is);
+        is >> resolution_x >> resolution_y;
+    }
+
     PSSMLTMarkovChain mutate() const {
         PSSMLTMarkovChain result(*this);
         // Screen coordinates
@@ -43,9 +59,9 @@ public:
     }
 
 protected:
-    inline static real perturb(const real value, const real s1, const real s2) {
+    real perturb(const real value, const real s1, const real s2) const {
         real result;
-        real r = rand();
+        real r = next_rand();
         if (r < 0.5f) {
             r = r * 2.0f;
             result = value + s2 * exp(-log(s2 / s1) * r);
@@ -58,6 +74,9 @@ protected:
     }
 };
 
+// Chains of the Markov chain renderers are independent, each with its own random numbers, and run in
+// parallel, num_chains of them, splatting into the (per-thread) accumulator. Each stage's mutations are
+// split evenly among them, so results do not depend on num_threads.
 class PSSMLTRenderer : public BidirectionalRenderer {
 private:
     struct MCMCState {
@@ -72,29 +91,105 @@ private:
         }
     };
 
-    MCMCState current_state;
+    std::vector<MCMCState> current_states;
     bool first_stage_done = false;
     // Normalizer
     real b;
 protected:
     real large_step_prob;
+    int num_chains;
+    // One per chain; never reallocated, since the chains point to them
+    std::vector<RandState> chain_rand_states;
+    // Of the bootstrap samples RandomStateSequence(sampler, k), k < width * height
+    std::vector<real> bootstrap_sc;
+
+    // Mutations of chain c in a stage of n
+    void get_chain_mutations(int c, int n, int &begin, int &end) const {
+        begin = (int)((int64)n * c / num_chains);
+        end = (int)((int64)n * (c + 1) / num_chains);
+    }
+
 public:
     virtual void initialize(const Config &config) override {
         BidirectionalRenderer::initialize(config);
         large_step_prob = config.get("large_step_prob", 0.3f);
+        num_chains = config.get("num_chains", num_threads);
+        assert_info(num_chains > 0, "num_chains must be positive");
+        chain_rand_states.clear();
+        for (int c = 0; c < num_chains; c++) {
+            chain_rand_states.push_back(RandState((uint64)c));
+        }
+    }
+
+    void write_checkpoint(BinaryFileStreamOutput &os) override {
+        BidirectionalRenderer::write_checkpoint(os);
+        os << first_stage_done << b << chain_rand_states;
+        for (auto &state : current_states) {
+            os << state.sc;
+            state.chain.write(os);
+            state.pc.write(os);
+        }
+    }
+
+    void read_checkpoint(BinaryFileStreamInput &is) override {
+        BidirectionalRenderer::read_checkpoint(is);
+        std::vector<RandState> rand_states;
+        is >> first_stage_done >> b >> rand_states;
+        assert_info((int)rand_states.size() == num_chains, "Checkpoint num_chains mismatch");
+        chain_rand_states = rand_states;
+        current_states.resize(first_stage_done ? num_chains : 0);
+        for (int c = 0; c < (int)current_states.size(); c++) {
+            MCMCState &state = current_states[c];
+            is >> state.sc;
+            state.chain.read(is);
+            state.chain.rand_state = &chain_rand_states[c];
+            state.pc.read(is);
+        }
     }
 
+    // The mean scalar contribution of the bootstrap samples, traced in parallel
     real estimate_b() {
-        real sum = 0;
         int n_samples = width * height;
-        for (int k = 0; k < n_samples; k++) {
+        bootstrap_sc.resize(n_samples);
+        ThreadedTaskManager::run([&](int k) {
             auto state_sequence = RandomStateSequence(sampler, k);
             Path eye_path = trace_eye_path(state_sequence);
             Path light_path = trace_light_path(state_sequence);
             PathContribution pc = connect(eye_path, light_path);
-            sum += scalar_contribution_function(pc);
+            bootstrap_sc[k] = scalar_contribution_function(pc);
+        }, 0, n_samples, num_threads);
+        double sum = 0;
+        for (int k = 0; k < n_samples; k++) {
+            sum += bootstrap_sc[k];
         }
-        return sum / n_samples;
+        return real(sum / n_samples);
+    }
+
+    // Chains start at bootstrap samples chosen in proportion to their contributions, i.e. in the stationary
+    // distribution, so there is no start-up bias
+    void initialize_chains() {
+        b = estimate_b();
+        P(b);
+        DiscreteSampler bootstrap_sampler;
+        if (b > 0) {
+            bootstrap_sampler.initialize(bootstrap_sc, true, true, num_threads);
+        }
+        current_states.resize(num_chains);
+        ThreadedTaskManager::run([&](int c) {
+            MCMCState &state = current_states[c];
+            RandState *rand_state = &chain_rand_states[c];
+            state.chain = PSSMLTMarkovChain((real)width, (real)height, rand_state);
+            if (b > 0) {
+                auto bootstrap_sequence = RandomStateSequence(sampler, bootstrap_sampler.sample(rand(*rand_state)));
+                auto recording_sequence = RecordingStateSequence(bootstrap_sequence);
+                Path eye_path = trace_eye_path(recording_sequence);
+                Path light_path = trace_light_path(recording_sequence);
+                state.chain.set_states(recording_sequence.samples);
+            }
+            state.pc = get_path_contribution(state.chain);
+            state.sc = scalar_contribution_function(state.pc);
+        }, 0, num_chains, num_threads, 1);
+        std::vector<real>().swap(bootstrap_sc);
     }
 
     real scalar_contribution_function(const PathContribution &pc) {
@@ -116,19 +211,14 @@ public:
         return connect(eye_path, light_path);
     }
 
-    virtual void render_stage() override {
-        if (!first_stage_done) {
-            b = estimate_b();
-            P(b);
-            current_state.chain = PSSMLTMarkovChain((real)width, (real)height);
-            current_state.pc = get_path_contribution(current_state.chain);
-            current_state.sc = scalar_contribution_function(current_state.pc);
-            first_stage_done = true;
-        }
+    // n mutations of chain c
+    void run_chain(int c, int n) {
+        RandState &rand_state = chain_rand_states[c];
+        MCMCState &current_state = current_states[c];
         MCMCState new_state;
-        for (int k = 0; k < width * height / stage_frequency; k++) {
+        for (int k = 0; k < n; k++) {
             real is_large_step;
-            if (rand() <= large_step_prob) {
+            if (rand(rand_state) <= large_step_prob) {
                 new_state.chain = current_state.chain.large_step();
                 is_large_step = 1.0;
             } else {
@@ -151,12 +241,25 @@ public:
                                         real((1.0 - a) / (current_state.sc / b + large_step_prob)));
             }
             // conditionally accept the chain
-            if (rand() <= a) {
+            if (rand(rand_state) <= a) {
                 current_state = new_state;
             }
-            sample_count += 1;
         }
     }
+
+    virtual void render_stage() override {
+        if (!first_stage_done) {
+            initialize_chains();
+            first_stage_done = true;
+        }
+        const int n = width * height / stage_frequency;
+        ThreadedTaskManager::run([&](int c) {
+            int begin, end;
+            get_chain_mutations(c, n, begin, end);
+            run_chain(c, end - begin);
+        }, 0, num_chains, num_threads, 1);
+        sample_count += n;
+    }
 };
 
 class MMLTRenderer : public PSSMLTRenderer {
@@ -167,13 +270,13 @@ protected:
     public:
         MMLTMarkovChain() : MMLTMarkovChain(0, 0) {}
 
-        MMLTMarkovChain(int resolution_x, int resolution_y) : PSSMLTMarkovChain((real)resolution_x,
-                                                                                (real)resolution_y) {
-            technique_state = rand();
+        MMLTMarkovChain(int resolution_x, int resolution_y, RandState *rand_state = nullptr)
+                : PSSMLTMarkovChain((real)resolution_x, (real)resolution_y, rand_state) {
+            technique_state = next_rand();
         }
 
         MMLTMarkovChain large_step() const {
-            return MMLTMarkovChain((int)resolution_x, (int)resolution_y);
+            return MMLTMarkovChain((int)resolution_x, (int)resolution_y, rand_state);
         }
 
         MMLTMarkovChain mutate() const {
@@ -193,6 +296,16 @@ protected:
         real get_technique_state() {
             return technique_state;
         }
+
+        void write(BinaryFileStreamOutput &os) const override {
+            PSSMLTMarkovChain::write(os);
+            os << technique_state;
+        }
+
+        void read(BinaryFileStreamInput &is) override {
+            PSSMLTMarkovChain::read(is);
+            is >> technique_state;
+        }
     };
 
     struct MCMCState {
@@ -208,34 +321,146 @@ protected:
         }
     };
 
-    std::vector<MCMCState> current_states;
+    // Of every chain, one per path length
+    std::vector<std::vector<MCMCState>> current_states;
     bool first_stage_done = false;
     DiscreteSampler path_length_sampler;
     std::vector<real> normalizers;
+    // Of the normalizers, reused by later renders of the same scene; none if empty
+    std::string normalizer_cache;
+
+    static uint64 hash_combine(uint64 hash, uint64 value) {
+        return hash64(hash ^ (value + 0x9e3779b97f4a7c15ull));
+    }
+
+    static uint64 hash_combine(uint64 hash, real value) {
+        unsigned int bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return hash_combine(hash, (uint64)bits);
+    }
+
+    static uint64 hash_combine(uint64 hash, const Vector3 &v) {
+        for (int i = 0; i < 3; i++) {
+            hash = hash_combine(hash, v[i]);
+        }
+        return hash;
+    }
+
+    // Of what the normalizers depend on but the materials: the geometry, camera and bootstrap settings
+    uint64 get_normalizer_cache_key() {
+        uint64 key = hash_combine(hash_combine(0, (uint64)width), (uint64)height);
+        key = hash_combine(hash_combine(key, (uint64)min_path_length), (uint64)max_path_length);
+        key = hash_combine(key, luminance_clamping);
+        key = hash_combine(hash_combine(key, camera->get_origin()), camera->get_dir());
+        for (auto &triangle : scene->get_triangles()) {
+            for (int i = 0; i < 3; i++) {
+                key = hash_combine(key, triangle.v[i]);
+            }
+        }
+        return key;
+    }
+
+    bool load_normalizers(uint64 key) {
+        if (normalizer_cache.empty()) {
+            return false;
+        }
+        FILE *f = std::fopen(normalizer_cache.c_str(), "rb");
+        if (f == nullptr) {
+            return false;
+        }
+        std::fclose(f);
+        BinaryFileStreamInput is(normalizer_cache);
+        int magic;
+        uint64 cache_key;
+        std::vector<real> cached_normalizers;
+        is >> magic >> cache_key >> cached_normalizers;
+        if (magic != normalizer_cache_magic || cache_key != key || cached_normalizers.size() != normalizers.size()) {
+            printf("Normalizer cache %s is of another scene; estimating again\n", normalizer_cache.c_str());
+            return false;
+        }
+        normalizers = cached_normalizers;
+        return true;
+    }
+
+    void save_normalizers(uint64 key) {
+        if (normalizer_cache.empty()) {
+            return;
+        }
+        const std::string temp_fn = normalizer_cache + ".tmp";
+        {
+            BinaryFileStreamOutput os(temp_fn);
+            os << normalizer_cache_magic << key << normalizers;
+            os.close();
+        }
+        assert_info(std::rename(temp_fn.c_str(), normalizer_cache.c_str()) == 0,
+                    "Can not write normalizer cache " + normalizer_cache);
+    }
 public:
     virtual void initialize(const Config &config) override {
         PSSMLTRenderer::initialize(config);
-        current_states.resize(max_path_length + 1);
+        current_states.assign(num_chains, std::vector<MCMCState>(max_path_length + 1));
         normalizers.resize(max_path_length + 1);
+        normalizer_cache = config.get("normalizer_cache", "");
+    }
+
+    // One chain per path length
+    void write_checkpoint(BinaryFileStreamOutput &os) override {
+        BidirectionalRenderer::write_checkpoint(os);
+        os << first_stage_done << normalizers << chain_rand_states;
+        for (auto &states : current_states) {
+            for (auto &state : states) {
+                os << state.sc << state.weight;
+                state.chain.write(os);
+                state.pc.write(os);
+            }
+        }
+    }
+
+    void read_checkpoint(BinaryFileStreamInput &is) override {
+        BidirectionalRenderer::read_checkpoint(is);
+        std::vector<real> checkpoint_normalizers;
+        std::vector<RandState> rand_states;
+        is >> first_stage_done >> checkpoint_normalizers >> rand_states;
+        assert_info(checkpoint_normalizers.size() == normalizers.size(), "Checkpoint max_path_length mismatch");
+        assert_info((int)rand_states.size() == num_chains, "Checkpoint num_chains mismatch");
+        normalizers = checkpoint_normalizers;
+        chain_rand_states = rand_states;
+        for (int c = 0; c < num_chains; c++) {
+            for (auto &state : current_states[c]) {
+                is >> state.sc >> state.weight;
+                state.chain.read(is);
+                state.chain.rand_state = &chain_rand_states[c];
+                state.pc.read(is);
+            }
+        }
+        if (first_stage_done) {
+            path_length_sampler.initialize(normalizers, true, true);
+        }
     }
 
+    // From bootstrap samples traced in parallel, summed in order
     void estimate_normalizers() {
-        real sum = 0;
         int n_samples = width * height;
-        std::vector<real> intensities(max_path_length + 1, 0.0f);
-        std::vector<long long> samples(max_path_length + 1, 0LL);
-        for (int k = 0; k < n_samples; k++) {
-            auto state_sequence = RandomStateSequence(sampler, k);
-            Path eye_path = trace_eye_path(state_sequence);
-            Path light_path = trace_light_path(state_sequence);
-            PathContribution pc = connect(eye_path, light_path);
-            for (auto &contribution : pc.contributions) {
-                intensities[contribution.path_length] += scalar_contribution_function(contribution);
-                samples[contribution.path_length] += 1;
+        const int task_size = 1024, num_tasks = (n_samples + task_size - 1) / task_size;
+        std::vector<std::vector<double>> task_intensities(num_tasks, std::vector<double>(max_path_length + 1, 0.0));
+        ThreadedTaskManager::run([&](int t) {
+            std::vector<double> &intensities = task_intensities[t];
+            for (int k = t * task_size; k < std::min(n_samples, (t + 1) * task_size); k++) {
+                auto state_sequence = RandomStateSequence(sampler, k);
+                Path eye_path = trace_eye_path(state_sequence);
+                Path light_path = trace_light_path(state_sequence);
+                PathContribution pc = connect(eye_path, light_path);
+                for (auto &contribution : pc.contributions) {
+                    intensities[contribution.path_length] += scalar_contribution_function(contribution);
+                }
             }
-        }
+        }, 0, num_tasks, num_threads, 1);
         for (int k = min_path_length; k <= max_path_length; k++) {
-            normalizers[k] = intensities[k] / n_samples / (k + 1);
+            double intensity = 0;
+            for (int t = 0; t < num_tasks; t++) {
+                intensity += task_intensities[t][k];
+            }
+            normalizers[k] = real(intensity / n_samples / (k + 1));
         }
     }
 
@@ -251,36 +476,41 @@ public:
     }
 
     void initialize_path_length_sampler() {
-        estimate_normalizers();
-        for (int i = min_path_length; i <= max_path_length; i++) {
-            if (normalizers[i] == 0.0f) {
-                // No path of such length
-                continue;
-            }
-            while (true) {
-                current_states[i].chain = MMLTMarkovChain(width, height);
-                current_states[i].pc = get_path_contribution(current_states[i].chain, i);
-                current_states[i].sc = scalar_contribution_function(current_states[i].pc);
-                if (current_states[i].sc > 0) {
-                    break;
+        const uint64 cache_key = normalizer_cache.empty() ? 0 : get_normalizer_cache_key();
+        if (!load_normalizers(cache_key)) {
+            estimate_normalizers();
+            save_normalizers(cache_key);
+        }
+        ThreadedTaskManager::run([&](int c) {
+            for (int i = min_path_length; i <= max_path_length; i++) {
+                if (normalizers[i] == 0.0f) {
+                    // No path of such length
+                    continue;
+                }
+                MCMCState &state = current_states[c][i];
+                while (true) {
+                    state.chain = MMLTMarkovChain(width, height, &chain_rand_states[c]);
+                    state.pc = get_path_contribution(state.chain, i);
+                    state.sc = scalar_contribution_function(state.pc);
+                    if (state.sc > 0) {
+                        break;
+                    }
                 }
             }
-        }
-        path_length_sampler.initialize(normalizers);
+        }, 0, num_chains, num_threads, 1);
+        path_length_sampler.initialize(normalizers, true, true);
     }
 
-    virtual void render_stage() override {
-        if (!first_stage_done) {
-            initialize_path_length_sampler();
-            first_stage_done = true;
-        }
+    // n mutations of chain c
+    virtual void run_chain(int c, int n) {
+        RandState &rand_state = chain_rand_states[c];
         MCMCState new_state;
-        for (int k = 0; k < width * height / stage_frequency; k++) {
+        for (int k = 0; k < n; k++) {
             real path_length_pdf;
-            int path_length = path_length_sampler.sample(rand(), path_length_pdf);
+            int path_length = path_length_sampler.sample(rand(rand_state), path_length_pdf);
             real is_large_step;
-            MCMCState &current_state = current_states[path_length];
-            if (rand() < large_step_prob) {
+            MCMCState &current_state = current_states[c][path_length];
+            if (rand(rand_state) < large_step_prob) {
                 new_state.chain = current_state.chain.large_step();
                 is_large_step = 1.0;
             } else {
@@ -306,12 +536,25 @@ public:
                                         real((current_state.sc / normalizers[path_length] + large_step_prob)));
             }
             // conditionally accept the chain
-            if (rand() <= a) {
+            if (rand(rand_state) <= a) {
                 current_state = new_state;
             }
-            sample_count += 1;
         }
     }
+
+    virtual void render_stage() override {
+        if (!first_stage_done) {
+            initialize_path_length_sampler();
+            first_stage_done = true;
+        }
+        const int n = width * height / stage_frequency;
+        ThreadedTaskManager::run([&](int c) {
+            int begin, end;
+            get_chain_mutations(c, n, begin, end);
+            run_chain(c, end - begin);
+        }, 0, num_chains, num_threads, 1);
+        sample_count += n;
+    }
 };
 
 TC_IMPLEMENTATION(Renderer, PSSMLTRenderer, "pssmlt");
@@ -323,16 +566,13 @@ public:
         large_step_prob = 0.0f;
     }
 
-    virtual void render_stage() override {
-        if (!first_stage_done) {
-            initialize_path_length_sampler();
-            first_stage_done = true;
-        }
+    void run_chain(int c, int n) override {
+        RandState &rand_state = chain_rand_states[c];
         MCMCState new_state;
-        for (int k = 0; k < width * height / stage_frequency; k++) {
+        for (int k = 0; k < n; k++) {
             real path_length_pdf;
-            int path_length = path_length_sampler.sample(rand(), path_length_pdf);
-            MCMCState &current_state = current_states[path_length];
+            int path_length = path_length_sampler.sample(rand(rand_state), path_length_pdf);
+            MCMCState &current_state = current_states[c][path_length];
             //P(current_state.weight);
             new_state.chain = current_state.chain.mutate();
             new_state.pc = get_path_contribution(new_state.chain, path_length);
@@ -342,7 +582,7 @@ public:
             if (current_state.sc > 0) {
                 r = current_state.weight * new_state.sc / current_state.sc;
                 a = r / (r + theta);
-                if (rand() < r) {
+                if (rand(rand_state) < r) {
                     accepted = true;
                 }
             } else {
@@ -359,7 +599,6 @@ public:
                 write_path_contribution(current_state.pc, current_state.weight * factor /
                                                           (current_state.sc / normalizers[path_length]));
             }
-            sample_count += 1;
         }
     }
 };
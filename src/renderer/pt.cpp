@@ -15,6 +15,8 @@
 #include <taichi/common/asset_manager.h>
 
 #include "markov_chain.h"
+#include "radiance_cache.h"
+#include "sd_tree.h"
 
 TC_NAMESPACE_BEGIN
 
@@ -28,6 +30,8 @@ struct PathContribution {
             x(x), y(y), c(c) {}
 };
 
+TC_BINARY_POD(PathContribution)
+
 // TODO: we do need a light source class to unify envmap and mesh light...
 
 class PathTracingRenderer : public Renderer {
@@ -35,16 +39,171 @@ public:
     virtual void initialize(const Config &config) override;
 
     void render_stage() override {
+        if (path_guiding && !guiding_initialized) {
+            initialize_guiding();
+        }
+        if (radiance_cache && !radiance_cache_initialized) {
+            initialize_radiance_cache();
+        }
         int samples = width * height;
-        auto task = [&](int i) {
-            RandomStateSequence rand(sampler, index + i);
-            auto cont = get_path_contribution(rand);
-            write_path_contribution(cont);
-        };
-        ThreadedTaskManager::run(task, 0, samples, num_threads);
+        if (tile_size > 0) {
+            // One sample per pixel for every pass over a tile, tile by tile in tile_order, each pass a task
+            std::vector<int> task_tiles, task_begin(1, 0);
+            for (int t = 0; t < (int)tile_passes.size(); t++) {
+                for (int i = 0; i < tile_passes[t]; i++) {
+                    task_tiles.push_back(t);
+                    task_begin.push_back(task_begin.back() + tile_sample_begin[t + 1] - tile_sample_begin[t]);
+                }
+            }
+            auto task = [&](int i) {
+                const int t = task_tiles[i];
+                render_samples(task_begin[i], task_begin[i + 1] - task_begin[i], &tile_pixels[tile_sample_begin[t]]);
+            };
+            ThreadedTaskManager::run(task, 0, (int)task_tiles.size(), num_threads, 1);
+            samples = task_begin.back();
+            num_stages++;
+            if (adaptive_sampling && num_stages >= adaptive_min_stages && !is_converged()) {
+                update_tile_passes();
+            }
+        } else {
+            render_untiled(samples);
+        }
         index += samples;
+        if (path_guiding) {
+            update_guiding();
+        }
+    }
+
+    // Samples index, ..., index + samples - 1, anywhere on the image
+    void render_untiled(int samples) {
+        if (!batch_primary_rays) {
+            auto task = [&](int i) {
+                RandomStateSequence rand(sampler, index + i);
+                auto cont = get_path_contribution(rand);
+                write_path_contribution(cont);
+            };
+            ThreadedTaskManager::run(task, 0, samples, num_threads);
+        } else {
+            auto task = [&](int batch) {
+                const int begin = batch * samples_per_task;
+                render_samples(begin, std::min(samples_per_task, samples - begin), nullptr);
+            };
+            ThreadedTaskManager::run(task, 0, (samples + samples_per_task - 1) / samples_per_task, num_threads);
+        }
+    }
+
+    // Tiles sample pixels by their own passes, so only untiled rendering has a sample sequence to split
+    bool supports_sample_ranges() const override {
+        return tile_size == 0;
+    }
+
+    void render_sample_range(long long begin, long long end) override {
+        assert_info(tile_size == 0, "Tiled path tracing can not render sample ranges");
+        const long long stage_index = index;
+        index = begin;
+        render_untiled((int)(end - begin));
+        index = stage_index;
+    }
+
+    ImageAccumulator<Vector3> *get_accumulator() override {
+        return &accumulator;
+    }
+
+    Vector3 estimate_radiance(const Ray &ray, StateSequence &rand) override {
+        // Both are trained by render_stage()
+        assert_info(!path_guiding && !radiance_cache, "path_guiding and radiance_cache need render_stage()");
+        return clamp_luminance(trace(ray, rand));
+    }
+
+    void add_external_samples(long long num_samples) override {
+        index += num_samples;
+    }
+
+    void write_checkpoint(BinaryFileStreamOutput &os) override {
+        os << index << num_stages << tile_passes;
+        accumulator.write(os);
+    }
+
+    void read_checkpoint(BinaryFileStreamInput &is) override {
+        std::vector<int> passes;
+        is >> index >> num_stages >> passes;
+        assert_info(passes.size() == tile_passes.size(), "Checkpoint tiles mismatch");
+        tile_passes = passes;
+        accumulator.reset();
+        accumulator.accumulate(is);
+    }
+
+    // Samples index + begin, ..., index + begin + n - 1, in pixels[k] if given and anywhere otherwise.
+    // With batch_primary_rays their primary rays are traced together; every sample then goes on with its
+    // own random sequence, exactly as get_path_contribution() would.
+    virtual void render_samples(int begin, int n, const Vector2i *pixels) {
+        const Vector2 size(1.0f / width, 1.0f / height);
+        Vector2 offsets[primary_batch_size];
+        Ray rays[primary_batch_size];
+        IntersectionInfo infos[primary_batch_size];
+        std::vector<RandomStateSequence> rands;
+        StateSequence *rand_ptrs[primary_batch_size];
+        rands.reserve(primary_batch_size);
+        for (int batch_begin = 0; batch_begin < n; batch_begin += primary_batch_size) {
+            const int m = std::min(primary_batch_size, n - batch_begin);
+            rands.clear();
+            for (int k = 0; k < m; k++) {
+                rands.push_back(RandomStateSequence(sampler, index + begin + batch_begin + k));
+                rand_ptrs[k] = &rands[k];
+                offsets[k] = Vector2(rands[k](), rands[k]());
+                if (pixels) {
+                    offsets[k] = (Vector2(pixels[batch_begin + k]) + offsets[k]) * size;
+                }
+            }
+            camera->generate_rays(m, offsets, size, rand_ptrs, rays);
+            if (batch_primary_rays) {
+                sg->query(rays, m, infos);
+            }
+            for (int k = 0; k < m; k++) {
+                Vector3 color = clamp_luminance(
+                        batch_primary_rays ? trace(rays[k], rands[k], &infos[k]) : trace(rays[k], rands[k]));
+                write_path_contribution(PathContribution(offsets[k].x, offsets[k].y, color));
+            }
+        }
+    }
+
+    long long get_num_samples() const override {
+        return index;
     }
 
+    real get_relative_error() override {
+        const Array2D<real> errors = accumulator.get_relative_errors(adaptive_min_intensity);
+        double sum = 0;
+        for (auto &ind : errors.get_region()) {
+            sum += sqr(errors[ind]);
+        }
+        return real(std::sqrt(sum / (width * height)));
+    }
+
+    bool is_converged() const override {
+        return adaptive_sampling && num_stages >= adaptive_min_stages &&
+               std::all_of(tile_passes.begin(), tile_passes.end(), [](int p) { return p == 0; });
+    }
+
+    // Pixels of the image by tile, in tile_order, and within tiles in Z-order, for coherent batches
+    void initialize_tiles(const std::string &tile_order);
+
+    // Passes of the next stage over every tile, from the error of its pixels: none once at the target,
+    // and more the farther off it is
+    void update_tile_passes();
+
+    // The bounds of all triangles of the scene, with a small margin
+    void get_scene_bounds(Vector3 &lower, Vector3 &upper) const;
+
+    // The SD-tree over the bounds of the scene
+    void initialize_guiding();
+
+    // The radiance cache, with radiance_cache_resolution cells along the longest side of the scene bounds
+    void initialize_radiance_cache();
+
+    // Ends the training iteration of the SD-tree once it has its stages
+    void update_guiding();
+
     virtual Array2D<Vector3> get_output() override {
         return accumulator.get_averaged();
     }
@@ -55,6 +214,23 @@ protected:
 
     bool russian_roulette;
 
+    // Sample lights by their estimated contribution at the shading point, from the scene's light BVH,
+    // instead of by their power alone
+    bool light_bvh;
+
+    void sample_light_source(const Vector3 &pos, real r, real &pdf, const Triangle *&triangle,
+                             const EnvironmentMap *&envmap) const {
+        if (light_bvh) {
+            scene->sample_light_source(pos, r, pdf, triangle, envmap);
+        } else {
+            scene->sample_light_source(r, pdf, triangle, envmap);
+        }
+    }
+
+    real get_triangle_pdf(const Vector3 &pos, int triangle_id) const {
+        return light_bvh ? scene->get_triangle_pdf(pos, triangle_id) : scene->get_triangle_pdf(triangle_id);
+    }
+
     Vector3 calculate_direct_lighting(const Vector3 &in_dir, const IntersectionInfo &info, const BSDF &bsdf,
                                       StateSequence &rand, VolumeStack &stack) {
         Vector3 acc(0);
@@ -62,11 +238,13 @@ protected:
         bool sample_envmap = false;
         const Triangle *p_triangle = nullptr;
         const EnvironmentMap *p_envmap = nullptr;
-        scene->sample_light_source(rand(), light_source_pdf, p_triangle, p_envmap);
+        sample_light_source(info.pos, rand(), light_source_pdf, p_triangle, p_envmap);
+        // Light samples are skipped if no light emits toward the point
+        const bool sample_light = p_triangle != nullptr || p_envmap != nullptr;
         Triangle tri;
         if (p_envmap) {
             sample_envmap = true;
-        } else {
+        } else if (p_triangle) {
             tri = *p_triangle;
         }
         // MIS between bsdf and light sampling.
@@ -80,7 +258,7 @@ protected:
             bool sample_bsdf = i < direct_lighting_bsdf;
             if (!sample_bsdf) {
                 // Light sampling
-                if (!sample_envmap && tri.get_relative_location_to_plane(info.pos) < 0)
+                if (!sample_light || (!sample_envmap && tri.get_relative_location_to_plane(info.pos) < 0))
                     continue;
             }
             Vector3 out_dir;
@@ -90,7 +268,8 @@ protected:
             Vector3 dist;
             if (sample_bsdf) {
                 // Sample BSDF
-                bsdf.sample(in_dir, rand(), rand(), out_dir, f, bsdf_p, event);
+                const Vector2 u = rand.next2();
+                bsdf.sample(in_dir, u.x, u.y, out_dir, f, bsdf_p, event);
                 if (SurfaceEventClassifier::is_index_matched(event)) {
                     // No direct lighting on index-matched surfaces.
                     // It's included in previous vertex.
@@ -103,7 +282,8 @@ protected:
                     real pdf;
                     out_dir = p_envmap->sample_direction(rand, pdf, _);
                 } else {
-                    Vector3 pos = tri.sample_point(rand(), rand());
+                    const Vector2 uv = rand.next2();
+                    Vector3 pos = tri.sample_point(uv.x, uv.y);
                     dist = pos - info.pos;
                     out_dir = normalize(dist);
                 }
@@ -124,15 +304,15 @@ protected:
             Vector3 throughput;
             if (test_info.intersected) {
                 // Mesh light
-                const Triangle &light_tri = scene->get_triangle(test_info.triangle_id);
                 BSDF light_bsdf(scene, test_info);
                 if (!light_bsdf.is_emissive() || !test_info.front) {
                     continue;
                 }
-                real c = abs(dot(ray.dir, tri.normal));
+                const Triangle &light_tri = scene->get_triangle(test_info.triangle_id);
+                real c = abs(dot(ray.dir, light_tri.normal));
                 dist = test_info.pos - info.pos;
                 light_p = dot(dist, dist) / std::max(1e-20f, light_tri.area * c) *
-                          scene->get_triangle_pdf(light_tri.id);
+                          get_triangle_pdf(info.pos, light_tri.id);
                 const Vector3 emission = light_bsdf.evaluate(test_info.normal, -out_dir);
                 throughput = f * co * emission * att;
             } else {
@@ -167,18 +347,27 @@ protected:
     Vector3 calculate_volumetric_direct_lighting(const Vector3 &in_dir, const Vector3 &orig,
                                                  StateSequence &rand, VolumeStack &stack);
 
-    PathContribution get_path_contribution(StateSequence &rand) {
-        Vector2 offset(rand(), rand());
-        Vector2 size(1.0f / width, 1.0f / height);
-        Ray ray = camera->sample(offset, size, rand);
-        Vector3 color = trace(ray, rand);
+    Vector3 clamp_luminance(Vector3 color) const {
         if (luminance_clamping > 0 && luminance(color) > luminance_clamping) {
             color = luminance_clamping / luminance(color) * color;
         }
+        return color;
+    }
+
+    PathContribution get_path_contribution(StateSequence &rand) {
+        Vector2 offset = rand.next2();
+        Vector2 size(1.0f / width, 1.0f / height);
+        Ray ray = camera->sample(offset, size, rand);
+        Vector3 color = clamp_luminance(trace(ray, rand));
         return PathContribution(offset.x, offset.y, color);
     }
 
-    virtual Vector3 trace(Ray ray, StateSequence &rand);
+    virtual Vector3 trace(Ray ray, StateSequence &rand) {
+        return trace(ray, rand, nullptr);
+    }
+
+    // With primary_hit, the result of sg->query(ray), if already known
+    Vector3 trace(Ray ray, StateSequence &rand, const IntersectionInfo *primary_hit);
 
     virtual void write_path_contribution(const PathContribution &cont, real scale = 1.0f) {
         auto x = clamp(cont.x, 0.0f, 1.0f - 1e-7f);
@@ -220,7 +409,8 @@ protected:
             SurfaceEvent event;
             Vector3 f, _;
             real pdf;
-            bsdf.sample(in_dir, rand(), rand(), _, f, pdf, event);
+            const Vector2 u = rand.next2();
+            bsdf.sample(in_dir, u.x, u.y, _, f, pdf, event);
             if (SurfaceEventClassifier::is_index_matched(event)) {
                 att *= f * bsdf.cos_theta(-in_dir);
                 ray = Ray(info.pos + ray.dir * 1e-3f, ray.dir);
@@ -257,6 +447,104 @@ protected:
     long long index;
     real luminance_clamping;
     bool envmap_is;
+    // Trace the primary rays of render_stage() in batches, as ray packets where the backend has them.
+    // Only for renderers that query sg, with the trace() of this class.
+    bool batch_primary_rays;
+    static const int primary_batch_size = 64;
+    // Samples of every render_samples() task of untiled rendering with batch_primary_rays
+    int samples_per_task;
+    // Square tiles of this size are rendered one per task, with one sample per pixel; 0 leaves the pixel
+    // of every sample to the sampler
+    int tile_size;
+    std::vector<Vector2i> tile_pixels;
+    std::vector<int> tile_sample_begin;
+    std::vector<int> tile_passes;
+    int num_stages;
+    // Tiles are rendered until the RMS relative error of their pixels (see
+    // ImageAccumulator::get_relative_errors) is below target_error
+    bool adaptive_sampling;
+    real target_error;
+    real adaptive_min_intensity;
+    int adaptive_min_stages;
+    int adaptive_max_passes;
+    // Practical path guiding: at surfaces that are neither delta nor index matched, directions are sampled
+    // from the incident radiance learnt in earlier stages, with probability 1 - guiding_bsdf_fraction, and
+    // from the BSDF otherwise. Training iteration k lasts 2^k stages; the first only samples the BSDF.
+    // With direct_lighting, the radiance learnt is only the indirect one, as emitters hit count for nothing.
+    bool path_guiding;
+    real guiding_bsdf_fraction;
+    int guiding_training_iterations;
+    real guiding_spatial_threshold;
+    real guiding_directional_threshold;
+    // In MB, for all nodes of the SD-tree
+    real guiding_max_memory;
+    bool guiding_initialized;
+    int guiding_iteration;
+    int guiding_stage;
+    SDTree sd_tree;
+
+    // Vertices a path records, for guiding and for the radiance cache each, beyond which it records none
+    static const int max_recorded_vertices = 64;
+
+    // Radiance caching, for previews: except for a radiance_cache_training_fraction of them, paths end at
+    // the first surface after the primary one that is neither delta nor index matched, with the radiance
+    // cached there, once its cell has radiance_cache_min_samples records. The others are traced in full and
+    // record the radiance leaving each such surface they hit. The cache is view independent, and so blurs
+    // glossy reflections, in exchange for much shorter paths.
+    bool radiance_cache;
+    real radiance_cache_training_fraction;
+    int radiance_cache_min_samples;
+    int radiance_cache_resolution;
+    int radiance_cache_entries;
+    bool radiance_cache_initialized;
+    RadianceCache cache;
+
+    // A surface of a training path, whose outgoing radiance is recorded once the path is done
+    struct CacheVertex {
+        Vector3 pos, normal;
+        // Of the path until it got there, and the radiance it got until then
+        Vector3 importance;
+        Vector3 radiance;
+    };
+
+    // A vertex of a path to record for guiding once the path is done
+    struct GuidingVertex {
+        Vector3 pos, dir;
+        real pdf;
+        // Of the path up to and including the scattering into dir, and the radiance it got until then
+        Vector3 importance;
+        Vector3 radiance;
+    };
+
+    bool is_recording_guiding() const {
+        return path_guiding && guiding_iteration < guiding_training_iterations;
+    }
+
+    // Samples out_dir at a surface as bsdf.sample() does, from its mixture with the guiding distribution
+    // at pos once there is one. f and pdf are then those of the mixture, unless the BSDF sampled a delta
+    // event. Returns whether the sample can be recorded for guiding, i.e. is not a delta event.
+    bool sample_guided(const BSDF &bsdf, const Vector3 &pos, const Vector3 &in_dir, StateSequence &rand,
+                       Vector3 &out_dir, Vector3 &f, real &pdf, SurfaceEvent &event) const {
+        const Vector2 u = rand.next2();
+        const real r = rand();
+        const real alpha = sd_tree.can_sample() ? guiding_bsdf_fraction : 1.0f;
+        if (r < alpha) {
+            bsdf.sample(in_dir, u.x, u.y, out_dir, f, pdf, event);
+            if (SurfaceEventClassifier::is_delta(event)) {
+                pdf *= alpha;
+                return false;
+            }
+            if (alpha == 1.0f) {
+                return true;
+            }
+        } else {
+            out_dir = sd_tree.sample(pos, u.x, u.y);
+            event = (int)SurfaceScatteringFlags::non_delta;
+        }
+        f = bsdf.evaluate(in_dir, out_dir);
+        pdf = alpha * bsdf.probability_density(in_dir, out_dir) + (1 - alpha) * sd_tree.pdf(pos, out_dir);
+        return true;
+    }
 };
 
 void PathTracingRenderer::initialize(const Config &config) {
@@ -266,14 +554,194 @@ void PathTracingRenderer::initialize(const Config &config) {
     this->direct_lighting_bsdf = config.get("direct_lighting_bsdf", 1);
     assert_info(this->direct_lighting_bsdf > 0 || this->direct_lighting_light > 0,
                 "Sum of direct_lighting_bsdf and direct_lighting_light should not be 0.");
-    this->sampler = create_instance<Sampler>(config.get("sampler", "prand"));
+    this->sampler = create_instance<Sampler>(config.get("sampler", "prand"), config);
     this->luminance_clamping = config.get("luminance_clamping", 0.0f);
-    this->accumulator = ImageAccumulator<Vector3>(width, height);
+    this->accumulator = ImageAccumulator<Vector3>(
+            width, height, ImageAccumulator<Vector3>::get_mode(config.get("image_accumulation", "per_thread")));
     this->russian_roulette = config.get("russian_roulette", true);
+    this->light_bvh = config.get("light_bvh", false);
     this->envmap_is = config.get("envmap_is", true);
+    this->batch_primary_rays = config.get("batch_primary_rays", true);
+    this->samples_per_task = primary_batch_size;
+    this->tile_size = config.get("tile_size", 0);
+    this->adaptive_sampling = config.get("adaptive_sampling", false);
+    this->target_error = config.get("target_error", 0.02f);
+    this->adaptive_min_intensity = config.get("adaptive_min_intensity", 0.01f);
+    this->adaptive_min_stages = std::max(2, config.get("adaptive_min_stages", 8));
+    this->adaptive_max_passes = config.get("adaptive_max_passes", 4);
+    this->path_guiding = config.get("path_guiding", false);
+    this->guiding_bsdf_fraction = config.get("guiding_bsdf_fraction", 0.5f);
+    this->guiding_training_iterations = config.get("guiding_training_iterations", 6);
+    this->guiding_spatial_threshold = config.get("guiding_spatial_threshold", 12000.0f);
+    this->guiding_directional_threshold = config.get("guiding_directional_threshold", 0.01f);
+    this->guiding_max_memory = config.get("guiding_max_memory", 256.0f);
+    assert_info(0 < guiding_bsdf_fraction && guiding_bsdf_fraction <= 1,
+                "guiding_bsdf_fraction should be in (0, 1]");
+    assert_info(0 <= guiding_training_iterations && guiding_training_iterations < 30,
+                "guiding_training_iterations should be in [0, 30)");
+    guiding_initialized = false;
+    guiding_iteration = 0;
+    guiding_stage = 0;
+    this->radiance_cache = config.get("radiance_cache", false);
+    this->radiance_cache_training_fraction = config.get("radiance_cache_training_fraction", 0.1f);
+    this->radiance_cache_min_samples = config.get("radiance_cache_min_samples", 16);
+    this->radiance_cache_resolution = config.get("radiance_cache_resolution", 128);
+    this->radiance_cache_entries = config.get("radiance_cache_entries", 1 << 20);
+    assert_info(0 < radiance_cache_training_fraction && radiance_cache_training_fraction <= 1,
+                "radiance_cache_training_fraction should be in (0, 1]");
+    assert_info(radiance_cache_resolution > 0, "radiance_cache_resolution should be positive");
+    radiance_cache_initialized = false;
+    if (adaptive_sampling && tile_size == 0) {
+        // Samples have to be placed by pixel
+        tile_size = 16;
+    }
+    num_stages = 0;
+    if (tile_size > 0) {
+        initialize_tiles(config.get("tile_order", "hilbert"));
+    }
     index = 0;
 }
 
+void PathTracingRenderer::get_scene_bounds(Vector3 &lower, Vector3 &upper) const {
+    lower = Vector3(std::numeric_limits<real>::max());
+    upper = Vector3(-std::numeric_limits<real>::max());
+    for (auto &tri : scene->get_triangles()) {
+        for (int i = 0; i < 3; i++) {
+            lower = min(lower, tri.v[i]);
+            upper = max(upper, tri.v[i]);
+        }
+    }
+    if (!(lower.x <= upper.x)) {
+        lower = Vector3(-1.0f);
+        upper = Vector3(1.0f);
+    }
+    const Vector3 margin = 1e-3f * (upper - lower) + Vector3(1e-4f);
+    lower -= margin;
+    upper += margin;
+}
+
+void PathTracingRenderer::initialize_guiding() {
+    Vector3 lower, upper;
+    get_scene_bounds(lower, upper);
+    sd_tree.initialize(lower, upper, guiding_spatial_threshold, guiding_directional_threshold,
+                       guiding_max_memory * 1024 * 1024);
+    guiding_initialized = true;
+}
+
+void PathTracingRenderer::initialize_radiance_cache() {
+    Vector3 lower, upper;
+    get_scene_bounds(lower, upper);
+    cache.initialize(lower, max_component(upper - lower) / radiance_cache_resolution, radiance_cache_entries);
+    radiance_cache_initialized = true;
+}
+
+void PathTracingRenderer::update_guiding() {
+    if (guiding_iteration >= guiding_training_iterations) {
+        return;
+    }
+    guiding_stage++;
+    if (guiding_stage == (1 << guiding_iteration)) {
+        sd_tree.refine(real(1 << guiding_iteration), num_threads);
+        guiding_iteration++;
+        guiding_stage = 0;
+    }
+}
+
+void PathTracingRenderer::initialize_tiles(const std::string &tile_order) {
+    assert_info(tile_order == "hilbert" || tile_order == "spiral" || tile_order == "scanline",
+                "Unknown tile order " + tile_order);
+    const int tiles_x = (width + tile_size - 1) / tile_size, tiles_y = (height + tile_size - 1) / tile_size;
+    std::vector<Vector2i> tiles;
+    if (tile_order == "hilbert") {
+        int n = 1;
+        while (n < std::max(tiles_x, tiles_y)) {
+            n *= 2;
+        }
+        // The d-th cell of the Hilbert curve over n x n cells, skipping those outside the image
+        for (int d = 0; d < n * n; d++) {
+            int x = 0, y = 0;
+            for (int s = 1, t = d; s < n; s *= 2, t /= 4) {
+                const int rx = 1 & (t / 2), ry = 1 & (t ^ rx);
+                if (ry == 0) {
+                    if (rx == 1) {
+                        x = s - 1 - x;
+                        y = s - 1 - y;
+                    }
+                    std::swap(x, y);
+                }
+                x += s * rx;
+                y += s * ry;
+            }
+            if (x < tiles_x && y < tiles_y) {
+                tiles.push_back(Vector2i(x, y));
+            }
+        }
+    } else {
+        for (int i = 0; i < tiles_x; i++) {
+            for (int j = 0; j < tiles_y; j++) {
+                tiles.push_back(Vector2i(i, j));
+            }
+        }
+        if (tile_order == "spiral") {
+            // Outwards from the center, ring by ring, each ring counterclockwise
+            const Vector2 center(0.5f * (tiles_x - 1), 0.5f * (tiles_y - 1));
+            auto key = [&](const Vector2i &t) {
+                const Vector2 d = Vector2(t) - center;
+                return std::make_pair((int)std::ceil(std::max(std::abs(d.x), std::abs(d.y))), std::atan2(d.y, d.x));
+            };
+            std::stable_sort(tiles.begin(), tiles.end(), [&](const Vector2i &a, const Vector2i &b) {
+                return key(a) < key(b);
+            });
+        }
+    }
+    int z_order_size = 1;
+    while (z_order_size < tile_size) {
+        z_order_size *= 2;
+    }
+    tile_pixels.clear();
+    tile_sample_begin.assign(1, 0);
+    for (auto &tile : tiles) {
+        const Vector2i lower = tile * tile_size;
+        const Vector2i upper = min(lower + Vector2i(tile_size), Vector2i(width, height));
+        for (int k = 0; k < z_order_size * z_order_size; k++) {
+            // De-interleaves the bits of k into x and y
+            int x = 0, y = 0;
+            for (int b = 0; (1 << b) < z_order_size; b++) {
+                x |= (k >> (2 * b) & 1) << b;
+                y |= (k >> (2 * b + 1) & 1) << b;
+            }
+            const Vector2i p = lower + Vector2i(x, y);
+            if (x < tile_size && y < tile_size && p.x < upper.x && p.y < upper.y) {
+                tile_pixels.push_back(p);
+            }
+        }
+        tile_sample_begin.push_back((int)tile_pixels.size());
+    }
+    tile_passes.assign(tiles.size(), 1);
+}
+
+void PathTracingRenderer::update_tile_passes() {
+    const Array2D<real> errors = accumulator.get_relative_errors(adaptive_min_intensity);
+    int num_converged = 0;
+    for (int t = 0; t < (int)tile_passes.size(); t++) {
+        real sum = 0;
+        for (int i = tile_sample_begin[t]; i < tile_sample_begin[t + 1]; i++) {
+            sum += sqr(errors[tile_pixels[i].x][tile_pixels[i].y]);
+        }
+        // Relative to the target, the squared error falls as 1 / samples, taken num_stages per pixel so far
+        const real excess = sum / (tile_sample_begin[t + 1] - tile_sample_begin[t]) / sqr(target_error);
+        if (excess <= 1) {
+            tile_passes[t] = 0;
+            num_converged++;
+        } else {
+            tile_passes[t] = (int)std::min((real)adaptive_max_passes, std::ceil(num_stages * (excess - 1)));
+        }
+    }
+    if (num_converged == (int)tile_passes.size()) {
+        printf("Converged to relative error %f after %d stages\n", target_error, num_stages);
+    }
+}
+
 Vector3 PathTracingRenderer::calculate_volumetric_direct_lighting(const Vector3 &in_dir, const Vector3 &orig,
                                                                   StateSequence &rand, VolumeStack &stack) {
     Vector3 acc(0);
@@ -281,11 +749,13 @@ Vector3 PathTracingRenderer::calculate_volumetric_direct_lighting(const Vector3
     bool sample_envmap = false;
     const Triangle *p_triangle = nullptr;
     const EnvironmentMap *p_envmap = nullptr;
-    scene->sample_light_source(rand(), light_source_pdf, p_triangle, p_envmap);
+    sample_light_source(orig, rand(), light_source_pdf, p_triangle, p_envmap);
+    // Light samples are skipped if no light emits toward the point
+    const bool sample_light = p_triangle != nullptr || p_envmap != nullptr;
     Triangle tri;
     if (p_envmap) {
         sample_envmap = true;
-    } else {
+    } else if (p_triangle) {
         tri = *p_triangle;
     }
     // MIS between bsdf and light sampling.
@@ -299,7 +769,7 @@ Vector3 PathTracingRenderer::calculate_volumetric_direct_lighting(const Vector3
         bool sample_bsdf = i < direct_lighting_bsdf;
         if (!sample_bsdf) {
             // Light sampling
-            if (!sample_envmap && tri.get_relative_location_to_plane(orig) < 0)
+            if (!sample_light || (!sample_envmap && tri.get_relative_location_to_plane(orig) < 0))
                 continue;
         }
         Vector3 out_dir;
@@ -318,7 +788,8 @@ Vector3 PathTracingRenderer::calculate_volumetric_direct_lighting(const Vector3
                 real pdf;
                 out_dir = p_envmap->sample_direction(rand, pdf, _);
             } else {
-                Vector3 pos = tri.sample_point(rand(), rand());
+                const Vector2 uv = rand.next2();
+                Vector3 pos = tri.sample_point(uv.x, uv.y);
                 dist = pos - orig;
                 out_dir = normalize(dist);
             }
@@ -339,15 +810,15 @@ Vector3 PathTracingRenderer::calculate_volumetric_direct_lighting(const Vector3
         Vector3 throughput;
         if (test_info.intersected) {
             // Mesh light
-            const Triangle &light_tri = scene->get_triangle(test_info.triangle_id);
             BSDF light_bsdf(scene, test_info);
             if (!light_bsdf.is_emissive() || !test_info.front) {
                 continue;
             }
-            real c = abs(dot(ray.dir, tri.normal));
+            const Triangle &light_tri = scene->get_triangle(test_info.triangle_id);
+            real c = abs(dot(ray.dir, light_tri.normal));
             dist = test_info.pos - orig;
             light_p = dot(dist, dist) / std::max(1e-20f, light_tri.area * c) *
-                      scene->get_triangle_pdf(light_tri.id);
+                      get_triangle_pdf(orig, light_tri.id);
             const Vector3 emission = light_bsdf.evaluate(test_info.normal, -out_dir);
             throughput = f * co * emission * att;
         } else {
@@ -372,11 +843,18 @@ Vector3 PathTracingRenderer::calculate_volumetric_direct_lighting(const Vector3
     return acc;
 }
 
-Vector3 PathTracingRenderer::trace(Ray ray, StateSequence &rand) {
+Vector3 PathTracingRenderer::trace(Ray ray, StateSequence &rand, const IntersectionInfo *primary_hit) {
     Vector3 ret(0);
     Vector3 importance(1);
     VolumeStack stack;
     int path_length = 1;
+    const bool recording = is_recording_guiding();
+    GuidingVertex guiding_vertices[max_recorded_vertices];
+    int num_guiding_vertices = 0;
+    // Only draws from rand with the cache, to leave the samples of other renders as they were
+    const bool cache_training = radiance_cache && rand() < radiance_cache_training_fraction;
+    CacheVertex cache_vertices[max_recorded_vertices];
+    int num_cache_vertices = 0;
     if (scene->get_atmosphere_material()) {
         stack.push(scene->get_atmosphere_material().get());
     }
@@ -390,7 +868,10 @@ Vector3 PathTracingRenderer::trace(Ray ray, StateSequence &rand) {
             break;
         }
         const VolumeMaterial &volume = *stack.top();
-        IntersectionInfo info = sg->query(ray);
+        if (depth == 1) {
+            RenderCounters::add(RenderCounter::primary_rays);
+        }
+        IntersectionInfo info = depth == 1 && primary_hit ? *primary_hit : sg->query(ray);
         real safe_distance = volume.sample_free_distance(rand, ray);
         Vector3 f(1.0f);
         Ray out_ray;
@@ -420,10 +901,29 @@ Vector3 PathTracingRenderer::trace(Ray ray, StateSequence &rand) {
                 }
                 break;
             }
+            if (radiance_cache && !bsdf.is_delta() && !bsdf.is_index_matched()) {
+                const Vector3 normal = dot(in_dir, info.normal) < 0 ? -info.normal : info.normal;
+                Vector3 cached;
+                if (cache_training) {
+                    if (num_cache_vertices < max_recorded_vertices) {
+                        cache_vertices[num_cache_vertices++] = CacheVertex{info.pos, normal, importance, ret};
+                    }
+                } else if (path_length > 1 &&
+                           cache.lookup(info.pos, normal, rand.next3(), radiance_cache_min_samples, cached)) {
+                    ret += importance * cached;
+                    break;
+                }
+            }
             real pdf;
             SurfaceEvent event;
             Vector3 out_dir;
-            bsdf.sample(in_dir, rand(), rand(), out_dir, f, pdf, event);
+            bool recordable = false;
+            if (path_guiding && !bsdf.is_delta() && !bsdf.is_index_matched()) {
+                recordable = sample_guided(bsdf, info.pos, in_dir, rand, out_dir, f, pdf, event);
+            } else {
+                const Vector2 u = rand.next2();
+                bsdf.sample(in_dir, u.x, u.y, out_dir, f, pdf, event);
+            }
             bool index_matched = SurfaceEventClassifier::is_index_matched(event);
             if (!index_matched) {
                 path_length += 1;
@@ -441,10 +941,16 @@ Vector3 PathTracingRenderer::trace(Ray ray, StateSequence &rand) {
                 }
             }
             out_ray = Ray(info.pos + out_dir * 1e-4f, out_dir, 1e-5f);
+            // Keep the footprint of the camera ray; it is not widened by (rough) scattering
+            out_ray.cone_width = info.cone_width;
             real c = abs(glm::dot(out_dir, info.normal));
             if (pdf < 1e-10f) {
                 break;
             }
+            if (recordable && recording && num_guiding_vertices < max_recorded_vertices) {
+                guiding_vertices[num_guiding_vertices++] =
+                        GuidingVertex{info.pos, out_dir, pdf, importance * f * (c / pdf), ret};
+            }
             f *= c / pdf;
         } else if (volume.sample_event(rand, Ray(ray.orig + ray.dir * safe_distance, ray.dir)) ==
                    VolumeEvent::scattering) {
@@ -471,20 +977,297 @@ Vector3 PathTracingRenderer::trace(Ray ray, StateSequence &rand) {
                 if (rand() < p) {
                     importance *= 1.0f / p;
                 } else {
+                    RenderCounters::add(RenderCounter::russian_roulette_terminations);
                     break;
                 }
             }
         }
     }
+    RenderCounters::add(RenderCounter::paths);
+    RenderCounters::add(RenderCounter::path_vertices, path_length);
+    // The radiance got after each vertex, per unit of its importance, is an estimate of that incident along
+    // its direction
+    for (int i = 0; i < num_guiding_vertices; i++) {
+        const GuidingVertex &v = guiding_vertices[i];
+        const Vector3 radiance = ret - v.radiance;
+        Vector3 incident(0.0f);
+        for (int k = 0; k < 3; k++) {
+            if (v.importance[k] > 0) {
+                incident[k] = radiance[k] / v.importance[k];
+            }
+        }
+        sd_tree.record(v.pos, v.dir, luminance(incident) / v.pdf);
+    }
+    for (int i = 0; i < num_cache_vertices; i++) {
+        const CacheVertex &v = cache_vertices[i];
+        const Vector3 radiance = ret - v.radiance;
+        Vector3 outgoing(0.0f);
+        for (int k = 0; k < 3; k++) {
+            if (v.importance[k] > 0) {
+                outgoing[k] = radiance[k] / v.importance[k];
+            }
+        }
+        cache.record(v.pos, v.normal, outgoing);
+    }
     return ret;
 }
 
 TC_IMPLEMENTATION(Renderer, PathTracingRenderer, "pt");
 
+// Path tracing of whole batches of paths at once, bounce by bounce, instead of one path after another.
+// Every bounce intersects the rays of all paths still alive as one sg->query() batch, sorted by direction
+// for coherent packets; surface hits are then sorted by material, and shaded material by material.
+// Each path consumes its random sequence exactly as trace() does, so the image is that of "pt" with the
+// same sampler, up to the order of floating point additions.
+class PTWavefrontRenderer final : public PathTracingRenderer {
+public:
+    void initialize(const Config &config) override {
+        PathTracingRenderer::initialize(config);
+        assert_info(!path_guiding, "Wavefront path tracing does not support path_guiding");
+        assert_info(!radiance_cache, "Wavefront path tracing does not support radiance_cache");
+        this->wavefront_size = config.get("wavefront_size", 4096);
+        assert_info(wavefront_size > 0, "wavefront_size should be positive");
+        // Untiled stages go through render_samples() too, one wavefront per task
+        batch_primary_rays = true;
+        samples_per_task = wavefront_size;
+    }
+
+    void render_samples(int begin, int n, const Vector2i *pixels) override {
+        Wavefront w;
+        for (int wave_begin = 0; wave_begin < n; wave_begin += wavefront_size) {
+            render_wavefront(w, begin + wave_begin, std::min(wavefront_size, n - wave_begin),
+                             pixels ? pixels + wave_begin : nullptr);
+        }
+    }
+
+protected:
+    int wavefront_size;
+
+    // Paths of a wavefront, by path, and the queues of a bounce
+    struct Wavefront {
+        std::vector<RandomStateSequence> rands;
+        std::vector<StateSequence *> rand_ptrs;
+        std::vector<Vector2> offsets;
+        std::vector<Ray> rays;
+        std::vector<IntersectionInfo> infos;
+        std::vector<Vector3> importance, radiance;
+        std::vector<int> path_lengths;
+        std::vector<VolumeStack> stacks;
+        // Paths alive, their rays and hits in query order, and paths at surfaces, in shading order
+        std::vector<int> active, next_active, surface_hits;
+        std::vector<Ray> queue_rays;
+        std::vector<IntersectionInfo> queue_infos;
+        std::vector<std::pair<int, int>> material_keys;
+    };
+
+    // Samples index + begin, ..., index + begin + n - 1 as render_samples() does, all traced together
+    void render_wavefront(Wavefront &w, int begin, int n, const Vector2i *pixels) {
+        const Vector2 size(1.0f / width, 1.0f / height);
+        w.rands.clear();
+        w.offsets.resize(n);
+        w.rays.resize(n);
+        w.infos.resize(n);
+        w.importance.assign(n, Vector3(1.0f));
+        w.radiance.assign(n, Vector3(0.0f));
+        w.path_lengths.assign(n, 1);
+        w.stacks.assign(n, VolumeStack());
+        w.active.clear();
+        for (int p = 0; p < n; p++) {
+            w.rands.push_back(RandomStateSequence(sampler, index + begin + p));
+            RandomStateSequence &rand = w.rands[p];
+            w.offsets[p] = Vector2(rand(), rand());
+            if (pixels) {
+                w.offsets[p] = (Vector2(pixels[p]) + w.offsets[p]) * size;
+            }
+            if (scene->get_atmosphere_material()) {
+                w.stacks[p].push(scene->get_atmosphere_material().get());
+            }
+            w.active.push_back(p);
+        }
+        w.rand_ptrs.resize(n);
+        for (int p = 0; p < n; p++) {
+            w.rand_ptrs[p] = &w.rands[p];
+        }
+        camera->generate_rays(n, w.offsets.data(), size, w.rand_ptrs.data(), w.rays.data());
+        for (int depth = 1; !w.active.empty(); depth++) {
+            if (depth > 1000) {
+                error("path too long");
+            }
+            w.next_active.clear();
+            intersect(w, depth);
+            w.surface_hits.clear();
+            for (int k = 0; k < (int)w.active.size(); k++) {
+                const int p = w.active[k];
+                w.rays[p] = w.queue_rays[k];
+                if (resolve_medium(w, p, w.queue_infos[k])) {
+                    w.infos[p] = w.queue_infos[k];
+                    w.surface_hits.push_back(p);
+                }
+            }
+            // Paths of a material (by its id in the scene's material table) together, for its code and data
+            // to stay in cache
+            w.material_keys.clear();
+            for (int p : w.surface_hits) {
+                w.material_keys.push_back(std::make_pair(w.infos[p].material_id, p));
+            }
+            std::sort(w.material_keys.begin(), w.material_keys.end());
+            for (auto &key : w.material_keys) {
+                shade_surface(w, key.second);
+            }
+            std::swap(w.active, w.next_active);
+        }
+        int64 path_vertices = 0;
+        for (int p = 0; p < n; p++) {
+            write_path_contribution(PathContribution(w.offsets[p].x, w.offsets[p].y, clamp_luminance(w.radiance[p])));
+            path_vertices += w.path_lengths[p];
+        }
+        RenderCounters::add(RenderCounter::paths, n);
+        RenderCounters::add(RenderCounter::path_vertices, path_vertices);
+    }
+
+    // Retires the paths at their last vertex, and queries the rays of the others, after the first bounce
+    // sorted by direction octant
+    void intersect(Wavefront &w, int depth) {
+        int num_active = 0;
+        for (int p : w.active) {
+            if (w.path_lengths[p] > max_path_length) {
+                continue;
+            }
+            if (w.stacks[p].size() == 0) {
+                // What's going on here...
+                P(w.stacks[p].size());
+                continue;
+            }
+            w.active[num_active++] = p;
+        }
+        w.active.resize(num_active);
+        if (depth > 1) {
+            auto octant = [&](int p) {
+                const Vector3 &d = w.rays[p].dir;
+                return int(d.x < 0) | int(d.y < 0) << 1 | int(d.z < 0) << 2;
+            };
+            std::stable_sort(w.active.begin(), w.active.end(), [&](int a, int b) {
+                return octant(a) < octant(b);
+            });
+        }
+        w.queue_rays.resize(num_active);
+        w.queue_infos.resize(num_active);
+        for (int k = 0; k < num_active; k++) {
+            w.queue_rays[k] = w.rays[w.active[k]];
+        }
+        if (num_active > 0) {
+            if (depth == 1) {
+                RenderCounters::add(RenderCounter::primary_rays, num_active);
+            }
+            sg->query(&w.queue_rays[0], num_active, &w.queue_infos[0]);
+        }
+    }
+
+    // The medium along the ray of path p up to its hit, as in trace(). Returns whether the path reaches the
+    // surface; volumetric scattering is handled here.
+    bool resolve_medium(Wavefront &w, int p, const IntersectionInfo &info) {
+        RandomStateSequence &rand = w.rands[p];
+        const Ray &ray = w.rays[p];
+        VolumeStack &stack = w.stacks[p];
+        const VolumeMaterial &volume = *stack.top();
+        const real safe_distance = volume.sample_free_distance(rand, ray);
+        if (!info.intersected) {
+            if (scene->envmap && (w.path_lengths[p] == 1 || !direct_lighting)) {
+                w.radiance[p] += w.importance[p] * scene->envmap->sample_illum(ray.dir);
+            }
+            return false;
+        }
+        if (info.dist < safe_distance) {
+            w.importance[p] *= volume.unbiased_sample_attenuation(ray.orig, info.pos, rand);
+            return true;
+        }
+        if (volume.sample_event(rand, Ray(ray.orig + ray.dir * safe_distance, ray.dir)) == VolumeEvent::scattering) {
+            int &path_length = w.path_lengths[p];
+            path_length += 1;
+            const Vector3 orig = ray.orig + ray.dir * safe_distance;
+            const Vector3 in_dir = -ray.dir;
+            if (direct_lighting && path_length_in_range(path_length + 1)) {
+                w.radiance[p] += w.importance[p] * calculate_volumetric_direct_lighting(in_dir, orig, rand, stack);
+            }
+            const Vector3 out_dir = volume.sample_phase(rand, Ray(orig, ray.dir));
+            w.rays[p] = Ray(orig, out_dir, 1e-5f);
+            continue_path(w, p, Vector3(1.0f));
+        }
+        return false;
+    }
+
+    // The surface bounce of path p, as in trace()
+    void shade_surface(Wavefront &w, int p) {
+        RandomStateSequence &rand = w.rands[p];
+        const IntersectionInfo &info = w.infos[p];
+        VolumeStack &stack = w.stacks[p];
+        int &path_length = w.path_lengths[p];
+        BSDF bsdf(scene, info);
+        const Vector3 in_dir = -w.rays[p].dir;
+        if (bsdf.is_emissive()) {
+            bool count = info.front && (path_length == 1 || !direct_lighting);
+            if (count && path_length_in_range(path_length)) {
+                w.radiance[p] += w.importance[p] * bsdf.evaluate(info.normal, in_dir);
+            }
+            return;
+        }
+        real pdf;
+        SurfaceEvent event;
+        Vector3 out_dir, f;
+        const Vector2 u = rand.next2();
+        bsdf.sample(in_dir, u.x, u.y, out_dir, f, pdf, event);
+        if (!SurfaceEventClassifier::is_index_matched(event)) {
+            path_length += 1;
+            if (direct_lighting && path_length_in_range(path_length)) {
+                w.radiance[p] += w.importance[p] * calculate_direct_lighting(in_dir, info, bsdf, rand, stack);
+            }
+        }
+        if (bsdf.is_entering(in_dir) && !bsdf.is_entering(out_dir)) {
+            if (bsdf.get_internal_material() != nullptr)
+                stack.push(bsdf.get_internal_material());
+        }
+        if (bsdf.is_entering(out_dir) && !bsdf.is_entering(in_dir)) {
+            if (bsdf.get_internal_material() != nullptr) {
+                stack.pop();
+            }
+        }
+        w.rays[p] = Ray(info.pos + out_dir * 1e-4f, out_dir, 1e-5f);
+        w.rays[p].cone_width = info.cone_width;
+        if (pdf < 1e-10f) {
+            return;
+        }
+        continue_path(w, p, f * (abs(glm::dot(out_dir, info.normal)) / pdf));
+    }
+
+    // Scales the importance of path p by f, and keeps it for the next bounce unless Russian roulette ends it
+    void continue_path(Wavefront &w, int p, const Vector3 &f) {
+        Vector3 &importance = w.importance[p];
+        importance *= f;
+        if (russian_roulette) {
+            real p_continue = luminance(importance);
+            if (p_continue <= 1) {
+                if (w.rands[p]() < p_continue) {
+                    importance *= 1.0f / p_continue;
+                } else {
+                    RenderCounters::add(RenderCounter::russian_roulette_terminations);
+                    return;
+                }
+            }
+        }
+        w.next_active.push_back(p);
+    }
+};
+
+TC_IMPLEMENTATION(Renderer, PTWavefrontRenderer, "pt_wavefront");
+
 class PTSDFRenderer final : public PathTracingRenderer {
 public:
     void initialize(const Config &config) override {
         PathTracingRenderer::initialize(config);
+        assert_info(!path_guiding, "SDF path tracing does not support path_guiding");
+        assert_info(!radiance_cache, "SDF path tracing does not support radiance_cache");
+        // Primary hits come from ray marching the SDF
+        batch_primary_rays = false;
         Config cfg;
         cfg.set("color", Vector3(1, 1, 1));
         material = create_instance<SurfaceMaterial>("diffuse", cfg);
@@ -496,19 +1279,7 @@ protected:
     std::shared_ptr<SurfaceMaterial> material;
 
     real ray_march(const Ray &ray, real limit = 1e5) {
-        real dist = 0;
-        for (int i = 0; i < 1000; i++) {
-            const Vector3 p = ray.orig + dist * ray.dir;
-            real d = sdf->eval(p);
-            if (d < eps) {
-                break;
-            }
-            dist += d;
-            if (dist > limit) {
-                break;
-            }
-        }
-        return dist;
+        return sdf->march(ray.orig, ray.dir, limit, eps, 1000);
     }
 
     Vector3
@@ -606,7 +1377,8 @@ protected:
             real pdf;
             SurfaceEvent event;
             Vector3 out_dir;
-            bsdf.sample(in_dir, rand(), rand(), out_dir, f, pdf, event);
+            const Vector2 u = rand.next2();
+            bsdf.sample(in_dir, u.x, u.y, out_dir, f, pdf, event);
 
             path_length += 1;
             if (direct_lighting && path_length_in_range(path_length)) {
@@ -628,11 +1400,14 @@ protected:
                     if (rand() < p) {
                         importance *= 1.0f / p;
                     } else {
+                        RenderCounters::add(RenderCounter::russian_roulette_terminations);
                         break;
                     }
                 }
             }
         }
+        RenderCounters::add(RenderCounter::paths);
+        RenderCounters::add(RenderCounter::path_vertices, path_length);
         return ret;
     }
 };
@@ -652,6 +1427,16 @@ public:
         return PSSMLTMarkovChain(resolution_x, resolution_y);
     }
 
+    void write(BinaryFileStreamOutput &os) const override {
+        MarkovChain::write(os);
+        os << resolution_x << resolution_y;
+    }
+
+    void read(BinaryFileStreamInput &is) override {
+        MarkovChain::read(is);
+        is >> resolution_x >> resolution_y;
+    }
+
     PSSMLTMarkovChain mutate(real strength = 1.0f) const {
         PSSMLTMarkovChain result(*this);
         // Pixel location
@@ -705,6 +1490,14 @@ protected:
     long long sample_count;
     Array2D<Vector3> buffer;
 public:
+    long long get_num_samples() const override {
+        return sample_count;
+    }
+
+    real get_relative_error() override {
+        return -1;
+    }
+
     Array2D<Vector3> get_output() override {
         Array2D<Vector3> output(width, height);
         float r = 1.0f / sample_count;
@@ -714,8 +1507,29 @@ public:
         return output;
     }
 
+    // Samples are states of one Markov chain, which can not be split into ranges
+    bool supports_sample_ranges() const override {
+        return false;
+    }
+
+    ImageAccumulator<Vector3> *get_accumulator() override {
+        return nullptr;
+    }
+
+    void write_checkpoint(BinaryFileStreamOutput &os) override {
+        os << first_stage_done << b << sample_count << buffer << current_state.pc << current_state.sc;
+        current_state.chain.write(os);
+    }
+
+    void read_checkpoint(BinaryFileStreamInput &is) override {
+        is >> first_stage_done >> b >> sample_count >> buffer >> current_state.pc >> current_state.sc;
+        current_state.chain.read(is);
+    }
+
     void initialize(const Config &config) override {
         PathTracingRenderer::initialize(config);
+        assert_info(!path_guiding, "MCMC path tracing does not support path_guiding");
+        assert_info(!radiance_cache, "MCMC path tracing does not support radiance_cache");
         large_step_prob = config.get("large_step_prob", 0.3f);
         estimation_rounds = config.get("estimation_rounds", 1);
         mutation_strength = config.get_real("mutation_strength");
@@ -0,0 +1,389 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/threading.h>
+#include <taichi/visual/renderer.h>
+#include <taichi/visual/sampler.h>
+#include <taichi/visual/texture.h>
+#include <taichi/visual/compiled_material.h>
+#include "pt_cuda.h"
+
+#include <map>
+
+TC_NAMESPACE_BEGIN
+
+#ifdef TC_USE_CUDA
+
+// Path tracing on a CUDA device (see pt_cuda.cu), with the materials and direct lighting of "pt" in vacuum.
+// The scene is flattened once, into triangles in the order of a BVH, the compiled material table, rasters of
+// its textures and the environment map, and the emission CDF, and again after update_geometry(). Every stage
+// traces one sample per pixel, with the camera rays of the next stage generated while the device traces.
+//
+// Built-in materials are evaluated exactly; generic ones (e.g. glass or mirrors) are rendered as gray diffuse
+// surfaces. The environment map only lights the scene through BSDF samples.
+class PathTracingCudaRenderer : public Renderer {
+public:
+    void initialize(const Config &config) override {
+        Renderer::initialize(config);
+        assert_info(scene->particle_sets.empty() && scene->level_sets.empty(),
+                    "pt_cuda does not render particles or level sets");
+        assert_info(!scene->get_atmosphere_material() || scene->get_atmosphere_material()->is_vacuum(),
+                    "pt_cuda only renders in vacuum");
+        parameters.width = width;
+        parameters.height = height;
+        parameters.min_path_length = min_path_length;
+        parameters.max_path_length = max_path_length;
+        parameters.russian_roulette = config.get("russian_roulette", true);
+        parameters.direct_lighting = config.get("direct_lighting", true);
+        parameters.direct_lighting_bsdf = config.get("direct_lighting_bsdf", 1);
+        parameters.direct_lighting_light = config.get("direct_lighting_light", 1);
+        assert_info(parameters.direct_lighting_bsdf > 0 || parameters.direct_lighting_light > 0,
+                    "Sum of direct_lighting_bsdf and direct_lighting_light should not be 0.");
+        parameters.luminance_clamping = config.get("luminance_clamping", 0.0f);
+        sampler = create_instance<Sampler>(config.get("sampler", "prand"), config);
+        texture_resolution = config.get("texture_resolution", 512);
+        environment_resolution = config.get("environment_resolution", Vector2i(1024, 512));
+        assert_info(texture_resolution > 1, "texture_resolution should be at least 2");
+        device.initialize(parameters);
+        upload_scene();
+        rays.clear();
+        index = 0;
+    }
+
+    void update_geometry() override {
+        Renderer::update_geometry();
+        upload_scene();
+    }
+
+    void render_stage() override {
+        const int samples = width * height;
+        if (rays.empty()) {
+            generate_rays(index, rays);
+        }
+        device.begin_stage(rays, (unsigned long long)index);
+        generate_rays(index + samples, next_rays);
+        device.finish_stage();
+        std::swap(rays, next_rays);
+        index += samples;
+    }
+
+    Array2D<Vector3> get_output() override {
+        std::vector<float> sums, counts;
+        device.get_accumulation(sums, counts);
+        Array2D<Vector3> output(width, height, Vector3(0.0f));
+        for (int i = 0; i < width; i++) {
+            for (int j = 0; j < height; j++) {
+                const int p = i * height + j;
+                if (counts[p] > 0) {
+                    output[i][j] = Vector3(sums[3 * p], sums[3 * p + 1], sums[3 * p + 2]) * (1.0f / counts[p]);
+                }
+            }
+        }
+        return output;
+    }
+
+    long long get_num_samples() const override {
+        return index;
+    }
+
+protected:
+    PTCudaParameters parameters;
+    PTCudaRenderer device;
+    std::shared_ptr<Sampler> sampler;
+    int texture_resolution;
+    Vector2i environment_resolution;
+    // Of the current and the next stage
+    std::vector<PTCudaRay> rays, next_rays;
+    long long index;
+
+    // One stratified sample per pixel, of samples first, first + 1, ... by pixel
+    void generate_rays(long long first, std::vector<PTCudaRay> &out) {
+        const Vector2 size(1.0f / width, 1.0f / height);
+        out.resize(width * height);
+        ThreadedTaskManager::run(width, num_threads, [&](int i) {
+            std::vector<RandomStateSequence> rands;
+            std::vector<StateSequence *> rand_ptrs(height);
+            std::vector<Vector2> offsets(height);
+            std::vector<Ray> column(height);
+            rands.reserve(height);
+            for (int j = 0; j < height; j++) {
+                rands.push_back(RandomStateSequence(sampler, first + i * height + j));
+                rand_ptrs[j] = &rands[j];
+                offsets[j] = (Vector2(i, j) + Vector2(rands[j](), rands[j]())) * size;
+            }
+            camera->generate_rays(height, offsets.data(), size, rand_ptrs.data(), column.data());
+            for (int j = 0; j < height; j++) {
+                PTCudaRay &ray = out[i * height + j];
+                for (int k = 0; k < 3; k++) {
+                    ray.orig[k] = column[j].orig[k];
+                    ray.dir[k] = column[j].dir[k];
+                }
+                ray.pixel = i * height + j;
+            }
+        });
+    }
+
+    void upload_scene() {
+        PTCudaScene s;
+        const std::vector<Triangle> &triangles = scene->get_triangles();
+        std::vector<int> order(triangles.size());
+        for (int i = 0; i < (int)order.size(); i++) {
+            order[i] = i;
+        }
+        if (!order.empty()) {
+            s.nodes.emplace_back();
+            build_bvh(triangles, order, 0, (int)order.size(), 0, s.nodes);
+        }
+        double total_emission = 0;
+        for (int k = 0; k < (int)order.size(); k++) {
+            const Triangle &t = triangles[order[k]];
+            PTCudaTriangle tri;
+            for (int a = 0; a < 3; a++) {
+                tri.v0[a] = t.v[0][a];
+                tri.e1[a] = t.v10[a];
+                tri.e2[a] = t.v20[a];
+                tri.normal[a] = t.normal[a];
+                tri.n0[a] = t.n0[a];
+                tri.n10[a] = t.n10[a];
+                tri.n20[a] = t.n20[a];
+            }
+            for (int a = 0; a < 2; a++) {
+                tri.uv0[a] = t.uv0[a];
+                tri.uv10[a] = t.uv10[a];
+                tri.uv20[a] = t.uv20[a];
+            }
+            tri.area = t.area;
+            tri.material = scene->triangle_material_ids[t.id];
+            tri.light_pdf = t.area * scene->get_triangle_emission(t.id);
+            if (tri.light_pdf > 0) {
+                total_emission += tri.light_pdf;
+                s.lights.push_back(k);
+            }
+            s.triangles.push_back(tri);
+        }
+        double cdf = 0;
+        for (int light : s.lights) {
+            PTCudaTriangle &tri = s.triangles[light];
+            tri.light_pdf = real(tri.light_pdf / total_emission);
+            cdf += tri.light_pdf;
+            s.light_cdf.push_back(real(cdf));
+        }
+        if (!s.light_cdf.empty()) {
+            s.light_cdf.back() = 1.0f;
+        }
+        std::map<const Texture *, int> rasters;
+        for (int id = 0; id < scene->material_table.size(); id++) {
+            s.materials.push_back(convert_material(scene->material_table[id], s, rasters));
+        }
+        s.albedo_resolution = MicrofacetAlbedo::resolution;
+        for (auto distribution : {MicrofacetDistribution::ggx, MicrofacetDistribution::beckmann}) {
+            const MicrofacetAlbedo &albedo = MicrofacetAlbedo::get(distribution);
+            const int res = MicrofacetAlbedo::resolution;
+            for (int j = 0; j < res; j++) {
+                for (int i = 0; i < res; i++) {
+                    s.albedo.push_back(albedo.get_albedo(real(i) / (res - 1), real(j) / (res - 1)));
+                }
+            }
+            for (int j = 0; j < res; j++) {
+                s.albedo.push_back(albedo.get_average_albedo(real(j) / (res - 1)));
+            }
+        }
+        if (scene->envmap) {
+            const EnvironmentMap *envmap = scene->envmap.get();
+            s.environment = add_raster(s, environment_resolution.x, environment_resolution.y, [&](Vector2 uv) {
+                const real phi = uv.x * 2 * pi, theta = uv.y * pi;
+                return envmap->sample_illum(
+                        Vector3(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi)));
+            });
+            s.environment_lighting = scene->envmap_sample_prob > 0;
+        }
+        device.set_scene(s);
+    }
+
+    // Sorts order[begin, end) into the subtree of nodes[node], with binned SAH splits along the longest axis
+    // of the centroids
+    void build_bvh(const std::vector<Triangle> &triangles, std::vector<int> &order, int begin, int end, int node,
+                   std::vector<PTCudaBVHNode> &nodes) {
+        const int num_bins = 16, max_leaf_size = 8;
+        Vector3 lower(std::numeric_limits<real>::max()), upper(-std::numeric_limits<real>::max());
+        Vector3 centroid_lower = lower, centroid_upper = upper;
+        for (int k = begin; k < end; k++) {
+            const Triangle &t = triangles[order[k]];
+            for (int a = 0; a < 3; a++) {
+                lower = min(lower, t.v[a]);
+                upper = max(upper, t.v[a]);
+            }
+            const Vector3 c = (t.v[0] + t.v[1] + t.v[2]) * (1.0f / 3);
+            centroid_lower = min(centroid_lower, c);
+            centroid_upper = max(centroid_upper, c);
+        }
+        for (int a = 0; a < 3; a++) {
+            nodes[node].lower[a] = lower[a];
+            nodes[node].upper[a] = upper[a];
+        }
+        const int n = end - begin;
+        auto make_leaf = [&]() {
+            nodes[node].first = begin;
+            nodes[node].count = n;
+        };
+        int axis = 0;
+        const Vector3 extent = centroid_upper - centroid_lower;
+        for (int a = 1; a < 3; a++) {
+            if (extent[a] > extent[axis]) {
+                axis = a;
+            }
+        }
+        if (n <= 2 || extent[axis] <= 0) {
+            make_leaf();
+            return;
+        }
+        auto get_bin = [&](int t) {
+            const Triangle &tri = triangles[t];
+            const real c = (tri.v[0][axis] + tri.v[1][axis] + tri.v[2][axis]) * (1.0f / 3);
+            return std::min(num_bins - 1, int((c - centroid_lower[axis]) / extent[axis] * num_bins));
+        };
+        auto get_area = [](const Vector3 &l, const Vector3 &u) {
+            const Vector3 d = max(u - l, Vector3(0.0f));
+            return d.x * d.y + d.y * d.z + d.z * d.x;
+        };
+        Vector3 bin_lower[num_bins], bin_upper[num_bins];
+        int bin_count[num_bins] = {0};
+        for (int b = 0; b < num_bins; b++) {
+            bin_lower[b] = Vector3(std::numeric_limits<real>::max());
+            bin_upper[b] = Vector3(-std::numeric_limits<real>::max());
+        }
+        for (int k = begin; k < end; k++) {
+            const int b = get_bin(order[k]);
+            const Triangle &t = triangles[order[k]];
+            bin_count[b]++;
+            for (int a = 0; a < 3; a++) {
+                bin_lower[b] = min(bin_lower[b], t.v[a]);
+                bin_upper[b] = max(bin_upper[b], t.v[a]);
+            }
+        }
+        // Cost of splitting after bin b, from the areas of both sides times their triangle counts
+        real right_cost[num_bins];
+        Vector3 l(std::numeric_limits<real>::max()), u(-std::numeric_limits<real>::max());
+        int count = 0;
+        for (int b = num_bins - 1; b > 0; b--) {
+            l = min(l, bin_lower[b]);
+            u = max(u, bin_upper[b]);
+            count += bin_count[b];
+            right_cost[b - 1] = count * get_area(l, u);
+        }
+        l = Vector3(std::numeric_limits<real>::max());
+        u = Vector3(-std::numeric_limits<real>::max());
+        count = 0;
+        int best_split = -1;
+        real best_cost = std::numeric_limits<real>::max();
+        for (int b = 0; b < num_bins - 1; b++) {
+            l = min(l, bin_lower[b]);
+            u = max(u, bin_upper[b]);
+            count += bin_count[b];
+            const real cost = count * get_area(l, u) + right_cost[b];
+            if (count > 0 && count < n && cost < best_cost) {
+                best_cost = cost;
+                best_split = b;
+            }
+        }
+        if (best_split == -1 || (n <= max_leaf_size && best_cost >= n * get_area(lower, upper))) {
+            make_leaf();
+            return;
+        }
+        const int middle = int(std::partition(order.begin() + begin, order.begin() + end,
+                                              [&](int t) { return get_bin(t) <= best_split; }) - order.begin());
+        const int children = (int)nodes.size();
+        nodes.resize(children + 2);
+        nodes[node].first = children;
+        nodes[node].count = 0;
+        build_bvh(triangles, order, begin, middle, children, nodes);
+        build_bvh(triangles, order, middle, end, children + 1, nodes);
+    }
+
+    // A width x height raster of f at the texel centers
+    template <typename F>
+    int add_raster(PTCudaScene &s, int width, int height, const F &f) {
+        PTCudaRaster raster;
+        raster.offset = (int)s.texels.size() / 3;
+        raster.width = width;
+        raster.height = height;
+        s.texels.resize(s.texels.size() + 3 * width * height);
+        float *texels = &s.texels[3 * raster.offset];
+        ThreadedTaskManager::run(width, num_threads, [&](int i) {
+            for (int j = 0; j < height; j++) {
+                const Vector3 value = f(Vector2((i + 0.5f) / width, (j + 0.5f) / height));
+                for (int k = 0; k < 3; k++) {
+                    texels[3 * (i * height + j) + k] = value[k];
+                }
+            }
+        });
+        s.rasters.push_back(raster);
+        return (int)s.rasters.size() - 1;
+    }
+
+    PTCudaParameter convert_parameter(const MaterialParameter &p, PTCudaScene &s,
+                                      std::map<const Texture *, int> &rasters) {
+        PTCudaParameter parameter;
+        for (int k = 0; k < 3; k++) {
+            parameter.value[k] = p.value[k];
+        }
+        parameter.raster = -1;
+        if (p.texture) {
+            auto it = rasters.find(p.texture);
+            if (it == rasters.end()) {
+                const Texture *texture = p.texture;
+                const int raster = add_raster(s, texture_resolution, texture_resolution,
+                                              [&](Vector2 uv) { return texture->sample3(uv); });
+                it = rasters.insert(std::make_pair(texture, raster)).first;
+            }
+            parameter.raster = it->second;
+        }
+        return parameter;
+    }
+
+    PTCudaMaterial convert_material(const CompiledMaterial &m, PTCudaScene &s,
+                                    std::map<const Texture *, int> &rasters) {
+        PTCudaMaterial material;
+        material.color = convert_parameter(m.color, s, rasters);
+        material.roughness = convert_parameter(m.roughness, s, rasters);
+        material.distribution = m.microfacet.distribution == MicrofacetDistribution::beckmann ? 1 : 0;
+        material.f0 = m.microfacet.f0;
+        material.energy_compensation = m.microfacet.albedo != nullptr;
+        material.nested = m.nested;
+        material.emissive = m.emissive;
+        switch (m.kind) {
+            case CompiledMaterialKind::diffuse:
+                material.kind = PTCudaMaterial::DIFFUSE;
+                break;
+            case CompiledMaterialKind::microfacet:
+                material.kind = PTCudaMaterial::MICROFACET;
+                break;
+            case CompiledMaterialKind::emissive:
+                material.kind = PTCudaMaterial::EMISSIVE;
+                break;
+            case CompiledMaterialKind::transparent:
+                material.kind = PTCudaMaterial::TRANSPARENT;
+                break;
+            default:
+                printf("Warning: pt_cuda renders a material that is not built in as gray diffuse.\n");
+                material.kind = PTCudaMaterial::DIFFUSE;
+                material.color.raster = -1;
+                for (int k = 0; k < 3; k++) {
+                    material.color.value[k] = 0.5f;
+                }
+        }
+        return material;
+    }
+};
+
+TC_IMPLEMENTATION(Renderer, PathTracingCudaRenderer, "pt_cuda");
+
+#endif
+
+TC_NAMESPACE_END
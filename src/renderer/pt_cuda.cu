@@ -0,0 +1,1041 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+// Device implementation of the "pt_cuda" renderer. The scattering functions follow compiled_material.h, the
+// shading frames Scene::get_intersection_info(), and the paths PathTracingRenderer::trace() and
+// calculate_direct_lighting() in vacuum, term by term; see there for the derivations.
+
+#include "pt_cuda.h"
+#include "../simulation3d/cuda_utils.cuh"
+#include <cuda_runtime.h>
+#include <algorithm>
+#include <cfloat>
+
+namespace taichi {
+
+const int pt_cuda_threads = 128;
+const float pt_cuda_pi = 3.14159265358979f;
+// eps of math_util.h
+const float pt_cuda_eps = 1e-6f;
+const int pt_cuda_stack_size = 64;
+// Vertices of a path, and surfaces a shadow ray passes, as in trace() and get_attenuation()
+const int pt_cuda_max_depth = 1000;
+const int pt_cuda_max_passes = 100;
+// Bounces queued at once after the first ones, while paths remain
+const int pt_cuda_bounce_chunk = 4;
+
+// The SurfaceScatteringFlags that matter here
+const int pt_cuda_delta = 1;
+const int pt_cuda_index_matched = 2;
+
+// Of DirectRay::flags
+const int pt_cuda_from_bsdf = 1;
+const int pt_cuda_delta_bsdf = 2;
+
+__device__ __forceinline__ float3 operator+(float3 a, float3 b) {
+    return make_float3(a.x + b.x, a.y + b.y, a.z + b.z);
+}
+
+__device__ __forceinline__ float3 operator-(float3 a, float3 b) {
+    return make_float3(a.x - b.x, a.y - b.y, a.z - b.z);
+}
+
+__device__ __forceinline__ float3 operator-(float3 a) {
+    return make_float3(-a.x, -a.y, -a.z);
+}
+
+__device__ __forceinline__ float3 operator*(float3 a, float3 b) {
+    return make_float3(a.x * b.x, a.y * b.y, a.z * b.z);
+}
+
+__device__ __forceinline__ float3 operator*(float s, float3 a) {
+    return make_float3(s * a.x, s * a.y, s * a.z);
+}
+
+__device__ __forceinline__ float3 operator*(float3 a, float s) {
+    return make_float3(s * a.x, s * a.y, s * a.z);
+}
+
+__device__ __forceinline__ float dot(float3 a, float3 b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+__device__ __forceinline__ float3 cross(float3 a, float3 b) {
+    return make_float3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+}
+
+__device__ __forceinline__ float3 normalized(float3 a) {
+    return (1.0f / sqrtf(dot(a, a))) * a;
+}
+
+__device__ __forceinline__ float3 load3(const float *a) {
+    return make_float3(a[0], a[1], a[2]);
+}
+
+__device__ __forceinline__ float sqr(float a) {
+    return a * a;
+}
+
+__device__ __forceinline__ float lerp(float t, float a, float b) {
+    return a + t * (b - a);
+}
+
+__device__ __forceinline__ float luminance(float3 c) {
+    return 0.212671f * c.x + 0.715160f * c.y + 0.072169f * c.z;
+}
+
+__device__ __forceinline__ int sgn(float a) {
+    return a < -pt_cuda_eps ? -1 : (a > pt_cuda_eps ? 1 : 0);
+}
+
+// PCG (RXS-M-XS) per path, seeded by a hash of the sample index
+__device__ __forceinline__ unsigned int mix_bits(unsigned int x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+__device__ __forceinline__ float next_random(unsigned int &state) {
+    state = state * 747796405u + 2891336453u;
+    unsigned int word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    word = (word >> 22u) ^ word;
+    return (word >> 8) * (1.0f / 16777216.0f);
+}
+
+struct SceneView {
+    const PTCudaTriangle *triangles;
+    const PTCudaBVHNode *nodes;
+    int num_nodes;
+    const PTCudaMaterial *materials;
+    const PTCudaRaster *rasters;
+    const float *texels;
+    const int *lights;
+    const float *light_cdf;
+    int num_lights;
+    int albedo_resolution;
+    const float *albedo;
+    int environment;
+    bool environment_lighting;
+};
+
+struct Hit {
+    int triangle;
+    float t, u, v;
+};
+
+struct PathState {
+    float3 orig, dir, importance;
+    // In the stage
+    int sample;
+    int path_length, depth;
+    unsigned int rng;
+};
+
+// A ray of calculate_direct_lighting(), from pos, with the BSDF and cosine factors of its contribution
+struct DirectRay {
+    float3 orig, dir, pos, throughput;
+    float bsdf_pdf;
+    int sample;
+    int flags;
+    unsigned int rng;
+};
+
+// Bilinear, repeated
+__device__ float3 sample_raster(const SceneView &s, int raster, float u, float v) {
+    const PTCudaRaster r = s.rasters[raster];
+    const float x = u * r.width - 0.5f, y = v * r.height - 0.5f;
+    const float x0 = floorf(x), y0 = floorf(y);
+    const float fx = x - x0, fy = y - y0;
+    float3 corners[4];
+    for (int k = 0; k < 4; k++) {
+        int i = ((int)x0 + (k >> 1)) % r.width, j = ((int)y0 + (k & 1)) % r.height;
+        i += i < 0 ? r.width : 0;
+        j += j < 0 ? r.height : 0;
+        corners[k] = load3(s.texels + 3 * (r.offset + i * r.height + j));
+    }
+    return (1 - fx) * ((1 - fy) * corners[0] + fy * corners[1]) + fx * ((1 - fy) * corners[2] + fy * corners[3]);
+}
+
+__device__ __forceinline__ float3 get_parameter(const SceneView &s, const PTCudaParameter &p, float2 uv) {
+    return p.raster < 0 ? load3(p.value) : sample_raster(s, p.raster, uv.x, uv.y);
+}
+
+__device__ float3 get_environment(const SceneView &s, float3 dir) {
+    float phi = atan2f(dir.z, dir.x);
+    phi += phi < 0 ? 2 * pt_cuda_pi : 0.0f;
+    const float theta = acosf(fminf(1.0f, fmaxf(-1.0f, dir.y)));
+    return sample_raster(s, s.environment, phi / (2 * pt_cuda_pi), theta / pt_cuda_pi);
+}
+
+// MicrofacetAlbedo::get_albedo() and get_average_albedo()
+__device__ float get_albedo(const SceneView &s, int distribution, float cos_theta, float roughness) {
+    const int res = s.albedo_resolution;
+    const float *table = s.albedo + distribution * (res * res + res);
+    const float x = fminf(1.0f, fmaxf(0.0f, cos_theta)) * (res - 1);
+    const float y = fminf(1.0f, fmaxf(0.0f, roughness)) * (res - 1);
+    const int i = min((int)x, res - 2), j = min((int)y, res - 2);
+    const float fx = x - i, fy = y - j;
+    const float *row0 = table + j * res + i, *row1 = row0 + res;
+    return lerp(fy, lerp(fx, row0[0], row0[1]), lerp(fx, row1[0], row1[1]));
+}
+
+__device__ float get_average_albedo(const SceneView &s, int distribution, float roughness) {
+    const int res = s.albedo_resolution;
+    const float *table = s.albedo + distribution * (res * res + res) + res * res;
+    const float y = fminf(1.0f, fmaxf(0.0f, roughness)) * (res - 1);
+    const int j = min((int)y, res - 2);
+    return lerp(y - j, table[j], table[j + 1]);
+}
+
+__device__ float3 set_up(float3 a, float3 y) {
+    float3 x;
+    if (fabsf(y.y) > 1.0f - pt_cuda_eps) {
+        x = make_float3(1, 0, 0);
+    } else {
+        x = normalized(cross(y, make_float3(0, 1, 0)));
+    }
+    const float3 z = cross(x, y);
+    return a.x * x + a.y * y + a.z * z;
+}
+
+__device__ float3 random_diffuse(float3 normal, float u, float v) {
+    if (u > v) {
+        const float t = u;
+        u = v;
+        v = t;
+    }
+    v = fmaxf(v, pt_cuda_eps);
+    u /= v;
+    const float xz = v, y = sqrtf(1 - v * v);
+    const float phi = u * pt_cuda_pi * 2;
+    return set_up(make_float3(xz * cosf(phi), y, xz * sinf(phi)), normal);
+}
+
+// DiffuseLobe
+
+__device__ float3 diffuse_sample_direction(float3 in, float u, float v) {
+    const float3 normal = make_float3(0, 0, (float)sgn(in.z));
+    if (fabsf(in.z) > 1 - pt_cuda_eps) {
+        return random_diffuse(normal, u, v);
+    }
+    if (u > v) {
+        const float t = u;
+        u = v;
+        v = t;
+    }
+    v = fmaxf(v, pt_cuda_eps);
+    u /= v;
+    const float y = sqrtf(1 - v * v);
+    const float phi = u * 2.0f * pt_cuda_pi;
+    const float r = v / sqrtf(in.x * in.x + in.y * in.y), p = in.x * r, q = in.y * r;
+    const float c = cosf(phi), s = sinf(phi);
+    return make_float3(p * c - q * s, q * c + p * s, y * sgn(in.z));
+}
+
+__device__ __forceinline__ float diffuse_probability_density(float3 in, float3 out) {
+    return in.z * out.z < pt_cuda_eps ? 0.0f : fabsf(out.z) / pt_cuda_pi;
+}
+
+__device__ __forceinline__ float3 diffuse_evaluate(float3 color, float3 in, float3 out) {
+    return (in.z * out.z > pt_cuda_eps ? 1.0f : 0.0f) * color * (1.0f / pt_cuda_pi);
+}
+
+// EmissiveLobe
+
+__device__ __forceinline__ float emissive_probability_density(float3 in, float3 out) {
+    return in.z * out.z < pt_cuda_eps ? 0.0f : out.z / pt_cuda_pi;
+}
+
+__device__ __forceinline__ float3 emissive_evaluate(float3 color, float3 in, float3 out) {
+    return (in.z * out.z > 0 ? 1.0f : 0.0f) * color;
+}
+
+// MicrofacetLobe, with distribution 0 for GGX and 1 for Beckmann
+
+__device__ float microfacet_D(int distribution, float roughness, float3 h) {
+    const float cos2 = sqr(h.z);
+    if (distribution == 1) {
+        if (cos2 < 1e-6f) {
+            return 0.0f;
+        }
+        const float a2 = sqr(roughness);
+        return expf((cos2 - 1) / (cos2 * a2)) / (pt_cuda_pi * a2 * sqr(cos2));
+    }
+    return sqr(roughness) / fmaxf(1e-6f, (pt_cuda_pi * sqr((sqr(roughness) - 1) * cos2 + 1.0f)));
+}
+
+__device__ float microfacet_Lambda(int distribution, float roughness, float3 w) {
+    const float cos2 = sqr(w.z), sin2 = fmaxf(0.0f, 1 - cos2);
+    if (sin2 == 0) {
+        return 0.0f;
+    }
+    const float tan2 = sin2 / fmaxf(1e-12f, cos2);
+    if (distribution == 1) {
+        const float b = 1.0f / (roughness * sqrtf(tan2));
+        return b < 1.6f ? (1 - 1.259f * b + 0.396f * b * b) / (3.535f * b + 2.181f * b * b) : 0.0f;
+    }
+    return 0.5f * (sqrtf(1 + sqr(roughness) * tan2) - 1);
+}
+
+__device__ __forceinline__ float microfacet_G1(int distribution, float roughness, float3 w) {
+    return 1.0f / (1.0f + microfacet_Lambda(distribution, roughness, w));
+}
+
+__device__ float2 sample_beckmann_visible_slope(float theta, float u, float v) {
+    u = fminf(1 - 1e-6f, fmaxf(1e-6f, u));
+    v = fminf(1 - 1e-6f, fmaxf(1e-6f, v));
+    if (theta < 1e-4f) {
+        const float r = sqrtf(-logf(1 - u)), phi = 2 * pt_cuda_pi * v;
+        return make_float2(r * cosf(phi), r * sinf(phi));
+    }
+    const float inv_sqrt_pi = 1.0f / sqrtf(pt_cuda_pi);
+    const float tan_theta = tanf(theta), cot_theta = 1.0f / tan_theta;
+    float a = -1, c = erff(cot_theta);
+    const float fit = 1 + theta * (-0.876f + theta * (0.4265f - 0.0594f * theta));
+    float b = c - (1 + c) * powf(1 - u, fit);
+    const float normalization = 1 / (1 + c + inv_sqrt_pi * tan_theta * expf(-cot_theta * cot_theta));
+    for (int i = 0; i < 10; i++) {
+        if (!(b >= a && b <= c)) {
+            b = 0.5f * (a + c);
+        }
+        const float x = erfinvf(b);
+        const float value = normalization * (1 + b + inv_sqrt_pi * tan_theta * expf(-x * x)) - u;
+        if (fabsf(value) < 1e-5f) {
+            break;
+        }
+        if (value > 0) {
+            c = b;
+        } else {
+            a = b;
+        }
+        b -= value / (normalization * (1 - x * tan_theta));
+    }
+    return make_float2(erfinvf(b), erfinvf(2 * v - 1));
+}
+
+__device__ float3 sample_visible_normal(int distribution, float roughness, float3 in, float u, float v) {
+    const float3 stretched = normalized(make_float3(roughness * in.x, roughness * in.y, in.z));
+    if (distribution == 1) {
+        const float2 slope = sample_beckmann_visible_slope(acosf(fminf(1.0f, fmaxf(-1.0f, stretched.z))), u, v);
+        const float len_xy = sqrtf(sqr(stretched.x) + sqr(stretched.y));
+        const float cos_phi = len_xy > 0 ? stretched.x / len_xy : 1.0f;
+        const float sin_phi = len_xy > 0 ? stretched.y / len_xy : 0.0f;
+        const float sx = (cos_phi * slope.x - sin_phi * slope.y) * roughness;
+        const float sy = (sin_phi * slope.x + cos_phi * slope.y) * roughness;
+        return normalized(make_float3(-sx, -sy, 1.0f));
+    }
+    const float len2 = sqr(stretched.x) + sqr(stretched.y);
+    const float3 t1 = len2 > 0 ? (1.0f / sqrtf(len2)) * make_float3(-stretched.y, stretched.x, 0)
+                               : make_float3(1, 0, 0);
+    const float3 t2 = cross(stretched, t1);
+    const float r = sqrtf(u), phi = 2 * pt_cuda_pi * v;
+    const float p1 = r * cosf(phi), s = 0.5f * (1 + stretched.z);
+    const float p2 = (1 - s) * sqrtf(fmaxf(0.0f, 1 - p1 * p1)) + s * r * sinf(phi);
+    const float3 n = p1 * t1 + p2 * t2 + sqrtf(fmaxf(0.0f, 1 - p1 * p1 - p2 * p2)) * stretched;
+    return normalized(make_float3(roughness * n.x, roughness * n.y, fmaxf(1e-6f, n.z)));
+}
+
+__device__ __forceinline__ float microfacet_F(float f0, float cos_theta) {
+    const float c = 1 - cos_theta;
+    return f0 + (1 - f0) * ((c * c) * (c * c) * c);
+}
+
+__device__ float microfacet_G(int distribution, float roughness, float3 in_dir, float3 out_dir, float3 h) {
+    if (dot(in_dir, h) * in_dir.z < pt_cuda_eps) {
+        return 0.0f;
+    }
+    if (distribution == 1) {
+        return microfacet_G1(distribution, roughness, in_dir) * microfacet_G1(distribution, roughness, out_dir);
+    }
+    const float a = 0.5f + roughness * 0.5f;
+    return 2.0f / (1 + sqrtf(1 + a * a * (sqr(1.0f / fmaxf(1e-6f, fabsf(in_dir.z))) - 1.0f)));
+}
+
+__device__ __forceinline__ float3 microfacet_reflect(float3 in, float3 h) {
+    h = normalized(h);
+    return in - 2.0f * (in - dot(in, h) * h);
+}
+
+__device__ __forceinline__ float get_multiple_scattering_probability(const SceneView &s, const PTCudaMaterial &m,
+                                                                     float roughness, float3 in) {
+    return m.energy_compensation ? 1 - get_albedo(s, m.distribution, fabsf(in.z), roughness) : 0.0f;
+}
+
+__device__ float3 microfacet_sample_direction(const SceneView &s, const PTCudaMaterial &m, float roughness,
+                                              float3 in, float u, float v) {
+    const float side = in.z < 0 ? -1.0f : 1.0f;
+    const float multiple = get_multiple_scattering_probability(s, m, roughness, in);
+    if (u < multiple) {
+        return random_diffuse(make_float3(0, 0, side), u / multiple, v);
+    }
+    u = (u - multiple) / (1 - multiple);
+    const float3 upper = make_float3(in.x, in.y, side * in.z);
+    const float3 out = microfacet_reflect(upper, sample_visible_normal(m.distribution, roughness, upper, u, v));
+    return make_float3(out.x, out.y, side * out.z);
+}
+
+__device__ float microfacet_probability_density(const SceneView &s, const PTCudaMaterial &m, float roughness,
+                                                float3 in, float3 out) {
+    if (in.z * out.z < pt_cuda_eps) {
+        return 0;
+    }
+    const float side = in.z < 0 ? -1.0f : 1.0f;
+    const float3 upper_in = make_float3(in.x, in.y, side * in.z), upper_out = make_float3(out.x, out.y, side * out.z);
+    const float3 h = normalized(upper_in + upper_out);
+    const float multiple = get_multiple_scattering_probability(s, m, roughness, in);
+    float pdf = multiple * upper_out.z / pt_cuda_pi;
+    if (dot(upper_in, h) > 0) {
+        pdf += (1 - multiple) * microfacet_G1(m.distribution, roughness, upper_in) *
+               microfacet_D(m.distribution, roughness, h) / fmaxf(1e-6f, 4.0f * upper_in.z);
+    }
+    return pdf;
+}
+
+__device__ float3 microfacet_evaluate(const SceneView &s, const PTCudaMaterial &m, float3 color, float roughness,
+                                      float3 in, float3 out) {
+    if (in.z * out.z < pt_cuda_eps) {
+        return make_float3(0, 0, 0);
+    }
+    const float3 h = normalized(in + out);
+    float factor = microfacet_F(m.f0, fmaxf(0.0f, dot(in, h))) * microfacet_G(m.distribution, roughness, in, out, h) *
+                   microfacet_D(m.distribution, roughness, h);
+    factor *= 1.0f / (4.0f * fmaxf(1e-5f, fabsf(in.z)) * fabsf(out.z));
+    if (m.energy_compensation) {
+        const float average = get_average_albedo(s, m.distribution, roughness);
+        if (average < 1 - 1e-4f) {
+            const float lost = (1 - get_albedo(s, m.distribution, fabsf(in.z), roughness)) *
+                               (1 - get_albedo(s, m.distribution, fabsf(out.z), roughness));
+            const float average_fresnel = m.f0 + (1 - m.f0) / 21.0f;
+            const float fresnel = sqr(average_fresnel) * average / (1 - average_fresnel * (1 - average));
+            factor += fresnel * lost / (pt_cuda_pi * (1 - average));
+        }
+    }
+    return color * factor;
+}
+
+__device__ __forceinline__ float get_roughness(const SceneView &s, const PTCudaMaterial &m, float2 uv) {
+    return fmaxf(1e-3f, get_parameter(s, m.roughness, uv).x);
+}
+
+// MaterialTable::sample(), probability_density() and evaluate_bsdf(), with the nesting of transparent
+// materials unrolled into the scale of their masks
+
+__device__ void sample_material(const SceneView &s, int id, float3 in, float u, float v, float2 uv, float3 &out,
+                                float3 &f, float &pdf, int &event) {
+    float scale = 1.0f;
+    while (s.materials[id].kind == PTCudaMaterial::TRANSPARENT) {
+        const PTCudaMaterial &m = s.materials[id];
+        const float alpha = get_parameter(s, m.color, uv).x;
+        if (u < alpha) {
+            out = -in;
+            f = make_float3(1, 1, 1) * (scale * alpha * fabsf(1.0f / in.z));
+            pdf = scale * alpha;
+            event = pt_cuda_delta | pt_cuda_index_matched;
+            return;
+        }
+        u = (u - alpha) / (1 - alpha);
+        scale *= 1 - alpha;
+        id = m.nested;
+    }
+    const PTCudaMaterial &m = s.materials[id];
+    const float3 color = get_parameter(s, m.color, uv);
+    event = 0;
+    if (m.kind == PTCudaMaterial::DIFFUSE) {
+        out = diffuse_sample_direction(in, u, v);
+        f = diffuse_evaluate(color, in, out);
+        pdf = out.z / pt_cuda_pi;
+    } else if (m.kind == PTCudaMaterial::MICROFACET) {
+        const float roughness = get_roughness(s, m, uv);
+        out = microfacet_sample_direction(s, m, roughness, in, u, v);
+        f = microfacet_evaluate(s, m, color, roughness, in, out);
+        pdf = microfacet_probability_density(s, m, roughness, in, out);
+    } else {
+        out = random_diffuse(make_float3(0, 0, in.z > 0 ? 1.0f : -1.0f), u, v);
+        f = emissive_evaluate(color, in, out);
+        pdf = emissive_probability_density(in, out);
+    }
+    f = scale * f;
+    pdf *= scale;
+}
+
+__device__ float material_probability_density(const SceneView &s, int id, float3 in, float3 out, float2 uv) {
+    float scale = 1.0f;
+    while (s.materials[id].kind == PTCudaMaterial::TRANSPARENT) {
+        scale *= 1 - get_parameter(s, s.materials[id].color, uv).x;
+        id = s.materials[id].nested;
+    }
+    const PTCudaMaterial &m = s.materials[id];
+    if (m.kind == PTCudaMaterial::DIFFUSE) {
+        return scale * diffuse_probability_density(in, out);
+    } else if (m.kind == PTCudaMaterial::MICROFACET) {
+        return scale * microfacet_probability_density(s, m, get_roughness(s, m, uv), in, out);
+    }
+    return scale * emissive_probability_density(in, out);
+}
+
+__device__ float3 material_evaluate(const SceneView &s, int id, float3 in, float3 out, float2 uv) {
+    float scale = 1.0f;
+    while (s.materials[id].kind == PTCudaMaterial::TRANSPARENT) {
+        scale *= 1 - get_parameter(s, s.materials[id].color, uv).x;
+        id = s.materials[id].nested;
+    }
+    const PTCudaMaterial &m = s.materials[id];
+    const float3 color = get_parameter(s, m.color, uv);
+    if (m.kind == PTCudaMaterial::DIFFUSE) {
+        return scale * diffuse_evaluate(color, in, out);
+    } else if (m.kind == PTCudaMaterial::MICROFACET) {
+        return scale * microfacet_evaluate(s, m, color, get_roughness(s, m, uv), in, out);
+    }
+    return scale * emissive_evaluate(color, in, out);
+}
+
+// The IntersectionInfo and BSDF frame of a hit
+struct Surface {
+    float3 pos, normal, geometry_normal;
+    // The shading frame
+    float3 tangent, bitangent;
+    float2 uv;
+    bool front;
+    int material;
+
+    __device__ float3 to_local(float3 w) const {
+        return make_float3(dot(w, tangent), dot(w, bitangent), dot(w, normal));
+    }
+
+    __device__ float3 to_world(float3 w) const {
+        return w.x * tangent + w.y * bitangent + w.z * normal;
+    }
+};
+
+__device__ Surface get_surface(const SceneView &s, const Hit &hit, float3 orig) {
+    const PTCudaTriangle &tri = s.triangles[hit.triangle];
+    const float3 v0 = load3(tri.v0), e1 = load3(tri.e1), e2 = load3(tri.e2), normal = load3(tri.normal);
+    Surface surface;
+    surface.pos = v0 + hit.u * e1 + hit.v * e2;
+    surface.front = dot(orig - v0, normal) > 0;
+    const float3 shading_normal = normalized(load3(tri.n0) + hit.u * load3(tri.n10) + hit.v * load3(tri.n20));
+    surface.uv = make_float2(tri.uv0[0] + hit.u * tri.uv10[0] + hit.v * tri.uv20[0],
+                             tri.uv0[1] + hit.u * tri.uv10[1] + hit.v * tri.uv20[1]);
+    surface.geometry_normal = surface.front ? normal : -normal;
+    surface.normal = surface.front ? shading_normal : -shading_normal;
+    const float3 u = normalized(e1);
+    surface.bitangent = normalized(cross((surface.front ? 1.0f : -1.0f) * surface.normal, u));
+    surface.tangent = normalized(cross(surface.bitangent, surface.normal));
+    surface.material = tri.material;
+    return surface;
+}
+
+// BSDF::evaluate(), which also rejects directions on different sides of the two normals
+__device__ float3 evaluate_bsdf(const SceneView &s, const Surface &surface, float3 in, float3 out) {
+    const float3 out_local = surface.to_local(out);
+    if (dot(surface.geometry_normal, out) * out_local.z <= 0.0f) {
+        return make_float3(0, 0, 0);
+    }
+    return material_evaluate(s, surface.material, surface.to_local(in), out_local, surface.uv);
+}
+
+__device__ Hit find_closest_hit(const SceneView &s, float3 orig, float3 dir) {
+    Hit hit;
+    hit.triangle = -1;
+    hit.t = FLT_MAX;
+    if (s.num_nodes == 0) {
+        return hit;
+    }
+    const float3 inv_dir = make_float3(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+    int stack[pt_cuda_stack_size];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const PTCudaBVHNode &node = s.nodes[stack[--top]];
+        if (node.count > 0) {
+            for (int k = node.first; k < node.first + node.count; k++) {
+                // Moeller-Trumbore, with the barycentrics of Scene::get_intersection_info()
+                const PTCudaTriangle &tri = s.triangles[k];
+                const float3 e1 = load3(tri.e1), e2 = load3(tri.e2);
+                const float3 p = cross(dir, e2);
+                const float det = dot(e1, p);
+                if (fabsf(det) < 1e-20f) {
+                    continue;
+                }
+                const float inv_det = 1.0f / det;
+                const float3 d = orig - load3(tri.v0);
+                const float u = dot(d, p) * inv_det;
+                if (u < 0 || u > 1) {
+                    continue;
+                }
+                const float3 q = cross(d, e1);
+                const float v = dot(dir, q) * inv_det;
+                if (v < 0 || u + v > 1) {
+                    continue;
+                }
+                const float t = dot(e2, q) * inv_det;
+                if (t > 0 && t < hit.t) {
+                    hit.triangle = k;
+                    hit.t = t;
+                    hit.u = u;
+                    hit.v = v;
+                }
+            }
+            continue;
+        }
+        // Both children, the nearer one on top
+        float entry[2];
+        for (int c = 0; c < 2; c++) {
+            const PTCudaBVHNode &child = s.nodes[node.first + c];
+            const float tx0 = (child.lower[0] - orig.x) * inv_dir.x, tx1 = (child.upper[0] - orig.x) * inv_dir.x;
+            const float ty0 = (child.lower[1] - orig.y) * inv_dir.y, ty1 = (child.upper[1] - orig.y) * inv_dir.y;
+            const float tz0 = (child.lower[2] - orig.z) * inv_dir.z, tz1 = (child.upper[2] - orig.z) * inv_dir.z;
+            const float t_near = fmaxf(fmaxf(fminf(tx0, tx1), fminf(ty0, ty1)), fmaxf(fminf(tz0, tz1), 0.0f));
+            const float t_far = fminf(fminf(fmaxf(tx0, tx1), fmaxf(ty0, ty1)), fminf(fmaxf(tz0, tz1), hit.t));
+            entry[c] = t_near <= t_far ? t_near : -1.0f;
+        }
+        const int nearer = entry[1] >= 0 && (entry[0] < 0 || entry[1] < entry[0]) ? 1 : 0;
+        if (entry[1 - nearer] >= 0 && top < pt_cuda_stack_size) {
+            stack[top++] = node.first + 1 - nearer;
+        }
+        if (entry[nearer] >= 0 && top < pt_cuda_stack_size) {
+            stack[top++] = node.first + nearer;
+        }
+    }
+    return hit;
+}
+
+// The first triangle of the light CDF above r
+__device__ int sample_light(const SceneView &s, float r) {
+    int lo = 0, hi = s.num_lights - 1;
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (s.light_cdf[mid] > r) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return s.lights[lo];
+}
+
+__device__ __forceinline__ bool path_length_in_range(const PTCudaParameters &p, int path_length) {
+    return p.min_path_length <= path_length && path_length <= p.max_path_length;
+}
+
+__global__ void start_paths(int n, const PTCudaRay *rays, unsigned long long first_sample, PathState *paths,
+                            int *counts) {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i == 0) {
+        counts[0] = n;
+        counts[1] = 0;
+        counts[2] = 0;
+    }
+    if (i >= n) {
+        return;
+    }
+    const unsigned long long sample = first_sample + i;
+    PathState path;
+    path.orig = load3(rays[i].orig);
+    path.dir = load3(rays[i].dir);
+    path.importance = make_float3(1, 1, 1);
+    path.sample = i;
+    path.path_length = 1;
+    path.depth = 1;
+    path.rng = mix_bits((unsigned int)sample ^ mix_bits((unsigned int)(sample >> 32) + 0x9e3779b9u));
+    paths[i] = path;
+}
+
+__global__ void intersect_paths(SceneView s, const int *count, const PathState *paths, Hit *hits) {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i < *count) {
+        hits[i] = find_closest_hit(s, paths[i].orig, paths[i].dir);
+    }
+}
+
+// One vertex of trace(): emission, the rays of direct lighting, and the scattered path, if it goes on
+__global__ void shade_paths(SceneView s, PTCudaParameters parameters, const int *count, const PathState *paths,
+                            const Hit *hits, PathState *next_paths, int *next_count, DirectRay *direct_rays,
+                            int *direct_count, float *radiance) {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= *count) {
+        return;
+    }
+    PathState path = paths[i];
+    const Hit hit = hits[i];
+    float *sample_radiance = radiance + 3 * path.sample;
+    float3 ret = make_float3(0, 0, 0);
+    bool goes_on = false;
+    if (hit.triangle < 0) {
+        if (s.environment >= 0 && (path.path_length == 1 || !parameters.direct_lighting)) {
+            ret = path.importance * get_environment(s, path.dir);
+        }
+    } else {
+        const Surface surface = get_surface(s, hit, path.orig);
+        const float3 in_dir = -path.dir;
+        if (s.materials[surface.material].emissive) {
+            if (surface.front && (path.path_length == 1 || !parameters.direct_lighting) &&
+                path_length_in_range(parameters, path.path_length)) {
+                ret = path.importance * evaluate_bsdf(s, surface, surface.normal, in_dir);
+            }
+        } else {
+            const float3 in_local = surface.to_local(in_dir);
+            float3 out_local, f;
+            float pdf;
+            int event;
+            const float u = next_random(path.rng), v = next_random(path.rng);
+            sample_material(s, surface.material, in_local, u, v, surface.uv, out_local, f, pdf, event);
+            const float3 out_dir = surface.to_world(out_local);
+            if (!(event & pt_cuda_index_matched)) {
+                path.path_length += 1;
+                if (parameters.direct_lighting && path_length_in_range(parameters, path.path_length)) {
+                    // One light for all light samples, as calculate_direct_lighting() chooses
+                    const int light = s.num_lights > 0 ? sample_light(s, next_random(path.rng)) : -1;
+                    const int samples = parameters.direct_lighting_bsdf + parameters.direct_lighting_light;
+                    for (int k = 0; k < samples; k++) {
+                        const bool from_bsdf = k < parameters.direct_lighting_bsdf;
+                        DirectRay ray;
+                        float3 light_f;
+                        int light_event = 0;
+                        if (from_bsdf) {
+                            float3 light_out_local;
+                            const float lu = next_random(path.rng), lv = next_random(path.rng);
+                            sample_material(s, surface.material, in_local, lu, lv, surface.uv, light_out_local,
+                                            light_f, ray.bsdf_pdf, light_event);
+                            if (light_event & pt_cuda_index_matched) {
+                                continue;
+                            }
+                            ray.dir = surface.to_world(light_out_local);
+                        } else {
+                            if (light < 0) {
+                                continue;
+                            }
+                            const PTCudaTriangle &tri = s.triangles[light];
+                            const float3 v0 = load3(tri.v0);
+                            if (dot(surface.pos - v0, load3(tri.normal)) < 0) {
+                                continue;
+                            }
+                            float x = next_random(path.rng), y = next_random(path.rng);
+                            if (x + y > 1) {
+                                x = 1 - x;
+                                y = 1 - y;
+                            }
+                            const float3 point = v0 + x * load3(tri.e1) + y * load3(tri.e2);
+                            ray.dir = normalized(point - surface.pos);
+                            light_f = evaluate_bsdf(s, surface, in_dir, ray.dir);
+                            ray.bsdf_pdf = material_probability_density(s, surface.material, in_local,
+                                                                        surface.to_local(ray.dir), surface.uv);
+                        }
+                        ray.orig = surface.pos + ray.dir * 1e-3f;
+                        ray.pos = surface.pos;
+                        ray.throughput = path.importance * light_f * fabsf(dot(ray.dir, surface.normal));
+                        ray.sample = path.sample;
+                        ray.flags = (from_bsdf ? pt_cuda_from_bsdf : 0) |
+                                    (light_event & pt_cuda_delta ? pt_cuda_delta_bsdf : 0);
+                        ray.rng = mix_bits(path.rng + k);
+                        direct_rays[atomicAdd(direct_count, 1)] = ray;
+                    }
+                }
+            }
+            const float c = fabsf(dot(out_dir, surface.normal));
+            if (pdf >= 1e-10f) {
+                path.orig = surface.pos + out_dir * 1e-4f;
+                path.dir = out_dir;
+                path.importance = path.importance * f * (c / pdf);
+                goes_on = true;
+                if (parameters.russian_roulette) {
+                    const float p = luminance(path.importance);
+                    if (p <= 1) {
+                        if (next_random(path.rng) < p) {
+                            path.importance = path.importance * (1.0f / p);
+                        } else {
+                            goes_on = false;
+                        }
+                    }
+                }
+                path.depth++;
+                goes_on = goes_on && path.path_length <= parameters.max_path_length &&
+                          path.depth <= pt_cuda_max_depth;
+            }
+        }
+    }
+    sample_radiance[0] += ret.x;
+    sample_radiance[1] += ret.y;
+    sample_radiance[2] += ret.z;
+    if (goes_on) {
+        next_paths[atomicAdd(next_count, 1)] = path;
+    }
+}
+
+// The shadow rays of direct lighting, through index-matched surfaces as get_attenuation() lets them, and their
+// contributions with the MIS weights of calculate_direct_lighting()
+__global__ void trace_direct_rays(SceneView s, PTCudaParameters parameters, const int *count,
+                                  const DirectRay *direct_rays, float *radiance) {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= *count) {
+        return;
+    }
+    DirectRay ray = direct_rays[i];
+    const float bsdf_weight = parameters.direct_lighting_bsdf * ray.bsdf_pdf;
+    const bool from_bsdf = (ray.flags & pt_cuda_from_bsdf) != 0;
+    float3 att = make_float3(1, 1, 1);
+    float3 contribution = make_float3(0, 0, 0);
+    for (int pass = 0; pass < pt_cuda_max_passes; pass++) {
+        const Hit hit = find_closest_hit(s, ray.orig, ray.dir);
+        if (hit.triangle < 0) {
+            // The environment map is only ever sampled through the BSDF
+            if (s.environment >= 0 && s.environment_lighting && from_bsdf && bsdf_weight > 0) {
+                contribution = (1.0f / bsdf_weight) * (ray.throughput * att * get_environment(s, ray.dir));
+            }
+            break;
+        }
+        const Surface surface = get_surface(s, hit, ray.orig);
+        if (s.materials[surface.material].emissive) {
+            if (!surface.front) {
+                break;
+            }
+            const PTCudaTriangle &tri = s.triangles[hit.triangle];
+            const float c = fabsf(dot(ray.dir, load3(tri.normal)));
+            const float3 dist = surface.pos - ray.pos;
+            const float light_p = dot(dist, dist) / fmaxf(1e-20f, tri.area * c) * tri.light_pdf;
+            const float3 emission = evaluate_bsdf(s, surface, surface.normal, -ray.dir);
+            const float weight = from_bsdf && (ray.flags & pt_cuda_delta_bsdf)
+                                 ? bsdf_weight : bsdf_weight + parameters.direct_lighting_light * light_p;
+            if (weight > 0) {
+                contribution = (1.0f / weight) * (ray.throughput * emission * att);
+            }
+            break;
+        }
+        float3 out, f;
+        float pdf;
+        int event;
+        const float3 in_local = surface.to_local(-ray.dir);
+        const float u = next_random(ray.rng), v = next_random(ray.rng);
+        sample_material(s, surface.material, in_local, u, v, surface.uv, out, f, pdf, event);
+        if (!(event & pt_cuda_index_matched)) {
+            break;
+        }
+        att = att * f * fabsf(in_local.z);
+        ray.orig = surface.pos + ray.dir * 1e-3f;
+    }
+    float *sample_radiance = radiance + 3 * ray.sample;
+    atomicAdd(sample_radiance, contribution.x);
+    atomicAdd(sample_radiance + 1, contribution.y);
+    atomicAdd(sample_radiance + 2, contribution.z);
+}
+
+__global__ void advance_queues(int *counts, int current) {
+    counts[current] = 0;
+    counts[2] = 0;
+}
+
+// clamp_luminance() and write_path_contribution(), which drops samples that are not finite
+__global__ void accumulate_samples(int n, PTCudaParameters parameters, const PTCudaRay *rays,
+                                   const float *radiance, float *sums, float *counts) {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n) {
+        return;
+    }
+    float3 c = load3(radiance + 3 * i);
+    const float lum = luminance(c);
+    if (parameters.luminance_clamping > 0 && lum > parameters.luminance_clamping) {
+        c = (parameters.luminance_clamping / lum) * c;
+    }
+    if (!isfinite(c.x) || !isfinite(c.y) || !isfinite(c.z)) {
+        return;
+    }
+    const int pixel = rays[i].pixel;
+    atomicAdd(sums + 3 * pixel, c.x);
+    atomicAdd(sums + 3 * pixel + 1, c.y);
+    atomicAdd(sums + 3 * pixel + 2, c.z);
+    atomicAdd(counts + pixel, 1.0f);
+}
+
+static int get_num_launch_blocks(int n) {
+    return std::max(1, (n + pt_cuda_threads - 1) / pt_cuda_threads);
+}
+
+struct PTCudaRenderer::Implementation {
+    PTCudaParameters parameters;
+    SceneView view;
+    DeviceArray<PTCudaTriangle> triangles;
+    DeviceArray<PTCudaBVHNode> nodes;
+    DeviceArray<PTCudaMaterial> materials;
+    DeviceArray<PTCudaRaster> rasters;
+    DeviceArray<float> texels, light_cdf, albedo;
+    DeviceArray<int> lights;
+    // Of the stage: the camera rays, the two path queues, the hits of the current one, and the direct rays
+    DeviceArray<PTCudaRay> rays;
+    DeviceArray<PathState> paths[2];
+    DeviceArray<Hit> hits;
+    DeviceArray<DirectRay> direct_rays;
+    // The lengths of the two path queues and of the direct rays
+    DeviceArray<int> counts;
+    DeviceArray<float> radiance;
+    // The accumulated image
+    DeviceArray<float> sums, sample_counts;
+    cudaStream_t stream = nullptr;
+    cudaEvent_t accumulation_ready = nullptr;
+    // Pinned: the length of the current queue, and the accumulation as of the last stage
+    int *host_count = nullptr;
+    float *host_sums = nullptr, *host_sample_counts = nullptr;
+    int num_samples = 0;
+    // The queue of the next bounce, and the bounces queued so far
+    int current = 0;
+    int depth = 0;
+
+    Implementation() {
+        TC_CUDA_CHECK(cudaStreamCreate(&stream));
+        TC_CUDA_CHECK(cudaEventCreateWithFlags(&accumulation_ready, cudaEventDisableTiming));
+        TC_CUDA_CHECK(cudaMallocHost(&host_count, sizeof(int)));
+        counts.resize(3);
+    }
+
+    ~Implementation() {
+        cudaFreeHost(host_sample_counts);
+        cudaFreeHost(host_sums);
+        cudaFreeHost(host_count);
+        cudaEventDestroy(accumulation_ready);
+        cudaStreamDestroy(stream);
+    }
+
+    int get_direct_rays_per_path() const {
+        return parameters.direct_lighting ? parameters.direct_lighting_bsdf + parameters.direct_lighting_light : 0;
+    }
+
+    // Launched over the capacity of the queues; the kernels read their lengths on the device
+    void queue_bounce() {
+        const int next = 1 - current;
+        const int blocks = get_num_launch_blocks(num_samples);
+        intersect_paths<<<blocks, pt_cuda_threads, 0, stream>>>(view, counts.data() + current,
+                                                                 paths[current].data(), hits.data());
+        shade_paths<<<blocks, pt_cuda_threads, 0, stream>>>(
+                view, parameters, counts.data() + current, paths[current].data(), hits.data(), paths[next].data(),
+                counts.data() + next, direct_rays.data(), counts.data() + 2, radiance.data());
+        if (get_direct_rays_per_path() > 0) {
+            trace_direct_rays<<<get_num_launch_blocks(num_samples * get_direct_rays_per_path()), pt_cuda_threads,
+                                0, stream>>>(view, parameters, counts.data() + 2, direct_rays.data(),
+                                             radiance.data());
+        }
+        advance_queues<<<1, 1, 0, stream>>>(counts.data(), current);
+        current = next;
+        depth++;
+    }
+};
+
+PTCudaRenderer::PTCudaRenderer() : impl(new Implementation()) {
+}
+
+PTCudaRenderer::~PTCudaRenderer() {
+}
+
+void PTCudaRenderer::initialize(const PTCudaParameters &parameters) {
+    Implementation &s = *impl;
+    s.parameters = parameters;
+    const int pixels = parameters.width * parameters.height;
+    s.sums.resize(3 * pixels);
+    s.sample_counts.resize(pixels);
+    cudaFreeHost(s.host_sample_counts);
+    cudaFreeHost(s.host_sums);
+    TC_CUDA_CHECK(cudaMallocHost(&s.host_sums, 3 * pixels * sizeof(float)));
+    TC_CUDA_CHECK(cudaMallocHost(&s.host_sample_counts, pixels * sizeof(float)));
+    reset();
+}
+
+void PTCudaRenderer::set_scene(const PTCudaScene &scene) {
+    Implementation &s = *impl;
+    s.triangles.upload(scene.triangles.data(), scene.triangles.size());
+    s.nodes.upload(scene.nodes.data(), scene.nodes.size());
+    s.materials.upload(scene.materials.data(), scene.materials.size());
+    s.rasters.upload(scene.rasters.data(), scene.rasters.size());
+    s.texels.upload(scene.texels.data(), scene.texels.size());
+    s.lights.upload(scene.lights.data(), scene.lights.size());
+    s.light_cdf.upload(scene.light_cdf.data(), scene.light_cdf.size());
+    s.albedo.upload(scene.albedo.data(), scene.albedo.size());
+    SceneView &view = s.view;
+    view.triangles = s.triangles.data();
+    view.nodes = s.nodes.data();
+    view.num_nodes = (int)scene.nodes.size();
+    view.materials = s.materials.data();
+    view.rasters = s.rasters.data();
+    view.texels = s.texels.data();
+    view.lights = s.lights.data();
+    view.light_cdf = s.light_cdf.data();
+    view.num_lights = (int)scene.lights.size();
+    view.albedo_resolution = scene.albedo_resolution;
+    view.albedo = s.albedo.data();
+    view.environment = scene.environment;
+    view.environment_lighting = scene.environment_lighting;
+}
+
+void PTCudaRenderer::begin_stage(const std::vector<PTCudaRay> &rays, unsigned long long first_sample) {
+    Implementation &s = *impl;
+    const int n = (int)rays.size();
+    s.num_samples = n;
+    s.rays.upload(rays.data(), n);
+    for (auto &queue : s.paths) {
+        queue.resize(n);
+    }
+    s.hits.resize(n);
+    s.direct_rays.resize((std::size_t)n * s.get_direct_rays_per_path());
+    s.radiance.resize(3 * n);
+    TC_CUDA_CHECK(cudaMemsetAsync(s.radiance.data(), 0, 3 * n * sizeof(float), s.stream));
+    start_paths<<<get_num_launch_blocks(n), pt_cuda_threads, 0, s.stream>>>(n, s.rays.data(), first_sample,
+                                                                             s.paths[0].data(), s.counts.data());
+    s.current = 0;
+    s.depth = 0;
+    // Every bounce that does not pass an index-matched surface lengthens the path
+    for (int b = 0; b < s.parameters.max_path_length; b++) {
+        s.queue_bounce();
+    }
+    TC_CUDA_CHECK(cudaGetLastError());
+}
+
+void PTCudaRenderer::finish_stage() {
+    Implementation &s = *impl;
+    while (s.depth < pt_cuda_max_depth) {
+        TC_CUDA_CHECK(cudaMemcpyAsync(s.host_count, s.counts.data() + s.current, sizeof(int),
+                                      cudaMemcpyDeviceToHost, s.stream));
+        TC_CUDA_CHECK(cudaStreamSynchronize(s.stream));
+        if (*s.host_count == 0) {
+            break;
+        }
+        for (int b = 0; b < pt_cuda_bounce_chunk; b++) {
+            s.queue_bounce();
+        }
+    }
+    const int pixels = s.parameters.width * s.parameters.height;
+    accumulate_samples<<<get_num_launch_blocks(s.num_samples), pt_cuda_threads, 0, s.stream>>>(
+            s.num_samples, s.parameters, s.rays.data(), s.radiance.data(), s.sums.data(), s.sample_counts.data());
+    TC_CUDA_CHECK(cudaMemcpyAsync(s.host_sums, s.sums.data(), 3 * pixels * sizeof(float), cudaMemcpyDeviceToHost,
+                                  s.stream));
+    TC_CUDA_CHECK(cudaMemcpyAsync(s.host_sample_counts, s.sample_counts.data(), pixels * sizeof(float),
+                                  cudaMemcpyDeviceToHost, s.stream));
+    TC_CUDA_CHECK(cudaEventRecord(s.accumulation_ready, s.stream));
+    TC_CUDA_CHECK(cudaGetLastError());
+}
+
+void PTCudaRenderer::get_accumulation(std::vector<float> &sums, std::vector<float> &counts) {
+    Implementation &s = *impl;
+    const int pixels = s.parameters.width * s.parameters.height;
+    TC_CUDA_CHECK(cudaEventSynchronize(s.accumulation_ready));
+    sums.assign(s.host_sums, s.host_sums + 3 * pixels);
+    counts.assign(s.host_sample_counts, s.host_sample_counts + pixels);
+}
+
+void PTCudaRenderer::reset() {
+    Implementation &s = *impl;
+    const int pixels = s.parameters.width * s.parameters.height;
+    TC_CUDA_CHECK(cudaStreamSynchronize(s.stream));
+    s.sums.set_zero();
+    s.sample_counts.set_zero();
+    std::fill(s.host_sums, s.host_sums + 3 * pixels, 0.0f);
+    std::fill(s.host_sample_counts, s.host_sample_counts + pixels, 0.0f);
+    TC_CUDA_CHECK(cudaEventRecord(s.accumulation_ready, s.stream));
+}
+
+}
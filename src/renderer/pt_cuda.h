@@ -0,0 +1,146 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+// Device side of the "pt_cuda" renderer. This header is shared by nvcc and the host compiler, so it only uses
+// plain types: vectors are float[3] and uvs float[2].
+
+#include <memory>
+#include <vector>
+
+namespace taichi {
+
+// A Triangle of the scene, as the device needs it
+struct PTCudaTriangle {
+    // v0, v1 - v0 and v2 - v0
+    float v0[3], e1[3], e2[3];
+    float normal[3];
+    // Of the interpolated normals and uvs, see Triangle::get_normal() and Triangle::get_uv()
+    float n0[3], n10[3], n20[3];
+    float uv0[2], uv10[2], uv20[2];
+    float area;
+    // In PTCudaScene::materials
+    int material;
+    // Of choosing the triangle when sampling a light, 0 for triangles that do not emit
+    float light_pdf;
+};
+
+struct PTCudaBVHNode {
+    float lower[3];
+    // The first triangle of leaves, and the first child of interior nodes, which is followed by the second one
+    int first;
+    float upper[3];
+    // Triangles of leaves, 0 for interior nodes
+    int count;
+};
+
+// A MaterialParameter: its value if constant, and bilinear in a raster of the texture otherwise
+struct PTCudaParameter {
+    float value[3];
+    // In PTCudaScene::rasters, or -1
+    int raster;
+};
+
+// width x height texels from texels[3 * offset], texel (i, j) at uv ((i + 0.5) / width, (j + 0.5) / height)
+// in texels[3 * (offset + i * height + j)], repeated outside [0, 1)
+struct PTCudaRaster {
+    int offset;
+    int width, height;
+};
+
+// A CompiledMaterial
+struct PTCudaMaterial {
+    enum Kind {
+        DIFFUSE = 0,
+        MICROFACET = 1,
+        EMISSIVE = 2,
+        TRANSPARENT = 3,
+    };
+    int kind;
+    PTCudaParameter color, roughness;
+    // 0 for GGX, 1 for Beckmann
+    int distribution;
+    float f0;
+    // With the multiple scattering lobe of MicrofacetAlbedo
+    bool energy_compensation;
+    // Of transparent materials
+    int nested;
+    bool emissive;
+};
+
+struct PTCudaScene {
+    // In the order of the BVH leaves
+    std::vector<PTCudaTriangle> triangles;
+    // The root first
+    std::vector<PTCudaBVHNode> nodes;
+    std::vector<PTCudaMaterial> materials;
+    std::vector<PTCudaRaster> rasters;
+    std::vector<float> texels;
+    // The emitting triangles, and the cumulative probabilities of choosing them
+    std::vector<int> lights;
+    std::vector<float> light_cdf;
+    // MicrofacetAlbedo tables, of GGX then Beckmann: albedo_resolution^2 directional albedos, as stored there,
+    // followed by albedo_resolution averages
+    int albedo_resolution = 0;
+    std::vector<float> albedo;
+    // A raster of the environment map over (phi / (2 pi), theta / pi), with y up, or -1
+    int environment = -1;
+    // Whether the environment map lights the scene besides being seen, as with a positive envmap_sample_prob
+    bool environment_lighting = false;
+};
+
+struct PTCudaParameters {
+    int width, height;
+    int min_path_length, max_path_length;
+    bool russian_roulette;
+    bool direct_lighting;
+    int direct_lighting_bsdf, direct_lighting_light;
+    float luminance_clamping;
+};
+
+// A camera ray of a sample
+struct PTCudaRay {
+    float orig[3], dir[3];
+    // x * height + y
+    int pixel;
+};
+
+// Wavefront path tracing: the paths of a stage advance together, one kernel per phase of a bounce (closest hits,
+// shading, and the shadow rays of direct lighting), on queues that only keep the live paths. The scene is
+// uploaded once; per stage only the camera rays go up. The accumulated image stays on the device, and a copy
+// of it streams back after every stage.
+class PTCudaRenderer {
+public:
+    PTCudaRenderer();
+
+    ~PTCudaRenderer();
+
+    void initialize(const PTCudaParameters &parameters);
+
+    void set_scene(const PTCudaScene &scene);
+
+    // Queues the first bounces of one path per ray, of samples first_sample, first_sample + 1, ... for the random
+    // numbers, so that the host can prepare the next stage meanwhile
+    void begin_stage(const std::vector<PTCudaRay> &rays, unsigned long long first_sample);
+
+    // Traces the paths to their ends and accumulates them
+    void finish_stage();
+
+    // Per pixel, the sum of the samples and their number, as of the last finished stage
+    void get_accumulation(std::vector<float> &sums, std::vector<float> &counts);
+
+    void reset();
+
+protected:
+    struct Implementation;
+    std::unique_ptr<Implementation> impl;
+};
+
+}
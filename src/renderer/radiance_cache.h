@@ -0,0 +1,123 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <taichi/math/linalg.h>
+#include <taichi/math/math_util.h>
+#include <taichi/system/threading.h>
+
+TC_NAMESPACE_BEGIN
+
+// Outgoing radiance of surfaces, averaged over the cells of a world-space grid and, within cells, over the
+// six axis directions closest to the normal, which keeps the two sides of thin walls apart. Cells are
+// entries of a fixed-size hash table, inserted by many threads at once without locks; cells that find no
+// entry within max_probes slots are not cached.
+class RadianceCache {
+public:
+    static const int max_probes = 8;
+
+    // num_entries is rounded up to a power of two
+    void initialize(const Vector3 &lower, real cell_size, int num_entries) {
+        this->lower = lower;
+        this->cell_size = cell_size;
+        inv_cell_size = 1.0f / cell_size;
+        int bits = 0;
+        while ((1 << bits) < num_entries) {
+            bits++;
+        }
+        mask = (1u << bits) - 1;
+        entries.reset(new Entry[mask + 1]);
+    }
+
+    void record(const Vector3 &pos, const Vector3 &normal, const Vector3 &radiance) {
+        if (!is_normal(radiance)) {
+            return;
+        }
+        Entry *entry = find(get_key(pos, normal), true);
+        if (entry == nullptr) {
+            return;
+        }
+        for (int k = 0; k < 3; k++) {
+            entry->sum[k].add(radiance[k]);
+        }
+        entry->count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // The radiance of the cell of pos, jittered by up to half a cell along every axis by u, so that
+    // averaging over lookups blends neighbouring cells. Fails where the cell has fewer than min_count records.
+    bool lookup(const Vector3 &pos, const Vector3 &normal, const Vector3 &u, int min_count,
+                Vector3 &radiance) const {
+        const Entry *entry = find(get_key(pos + (u - Vector3(0.5f)) * cell_size, normal), false);
+        if (entry == nullptr) {
+            return false;
+        }
+        const int count = entry->count.load(std::memory_order_relaxed);
+        if (count < std::max(min_count, 1)) {
+            return false;
+        }
+        radiance = Vector3(entry->sum[0], entry->sum[1], entry->sum[2]) * (1.0f / count);
+        return true;
+    }
+
+private:
+    struct Entry {
+        // 0 for free entries, as keys are never 0
+        std::atomic<uint64> key;
+        RelaxedAtomic<real> sum[3];
+        std::atomic<int> count;
+
+        Entry() : key(0), count(0) {}
+    };
+
+    Vector3 lower;
+    real cell_size, inv_cell_size;
+    unsigned int mask;
+    std::unique_ptr<Entry[]> entries;
+
+    // 20 bits per cell coordinate, and the axis direction in the lowest three bits, plus one
+    uint64 get_key(const Vector3 &pos, const Vector3 &normal) const {
+        const Vector3 p = (pos - lower) * inv_cell_size;
+        uint64 key = 0;
+        for (int i = 0; i < 3; i++) {
+            key = key << 20 | ((uint64)(int64)std::floor(p[i]) & ((1 << 20) - 1));
+        }
+        const Vector3 a(std::abs(normal.x), std::abs(normal.y), std::abs(normal.z));
+        const int axis = a.x >= a.y && a.x >= a.z ? 0 : (a.y >= a.z ? 1 : 2);
+        return (key << 3 | (uint64)(axis * 2 + (normal[axis] < 0))) + 1;
+    }
+
+    // Entries are atomic, so even lookups may go through a const cache
+    Entry *find(uint64 key, bool insert) const {
+        const unsigned int slot = (unsigned int)hash64(key);
+        for (int i = 0; i < max_probes; i++) {
+            Entry &entry = entries[(slot + i) & mask];
+            uint64 current = entry.key.load(std::memory_order_acquire);
+            if (current == 0 && insert) {
+                // Either this thread claims the entry or current becomes the key of whoever did
+                if (entry.key.compare_exchange_strong(current, key, std::memory_order_acq_rel)) {
+                    return &entry;
+                }
+            }
+            if (current == key) {
+                return &entry;
+            }
+            if (current == 0) {
+                return nullptr;
+            }
+        }
+        return nullptr;
+    }
+};
+
+TC_NAMESPACE_END
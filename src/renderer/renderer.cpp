@@ -8,15 +8,23 @@
 *******************************************************************************/
 
 #include <taichi/visual/renderer.h>
+#include <taichi/visual/bsdf.h>
+#include <taichi/visual/sampler.h>
+#include <taichi/system/threading.h>
+#include <taichi/system/tracer.h>
+#include <taichi/io/image_writer.h>
 
 TC_NAMESPACE_BEGIN
 
 void Renderer::initialize(const Config &config) {
-    this->ray_intersection = create_instance<RayIntersection>(config.get("ray_intersection", "embree"));
-    sg = std::make_shared<SceneGeometry>(scene, ray_intersection);
+    sg = scene->get_geometry(config.get("ray_intersection", "embree"));
+    this->ray_intersection = sg->get_ray_intersection();
     this->min_path_length = config.get_int("min_path_length");
     this->max_path_length = config.get_int("max_path_length");
     this->num_threads = config.get("num_threads", 1);
+    profiler.enabled = config.get("profile", true);
+    this->print_statistics = config.get("print_statistics", false);
+    stage_statistics = total_statistics = RenderStatistics();
     assert_info(min_path_length <= max_path_length, "min_path_length > max_path_length");
 }
 
@@ -27,21 +35,161 @@ void Renderer::set_scene(std::shared_ptr<Scene> scene) {
     this->height = camera->get_height();
 }
 
-void Renderer::write_output(std::string fn) {
-    auto tmp = get_output();
-    Vector3 sum(0.0f);
-    for (auto p : tmp) {
-        sum += p;
+void Renderer::update_geometry() {
+    sg->update();
+}
+
+void Renderer::render_counted_stage() {
+    TC_TRACE_SCOPE("render_stage");
+    const RenderStatistics start = RenderCounters::get_statistics();
+    render_stage();
+    stage_statistics = RenderCounters::get_statistics() - start;
+    total_statistics += stage_statistics;
+    if (print_statistics) {
+        stage_statistics.print("stage");
+        total_statistics.print("total");
     }
-    auto scale = luminance(sum) / luminance(Vector3(1.0f)) / tmp.get_width() / tmp.get_height() / 0.18f;
-    for (auto ind : tmp.get_region()) {
-        for (int i = 0; i < 3; i++) {
-            tmp[ind][i] = std::pow(clamp(tmp[ind][i] / scale, 0.0f, 1.0f), 1 / 2.2f);
+}
+
+template <typename T>
+RenderProgress Renderer::render_stages(real max_seconds, const T &done) {
+    RenderProgress progress;
+    const double start = Time::get_time();
+    const long long start_samples = get_num_samples();
+    const RenderStatistics start_statistics = total_statistics;
+    double elapsed = 0, last_stage = 0;
+    while (!is_converged()) {
+        // Stages are assumed to take as long as the last one
+        if (progress.stages > 0 && elapsed + last_stage > max_seconds) {
+            break;
         }
+        render_counted_stage();
+        progress.stages++;
+        const double now = Time::get_time() - start;
+        last_stage = now - elapsed;
+        elapsed = now;
+        if (done()) {
+            break;
+        }
+    }
+    progress.seconds = (real)elapsed;
+    progress.samples_per_pixel = (real)get_num_samples() / (width * height);
+    if (elapsed > 0) {
+        progress.samples_per_second = real((get_num_samples() - start_samples) / elapsed);
     }
-    tmp.write(fn);
+    progress.statistics = total_statistics - start_statistics;
+    progress.rays_per_second = (real)progress.statistics.get_rays_per_second();
+    progress.converged = is_converged();
+    return progress;
 }
 
+RenderProgress Renderer::render_for(real seconds) {
+    return render_stages(seconds, []() { return false; });
+}
+
+RenderProgress Renderer::render_until(real relative_error, real max_seconds) {
+    real error = -1;
+    RenderProgress progress = render_stages(max_seconds, [&]() {
+        error = get_relative_error();
+        return error >= 0 && error <= relative_error;
+    });
+    progress.relative_error = error;
+    return progress;
+}
+
+static const int checkpoint_magic = 0x54434b50;
+
+void Renderer::save_checkpoint(const std::string &fn) {
+    // Written next to fn and renamed over it, so that a render stopped while writing keeps its last checkpoint
+    const std::string temp_fn = fn + ".tmp";
+    {
+        BinaryFileStreamOutput os(temp_fn);
+        os << checkpoint_magic << width << height << get_rand_state();
+        write_checkpoint(os);
+        os.close();
+    }
+    assert_info(std::rename(temp_fn.c_str(), fn.c_str()) == 0, "Can not write checkpoint " + fn);
+}
+
+void Renderer::load_checkpoint(const std::string &fn) {
+    BinaryFileStreamInput is(fn);
+    int magic, checkpoint_width, checkpoint_height;
+    is >> magic >> checkpoint_width >> checkpoint_height;
+    assert_info(magic == checkpoint_magic, fn + " is not a render checkpoint");
+    assert_info(checkpoint_width == width && checkpoint_height == height, "Checkpoint resolution mismatch");
+    is >> get_rand_state();
+    read_checkpoint(is);
+}
+
+FeatureBuffers Renderer::get_features(int samples_per_pixel) {
+    assert_info(samples_per_pixel > 0, "Feature buffers need at least a sample per pixel");
+    FeatureBuffers features;
+    features.albedo.initialize(width, height, Vector3(0.0f));
+    features.normal.initialize(width, height, Vector3(0.0f));
+    features.depth.initialize(width, height, 0.0f);
+    auto sampler = create_instance<Sampler>("prand");
+    const Vector2 size(1.0f / width, 1.0f / height);
+    const real inv_samples = 1.0f / samples_per_pixel;
+    ThreadedTaskManager::run([&](int j) {
+        for (int i = 0; i < width; i++) {
+            Vector3 albedo(0.0f), normal(0.0f);
+            real depth = 0;
+            for (int s = 0; s < samples_per_pixel; s++) {
+                RandomStateSequence rand(sampler, ((long long)j * width + i) * samples_per_pixel + s);
+                const Vector2 offset = (Vector2(i, j) + rand.next2()) * size;
+                Ray ray = camera->sample(offset, size, rand);
+                IntersectionInfo info = sg->query(ray);
+                if (!info.intersected) {
+                    albedo += Vector3(1.0f);
+                    continue;
+                }
+                normal += info.normal;
+                depth += info.dist;
+                BSDF bsdf(scene, info);
+                if (bsdf.is_emissive()) {
+                    albedo += Vector3(1.0f);
+                    continue;
+                }
+                Vector3 out_dir, f;
+                real pdf;
+                SurfaceEvent event;
+                const Vector2 u = rand.next2();
+                bsdf.sample(-ray.dir, u.x, u.y, out_dir, f, pdf, event);
+                if (pdf >= 1e-10f) {
+                    albedo += f * (std::abs(glm::dot(out_dir, info.normal)) / pdf);
+                }
+            }
+            features.albedo[i][j] = albedo * inv_samples;
+            features.normal[i][j] = normal * inv_samples;
+            features.depth[i][j] = depth * inv_samples;
+        }
+    }, 0, height, num_threads);
+    return features;
+}
+
+std::shared_ptr<AsyncTask> Renderer::write_output(std::string fn) {
+    // The snapshot is taken right away; only the conversion and writing are left to the output thread
+    auto image = std::make_shared<Array2D<Vector3>>(get_output());
+    if (output_executor == nullptr) {
+        output_executor = std::make_shared<AsyncExecutor>();
+    }
+    const int threads = num_threads;
+    const bool exr = fn.size() >= 4 && fn.compare(fn.size() - 4, 4, ".exr") == 0;
+    last_output = output_executor->submit([image, fn, threads, exr]() {
+        if (exr) {
+            write_exr_image(fn, *image, true, threads);
+        } else {
+            write_ldr_image(fn, *image, get_image_exposure_scale(*image, threads), 2.2f, threads);
+        }
+    });
+    return last_output;
+}
+
+void Renderer::wait_for_output() {
+    if (last_output != nullptr) {
+        last_output->get();
+    }
+}
 
 TC_NAMESPACE_END
 
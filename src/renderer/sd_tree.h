@@ -0,0 +1,318 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <taichi/math/linalg.h>
+#include <taichi/system/threading.h>
+
+TC_NAMESPACE_BEGIN
+
+// A distribution of directions, as a quadtree over the unit square of cylindrical coordinates
+// ((cos theta + 1) / 2, phi / (2 pi)), which maps areas to solid angles uniformly. Every node holds the energy
+// of its four quadrants, recorded by many threads at once; quadrants that were not subdivided are uniform.
+class DirectionalQuadTree {
+public:
+    static const int max_depth = 20;
+
+    DirectionalQuadTree() {
+        nodes.resize(1);
+    }
+
+    static Vector2 direction_to_square(const Vector3 &dir) {
+        const real cos_theta = clamp(dir.z, -1.0f, 1.0f);
+        real phi = std::atan2(dir.y, dir.x);
+        if (phi < 0) {
+            phi += 2 * pi;
+        }
+        return Vector2(clamp((cos_theta + 1) * 0.5f, 0.0f, 1.0f - 1e-7f),
+                       clamp(phi * (1.0f / (2 * pi)), 0.0f, 1.0f - 1e-7f));
+    }
+
+    static Vector3 square_to_direction(const Vector2 &p) {
+        const real cos_theta = 2 * p.x - 1, phi = 2 * pi * p.y;
+        const real sin_theta = std::sqrt(std::max(0.0f, 1 - cos_theta * cos_theta));
+        return Vector3(sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta);
+    }
+
+    void record(const Vector3 &dir, real energy) {
+        Vector2 p = direction_to_square(dir);
+        int node = 0;
+        while (true) {
+            const int q = get_quadrant(p);
+            nodes[node].sum[q].add(energy);
+            if (nodes[node].children[q] == 0) {
+                break;
+            }
+            node = nodes[node].children[q];
+        }
+    }
+
+    // All over the sphere, uniform where nothing was recorded
+    real pdf(const Vector3 &dir) const {
+        Vector2 p = direction_to_square(dir);
+        real density = 1.0f / (4 * pi);
+        int node = 0;
+        while (true) {
+            const real total = get_total(node);
+            if (!(total > 0)) {
+                break;
+            }
+            const int q = get_quadrant(p);
+            density *= 4 * nodes[node].sum[q] / total;
+            if (nodes[node].children[q] == 0) {
+                break;
+            }
+            node = nodes[node].children[q];
+        }
+        return density;
+    }
+
+    Vector3 sample(real u, real v) const {
+        Vector2 origin(0.0f);
+        real size = 1;
+        int node = 0;
+        while (true) {
+            const Node &n = nodes[node];
+            const real total = get_total(node);
+            if (!(total > 0)) {
+                break;
+            }
+            // Quadrant q covers x in [q & 1, (q & 1) + 1) / 2 and y in [q >> 1, (q >> 1) + 1) / 2
+            const real bottom = n.sum[0] + n.sum[1];
+            int q = 0;
+            if (u * total < bottom) {
+                u = u * total / bottom;
+                const bool right = v * bottom >= n.sum[0];
+                v = right ? (v * bottom - n.sum[0]) / n.sum[1] : v * bottom / n.sum[0];
+                q = right;
+            } else {
+                u = (u * total - bottom) / (total - bottom);
+                const real top = total - bottom;
+                const bool right = v * top >= n.sum[2];
+                v = right ? (v * top - n.sum[2]) / n.sum[3] : v * top / n.sum[2];
+                q = 2 + right;
+            }
+            u = clamp(u, 0.0f, 1.0f - 1e-7f);
+            v = clamp(v, 0.0f, 1.0f - 1e-7f);
+            size *= 0.5f;
+            origin += size * Vector2(real(q & 1), real(q >> 1));
+            if (n.children[q] == 0) {
+                break;
+            }
+            node = n.children[q];
+        }
+        // u chose the row and v the column, and both are uniform again within the quadrant
+        return square_to_direction(origin + size * Vector2(v, u));
+    }
+
+    // The subdivision of source, with energy recorded, for recording the next iteration: quadrants are
+    // subdivided while they hold more than threshold of the total energy, and merged otherwise
+    void refine_from(const DirectionalQuadTree &source, real threshold) {
+        nodes.clear();
+        const real total = source.get_total(0);
+        build(source, 0, total, total * threshold, 1);
+    }
+
+    int get_num_nodes() const {
+        return (int)nodes.size();
+    }
+
+    static std::size_t get_node_bytes() {
+        return sizeof(Node);
+    }
+
+private:
+    struct Node {
+        RelaxedAtomic<real> sum[4];
+        // 0 for quadrants without children, as the root is no child
+        int children[4] = {0, 0, 0, 0};
+    };
+
+    std::vector<Node> nodes;
+
+    // The quadrant of p in [0, 1)^2, which is then mapped to [0, 1)^2 within it
+    static int get_quadrant(Vector2 &p) {
+        const int qx = p.x >= 0.5f, qy = p.y >= 0.5f;
+        p = Vector2(p.x * 2 - qx, p.y * 2 - qy);
+        return qx + 2 * qy;
+    }
+
+    real get_total(int node) const {
+        const Node &n = nodes[node];
+        return n.sum[0] + n.sum[1] + n.sum[2] + n.sum[3];
+    }
+
+    // Appends the node of a square of energy energy, as node source_node of source if that is not -1
+    int build(const DirectionalQuadTree &source, int source_node, real energy, real min_energy, int depth) {
+        const int id = (int)nodes.size();
+        nodes.emplace_back();
+        for (int q = 0; q < 4; q++) {
+            int source_child = -1;
+            real e = energy * 0.25f;
+            if (source_node != -1) {
+                e = source.nodes[source_node].sum[q];
+                source_child = source.nodes[source_node].children[q] != 0 ? source.nodes[source_node].children[q] : -1;
+            }
+            if (depth < max_depth && e > min_energy && min_energy > 0) {
+                const int child = build(source, source_child, e, min_energy, depth + 1);
+                nodes[id].children[q] = child;
+            }
+        }
+        return id;
+    }
+};
+
+// The SD-tree of practical path guiding (Mueller et al. 2017): a binary tree over the scene bounds, split
+// along x, y and z in turn, whose leaves hold distributions of incident radiance. Each leaf samples from the
+// quadtree recorded in the previous iteration, while all threads record into another one without locks.
+class SDTree {
+public:
+    // max_bytes bounds the memory of all nodes
+    void initialize(const Vector3 &lower, const Vector3 &upper, real spatial_threshold, real directional_threshold,
+                    real max_bytes) {
+        this->lower = lower;
+        const Vector3 extent = upper - lower;
+        inv_extent = Vector3(1.0f / std::max(extent.x, 1e-6f), 1.0f / std::max(extent.y, 1e-6f),
+                             1.0f / std::max(extent.z, 1e-6f));
+        this->spatial_threshold = spatial_threshold;
+        this->directional_threshold = directional_threshold;
+        this->max_nodes = std::max(4LL, (long long)(max_bytes / DirectionalQuadTree::get_node_bytes()));
+        spatial_nodes.assign(1, SpatialNode());
+        leaves.assign(1, Leaf());
+        num_iterations = 0;
+    }
+
+    // Whether there is a previous iteration to sample from
+    bool can_sample() const {
+        return num_iterations > 0;
+    }
+
+    void record(const Vector3 &pos, const Vector3 &dir, real energy) {
+        Leaf &leaf = leaves[get_leaf(pos)];
+        leaf.count.add(1);
+        if (energy > 0 && std::isfinite(energy)) {
+            leaf.building.record(dir, energy);
+        }
+    }
+
+    real pdf(const Vector3 &pos, const Vector3 &dir) const {
+        return leaves[get_leaf(pos)].sampling.pdf(dir);
+    }
+
+    Vector3 sample(const Vector3 &pos, real u, real v) const {
+        return leaves[get_leaf(pos)].sampling.sample(u, v);
+    }
+
+    // Ends an iteration of samples_scale times as many samples as the first: leaves sample from what was
+    // recorded, split in space where they got many records, and record anew into refined quadtrees.
+    // Leaves stop splitting, and quadtrees get coarser, to stay within max_nodes nodes.
+    void refine(real samples_scale, int num_threads) {
+        for (auto &leaf : leaves) {
+            leaf.sampling = leaf.building;
+        }
+        const long long split_count = (long long)(spatial_threshold * std::sqrt(samples_scale));
+        long long num_nodes = get_num_nodes();
+        for (int i = 0; i < (int)spatial_nodes.size(); i++) {
+            if (spatial_nodes[i].child != 0) {
+                continue;
+            }
+            const int leaf_id = spatial_nodes[i].leaf;
+            const long long count = leaves[leaf_id].count;
+            const long long directional_nodes = 2 * leaves[leaf_id].sampling.get_num_nodes();
+            if (count <= split_count || spatial_nodes[i].depth >= max_spatial_depth ||
+                num_nodes + 2 + directional_nodes > max_nodes) {
+                continue;
+            }
+            // Both halves start from the distribution of the whole, with half of its records each, and may be
+            // split again below
+            Leaf half = leaves[leaf_id];
+            half.count = RelaxedAtomic<long long>(count / 2);
+            num_nodes += 2 + directional_nodes;
+            const int child = (int)spatial_nodes.size();
+            SpatialNode node;
+            node.depth = spatial_nodes[i].depth + 1;
+            node.leaf = leaf_id;
+            spatial_nodes.push_back(node);
+            node.leaf = (int)leaves.size();
+            spatial_nodes.push_back(node);
+            leaves[leaf_id] = half;
+            leaves.push_back(half);
+            spatial_nodes[i].child = child;
+        }
+        real threshold = directional_threshold;
+        while (true) {
+            ThreadedTaskManager::run([&](int i) {
+                leaves[i].building.refine_from(leaves[i].sampling, threshold);
+                leaves[i].count = RelaxedAtomic<long long>(0);
+            }, 0, (int)leaves.size(), num_threads);
+            if (get_num_nodes() <= max_nodes || threshold >= 1) {
+                break;
+            }
+            threshold *= 2;
+        }
+        num_iterations++;
+    }
+
+    // Spatial nodes and the nodes of the quadtrees of all leaves, which take about as much memory
+    long long get_num_nodes() const {
+        long long n = (long long)spatial_nodes.size();
+        for (auto &leaf : leaves) {
+            n += leaf.sampling.get_num_nodes() + leaf.building.get_num_nodes();
+        }
+        return n;
+    }
+
+    int get_num_leaves() const {
+        return (int)leaves.size();
+    }
+
+private:
+    static const int max_spatial_depth = 48;
+
+    struct SpatialNode {
+        // Children child and child + 1, below and above the middle along axis depth % 3, or none if 0
+        int child = 0;
+        int leaf = 0;
+        int depth = 0;
+    };
+
+    struct Leaf {
+        DirectionalQuadTree sampling, building;
+        RelaxedAtomic<long long> count;
+    };
+
+    Vector3 lower, inv_extent;
+    real spatial_threshold;
+    real directional_threshold;
+    long long max_nodes;
+    int num_iterations;
+    std::vector<SpatialNode> spatial_nodes;
+    std::vector<Leaf> leaves;
+
+    int get_leaf(const Vector3 &pos) const {
+        Vector3 p = (pos - lower) * inv_extent;
+        for (int i = 0; i < 3; i++) {
+            p[i] = clamp(p[i], 0.0f, 1.0f - 1e-7f);
+        }
+        int node = 0;
+        while (spatial_nodes[node].child != 0) {
+            const int axis = spatial_nodes[node].depth % 3;
+            const int upper = p[axis] >= 0.5f;
+            p[axis] = p[axis] * 2 - upper;
+            node = spatial_nodes[node].child + upper;
+        }
+        return spatial_nodes[node].leaf;
+    }
+};
+
+TC_NAMESPACE_END
@@ -16,17 +16,20 @@ TC_NAMESPACE_BEGIN
 void SPPMRenderer::initialize(const Config &config) {
     Renderer::initialize(config);
     alpha = config.get("alpha", 0.666666667f);
-    sampler = create_instance<Sampler>(config.get("sampler", "prand"));
+    sampler = create_instance<Sampler>(config.get("sampler", "prand"), config);
     russian_roulette = config.get("russian_roulette", true);
     initial_radius = config.get_real("initial_radius");
     shrinking_radius = config.get_bool("shrinking_radius");
     stochastic_eye_ray = config.get("stochastic_eye_ray", true); // PPM or SPPM?
+    compact_hash_grid = config.get("compact_hash_grid", false);
     image.initialize(width, height);
     photon_counter = 0;
     stages = 0;
     radius2.initialize(width, height, initial_radius * initial_radius);
     flux.initialize(width, height, Vector3(0.0f));
     num_photons.initialize(width, height, 0LL);
+    pass_flux.initialize(width, height, Vector3(0.0f));
+    pass_photons.initialize(width, height, 0);
     image_direct_illum.initialize(width, height);
     num_photons_per_stage = config.get("num_photons_per_stage", width * height);
     eye_ray_stages = 0;
@@ -38,27 +41,89 @@ void SPPMRenderer::render_stage() {
         eye_ray_pass();
         eye_ray_stages += 1;
     }
-    hash_grid.build_grid();
-    for (int i = 0; i < num_photons_per_stage; i++) {
-        auto state_sequence = RandomStateSequence(sampler, photon_counter);
-        trace_photon(state_sequence);
-        photon_counter += 1;
-    }
+    hash_grid.build_grid(num_threads);
+    trace_photons(num_photons_per_stage);
+    update_hit_points();
     stages += 1;
-    for (auto &ind : image.get_region()) {
-        image[ind] = 1.0f / (pi * radius2[ind]) / photon_counter * flux[ind] +
-                     image_direct_illum[ind] * (1.0f / eye_ray_stages);
+    parallel_for(0, width, num_threads, [&](int i) {
+        for (int j = 0; j < height; j++) {
+            image[i][j] = 1.0f / (pi * radius2[i][j]) / photon_counter * flux[i][j] +
+                          image_direct_illum[i][j] * (1.0f / eye_ray_stages);
+        }
+    }, 1);
+}
+
+void SPPMRenderer::trace_photons(int n) {
+    // In rounds of tasks, to bound the memory of the hits
+    const int task_size = 256, round_size = task_size * 256;
+    std::vector<std::vector<PhotonHit>> task_hits(round_size / task_size);
+    for (int round_begin = 0; round_begin < n; round_begin += round_size) {
+        const int round_end = std::min(n, round_begin + round_size);
+        const int num_tasks = (round_end - round_begin + task_size - 1) / task_size;
+        ThreadedTaskManager::run([&](int t) {
+            std::vector<PhotonHit> &hits = task_hits[t];
+            hits.clear();
+            const int begin = round_begin + t * task_size, end = std::min(round_end, begin + task_size);
+            for (int i = begin; i < end; i++) {
+                auto state_sequence = RandomStateSequence(sampler, photon_counter + i);
+                trace_photon(state_sequence, hits);
+            }
+        }, 0, num_tasks, num_threads, 1);
+        for (int t = 0; t < num_tasks; t++) {
+            gather_photons(task_hits[t]);
+        }
+    }
+    photon_counter += n;
+}
+
+void SPPMRenderer::gather_photons(const std::vector<PhotonHit> &hits) {
+    for (auto &hit : hits) {
+        pass_flux[hit.pixel.x][hit.pixel.y] += hit.flux;
+        pass_photons[hit.pixel.x][hit.pixel.y]++;
     }
 }
 
-void SPPMRenderer::trace_eye_path(StateSequence &rand, Ray &ray, const Vector2i &pixel) {
+void SPPMRenderer::update_hit_points() {
+    parallel_for(0, width, num_threads, [&](int i) {
+        for (int j = 0; j < height; j++) {
+            const int m = pass_photons[i][j];
+            if (m == 0) {
+                continue;
+            }
+            // num_photons is N / alpha, for the N of Hachisuka et al.:
+            // N' = N + alpha M and R'^2 = R^2 (N + alpha M) / (N + M)
+            long long &n = num_photons[i][j];
+            real g = 1.0f;
+            if (shrinking_radius) {
+                g = (n * alpha + m * alpha) / (n * alpha + m);
+            }
+            radius2[i][j] *= g;
+            flux[i][j] = (flux[i][j] + pass_flux[i][j]) * g;
+            n += m;
+            pass_flux[i][j] = Vector3(0.0f);
+            pass_photons[i][j] = 0;
+        }
+    }, 1);
+}
+
+void SPPMRenderer::write_checkpoint(BinaryFileStreamOutput &os) {
+    os << photon_counter << stages << eye_ray_stages;
+    os << radius2 << flux << num_photons << image << image_direct_illum;
+}
+
+void SPPMRenderer::read_checkpoint(BinaryFileStreamInput &is) {
+    is >> photon_counter >> stages >> eye_ray_stages;
+    is >> radius2 >> flux >> num_photons >> image >> image_direct_illum;
+}
+
+void SPPMRenderer::trace_eye_path(StateSequence &rand, Ray &ray, const Vector2i &pixel,
+                                  const IntersectionInfo *primary_hit) {
     Vector3 importance = Vector3(1.0f);
     for (int depth = 0; depth + 1 <= max_path_length; depth++) {
-        IntersectionInfo info = sg->query(ray);
+        IntersectionInfo info = depth == 0 && primary_hit ? *primary_hit : sg->query(ray);
         if (!info.intersected)
             return;
 
-        Triangle &tri = scene->triangles[info.triangle_id];
         BSDF bsdf(scene, info);
         Vector3 in_dir = -ray.dir;
         if (bsdf.is_emissive()) {
@@ -87,13 +152,13 @@ void SPPMRenderer::trace_eye_path(StateSequence &rand, Ray &ray, const Vector2i
             hit_point.path_length = depth + 1;
             hit_points.push_back(hit_point);
             real radius = std::sqrt(radius2[pixel.x][pixel.y]);
-            hash_grid.push_back_to_all_cells_in_range(info.pos, radius, hit_point.id);
+            hash_grid.insert(info.pos, radius, hit_point.id);
             return;
         }
     }
 }
 
-bool SPPMRenderer::trace_photon(StateSequence &rand, real contribution_scaling) { // returns visibility
+bool SPPMRenderer::trace_photon(StateSequence &rand, std::vector<PhotonHit> &hits, real contribution_scaling) {
     bool visible = false;
     real pdf;
     const Triangle &tri = scene->sample_triangle_light_emission(rand(), pdf);
@@ -110,7 +175,6 @@ bool SPPMRenderer::trace_photon(StateSequence &rand, real contribution_scaling)
         IntersectionInfo info = sg->query(ray);
         if (!info.intersected)
             break;
-        Triangle &tri = scene->triangles[info.triangle_id];
         BSDF bsdf(scene, info);
         Vector3 in_dir = -ray.dir;
         Vector3 out_dir;
@@ -126,29 +190,23 @@ bool SPPMRenderer::trace_photon(StateSequence &rand, real contribution_scaling)
             // No vertex merging for delta BSDF
         } else {
             // Vertex merging
-            int *begin = hash_grid.begin(info.pos);
-            int *end = hash_grid.end(info.pos);
-            for (int *p_hp_id = begin; p_hp_id < end; p_hp_id++) {
-                HitPoint &hp = hit_points[*p_hp_id];
-                Vector3 v = (hp.pos - info.pos);
-                int path_length = hp.path_length + depth + 1;
-                real &hp_radius2 = radius2[hp.pixel.x][hp.pixel.y];
-                if (path_length_in_range(path_length) &&
-                    dot(hp.normal, info.normal) > eps && dot(v, v) < hp_radius2) {
-                    if (contribution_scaling > 0) {
-                        long long &hp_num_photons = num_photons[hp.pixel.x][hp.pixel.y];
-                        real g;
-                        if (shrinking_radius)
-                            g = (hp_num_photons * alpha + alpha) / (hp_num_photons * alpha + 1.0f);
-                        else
-                            g = 1.0f;
-                        hp_radius2 *= g;
-                        Vector3 contribution = contribution_scaling * hp.importance * flux *
-                                               bsdf.evaluate(in_dir, hp.eye_out_dir);
-                        this->flux[hp.pixel.x][hp.pixel.y] = (this->flux[hp.pixel.x][hp.pixel.y] + contribution) * g;
-                        hp_num_photons++;
+            int buckets[HashGrid::max_query_cells];
+            const int num_buckets = hash_grid.get_query_buckets(info.pos, buckets);
+            for (int b = 0; b < num_buckets; b++) {
+                for (const int *p_hp_id = hash_grid.begin(buckets[b]); p_hp_id < hash_grid.end(buckets[b]); p_hp_id++) {
+                    HitPoint &hp = hit_points[*p_hp_id];
+                    Vector3 v = (hp.pos - info.pos);
+                    int path_length = hp.path_length + depth + 1;
+                    const real hp_radius2 = radius2[hp.pixel.x][hp.pixel.y];
+                    if (path_length_in_range(path_length) &&
+                        dot(hp.normal, info.normal) > eps && dot(v, v) < hp_radius2) {
+                        if (contribution_scaling > 0) {
+                            Vector3 contribution = contribution_scaling * hp.importance * flux *
+                                                   bsdf.evaluate(in_dir, hp.eye_out_dir);
+                            hits.push_back(PhotonHit{hp.pixel, contribution});
+                        }
+                        visible = true;
                     }
-                    visible = true;
                 }
             }
         }
@@ -160,6 +218,7 @@ bool SPPMRenderer::trace_photon(StateSequence &rand, real contribution_scaling)
                 if (rand() < p) {
                     flux = (1.0f / p) * flux;
                 } else {
+                    RenderCounters::add(RenderCounter::russian_roulette_terminations);
                     break;
                 }
             }
@@ -171,15 +230,34 @@ bool SPPMRenderer::trace_photon(StateSequence &rand, real contribution_scaling)
 
 void SPPMRenderer::eye_ray_pass() {
     auto sampler = create_instance<Sampler>("prand");
-    hash_grid.initialize(initial_radius, width * height * 10 + 7); // TODO: hash cell size should be shrinking...
+    // TODO: hash cell size should be shrinking...
+    hash_grid.initialize(initial_radius, width * height * 10 + 7, compact_hash_grid);
     hit_points.clear();
+    // The primary rays of a column are traced together, in packets where the backend has them
+    const int batch_size = 64;
+    std::vector<RandomStateSequence> rands;
+    rands.reserve(batch_size);
+    StateSequence *rand_ptrs[batch_size];
+    Vector2 offsets[batch_size];
+    const Vector2 size(1.0f / width, 1.0f / height);
+    Ray rays[batch_size];
+    IntersectionInfo infos[batch_size];
     for (int i = 0; i < width; i++) {
-        for (int j = 0; j < height; j++) {
-            auto rand = RandomStateSequence(sampler, i * height + j);
-            Vector2 offset(real(i) / (real)width, real(j) / (real)height);
-            Vector2 size(1.0f / width, 1.0f / height);
-            Ray ray = camera->sample(offset, size, rand);
-            trace_eye_path(rand, ray, Vector2i(i, j));
+        for (int begin = 0; begin < height; begin += batch_size) {
+            const int n = std::min(batch_size, height - begin);
+            rands.clear();
+            for (int k = 0; k < n; k++) {
+                const int j = begin + k;
+                rands.push_back(RandomStateSequence(sampler, i * height + j));
+                rand_ptrs[k] = &rands[k];
+                offsets[k] = Vector2(real(i) / (real)width, real(j) / (real)height);
+            }
+            camera->generate_rays(n, offsets, size, rand_ptrs, rays);
+            RenderCounters::add(RenderCounter::primary_rays, n);
+            sg->query(rays, n, infos);
+            for (int k = 0; k < n; k++) {
+                trace_eye_path(rands[k], rays[k], Vector2i(i, begin + k), &infos[k]);
+            }
         }
     }
 }
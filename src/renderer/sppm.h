@@ -26,6 +26,12 @@ struct HitPoint {
     int path_length = 0;
 };
 
+// Flux a photon deposits at the hit point of a pixel
+struct PhotonHit {
+    Vector2i pixel;
+    Vector3 flux;
+};
+
 class SPPMRenderer : public Renderer {
 public:
     virtual void initialize(const Config &config) override;
@@ -36,13 +42,36 @@ public:
         return image;
     }
 
-    virtual void trace_eye_path(StateSequence &rand, Ray &ray, const Vector2i &pixel = Vector2i(-1, -1));
+    long long get_num_samples() const override {
+        return photon_counter;
+    }
+
+    // With primary_hit, the result of sg->query(ray), if already known
+    virtual void trace_eye_path(StateSequence &rand, Ray &ray, const Vector2i &pixel = Vector2i(-1, -1),
+                                const IntersectionInfo *primary_hit = nullptr);
 
-    virtual bool trace_photon(StateSequence &rand, real contribution_scaling = 1.0f); // Returns visibility
+    // Appends the photon's contributions to hits; returns visibility
+    virtual bool trace_photon(StateSequence &rand, std::vector<PhotonHit> &hits, real contribution_scaling = 1.0f);
+
+    // Photons photon_counter, ..., photon_counter + n - 1, traced in parallel and gathered in order, so
+    // that the result does not depend on num_threads
+    void trace_photons(int n);
+
+    // Into the photons and flux of this pass
+    void gather_photons(const std::vector<PhotonHit> &hits);
+
+    // The progressive radius and flux update of SPPM for the photons gathered this pass,
+    // with a fixed radius within passes
+    void update_hit_points();
 
     virtual void eye_ray_pass();
 
 protected:
+    // Hit points are not saved: every stage clears the hash grid, which only eye ray passes refill
+    void write_checkpoint(BinaryFileStreamOutput &os) override;
+
+    void read_checkpoint(BinaryFileStreamInput &is) override;
+
     real alpha;
     real initial_radius;
     int num_photons_per_stage;
@@ -55,8 +84,12 @@ protected:
     Array2D<real> radius2;
     Array2D<Vector3> flux;
     Array2D<long long> num_photons;
+    Array2D<Vector3> pass_flux;
+    Array2D<int> pass_photons;
     int64 photon_counter;
     bool stochastic_eye_ray;
+    // Stores every hit point once in the hash grid, for lookups of the 27 cells around a photon
+    bool compact_hash_grid;
     bool russian_roulette;
     bool shrinking_radius;
     int eye_ray_stages;
@@ -17,14 +17,18 @@ protected:
     int num_stages;
     real initial_radius;
     HashGrid hash_grid;
-    std::vector<Path> light_paths;
+    // Light vertices to merge with, of light_paths_for_connection
+    MergeVertices light_vertices;
     std::vector<Path> light_paths_for_connection;
+    std::vector<Path> eye_paths;
     real radius;
     int n_samples_per_stage;
     Array2D<Vector3> bdpm_image;
     real alpha;
     bool use_vc;
     bool use_vm;
+    // Stores every vertex once in the hash grid, for lookups of the 27 cells around a query
+    bool compact_hash_grid;
 
 public:
     virtual void initialize(const Config &config) override {
@@ -33,6 +37,7 @@ public:
         initial_radius = config.get_float("initial_radius");
         use_vc = config.get("use_vc", true);
         use_vm = config.get("use_vm", true);
+        compact_hash_grid = config.get("compact_hash_grid", false);
         alpha = config.get("alpha", 0.66667f);
         bdpm_image.initialize(width, height, Vector3(0.0f, 0.0f, 0.0f));
         radius = initial_radius;
@@ -41,108 +46,153 @@ public:
 
     PathContribution vertex_merge(const Path &full_eye_path) {
         PathContribution pc;
+        if (full_eye_path.size() < 2) {
+            return pc;
+        }
+        // Screen coordinates
+        Vector3 camera_direction = normalize(full_eye_path[1].pos - full_eye_path[0].pos);
+        real screen_u, screen_v;
+        camera->get_pixel_coordinate(camera_direction, screen_u, screen_v);
+        if (!(0 <= screen_u && screen_u < 1 && 0 <= screen_v && screen_v < 1)) {
+            // TODO: is this caused by non-zero radius?
+            return pc;
+        }
         real radius2 = radius * radius;
+        Path full_path;
+        int candidates[64];
         for (int num_eye_vertices = 2; num_eye_vertices <= (int)full_eye_path.size(); num_eye_vertices++) {
-            Path eye_path(full_eye_path.begin(), full_eye_path.begin() + num_eye_vertices);
-            Vector3 merging_pos = eye_path.back().pos;
-            int *begin = hash_grid.begin(merging_pos), *end = hash_grid.end(merging_pos);
-            for (int *light_path_id_pointer = begin; light_path_id_pointer < end; light_path_id_pointer++) {
-                int light_path_id = *light_path_id_pointer;
-                Path light_path = light_paths[light_path_id];
-                int path_length = (int)eye_path.size() + (int)light_path.size() - 2;
-                int num_light_vertices = (int)light_path.size();
-                Vertex merging_vertex_eye = eye_path.back();
-                Vertex merging_vertex_light = light_path.back();
-                if (SurfaceEventClassifier::is_delta(merging_vertex_eye.event) ||
-                    SurfaceEventClassifier::is_delta(merging_vertex_light.event)) {
-                    // Do not connect Delta BSDF
-                    continue;
-                }
-                Vector3 v = merging_vertex_eye.pos - merging_vertex_light.pos;
-                if (min_path_length <= path_length && path_length <= max_path_length &&
-                    dot(merging_vertex_eye.normal, merging_vertex_light.normal) > eps && dot(v, v) <= radius2) {
-                    // Screen coordinates
-                    Vector3 camera_direction = normalize(eye_path[1].pos - eye_path[0].pos);
-                    real screen_u, screen_v;
-                    camera->get_pixel_coordinate(camera_direction, screen_u, screen_v);
-                    if (!(0 <= screen_u && screen_u < 1 && 0 <= screen_v && screen_v < 1)) {
-                        //assert_info(-eps <= screen_u && screen_u <= 1 + eps && -eps <= screen_v && screen_v <= 1 + eps,
-                        //            "Eye ray outside camera ???");
-                        // TODO: is this caused by non-zero radius?
-                        continue;
-                    }
-                    screen_u = clamp(screen_u, 0.0f, 1.0f);
-                    screen_v = clamp(screen_v, 0.0f, 1.0f);
-                    eye_path.back().connected = true;
-                    Path full_path;
-                    full_path.resize(
-                            num_eye_vertices + num_light_vertices - 1); // note that last light vertex is deleted
-                    for (int i = 0; i < num_eye_vertices; i++) full_path[i] = eye_path[i];
-                    for (int i = 0; i < num_light_vertices - 1; i++) full_path[path_length - i] = light_path[i];
-                    // evaluate the path
-                    Vector3 f = path_throughput(full_path);
-                    if (max_component(f) <= 0.0f) {
-                        //printf("f\n");
-                        continue;
-                    }
-                    double p = path_pdf(full_path, num_eye_vertices, num_light_vertices);
-                    if (p <= 0.0f) {
-                        //printf("p\n");
-                        continue;
+            const Vertex &merging_vertex_eye = full_eye_path[num_eye_vertices - 1];
+            if (SurfaceEventClassifier::is_delta(merging_vertex_eye.event)) {
+                // Do not connect Delta BSDF
+                continue;
+            }
+            int buckets[HashGrid::max_query_cells];
+            const int num_buckets = hash_grid.get_query_buckets(merging_vertex_eye.pos, buckets);
+            for (int b = 0; b < num_buckets; b++) {
+                const int *begin = hash_grid.begin(buckets[b]), *end = hash_grid.end(buckets[b]);
+                while (begin < end) {
+                    // Candidates are culled in batches over the light vertex arrays, and only the
+                    // remaining ones are evaluated on their paths
+                    int num_candidates = 0;
+                    for (; begin < end && num_candidates < 64; begin++) {
+                        const int i = *begin;
+                        const int path_length = num_eye_vertices + light_vertices.num_vertices[i] - 2;
+                        Vector3 v = merging_vertex_eye.pos - light_vertices.positions[i];
+                        if (min_path_length <= path_length && path_length <= max_path_length &&
+                            dot(merging_vertex_eye.normal, light_vertices.normals[i]) > eps && dot(v, v) <= radius2) {
+                            candidates[num_candidates++] = i;
+                        }
                     }
-                    double w = mis_weight(full_path, num_eye_vertices, num_light_vertices, use_vc, n_samples_per_stage);
-                    if (w <= 0.0f) {
-                        //printf("w\n");
-                        continue;
+                    for (int k = 0; k < num_candidates; k++) {
+                        const int i = candidates[k];
+                        const Path &light_path = light_paths_for_connection[light_vertices.paths[i]];
+                        const int num_light_vertices = light_vertices.num_vertices[i];
+                        const int path_length = num_eye_vertices + num_light_vertices - 2;
+                        // Note that the last light vertex is deleted
+                        full_path.resize(num_eye_vertices + num_light_vertices - 1);
+                        for (int j = 0; j < num_eye_vertices; j++) full_path[j] = full_eye_path[j];
+                        full_path[num_eye_vertices - 1].connected = true;
+                        for (int j = 0; j < num_light_vertices - 1; j++) full_path[path_length - j] = light_path[j];
+                        // evaluate the path
+                        Vector3 f = path_throughput(full_path);
+                        if (max_component(f) <= 0.0f) {
+                            continue;
+                        }
+                        double p = path_pdf(full_path, num_eye_vertices, num_light_vertices);
+                        if (p <= 0.0f) {
+                            continue;
+                        }
+                        double w = mis_weight(full_path, num_eye_vertices, num_light_vertices, use_vc,
+                                              n_samples_per_stage);
+                        if (w <= 0.0f) {
+                            continue;
+                        }
+                        Vector3 c = f * float(w / p);
+                        if (max_component(c) <= 0.0) continue;
+                        pc.push_back(Contribution(screen_u, screen_v, path_length, c));
                     }
-                    Vector3 c = f * float(w / p);
-                    if (max_component(c) <= 0.0) continue;
-                    pc.push_back(Contribution(screen_u, screen_v, path_length, c));
                 }
             }
         }
         return pc;
     }
 
+    // The non-delta vertices of the light paths of the stage, past their first, to be merged with
+    void build_light_vertices() {
+        light_vertices.build(light_paths_for_connection, -1, num_threads);
+        hash_grid.insert_all(light_vertices.size(), [&](int i) { return light_vertices.positions[i]; }, radius,
+                             num_threads);
+        hash_grid.build_grid(num_threads);
+    }
+
     virtual void render_stage() override {
         radius = initial_radius * pow(num_stages + 1.0f, -(1.0f - alpha) / 2.0f);
         vm_pdf_constant = pi * radius * radius;
-        hash_grid.initialize(radius, width * height * 10 + 7);
-        light_paths.clear();
+        hash_grid.initialize(radius, width * height * 10 + 7, compact_hash_grid);
         light_paths_for_connection.resize(n_samples_per_stage);
-        // Generate light paths (photons)
-        ThreadedTaskManager::run([&](int k) {
-            auto state_sequence = RandomStateSequence(sampler, sample_count * 2 + k); // TODO: wrong...
-            Path light_path = trace_light_path(state_sequence);
-            light_paths_for_connection[k] = light_path;
-        }, 0, n_samples_per_stage, num_threads);
-
-        for (int k = 0; k < n_samples_per_stage; k++) {
-            Path &light_path = light_paths_for_connection[k];
-            if (use_vm) {
-                for (int num_light_vertices = 2; num_light_vertices <= (int)light_path.size(); num_light_vertices++) {
-                    Path partial_light_path(light_path.begin(), light_path.begin() + num_light_vertices);
-                    hash_grid.push_back_to_all_cells_in_range(partial_light_path.back().pos, radius,
-                                                              (int)light_paths.size());
-                    light_paths.push_back(partial_light_path);
+        eye_paths.resize(n_samples_per_stage);
+        {
+            Profiler::Scope _(profiler, "light_paths");
+            // Generate light paths (photons)
+            ThreadedTaskManager::run([&](int k) {
+                auto state_sequence = RandomStateSequence(sampler, sample_count * 2 + k); // TODO: wrong...
+                light_paths_for_connection[k] = trace_light_path(state_sequence);
+            }, 0, n_samples_per_stage, num_threads);
+        }
+        if (use_vm) {
+            Profiler::Scope _(profiler, "merge_build");
+            build_light_vertices();
+        }
+        {
+            Profiler::Scope _(profiler, "eye_paths");
+            // Generate eye paths (importons)
+            ThreadedTaskManager::run([&](int k) {
+                auto state_sequence = RandomStateSequence(sampler, sample_count * 2 + n_samples_per_stage + k);
+                eye_paths[k] = trace_eye_path(state_sequence);
+                if (use_vc) {
+                    write_path_contribution(
+                            connect(eye_paths[k], light_paths_for_connection[k], -1, -1,
+                                    (int)use_vm * n_samples_per_stage));
                 }
-            }
+            }, 0, n_samples_per_stage, num_threads);
+        }
+        if (use_vm) {
+            Profiler::Scope _(profiler, "merge_query");
+            ThreadedTaskManager::run([&](int k) {
+                write_path_contribution(vertex_merge(eye_paths[k]));
+            }, 0, n_samples_per_stage, num_threads);
         }
-        hash_grid.build_grid();
-        // Generate eye paths (importons)
-        ThreadedTaskManager::run([&](int k) {
-            auto state_sequence = RandomStateSequence(sampler, sample_count * 2 + n_samples_per_stage + k);
-            Path eye_path = trace_eye_path(state_sequence);
-            if (use_vm) {
-                write_path_contribution(vertex_merge(eye_path));
-            }
-            if (use_vc) {
-                write_path_contribution(
-                        connect(eye_path, light_paths_for_connection[k], -1, -1, (int)use_vm * n_samples_per_stage));
-            }
-        }, 0, n_samples_per_stage, num_threads);
         sample_count += n_samples_per_stage;
     }
+
+    // Light paths are merged with the eye paths of their stage, so ranges are made of whole stages
+    bool supports_sample_ranges() const override {
+        return true;
+    }
+
+    long long get_sample_range_granularity() const override {
+        return n_samples_per_stage;
+    }
+
+    void write_checkpoint(BinaryFileStreamOutput &os) override {
+        BidirectionalRenderer::write_checkpoint(os);
+        os << num_stages;
+    }
+
+    void read_checkpoint(BinaryFileStreamInput &is) override {
+        BidirectionalRenderer::read_checkpoint(is);
+        is >> num_stages;
+    }
+
+    void render_sample_range(long long begin, long long end) override {
+        assert_info(begin % n_samples_per_stage == 0 && end % n_samples_per_stage == 0,
+                    "VCM sample ranges must be made of whole stages");
+        const long long stage_sample_count = sample_count;
+        for (sample_count = begin; sample_count < end;) {
+            render_stage();
+        }
+        sample_count = stage_sample_count;
+    }
 };
 
 TC_IMPLEMENTATION(Renderer, VCMRenderer, "vcm");
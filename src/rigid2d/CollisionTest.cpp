@@ -9,7 +9,7 @@
 
 #include "Physics.h"
 
-void Physics::TestCollision(Polygon *a, Polygon *b) {
+void Physics::TestCollision(Polygon *a, Polygon *b, ContactPool &contacts) {
     Vector2D n;
     Line edge; int edgeId;
     double minDepth = DBL_INF;
@@ -66,10 +66,10 @@ void Physics::TestCollision(Polygon *a, Polygon *b) {
         cons[3] = make_pair(tan * D, D);
         sort(cons, cons + 4);
         if (sgn(a->GetNormal(i) * b->GetNormal(j) + 1.0) != 0) {
-            constraints.push_back(new Contact(a, b, cons[1].second, n, minDepth));
-            constraints.push_back(new Contact(a, b, cons[2].second, n, minDepth));
+            contacts.Add(a, b, cons[1].second, n, minDepth);
+            contacts.Add(a, b, cons[2].second, n, minDepth);
         } else {
-            constraints.push_back(new Contact(a, b, (cons[1].second + cons[2].second - Vector2D::Origin) * 0.5, n, minDepth));                
+            contacts.Add(a, b, (cons[1].second + cons[2].second - Vector2D::Origin) * 0.5, n, minDepth);                
         }
     } else {
         Vector2D retP;
@@ -81,19 +81,19 @@ void Physics::TestCollision(Polygon *a, Polygon *b) {
                 retDep = depth, retP = p;
         }
         if (retDep > -eps)
-            constraints.push_back(new Contact(a, b, retP, n, retDep));
+            contacts.Add(a, b, retP, n, retDep);
     }
 }
 
-void Physics::TestCollision(Circle *a, Circle *b) {
+void Physics::TestCollision(Circle *a, Circle *b, ContactPool &contacts) {
     Vector2D n = (b->GetCentroidPosition() - a->GetCentroidPosition());
     double depth = a->radius + b->radius - n.GetLength();
     if (depth < 0) return;
     n.Normalize();
-    constraints.push_back(new Contact(a, b, a->GetCentroidPosition() + n * a->radius, n, depth));
+    contacts.Add(a, b, a->GetCentroidPosition() + n * a->radius, n, depth);
 }
 
-void Physics::TestCollision(Circle *a, Polygon *b) {
+void Physics::TestCollision(Circle *a, Polygon *b, ContactPool &contacts) {
     Vector2D n, p;
     Line edge;
     double minDepth = DBL_INF;
@@ -113,37 +113,37 @@ void Physics::TestCollision(Circle *a, Polygon *b) {
         }
     }
     if (minDepth < DBL_INF)
-        constraints.push_back(new Contact(b, a, p, n, minDepth));
+        contacts.Add(b, a, p, n, minDepth);
     for (int i = 0; i < b->nPoints; i++) {
         Vector2D p = b->GetTransformToWorld()(b->points[i]);
         if (a->IsPointInside(p)) {
             double depth = a->radius - (a->GetCentroidPosition() - p).GetLength();
-            constraints.push_back(new Contact(a, b, p, (p - a->GetCentroidPosition()).GetDirection(), depth));
+            contacts.Add(a, b, p, (p - a->GetCentroidPosition()).GetDirection(), depth);
             return;
         }
     }
 }
 
-void Physics::TestCollision(Shape *a, Shape *b) {
+void Physics::TestCollision(Shape *a, Shape *b, ContactPool &contacts) {
     if (!(a->layerMask & b->layerMask)) return;
     if (a->object == b->object) return;
     int typeA = a->GetType(), typeB = b->GetType();
     if (typeA == Polygon::ShapeType && typeB == Polygon::ShapeType)
-        return TestCollision((Polygon *)a, (Polygon *)b);
+        return TestCollision((Polygon *)a, (Polygon *)b, contacts);
     if (typeA == Circle::ShapeType && typeB == Circle::ShapeType)
-        return TestCollision((Circle *)a, (Circle *)b);
+        return TestCollision((Circle *)a, (Circle *)b, contacts);
     if (typeA == Circle::ShapeType && typeB == Polygon::ShapeType)
-        return TestCollision((Circle *)a, (Polygon *)b);
+        return TestCollision((Circle *)a, (Polygon *)b, contacts);
     if (typeA == Polygon::ShapeType && typeB == Circle::ShapeType)
-        return TestCollision((Circle *)b, (Polygon *)a);
+        return TestCollision((Circle *)b, (Polygon *)a, contacts);
 }
 
 /*
-void Physics::TestCollision(Object *a, Object *b) {
+void Physics::TestCollision(Object *a, Object *b, ContactPool &contacts) {
     if (!(a->layerMask & b->layerMask)) return;
     for (int i = 0; i < (int)a->shapes.size(); i++) {
         for (int j = 0; j < (int)b->shapes.size(); j++)
-            TestCollision(a->shapes[i], b->shapes[j]);
+            TestCollision(a->shapes[i], b->shapes[j], contacts);
     }
 }
 */
\ No newline at end of file
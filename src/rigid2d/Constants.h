@@ -39,6 +39,15 @@ const int screenHeight = 768;
 const double eps = 1e-8;
 const double pi = acos(-1.);
 const double timeInterval = 0.1;
+// Islands whose objects all stay below these speeds for timeToSleep go to sleep
+const double sleepLinearVelocity = 1.0;
+const double sleepAngularVelocity = 0.02;
+const double timeToSleep = 2.0;
+// Bullets stop where they first come within toiTolerance of another object, and are then moved into it by at
+// most toiPenetration, below the slop of the position iterations, for the contact solver to take over
+const double toiTolerance = 0.05;
+const double toiPenetration = 0.08;
+const int toiIterations = 30;
 #define DBL_INF numeric_limits<double>::infinity()
 
 inline float randf() {
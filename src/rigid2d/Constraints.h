@@ -11,11 +11,14 @@
 #define CONSTRAINTS_H
 
 #include "Object.h"
-#include "MemoryAllocator.h"
+#include <taichi/common/pool_allocator.h>
 
 class Force {
 public:
+    virtual ~Force() {}
     virtual bool Linking(Object *object) = 0;
+    // The two objects it acts on, which are solved in the same island
+    virtual pair<Object *, Object *> GetObjects() = 0;
     virtual void Apply(double T) = 0;
     virtual void Redraw() {}
 };
@@ -68,6 +71,9 @@ public :
     bool Linking(Object *object) {
         return objectA == object || objectB == object;
     }
+    pair<Object *, Object *> GetObjects() {
+        return make_pair(objectA, objectB);
+    }
 };
 
 class Constraint {
@@ -78,6 +84,8 @@ public:
     virtual void ProcessPosition() = 0;
     virtual Constraint *Copy() = 0;
     virtual bool Linking(Object *object) = 0;
+    // The two objects it acts on, which are solved in the same island
+    virtual pair<Object *, Object *> GetObjects() = 0;
     virtual void Redraw() {}
     virtual ~Constraint() {};
 };
@@ -164,11 +172,11 @@ public:
         if (object == objectA || object == objectB) return true;
         return false;
     }
+    pair<Object *, Object *> GetObjects() {
+        return make_pair(objectA, objectB);
+    }
 
-    void *operator new(size_t _);
-
-    void operator delete(void *p, size_t _);
-
+    TC_POOL_ALLOCATED(Contact)
 
 };
 
@@ -228,6 +236,9 @@ public:
         if (object == objectB) return true;
         return false;
     }
+    pair<Object *, Object *> GetObjects() {
+        return make_pair(objectA, objectB);
+    }
 };
 
     
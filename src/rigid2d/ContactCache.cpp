@@ -0,0 +1,13 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include "ContactCache.h"
+
+const double ContactCache::matchDistance = 4.0;
+const double ContactCache::matchCosine = 0.95;
@@ -0,0 +1,174 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#ifndef CONTACT_CACHE_H
+#define CONTACT_CACHE_H
+
+#include "Object.h"
+
+#include <algorithm>
+
+// Contacts as arrays over contacts instead of one Contact object each, so that rebuilding them every step and
+// every position iteration allocates nothing once the arrays have grown.
+// Impulses are accumulated over the velocity iterations and clamped as totals (normal impulses never pull,
+// friction stays within the friction cone of the normal impulse), so that they can be carried to the next step.
+class ContactPool {
+public:
+    vector<Shape *> shapeA, shapeB;
+    vector<Object *> objectA, objectB;
+    // Contact points and normals, from A to B
+    vector<Vector2D> p, n;
+    vector<double> depth, restitution, friction;
+    // Effective masses along the normal and the tangent, and the extra approach speed restitution removes
+    vector<double> normalMass, tangentMass, velocityBias;
+    // Accumulated impulses along the normal and the tangent
+    vector<double> normalImpulse, tangentImpulse;
+
+    int Size() const {
+        return (int)p.size();
+    }
+    void Clear() {
+        shapeA.clear(); shapeB.clear();
+        objectA.clear(); objectB.clear();
+        p.clear(); n.clear();
+        depth.clear(); restitution.clear(); friction.clear();
+        normalMass.clear(); tangentMass.clear(); velocityBias.clear();
+        normalImpulse.clear(); tangentImpulse.clear();
+    }
+    void Add(Shape *a, Shape *b, Vector2D p, Vector2D n, double depth) {
+        shapeA.push_back(a); shapeB.push_back(b);
+        objectA.push_back(a->object); objectB.push_back(b->object);
+        this->p.push_back(p); this->n.push_back(n);
+        this->depth.push_back(depth);
+        restitution.push_back(sqrt(a->restitution * b->restitution));
+        friction.push_back(sqrt(a->friction * b->friction));
+        normalMass.push_back(0.0); tangentMass.push_back(0.0); velocityBias.push_back(0.0);
+        normalImpulse.push_back(0.0); tangentImpulse.push_back(0.0);
+    }
+    double GetMass(int i, Vector2D d) const {
+        Object *a = objectA[i], *b = objectB[i];
+        Vector2D r0 = p[i] - a->position, r1 = p[i] - b->position;
+        return 1.0 / (a->invMass + b->invMass + sqr(r0 % d) * a->invInertia + sqr(r1 % d) * b->invInertia);
+    }
+    // Before the velocity iterations: masses, and restitution from the approach speed at the start of the step
+    void PrepareVelocity(int i) {
+        normalMass[i] = GetMass(i, n[i]);
+        tangentMass[i] = GetMass(i, n[i].GetRotate());
+        double v0 = -n[i] * (objectB[i]->GetPointVelocity(p[i]) - objectA[i]->GetPointVelocity(p[i]));
+        velocityBias[i] = v0 > 10 ? restitution[i] * v0 : 0.0;
+    }
+    void ApplyImpulse(int i, Vector2D impulse) {
+        objectA[i]->ApplyImpulse(p[i], -impulse);
+        objectB[i]->ApplyImpulse(p[i], impulse);
+    }
+    // Applies the impulses carried over from the previous step
+    void WarmStart(int i) {
+        ApplyImpulse(i, normalImpulse[i] * n[i] + tangentImpulse[i] * n[i].GetRotate());
+    }
+    void ProcessVelocity(int i, bool frictionSwitch) {
+        Vector2D v10 = objectB[i]->GetPointVelocity(p[i]) - objectA[i]->GetPointVelocity(p[i]);
+        double v0 = -n[i] * v10;
+        double J = max(0.0, normalImpulse[i] + normalMass[i] * (v0 + velocityBias[i]));
+        ApplyImpulse(i, (J - normalImpulse[i]) * n[i]);
+        normalImpulse[i] = J;
+        if (frictionSwitch) {
+            Vector2D tao = n[i].GetRotate();
+            v10 = objectB[i]->GetPointVelocity(p[i]) - objectA[i]->GetPointVelocity(p[i]);
+            double limit = friction[i] * J;
+            double j = max(min(tangentImpulse[i] - tangentMass[i] * (v10 * tao), limit), -limit);
+            ApplyImpulse(i, (j - tangentImpulse[i]) * tao);
+            tangentImpulse[i] = j;
+        }
+    }
+    void ProcessPosition(int i) {
+        double correctiveJ = (0.5 * max(0.0, depth[i] - 0.1) / timeInterval) * GetMass(i, n[i]);
+        if (correctiveJ > 0) {
+            objectA[i]->ApplyCorrectiveImpulse(p[i], -correctiveJ * n[i], true);
+            objectB[i]->ApplyCorrectiveImpulse(p[i], correctiveJ * n[i], true);
+        }
+    }
+};
+
+// The contacts of the current step, and those of the previous step by shape pair, to start the impulses of the
+// contacts of a pair from those of the matching contacts of the previous step.
+// A contact matches the closest previous contact of its pair within matchDistance with a similar normal;
+// TestCollision puts the contacts of a pair next to each other, so each pair is a range of the previous pool.
+class ContactCache {
+    typedef pair<Shape *, Shape *> Key;
+    struct Manifold {
+        Key key;
+        int begin, end;
+        bool operator < (const Manifold &other) const {
+            return key < other.key;
+        }
+    };
+    ContactPool previous;
+    vector<Manifold> manifolds;
+
+    static Key GetKey(Shape *a, Shape *b) {
+        return a < b ? Key(a, b) : Key(b, a);
+    }
+public:
+    // In world units, a little more than the broadphase skin
+    static const double matchDistance;
+    static const double matchCosine;
+    ContactPool contacts;
+
+    // Moves the contacts of the last step to the cache and empties contacts for the new step
+    void Begin() {
+        swap(previous, contacts);
+        contacts.Clear();
+        manifolds.clear();
+        for (int i = 0; i < previous.Size(); ) {
+            Manifold m;
+            m.key = GetKey(previous.shapeA[i], previous.shapeB[i]);
+            m.begin = i;
+            while (i < previous.Size() && GetKey(previous.shapeA[i], previous.shapeB[i]) == m.key) i++;
+            m.end = i;
+            manifolds.push_back(m);
+        }
+        sort(manifolds.begin(), manifolds.end());
+    }
+    // Forgets the previous step, e.g. when shapes are deleted and their addresses may be reused
+    void Reset() {
+        previous.Clear();
+        contacts.Clear();
+        manifolds.clear();
+    }
+    // Copies the impulses of the matching contacts of the previous step; returns the number of contacts matched
+    int Match() {
+        int matched = 0;
+        for (int i = 0; i < contacts.Size(); i++) {
+            Manifold m;
+            m.key = GetKey(contacts.shapeA[i], contacts.shapeB[i]);
+            vector<Manifold>::iterator it = lower_bound(manifolds.begin(), manifolds.end(), m);
+            if (it == manifolds.end() || it->key != m.key) continue;
+            int best = -1;
+            double bestDist = matchDistance;
+            for (int j = it->begin; j < it->end; j++) {
+                // Impulses are along the normal from A to B, which flips with the order of the pair
+                double sign = previous.shapeA[j] == contacts.shapeA[i] ? 1.0 : -1.0;
+                if (sign * (previous.n[j] * contacts.n[i]) < matchCosine) continue;
+                double dist = (previous.p[j] - contacts.p[i]).GetLength();
+                if (dist < bestDist) {
+                    bestDist = dist;
+                    best = j;
+                }
+            }
+            if (best == -1) continue;
+            contacts.normalImpulse[i] = previous.normalImpulse[best];
+            // The tangent flips with the normal, and so does the order of the pair: the impulse keeps its sign
+            contacts.tangentImpulse[i] = previous.tangentImpulse[best];
+            matched++;
+        }
+        return matched;
+    }
+};
+
+#endif
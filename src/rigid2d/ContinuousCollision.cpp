@@ -0,0 +1,182 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include "Physics.h"
+
+static Vector2D GetClosestPoint(Vector2D p, Vector2D a, Vector2D b) {
+    Vector2D ab = b - a;
+    double length2 = ab.GetLength2();
+    if (length2 < eps) return a;
+    return a + ab * max(0.0, min(1.0, (p - a) * ab / length2));
+}
+
+double Physics::GetSeparation(Polygon *a, Polygon *b, Vector2D &pa, Vector2D &pb) {
+    auto separatedByNormals = [](Polygon *a, Polygon *b) {
+        for (int i = 0; i < a->nPoints; i++) {
+            double min0, max0, min1, max1;
+            a->GetProjection(a->GetNormal(i), min0, max0);
+            b->GetProjection(a->GetNormal(i), min1, max1);
+            if (max0 < min1 || max1 < min0) return true;
+        }
+        return false;
+    };
+    if (!separatedByNormals(a, b) && !separatedByNormals(b, a)) return 0.0;
+    // Disjoint convex polygons are closest at a vertex of one of them
+    double best = DBL_INF;
+    for (int i = 0; i < a->nPoints; i++) {
+        for (int j = 0; j < b->nPoints; j++) {
+            Vector2D p = a->GetPoint(i);
+            Vector2D q = GetClosestPoint(p, b->GetPoint(j), b->GetPoint(loopNext(j, b->nPoints)));
+            double d = (q - p).GetLength();
+            if (d < best) best = d, pa = p, pb = q;
+            q = b->GetPoint(j);
+            p = GetClosestPoint(q, a->GetPoint(i), a->GetPoint(loopNext(i, a->nPoints)));
+            d = (q - p).GetLength();
+            if (d < best) best = d, pa = p, pb = q;
+        }
+    }
+    return best;
+}
+
+double Physics::GetSeparation(Circle *a, Circle *b, Vector2D &pa, Vector2D &pb) {
+    Vector2D ca = a->GetCentroidPosition(), cb = b->GetCentroidPosition();
+    Vector2D d = cb - ca;
+    double length = d.GetLength();
+    if (length <= a->radius + b->radius) return 0.0;
+    pa = ca + d * (a->radius / length);
+    pb = cb - d * (b->radius / length);
+    return length - a->radius - b->radius;
+}
+
+double Physics::GetSeparation(Circle *a, Polygon *b, Vector2D &pa, Vector2D &pb) {
+    Vector2D c = a->GetCentroidPosition();
+    if (b->IsPointInside(c)) return 0.0;
+    double best = DBL_INF;
+    for (int j = 0; j < b->nPoints; j++) {
+        Vector2D q = GetClosestPoint(c, b->GetPoint(j), b->GetPoint(loopNext(j, b->nPoints)));
+        double d = (q - c).GetLength();
+        if (d < best) best = d, pb = q;
+    }
+    if (best <= a->radius) return 0.0;
+    pa = c + (pb - c) * (a->radius / best);
+    return best - a->radius;
+}
+
+double Physics::GetSeparation(Shape *a, Shape *b, Vector2D &pa, Vector2D &pb) {
+    int typeA = a->GetType(), typeB = b->GetType();
+    if (typeA == Polygon::ShapeType && typeB == Polygon::ShapeType)
+        return GetSeparation((Polygon *)a, (Polygon *)b, pa, pb);
+    if (typeA == Circle::ShapeType && typeB == Circle::ShapeType)
+        return GetSeparation((Circle *)a, (Circle *)b, pa, pb);
+    if (typeA == Circle::ShapeType)
+        return GetSeparation((Circle *)a, (Polygon *)b, pa, pb);
+    return GetSeparation((Circle *)b, (Polygon *)a, pb, pa);
+}
+
+// Earliest fraction of the step at which shape, moving with its object from pose (p0, a0) by (dp, da), comes
+// within toiTolerance of other, or 1 if it does not. Conservative advancement: no point of shape, within radius
+// of the object position, approaches other along the normal between their closest points faster than
+// dp * n + |da| * radius, so advancing by the distance over that speed cannot pass through other.
+// Shapes overlapping at the start are left to the contact solver.
+double Physics::GetTimeOfImpact(Shape *shape, Shape *other, Vector2D p0, double a0, Vector2D dp, double da,
+        double radius) {
+    Object *object = shape->object;
+    double t = 0.0;
+    for (int k = 0; k < toiIterations; k++) {
+        object->SetPose(p0 + dp * t, a0 + da * t);
+        Vector2D pa, pb;
+        double d = GetSeparation(shape, other, pa, pb);
+        if (d == 0.0 && k == 0) return 1.0;
+        if (d <= toiTolerance) return t;
+        Vector2D n = (pb - pa) / d;
+        double speed = dp * n + abs(da) * radius;
+        if (speed <= 0) return 1.0;
+        t += (d - 0.5 * toiTolerance) / speed;
+        if (t >= 1.0) return 1.0;
+    }
+    return t;
+}
+
+void Physics::BeginSweeps() {
+    for (int i = 0; i < (int)objects.size(); i++) {
+        objects[i]->sweepPosition = objects[i]->position;
+        objects[i]->sweepAngle = objects[i]->rotationAngle;
+    }
+}
+
+// Moves each bullet back from where the step left it to where it first touches another object on the way, then
+// just into that object so that the contact is found and solved as usual. Objects are swept along a straight
+// line and a uniform rotation between their poses at the start and at the end of the step; the rest of the
+// motion of a bullet that hits something is lost. Other objects stay at the end of the step, and are tested
+// in the order of objects, so that bullets hitting each other do so deterministically.
+void Physics::SolveTimesOfImpact() {
+    for (int i = 0; i < (int)objects.size(); i++) {
+        Object *bullet = objects[i];
+        if (!bullet->bullet || bullet->fixed || bullet->sleeping) continue;
+        Vector2D p0 = bullet->sweepPosition, p1 = bullet->position;
+        double a0 = bullet->sweepAngle, a1 = bullet->rotationAngle;
+        Vector2D dp = p1 - p0;
+        double da = a1 - a0;
+        double radius = 0.0;
+        AABB box(DBL_INF, DBL_INF, -DBL_INF, -DBL_INF);
+        for (int k = 0; k < (int)bullet->shapes.size(); k++) {
+            Shape *shape = bullet->shapes[k];
+            if (shape->GetType() == Polygon::ShapeType) {
+                Polygon *polygon = (Polygon *)shape;
+                for (int j = 0; j < polygon->nPoints; j++)
+                    radius = max(radius, (polygon->GetPoint(j) - p1).GetLength());
+            } else {
+                Circle *circle = (Circle *)shape;
+                radius = max(radius, (circle->GetCentroidPosition() - p1).GetLength() + circle->radius);
+            }
+            box += shape->GetAABB();
+        }
+        // Bullets moving less than half their size overlap whatever they could have passed through
+        double motion = dp.GetLength() + abs(da) * radius;
+        if (motion < 0.5 * min(box.x1 - box.x0, box.y1 - box.y0)) continue;
+
+        bullet->SetPose(p0, a0);
+        for (int k = 0; k < (int)bullet->shapes.size(); k++)
+            box += bullet->shapes[k]->GetAABB();
+        sweepCandidates.clear();
+        for (int j = 0; j < (int)objects.size(); j++) {
+            if (objects[j] == bullet) continue;
+            for (int k = 0; k < (int)objects[j]->shapes.size(); k++)
+                if (box.Overlap(objects[j]->shapes[k]->GetAABB()))
+                    sweepCandidates.push_back(objects[j]->shapes[k]);
+        }
+
+        double toi = 1.0;
+        Shape *hitShape = NULL, *hitOther = NULL;
+        for (int k = 0; k < (int)bullet->shapes.size(); k++) {
+            Shape *shape = bullet->shapes[k];
+            for (int j = 0; j < (int)sweepCandidates.size(); j++) {
+                Shape *other = sweepCandidates[j];
+                if (!(shape->layerMask & other->layerMask)) continue;
+                double t = GetTimeOfImpact(shape, other, p0, a0, dp, da, radius);
+                if (t < toi) {
+                    toi = t;
+                    hitShape = shape;
+                    hitOther = other;
+                }
+            }
+        }
+        if (hitShape == NULL) {
+            bullet->SetPose(p1, a1);
+            continue;
+        }
+        for (int k = 0; k < toiIterations && toi < 1.0; k++) {
+            bullet->SetPose(p0 + dp * toi, a0 + da * toi);
+            Vector2D pa, pb;
+            if (GetSeparation(hitShape, hitOther, pa, pb) == 0.0) break;
+            toi = min(1.0, toi + toiPenetration / motion);
+        }
+        bullet->SetPose(p0 + dp * toi, a0 + da * toi);
+    }
+}
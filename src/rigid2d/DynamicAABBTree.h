@@ -0,0 +1,207 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#ifndef DYNAMIC_AABB_TREE_H
+#define DYNAMIC_AABB_TREE_H
+
+#include "Shape.h"
+
+// A bounding volume hierarchy over boxes that are inserted, moved and removed one at a time.
+// Leaves are placed where they grow the perimeter of the tree least, and subtrees are rotated to keep
+// the tree balanced.
+class DynamicAABBTree {
+    struct Node {
+        AABB box;
+        int parent, left, right;
+        // -1 for free nodes, 0 for leaves
+        int height;
+        Shape *shape;
+        bool IsLeaf() const {
+            return left == -1;
+        }
+    };
+    vector<Node> nodes;
+    int root, freeList;
+    mutable vector<int> queryStack;
+
+    static double Perimeter(const AABB &box) {
+        return 2 * ((box.x1 - box.x0) + (box.y1 - box.y0));
+    }
+    static AABB Union(const AABB &a, const AABB &b) {
+        return AABB(min(a.x0, b.x0), min(a.y0, b.y0), max(a.x1, b.x1), max(a.y1, b.y1));
+    }
+    int AllocateNode() {
+        if (freeList == -1) {
+            nodes.push_back(Node());
+            freeList = (int)nodes.size() - 1;
+            nodes[freeList].parent = -1;
+        }
+        int id = freeList;
+        freeList = nodes[id].parent;
+        nodes[id].parent = nodes[id].left = nodes[id].right = -1;
+        nodes[id].height = 0;
+        nodes[id].shape = NULL;
+        return id;
+    }
+    void FreeNode(int id) {
+        nodes[id].parent = freeList;
+        nodes[id].height = -1;
+        freeList = id;
+    }
+    void Refit(int id) {
+        Node &node = nodes[id];
+        node.box = Union(nodes[node.left].box, nodes[node.right].box);
+        node.height = 1 + max(nodes[node.left].height, nodes[node.right].height);
+    }
+    // Rotates a grandchild up if the children of a differ in height by more than one; returns the new root
+    // of the subtree
+    int Balance(int a) {
+        Node &A = nodes[a];
+        if (A.IsLeaf() || A.height < 2) return a;
+        int b = A.left, c = A.right;
+        int balance = nodes[c].height - nodes[b].height;
+        if (balance > 1) return Rotate(a, c, b);
+        if (balance < -1) return Rotate(a, b, c);
+        return a;
+    }
+    // Moves the taller child up into the place of a, with a taking the shorter of its children
+    int Rotate(int a, int up, int other) {
+        int f = nodes[up].left, g = nodes[up].right;
+        nodes[up].left = a;
+        nodes[up].parent = nodes[a].parent;
+        nodes[a].parent = up;
+        if (nodes[up].parent != -1) {
+            Node &parent = nodes[nodes[up].parent];
+            (parent.left == a ? parent.left : parent.right) = up;
+        } else {
+            root = up;
+        }
+        if (nodes[f].height < nodes[g].height) swap(f, g);
+        nodes[up].right = f;
+        nodes[a].left = other;
+        nodes[a].right = g;
+        nodes[g].parent = a;
+        Refit(a);
+        Refit(up);
+        return up;
+    }
+    void InsertLeaf(int leaf) {
+        if (root == -1) {
+            root = leaf;
+            nodes[root].parent = -1;
+            return;
+        }
+        const AABB box = nodes[leaf].box;
+        int index = root;
+        while (!nodes[index].IsLeaf()) {
+            const Node &node = nodes[index];
+            double area = Perimeter(node.box);
+            double combinedArea = Perimeter(Union(node.box, box));
+            // Cost of a new parent for this node and the leaf, and of pushing the leaf further down
+            double cost = 2 * combinedArea;
+            double inheritanceCost = 2 * (combinedArea - area);
+            double childCost[2];
+            for (int k = 0; k < 2; k++) {
+                const Node &child = nodes[k == 0 ? node.left : node.right];
+                double enlarged = Perimeter(Union(child.box, box));
+                childCost[k] = (child.IsLeaf() ? enlarged : enlarged - Perimeter(child.box)) + inheritanceCost;
+            }
+            if (cost < childCost[0] && cost < childCost[1]) break;
+            index = childCost[0] < childCost[1] ? node.left : node.right;
+        }
+        int sibling = index;
+        int oldParent = nodes[sibling].parent;
+        int newParent = AllocateNode();
+        nodes[newParent].parent = oldParent;
+        nodes[newParent].left = sibling;
+        nodes[newParent].right = leaf;
+        nodes[sibling].parent = newParent;
+        nodes[leaf].parent = newParent;
+        if (oldParent != -1) {
+            Node &parent = nodes[oldParent];
+            (parent.left == sibling ? parent.left : parent.right) = newParent;
+        } else {
+            root = newParent;
+        }
+        for (index = newParent; index != -1; index = nodes[index].parent) {
+            Refit(index);
+            index = Balance(index);
+        }
+    }
+    void RemoveLeaf(int leaf) {
+        if (leaf == root) {
+            root = -1;
+            return;
+        }
+        int parent = nodes[leaf].parent;
+        int grandParent = nodes[parent].parent;
+        int sibling = nodes[parent].left == leaf ? nodes[parent].right : nodes[parent].left;
+        FreeNode(parent);
+        nodes[sibling].parent = grandParent;
+        if (grandParent == -1) {
+            root = sibling;
+            return;
+        }
+        Node &node = nodes[grandParent];
+        (node.left == parent ? node.left : node.right) = sibling;
+        for (int index = grandParent; index != -1; index = nodes[index].parent) {
+            Refit(index);
+            index = Balance(index);
+        }
+    }
+public:
+    DynamicAABBTree() : root(-1), freeList(-1) {}
+    // Returns the id of the new leaf
+    int Insert(const AABB &box, Shape *shape) {
+        int leaf = AllocateNode();
+        nodes[leaf].box = box;
+        nodes[leaf].shape = shape;
+        InsertLeaf(leaf);
+        return leaf;
+    }
+    void Remove(int leaf) {
+        RemoveLeaf(leaf);
+        FreeNode(leaf);
+    }
+    void Move(int leaf, const AABB &box) {
+        RemoveLeaf(leaf);
+        nodes[leaf].box = box;
+        InsertLeaf(leaf);
+    }
+    const AABB &GetBox(int leaf) const {
+        return nodes[leaf].box;
+    }
+    Shape *GetShape(int leaf) const {
+        return nodes[leaf].shape;
+    }
+    int GetHeight() const {
+        return root == -1 ? 0 : nodes[root].height;
+    }
+    // Calls callback(leaf) for every leaf whose box overlaps box
+    template <typename T>
+    void Query(AABB box, const T &callback) const {
+        if (root == -1) return;
+        queryStack.clear();
+        queryStack.push_back(root);
+        while (!queryStack.empty()) {
+            const Node &node = nodes[queryStack.back()];
+            int id = queryStack.back();
+            queryStack.pop_back();
+            if (!box.Overlap(node.box)) continue;
+            if (node.IsLeaf()) {
+                callback(id);
+            } else {
+                queryStack.push_back(node.left);
+                queryStack.push_back(node.right);
+            }
+        }
+    }
+};
+
+#endif
@@ -118,6 +118,7 @@ void Game::Run() {
         }
         
         if (!settings.pause) {
+            physics.settings = settings;
             physics.Proceed(timeInterval);
         } else exit(0);//glfwSleep(0.05);
         /*
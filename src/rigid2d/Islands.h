@@ -0,0 +1,129 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#ifndef ISLANDS_H
+#define ISLANDS_H
+
+#include "Constraints.h"
+
+// Groups of objects that can touch (by their broadphase pairs) or are linked by constraints or forces, found
+// by union-find every step. Islands share nothing they write to and are solved in parallel.
+// Fixed objects belong to no island, so that piles resting on the same ground stay independent.
+// Members of each island are kept as ranges of flat arrays, which are reused from step to step.
+class Islands {
+    vector<int> parent;
+    // Island of each object, -1 for fixed objects
+    vector<int> objectIsland;
+    vector<int> objectBegin, objectList;
+    vector<int> pairBegin, pairList;
+    vector<int> constraintBegin, constraintList;
+    vector<int> contactBegin, contactList;
+    vector<int> keys, cursor;
+    int numIslands;
+
+    int Find(int x) {
+        while (parent[x] != x) {
+            parent[x] = parent[parent[x]];
+            x = parent[x];
+        }
+        return x;
+    }
+    void Union(Object *a, Object *b) {
+        if (a->fixed || b->fixed) return;
+        int x = Find(a->solverIndex), y = Find(b->solverIndex);
+        if (x != y) parent[max(x, y)] = min(x, y);
+    }
+    // Sorts items into ranges by their islands; items of island -1 are left out
+    void Bucket(const vector<int> &islands, vector<int> &begin, vector<int> &list) {
+        begin.assign(numIslands + 1, 0);
+        for (int i = 0; i < (int)islands.size(); i++)
+            if (islands[i] != -1) begin[islands[i] + 1]++;
+        for (int k = 0; k < numIslands; k++)
+            begin[k + 1] += begin[k];
+        list.resize(begin[numIslands]);
+        cursor.assign(begin.begin(), begin.end() - 1);
+        for (int i = 0; i < (int)islands.size(); i++)
+            if (islands[i] != -1) list[cursor[islands[i]]++] = i;
+    }
+    int GetIsland(Object *a, Object *b) const {
+        return a->fixed ? objectIsland[b->solverIndex] : objectIsland[a->solverIndex];
+    }
+public:
+    Islands() : numIslands(0) {}
+    void Build(const vector<Object *> &objects, const vector<pair<Shape *, Shape *> > &pairs,
+            const vector<Constraint *> &constraints, const vector<Force *> &forces) {
+        int n = (int)objects.size();
+        parent.resize(n);
+        for (int i = 0; i < n; i++) {
+            objects[i]->solverIndex = i;
+            parent[i] = i;
+        }
+        for (int i = 0; i < (int)pairs.size(); i++)
+            Union(pairs[i].first->object, pairs[i].second->object);
+        for (int i = 0; i < (int)constraints.size(); i++) {
+            pair<Object *, Object *> linked = constraints[i]->GetObjects();
+            Union(linked.first, linked.second);
+        }
+        for (int i = 0; i < (int)forces.size(); i++) {
+            pair<Object *, Object *> linked = forces[i]->GetObjects();
+            Union(linked.first, linked.second);
+        }
+        // Roots come first in their islands, so islands are numbered in order of their first object
+        numIslands = 0;
+        objectIsland.resize(n);
+        for (int i = 0; i < n; i++) {
+            if (objects[i]->fixed) objectIsland[i] = -1;
+            else if (Find(i) == i) objectIsland[i] = numIslands++;
+            else objectIsland[i] = objectIsland[Find(i)];
+        }
+        Bucket(objectIsland, objectBegin, objectList);
+        keys.resize(pairs.size());
+        for (int i = 0; i < (int)pairs.size(); i++)
+            keys[i] = GetIsland(pairs[i].first->object, pairs[i].second->object);
+        Bucket(keys, pairBegin, pairList);
+        keys.resize(constraints.size());
+        for (int i = 0; i < (int)constraints.size(); i++) {
+            pair<Object *, Object *> linked = constraints[i]->GetObjects();
+            keys[i] = GetIsland(linked.first, linked.second);
+        }
+        Bucket(keys, constraintBegin, constraintList);
+    }
+    // Sorts the contacts of the current step into the islands
+    void AddContacts(const ContactPool &contacts) {
+        keys.resize(contacts.Size());
+        for (int i = 0; i < contacts.Size(); i++)
+            keys[i] = GetIsland(contacts.objectA[i], contacts.objectB[i]);
+        Bucket(keys, contactBegin, contactList);
+    }
+    int Size() const {
+        return numIslands;
+    }
+    int GetIsland(Object *object) const {
+        return objectIsland[object->solverIndex];
+    }
+    // Indices into the objects, pairs, constraints and contacts given to Build and AddContacts
+    const int *GetObjects(int k, int &count) const {
+        count = objectBegin[k + 1] - objectBegin[k];
+        return objectList.data() + objectBegin[k];
+    }
+    const int *GetPairs(int k, int &count) const {
+        count = pairBegin[k + 1] - pairBegin[k];
+        return pairList.data() + pairBegin[k];
+    }
+    const int *GetConstraints(int k, int &count) const {
+        count = constraintBegin[k + 1] - constraintBegin[k];
+        return constraintList.data() + constraintBegin[k];
+    }
+    const int *GetContacts(int k, int &count) const {
+        count = contactBegin[k + 1] - contactBegin[k];
+        return contactList.data() + contactBegin[k];
+    }
+};
+
+#endif
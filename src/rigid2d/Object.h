@@ -14,8 +14,11 @@
 #include "Circle.h"
 #include "Settings.h"
 
+#include <taichi/common/pool_allocator.h>
+
 class Object {
 public:
+    TC_POOL_ALLOCATED(Object)
     vector<Shape *> shapes;
     double mass, base_mass;
     double inertia, base_inertia;
@@ -33,6 +36,17 @@ public:
     bool fibRot, selected;
     int priority;
     int type;
+    // Sleeping objects are neither integrated nor solved until their island is woken
+    bool sleeping;
+    // How long the object has been slow enough to sleep
+    double restingTime;
+    // Index in Physics::objects, for the island of the current step
+    int solverIndex;
+    // Bullets are swept from their pose at the start of each step, so that fast ones cannot pass through thin
+    // objects; see Physics::SolveTimesOfImpact
+    bool bullet;
+    Vector2D sweepPosition;
+    double sweepAngle;
     void Init() {
         color = RGB3f::RandomBrightColor();
         fixed = false;
@@ -46,6 +60,11 @@ public:
         linearResistance = rotationResistance = 0.0001;
         selected = false;
         type = 0;
+        sleeping = false;
+        restingTime = 0.0;
+        solverIndex = -1;
+        bullet = false;
+        sweepAngle = 0.0;
     }
 
 
@@ -88,6 +107,10 @@ public:
         Init();
         AddShapes(shapes);
     }
+    ~Object() {
+        for (int i = 0; i < (int)shapes.size(); i++)
+            delete shapes[i];
+    }
     void AddShape(Shape *shape) {
         shapes.push_back(shape);
         shape->object = this;
@@ -138,30 +161,52 @@ public:
         this->rotationAngle = rotationAngle;
         ResetTransformToWorld();
     }
-    void ApplyGravity(double T) {
-        if (fixed) return;
-        ApplyImpulse(position, Vector2D(0, -settings.gravity, 0) * mass * T);
+    void SetPose(Vector2D position, double rotationAngle) {
+        this->position = position;
+        this->rotationAngle = rotationAngle;
+        ResetTransformToWorld();
+    }
+    void SetBullet(bool bullet) {
+        this->bullet = bullet;
+    }
+    void ApplyGravity(double T, double gravity) {
+        if (fixed || sleeping) return;
+        ApplyImpulse(position, Vector2D(0, -gravity, 0) * mass * T);
     }
     void SetFixed(bool fixed) {
         this->fixed = fixed;
+        SetAwake();
         Update();
     }
     bool GetFixed() {
         return this->fixed;
     }
+    void SetAwake() {
+        sleeping = false;
+        restingTime = 0.0;
+    }
+    void Sleep() {
+        sleeping = true;
+        linearVelocity = Vector2D(0, 0, 0);
+        angularVelocity = 0.0;
+    }
+    // Fixed objects take no impulses, so that islands solved in parallel can share them without writing to them
     void ApplyTorque(double torque) {
+        if (fixed) return;
         angularVelocity += torque * invInertia;
     }
     void ApplyImpulse(Vector2D r, Vector2D p) {
+        if (fixed) return;
         linearVelocity += p * invMass;
         ApplyTorque((r - position) % p);
     }
     void ApplyCorrectiveImpulse(Vector2D r, Vector2D p, bool paintNeed = true) {
+        if (fixed) return;
         correctiveLinearVelocity += p * invMass;
         correctiveAngularVelocity += (r - position) % p * invInertia;
     }
     void Proceed(double T) {
-        if (fixed) return; 
+        if (fixed || sleeping) return; 
         position += T * (linearVelocity);
         rotationAngle += T * (angularVelocity);
         if (sgn(linearVelocity.GetLength2()))
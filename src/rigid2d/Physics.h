@@ -10,21 +10,48 @@
 #pragma once
 
 #include "Constraints.h"
+#include "ContactCache.h"
+#include "Islands.h"
 #include "QuickIntersectionTest.h"
 #include "ShapeFactory.h"
 #include "Timer.h"
 
+#include <taichi/system/threading.h>
+
 class Physics {
 private:
     IntersectionTest iTest;
+    vector<pair<Shape *, Shape *> > potentialCols;
+    // Pairs of the position iterations, with a larger skin
+    vector<pair<Shape *, Shape *> > positionCols;
+    Islands islands;
+    vector<char> islandAwake;
+    vector<int> awakeIslands;
+    // Contacts of the velocity iterations, kept with their impulses for the next step
+    ContactCache contactCache;
+    // Shapes in the way of the bullet being swept
+    vector<Shape *> sweepCandidates;
 public:
     vector<Object *> objects;
-    vector<Constraint *> constraints;
     vector<Constraint *> constantConstraints;
     vector<Force *> forces;
     vector<Vector2D> contactPoints;
     Object *worldBox;
-    Physics() {
+    // Of this world only, so that worlds can be stepped concurrently with different settings
+    Settings settings;
+    Physics() : worldBox(NULL) {
+    }
+    explicit Physics(const Settings &settings) : worldBox(NULL), settings(settings) {
+    }
+    Physics(const Physics &) = delete;
+    Physics &operator = (const Physics &) = delete;
+    ~Physics() {
+        for (int i = 0; i < (int)objects.size(); i++)
+            delete objects[i];
+        for (int i = 0; i < (int)constantConstraints.size(); i++)
+            delete constantConstraints[i];
+        for (int i = 0; i < (int)forces.size(); i++)
+            delete forces[i];
     }
     void SetAsDefaultWorld() {
         DeleteAllObjects();
@@ -52,6 +79,11 @@ public:
         while ((int)objects.size()) DeleteLastObject();
     }
     void DeleteObject(Object *object) {
+        contactCache.Reset();
+        // Whatever rested on it has to fall
+        for (int i = 0; i < (int)objects.size(); i++)
+            objects[i]->SetAwake();
+        if (object == worldBox) worldBox = NULL;
         delete object;
         sort(objects.begin(), objects.end());
         objects.erase(lower_bound(objects.begin(), objects.end(), object));
@@ -68,63 +100,128 @@ public:
     }
     void Proceed(double T) {
         CleanRubbish();
+        if (settings.continuousSwitch)
+            BeginSweeps();
         for (int i = 0; i < settings.stepIteration; i++)
             ProceedSmallStep(T / settings.stepIteration);
+        if (settings.continuousSwitch)
+            SolveTimesOfImpact();
         for (int i = 0; i < (int)objects.size(); i++)
-            objects[i]->ApplyGravity(T);
+            objects[i]->ApplyGravity(T, settings.gravity);
         SolveSituation(T);
     }
     void ProceedSmallStep(double T) {
         for (int i = 0; i < (int)forces.size(); i++)
             forces[i]->Apply(T);
-        for (int i = 0; i < (int)objects.size(); i++)
+        taichi::parallel_for(0, (int)objects.size(), settings.numThreads, [&](int i) {
             objects[i]->Proceed(T);
+        });
     }
+    // Solves the contacts and constraints of each island that is awake, in parallel over islands
     void SolveSituation(double T) {
 
         contactPoints.clear();
-        for (int i = 0; i < (int)constantConstraints.size(); i++)
-            constraints.push_back(constantConstraints[i]->Copy());
-        vector<pair<Shape*, Shape *> > potentialCols;
 
         iTest.Init(objects, 3.0);
-        potentialCols = iTest.GetResult();
+        iTest.GetResult(potentialCols);
+        // Positions do not change before the position iterations, so their pairs can be found here
+        iTest.Init(objects, 5);
+        iTest.GetResult(positionCols);
+//        printf("Potential Collisions %d\n", (int)positionCols.size());
 
+        islands.Build(objects, positionCols, constantConstraints, forces);
+        WakeIslands();
 
-        for (int i = 0; i < (int)potentialCols.size(); i++)
-            TestCollision(potentialCols[i].first, potentialCols[i].second);
+        contactCache.Begin();
+        ContactPool &contacts = contactCache.contacts;
+        for (int i = 0; i < (int)potentialCols.size(); i++) {
+            Shape *a = potentialCols[i].first, *b = potentialCols[i].second;
+            if (IsAwake(a->object, b->object))
+                TestCollision(a, b, contacts);
+        }
+        if (settings.warmStarting)
+            contactCache.Match();
+        islands.AddContacts(contacts);
 
-        
-        for (int K = 0; K < settings.velocityIteration; K++)
-            for (int i = 0; i < (int)constraints.size(); i++)
-                constraints[i]->ProcessVelocity();
+        taichi::parallel_for(0, (int)awakeIslands.size(), settings.numThreads, [&](int k) {
+            SolveIsland(awakeIslands[k], T);
+        }, 1);
         //Show Collision Points
-        for (int i = 0; i < (int)constraints.size(); i++) {
-            if (constraints[i]->type == TYPE_CONTACT)
-                contactPoints.push_back(((Contact *)constraints[i])->p);
+        contactPoints = contacts.p;
+    }
+    bool IsAwake(Object *a, Object *b) {
+        int k = islands.GetIsland(a->fixed ? b : a);
+        return k != -1 && islandAwake[k];
+    }
+    // An island is awake if any of its objects is, or has been set moving since it fell asleep
+    void WakeIslands() {
+        islandAwake.assign(islands.Size(), 0);
+        awakeIslands.clear();
+        for (int k = 0; k < islands.Size(); k++) {
+            int n;
+            const int *members = islands.GetObjects(k, n);
+            bool awake = !settings.sleepSwitch;
+            for (int i = 0; i < n && !awake; i++) {
+                Object *object = objects[members[i]];
+                awake = !object->sleeping || !IsSlow(object);
+            }
+            if (!awake) continue;
+            for (int i = 0; i < n; i++)
+                if (objects[members[i]]->sleeping)
+                    objects[members[i]]->SetAwake();
+            islandAwake[k] = 1;
+            awakeIslands.push_back(k);
+        }
+    }
+    static bool IsSlow(Object *object) {
+        return object->linearVelocity.GetLength() < sleepLinearVelocity &&
+            abs(object->angularVelocity) < sleepAngularVelocity;
+    }
+    void SolveIsland(int k, double T) {
+        ContactPool &contacts = contactCache.contacts;
+        int numObjects, numPairs, numConstraints, numContacts;
+        const int *islandObjects = islands.GetObjects(k, numObjects);
+        const int *islandPairs = islands.GetPairs(k, numPairs);
+        const int *islandConstraints = islands.GetConstraints(k, numConstraints);
+        const int *islandContacts = islands.GetContacts(k, numContacts);
+
+        for (int i = 0; i < numContacts; i++)
+            contacts.PrepareVelocity(islandContacts[i]);
+        if (settings.warmStarting)
+            for (int i = 0; i < numContacts; i++)
+                contacts.WarmStart(islandContacts[i]);
+        for (int K = 0; K < settings.velocityIteration; K++) {
+            for (int i = 0; i < numConstraints; i++)
+                constantConstraints[islandConstraints[i]]->ProcessVelocity();
+            for (int i = 0; i < numContacts; i++)
+                contacts.ProcessVelocity(islandContacts[i], settings.frictionSwitch != 0);
         }
 
-        iTest.Init(objects, 5);
-        potentialCols = iTest.GetResult();        
-//        printf("Potential Collisions %d\n", (int)potentialCols.size());
-        
+        // Contacts of the current position iteration, of the islands of this thread
+        static thread_local ContactPool positionContacts;
         for (int K = 0; K < settings.positionIteration; K++) {
-            for (int i = 0; i < (int)constraints.size(); i++) delete(constraints[i]);
-            constraints.clear();
-            for (int i = 0; i < (int)potentialCols.size(); i++)
-                TestCollision(potentialCols[i].first, potentialCols[i].second);
-//            random_shuffle(constraints.begin(), constraints.end());
-            for (int i = 0; i < (int)constraints.size(); i++)
-                constraints[i]->ProcessPosition();
-            for (int i = 0; i < (int)constantConstraints.size(); i++)
-                constantConstraints[i]->ProcessPosition();
-            for (int i = 0; i < (int)objects.size(); i++)
-                objects[i]->ApplyPositionCorrection(T);
+            positionContacts.Clear();
+            for (int i = 0; i < numPairs; i++)
+                TestCollision(positionCols[islandPairs[i]].first, positionCols[islandPairs[i]].second,
+                    positionContacts);
+            for (int i = 0; i < positionContacts.Size(); i++)
+                positionContacts.ProcessPosition(i);
+            for (int i = 0; i < numConstraints; i++)
+                constantConstraints[islandConstraints[i]]->ProcessPosition();
+            for (int i = 0; i < numObjects; i++)
+                objects[islandObjects[i]]->ApplyPositionCorrection(T);
         }
-        for (; !constraints.empty(); ) {
-            delete constraints.back();
-            constraints.pop_back();
+
+        if (!settings.sleepSwitch) return;
+        double restingTime = DBL_INF;
+        for (int i = 0; i < numObjects; i++) {
+            Object *object = objects[islandObjects[i]];
+            object->restingTime = IsSlow(object) ? object->restingTime + T : 0.0;
+            restingTime = min(restingTime, object->restingTime);
         }
+        if (restingTime >= timeToSleep)
+            for (int i = 0; i < numObjects; i++)
+                objects[islandObjects[i]]->Sleep();
     }
     void CleanRubbish() {
         bool flg = true;
@@ -159,11 +256,23 @@ public:
             graphics.DrawPoint(contactPoints[i].x, contactPoints[i].y, Colors::Black, 3);
         */
     }
-    void TestCollision(Polygon *a, Polygon *b);
-    void TestCollision(Circle *a, Circle *b);
-    void TestCollision(Circle *a, Polygon *b);
-    void TestCollision(Shape *a, Shape *b);
-    void TestCollision(Object *a, Object *b);
+    // Add the contacts of a and b to contacts
+    void TestCollision(Polygon *a, Polygon *b, ContactPool &contacts);
+    void TestCollision(Circle *a, Circle *b, ContactPool &contacts);
+    void TestCollision(Circle *a, Polygon *b, ContactPool &contacts);
+    void TestCollision(Shape *a, Shape *b, ContactPool &contacts);
+    void TestCollision(Object *a, Object *b, ContactPool &contacts);
+
+    // Continuous collision of bullets
+    void BeginSweeps();
+    void SolveTimesOfImpact();
+    static double GetTimeOfImpact(Shape *shape, Shape *other, Vector2D p0, double a0, Vector2D dp, double da,
+        double radius);
+    // Distance between a and b and its closest points, or 0 if they overlap
+    static double GetSeparation(Polygon *a, Polygon *b, Vector2D &pa, Vector2D &pb);
+    static double GetSeparation(Circle *a, Circle *b, Vector2D &pa, Vector2D &pb);
+    static double GetSeparation(Circle *a, Polygon *b, Vector2D &pa, Vector2D &pb);
+    static double GetSeparation(Shape *a, Shape *b, Vector2D &pa, Vector2D &pb);
 
     /*
     static void TW_CALL GetObjectNumberTW(void *value, void *data) {
@@ -0,0 +1,98 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#ifndef PHYSICS_BATCH_H
+#define PHYSICS_BATCH_H
+
+#include "Physics.h"
+
+// Independent worlds stepped together, e.g. for parameter sweeps. Worlds are headless: they start empty (no
+// world box), have settings of their own, and are never drawn. Each world is stepped by one thread at a time and
+// the worlds are spread over the threads, so throughput grows with the number of threads as long as there are
+// more worlds than threads.
+class PhysicsBatch {
+    vector<Physics *> worlds;
+public:
+    // Per object: x, y, rotation angle, linear velocity x and y, angular velocity
+    static const int stateSize = 6;
+
+    // Worlds solve their islands serially by default, as the batch is parallel over worlds
+    explicit PhysicsBatch(int numWorlds) {
+        Settings settings;
+        settings.numThreads = 1;
+        for (int i = 0; i < numWorlds; i++)
+            worlds.push_back(new Physics(settings));
+    }
+    PhysicsBatch(int numWorlds, const Settings &settings) {
+        for (int i = 0; i < numWorlds; i++)
+            worlds.push_back(new Physics(settings));
+    }
+    PhysicsBatch(const PhysicsBatch &) = delete;
+    PhysicsBatch &operator = (const PhysicsBatch &) = delete;
+    ~PhysicsBatch() {
+        for (int i = 0; i < (int)worlds.size(); i++)
+            delete worlds[i];
+    }
+    int Size() const {
+        return (int)worlds.size();
+    }
+    Physics &GetWorld(int w) {
+        return *worlds[w];
+    }
+    Object *AddObject(int w, Object *object, Vector2D center, double angle, bool fixed) {
+        object->SetPosition(Vector2D(center.x, center.y, 1));
+        object->SetRotationAngle(angle);
+        if (fixed) object->SetFixed(true);
+        worlds[w]->AddObject(object);
+        return object;
+    }
+    Object *AddBox(int w, Vector2D center, double width, double height, double angle = 0.0, bool fixed = false) {
+        return AddObject(w, ShapeFactory::GenerateBoxObject(width, height), center, angle, fixed);
+    }
+    Object *AddCircle(int w, Vector2D center, double radius, bool fixed = false) {
+        return AddObject(w, ShapeFactory::GenerateCircleObject(radius), center, 0.0, fixed);
+    }
+    // Advances every world by steps steps of T
+    void Proceed(double T, int steps, int numThreads) {
+        taichi::parallel_for(0, Size(), numThreads, [&](int w) {
+            for (int i = 0; i < steps; i++)
+                worlds[w]->Proceed(T);
+        }, 1);
+    }
+    int GetNumObjects(int w) const {
+        return (int)worlds[w]->objects.size();
+    }
+    // stateSize values per object of world w, in the order of Physics::objects (the order of addition, unless
+    // objects have been deleted)
+    void GetState(int w, double *state) const {
+        const vector<Object *> &objects = worlds[w]->objects;
+        for (int i = 0; i < (int)objects.size(); i++, state += stateSize) {
+            Object *object = objects[i];
+            state[0] = object->position.x;
+            state[1] = object->position.y;
+            state[2] = object->rotationAngle;
+            state[3] = object->linearVelocity.x;
+            state[4] = object->linearVelocity.y;
+            state[5] = object->angularVelocity;
+        }
+    }
+    void SetState(int w, const double *state) {
+        const vector<Object *> &objects = worlds[w]->objects;
+        for (int i = 0; i < (int)objects.size(); i++, state += stateSize) {
+            Object *object = objects[i];
+            object->position = Vector2D(state[0], state[1], 1);
+            object->SetRotationAngle(state[2]);
+            object->linearVelocity = Vector2D(state[3], state[4], 0);
+            object->angularVelocity = state[5];
+            object->SetAwake();
+        }
+    }
+};
+
+#endif
@@ -11,7 +11,9 @@
 #define QUICK_INTERSECTION_TEST_H
 
 #include "Object.h"
+#include "DynamicAABBTree.h"
 
+#include <map>
 #include <set>
 /*
 class IntersectionTest {
@@ -130,43 +132,122 @@ public:
 
 */
 
+// Broadphase kept from step to step: every shape has a fat box in a DynamicAABBTree, its box enlarged by
+// twice the largest skin seen, and is only moved in the tree once its box enlarged by skin leaves the fat box.
+// Pairs of shapes with overlapping fat boxes are kept as well; only the moved shapes are queried for new ones.
 class IntersectionTest {
-    vector<Shape *> shapes;
-    int n;
-    AABB aabbs[1024];
-    double skin;
+    struct Proxy {
+        int leaf;
+        AABB box;
+        // Position in the shapes passed to the last Init
+        int index;
+        bool alive;
+    };
+    DynamicAABBTree tree;
+    map<Shape *, Proxy> proxies;
+    // With a < b
+    set<pair<Shape *, Shape *> > pairs;
+    vector<pair<Shape *, Shape *> > addedPairs, removedPairs;
+    double skin, fatMargin;
 public:
-    IntersectionTest() {}
-    void Init(vector<Object *> objects, double skin) {
-        shapes.clear();
+    IntersectionTest() : skin(0), fatMargin(0) {}
+    // Updates the tree with the shapes of objects, which may have been added, moved or removed since the last call
+    void Init(const vector<Object *> &objects, double skin) {
+        this->skin = skin;
+        bool grow = 2 * skin > fatMargin;
+        fatMargin = max(fatMargin, 2 * skin);
+        for (map<Shape *, Proxy>::iterator it = proxies.begin(); it != proxies.end(); it++)
+            it->second.alive = false;
+        vector<Shape *> moved;
+        int index = 0;
         for (int i = 0; i < (int)objects.size(); i++) {
-            for (vector<Shape *>::iterator it = objects[i]->shapes.begin(); it != objects[i]->shapes.end(); it++) {
-                if ((*it)->layerMask != 0) {
-                    shapes.push_back(*it);
+            for (int j = 0; j < (int)objects[i]->shapes.size(); j++) {
+                Shape *shape = objects[i]->shapes[j];
+                if (shape->layerMask == 0) continue;
+                AABB box = shape->GetAABB();
+                AABB skinned = box;
+                skinned.Enlarge(skin);
+                AABB fat = box;
+                fat.Enlarge(fatMargin);
+                map<Shape *, Proxy>::iterator proxy = proxies.find(shape);
+                if (proxy == proxies.end()) {
+                    Proxy p;
+                    p.leaf = tree.Insert(fat, shape);
+                    proxy = proxies.insert(make_pair(shape, p)).first;
+                    moved.push_back(shape);
+                } else if (grow || !Contains(tree.GetBox(proxy->second.leaf), skinned)) {
+                    tree.Move(proxy->second.leaf, fat);
+                    moved.push_back(shape);
                 }
+                proxy->second.box = box;
+                proxy->second.index = index++;
+                proxy->second.alive = true;
             }
         }
-        this->skin = skin;
+        addedPairs.clear();
+        removedPairs.clear();
+        for (map<Shape *, Proxy>::iterator it = proxies.begin(); it != proxies.end();) {
+            if (!it->second.alive) {
+                tree.Remove(it->second.leaf);
+                proxies.erase(it++);
+            } else {
+                it++;
+            }
+        }
+        for (set<pair<Shape *, Shape *> >::iterator it = pairs.begin(); it != pairs.end();) {
+            map<Shape *, Proxy>::iterator a = proxies.find(it->first), b = proxies.find(it->second);
+            if (a == proxies.end() || b == proxies.end() ||
+                !AABB(tree.GetBox(a->second.leaf)).Overlap(tree.GetBox(b->second.leaf))) {
+                removedPairs.push_back(*it);
+                pairs.erase(it++);
+            } else {
+                it++;
+            }
+        }
+        for (int i = 0; i < (int)moved.size(); i++) {
+            Shape *shape = moved[i];
+            tree.Query(tree.GetBox(proxies[shape].leaf), [&](int leaf) {
+                Shape *other = tree.GetShape(leaf);
+                if (other == shape) return;
+                pair<Shape *, Shape *> p = shape < other ? make_pair(shape, other) : make_pair(other, shape);
+                if (pairs.insert(p).second) addedPairs.push_back(p);
+            });
+        }
     }
-    vector<pair<Shape *, Shape *> > GetResult() {
-        
-        n = (int)shapes.size();
-        if (n <= 1) return vector<pair<Shape *, Shape *> >();
-        for (int i = 0; i < n; i++) {
-            aabbs[i] = shapes[i]->GetAABB();
-            aabbs[i].Enlarge(skin);
+    static bool Contains(const AABB &outer, const AABB &inner) {
+        return outer.x0 <= inner.x0 && outer.y0 <= inner.y0 && inner.x1 <= outer.x1 && inner.y1 <= outer.y1;
+    }
+    // Pairs whose boxes enlarged by skin overlap, ordered as the shapes of objects
+    void GetResult(vector<pair<Shape *, Shape *> > &ret) {
+        vector<pair<pair<int, int>, pair<Shape *, Shape *> > > sorted;
+        for (set<pair<Shape *, Shape *> >::iterator it = pairs.begin(); it != pairs.end(); it++) {
+            const Proxy &a = proxies[it->first], &b = proxies[it->second];
+            AABB boxA = a.box, boxB = b.box;
+            boxA.Enlarge(skin);
+            boxB.Enlarge(skin);
+            if (!boxA.Overlap(boxB)) continue;
+            if (a.index < b.index)
+                sorted.push_back(make_pair(make_pair(a.index, b.index), *it));
+            else
+                sorted.push_back(make_pair(make_pair(b.index, a.index), make_pair(it->second, it->first)));
         }
+        sort(sorted.begin(), sorted.end());
+        ret.clear();
+        for (int i = 0; i < (int)sorted.size(); i++)
+            ret.push_back(sorted[i].second);
+    }
+    vector<pair<Shape *, Shape *> > GetResult() {
         vector<pair<Shape *, Shape *> > ret;
-        for (int i = 0; i < n; i++) {
-            for (int j = i + 1; j < n; j++) {
-                if (aabbs[i].Overlap(aabbs[j])) {
-                    ret.push_back(make_pair(shapes[i], shapes[j]));
-                }
-            }
-        }    
+        GetResult(ret);
         return ret;
     }
+    // Pairs of fat boxes that started or stopped overlapping in the last Init
+    const vector<pair<Shape *, Shape *> > &GetAddedPairs() const {
+        return addedPairs;
+    }
+    const vector<pair<Shape *, Shape *> > &GetRemovedPairs() const {
+        return removedPairs;
+    }
 };
 
-
 #endif
\ No newline at end of file
@@ -22,6 +22,9 @@ void Settings::InitAntTweakBar() {
     TwAddVarRW(bar, "positionIter", TW_TYPE_INT32, &positionIteration, " label='Position Iterations' min=0 max=20 step=1 group='Iterations'");
     TwAddVarRW(bar, "stepIter", TW_TYPE_INT32, &stepIteration, " label='Step Iterations' min=1 max=50 step=1 group='Iterations'");
     TwAddVarRW(bar, "fricSwitch", TW_TYPE_BOOLCPP, &frictionSwitch, " label='Friction' group='World Properties'");
+    TwAddVarRW(bar, "warmStarting", TW_TYPE_BOOLCPP, &warmStarting, " label='Warm Starting' group='Iterations'");
+    TwAddVarRW(bar, "sleepSwitch", TW_TYPE_BOOLCPP, &sleepSwitch, " label='Sleeping' group='World Properties'");
+    TwAddVarRW(bar, "continuousSwitch", TW_TYPE_BOOLCPP, &continuousSwitch, " label='Continuous Collision' group='World Properties'");
     TwAddVarRW(bar, "pause", TW_TYPE_BOOLCPP, &pause, " label='Pause' group='World Properties'");
     TwAddVarRW(bar, "gravity", TW_TYPE_DOUBLE, &gravity, " label='Gravity' min=-10 max=10 step=0.5 group='World Properties'");
     
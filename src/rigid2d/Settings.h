@@ -10,6 +10,9 @@
 #ifndef SETTINGS_H
 #define SETTINGS_H
 
+#include <algorithm>
+#include <thread>
+
 class Settings {
 
 public:
@@ -17,21 +20,41 @@ public:
     int positionIteration;
     int stepIteration;
     int frictionSwitch;
+    // Start the contact impulses of a step from those of the previous step
+    int warmStarting;
+    // Put islands at rest to sleep
+    int sleepSwitch;
+    // Sweep bullets for their first impact in each step
+    int continuousSwitch;
+    // Threads solving islands
+    int numThreads;
     double gravity;
     bool pause;
     int frameRate;
-    void Init() {
+    Settings() {
+        SetDefaults();
+    }
+    void SetDefaults() {
         velocityIteration = 40;
         positionIteration = 5;
         stepIteration = 30;
         frictionSwitch = true;
+        warmStarting = true;
+        sleepSwitch = true;
+        continuousSwitch = true;
+        numThreads = std::max(1, (int)std::thread::hardware_concurrency());
         gravity = 9.8;
         pause = false;
+        frameRate = 0;
+    }
+    void Init() {
+        SetDefaults();
         InitAntTweakBar();
     }
     void InitAntTweakBar();
 };
 
+// Of the interactive game; Physics worlds have their own
 extern Settings settings;
 
 #endif
\ No newline at end of file
@@ -28,13 +28,14 @@ public:
         y0 = min(y0, other.y0);
         x1 = max(x1, other.x1);
         y1 = max(y1, other.y1);
-
+        return *this;
     }
     AABB &operator += (const Vector2D &vec) {
         x0 = min(x0, vec.x);
         y0 = min(y0, vec.y);
         x1 = max(x1, vec.x);
         y1 = max(y1, vec.y);
+        return *this;
     }
     bool Overlap(const AABB &other) {
         return (!(x1 < other.x0 || other.x1 < x0)) && (!(y1 < other.y0 || other.y1 < y0));
@@ -70,6 +71,7 @@ public:
         boundaryWidth = 1.0;
 //        priority = 1;
     }
+    virtual ~Shape() {}
     virtual void Move(Vector2D vec) = 0;
     //Update Shape Information
     virtual void Update() = 0;
@@ -24,43 +24,146 @@ public:
 
 TC_IMPLEMENTATION(Sampler, PseudoRandomSampler, "prand")
 
+// The primes up to 10000, built on first use
 class PrimeList {
 public:
-    PrimeList() {
-        for (int i = 2; i <= 10000; i++) {
-            if (is_prime(i)) {
-                primes.push_back(i);
-            }
-        }
-        assert(primes.size() == 1229);
+    static const PrimeList &get_instance() {
+        static PrimeList list;
+        return list;
     }
 
-    int get_prime(int i) {
+    int get_prime(int i) const {
         return primes[i];
     }
 
-    int get_num_primes() {
+    int get_num_primes() const {
         return (int)primes.size();
     }
 private:
+    PrimeList() {
+        StartupProfile::Scope _("table", "prime_list");
+        // Sieve of Eratosthenes
+        const int n = 10000;
+        std::vector<char> composite(n + 1, 0);
+        for (int i = 2; i <= n; i++) {
+            if (composite[i]) {
+                continue;
+            }
+            primes.push_back(i);
+            for (int j = i * i; j <= n; j += i) {
+                composite[j] = 1;
+            }
+        }
+        assert(primes.size() == 1229);
+    }
+
     std::vector<int> primes;
 };
 
+// Radical inverses of the first dimensions take several digits a step from per-dimension tables of digit
+// permutations, random ones (seeded by "sampler_seed") unless "sampler_scramble" is false, in which case the
+// permutation is the reversal i -> p - i of before. Later dimensions are reversed digit by digit.
 class HaltonSampler : public Sampler {
 public:
-    real sample(int d, long long i) const {
-        assert(d < prime_list.get_num_primes());
-        real val = hal(d, i + 1); // The first one is evil...
-        return val;
+    HaltonSampler() : prime_list(&PrimeList::get_instance()) {
+        initialize_tables(true, 0);
+    }
+
+    void initialize(const Config &config) override {
+        initialize_tables(config.get("sampler_scramble", true), (uint64)config.get("sampler_seed", 0));
+    }
+
+    real sample(int d, long long i) const override {
+        return sample_dimension(d, i + 1); // The first one is evil...
+    }
+
+    void sample(int d, int n, long long i, real *out) const override {
+        for (int k = 0; k < n; k++) {
+            out[k] = sample_dimension(d + k, i + 1);
+        }
+    }
+
+    int get_batch_size() const override {
+        return 8;
     }
 
 private:
+    static const int num_table_dimensions = 256;
+    // Entries per table are the largest power of the prime up to this, or the prime
+    static const int max_table_size = 1024;
+
+    struct Table {
+        int base;
+        // A power of base: entries are the numbers of that many digits
+        int size;
+        double step_scale;
+        // Of the digits of entry x, least significant first, permuted and placed after the radix point
+        std::vector<float> values;
+        // Of infinitely many zero digits after a step
+        double tail;
+    };
+
+    std::vector<Table> tables;
+
+    void initialize_tables(bool scramble, uint64 seed) {
+        tables.resize(std::min(num_table_dimensions, prime_list->get_num_primes()));
+        for (int d = 0; d < (int)tables.size(); d++) {
+            Table &table = tables[d];
+            const int p = prime_list->get_prime(d);
+            std::vector<int> permutation(p);
+            for (int k = 0; k < p; k++) {
+                permutation[k] = rev(k, p);
+            }
+            if (scramble) {
+                RandState rand_state(hash64(seed) + (uint64)d);
+                for (int k = p - 1; k > 0; k--) {
+                    std::swap(permutation[k], permutation[std::min(k, (int)(rand(rand_state) * (k + 1)))]);
+                }
+            }
+            int digits = 1;
+            table.base = p;
+            table.size = p;
+            while ((int64)table.size * p <= max_table_size) {
+                table.size *= p;
+                digits++;
+            }
+            table.step_scale = 1.0 / table.size;
+            table.values.resize(table.size);
+            for (int x = 0; x < table.size; x++) {
+                double value = 0, scale = 1.0 / p;
+                for (int k = 0, y = x; k < digits; k++, y /= p, scale /= p) {
+                    value += permutation[y % p] * scale;
+                }
+                table.values[x] = (float)value;
+            }
+            table.tail = permutation[0] / (p - 1.0);
+        }
+    }
+
+    real sample_dimension(int d, long long j) const {
+        assert(d < prime_list->get_num_primes());
+        if (d < (int)tables.size()) {
+            return radical_inverse(tables[d], j);
+        }
+        return hal(d, j);
+    }
+
+    static real radical_inverse(const Table &table, long long j) {
+        double h = 0, scale = 1;
+        while (j > 0) {
+            h += table.values[j % table.size] * scale;
+            j /= table.size;
+            scale *= table.step_scale;
+        }
+        return (real)std::min(h + table.tail * scale, 1.0 - 1e-7);
+    }
+
     inline int rev(const int i, const int p) const {
         return i == 0 ? i : p - i;
     }
 
     real hal(const int d, long long j) const {
-        const int p = prime_list.get_prime(d);
+        const int p = prime_list->get_prime(d);
         real h = 0.0, f = 1.0f / p, fct = f;
         while (j > 0) {
             h += rev(j % p, p) * fct;
@@ -69,16 +172,135 @@ private:
         }
         return h;
     }
-    static PrimeList prime_list;
+    const PrimeList *prime_list;
 };
-PrimeList HaltonSampler::prime_list;
 
 TC_IMPLEMENTATION(Sampler, HaltonSampler, "halton")
 
+// Sobol points in Gray code order (Antonov and Saleev), so that those of consecutive indices differ by one column
+// of the generator matrices: points of each thread's last index are kept, and the next index costs one XOR a
+// dimension. Every dimension is Owen scrambled by the hash of Burley ("Practical Hash-based Owen Scrambling",
+// 2020) unless "sampler_scramble" is false, seeded by "sampler_seed". Dimensions past the table's are random.
 class SobolSampler : public Sampler {
+protected:
+    static const int num_dimensions = (int)sobol::Matrices::num_dimensions;
+    bool scramble = true;
+    unsigned int seeds[num_dimensions];
+
+    // Unscrambled points of this thread's last indices, shared by all Sobol samplers as the matrices are
+    struct Cache {
+        long long index[num_dimensions];
+        unsigned int value[num_dimensions];
+
+        Cache() {
+            std::fill(index, index + num_dimensions, -1LL);
+        }
+    };
+
+    static Cache &get_cache() {
+        static thread_local Cache cache;
+        return cache;
+    }
+
+    static unsigned int reverse_bits(unsigned int x) {
+        x = ((x >> 1) & 0x55555555U) | ((x & 0x55555555U) << 1);
+        x = ((x >> 2) & 0x33333333U) | ((x & 0x33333333U) << 2);
+        x = ((x >> 4) & 0x0F0F0F0FU) | ((x & 0x0F0F0F0FU) << 4);
+        x = ((x >> 8) & 0x00FF00FFU) | ((x & 0x00FF00FFU) << 8);
+        return (x >> 16) | (x << 16);
+    }
+
+    unsigned int owen_scramble(unsigned int x, int d) const {
+        if (!scramble) {
+            return x;
+        }
+        // The Laine-Karras permutation on reversed bits permutes each bit by those above it only
+        x = reverse_bits(x);
+        x += seeds[d];
+        x ^= x * 0x6c50b47cU;
+        x ^= x * 0xb82f1e52U;
+        x ^= x * 0xc7afe638U;
+        x ^= x * 0x8d22f6e6U;
+        return reverse_bits(x);
+    }
+
+    static real to_real(unsigned int x) {
+        // Of the upper 24 bits, to stay below 1
+        return (x >> 8) * (1.0f / 16777216.0f);
+    }
+
+    // Unscrambled dimensions [d, d + n) of index i, all below num_dimensions
+    static void generate(int d, int n, long long i, unsigned int *out) {
+        assert_info(0 <= i && i < (1LL << sobol::Matrices::size), "Sobol index out of range");
+        Cache &cache = get_cache();
+        const unsigned int *transposed = &sobol::Matrices::get_instance().transposed[0];
+        bool next = true, current = true;
+        for (int k = d; k < d + n; k++) {
+            next = next && cache.index[k] == i - 1;
+            current = current && cache.index[k] == i;
+        }
+        if (!current && next && i > 0) {
+            // gray(i) and gray(i - 1) differ in the lowest set bit of i
+            const unsigned int *column = transposed + (size_t)__builtin_ctzll((unsigned long long)i) * num_dimensions;
+            for (int k = d; k < d + n; k++) {
+                cache.value[k] ^= column[k];
+            }
+        } else if (!current) {
+            std::fill(cache.value + d, cache.value + d + n, 0U);
+            unsigned long long gray = (unsigned long long)(i ^ (i >> 1));
+            for (const unsigned int *column = transposed; gray; gray >>= 1, column += num_dimensions) {
+                if (gray & 1) {
+                    for (int k = d; k < d + n; k++) {
+                        cache.value[k] ^= column[k];
+                    }
+                }
+            }
+        }
+        for (int k = d; k < d + n; k++) {
+            cache.index[k] = i;
+            out[k - d] = cache.value[k];
+        }
+    }
+
 public:
-    real sample(int d, long long i) const {
-        return sobol::sample(i, d);
+    SobolSampler() {
+        initialize_seeds(0);
+    }
+
+    void initialize(const Config &config) override {
+        scramble = config.get("sampler_scramble", true);
+        initialize_seeds((uint64)config.get("sampler_seed", 0));
+    }
+
+    void initialize_seeds(uint64 seed) {
+        for (int d = 0; d < num_dimensions; d++) {
+            seeds[d] = (unsigned int)hash64(hash64(seed) + (uint64)d);
+        }
+    }
+
+    real sample(int d, long long i) const override {
+        real ret;
+        sample(d, 1, i, &ret);
+        return ret;
+    }
+
+    void sample(int d, int n, long long i, real *out) const override {
+        const int table_end = std::min(d + n, num_dimensions);
+        unsigned int values[16];
+        for (int begin = d; begin < table_end; begin += 16) {
+            const int count = std::min(16, table_end - begin);
+            generate(begin, count, i, values);
+            for (int k = 0; k < count; k++) {
+                out[begin - d + k] = to_real(owen_scramble(values[k], begin + k));
+            }
+        }
+        for (int k = std::max(d, table_end); k < d + n; k++) {
+            out[k - d] = counter_rand(hash64((uint64)i), (uint64)k);
+        }
+    }
+
+    int get_batch_size() const override {
+        return 8;
     }
 };
 
@@ -22,6 +22,7 @@
 #define SOBOL_H
 
 #include <taichi/common/util.h>
+#include <vector>
 
 namespace sobol {
 
@@ -29,7 +30,16 @@ struct Matrices
 {
     static const unsigned num_dimensions = 1024;
     static const unsigned size = 52;
-    static const unsigned matrices[];
+
+    // Generator matrices: column k of dimension d at d * size + k
+    std::vector<unsigned> columns;
+    // The same, at k * num_dimensions + d, for all dimensions at once
+    std::vector<unsigned> transposed;
+
+    static const Matrices &get_instance();
+
+private:
+    Matrices();
 };
 
 // Compute one component of the Sobol'-sequence, where the component
@@ -44,11 +54,12 @@ inline float sample(
 {
     assert(dimension < Matrices::num_dimensions);
 
+    const unsigned *matrices = &Matrices::get_instance().columns[0];
     unsigned result = scramble;
     for (unsigned i = dimension * Matrices::size; index; index >>= 1, ++i)
     {
         if (index & 1)
-            result ^= Matrices::matrices[i];
+            result ^= matrices[i];
     }
 
     return result * (1.f / (1ULL << 32));
@@ -0,0 +1,789 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2016 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/math/linalg.h>
+#include <taichi/math/radix_sort.h>
+#include <taichi/system/memory.h>
+#include <taichi/system/threading.h>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <vector>
+#if !defined(TC_DISABLE_SSE) && defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+TC_NAMESPACE_BEGIN
+
+class BarnesHutSummation {
+public:
+    struct Particle {
+        Vector3 position;
+        real mass;
+
+        Particle() {
+            mass = 0.0f;
+            position = Vector3(0.0f);
+        }
+
+        Particle(const Vector3 &position, real mass) : position(position), mass(mass) {}
+
+        Particle operator+(const Particle &o) const {
+            Particle ret;
+            ret.mass = mass + o.mass;
+            ret.position = (position * mass + o.position * o.mass) / ret.mass;
+            CV(ret.position);
+            CV(ret.mass);
+            return ret;
+        }
+    };
+
+    // The children of a node are contiguous and in child index order, and the blocks of children
+    // are in depth-first order, so that a traversal mostly streams through memory
+    struct Node {
+        Particle p;
+        int first_child = 0;
+        // Bit c is set if there is a child with child index c
+        unsigned char child_mask = 0;
+        unsigned char num_children = 0;
+
+        bool is_leaf() const {
+            return child_mask == 0 && p.mass > 0;
+        }
+    };
+
+protected:
+    // The tree as it is built, before pack() lays it out for traversal
+    struct BuildNode {
+        Particle p;
+        int children[8];
+
+        BuildNode() {
+            memset(children, 0, sizeof(children));
+            p = Particle();
+        }
+
+        bool is_leaf() const {
+            for (int i = 0; i < 8; i++) {
+                if (children[i] != 0) {
+                    return false;
+                }
+            }
+            return p.mass > 0;
+        }
+    };
+
+    real resolution, inv_resolution;
+    int total_levels;
+    int margin;
+
+    std::vector<BuildNode> build_nodes;
+    int node_end;
+    std::vector<Node> nodes;
+    // Per node and in grid cells, lower x, y, z and upper x, y, z of the cells whose particles
+    // need the node opened. They are stored per axis so that the bounds of all children of a node can
+    // be tested at once, and padded so that 8 entries can be loaded anywhere.
+    AlignedVector<float> bounds[6];
+    Vector3 lower_corner;
+    // Leaf bucket mode: subtrees with at most bucket_size leaves are not traversed, their leaves
+    // (the bodies, in depth-first order) interact directly. 0 disables it.
+    int bucket_size = 0;
+    // Bodies of the subtree of every node
+    std::vector<int> first_body, num_bodies;
+    // Positions and masses of the bodies, padded like bounds
+    AlignedVector<float> body_x, body_y, body_z, body_mass;
+    // The leaf node of every body
+    std::vector<int> body_node;
+    // After index_particles(): the leaf of every particle (0 if massless), and the particles of every
+    // body, body_particles[body_particle_begin[b], body_particle_begin[b + 1])
+    std::vector<int> particle_leaf, body_particle_begin, body_particles;
+
+    // Levels above this depth pack their subtrees in parallel
+    static const int parallel_depth = 4;
+
+    Vector3i get_coord(const Vector3 &position) const {
+        Vector3i u;
+        Vector3 t = (position - lower_corner) * inv_resolution;
+        for (int i = 0; i < 3; i++) {
+            u[i] = int(t[i]);
+        }
+        return u;
+    }
+
+    int get_child_index(const Vector3i &u, int level) const {
+        int ret = 0;
+        for (int i = 0; i < 3; i++) {
+            ret += ((u[i] >> (total_levels - level - 1)) & 1) << i;
+        }
+        return ret;
+    }
+
+    // Spreads the lowest 21 bits of x to every third bit
+    static uint64 spread_bits(uint64 x) {
+        x &= 0x1fffffull;
+        x = (x | x << 32) & 0x1f00000000ffffull;
+        x = (x | x << 16) & 0x1f0000ff0000ffull;
+        x = (x | x << 8) & 0x100f00f00f00f00full;
+        x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+        x = (x | x << 2) & 0x1249249249249249ull;
+        return x;
+    }
+
+    // Interleaves the total_levels bits of u, so that the octal digit total_levels - level - 1
+    // is get_child_index(u, level)
+    uint64 get_morton_code(const Vector3i &u) const {
+        const uint64 mask = (1ull << total_levels) - 1;
+        return spread_bits(u.x & mask) | spread_bits(u.y & mask) << 1 | spread_bits(u.z & mask) << 2;
+    }
+
+    int get_child_index(uint64 code, int level) const {
+        return int(code >> (3 * (total_levels - level - 1))) & 7;
+    }
+
+    // Number of leading octal digits that a and b share
+    int get_common_levels(uint64 a, uint64 b) const {
+        uint64 diff = a ^ b;
+        if (diff == 0) {
+            return total_levels;
+        }
+#if defined(__GNUC__)
+        return total_levels - (66 - __builtin_clzll(diff)) / 3;
+#else
+        int levels = total_levels;
+        while (diff != 0) {
+            diff >>= 3;
+            levels--;
+        }
+        return levels;
+#endif
+    }
+
+    // Mass, center of mass and bounds of node t from those of its children
+    void summarize_node(int t) {
+        Node &node = nodes[t];
+        if (node.is_leaf()) {
+            Vector3i u = get_coord(node.p.position);
+            for (int i = 0; i < 3; i++) {
+                bounds[i][t] = float(u[i] - margin);
+                bounds[3 + i][t] = float(u[i] + margin);
+            }
+            return;
+        }
+        real mass = 0.0f;
+        Vector3 total_position(0.0f);
+        for (int i = 0; i < 3; i++) {
+            bounds[i][t] = std::numeric_limits<float>::max();
+            bounds[3 + i][t] = std::numeric_limits<float>::lowest();
+        }
+        for (int c = node.first_child; c < node.first_child + node.num_children; c++) {
+            const Node &ch = nodes[c];
+            mass += ch.p.mass;
+            total_position += ch.p.mass * ch.p.position;
+            for (int i = 0; i < 3; i++) {
+                bounds[i][t] = std::min(bounds[i][t], bounds[i][c]);
+                bounds[3 + i][t] = std::max(bounds[3 + i][t], bounds[3 + i][c]);
+            }
+        }
+        total_position *= 1.0f / mass;
+        if (abnormal(total_position)) {
+            P(mass);
+            for (int c = node.first_child; c < node.first_child + node.num_children; c++) {
+                P(c);
+                P(nodes[c].p.position);
+                P(nodes[c].p.mass);
+            }
+        }
+        CV(total_position);
+        node.p = Particle(total_position, mass);
+    }
+
+    // Number of nodes below build node b, and of leaves in its subtree
+    int count_descendants(int b, int depth, std::vector<int> &descendants, std::vector<int> &leaves,
+                          int num_threads) const {
+        const BuildNode &node = build_nodes[b];
+        int children[8], num_children = 0;
+        for (int c = 0; c < 8; c++) {
+            if (node.children[c]) {
+                children[num_children++] = node.children[c];
+            }
+        }
+        auto count = [&](int i) {
+            count_descendants(children[i], depth + 1, descendants, leaves, num_threads);
+        };
+        if (depth < parallel_depth) {
+            parallel_for(0, num_children, num_threads, count, 1);
+        } else {
+            for (int i = 0; i < num_children; i++) {
+                count(i);
+            }
+        }
+        int sum = num_children, num_leaves = num_children == 0 && node.p.mass > 0;
+        for (int i = 0; i < num_children; i++) {
+            sum += descendants[children[i]];
+            num_leaves += leaves[children[i]];
+        }
+        descendants[b] = sum;
+        leaves[b] = num_leaves;
+        return sum;
+    }
+
+    // Makes build node b node t, with its children at first_child and their subtrees after them,
+    // and its leaves the bodies from body, and summarizes it
+    void place(int b, int t, int first_child, int body, int depth, const std::vector<int> &descendants,
+               const std::vector<int> &leaves, int num_threads) {
+        const BuildNode &build_node = build_nodes[b];
+        Node &node = nodes[t];
+        node.p = build_node.p;
+        first_body[t] = body;
+        num_bodies[t] = leaves[b];
+        if (node.is_leaf()) {
+            body_x[body] = node.p.position.x;
+            body_y[body] = node.p.position.y;
+            body_z[body] = node.p.position.z;
+            body_mass[body] = node.p.mass;
+            body_node[body] = t;
+        }
+        int children[8], starts[8], bodies[8], num_children = 0;
+        for (int c = 0; c < 8; c++) {
+            if (build_node.children[c]) {
+                node.child_mask |= 1 << c;
+                children[num_children++] = build_node.children[c];
+            }
+        }
+        int start = first_child + num_children;
+        for (int i = 0; i < num_children; i++) {
+            starts[i] = start;
+            start += descendants[children[i]];
+            bodies[i] = body;
+            body += leaves[children[i]];
+        }
+        node.first_child = num_children ? first_child : 0;
+        node.num_children = (unsigned char)num_children;
+        auto place_child = [&](int i) {
+            place(children[i], first_child + i, starts[i], bodies[i], depth + 1, descendants, leaves, num_threads);
+        };
+        if (depth < parallel_depth) {
+            parallel_for(0, num_children, num_threads, place_child, 1);
+        } else {
+            for (int i = 0; i < num_children; i++) {
+                place_child(i);
+            }
+        }
+        summarize_node(t);
+    }
+
+    // Lays out the built tree for traversal and summarizes it; as in build_nodes, the root is node 1
+    void pack(int num_threads) {
+        const int root = 1;
+        std::vector<int> descendants(node_end, 0), leaves(node_end, 0);
+        const int num_nodes = root + 1 + count_descendants(root, 0, descendants, leaves, num_threads);
+        nodes.assign(num_nodes, Node());
+        for (auto &b : bounds) {
+            b.assign(num_nodes + 8, 0.0f);
+        }
+        first_body.assign(num_nodes, 0);
+        num_bodies.assign(num_nodes, 0);
+        for (auto b : {&body_x, &body_y, &body_z, &body_mass}) {
+            b->assign(leaves[root] + 8, 0.0f);
+        }
+        body_node.assign(leaves[root], 0);
+        particle_leaf.clear();
+        place(root, root, root + 1, 0, 0, descendants, leaves, num_threads);
+        std::vector<BuildNode>().swap(build_nodes);
+    }
+
+    // Bit i is set if child node.first_child + i is to be opened for a particle in cell u
+    int get_open_mask(const Node &node, const Vector3i &u) const {
+        const int f = node.first_child;
+#if !defined(TC_DISABLE_SSE) && defined(__AVX__)
+        __m256 open = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (int i = 0; i < 3; i++) {
+            const __m256 x = _mm256_set1_ps(float(u[i]));
+            open = _mm256_and_ps(open, _mm256_cmp_ps(_mm256_loadu_ps(&bounds[i][f]), x, _CMP_LE_OQ));
+            open = _mm256_and_ps(open, _mm256_cmp_ps(x, _mm256_loadu_ps(&bounds[3 + i][f]), _CMP_LE_OQ));
+        }
+        return _mm256_movemask_ps(open) & ((1 << node.num_children) - 1);
+#else
+        int mask = 0;
+        for (int c = 0; c < node.num_children; c++) {
+            bool open = true;
+            for (int i = 0; i < 3; i++) {
+                open = open && bounds[i][f + c] <= float(u[i]) && float(u[i]) <= bounds[3 + i][f + c];
+            }
+            mask |= int(open) << c;
+        }
+        return mask;
+#endif
+    }
+
+    // Summarizes the subtree of t again, bottom-up
+    void refit_node(int t, int depth, int num_threads) {
+        const Node &node = nodes[t];
+        auto refit_child = [&](int i) {
+            refit_node(node.first_child + i, depth + 1, num_threads);
+        };
+        if (depth < parallel_depth) {
+            parallel_for(0, node.num_children, num_threads, refit_child, 1);
+        } else {
+            for (int i = 0; i < node.num_children; i++) {
+                refit_child(i);
+            }
+        }
+        summarize_node(t);
+    }
+
+    bool is_bucket(int t) const {
+        return num_bodies[t] <= bucket_size && !nodes[t].is_leaf();
+    }
+
+    template <typename T>
+    Vector3 summation(int t, const Particle &p, const Vector3i &u, const T &func) const {
+        const Node &node = nodes[t];
+        if (node.is_leaf()) {
+            return func(p, node.p);
+        }
+        Vector3 ret(0.0f);
+        if (is_bucket(t)) {
+            for (int i = first_body[t]; i < first_body[t] + num_bodies[t]; i++) {
+                ret += func(p, Particle(Vector3(body_x[i], body_y[i], body_z[i]), body_mass[i]));
+            }
+            return ret;
+        }
+        const int open = get_open_mask(node, u);
+        for (int i = 0; i < node.num_children; i++) {
+            if (open >> i & 1) {
+                ret += summation(node.first_child + i, p, u, func);
+            } else {
+                // Coarse summation
+                ret += func(p, nodes[node.first_child + i].p);
+            }
+        }
+        return ret;
+    }
+
+    static Vector3 get_gravity(const Particle &p, const Particle &q, real softening2) {
+        Vector3 d = p.position - q.position;
+        const real dist2 = dot(d, d) + softening2;
+        return d * (p.mass * q.mass / (dist2 * std::sqrt(dist2)));
+    }
+
+    // Softened gravity on p from bodies [begin, end)
+    Vector3 get_bucket_gravity(const Particle &p, int begin, int end, real softening2) const {
+        return p.mass * sum_gravity(p.position, &body_x[begin], &body_y[begin], &body_z[begin], &body_mass[begin],
+                                    end - begin, softening2);
+    }
+
+    Vector3 gravity_summation(int t, const Particle &p, const Vector3i &u, real softening2) const {
+        const Node &node = nodes[t];
+        if (node.is_leaf()) {
+            return get_gravity(p, node.p, softening2);
+        }
+        if (is_bucket(t)) {
+            return get_bucket_gravity(p, first_body[t], first_body[t] + num_bodies[t], softening2);
+        }
+        Vector3 ret(0.0f);
+        const int open = get_open_mask(node, u);
+        for (int i = 0; i < node.num_children; i++) {
+            if (open >> i & 1) {
+                ret += gravity_summation(node.first_child + i, p, u, softening2);
+            } else {
+                ret += get_gravity(p, nodes[node.first_child + i].p, softening2);
+            }
+        }
+        return ret;
+    }
+
+    int create_child(int t, int child_index) {
+        return create_child(t, child_index, Particle(Vector3(0.0f), 0.0f));
+    }
+
+    int create_child(int t, int child_index, const Particle &p) {
+        int nt = get_new_node();
+        build_nodes[t].children[child_index] = nt;
+        build_nodes[nt].p = p;
+        return nt;
+    }
+
+    int get_new_node() {
+        build_nodes[node_end] = BuildNode();
+        return node_end++;
+    }
+
+    // Bounding box of the particles and the number of levels of the grid
+    void setup_grid(real resolution, real margin_real, const std::vector<Particle> &particles, int num_threads) {
+        this->resolution = resolution;
+        this->inv_resolution = 1.0f / resolution;
+        this->margin = (int)std::ceil(margin_real * inv_resolution);
+        assert(particles.size() != 0);
+        const int n = (int)particles.size();
+        const int num_chunks = std::max(1, std::min(num_threads * 4, n / 16384));
+        std::vector<Vector3> chunk_lower(num_chunks, Vector3(1e30f)), chunk_upper(num_chunks, Vector3(-1e30f));
+        parallel_for(0, num_chunks, num_threads, [&](int c) {
+            for (int i = (int)((int64)n * c / num_chunks); i < (int)((int64)n * (c + 1) / num_chunks); i++) {
+                for (int k = 0; k < 3; k++) {
+                    chunk_lower[c][k] = std::min(chunk_lower[c][k], particles[i].position[k]);
+                    chunk_upper[c][k] = std::max(chunk_upper[c][k], particles[i].position[k]);
+                }
+            }
+        }, 1);
+        Vector3 lower(1e30f);
+        Vector3 upper(-1e30f);
+        for (int c = 0; c < num_chunks; c++) {
+            for (int k = 0; k < 3; k++) {
+                lower[k] = std::min(lower[k], chunk_lower[c][k]);
+                upper[k] = std::max(upper[k], chunk_upper[c][k]);
+            }
+        }
+        lower_corner = lower;
+        int intervals = (int)std::ceil(max_component(upper - lower) / resolution);
+        // At least one level, so that child indices are defined when all particles coincide
+        total_levels = 1;
+        for (int i = 2; i < intervals; i *= 2, total_levels++);
+    }
+
+public:
+    // We do not evaluate the weighted average of position and mass on the fly
+    // for efficiency and accuracy.
+    // Builds the tree in parallel from the particles sorted by Morton code: every internal node is
+    // a cell holding at least two distinct codes, which is the tree initialize_incremental builds.
+    // Cells are identified by the first pair of adjacent codes they hold, so that each pair knows
+    // its cells without looking at the others (as in Karras, "Maximizing parallelism in the
+    // construction of BVHs, octrees, and k-d trees"), and are summarized level by level bottom-up.
+    void initialize(real resolution, real margin_real, const std::vector<Particle> &particles,
+                    int num_threads = 1) {
+        setup_grid(resolution, margin_real, particles, num_threads);
+        assert_info(total_levels <= 21, "Too many levels for 64-bit Morton codes; increase the resolution");
+        const int n = (int)particles.size();
+        const int code_bits = 3 * total_levels;
+        // Massless particles are sorted to the end and dropped
+        std::vector<uint64> codes(n);
+        std::vector<int> order(n);
+        parallel_for(0, n, num_threads, [&](int i) {
+            codes[i] = particles[i].mass == 0 ? 1ull << code_bits : get_morton_code(get_coord(particles[i].position));
+            order[i] = i;
+        }, 4096);
+        radix_sort(codes, order, code_bits + 1, num_threads);
+        const int num_massive = (int)(std::lower_bound(codes.begin(), codes.end(), 1ull << code_bits) - codes.begin());
+
+        // Particles in the same finest cell are merged into one leaf
+        std::vector<int> leaf_begin(num_massive);
+        parallel_for(0, num_massive, num_threads, [&](int i) {
+            leaf_begin[i] = i == 0 || codes[i] != codes[i - 1];
+        }, 4096);
+        const int num_leaves = exclusive_scan(leaf_begin, num_threads);
+        std::vector<uint64> leaf_codes(num_leaves);
+        std::vector<Particle> leaf_particles(num_leaves);
+        parallel_for(0, num_massive, num_threads, [&](int i) {
+            if (i != 0 && codes[i] == codes[i - 1]) {
+                return;
+            }
+            const int leaf = leaf_begin[i];
+            leaf_codes[leaf] = codes[i];
+            Particle p = particles[order[i]];
+            for (int j = i + 1; j < num_massive && codes[j] == codes[i]; j++) {
+                p = particles[order[j]] + p;
+            }
+            leaf_particles[leaf] = p;
+        }, 4096);
+
+        // common_levels[i]: the levels leaves i and i + 1 share; their first common_levels[i] + 1
+        // cells (levels 0 to common_levels[i]) hold both. Pair i owns those no earlier pair is in.
+        const int num_pairs = std::max(0, num_leaves - 1);
+        std::vector<int> common_levels(num_pairs), first_owned(num_pairs), internal_offset(num_pairs);
+        parallel_for(0, num_pairs, num_threads, [&](int i) {
+            common_levels[i] = get_common_levels(leaf_codes[i], leaf_codes[i + 1]);
+        }, 4096);
+        parallel_for(0, num_pairs, num_threads, [&](int i) {
+            first_owned[i] = i == 0 ? 0 : common_levels[i - 1] + 1;
+            internal_offset[i] = std::max(0, common_levels[i] + 1 - first_owned[i]);
+        }, 4096);
+        // The root is there even for a single leaf, like with initialize_incremental
+        const int num_internal = num_pairs == 0 ? 1 : exclusive_scan(internal_offset, num_threads);
+        // We do not use the 0th node; internal nodes come first, leaves after them
+        const int root = 1, first_leaf = 1 + num_internal;
+        node_end = first_leaf + num_leaves;
+        build_nodes.clear();
+        build_nodes.resize(node_end);
+        // The internal node of the cell at `level` holding leaf i
+        auto get_cell = [&](int i, int level) {
+            // The first leaf of the cell: common levels with leaf i only decrease towards the left.
+            // Most cells are small, so the range is found by doubling steps first.
+            int begin = i, end = i;
+            for (int step = 1; begin > 0; step *= 2) {
+                begin = std::max(0, i - step);
+                if (get_common_levels(leaf_codes[begin], leaf_codes[i]) < level) {
+                    break;
+                }
+                end = begin;
+            }
+            while (begin < end) {
+                int mid = (begin + end) / 2;
+                if (get_common_levels(leaf_codes[mid], leaf_codes[i]) >= level) {
+                    end = mid;
+                } else {
+                    begin = mid + 1;
+                }
+            }
+            return num_pairs == 0 ? root : root + internal_offset[begin] + level - first_owned[begin];
+        };
+        parallel_for(0, num_pairs, num_threads, [&](int i) {
+            for (int level = std::max(1, first_owned[i]); level <= common_levels[i]; level++) {
+                const int t = root + internal_offset[i] + level - first_owned[i];
+                const int parent = level - 1 >= first_owned[i] ? t - 1 : get_cell(i, level - 1);
+                build_nodes[parent].children[get_child_index(leaf_codes[i], level - 1)] = t;
+            }
+        }, 1024);
+        parallel_for(0, num_leaves, num_threads, [&](int i) {
+            int level = 0;
+            if (i > 0) {
+                level = std::max(level, common_levels[i - 1]);
+            }
+            if (i < num_pairs) {
+                level = std::max(level, common_levels[i]);
+            }
+            const int t = first_leaf + i;
+            build_nodes[t].p = leaf_particles[i];
+            build_nodes[get_cell(i, level)].children[get_child_index(leaf_codes[i], level)] = t;
+        }, 4096);
+        pack(num_threads);
+
+    }
+
+    // Inserts the particles one by one on one thread; kept to validate initialize against
+    void initialize_incremental(real resolution, real margin_real, const std::vector<Particle> &particles) {
+        setup_grid(resolution, margin_real, particles, 1);
+        // We do not use the 0th node...
+        node_end = 1;
+        build_nodes.clear();
+        build_nodes.resize(particles.size() * 2);
+        int root = get_new_node();
+        // Make sure that one leaf node contains only one particle.
+        // Unless particles are too close and thereby merged.
+        for (auto &p : particles) {
+            if (p.mass == 0) {
+                continue;
+            }
+            Vector3i u = get_coord(p.position);
+            int t = root;
+            if (build_nodes[t].is_leaf()) {
+                // First node
+                build_nodes[t].p = p;
+                continue;
+            }
+            // Traverse down until there's no way...
+            int k = 0;
+            int cp;
+            for (; k < total_levels; k++) {
+                cp = get_child_index(u, k);
+                if (build_nodes[t].children[cp] != 0) {
+                    t = build_nodes[t].children[cp];
+                } else {
+                    break;
+                }
+            }
+            if (build_nodes[t].is_leaf()) {
+                // Leaf node, containing one particle q
+                // Split the node until p and q belong to different children.
+                Particle q = build_nodes[t].p;
+                build_nodes[t].p = Particle();
+                Vector3i v = get_coord(q.position);
+                int cq = get_child_index(v, k);
+                while (cp == cq && k < total_levels) {
+                    t = create_child(t, cp);
+                    k++;
+                    cp = get_child_index(u, k);
+                    cq = get_child_index(v, k);
+                }
+                if (k == total_levels) {
+                    // We have to merge two particles since they are too close...
+                    q = p + q;
+                    create_child(t, cp, q);
+                } else {
+                    build_nodes[t].p = Particle();
+                    create_child(t, cp, p);
+                    create_child(t, cq, q);
+                }
+            } else {
+                // Non-leaf node, simply create a child.
+                create_child(t, cp, p);
+            }
+        }
+        pack(1);
+    }
+
+    template <typename T>
+    Vector3 summation(int t, const Particle &p, const T &func) const {
+        return summation(t, p, get_coord(p.position), func);
+    }
+
+    // Softened gravity on a unit mass at p from n bodies in SoA form, sum m_i (p - x_i) / (|p - x_i|^2 +
+    // softening2)^1.5, 8 bodies at a time. The arrays are read in blocks of 8, up to 7 entries past n.
+    static Vector3 sum_gravity(const Vector3 &p, const float *x, const float *y, const float *z, const float *m,
+                               int n, real softening2) {
+#if !defined(TC_DISABLE_SSE) && defined(__AVX__)
+        // Lanes [0, r) of tail_masks + 8 - r are set
+        alignas(32) static const int tail_masks[16] = {-1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0};
+        const __m256 px = _mm256_set1_ps(p.x), py = _mm256_set1_ps(p.y), pz = _mm256_set1_ps(p.z);
+        const __m256 eps2 = _mm256_set1_ps(softening2), half = _mm256_set1_ps(0.5f),
+                three_halves = _mm256_set1_ps(1.5f);
+        __m256 fx = _mm256_setzero_ps(), fy = _mm256_setzero_ps(), fz = _mm256_setzero_ps();
+        for (int j = 0; j < n; j += 8) {
+            const __m256 dx = _mm256_sub_ps(px, _mm256_loadu_ps(&x[j]));
+            const __m256 dy = _mm256_sub_ps(py, _mm256_loadu_ps(&y[j]));
+            const __m256 dz = _mm256_sub_ps(pz, _mm256_loadu_ps(&z[j]));
+            const __m256 dist2 = _mm256_add_ps(
+                    _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)),
+                    _mm256_add_ps(_mm256_mul_ps(dz, dz), eps2));
+            // One Newton step brings rsqrt from 12 to about 22 bits
+            __m256 r = _mm256_rsqrt_ps(dist2);
+            r = _mm256_mul_ps(r, _mm256_sub_ps(three_halves, _mm256_mul_ps(_mm256_mul_ps(half, dist2),
+                                                                           _mm256_mul_ps(r, r))));
+            __m256 w = _mm256_mul_ps(_mm256_loadu_ps(&m[j]), _mm256_mul_ps(r, _mm256_mul_ps(r, r)));
+            if (n - j < 8) {
+                w = _mm256_and_ps(w, _mm256_loadu_ps((const float *)&tail_masks[8 - (n - j)]));
+            }
+            fx = _mm256_add_ps(fx, _mm256_mul_ps(w, dx));
+            fy = _mm256_add_ps(fy, _mm256_mul_ps(w, dy));
+            fz = _mm256_add_ps(fz, _mm256_mul_ps(w, dz));
+        }
+        alignas(32) float sx[8], sy[8], sz[8];
+        _mm256_store_ps(sx, fx);
+        _mm256_store_ps(sy, fy);
+        _mm256_store_ps(sz, fz);
+        Vector3 ret(0.0f);
+        for (int i = 0; i < 8; i++) {
+            ret += Vector3(sx[i], sy[i], sz[i]);
+        }
+        return ret;
+#else
+        Vector3 ret(0.0f);
+        for (int j = 0; j < n; j++) {
+            ret += get_gravity(Particle(p, 1.0f), Particle(Vector3(x[j], y[j], z[j]), m[j]), softening2);
+        }
+        return ret;
+#endif
+    }
+
+    // Records which leaf every particle was merged into; call right after initialize(), with the same
+    // particles, to be able to refit() the tree
+    void index_particles(const std::vector<Particle> &particles, int num_threads = 1) {
+        const int n = (int)particles.size(), num_leaves = (int)body_node.size();
+        particle_leaf.resize(n);
+        std::vector<uint64> keys(n);
+        std::vector<int> order(n);
+        parallel_for(0, n, num_threads, [&](int i) {
+            particle_leaf[i] = particles[i].mass == 0 ? 0 : get_leaf(particles[i].position);
+            assert_info(particles[i].mass == 0 || particle_leaf[i] != 0, "Particles must not move before indexing");
+            // Massless particles sort to the end
+            keys[i] = uint64(particle_leaf[i] ? first_body[particle_leaf[i]] : num_leaves);
+            order[i] = i;
+        }, 4096);
+        int key_bits = 1;
+        while ((1ll << key_bits) <= num_leaves) {
+            key_bits++;
+        }
+        radix_sort(keys, order, key_bits, num_threads);
+        body_particle_begin.resize(num_leaves + 1);
+        parallel_for(0, num_leaves + 1, num_threads, [&](int b) {
+            body_particle_begin[b] = (int)(std::lower_bound(keys.begin(), keys.end(), (uint64)b) - keys.begin());
+        }, 4096);
+        body_particles.swap(order);
+    }
+
+    // Moves the leaves to the new positions of their particles and summarizes the tree again, keeping
+    // its topology. The opening test stays exact, as bounds are recomputed, but nodes grow looser as
+    // particles drift. Needs index_particles() after the last initialize().
+    void refit(const std::vector<Particle> &particles, int num_threads = 1) {
+        assert_info(particle_leaf.size() == particles.size(), "refit() needs index_particles() on the same particles");
+        parallel_for(0, (int)body_node.size(), num_threads, [&](int b) {
+            Particle p = particles[body_particles[body_particle_begin[b]]];
+            for (int k = body_particle_begin[b] + 1; k < body_particle_begin[b + 1]; k++) {
+                p = particles[body_particles[k]] + p;
+            }
+            nodes[body_node[b]].p = p;
+            body_x[b] = p.position.x;
+            body_y[b] = p.position.y;
+            body_z[b] = p.position.z;
+            body_mass[b] = p.mass;
+        }, 1024);
+        refit_node(get_root(), 0, num_threads);
+    }
+
+    // The leaf of particle i of the last index_particles()
+    int get_particle_leaf(int i) const {
+        return particle_leaf[i];
+    }
+
+    // Softened gravity m_p m_q (p - q) / (|p - q|^2 + softening2)^1.5 on p from the tree, with the leaf
+    // buckets evaluated 8 bodies at a time
+    Vector3 gravity_summation(const Particle &p, real softening2) const {
+        return gravity_summation(get_root(), p, get_coord(p.position), softening2);
+    }
+
+    // Takes effect from the next initialize()
+    void set_bucket_size(int bucket_size) {
+        assert_info(bucket_size >= 0, "bucket_size must be non-negative");
+        this->bucket_size = bucket_size;
+    }
+
+    int get_root() const {
+        return 1;
+    }
+
+    int get_num_nodes() const {
+        return (int)nodes.size();
+    }
+
+    const Node &get_node(int t) const {
+        return nodes[t];
+    }
+
+    // The leaf holding a particle at position, or 0 if the tree has none there
+    int get_leaf(const Vector3 &position) const {
+        const Vector3i u = get_coord(position);
+        int t = get_root();
+        for (int level = 0; !nodes[t].is_leaf(); level++) {
+            const Node &node = nodes[t];
+            if (level >= total_levels) {
+                // Below the finest cell, where initialize_incremental merges particles
+                if (node.num_children == 0) {
+                    return 0;
+                }
+                t = node.first_child;
+                continue;
+            }
+            const int c = get_child_index(u, level);
+            if (!(node.child_mask >> c & 1)) {
+                return 0;
+            }
+            t = node.first_child;
+            for (int i = 0; i < c; i++) {
+                t += node.child_mask >> i & 1;
+            }
+        }
+        return t;
+    }
+
+    void print_tree(int t, int level) const {
+        for (int i = 0; i < level; i++) {
+            printf("  ");
+        }
+        const Particle &p = nodes[t].p;
+        printf("p (%f, %f, %f) m %f ", p.position.x, p.position.y, p.position.z, p.mass);
+        printf("(%g, %g, %g) (%g, %g, %g)\n", bounds[0][t], bounds[1][t], bounds[2][t], bounds[3][t], bounds[4][t],
+               bounds[5][t]);
+        for (int i = 0; i < nodes[t].num_children; i++) {
+            print_tree(nodes[t].first_child + i, level + 1);
+        }
+    }
+};
+
+TC_NAMESPACE_END
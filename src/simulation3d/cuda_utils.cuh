@@ -0,0 +1,102 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+// Helpers shared by the CUDA translation units; only for nvcc
+
+#include <cuda_runtime.h>
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+namespace taichi {
+
+inline void check_cuda(cudaError_t error, const char *call, const char *file, int line) {
+    if (error != cudaSuccess) {
+        throw std::runtime_error(std::string("CUDA error in ") + call + " at " + file + ":" + std::to_string(line) +
+                                 ": " + cudaGetErrorString(error));
+    }
+}
+
+#define TC_CUDA_CHECK(call) check_cuda((call), #call, __FILE__, __LINE__)
+
+// Owning device buffer
+template <typename T>
+class DeviceArray {
+protected:
+    T *ptr = nullptr;
+    std::size_t n = 0;
+
+public:
+    DeviceArray() {}
+
+    DeviceArray(const DeviceArray &) = delete;
+
+    DeviceArray &operator=(const DeviceArray &) = delete;
+
+    ~DeviceArray() {
+        if (ptr != nullptr) {
+            cudaFree(ptr);
+        }
+    }
+
+    void resize(std::size_t new_size) {
+        if (new_size == n) {
+            return;
+        }
+        if (ptr != nullptr) {
+            TC_CUDA_CHECK(cudaFree(ptr));
+            ptr = nullptr;
+        }
+        n = new_size;
+        if (n > 0) {
+            TC_CUDA_CHECK(cudaMalloc(&ptr, n * sizeof(T)));
+        }
+    }
+
+    void upload(const T *host, std::size_t size) {
+        resize(size);
+        if (n > 0) {
+            TC_CUDA_CHECK(cudaMemcpy(ptr, host, n * sizeof(T), cudaMemcpyHostToDevice));
+        }
+    }
+
+    void download(T *host) const {
+        if (n > 0) {
+            TC_CUDA_CHECK(cudaMemcpy(host, ptr, n * sizeof(T), cudaMemcpyDeviceToHost));
+        }
+    }
+
+    void set_zero() {
+        if (n > 0) {
+            TC_CUDA_CHECK(cudaMemset(ptr, 0, n * sizeof(T)));
+        }
+    }
+
+    void swap(DeviceArray &o) {
+        std::swap(ptr, o.ptr);
+        std::swap(n, o.n);
+    }
+
+    T *data() {
+        return ptr;
+    }
+
+    const T *data() const {
+        return ptr;
+    }
+
+    std::size_t size() const {
+        return n;
+    }
+};
+
+}
@@ -14,7 +14,11 @@
 #include <taichi/dynamics/poisson_solver3d.h>
 #include <taichi/visualization/particle_visualization.h>
 #include <taichi/common/asset_manager.h>
+#include <taichi/system/memory.h>
 #include <taichi/system/timer.h>
+#include <taichi/system/threading.h>
+#include <algorithm>
+#include <limits>
 
 TC_NAMESPACE_BEGIN
 const static Vector3i offsets[]{
@@ -43,14 +47,19 @@ void Smoke3D::project() {
         if (ind.k < res[2])
             divergence[ind] -= w[ind];
     }
-    pressure = 0;
+    // The pressure of the last step is the initial guess
+    if (!warm_start) {
+        pressure = 0;
+    }
     pressure_solver->set_boundary_condition(boundary_condition);
-    for (auto &ind : boundary_condition.get_region()) {
+    parallel_for(boundary_condition.get_region(), num_threads, [&](const Index3D &ind) {
         if (boundary_condition[ind] != PoissonSolver3D::INTERIOR) {
             divergence[ind] = 0.0f;
+            pressure[ind] = 0.0f;
         }
-    }
+    });
     pressure_solver->run(divergence, pressure, pressure_tolerance);
+    solver_statistics.push_back(pressure_solver->get_statistics());
     auto is_neumann = [&](Index3D const &ind) -> bool {
         if (boundary_condition.inside(ind)) {
             return boundary_condition[ind] == PoissonSolver3D::NEUMANN;
@@ -83,6 +92,7 @@ void Smoke3D::project() {
 
 void Smoke3D::initialize(const Config &config) {
     Simulation3D::initialize(config);
+    TC_MEMORY_TAG("smoke3d");
     res = config.get_vec3i("resolution");
     smoke_alpha = config.get("smoke_alpha", 0.0f);
     smoke_beta = config.get("smoke_beta", 0.0f);
@@ -101,18 +111,64 @@ void Smoke3D::initialize(const Config &config) {
     }
 
     perturbation = config.get("perturbation", 0.0f);
+    vorticity_confinement = config.get("vorticity_confinement", 0.0f);
+    warm_start = config.get("warm_start", true);
+    advection = config.get("advection", "semi_lagrangian");
+    time_stepper.initialize(config, 0.0f);
+    assert_info(advection == "semi_lagrangian" || advection == "maccormack",
+                "'advection' has to be 'semi_lagrangian' or 'maccormack' instead of " + advection);
+    maximum_pressure_iterations = config.get_int("maximum_pressure_iterations");
+    initial_temperature = config.get("initial_t", 0.0f);
+    current_t = 0.0f;
+    upres = config.get("upres", 1);
+    if (upres > 1) {
+        upres_strength = config.get("upres_strength", 0.5f);
+        upres_frequency = config.get("upres_frequency", 1.0f);
+        upres_noise_speed = config.get("upres_noise_speed", 0.5f);
+        upres_threshold = config.get("upres_threshold", 1e-4f);
+        upres_octaves = 1;
+        while ((2 << upres_octaves) <= upres) {
+            upres_octaves++;
+        }
+        TC_MEMORY_TAG("smoke3d.upres");
+        fine_rho.reset(new FineGrid());
+        next_fine_rho.reset(new FineGrid());
+        fine_rho->initialize(res * upres, 0.0f);
+        next_fine_rho->initialize(res * upres, 0.0f);
+    }
+    sparse_grid = config.get("sparse_grid", false);
+    if (sparse_grid) {
+        sparse_threshold = config.get("sparse_threshold", 1e-4f);
+        sparse_velocity_threshold = config.get("sparse_velocity_threshold", 0.01f);
+        sparse_margin = config.get("sparse_margin", 1);
+        assert_info(advection == "semi_lagrangian", "Sparse smoke grids only support semi-Lagrangian advection");
+        assert_info(initial_temperature == 0, "Sparse smoke grids need an initial temperature of 0, which the "
+                                              "blocks not kept are at");
+        TC_MEMORY_TAG("smoke3d.grid");
+        SmokeNode background;
+        background.u = background.v = background.w = background.rho = background.t = background.pressure = 0;
+        background.row = -1;
+        grid.reset(new SparseGrid());
+        next_grid.reset(new SparseGrid());
+        grid->initialize(res + Vector3i(1), background);
+        next_grid->initialize(res + Vector3i(1), background);
+        source_blocks_dirty = true;
+        return;
+    }
     Config solver_config;
     solver_config.set("res", res).set("num_threads", num_threads).set("padding", padding).
-            set("maximum_iterations", config.get_int("maximum_pressure_iterations"));
+            set("maximum_iterations", maximum_pressure_iterations).
+            set("statistics_log", config.get("solver_statistics_log", ""));
     pressure_solver = create_instance<PoissonSolver3D>(config.get_string("pressure_solver"), solver_config);
-    u = Array(res[0] + 1, res[1], res[2], 0.0f, Vector3(0.0f, 0.5f, 0.5f));
-    v = Array(res[0], res[1] + 1, res[2], 0.0f, Vector3(0.5f, 0.0f, 0.5f));
-    w = Array(res[0], res[1], res[2] + 1, 0.0f, Vector3(0.5f, 0.5f, 0.0f));
-    rho = Array(res[0], res[1], res[2], 0.0f);
-    pressure = Array(res[0], res[1], res[2], 0.0f);
-    last_pressure = Array(res[0], res[1], res[2], 0.0f);
-    t = Array(res[0], res[1], res[2], config.get("initial_t", 0.0f));
-    current_t = 0.0f;
+    pressure_solver->set_profiler(&profiler);
+    // Pages are first touched by the threads that will work on them
+    u.initialize(res[0] + 1, res[1], res[2], 0.0f, Vector3(0.0f, 0.5f, 0.5f), num_threads);
+    v.initialize(res[0], res[1] + 1, res[2], 0.0f, Vector3(0.5f, 0.0f, 0.5f), num_threads);
+    w.initialize(res[0], res[1], res[2] + 1, 0.0f, Vector3(0.5f, 0.5f, 0.0f), num_threads);
+    rho.initialize(res, 0.0f, Vector3(0.5f), num_threads);
+    pressure.initialize(res, 0.0f, Vector3(0.5f), num_threads);
+    last_pressure.initialize(res, 0.0f, Vector3(0.5f), num_threads);
+    t.initialize(res, initial_temperature, Vector3(0.5f), num_threads);
     boundary_condition = PoissonSolver3D::BCArray(res);
     for (auto &ind : boundary_condition.get_region()) {
         Vector3 d = ind.get_pos() - Vector3(res) * 0.5f;
@@ -167,6 +223,76 @@ std::vector<RenderParticle> Smoke3D::get_render_particles() const {
     return render_particles;
 }
 
+void Smoke3D::get_particle_frame(ParticleFrame &frame) const {
+    const int n = (int)trackers.size();
+    const bool with_color = (frame.fields & ParticleFrame::COLOR) != 0;
+    frame.time = current_t;
+    frame.position.resize(n);
+    frame.color.resize(with_color ? n : 0);
+    frame.velocity.clear();
+    frame.state.clear();
+    parallel_for(0, n, num_threads, [&](int i) {
+        frame.position[i] = trackers[i].position;
+        if (with_color) {
+            frame.color[i] = trackers[i].color;
+        }
+    }, 1024);
+}
+
+void Smoke3D::get_sparse_volume(SparseVolume &volume, real threshold) const {
+    volume.time = current_t;
+    if (upres > 1) {
+        get_upres_volume(volume, threshold);
+        return;
+    }
+    if (!sparse_grid) {
+        volume.from_arrays({"density", "temperature"}, {&rho, &t}, {0.0f, initial_temperature}, threshold,
+                           num_threads);
+        return;
+    }
+    // Tiles are the grid's blocks, in the same layout; the blocks of nodes res only hold faces
+    static_assert(SparseVolume::tile_size == smoke3d_block_size, "Volume tiles must be smoke grid blocks");
+    volume.res = res;
+    volume.storage_offset = Vector3(0.5f);
+    volume.channels = {"density", "temperature"};
+    volume.backgrounds = {0.0f, initial_temperature};
+    const Vector3i tile_res = volume.get_tile_res();
+    std::vector<std::pair<int, Vector3i>> tiles;
+    for (auto &block : grid->get_allocated_blocks()) {
+        if (block.x < tile_res.x && block.y < tile_res.y && block.z < tile_res.z) {
+            tiles.push_back(std::make_pair((block.x * tile_res.y + block.y) * tile_res.z + block.z, block));
+        }
+    }
+    std::sort(tiles.begin(), tiles.end(), [](const std::pair<int, Vector3i> &a, const std::pair<int, Vector3i> &b) {
+        return a.first < b.first;
+    });
+    std::vector<char> occupied(tiles.size(), 0);
+    parallel_for(0, (int)tiles.size(), num_threads, [&](int i) {
+        const SmokeNode *page = grid->get_page(tiles[i].second);
+        for (int n = 0; n < SparseVolume::tile_volume; n++) {
+            occupied[i] |= page[n].rho > threshold || std::abs(page[n].t) > threshold;
+        }
+    }, 16);
+    volume.tiles.clear();
+    volume.values.assign(2, std::vector<real>());
+    for (int i = 0; i < (int)tiles.size(); i++) {
+        if (!occupied[i]) {
+            continue;
+        }
+        volume.tiles.push_back(tiles[i].first);
+        const SmokeNode *page = grid->get_page(tiles[i].second);
+        const Vector3i begin = tiles[i].second * smoke3d_block_size;
+        for (int n = 0; n < SparseVolume::tile_volume; n++) {
+            const Vector3i c = begin + Vector3i(n / (smoke3d_block_size * smoke3d_block_size),
+                                                n / smoke3d_block_size % smoke3d_block_size,
+                                                n % smoke3d_block_size);
+            const bool inside = c.x < res.x && c.y < res.y && c.z < res.z;
+            volume.values[0].push_back(inside ? page[n].rho : 0.0f);
+            volume.values[1].push_back(inside ? page[n].t : initial_temperature);
+        }
+    }
+}
+
 void Smoke3D::show(Array2D<Vector3> &buffer) {
     buffer.reset(Vector3(0));
     int half_width = buffer.get_width() / 2, half_height = buffer.get_height() / 2;
@@ -178,8 +304,8 @@ void Smoke3D::show(Array2D<Vector3> &buffer) {
                 real x = (i + 0.5f) / (real)half_width * res[0];
                 real y = (j + 0.5f) / (real)buffer.get_height() * res[1];
                 real z = k + 0.5f;
-                rho_sum += rho.sample(x, y, z);
-                t_sum += t.sample(x, y, z);
+                rho_sum += sample_density(Vector3(x, y, z));
+                t_sum += sample_temperature(Vector3(x, y, z));
             }
             rho_sum *= density_scaling;
             t_sum = std::min(1.0f, t_sum / res[2]);
@@ -195,8 +321,8 @@ void Smoke3D::show(Array2D<Vector3> &buffer) {
                 real x = (i + 0.5f) / (real)half_width * res[0];
                 real y = k + 0.5f;
                 real z = (j + 0.5f) / (real)half_height * res[2];
-                rho_sum += rho.sample(x, y, z);
-                t_sum += t.sample(x, y, z);
+                rho_sum += sample_density(Vector3(x, y, z));
+                t_sum += sample_temperature(Vector3(x, y, z));
             }
             rho_sum *= density_scaling;
             t_sum = std::min(1.0f, t_sum / res[2]);
@@ -206,16 +332,77 @@ void Smoke3D::show(Array2D<Vector3> &buffer) {
     }
 }
 
+// Midpoint rule, with the trilinear sampling of the grid advection
 void Smoke3D::move_trackers(real delta_t) {
-    for (auto &tracker : trackers) {
+    parallel_for(0, (int)trackers.size(), num_threads, [&](int i) {
+        Tracker3D &tracker = trackers[i];
         auto velocity = sample_velocity(tracker.position);
         tracker.position += sample_velocity(tracker.position + 0.5f * delta_t * velocity) * delta_t;
-    }
+    }, 1024);
 }
 
 void Smoke3D::step(real delta_t) {
+    TC_MEMORY_TAG("smoke3d");
+    time_stepper.begin_frame(delta_t);
+    if (!time_stepper.is_adaptive()) {
+        sparse_grid ? sparse_substep(delta_t) : substep(delta_t);
+        step_substeps.push_back(1);
+        return;
+    }
+    real remaining = delta_t;
+    while (remaining > 0) {
+        real dt;
+        {
+            Profiler::Scope _(profiler, "time_step", (uint64)res[0] * res[1] * res[2] * 5 * sizeof(real));
+            dt = time_stepper.get_substep(remaining, get_max_speed(), get_max_acceleration());
+        }
+        sparse_grid ? sparse_substep(dt) : substep(dt);
+        remaining = dt < remaining ? remaining - dt : 0.0f;
+    }
+    step_substeps.push_back(time_stepper.get_num_substeps());
+}
+
+real Smoke3D::get_max_speed() const {
+    auto max_speed = [](real a, real b) { return std::max(a, b); };
+    if (sparse_grid) {
+        const std::vector<Vector3i> &blocks = grid->get_allocated_blocks();
+        return parallel_reduce(0, (int)blocks.size(), num_threads, 0.0f, [&](int b) {
+            real speed = 0.0f;
+            grid->for_each_node(blocks[b], [&](const Index3D &, const SmokeNode &node) {
+                speed = std::max(speed, std::max(std::abs(node.u), std::max(std::abs(node.v), std::abs(node.w))));
+            });
+            return speed;
+        }, max_speed);
+    }
+    real speed = 0.0f;
+    for (const Array *field : {&u, &v, &w}) {
+        speed = std::max(speed, parallel_reduce(field->get_region(), num_threads, 0.0f,
+                                                [&](const Index3D &ind) { return std::abs((*field)[ind]); },
+                                                max_speed));
+    }
+    return speed;
+}
+
+real Smoke3D::get_max_acceleration() const {
+    if (sparse_grid) {
+        const std::vector<Vector3i> &blocks = grid->get_allocated_blocks();
+        return parallel_reduce(0, (int)blocks.size(), num_threads, 0.0f, [&](int b) {
+            real acceleration = 0.0f;
+            grid->for_each_node(blocks[b], [&](const Index3D &, const SmokeNode &node) {
+                acceleration = std::max(acceleration, std::abs(-smoke_alpha * node.rho + smoke_beta * node.t));
+            });
+            return acceleration;
+        }, [](real a, real b) { return std::max(a, b); });
+    }
+    return parallel_reduce(rho.get_region(), num_threads, 0.0f, [&](const Index3D &ind) {
+        return std::abs(-smoke_alpha * rho[ind] + smoke_beta * t[ind]);
+    }, [](real a, real b) { return std::max(a, b); });
+}
+
+void Smoke3D::substep(real delta_t) {
+    const uint64 num_cells = (uint64)res[0] * res[1] * res[2];
     {
-        Time::Timer _("Seeding");
+        Profiler::Scope _(profiler, "seeding", num_cells * 4 * sizeof(real));
         for (auto &ind : rho.get_region()) {
             for (int k = 0; k < super_sampling; k++) {
                 Vector3 pos = ind.get_pos() + Vector3(rand(), rand(), rand()) - ind.storage_offset;
@@ -241,35 +428,53 @@ void Smoke3D::step(real delta_t) {
                 }
             }
         }
-        for (auto &ind : v.get_region()) {
+    }
+    {
+        Profiler::Scope _(profiler, "forces", num_cells * 4 * sizeof(real));
+        parallel_for(v.get_region(), num_threads, [&](const Index3D &ind) {
             if (ind.j < res[1]) {
                 v[ind] += (-smoke_alpha * rho[ind] + smoke_beta * t[ind]) * delta_t;
             }
-        }
+        });
         real t_decay = std::exp(-delta_t * temperature_decay);
-        for (auto &ind : t.get_region()) {
+        parallel_for(t.get_region(), num_threads, [&](const Index3D &ind) {
             t[ind] *= t_decay;
-        }
+        });
+    }
+    if (vorticity_confinement > 0) {
+        Profiler::Scope _(profiler, "vorticity_confinement", num_cells * 6 * sizeof(real));
+        confine_vorticity(delta_t);
     }
     apply_boundary_condition();
-    TIME(project());
+    {
+        // Divergence, the solve and the velocity update; the solver's own iterations are not counted
+        Profiler::Scope _(profiler, "pressure_solve", num_cells * 12 * sizeof(real));
+        project();
+    }
     apply_boundary_condition();
-    TIME(move_trackers(delta_t));
-    TIME(remove_outside_trackers());
-    TIME(advect(delta_t));
+    {
+        Profiler::Scope _(profiler, "advection", num_cells * 5 * 5 * sizeof(real) +
+                                                 trackers.size() * 2 * sizeof(Tracker3D));
+        move_trackers(delta_t);
+        remove_outside_trackers();
+        advect(delta_t);
+    }
     apply_boundary_condition();
+    if (upres > 1) {
+        Profiler::Scope _(profiler, "upres", (uint64)fine_rho->get_num_allocated_blocks() * FineGrid::block_volume *
+                                             sizeof(real) * 3);
+        upres_step(delta_t);
+    }
     current_t += delta_t;
 }
 
+// Compacts the trackers in place, in one pass and keeping their order
 void Smoke3D::remove_outside_trackers() {
-    std::vector<Tracker3D> all_trackers = trackers;
-    trackers.clear();
-    for (auto &tracker : all_trackers) {
+    auto outside = [&](const Tracker3D &tracker) {
         Vector3 p = tracker.position;
-        if (0 <= p.x && p.x <= res[0] && 0 <= p.y && p.y <= res[1] && 0 <= p.z && p.z <= res[2]) {
-            trackers.push_back(tracker);
-        }
-    }
+        return !(0 <= p.x && p.x <= res[0] && 0 <= p.y && p.y <= res[1] && 0 <= p.z && p.z <= res[2]);
+    };
+    trackers.erase(std::remove_if(trackers.begin(), trackers.end(), outside), trackers.end());
 }
 
 Vector3 Smoke3D::sample_velocity(const Array &u, const Array &v, const Array &w, const Vector3 &pos) {
@@ -277,19 +482,124 @@ Vector3 Smoke3D::sample_velocity(const Array &u, const Array &v, const Array &w,
 }
 
 Vector3 Smoke3D::sample_velocity(const Vector3 &pos) const {
+    if (sparse_grid) {
+        return sample_sparse_velocity(*grid, pos);
+    }
     return sample_velocity(u, v, w, pos);
 }
 
-void Smoke3D::advect(Array &attr, real delta_t) {
-    auto new_attr = attr.same_shape(0);
-    for (auto &ind : new_attr.get_region()) {
-        auto old_position = ind.get_pos() - delta_t * sample_velocity(ind.get_pos());
-        new_attr[ind] = attr.sample(old_position);
+// The trilinear stencil of a position, as in Array3D::sample, to be applied to every field on the grid
+struct TrilinearStencil {
+    int base, stride, depth;
+    real x_r, y_r, z_r;
+
+    TrilinearStencil(const Array3D<real> &grid, const Vector3 &pos) {
+        const int width = grid.get_width(), height = grid.get_height();
+        depth = grid.get_depth();
+        stride = height * depth;
+        const Vector3 offset = grid.get_storage_offset();
+        real x = clamp(pos.x - offset.x, 0.f, width - 1.f - eps);
+        real y = clamp(pos.y - offset.y, 0.f, height - 1.f - eps);
+        real z = clamp(pos.z - offset.z, 0.f, depth - 1.f - eps);
+        int x_i = clamp(int(x), 0, width - 2);
+        int y_i = clamp(int(y), 0, height - 2);
+        int z_i = clamp(int(z), 0, depth - 2);
+        x_r = x - x_i;
+        y_r = y - y_i;
+        z_r = z - z_i;
+        base = x_i * stride + y_i * depth + z_i;
+    }
+
+    real sample(const real *data) const {
+        const real *p = data + base;
+        return lerp(z_r,
+                    lerp(x_r, lerp(y_r, p[0], p[depth]), lerp(y_r, p[stride], p[stride + depth])),
+                    lerp(x_r, lerp(y_r, p[1], p[depth + 1]), lerp(y_r, p[stride + 1], p[stride + depth + 1])));
+    }
+
+    // The range of the values interpolated
+    void get_range(const real *data, real &lower, real &upper) const {
+        lower = std::numeric_limits<real>::infinity();
+        upper = -lower;
+        for (int i = 0; i < 2; i++) {
+            for (int j = 0; j < 2; j++) {
+                for (int k = 0; k < 2; k++) {
+                    const real value = data[base + i * stride + j * depth + k];
+                    lower = std::min(lower, value);
+                    upper = std::max(upper, value);
+                }
+            }
+        }
+    }
+};
+
+template <typename T>
+void Smoke3D::for_each_backtrace(const Array &grid, const Array &u, const Array &v, const Array &w, real delta_t,
+                                 const T &func) const {
+    const int height = grid.get_height(), depth = grid.get_depth();
+    const Vector3 offset = grid.get_storage_offset();
+    parallel_for(0, grid.get_width(), num_threads, [&](int i) {
+        for (int j = 0; j < height; j++) {
+            for (int k = 0; k < depth; k++) {
+                const Vector3 pos = Vector3(real(i), real(j), real(k)) + offset;
+                const Vector3 old_position = pos - delta_t * sample_velocity(u, v, w, pos);
+                func((i * height + j) * depth + k, TrilinearStencil(grid, old_position));
+            }
+        }
+    }, 1);
+}
+
+void Smoke3D::advect(const std::vector<Array *> &fields, const Array &u, const Array &v, const Array &w,
+                     real delta_t) {
+    const int n = (int)fields.size();
+    const Array &grid = *fields[0];
+    // The fields take over fresh storage, as every cell of theirs is written below
+    std::vector<Array> sources;
+    for (auto field : fields) {
+        sources.push_back(field->same_shape(uninitialized));
+        sources.back().swap(*field);
     }
-    attr = new_attr;
+    std::vector<const real *> source_data(n);
+    std::vector<real *> field_data(n);
+    for (int f = 0; f < n; f++) {
+        source_data[f] = &sources[f][0][0][0];
+        field_data[f] = &(*fields[f])[0][0][0];
+    }
+    for_each_backtrace(grid, u, v, w, delta_t, [&](int index, const TrilinearStencil &stencil) {
+        for (int f = 0; f < n; f++) {
+            field_data[f][index] = stencil.sample(source_data[f]);
+        }
+    });
+    if (advection != "maccormack") {
+        return;
+    }
+    // MacCormack: the error of a backward advection of the result corrects it by half,
+    // clamped to the range of the forward stencil so that no new extrema appear
+    std::vector<Array> backward(n, grid.same_shape(uninitialized));
+    std::vector<const real *> forward_data(n);
+    std::vector<real *> backward_data(n);
+    for (int f = 0; f < n; f++) {
+        forward_data[f] = field_data[f];
+        backward_data[f] = &backward[f][0][0][0];
+    }
+    for_each_backtrace(grid, u, v, w, -delta_t, [&](int index, const TrilinearStencil &stencil) {
+        for (int f = 0; f < n; f++) {
+            backward_data[f][index] = stencil.sample(forward_data[f]);
+        }
+    });
+    for_each_backtrace(grid, u, v, w, delta_t, [&](int index, const TrilinearStencil &stencil) {
+        for (int f = 0; f < n; f++) {
+            real lower, upper;
+            stencil.get_range(source_data[f], lower, upper);
+            const real corrected = field_data[f][index] + 0.5f * (source_data[f][index] - backward_data[f][index]);
+            field_data[f][index] = clamp(corrected, lower, upper);
+        }
+    });
 }
 
 void Smoke3D::apply_boundary_condition() {
+    Profiler::Scope _(profiler, "boundary_conditions",
+                      (uint64)res[0] * res[1] * res[2] * (sizeof(PoissonSolver3D::CellType) + 6 * sizeof(real)));
     for (auto &ind : boundary_condition.get_region()) {
         if (boundary_condition[ind] == PoissonSolver3D::NEUMANN) {
             u[ind] = 0;
@@ -319,16 +629,125 @@ void Smoke3D::apply_boundary_condition() {
     }
 }
 
+// Everything is advected through the velocity at the start of the advection.
+// Density and temperature share their grid, so they share the back-traced positions too.
 void Smoke3D::advect(real delta_t) {
-    advect(rho, delta_t);
-    advect(t, delta_t);
-    advect(u, delta_t);
-    advect(v, delta_t);
-    advect(w, delta_t);
+    const Array u0 = u, v0 = v, w0 = w;
+    advect({&rho, &t}, u0, v0, w0, delta_t);
+    advect({&u}, u0, v0, w0, delta_t);
+    advect({&v}, u0, v0, w0, delta_t);
+    advect({&w}, u0, v0, w0, delta_t);
 }
 
-void Smoke3D::confine_vorticity(real delta_t) {
+template <typename V, typename S>
+void Smoke3D::confine_vorticity_tile(const Vector3i &begin, const Vector3i &end, real delta_t, const V &velocity,
+                                     const S &set_velocity) const {
+    // Cell velocities over [begin - 3, end + 2), curls and their magnitudes over [begin - 2, end + 1) and
+    // forces over [begin - 1, end), all indexed from begin - 3
+    const Vector3i origin = begin - Vector3i(3), size = end - begin + Vector3i(5);
+    const Vector3i strides(size.y * size.z, size.z, 1);
+    const int volume = size.x * size.y * size.z;
+    std::vector<Vector3> cell_velocity(volume), curl(volume), force(volume);
+    std::vector<real> magnitude(volume);
+    auto for_each_cell = [&](const Vector3i &from, const Vector3i &to, const auto &f) {
+        for (int i = from.x; i < to.x; i++) {
+            for (int j = from.y; j < to.y; j++) {
+                for (int k = from.z; k < to.z; k++) {
+                    f(Vector3i(i, j, k), (i - origin.x) * strides.x + (j - origin.y) * strides.y + k - origin.z);
+                }
+            }
+        }
+    };
+    // Cells outside the domain take the velocity of the nearest one inside
+    for_each_cell(origin, end + Vector3i(2), [&](const Vector3i &c, int index) {
+        const Vector3i inside = glm::clamp(c, Vector3i(0), res - Vector3i(1));
+        Vector3 average;
+        for (int d = 0; d < 3; d++) {
+            Vector3i upper = inside;
+            upper[d]++;
+            average[d] = 0.5f * (velocity(d, inside) + velocity(d, upper));
+        }
+        cell_velocity[index] = average;
+    });
+    for_each_cell(begin - Vector3i(2), end + Vector3i(1), [&](const Vector3i &, int index) {
+        auto derivative = [&](int field, int d) {
+            return 0.5f * (cell_velocity[index + strides[d]][field] - cell_velocity[index - strides[d]][field]);
+        };
+        const Vector3 omega(derivative(2, 1) - derivative(1, 2), derivative(0, 2) - derivative(2, 0),
+                            derivative(1, 0) - derivative(0, 1));
+        curl[index] = omega;
+        magnitude[index] = length(omega);
+    });
+    for_each_cell(begin - Vector3i(1), end, [&](const Vector3i &c, int index) {
+        if (!(0 <= c.x && c.x < res.x && 0 <= c.y && c.y < res.y && 0 <= c.z && c.z < res.z)) {
+            force[index] = Vector3(0.0f);
+            return;
+        }
+        Vector3 gradient;
+        for (int d = 0; d < 3; d++) {
+            gradient[d] = 0.5f * (magnitude[index + strides[d]] - magnitude[index - strides[d]]);
+        }
+        const real gradient_length = length(gradient);
+        force[index] = gradient_length > 1e-20f
+                       ? vorticity_confinement / gradient_length * cross(gradient, curl[index]) : Vector3(0.0f);
+    });
+    // Faces by the average of their two cells, those outside the domain exerting none
+    for_each_cell(begin, end, [&](const Vector3i &node, int index) {
+        for (int d = 0; d < 3; d++) {
+            bool is_face = true;
+            for (int a = 0; a < 3; a++) {
+                is_face = is_face && node[a] < res[a] + int(a == d);
+            }
+            if (is_face) {
+                const real f = 0.5f * (force[index - strides[d]][d] + force[index][d]);
+                set_velocity(d, node, velocity(d, node) + delta_t * f);
+            }
+        }
+    });
+}
 
+void Smoke3D::confine_vorticity(real delta_t) {
+    if (sparse_grid) {
+        // Into next_grid, block by block, as the tiles read the velocities around them
+        const std::vector<Vector3i> &blocks = grid->get_allocated_blocks();
+        const SparseGrid &source = *grid;
+        SparseGrid &target = *next_grid;
+        parallel_for(0, (int)blocks.size(), num_threads, [&](int b) {
+            target.for_each_node(blocks[b], [&](const Index3D &ind, SmokeNode &node) {
+                node = source(ind.i, ind.j, ind.k);
+            });
+            const Vector3i begin = blocks[b] * smoke3d_block_size;
+            confine_vorticity_tile(begin, glm::min(begin + Vector3i(smoke3d_block_size), source.get_res()), delta_t,
+                                   [&](int d, const Vector3i &node) {
+                                       const SmokeNode &n = source.get(node.x, node.y, node.z);
+                                       return d == 0 ? n.u : (d == 1 ? n.v : n.w);
+                                   },
+                                   [&](int d, const Vector3i &node, real value) {
+                                       SmokeNode &n = target[node];
+                                       (d == 0 ? n.u : (d == 1 ? n.v : n.w)) = value;
+                                   });
+        }, 1);
+        std::swap(grid, next_grid);
+        return;
+    }
+    // Into fresh storage, over tiles of the faces' nodes [0, res + 1), large enough for the halos not to
+    // dominate
+    const int tile_size = 16;
+    Array *fields[3] = {&u, &v, &w};
+    Array sources[3];
+    for (int d = 0; d < 3; d++) {
+        sources[d] = fields[d]->same_shape(uninitialized);
+        sources[d].swap(*fields[d]);
+    }
+    const Vector3i nodes = res + Vector3i(1);
+    const Vector3i tiles = (nodes + Vector3i(tile_size - 1)) / tile_size;
+    parallel_for(0, tiles.x * tiles.y * tiles.z, num_threads, [&](int tile) {
+        const Vector3i begin = Vector3i(tile / (tiles.y * tiles.z), tile / tiles.z % tiles.y, tile % tiles.z) *
+                               tile_size;
+        confine_vorticity_tile(begin, glm::min(begin + Vector3i(tile_size), nodes), delta_t,
+                               [&](int d, const Vector3i &node) { return sources[d][node]; },
+                               [&](int d, const Vector3i &node, real value) { (*fields[d])[node] = value; });
+    }, 1);
 }
 
 void Smoke3D::update(const Config &config) {
@@ -336,6 +755,7 @@ void Smoke3D::update(const Config &config) {
     initial_velocity_tex = AssetManager::get_asset<Texture>(config.get_int("initial_velocity_tex"));
     color_tex = AssetManager::get_asset<Texture>(config.get_int("color_tex"));
     temperature_tex = AssetManager::get_asset<Texture>(config.get_int("temperature_tex"));
+    source_blocks_dirty = true;
 }
 
 TC_IMPLEMENTATION(Simulation3D, Smoke3D, "smoke");
@@ -14,8 +14,11 @@
 #include <taichi/visualization/image_buffer.h>
 #include <taichi/common/meta.h>
 #include <taichi/math/array_3d.h>
+#include <taichi/math/sparse_grid_3d.h>
+#include <taichi/math/algebraic_multigrid.h>
 #include <taichi/dynamics/poisson_solver3d.h>
 #include <taichi/dynamics/simulation3d.h>
+#include <taichi/dynamics/time_stepping.h>
 #include <taichi/visual/texture.h>
 
 TC_NAMESPACE_BEGIN
@@ -30,17 +33,33 @@ public:
     Tracker3D(const Vector3 &position, const Vector3 &color) : position(position), color(color) {}
 };
 
+const int smoke3d_block_size = 8;
+
+// A node of the sparse smoke grid: the velocities of the lower faces of its cell, and the cell's values. Nodes
+// res (in any dimension) only hold the upper faces of the domain.
+struct SmokeNode {
+    real u, v, w, rho, t, pressure;
+    // Of the cell in the pressure solve, -1 if it is not in it
+    int row;
+};
+
 class Smoke3D : public Simulation3D {
     typedef Array3D<real> Array;
+    typedef SparseGrid3D<SmokeNode, smoke3d_block_size> SparseGrid;
+    typedef SparseGrid3D<real, smoke3d_block_size> FineGrid;
 public:
     Array u, v, w, rho, t, pressure, last_pressure;
     Vector3i res;
     real smoke_alpha, smoke_beta;
     real temperature_decay;
+    // Temperature the grid starts at, which is also the background of exported volumes
+    real initial_temperature;
     real pressure_tolerance;
     real density_scaling;
     real tracker_generation;
     real perturbation;
+    // Strength of the vorticity confinement force, 0 (default) for none
+    real vorticity_confinement;
     int super_sampling;
     std::shared_ptr<Texture> generation_tex;
     std::shared_ptr<Texture> initial_velocity_tex;
@@ -48,10 +67,56 @@ public:
     std::shared_ptr<Texture> temperature_tex;
 
     bool open_boundary;
+    // Start the pressure solve from the pressure of the last step
+    bool warm_start;
+    // "semi_lagrangian" (default), or "maccormack" for less numerical diffusion
+    std::string advection;
     std::vector<Tracker3D> trackers;
+    // Frames are substepped by CFL if "cfl" is positive, and single steps otherwise
+    CFLTimeStepper time_stepper;
     std::shared_ptr<PoissonSolver3D> pressure_solver;
     PoissonSolver3D::BCArray boundary_condition;
 
+    // Instead of the dense fields, only blocks with smoke, velocity or sources are kept, dilated by the
+    // distance the flow crosses in a substep and sparse_margin blocks, which are reallocated once the flow
+    // outgrows them or they are 2 * sparse_margin blocks too many around it; the rest of the domain is air at
+    // rest, at zero pressure. Semi-Lagrangian advection only, with the pressure solved by AMG-preconditioned CG
+    // over the cells kept.
+    bool sparse_grid;
+    // Blocks are dropped once their densities and temperatures are all within sparse_threshold of 0, and
+    // their velocities below sparse_velocity_threshold times the maximum speed (as the pressure solve spreads
+    // small velocities over the whole domain), or sparse_threshold if that is more
+    real sparse_threshold;
+    real sparse_velocity_threshold;
+    int sparse_margin;
+    int maximum_pressure_iterations;
+    // The current fields, and the ones advection writes, over the same blocks
+    std::unique_ptr<SparseGrid> grid, next_grid;
+    // Blocks where generation_tex seeds smoke, found when the textures change
+    std::vector<Vector3i> source_blocks;
+    bool source_blocks_dirty = true;
+    // Of the pressure solve, whose system and AMG hierarchy are kept while its cells stay the same
+    std::vector<Vector3i> pressure_cells;
+    SparseMatrix pressure_matrix;
+    AlgebraicMultigrid pressure_amg;
+    bool pressure_null_space = false;
+
+    // With "upres" > 1, a density field of upres times the resolution is carried along, advected by the
+    // velocity plus curl noise turbulence, without a pressure solve of its own, in blocks around its smoke.
+    // Volumes are then exported at the fine resolution, with the temperature interpolated.
+    int upres;
+    // Of the turbulence, relative to the local speed
+    real upres_strength;
+    // Of the coarsest noise octave, per cell, and how fast the noise pattern moves through space
+    real upres_frequency;
+    real upres_noise_speed;
+    // Noise octaves, each of twice the frequency and 2^(-5/6) the amplitude of the last (a Kolmogorov
+    // spectrum), the finest being two fine cells across
+    int upres_octaves;
+    // Fine blocks are dropped once their densities are all within this of 0
+    real upres_threshold;
+    std::unique_ptr<FineGrid> fine_rho, next_fine_rho;
+
     Smoke3D() {}
 
     void remove_outside_trackers();
@@ -60,17 +125,42 @@ public:
 
     void project();
 
+    // Adds vorticity_confinement * (N x curl) to the faces, N being the normalized gradient of |curl|, for the
+    // swirls the grid would otherwise dissipate
     void confine_vorticity(real delta_t);
 
+    // The confinement of the faces of nodes [begin, end), from the velocities of the tile and three cells
+    // around it, read by velocity(d, node) (of the lower face of the node's cell normal to axis d) and written
+    // by set_velocity(d, node, value). Curl, its magnitude, its gradient and the force are computed in one
+    // pass over the tile, on buffers small enough to stay in cache.
+    template <typename V, typename S>
+    void confine_vorticity_tile(const Vector3i &begin, const Vector3i &end, real delta_t, const V &velocity,
+                                const S &set_velocity) const;
+
     void advect(real delta_t);
 
     void move_trackers(real delta_t);
 
     void step(real delta_t) override;
 
+    void substep(real delta_t);
+
+    // In cells per unit time, of the face velocities
+    real get_max_speed() const;
+
+    // Of the buoyancy, in cells per unit time squared
+    real get_max_acceleration() const;
+
     virtual void show(Array2D<Vector3> &buffer);
 
-    void advect(Array &attr, real delta_t);
+    // Every grid point of the fields' grid, with the trilinear stencil of its back-traced position
+    template <typename T>
+    void for_each_backtrace(const Array &grid, const Array &u, const Array &v, const Array &w, real delta_t,
+                            const T &func) const;
+
+    // Advects fields sharing one grid through the velocity (u, v, w), sampling them
+    // with the same back-traced positions
+    void advect(const std::vector<Array *> &fields, const Array &u, const Array &v, const Array &w, real delta_t);
 
     void apply_boundary_condition();
 
@@ -80,7 +170,59 @@ public:
 
     std::vector<RenderParticle> get_render_particles() const override;
 
+    // The tracker positions, and their colors with ParticleFrame::COLOR, for export_particles
+    void get_particle_frame(ParticleFrame &frame) const override;
+
+    // Channels "density" and "temperature", the latter with the initial temperature as background
+    void get_sparse_volume(SparseVolume &volume, real threshold) const override;
+
     void update(const Config &config) override;
+
+    // Everything of sparse_grid. Blocks marked in a block_res array, indexed as by SparseGrid3D::get_block_id,
+    // dilated by the blocks within dilation of them on each axis
+    static std::vector<char> dilate_blocks(const std::vector<char> &marked, const Vector3i &block_res,
+                                           int dilation, int num_threads);
+
+    static std::vector<Vector3i> get_marked_blocks(const std::vector<char> &marked, const Vector3i &block_res);
+
+    void find_source_blocks();
+
+    void update_active_blocks(real delta_t);
+
+    // target(const Index3D &, SmokeNode &) for every node of the grid's blocks, in parallel
+    template <typename T>
+    void for_each_node(SparseGrid &grid, const T &target) const;
+
+    void sparse_substep(real delta_t);
+
+    void sparse_seed(real delta_t);
+
+    void sparse_apply_boundary_condition();
+
+    void sparse_project();
+
+    void sparse_advect(real delta_t);
+
+    // Trilinear, as Array3D::sample of the dense field with that storage offset and size
+    static real sample(const SparseGrid &grid, real SmokeNode::*field, const Vector3 &offset, const Vector3i &size,
+                       const Vector3 &pos);
+
+    Vector3 sample_sparse_velocity(const SparseGrid &grid, const Vector3 &pos) const;
+
+    // Of the density and temperature, dense or sparse
+    real sample_density(const Vector3 &pos) const;
+
+    real sample_temperature(const Vector3 &pos) const;
+
+    // Everything of upres
+    void upres_step(real delta_t);
+
+    void update_fine_blocks(real delta_t);
+
+    // Of the fine cells in the block, in fine cells per unit time
+    void get_fine_velocities(const Vector3i &block, Vector3 *velocities) const;
+
+    void get_upres_volume(SparseVolume &volume, real threshold) const;
 };
 
 TC_NAMESPACE_END
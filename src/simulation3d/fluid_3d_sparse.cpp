@@ -0,0 +1,490 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include "fluid_3d.h"
+#include <taichi/io/volume_exporter.h>
+#include <taichi/system/memory.h>
+#include <taichi/system/threading.h>
+#include <taichi/system/timer.h>
+#include <algorithm>
+#include <cmath>
+
+TC_NAMESPACE_BEGIN
+
+// Smoke3D with sparse_grid. Node (i, j, k) holds u at face (i, j + 0.5, k + 0.5), v at (i + 0.5, j, k + 0.5),
+// w at (i + 0.5, j + 0.5, k) and the cell values at (i + 0.5, j + 0.5, k + 0.5), as the dense fields do. Nodes
+// of unallocated blocks are at the background: at rest, without smoke and at zero pressure.
+
+static const Vector3i face_directions[3]{Vector3i(1, 0, 0), Vector3i(0, 1, 0), Vector3i(0, 0, 1)};
+static real SmokeNode::*const face_velocities[3]{&SmokeNode::u, &SmokeNode::v, &SmokeNode::w};
+
+template <typename T>
+void Smoke3D::for_each_node(SparseGrid &grid, const T &target) const {
+    const std::vector<Vector3i> &blocks = grid.get_allocated_blocks();
+    parallel_for(0, (int)blocks.size(), num_threads, [&](int b) {
+        grid.for_each_node(blocks[b], target);
+    }, 1);
+}
+
+real Smoke3D::sample(const SparseGrid &grid, real SmokeNode::*field, const Vector3 &offset, const Vector3i &size,
+                     const Vector3 &pos) {
+    const real x = clamp(pos.x - offset.x, 0.f, size.x - 1.f - eps);
+    const real y = clamp(pos.y - offset.y, 0.f, size.y - 1.f - eps);
+    const real z = clamp(pos.z - offset.z, 0.f, size.z - 1.f - eps);
+    const int x_i = clamp(int(x), 0, size.x - 2);
+    const int y_i = clamp(int(y), 0, size.y - 2);
+    const int z_i = clamp(int(z), 0, size.z - 2);
+    const real x_r = x - x_i, y_r = y - y_i, z_r = z - z_i;
+    auto get = [&](int i, int j, int k) { return grid.get(i, j, k).*field; };
+    return lerp(z_r,
+                lerp(x_r, lerp(y_r, get(x_i, y_i, z_i), get(x_i, y_i + 1, z_i)),
+                     lerp(y_r, get(x_i + 1, y_i, z_i), get(x_i + 1, y_i + 1, z_i))),
+                lerp(x_r, lerp(y_r, get(x_i, y_i, z_i + 1), get(x_i, y_i + 1, z_i + 1)),
+                     lerp(y_r, get(x_i + 1, y_i, z_i + 1), get(x_i + 1, y_i + 1, z_i + 1))));
+}
+
+Vector3 Smoke3D::sample_sparse_velocity(const SparseGrid &grid, const Vector3 &pos) const {
+    return Vector3(sample(grid, &SmokeNode::u, Vector3(0.0f, 0.5f, 0.5f), res + Vector3i(1, 0, 0), pos),
+                   sample(grid, &SmokeNode::v, Vector3(0.5f, 0.0f, 0.5f), res + Vector3i(0, 1, 0), pos),
+                   sample(grid, &SmokeNode::w, Vector3(0.5f, 0.5f, 0.0f), res + Vector3i(0, 0, 1), pos));
+}
+
+real Smoke3D::sample_density(const Vector3 &pos) const {
+    if (!sparse_grid) {
+        return rho.sample(pos);
+    }
+    return sample(*grid, &SmokeNode::rho, Vector3(0.5f), res, pos);
+}
+
+real Smoke3D::sample_temperature(const Vector3 &pos) const {
+    if (!sparse_grid) {
+        return t.sample(pos);
+    }
+    return sample(*grid, &SmokeNode::t, Vector3(0.5f), res, pos);
+}
+
+std::vector<char> Smoke3D::dilate_blocks(const std::vector<char> &marked, const Vector3i &block_res, int dilation,
+                                         int num_threads) {
+    auto get_block_id = [&](const Vector3i &block) {
+        return (block.x * block_res.y + block.y) * block_res.z + block.z;
+    };
+    // One axis at a time
+    std::vector<char> result = marked;
+    for (int axis = 0; axis < 3; axis++) {
+        std::vector<char> dilated(result.size(), 0);
+        parallel_for(0, block_res.x, num_threads, [&](int bx) {
+            for (int by = 0; by < block_res.y; by++) {
+                for (int bz = 0; bz < block_res.z; bz++) {
+                    const Vector3i block(bx, by, bz);
+                    if (!result[get_block_id(block)]) {
+                        continue;
+                    }
+                    const int lower = std::max(0, block[axis] - dilation);
+                    const int upper = std::min(block_res[axis] - 1, block[axis] + dilation);
+                    Vector3i neighbour = block;
+                    for (neighbour[axis] = lower; neighbour[axis] <= upper; neighbour[axis]++) {
+                        dilated[get_block_id(neighbour)] = 1;
+                    }
+                }
+            }
+        }, 1);
+        result.swap(dilated);
+    }
+    return result;
+}
+
+std::vector<Vector3i> Smoke3D::get_marked_blocks(const std::vector<char> &marked, const Vector3i &block_res) {
+    std::vector<Vector3i> blocks;
+    for (int bx = 0; bx < block_res.x; bx++) {
+        for (int by = 0; by < block_res.y; by++) {
+            for (int bz = 0; bz < block_res.z; bz++) {
+                if (marked[(bx * block_res.y + by) * block_res.z + bz]) {
+                    blocks.push_back(Vector3i(bx, by, bz));
+                }
+            }
+        }
+    }
+    return blocks;
+}
+
+void Smoke3D::find_source_blocks() {
+    // The generation texture at the corners and centers of every cell, which covers the jittered seeds of
+    // textures that are not zero over whole cells. Blocks are those of the sparse grid, over res + 1 nodes.
+    const Vector3i block_res = (res + Vector3i(smoke3d_block_size)) / smoke3d_block_size;
+    auto get_block_id = [&](const Vector3i &block) {
+        return (block.x * block_res.y + block.y) * block_res.z + block.z;
+    };
+    std::vector<char> is_source(block_res.x * block_res.y * block_res.z, 0);
+    parallel_for(0, block_res.x, num_threads, [&](int bx) {
+        for (int by = 0; by < block_res.y; by++) {
+            for (int bz = 0; bz < block_res.z; bz++) {
+                const Vector3i block(bx, by, bz);
+                const Vector3i begin = block * smoke3d_block_size;
+                const Vector3i end = glm::min(begin + Vector3i(smoke3d_block_size), res);
+                bool source = false;
+                for (int i = begin.x * 2; i <= end.x * 2 && !source; i++) {
+                    for (int j = begin.y * 2; j <= end.y * 2 && !source; j++) {
+                        for (int k = begin.z * 2; k <= end.z * 2 && !source; k++) {
+                            const Vector3 pos = Vector3(i, j, k) * 0.5f / Vector3(res);
+                            source = generation_tex->sample(pos).x != 0;
+                        }
+                    }
+                }
+                is_source[get_block_id(block)] = source;
+            }
+        }
+    }, 1);
+    source_blocks = get_marked_blocks(is_source, block_res);
+    source_blocks_dirty = false;
+}
+
+void Smoke3D::update_active_blocks(real delta_t) {
+    TC_MEMORY_TAG("smoke3d.grid");
+    const Vector3i block_res = grid->get_block_res();
+    std::vector<char> active(block_res.x * block_res.y * block_res.z, 0);
+    const std::vector<Vector3i> &blocks = grid->get_allocated_blocks();
+    const real max_speed = get_max_speed();
+    const real velocity_threshold = std::max(sparse_threshold, sparse_velocity_threshold * max_speed);
+    parallel_for(0, (int)blocks.size(), num_threads, [&](int b) {
+        bool occupied = false;
+        grid->for_each_node(blocks[b], [&](const Index3D &, const SmokeNode &node) {
+            occupied = occupied || std::abs(node.u) > velocity_threshold ||
+                       std::abs(node.v) > velocity_threshold || std::abs(node.w) > velocity_threshold ||
+                       node.rho > sparse_threshold || std::abs(node.t) > sparse_threshold;
+        });
+        active[grid->get_block_id(blocks[b])] = occupied;
+    }, 1);
+    for (auto &block : source_blocks) {
+        active[grid->get_block_id(block)] = 1;
+    }
+    // Dilated by the blocks the flow reaches
+    const std::vector<char> required = dilate_blocks(active, block_res,
+                                                    (int)std::ceil(max_speed * delta_t / smoke3d_block_size),
+                                                    num_threads);
+    // The blocks are kept while they cover the ones required and are within 2 * sparse_margin of them, so that
+    // they (and the pressure system) change once every few substeps as the smoke moves
+    const std::vector<char> limit = dilate_blocks(required, block_res, 2 * sparse_margin, num_threads);
+    bool keep = true;
+    for (auto &block : blocks) {
+        keep = keep && limit[grid->get_block_id(block)];
+    }
+    int num_missing = (int)std::count(required.begin(), required.end(), 1);
+    for (auto &block : blocks) {
+        num_missing -= required[grid->get_block_id(block)];
+    }
+    if (keep && num_missing == 0) {
+        return;
+    }
+    const std::vector<Vector3i> active_blocks =
+            get_marked_blocks(dilate_blocks(required, block_res, sparse_margin, num_threads), block_res);
+    grid->set_allocated_blocks(active_blocks);
+    next_grid->set_allocated_blocks(active_blocks);
+}
+
+void Smoke3D::sparse_seed(real delta_t) {
+    // Serial, as the dense seeding, for the order of rand() and the trackers
+    for (auto &block : source_blocks) {
+        grid->for_each_node(block, [&](const Index3D &ind, SmokeNode &node) {
+            if (ind.i >= res.x || ind.j >= res.y || ind.k >= res.z) {
+                return;
+            }
+            for (int k = 0; k < super_sampling; k++) {
+                Vector3 pos = Vector3(ind.i, ind.j, ind.k) + Vector3(rand(), rand(), rand());
+                Vector3 relative_pos = pos / Vector3(res);
+                real seed = generation_tex->sample(relative_pos).x / super_sampling;
+                if (seed == 0) {
+                    continue;
+                }
+                Vector3 initial_speed = initial_velocity_tex->sample3(relative_pos);
+                Vector3 color = color_tex->sample3(relative_pos);
+                node.t = temperature_tex->sample3(relative_pos).x;
+                node.rho += seed;
+                node.u = initial_speed.x;
+                node.v = initial_speed.y;
+                node.w = initial_speed.z;
+                real gen = delta_t * seed;
+                int gen_int = (int)std::floor(gen) + int(rand() < gen - std::floor(gen));
+                for (int i = 0; i < gen_int; i++) {
+                    trackers.push_back(Tracker3D(pos, color));
+                }
+            }
+        });
+    }
+}
+
+void Smoke3D::sparse_apply_boundary_condition() {
+    if (open_boundary) {
+        return;
+    }
+    // The faces the dense apply_boundary_condition closes
+    for_each_node(*grid, [&](const Index3D &ind, SmokeNode &node) {
+        if (ind.j < res.y && ind.k < res.z && (ind.i == 0 || ind.i == res.x - 1)) {
+            node.u = 0;
+        }
+        if (ind.i < res.x && ind.k < res.z && (ind.j == 0 || ind.j == res.y - 1)) {
+            node.v = 0;
+        }
+        if (ind.i < res.x && ind.j < res.y && (ind.k == 0 || ind.k == res.z - 1)) {
+            node.w = 0;
+        }
+    });
+}
+
+void Smoke3D::sparse_project() {
+    const double solve_start_time = Time::get_time();
+    SolverStatistics statistics;
+    statistics.solver = "smoke3d_sparse_amgpcg";
+    statistics.tolerance = pressure_tolerance;
+    auto is_cell = [&](const Vector3i &c) {
+        return 0 <= c.x && c.x < res.x && 0 <= c.y && c.y < res.y && 0 <= c.z && c.z < res.z;
+    };
+    // Cells are solved for if their upper faces are kept too; the others are air at rest
+    const std::vector<Vector3i> &blocks = grid->get_allocated_blocks();
+    std::vector<std::vector<Vector3i>> block_cells(blocks.size());
+    parallel_for(0, (int)blocks.size(), num_threads, [&](int b) {
+        grid->for_each_node(blocks[b], [&](const Index3D &ind, SmokeNode &node) {
+            const Vector3i c(ind.i, ind.j, ind.k);
+            node.row = -1;
+            if (!is_cell(c)) {
+                return;
+            }
+            for (auto &d : face_directions) {
+                if (!grid->has_block(grid->get_block_coord(c + d))) {
+                    return;
+                }
+            }
+            block_cells[b].push_back(c);
+        });
+    }, 1);
+    std::vector<Vector3i> cells;
+    for (auto &c : block_cells) {
+        cells.insert(cells.end(), c.begin(), c.end());
+    }
+    const int n = (int)cells.size();
+    parallel_for(0, n, num_threads, [&](int r) {
+        (*grid)[cells[r]].row = r;
+    }, 1024);
+    if (cells != pressure_cells) {
+        Profiler::Scope _(profiler, "pressure_setup");
+        const int num_chunks = std::max(1, std::min(num_threads, n / 1024));
+        std::vector<SparseMatrixBuilder> builders(num_chunks, SparseMatrixBuilder(n, n));
+        std::vector<char> chunk_dirichlet(num_chunks, 0);
+        parallel_for(0, num_chunks, num_threads, [&](int chunk) {
+            for (int r = (int)((int64)n * chunk / num_chunks); r < (int)((int64)n * (chunk + 1) / num_chunks); r++) {
+                int diagonal = 0, neighbours = 0;
+                for (int d = 0; d < 3; d++) {
+                    for (int sign = -1; sign <= 1; sign += 2) {
+                        const Vector3i neighbour = cells[r] + sign * face_directions[d];
+                        if (!is_cell(neighbour)) {
+                            // Open boundaries are at zero pressure, closed ones are walls
+                            diagonal += open_boundary;
+                            continue;
+                        }
+                        const int row = grid->get(neighbour.x, neighbour.y, neighbour.z).row;
+                        if (row != -1) {
+                            builders[chunk].insert(r, row, -1.0f);
+                            neighbours++;
+                        }
+                        diagonal++;
+                    }
+                }
+                builders[chunk].insert(r, r, (real)diagonal);
+                chunk_dirichlet[chunk] |= diagonal > neighbours;
+            }
+        }, 1);
+        for (int chunk = 1; chunk < num_chunks; chunk++) {
+            builders[0].append(builders[chunk]);
+        }
+        pressure_matrix = builders[0].build(false, num_threads);
+        pressure_null_space = std::find(chunk_dirichlet.begin(), chunk_dirichlet.end(), 1) == chunk_dirichlet.end();
+        if (n > 0) {
+            pressure_amg.setup(pressure_matrix, num_threads);
+        }
+        pressure_cells = cells;
+    }
+    // PCG for L p = div, from the pressure of the last step if warm_start
+    std::vector<real> x(n), r(n), p(n), z(n), q(n);
+    parallel_for(0, n, num_threads, [&](int row) {
+        const Vector3i &c = cells[row];
+        const SmokeNode &node = (*grid)[c];
+        real divergence = 0;
+        for (int d = 0; d < 3; d++) {
+            divergence += (*grid)[c + face_directions[d]].*face_velocities[d] - node.*face_velocities[d];
+        }
+        r[row] = divergence;
+        x[row] = warm_start ? node.pressure : 0.0f;
+    }, 1024);
+    auto dot = [&](const std::vector<real> &a, const std::vector<real> &b) {
+        return parallel_reduce(0, n, num_threads, 0.0, [&](int i) { return (double)a[i] * b[i]; },
+                               [](double s, double t) { return s + t; }, true);
+    };
+    auto max_abs = [&](const std::vector<real> &a) {
+        return parallel_reduce(0, n, num_threads, 0.0, [&](int i) { return (double)std::abs(a[i]); },
+                               [](double s, double t) { return std::max(s, t); });
+    };
+    auto remove_mean = [&](std::vector<real> &a) {
+        if (pressure_null_space && n > 0) {
+            const real mean = (real)(parallel_reduce(0, n, num_threads, 0.0, [&](int i) { return (double)a[i]; },
+                                                     [](double s, double t) { return s + t; }, true) / n);
+            parallel_for(0, n, num_threads, [&](int i) { a[i] -= mean; }, 4096);
+        }
+    };
+    auto precondition = [&]() {
+        std::fill(z.begin(), z.end(), 0.0f);
+        if (n > 0) {
+            Profiler::Scope _(profiler, "pressure_amg");
+            pressure_amg.run(r.data(), z.data());
+        }
+    };
+    pressure_matrix.multiply(x.data(), q.data(), num_threads);
+    parallel_for(0, n, num_threads, [&](int i) { r[i] -= q[i]; }, 4096);
+    remove_mean(r);
+    double nu = max_abs(r);
+    statistics.residual_history.push_back(nu);
+    if (nu >= pressure_tolerance) {
+        precondition();
+        p = z;
+        double rho_old = dot(z, r);
+        for (int count = 0; count <= maximum_pressure_iterations; count++) {
+            pressure_matrix.multiply(p.data(), q.data(), num_threads);
+            const real alpha = (real)(rho_old / std::max(1e-20, dot(p, q)));
+            parallel_for(0, n, num_threads, [&](int i) {
+                x[i] += alpha * p[i];
+                r[i] -= alpha * q[i];
+            }, 4096);
+            remove_mean(r);
+            nu = max_abs(r);
+            statistics.residual_history.push_back(nu);
+            statistics.iterations++;
+            if (nu < pressure_tolerance || count == maximum_pressure_iterations) {
+                break;
+            }
+            precondition();
+            const double rho_new = dot(z, r);
+            const real beta = (real)(rho_new / rho_old);
+            rho_old = rho_new;
+            parallel_for(0, n, num_threads, [&](int i) { p[i] = z[i] + beta * p[i]; }, 4096);
+        }
+    }
+    statistics.converged = nu < pressure_tolerance;
+    parallel_for(0, n, num_threads, [&](int row) {
+        (*grid)[cells[row]].pressure = x[row];
+    }, 1024);
+    // Every face by the pressures of its two cells, those not solved for being at zero; pressures of air
+    // at rest are cleared first
+    for_each_node(*grid, [&](const Index3D &, SmokeNode &node) {
+        if (node.row == -1) {
+            node.pressure = 0;
+        }
+    });
+    auto is_wall = [&](const Vector3i &c) {
+        return !open_boundary && !is_cell(c);
+    };
+    for_each_node(*grid, [&](const Index3D &ind, SmokeNode &node) {
+        const Vector3i c(ind.i, ind.j, ind.k);
+        for (int d = 0; d < 3; d++) {
+            const Vector3i lower = c - face_directions[d];
+            real delta = 0;
+            if (is_cell(c) && !is_wall(lower)) {
+                delta += node.pressure;
+            }
+            if (is_cell(lower) && !is_wall(c)) {
+                delta -= grid->get(lower.x, lower.y, lower.z).pressure;
+            }
+            node.*face_velocities[d] += delta;
+        }
+    });
+    statistics.solve_time = Time::get_time() - solve_start_time;
+    solver_statistics.push_back(statistics);
+}
+
+void Smoke3D::sparse_advect(real delta_t) {
+    const Vector3 cell_offset(0.5f);
+    const Vector3 face_offsets[3]{Vector3(0.0f, 0.5f, 0.5f), Vector3(0.5f, 0.0f, 0.5f), Vector3(0.5f, 0.5f, 0.0f)};
+    const SparseGrid &source = *grid;
+    for_each_node(*next_grid, [&](const Index3D &ind, SmokeNode &node) {
+        const Vector3i c(ind.i, ind.j, ind.k);
+        const Vector3 pos(real(ind.i), real(ind.j), real(ind.k));
+        node = source[c];
+        if (c.x < res.x && c.y < res.y && c.z < res.z) {
+            const Vector3 cell = pos + cell_offset;
+            const Vector3 old_position = cell - delta_t * sample_sparse_velocity(source, cell);
+            node.rho = sample(source, &SmokeNode::rho, cell_offset, res, old_position);
+            node.t = sample(source, &SmokeNode::t, cell_offset, res, old_position);
+        } else {
+            node.rho = node.t = 0;
+        }
+        for (int d = 0; d < 3; d++) {
+            const Vector3i size = res + face_directions[d];
+            bool inside = true;
+            for (int a = 0; a < 3; a++) {
+                inside = inside && c[a] < size[a];
+            }
+            if (!inside) {
+                node.*face_velocities[d] = 0;
+                continue;
+            }
+            const Vector3 face = pos + face_offsets[d];
+            const Vector3 old_position = face - delta_t * sample_sparse_velocity(source, face);
+            node.*face_velocities[d] = sample(source, face_velocities[d], face_offsets[d], size, old_position);
+        }
+    });
+    std::swap(grid, next_grid);
+}
+
+void Smoke3D::sparse_substep(real delta_t) {
+    {
+        Profiler::Scope _(profiler, "sparse_blocks");
+        if (source_blocks_dirty) {
+            find_source_blocks();
+        }
+        update_active_blocks(delta_t);
+    }
+    const uint64 num_nodes = (uint64)grid->get_num_allocated_blocks() * SparseGrid::block_volume;
+    {
+        Profiler::Scope _(profiler, "seeding");
+        sparse_seed(delta_t);
+    }
+    {
+        Profiler::Scope _(profiler, "forces", num_nodes * sizeof(SmokeNode) * 2);
+        const real t_decay = std::exp(-delta_t * temperature_decay);
+        for_each_node(*grid, [&](const Index3D &ind, SmokeNode &node) {
+            if (ind.i < res.x && ind.j < res.y && ind.k < res.z) {
+                node.v += (-smoke_alpha * node.rho + smoke_beta * node.t) * delta_t;
+                node.t *= t_decay;
+            }
+        });
+    }
+    if (vorticity_confinement > 0) {
+        Profiler::Scope _(profiler, "vorticity_confinement", num_nodes * sizeof(SmokeNode) * 2);
+        confine_vorticity(delta_t);
+    }
+    sparse_apply_boundary_condition();
+    {
+        Profiler::Scope _(profiler, "pressure_solve", num_nodes * sizeof(SmokeNode) * 4);
+        sparse_project();
+    }
+    sparse_apply_boundary_condition();
+    {
+        Profiler::Scope _(profiler, "advection", num_nodes * sizeof(SmokeNode) * 3 +
+                                                 trackers.size() * 2 * sizeof(Tracker3D));
+        move_trackers(delta_t);
+        remove_outside_trackers();
+        sparse_advect(delta_t);
+    }
+    sparse_apply_boundary_condition();
+    if (upres > 1) {
+        Profiler::Scope _(profiler, "upres", (uint64)fine_rho->get_num_allocated_blocks() * FineGrid::block_volume *
+                                             sizeof(real) * 3);
+        upres_step(delta_t);
+    }
+    current_t += delta_t;
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,248 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include "fluid_3d.h"
+#include <taichi/io/volume_exporter.h>
+#include <taichi/math/perlin_noise.h>
+#include <taichi/system/memory.h>
+#include <taichi/system/threading.h>
+#include <algorithm>
+#include <cmath>
+
+TC_NAMESPACE_BEGIN
+
+// Smoke3D with upres, after Kim et al. 2008, "Wavelet Turbulence for Fluid Simulation", with curl noise of
+// Perlin noise in place of wavelet noise. The fine density (cell (i, j, k) at (i + 0.5, j + 0.5, k + 0.5) fine
+// cells) is advected semi-Lagrangian through the coarse velocity plus the curl of a noise potential, whose
+// octaves have amplitudes of a Kolmogorov spectrum, all scaled by the local coarse speed (the square root of
+// twice the kinetic energy). The noise coordinates are not advected; the pattern moves at upres_noise_speed.
+
+// The root mean square length of the curl of the noise potential, per unit of noise coordinates, which the
+// octaves are normalized by, and the bound they are clamped to after that (rarely reached)
+static const real upres_curl_rms = 1.73f;
+static const real upres_curl_bound = 2.5f;
+
+static real get_octave_amplitude(int octave) {
+    return std::pow(2.0f, -5.0f / 6.0f * octave);
+}
+
+void Smoke3D::get_fine_velocities(const Vector3i &block, Vector3 *velocities) const {
+    const int n = smoke3d_block_size, m = n + 1;
+    const Vector3i begin = block * n;
+    // The potential at the corners of the block's cells, lanes of PerlinNoise at a time
+    const int num_corners = m * m * m;
+    const int lanes = PerlinNoise::num_lanes;
+    std::vector<real> potential(3 * num_corners);
+    static const Vector3 component_offsets[3]{Vector3(0.0f), Vector3(31.416f, 17.32f, 5.77f),
+                                              Vector3(-11.18f, 27.18f, -41.42f)};
+    std::vector<Vector3> turbulence(n * n * n, Vector3(0.0f));
+    for (int octave = 0; octave < upres_octaves; octave++) {
+        const real frequency = upres_frequency * (1 << octave);
+        // Noise coordinates per fine cell
+        const real scale = frequency / upres;
+        const Vector3 drift(current_t * upres_noise_speed * frequency);
+        for (int first = 0; first < num_corners; first += lanes) {
+            for (int c = 0; c < 3; c++) {
+                Vector3N<PerlinNoise::num_lanes> q;
+                for (int l = 0; l < lanes; l++) {
+                    const int corner = std::min(first + l, num_corners - 1);
+                    const Vector3 node = Vector3(begin + Vector3i(corner / (m * m), corner / m % m, corner % m));
+                    q.set(l, node * scale + drift + component_offsets[c]);
+                }
+                const VectorN<PerlinNoise::num_lanes> values = PerlinNoise::noise(q);
+                for (int l = 0; l < lanes && first + l < num_corners; l++) {
+                    potential[c * num_corners + first + l] = values.d[l];
+                }
+            }
+        }
+        const real amplitude = get_octave_amplitude(octave);
+        // Derivatives over a cell are differences of the sums of the potential over its faces, in noise
+        // coordinates
+        const real derivative_scale = 0.25f / (scale * upres_curl_rms);
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < n; j++) {
+                for (int k = 0; k < n; k++) {
+                    const int base = (i * m + j) * m + k;
+                    // Per component, the derivatives along x, y and z
+                    Vector3 derivatives[3];
+                    for (int c = 0; c < 3; c++) {
+                        const real *p = &potential[c * num_corners + base];
+                        const real v000 = p[0], v001 = p[1], v010 = p[m], v011 = p[m + 1];
+                        const real v100 = p[m * m], v101 = p[m * m + 1], v110 = p[m * m + m], v111 = p[m * m + m + 1];
+                        derivatives[c] = derivative_scale *
+                                         Vector3((v100 + v101 + v110 + v111) - (v000 + v001 + v010 + v011),
+                                                 (v010 + v011 + v110 + v111) - (v000 + v001 + v100 + v101),
+                                                 (v001 + v011 + v101 + v111) - (v000 + v010 + v100 + v110));
+                    }
+                    Vector3 curl(derivatives[2].y - derivatives[1].z, derivatives[0].z - derivatives[2].x,
+                                 derivatives[1].x - derivatives[0].y);
+                    const real curl_length = length(curl);
+                    if (curl_length > upres_curl_bound) {
+                        curl *= upres_curl_bound / curl_length;
+                    }
+                    turbulence[(i * n + j) * n + k] += amplitude * curl;
+                }
+            }
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            for (int k = 0; k < n; k++) {
+                const int index = (i * n + j) * n + k;
+                const Vector3 coarse_velocity = sample_velocity((Vector3(begin + Vector3i(i, j, k)) + Vector3(0.5f)) /
+                                                                real(upres));
+                velocities[index] = real(upres) * (coarse_velocity + upres_strength * length(coarse_velocity) *
+                                                                     turbulence[index]);
+            }
+        }
+    }
+}
+
+void Smoke3D::update_fine_blocks(real delta_t) {
+    TC_MEMORY_TAG("smoke3d.upres");
+    const Vector3i block_res = fine_rho->get_block_res();
+    std::vector<char> marked(block_res.x * block_res.y * block_res.z, 0);
+    const std::vector<Vector3i> &blocks = fine_rho->get_allocated_blocks();
+    parallel_for(0, (int)blocks.size(), num_threads, [&](int b) {
+        const real *page = fine_rho->get_page(blocks[b]);
+        marked[fine_rho->get_block_id(blocks[b])] =
+                std::any_of(page, page + FineGrid::block_volume, [&](real v) { return v > upres_threshold; });
+    }, 16);
+    // The fine blocks of the sources
+    for (auto &source : source_blocks) {
+        for (int i = 0; i < upres; i++) {
+            for (int j = 0; j < upres; j++) {
+                for (int k = 0; k < upres; k++) {
+                    const Vector3i block = source * upres + Vector3i(i, j, k);
+                    if (fine_rho->inside_blocks(block)) {
+                        marked[fine_rho->get_block_id(block)] = 1;
+                    }
+                }
+            }
+        }
+    }
+    // Dilated by the blocks the fine velocity, turbulence included, can reach
+    real turbulence_bound = 0;
+    for (int octave = 0; octave < upres_octaves; octave++) {
+        turbulence_bound += get_octave_amplitude(octave) * upres_curl_bound;
+    }
+    const real max_speed = get_max_speed() * upres * (1 + upres_strength * turbulence_bound);
+    const int dilation = (int)std::ceil(max_speed * delta_t / smoke3d_block_size);
+    const std::vector<Vector3i> active_blocks =
+            get_marked_blocks(dilate_blocks(marked, block_res, dilation, num_threads), block_res);
+    fine_rho->set_allocated_blocks(active_blocks);
+    next_fine_rho->set_allocated_blocks(active_blocks);
+}
+
+void Smoke3D::upres_step(real delta_t) {
+    if (source_blocks_dirty) {
+        find_source_blocks();
+    }
+    update_fine_blocks(delta_t);
+    const Vector3i fine_res = fine_rho->get_res();
+    const int n = smoke3d_block_size;
+    // Sources are sampled once per fine cell, at its center, as they add to the coarse density once per
+    // coarse cell
+    const Vector3i coarse_block_res = (res + Vector3i(n)) / n;
+    std::vector<char> is_source(coarse_block_res.x * coarse_block_res.y * coarse_block_res.z, 0);
+    for (auto &block : source_blocks) {
+        is_source[(block.x * coarse_block_res.y + block.y) * coarse_block_res.z + block.z] = 1;
+    }
+    std::vector<Vector3i> fine_sources;
+    for (auto &block : fine_rho->get_allocated_blocks()) {
+        const Vector3i coarse_block = block / upres;
+        if (is_source[(coarse_block.x * coarse_block_res.y + coarse_block.y) * coarse_block_res.z +
+                      coarse_block.z]) {
+            fine_sources.push_back(block);
+        }
+    }
+    parallel_for(0, (int)fine_sources.size(), num_threads, [&](int b) {
+        fine_rho->for_each_node(fine_sources[b], [&](const Index3D &ind, real &density) {
+            density += generation_tex->sample((ind.get_pos() + Vector3(0.5f)) / Vector3(fine_res)).x;
+        });
+    }, 1);
+    const FineGrid &source = *fine_rho;
+    auto sample = [&](const Vector3 &pos) {
+        const real x = clamp(pos.x - 0.5f, 0.f, fine_res.x - 1.f - eps);
+        const real y = clamp(pos.y - 0.5f, 0.f, fine_res.y - 1.f - eps);
+        const real z = clamp(pos.z - 0.5f, 0.f, fine_res.z - 1.f - eps);
+        const int x_i = clamp(int(x), 0, fine_res.x - 2);
+        const int y_i = clamp(int(y), 0, fine_res.y - 2);
+        const int z_i = clamp(int(z), 0, fine_res.z - 2);
+        const real x_r = x - x_i, y_r = y - y_i, z_r = z - z_i;
+        return lerp(z_r,
+                    lerp(x_r, lerp(y_r, source.get(x_i, y_i, z_i), source.get(x_i, y_i + 1, z_i)),
+                         lerp(y_r, source.get(x_i + 1, y_i, z_i), source.get(x_i + 1, y_i + 1, z_i))),
+                    lerp(x_r, lerp(y_r, source.get(x_i, y_i, z_i + 1), source.get(x_i, y_i + 1, z_i + 1)),
+                         lerp(y_r, source.get(x_i + 1, y_i, z_i + 1), source.get(x_i + 1, y_i + 1, z_i + 1))));
+    };
+    const std::vector<Vector3i> &blocks = next_fine_rho->get_allocated_blocks();
+    parallel_for(0, (int)blocks.size(), num_threads, [&](int b) {
+        Vector3 velocities[smoke3d_block_size * smoke3d_block_size * smoke3d_block_size];
+        get_fine_velocities(blocks[b], velocities);
+        const Vector3i begin = blocks[b] * n;
+        next_fine_rho->for_each_node(blocks[b], [&](const Index3D &ind, real &density) {
+            const Vector3i local = Vector3i(ind.i, ind.j, ind.k) - begin;
+            const Vector3 pos = ind.get_pos() + Vector3(0.5f);
+            density = sample(pos - delta_t * velocities[(local.x * n + local.y) * n + local.z]);
+        });
+    }, 1);
+    std::swap(fine_rho, next_fine_rho);
+}
+
+void Smoke3D::get_upres_volume(SparseVolume &volume, real threshold) const {
+    // Tiles are the fine blocks, in the same layout
+    static_assert(SparseVolume::tile_size == smoke3d_block_size, "Volume tiles must be smoke grid blocks");
+    const Vector3i fine_res = fine_rho->get_res();
+    volume.res = fine_res;
+    volume.storage_offset = Vector3(0.5f);
+    volume.channels = {"density", "temperature"};
+    volume.backgrounds = {0.0f, initial_temperature};
+    const Vector3i tile_res = volume.get_tile_res();
+    std::vector<std::pair<int, Vector3i>> tiles;
+    for (auto &block : fine_rho->get_allocated_blocks()) {
+        tiles.push_back(std::make_pair((block.x * tile_res.y + block.y) * tile_res.z + block.z, block));
+    }
+    std::sort(tiles.begin(), tiles.end(), [](const std::pair<int, Vector3i> &a, const std::pair<int, Vector3i> &b) {
+        return a.first < b.first;
+    });
+    const int n = smoke3d_block_size;
+    // Both channels of every tile, temperatures interpolated from the coarse grid
+    std::vector<std::vector<real>> values(tiles.size());
+    std::vector<char> occupied(tiles.size(), 0);
+    parallel_for(0, (int)tiles.size(), num_threads, [&](int i) {
+        const real *page = fine_rho->get_page(tiles[i].second);
+        const Vector3i begin = tiles[i].second * n;
+        values[i].resize(2 * SparseVolume::tile_volume);
+        for (int c = 0; c < SparseVolume::tile_volume; c++) {
+            const Vector3i cell = begin + Vector3i(c / (n * n), c / n % n, c % n);
+            const bool inside = cell.x < fine_res.x && cell.y < fine_res.y && cell.z < fine_res.z;
+            const real density = inside ? page[c] : 0.0f;
+            const real temperature = inside ? sample_temperature((Vector3(cell) + Vector3(0.5f)) / real(upres))
+                                            : initial_temperature;
+            values[i][c] = density;
+            values[i][SparseVolume::tile_volume + c] = temperature;
+            occupied[i] |= density > threshold || std::abs(temperature - initial_temperature) > threshold;
+        }
+    }, 1);
+    volume.tiles.clear();
+    volume.values.assign(2, std::vector<real>());
+    for (int i = 0; i < (int)tiles.size(); i++) {
+        if (!occupied[i]) {
+            continue;
+        }
+        volume.tiles.push_back(tiles[i].first);
+        for (int c = 0; c < 2; c++) {
+            volume.values[c].insert(volume.values[c].end(), values[i].begin() + c * SparseVolume::tile_volume,
+                                    values[i].begin() + (c + 1) * SparseVolume::tile_volume);
+        }
+    }
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,374 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include "fmm.h"
+#include <cmath>
+
+TC_NAMESPACE_BEGIN
+
+void FastMultipoleSummation::initialize(int order, real opening_angle, int leaf_size, real softening) {
+    assert_info(1 <= order && order <= max_order, "FMM order must be between 1 and 8");
+    assert_info(opening_angle > 0 && opening_angle < 1, "The opening angle must be in (0, 1)");
+    assert_info(leaf_size > 0, "leaf_size must be positive");
+    this->order = order;
+    this->opening_angle = opening_angle;
+    this->leaf_size = leaf_size;
+    this->softening2 = softening * softening;
+    multi_indices.clear();
+    for (int o = 0; o <= order; o++) {
+        for (int x = o; x >= 0; x--) {
+            for (int y = o - x; y >= 0; y--) {
+                multi_indices.push_back(Vector3i(x, y, o - x - y));
+            }
+        }
+    }
+    num_coefficients = (int)multi_indices.size();
+    auto get_index = [&](const Vector3i &n) {
+        for (int i = 0; i < num_coefficients; i++) {
+            if (multi_indices[i] == n) {
+                return i;
+            }
+        }
+        return -1;
+    };
+    for (int a = 0; a < 3; a++) {
+        minus[a].resize(num_coefficients);
+        plus[a].resize(num_coefficients);
+        Vector3i e(0);
+        e[a] = 1;
+        for (int i = 0; i < num_coefficients; i++) {
+            minus[a][i] = multi_indices[i][a] > 0 ? get_index(multi_indices[i] - e) : -1;
+            plus[a][i] = get_index(multi_indices[i] + e);
+        }
+    }
+    terms.clear();
+    for (int a = 0; a < num_coefficients; a++) {
+        for (int b = 0; b < num_coefficients; b++) {
+            int sum = get_index(multi_indices[a] + multi_indices[b]);
+            if (sum != -1) {
+                const Vector3i &n = multi_indices[a];
+                terms.push_back(Term{a, b, sum, (n.x + n.y + n.z) % 2 ? -1.0 : 1.0});
+            }
+        }
+    }
+}
+
+void FastMultipoleSummation::get_powers(const Vector3d &v, double *powers) const {
+    powers[0] = 1;
+    for (int i = 1; i < num_coefficients; i++) {
+        const Vector3i &n = multi_indices[i];
+        const int a = n.x > 0 ? 0 : (n.y > 0 ? 1 : 2);
+        powers[i] = powers[minus[a][i]] * v[a] / n[a];
+    }
+}
+
+// With h_j(s) = 2^j G^(j)(s) as a function of s = |r|^2, d/dx h_j = x h_(j+1), so by Leibniz's rule
+// T_j(n + e_x) = x T_j+1(n) + n_x T_j+1(n - e_x) for T_j(n) = D^n h_j, and D^n G = T_0(n)
+void FastMultipoleSummation::get_derivatives(const Vector3d &r, double *derivatives) const {
+    const int stride = max_order + 1;
+    double t[(max_order + 1) * (max_order + 1) * (max_order + 2) * (max_order + 3) / 6];
+    const double inv = 1.0 / (dot(r, r) + softening2);
+    t[0] = std::sqrt(inv);
+    for (int j = 0; j < order; j++) {
+        t[j + 1] = -(2 * j + 1) * inv * t[j];
+    }
+    for (int i = 1; i < num_coefficients; i++) {
+        const Vector3i &n = multi_indices[i];
+        const int a = n.x > 0 ? 0 : (n.y > 0 ? 1 : 2);
+        const int m = minus[a][i], mm = n[a] >= 2 ? minus[a][m] : -1;
+        const int o = n.x + n.y + n.z;
+        for (int j = 0; j <= order - o; j++) {
+            double value = r[a] * t[m * stride + j + 1];
+            if (mm != -1) {
+                value += (n[a] - 1) * t[mm * stride + j + 1];
+            }
+            t[i * stride + j] = value;
+        }
+    }
+    for (int i = 0; i < num_coefficients; i++) {
+        derivatives[i] = t[i * stride];
+    }
+}
+
+void FastMultipoleSummation::count(int node, int depth, std::vector<int> &num_bodies,
+                                   std::vector<int> &num_cells) const {
+    const BarnesHutSummation::Node &n = tree->get_node(node);
+    if (n.is_leaf()) {
+        num_bodies[node] = 1;
+        num_cells[node] = 1;
+        return;
+    }
+    auto count_child = [&](int i) {
+        count(n.first_child + i, depth + 1, num_bodies, num_cells);
+    };
+    if (depth < parallel_depth) {
+        parallel_for(0, n.num_children, num_threads, count_child, 1);
+    } else {
+        for (int i = 0; i < n.num_children; i++) {
+            count_child(i);
+        }
+    }
+    int bodies = 0, child_cells = 0;
+    for (int i = 0; i < n.num_children; i++) {
+        bodies += num_bodies[n.first_child + i];
+        child_cells += num_cells[n.first_child + i];
+    }
+    num_bodies[node] = bodies;
+    num_cells[node] = bodies <= leaf_size ? 1 : 1 + child_cells;
+}
+
+void FastMultipoleSummation::gather_bodies(int node, int &body) {
+    const BarnesHutSummation::Node &n = tree->get_node(node);
+    if (n.is_leaf()) {
+        bodies[body] = n.p;
+        body_of_node[node] = body++;
+        return;
+    }
+    for (int i = 0; i < n.num_children; i++) {
+        gather_bodies(n.first_child + i, body);
+    }
+}
+
+void FastMultipoleSummation::place(int node, int cell, int body_begin, int depth, const std::vector<int> &num_bodies,
+                                   const std::vector<int> &num_cells) {
+    const BarnesHutSummation::Node &n = tree->get_node(node);
+    Cell &c = cells[cell];
+    c.node = node;
+    c.body_begin = body_begin;
+    c.body_end = body_begin + num_bodies[node];
+    c.num_children = 0;
+    c.center = Vector3d(n.p.position);
+    c.radius = 0;
+    if (n.is_leaf() || num_bodies[node] <= leaf_size) {
+        int body = body_begin;
+        gather_bodies(node, body);
+        return;
+    }
+    int child_cells[8], child_bodies[8];
+    int next_cell = cell + 1, next_body = body_begin;
+    for (int i = 0; i < n.num_children; i++) {
+        const int child = n.first_child + i;
+        child_cells[i] = next_cell;
+        child_bodies[i] = next_body;
+        c.children[c.num_children++] = next_cell;
+        next_cell += num_cells[child];
+        next_body += num_bodies[child];
+    }
+    auto place_child = [&](int i) {
+        place(n.first_child + i, child_cells[i], child_bodies[i], depth + 1, num_bodies, num_cells);
+    };
+    if (depth < parallel_depth) {
+        parallel_for(0, n.num_children, num_threads, place_child, 1);
+    } else {
+        for (int i = 0; i < n.num_children; i++) {
+            place_child(i);
+        }
+    }
+}
+
+void FastMultipoleSummation::upward(int cell, int depth) {
+    Cell &c = cells[cell];
+    double *m = &multipoles[(size_t)cell * num_coefficients];
+    std::fill(m, m + num_coefficients, 0.0);
+    double powers[(max_order + 1) * (max_order + 2) * (max_order + 3) / 6];
+    if (is_leaf(cell)) {
+        for (int b = c.body_begin; b < c.body_end; b++) {
+            const Vector3d s = Vector3d(bodies[b].position) - c.center;
+            c.radius = std::max(c.radius, (double)length(s));
+            get_powers(s, powers);
+            for (int i = 0; i < num_coefficients; i++) {
+                m[i] += bodies[b].mass * powers[i];
+            }
+        }
+        return;
+    }
+    auto upward_child = [&](int i) {
+        upward(c.children[i], depth + 1);
+    };
+    if (depth < parallel_depth) {
+        parallel_for(0, c.num_children, num_threads, upward_child, 1);
+    } else {
+        for (int i = 0; i < c.num_children; i++) {
+            upward_child(i);
+        }
+    }
+    for (int i = 0; i < c.num_children; i++) {
+        const Cell &child = cells[c.children[i]];
+        const Vector3d e = child.center - c.center;
+        c.radius = std::max(c.radius, length(e) + child.radius);
+        get_powers(e, powers);
+        const double *child_m = &multipoles[(size_t)c.children[i] * num_coefficients];
+        for (auto &term : terms) {
+            m[term.sum] += child_m[term.a] * powers[term.b];
+        }
+    }
+}
+
+void FastMultipoleSummation::interact(int source, int target, int depth) {
+    const Cell &a = cells[source], &b = cells[target];
+    const double distance = length(a.center - b.center);
+    if (a.radius + b.radius < opening_angle * distance) {
+        m2l_lists[target].push_back(source);
+        return;
+    }
+    if (is_leaf(source) && is_leaf(target)) {
+        p2p_lists[target].push_back(source);
+        return;
+    }
+    if (!is_leaf(target) && (is_leaf(source) || b.radius >= a.radius)) {
+        // Different targets are filled by different threads
+        auto split = [&](int i) {
+            interact(source, b.children[i], depth + 1);
+        };
+        if (depth < parallel_depth) {
+            parallel_for(0, b.num_children, num_threads, split, 1);
+        } else {
+            for (int i = 0; i < b.num_children; i++) {
+                split(i);
+            }
+        }
+    } else {
+        for (int i = 0; i < a.num_children; i++) {
+            interact(a.children[i], target, depth);
+        }
+    }
+}
+
+void FastMultipoleSummation::interact_self(int cell, int depth) {
+    const Cell &c = cells[cell];
+    if (is_leaf(cell)) {
+        p2p_lists[cell].push_back(cell);
+        return;
+    }
+    auto targets = [&](int j) {
+        for (int i = 0; i < c.num_children; i++) {
+            if (i == j) {
+                interact_self(c.children[j], depth + 1);
+            } else {
+                interact(c.children[i], c.children[j], depth + 1);
+            }
+        }
+    };
+    if (depth < parallel_depth) {
+        parallel_for(0, c.num_children, num_threads, targets, 1);
+    } else {
+        for (int j = 0; j < c.num_children; j++) {
+            targets(j);
+        }
+    }
+}
+
+void FastMultipoleSummation::downward(int cell, int depth) {
+    const Cell &c = cells[cell];
+    const double *l = &locals[(size_t)cell * num_coefficients];
+    auto downward_child = [&](int i) {
+        const int child = c.children[i];
+        double powers[(max_order + 1) * (max_order + 2) * (max_order + 3) / 6];
+        get_powers(cells[child].center - c.center, powers);
+        double *child_l = &locals[(size_t)child * num_coefficients];
+        for (auto &term : terms) {
+            child_l[term.a] += l[term.sum] * powers[term.b];
+        }
+        downward(child, depth + 1);
+    };
+    if (depth < parallel_depth) {
+        parallel_for(0, c.num_children, num_threads, downward_child, 1);
+    } else {
+        for (int i = 0; i < c.num_children; i++) {
+            downward_child(i);
+        }
+    }
+}
+
+void FastMultipoleSummation::evaluate(const BarnesHutSummation &tree, int num_threads) {
+    this->tree = &tree;
+    this->num_threads = num_threads;
+    const int root = tree.get_root();
+    std::vector<int> num_bodies(tree.get_num_nodes(), 0), num_cells(tree.get_num_nodes(), 0);
+    count(root, 0, num_bodies, num_cells);
+    cells.resize(num_cells[root]);
+    bodies.resize(num_bodies[root]);
+    body_of_node.assign(tree.get_num_nodes(), -1);
+    place(root, 0, 0, 0, num_bodies, num_cells);
+    leaf_cells.clear();
+    for (int c = 0; c < (int)cells.size(); c++) {
+        if (is_leaf(c)) {
+            leaf_cells.push_back(c);
+        }
+    }
+
+    multipoles.resize(cells.size() * num_coefficients);
+    upward(0, 0);
+
+    m2l_lists.assign(cells.size(), std::vector<int>());
+    p2p_lists.assign(cells.size(), std::vector<int>());
+    interact_self(0, 0);
+    num_m2l = num_p2p = 0;
+    for (int c = 0; c < (int)cells.size(); c++) {
+        num_m2l += (int)m2l_lists[c].size();
+        num_p2p += (int)p2p_lists[c].size();
+    }
+
+    // M2L, in parallel over targets
+    locals.assign(cells.size() * num_coefficients, 0.0);
+    parallel_for(0, (int)cells.size(), num_threads, [&](int target) {
+        double derivatives[(max_order + 1) * (max_order + 2) * (max_order + 3) / 6];
+        double *l = &locals[(size_t)target * num_coefficients];
+        for (int source : m2l_lists[target]) {
+            get_derivatives(cells[target].center - cells[source].center, derivatives);
+            const double *m = &multipoles[(size_t)source * num_coefficients];
+            for (auto &term : terms) {
+                // (-1)^|n| M_n D^(n + k) G for the term n = a, k = b
+                l[term.b] += term.sign_a * m[term.a] * derivatives[term.sum];
+            }
+        }
+    }, 16);
+    downward(0, 0);
+
+    // L2P and P2P, in parallel over leaf cells
+    forces.resize(bodies.size());
+    parallel_for(0, (int)leaf_cells.size(), num_threads, [&](int k) {
+        const Cell &c = cells[leaf_cells[k]];
+        const double *l = &locals[(size_t)leaf_cells[k] * num_coefficients];
+        double powers[(max_order + 1) * (max_order + 2) * (max_order + 3) / 6];
+        for (int b = c.body_begin; b < c.body_end; b++) {
+            const Vector3 x = bodies[b].position;
+            get_powers(Vector3d(x) - c.center, powers);
+            // -grad of sum_n L_n y^n / n!
+            Vector3d force(0.0);
+            for (int i = 0; i < num_coefficients; i++) {
+                for (int a = 0; a < 3; a++) {
+                    if (plus[a][i] != -1) {
+                        force[a] -= l[plus[a][i]] * powers[i];
+                    }
+                }
+            }
+            for (int source : p2p_lists[leaf_cells[k]]) {
+                const Cell &s = cells[source];
+                for (int q = s.body_begin; q < s.body_end; q++) {
+                    const Vector3 d = x - bodies[q].position;
+                    const real dist2 = dot(d, d) + softening2;
+                    force += Vector3d(d * (bodies[q].mass / (dist2 * std::sqrt(dist2))));
+                }
+            }
+            forces[b] = Vector3(force);
+        }
+    }, 4);
+}
+
+Vector3 FastMultipoleSummation::get_force(const Vector3 &position) const {
+    return get_leaf_force(tree->get_leaf(position));
+}
+
+Vector3 FastMultipoleSummation::get_leaf_force(int leaf) const {
+    assert_info(leaf != 0 && body_of_node[leaf] != -1, "FMM forces are only known at the bodies of the tree");
+    return forces[body_of_node[leaf]];
+}
+
+TC_NAMESPACE_END
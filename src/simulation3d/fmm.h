@@ -0,0 +1,130 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <vector>
+#include "barnes_hut.h"
+
+TC_NAMESPACE_BEGIN
+
+// Fast multipole method for the softened gravity of NBody, f(p, q) = m_p m_q (p - q) / (|p - q|^2 + softening^2)^1.5,
+// on the tree of a BarnesHutSummation, whose leaves are the bodies.
+// Potentials are Cartesian Taylor expansions of configurable order about the centers of mass. The interaction
+// lists come from a dual tree traversal (Dehnen, "A fast multipole method for stellar dynamics", 2014) that
+// accepts cells A, B once r_A + r_B < opening_angle |z_A - z_B|. Subtrees with at most leaf_size bodies are
+// leaf cells, whose bodies interact directly. Every pass runs in parallel, with results independent of the
+// thread count.
+class FastMultipoleSummation {
+public:
+    using Particle = BarnesHutSummation::Particle;
+
+    static const int max_order = 8;
+
+    FastMultipoleSummation() {}
+
+    // order is that of the potential's expansion: forces are accurate to order - 1
+    void initialize(int order, real opening_angle, int leaf_size, real softening);
+
+    // Forces on unit masses at every body of the tree, from all bodies
+    void evaluate(const BarnesHutSummation &tree, int num_threads = 1);
+
+    // After evaluate(), the force on a unit mass at the body holding position, which must be one of the tree's
+    Vector3 get_force(const Vector3 &position) const;
+
+    // After evaluate(), the force on a unit mass at a leaf of the tree
+    Vector3 get_leaf_force(int leaf) const;
+
+    int get_num_m2l() const {
+        return num_m2l;
+    }
+
+    int get_num_p2p() const {
+        return num_p2p;
+    }
+
+protected:
+    struct Cell {
+        // The tree node whose subtree this is
+        int node;
+        int body_begin, body_end;
+        // None for leaf cells
+        int num_children;
+        int children[8];
+        Vector3d center;
+        // Of the sphere about center holding every body
+        double radius;
+    };
+
+    // Pairs of coefficients a, b with |a| + |b| <= order, and the coefficient of a + b
+    struct Term {
+        int a, b, sum;
+        // (-1)^|a|
+        double sign_a;
+    };
+
+    int order = 4;
+    real opening_angle = 0.5f;
+    int leaf_size = 16;
+    real softening2 = 1e-4f;
+
+    // Multi-indices n of the coefficients, by increasing |n|
+    int num_coefficients;
+    std::vector<Vector3i> multi_indices;
+    // Of n - e_axis and n + e_axis, or -1
+    std::vector<int> minus[3], plus[3];
+    std::vector<Term> terms;
+
+    int num_threads = 1;
+    const BarnesHutSummation *tree = nullptr;
+    std::vector<Cell> cells;
+    std::vector<int> leaf_cells;
+    std::vector<Particle> bodies;
+    // Body of every leaf of the tree, or -1
+    std::vector<int> body_of_node;
+    std::vector<Vector3> forces;
+    // num_coefficients per cell: multipoles M_n = sum m (q - z)^n / n!, and locals L_n, the n-th derivatives
+    // of the far field potential at the center
+    std::vector<double> multipoles, locals;
+    // Of each target cell
+    std::vector<std::vector<int>> m2l_lists, p2p_lists;
+    int num_m2l = 0, num_p2p = 0;
+
+    // Subtrees above this depth are processed in parallel
+    static const int parallel_depth = 4;
+
+    // v^n / n! for every coefficient n
+    void get_powers(const Vector3d &v, double *powers) const;
+
+    // The derivatives D^n G(r) of G(r) = (|r|^2 + softening^2)^-0.5, for every coefficient n
+    void get_derivatives(const Vector3d &r, double *derivatives) const;
+
+    void count(int node, int depth, std::vector<int> &num_bodies, std::vector<int> &num_cells) const;
+
+    void place(int node, int cell, int body_begin, int depth, const std::vector<int> &num_bodies,
+               const std::vector<int> &num_cells);
+
+    void gather_bodies(int node, int &body);
+
+    // P2M at leaf cells and M2M above
+    void upward(int cell, int depth);
+
+    void interact(int source, int target, int depth);
+
+    void interact_self(int cell, int depth);
+
+    // L2L to the children
+    void downward(int cell, int depth);
+
+    bool is_leaf(int cell) const {
+        return cells[cell].num_children == 0;
+    }
+};
+
+TC_NAMESPACE_END
@@ -0,0 +1,123 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/dynamics/frame_pipeline.h>
+#include <cmath>
+#include <cstdio>
+
+TC_NAMESPACE_BEGIN
+
+static std::string frame_filename(const std::string &pattern, int index) {
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer), pattern.c_str(), index);
+    return buffer;
+}
+
+FramePipeline::FramePipeline(std::shared_ptr<Simulation3D> simulation, std::shared_ptr<ParticleRenderer> renderer)
+        : simulation(simulation), renderer(renderer) {
+    assert_info(simulation != nullptr, "A frame pipeline needs a simulation");
+    assert_info(renderer != nullptr, "A frame pipeline needs a particle renderer");
+}
+
+void FramePipeline::initialize(const Config &config) {
+    const int num_threads = config.get_int("num_threads");
+    const real render_ratio = config.get("render_ratio", 0.5f);
+    assert_info(0 <= render_ratio && render_ratio <= 1, "render_ratio must be within [0, 1]");
+    // Each stage keeps at least one thread, so both may have all of them on a single core
+    render_threads = clamp((int)std::round(num_threads * render_ratio), 1, std::max(1, num_threads - 1));
+    simulation_threads = std::max(1, num_threads - render_threads);
+    simulation->set_num_threads(simulation_threads);
+    renderer->set_num_threads(render_threads);
+    res = Vector2i(config.get_int("width"), config.get_int("height"));
+    output = config.get("output", std::string(""));
+    exposure = config.get("exposure", 1.0f);
+    gamma = config.get("gamma", 2.2f);
+    preview_budget = config.get("preview_budget", 0);
+    volume_output = config.get("volume_output", std::string(""));
+    volume_threshold = config.get("volume_threshold", 0.0f);
+    compress = config.get("compress", true);
+    first_frame = config.get("first_frame", 0);
+    if (!volume_output.empty()) {
+        volume_exporter = std::make_shared<VolumeExporter>();
+    }
+}
+
+void FramePipeline::step(real t) {
+    simulation->step(t);
+    const int b = num_frames % 2;
+    // The executor runs in order, so the render of frame n - 1 is the only one that may still be running
+    if (renders[b]) {
+        renders[b]->get();
+        renders[b] = nullptr;
+    }
+    PipelineFrame &frame = frames[b];
+    frame.index = first_frame + num_frames;
+    frame.time = simulation->get_current_time();
+    if (preview_budget > 0) {
+        frame.particles = simulation->get_preview_particles(preview_budget);
+    } else {
+        frame.particles = simulation->get_render_particles();
+    }
+    frame.has_volume = volume_exporter != nullptr;
+    if (frame.has_volume) {
+        simulation->get_sparse_volume(frame.volume, volume_threshold);
+    }
+    renders[b] = executor.submit([this, &frame]() {
+        render(frame);
+    });
+    num_frames++;
+}
+
+void FramePipeline::render(PipelineFrame &frame) {
+    if (frame.image.get_width() != res.x || frame.image.get_height() != res.y) {
+        frame.image.initialize(res);
+    }
+    frame.image.reset(Vector3(0.0f));
+    renderer->render(frame.image, frame.particles);
+    if (!output.empty()) {
+        const real inv_gamma = 1.0f / gamma;
+        parallel_for(0, res.x, render_threads, [&](int i) {
+            for (int j = 0; j < res.y; j++) {
+                Vector3 &pixel = frame.image[i][j];
+                for (int k = 0; k < 3; k++) {
+                    pixel[k] = std::pow(clamp(pixel[k] * exposure, 0.0f, 1.0f), inv_gamma);
+                }
+            }
+        });
+        frame.image.write(frame_filename(output, frame.index));
+    }
+    if (frame.has_volume) {
+        volume_exporter->write(frame_filename(volume_output, frame.index), std::move(frame.volume), compress);
+    }
+}
+
+void FramePipeline::wait() {
+    for (int i = 0; i < 2; i++) {
+        // Oldest first, so that the first error is the one of the earliest frame
+        const int b = (num_frames + i) % 2;
+        if (renders[b]) {
+            auto task = renders[b];
+            renders[b] = nullptr;
+            task->get();
+        }
+    }
+    if (volume_exporter) {
+        volume_exporter->wait();
+    }
+}
+
+FramePipeline::~FramePipeline() {
+    for (int i = 0; i < 2; i++) {
+        if (renders[i]) {
+            renders[i]->wait();
+        }
+    }
+}
+
+TC_NAMESPACE_END
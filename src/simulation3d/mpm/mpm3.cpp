@@ -10,6 +10,7 @@
 
 #include "mpm3.h"
 #include <taichi/math/qr_svd.h>
+#include <taichi/system/memory.h>
 #include <taichi/system/threading.h>
 #include <taichi/visual/texture.h>
 #include <taichi/math/math_util.h>
@@ -17,155 +18,421 @@
 
 TC_NAMESPACE_BEGIN
 
-// Note: assuming abs(x) <= 2!!
-inline float w(float x) {
-    x = abs(x);
-    assert(x <= 2);
-    if (x < 1) {
-        return 0.5f * x * x * x - x * x + 2.0f / 3.0f;
-    } else {
-        return -1.0f / 6.0f * x * x * x + x * x - 2 * x + 4.0f / 3.0f;
-    }
-}
-
-// Note: assuming abs(x) <= 2!!
-inline float dw(float x) {
-    float s = x < 0.0f ? -1.0f : 1.0f;
-    x *= s;
-    assert(x <= 2.0f);
-    float val;
-    float xx = x * x;
-    if (x < 1.0f) {
-        val = 1.5f * xx - 2.0f * x;
-    } else {
-        val = -0.5f * xx + 2.0f * x - 2.0f;
-    }
-    return s * val;
-}
-
-inline float w(const Vector3 &a) {
-    return w(a.x) * w(a.y) * w(a.z);
-}
-
-inline Vector3 dw(const Vector3 &a) {
-    return Vector3(dw(a.x) * w(a.y) * w(a.z), w(a.x) * dw(a.y) * w(a.z), w(a.x) * w(a.y) * dw(a.z));
-}
-
 void MPM3D::initialize(const Config &config) {
     Simulation3D::initialize(config);
+    initial_config = config;
     res = config.get_vec3i("resolution");
     gravity = config.get_vec3("gravity");
     apic = config.get("apic", true);
+    block_p2g = config.get("block_p2g", false);
+    fused_p2g = config.get("fused_p2g", false);
     async = config.get("async", false);
     base_delta_t = config.get("base_delta_t", 1e-6f);
     cfl = config.get("cfl", 1.0f);
     strength_dt_mul = config.get("strength_dt_mul", 1.0f);
+    implicit = config.get("implicit", false);
+    implicit_newton_iterations = config.get("implicit_newton_iterations", 1);
+    implicit_max_iterations = config.get("implicit_max_iterations", 50);
+    implicit_tolerance = config.get("implicit_tolerance", 1e-3f);
     TC_LOAD_CONFIG(affine_damping, 0.0f);
+    TC_LOAD_CONFIG(reorder_interval, 64);
+    TC_LOAD_CONFIG(adaptive_sampling_interval, 0);
+    TC_LOAD_CONFIG(min_particles_per_cell, 4);
+    TC_LOAD_CONFIG(max_particles_per_cell, 16);
     if (async) {
         maximum_delta_t = config.get("maximum_delta_t", 1e-1f);
     } else {
         maximum_delta_t = base_delta_t;
     }
 
-    grid_velocity.initialize(res + Vector3i(1), Vector(0.0f), Vector3(0.0f));
-    grid_mass.initialize(res + Vector3i(1), 0, Vector3(0.0f));
-    grid_locks.initialize(res + Vector3i(1), 0, Vector3(0.0f));
-    scheduler.initialize(res, base_delta_t, cfl, strength_dt_mul, &levelset);
+    sparse_grid = config.get("sparse_grid", false);
+    domain.initialize(create_instance<Communicator>(config.get("communicator", std::string("serial")), config),
+                      (res.x + mpm3d_grid_block_size - 1) / mpm3d_grid_block_size);
+    if (domain.is_distributed()) {
+        // Ghost nodes are summed between the scatter and the normalization of the fused P2G,
+        // and each rank only keeps the grid around its own slab
+        fused_p2g = true;
+        sparse_grid = true;
+    }
+    if (implicit) {
+        assert_info(!async, "Implicit MPM does not support async time stepping");
+        assert_info(!domain.is_distributed(), "Implicit MPM does not support distributed simulation");
+        // The stress is applied by the solve instead of the scatter
+        fused_p2g = false;
+    }
+    {
+        TC_MEMORY_TAG("mpm3.grid");
+        grid.initialize(res + Vector3i(1));
+        if (!sparse_grid) {
+            grid.allocate_all();
+        }
+        if (implicit) {
+            implicit_grid.initialize(res + Vector3i(1));
+        }
+    }
+    TC_MEMORY_TAG("mpm3.scheduler");
+    scheduler.initialize(res, base_delta_t, cfl, strength_dt_mul, &levelset, &particles, num_threads);
 }
 
 void MPM3D::add_particles(const Config &config) {
+    TC_MEMORY_TAG("mpm3.particles");
     std::shared_ptr<Texture> density_texture = AssetManager::get_asset<Texture>(config.get_int("density_tex"));
-    for (int i = 0; i < res[0]; i++) {
+    auto material = create_mpm3_material(config.get("type", std::string("ep")));
+    material->initialize(config);
+    int material_id = (int)materials.size();
+    materials.push_back(material);
+    material_configs.push_back(config);
+    Vector initial_velocity = config.get("initial_velocity", Vector(0.0f));
+    // Each cell draws counter-based random numbers keyed by the seed, the material and the cell,
+    // so that seeding does not depend on the thread or rank visiting the cell
+    const uint64 seed = hash64(hash64(uint64(config.get("seed", 0))) + uint64(material_id));
+    // x-slices are generated in parallel, then copied into the storage in order
+    std::vector<std::vector<Vector>> slice_positions(res[0]);
+    parallel_for(0, res[0], num_threads, [&](int i) {
+        if (!domain.owns_column(i / mpm3d_grid_block_size)) {
+            return;
+        }
+        std::vector<Vector> &positions = slice_positions[i];
+        // The densities of a row of cells at a time, through Texture::sample_n
+        std::vector<Vector3> coords(res[2]);
+        std::vector<Vector4> densities(res[2]);
         for (int j = 0; j < res[1]; j++) {
             for (int k = 0; k < res[2]; k++) {
-                Vector3 coord = Vector3(i + 0.5f, j + 0.5f, k + 0.5f) / Vector3(res);
-                real num = density_texture->sample(coord).x;
-                int t = (int)num + (rand() < num - int(num));
+                coords[k] = Vector3(i + 0.5f, j + 0.5f, k + 0.5f) / Vector3(res);
+            }
+            density_texture->sample_n(coords.data(), res[2], densities.data());
+            for (int k = 0; k < res[2]; k++) {
+                const uint64 key = hash64(seed + uint64((int64(i) * res[1] + j) * res[2] + k));
+                real num = densities[k].x;
+                int t = (int)num + (counter_rand(key, 0) < num - int(num));
                 for (int l = 0; l < t; l++) {
-                    MPM3Particle *p = nullptr;
-                    if (config.get("type", std::string("ep")) == std::string("ep")) {
-                        p = new EPParticle3();
-                        p->initialize(config);
-                    } else {
-                        p = new DPParticle3();
-                        p->initialize(config);
-                    }
-                    p->pos = Vector(i + rand(), j + rand(), k + rand());
-                    p->mass = 1.0f;
-                    p->v = config.get("initial_velocity", p->v);
-                    p->last_update = current_t_int;
-                    particles.push_back(p);
-                    scheduler.insert_particle(p, true);
+                    positions.push_back(Vector(i + counter_rand(key, 3 * l + 1), j + counter_rand(key, 3 * l + 2),
+                                               k + counter_rand(key, 3 * l + 3)));
                 }
             }
         }
+    });
+    std::vector<int> slice_begin(res[0] + 1, particles.size());
+    for (int i = 0; i < res[0]; i++) {
+        slice_begin[i + 1] = slice_begin[i] + (int)slice_positions[i].size();
     }
+    int begin = particles.add_particles(slice_begin[res[0]] - slice_begin[0], initial_velocity, 1.0f, material_id,
+                                        current_t_int);
+    int end = particles.size();
+    parallel_for(0, res[0], num_threads, [&](int i) {
+        std::copy(slice_positions[i].begin(), slice_positions[i].end(), particles.pos.begin() + slice_begin[i]);
+        std::vector<Vector>().swap(slice_positions[i]);
+    });
+    material->initialize_particles(particles, begin, end, num_threads);
+    TC_MEMORY_TAG("mpm3.scheduler");
+    scheduler.insert_particles(begin, end);
     P(particles.size());
 }
 
+RenderParticle MPM3D::get_render_particle(int i) const {
+    Vector3 center(res[0] / 2.0f, res[1] / 2.0f, res[2] / 2.0f);
+    // at least synchronize the position
+    Vector3 pos = particles.pos[i] - center + (current_t_int - particles.last_update[i]) * base_delta_t *
+                                              particles.v[i];
+    if (particles.state[i] == MPM3Particles::UPDATING) {
+        return RenderParticle(pos, Vector4(0.8f, 0.1f, 0.2f, 0.5f));
+    } else
+    if (particles.state[i] == MPM3Particles::BUFFER) {
+        return RenderParticle(pos, Vector4(0.8f, 0.8f, 0.2f, 0.5f));
+    }
+    else {
+        return RenderParticle(pos, Vector4(0.8f, 0.9f, 1.0f, 0.5f));
+    }
+}
+
 std::vector<RenderParticle> MPM3D::get_render_particles() const {
     using Particle = RenderParticle;
     std::vector<Particle> render_particles;
     render_particles.reserve(particles.size());
-    Vector3 center(res[0] / 2.0f, res[1] / 2.0f, res[2] / 2.0f);
-    for (auto p_p : particles) {
-        MPM3Particle &p = *p_p;
-        // at least synchronize the position
-        Vector3 pos = p.pos - center + (current_t_int - p.last_update) * base_delta_t * p.v;
-        if (p.state == MPM3Particle::UPDATING) {
-            render_particles.push_back(Particle(pos, Vector4(0.8f, 0.1f, 0.2f, 0.5f)));
-        } else
-        if (p.state == MPM3Particle::BUFFER) {
-            render_particles.push_back(Particle(pos, Vector4(0.8f, 0.8f, 0.2f, 0.5f)));
+    for (int i = 0; i < particles.size(); i++) {
+        render_particles.push_back(get_render_particle(i));
+    }
+    return render_particles;
+}
+
+std::vector<RenderParticle> MPM3D::get_preview_particles(int budget) const {
+    assert_info(budget > 0, "The splat budget should be positive");
+    if (particles.size() <= budget) {
+        return get_render_particles();
+    }
+    // Particles added since the last substep are not binned yet
+    if ((int)scheduler.get_sorted_particles().size() != particles.size()) {
+        return Simulation3D::get_preview_particles(budget);
+    }
+    const Vector3i &block_res = scheduler.res;
+    const int num_blocks = block_res.x * block_res.y * block_res.z;
+    // Super blocks of merge^3 blocks are split into split^3 cells; one of the two is 1
+    auto get_occupied = [&](int merge) {
+        const Vector3i super_res = (block_res + Vector3i(merge - 1)) / merge;
+        std::vector<char> marks(super_res.x * super_res.y * super_res.z, 0);
+        for (int b = 0; b < num_blocks; b++) {
+            if (!scheduler.get_particle_group(b).empty()) {
+                const int x = b / (block_res.y * block_res.z) / merge, y = b / block_res.z % block_res.y / merge;
+                const int z = b % block_res.z / merge;
+                marks[(x * super_res.y + y) * super_res.z + z] = 1;
+            }
         }
-        else {
-            render_particles.push_back(Particle(pos, Vector4(0.8f, 0.9f, 1.0f, 0.5f)));
+        std::vector<int> occupied;
+        for (int s = 0; s < (int)marks.size(); s++) {
+            if (marks[s]) {
+                occupied.push_back(s);
+            }
         }
+        return occupied;
+    };
+    int merge = 1, split = 1;
+    std::vector<int> occupied = get_occupied(merge);
+    while ((int64)occupied.size() > budget) {
+        merge *= 2;
+        occupied = get_occupied(merge);
     }
-    return render_particles;
+    while (merge == 1 && split < mpm3d_grid_block_size &&
+           (int64)occupied.size() * (8 * split * split * split) <= budget) {
+        split *= 2;
+    }
+    const Vector3i super_res = (block_res + Vector3i(merge - 1)) / merge;
+    const int cells_per_super_block = split * split * split;
+    const real inv_cell_size = real(split) / (merge * mpm3d_grid_block_size);
+    std::vector<RenderParticle> slots(occupied.size() * cells_per_super_block);
+    std::vector<char> slot_used(slots.size(), 0);
+    parallel_for(0, (int)occupied.size(), num_threads, [&](int k) {
+        const int s = occupied[k];
+        const Vector3i super_block(s / (super_res.y * super_res.z), s / super_res.z % super_res.y, s % super_res.z);
+        const Vector3 origin(super_block * (merge * mpm3d_grid_block_size));
+        std::vector<SplatAccumulator> cells(cells_per_super_block);
+        const Vector3i block_begin = super_block * merge;
+        const Vector3i block_end = glm::min(block_begin + Vector3i(merge), block_res);
+        for (int x = block_begin.x; x < block_end.x; x++) {
+            for (int y = block_begin.y; y < block_end.y; y++) {
+                for (int z = block_begin.z; z < block_end.z; z++) {
+                    for (int p : scheduler.get_particle_group(Vector3i(x, y, z))) {
+                        const Vector3 g = (particles.pos[p] - origin) * inv_cell_size;
+                        const int i = clamp((int)g.x, 0, split - 1), j = clamp((int)g.y, 0, split - 1);
+                        const int l = clamp((int)g.z, 0, split - 1);
+                        cells[(i * split + j) * split + l].add(get_render_particle(p));
+                    }
+                }
+            }
+        }
+        for (int c = 0; c < cells_per_super_block; c++) {
+            if (!cells[c].empty()) {
+                slots[k * cells_per_super_block + c] = cells[c].get();
+                slot_used[k * cells_per_super_block + c] = 1;
+            }
+        }
+    });
+    std::vector<RenderParticle> splats;
+    splats.reserve(slots.size());
+    for (int i = 0; i < (int)slots.size(); i++) {
+        if (slot_used[i]) {
+            splats.push_back(slots[i]);
+        }
+    }
+    return splats;
 }
 
-void MPM3D::rasterize() {
-    grid_velocity.reset(Vector(0.0f));
-    grid_mass.reset(0.0f);
-    parallel_for_each_active_particle([&](MPM3Particle &p) {
-        for (auto &ind : get_bounded_rasterization_region(p.pos)) {
-            Vector3 d_pos = Vector(ind.i, ind.j, ind.k) - p.pos;
-            real weight = w(d_pos);
-            grid_locks[ind].lock();
-            grid_mass[ind] += weight * p.mass;
-            grid_velocity[ind] += weight * p.mass * (p.v + (3.0f) * p.apic_b * d_pos);
-            grid_locks[ind].unlock();
+// Positions are synchronized to the current time like get_render_particles, but keep grid coordinates
+void MPM3D::get_particle_frame(ParticleFrame &frame) const {
+    const int n = particles.size();
+    const bool with_velocity = (frame.fields & ParticleFrame::VELOCITY) != 0;
+    frame.time = current_t;
+    frame.position.resize(n);
+    frame.velocity.resize(with_velocity ? n : 0);
+    if (frame.fields & ParticleFrame::STATE) {
+        frame.state.assign(particles.state.begin(), particles.state.end());
+    } else {
+        frame.state.clear();
+    }
+    parallel_for(0, n, num_threads, [&](int i) {
+        frame.position[i] = particles.pos[i] + (current_t_int - particles.last_update[i]) * base_delta_t *
+                                               particles.v[i];
+        if (with_velocity) {
+            frame.velocity[i] = particles.v[i];
         }
     });
-    for (auto ind : grid_mass.get_region()) {
-        if (grid_mass[ind] > 0) {
-            CV(grid_velocity[ind]);
-            CV(1 / grid_mass[ind]);
-            grid_velocity[ind] = grid_velocity[ind] * (1.0f / grid_mass[ind]);
-            CV(grid_velocity[ind]);
+}
+
+// Nodes touched by the particles of one block: [block * size - 1, block * size + size + 2)
+const int mpm3d_block_scratch_size = mpm3d_grid_block_size + 3;
+
+inline int get_block_scratch_index(const Index3D &ind, const Vector3i &origin) {
+    return ((ind.i - origin.x) * mpm3d_block_scratch_size + (ind.j - origin.y)) * mpm3d_block_scratch_size +
+           (ind.k - origin.z);
+}
+
+void MPM3D::rasterize_blocked() {
+    const int scratch_size = mpm3d_block_scratch_size;
+    parallel_for_each_active_block_colored([&](const Vector3i &block, const MPM3ParticleRange &group) {
+        // mass in w, momentum in xyz
+        thread_local std::vector<Vector4> scratch;
+        scratch.assign(scratch_size * scratch_size * scratch_size, Vector4(0.0f));
+        const Vector3i origin = block * mpm3d_grid_block_size - Vector3i(1);
+        for (int p : group) {
+            const Vector pos = particles.pos[p];
+            const Vector v = particles.v[p];
+            const Matrix apic_b = particles.apic_b[p];
+            const real mass = particles.mass[p];
+            const MPM3Kernel &kernel = particles.get_kernel(p);
+            for (auto &ind : get_bounded_rasterization_region(pos)) {
+                Vector3 d_pos = Vector(ind.i, ind.j, ind.k) - pos;
+                real weight = kernel.get_w(ind);
+                Vector momentum = weight * mass * (v + (3.0f) * apic_b * d_pos);
+                scratch[get_block_scratch_index(ind, origin)] += Vector4(momentum, weight * mass);
+            }
+        }
+        for (auto &ind : Region(origin.x, origin.x + scratch_size, origin.y, origin.y + scratch_size,
+                                origin.z, origin.z + scratch_size)) {
+            if (!grid.inside(ind)) {
+                continue;
+            }
+            const Vector4 &node = scratch[get_block_scratch_index(ind, origin)];
+            if (node.w == 0) {
+                continue;
+            }
+            MPM3GridNode &g = grid[ind];
+            g.mass += node.w;
+            g.velocity += Vector(node);
+        }
+    });
+}
+
+void MPM3D::rasterize() {
+    clear_dirty_grid_blocks();
+    if (block_p2g) {
+        rasterize_blocked();
+    } else {
+        parallel_for_each_active_particle([&](int p) {
+            const Vector pos = particles.pos[p];
+            const Vector v = particles.v[p];
+            const Matrix apic_b = particles.apic_b[p];
+            const real mass = particles.mass[p];
+            const MPM3Kernel &kernel = particles.get_kernel(p);
+            for (auto &ind : get_bounded_rasterization_region(pos)) {
+                Vector3 d_pos = Vector(ind.i, ind.j, ind.k) - pos;
+                real weight = kernel.get_w(ind);
+                MPM3GridNode &g = grid[ind];
+                g.lock.lock();
+                g.mass += weight * mass;
+                g.velocity += weight * mass * (v + (3.0f) * apic_b * d_pos);
+                g.lock.unlock();
+            }
+        });
+    }
+    parallel_for_each_grid_node([](const Index3D &ind, MPM3GridNode &g) {
+        if (g.mass > 0) {
+            CV(g.velocity);
+            CV(1 / g.mass);
+            g.velocity = g.velocity * (1.0f / g.mass);
+            CV(g.velocity);
         }
+    });
+}
+
+void MPM3D::rasterize_fused(real delta_t) {
+    clear_dirty_grid_blocks();
+    // Momentum goes to velocity and the stress impulse to velocity_backup, so that
+    // the backup still holds the pre-force velocity after normalization.
+    if (block_p2g) {
+        const int scratch_size = mpm3d_block_scratch_size;
+        parallel_for_each_active_block_colored([&](const Vector3i &block, const MPM3ParticleRange &group) {
+            thread_local std::vector<Vector4> scratch;
+            thread_local std::vector<Vector> scratch_impulse;
+            scratch.assign(scratch_size * scratch_size * scratch_size, Vector4(0.0f));
+            scratch_impulse.assign(scratch_size * scratch_size * scratch_size, Vector(0.0f));
+            const Vector3i origin = block * mpm3d_grid_block_size - Vector3i(1);
+            for (int p : group) {
+                const Vector pos = particles.pos[p];
+                const Vector v = particles.v[p];
+                const Matrix apic_b = particles.apic_b[p];
+                const real mass = particles.mass[p];
+                const Matrix impulse = delta_t * materials[particles.material[p]]->get_force(particles, p);
+                const MPM3Kernel &kernel = particles.get_kernel(p);
+                for (auto &ind : get_bounded_rasterization_region(pos)) {
+                    Vector3 d_pos = Vector(ind.i, ind.j, ind.k) - pos;
+                    real weight = kernel.get_w(ind);
+                    int s = get_block_scratch_index(ind, origin);
+                    scratch[s] += Vector4(weight * mass * (v + (3.0f) * apic_b * d_pos), weight * mass);
+                    scratch_impulse[s] += impulse * kernel.get_dw(ind);
+                }
+            }
+            for (auto &ind : Region(origin.x, origin.x + scratch_size, origin.y, origin.y + scratch_size,
+                                    origin.z, origin.z + scratch_size)) {
+                if (!grid.inside(ind)) {
+                    continue;
+                }
+                int s = get_block_scratch_index(ind, origin);
+                const Vector4 &node = scratch[s];
+                if (node.w == 0) {
+                    continue;
+                }
+                MPM3GridNode &g = grid[ind];
+                g.mass += node.w;
+                g.velocity += Vector(node);
+                g.velocity_backup += scratch_impulse[s];
+            }
+        });
+    } else {
+        parallel_for_each_active_particle([&](int p) {
+            const Vector pos = particles.pos[p];
+            const Vector v = particles.v[p];
+            const Matrix apic_b = particles.apic_b[p];
+            const real mass = particles.mass[p];
+            const Matrix impulse = delta_t * materials[particles.material[p]]->get_force(particles, p);
+            const MPM3Kernel &kernel = particles.get_kernel(p);
+            for (auto &ind : get_bounded_rasterization_region(pos)) {
+                Vector3 d_pos = Vector(ind.i, ind.j, ind.k) - pos;
+                real weight = kernel.get_w(ind);
+                Vector momentum = weight * mass * (v + (3.0f) * apic_b * d_pos);
+                Vector force_impulse = impulse * kernel.get_dw(ind);
+                MPM3GridNode &g = grid[ind];
+                g.lock.lock();
+                g.mass += weight * mass;
+                g.velocity += momentum;
+                g.velocity_backup += force_impulse;
+                g.lock.unlock();
+            }
+        });
+    }
+    if (domain.is_distributed()) {
+        exchange_ghost_grid_nodes();
     }
+    parallel_for_each_grid_node([](const Index3D &ind, MPM3GridNode &g) {
+        if (g.mass > 0) {
+            real inv_mass = 1.0f / g.mass;
+            Vector impulse = g.velocity_backup;
+            g.velocity_backup = g.velocity * inv_mass;
+            g.velocity = g.velocity_backup + impulse * inv_mass;
+            CV(g.velocity);
+        }
+    });
 }
 
 void MPM3D::resample() {
     real alpha_delta_t = 1;
     if (apic)
         alpha_delta_t = 0;
-    parallel_for_each_active_particle([&](MPM3Particle &p) {
-        if (p.state != MPM3Particle::UPDATING)
+    parallel_for_each_active_particle([&](int p) {
+        if (particles.state[p] != MPM3Particles::UPDATING)
             return;
-        real delta_t = base_delta_t * (current_t_int - p.last_update);
+        const Vector pos = particles.pos[p];
+        real delta_t = base_delta_t * (current_t_int - particles.last_update[p]);
         Vector v(0.0f), bv(0.0f);
         Matrix cdg(0.0f);
         Matrix b(0.0f);
         int count = 0;
-        for (auto &ind : get_bounded_rasterization_region(p.pos)) {
+        const MPM3Kernel &kernel = particles.get_kernel(p);
+        for (auto &ind : get_bounded_rasterization_region(pos)) {
             count++;
-            Vector d_pos = p.pos - Vector3(ind.i, ind.j, ind.k);
-            float weight = w(d_pos);
-            Vector gw = dw(d_pos);
-            Vector grid_vel = grid_velocity[ind];
+            Vector d_pos = pos - Vector3(ind.i, ind.j, ind.k);
+            float weight = kernel.get_w(ind);
+            Vector gw = kernel.get_dw(ind);
+            const MPM3GridNode &g = grid[ind];
+            Vector grid_vel = g.velocity;
             v += weight * grid_vel;
             Vector aa = grid_vel;
             Vector bb = -d_pos;
@@ -173,58 +440,99 @@ void MPM3D::resample() {
                        aa[0] * bb[1], aa[1] * bb[1], aa[2] * bb[1],
                        aa[0] * bb[2], aa[1] * bb[2], aa[2] * bb[2]);
             b += weight * out;
-            bv += weight * grid_velocity_backup[ind];
-            cdg += glm::outerProduct(grid_velocity[ind], gw);
-            CV(grid_velocity[ind]);
+            bv += weight * g.velocity_backup;
+            cdg += glm::outerProduct(grid_vel, gw);
+            CV(grid_vel);
         }
         if (count != 64 || !apic) {
             b = Matrix(0);
         }
         // We should use an std::exp here, but it is too slow...
         real damping = std::max(0.0f, 1.0f - delta_t * affine_damping);
-        p.apic_b = b * damping;
+        particles.apic_b[p] = b * damping;
         cdg = Matrix(1) + delta_t * cdg;
-        p.v = (1 - alpha_delta_t) * v + alpha_delta_t * (v - bv + p.v);
-        Matrix dg = cdg * p.dg_e * p.dg_p;
-        p.dg_e = cdg * p.dg_e;
-        p.dg_cache = dg;
+        particles.v[p] = (1 - alpha_delta_t) * v + alpha_delta_t * (v - bv + particles.v[p]);
+        particles.dg_e[p] = cdg * particles.dg_e[p];
     });
 }
 
 void MPM3D::apply_deformation_force(float delta_t) {
     //printf("Calculating force...\n");
-    parallel_for_each_active_particle([&](MPM3Particle &p) {
-        p.calculate_force();
-    });
+    particles.tmp_force.resize(particles.size());
+    for (int m = 0; m < (int)materials.size(); m++) {
+        materials[m]->calculate_force(particles, active_particles_by_material[m], num_threads);
+    }
     //printf("Accumulating force...\n");
-    parallel_for_each_active_particle([&](MPM3Particle &p) {
-        for (auto &ind : get_bounded_rasterization_region(p.pos)) {
-            real mass = grid_mass[ind];
+    if (block_p2g) {
+        apply_deformation_force_blocked(delta_t);
+        return;
+    }
+    parallel_for_each_active_particle([&](int p) {
+        const Vector pos = particles.pos[p];
+        const Matrix tmp_force = particles.tmp_force[p];
+        const MPM3Kernel &kernel = particles.get_kernel(p);
+        for (auto &ind : get_bounded_rasterization_region(pos)) {
+            MPM3GridNode &g = grid[ind];
+            real mass = g.mass;
             if (mass == 0.0f) { // No EPS here
                 continue;
             }
-            Vector d_pos = p.pos - Vector3(ind.i, ind.j, ind.k);
-            Vector gw = dw(d_pos);
-            Vector force = p.tmp_force * gw;
+            Vector gw = kernel.get_dw(ind);
+            Vector force = tmp_force * gw;
             CV(force);
-            grid_locks[ind].lock();
-            grid_velocity[ind] += delta_t / mass * force;
-            grid_locks[ind].unlock();
+            g.lock.lock();
+            g.velocity += delta_t / mass * force;
+            g.lock.unlock();
+        }
+    });
+}
+
+void MPM3D::apply_deformation_force_blocked(float delta_t) {
+    const int scratch_size = mpm3d_block_scratch_size;
+    parallel_for_each_active_block_colored([&](const Vector3i &block, const MPM3ParticleRange &group) {
+        thread_local std::vector<Vector> scratch;
+        scratch.assign(scratch_size * scratch_size * scratch_size, Vector(0.0f));
+        const Vector3i origin = block * mpm3d_grid_block_size - Vector3i(1);
+        for (int p : group) {
+            const Vector pos = particles.pos[p];
+            const Matrix tmp_force = particles.tmp_force[p];
+            const MPM3Kernel &kernel = particles.get_kernel(p);
+            for (auto &ind : get_bounded_rasterization_region(pos)) {
+                Vector gw = kernel.get_dw(ind);
+                Vector force = tmp_force * gw;
+                CV(force);
+                scratch[get_block_scratch_index(ind, origin)] += force;
+            }
+        }
+        for (auto &ind : Region(origin.x, origin.x + scratch_size, origin.y, origin.y + scratch_size,
+                                origin.z, origin.z + scratch_size)) {
+            if (!grid.inside(ind)) {
+                continue;
+            }
+            MPM3GridNode &g = grid[ind];
+            if (g.mass == 0.0f) { // No EPS here
+                continue;
+            }
+            g.velocity += delta_t / g.mass * scratch[get_block_scratch_index(ind, origin)];
         }
     });
 }
 
 void MPM3D::grid_apply_boundary_conditions(const DynamicLevelSet3D &levelset, real t) {
-    for (auto &ind : scheduler.get_active_grid_points()) {
-        Vector3 pos = Vector3(0.5 + ind[0], 0.5 + ind[1], 0.5 + ind[2]);
-        real phi = levelset.sample(pos, t);
-        if (1 < phi || phi < -3) continue;
-        Vector3 n = levelset.get_spatial_gradient(pos, t);
-        Vector boundary_velocity = levelset.get_temporal_derivative(pos, t) * n;
-        Vector3 v = grid_velocity[ind] - boundary_velocity;
+    const std::vector<Vector3i> &active_grid_points = scheduler.get_active_grid_points();
+    levelset.query(active_grid_points, t, boundary_queries, num_threads);
+    ThreadedTaskManager::run((int)active_grid_points.size(), num_threads, [&](int i) {
+        const Vector3i &ind = active_grid_points[i];
+        const DynamicLevelSet3D::Query &q = boundary_queries[i];
+        real phi = q.phi;
+        if (1 < phi || phi < -3) return;
+        Vector3 n = q.normal;
+        Vector boundary_velocity = q.temporal_derivative * n;
+        Vector3 &grid_velocity = grid[ind].velocity;
+        Vector3 v = grid_velocity - boundary_velocity;
         if (phi > 0) { // 0~1
             real pressure = std::max(-glm::dot(v, n), 0.0f);
-            real mu = levelset.levelset0->friction;
+            real mu = levelset.get_friction();
             if (mu < 0) { // sticky
                 v = Vector3(0.0f);
             } else {
@@ -239,81 +547,532 @@ void MPM3D::grid_apply_boundary_conditions(const DynamicLevelSet3D &levelset, re
             v = n * std::max(0.0f, glm::dot(v, n));
         }
         v += boundary_velocity;
-        grid_velocity[ind] = v;
-    }
+        grid_velocity = v;
+    });
 }
 
 void MPM3D::particle_collision_resolution(real t) {
-    parallel_for_each_active_particle([&](MPM3Particle &p) {
-        if (p.state == MPM3Particle::UPDATING) {
-            p.resolve_collision(levelset, t);
+    // Particles stay binned by the block they were in at the last update, so each block's particles are bounded
+    // first. Interpolating a distance field grows phi by at most sqrt(3) per unit of distance, so a box whose
+    // center is farther from the boundary than that times its half diagonal has no particle inside it.
+    const int max_window_extent = 4 * mpm3d_grid_block_size;
+    const std::vector<Vector3i> &active_blocks = scheduler.get_active_blocks();
+    ThreadedTaskManager::run((int)active_blocks.size(), num_threads, [&](int b) {
+        const MPM3ParticleRange group = scheduler.get_particle_group(active_blocks[b]);
+        if (group.empty()) {
+            return;
+        }
+        Vector3 lower(1e30f), upper(-1e30f);
+        for (int p : group) {
+            lower = glm::min(lower, particles.pos[p]);
+            upper = glm::max(upper, particles.pos[p]);
         }
+        const Vector3 center = 0.5f * (lower + upper);
+        const real half_diagonal = 0.5f * length(upper - lower);
+        if (levelset.sample(center, t) > std::sqrt(3.0f) * half_diagonal) {
+            return;
+        }
+        thread_local DynamicLevelSet3D::Window window;
+        const Vector3 extent = upper - lower;
+        if (std::max(extent.x, std::max(extent.y, extent.z)) < max_window_extent) {
+            levelset.fetch_window(lower, upper, window);
+        } else {
+            // Stray particles; the queries fall back to the level sets
+            window.size = Vector3i(0);
+        }
+        for (int p : group) {
+            if (particles.state[p] != MPM3Particles::UPDATING) {
+                continue;
+            }
+            Vector3 &pos = particles.pos[p];
+            const DynamicLevelSet3D::Query q = levelset.query(window, pos, t);
+            const real phi = q.phi;
+            if (phi < 0) {
+                const Vector3 &gradient = q.normal;
+                Vector3 &v = particles.v[p];
+                pos -= gradient * phi;
+                v -= glm::dot(gradient, v) * gradient;
+            }
+        }
+    });
+}
+
+// Node layers x in [cut * size - 1, cut * size + 1] receive particles from both sides of the cut
+// at block column `cut`: the last layer of column cut - 1 and the first two of column cut.
+inline bool is_ghost_node_layer(int x, int cut) {
+    return cut * mpm3d_grid_block_size - 1 <= x && x <= cut * mpm3d_grid_block_size + 1;
+}
+
+void MPM3D::exchange_ghost_grid_nodes() {
+    // Mass, momentum and stress impulse before normalization, preceded by the block coordinates.
+    // All messages are written before any contribution is added, so both sides send partial sums.
+    const int cut[2] = {domain.column_begin, domain.column_end};
+    std::vector<char> send[2], recv[2];
+    for (int side = 0; side < 2; side++) {
+        if (!domain.has_neighbour(side)) {
+            continue;
+        }
+        BinaryMemoryStreamOutput os;
+        for (auto &block : grid_blocks) {
+            if (block.x != cut[side] - 1 && block.x != cut[side]) {
+                continue;
+            }
+            os << block;
+            grid.for_each_node(block, [&](const Index3D &ind, MPM3GridNode &g) {
+                if (is_ghost_node_layer(ind.i, cut[side])) {
+                    os << g.mass << g.velocity << g.velocity_backup;
+                }
+            });
+        }
+        send[side].swap(os.data);
+    }
+    domain.exchange(send, recv);
+    for (int side = 0; side < 2; side++) {
+        BinaryMemoryStreamInput is(recv[side]);
+        while (!is.eof()) {
+            Vector3i block = is.read<Vector3i>();
+            // Nobody here scatters to or gathers from blocks this rank did not allocate
+            const bool allocated = grid.has_block(block);
+            for (auto &ind : grid.get_block_region(block)) {
+                if (!is_ghost_node_layer(ind.i, cut[side])) {
+                    continue;
+                }
+                real mass = is.read<real>();
+                Vector momentum = is.read<Vector>();
+                Vector impulse = is.read<Vector>();
+                if (allocated) {
+                    MPM3GridNode &g = grid[ind];
+                    g.mass += mass;
+                    g.velocity += momentum;
+                    g.velocity_backup += impulse;
+                }
+            }
+        }
+    }
+}
+
+void MPM3D::migrate_particles() {
+    // Only updating particles move, and the CFL limit keeps them within one block per substep
+    const int n = particles.size();
+    std::vector<char> leaving(n, 0);
+    BinaryMemoryStreamOutput os[2];
+    int num_leaving = 0;
+    for (int p : scheduler.get_active_particles()) {
+        if (particles.state[p] != MPM3Particles::UPDATING) {
+            continue;
+        }
+        int column = int(particles.pos[p].x) / mpm3d_grid_block_size;
+        if (domain.owns_column(column)) {
+            continue;
+        }
+        int owner = domain.get_column_owner(column);
+        assert_info(std::abs(owner - domain.rank) == 1,
+                    "Particle moved from rank " + std::to_string(domain.rank) + " past its neighbours to rank "
+                    + std::to_string(owner));
+        BinaryMemoryStreamOutput &side_os = os[owner > domain.rank];
+        particles.write_particle(side_os, p);
+        const MPM3Material &material = *materials[particles.material[p]];
+        std::vector<real> attributes(material.get_num_particle_attributes());
+        material.get_particle_attributes(p, attributes.data());
+        for (real a : attributes) {
+            side_os << a;
+        }
+        leaving[p] = 1;
+        num_leaving++;
+    }
+    std::vector<char> send[2], recv[2];
+    send[0].swap(os[0].data);
+    send[1].swap(os[1].data);
+    domain.exchange(send, recv);
+    // Arrivals are appended to the storage; their attributes wait in incoming_attributes
+    std::vector<real> incoming_attributes;
+    std::vector<int> incoming_attribute_offset;
+    for (int side = 0; side < 2; side++) {
+        BinaryMemoryStreamInput is(recv[side]);
+        while (!is.eof()) {
+            int p = particles.read_particle(is);
+            assert_info(0 <= particles.material[p] && particles.material[p] < (int)materials.size(),
+                        "Migrating particle has an unknown material");
+            incoming_attribute_offset.push_back((int)incoming_attributes.size());
+            int num_attributes = materials[particles.material[p]]->get_num_particle_attributes();
+            for (int a = 0; a < num_attributes; a++) {
+                incoming_attributes.push_back(is.read<real>());
+            }
+        }
+    }
+    if (num_leaving == 0 && particles.size() == n) {
+        return;
+    }
+    rebuild_particle_storage(n, leaving, incoming_attributes, incoming_attribute_offset);
+}
+
+void MPM3D::rebuild_particle_storage(int n, const std::vector<char> &removed,
+                                     const std::vector<real> &appended_attributes,
+                                     const std::vector<int> &appended_attribute_offset) {
+    // Each material keeps its remaining particles in order, followed by its appended ones
+    std::vector<int> old_index;
+    old_index.reserve(particles.size());
+    for (int m = 0; m < (int)materials.size(); m++) {
+        MPM3Material &material = *materials[m];
+        const int begin = (int)old_index.size();
+        for (int p = material.begin; p < material.end; p++) {
+            if (!removed[p]) {
+                old_index.push_back(p);
+            }
+        }
+        for (int p = n; p < particles.size(); p++) {
+            if (particles.material[p] == m) {
+                old_index.push_back(p);
+            }
+        }
+        const int end = (int)old_index.size();
+        const int num_attributes = material.get_num_particle_attributes();
+        if (num_attributes == 0) {
+            material.set_particle_range(begin, end);
+            continue;
+        }
+        std::vector<real> attributes((end - begin) * num_attributes);
+        for (int i = begin; i < end; i++) {
+            real *dst = attributes.data() + (i - begin) * num_attributes;
+            int p = old_index[i];
+            if (p < n) {
+                material.get_particle_attributes(p, dst);
+            } else {
+                std::copy_n(appended_attributes.data() + appended_attribute_offset[p - n], num_attributes, dst);
+            }
+        }
+        material.set_particle_range(begin, end);
+        for (int i = begin; i < end; i++) {
+            material.set_particle_attributes(i, attributes.data() + (i - begin) * num_attributes);
+        }
+    }
+    particles.permute(old_index);
+    scheduler.reset_particle_groups();
+}
+
+void MPM3D::update_grid_occupancy() {
+    // Particles of a block reach one node past its lower face and two past its upper face,
+    // so the grid needs the active blocks dilated by one.
+    const Vector3i block_res = grid.get_block_res();
+    std::vector<char> touched(block_res.x * block_res.y * block_res.z, 0);
+    grid_blocks.clear();
+    for (auto &block : scheduler.get_active_blocks()) {
+        for (int dx = -1; dx <= 1; dx++) {
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dz = -1; dz <= 1; dz++) {
+                    Vector3i b = block + Vector3i(dx, dy, dz);
+                    if (!grid.inside_blocks(b)) {
+                        continue;
+                    }
+                    char &t = touched[grid.get_block_id(b)];
+                    if (!t) {
+                        t = 1;
+                        grid_blocks.push_back(b);
+                    }
+                }
+            }
+        }
+    }
+    if (sparse_grid) {
+        TC_MEMORY_TAG("mpm3.grid");
+        grid.set_allocated_blocks(grid_blocks);
+    }
+}
+
+void MPM3D::clear_dirty_grid_blocks() {
+    // Blocks outside dirty_grid_blocks were never written or got a fresh page
+    ThreadedTaskManager::run((int)dirty_grid_blocks.size(), num_threads, [&](int i) {
+        if (grid.has_block(dirty_grid_blocks[i])) {
+            grid.reset_block(dirty_grid_blocks[i], MPM3GridNode());
+        }
+    });
+    dirty_grid_blocks = grid_blocks;
+}
+
+void MPM3D::reorder_particles() {
+    // Sort each material's range by block, so that blocks read contiguous memory.
+    // Materials keep their ranges since they may store per-particle state.
+    const int n = particles.size();
+    std::vector<int> old_index(n), cursor(materials.size());
+    for (int m = 0; m < (int)materials.size(); m++) {
+        cursor[m] = materials[m]->begin;
+    }
+    std::vector<char> binned(n, 0);
+    for (int p : scheduler.get_sorted_particles()) {
+        old_index[cursor[particles.material[p]]++] = p;
+        binned[p] = 1;
+    }
+    for (int p = 0; p < n; p++) {
+        if (!binned[p]) {
+            old_index[cursor[particles.material[p]]++] = p;
+        }
+    }
+    std::vector<int> new_index(n);
+    for (int i = 0; i < n; i++) {
+        new_index[old_index[i]] = i;
+    }
+    {
+        TC_MEMORY_TAG("mpm3.particles");
+        particles.permute(old_index);
+    }
+    for (auto &material : materials) {
+        material->permute_particles(old_index);
+    }
+    scheduler.remap_particles(new_index);
+}
+
+void MPM3D::calculate_kernels() {
+    if (!MPM3Particles::stores_kernels) {
+        return;
+    }
+    TC_MEMORY_TAG("mpm3.particles");
+    particles.kernels.resize(particles.size());
+    parallel_for_each_active_particle([&](int p) {
+        particles.kernels[p].calculate(particles.pos[p]);
     });
 }
 
+void MPM3D::update_active_particles_by_material() {
+    active_particles_by_material.resize(materials.size());
+    for (auto &group : active_particles_by_material) {
+        group.clear();
+    }
+    for (auto p : scheduler.get_active_particles()) {
+        active_particles_by_material[particles.material[p]].push_back(p);
+    }
+}
+
 void MPM3D::substep() {
-    if (!particles.empty()) {
-        /*
-        for (auto &p : particles) {
-            p.calculate_kernels();
-        }
-        */
-
-        scheduler.update_particle_groups();
-        scheduler.reset_particle_states();
-//        int64 original_t_int_increment;
-//        int64 t_int_increment;
-        old_t_int = current_t_int;
-        if (async) {
-            scheduler.reset();
-            scheduler.update_dt_limits(current_t);
+    // A distributed rank takes part even without particles, for the collective communication
+    if (!particles.empty() || domain.is_distributed()) {
+        Profiler::Scope substep_scope(profiler, "substep");
+        TC_MEMORY_TAG("mpm3");
+        // Rough memory traffic of each phase, for telling bandwidth-bound phases apart
+        const uint64 node_bytes = sizeof(MPM3GridNode);
+        const uint64 kernel_bytes = MPM3Particles::stores_kernels ? sizeof(MPM3Kernel) : 0;
+        const uint64 stored_matrix_bytes = sizeof(MPM3Particles::StoredMatrix);
+        const uint64 p2g_particle_bytes = 2 * sizeof(Vector) + stored_matrix_bytes + sizeof(real) + kernel_bytes +
+                                          (fused_p2g ? sizeof(Matrix) : 0);
+        const uint64 g2p_particle_bytes = 2 * sizeof(Vector) + kernel_bytes + 2 * stored_matrix_bytes +
+                                          2 * sizeof(Matrix);
+
+        {
+            Profiler::Scope _(profiler, "binning", particles.size() * (sizeof(Vector) + sizeof(int)));
+            {
+                TC_MEMORY_TAG("mpm3.scheduler");
+                scheduler.update_particle_groups();
+            }
+            if (reorder_interval > 0 && substep_counter % reorder_interval == 0) {
+                reorder_particles();
+            }
+        }
+        if (adaptive_sampling_interval > 0 && substep_counter % adaptive_sampling_interval == 0) {
+            Profiler::Scope _(profiler, "adaptive_sampling");
+            adapt_particle_sampling();
+        }
+        substep_counter++;
+        {
+            Profiler::Scope _(profiler, "scheduling", particles.size() * (sizeof(int) + sizeof(int64)));
+            TC_MEMORY_TAG("mpm3.scheduler");
+            scheduler.reset_particle_states();
+            old_t_int = current_t_int;
+            if (async) {
+                scheduler.reset();
+                scheduler.update_particle_dt_limits();
+                domain.exchange_ghost_columns(scheduler.min_vel);
+                domain.exchange_ghost_columns(scheduler.max_vel);
+                scheduler.update_cfl_dt_limits(current_t);
 
-            original_t_int_increment = std::min(get_largest_pot(int64(maximum_delta_t / base_delta_t)),
-                                                scheduler.update_max_dt_int(current_t_int));
+                // All ranks advance by the globally smallest step, and agree on the step sizes of
+                // the blocks next to the cuts
+                original_t_int_increment = std::min(get_largest_pot(int64(maximum_delta_t / base_delta_t)),
+                                                    domain.all_reduce_min(scheduler.update_max_dt_int(current_t_int)));
+                domain.exchange_ghost_columns(scheduler.max_dt_int);
 
-            t_int_increment = original_t_int_increment - current_t_int % original_t_int_increment;
+                t_int_increment = original_t_int_increment - current_t_int % original_t_int_increment;
 
-            current_t_int += t_int_increment;
-            current_t = current_t_int * base_delta_t;
+                current_t_int += t_int_increment;
+                current_t = current_t_int * base_delta_t;
 
-            scheduler.set_time(current_t_int);
+                scheduler.set_time(current_t_int);
 
-            scheduler.expand(false, true);
-        } else {
-            // sync
-            t_int_increment = 1;
-            scheduler.states = 2;
-            for (auto &p : particles) {
-                p->state = MPM3Particle::UPDATING;
-            }
-            current_t_int += t_int_increment;
-            current_t = current_t_int * base_delta_t;
-        }
-        scheduler.update();
-//        P(scheduler.active_grid_points.size());
-//        P(scheduler.active_particles.size());
-
-        rasterize();
-        grid_backup_velocity();
-        grid_apply_external_force(gravity, t_int_increment * base_delta_t);
-        apply_deformation_force(t_int_increment * base_delta_t);
-        grid_apply_boundary_conditions(levelset, current_t);
-        resample();
-        parallel_for_each_particle([&](MPM3Particle &p) {
-            if (p.state == MPM3Particle::UPDATING) {
-                p.pos += (current_t_int - p.last_update) * base_delta_t * p.v;
-                p.last_update = current_t_int;
-                p.pos.x = clamp(p.pos.x, 0.0f, res[0] - eps);
-                p.pos.y = clamp(p.pos.y, 0.0f, res[1] - eps);
-                p.pos.z = clamp(p.pos.z, 0.0f, res[2] - eps);
-                p.plasticity();
+                scheduler.expand(false, true);
+                domain.exchange_ghost_columns(scheduler.states);
+                domain.clear_remote_columns(scheduler.states, 0);
+            } else {
+                // sync
+                t_int_increment = 1;
+                scheduler.states = 2;
+                domain.clear_remote_columns(scheduler.states, 0);
+                for (auto &state : particles.state) {
+                    state = MPM3Particles::UPDATING;
+                }
+                current_t_int += t_int_increment;
+                current_t = current_t_int * base_delta_t;
             }
-        });
-        particle_collision_resolution(current_t);
+            scheduler.update();
+            update_grid_occupancy();
+            update_active_particles_by_material();
+        }
+        const uint64 num_active_particles = scheduler.get_active_particles().size();
+        const uint64 num_active_nodes = scheduler.get_active_grid_points().size();
+        {
+            Profiler::Scope _(profiler, "kernels", num_active_particles * (sizeof(Vector) + kernel_bytes));
+            calculate_kernels();
+        }
+        {
+            Profiler::Scope _(profiler, "p2g", num_active_particles * p2g_particle_bytes + num_active_nodes * node_bytes);
+            if (fused_p2g) {
+                rasterize_fused(t_int_increment * base_delta_t);
+            } else {
+                rasterize();
+            }
+        }
+        {
+            Profiler::Scope _(profiler, "grid_update", 2 * num_active_nodes * node_bytes);
+            if (!fused_p2g) {
+                grid_backup_velocity();
+            }
+            grid_apply_external_force(gravity, t_int_increment * base_delta_t);
+        }
+        if (implicit) {
+            Profiler::Scope _(profiler, "implicit_solve");
+            implicit_grid_update(t_int_increment * base_delta_t);
+        } else if (!fused_p2g) {
+            Profiler::Scope _(profiler, "forces",
+                              num_active_particles * (2 * sizeof(Matrix) + kernel_bytes) +
+                              num_active_nodes * node_bytes);
+            apply_deformation_force(t_int_increment * base_delta_t);
+        }
+        {
+            Profiler::Scope _(profiler, "boundary_conditions", 2 * num_active_nodes * node_bytes);
+            grid_apply_boundary_conditions(levelset, current_t);
+        }
+        {
+            Profiler::Scope _(profiler, "g2p", num_active_particles * g2p_particle_bytes + num_active_nodes * node_bytes);
+            resample();
+        }
+        {
+            Profiler::Scope _(profiler, "advection",
+                              particles.size() * (2 * sizeof(Vector) + sizeof(int64) + sizeof(int)));
+            parallel_for_each_particle([&](int p) {
+                if (particles.state[p] == MPM3Particles::UPDATING) {
+                    Vector &pos = particles.pos[p];
+                    pos += (current_t_int - particles.last_update[p]) * base_delta_t * particles.v[p];
+                    particles.last_update[p] = current_t_int;
+                    pos.x = clamp(pos.x, 0.0f, res[0] - eps);
+                    pos.y = clamp(pos.y, 0.0f, res[1] - eps);
+                    pos.z = clamp(pos.z, 0.0f, res[2] - eps);
+                }
+            });
+        }
+        {
+            Profiler::Scope _(profiler, "plasticity", num_active_particles * 2 * (sizeof(Matrix) + stored_matrix_bytes));
+            for (int m = 0; m < (int)materials.size(); m++) {
+                std::vector<int> &group = active_particles_by_material[m];
+                group.erase(std::remove_if(group.begin(), group.end(), [&](int p) {
+                    return particles.state[p] != MPM3Particles::UPDATING;
+                }), group.end());
+                materials[m]->plasticity(particles, group, num_threads);
+                if (async) {
+                    materials[m]->update_allowed_dt(particles, group, num_threads);
+                }
+            }
+        }
+        {
+            Profiler::Scope _(profiler, "collision", num_active_particles * 2 * sizeof(Vector));
+            particle_collision_resolution(current_t);
+        }
         if (async) {
+            Profiler::Scope _(profiler, "dt_smoothing");
             scheduler.enforce_smoothness(original_t_int_increment);
         }
+        if (domain.is_distributed()) {
+            Profiler::Scope _(profiler, "migration");
+            TC_MEMORY_TAG("mpm3.particles");
+            migrate_particles();
+        }
+    }
+}
+
+// Bump whenever the layout written by save_checkpoint changes
+const int mpm3_checkpoint_version = 1;
+const uint64 mpm3_checkpoint_magic = 0x4b43334d504d4354ull; // "TCMPM3CK"
+
+static void write_config(BinaryFileStreamOutput &os, const Config &config) {
+    std::vector<std::string> keys = config.get_keys();
+    os << uint64(keys.size());
+    for (auto &key : keys) {
+        os << key << config.get_string(key);
+    }
+}
+
+static Config read_config(BinaryFileStreamInput &is) {
+    Config config;
+    uint64 num_keys = is.read<uint64>();
+    for (uint64 i = 0; i < num_keys; i++) {
+        std::string key = is.read<std::string>();
+        config.set(key, is.read<std::string>());
+    }
+    return config;
+}
+
+std::string MPM3D::get_checkpoint_file_name(const std::string &fn) const {
+    if (!domain.is_distributed()) {
+        return fn;
+    }
+    return fn + "." + std::to_string(domain.rank);
+}
+
+void MPM3D::save_checkpoint(const std::string &fn_) const {
+    const std::string fn = get_checkpoint_file_name(fn_);
+    // Write to a temporary file first so that a preemption never leaves a truncated checkpoint
+    std::string tmp_fn = fn + ".tmp";
+    {
+        BinaryFileStreamOutput os(tmp_fn);
+        os << mpm3_checkpoint_magic << mpm3_checkpoint_version;
+        write_config(os, initial_config);
+        os << current_t << request_t << current_t_int << original_t_int_increment << t_int_increment
+           << old_t_int << substep_counter;
+        particles.write(os);
+        os << uint64(materials.size());
+        for (int m = 0; m < (int)materials.size(); m++) {
+            os << materials[m]->get_name();
+            write_config(os, material_configs[m]);
+            materials[m]->write_state(os);
+        }
+        scheduler.write(os);
+        os.close();
+    }
+    assert_info(std::rename(tmp_fn.c_str(), fn.c_str()) == 0, "Can not move checkpoint to " + fn);
+}
+
+// In distributed runs the simulator has to be initialized with the communicator first, so that
+// each rank finds its own file
+void MPM3D::load_checkpoint(const std::string &fn_) {
+    const std::string fn = get_checkpoint_file_name(fn_);
+    BinaryFileStreamInput is(fn);
+    assert_info(is.read<uint64>() == mpm3_checkpoint_magic, fn + " is not an MPM3D checkpoint");
+    int version = is.read<int>();
+    assert_info(version == mpm3_checkpoint_version,
+                "Unsupported MPM3D checkpoint version " + std::to_string(version));
+    initialize(read_config(is));
+    is >> current_t >> request_t >> current_t_int >> original_t_int_increment >> t_int_increment
+       >> old_t_int >> substep_counter;
+    particles.read(is);
+    materials.clear();
+    material_configs.clear();
+    uint64 num_materials = is.read<uint64>();
+    for (uint64 m = 0; m < num_materials; m++) {
+        auto material = create_mpm3_material(is.read<std::string>());
+        Config material_config = read_config(is);
+        material->initialize(material_config);
+        material->read_state(is);
+        materials.push_back(material);
+        material_configs.push_back(material_config);
     }
+    scheduler.read(is);
+    dirty_grid_blocks.clear();
 }
 
 bool MPM3D::test() const {
@@ -19,6 +19,7 @@
 #include <taichi/common/meta.h>
 #include <taichi/dynamics/simulation3d.h>
 #include <taichi/math/array_3d.h>
+#include <taichi/math/sparse_grid_3d.h>
 #include <taichi/math/qr_svd.h>
 #include <taichi/math/levelset_3d.h>
 #include <taichi/math/dynamic_levelset_3d.h>
@@ -26,9 +27,30 @@
 
 #include "mpm3_scheduler.h"
 #include "mpm3_particle.h"
+#include "mpm3_domain.h"
 
 TC_NAMESPACE_BEGIN
 
+struct MPM3GridNode {
+    Vector3 velocity;
+    real mass;
+    Vector3 velocity_backup;
+    Spinlock lock;
+
+    MPM3GridNode() : velocity(0.0f), mass(0.0f), velocity_backup(0.0f) {}
+};
+
+// Per grid node state of the implicit solve: the velocity before the elastic forces, the Newton update and the
+// vectors of its preconditioned CG solve
+struct MPM3ImplicitNode {
+    Vector3 v_star;
+    Vector3 delta;
+    Vector3 r, p, q;
+    real inv_diag;
+
+    MPM3ImplicitNode() : v_star(0.0f), delta(0.0f), r(0.0f), p(0.0f), q(0.0f), inv_diag(0.0f) {}
+};
+
 class MPM3D : public Simulation3D {
 protected:
     typedef Vector3 Vector;
@@ -38,18 +60,51 @@ public:
     static const int D = 3;
 
 public:
-    std::vector<MPM3Particle *> particles; // for efficiency
-    Array3D<Vector> grid_velocity;
-    Array3D<Vector> grid_velocity_backup;
-    Array3D<Spinlock> grid_locks;
-    Array3D<real> grid_mass;
+    MPM3Particles particles;
+    std::vector<std::shared_ptr<MPM3Material>> materials;
+    // The configs the simulator and each material were created with, kept for checkpoints
+    Config initial_config;
+    std::vector<Config> material_configs;
+    // Active particles bucketed by material, rebuilt every substep
+    std::vector<std::vector<int>> active_particles_by_material;
+    // Nodes [0, res] in each dimension, paged by scheduler block
+    SparseGrid3D<MPM3GridNode, mpm3d_grid_block_size> grid;
+    // Grid blocks within reach of active particles, in the order they were found
+    std::vector<Vector3i> grid_blocks;
+    // Grid blocks written since they were last cleared
+    std::vector<Vector3i> dirty_grid_blocks;
+    // Level set queries at the active grid points, for the boundary conditions
+    std::vector<DynamicLevelSet3D::Query> boundary_queries;
+    // Only keep grid_blocks resident
+    bool sparse_grid;
     Vector3i res;
     int max_dim;
     Vector gravity;
     bool apic;
+    // Scatter per scheduler block into local scratch grids instead of locking every node
+    bool block_p2g;
+    // Compute stress inside the P2G scatter instead of in separate force passes
+    bool fused_p2g;
+    // Backward Euler for the elastic forces, with grid velocities from a matrix-free Newton-CG solve; sync only
+    bool implicit;
+    int implicit_newton_iterations;
+    int implicit_max_iterations;
+    real implicit_tolerance;
+    // Over grid_blocks, while implicit
+    SparseGrid3D<MPM3ImplicitNode, mpm3d_grid_block_size> implicit_grid;
+    // Per active particle, the deformation gradient of the current Newton iterate
+    std::vector<Matrix> implicit_dg;
 
     bool async;
     real affine_damping;
+    // Substeps between reorderings of the particle storage by block, 0 to disable
+    int reorder_interval;
+    // Substeps between adaptive resamplings of the particles, 0 to disable
+    int adaptive_sampling_interval;
+    // Cells with particles are split below and merged above these counts
+    int min_particles_per_cell;
+    int max_particles_per_cell;
+    int64 substep_counter = 0;
     real base_delta_t;
     real maximum_delta_t;
     real cfl;
@@ -60,6 +115,9 @@ public:
     int64 t_int_increment;
     int64 old_t_int;
     MPM3Scheduler scheduler;
+    // The slab of block columns this process simulates; a single slab unless a distributed
+    // `communicator` is configured
+    MPM3Domain domain;
 
     Region get_bounded_rasterization_region(Vector p) {
         assert_info(is_normal(p.x) && is_normal(p.y) && is_normal(p.z),
@@ -91,47 +149,164 @@ public:
 
     void rasterize();
 
+    void rasterize_blocked();
+
+    // rasterize(), grid_backup_velocity() and apply_deformation_force() in a single scatter
+    void rasterize_fused(real delta_t);
+
     void resample();
 
+    // Computes grid_blocks and, for sparse grids, allocates exactly these blocks
+    void update_grid_occupancy();
+
+    // Resets the blocks dirtied in the previous substep, making all of grid_blocks zero
+    void clear_dirty_grid_blocks();
+
     void grid_backup_velocity() {
-        grid_velocity_backup = grid_velocity;
+        parallel_for_each_grid_node([](const Index3D &ind, MPM3GridNode &node) {
+            node.velocity_backup = node.velocity;
+        });
     }
 
     void apply_deformation_force(float delta_t);
 
+    void apply_deformation_force_blocked(float delta_t);
+
+    // Replaces apply_deformation_force: solves M (v - v*) = delta_t f(x + delta_t v) for the grid velocities v,
+    // starting from v* (the velocities with gravity), by Newton iterations with Jacobi-preconditioned CG. The
+    // stiffness is applied matrix-free, from central differences of the particle stresses.
+    void implicit_grid_update(real delta_t);
+
+    // Newton iteration: implicit_dg and tmp_force for the current velocities, and the residual, into r, and the
+    // Jacobi preconditioner
+    void implicit_update_residual(real delta_t);
+
+    // q = H p, for the Hessian H of the current Newton iterate
+    void implicit_apply_hessian(real delta_t);
+
+    // `target(MPM3GridNode &, MPM3ImplicitNode &)` for every node of grid_blocks
+    template <typename T>
+    void parallel_for_each_implicit_node(const T &target) {
+        ThreadedTaskManager::run((int)grid_blocks.size(), num_threads, [&](int i) {
+            MPM3ImplicitNode *page = implicit_grid.get_page(grid_blocks[i]);
+            grid.for_each_node(grid_blocks[i], [&](const Index3D &ind, MPM3GridNode &node) {
+                target(node, page[implicit_grid.get_local_index(ind.i, ind.j, ind.k)]);
+            });
+        });
+    }
+
+    // Of `f(const MPM3GridNode &, const MPM3ImplicitNode &)` over the nodes of grid_blocks, independent of
+    // num_threads
+    template <typename F, typename C>
+    double implicit_reduce(const F &f, const C &combine) {
+        return parallel_reduce(0, (int)grid_blocks.size(), num_threads, 0.0, [&](int i) {
+            double acc = 0.0;
+            const MPM3ImplicitNode *page = implicit_grid.get_page(grid_blocks[i]);
+            grid.for_each_node(grid_blocks[i], [&](const Index3D &ind, MPM3GridNode &node) {
+                acc = combine(acc, f(node, page[implicit_grid.get_local_index(ind.i, ind.j, ind.k)]));
+            });
+            return acc;
+        }, combine, true);
+    }
+
     void grid_apply_boundary_conditions(const DynamicLevelSet3D &levelset, real t);
 
     void grid_apply_external_force(Vector acc, real delta_t) {
-        for (auto &ind : grid_mass.get_region()) {
-            if (grid_mass[ind] > 0) // Do not use EPS here!!
-                grid_velocity[ind] += delta_t * acc;
-        }
+        parallel_for_each_grid_node([&](const Index3D &ind, MPM3GridNode &node) {
+            if (node.mass > 0) // Do not use EPS here!!
+                node.velocity += delta_t * acc;
+        });
     }
 
     void particle_collision_resolution(real t);
 
+    // Adds the neighbouring ranks' contributions to the nodes both sides scatter to,
+    // between the P2G scatter and the normalization
+    void exchange_ghost_grid_nodes();
+
+    // Hands the particles that left the slab over to the rank owning their new block column
+    void migrate_particles();
+
+    // Drops the particles [0, n) flagged in `removed` and moves the particles from n on into the ranges of their
+    // materials, with the material attributes of particle n + i at appended_attributes[appended_attribute_offset[i]]
+    void rebuild_particle_storage(int n, const std::vector<char> &removed, const std::vector<real> &appended_attributes,
+                                  const std::vector<int> &appended_attribute_offset);
+
+    // Merges the closest particles of cells with more than max_particles_per_cell, and splits those of cells
+    // with fewer than min_particles_per_cell along their largest stretch. Mass, momentum and the affine
+    // angular momentum are conserved, and particle masses stay within [1/2, 2] of the seeded one.
+    void adapt_particle_sampling();
+
+    // Every rank of a distributed run reads and writes its own checkpoint file
+    std::string get_checkpoint_file_name(const std::string &fn) const;
+
+    void update_active_particles_by_material();
+
+    void reorder_particles();
+
+    // Positions stay fixed from here until the end of resample()
+    void calculate_kernels();
+
     void substep();
 
+    // `target` receives the particle index
     template <typename T>
     void parallel_for_each_particle(const T &target) {
-        ThreadedTaskManager::run((int)particles.size(), num_threads, [&](int i) {
-            target(*particles[i]);
+        ThreadedTaskManager::run(particles.size(), num_threads, [&](int i) {
+            target(i);
+        });
+    }
+
+    // Visits active blocks one 2x2x2 parity class at a time. Blocks of the same parity are
+    // two blocks apart, wider than the (block_size + 3)^3 stencil footprint, so `target`
+    // can write to the grid nodes around its block without synchronization.
+    template <typename T>
+    void parallel_for_each_active_block_colored(const T &target) {
+        const std::vector<Vector3i> &active_blocks = scheduler.get_active_blocks();
+        std::vector<Vector3i> colored_blocks;
+        for (int color = 0; color < 8; color++) {
+            colored_blocks.clear();
+            for (auto &block : active_blocks) {
+                if ((block.x & 1) * 4 + (block.y & 1) * 2 + (block.z & 1) == color) {
+                    colored_blocks.push_back(block);
+                }
+            }
+            ThreadedTaskManager::run((int)colored_blocks.size(), num_threads, [&](int i) {
+                target(colored_blocks[i], scheduler.get_particle_group(colored_blocks[i]));
+            });
+        }
+    }
+
+    // `target(const Index3D &, MPM3GridNode &)` for every node of grid_blocks
+    template <typename T>
+    void parallel_for_each_grid_node(const T &target) {
+        ThreadedTaskManager::run((int)grid_blocks.size(), num_threads, [&](int i) {
+            grid.for_each_node(grid_blocks[i], target);
         });
     }
 
     template <typename T>
     void parallel_for_each_active_particle(const T &target) {
-        ThreadedTaskManager::run((int)scheduler.get_active_particles().size(), num_threads, [&](int i) {
-            target(*scheduler.get_active_particles()[i]);
+        const std::vector<int> &active_particles = scheduler.get_active_particles();
+        ThreadedTaskManager::run((int)active_particles.size(), num_threads, [&](int i) {
+            target(active_particles[i]);
         });
     }
 
+    // Particle i as rendered, with its position synchronized to the current time
+    RenderParticle get_render_particle(int i) const;
+
 public:
 
     MPM3D() {}
 
     virtual void initialize(const Config &config) override;
 
+    virtual void set_num_threads(int num_threads) override {
+        Simulation3D::set_num_threads(num_threads);
+        scheduler.num_threads = num_threads;
+    }
+
     virtual void add_particles(const Config &config) override;
 
     virtual void step(real dt) override {
@@ -147,13 +322,17 @@ public:
         }
     }
 
+    // Particle output only covers the particles of this rank
     std::vector<RenderParticle> get_render_particles() const override;
 
-    ~MPM3D() {
-        for (auto &p : particles) {
-            delete p;
-        }
-    }
+    // Splats per cell of the scheduler blocks, which are subdivided, or merged, to fit the budget
+    std::vector<RenderParticle> get_preview_particles(int budget) const override;
+
+    void get_particle_frame(ParticleFrame &frame) const override;
+
+    void save_checkpoint(const std::string &fn) const override;
+
+    void load_checkpoint(const std::string &fn) override;
 };
 
 TC_NAMESPACE_END
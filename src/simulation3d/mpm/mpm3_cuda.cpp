@@ -0,0 +1,248 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#ifdef TC_USE_CUDA
+
+#include "mpm3.h"
+#include "mpm3_cuda.h"
+
+TC_NAMESPACE_BEGIN
+
+// MPM3D with the synchronous fused substep running on a CUDA device (see mpm3_cuda.cu).
+// Seeding, materials and checkpoints are the host MPM3D code. The particles stay on the device
+// while stepping, and are copied back only when the host needs them: for rendering, particle
+// frames, checkpoints and adding particles.
+// Only "ep" and "dp" materials are supported, and the device grid is dense.
+class MPM3DCuda : public MPM3D {
+protected:
+    MPM3CudaSolver solver;
+    // The device has the current particles
+    bool device_valid = false;
+    // The host storage has the current particles
+    mutable bool host_valid = true;
+
+    static void store_matrix(const Matrix &m, float *a) {
+        for (int r = 0; r < 3; r++) {
+            for (int c = 0; c < 3; c++) {
+                a[r * 3 + c] = m[c][r];
+            }
+        }
+    }
+
+    static Matrix load_matrix(const float *a) {
+        Matrix m;
+        for (int r = 0; r < 3; r++) {
+            for (int c = 0; c < 3; c++) {
+                m[c][r] = a[r * 3 + c];
+            }
+        }
+        return m;
+    }
+
+    void upload_materials() {
+        std::vector<MPM3CudaMaterial> device_materials(materials.size());
+        for (int m = 0; m < (int)materials.size(); m++) {
+            MPM3CudaMaterial &d = device_materials[m];
+            if (auto ep = dynamic_cast<const EPMaterial3 *>(materials[m].get())) {
+                d.type = MPM3CudaMaterial::SNOW;
+                d.mu_0 = ep->mu_0;
+                d.lambda_0 = ep->lambda_0;
+                d.hardening = ep->hardening;
+                d.theta_c = ep->theta_c;
+                d.theta_s = ep->theta_s;
+            } else if (auto dp = dynamic_cast<const DPMaterial3 *>(materials[m].get())) {
+                d.type = MPM3CudaMaterial::SAND;
+                d.mu_0 = dp->mu_0;
+                d.lambda_0 = dp->lambda_0;
+                d.h_0 = dp->h_0;
+                d.h_1 = dp->h_1;
+                d.h_2 = dp->h_2;
+                d.h_3 = dp->h_3;
+            } else {
+                error("mpm_cuda does not support material " + materials[m]->get_name());
+            }
+        }
+        solver.set_materials(device_materials);
+    }
+
+    void synchronize_device() {
+        if (device_valid) {
+            return;
+        }
+        upload_materials();
+        MPM3CudaParticleBuffer buffer;
+        buffer.resize(particles.size());
+        for (int i = 0; i < particles.size(); i++) {
+            for (int d = 0; d < 3; d++) {
+                buffer.pos[i * 3 + d] = particles.pos[i][d];
+                buffer.v[i * 3 + d] = particles.v[i][d];
+            }
+            store_matrix(Matrix(particles.apic_b[i]), &buffer.apic_b[i * 9]);
+            store_matrix(particles.dg_e[i], &buffer.dg_e[i * 9]);
+            store_matrix(Matrix(particles.dg_p[i]), &buffer.dg_p[i * 9]);
+            buffer.mass[i] = particles.mass[i];
+            buffer.vol[i] = particles.vol[i];
+            buffer.material[i] = particles.material[i];
+            real attributes[2] = {0.0f, 0.0f};
+            const MPM3Material &material = *materials[particles.material[i]];
+            if (material.get_num_particle_attributes() == 2) {
+                material.get_particle_attributes(i, attributes);
+            }
+            buffer.alpha[i] = attributes[0];
+            buffer.q[i] = attributes[1];
+        }
+        solver.upload_particles(buffer);
+        device_valid = true;
+    }
+
+    // Logically const: the particles are the same, only their host copy gets refreshed
+    void synchronize_host() const {
+        if (host_valid) {
+            return;
+        }
+        MPM3DCuda *self = const_cast<MPM3DCuda *>(this);
+        MPM3Particles &p = self->particles;
+        MPM3CudaParticleBuffer buffer;
+        solver.download_particles(buffer);
+        for (int i = 0; i < p.size(); i++) {
+            p.pos[i] = Vector(buffer.pos[i * 3], buffer.pos[i * 3 + 1], buffer.pos[i * 3 + 2]);
+            p.v[i] = Vector(buffer.v[i * 3], buffer.v[i * 3 + 1], buffer.v[i * 3 + 2]);
+            p.apic_b[i] = load_matrix(&buffer.apic_b[i * 9]);
+            p.dg_e[i] = load_matrix(&buffer.dg_e[i * 9]);
+            p.dg_p[i] = load_matrix(&buffer.dg_p[i * 9]);
+            p.state[i] = MPM3Particles::UPDATING;
+            p.last_update[i] = current_t_int;
+            MPM3Material &material = *self->materials[p.material[i]];
+            if (material.get_num_particle_attributes() == 2) {
+                const real attributes[2] = {buffer.alpha[i], buffer.q[i]};
+                material.set_particle_attributes(i, attributes);
+            }
+        }
+        host_valid = true;
+    }
+
+    // With profiling on, waits for the phase so that its time is attributed correctly
+    template <typename T>
+    void run_phase(const char *name, const T &phase) {
+        Profiler::Scope _(profiler, name);
+        phase();
+        if (profiler.enabled) {
+            solver.synchronize();
+        }
+    }
+
+    void substep_on_device() {
+        if (particles.empty()) {
+            return;
+        }
+        synchronize_device();
+        Profiler::Scope substep_scope(profiler, "substep");
+        substep_counter++;
+        old_t_int = current_t_int;
+        t_int_increment = 1;
+        current_t_int += t_int_increment;
+        current_t = current_t_int * base_delta_t;
+        run_phase("sorting", [&]() {
+            solver.sort_particles();
+        });
+        run_phase("p2g", [&]() {
+            solver.rasterize();
+        });
+        run_phase("grid_update", [&]() {
+            solver.update_grid(current_t);
+        });
+        run_phase("g2p", [&]() {
+            solver.resample(current_t);
+        });
+        host_valid = false;
+    }
+
+public:
+    void initialize(const Config &config) override {
+        MPM3D::initialize(config);
+        assert_info(!async, "mpm_cuda only supports synchronous stepping");
+        assert_info(!domain.is_distributed(), "mpm_cuda does not support distributed runs");
+        MPM3CudaParameters parameters;
+        for (int d = 0; d < 3; d++) {
+            parameters.res[d] = res[d];
+            parameters.gravity[d] = gravity[d];
+        }
+        parameters.delta_t = base_delta_t;
+        parameters.apic = apic;
+        parameters.affine_damping = affine_damping;
+        solver.initialize(parameters);
+    }
+
+    void set_levelset(const DynamicLevelSet3D &levelset) override {
+        MPM3D::set_levelset(levelset);
+        assert_info(!levelset.is_sparse(), "mpm_cuda needs dense level sets");
+        const LevelSet3D &ls0 = *levelset.levelset0, &ls1 = *levelset.levelset1;
+        assert_info(ls0.get_width() == ls1.get_width() && ls0.get_height() == ls1.get_height() &&
+                    ls0.get_depth() == ls1.get_depth(), "mpm_cuda needs both level sets at the same resolution");
+        MPM3CudaLevelSet device_levelset;
+        device_levelset.res[0] = ls0.get_width();
+        device_levelset.res[1] = ls0.get_height();
+        device_levelset.res[2] = ls0.get_depth();
+        for (int d = 0; d < 3; d++) {
+            device_levelset.storage_offset[d] = ls0.get_storage_offset()[d];
+        }
+        device_levelset.t0 = levelset.t0;
+        device_levelset.t1 = levelset.t1;
+        device_levelset.friction = ls0.friction;
+        device_levelset.phi0 = ls0.get_data().data();
+        device_levelset.phi1 = ls1.get_data().data();
+        solver.set_levelset(device_levelset);
+    }
+
+    void add_particles(const Config &config) override {
+        synchronize_host();
+        MPM3D::add_particles(config);
+        device_valid = false;
+    }
+
+    void step(real dt) override {
+        if (dt < 0) {
+            substep_on_device();
+            request_t = current_t;
+        } else {
+            request_t += dt;
+            while (current_t + base_delta_t < request_t) {
+                substep_on_device();
+            }
+            P(t_int_increment * base_delta_t);
+        }
+    }
+
+    std::vector<RenderParticle> get_render_particles() const override {
+        synchronize_host();
+        return MPM3D::get_render_particles();
+    }
+
+    void get_particle_frame(ParticleFrame &frame) const override {
+        synchronize_host();
+        MPM3D::get_particle_frame(frame);
+    }
+
+    void save_checkpoint(const std::string &fn) const override {
+        synchronize_host();
+        MPM3D::save_checkpoint(fn);
+    }
+
+    void load_checkpoint(const std::string &fn) override {
+        MPM3D::load_checkpoint(fn);
+        host_valid = true;
+        device_valid = false;
+    }
+};
+
+TC_IMPLEMENTATION(Simulation3D, MPM3DCuda, "mpm_cuda");
+
+TC_NAMESPACE_END
+
+#endif
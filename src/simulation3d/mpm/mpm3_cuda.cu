@@ -0,0 +1,907 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+// Device implementation of the synchronous MPM3D substep. The math follows the fused host
+// pipeline (mpm3.cpp with fused_p2g) term by term; see there for the derivations.
+
+#include "mpm3_cuda.h"
+#include "../cuda_utils.cuh"
+#include <cuda_runtime.h>
+#include <thrust/device_ptr.h>
+#include <thrust/gather.h>
+#include <thrust/sequence.h>
+#include <thrust/sort.h>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+namespace taichi {
+
+// Row-major 3x3 matrix
+struct Mat3 {
+    float a[9];
+};
+
+__device__ __forceinline__ float &at(Mat3 &m, int r, int c) {
+    return m.a[r * 3 + c];
+}
+
+__device__ __forceinline__ float at(const Mat3 &m, int r, int c) {
+    return m.a[r * 3 + c];
+}
+
+__device__ __forceinline__ Mat3 diag(float x, float y, float z) {
+    Mat3 m;
+    for (int i = 0; i < 9; i++) {
+        m.a[i] = 0.0f;
+    }
+    m.a[0] = x;
+    m.a[4] = y;
+    m.a[8] = z;
+    return m;
+}
+
+__device__ __forceinline__ Mat3 operator*(const Mat3 &x, const Mat3 &y) {
+    Mat3 m;
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 3; c++) {
+            at(m, r, c) = at(x, r, 0) * at(y, 0, c) + at(x, r, 1) * at(y, 1, c) + at(x, r, 2) * at(y, 2, c);
+        }
+    }
+    return m;
+}
+
+__device__ __forceinline__ Mat3 operator*(float s, const Mat3 &x) {
+    Mat3 m;
+    for (int i = 0; i < 9; i++) {
+        m.a[i] = s * x.a[i];
+    }
+    return m;
+}
+
+__device__ __forceinline__ Mat3 operator+(const Mat3 &x, const Mat3 &y) {
+    Mat3 m;
+    for (int i = 0; i < 9; i++) {
+        m.a[i] = x.a[i] + y.a[i];
+    }
+    return m;
+}
+
+__device__ __forceinline__ Mat3 operator-(const Mat3 &x, const Mat3 &y) {
+    Mat3 m;
+    for (int i = 0; i < 9; i++) {
+        m.a[i] = x.a[i] - y.a[i];
+    }
+    return m;
+}
+
+__device__ __forceinline__ float3 operator*(const Mat3 &m, const float3 &v) {
+    return make_float3(at(m, 0, 0) * v.x + at(m, 0, 1) * v.y + at(m, 0, 2) * v.z,
+                       at(m, 1, 0) * v.x + at(m, 1, 1) * v.y + at(m, 1, 2) * v.z,
+                       at(m, 2, 0) * v.x + at(m, 2, 1) * v.y + at(m, 2, 2) * v.z);
+}
+
+__device__ __forceinline__ Mat3 transposed(const Mat3 &x) {
+    Mat3 m;
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 3; c++) {
+            at(m, r, c) = at(x, c, r);
+        }
+    }
+    return m;
+}
+
+__device__ __forceinline__ float det(const Mat3 &m) {
+    return at(m, 0, 0) * (at(m, 1, 1) * at(m, 2, 2) - at(m, 1, 2) * at(m, 2, 1)) -
+           at(m, 0, 1) * (at(m, 1, 0) * at(m, 2, 2) - at(m, 1, 2) * at(m, 2, 0)) +
+           at(m, 0, 2) * (at(m, 1, 0) * at(m, 2, 1) - at(m, 1, 1) * at(m, 2, 0));
+}
+
+__device__ __forceinline__ Mat3 inverse(const Mat3 &m) {
+    const float inv_det = 1.0f / det(m);
+    Mat3 o;
+    at(o, 0, 0) = (at(m, 1, 1) * at(m, 2, 2) - at(m, 1, 2) * at(m, 2, 1)) * inv_det;
+    at(o, 0, 1) = (at(m, 0, 2) * at(m, 2, 1) - at(m, 0, 1) * at(m, 2, 2)) * inv_det;
+    at(o, 0, 2) = (at(m, 0, 1) * at(m, 1, 2) - at(m, 0, 2) * at(m, 1, 1)) * inv_det;
+    at(o, 1, 0) = (at(m, 1, 2) * at(m, 2, 0) - at(m, 1, 0) * at(m, 2, 2)) * inv_det;
+    at(o, 1, 1) = (at(m, 0, 0) * at(m, 2, 2) - at(m, 0, 2) * at(m, 2, 0)) * inv_det;
+    at(o, 1, 2) = (at(m, 0, 2) * at(m, 1, 0) - at(m, 0, 0) * at(m, 1, 2)) * inv_det;
+    at(o, 2, 0) = (at(m, 1, 0) * at(m, 2, 1) - at(m, 1, 1) * at(m, 2, 0)) * inv_det;
+    at(o, 2, 1) = (at(m, 0, 1) * at(m, 2, 0) - at(m, 0, 0) * at(m, 2, 1)) * inv_det;
+    at(o, 2, 2) = (at(m, 0, 0) * at(m, 1, 1) - at(m, 0, 1) * at(m, 1, 0)) * inv_det;
+    return o;
+}
+
+// a b^T
+__device__ __forceinline__ Mat3 outer(const float3 &a, const float3 &b) {
+    Mat3 m;
+    const float av[3] = {a.x, a.y, a.z}, bv[3] = {b.x, b.y, b.z};
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 3; c++) {
+            at(m, r, c) = av[r] * bv[c];
+        }
+    }
+    return m;
+}
+
+__device__ __forceinline__ float3 operator+(const float3 &a, const float3 &b) {
+    return make_float3(a.x + b.x, a.y + b.y, a.z + b.z);
+}
+
+__device__ __forceinline__ float3 operator-(const float3 &a, const float3 &b) {
+    return make_float3(a.x - b.x, a.y - b.y, a.z - b.z);
+}
+
+__device__ __forceinline__ float3 operator*(float s, const float3 &a) {
+    return make_float3(s * a.x, s * a.y, s * a.z);
+}
+
+__device__ __forceinline__ float dot(const float3 &a, const float3 &b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+__device__ __forceinline__ float length(const float3 &a) {
+    return sqrtf(dot(a, a));
+}
+
+__device__ __forceinline__ float clampf(float x, float lower, float upper) {
+    return fminf(fmaxf(x, lower), upper);
+}
+
+// SVD m = u diag(sig) v^T with non-negative sig, as the host svd: v is a rotation, and for inverted
+// elements the sign of the last singular value is folded into u, which is then a reflection.
+// Jacobi eigenvectors of m^T m give v, and a Givens QR of m v gives u and sig, which keeps
+// small singular values accurate.
+__device__ void svd(const Mat3 &m, Mat3 &u, float sig[3], Mat3 &v) {
+    Mat3 s = transposed(m) * m;
+    v = diag(1.0f, 1.0f, 1.0f);
+    const int pairs[3][2] = {{0, 1}, {0, 2}, {1, 2}};
+    for (int sweep = 0; sweep < 6; sweep++) {
+        for (int k = 0; k < 3; k++) {
+            const int p = pairs[k][0], q = pairs[k][1];
+            const float s_pq = at(s, p, q);
+            if (fabsf(s_pq) < 1e-30f) {
+                continue;
+            }
+            const float theta = (at(s, q, q) - at(s, p, p)) / (2.0f * s_pq);
+            const float t = fabsf(theta) > 1e15f
+                                    ? 0.5f / theta
+                                    : copysignf(1.0f, theta) / (fabsf(theta) + sqrtf(theta * theta + 1.0f));
+            const float c = rsqrtf(t * t + 1.0f), sn = t * c;
+            at(s, p, p) -= t * s_pq;
+            at(s, q, q) += t * s_pq;
+            at(s, p, q) = at(s, q, p) = 0.0f;
+            const int r = 3 - p - q;
+            const float s_rp = at(s, r, p), s_rq = at(s, r, q);
+            at(s, r, p) = at(s, p, r) = c * s_rp - sn * s_rq;
+            at(s, r, q) = at(s, q, r) = sn * s_rp + c * s_rq;
+            for (int i = 0; i < 3; i++) {
+                const float v_ip = at(v, i, p), v_iq = at(v, i, q);
+                at(v, i, p) = c * v_ip - sn * v_iq;
+                at(v, i, q) = sn * v_ip + c * v_iq;
+            }
+        }
+    }
+    // Eigenvalues in descending order
+    float lambda[3] = {at(s, 0, 0), at(s, 1, 1), at(s, 2, 2)};
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2 - i; j++) {
+            if (lambda[j] < lambda[j + 1]) {
+                float tmp = lambda[j];
+                lambda[j] = lambda[j + 1];
+                lambda[j + 1] = tmp;
+                for (int r = 0; r < 3; r++) {
+                    tmp = at(v, r, j);
+                    at(v, r, j) = at(v, r, j + 1);
+                    at(v, r, j + 1) = tmp;
+                }
+            }
+        }
+    }
+    if (det(v) < 0.0f) {
+        for (int r = 0; r < 3; r++) {
+            at(v, r, 2) = -at(v, r, 2);
+        }
+    }
+    // Givens QR of b = m v, zeroing (1, 0), (2, 0) and (2, 1)
+    Mat3 b = m * v;
+    u = diag(1.0f, 1.0f, 1.0f);
+    const int rotations[3][3] = {{0, 1, 0}, {0, 2, 0}, {1, 2, 1}};
+    for (int k = 0; k < 3; k++) {
+        const int i = rotations[k][0], j = rotations[k][1], col = rotations[k][2];
+        const float x = at(b, i, col), y = at(b, j, col);
+        const float r = sqrtf(x * x + y * y);
+        if (r < 1e-30f) {
+            continue;
+        }
+        const float c = x / r, sn = y / r;
+        for (int l = 0; l < 3; l++) {
+            const float b_il = at(b, i, l), b_jl = at(b, j, l);
+            at(b, i, l) = c * b_il + sn * b_jl;
+            at(b, j, l) = -sn * b_il + c * b_jl;
+            const float u_li = at(u, l, i), u_lj = at(u, l, j);
+            at(u, l, i) = c * u_li + sn * u_lj;
+            at(u, l, j) = -sn * u_li + c * u_lj;
+        }
+    }
+    sig[0] = at(b, 0, 0);
+    sig[1] = at(b, 1, 1);
+    sig[2] = at(b, 2, 2);
+    // The rotations leave the first two non-negative
+    if (sig[2] < 0.0f) {
+        sig[2] = -sig[2];
+        for (int r = 0; r < 3; r++) {
+            at(u, r, 2) = -at(u, r, 2);
+        }
+    }
+}
+
+__device__ __forceinline__ Mat3 compose(const Mat3 &u, const float sig[3], const Mat3 &v) {
+    return u * diag(sig[0], sig[1], sig[2]) * transposed(v);
+}
+
+// Cubic B-spline weights over the 4 nodes base .. base + 3, as MPM3Kernel
+struct Kernel {
+    int base[3];
+    float w[3][4], dw[3][4];
+
+    __device__ Kernel(const float3 &pos) {
+        const float p[3] = {pos.x, pos.y, pos.z};
+        for (int d = 0; d < 3; d++) {
+            const int b = int(p[d]);
+            const float f = p[d] - b;
+            base[d] = b - 1;
+            const float f2 = f * f, f3 = f2 * f;
+            w[d][0] = -1.0f / 6.0f * f3 + 0.5f * f2 - 0.5f * f + 1.0f / 6.0f;
+            w[d][1] = 0.5f * f3 - f2 + 2.0f / 3.0f;
+            w[d][2] = -0.5f * f3 + 0.5f * f2 + 0.5f * f + 1.0f / 6.0f;
+            w[d][3] = 1.0f / 6.0f * f3;
+            dw[d][0] = -0.5f * f2 + f - 0.5f;
+            dw[d][1] = 1.5f * f2 - 2.0f * f;
+            dw[d][2] = -1.5f * f2 + f + 0.5f;
+            dw[d][3] = 0.5f * f2;
+        }
+    }
+
+    __device__ float get_w(int a, int b, int c) const {
+        return w[0][a] * w[1][b] * w[2][c];
+    }
+
+    __device__ float3 get_dw(int a, int b, int c) const {
+        return make_float3(dw[0][a] * w[1][b] * w[2][c], w[0][a] * dw[1][b] * w[2][c], w[0][a] * w[1][b] * dw[2][c]);
+    }
+};
+
+// Device copy of a MPM3CudaLevelSet
+struct LevelSetView {
+    int res[3];
+    float storage_offset[3];
+    float t0, t1, friction;
+    const float *phi0, *phi1;
+
+    __device__ float get(const float *phi, int i, int j, int k) const {
+        return phi[(i * res[1] + j) * res[2] + k];
+    }
+
+    // LevelSet3D::get and LevelSet3D::get_gradient in one pass
+    __device__ float sample(const float *phi, const float3 &pos, float3 &gradient) const {
+        const float p[3] = {pos.x, pos.y, pos.z};
+        int idx[3];
+        float frac[3];
+        for (int d = 0; d < 3; d++) {
+            const float x = clampf(p[d] - storage_offset[d], 0.0f, res[d] - 1.0f - 1e-6f);
+            idx[d] = min(max(int(x), 0), res[d] - 2);
+            frac[d] = x - idx[d];
+        }
+        float c[2][2][2];
+        for (int a = 0; a < 2; a++) {
+            for (int b = 0; b < 2; b++) {
+                for (int e = 0; e < 2; e++) {
+                    c[a][b][e] = get(phi, idx[0] + a, idx[1] + b, idx[2] + e);
+                }
+            }
+        }
+        auto lerp = [](float t, float x0, float x1) {
+            return (1.0f - t) * x0 + t * x1;
+        };
+        const float x_r = frac[0], y_r = frac[1], z_r = frac[2];
+        gradient.x = lerp(y_r, lerp(z_r, c[1][0][0] - c[0][0][0], c[1][0][1] - c[0][0][1]),
+                          lerp(z_r, c[1][1][0] - c[0][1][0], c[1][1][1] - c[0][1][1]));
+        gradient.y = lerp(z_r, lerp(x_r, c[0][1][0] - c[0][0][0], c[1][1][0] - c[1][0][0]),
+                          lerp(x_r, c[0][1][1] - c[0][0][1], c[1][1][1] - c[1][0][1]));
+        gradient.z = lerp(x_r, lerp(y_r, c[0][0][1] - c[0][0][0], c[0][1][1] - c[0][1][0]),
+                          lerp(y_r, c[1][0][1] - c[1][0][0], c[1][1][1] - c[1][1][0]));
+        return lerp(x_r, lerp(y_r, lerp(z_r, c[0][0][0], c[0][0][1]), lerp(z_r, c[0][1][0], c[0][1][1])),
+                    lerp(y_r, lerp(z_r, c[1][0][0], c[1][0][1]), lerp(z_r, c[1][1][0], c[1][1][1])));
+    }
+
+    // DynamicLevelSet3D::sample, get_spatial_gradient and get_temporal_derivative
+    __device__ float sample(const float3 &pos, float t, float3 &normal, float &temporal_derivative) const {
+        float3 g0, g1;
+        const float l0 = sample(phi0, pos, g0);
+        const float l1 = sample(phi1, pos, g1);
+        const float a = (t - t0) / (t1 - t0);
+        const float3 g = (1.0f - a) * g0 + a * g1;
+        const float g_length = length(g);
+        normal = g_length < 1e-10f ? make_float3(1.0f, 0.0f, 0.0f) : (1.0f / g_length) * g;
+        temporal_derivative = (l1 - l0) / (t1 - t0);
+        return (1.0f - a) * l0 + a * l1;
+    }
+};
+
+struct ParticleView {
+    int n;
+    float3 *pos, *v;
+    Mat3 *apic_b, *dg_e, *dg_p;
+    float *mass, *vol, *alpha, *q;
+    int *material;
+};
+
+struct GridView {
+    // Nodes per axis, res + 1 for the cells of MPM3D, as its grid
+    int res[3];
+    int num_blocks[3];
+    // xyz: momentum, then velocity after update_grid; w: mass
+    float4 *momentum;
+    // xyz: stress impulse, then the velocity before forces after update_grid
+    float4 *impulse;
+
+    __device__ bool inside(int i, int j, int k) const {
+        return 0 <= i && i < res[0] && 0 <= j && j < res[1] && 0 <= k && k < res[2];
+    }
+
+    __device__ int index(int i, int j, int k) const {
+        return (i * res[1] + j) * res[2] + k;
+    }
+};
+
+const int block_size = 8;
+// Nodes touched by the particles of one block: [block * size - 1, block * size + size + 2)
+const int scratch_size = block_size + 3;
+const int scratch_nodes = scratch_size * scratch_size * scratch_size;
+
+// Constitutive models, as EPMaterial3 and DPMaterial3
+
+__device__ Mat3 get_force(const MPM3CudaMaterial &material, const ParticleView &p, int i) {
+    const Mat3 f = p.dg_e[i];
+    Mat3 u, v;
+    float sig[3];
+    svd(f, u, sig, v);
+    Mat3 stress;
+    if (material.type == MPM3CudaMaterial::SNOW) {
+        const float j_e = det(f);
+        const float j_p = det(p.dg_p[i]);
+        const float e = expf(fminf(material.hardening * (1.0f - j_p), 1000.0f));
+        const float mu = material.mu_0 * e, lambda = material.lambda_0 * e;
+        const Mat3 r = u * transposed(v);
+        stress = 2.0f * mu * (f - r) + lambda * (j_e - 1.0f) * j_e * transposed(inverse(f));
+    } else {
+        float log_sig[3], inv_sig[3];
+        for (int d = 0; d < 3; d++) {
+            const float s = fmaxf(sig[d], 1e-6f);
+            log_sig[d] = logf(s);
+            inv_sig[d] = 1.0f / s;
+        }
+        const float tr = log_sig[0] + log_sig[1] + log_sig[2];
+        float center[3];
+        for (int d = 0; d < 3; d++) {
+            center[d] = 2.0f * material.mu_0 * inv_sig[d] * log_sig[d] + material.lambda_0 * tr * inv_sig[d];
+        }
+        stress = compose(u, center, v);
+    }
+    return (-p.vol[i]) * stress * transposed(f);
+}
+
+__device__ void plasticity(const MPM3CudaMaterial &material, ParticleView &p, int i) {
+    Mat3 u, v;
+    float sig[3];
+    const Mat3 f = p.dg_e[i];
+    svd(f, u, sig, v);
+    if (material.type == MPM3CudaMaterial::SNOW) {
+        const Mat3 dg_total = f * p.dg_p[i];
+        for (int d = 0; d < 3; d++) {
+            sig[d] = clampf(sig[d], 1.0f - material.theta_c, 1.0f + material.theta_s);
+        }
+        const Mat3 dg_e = compose(u, sig, v);
+        p.dg_e[i] = dg_e;
+        svd(inverse(dg_e) * dg_total, u, sig, v);
+        for (int d = 0; d < 3; d++) {
+            sig[d] = clampf(sig[d], 0.1f, 10.0f);
+        }
+        p.dg_p[i] = compose(u, sig, v);
+    } else {
+        // Projection onto the Drucker-Prager yield surface in log-strain space
+        const float mu_0 = material.mu_0, lambda_0 = material.lambda_0;
+        float epsilon[3];
+        for (int d = 0; d < 3; d++) {
+            epsilon[d] = logf(fmaxf(sig[d], 1e-6f));
+        }
+        const float tr = epsilon[0] + epsilon[1] + epsilon[2];
+        float epsilon_hat[3];
+        for (int d = 0; d < 3; d++) {
+            epsilon_hat[d] = epsilon[d] - tr / 3.0f;
+        }
+        const float epsilon_for = sqrtf(epsilon[0] * epsilon[0] + epsilon[1] * epsilon[1] + epsilon[2] * epsilon[2]);
+        const float epsilon_hat_for = sqrtf(epsilon_hat[0] * epsilon_hat[0] + epsilon_hat[1] * epsilon_hat[1] +
+                                            epsilon_hat[2] * epsilon_hat[2]);
+        float t[3] = {1.0f, 1.0f, 1.0f};
+        float delta_q;
+        if (epsilon_hat_for <= 0 || tr > 0.0f) {
+            delta_q = epsilon_for;
+        } else {
+            const float delta_gamma =
+                    epsilon_hat_for + (3.0f * lambda_0 + 2.0f * mu_0) / (2.0f * mu_0) * tr * p.alpha[i];
+            if (delta_gamma <= 0) {
+                for (int d = 0; d < 3; d++) {
+                    t[d] = sig[d];
+                }
+                delta_q = 0;
+            } else {
+                for (int d = 0; d < 3; d++) {
+                    t[d] = expf(epsilon[d] - delta_gamma / epsilon_hat_for * epsilon_hat[d]);
+                }
+                delta_q = delta_gamma;
+            }
+        }
+        p.dg_e[i] = compose(u, t, v);
+        float ratio[3];
+        for (int d = 0; d < 3; d++) {
+            ratio[d] = sig[d] / t[d];
+        }
+        p.dg_p[i] = compose(v, ratio, v) * p.dg_p[i];
+        const float q = p.q[i] + delta_q;
+        p.q[i] = q;
+        const float phi = material.h_0 + (material.h_1 * q - material.h_3) * expf(-material.h_2 * q);
+        const float sin_phi = sinf(phi * 3.14159265358979f / 180.0f);
+        p.alpha[i] = sqrtf(2.0f / 3.0f) * (2.0f * sin_phi) / (3.0f - sin_phi);
+    }
+}
+
+// Kernels
+
+__global__ void compute_block_keys(ParticleView p, GridView grid, int *keys, int *order) {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= p.n) {
+        return;
+    }
+    const float3 x = p.pos[i];
+    const int bx = min(int(x.x) / block_size, grid.num_blocks[0] - 1);
+    const int by = min(int(x.y) / block_size, grid.num_blocks[1] - 1);
+    const int bz = min(int(x.z) / block_size, grid.num_blocks[2] - 1);
+    keys[i] = (bx * grid.num_blocks[1] + by) * grid.num_blocks[2] + bz;
+    order[i] = i;
+}
+
+__global__ void find_block_ranges(int n, const int *keys, int *block_begin, int *block_end) {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n) {
+        return;
+    }
+    if (i == 0 || keys[i] != keys[i - 1]) {
+        block_begin[keys[i]] = i;
+    }
+    if (i == n - 1 || keys[i] != keys[i + 1]) {
+        block_end[keys[i]] = i + 1;
+    }
+}
+
+// One thread block per grid block. The particles of the block scatter into shared memory,
+// which is then added to the grid; only the halo is contended between thread blocks.
+__global__ void rasterize_blocks(ParticleView p, GridView grid, const int *block_begin, const int *block_end,
+                                 const MPM3CudaMaterial *materials, float delta_t) {
+    const int block = blockIdx.x;
+    const int begin = block_begin[block], end = block_end[block];
+    if (begin == end) {
+        return;
+    }
+    __shared__ float4 scratch[scratch_nodes];
+    __shared__ float3 scratch_impulse[scratch_nodes];
+    for (int s = threadIdx.x; s < scratch_nodes; s += blockDim.x) {
+        scratch[s] = make_float4(0.0f, 0.0f, 0.0f, 0.0f);
+        scratch_impulse[s] = make_float3(0.0f, 0.0f, 0.0f);
+    }
+    __syncthreads();
+    const int bx = block / (grid.num_blocks[1] * grid.num_blocks[2]);
+    const int by = block / grid.num_blocks[2] % grid.num_blocks[1];
+    const int bz = block % grid.num_blocks[2];
+    const int origin[3] = {bx * block_size - 1, by * block_size - 1, bz * block_size - 1};
+    for (int i = begin + threadIdx.x; i < end; i += blockDim.x) {
+        const float3 pos = p.pos[i];
+        const float3 v = p.v[i];
+        const Mat3 apic_b = p.apic_b[i];
+        const float mass = p.mass[i];
+        const Mat3 impulse = delta_t * get_force(materials[p.material[i]], p, i);
+        const Kernel kernel(pos);
+        for (int a = 0; a < 4; a++) {
+            for (int b = 0; b < 4; b++) {
+                for (int c = 0; c < 4; c++) {
+                    const int ni = kernel.base[0] + a, nj = kernel.base[1] + b, nk = kernel.base[2] + c;
+                    if (!grid.inside(ni, nj, nk)) {
+                        continue;
+                    }
+                    const float3 d_pos = make_float3(ni - pos.x, nj - pos.y, nk - pos.z);
+                    const float weight = kernel.get_w(a, b, c);
+                    const float3 momentum = (weight * mass) * (v + 3.0f * (apic_b * d_pos));
+                    const float3 force_impulse = impulse * kernel.get_dw(a, b, c);
+                    const int s =
+                            ((ni - origin[0]) * scratch_size + (nj - origin[1])) * scratch_size + (nk - origin[2]);
+                    atomicAdd(&scratch[s].x, momentum.x);
+                    atomicAdd(&scratch[s].y, momentum.y);
+                    atomicAdd(&scratch[s].z, momentum.z);
+                    atomicAdd(&scratch[s].w, weight * mass);
+                    atomicAdd(&scratch_impulse[s].x, force_impulse.x);
+                    atomicAdd(&scratch_impulse[s].y, force_impulse.y);
+                    atomicAdd(&scratch_impulse[s].z, force_impulse.z);
+                }
+            }
+        }
+    }
+    __syncthreads();
+    for (int s = threadIdx.x; s < scratch_nodes; s += blockDim.x) {
+        const float4 node = scratch[s];
+        if (node.w == 0.0f) {
+            continue;
+        }
+        const int ni = origin[0] + s / (scratch_size * scratch_size);
+        const int nj = origin[1] + s / scratch_size % scratch_size;
+        const int nk = origin[2] + s % scratch_size;
+        float4 &g = grid.momentum[grid.index(ni, nj, nk)];
+        atomicAdd(&g.x, node.x);
+        atomicAdd(&g.y, node.y);
+        atomicAdd(&g.z, node.z);
+        atomicAdd(&g.w, node.w);
+        float4 &gi = grid.impulse[grid.index(ni, nj, nk)];
+        const float3 impulse = scratch_impulse[s];
+        atomicAdd(&gi.x, impulse.x);
+        atomicAdd(&gi.y, impulse.y);
+        atomicAdd(&gi.z, impulse.z);
+    }
+}
+
+__global__ void update_grid_nodes(GridView grid, LevelSetView levelset, float3 gravity, float delta_t, float t) {
+    const int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index >= grid.res[0] * grid.res[1] * grid.res[2]) {
+        return;
+    }
+    const int i = index / (grid.res[1] * grid.res[2]), j = index / grid.res[2] % grid.res[1], k = index % grid.res[2];
+    const float4 node = grid.momentum[index];
+    const float4 node_impulse = grid.impulse[index];
+    float3 velocity = make_float3(0.0f, 0.0f, 0.0f), backup = make_float3(0.0f, 0.0f, 0.0f);
+    if (node.w > 0) {
+        const float inv_mass = 1.0f / node.w;
+        backup = inv_mass * make_float3(node.x, node.y, node.z);
+        velocity = backup + inv_mass * make_float3(node_impulse.x, node_impulse.y, node_impulse.z);
+        velocity = velocity + delta_t * gravity;
+    }
+    float3 n;
+    float temporal_derivative;
+    const float phi = levelset.sample(make_float3(i + 0.5f, j + 0.5f, k + 0.5f), t, n, temporal_derivative);
+    if (-3 <= phi && phi <= 1) {
+        const float3 boundary_velocity = temporal_derivative * n;
+        float3 v = velocity - boundary_velocity;
+        if (phi > 0) {
+            const float pressure = fmaxf(-dot(v, n), 0.0f);
+            const float mu = levelset.friction;
+            if (mu < 0) {
+                v = make_float3(0.0f, 0.0f, 0.0f);
+            } else {
+                float3 tangent = v - dot(v, n) * n;
+                if (length(tangent) > 1e-6f) {
+                    tangent = (1.0f / length(tangent)) * tangent;
+                }
+                const float friction = -clampf(dot(tangent, v), -mu * pressure, mu * pressure);
+                v = v + pressure * n + friction * tangent;
+            }
+        } else if (phi < 0.0f) {
+            v = fmaxf(0.0f, dot(v, n)) * n;
+        }
+        velocity = v + boundary_velocity;
+    }
+    grid.momentum[index] = make_float4(velocity.x, velocity.y, velocity.z, node.w);
+    grid.impulse[index] = make_float4(backup.x, backup.y, backup.z, 0.0f);
+}
+
+__global__ void resample_particles(ParticleView p, GridView grid, LevelSetView levelset,
+                                   const MPM3CudaMaterial *materials, MPM3CudaParameters parameters, float t) {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= p.n) {
+        return;
+    }
+    const float delta_t = parameters.delta_t;
+    float3 pos = p.pos[i];
+    const Kernel kernel(pos);
+    float3 v = make_float3(0.0f, 0.0f, 0.0f), bv = make_float3(0.0f, 0.0f, 0.0f);
+    Mat3 cdg = diag(0.0f, 0.0f, 0.0f), b = diag(0.0f, 0.0f, 0.0f);
+    int count = 0;
+    for (int a = 0; a < 4; a++) {
+        for (int bj = 0; bj < 4; bj++) {
+            for (int c = 0; c < 4; c++) {
+                const int ni = kernel.base[0] + a, nj = kernel.base[1] + bj, nk = kernel.base[2] + c;
+                if (!grid.inside(ni, nj, nk)) {
+                    continue;
+                }
+                count++;
+                const int index = grid.index(ni, nj, nk);
+                const float4 node = grid.momentum[index];
+                const float4 node_backup = grid.impulse[index];
+                const float3 grid_vel = make_float3(node.x, node.y, node.z);
+                const float weight = kernel.get_w(a, bj, c);
+                v = v + weight * grid_vel;
+                b = b + weight * outer(grid_vel, make_float3(ni - pos.x, nj - pos.y, nk - pos.z));
+                bv = bv + weight * make_float3(node_backup.x, node_backup.y, node_backup.z);
+                cdg = cdg + outer(grid_vel, kernel.get_dw(a, bj, c));
+            }
+        }
+    }
+    if (count != 64 || !parameters.apic) {
+        b = diag(0.0f, 0.0f, 0.0f);
+    }
+    p.apic_b[i] = fmaxf(0.0f, 1.0f - delta_t * parameters.affine_damping) * b;
+    cdg = diag(1.0f, 1.0f, 1.0f) + delta_t * cdg;
+    if (!parameters.apic) {
+        // FLIP
+        v = v - bv + p.v[i];
+    }
+    p.dg_e[i] = cdg * p.dg_e[i];
+
+    pos = pos + delta_t * v;
+    pos.x = clampf(pos.x, 0.0f, parameters.res[0] - 1e-6f);
+    pos.y = clampf(pos.y, 0.0f, parameters.res[1] - 1e-6f);
+    pos.z = clampf(pos.z, 0.0f, parameters.res[2] - 1e-6f);
+
+    plasticity(materials[p.material[i]], p, i);
+
+    float3 n;
+    float temporal_derivative;
+    const float phi = levelset.sample(pos, t, n, temporal_derivative);
+    if (phi < 0) {
+        pos = pos - phi * n;
+        v = v - dot(n, v) * n;
+    }
+    p.pos[i] = pos;
+    p.v[i] = v;
+}
+
+// Solver
+
+struct MPM3CudaSolver::Implementation {
+    MPM3CudaParameters parameters;
+    int num_blocks[3];
+    int total_blocks = 0;
+    int num_nodes = 0;
+    int n = 0;
+
+    DeviceArray<float3> pos, v;
+    DeviceArray<Mat3> apic_b, dg_e, dg_p;
+    DeviceArray<float> mass, vol, alpha, q;
+    DeviceArray<int> material;
+    // Index of each particle in the last upload
+    DeviceArray<int> id;
+
+    DeviceArray<int> keys, order;
+    DeviceArray<int> block_begin, block_end;
+    DeviceArray<float3> sort_float3;
+    DeviceArray<Mat3> sort_mat3;
+    DeviceArray<float> sort_float;
+    DeviceArray<int> sort_int;
+
+    DeviceArray<float4> grid_momentum, grid_impulse;
+    DeviceArray<MPM3CudaMaterial> materials;
+    DeviceArray<float> phi0, phi1;
+    LevelSetView levelset;
+    bool has_levelset = false;
+
+    static int get_num_launch_blocks(int n, int threads) {
+        return (n + threads - 1) / threads;
+    }
+
+    ParticleView get_particle_view() {
+        ParticleView view;
+        view.n = n;
+        view.pos = pos.data();
+        view.v = v.data();
+        view.apic_b = apic_b.data();
+        view.dg_e = dg_e.data();
+        view.dg_p = dg_p.data();
+        view.mass = mass.data();
+        view.vol = vol.data();
+        view.alpha = alpha.data();
+        view.q = q.data();
+        view.material = material.data();
+        return view;
+    }
+
+    GridView get_grid_view() {
+        GridView view;
+        for (int d = 0; d < 3; d++) {
+            view.res[d] = parameters.res[d] + 1;
+            view.num_blocks[d] = num_blocks[d];
+        }
+        view.momentum = grid_momentum.data();
+        view.impulse = grid_impulse.data();
+        return view;
+    }
+
+    // Applies `order` to one particle array
+    template <typename T>
+    void permute(DeviceArray<T> &arr, DeviceArray<T> &tmp) {
+        tmp.resize(n);
+        thrust::device_ptr<int> order_ptr(order.data());
+        thrust::gather(order_ptr, order_ptr + n, thrust::device_ptr<T>(arr.data()), thrust::device_ptr<T>(tmp.data()));
+        arr.swap(tmp);
+    }
+};
+
+MPM3CudaSolver::MPM3CudaSolver() : impl(new Implementation()) {}
+
+MPM3CudaSolver::~MPM3CudaSolver() {}
+
+void MPM3CudaSolver::initialize(const MPM3CudaParameters &parameters) {
+    impl->parameters = parameters;
+    impl->total_blocks = 1;
+    impl->num_nodes = 1;
+    for (int d = 0; d < 3; d++) {
+        // The grid has a node past the last cell, as MPM3D's
+        const int nodes = parameters.res[d] + 1;
+        impl->num_blocks[d] = (nodes + block_size - 1) / block_size;
+        impl->total_blocks *= impl->num_blocks[d];
+        impl->num_nodes *= nodes;
+    }
+    impl->block_begin.resize(impl->total_blocks);
+    impl->block_end.resize(impl->total_blocks);
+    impl->grid_momentum.resize(impl->num_nodes);
+    impl->grid_impulse.resize(impl->num_nodes);
+}
+
+void MPM3CudaSolver::set_materials(const std::vector<MPM3CudaMaterial> &materials) {
+    impl->materials.upload(materials.data(), materials.size());
+}
+
+void MPM3CudaSolver::set_levelset(const MPM3CudaLevelSet &levelset) {
+    const std::size_t size = (std::size_t)levelset.res[0] * levelset.res[1] * levelset.res[2];
+    impl->phi0.upload(levelset.phi0, size);
+    impl->phi1.upload(levelset.phi1, size);
+    LevelSetView &view = impl->levelset;
+    for (int d = 0; d < 3; d++) {
+        view.res[d] = levelset.res[d];
+        view.storage_offset[d] = levelset.storage_offset[d];
+    }
+    view.t0 = levelset.t0;
+    view.t1 = levelset.t1;
+    view.friction = levelset.friction;
+    view.phi0 = impl->phi0.data();
+    view.phi1 = impl->phi1.data();
+    impl->has_levelset = true;
+}
+
+void MPM3CudaSolver::upload_particles(const MPM3CudaParticleBuffer &buffer) {
+    const int n = buffer.size();
+    impl->n = n;
+    impl->pos.upload(reinterpret_cast<const float3 *>(buffer.pos.data()), n);
+    impl->v.upload(reinterpret_cast<const float3 *>(buffer.v.data()), n);
+    impl->apic_b.upload(reinterpret_cast<const Mat3 *>(buffer.apic_b.data()), n);
+    impl->dg_e.upload(reinterpret_cast<const Mat3 *>(buffer.dg_e.data()), n);
+    impl->dg_p.upload(reinterpret_cast<const Mat3 *>(buffer.dg_p.data()), n);
+    impl->mass.upload(buffer.mass.data(), n);
+    impl->vol.upload(buffer.vol.data(), n);
+    impl->alpha.upload(buffer.alpha.data(), n);
+    impl->q.upload(buffer.q.data(), n);
+    impl->material.upload(buffer.material.data(), n);
+    impl->id.resize(n);
+    thrust::sequence(thrust::device_ptr<int>(impl->id.data()), thrust::device_ptr<int>(impl->id.data()) + n);
+    impl->keys.resize(n);
+    impl->order.resize(n);
+}
+
+// Downloads the device order, then puts every particle back at its uploaded index
+void MPM3CudaSolver::download_particles(MPM3CudaParticleBuffer &buffer) const {
+    const int n = impl->n;
+    MPM3CudaParticleBuffer sorted;
+    sorted.resize(n);
+    std::vector<int> id(n);
+    impl->pos.download(reinterpret_cast<float3 *>(sorted.pos.data()));
+    impl->v.download(reinterpret_cast<float3 *>(sorted.v.data()));
+    impl->apic_b.download(reinterpret_cast<Mat3 *>(sorted.apic_b.data()));
+    impl->dg_e.download(reinterpret_cast<Mat3 *>(sorted.dg_e.data()));
+    impl->dg_p.download(reinterpret_cast<Mat3 *>(sorted.dg_p.data()));
+    impl->mass.download(sorted.mass.data());
+    impl->vol.download(sorted.vol.data());
+    impl->alpha.download(sorted.alpha.data());
+    impl->q.download(sorted.q.data());
+    impl->material.download(sorted.material.data());
+    impl->id.download(id.data());
+    buffer.resize(n);
+    for (int k = 0; k < n; k++) {
+        const int i = id[k];
+        std::copy(&sorted.pos[3 * k], &sorted.pos[3 * k] + 3, &buffer.pos[3 * i]);
+        std::copy(&sorted.v[3 * k], &sorted.v[3 * k] + 3, &buffer.v[3 * i]);
+        std::copy(&sorted.apic_b[9 * k], &sorted.apic_b[9 * k] + 9, &buffer.apic_b[9 * i]);
+        std::copy(&sorted.dg_e[9 * k], &sorted.dg_e[9 * k] + 9, &buffer.dg_e[9 * i]);
+        std::copy(&sorted.dg_p[9 * k], &sorted.dg_p[9 * k] + 9, &buffer.dg_p[9 * i]);
+        buffer.mass[i] = sorted.mass[k];
+        buffer.vol[i] = sorted.vol[k];
+        buffer.alpha[i] = sorted.alpha[k];
+        buffer.q[i] = sorted.q[k];
+        buffer.material[i] = sorted.material[k];
+    }
+}
+
+void MPM3CudaSolver::sort_particles() {
+    Implementation &s = *impl;
+    if (s.n == 0) {
+        return;
+    }
+    const int threads = 256;
+    compute_block_keys<<<s.get_num_launch_blocks(s.n, threads), threads>>>(s.get_particle_view(), s.get_grid_view(),
+                                                                          s.keys.data(), s.order.data());
+    TC_CUDA_CHECK(cudaGetLastError());
+    thrust::device_ptr<int> keys(s.keys.data());
+    thrust::sort_by_key(keys, keys + s.n, thrust::device_ptr<int>(s.order.data()));
+    s.permute(s.pos, s.sort_float3);
+    s.permute(s.v, s.sort_float3);
+    s.permute(s.apic_b, s.sort_mat3);
+    s.permute(s.dg_e, s.sort_mat3);
+    s.permute(s.dg_p, s.sort_mat3);
+    s.permute(s.mass, s.sort_float);
+    s.permute(s.vol, s.sort_float);
+    s.permute(s.alpha, s.sort_float);
+    s.permute(s.q, s.sort_float);
+    s.permute(s.material, s.sort_int);
+    s.permute(s.id, s.sort_int);
+    s.block_begin.set_zero();
+    s.block_end.set_zero();
+    find_block_ranges<<<s.get_num_launch_blocks(s.n, threads), threads>>>(s.n, s.keys.data(), s.block_begin.data(),
+                                                                          s.block_end.data());
+    TC_CUDA_CHECK(cudaGetLastError());
+}
+
+void MPM3CudaSolver::rasterize() {
+    Implementation &s = *impl;
+    s.grid_momentum.set_zero();
+    s.grid_impulse.set_zero();
+    if (s.n == 0) {
+        return;
+    }
+    rasterize_blocks<<<s.total_blocks, 128>>>(s.get_particle_view(), s.get_grid_view(), s.block_begin.data(),
+                                              s.block_end.data(), s.materials.data(), s.parameters.delta_t);
+    TC_CUDA_CHECK(cudaGetLastError());
+}
+
+void MPM3CudaSolver::update_grid(float t) {
+    Implementation &s = *impl;
+    if (!s.has_levelset) {
+        throw std::runtime_error("mpm_cuda needs a level set before the first substep");
+    }
+    const int threads = 256;
+    const float3 gravity = make_float3(s.parameters.gravity[0], s.parameters.gravity[1], s.parameters.gravity[2]);
+    update_grid_nodes<<<s.get_num_launch_blocks(s.num_nodes, threads), threads>>>(
+            s.get_grid_view(), s.levelset, gravity, s.parameters.delta_t, t);
+    TC_CUDA_CHECK(cudaGetLastError());
+}
+
+void MPM3CudaSolver::resample(float t) {
+    Implementation &s = *impl;
+    if (s.n == 0) {
+        return;
+    }
+    const int threads = 256;
+    resample_particles<<<s.get_num_launch_blocks(s.n, threads), threads>>>(
+            s.get_particle_view(), s.get_grid_view(), s.levelset, s.materials.data(), s.parameters, t);
+    TC_CUDA_CHECK(cudaGetLastError());
+}
+
+void MPM3CudaSolver::synchronize() const {
+    TC_CUDA_CHECK(cudaDeviceSynchronize());
+}
+
+int MPM3CudaSolver::get_num_particles() const {
+    return impl->n;
+}
+
+}
@@ -0,0 +1,119 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+// Device side of the "mpm_cuda" simulator. This header is shared by nvcc and the host
+// compiler, so it only uses plain types: vectors are float[3] and matrices are float[9], row-major.
+
+#include <memory>
+#include <vector>
+
+namespace taichi {
+
+// Constitutive parameters of one MPM3Material, indexed by MPM3Particles::material
+struct MPM3CudaMaterial {
+    enum Type {
+        SNOW = 0, // EPMaterial3
+        SAND = 1, // DPMaterial3
+    };
+    int type;
+    float mu_0, lambda_0;
+    // Snow
+    float hardening, theta_c, theta_s;
+    // Sand
+    float h_0, h_1, h_2, h_3;
+};
+
+// Host-side staging of the particle state, one entry (or 3 or 9 floats) per particle
+struct MPM3CudaParticleBuffer {
+    std::vector<float> pos, v;
+    std::vector<float> apic_b, dg_e, dg_p;
+    std::vector<float> mass, vol;
+    // Sand hardening state; unused by snow particles
+    std::vector<float> alpha, q;
+    std::vector<int> material;
+
+    int size() const {
+        return (int)mass.size();
+    }
+
+    void resize(int n) {
+        pos.resize(3 * n);
+        v.resize(3 * n);
+        apic_b.resize(9 * n);
+        dg_e.resize(9 * n);
+        dg_p.resize(9 * n);
+        mass.resize(n);
+        vol.resize(n);
+        alpha.resize(n);
+        q.resize(n);
+        material.resize(n);
+    }
+};
+
+// The two level sets of a DynamicLevelSet3D, as stored by LevelSet3D
+struct MPM3CudaLevelSet {
+    int res[3];
+    float storage_offset[3];
+    float t0, t1;
+    float friction;
+    const float *phi0, *phi1;
+};
+
+struct MPM3CudaParameters {
+    int res[3];
+    float gravity[3];
+    float delta_t;
+    bool apic;
+    float affine_damping;
+};
+
+// Particles stay on the device between substeps; they are only copied when uploaded or downloaded.
+// The phases are separate calls so that the host can time them. Kernel launches are asynchronous,
+// call synchronize() before reading a clock.
+class MPM3CudaSolver {
+public:
+    MPM3CudaSolver();
+
+    ~MPM3CudaSolver();
+
+    void initialize(const MPM3CudaParameters &parameters);
+
+    void set_materials(const std::vector<MPM3CudaMaterial> &materials);
+
+    void set_levelset(const MPM3CudaLevelSet &levelset);
+
+    void upload_particles(const MPM3CudaParticleBuffer &buffer);
+
+    // Returns the particles in the order of the last upload, whatever sorting happened since
+    void download_particles(MPM3CudaParticleBuffer &buffer) const;
+
+    // Sorts the particles by grid block and finds the particle range of every block
+    void sort_particles();
+
+    // Shared-memory P2G of momentum, mass and stress impulse, one thread block per grid block
+    void rasterize();
+
+    // Normalization, gravity and level set boundary conditions at time t
+    void update_grid(float t);
+
+    // G2P, advection, plasticity and level set collision at time t
+    void resample(float t);
+
+    void synchronize() const;
+
+    int get_num_particles() const;
+
+protected:
+    struct Implementation;
+    std::unique_ptr<Implementation> impl;
+};
+
+}
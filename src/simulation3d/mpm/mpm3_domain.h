@@ -0,0 +1,140 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <taichi/math/array_3d.h>
+#include <taichi/io/binary_stream.h>
+#include <taichi/system/communicator.h>
+
+TC_NAMESPACE_BEGIN
+
+// Static slab decomposition of MPM3D along x, in units of scheduler block columns.
+// Rank r owns the columns [column_begin, column_end) and the particles inside them. The column
+// right outside each end of the slab is a ghost column, holding a copy of the neighbour's
+// scheduler state so that 3x3x3 block stencils agree on both sides of the cut.
+class MPM3Domain {
+public:
+    std::shared_ptr<Communicator> communicator;
+    int rank = 0, num_ranks = 1;
+    int num_columns = 0;
+    int column_begin = 0, column_end = 0;
+
+    void initialize(const std::shared_ptr<Communicator> &communicator, int num_columns) {
+        this->communicator = communicator;
+        this->num_columns = num_columns;
+        rank = communicator->get_rank();
+        num_ranks = communicator->get_num_ranks();
+        assert_info(num_columns >= num_ranks,
+                    "MPM3D needs at least one block column per rank, but there are " +
+                    std::to_string(num_columns) + " columns for " + std::to_string(num_ranks) + " ranks");
+        column_begin = get_column_begin(rank);
+        column_end = get_column_begin(rank + 1);
+    }
+
+    bool is_distributed() const {
+        return num_ranks > 1;
+    }
+
+    int get_column_begin(int r) const {
+        return int(int64(r) * num_columns / num_ranks);
+    }
+
+    int get_column_owner(int column) const {
+        int r = int(int64(column) * num_ranks / num_columns);
+        while (r + 1 < num_ranks && get_column_begin(r + 1) <= column) {
+            r++;
+        }
+        while (r > 0 && get_column_begin(r) > column) {
+            r--;
+        }
+        return r;
+    }
+
+    bool owns_column(int column) const {
+        return column_begin <= column && column < column_end;
+    }
+
+    // Owned or ghost
+    bool is_local_column(int column) const {
+        return column_begin - 1 <= column && column <= column_end;
+    }
+
+    // side 0 is rank - 1, side 1 is rank + 1
+    bool has_neighbour(int side) const {
+        return side == 0 ? rank > 0 : rank + 1 < num_ranks;
+    }
+
+    void exchange(const std::vector<char> send[2], std::vector<char> recv[2]) const {
+        communicator->exchange_with_neighbours(send, recv);
+    }
+
+    int64 all_reduce_min(int64 val) const {
+        return communicator->all_reduce_min(val);
+    }
+
+    // Sends the first and last owned column of `arr` to the neighbours and overwrites the ghost
+    // columns with theirs
+    template <typename T>
+    void exchange_ghost_columns(Array3D<T> &arr) const {
+        if (!is_distributed()) {
+            return;
+        }
+        const int boundary_column[2] = {column_begin, column_end - 1};
+        const int ghost_column[2] = {column_begin - 1, column_end};
+        std::vector<char> send[2], recv[2];
+        for (int side = 0; side < 2; side++) {
+            if (!has_neighbour(side)) {
+                continue;
+            }
+            BinaryMemoryStreamOutput os;
+            for (int j = 0; j < arr.get_height(); j++) {
+                for (int k = 0; k < arr.get_depth(); k++) {
+                    os << arr[boundary_column[side]][j][k];
+                }
+            }
+            send[side].swap(os.data);
+        }
+        exchange(send, recv);
+        for (int side = 0; side < 2; side++) {
+            if (!has_neighbour(side)) {
+                continue;
+            }
+            BinaryMemoryStreamInput is(recv[side]);
+            for (int j = 0; j < arr.get_height(); j++) {
+                for (int k = 0; k < arr.get_depth(); k++) {
+                    is >> arr[ghost_column[side]][j][k];
+                }
+            }
+        }
+    }
+
+    // Resets the columns that are neither owned nor ghost, whose contents are stale on this rank
+    template <typename T>
+    void clear_remote_columns(Array3D<T> &arr, const T &val) const {
+        if (!is_distributed()) {
+            return;
+        }
+        for (int i = 0; i < arr.get_width(); i++) {
+            if (is_local_column(i)) {
+                continue;
+            }
+            for (int j = 0; j < arr.get_height(); j++) {
+                for (int k = 0; k < arr.get_depth(); k++) {
+                    arr[i][j][k] = val;
+                }
+            }
+        }
+    }
+};
+
+TC_NAMESPACE_END
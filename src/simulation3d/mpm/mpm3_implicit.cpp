@@ -0,0 +1,198 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include "mpm3.h"
+#include <taichi/system/timer.h>
+
+TC_NAMESPACE_BEGIN
+
+// Newton iterations minimize E(v) = sum_i m_i |v_i - v*_i|^2 / 2 + sum_p V_p psi_p(F_p(v)), for the deformation
+// gradients F_p(v) = (I + delta_t sum_i v_i dw_ip^T) F_p the velocities v give, i.e. the incremental potential
+// of backward Euler. Its gradient, with P_p the stress at F_p(v), is
+//     g_i = m_i (v_i - v*_i) + delta_t sum_p V_p P_p F_p^T dw_ip,
+// and its Hessian applied to d
+//     (H d)_i = m_i d_i + delta_t sum_p V_p dP_p F_p^T dw_ip,   dP_p = dP/dF [delta_t sum_j d_j dw_jp^T F_p],
+// which is evaluated without assembly; dP by central differences of the stress, so that every material works.
+
+// Relative size of the finite difference steps of the stress
+const real mpm3_implicit_fd_step = 1e-3f;
+
+void MPM3D::implicit_update_residual(real delta_t) {
+    implicit_dg.resize(particles.size());
+    particles.tmp_force.resize(particles.size());
+    parallel_for_each_active_particle([&](int p) {
+        const Vector pos = particles.pos[p];
+        const MPM3Kernel &kernel = particles.get_kernel(p);
+        Matrix cdg(0.0f);
+        for (auto &ind : get_bounded_rasterization_region(pos)) {
+            cdg += glm::outerProduct(grid[ind].velocity, kernel.get_dw(ind));
+        }
+        const Matrix &dg_e = particles.dg_e[p];
+        implicit_dg[p] = (Matrix(1.0f) + delta_t * cdg) * dg_e;
+        const MPM3Material &material = *materials[particles.material[p]];
+        particles.tmp_force[p] = -particles.vol[p] * material.get_stress(particles, p, implicit_dg[p]) *
+                                 glm::transpose(dg_e);
+    });
+    parallel_for_each_implicit_node([&](MPM3GridNode &node, MPM3ImplicitNode &inode) {
+        if (node.mass > 0) {
+            inode.r = node.mass * (inode.v_star - node.velocity);
+            inode.inv_diag = node.mass;
+        } else {
+            inode.r = Vector(0.0f);
+            inode.inv_diag = 0.0f;
+        }
+    });
+    // The diagonal is that of the stiffness of an isotropic material with dP = k dF
+    parallel_for_each_active_block_colored([&](const Vector3i &block, const MPM3ParticleRange &group) {
+        for (int p : group) {
+            const Vector pos = particles.pos[p];
+            const MPM3Kernel &kernel = particles.get_kernel(p);
+            const Matrix &force = particles.tmp_force[p];
+            const Matrix dg_t = glm::transpose(particles.dg_e[p]);
+            const real k = delta_t * delta_t * particles.vol[p] *
+                           materials[particles.material[p]]->get_stiffness(particles, p);
+            for (auto &ind : get_bounded_rasterization_region(pos)) {
+                if (grid[ind].mass == 0.0f) {
+                    continue;
+                }
+                const Vector gw = kernel.get_dw(ind);
+                MPM3ImplicitNode &inode = implicit_grid[ind];
+                inode.r += delta_t * (force * gw);
+                const Vector fw = dg_t * gw;
+                inode.inv_diag += k * glm::dot(fw, fw);
+            }
+        }
+    });
+    parallel_for_each_implicit_node([&](MPM3GridNode &node, MPM3ImplicitNode &inode) {
+        if (inode.inv_diag > 0) {
+            inode.inv_diag = 1.0f / inode.inv_diag;
+        }
+    });
+}
+
+void MPM3D::implicit_apply_hessian(real delta_t) {
+    parallel_for_each_implicit_node([&](MPM3GridNode &node, MPM3ImplicitNode &inode) {
+        inode.q = node.mass * inode.p;
+    });
+    parallel_for_each_active_block_colored([&](const Vector3i &block, const MPM3ParticleRange &group) {
+        for (int p : group) {
+            const Vector pos = particles.pos[p];
+            const MPM3Kernel &kernel = particles.get_kernel(p);
+            const Region region = get_bounded_rasterization_region(pos);
+            Matrix d(0.0f);
+            for (auto &ind : region) {
+                d += glm::outerProduct(implicit_grid[ind].p, kernel.get_dw(ind));
+            }
+            const Matrix &dg_e = particles.dg_e[p];
+            const Matrix d_dg = delta_t * d * dg_e;
+            const real scale = std::max(1.0f, frobenius_norm(implicit_dg[p]));
+            const real norm = frobenius_norm(d_dg);
+            // Negligible directions are skipped, also so that h stays finite
+            if (!(norm > 1e-12f * scale)) {
+                continue;
+            }
+            const real h = mpm3_implicit_fd_step * scale / norm;
+            const MPM3Material &material = *materials[particles.material[p]];
+            const Matrix d_stress = (material.get_stress(particles, p, implicit_dg[p] + h * d_dg) -
+                                     material.get_stress(particles, p, implicit_dg[p] - h * d_dg)) * (0.5f / h);
+            const Matrix d_force = (delta_t * particles.vol[p]) * d_stress * glm::transpose(dg_e);
+            for (auto &ind : region) {
+                if (grid[ind].mass == 0.0f) {
+                    continue;
+                }
+                implicit_grid[ind].q += d_force * kernel.get_dw(ind);
+            }
+        }
+    });
+}
+
+void MPM3D::implicit_grid_update(real delta_t) {
+    TC_MEMORY_TAG("mpm3.implicit");
+    const double solve_start_time = Time::get_time();
+    implicit_grid.set_allocated_blocks(grid_blocks);
+    parallel_for_each_implicit_node([&](MPM3GridNode &node, MPM3ImplicitNode &inode) {
+        inode = MPM3ImplicitNode();
+        inode.v_star = node.velocity;
+    });
+    auto plus = [](double a, double b) { return a + b; };
+    auto max = [](double a, double b) { return std::max(a, b); };
+    SolverStatistics statistics;
+    statistics.solver = "mpm3_newton_cg";
+    statistics.tolerance = implicit_tolerance;
+    statistics.converged = true;
+    for (int newton = 0; newton < implicit_newton_iterations; newton++) {
+        implicit_update_residual(delta_t);
+        const double initial_residual = implicit_reduce([](const MPM3GridNode &, const MPM3ImplicitNode &inode) {
+            return (double)max_component(glm::abs(inode.r));
+        }, max);
+        if (newton == 0) {
+            statistics.residual_history.push_back(initial_residual);
+        }
+        if (initial_residual == 0) {
+            break;
+        }
+        // Preconditioned CG for H delta = r, with z = inv_diag r
+        parallel_for_each_implicit_node([&](MPM3GridNode &node, MPM3ImplicitNode &inode) {
+            inode.delta = Vector(0.0f);
+            inode.p = inode.inv_diag * inode.r;
+        });
+        double rz = implicit_reduce([](const MPM3GridNode &, const MPM3ImplicitNode &inode) {
+            return (double)inode.inv_diag * glm::dot(inode.r, inode.r);
+        }, plus);
+        bool converged = false;
+        for (int i = 0; i < implicit_max_iterations; i++) {
+            implicit_apply_hessian(delta_t);
+            const double pq = implicit_reduce([](const MPM3GridNode &, const MPM3ImplicitNode &inode) {
+                return (double)glm::dot(inode.p, inode.q);
+            }, plus);
+            if (!(pq > 0)) {
+                // Not positive definite (e.g. compressed corotated elements), so the step so far is kept, or
+                // the Jacobi step inv_diag r if there is none, so that the stress is not dropped altogether
+                if (i == 0) {
+                    parallel_for_each_implicit_node([&](MPM3GridNode &node, MPM3ImplicitNode &inode) {
+                        inode.delta = inode.p;
+                    });
+                }
+                break;
+            }
+            const real alpha = real(rz / pq);
+            parallel_for_each_implicit_node([&](MPM3GridNode &node, MPM3ImplicitNode &inode) {
+                inode.delta += alpha * inode.p;
+                inode.r -= alpha * inode.q;
+            });
+            statistics.iterations++;
+            const double residual = implicit_reduce([](const MPM3GridNode &, const MPM3ImplicitNode &inode) {
+                return (double)max_component(glm::abs(inode.r));
+            }, max);
+            statistics.residual_history.push_back(residual);
+            if (residual <= implicit_tolerance * initial_residual) {
+                converged = true;
+                break;
+            }
+            const double rz_new = implicit_reduce([](const MPM3GridNode &, const MPM3ImplicitNode &inode) {
+                return (double)inode.inv_diag * glm::dot(inode.r, inode.r);
+            }, plus);
+            const real beta = real(rz_new / rz);
+            rz = rz_new;
+            parallel_for_each_implicit_node([&](MPM3GridNode &node, MPM3ImplicitNode &inode) {
+                inode.p = inode.inv_diag * inode.r + beta * inode.p;
+            });
+        }
+        statistics.converged = statistics.converged && converged;
+        parallel_for_each_implicit_node([&](MPM3GridNode &node, MPM3ImplicitNode &inode) {
+            if (node.mass > 0) {
+                node.velocity += inode.delta;
+            }
+        });
+    }
+    statistics.solve_time = Time::get_time() - solve_start_time;
+    solver_statistics.push_back(statistics);
+}
+
+TC_NAMESPACE_END
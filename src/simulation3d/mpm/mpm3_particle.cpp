@@ -11,6 +11,14 @@
 
 TC_NAMESPACE_BEGIN
 
-long long MPM3Particle::instance_count;
+std::shared_ptr<MPM3Material> create_mpm3_material(const std::string &type) {
+    if (type == "ep") {
+        return std::make_shared<EPMaterial3>();
+    } else if (type == "dp") {
+        return std::make_shared<DPMaterial3>();
+    }
+    error("Unknown MPM3 material type: " + type);
+    return nullptr;
+}
 
 TC_NAMESPACE_END
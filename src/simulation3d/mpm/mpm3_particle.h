@@ -10,88 +10,425 @@
 
 #pragma once
 
+#include <memory>
+#include <string>
+#include <vector>
 #include <taichi/math/qr_svd.h>
+#include <taichi/math/half.h>
 #include <taichi/common/meta.h>
 #include <taichi/math/array_3d.h>
 #include <taichi/math/dynamic_levelset_3d.h>
+#include <taichi/io/binary_stream.h>
+#include <taichi/system/memory.h>
+#include <taichi/system/threading.h>
+#include "mpm3_utils.h"
 
 TC_NAMESPACE_BEGIN
 
-struct MPM3Particle {
+// A 3x3 matrix stored as fp16, which the compact particle format uses for the fields that
+// need the least precision. It converts to Matrix3, so the math around it stays in fp32.
+struct MPM3CompactMatrix {
+    float16 data[9];
+
+    MPM3CompactMatrix() {}
+
+    MPM3CompactMatrix(const Matrix3 &m) {
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                data[i * 3 + j] = m[i][j];
+            }
+        }
+    }
+
+    operator Matrix3() const {
+        Matrix3 m;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                m[i][j] = data[i * 3 + j];
+            }
+        }
+        return m;
+    }
+};
+
+// Structure-of-arrays particle storage. Particle i is the i-th entry of every array.
+// Only fields touched by the transfers live here; constitutive parameters belong to MPM3Material.
+// Building with TC_MPM3_COMPACT_PARTICLES stores apic_b and dg_p in fp16 and recomputes the
+// interpolation kernels on the fly instead of storing them. With fused_p2g, which never needs
+// tmp_force, a particle then takes the 160 bytes of its stored fields less 2 x 18 saved on the
+// matrices, 124 bytes, instead of those 160 and the 112 of sizeof(MPM3Kernel).
+struct MPM3Particles {
     using Vector = Vector3;
     using Matrix = Matrix3;
-    using Region = Region3D;
     static const int D = 3;
-    Vector3 color = Vector3(1, 0, 0);
-    Vector pos, v;
-    Matrix dg_e, dg_p, tmp_force;
-    real mass;
-    real vol;
-    Matrix apic_b;
-    Matrix dg_cache;
-    static long long instance_count;
-    long long id = instance_count++;
+    template <typename T> using Array = AlignedVector<T>;
+#ifdef TC_MPM3_COMPACT_PARTICLES
+    using StoredMatrix = MPM3CompactMatrix;
+    static const bool stores_kernels = false;
+#else
+    using StoredMatrix = Matrix;
+    static const bool stores_kernels = true;
+#endif
+
     enum State {
         INACTIVE = 0,
         BUFFER = 1,
         UPDATING = 2,
     };
-    int state = INACTIVE;
-    int64 last_update;
 
-    MPM3Particle() {
-        last_update = 0;
-        dg_e = Matrix(1.0f);
-        dg_p = Matrix(1.0f);
-        apic_b = Matrix(0);
-        v = Vector(0.0f);
-        vol = 1.0f;
+    Array<Vector> pos, v;
+    Array<StoredMatrix> apic_b;
+    Array<Matrix> dg_e;
+    Array<StoredMatrix> dg_p;
+    Array<real> mass, vol;
+    Array<int> state;
+    Array<int64> last_update;
+    // Index into MPM3D::materials
+    Array<int> material;
+    // Cached strength limit, refreshed whenever dg_e or dg_p changes
+    Array<real> allowed_dt;
+    // Per-substep scratch, only valid for the active particles. MPM3D sizes these before
+    // filling them; they do not follow add_particle, permute or read.
+    Array<Matrix> tmp_force;
+    Array<MPM3Kernel> kernels;
+
+    // The interpolation kernel of active particle i, whether it is stored or not
+#ifdef TC_MPM3_COMPACT_PARTICLES
+    MPM3Kernel get_kernel(int i) const {
+        return MPM3Kernel(pos[i]);
+    }
+#else
+    const MPM3Kernel &get_kernel(int i) const {
+        return kernels[i];
+    }
+#endif
+
+    int size() const {
+        return (int)pos.size();
+    }
+
+    bool empty() const {
+        return pos.empty();
+    }
+
+    void reserve(int n) {
+        pos.reserve(n);
+        v.reserve(n);
+        apic_b.reserve(n);
+        dg_e.reserve(n);
+        dg_p.reserve(n);
+        mass.reserve(n);
+        vol.reserve(n);
+        state.reserve(n);
+        last_update.reserve(n);
+        material.reserve(n);
+        allowed_dt.reserve(n);
+    }
+
+    int add_particle(const Vector &pos_, const Vector &v_, real mass_, int material_, int64 t_int) {
+        pos.push_back(pos_);
+        v.push_back(v_);
+        apic_b.push_back(Matrix(0.0f));
+        dg_e.push_back(Matrix(1.0f));
+        dg_p.push_back(Matrix(1.0f));
+        mass.push_back(mass_);
+        vol.push_back(1.0f);
+        state.push_back(INACTIVE);
+        last_update.push_back(t_int);
+        material.push_back(material_);
+        allowed_dt.push_back(0.0f);
+        return size() - 1;
+    }
+
+    // Appends n particles at the origin, as add_particle would create them, for the caller to place.
+    // Returns the index of the first one.
+    int add_particles(int n, const Vector &v_, real mass_, int material_, int64 t_int) {
+        int first = size();
+        int new_size = first + n;
+        pos.resize(new_size, Vector(0.0f));
+        v.resize(new_size, v_);
+        apic_b.resize(new_size, Matrix(0.0f));
+        dg_e.resize(new_size, Matrix(1.0f));
+        dg_p.resize(new_size, Matrix(1.0f));
+        mass.resize(new_size, mass_);
+        vol.resize(new_size, 1.0f);
+        state.resize(new_size, INACTIVE);
+        last_update.resize(new_size, t_int);
+        material.resize(new_size, material_);
+        allowed_dt.resize(new_size, 0.0f);
+        return first;
+    }
+
+    // Appends a copy of particle i and returns its index
+    int duplicate_particle(int i) {
+        // Copied first, as appending may reallocate the arrays
+        const Vector pos_i = pos[i], v_i = v[i];
+        int j = add_particle(pos_i, v_i, mass[i], material[i], last_update[i]);
+        apic_b[j] = apic_b[i];
+        dg_e[j] = dg_e[i];
+        dg_p[j] = dg_p[i];
+        vol[j] = vol[i];
+        state[j] = state[i];
+        allowed_dt[j] = allowed_dt[i];
+        return j;
+    }
+
+    // Particle i becomes old particle old_index[i]; particles missing from old_index are dropped
+    void permute(const std::vector<int> &old_index) {
+        permute_array(pos, old_index);
+        permute_array(v, old_index);
+        permute_array(apic_b, old_index);
+        permute_array(dg_e, old_index);
+        permute_array(dg_p, old_index);
+        permute_array(mass, old_index);
+        permute_array(vol, old_index);
+        permute_array(state, old_index);
+        permute_array(last_update, old_index);
+        permute_array(material, old_index);
+        permute_array(allowed_dt, old_index);
+    }
+
+    template <typename T>
+    static void permute_array(Array<T> &arr, const std::vector<int> &old_index) {
+        Array<T> permuted(old_index.size());
+        for (int i = 0; i < (int)old_index.size(); i++) {
+            permuted[i] = arr[old_index[i]];
+        }
+        arr.swap(permuted);
+    }
+
+    // Matrices are written in fp32 whatever the storage format, so that checkpoints and messages
+    // do not depend on TC_MPM3_COMPACT_PARTICLES. Per-substep scratch is not stored; it is
+    // recomputed before use.
+    void write(BinaryFileStreamOutput &os) const {
+        os << pos << v;
+        write_matrices(os, apic_b);
+        os << dg_e;
+        write_matrices(os, dg_p);
+        os << mass << vol << state << last_update << material << allowed_dt;
+    }
+
+    void read(BinaryFileStreamInput &is) {
+        is >> pos >> v;
+        read_matrices(is, apic_b);
+        is >> dg_e;
+        read_matrices(is, dg_p);
+        is >> mass >> vol >> state >> last_update >> material >> allowed_dt;
+    }
+
+    // A single particle in the same format, e.g. for handing it over to another process
+    template <typename OS>
+    void write_particle(OS &os, int i) const {
+        os << pos[i] << v[i] << Matrix(apic_b[i]) << dg_e[i] << Matrix(dg_p[i]) << mass[i] << vol[i] << state[i]
+           << last_update[i] << material[i] << allowed_dt[i];
+    }
+
+    // Appends a particle written by write_particle and returns its index
+    template <typename IS>
+    int read_particle(IS &is) {
+        int i = add_particle(Vector(0.0f), Vector(0.0f), 0.0f, 0, 0);
+        is >> pos[i] >> v[i];
+        apic_b[i] = is.template read<Matrix>();
+        is >> dg_e[i];
+        dg_p[i] = is.template read<Matrix>();
+        is >> mass[i] >> vol[i] >> state[i] >> last_update[i] >> material[i] >> allowed_dt[i];
+        return i;
+    }
+
+    template <typename OS>
+    static void write_matrices(OS &os, const Array<Matrix> &arr) {
+        os << arr;
+    }
+
+    template <typename OS>
+    static void write_matrices(OS &os, const Array<MPM3CompactMatrix> &arr) {
+        os << Array<Matrix>(arr.begin(), arr.end());
+    }
+
+    template <typename IS>
+    static void read_matrices(IS &is, Array<Matrix> &arr) {
+        is >> arr;
+    }
+
+    template <typename IS>
+    static void read_matrices(IS &is, Array<MPM3CompactMatrix> &arr) {
+        Array<Matrix> full;
+        is >> full;
+        arr.assign(full.begin(), full.end());
+    }
+
+    void print(int i) const {
+        P(pos[i]);
+        P(v[i]);
+        P(dg_e[i]);
+        P(Matrix(dg_p[i]));
+    }
+};
+
+// A constitutive model applied to a contiguous range [begin, end) of particles.
+// Virtual calls happen once per batch; the per-particle code is inlined by MPM3MaterialBase.
+class MPM3Material {
+public:
+    using Vector = Vector3;
+    using Matrix = Matrix3;
+    static const int D = 3;
+
+    int begin = 0, end = 0;
+
+    virtual void initialize(const Config &config) {}
+
+    // Called once the particles [begin, end) have been appended to the storage.
+    virtual void initialize_particles(MPM3Particles &particles, int begin, int end, int num_threads) {
+        this->begin = begin;
+        this->end = end;
+    }
+
+    // Writes particles.tmp_force for every particle in `indices`
+    virtual void calculate_force(MPM3Particles &particles, const std::vector<int> &indices, int num_threads) = 0;
+
+    // The same quantity for a single particle, for passes that consume it on the fly
+    virtual Matrix get_force(const MPM3Particles &particles, int i) const = 0;
+
+    // The first Piola-Kirchhoff stress of particle i at the elastic deformation gradient dg_e instead of its own,
+    // for implicit integration
+    virtual Matrix get_stress(const MPM3Particles &particles, int i, const Matrix &dg_e) const = 0;
+
+    // A bound on the stress change per unit of deformation change (e.g. 2 mu + lambda), for preconditioners
+    virtual real get_stiffness(const MPM3Particles &particles, int i) const {
+        return 0.0f;
+    }
+
+    virtual void plasticity(MPM3Particles &particles, const std::vector<int> &indices, int num_threads) = 0;
+
+    virtual void update_allowed_dt(MPM3Particles &particles, const std::vector<int> &indices,
+                                   int num_threads) = 0;
+
+    virtual std::string get_name() const = 0;
+
+    // The particle storage was permuted within [begin, end): particle i is old particle old_index[i]
+    virtual void permute_particles(const std::vector<int> &old_index) {}
+
+    // Per-particle state that travels with a particle moving to another process, as
+    // get_num_particle_attributes() reals per particle. i is a particle index in [begin, end).
+    virtual int get_num_particle_attributes() const {
+        return 0;
     }
 
-    virtual real get_allowed_dt() const = 0;
+    virtual void get_particle_attributes(int i, real *attributes) const {}
 
-    virtual void initialize(const Config &config) {
+    virtual void set_particle_attributes(int i, const real *attributes) {}
 
+    // The particles of this material now occupy [begin, end); their attributes are set afterwards
+    virtual void set_particle_range(int begin, int end) {
+        this->begin = begin;
+        this->end = end;
     }
 
-    virtual void set_compression(float compression) {
-        dg_p = Matrix(compression); // 1.0f = no compression
+    // Per-particle state for checkpoints. Parameters come from the config passed to initialize().
+    virtual void write_state(BinaryFileStreamOutput &os) const {
+        os << begin << end;
     }
 
-    virtual Matrix get_energy_gradient() = 0;
+    virtual void read_state(BinaryFileStreamInput &is) {
+        is >> begin >> end;
+    }
 
-    virtual void calculate_kernels() {}
+    virtual ~MPM3Material() {}
+};
 
-    virtual void calculate_force() = 0;
+// CRTP helper: Model provides the non-virtual per-particle functions
+//   initialize_particle, get_stress_single, plasticity_single and get_allowed_dt_single.
+// Stress, at a given elastic deformation gradient, and plasticity receive the SVD of it, resp. of dg_e, computed
+// svd_batch_size particles at a time.
+// A Model may shadow plasticity_batch instead of providing plasticity_single when it needs further
+// decompositions.
+template <typename Model>
+class MPM3MaterialBase : public MPM3Material {
+public:
+    static const int svd_batch_size = 64;
+
+    void calculate_force(MPM3Particles &particles, const std::vector<int> &indices, int num_threads) override {
+        const int num_batches = ((int)indices.size() + svd_batch_size - 1) / svd_batch_size;
+        ThreadedTaskManager::run(num_batches, num_threads, [&](int b) {
+            const int *batch = &indices[b * svd_batch_size];
+            const int n = std::min(svd_batch_size, (int)indices.size() - b * svd_batch_size);
+            Matrix dg[svd_batch_size], u[svd_batch_size], sig[svd_batch_size], v[svd_batch_size];
+            for (int k = 0; k < n; k++) {
+                dg[k] = particles.dg_e[batch[k]];
+            }
+            svd(n, dg, u, sig, v);
+            for (int k = 0; k < n; k++) {
+                particles.tmp_force[batch[k]] = get_force_single(particles, batch[k], u[k], sig[k], v[k]);
+            }
+        });
+    }
 
-    virtual void plasticity() {};
+    Matrix get_force(const MPM3Particles &particles, int i) const override {
+        Matrix u, sig, v;
+        svd(particles.dg_e[i], u, sig, v);
+        return get_force_single(particles, i, u, sig, v);
+    }
+
+    // u, sig, v: SVD of dg_e
+    Matrix get_force_single(const MPM3Particles &particles, int i, const Matrix &u, const Matrix &sig,
+                            const Matrix &v) const {
+        const Matrix &dg_e = particles.dg_e[i];
+        return -particles.vol[i] * static_cast<const Model *>(this)->get_stress_single(particles, i, dg_e, u, sig, v)
+               * glm::transpose(dg_e);
+    }
+
+    Matrix get_stress(const MPM3Particles &particles, int i, const Matrix &dg_e) const override {
+        Matrix u, sig, v;
+        svd(dg_e, u, sig, v);
+        return static_cast<const Model *>(this)->get_stress_single(particles, i, dg_e, u, sig, v);
+    }
+
+    void plasticity(MPM3Particles &particles, const std::vector<int> &indices, int num_threads) override {
+        Model *model = static_cast<Model *>(this);
+        const int num_batches = ((int)indices.size() + svd_batch_size - 1) / svd_batch_size;
+        ThreadedTaskManager::run(num_batches, num_threads, [&](int b) {
+            const int n = std::min(svd_batch_size, (int)indices.size() - b * svd_batch_size);
+            model->plasticity_batch(particles, &indices[b * svd_batch_size], n);
+        });
+    }
 
-    virtual void resolve_collision(const DynamicLevelSet3D &levelset, real t) {
-        real phi = levelset.sample(pos, t);
-        if (phi < 0) {
-            Vector3 gradient = levelset.get_spatial_gradient(pos, t);
-            pos -= gradient * phi;
-            v -= glm::dot(gradient, v) * gradient;
+    // n <= svd_batch_size particles
+    void plasticity_batch(MPM3Particles &particles, const int *batch, int n) {
+        Model *model = static_cast<Model *>(this);
+        Matrix dg[svd_batch_size], u[svd_batch_size], sig[svd_batch_size], v[svd_batch_size];
+        for (int k = 0; k < n; k++) {
+            dg[k] = particles.dg_e[batch[k]];
+        }
+        svd(n, dg, u, sig, v);
+        for (int k = 0; k < n; k++) {
+            model->plasticity_single(particles, batch[k], u[k], sig[k], v[k]);
         }
     }
 
-    virtual void print() {
-        P(pos);
-        P(v);
-        P(dg_e);
-        P(dg_p);
+    void update_allowed_dt(MPM3Particles &particles, const std::vector<int> &indices, int num_threads) override {
+        const Model *model = static_cast<const Model *>(this);
+        ThreadedTaskManager::run((int)indices.size(), num_threads, [&](int i) {
+            particles.allowed_dt[indices[i]] = model->get_allowed_dt_single(particles, indices[i]);
+        });
     }
 
-    virtual ~MPM3Particle() {}
+    void initialize_particles(MPM3Particles &particles, int begin, int end, int num_threads) override {
+        MPM3Material::initialize_particles(particles, begin, end, num_threads);
+        Model *model = static_cast<Model *>(this);
+        parallel_for(begin, end, num_threads, [&](int i) {
+            model->initialize_particle(particles, i);
+            particles.allowed_dt[i] = model->get_allowed_dt_single(particles, i);
+        });
+    }
 };
 
-struct EPParticle3 : public MPM3Particle {
+// Snow (elastoplastic)
+class EPMaterial3 : public MPM3MaterialBase<EPMaterial3> {
+public:
     real hardening = 10.0f;
     real mu_0 = 1e5f, lambda_0 = 1e5f;
     real theta_c = 2.5e-2f, theta_s = 7.5e-3f;
-
-    EPParticle3() : MPM3Particle() {
-    }
+    real compression = 1.0f;
 
     void initialize(const Config &config) override {
         hardening = config.get("hardening", hardening);
@@ -99,74 +436,91 @@ struct EPParticle3 : public MPM3Particle {
         mu_0 = config.get("mu_0", mu_0);
         theta_c = config.get("theta_c", theta_c);
         theta_s = config.get("theta_s", theta_s);
-        real compression = config.get("compression", 1.0f);
-        dg_p = Matrix(compression);
+        compression = config.get("compression", 1.0f);
+    }
+
+    std::string get_name() const override {
+        return "ep";
+    }
+
+    void initialize_particle(MPM3Particles &p, int i) {
+        p.dg_p[i] = Matrix(compression); // 1.0f = no compression
     }
 
-    virtual Matrix get_energy_gradient() override {
+    // u, sig, v: SVD of dg_e
+    Matrix get_stress_single(const MPM3Particles &p, int i, const Matrix &dg_e, const Matrix &u, const Matrix &sig,
+                             const Matrix &v) const {
         real j_e = det(dg_e);
-        real j_p = det(dg_p);
+        real j_p = det(p.dg_p[i]);
         real e = std::exp(std::min(hardening * (1.0f - j_p), 1000.0f));
         real mu = mu_0 * e;
         real lambda = lambda_0 * e;
-        Matrix r, s;
-        polar_decomp(dg_e, r, s);
+        // Rotation of the polar decomposition
+        Matrix r = u * glm::transpose(v);
         if (!is_normal(r)) {
             P(dg_e);
             P(r);
-            P(s);
         }
         CV(r);
-        CV(s);
         return 2 * mu * (dg_e - r) +
                lambda * (j_e - 1) * j_e * glm::inverse(glm::transpose(dg_e));
     }
 
-    virtual void calculate_kernels() override {}
-
-    virtual void calculate_force() override {
-        tmp_force = -vol * get_energy_gradient() * glm::transpose(dg_e);
-    };
-
-    virtual void plasticity() override {
-        Matrix svd_u, sig, svd_v;
-        svd(dg_e, svd_u, sig, svd_v);
-        for (int i = 0; i < D; i++) {
-            sig[i][i] = clamp(sig[i][i], 1.0f - theta_c, 1.0f + theta_s);
+    // Clamps the singular values of dg_e, then those of the resulting dg_p; both SVDs are batched
+    void plasticity_batch(MPM3Particles &p, const int *batch, int n) const {
+        Matrix dg[svd_batch_size], u[svd_batch_size], sig[svd_batch_size], v[svd_batch_size];
+        for (int k = 0; k < n; k++) {
+            dg[k] = p.dg_e[batch[k]];
+        }
+        svd(n, dg, u, sig, v);
+        for (int k = 0; k < n; k++) {
+            const int i = batch[k];
+            // The total deformation gradient, which the projection of dg_e leaves unchanged
+            const Matrix dg_total = dg[k] * Matrix(p.dg_p[i]);
+            for (int d = 0; d < D; d++) {
+                sig[k][d][d] = clamp(sig[k][d][d], 1.0f - theta_c, 1.0f + theta_s);
+            }
+            p.dg_e[i] = u[k] * sig[k] * glm::transpose(v[k]);
+            dg[k] = glm::inverse(p.dg_e[i]) * dg_total;
         }
-        dg_e = svd_u * sig * glm::transpose(svd_v);
-        dg_p = glm::inverse(dg_e) * dg_cache;
-        svd(dg_p, svd_u, sig, svd_v);
-        for (int i = 0; i < D; i++) {
-            sig[i][i] = clamp(sig[i][i], 0.1f, 10.0f);
+        svd(n, dg, u, sig, v);
+        for (int k = 0; k < n; k++) {
+            for (int d = 0; d < D; d++) {
+                sig[k][d][d] = clamp(sig[k][d][d], 0.1f, 10.0f);
+            }
+            p.dg_p[batch[k]] = u[k] * sig[k] * glm::transpose(v[k]);
         }
-        dg_p = svd_u * sig * glm::transpose(svd_v);
-    };
+    }
 
-    std::pair<real, real> get_lame_parameters() const {
-        real j_e = det(dg_e);
-        real j_p = det(dg_p);
+    std::pair<real, real> get_lame_parameters(const MPM3Particles &p, int i) const {
+        real j_p = det(p.dg_p[i]);
         real e = std::max(1e-7f, std::exp(std::min(hardening * (1.0f - j_p), 5.0f)));
         real mu = mu_0 * e;
         real lambda = lambda_0 * e;
         return {mu, lambda};
     }
 
-    virtual real get_allowed_dt() const override {
-        auto lame = get_lame_parameters();
+    real get_stiffness(const MPM3Particles &p, int i) const override {
+        auto lame = get_lame_parameters(p, i);
+        return 2 * lame.first + lame.second;
+    }
+
+    real get_allowed_dt_single(const MPM3Particles &p, int i) const {
+        auto lame = get_lame_parameters(p, i);
         real strength_limit = 0.5f / std::sqrt(lame.first + 2 * lame.second);
         return strength_limit;
     }
 };
 
-struct DPParticle3 : public MPM3Particle {
+// Sand (Drucker-Prager)
+class DPMaterial3 : public MPM3MaterialBase<DPMaterial3> {
+public:
     real h_0 = 35.0f, h_1 = 9.0f, h_2 = 0.2f, h_3 = 10.0f;
     real lambda_0 = 204057.0f, mu_0 = 136038.0f;
-    real alpha = 1.0f;
-    real q = 0.0f;
-
-    DPParticle3() : MPM3Particle() {
-    }
+    real alpha_0 = 1.0f;
+    real compression = 1.0f;
+    // Per-particle hardening state, indexed by (particle index - begin)
+    std::vector<real> alpha, q;
 
     void initialize(const Config &config) override {
         h_0 = config.get("h_0", h_0);
@@ -175,16 +529,65 @@ struct DPParticle3 : public MPM3Particle {
         h_3 = config.get("h_3", h_3);
         lambda_0 = config.get("lambda_0", lambda_0);
         mu_0 = config.get("mu_0", mu_0);
-        alpha = config.get("alpha", alpha);
-        real compression = config.get("compression", 1.0f);
-        dg_p = Matrix(compression);
+        alpha_0 = config.get("alpha", alpha_0);
+        compression = config.get("compression", 1.0f);
+    }
+
+    std::string get_name() const override {
+        return "dp";
+    }
+
+    void initialize_particles(MPM3Particles &particles, int begin, int end, int num_threads) override {
+        alpha.assign(end - begin, alpha_0);
+        q.assign(end - begin, 0.0f);
+        MPM3MaterialBase<DPMaterial3>::initialize_particles(particles, begin, end, num_threads);
+    }
+
+    void initialize_particle(MPM3Particles &p, int i) {
+        p.dg_p[i] = Matrix(compression);
+    }
+
+    void permute_particles(const std::vector<int> &old_index) override {
+        std::vector<real> new_alpha(alpha.size()), new_q(q.size());
+        for (int i = begin; i < end; i++) {
+            new_alpha[i - begin] = alpha[old_index[i] - begin];
+            new_q[i - begin] = q[old_index[i] - begin];
+        }
+        alpha.swap(new_alpha);
+        q.swap(new_q);
+    }
+
+    int get_num_particle_attributes() const override {
+        return 2;
     }
 
-    Matrix3 get_energy_gradient() override {
-        return Matrix3(1.f);
+    void get_particle_attributes(int i, real *attributes) const override {
+        attributes[0] = alpha[i - begin];
+        attributes[1] = q[i - begin];
     }
 
-    void project(Matrix3 sigma, real alpha, Matrix3 &sigma_out, real &out) {
+    void set_particle_attributes(int i, const real *attributes) override {
+        alpha[i - begin] = attributes[0];
+        q[i - begin] = attributes[1];
+    }
+
+    void set_particle_range(int begin, int end) override {
+        MPM3MaterialBase<DPMaterial3>::set_particle_range(begin, end);
+        alpha.resize(end - begin);
+        q.resize(end - begin);
+    }
+
+    void write_state(BinaryFileStreamOutput &os) const override {
+        MPM3MaterialBase<DPMaterial3>::write_state(os);
+        os << alpha << q;
+    }
+
+    void read_state(BinaryFileStreamInput &is) override {
+        MPM3MaterialBase<DPMaterial3>::read_state(is);
+        is >> alpha >> q;
+    }
+
+    void project(Matrix3 sigma, real alpha, Matrix3 &sigma_out, real &out) const {
         const real d = 3;
         Matrix3 epsilon(log(sigma[0][0]), 0.f, 0.f, 0.f, log(sigma[1][1]), 0.f, 0.f, 0.f, log(sigma[2][2]));
         real tr = epsilon[0][0] + epsilon[1][1] + epsilon[2][2];
@@ -209,13 +612,8 @@ struct DPParticle3 : public MPM3Particle {
         }
     }
 
-    void calculate_kernels() override {
-    }
-
-    void calculate_force() override {
-        Matrix3 u, v, sig, dg = dg_e;
-        svd(dg_e, u, sig, v);
-
+    Matrix get_stress_single(const MPM3Particles &p, int i, const Matrix &dg_e, const Matrix &u, const Matrix &sig,
+                             const Matrix &v) const {
         assert_info(sig[0][0] > 0, "negative singular value");
         assert_info(sig[1][1] > 0, "negative singular value");
         assert_info(sig[2][2] > 0, "negative singular value");
@@ -225,15 +623,18 @@ struct DPParticle3 : public MPM3Particle {
         Matrix3 center =
                 2 * mu_0 * inv_sig * log_sig + lambda_0 * (log_sig[0][0] + log_sig[1][1] + log_sig[2][2]) * inv_sig;
 
-        tmp_force = -vol * (u * center * glm::transpose(v)) * glm::transpose(dg);
+        return u * center * glm::transpose(v);
     }
 
-    void plasticity() override {
-        Matrix3 u, v, sig;
-        svd(dg_e, u, sig, v);
+    real get_stiffness(const MPM3Particles &p, int i) const override {
+        return 2 * mu_0 + lambda_0;
+    }
+
+    void plasticity_single(MPM3Particles &p, int i, const Matrix &u, const Matrix &sig, const Matrix &v) {
+        Matrix3 &dg_e = p.dg_e[i];
         Matrix3 t = Matrix3(1.0);
         real delta_q = 0;
-        project(sig, alpha, t, delta_q);
+        project(sig, alpha[i - begin], t, delta_q);
         Matrix3 rec = u * sig * glm::transpose(v);
         Matrix3 diff = rec - dg_e;
         if (!(frobenius_norm(diff) < 1e-4f)) {
@@ -246,15 +647,18 @@ struct DPParticle3 : public MPM3Particle {
             error("SVD error\n");
         }
         dg_e = u * t * glm::transpose(v);
-        dg_p = v * glm::inverse(t) * sig * glm::transpose(v) * dg_p;
-        q += delta_q;
-        real phi = h_0 + (h_1 * q - h_3) * expf(-h_2 * q);
-        alpha = sqrtf(2.0f / 3.0f) * (2.0f * sin(phi * pi / 180.0f)) / (3.0f - sin(phi * pi / 180.0f));
+        p.dg_p[i] = v * glm::inverse(t) * sig * glm::transpose(v) * Matrix(p.dg_p[i]);
+        real &q_i = q[i - begin];
+        q_i += delta_q;
+        real phi = h_0 + (h_1 * q_i - h_3) * expf(-h_2 * q_i);
+        alpha[i - begin] = sqrtf(2.0f / 3.0f) * (2.0f * sin(phi * pi / 180.0f)) / (3.0f - sin(phi * pi / 180.0f));
     }
 
-    real get_allowed_dt() const override {
+    real get_allowed_dt_single(const MPM3Particles &p, int i) const {
         return 0.0f;
     }
 };
 
+std::shared_ptr<MPM3Material> create_mpm3_material(const std::string &type);
+
 TC_NAMESPACE_END
@@ -0,0 +1,201 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include "mpm3.h"
+#include <algorithm>
+
+TC_NAMESPACE_BEGIN
+
+// Particles are resampled cell by cell. A crowded cell merges its closest compatible pairs (same material and
+// time stamp) into particles at their center of mass; a sparse one splits its heaviest particles into two halves
+// along the direction of largest stretch. Merges only go up to twice, and splits down to half of, the seeded
+// mass, so that no particle dominates or vanishes from its nodes.
+
+// The mass add_particles gives
+const real mpm3_nominal_particle_mass = 1.0f;
+
+void MPM3D::adapt_particle_sampling() {
+    const int block_size = mpm3d_grid_block_size;
+    const int block_cells = block_size * block_size * block_size;
+    const Vector3i block_res = scheduler.res;
+    std::vector<int> blocks;
+    for (int b = 0; b < block_res.x * block_res.y * block_res.z; b++) {
+        if (scheduler.block_begin[b + 1] > scheduler.block_begin[b]) {
+            blocks.push_back(b);
+        }
+    }
+    const int n = particles.size();
+    std::vector<char> removed(n, 0);
+    // Per block, the particles that absorbed others, and the split particles with the position of their twins
+    std::vector<std::vector<int>> merged(blocks.size());
+    std::vector<std::vector<std::pair<int, Vector>>> splits(blocks.size());
+    // Every block only touches its own particles, which stay in it
+    ThreadedTaskManager::run((int)blocks.size(), num_threads, [&](int b) {
+        const MPM3ParticleRange group = scheduler.get_particle_group(blocks[b]);
+        const int block_id = blocks[b];
+        const Vector3i origin = Vector3i(block_id / (block_res.y * block_res.z), block_id / block_res.z % block_res.y,
+                                         block_id % block_res.z) * block_size;
+        auto get_cell = [&](int p) {
+            const Vector &pos = particles.pos[p];
+            int i = clamp(int(pos.x) - origin.x, 0, block_size - 1);
+            int j = clamp(int(pos.y) - origin.y, 0, block_size - 1);
+            int k = clamp(int(pos.z) - origin.z, 0, block_size - 1);
+            return (i * block_size + j) * block_size + k;
+        };
+        std::vector<int> cell_begin(block_cells + 1, 0);
+        for (int p : group) {
+            cell_begin[get_cell(p) + 1]++;
+        }
+        for (int c = 0; c < block_cells; c++) {
+            cell_begin[c + 1] += cell_begin[c];
+        }
+        std::vector<int> cursor(cell_begin.begin(), cell_begin.end() - 1);
+        std::vector<int> cell_particles(group.size());
+        for (int p : group) {
+            cell_particles[cursor[get_cell(p)]++] = p;
+        }
+        std::vector<std::pair<real, std::pair<int, int>>> pairs;
+        std::vector<char> used;
+        std::vector<real> attributes_a, attributes_b;
+        for (int c = 0; c < block_cells; c++) {
+            int *cell = cell_particles.data() + cell_begin[c];
+            int count = cell_begin[c + 1] - cell_begin[c];
+            if (count > max_particles_per_cell) {
+                // Closest pairs first
+                pairs.clear();
+                for (int i = 0; i < count; i++) {
+                    for (int j = i + 1; j < count; j++) {
+                        const int p = cell[i], q = cell[j];
+                        if (particles.material[p] == particles.material[q] &&
+                            particles.last_update[p] == particles.last_update[q]) {
+                            const Vector d = particles.pos[p] - particles.pos[q];
+                            pairs.push_back({glm::dot(d, d), {i, j}});
+                        }
+                    }
+                }
+                std::sort(pairs.begin(), pairs.end());
+                used.assign(count, 0);
+                for (auto &pair : pairs) {
+                    if (count <= max_particles_per_cell) {
+                        break;
+                    }
+                    const int p = cell[pair.second.first], q = cell[pair.second.second];
+                    if (used[pair.second.first] || used[pair.second.second] ||
+                        particles.mass[p] + particles.mass[q] > 2 * mpm3_nominal_particle_mass) {
+                        continue;
+                    }
+                    // q is merged into p
+                    const real mass = particles.mass[p] + particles.mass[q], w = particles.mass[q] / mass;
+                    const Vector pos = (1 - w) * particles.pos[p] + w * particles.pos[q];
+                    const Vector v = (1 - w) * particles.v[p] + w * particles.v[q];
+                    // The relative motion of the two becomes affine motion, which keeps the angular momentum
+                    particles.apic_b[p] =
+                            (1 - w) * (Matrix(particles.apic_b[p]) +
+                                       glm::outerProduct(particles.v[p] - v, particles.pos[p] - pos)) +
+                            w * (Matrix(particles.apic_b[q]) +
+                                 glm::outerProduct(particles.v[q] - v, particles.pos[q] - pos));
+                    particles.dg_e[p] = (1 - w) * particles.dg_e[p] + w * particles.dg_e[q];
+                    particles.dg_p[p] = (1 - w) * Matrix(particles.dg_p[p]) + w * Matrix(particles.dg_p[q]);
+                    particles.vol[p] += particles.vol[q];
+                    particles.pos[p] = pos;
+                    particles.v[p] = v;
+                    particles.mass[p] = mass;
+                    MPM3Material &material = *materials[particles.material[p]];
+                    const int num_attributes = material.get_num_particle_attributes();
+                    if (num_attributes > 0) {
+                        attributes_a.resize(num_attributes);
+                        attributes_b.resize(num_attributes);
+                        material.get_particle_attributes(p, attributes_a.data());
+                        material.get_particle_attributes(q, attributes_b.data());
+                        for (int a = 0; a < num_attributes; a++) {
+                            attributes_a[a] = (1 - w) * attributes_a[a] + w * attributes_b[a];
+                        }
+                        material.set_particle_attributes(p, attributes_a.data());
+                    }
+                    used[pair.second.first] = used[pair.second.second] = 1;
+                    removed[q] = 1;
+                    merged[b].push_back(p);
+                    count--;
+                }
+            } else if (count > 0 && count < min_particles_per_cell) {
+                // Heaviest first
+                std::sort(cell, cell + count, [&](int p, int q) {
+                    return particles.mass[p] > particles.mass[q] || (particles.mass[p] == particles.mass[q] && p < q);
+                });
+                for (int i = 0; i < count && count + i < min_particles_per_cell; i++) {
+                    const int p = cell[i];
+                    if (particles.mass[p] < mpm3_nominal_particle_mass) {
+                        break;
+                    }
+                    // Along the largest stretch, with both halves kept in the block
+                    Matrix u, sig, v;
+                    svd(particles.dg_e[p] * Matrix(particles.dg_p[p]), u, sig, v);
+                    int axis = 0;
+                    for (int k = 1; k < D; k++) {
+                        if (sig[k][k] > sig[axis][axis]) {
+                            axis = k;
+                        }
+                    }
+                    Vector d = 0.25f * u[axis];
+                    const Vector &pos = particles.pos[p];
+                    real scale = 1.0f;
+                    for (int k = 0; k < D; k++) {
+                        if (d[k] != 0) {
+                            const real room = std::min(pos[k] - origin[k], origin[k] + block_size - pos[k]);
+                            scale = std::min(scale, 0.99f * room / std::abs(d[k]));
+                        }
+                    }
+                    d *= std::max(scale, 0.0f);
+                    particles.mass[p] *= 0.5f;
+                    particles.vol[p] *= 0.5f;
+                    particles.pos[p] -= d;
+                    splits[b].push_back({p, particles.pos[p] + 2.0f * d});
+                }
+            }
+        }
+    });
+    // The merged particles take the allowed dt of their new deformation gradients
+    std::vector<std::vector<int>> merged_by_material(materials.size());
+    bool changed = false;
+    for (auto &block_merged : merged) {
+        for (int p : block_merged) {
+            merged_by_material[particles.material[p]].push_back(p);
+            changed = true;
+        }
+    }
+    for (int m = 0; m < (int)materials.size(); m++) {
+        materials[m]->update_allowed_dt(particles, merged_by_material[m], num_threads);
+    }
+    // Twins copy their particle, material attributes included
+    std::vector<real> appended_attributes;
+    std::vector<int> appended_attribute_offset;
+    {
+        TC_MEMORY_TAG("mpm3.particles");
+        for (auto &block_splits : splits) {
+            for (auto &split : block_splits) {
+                const int p = split.first;
+                const int twin = particles.duplicate_particle(p);
+                particles.pos[twin] = split.second;
+                const MPM3Material &material = *materials[particles.material[p]];
+                appended_attribute_offset.push_back((int)appended_attributes.size());
+                appended_attributes.resize(appended_attributes.size() + material.get_num_particle_attributes());
+                material.get_particle_attributes(p, appended_attributes.data() + appended_attribute_offset.back());
+                changed = true;
+            }
+        }
+        if (!changed) {
+            return;
+        }
+        rebuild_particle_storage(n, removed, appended_attributes, appended_attribute_offset);
+    }
+    TC_MEMORY_TAG("mpm3.scheduler");
+    scheduler.update_particle_groups();
+}
+
+TC_NAMESPACE_END
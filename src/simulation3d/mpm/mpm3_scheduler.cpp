@@ -9,141 +9,311 @@
 *******************************************************************************/
 
 #include "mpm3_scheduler.h"
+#include <algorithm>
 
 TC_NAMESPACE_BEGIN
 
 template<typename T> using Array = Array3D<T>;
 
 void MPM3Scheduler::expand(bool expand_vel, bool expand_state) {
+    // Every block gathers from its 3x3x3 neighbourhood, so that blocks are independent
     Array<int> new_states;
-    Array<int> old_states;
     if (expand_state) {
-        old_states = states;
+        new_states.initialize(res, 0);
     }
-    min_vel_expanded = Vector3(1e30f, 1e30f, 1e30f);
-    max_vel_expanded = Vector3(-1e30f, -1e30f, -1e30f);
-    new_states.initialize(res, 0);
-
-    auto update = [&](const Index3D ind, int dx, int dy, int dz,
-                      const Array<Vector3> &min_vel,
-                      const Array<Vector3> &max_vel,
-                      Array<Vector3> &new_min_vel,
-                      Array<Vector3> &new_max_vel,
-                      const Array<int> &states, Array<int> &new_states) -> void {
-        if (expand_vel) {
-            auto &tmp_min = new_min_vel[ind.neighbour(dx, dy, dz)];
-            tmp_min[0] = std::min(tmp_min[0], min_vel[ind][0]);
-            tmp_min[1] = std::min(tmp_min[1], min_vel[ind][1]);
-            tmp_min[2] = std::min(tmp_min[2], min_vel[ind][2]);
-            auto &tmp_max = new_max_vel[ind.neighbour(dx, dy, dz)];
-            tmp_max[0] = std::max(tmp_max[0], max_vel[ind][0]);
-            tmp_max[1] = std::max(tmp_max[1], max_vel[ind][1]);
-            tmp_max[2] = std::max(tmp_max[2], max_vel[ind][2]);
-        }
-        if (expand_state) {
-            if (states[ind])
-                new_states[ind.neighbour(dx, dy, dz)] = 1;
-        }
-    };
-
-    for (auto &ind : states.get_region()) {
+    parallel_for_each_block([&](const Index3D &ind) {
+        Vector3 tmp_min(1e30f, 1e30f, 1e30f), tmp_max(-1e30f, -1e30f, -1e30f);
+        bool neighbour_active = false;
         for (int dx = -1; dx <= 1; dx++) {
             for (int dy = -1; dy <= 1; dy++) {
                 for (int dz = -1; dz <= 1; dz++) {
-                    if (states.inside(ind.neighbour(dx, dy, dz)))
-                        update(ind, dx, dy, dz, min_vel, max_vel, min_vel_expanded, max_vel_expanded, states, new_states);
+                    auto neighbour_ind = ind.neighbour(dx, dy, dz);
+                    if (!states.inside(neighbour_ind)) {
+                        continue;
+                    }
+                    if (expand_vel) {
+                        const Vector3 &neighbour_min = min_vel[neighbour_ind];
+                        const Vector3 &neighbour_max = max_vel[neighbour_ind];
+                        for (int d = 0; d < 3; d++) {
+                            tmp_min[d] = std::min(tmp_min[d], neighbour_min[d]);
+                            tmp_max[d] = std::max(tmp_max[d], neighbour_max[d]);
+                        }
+                    }
+                    if (expand_state && states[neighbour_ind]) {
+                        neighbour_active = true;
+                    }
                 }
             }
         }
-    }
+        min_vel_expanded[ind] = tmp_min;
+        max_vel_expanded[ind] = tmp_max;
+        if (expand_state) {
+            new_states[ind] = int(neighbour_active) + states[ind];
+        }
+    });
     if (expand_state) {
         states = new_states;
-        states += old_states;
     } // 1: buffer, 2: updating
 }
 
 void MPM3Scheduler::update() {
-    // Use <= here since grid_res = sim_res + 1
-    active_particles.clear();
-    active_grid_points.clear();
-    for (int i = 0; i <= sim_res[0]; i++) {
-        for (int j = 0; j <= sim_res[1]; j++) {
-            for (int k = 0; k <= sim_res[2]; k++) {
-                if (states[i / mpm3d_grid_block_size][j / mpm3d_grid_block_size][k / mpm3d_grid_block_size] != 0) {
-                    active_grid_points.push_back(Vector3i(i, j, k));
-                }
-            }
+    // The active lists are built by stream compaction: every row of blocks (or active block)
+    // counts its output, the counts are prefix-summed, then each writes its own range in parallel.
+    const int num_rows = get_num_block_rows();
+    std::vector<int> row_begin(num_rows + 1, 0);
+    ThreadedTaskManager::run(num_rows, num_threads, [&](int row) {
+        int count = 0;
+        for (auto &ind : get_block_row(row)) {
+            count += int(states[ind] != 0);
         }
+        row_begin[row + 1] = count;
+    });
+    for (int row = 0; row < num_rows; row++) {
+        row_begin[row + 1] += row_begin[row];
     }
-    for (auto &ind : states.get_region()) {
-        if (states[ind] != 0) {
-            for (auto &p : particle_groups[res[2] * res[1] * ind.i + res[2] * ind.j + ind.k]) {
-                active_particles.push_back(p);
+    active_blocks.resize(row_begin[num_rows]);
+    ThreadedTaskManager::run(num_rows, num_threads, [&](int row) {
+        int out = row_begin[row];
+        for (auto &ind : get_block_row(row)) {
+            if (states[ind] != 0) {
+                active_blocks[out++] = Vector3i(ind.i, ind.j, ind.k);
             }
         }
+    });
+    const int num_active_blocks = (int)active_blocks.size();
+    std::vector<int> particle_begin(num_active_blocks + 1, 0), grid_point_begin(num_active_blocks + 1, 0);
+    ThreadedTaskManager::run(num_active_blocks, num_threads, [&](int b) {
+        Vector3i node_begin, node_end;
+        get_block_nodes(active_blocks[b], node_begin, node_end);
+        Vector3i extent = node_end - node_begin;
+        particle_begin[b + 1] = get_particle_group(active_blocks[b]).size();
+        grid_point_begin[b + 1] = extent.x * extent.y * extent.z;
+    });
+    for (int b = 0; b < num_active_blocks; b++) {
+        particle_begin[b + 1] += particle_begin[b];
+        grid_point_begin[b + 1] += grid_point_begin[b];
     }
+    active_particles.resize(particle_begin[num_active_blocks]);
+    active_grid_points.resize(grid_point_begin[num_active_blocks]);
+    ThreadedTaskManager::run(num_active_blocks, num_threads, [&](int b) {
+        MPM3ParticleRange group = get_particle_group(active_blocks[b]);
+        std::copy(group.begin(), group.end(), active_particles.begin() + particle_begin[b]);
+        Vector3i node_begin, node_end;
+        get_block_nodes(active_blocks[b], node_begin, node_end);
+        int out = grid_point_begin[b];
+        for (int i = node_begin.x; i < node_end.x; i++) {
+            for (int j = node_begin.y; j < node_end.y; j++) {
+                for (int k = node_begin.z; k < node_end.z; k++) {
+                    active_grid_points[out++] = Vector3i(i, j, k);
+                }
+            }
+        }
+    });
     update_particle_states();
 }
 
 int64 MPM3Scheduler::update_max_dt_int(int64 t_int) {
-    int64 ret = 1LL << 60;
-    for (auto &ind : max_dt_int.get_region()) {
-        int64 this_step_limit = std::min(max_dt_int_cfl[ind], max_dt_int_strength[ind]);
-        int64 allowed_multiplier = 1;
-        if (t_int % max_dt_int[ind] == 0) {
-            allowed_multiplier = 2;
-        }
-        max_dt_int[ind] = std::min(max_dt_int[ind] * allowed_multiplier, this_step_limit);
-        if (has_particle(ind)) {
-            ret = std::min(ret, max_dt_int[ind]);
+    // Rows of blocks reduce into their own slots, which are then reduced serially
+    std::vector<int64> row_min(get_num_block_rows(), 1LL << 60);
+    ThreadedTaskManager::run(get_num_block_rows(), num_threads, [&](int row) {
+        for (auto &ind : get_block_row(row)) {
+            int64 this_step_limit = std::min(max_dt_int_cfl[ind], max_dt_int_strength[ind]);
+            int64 allowed_multiplier = 1;
+            if (t_int % max_dt_int[ind] == 0) {
+                allowed_multiplier = 2;
+            }
+            max_dt_int[ind] = std::min(max_dt_int[ind] * allowed_multiplier, this_step_limit);
+            if (has_particle(ind)) {
+                row_min[row] = std::min(row_min[row], max_dt_int[ind]);
+            }
         }
-    }
-    return ret;
+    });
+    return *std::min_element(row_min.begin(), row_min.end());
 }
 
 void MPM3Scheduler::update_particle_groups() {
-    // Remove all updating particles, and then re-insert them
-    for (auto &ind : states.get_region()) {
-        if (states[ind] == 0) {
+    const int num_blocks = res[0] * res[1] * res[2];
+    particle_block.resize(particles->size(), -1);
+    parallel_for_each_block([&](const Index3D &ind) {
+        if (states[ind] != 0) {
+            updated[ind] = 1;
+        }
+    });
+    // Only the particles of the last update() can have moved
+    std::vector<int> new_block(active_particles.size());
+    ThreadedTaskManager::run((int)active_particles.size(), num_threads, [&](int i) {
+        new_block[i] = get_block_id(particles->pos[active_particles[i]]);
+    });
+    std::vector<int> block_size(num_blocks);
+    for (int b = 0; b < num_blocks; b++) {
+        block_size[b] = block_begin[b + 1] - block_begin[b];
+    }
+    // Arrivals are bucketed by their new block with a counting sort
+    std::vector<int> arrival_begin(num_blocks + 1, 0);
+    int num_movers = 0;
+    for (int i = 0; i < (int)active_particles.size(); i++) {
+        int p = active_particles[i];
+        int old_b = particle_block[p], new_b = new_block[i];
+        if (old_b == new_b) {
             continue;
         }
-        particle_groups[res[2] * res[1] * ind.i + res[2] * ind.j + ind.k].clear();
-        updated[ind] = 1;
+        num_movers++;
+        if (old_b != -1) {
+            block_size[old_b]--;
+        }
+        if (new_b != -1) {
+            block_size[new_b]++;
+            arrival_begin[new_b + 1]++;
+        }
     }
-    for (auto &p : active_particles) {
-        insert_particle(p);
+    if (num_movers == 0) {
+        return;
+    }
+    for (int b = 0; b < num_blocks; b++) {
+        arrival_begin[b + 1] += arrival_begin[b];
+    }
+    std::vector<int> arrivals(arrival_begin[num_blocks]);
+    std::vector<int> arrival_end(arrival_begin.begin(), arrival_begin.end() - 1);
+    for (int i = 0; i < (int)active_particles.size(); i++) {
+        int p = active_particles[i];
+        int new_b = new_block[i];
+        if (particle_block[p] == new_b) {
+            continue;
+        }
+        particle_block[p] = new_b;
+        if (new_b != -1) {
+            arrivals[arrival_end[new_b]++] = p;
+            const Vector3 &pos = particles->pos[p];
+            updated[int(pos.x / mpm3d_grid_block_size)][int(pos.y / mpm3d_grid_block_size)]
+            [int(pos.z / mpm3d_grid_block_size)] = 1;
+        }
+    }
+    std::vector<int> new_block_begin(num_blocks + 1, 0);
+    for (int b = 0; b < num_blocks; b++) {
+        new_block_begin[b + 1] = new_block_begin[b] + block_size[b];
     }
+    // Each block keeps its staying particles in their old order and appends its arrivals
+    std::vector<int> new_sorted_particles(new_block_begin[num_blocks]);
+    ThreadedTaskManager::run(num_blocks, num_threads, [&](int b) {
+        int out = new_block_begin[b];
+        for (int k = block_begin[b]; k < block_begin[b + 1]; k++) {
+            int p = sorted_particles[k];
+            if (particle_block[p] == b) {
+                new_sorted_particles[out++] = p;
+            }
+        }
+        for (int k = arrival_begin[b]; k < arrival_begin[b + 1]; k++) {
+            new_sorted_particles[out++] = arrivals[k];
+        }
+    });
+    sorted_particles.swap(new_sorted_particles);
+    block_begin.swap(new_block_begin);
 }
 
-void MPM3Scheduler::insert_particle(MPM3Particle *p, bool is_new_particle) {
-    int x = int(p->pos.x / mpm3d_grid_block_size);
-    int y = int(p->pos.y / mpm3d_grid_block_size);
-    int z = int(p->pos.z / mpm3d_grid_block_size);
+void MPM3Scheduler::insert_particle(int p) {
+    if ((int)particle_block.size() <= p) {
+        particle_block.resize(p + 1, -1);
+    }
+    const Vector3 &pos = particles->pos[p];
+    int x = int(pos.x / mpm3d_grid_block_size);
+    int y = int(pos.y / mpm3d_grid_block_size);
+    int z = int(pos.z / mpm3d_grid_block_size);
     if (states.inside(x, y, z)) {
-        int index = res[2] * res[1] * x + res[2] * y + z;
-        particle_groups[index].push_back(p);
         updated[x][y][z] = 1;
-        if (is_new_particle) {
-            max_dt_int[x][y][z] = 1;
-            active_particles.push_back(p);
-        }
+        max_dt_int[x][y][z] = 1;
+        active_particles.push_back(p);
     }
 }
 
-void MPM3Scheduler::update_dt_limits(real t) {
-    for (auto &ind : states.get_region()) {
+void MPM3Scheduler::insert_particles(int begin, int end) {
+    if ((int)particle_block.size() < end) {
+        particle_block.resize(end, -1);
+    }
+    active_particles.reserve(active_particles.size() + (end - begin));
+    for (int p = begin; p < end; p++) {
+        insert_particle(p);
+    }
+}
+
+void MPM3Scheduler::reset_particle_groups() {
+    sorted_particles.clear();
+    std::fill(block_begin.begin(), block_begin.end(), 0);
+    particle_block.assign(particles->size(), -1);
+    active_particles.resize(particles->size());
+    for (int p = 0; p < particles->size(); p++) {
+        active_particles[p] = p;
+    }
+}
+
+void MPM3Scheduler::remap_particles(const std::vector<int> &new_index) {
+    for (auto &p : sorted_particles) {
+        p = new_index[p];
+    }
+    for (auto &p : active_particles) {
+        p = new_index[p];
+    }
+    std::vector<int> new_particle_block(particle_block.size());
+    for (int p = 0; p < (int)particle_block.size(); p++) {
+        new_particle_block[new_index[p]] = particle_block[p];
+    }
+    particle_block.swap(new_particle_block);
+}
+
+template <typename T>
+static void write_array(BinaryFileStreamOutput &os, const Array<T> &arr) {
+    for (auto &ind : arr.get_region()) {
+        os << arr[ind];
+    }
+}
+
+template <typename T>
+static void read_array(BinaryFileStreamInput &is, Array<T> &arr) {
+    for (auto &ind : arr.get_region()) {
+        is >> arr[ind];
+    }
+}
+
+void MPM3Scheduler::write(BinaryFileStreamOutput &os) const {
+    os << res;
+    write_array(os, max_dt_int_strength);
+    write_array(os, max_dt_int_cfl);
+    write_array(os, max_dt_int);
+    write_array(os, states);
+    write_array(os, updated);
+    write_array(os, max_vel);
+    write_array(os, min_vel);
+    os << sorted_particles << block_begin << particle_block << active_particles;
+}
+
+void MPM3Scheduler::read(BinaryFileStreamInput &is) {
+    Vector3i stored_res;
+    is >> stored_res;
+    assert_info(stored_res == res, "Checkpoint scheduler resolution mismatch");
+    read_array(is, max_dt_int_strength);
+    read_array(is, max_dt_int_cfl);
+    read_array(is, max_dt_int);
+    read_array(is, states);
+    read_array(is, updated);
+    read_array(is, max_vel);
+    read_array(is, min_vel);
+    is >> sorted_particles >> block_begin >> particle_block >> active_particles;
+}
+
+void MPM3Scheduler::update_particle_dt_limits() {
+    parallel_for_each_block([&](const Index3D &ind) {
         // Update those blocks needing an update
         if (!updated[ind]) {
-            continue;
+            return;
         }
         updated[ind] = 0;
         max_dt_int_strength[ind] = 1LL << 60;
         max_dt_int_cfl[ind] = 1LL << 60;
         min_vel[ind] = Vector3(1e30f, 1e30f, 1e30f);
         max_vel[ind] = Vector3(-1e30f, -1e30f, -1e30f);
-        for (auto &p : particle_groups[res[2] * res[1] * ind.i + res[2] * ind.j + ind.k]) {
+        for (int p : get_particle_group(Vector3i(ind.i, ind.j, ind.k))) {
             int64 march_interval;
-            int64 allowed_t_int_inc = (int64)(strength_dt_mul * p->get_allowed_dt() / base_delta_t);
+            const Vector3 &v = particles->v[p];
+            int64 allowed_t_int_inc = (int64)(strength_dt_mul * particles->allowed_dt[p] / base_delta_t);
             if (allowed_t_int_inc <= 0) {
                 P(allowed_t_int_inc);
                 allowed_t_int_inc = 1;
@@ -152,19 +322,22 @@ void MPM3Scheduler::update_dt_limits(real t) {
             max_dt_int_strength[ind] = std::min(max_dt_int_strength[ind],
                                                 march_interval);
             auto &tmp_min = min_vel[ind];
-            tmp_min[0] = std::min(tmp_min[0], p->v.x);
-            tmp_min[1] = std::min(tmp_min[1], p->v.y);
-            tmp_min[2] = std::min(tmp_min[2], p->v.z);
+            tmp_min[0] = std::min(tmp_min[0], v.x);
+            tmp_min[1] = std::min(tmp_min[1], v.y);
+            tmp_min[2] = std::min(tmp_min[2], v.z);
             auto &tmp_max = max_vel[ind];
-            tmp_max[0] = std::max(tmp_max[0], p->v.x);
-            tmp_max[1] = std::max(tmp_max[1], p->v.y);
-            tmp_max[2] = std::max(tmp_max[2], p->v.z);
+            tmp_max[0] = std::max(tmp_max[0], v.x);
+            tmp_max[1] = std::max(tmp_max[1], v.y);
+            tmp_max[2] = std::max(tmp_max[2], v.z);
         }
-    }
+    });
+}
+
+void MPM3Scheduler::update_cfl_dt_limits(real t) {
     // Expand velocity
     expand(true, false);
 
-    for (auto &ind : min_vel.get_region()) {
+    parallel_for_each_block([&](const Index3D &ind) {
         real block_vel = std::max(
             std::max(
                 max_vel_expanded[ind][0] - min_vel_expanded[ind][0],
@@ -173,7 +346,7 @@ void MPM3Scheduler::update_dt_limits(real t) {
         ) + 1e-7f;
         if (block_vel < 0) {
             // Blocks with no particles
-            continue;
+            return;
         }
         int64 cfl_limit = int64(cfl / block_vel / base_delta_t);
         if (cfl_limit <= 0) {
@@ -192,7 +365,7 @@ void MPM3Scheduler::update_dt_limits(real t) {
             cfl_limit = std::min(cfl_limit, boundary_limit);
         }
         max_dt_int_cfl[ind] = get_largest_pot(cfl_limit);
-    }
+    });
 }
 
 /*
@@ -303,32 +476,31 @@ void MPMScheduler::print_max_dt_int() {
 */
 
 void MPM3Scheduler::update_particle_states() {
-    for (auto &p : get_active_particles()) {
+    ThreadedTaskManager::run((int)active_particles.size(), num_threads, [&](int i) {
+        int p = active_particles[i];
+        const Vector3 &pos = particles->pos[p];
         Vector3i low_res_pos(
-            int(p->pos.x / mpm3d_grid_block_size),
-            int(p->pos.y / mpm3d_grid_block_size),
-            int(p->pos.z / mpm3d_grid_block_size)
+            int(pos.x / mpm3d_grid_block_size),
+            int(pos.y / mpm3d_grid_block_size),
+            int(pos.z / mpm3d_grid_block_size)
         );
         if (states[low_res_pos] == 2) {
-            p->color = Vector3(1.0f);
-            p->state = MPM3Particle::UPDATING;
+            particles->state[p] = MPM3Particles::UPDATING;
         } else {
-            p->color = Vector3(0.7f);
-            p->state = MPM3Particle::BUFFER;
+            particles->state[p] = MPM3Particles::BUFFER;
         }
-    }
+    });
 }
 
 void MPM3Scheduler::reset_particle_states() {
-    for (auto &p : get_active_particles()) {
-        p->state = MPM3Particle::INACTIVE;
-        p->color = Vector3(0.3f);
-    }
+    ThreadedTaskManager::run((int)active_particles.size(), num_threads, [&](int i) {
+        particles->state[active_particles[i]] = MPM3Particles::INACTIVE;
+    });
 }
 
 void MPM3Scheduler::enforce_smoothness(int64 t_int_increment) {
     Array<int64> new_max_dt_int = max_dt_int;
-    for (auto &ind : states.get_region()) {
+    parallel_for_each_block([&](const Index3D &ind) {
         if (states[ind] != 0) {
             for (int dx = -1; dx <= 1; dx++) {
                 for (int dy = -1; dy <= 1; dy++) {
@@ -341,7 +513,7 @@ void MPM3Scheduler::enforce_smoothness(int64 t_int_increment) {
                 }
             }
         }
-    }
+    });
     max_dt_int = new_max_dt_int;
 }
 
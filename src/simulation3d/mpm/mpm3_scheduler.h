@@ -21,7 +21,26 @@
 
 TC_NAMESPACE_BEGIN
 
-const int mpm3d_grid_block_size = 8;
+// Indices of the particles binned into one block
+struct MPM3ParticleRange {
+    const int *first, *last;
+
+    const int *begin() const {
+        return first;
+    }
+
+    const int *end() const {
+        return last;
+    }
+
+    int size() const {
+        return int(last - first);
+    }
+
+    bool empty() const {
+        return first == last;
+    }
+};
 
 class MPM3Scheduler {
 public:
@@ -34,18 +53,27 @@ public:
     Array<int> updated;
     Array<Vector3> max_vel, min_vel;
     Array<Vector3> max_vel_expanded, min_vel_expanded;
-    std::vector<std::vector<MPM3Particle *>> particle_groups;
+    // Particle indices grouped by block; block b owns [block_begin[b], block_begin[b + 1])
+    std::vector<int> sorted_particles;
+    std::vector<int> block_begin;
+    // Block id each particle is binned into, -1 if it is not binned
+    std::vector<int> particle_block;
     Vector3i res;
     Vector3i sim_res;
-    std::vector<MPM3Particle *> active_particles;
+    MPM3Particles *particles;
+    std::vector<int> active_particles;
     std::vector<Vector3i> active_grid_points;
+    std::vector<Vector3i> active_blocks;
     DynamicLevelSet3D *levelset;
     real base_delta_t;
     real cfl, strength_dt_mul;
+    int num_threads;
 
     void initialize(const Vector3i &sim_res, real base_delta_t, real cfl, real strength_dt_mul,
-                    DynamicLevelSet3D *levelset) {
+                    DynamicLevelSet3D *levelset, MPM3Particles *particles, int num_threads) {
         this->sim_res = sim_res;
+        this->particles = particles;
+        this->num_threads = num_threads;
         res.x = (sim_res.x + mpm3d_grid_block_size - 1) / mpm3d_grid_block_size;
         res.y = (sim_res.y + mpm3d_grid_block_size - 1) / mpm3d_grid_block_size;
         res.z = (sim_res.z + mpm3d_grid_block_size - 1) / mpm3d_grid_block_size;
@@ -57,10 +85,9 @@ public:
 
         states.initialize(res, 0);
         updated.initialize(res, 1);
-        particle_groups.resize(res[0] * res[1] * res[2]);
-        for (int i = 0; i < res[0] * res[1] * res[2]; i++) {
-            particle_groups[i] = std::vector<MPM3Particle *>();
-        }
+        sorted_particles.clear();
+        block_begin.assign(res[0] * res[1] * res[2] + 1, 0);
+        particle_block.clear();
 
         min_vel.initialize(res, Vector3(0));
         min_vel = Vector3(1e30f, 1e30f, 1e30f);
@@ -83,7 +110,62 @@ public:
     }
 
     bool has_particle(const Vector3i &ind) {
-        return particle_groups[ind.x * res[1] * res[2] + ind.y * res[2] + ind.z].size() > 0;
+        int b = get_block_id(ind);
+        return block_begin[b + 1] > block_begin[b];
+    }
+
+    int get_block_id(const Vector3i &block) const {
+        return block.x * res[1] * res[2] + block.y * res[2] + block.z;
+    }
+
+    // Block containing pos, or -1 if pos is outside the scheduler blocks
+    int get_block_id(const Vector3 &pos) const {
+        int x = int(pos.x / mpm3d_grid_block_size);
+        int y = int(pos.y / mpm3d_grid_block_size);
+        int z = int(pos.z / mpm3d_grid_block_size);
+        return states.inside(x, y, z) ? get_block_id(Vector3i(x, y, z)) : -1;
+    }
+
+    MPM3ParticleRange get_particle_group(const Vector3i &block) const {
+        return get_particle_group(get_block_id(block));
+    }
+
+    MPM3ParticleRange get_particle_group(int block_id) const {
+        const int *base = sorted_particles.data();
+        return MPM3ParticleRange{base + block_begin[block_id], base + block_begin[block_id + 1]};
+    }
+
+    // Blocks are processed in rows along z: row r holds the blocks (r / res.y, r % res.y, *)
+    int get_num_block_rows() const {
+        return res[0] * res[1];
+    }
+
+    Region3D get_block_row(int row) const {
+        int i = row / res[1], j = row % res[1];
+        return Region3D(i, i + 1, j, j + 1, 0, res[2]);
+    }
+
+    // target(const Index3D &) for every block; rows run in parallel
+    template <typename T>
+    void parallel_for_each_block(const T &target) const {
+        ThreadedTaskManager::run(get_num_block_rows(), num_threads, [&](int row) {
+            for (auto &ind : get_block_row(row)) {
+                target(ind);
+            }
+        });
+    }
+
+    // Grid nodes [node_begin, node_end) of a block; nodes on the upper boundary belong to the last block
+    void get_block_nodes(const Vector3i &block, Vector3i &node_begin, Vector3i &node_end) const {
+        node_begin = block * mpm3d_grid_block_size;
+        for (int d = 0; d < 3; d++) {
+            node_end[d] = block[d] == res[d] - 1 ? sim_res[d] + 1 : node_begin[d] + mpm3d_grid_block_size;
+        }
+    }
+
+    // All binned particles, in block order
+    const std::vector<int> &get_sorted_particles() const {
+        return sorted_particles;
     }
 
     void expand(bool expand_vel, bool expand_state);
@@ -93,18 +175,39 @@ public:
     int64 update_max_dt_int(int64 t_int);
 
     void set_time(int64 t_int) {
-        for (auto &ind : states.get_region()) {
+        parallel_for_each_block([&](const Index3D &ind) {
             if (t_int % max_dt_int[ind] == 0) {
                 states[ind] = 1;
             }
-        }
+        });
     }
 
+    // Rebins the particles of the last update() that crossed a block boundary
     void update_particle_groups();
 
-    void insert_particle(MPM3Particle *p, bool is_new_particle = false);
+    // Registers a newly added particle; it is binned by the next update_particle_groups()
+    void insert_particle(int p);
+
+    // insert_particle for the particles [begin, end)
+    void insert_particles(int begin, int end);
+
+    // Forgets the binning after the particle storage was rebuilt; every particle is rebinned by
+    // the next update_particle_groups()
+    void reset_particle_groups();
+
+    // Renames particle p to new_index[p] after the particle storage has been permuted
+    void remap_particles(const std::vector<int> &new_index);
 
-    void update_dt_limits(real t);
+    // State carried between substeps, for checkpoints
+    void write(BinaryFileStreamOutput &os) const;
+
+    void read(BinaryFileStreamInput &is);
+
+    // Limits from the particles of the blocks flagged in `updated`
+    void update_particle_dt_limits();
+
+    // CFL and boundary limits; these read the velocity bounds of the neighbouring blocks
+    void update_cfl_dt_limits(real t);
 
     int get_num_active_grids() {
         int count = 0;
@@ -114,7 +217,7 @@ public:
         return count;
     }
 
-    const std::vector<MPM3Particle *> &get_active_particles() const {
+    const std::vector<int> &get_active_particles() const {
         return active_particles;
     }
 
@@ -122,6 +225,11 @@ public:
         return active_grid_points;
     }
 
+    // Blocks with non-zero state, in lexicographical order
+    const std::vector<Vector3i> &get_active_blocks() const {
+        return active_blocks;
+    }
+
 //    void visualize(const Vector4 &debug_input, Array<Vector4> &debug_blocks) const;
 
 //    void print_limits();
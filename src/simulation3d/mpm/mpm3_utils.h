@@ -17,9 +17,117 @@
 #include <taichi/math/levelset_3d.h>
 #include <taichi/math/dynamic_levelset_3d.h>
 
+#if !defined(TC_DISABLE_SSE) && !defined(TC_USE_SSE)
+#define TC_USE_SSE
+#endif
+
+#ifdef TC_USE_SSE
+#include <immintrin.h>
+#endif
+
 TC_NAMESPACE_BEGIN
 
 const int mpm3d_grid_block_size = 8;
 
-TC_NAMESPACE_END
+// Note: assuming abs(x) <= 2!!
+inline real w(real x) {
+    x = abs(x);
+    assert(x <= 2);
+    if (x < 1) {
+        return 0.5f * x * x * x - x * x + 2.0f / 3.0f;
+    } else {
+        return -1.0f / 6.0f * x * x * x + x * x - 2 * x + 4.0f / 3.0f;
+    }
+}
+
+// Note: assuming abs(x) <= 2!!
+inline real dw(real x) {
+    real s = x < 0.0f ? -1.0f : 1.0f;
+    x *= s;
+    assert(x <= 2.0f);
+    real val;
+    real xx = x * x;
+    if (x < 1.0f) {
+        val = 1.5f * xx - 2.0f * x;
+    } else {
+        val = -0.5f * xx + 2.0f * x - 2.0f;
+    }
+    return s * val;
+}
+
+inline real w(const Vector3 &a) {
+    return w(a.x) * w(a.y) * w(a.z);
+}
+
+inline Vector3 dw(const Vector3 &a) {
+    return Vector3(dw(a.x) * w(a.y) * w(a.z), w(a.x) * dw(a.y) * w(a.z), w(a.x) * w(a.y) * dw(a.z));
+}
+
+// w(f + 1 - o) and dw(f + 1 - o) for o = 0..3 written as polynomials in the fractional
+// position f. Row p holds the coefficients of f^p, one lane per node offset.
+alignas(16) const real mpm3_kernel_w_coeff[4][4] = {
+        {1.0f / 6.0f,  2.0f / 3.0f, 1.0f / 6.0f,  0.0f},
+        {-0.5f,        0.0f,        0.5f,         0.0f},
+        {0.5f,         -1.0f,       0.5f,         0.0f},
+        {-1.0f / 6.0f, 0.5f,        -0.5f,        1.0f / 6.0f},
+};
+
+alignas(16) const real mpm3_kernel_dw_coeff[3][4] = {
+        {-0.5f, 0.0f,  0.5f,  0.0f},
+        {1.0f,  -2.0f, 1.0f,  0.0f},
+        {-0.5f, 1.5f,  -1.5f, 0.5f},
+};
 
+// Separable cubic B-spline weights of one particle, computed once per substep.
+// Node base + (a, b, c), 0 <= a, b, c < 4, has weight w[0][a] * w[1][b] * w[2][c].
+// dw holds the 1D derivatives with respect to (particle position - node position).
+struct MPM3Kernel {
+    alignas(16) real w[3][4];
+    alignas(16) real dw[3][4];
+    Vector3i base;
+
+    MPM3Kernel() {}
+
+    explicit MPM3Kernel(const Vector3 &pos) {
+        calculate(pos);
+    }
+
+    // pos must be non-negative
+    void calculate(const Vector3 &pos) {
+        for (int d = 0; d < 3; d++) {
+            int b = int(pos[d]);
+            real f = pos[d] - b;
+            base[d] = b - 1;
+#ifdef TC_USE_SSE
+            __m128 x = _mm_set1_ps(f);
+            __m128 wv = _mm_load_ps(mpm3_kernel_w_coeff[3]);
+            wv = _mm_add_ps(_mm_mul_ps(wv, x), _mm_load_ps(mpm3_kernel_w_coeff[2]));
+            wv = _mm_add_ps(_mm_mul_ps(wv, x), _mm_load_ps(mpm3_kernel_w_coeff[1]));
+            wv = _mm_add_ps(_mm_mul_ps(wv, x), _mm_load_ps(mpm3_kernel_w_coeff[0]));
+            _mm_store_ps(w[d], wv);
+            __m128 dwv = _mm_load_ps(mpm3_kernel_dw_coeff[2]);
+            dwv = _mm_add_ps(_mm_mul_ps(dwv, x), _mm_load_ps(mpm3_kernel_dw_coeff[1]));
+            dwv = _mm_add_ps(_mm_mul_ps(dwv, x), _mm_load_ps(mpm3_kernel_dw_coeff[0]));
+            _mm_store_ps(dw[d], dwv);
+#else
+            for (int o = 0; o < 4; o++) {
+                w[d][o] = ((mpm3_kernel_w_coeff[3][o] * f + mpm3_kernel_w_coeff[2][o]) * f +
+                           mpm3_kernel_w_coeff[1][o]) * f + mpm3_kernel_w_coeff[0][o];
+                dw[d][o] = (mpm3_kernel_dw_coeff[2][o] * f + mpm3_kernel_dw_coeff[1][o]) * f +
+                           mpm3_kernel_dw_coeff[0][o];
+            }
+#endif
+        }
+    }
+
+    real get_w(const Index3D &ind) const {
+        return w[0][ind.i - base.x] * w[1][ind.j - base.y] * w[2][ind.k - base.z];
+    }
+
+    Vector3 get_dw(const Index3D &ind) const {
+        const int a = ind.i - base.x, b = ind.j - base.y, c = ind.k - base.z;
+        return Vector3(dw[0][a] * w[1][b] * w[2][c], w[0][a] * dw[1][b] * w[2][c], w[0][a] * w[1][b] * dw[2][c]);
+    }
+};
+
+TC_NAMESPACE_END
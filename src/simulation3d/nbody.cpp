@@ -10,282 +10,11 @@
 #include <taichi/dynamics/simulation3d.h>
 #include <taichi/visualization/particle_visualization.h>
 #include <taichi/visual/texture.h>
+#include "barnes_hut.h"
+#include "fmm.h"
 
 TC_NAMESPACE_BEGIN
 
-class BarnesHutSummation {
-public:
-    struct Particle {
-        Vector3 position;
-        real mass;
-
-        Particle() {
-            mass = 0.0f;
-            position = Vector3(0.0f);
-        }
-
-        Particle(const Vector3 &position, real mass) : position(position), mass(mass) {}
-
-        Particle operator+(const Particle &o) const {
-            Particle ret;
-            ret.mass = mass + o.mass;
-            ret.position = (position * mass + o.position * o.mass) / ret.mass;
-            CV(ret.position);
-            CV(ret.mass);
-            return ret;
-        }
-    };
-
-protected:
-    struct Node {
-        Particle p;
-        int children[8]; // We do not use pointer here to save memory bandwidth(64 bit v.s. 32 bit)
-        // There are so many ways to optimize and I'll consider them later...
-        Vector3i bounds[2]; // TODO: this is quite brute-force...
-        Node() {
-            memset(children, 0, sizeof(children));
-            p = Particle();
-        }
-
-        bool is_leaf() {
-            for (int i = 0; i < 8; i++) {
-                if (children[i] != 0) {
-                    return false;
-                }
-            }
-            return p.mass > 0;
-        }
-    };
-
-    real resolution, inv_resolution;
-    int total_levels;
-    int margin;
-
-    std::vector<Node> nodes;
-    int node_end;
-    Vector3 lower_corner;
-
-    Vector3i get_coord(const Vector3 &position) {
-        Vector3i u;
-        Vector3 t = (position - lower_corner) * inv_resolution;
-        for (int i = 0; i < 3; i++) {
-            u[i] = int(t[i]);
-        }
-        return u;
-    }
-
-    int get_child_index(const Vector3i &u, int level) {
-        int ret = 0;
-        for (int i = 0; i < 3; i++) {
-            ret += ((u[i] >> (total_levels - level - 1)) & 1) << i;
-        }
-        return ret;
-    }
-
-    void summarize(int t) {
-        Node &node = nodes[t];
-        if (node.is_leaf()) {
-            Vector3i u = get_coord(node.p.position);
-            node.bounds[0] = u - Vector3i(margin);
-            node.bounds[1] = u + Vector3i(margin);
-            return;
-        }
-        real mass = 0.0f;
-        Vector3 total_position(0.0f);
-        node.bounds[0] = Vector3i(std::numeric_limits<int>::max());
-        node.bounds[1] = Vector3i(std::numeric_limits<int>::min());
-        for (int c = 0; c < 8; c++) {
-            if (node.children[c]) {
-                summarize(nodes[t].children[c]);
-                const Node &ch = nodes[node.children[c]];
-                mass += ch.p.mass;
-                total_position += ch.p.mass * ch.p.position;
-                for (int i = 0; i < 3; i++) {
-                    node.bounds[0][i] = std::min(node.bounds[0][i], ch.bounds[0][i]);
-                    node.bounds[1][i] = std::max(node.bounds[1][i], ch.bounds[1][i]);
-                }
-            }
-        }
-        total_position *= 1.0f / mass;
-        if (abnormal(total_position)) {
-            P(mass);
-            for (int i = 0; i < 8; i++) {
-                P(i);
-                P(node.children[i]);
-                P(nodes[node.children[i]].p.position);
-                P(nodes[node.children[i]].p.mass);
-            }
-        }
-        CV(total_position);
-        node.p = Particle(total_position, mass);
-    }
-
-    int create_child(int t, int child_index) {
-        return create_child(t, child_index, Particle(Vector3(0.0f), 0.0f));
-    }
-
-    int create_child(int t, int child_index, const Particle &p) {
-        int nt = get_new_node();
-        nodes[t].children[child_index] = nt;
-        nodes[nt].p = p;
-        return nt;
-    }
-
-    int get_new_node() {
-        nodes[node_end] = Node();
-        return node_end++;
-    }
-
-public:
-    // We do not evaluate the weighted average of position and mass on the fly
-    // for efficiency and accuracy
-    void initialize(real resolution, real margin_real, const std::vector<Particle> &particles) {
-        this->resolution = resolution;
-        this->inv_resolution = 1.0f / resolution;
-        this->margin = (int)std::ceil(margin_real * inv_resolution);
-        assert(particles.size() != 0);
-        Vector3 lower(1e30f);
-        Vector3 upper(-1e30f);
-        for (auto &p : particles) {
-            for (int k = 0; k < 3; k++) {
-                lower[k] = std::min(lower[k], p.position[k]);
-                upper[k] = std::max(upper[k], p.position[k]);
-            }
-            //P(p.position);
-        }
-        lower_corner = lower;
-        int intervals = (int)std::ceil(max_component(upper - lower) / resolution);
-        total_levels = 0;
-        for (int i = 1; i < intervals; i *= 2, total_levels++);
-        // We do not use the 0th node...
-        node_end = 1;
-        nodes.clear();
-        nodes.resize(particles.size() * 2);
-        int root = get_new_node();
-        // Make sure that one leaf node contains only one particle.
-        // Unless particles are too close and thereby merged.
-        for (auto &p : particles) {
-            if (p.mass == 0) {
-                continue;
-            }
-            Vector3i u = get_coord(p.position);
-            int t = root;
-            if (nodes[t].is_leaf()) {
-                // First node
-                nodes[t].p = p;
-                continue;
-            }
-            // Traverse down until there's no way...
-            int k = 0;
-            int cp;
-            for (; k < total_levels; k++) {
-                cp = get_child_index(u, k);
-                if (nodes[t].children[cp] != 0) {
-                    t = nodes[t].children[cp];
-                } else {
-                    break;
-                }
-            }
-            if (nodes[t].is_leaf()) {
-                // Leaf node, containing one particle q
-                // Split the node until p and q belong to different children.
-                Particle q = nodes[t].p;
-                nodes[t].p = Particle();
-                Vector3i v = get_coord(q.position);
-                int cq = get_child_index(v, k);
-                while (cp == cq && k < total_levels) {
-                    t = create_child(t, cp);
-                    k++;
-                    cp = get_child_index(u, k);
-                    cq = get_child_index(v, k);
-                }
-                if (k == total_levels) {
-                    // We have to merge two particles since they are too close...
-                    q = p + q;
-                    create_child(t, cp, q);
-                } else {
-                    nodes[t].p = Particle();
-                    create_child(t, cp, p);
-                    create_child(t, cq, q);
-                }
-            } else {
-                // Non-leaf node, simply create a child.
-                create_child(t, cp, p);
-            }
-        }
-        P(node_end);
-        summarize(root);
-    }
-
-    /*
-    template<typename T>
-    Vector3 summation(const Particle &p, const T &func) {
-        // TODO: fine level
-        // TODO: only one particle?
-        int t = 1;
-        Vector3 ret(0.0f);
-        Vector3 u = get_coord(p.position);
-        for (int k = 0; k < total_levels; k++) {
-            int cp = get_child_index(u, k);
-            for (int c = 0; c < 8; c++) {
-                if (c != cp && nodes[t].children[c]) {
-                    const Node &n = nodes[nodes[t].children[c]];
-                    auto tmp = func(p, n.p);
-                    ret += tmp;
-                }
-            }
-            t = nodes[t].children[cp];
-            if (t == 0) {
-                break;
-            }
-        }
-        return ret;
-    }
-    */
-
-    template <typename T>
-    Vector3 summation(int t, const Particle &p, const T &func) {
-        const Node &node = nodes[t];
-        if (nodes[t].is_leaf()) {
-            return func(p, node.p);
-        }
-        Vector3 ret(0.0f);
-        Vector3i u = get_coord(p.position);
-        for (int c = 0; c < 8; c++) {
-            if (node.children[c]) {
-                const Node &ch = nodes[node.children[c]];
-                if (
-                        ch.bounds[0][0] <= u[0] && u[0] <= ch.bounds[1][0] &&
-                        ch.bounds[0][1] <= u[1] && u[1] <= ch.bounds[1][1] &&
-                        ch.bounds[0][2] <= u[2] && u[2] <= ch.bounds[1][2]
-                        ) {
-                    ret += summation(node.children[c], p, func);
-                } else {
-                    // Coarse summation 
-                    ret += func(p, ch.p);
-                }
-            }
-        }
-        return ret;
-    }
-
-    void print_tree(int t, int level) {
-        for (int i = 0; i < level; i++) {
-            printf("  ");
-        }
-        const Particle &p = nodes[t].p;
-        printf("p (%f, %f, %f) m %f ", p.position.x, p.position.y, p.position.z, p.mass);
-        printf("(%d, %d, %d) (%d, %d, %d)\n",
-               nodes[t].bounds[0][0], nodes[t].bounds[0][1], nodes[t].bounds[0][2],
-               nodes[t].bounds[1][0], nodes[t].bounds[1][1], nodes[t].bounds[1][2]);
-        for (int c = 0; c < 8; c++) {
-            if (nodes[t].children[c] != 0) {
-                print_tree(nodes[t].children[c], level + 1);
-            }
-        }
-    }
-};
-
 class NBody : public Simulation3D {
     struct Particle {
         Vector3 position, velocity, color;
@@ -301,6 +30,21 @@ protected:
     std::vector<Particle> particles;
     BarnesHutSummation bhs;
     real delta_t;
+    // "morton" (default), the parallel build, or "incremental", the serial insertion kept to validate against
+    std::string tree_builder;
+    // Subtrees with at most this many bodies interact body by body with a SIMD kernel; 0 disables it
+    int leaf_bucket_size;
+    // "symplectic_euler" (default), kick then drift by dt, or "leapfrog", kick-drift-kick
+    std::string integrator;
+    // The tree is refit rather than rebuilt until a particle has moved this far from where it was at the
+    // last rebuild; 0 rebuilds it every substep
+    real tree_rebuild_drift;
+    std::vector<BarnesHutSummation::Particle> bhps;
+    std::vector<Vector3> tree_positions;
+    bool tree_built = false;
+    std::vector<Vector3> accelerations;
+    // accelerations are those at the current positions, as the second kick of leapfrog leaves them
+    bool accelerations_valid = false;
 public:
     virtual void initialize(const Config &config) override {
         Simulation3D::initialize(config);
@@ -308,6 +52,14 @@ public:
         particles.reserve(num_particles);
         gravitation = config.get_real("gravitation");
         delta_t = config.get_real("delta_t");
+        tree_builder = config.get("tree_builder", "morton");
+        assert_info(tree_builder == "morton" || tree_builder == "incremental",
+                    "Unknown tree_builder " + tree_builder);
+        leaf_bucket_size = config.get("leaf_bucket_size", 0);
+        bhs.set_bucket_size(leaf_bucket_size);
+        integrator = config.get("integrator", "symplectic_euler");
+        assert_info(integrator == "symplectic_euler" || integrator == "leapfrog", "Unknown integrator " + integrator);
+        tree_rebuild_drift = config.get("tree_rebuild_drift", 0.0f);
         real vel_scale = config.get_real("vel_scale");
         for (int i = 0; i < num_particles; i++) {
             Vector3 p(rand(), rand(), rand());
@@ -327,59 +79,146 @@ public:
         return render_particles;
     }
 
-    void substep(real dt) {
+    void get_particle_frame(ParticleFrame &frame) const override {
+        frame.time = current_t;
+        frame.position.resize(particles.size());
+        frame.velocity.resize(frame.fields & ParticleFrame::VELOCITY ? particles.size() : 0);
+        frame.state.clear();
+        for (int i = 0; i < (int)particles.size(); i++) {
+            frame.position[i] = particles[i].position;
+            if (!frame.velocity.empty()) {
+                frame.velocity[i] = particles[i].velocity;
+            }
+        }
+    }
+
+    static Vector3 get_force(const BarnesHutSummation::Particle &p, const BarnesHutSummation::Particle &q) {
+        CV(p.position);
+        CV(q.position);
+        Vector3 d = p.position - q.position;
+        real dist2 = dot(d, d);
+        dist2 += 1e-4f;
+        CV(d);
+        d *= p.mass * q.mass / (dist2 * sqrt(dist2));
+        CV(p.mass);
+        CV(q.mass);
+        CV(dist2);
+        CV(d);
+        return d;
+    }
+
+    // The leaf of the tree holding particle i
+    int get_particle_leaf(int i) const {
+        return tree_rebuild_drift > 0 ? bhs.get_particle_leaf(i) : bhs.get_leaf(particles[i].position);
+    }
+
+    // Barnes-Hut force on a unit mass at particle i, with bhs up to date
+    Vector3 get_tree_force(int i) const {
         using BHP = BarnesHutSummation::Particle;
-        std::vector<BHP> bhps;
-        bhps.reserve(particles.size());
-        for (auto &p : particles) {
-            bhps.push_back(BHP(p.position, 1.0f));
+        if (leaf_bucket_size > 0) {
+            return bhs.gravity_summation(BHP(particles[i].position, 1.0f), 1e-4f);
+        } else {
+            return bhs.summation(1, BHP(particles[i].position, 1.0f), get_force);
         }
+    }
 
-        bhs.initialize(1e-4f, 1e-3f, bhps);
-        // bhs.print_tree(1, 0);
+    virtual bool uses_tree() const {
+        return true;
+    }
 
-        auto f = [](const BHP &p, const BHP &q) {
-            CV(p.position);
-            CV(q.position);
-            Vector3 d = p.position - q.position;
-            real dist2 = dot(d, d);
-            dist2 += 1e-4f;
-            CV(d);
-            d *= p.mass * q.mass / (dist2 * sqrt(dist2));
-            CV(p.mass);
-            CV(q.mass);
-            CV(dist2);
-            CV(d);
-            return d;
-        };
-        if (gravitation != 0) {
-            real max_err = -1;
-            ThreadedTaskManager::run((int)particles.size(), num_threads, [&](int i) {
-                auto &p = particles[i];
-                /*
-                Vector3 total_f(0.0f);
-                for (int j = 0; j < (int)particles.size(); j++) {
-                    auto &q = particles[j];
-                    total_f += f(BHP(p.position, 1.0f), BHP(q.position, 1.0f));
-                }
+    // Forces on unit masses at every particle, with bhs up to date
+    virtual void compute_forces(std::vector<Vector3> &forces) {
+        ThreadedTaskManager::run((int)particles.size(), num_threads, [&](int i) {
+            forces[i] = get_tree_force(i);
+            CV(forces[i]);
+        });
+    }
 
-                auto err = length(total_f_bhs - total_f) / length(total_f);
-                max_err = std::max(err, max_err);
-                
-                P(total_f);
-                P(total_f_bhs);
-                P(err);
-                */
-                Vector3 total_f_bhs = bhs.summation(1, BHP(p.position, 1.0f), f);
-                CV(total_f_bhs);
-                particles[i].velocity += total_f_bhs * gravitation * dt;
-                CV(particles[i].velocity);
-                CV(total_f_bhs);
-            });
-            //P(max_err);
+    // Largest distance of a particle from its position at the last rebuild
+    real get_max_drift() const {
+        const int n = (int)particles.size();
+        const int num_chunks = std::max(1, std::min(num_threads * 4, n / 16384));
+        std::vector<real> chunk_max(num_chunks, 0.0f);
+        parallel_for(0, num_chunks, num_threads, [&](int c) {
+            for (int i = (int)((int64)n * c / num_chunks); i < (int)((int64)n * (c + 1) / num_chunks); i++) {
+                chunk_max[c] = std::max(chunk_max[c], length(particles[i].position - tree_positions[i]));
+            }
+        }, 1);
+        return *std::max_element(chunk_max.begin(), chunk_max.end());
+    }
+
+    // Rebuilds the tree at the current positions, or refits it while the particles are close enough to
+    // where it was built
+    void update_tree() {
+        Profiler::Scope _(profiler, "tree_build");
+        using BHP = BarnesHutSummation::Particle;
+        bhps.resize(particles.size());
+        parallel_for(0, (int)particles.size(), num_threads, [&](int i) {
+            bhps[i] = BHP(particles[i].position, 1.0f);
+        }, 4096);
+        if (tree_built && tree_rebuild_drift > 0 && get_max_drift() < tree_rebuild_drift) {
+            bhs.refit(bhps, num_threads);
+            return;
         }
-        for (auto &p : particles) {
-            p.position += dt * p.velocity;
+        if (tree_builder == "morton") {
+            bhs.initialize(1e-4f, 1e-3f, bhps, num_threads);
+        } else {
+            bhs.initialize_incremental(1e-4f, 1e-3f, bhps);
+        }
+        if (tree_rebuild_drift > 0) {
+            bhs.index_particles(bhps, num_threads);
+            tree_positions.resize(particles.size());
+            parallel_for(0, (int)particles.size(), num_threads, [&](int i) {
+                tree_positions[i] = particles[i].position;
+            }, 4096);
+        }
+        tree_built = true;
+    }
+
+    void compute_accelerations() {
+        accelerations.resize(particles.size());
+        if (gravitation == 0) {
+            std::fill(accelerations.begin(), accelerations.end(), Vector3(0.0f));
+            return;
+        }
+        if (uses_tree()) {
+            update_tree();
+        }
+        // bhs.print_tree(1, 0);
+        Profiler::Scope _(profiler, "forces");
+        compute_forces(accelerations);
+        parallel_for(0, (int)particles.size(), num_threads, [&](int i) {
+            accelerations[i] *= gravitation;
+        }, 4096);
+    }
+
+    void kick(real dt) {
+        parallel_for(0, (int)particles.size(), num_threads, [&](int i) {
+            particles[i].velocity += accelerations[i] * dt;
+            CV(particles[i].velocity);
+        }, 4096);
+    }
+
+    void drift(real dt) {
+        parallel_for(0, (int)particles.size(), num_threads, [&](int i) {
+            particles[i].position += dt * particles[i].velocity;
+        }, 4096);
+    }
+
+    void substep(real dt) {
+        if (integrator == "leapfrog") {
+            if (!accelerations_valid) {
+                compute_accelerations();
+            }
+            kick(0.5f * dt);
+            drift(dt);
+            compute_accelerations();
+            kick(0.5f * dt);
+            accelerations_valid = true;
+        } else {
+            compute_accelerations();
+            kick(dt);
+            drift(dt);
         }
         current_t += dt;
     }
@@ -394,4 +233,108 @@ public:
 
 TC_IMPLEMENTATION(Simulation3D, NBody, "nbody");
 
+// NBody with forces from the fast multipole method on the same tree, O(N) rather than O(N log N)
+class NBodyFMM : public NBody {
+protected:
+    FastMultipoleSummation fmm;
+public:
+    virtual void initialize(const Config &config) override {
+        NBody::initialize(config);
+        fmm.initialize(config.get("expansion_order", 4), config.get("opening_angle", 0.5f),
+                       config.get("fmm_leaf_size", 16), 1e-2f);
+    }
+
+    virtual void compute_forces(std::vector<Vector3> &forces) override {
+        {
+            Profiler::Scope _(profiler, "fmm");
+            fmm.evaluate(bhs, num_threads);
+        }
+        ThreadedTaskManager::run((int)particles.size(), num_threads, [&](int i) {
+            forces[i] = fmm.get_leaf_force(get_particle_leaf(i));
+        });
+    }
+};
+
+TC_IMPLEMENTATION(Simulation3D, NBodyFMM, "nbody_fmm");
+
+// NBody with exact all-pairs forces, the reference for the approximations, and for medium N faster than
+// the tree. Targets are processed in blocks against tiles of sources that stay in cache.
+// With "error_report_samples" > 0, every force evaluation also reports the error of the Barnes-Hut forces
+// on that many bodies.
+class NBodyDirect : public NBody {
+protected:
+    static const int target_block = 64, source_tile = 2048;
+    int error_report_samples;
+    AlignedVector<float> source_x, source_y, source_z, source_mass;
+public:
+    virtual void initialize(const Config &config) override {
+        NBody::initialize(config);
+        error_report_samples = config.get("error_report_samples", 0);
+    }
+
+    virtual bool uses_tree() const override {
+        return error_report_samples > 0;
+    }
+
+    virtual void compute_forces(std::vector<Vector3> &forces) override {
+        const int n = (int)particles.size();
+        // Padded for the blocks of 8 of sum_gravity
+        for (auto s : {&source_x, &source_y, &source_z, &source_mass}) {
+            s->resize(n + 8);
+        }
+        parallel_for(0, n, num_threads, [&](int i) {
+            source_x[i] = particles[i].position.x;
+            source_y[i] = particles[i].position.y;
+            source_z[i] = particles[i].position.z;
+            source_mass[i] = 1.0f;
+        }, 4096);
+        parallel_for(0, (n + target_block - 1) / target_block, num_threads, [&](int block) {
+            const int begin = block * target_block, end = std::min(n, begin + target_block);
+            // Partial sums are accumulated in double, so that large N do not lose precision
+            Vector3d total[target_block];
+            for (int i = begin; i < end; i++) {
+                total[i - begin] = Vector3d(0.0);
+            }
+            for (int s = 0; s < n; s += source_tile) {
+                const int count = std::min(source_tile, n - s);
+                for (int i = begin; i < end; i++) {
+                    total[i - begin] += Vector3d(BarnesHutSummation::sum_gravity(
+                            particles[i].position, &source_x[s], &source_y[s], &source_z[s], &source_mass[s], count,
+                            1e-4f));
+                }
+            }
+            for (int i = begin; i < end; i++) {
+                forces[i] = Vector3(total[i - begin]);
+            }
+        }, 1);
+        if (error_report_samples > 0) {
+            report_tree_error(forces);
+        }
+    }
+
+    // Relative errors of the Barnes-Hut forces on evenly spaced bodies
+    void report_tree_error(const std::vector<Vector3> &forces) const {
+        const int n = (int)particles.size();
+        const int samples = std::min(n, error_report_samples);
+        std::vector<double> errors(samples), magnitudes(samples);
+        parallel_for(0, samples, num_threads, [&](int k) {
+            const int i = (int)((int64)n * k / samples);
+            errors[k] = length(Vector3d(get_tree_force(i)) - Vector3d(forces[i]));
+            magnitudes[k] = length(Vector3d(forces[i]));
+        }, 16);
+        double error2 = 0, magnitude2 = 0, max_error = 0;
+        for (int k = 0; k < samples; k++) {
+            error2 += errors[k] * errors[k];
+            magnitude2 += magnitudes[k] * magnitudes[k];
+            if (magnitudes[k] > 0) {
+                max_error = std::max(max_error, errors[k] / magnitudes[k]);
+            }
+        }
+        printf("NBody t = %f: Barnes-Hut force error on %d bodies, rms relative %e, max relative %e\n", current_t,
+               samples, magnitude2 > 0 ? std::sqrt(error2 / magnitude2) : 0.0, max_error);
+    }
+};
+
+TC_IMPLEMENTATION(Simulation3D, NBodyDirect, "nbody_direct");
+
 TC_NAMESPACE_END
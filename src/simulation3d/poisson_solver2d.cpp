@@ -10,6 +10,8 @@
 #include <taichi/system/threading.h>
 #include <taichi/dynamics/poisson_solver2d.h>
 #include <taichi/math/stencils.h>
+#include <taichi/math/temporal_blocking.h>
+#include "poisson_solver_cuda.h"
 
 TC_NAMESPACE_BEGIN
 
@@ -26,6 +28,8 @@ public:
     std::vector<BCArray> boundaries;
     const int size_threshold = 64;
     int num_threads;
+    // Smoother half-sweeps fused per pass over the grid; 1 sweeps the whole grid for each
+    int temporal_blocking;
     CellType padding;
     bool has_null_space;
 
@@ -156,6 +160,7 @@ public:
     void initialize(const Config &config) override {
         this->res = config.get_vec2i("res");
         this->num_threads = config.get_int("num_threads");
+        this->temporal_blocking = config.get("temporal_blocking", 8);
         auto padding_name = config.get_string("padding");
         assert_info(padding_name == "dirichlet" || padding_name == "neumann",
                     "'padding' has to be 'dirichlet' or 'neumann' instead of " + std::string(padding_name));
@@ -177,7 +182,8 @@ public:
         } while (res[0] * res[1] * 8 >= size_threshold);
     }
 
-    void parallel_for_each_cell(Array &arr, int threshold, const std::function<void(const Index2D &index)> &func) {
+    template <typename A>
+    void parallel_for_each_cell(const A &arr, int threshold, const std::function<void(const Index2D &index)> &func) {
         int max_side = std::max(std::max(arr.get_width(), arr.get_height()), 0);
         int num_threads;
         if (max_side >= threshold) {
@@ -197,38 +203,40 @@ public:
         return has_null_space;
     }
 
+    // Red-black, with up to temporal_blocking half-sweeps fused into wavefronts over the columns
     void gauss_seidel(const System &system, const Array &residual, Array &pressure, int rounds) {
-        for (int i = 0; i < rounds; i++) {
-            for (int c = 0; c < 2; c++) {
-                parallel_for_each_cell(pressure, 64, [&](const Index2D &ind) {
-                    int sum = ind.i + ind.j;
-                    if ((sum) % 2 == c) {
-                        if (system[ind].inv_numerator > 0) {
-                            real res = residual[ind];
-                            for (int k = 0; k < 4; k++) {
-                                Vector2i offset = neighbour4_2d[k];
-                                if (system[ind].get_neighbour_cell_type(k) == INTERIOR) {
-                                    res += pressure[ind + offset];
-                                }
-                            }
-                            pressure[ind] = res * system[ind].inv_numerator;
-                        } else {
-                            pressure[ind] = 0.0f;
+        const int height = pressure.get_height();
+        const int threads = std::max(pressure.get_width(), height) >= 64 ? num_threads : 1;
+        // Half-sweep s relaxes the cells with (i + j) % 2 == s % 2, reading only the neighbouring columns
+        temporal_blocked_for(0, pressure.get_width(), rounds * 2, threads, [&](int s, int i) {
+            for (int j = (i + s) & 1; j < height; j += 2) {
+                const Index2D ind(i, j);
+                if (system[ind].inv_numerator > 0) {
+                    real res = residual[ind];
+                    for (int k = 0; k < 4; k++) {
+                        Vector2i offset = neighbour4_2d[k];
+                        if (system[ind].get_neighbour_cell_type(k) == INTERIOR) {
+                            res += pressure[ind + offset];
                         }
                     }
-                });
+                    pressure[ind] = res * system[ind].inv_numerator;
+                } else {
+                    pressure[ind] = 0.0f;
+                }
             }
-        }
+        }, temporal_blocking);
     }
 
-    void apply_L(const System &system, const Array &pressure, Array &output) {
+    // S is real, or double for the outer iteration of mixed precision solves
+    template <typename S>
+    void apply_L(const System &system, const Array2D<S> &pressure, Array2D<S> &output) {
         for (auto &ind : pressure.get_region()) {
             if (system[ind].inv_numerator == 0.0f) {
                 output[ind] = 0.0f;
                 continue;
             }
-            real pressure_center = pressure[ind];
-            real res = 0.0f;
+            S pressure_center = pressure[ind];
+            S res = 0.0f;
             for (int k = 0; k < 4; k++) {
                 Vector2i offset = neighbour4_2d[k];
                 CellType type = system[ind].get_neighbour_cell_type(k);
@@ -242,14 +250,16 @@ public:
         }
     }
 
-    void compute_residual(const System &system, const Array &pressure, const Array &div, Array &residual) {
+    template <typename S>
+    void compute_residual(const System &system, const Array2D<S> &pressure, const Array2D<S> &div,
+                          Array2D<S> &residual) {
         parallel_for_each_cell(residual, 128, [&](const Index2D &ind) {
             if (system[ind].inv_numerator == 0) {
                 residual[ind] = 0.0f;
                 return;
             }
-            real pressure_center = pressure[ind];
-            real res = 0.0f;
+            S pressure_center = pressure[ind];
+            S res = 0.0f;
             for (int k = 0; k < 4; k++) {
                 Vector2i offset = neighbour4_2d[k];
                 CellType type = system[ind].get_neighbour_cell_type(k);
@@ -311,58 +321,154 @@ public:
             run(0);
             compute_residual(systems[0], pressures[0], residuals[0], tmp_residuals[0]);
             P(iterations);
-            P(tmp_residuals[0].abs_max());
-        } while (tmp_residuals[0].abs_max() > pressure_tolerance);
+            P(tmp_residuals[0].abs_max(num_threads));
+        } while (tmp_residuals[0].abs_max(num_threads) > pressure_tolerance);
         pressure = pressures[0];
     }
 };
 
 class MultigridPCGPoissonSolver2D : public MultigridPoissonSolver2D {
+protected:
+    // Kept across solves, so that the iterations allocate nothing
+    Array r, p, z;
+    // The outer iteration of mixed precision solves
+    Array2D<double> x_double, b_double, r_double, p_double, z_double, q_double;
+
 public:
+    // Runs the outer iteration in double and only the preconditioner in real
+    bool mixed_precision;
+    // With mixed_precision, the residual is recomputed from the solution every this many iterations,
+    // so that the recurrence can't drift away from it
+    int residual_replacement_interval;
+    // Start from the given pressure instead of zero, e.g. the solution of a similar system solved before
+    bool warm_start;
+    int maximum_iterations;
+
     void initialize(const Config &config) {
         MultigridPoissonSolver2D::initialize(config);
+        mixed_precision = config.get("mixed_precision", false);
+        warm_start = config.get("warm_start", false);
+        maximum_iterations = config.get("maximum_iterations", 20);
+        // By default, at least once within maximum_iterations
+        residual_replacement_interval =
+                config.get("residual_replacement_interval", std::max(1, std::min(50, maximum_iterations / 2)));
+        assert_info(residual_replacement_interval > 0, "'residual_replacement_interval' has to be positive");
+        r = Array(res);
+        p = Array(res);
+        z = Array(res);
+        if (mixed_precision) {
+            for (auto arr : {&x_double, &b_double, &r_double, &p_double, &z_double, &q_double}) {
+                *arr = Array2D<double>(res);
+            }
+        }
     }
 
-    Array apply_preconditioner(Array &r) {
+    // x = M^-1 b
+    void apply_preconditioner(const Array &b, Array &x) {
         pressures[0] = 0;
-        residuals[0] = r;
+        residuals[0] = b;
         MultigridPoissonSolver2D::run(0);
-        return pressures[0];
+        // pressures[0] is cleared before every V-cycle, so it can take x's storage
+        x.swap(pressures[0]);
+    }
+
+    // PCG in double around the preconditioner in real. The solution is rounded to real at the end.
+    void run_mixed_precision(const Array &residual, Array &pressure, real pressure_tolerance) {
+        if (warm_start) {
+            x_double.assign_converted(pressure, num_threads);
+        } else {
+            pressure = 0;
+            x_double = 0;
+        }
+        b_double.assign_converted(residual, num_threads);
+        auto update_residual = [&]() {
+            compute_residual(systems[0], x_double, b_double, r_double);
+            if (has_null_space) {
+                r_double -= r_double.get_average();
+            }
+        };
+        auto precondition = [&]() {
+            r.assign_converted(r_double, num_threads);
+            apply_preconditioner(r, z);
+            z_double.assign_converted(z, num_threads);
+        };
+        if (warm_start) {
+            update_residual();
+        } else {
+            r_double = b_double;
+        }
+        double nu = r_double.abs_max(num_threads);
+        if (nu < pressure_tolerance)
+            return;
+        precondition();
+        p_double = z_double;
+        double rho = p_double.dot(r_double, num_threads);
+        for (int count = 0; count <= maximum_iterations; count++) {
+            apply_L(systems[0], p_double, q_double);
+            double sigma = p_double.dot(q_double, num_threads);
+            double alpha = rho / max(1e-300, sigma);
+            x_double.axpy(alpha, p_double, num_threads);
+            if ((count + 1) % residual_replacement_interval == 0) {
+                update_residual();
+            } else {
+                r_double.axpy(-alpha, q_double, num_threads);
+                if (has_null_space) {
+                    r_double -= r_double.get_average();
+                }
+            }
+            nu = r_double.abs_max(num_threads);
+            if (nu < pressure_tolerance || count == maximum_iterations) {
+                break;
+            }
+            precondition();
+            double rho_new = z_double.dot(r_double, num_threads);
+            double beta = rho_new / rho;
+            rho = rho_new;
+            p_double.xpay(z_double, beta, num_threads);
+        }
+        pressure.assign_converted(x_double, num_threads);
     }
 
     virtual void run(const Array &residual, Array &pressure, real pressure_tolerance) {
-        pressure = 0;
-        Array r(res), mu(res), tmp(res);
-        mu = has_null_space ? r.get_average() : 0;
-        r = residual; //TODO: r = r - Lx
-        double nu = (r - mu).abs_max();
+        if (mixed_precision) {
+            run_mixed_precision(residual, pressure, pressure_tolerance);
+            return;
+        }
+        if (warm_start) {
+            compute_residual(systems[0], pressure, residual, r);
+            if (has_null_space) {
+                r -= r.get_average();
+            }
+        } else {
+            pressure = 0;
+            r = residual;
+        }
+        double nu = r.abs_max(num_threads);
         if (nu < pressure_tolerance)
             return;
-        r -= mu;
-        Array p = apply_preconditioner(r);
-        double rho = p.dot_double(r);
-        int maximum_iterations = 20;
-        Array z(res);
+        apply_preconditioner(r, p);
+        double rho = p.dot_double(r, num_threads);
         for (int count = 0; count <= maximum_iterations; count++) {
             apply_L(systems[0], p, z);
-            double sigma = p.dot_double(z);
+            double sigma = p.dot_double(z, num_threads);
             double alpha = rho / max(1e-20, sigma);
-            r.add_in_place(-(real)alpha, z);
-            mu = has_null_space ? r.get_average() : 0;
-            nu = (r - mu).abs_max();
-            (r - mu).print_abs_max_pos();
+            r.axpy(-(real)alpha, z, num_threads);
+            if (has_null_space) {
+                r -= r.get_average();
+            }
+            nu = r.abs_max(num_threads);
+            r.print_abs_max_pos();
             printf(" MGPCG iteration #%02d, nu=%f\n", count, nu);
             if (nu < pressure_tolerance || count == maximum_iterations) {
-                pressure.add_in_place((real)alpha, p);
+                pressure.axpy((real)alpha, p, num_threads);
                 return;
             }
-            r -= mu;
-            z = apply_preconditioner(r);
-            double rho_new = z.dot_double(r);
+            apply_preconditioner(r, z);
+            double rho_new = z.dot_double(r, num_threads);
             double beta = rho_new / rho;
             rho = rho_new;
-            pressure.add_in_place((real)alpha, p);
-            p = z.add((real)beta, p);
+            pressure.axpy((real)alpha, p, num_threads);
+            p.xpay(z, (real)beta, num_threads);
         }
     }
 };
@@ -371,4 +477,64 @@ TC_IMPLEMENTATION(PoissonSolver2D, MultigridPoissonSolver2D, "mg");
 
 TC_IMPLEMENTATION(PoissonSolver2D, MultigridPCGPoissonSolver2D, "mgpcg");
 
+#ifdef TC_USE_CUDA
+
+// MGPCG on a CUDA device (see poisson_solver_cuda.cu), with the hierarchy of MultigridPoissonSolver2D, which
+// is uploaded whenever the boundary is set
+class MultigridPCGPoissonSolver2DCuda : public MultigridPoissonSolver2D {
+protected:
+    PoissonCudaSolver solver;
+    std::vector<double> device_residuals;
+
+public:
+    // Start from the given pressure instead of zero, e.g. the solution of a similar system solved before
+    bool warm_start;
+
+    void initialize(const Config &config) override {
+        MultigridPoissonSolver2D::initialize(config);
+        warm_start = config.get("warm_start", false);
+        PoissonCudaParameters parameters;
+        parameters.dim = 2;
+        parameters.prolongation_scale = 1.0f;
+        parameters.smoothing_rounds = 4;
+        parameters.bottom_size = size_threshold;
+        parameters.bottom_rounds = 100;
+        parameters.maximum_iterations = 20;
+        solver.initialize(parameters);
+    }
+
+    void set_boundary_condition(const BCArray &boundary) override {
+        MultigridPoissonSolver2D::set_boundary_condition(boundary);
+        std::vector<PoissonCudaLevel> levels(max_level);
+        for (int l = 0; l < max_level; l++) {
+            const System &system = systems[l];
+            PoissonCudaLevel &level = levels[l];
+            const int height = system.get_height();
+            level.res[0] = 1;
+            level.res[1] = system.get_width();
+            level.res[2] = height;
+            // In the order of neighbour4_2d
+            const int offsets[4] = {height, -height, 1, -1};
+            level.num_neighbours = 4;
+            std::copy(offsets, offsets + 4, level.offsets);
+            const SystemRow *rows = system[0];
+            level.rows.resize(system.get_size());
+            for (int i = 0; i < (int)level.rows.size(); i++) {
+                level.rows[i].inv_numerator = rows[i].inv_numerator;
+                level.rows[i].neighbours = rows[i].neighbours;
+            }
+        }
+        solver.set_levels(levels, has_null_space);
+    }
+
+    void run(const Array &residual, Array &pressure, real pressure_tolerance) override {
+        device_residuals.clear();
+        solver.solve(residual[0], pressure[0], pressure_tolerance, warm_start, device_residuals);
+    }
+};
+
+TC_IMPLEMENTATION(PoissonSolver2D, MultigridPCGPoissonSolver2DCuda, "mgpcg_cuda");
+
+#endif
+
 TC_NAMESPACE_END
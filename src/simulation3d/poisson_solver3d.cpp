@@ -7,14 +7,49 @@
     the MIT license as written in the LICENSE file.
 *******************************************************************************/
 
+#include <taichi/system/memory.h>
 #include <taichi/system/threading.h>
 #include <taichi/dynamics/poisson_solver3d.h>
 #include <taichi/math/stencils.h>
+#include <taichi/math/temporal_blocking.h>
+#include <taichi/math/algebraic_multigrid.h>
+#include "poisson_solver_cuda.h"
+
+#if !defined(TC_DISABLE_SSE) && defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 TC_NAMESPACE_BEGIN
 
 void PoissonSolver3D::initialize(const Config &config) {
     maximum_iterations = config.get_int("maximum_iterations");
+    statistics_log = config.get("statistics_log", "");
+}
+
+void PoissonSolver3D::begin_solve(const std::string &solver, double tolerance) {
+    statistics = SolverStatistics();
+    statistics.solver = solver;
+    statistics.tolerance = tolerance;
+    solve_start_time = Time::get_time();
+}
+
+void PoissonSolver3D::add_residual(double residual) {
+    statistics.residual_history.push_back(residual);
+}
+
+void PoissonSolver3D::end_solve() {
+    statistics.solve_time = Time::get_time() - solve_start_time;
+    const int num_residuals = (int)statistics.residual_history.size();
+    statistics.iterations = std::max(0, num_residuals - 1);
+    statistics.converged = num_residuals > 0 && statistics.residual_history.back() < statistics.tolerance;
+    statistics.phases = solve_profiler.get_records();
+    if (profiler && profiler->enabled) {
+        profiler->merge(solve_profiler);
+    }
+    solve_profiler.clear();
+    if (!statistics_log.empty()) {
+        statistics.append_to_log(statistics_log);
+    }
 }
 
 // Maybe we are going to need Algebraic Multigrid in the future,
@@ -29,6 +64,12 @@ public:
     std::vector<BCArray> boundaries;
     const int size_threshold = 64;
     int num_threads;
+    // Levels with fewer cells run serially
+    int parallel_threshold;
+    // Smoother half-sweeps fused per pass over the grid; 1 sweeps the whole grid for each
+    int temporal_blocking;
+    // "mg_level_0", "mg_level_1"... for the profiler
+    std::vector<std::string> level_names;
     CellType padding;
     bool has_null_space;
     bool use_as_preconditioner;
@@ -84,14 +125,120 @@ public:
 
     std::vector<System> systems;
 
+    // Cells are grouped into runs of block_size along z. A block is regular if all its cells
+    // and their neighbours are interior, so that the smoother needs no cell type decoding.
+    static const int block_size = 4;
+    // Per level, indexed by flat index / block_size. Empty if the depth is not a multiple of block_size.
+    std::vector<std::vector<unsigned char>> regular_blocks;
+    // Bumped whenever set_boundary_condition changes something
+    int boundary_version = 0;
+
+    // Algebraic multigrid over the interior cells of the finest level, set up on demand
+    AlgebraicMultigrid amg;
+    // The flat index of the cell of every AMG row
+    std::vector<int> amg_cells;
+    int amg_version = -1;
+
+    // Runs func(i, j, k) for every cell in [lo, hi)
+    template <typename T>
+    static void for_each_in_box(Vector3i lo, Vector3i hi, const T &func) {
+        for (int i = lo[0]; i < hi[0]; i++) {
+            for (int j = lo[1]; j < hi[1]; j++) {
+                for (int k = lo[2]; k < hi[2]; k++) {
+                    func(i, j, k);
+                }
+            }
+        }
+    }
+
+    // The cell type of a coarse cell, from its 2 * 2 * 2 children
+    static CellType coarsen_cell(const BCArray &fine, int i, int j, int k) {
+        bool has_dirichlet = false;
+        bool all_neumann = true;
+        for (int di = 0; di < 2; di++) {
+            for (int dj = 0; dj < 2; dj++) {
+                for (int dk = 0; dk < 2; dk++) {
+                    CellType bc = fine[i * 2 + di][j * 2 + dj][k * 2 + dk];
+                    if (bc == DIRICHLET) {
+                        has_dirichlet = true;
+                    }
+                    if (bc != NEUMANN) {
+                        all_neumann = false;
+                    }
+                }
+            }
+        }
+        return has_dirichlet ? DIRICHLET : (all_neumann ? NEUMANN : INTERIOR);
+    }
+
+    void update_system_row(int l, const Index3D &ind) {
+        SystemRow &row = systems[l][ind];
+        row = SystemRow();
+        for (int i = 0; i < 6; i++) {
+            auto n_ind = ind + neighbour6_3d[i];
+            CellType cell;
+            if (boundaries[l].inside(n_ind)) {
+                cell = boundaries[l][n_ind];
+            } else {
+                cell = padding;
+            }
+            row.set_neighbour_cell_type(i, cell);
+            if (cell == DIRICHLET || cell == INTERIOR) {
+                row.inv_numerator += 1.0f;
+            }
+        }
+        if (boundaries[l][ind] != INTERIOR)
+            row.inv_numerator = 0;
+        else {
+            row.inv_numerator = 1.0f / row.inv_numerator;
+        }
+    }
+
+    void update_regular_block(int l, int b) {
+        const SystemRow *rows = &systems[l][0][0][0];
+        bool all_interior = true;
+        for (int k = 0; k < block_size; k++) {
+            const SystemRow &row = rows[b * block_size + k];
+            all_interior = all_interior && row.inv_numerator > 0 && row.neighbours == 0;
+        }
+        regular_blocks[l][b] = all_interior;
+    }
+
+    // Only the part of every level under the changed cells is rebuilt, so with static obstacles
+    // the hierarchy is built once and later calls just compare the boundary.
     void set_boundary_condition(const BCArray &boundary) override {
-        Vector3i res = this->res;
-        boundaries.clear();
-        boundaries.push_back(BCArray(res));
+        TC_MEMORY_TAG("poisson_solver3d");
+        // Counts the comparison with the last boundary only
+        Profiler::Scope _(solve_profiler, "boundary_setup", (uint64)boundary.get_size() * 2 * sizeof(CellType));
+        Vector3i lo(0), hi = res;
+        const bool rebuild = boundaries.empty();
+        if (rebuild) {
+            Vector3i res = this->res;
+            for (int l = 0; l < max_level; l++) {
+                boundaries.push_back(BCArray(res));
+                systems.push_back(System(res));
+                regular_blocks.push_back(std::vector<unsigned char>(res[2] % block_size == 0 ?
+                                                                    res[0] * res[1] * res[2] / block_size : 0));
+                res /= 2;
+            }
+        } else {
+            // Bounding box of the changed cells
+            lo = res;
+            hi = Vector3i(0);
+            for (auto &ind : boundary.get_region()) {
+                if (boundary[ind] != boundaries[0][ind]) {
+                    lo = glm::min(lo, Vector3i(ind.i, ind.j, ind.k));
+                    hi = glm::max(hi, Vector3i(ind.i + 1, ind.j + 1, ind.k + 1));
+                }
+            }
+            if (hi[0] <= lo[0]) {
+                return;
+            }
+        }
+        boundary_version++;
         // Iff we pad with Neumann and there's no dirichlet...
         has_null_space = padding == NEUMANN;
-
-        for (auto &ind :boundary.get_region()) {
+        for (auto &ind : boundary.get_region()) {
             if (boundary[ind] == DIRICHLET)
                 has_null_space = false;
         }
@@ -103,67 +250,53 @@ public:
             // error("null space detected");
         }
 
-        // Step 1: figure out cell types
-        for (int l = 0; l < max_level - 1; l++) {
-            res /= 2;
-            boundaries.push_back(BCArray(res));
-            for (auto &ind : boundaries.back().get_region()) {
-                auto &previous_boundary = boundaries[(int)boundaries.size() - 2];
-                bool has_dirichlet = false;
-                bool all_neumann = true;
-                for (int i = 0; i < 2; i++) {
-                    for (int j = 0; j < 2; j++) {
-                        for (int k = 0; k < 2; k++) {
-                            char bc = previous_boundary[ind.i * 2 + i][ind.j * 2 + j][ind.k * 2 + k];
-                            if (bc == DIRICHLET) {
-                                has_dirichlet = true;
-                                break;
-                            }
-                            if (bc != NEUMANN) {
-                                all_neumann = false;
-                            }
-                        }
-                    }
+        for (int l = 0; l < max_level; l++) {
+            // Step 1: update the cell types in the box, and shrink it to the cells that changed
+            BCArray &bc = boundaries[l];
+            const Vector3i level_res(bc.get_width(), bc.get_height(), bc.get_depth());
+            Vector3i changed_lo = level_res, changed_hi(0);
+            for_each_in_box(lo, hi, [&](int i, int j, int k) {
+                CellType cell = l == 0 ? boundary[i][j][k] : coarsen_cell(boundaries[l - 1], i, j, k);
+                if (rebuild || cell != bc[i][j][k]) {
+                    changed_lo = glm::min(changed_lo, Vector3i(i, j, k));
+                    changed_hi = glm::max(changed_hi, Vector3i(i + 1, j + 1, k + 1));
                 }
-                CellType bc = has_dirichlet ? DIRICHLET : (all_neumann ? NEUMANN : INTERIOR);
-                boundaries.back()[ind] = bc;
+                bc[i][j][k] = cell;
+            });
+            if (changed_hi[0] <= changed_lo[0]) {
+                // The coarser levels are unaffected
+                break;
             }
-        }
-
-        systems.clear();
-        res = this->res;
-        // Step 2: build the compressed systems
-        for (int l = 0; l < max_level; l++) {
-            System system(res);
-            for (auto &ind: system.get_region()) {
-                for (int i = 0; i < 6; i++) {
-                    auto n_ind = ind + neighbour6_3d[i];
-                    CellType cell;
-                    if (boundaries[l].inside(n_ind)) {
-                        cell = boundaries[l][n_ind];
-                    } else {
-                        cell = padding;
-                    }
-                    system[ind].set_neighbour_cell_type(i, cell);
-                    if (cell == DIRICHLET || cell == INTERIOR) {
-                        system[ind].inv_numerator += 1.0f;
+            // Step 2: rebuild the compressed system rows that see these cells
+            const Vector3i rows_lo = glm::max(changed_lo - Vector3i(1), Vector3i(0));
+            const Vector3i rows_hi = glm::min(changed_hi + Vector3i(1), level_res);
+            for_each_in_box(rows_lo, rows_hi, [&](int i, int j, int k) {
+                update_system_row(l, Index3D(i, j, k));
+            });
+            // Step 3: reclassify their blocks
+            if (!regular_blocks[l].empty()) {
+                const int block_lo = rows_lo[2] / block_size, block_hi = (rows_hi[2] + block_size - 1) / block_size;
+                const int height = bc.get_height(), blocks_per_row = bc.get_depth() / block_size;
+                for (int i = rows_lo[0]; i < rows_hi[0]; i++) {
+                    for (int j = rows_lo[1]; j < rows_hi[1]; j++) {
+                        for (int b = block_lo; b < block_hi; b++) {
+                            update_regular_block(l, (i * height + j) * blocks_per_row + b);
+                        }
                     }
                 }
-                if (boundaries[l][ind] != INTERIOR)
-                    system[ind].inv_numerator = 0;
-                else {
-                    system[ind].inv_numerator = 1.0f / system[ind].inv_numerator;
-                }
             }
-            systems.push_back(system);
-            res /= 2;
+            lo = changed_lo / 2;
+            hi = (changed_hi + Vector3i(1)) / 2;
         }
     }
 
     void initialize(const Config &config) override {
+        TC_MEMORY_TAG("poisson_solver3d");
         PoissonSolver3D::initialize(config);
         this->res = config.get_vec3i("res");
         this->num_threads = config.get_int("num_threads");
+        this->parallel_threshold = config.get("parallel_threshold", 4096);
+        this->temporal_blocking = config.get("temporal_blocking", 8);
         auto padding_name = config.get_string("padding");
         use_as_preconditioner = false;
         assert_info(padding_name == "dirichlet" || padding_name == "neumann",
@@ -182,275 +315,558 @@ public:
             assert_info(res[0] % 2 == 0, "odd width");
             assert_info(res[1] % 2 == 0, "odd height");
             assert_info(res[2] % 2 == 0, "odd depth");
+            level_names.push_back("mg_level_" + std::to_string(max_level));
             res /= 2;
             max_level++;
         } while (res[0] * res[1] * res[2] * 8 >= size_threshold);
     }
 
-    void parallel_for_each_cell(Array &arr, int threshold, const std::function<void(const Index3D &index)> &func) {
-        int max_side = std::max(std::max(arr.get_width(), arr.get_height()), arr.get_depth());
-        int num_threads;
-        if (max_side >= threshold) {
-            num_threads = this->num_threads;
-        } else {
-            num_threads = 1;
-        }
-        ThreadedTaskManager::run(arr.get_width(), num_threads, [&](int x) {
-            const int height = arr.get_height();
-            const int depth = arr.get_depth();
-            for (int y = 0; y < height; y++) {
-                for (int z = 0; z < depth; z++) {
-                    func(Index3D(x, y, z));
-                }
-            }
-        });
+    // Threads for work over arr: one unless it has at least parallel_threshold cells
+    template <typename A>
+    int get_num_threads(const A &arr) const {
+        return arr.get_size() >= parallel_threshold ? num_threads : 1;
+    }
+
+    // Runs func(x) for every x slab of arr
+    template <typename A, typename T>
+    void parallel_for_each_slab(const A &arr, const T &func) const {
+        parallel_for(0, arr.get_width(), get_num_threads(arr), func, 1);
+    }
+
+    // Flat index offsets of the neighbours, in the order of neighbour6_3d
+    template <typename A>
+    static void get_neighbour_offsets(const A &arr, int offsets[6]) {
+        const int depth = arr.get_depth(), stride = arr.get_height() * depth;
+        const int values[6] = {1, -1, depth, -depth, stride, -stride};
+        std::copy(values, values + 6, offsets);
     }
 
     bool get_has_null_space() {
         return has_null_space;
     }
 
-    void gauss_seidel(const System &system, const Array &residual, Array &pressure, int rounds) {
-        for (int i = 0; i < rounds; i++) {
-            for (int c = 0; c < 2; c++) {
-                parallel_for_each_cell(pressure, 128, [&](const Index3D &ind) {
-                    int sum = ind.i + ind.j + ind.k;
-                    if ((sum) % 2 == c) {
-                        if (system[ind].inv_numerator > 0) {
-                            real res = residual[ind];
-                            for (int k = 0; k < 6; k++) {
-                                Vector3i offset = neighbour6_3d[k];
-                                if (system[ind].get_neighbour_cell_type(k) == INTERIOR) {
-                                    res += pressure[ind + offset];
-                                }
-                            }
-                            pressure[ind] = res * system[ind].inv_numerator;
-                        } else {
-                            pressure[ind] = 0.0f;
-                        }
-                    }
-                });
+    // Relaxes the cells of parity p in the regular block starting at index, whose inv_numerator is 1/6.
+    // The cells of the other parity are computed too, but not written.
+    static void relax_regular_block(const real *b, real *x, int index, const int offsets[6], int p, real omega) {
+#if !defined(TC_DISABLE_SSE) && defined(__SSE2__)
+        static_assert(block_size == 4, "One SSE register per block");
+        const __m128 mask = _mm_castsi128_ps(p == 0 ? _mm_setr_epi32(-1, 0, -1, 0) : _mm_setr_epi32(0, -1, 0, -1));
+        const real *center = x + index;
+        __m128 res = _mm_loadu_ps(b + index);
+        for (int k = 0; k < 6; k++) {
+            res = _mm_add_ps(res, _mm_loadu_ps(center + offsets[k]));
+        }
+        const __m128 old = _mm_loadu_ps(center);
+        const __m128 relaxed = _mm_add_ps(old, _mm_mul_ps(_mm_set1_ps(omega),
+                                                          _mm_sub_ps(_mm_mul_ps(res, _mm_set1_ps(1.0f / 6.0f)), old)));
+        _mm_storeu_ps(x + index, _mm_or_ps(_mm_and_ps(mask, relaxed), _mm_andnot_ps(mask, old)));
+#else
+        for (int i = index + p; i < index + block_size; i += 2) {
+            real res = b[i];
+            for (int k = 0; k < 6; k++) {
+                res += x[i + offsets[k]];
             }
+            x[i] += omega * (res * (1.0f / 6.0f) - x[i]);
         }
+#endif
     }
 
-    void damped_jacobi(const System &system, const Array &residual, Array &pressure, int rounds) {
-        for (int i = 0; i < rounds; i++) {
-            for (int c = 0; c < 2; c++) {
-                parallel_for_each_cell(pressure, 128, [&](const Index3D &ind) {
-                    int sum = ind.i + ind.j + ind.k;
-                    if ((sum) % 2 == c) {
-                        if (system[ind].inv_numerator > 0) {
-                            real res = residual[ind];
-                            for (int k = 0; k < 6; k++) {
-                                Vector3i offset = neighbour6_3d[k];
-                                if (system[ind].get_neighbour_cell_type(k) == INTERIOR) {
-                                    res += pressure[ind + offset];
-                                }
-                            }
-                            real delta = res * system[ind].inv_numerator - pressure[ind];
-                            pressure[ind] += delta * 0.666666666667f;
-                        } else {
-                            pressure[ind] = 0.0f;
+    // Red-black Gauss-Seidel with relaxation omega: the cells of one color only depend on
+    // the other, so the slabs of a color can be updated concurrently. Up to temporal_blocking
+    // half-sweeps are fused into wavefronts over the slabs, with the same result as sweeping them one by one.
+    // Regular blocks take the vectorized path, the others decode their cell types.
+    void red_black_relax(const System &system, const std::vector<unsigned char> &regular, const Array &residual,
+                         Array &pressure, int rounds, real omega) {
+        const int height = pressure.get_height(), depth = pressure.get_depth();
+        const int row_blocks = regular.empty() ? 0 : depth / block_size;
+        int offsets[6];
+        get_neighbour_offsets(pressure, offsets);
+        const SystemRow *rows = &system[0][0][0];
+        const real *b = &residual[0][0][0];
+        real *x = &pressure[0][0][0];
+        auto relax_generic = [&](int index, int end, int parity) {
+            for (index += parity; index < end; index += 2) {
+                const SystemRow &row = rows[index];
+                if (row.inv_numerator > 0) {
+                    real res = b[index];
+                    for (int k = 0; k < 6; k++) {
+                        if (row.get_neighbour_cell_type(k) == INTERIOR) {
+                            res += x[index + offsets[k]];
                         }
                     }
-                });
-            }
-        }
-    }
-
-    void apply_L(const System &system, const Array &pressure, Array &output) {
-        for (auto &ind : pressure.get_region()) {
-            if (system[ind].inv_numerator == 0.0f) {
-                output[ind] = 0.0f;
-                continue;
+                    x[index] += omega * (res * row.inv_numerator - x[index]);
+                } else {
+                    x[index] = 0.0f;
+                }
             }
-            real pressure_center = pressure[ind];
-            real res = 0.0f;
-            for (int k = 0; k < 6; k++) {
-                Vector3i offset = neighbour6_3d[k];
-                CellType type = system[ind].get_neighbour_cell_type(k);
-                if (type == INTERIOR) {
-                    res += pressure_center - pressure[ind + offset];
-                } else if (type == DIRICHLET) {
-                    res += pressure_center;
+        };
+        // Half-sweep s relaxes color s % 2, reading only the neighbouring slabs
+        temporal_blocked_for(0, pressure.get_width(), rounds * 2, get_num_threads(pressure), [&](int s, int u) {
+            const int c = s & 1;
+            for (int v = 0; v < height; v++) {
+                const int base = (u * height + v) * depth;
+                const int parity = (c + u + v) & 1;
+                if (row_blocks == 0) {
+                    relax_generic(base, base + depth, parity);
+                    continue;
+                }
+                // block_size is even, so every block starts with the parity of the row
+                for (int k = 0; k < row_blocks; k++) {
+                    const int index = base + k * block_size;
+                    if (regular[index / block_size]) {
+                        relax_regular_block(b, x, index, offsets, parity, omega);
+                    } else {
+                        relax_generic(index, index + block_size, parity);
+                    }
                 }
             }
-            output[ind] = res;
-        }
+        }, temporal_blocking);
     }
 
-    void compute_residual(const System &system, const Array &pressure, const Array &div, Array &residual) {
-        parallel_for_each_cell(residual, 128, [&](const Index3D &ind) {
-            if (system[ind].inv_numerator == 0) {
-                residual[ind] = 0.0f;
-                return;
-            }
-            real pressure_center = pressure[ind];
-            real res = 0.0f;
-            for (int k = 0; k < 6; k++) {
-                Vector3i offset = neighbour6_3d[k];
-                CellType type = system[ind].get_neighbour_cell_type(k);
-                if (type == INTERIOR) {
-                    res += pressure_center - pressure[ind + offset];
-                } else if (type == DIRICHLET) {
-                    res += pressure_center;
+    void gauss_seidel(int level, int rounds) {
+        red_black_relax(systems[level], regular_blocks[level], residuals[level], pressures[level], rounds, 1.0f);
+    }
+
+    void damped_jacobi(int level, int rounds) {
+        red_black_relax(systems[level], regular_blocks[level], residuals[level], pressures[level], rounds,
+                        0.666666666667f);
+    }
+
+    // output = L pressure, or with div, div - L pressure
+    // S is real, or double for the outer iteration of mixed precision solves
+    template <typename S>
+    void apply_L(const System &system, const Array3D<S> &pressure, Array3D<S> &output,
+                 const Array3D<S> *div = nullptr) {
+        const int height = pressure.get_height(), depth = pressure.get_depth();
+        int offsets[6];
+        get_neighbour_offsets(pressure, offsets);
+        const SystemRow *rows = &system[0][0][0];
+        const S *x = &pressure[0][0][0], *b = div ? &(*div)[0][0][0] : nullptr;
+        S *y = &output[0][0][0];
+        parallel_for_each_slab(pressure, [&](int u) {
+            const int begin = u * height * depth, end = begin + height * depth;
+            for (int index = begin; index < end; index++) {
+                const SystemRow &row = rows[index];
+                if (row.inv_numerator == 0.0f) {
+                    y[index] = 0.0f;
+                    continue;
+                }
+                const S pressure_center = x[index];
+                S res = 0.0f;
+                for (int k = 0; k < 6; k++) {
+                    CellType type = row.get_neighbour_cell_type(k);
+                    if (type == INTERIOR) {
+                        res += pressure_center - x[index + offsets[k]];
+                    } else if (type == DIRICHLET) {
+                        res += pressure_center;
+                    }
                 }
+                y[index] = b ? b[index] - res : res;
             }
-            residual[ind] = div[ind] - res;
         });
     }
 
+    template <typename S>
+    void compute_residual(const System &system, const Array3D<S> &pressure, const Array3D<S> &div,
+                          Array3D<S> &residual) {
+        apply_L(system, pressure, residual, &div);
+    }
+
     void downsample(const System &system, const Array &x, Array &x_downsampled) { // Restriction
-        for (auto &ind : x_downsampled.get_region()) {
-            if (system[ind].inv_numerator > 0) {
-                x_downsampled[ind] =
-                        x[ind.i * 2 + 0][ind.j * 2 + 0][ind.k * 2 + 0] +
-                        x[ind.i * 2 + 0][ind.j * 2 + 0][ind.k * 2 + 1] +
-                        x[ind.i * 2 + 0][ind.j * 2 + 1][ind.k * 2 + 0] +
-                        x[ind.i * 2 + 0][ind.j * 2 + 1][ind.k * 2 + 1] +
-                        x[ind.i * 2 + 1][ind.j * 2 + 0][ind.k * 2 + 0] +
-                        x[ind.i * 2 + 1][ind.j * 2 + 0][ind.k * 2 + 1] +
-                        x[ind.i * 2 + 1][ind.j * 2 + 1][ind.k * 2 + 0] +
-                        x[ind.i * 2 + 1][ind.j * 2 + 1][ind.k * 2 + 1];
-            } else {
-                x_downsampled[ind] = 0.0f;
+        const int height = x_downsampled.get_height(), depth = x_downsampled.get_depth();
+        parallel_for_each_slab(x_downsampled, [&](int i) {
+            for (int j = 0; j < height; j++) {
+                for (int k = 0; k < depth; k++) {
+                    if (system[i][j][k].inv_numerator > 0) {
+                        real sum = 0;
+                        for (int di = 0; di < 2; di++) {
+                            for (int dj = 0; dj < 2; dj++) {
+                                const real *column = &x[i * 2 + di][j * 2 + dj][k * 2];
+                                sum += column[0] + column[1];
+                            }
+                        }
+                        x_downsampled[i][j][k] = sum;
+                    } else {
+                        x_downsampled[i][j][k] = 0.0f;
+                    }
+                }
             }
-        }
+        });
     }
 
     void prolongate(const System &system, Array &x, const Array &x_delta) const {
-        for (auto &ind : x.get_region()) {
-            // Do not prolongate to cells without a degree of freedom
-            if (system[ind].inv_numerator > 0) {
-                x[ind] += x_delta[ind.i / 2][ind.j / 2][ind.k / 2] * 0.5f;
+        const int height = x.get_height(), depth = x.get_depth();
+        parallel_for_each_slab(x, [&](int i) {
+            for (int j = 0; j < height; j++) {
+                const real *coarse = x_delta[i / 2][j / 2];
+                real *fine = x[i][j];
+                const SystemRow *rows = system[i][j];
+                for (int k = 0; k < depth; k++) {
+                    // Do not prolongate to cells without a degree of freedom
+                    if (rows[k].inv_numerator > 0) {
+                        fine[k] += coarse[k / 2] * 0.5f;
+                    }
+                }
             }
-        }
+        });
     }
 
+    // Memory traffic of a smoothing sweep, or of a residual computation, over level
+    uint64 get_sweep_bytes(int level) const {
+        return (uint64)residuals[level].get_size() * (sizeof(SystemRow) + 3 * sizeof(real));
+    }
+
+    // The time spent on every level excludes the coarser ones
     void run(int level) {
-        if (use_as_preconditioner)
-            pressures[level].reset(0.0f);
+        Profiler &profiler = solve_profiler;
+        const char *name = level_names[level].c_str();
+        const uint64 sweep_bytes = get_sweep_bytes(level);
         if (residuals[level].get_size() <= size_threshold) { // 4 * 4 * 4
-            gauss_seidel(systems[level], residuals[level], pressures[level], 100);
+            Profiler::Scope _(profiler, name, 100 * sweep_bytes);
+            if (use_as_preconditioner)
+                pressures[level].reset(0.0f);
+            gauss_seidel(level, 100);
         } else {
-            gauss_seidel(systems[level], residuals[level], pressures[level], 4);
             {
+                // Smoothing, the residual and its restriction
+                Profiler::Scope _(profiler, name, 5 * sweep_bytes + residuals[level].get_size() * sizeof(real));
+                if (use_as_preconditioner)
+                    pressures[level].reset(0.0f);
+                gauss_seidel(level, 4);
                 compute_residual(systems[level], pressures[level], residuals[level], tmp_residuals[level]);
                 downsample(systems[level + 1], tmp_residuals[level], residuals[level + 1]);
-                run(level + 1);
+            }
+            run(level + 1);
+            {
+                Profiler::Scope _(profiler, name, 5 * sweep_bytes);
                 prolongate(systems[level], pressures[level], pressures[level + 1]);
+                gauss_seidel(level, 4);
+            }
+        }
+    }
+
+    // Builds the AMG hierarchy of the finest level, unless the boundary is unchanged since the last setup
+    void setup_amg() {
+        if (amg_version == boundary_version) {
+            return;
+        }
+        Profiler::Scope _(solve_profiler, "amg_setup");
+        const System &system = systems[0];
+        const SystemRow *rows = &system[0][0][0];
+        amg_cells.clear();
+        std::vector<int> cell_rows(system.get_size(), -1);
+        for (int i = 0; i < system.get_size(); i++) {
+            if (rows[i].inv_numerator > 0) {
+                cell_rows[i] = (int)amg_cells.size();
+                amg_cells.push_back(i);
+            }
+        }
+        const int n = (int)amg_cells.size();
+        int offsets[6];
+        get_neighbour_offsets(pressures[0], offsets);
+        const int num_chunks = std::max(1, std::min(num_threads, n / 1024));
+        std::vector<SparseMatrixBuilder> builders(num_chunks, SparseMatrixBuilder(n, n));
+        parallel_for(0, num_chunks, num_threads, [&](int c) {
+            for (int r = (int)((int64)n * c / num_chunks); r < (int)((int64)n * (c + 1) / num_chunks); r++) {
+                const int index = amg_cells[r];
+                int diagonal = 0;
+                for (int k = 0; k < 6; k++) {
+                    CellType type = rows[index].get_neighbour_cell_type(k);
+                    if (type == INTERIOR) {
+                        builders[c].insert(r, cell_rows[index + offsets[k]], -1.0f);
+                    }
+                    if (type == INTERIOR || type == DIRICHLET) {
+                        diagonal++;
+                    }
+                }
+                builders[c].insert(r, r, (real)diagonal);
             }
-            gauss_seidel(systems[level], residuals[level], pressures[level], 4);
+        }, 1);
+        for (int c = 1; c < num_chunks; c++) {
+            builders[0].append(builders[c]);
+        }
+        amg.setup(builders[0].build(false, num_threads), num_threads);
+        amg_version = boundary_version;
+    }
+
+    // One AMG V-cycle for L x = b, from x. Cells without a degree of freedom get zero.
+    void run_amg(const Array &b, Array &x) {
+        setup_amg();
+        Profiler::Scope _(solve_profiler, "amg_cycle");
+        const int n = (int)amg_cells.size();
+        std::vector<real> b_rows(n), x_rows(n);
+        const real *b_cells = &b[0][0][0];
+        real *x_cells = &x[0][0][0];
+        parallel_for(0, n, num_threads, [&](int r) {
+            b_rows[r] = b_cells[amg_cells[r]];
+            x_rows[r] = x_cells[amg_cells[r]];
+        }, 1024);
+        if (n > 0) {
+            amg.run(b_rows.data(), x_rows.data());
         }
+        x = 0;
+        parallel_for(0, n, num_threads, [&](int r) {
+            x_cells[amg_cells[r]] = x_rows[r];
+        }, 1024);
     }
 
     virtual void run(const Array &residual, Array &pressure, real pressure_tolerance) override {
+        StatisticsScope _(*this, "mg", pressure_tolerance);
         pressures[0] = pressure;
         residuals[0] = residual;
+        compute_residual(systems[0], pressures[0], residuals[0], tmp_residuals[0]);
+        add_residual(tmp_residuals[0].abs_max(get_num_threads(tmp_residuals[0])));
         int iterations = 0;
         do {
             iterations++;
             run(0);
             compute_residual(systems[0], pressures[0], residuals[0], tmp_residuals[0]);
+            add_residual(tmp_residuals[0].abs_max(get_num_threads(tmp_residuals[0])));
             P(iterations);
-            P(tmp_residuals[0].abs_max());
-        } while (tmp_residuals[0].abs_max() > pressure_tolerance);
+            P(tmp_residuals[0].abs_max(get_num_threads(tmp_residuals[0])));
+        } while (tmp_residuals[0].abs_max(get_num_threads(tmp_residuals[0])) > pressure_tolerance);
         pressure = pressures[0];
     }
+
+    // Memory traffic of the vector work of a Krylov iteration, before and after the preconditioner
+    uint64 get_krylov_bytes(int scalar_size) const {
+        return (uint64)residuals[0].get_size() * (sizeof(SystemRow) + 17 * scalar_size);
+    }
 };
 
 class CGPoissonSolver3D : public MultigridPoissonSolver3D {
+protected:
+    // Kept across solves, so that the iterations allocate nothing
+    Array r, p, z;
+
 public:
     void initialize(const Config &config) {
+        TC_MEMORY_TAG("poisson_solver3d");
         MultigridPoissonSolver3D::initialize(config);
+        r = Array(res);
+        p = Array(res);
+        z = Array(res);
     }
 
-    Array apply_preconditioner(Array &r) {
-        return r;
+    void apply_preconditioner(const Array &b, Array &x) {
+        x = b;
     }
 
     virtual void run(const Array &residual, Array &pressure, real pressure_tolerance) {
-        pressure = 0;
-        Array r(res), mu(res), tmp(res);
-        mu = has_null_space ? r.get_average() : 0;
-        r = residual - mu; //TODO: r = r - Lx
-        double nu = r.abs_max();
+        StatisticsScope _(*this, "cg", pressure_tolerance);
+        // pressure is the initial guess
+        const int threads = get_num_threads(r);
+        compute_residual(systems[0], pressure, residual, r);
+        if (has_null_space) {
+            r -= r.get_average();
+        }
+        double nu = r.abs_max(threads);
+        add_residual(nu);
         if (nu < pressure_tolerance)
             return;
-        Array p = apply_preconditioner(r);
-        double rho = p.dot_double(r);
-        Array z(res);
+        apply_preconditioner(r, p);
+        double rho = p.dot_double(r, threads);
         for (int count = 0; count <= maximum_iterations; count++) {
-            apply_L(systems[0], p, z);
-            double sigma = p.dot_double(z);
-            double alpha = rho / max(1e-20, sigma);
-            r.add_in_place(-(real)alpha, z);
-            mu = has_null_space ? r.get_average() : 0.0f;
-            r -= mu;
-            nu = r.abs_max();
+            double alpha;
+            {
+                Profiler::Scope _(solve_profiler, "krylov", get_krylov_bytes(sizeof(real)));
+                apply_L(systems[0], p, z);
+                double sigma = p.dot_double(z, threads);
+                alpha = rho / max(1e-20, sigma);
+                r.axpy(-(real)alpha, z, threads);
+                if (has_null_space) {
+                    r -= r.get_average();
+                }
+                nu = r.abs_max(threads);
+            }
+            add_residual(nu);
             r.print_abs_max_pos();
             printf(" CG iteration #%02d, nu=%f\n", count, nu);
             if (nu < pressure_tolerance || count == maximum_iterations) {
-                pressure.add_in_place((real)alpha, p);
+                pressure.axpy((real)alpha, p, threads);
                 return;
             }
-            z = apply_preconditioner(r);
-            double rho_new = z.dot_double(r);
+            apply_preconditioner(r, z);
+            Profiler::Scope _(solve_profiler, "krylov");
+            double rho_new = z.dot_double(r, threads);
             double beta = rho_new / rho;
             rho = rho_new;
-            pressure.add_in_place((real)alpha, p);
-            p = z.add((real)beta, p);
+            pressure.axpy((real)alpha, p, threads);
+            p.xpay(z, (real)beta, threads);
+        }
+    }
+};
+
+// Stationary AMG V-cycles on the finest level. The geometric levels are still built for the system rows.
+class AMGPoissonSolver3D : public MultigridPoissonSolver3D {
+public:
+    virtual void run(const Array &residual, Array &pressure, real pressure_tolerance) override {
+        StatisticsScope _(*this, "amg", pressure_tolerance);
+        for (int count = 0; count <= maximum_iterations; count++) {
+            compute_residual(systems[0], pressure, residual, tmp_residuals[0]);
+            real nu = tmp_residuals[0].abs_max(get_num_threads(tmp_residuals[0]));
+            add_residual(nu);
+            printf(" AMG iteration #%02d, nu=%f\n", count, nu);
+            if (nu < pressure_tolerance || count == maximum_iterations) {
+                return;
+            }
+            run_amg(residual, pressure);
         }
     }
 };
 
 class MultigridPCGPoissonSolver3D : public MultigridPoissonSolver3D {
+protected:
+    // Kept across solves, so that the iterations allocate nothing
+    Array r, p, z;
+    // The outer iteration of mixed precision solves
+    Array3D<double> x_double, b_double, r_double, p_double, z_double, q_double;
+
 public:
+    // "gmg" (default) for a geometric V-cycle, or "amg"
+    std::string preconditioner;
+    // Runs the outer iteration in double and only the preconditioner in real
+    bool mixed_precision;
+    // With mixed_precision, the residual is recomputed from the solution every this many iterations,
+    // so that the recurrence can't drift away from it
+    int residual_replacement_interval;
+
     void initialize(const Config &config) {
+        TC_MEMORY_TAG("poisson_solver3d");
         MultigridPoissonSolver3D::initialize(config);
         use_as_preconditioner = true;
+        preconditioner = config.get("preconditioner", "gmg");
+        assert_info(preconditioner == "gmg" || preconditioner == "amg",
+                    "'preconditioner' has to be 'gmg' or 'amg' instead of " + preconditioner);
+        mixed_precision = config.get("mixed_precision", false);
+        residual_replacement_interval = config.get("residual_replacement_interval", 50);
+        assert_info(residual_replacement_interval > 0, "'residual_replacement_interval' has to be positive");
+        r = Array(res);
+        p = Array(res);
+        z = Array(res);
+        if (mixed_precision) {
+            for (auto arr : {&x_double, &b_double, &r_double, &p_double, &z_double, &q_double}) {
+                *arr = Array3D<double>(res);
+            }
+        }
     }
 
-    Array apply_preconditioner(Array &r) {
+    // x = M^-1 b
+    void apply_preconditioner(const Array &b, Array &x) {
+        if (preconditioner == "amg") {
+            x = 0;
+            run_amg(b, x);
+            return;
+        }
         pressures[0] = 0;
-        residuals[0] = r;
+        residuals[0] = b;
         MultigridPoissonSolver3D::run(0);
-        return pressures[0];
+        // pressures[0] is cleared before every V-cycle, so it can take x's storage
+        x.swap(pressures[0]);
+    }
+
+    // PCG in double around the preconditioner in real. The solution is rounded to real at the end.
+    void run_mixed_precision(const Array &residual, Array &pressure, real pressure_tolerance) {
+        const int threads = get_num_threads(r);
+        x_double.assign_converted(pressure, threads);
+        b_double.assign_converted(residual, threads);
+        auto update_residual = [&]() {
+            compute_residual(systems[0], x_double, b_double, r_double);
+            if (has_null_space) {
+                r_double -= r_double.get_average();
+            }
+        };
+        auto precondition = [&]() {
+            r.assign_converted(r_double, threads);
+            apply_preconditioner(r, z);
+            z_double.assign_converted(z, threads);
+        };
+        update_residual();
+        double nu = r_double.abs_max(threads);
+        add_residual(nu);
+        if (nu < pressure_tolerance)
+            return;
+        precondition();
+        p_double = z_double;
+        double rho = p_double.dot(r_double, threads);
+        for (int count = 0; count <= maximum_iterations; count++) {
+            {
+                Profiler::Scope _(solve_profiler, "krylov", get_krylov_bytes(sizeof(double)));
+                apply_L(systems[0], p_double, q_double);
+                double sigma = p_double.dot(q_double, threads);
+                double alpha = rho / max(1e-300, sigma);
+                x_double.axpy(alpha, p_double, threads);
+                if ((count + 1) % residual_replacement_interval == 0) {
+                    update_residual();
+                } else {
+                    r_double.axpy(-alpha, q_double, threads);
+                    if (has_null_space) {
+                        r_double -= r_double.get_average();
+                    }
+                }
+                nu = r_double.abs_max(threads);
+            }
+            add_residual(nu);
+            printf(" MGPCG (mixed precision) iteration #%02d, nu=%e\n", count, nu);
+            if (nu < pressure_tolerance || count == maximum_iterations) {
+                break;
+            }
+            precondition();
+            Profiler::Scope _(solve_profiler, "krylov");
+            double rho_new = z_double.dot(r_double, threads);
+            double beta = rho_new / rho;
+            rho = rho_new;
+            p_double.xpay(z_double, beta, threads);
+        }
+        pressure.assign_converted(x_double, threads);
     }
 
     virtual void run(const Array &residual, Array &pressure, real pressure_tolerance) {
         P(residual.sum());
-        pressure = 0;
-        Array r(res), mu(res), tmp(res);
-        mu = has_null_space ? r.get_average() : 0;
-        r = residual - mu; //TODO: r = r - Lx
-        double nu = r.abs_max();
+        StatisticsScope _(*this, mixed_precision ? "mgpcg_mixed" : "mgpcg", pressure_tolerance);
+        if (mixed_precision) {
+            run_mixed_precision(residual, pressure, pressure_tolerance);
+            return;
+        }
+        // pressure is the initial guess
+        const int threads = get_num_threads(r);
+        compute_residual(systems[0], pressure, residual, r);
+        if (has_null_space) {
+            r -= r.get_average();
+        }
+        double nu = r.abs_max(threads);
+        add_residual(nu);
         if (nu < pressure_tolerance)
             return;
-        Array p = apply_preconditioner(r);
-        double rho = p.dot_double(r);
-        Array z(res);
+        apply_preconditioner(r, p);
+        double rho = p.dot_double(r, threads);
         for (int count = 0; count <= maximum_iterations; count++) {
-            apply_L(systems[0], p, z);
-            double sigma = p.dot_double(z);
-            double alpha = rho / max(1e-20, sigma);
-            r.add_in_place(-(real)alpha, z);
-            mu = has_null_space ? r.get_average() : 0.0f;
-            r -= mu;
-            nu = r.abs_max();
+            double alpha;
+            {
+                Profiler::Scope _(solve_profiler, "krylov", get_krylov_bytes(sizeof(real)));
+                apply_L(systems[0], p, z);
+                double sigma = p.dot_double(z, threads);
+                alpha = rho / max(1e-20, sigma);
+                r.axpy(-(real)alpha, z, threads);
+                if (has_null_space) {
+                    r -= r.get_average();
+                }
+                nu = r.abs_max(threads);
+            }
+            add_residual(nu);
             r.print_abs_max_pos();
             printf(" MGPCG iteration #%02d, nu=%f\n", count, nu);
             if (nu < pressure_tolerance || count == maximum_iterations) {
-                pressure.add_in_place((real)alpha, p);
+                pressure.axpy((real)alpha, p, threads);
                 return;
             }
-            z = apply_preconditioner(r);
-            double rho_new = z.dot_double(r);
+            apply_preconditioner(r, z);
+            Profiler::Scope _(solve_profiler, "krylov");
+            double rho_new = z.dot_double(r, threads);
             double beta = rho_new / rho;
             rho = rho_new;
-            pressure.add_in_place((real)alpha, p);
-            p = z.add((real)beta, p);
+            pressure.axpy((real)alpha, p, threads);
+            p.xpay(z, (real)beta, threads);
         }
     }
 };
@@ -461,4 +877,71 @@ TC_IMPLEMENTATION(PoissonSolver3D, CGPoissonSolver3D, "cg");
 
 TC_IMPLEMENTATION(PoissonSolver3D, MultigridPCGPoissonSolver3D, "mgpcg");
 
+TC_IMPLEMENTATION(PoissonSolver3D, AMGPoissonSolver3D, "amg");
+
+#ifdef TC_USE_CUDA
+
+// MGPCG on a CUDA device (see poisson_solver_cuda.cu), with the hierarchy of MultigridPoissonSolver3D. The
+// systems are uploaded whenever the boundary changes, and every solve warm starts from the given pressure.
+class MultigridPCGPoissonSolver3DCuda : public MultigridPoissonSolver3D {
+protected:
+    PoissonCudaSolver solver;
+    // The boundary_version on the device
+    int device_version = -1;
+    std::vector<double> device_residuals;
+
+public:
+    void initialize(const Config &config) override {
+        TC_MEMORY_TAG("poisson_solver3d");
+        MultigridPoissonSolver3D::initialize(config);
+        use_as_preconditioner = true;
+        PoissonCudaParameters parameters;
+        parameters.dim = 3;
+        parameters.prolongation_scale = 0.5f;
+        parameters.smoothing_rounds = 4;
+        parameters.bottom_size = size_threshold;
+        parameters.bottom_rounds = 100;
+        parameters.maximum_iterations = maximum_iterations;
+        solver.initialize(parameters);
+    }
+
+    void set_boundary_condition(const BCArray &boundary) override {
+        MultigridPoissonSolver3D::set_boundary_condition(boundary);
+        if (device_version == boundary_version) {
+            return;
+        }
+        std::vector<PoissonCudaLevel> levels(max_level);
+        for (int l = 0; l < max_level; l++) {
+            const System &system = systems[l];
+            PoissonCudaLevel &level = levels[l];
+            level.res[0] = system.get_width();
+            level.res[1] = system.get_height();
+            level.res[2] = system.get_depth();
+            level.num_neighbours = 6;
+            get_neighbour_offsets(system, level.offsets);
+            const SystemRow *rows = &system[0][0][0];
+            level.rows.resize(system.get_size());
+            for (int i = 0; i < (int)level.rows.size(); i++) {
+                level.rows[i].inv_numerator = rows[i].inv_numerator;
+                level.rows[i].neighbours = rows[i].neighbours;
+            }
+        }
+        solver.set_levels(levels, has_null_space);
+        device_version = boundary_version;
+    }
+
+    void run(const Array &residual, Array &pressure, real pressure_tolerance) override {
+        StatisticsScope _(*this, "mgpcg_cuda", pressure_tolerance);
+        device_residuals.clear();
+        solver.solve(&residual[0][0][0], &pressure[0][0][0], pressure_tolerance, true, device_residuals);
+        for (double nu : device_residuals) {
+            add_residual(nu);
+        }
+    }
+};
+
+TC_IMPLEMENTATION(PoissonSolver3D, MultigridPCGPoissonSolver3DCuda, "mgpcg_cuda");
+
+#endif
+
 TC_NAMESPACE_END
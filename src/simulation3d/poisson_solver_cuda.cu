@@ -0,0 +1,450 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+// Device implementation of MGPCG. The V-cycle and the iteration follow MultigridPCGPoissonSolver3D and
+// MultigridPCGPoissonSolver2D step by step, with the same smoothing order, so that the iterates only differ
+// by rounding.
+
+#include "poisson_solver_cuda.h"
+#include "cuda_utils.cuh"
+#include <cuda_runtime.h>
+#include <algorithm>
+#include <memory>
+
+namespace taichi {
+
+const int poisson_cuda_threads = 256;
+// Blocks of the first pass of the reductions, each combining a grid-stride share of the terms
+const int poisson_cuda_reduction_blocks = 256;
+
+// The cell types of PoissonSolver3D and PoissonSolver2D
+const int poisson_cuda_interior = 0;
+const int poisson_cuda_dirichlet = 1;
+
+// Device scalars of the iteration
+enum PoissonCudaScalar {
+    RHO = 0,
+    SIGMA = 1,
+    ALPHA = 2,
+    BETA = 3,
+    SUM = 4,
+    NUM_SCALARS = 5,
+};
+
+struct PoissonCudaLevelView {
+    int res[3];
+    int n;
+    int num_neighbours;
+    int offsets[6];
+    const PoissonCudaRow *rows;
+};
+
+static int get_num_launch_blocks(int n) {
+    return std::max(1, (n + poisson_cuda_threads - 1) / poisson_cuda_threads);
+}
+
+__device__ __forceinline__ void relax_cell(const PoissonCudaLevelView &level, const float *b, float *x, int index) {
+    const PoissonCudaRow row = level.rows[index];
+    if (row.inv_numerator > 0) {
+        float res = b[index];
+        for (int k = 0; k < level.num_neighbours; k++) {
+            if (((row.neighbours >> (2 * k)) & 3) == poisson_cuda_interior) {
+                res += x[index + level.offsets[k]];
+            }
+        }
+        x[index] = res * row.inv_numerator;
+    } else {
+        x[index] = 0.0f;
+    }
+}
+
+// The cell of color (i + j + k) % 2 of pair t, i.e. of cells 2t and 2t + 1, which share their row as the
+// innermost dimension is even
+__device__ __forceinline__ int get_colored_cell(const PoissonCudaLevelView &level, int t, int color) {
+    const int first = 2 * t;
+    const int i = first / (level.res[1] * level.res[2]);
+    const int j = first / level.res[2] % level.res[1];
+    return first + ((color + i + j) & 1);
+}
+
+// Gauss-Seidel half-sweep over the cells of one color, which only depend on the other color
+__global__ void relax_color(PoissonCudaLevelView level, const float *b, float *x, int color) {
+    const int t = blockIdx.x * blockDim.x + threadIdx.x;
+    if (2 * t < level.n) {
+        relax_cell(level, b, x, get_colored_cell(level, t, color));
+    }
+}
+
+// All the half-sweeps of the coarsest level in a single block, which is small enough
+__global__ void relax_bottom(PoissonCudaLevelView level, const float *b, float *x, int rounds) {
+    for (int s = 0; s < rounds * 2; s++) {
+        for (int t = threadIdx.x; 2 * t < level.n; t += blockDim.x) {
+            relax_cell(level, b, x, get_colored_cell(level, t, s & 1));
+        }
+        __syncthreads();
+    }
+}
+
+// r = b - L x, or L x if b is null
+__global__ void apply_laplacian(PoissonCudaLevelView level, const float *x, const float *b, float *r) {
+    const int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index >= level.n) {
+        return;
+    }
+    const PoissonCudaRow row = level.rows[index];
+    if (row.inv_numerator == 0.0f) {
+        r[index] = 0.0f;
+        return;
+    }
+    const float center = x[index];
+    float res = 0.0f;
+    for (int k = 0; k < level.num_neighbours; k++) {
+        const int type = (row.neighbours >> (2 * k)) & 3;
+        if (type == poisson_cuda_interior) {
+            res += center - x[index + level.offsets[k]];
+        } else if (type == poisson_cuda_dirichlet) {
+            res += center;
+        }
+    }
+    r[index] = b ? b[index] - res : res;
+}
+
+// Sums the residuals of the children of every coarse cell with a degree of freedom
+__global__ void restrict_residual(PoissonCudaLevelView coarse, PoissonCudaLevelView fine, int coarsen_first,
+                                  const float *fine_r, float *coarse_b) {
+    const int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index >= coarse.n) {
+        return;
+    }
+    if (coarse.rows[index].inv_numerator <= 0) {
+        coarse_b[index] = 0.0f;
+        return;
+    }
+    const int i = index / (coarse.res[1] * coarse.res[2]);
+    const int j = index / coarse.res[2] % coarse.res[1];
+    const int k = index % coarse.res[2];
+    float sum = 0.0f;
+    for (int di = 0; di <= coarsen_first; di++) {
+        const int fi = coarsen_first ? i * 2 + di : i;
+        for (int dj = 0; dj < 2; dj++) {
+            const float *column = fine_r + (fi * fine.res[1] + j * 2 + dj) * fine.res[2] + k * 2;
+            sum += column[0] + column[1];
+        }
+    }
+    coarse_b[index] = sum;
+}
+
+// Adds the scaled coarse correction to the cells with a degree of freedom
+__global__ void prolongate_correction(PoissonCudaLevelView fine, PoissonCudaLevelView coarse, int coarsen_first,
+                                      const float *coarse_x, float *x, float scale) {
+    const int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index >= fine.n || fine.rows[index].inv_numerator <= 0) {
+        return;
+    }
+    const int i = index / (fine.res[1] * fine.res[2]);
+    const int j = index / fine.res[2] % fine.res[1];
+    const int k = index % fine.res[2];
+    const int ci = coarsen_first ? i / 2 : i;
+    x[index] += coarse_x[(ci * coarse.res[1] + j / 2) * coarse.res[2] + k / 2] * scale;
+}
+
+// y += sign * scalar x
+__global__ void axpy(int n, const double *scalar, float sign, const float *x, float *y) {
+    const int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < n) {
+        y[index] += sign * (float)*scalar * x[index];
+    }
+}
+
+// y = x + scalar y
+__global__ void xpay(int n, const double *scalar, const float *x, float *y) {
+    const int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < n) {
+        y[index] = x[index] + (float)*scalar * y[index];
+    }
+}
+
+// Removes the constant component, from the sum of the n values
+__global__ void subtract_average(int n, const double *sum, float *x) {
+    const int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < n) {
+        x[index] -= (float)(*sum / n);
+    }
+}
+
+// First pass of a sum of a[i] * b[i], or of a[i] if b is null, in double
+__global__ void sum_partials(int n, const float *a, const float *b, double *partials) {
+    __shared__ double shared[poisson_cuda_threads];
+    double sum = 0;
+    for (int i = blockIdx.x * blockDim.x + threadIdx.x; i < n; i += blockDim.x * gridDim.x) {
+        sum += b ? (double)a[i] * b[i] : (double)a[i];
+    }
+    shared[threadIdx.x] = sum;
+    __syncthreads();
+    for (int s = blockDim.x / 2; s > 0; s >>= 1) {
+        if (threadIdx.x < s) {
+            shared[threadIdx.x] += shared[threadIdx.x + s];
+        }
+        __syncthreads();
+    }
+    if (threadIdx.x == 0) {
+        partials[blockIdx.x] = shared[0];
+    }
+}
+
+__global__ void abs_max_partials(int n, const float *a, float *partials) {
+    __shared__ float shared[poisson_cuda_threads];
+    float m = 0;
+    for (int i = blockIdx.x * blockDim.x + threadIdx.x; i < n; i += blockDim.x * gridDim.x) {
+        m = fmaxf(m, fabsf(a[i]));
+    }
+    shared[threadIdx.x] = m;
+    __syncthreads();
+    for (int s = blockDim.x / 2; s > 0; s >>= 1) {
+        if (threadIdx.x < s) {
+            shared[threadIdx.x] = fmaxf(shared[threadIdx.x], shared[threadIdx.x + s]);
+        }
+        __syncthreads();
+    }
+    if (threadIdx.x == 0) {
+        partials[blockIdx.x] = shared[0];
+    }
+}
+
+// Second pass, in a single block of poisson_cuda_reduction_blocks threads, in a fixed order
+template <typename T, bool is_max>
+__global__ void finish_reduction(const T *partials, T *out) {
+    __shared__ T shared[poisson_cuda_reduction_blocks];
+    shared[threadIdx.x] = partials[threadIdx.x];
+    __syncthreads();
+    for (int s = blockDim.x / 2; s > 0; s >>= 1) {
+        if (threadIdx.x < s) {
+            shared[threadIdx.x] = is_max ? max(shared[threadIdx.x], shared[threadIdx.x + s])
+                                         : shared[threadIdx.x] + shared[threadIdx.x + s];
+        }
+        __syncthreads();
+    }
+    if (threadIdx.x == 0) {
+        *out = shared[0];
+    }
+}
+
+__global__ void compute_alpha(double *scalars) {
+    scalars[ALPHA] = scalars[RHO] / max(1e-20, scalars[SIGMA]);
+}
+
+// With the new rho in SUM
+__global__ void compute_beta(double *scalars) {
+    scalars[BETA] = scalars[SUM] / scalars[RHO];
+    scalars[RHO] = scalars[SUM];
+}
+
+struct PoissonCudaSolver::Implementation {
+    struct Level {
+        PoissonCudaLevelView view;
+        DeviceArray<PoissonCudaRow> rows;
+        // The right-hand side and solution of the coarse levels, and the residual of every level
+        DeviceArray<float> b, x, r;
+    };
+
+    PoissonCudaParameters parameters;
+    std::vector<std::unique_ptr<Level>> levels;
+    bool has_null_space = false;
+    DeviceArray<float> b, x, r, p, z;
+    DeviceArray<double> sum_partials_buffer, scalars;
+    DeviceArray<float> max_partials_buffer, norm;
+    // The iteration runs on `stream`, the norm reduction on `norm_stream`
+    cudaStream_t stream = nullptr, norm_stream = nullptr;
+    cudaEvent_t residual_ready = nullptr, norm_ready = nullptr;
+    // Pinned, for the asynchronous copy of the norm
+    float *host_norm = nullptr;
+
+    Implementation() {
+        TC_CUDA_CHECK(cudaStreamCreate(&stream));
+        TC_CUDA_CHECK(cudaStreamCreate(&norm_stream));
+        TC_CUDA_CHECK(cudaEventCreateWithFlags(&residual_ready, cudaEventDisableTiming));
+        TC_CUDA_CHECK(cudaEventCreateWithFlags(&norm_ready, cudaEventDisableTiming));
+        TC_CUDA_CHECK(cudaMallocHost(&host_norm, sizeof(float)));
+        sum_partials_buffer.resize(poisson_cuda_reduction_blocks);
+        max_partials_buffer.resize(poisson_cuda_reduction_blocks);
+        scalars.resize(NUM_SCALARS);
+        norm.resize(1);
+    }
+
+    ~Implementation() {
+        cudaFreeHost(host_norm);
+        cudaEventDestroy(norm_ready);
+        cudaEventDestroy(residual_ready);
+        cudaStreamDestroy(norm_stream);
+        cudaStreamDestroy(stream);
+    }
+
+    int get_n() const {
+        return levels.empty() ? 0 : levels[0]->view.n;
+    }
+
+    // The sum of a[i] * b[i], or of a[i], into scalars[target]
+    void sum(const float *a, const float *b, int target) {
+        sum_partials<<<poisson_cuda_reduction_blocks, poisson_cuda_threads, 0, stream>>>(
+                get_n(), a, b, sum_partials_buffer.data());
+        finish_reduction<double, false><<<1, poisson_cuda_reduction_blocks, 0, stream>>>(
+                sum_partials_buffer.data(), scalars.data() + target);
+    }
+
+    void project_out_null_space(float *v) {
+        if (!has_null_space) {
+            return;
+        }
+        sum(v, nullptr, SUM);
+        subtract_average<<<get_num_launch_blocks(get_n()), poisson_cuda_threads, 0, stream>>>(
+                get_n(), scalars.data() + SUM, v);
+    }
+
+    // Starts the reduction of the max norm of r on norm_stream, once `stream` has computed r
+    void begin_norm() {
+        TC_CUDA_CHECK(cudaEventRecord(residual_ready, stream));
+        TC_CUDA_CHECK(cudaStreamWaitEvent(norm_stream, residual_ready, 0));
+        abs_max_partials<<<poisson_cuda_reduction_blocks, poisson_cuda_threads, 0, norm_stream>>>(
+                get_n(), r.data(), max_partials_buffer.data());
+        finish_reduction<float, true><<<1, poisson_cuda_reduction_blocks, 0, norm_stream>>>(
+                max_partials_buffer.data(), norm.data());
+        TC_CUDA_CHECK(cudaMemcpyAsync(host_norm, norm.data(), sizeof(float), cudaMemcpyDeviceToHost, norm_stream));
+        TC_CUDA_CHECK(cudaEventRecord(norm_ready, norm_stream));
+    }
+
+    double end_norm() {
+        TC_CUDA_CHECK(cudaEventSynchronize(norm_ready));
+        return *host_norm;
+    }
+
+    void smooth(const Level &level, const float *b, float *x, int rounds) {
+        const int blocks = get_num_launch_blocks(level.view.n / 2);
+        for (int s = 0; s < rounds * 2; s++) {
+            relax_color<<<blocks, poisson_cuda_threads, 0, stream>>>(level.view, b, x, s & 1);
+        }
+    }
+
+    // One V-cycle for L x = b from zero, as the host solvers precondition
+    void run(int l, const float *b, float *x) {
+        Level &level = *levels[l];
+        const int n = level.view.n;
+        TC_CUDA_CHECK(cudaMemsetAsync(x, 0, n * sizeof(float), stream));
+        if (n <= parameters.bottom_size || l + 1 == (int)levels.size()) {
+            const int threads = std::min(1024, (n / 2 + 31) / 32 * 32);
+            relax_bottom<<<1, threads, 0, stream>>>(level.view, b, x, parameters.bottom_rounds);
+            return;
+        }
+        Level &coarse = *levels[l + 1];
+        const int coarsen_first = parameters.dim == 3;
+        smooth(level, b, x, parameters.smoothing_rounds);
+        apply_laplacian<<<get_num_launch_blocks(n), poisson_cuda_threads, 0, stream>>>(level.view, x, b,
+                                                                                        level.r.data());
+        restrict_residual<<<get_num_launch_blocks(coarse.view.n), poisson_cuda_threads, 0, stream>>>(
+                coarse.view, level.view, coarsen_first, level.r.data(), coarse.b.data());
+        run(l + 1, coarse.b.data(), coarse.x.data());
+        prolongate_correction<<<get_num_launch_blocks(n), poisson_cuda_threads, 0, stream>>>(
+                level.view, coarse.view, coarsen_first, coarse.x.data(), x, parameters.prolongation_scale);
+        smooth(level, b, x, parameters.smoothing_rounds);
+    }
+};
+
+PoissonCudaSolver::PoissonCudaSolver() : impl(new Implementation()) {
+}
+
+PoissonCudaSolver::~PoissonCudaSolver() {
+}
+
+void PoissonCudaSolver::initialize(const PoissonCudaParameters &parameters) {
+    impl->parameters = parameters;
+}
+
+void PoissonCudaSolver::set_levels(const std::vector<PoissonCudaLevel> &levels, bool has_null_space) {
+    Implementation &s = *impl;
+    s.has_null_space = has_null_space;
+    s.levels.resize(levels.size());
+    for (int l = 0; l < (int)levels.size(); l++) {
+        if (!s.levels[l]) {
+            s.levels[l].reset(new Implementation::Level());
+        }
+        Implementation::Level &level = *s.levels[l];
+        const PoissonCudaLevel &host = levels[l];
+        PoissonCudaLevelView &view = level.view;
+        std::copy(host.res, host.res + 3, view.res);
+        view.n = host.res[0] * host.res[1] * host.res[2];
+        view.num_neighbours = host.num_neighbours;
+        std::copy(host.offsets, host.offsets + 6, view.offsets);
+        level.rows.upload(host.rows.data(), host.rows.size());
+        view.rows = level.rows.data();
+        level.r.resize(view.n);
+        // The finest level works on the Krylov vectors instead
+        if (l > 0) {
+            level.b.resize(view.n);
+            level.x.resize(view.n);
+        }
+    }
+    const int n = s.get_n();
+    for (auto arr : {&s.b, &s.x, &s.r, &s.p, &s.z}) {
+        arr->resize(n);
+    }
+}
+
+void PoissonCudaSolver::solve(const float *b_host, float *x_host, float tolerance, bool warm_start,
+                              std::vector<double> &residuals) {
+    Implementation &s = *impl;
+    const int n = s.get_n();
+    const int blocks = get_num_launch_blocks(n);
+    const PoissonCudaLevelView &finest = s.levels[0]->view;
+    double *scalars = s.scalars.data();
+    s.b.upload(b_host, n);
+    if (warm_start) {
+        s.x.upload(x_host, n);
+        apply_laplacian<<<blocks, poisson_cuda_threads, 0, s.stream>>>(finest, s.x.data(), s.b.data(), s.r.data());
+        s.project_out_null_space(s.r.data());
+    } else {
+        TC_CUDA_CHECK(cudaMemsetAsync(s.x.data(), 0, n * sizeof(float), s.stream));
+        TC_CUDA_CHECK(cudaMemcpyAsync(s.r.data(), s.b.data(), n * sizeof(float), cudaMemcpyDeviceToDevice,
+                                      s.stream));
+    }
+    s.begin_norm();
+    double nu = s.end_norm();
+    residuals.push_back(nu);
+    if (nu >= tolerance) {
+        s.run(0, s.r.data(), s.p.data());
+        s.sum(s.p.data(), s.r.data(), RHO);
+        for (int count = 0; count <= s.parameters.maximum_iterations; count++) {
+            apply_laplacian<<<blocks, poisson_cuda_threads, 0, s.stream>>>(finest, s.p.data(), nullptr,
+                                                                           s.z.data());
+            s.sum(s.p.data(), s.z.data(), SIGMA);
+            compute_alpha<<<1, 1, 0, s.stream>>>(scalars);
+            axpy<<<blocks, poisson_cuda_threads, 0, s.stream>>>(n, scalars + ALPHA, -1.0f, s.z.data(), s.r.data());
+            s.project_out_null_space(s.r.data());
+            s.begin_norm();
+            axpy<<<blocks, poisson_cuda_threads, 0, s.stream>>>(n, scalars + ALPHA, 1.0f, s.p.data(), s.x.data());
+            const bool last = count == s.parameters.maximum_iterations;
+            if (!last) {
+                // Queued before the norm is known, so that the reduction overlaps the V-cycle, which is
+                // wasted on the final iteration only
+                s.run(0, s.r.data(), s.z.data());
+                s.sum(s.z.data(), s.r.data(), SUM);
+                compute_beta<<<1, 1, 0, s.stream>>>(scalars);
+                xpay<<<blocks, poisson_cuda_threads, 0, s.stream>>>(n, scalars + BETA, s.z.data(), s.p.data());
+            }
+            nu = s.end_norm();
+            residuals.push_back(nu);
+            if (nu < tolerance || last) {
+                break;
+            }
+        }
+    }
+    TC_CUDA_CHECK(cudaStreamSynchronize(s.stream));
+    TC_CUDA_CHECK(cudaGetLastError());
+    s.x.download(x_host);
+}
+
+}
@@ -0,0 +1,74 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+// Device side of the "mgpcg_cuda" Poisson solvers. This header is shared by nvcc and the host
+// compiler, so it only uses plain types.
+
+#include <memory>
+#include <vector>
+
+namespace taichi {
+
+// A row of the system, as the host multigrid solvers compress it: the reciprocal of the diagonal, 0 for cells
+// without a degree of freedom, and the cell type of neighbour k in bits 2k and 2k + 1
+struct PoissonCudaRow {
+    float inv_numerator;
+    int neighbours;
+};
+
+// One level of the hierarchy. 2D grids are stored as 1 x width x height, so that the flat index is the same
+// and the last dimension, which is even on every level, is the innermost one.
+struct PoissonCudaLevel {
+    int res[3];
+    int num_neighbours;
+    // Flat index offsets of the neighbours, in the order of their bits in PoissonCudaRow::neighbours
+    int offsets[6];
+    std::vector<PoissonCudaRow> rows;
+};
+
+struct PoissonCudaParameters {
+    // The first dimension of the levels is only coarsened in 3D
+    int dim;
+    // Coarse corrections are scaled by this when prolongated
+    float prolongation_scale;
+    // Red-black Gauss-Seidel rounds before and after the coarse correction
+    int smoothing_rounds;
+    // The V-cycle stops at the first level of at most bottom_size cells, which gets bottom_rounds rounds
+    int bottom_size;
+    int bottom_rounds;
+    int maximum_iterations;
+};
+
+// MGPCG with the multigrid hierarchy and the Krylov vectors kept on the device. Only the right-hand side and
+// the solution are copied per solve, and the residual norm of every iteration. The scalars of the iteration
+// stay on the device, and the norm is reduced on a second stream while the next preconditioner runs.
+class PoissonCudaSolver {
+public:
+    PoissonCudaSolver();
+
+    ~PoissonCudaSolver();
+
+    void initialize(const PoissonCudaParameters &parameters);
+
+    // Finest level first. With a null space, the constant component is projected out of the residuals.
+    void set_levels(const std::vector<PoissonCudaLevel> &levels, bool has_null_space);
+
+    // Solves L x = b, from x if warm_start and from zero otherwise, until the max norm of the residual is below
+    // tolerance or after maximum_iterations iterations. residuals receives the norm initially and after every
+    // iteration.
+    void solve(const float *b, float *x, float tolerance, bool warm_start, std::vector<double> &residuals);
+
+protected:
+    struct Implementation;
+    std::unique_ptr<Implementation> impl;
+};
+
+}
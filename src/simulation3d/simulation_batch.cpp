@@ -0,0 +1,131 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/dynamics/simulation_batch.h>
+#include <taichi/system/threading.h>
+#include <taichi/system/timer.h>
+#include <algorithm>
+#include <limits>
+
+TC_NAMESPACE_BEGIN
+
+void SimulationBatch::initialize(const Config &config) {
+    num_threads = config.get_int("num_threads");
+    threads_per_simulation = config.get("threads_per_simulation", 1);
+    assert_info(num_threads >= 1 && threads_per_simulation >= 1, "Thread counts must be positive");
+    for (auto &entry : simulations) {
+        entry.simulation->set_num_threads(threads_per_simulation);
+    }
+}
+
+int SimulationBatch::add(std::shared_ptr<Simulation3D> simulation) {
+    assert_info(simulation != nullptr, "A batch can not hold a null simulation");
+    simulation->set_num_threads(threads_per_simulation);
+    Entry entry;
+    entry.simulation = simulation;
+    entry.statistics.current_time = simulation->get_current_time();
+    simulations.push_back(entry);
+    return (int)simulations.size() - 1;
+}
+
+// The pool gives thread s the s-th of num_threads contiguous ranges, and steals the upper half of the largest
+// range left. The simulations are dealt to the ranges longest first (those not yet timed first of all), so that
+// every thread starts with long ones and the short ones at the ends are left to stealing.
+std::vector<int> SimulationBatch::get_schedule() const {
+    std::vector<int> order;
+    std::vector<double> cost(simulations.size());
+    for (int i = 0; i < (int)simulations.size(); i++) {
+        const Statistics &stat = simulations[i].statistics;
+        if (stat.failed) {
+            continue;
+        }
+        cost[i] = stat.steps > 0 ? stat.step_time / stat.steps : std::numeric_limits<double>::infinity();
+        order.push_back(i);
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return cost[a] > cost[b];
+    });
+    const int n = (int)order.size(), ranges = std::max(1, std::min(num_threads, n));
+    std::vector<int> schedule(n), next(ranges), end(ranges);
+    for (int s = 0; s < ranges; s++) {
+        next[s] = (int)((int64)s * n / ranges);
+        end[s] = (int)((int64)(s + 1) * n / ranges);
+    }
+    int s = 0;
+    for (int i : order) {
+        while (next[s] == end[s]) {
+            s = (s + 1) % ranges;
+        }
+        schedule[next[s]++] = i;
+        s = (s + 1) % ranges;
+    }
+    return schedule;
+}
+
+void SimulationBatch::step(real t, int num_steps) {
+    const std::vector<int> schedule = get_schedule();
+    // Per simulation in the schedule, of this call
+    std::vector<double> busy_time(schedule.size(), 0.0);
+    std::vector<int> steps(schedule.size(), 0);
+    const double start = Time::get_time();
+    parallel_for(0, (int)schedule.size(), num_threads, [&](int k) {
+        Entry &entry = simulations[schedule[k]];
+        for (int i = 0; i < num_steps; i++) {
+            const double step_start = Time::get_time();
+            try {
+                entry.simulation->step(t);
+            } catch (...) {
+                entry.error = std::current_exception();
+                entry.statistics.failed = true;
+            }
+            const double step_time = Time::get_time() - step_start;
+            busy_time[k] += step_time;
+            entry.statistics.step_time += step_time;
+            entry.statistics.last_step_time = step_time;
+            if (entry.statistics.failed) {
+                printf("Warning: simulation %d failed at t = %f\n", schedule[k], entry.statistics.current_time);
+                break;
+            }
+            steps[k]++;
+            entry.statistics.steps++;
+            entry.statistics.current_time = entry.simulation->get_current_time();
+        }
+    }, 1);
+    wall_time = Time::get_time() - start;
+    last_steps = 0;
+    last_busy_time = 0;
+    for (int k = 0; k < (int)schedule.size(); k++) {
+        last_steps += steps[k];
+        last_busy_time += busy_time[k];
+    }
+}
+
+std::vector<SimulationBatch::Statistics> SimulationBatch::get_all_statistics() const {
+    std::vector<Statistics> statistics;
+    for (auto &entry : simulations) {
+        statistics.push_back(entry.statistics);
+    }
+    return statistics;
+}
+
+void SimulationBatch::rethrow(int i) const {
+    if (simulations[i].error) {
+        std::rethrow_exception(simulations[i].error);
+    }
+}
+
+double SimulationBatch::get_throughput() const {
+    return wall_time > 0 ? last_steps / wall_time : 0.0;
+}
+
+double SimulationBatch::get_utilization() const {
+    return wall_time > 0 ? last_busy_time / (wall_time * num_threads) : 0.0;
+}
+
+TC_NAMESPACE_END
@@ -8,6 +8,7 @@
 *******************************************************************************/
 
 #include <taichi/visual/surface_material.h>
+#include <taichi/visual/compiled_material.h>
 #include <taichi/physics/physics_constants.h>
 #include <taichi/math/discrete_sampler.h>
 #include <taichi/common/asset_manager.h>
@@ -47,34 +48,28 @@ public:
         return true;
     }
 
-    Vector3 sample_direction(const Vector3 &in, real u, real v, const Vector2 &uv) const {
-        return random_diffuse(Vector3(0, 0, in.z > 0 ? 1 : -1), u, v);
-    }
-
     virtual void sample(const Vector3 &in_dir, real u, real v, Vector3 &out_dir, Vector3 &f, real &pdf,
                         SurfaceEvent &event, const Vector2 &uv) const override {
-        out_dir = sample_direction(in_dir, u, v, uv);
-        f = evaluate_bsdf(in_dir, out_dir, uv);
-        pdf = probability_density(in_dir, out_dir, uv);
-        event = (int)SurfaceScatteringFlags::emit;
+        EmissiveLobe::sample(color_sampler->sample3(uv), in_dir, u, v, out_dir, f, pdf, event);
     }
 
     virtual real probability_density(const Vector3 &in, const Vector3 &out, const Vector2 &uv) const override {
-        if (in.z * out.z < eps) {
-            return 0;
-        }
-        return out.z / pi;
+        return EmissiveLobe::probability_density(in, out);
     }
 
     virtual Vector3 evaluate_bsdf(const Vector3 &in, const Vector3 &out, const Vector2 &uv) const override {
-        auto color = color_sampler->sample3(uv);
-        return (in.z * out.z > 0 ? 1.0f : 0.0f) * color; // No division by pi here.
+        return EmissiveLobe::evaluate(color_sampler->sample3(uv), in, out);
     }
 
     virtual real get_importance(const Vector2 &uv) const override {
         return luminance(color_sampler->sample3(uv));
     }
 
+    bool compile(MaterialTable &table, CompiledMaterial &compiled) const override {
+        compiled.kind = CompiledMaterialKind::emissive;
+        compiled.color.set(color_sampler);
+        return true;
+    }
 };
 
 TC_IMPLEMENTATION(SurfaceMaterial, EmissiveMaterial, "emissive");
@@ -88,51 +83,29 @@ public:
         assert(color_sampler != nullptr);
     }
 
-    Vector3 sample_direction(const Vector3 &in, real u, real v, const Vector2 &uv) const {
-        Vector3 normal(0, 0, sgn(in.z));
-        if (abs(in.z) > 1 - eps) {
-            return random_diffuse(normal, u, v);
-        } else {
-            // We do the following other than the above to ensure correlation for MCMC...
-            if (u > v) {
-                std::swap(u, v);
-            }
-            if (v < eps) {
-                v = eps;
-            }
-            u /= v;
-            real xz = v, y = sqrt(1 - v * v);
-            real phi = u * 2.0f * pi;
-            real r = v / sqrt(in.x * in.x + in.y * in.y), p = in.x * r, q = in.y * r;
-            real c = cos(phi), s = sin(phi);
-            return Vector3(p * c - q * s, q * c + p * s, y * sgn(in.z));
-        }
-    }
-
     virtual real probability_density(const Vector3 &in, const Vector3 &out, const Vector2 &uv) const override {
-        if (in.z * out.z < eps) {
-            return 0;
-        }
-        return std::abs(out.z) / pi;
+        return DiffuseLobe::probability_density(in, out);
     }
 
     virtual Vector3 evaluate_bsdf(const Vector3 &in, const Vector3 &out, const Vector2 &uv) const override {
-        auto color = color_sampler->sample3(uv);
-        return (in.z * out.z > eps ? 1.0f : 0.0f) * color * (1.0f / pi);
+        return DiffuseLobe::evaluate(color_sampler->sample3(uv), in, out);
     }
 
     virtual void sample(const Vector3 &in_dir, real u, real v, Vector3 &out_dir,
                         Vector3 &f, real &pdf,
                         SurfaceEvent &event, const Vector2 &uv) const override {
-        out_dir = sample_direction(in_dir, u, v, uv);
-        f = evaluate_bsdf(in_dir, out_dir, uv);
-        event = (int)SurfaceScatteringFlags::non_delta;
-        pdf = out_dir.z / pi;
+        DiffuseLobe::sample(color_sampler->sample3(uv), in_dir, u, v, out_dir, f, pdf, event);
     }
 
     virtual real get_importance(const Vector2 &uv) const override {
         return luminance(color_sampler->sample3(uv));
     }
+
+    bool compile(MaterialTable &table, CompiledMaterial &compiled) const override {
+        compiled.kind = CompiledMaterialKind::diffuse;
+        compiled.color.set(color_sampler);
+        return true;
+    }
 };
 
 TC_IMPLEMENTATION(SurfaceMaterial, DiffuseMaterial, "diffuse");
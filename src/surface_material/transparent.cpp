@@ -8,6 +8,7 @@
 *******************************************************************************/
 
 #include <taichi/visual/surface_material.h>
+#include <taichi/visual/compiled_material.h>
 #include <taichi/physics/physics_constants.h>
 #include <taichi/math/discrete_sampler.h>
 #include <taichi/common/asset_manager.h>
@@ -61,6 +62,13 @@ public:
     virtual bool is_delta() const override {
         return nested->is_delta();
     }
+
+    bool compile(MaterialTable &table, CompiledMaterial &compiled) const override {
+        compiled.kind = CompiledMaterialKind::transparent;
+        compiled.color.set(mask);
+        compiled.nested = table.add(nested.get());
+        return true;
+    }
 };
 
 TC_IMPLEMENTATION(SurfaceMaterial, TransparentMaterial, "transparent")
@@ -0,0 +1,134 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/communicator.h>
+#include <climits>
+#include <cstdlib>
+
+#ifdef TC_USE_MPI
+#include <mpi.h>
+#endif
+
+TC_NAMESPACE_BEGIN
+
+// A single process, i.e. no neighbours
+class SerialCommunicator : public Communicator {
+public:
+    int get_rank() const override {
+        return 0;
+    }
+
+    int get_num_ranks() const override {
+        return 1;
+    }
+
+    void exchange_with_neighbours(const std::vector<char> send[2], std::vector<char> recv[2]) override {
+        recv[0].clear();
+        recv[1].clear();
+    }
+
+    int64 all_reduce_min(int64 val) override {
+        return val;
+    }
+
+    std::string get_name() const override {
+        return "serial";
+    }
+};
+
+TC_IMPLEMENTATION(Communicator, SerialCommunicator, "serial");
+
+#ifdef TC_USE_MPI
+
+// The processes of MPI_COMM_WORLD, ordered by rank. MPI is initialized on first use if the
+// host application has not done so, and finalized at exit in that case.
+class MPICommunicator : public Communicator {
+protected:
+    int rank = 0, num_ranks = 1;
+
+    static void finalize_mpi() {
+        int finalized;
+        MPI_Finalized(&finalized);
+        if (!finalized) {
+            MPI_Finalize();
+        }
+    }
+
+public:
+    void initialize(const Config &config) override {
+        int initialized;
+        MPI_Initialized(&initialized);
+        if (!initialized) {
+            MPI_Init(nullptr, nullptr);
+            std::atexit(finalize_mpi);
+        }
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+    }
+
+    int get_rank() const override {
+        return rank;
+    }
+
+    int get_num_ranks() const override {
+        return num_ranks;
+    }
+
+    void exchange_with_neighbours(const std::vector<char> send[2], std::vector<char> recv[2]) override {
+        const int neighbours[2] = {rank - 1, rank + 1};
+        // Sizes go first so that the receivers can allocate; messages from the two sides are
+        // told apart by their source.
+        unsigned long long send_size[2], recv_size[2] = {0, 0};
+        std::vector<MPI_Request> requests;
+        for (int side = 0; side < 2; side++) {
+            if (neighbours[side] < 0 || neighbours[side] >= num_ranks) {
+                continue;
+            }
+            assert_info(send[side].size() <= (std::size_t)INT_MAX, "Message too large for MPI");
+            send_size[side] = send[side].size();
+            requests.emplace_back();
+            MPI_Irecv(&recv_size[side], 1, MPI_UNSIGNED_LONG_LONG, neighbours[side], 0, MPI_COMM_WORLD,
+                      &requests.back());
+            requests.emplace_back();
+            MPI_Isend(&send_size[side], 1, MPI_UNSIGNED_LONG_LONG, neighbours[side], 0, MPI_COMM_WORLD,
+                      &requests.back());
+        }
+        MPI_Waitall((int)requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+        requests.clear();
+        for (int side = 0; side < 2; side++) {
+            recv[side].resize(recv_size[side]);
+            if (neighbours[side] < 0 || neighbours[side] >= num_ranks) {
+                continue;
+            }
+            requests.emplace_back();
+            MPI_Irecv(recv[side].data(), (int)recv_size[side], MPI_CHAR, neighbours[side], 1, MPI_COMM_WORLD,
+                      &requests.back());
+            requests.emplace_back();
+            MPI_Isend(const_cast<char *>(send[side].data()), (int)send_size[side], MPI_CHAR, neighbours[side], 1,
+                      MPI_COMM_WORLD, &requests.back());
+        }
+        MPI_Waitall((int)requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+    }
+
+    int64 all_reduce_min(int64 val) override {
+        long long local = val, global;
+        MPI_Allreduce(&local, &global, 1, MPI_LONG_LONG, MPI_MIN, MPI_COMM_WORLD);
+        return global;
+    }
+
+    std::string get_name() const override {
+        return "mpi";
+    }
+};
+
+TC_IMPLEMENTATION(Communicator, MPICommunicator, "mpi");
+
+#endif
+
+TC_NAMESPACE_END
@@ -0,0 +1,120 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/cpu_dispatch.h>
+#include <algorithm>
+#include <cstdlib>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define TC_CPUID_MSVC
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#define TC_CPUID_GNU
+#endif
+
+TC_NAMESPACE_BEGIN
+
+#if defined(TC_CPUID_MSVC) || defined(TC_CPUID_GNU)
+
+static void cpuid(int leaf, int subleaf, unsigned int regs[4]) {
+#ifdef TC_CPUID_MSVC
+    int r[4];
+    __cpuidex(r, leaf, subleaf);
+    std::copy(r, r + 4, regs);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// The register state the OS saves on context switches (XCR0)
+static unsigned long long get_xcr0() {
+#ifdef TC_CPUID_MSVC
+    return _xgetbv(0);
+#else
+    unsigned int eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((unsigned long long)edx << 32) | eax;
+#endif
+}
+
+static CPUTarget detect_cpu_target() {
+    unsigned int regs[4];
+    cpuid(0, 0, regs);
+    if (regs[0] < 7) {
+        return CPUTarget::baseline;
+    }
+    cpuid(1, 0, regs);
+    const bool osxsave = (regs[2] >> 27) & 1, fma = (regs[2] >> 12) & 1, avx = (regs[2] >> 28) & 1;
+    if (!osxsave || !avx || !fma) {
+        return CPUTarget::baseline;
+    }
+    const unsigned long long xcr0 = get_xcr0();
+    // SSE and AVX state
+    if ((xcr0 & 0x6) != 0x6) {
+        return CPUTarget::baseline;
+    }
+    cpuid(7, 0, regs);
+    const unsigned int ebx = regs[1];
+    if (!((ebx >> 5) & 1)) {
+        return CPUTarget::baseline;
+    }
+    // F, DQ, BW and VL, and the opmask and upper ZMM state
+    const bool avx512 = ((ebx >> 16) & 1) && ((ebx >> 17) & 1) && ((ebx >> 30) & 1) && ((ebx >> 31) & 1);
+    if (avx512 && (xcr0 & 0xe6) == 0xe6) {
+        return CPUTarget::avx512;
+    }
+    return CPUTarget::avx2;
+}
+
+#else
+
+static CPUTarget detect_cpu_target() {
+    return CPUTarget::baseline;
+}
+
+#endif
+
+static CPUTarget get_requested_cpu_target(CPUTarget detected) {
+    const char *requested = std::getenv("TC_CPU_TARGET");
+    if (requested == nullptr || *requested == 0) {
+        return detected;
+    }
+    const std::string name = requested;
+    CPUTarget target = detected;
+    if (name == "baseline") {
+        target = CPUTarget::baseline;
+    } else if (name == "avx2") {
+        target = CPUTarget::avx2;
+    } else if (name == "avx512") {
+        target = CPUTarget::avx512;
+    } else {
+        error("Unknown TC_CPU_TARGET " + name);
+    }
+    // Only ever lowered, as the CPU could not run the wider variants
+    return (int)target < (int)detected ? target : detected;
+}
+
+CPUTarget get_cpu_target() {
+    static const CPUTarget target = get_requested_cpu_target(detect_cpu_target());
+    return target;
+}
+
+std::string get_cpu_target_name(CPUTarget target) {
+    switch (target) {
+        case CPUTarget::avx512:
+            return "avx512";
+        case CPUTarget::avx2:
+            return "avx2";
+        default:
+            return "baseline";
+    }
+}
+
+TC_NAMESPACE_END
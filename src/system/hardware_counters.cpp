@@ -0,0 +1,210 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/hardware_counters.h>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+TC_NAMESPACE_BEGIN
+
+std::atomic<bool> HardwareCounters::enabled(false);
+
+namespace {
+
+const int num_events = 5;
+
+// The counters of one thread: a perf_event group led by the cycle counter. Any thread may read it.
+struct ThreadCounters {
+    int fds[num_events];
+    // For each member of the group in read order, the event it counts
+    std::vector<int> members;
+
+    ThreadCounters() {
+        std::fill(fds, fds + num_events, -1);
+    }
+
+    bool open();
+
+    HardwareCounterValues read() const;
+
+    ~ThreadCounters();
+};
+
+// Counters of exited threads are read one last time into retired
+struct CounterRegistry {
+    std::mutex mut;
+    std::vector<std::shared_ptr<ThreadCounters>> threads;
+    HardwareCounterValues retired;
+};
+
+CounterRegistry &get_registry() {
+    // Never destroyed, for threads that exit after static destruction began
+    static CounterRegistry *registry = new CounterRegistry();
+    return *registry;
+}
+
+int64 &get_value(HardwareCounterValues &values, int event) {
+    int64 *fields[num_events] = {&values.cycles, &values.instructions, &values.l1d_misses, &values.llc_misses,
+                                 &values.branch_misses};
+    return *fields[event];
+}
+
+#ifdef __linux__
+
+bool ThreadCounters::open() {
+    const uint32_t types[num_events] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+                                        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE};
+    const uint64 configs[num_events] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    for (int i = 0; i < num_events; i++) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[i];
+        attr.config = configs[i];
+        // The group starts at once, when its leader is enabled
+        attr.disabled = i == 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        fds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds[0], 0);
+        if (fds[i] < 0) {
+            if (i == 0) {
+                return false;
+            }
+            // Members the CPU lacks, e.g. cache events in some VMs, are left out
+            continue;
+        }
+        members.push_back(i);
+    }
+    ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+}
+
+HardwareCounterValues ThreadCounters::read() const {
+    HardwareCounterValues values;
+    uint64 buffer[1 + num_events];
+    const ssize_t size = ::read(fds[0], buffer, sizeof(buffer));
+    if (size < (ssize_t)sizeof(uint64)) {
+        return values;
+    }
+    const int n = std::min((int)buffer[0], (int)members.size());
+    for (int i = 0; i < n; i++) {
+        get_value(values, members[i]) = (int64)buffer[1 + i];
+    }
+    return values;
+}
+
+ThreadCounters::~ThreadCounters() {
+    for (int fd : fds) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+#else
+
+bool ThreadCounters::open() {
+    return false;
+}
+
+HardwareCounterValues ThreadCounters::read() const {
+    return HardwareCounterValues();
+}
+
+ThreadCounters::~ThreadCounters() {
+}
+
+#endif
+
+// Leaves the counts of its thread to the registry when the thread exits
+struct LocalCounters {
+    std::shared_ptr<ThreadCounters> counters;
+    // Tried and failed, e.g. for lack of permissions
+    bool failed = false;
+
+    ~LocalCounters() {
+        if (!counters) {
+            return;
+        }
+        CounterRegistry &registry = get_registry();
+        std::lock_guard<std::mutex> _(registry.mut);
+        registry.retired += counters->read();
+        registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), counters));
+    }
+};
+
+LocalCounters &get_local_counters() {
+    thread_local LocalCounters local;
+    return local;
+}
+
+}
+
+bool HardwareCounters::is_available() {
+#ifdef __linux__
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool HardwareCounters::set_enabled(bool enabled) {
+    HardwareCounters::enabled.store(enabled, std::memory_order_relaxed);
+    if (enabled) {
+        attach_thread();
+        if (!get_local_counters().counters) {
+            HardwareCounters::enabled.store(false, std::memory_order_relaxed);
+            return false;
+        }
+    }
+    return enabled;
+}
+
+void HardwareCounters::attach_thread() {
+    LocalCounters &local = get_local_counters();
+    if (local.counters || local.failed || !is_enabled()) {
+        return;
+    }
+    auto counters = std::make_shared<ThreadCounters>();
+    if (!counters->open()) {
+        local.failed = true;
+        return;
+    }
+    local.counters = counters;
+    CounterRegistry &registry = get_registry();
+    std::lock_guard<std::mutex> _(registry.mut);
+    registry.threads.push_back(counters);
+}
+
+HardwareCounterValues HardwareCounters::read() {
+    CounterRegistry &registry = get_registry();
+    std::lock_guard<std::mutex> _(registry.mut);
+    HardwareCounterValues total = registry.retired;
+    for (auto &counters : registry.threads) {
+        total += counters->read();
+    }
+    return total;
+}
+
+TC_NAMESPACE_END
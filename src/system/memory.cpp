@@ -0,0 +1,134 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/memory.h>
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+
+TC_NAMESPACE_BEGIN
+
+namespace {
+
+struct TagCounters {
+    std::atomic<int64> current, peak, num_allocations;
+
+    TagCounters() : current(0), peak(0), num_allocations(0) {}
+};
+
+void update_peak(std::atomic<int64> &peak, int64 value) {
+    int64 old = peak.load(std::memory_order_relaxed);
+    while (value > old && !peak.compare_exchange_weak(old, value, std::memory_order_relaxed)) {
+    }
+}
+
+// Tag 0 is "untagged"
+struct TagRegistry {
+    std::mutex mut;
+    std::vector<std::string> names;
+    TagCounters tags[MemoryAccounting::max_num_tags];
+    TagCounters total;
+
+    TagRegistry() {
+        names.push_back("untagged");
+    }
+};
+
+TagRegistry &get_registry() {
+    // Never destroyed, since static objects may free memory during static destruction
+    static TagRegistry *registry = new TagRegistry();
+    return *registry;
+}
+
+thread_local int current_tag = 0;
+
+}
+
+int MemoryAccounting::get_tag(const std::string &name) {
+    TagRegistry &registry = get_registry();
+    std::lock_guard<std::mutex> _(registry.mut);
+    for (int i = 0; i < (int)registry.names.size(); i++) {
+        if (registry.names[i] == name) {
+            return i;
+        }
+    }
+    assert_info((int)registry.names.size() < max_num_tags, "Too many memory tags");
+    registry.names.push_back(name);
+    return (int)registry.names.size() - 1;
+}
+
+int MemoryAccounting::get_current_tag() {
+    return current_tag;
+}
+
+void MemoryAccounting::add(int tag, int64 bytes) {
+    TagRegistry &registry = get_registry();
+    TagCounters &counters = registry.tags[tag];
+    update_peak(counters.peak, counters.current.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+    update_peak(registry.total.peak, registry.total.current.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+    if (bytes > 0) {
+        counters.num_allocations.fetch_add(1, std::memory_order_relaxed);
+        registry.total.num_allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+std::vector<MemoryAccounting::Record> MemoryAccounting::get_records() {
+    TagRegistry &registry = get_registry();
+    std::lock_guard<std::mutex> _(registry.mut);
+    std::vector<Record> records;
+    for (int i = 0; i < (int)registry.names.size(); i++) {
+        const TagCounters &counters = registry.tags[i];
+        records.push_back(Record{registry.names[i], counters.current.load(std::memory_order_relaxed),
+                                 counters.peak.load(std::memory_order_relaxed),
+                                 counters.num_allocations.load(std::memory_order_relaxed)});
+    }
+    return records;
+}
+
+int64 MemoryAccounting::get_current_bytes() {
+    return get_registry().total.current.load(std::memory_order_relaxed);
+}
+
+int64 MemoryAccounting::get_peak_bytes() {
+    return get_registry().total.peak.load(std::memory_order_relaxed);
+}
+
+void MemoryAccounting::reset_peaks() {
+    TagRegistry &registry = get_registry();
+    std::lock_guard<std::mutex> _(registry.mut);
+    for (int i = 0; i < (int)registry.names.size(); i++) {
+        registry.tags[i].peak.store(registry.tags[i].current.load(std::memory_order_relaxed),
+                                    std::memory_order_relaxed);
+    }
+    registry.total.peak.store(registry.total.current.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+void MemoryAccounting::print() {
+    const double mb = 1.0 / (1 << 20);
+    printf("%-32s %12s %12s %12s\n", "Memory tag", "Current MB", "Peak MB", "Allocations");
+    for (auto &record : get_records()) {
+        if (record.peak == 0 && record.num_allocations == 0) {
+            continue;
+        }
+        printf("%-32s %12.2f %12.2f %12lld\n", record.name.c_str(), record.current * mb, record.peak * mb,
+               (long long)record.num_allocations);
+    }
+    printf("%-32s %12.2f %12.2f\n", "total", get_current_bytes() * mb, get_peak_bytes() * mb);
+}
+
+MemoryAccounting::Scope::Scope(int tag) {
+    previous_tag = current_tag;
+    current_tag = tag;
+}
+
+MemoryAccounting::Scope::~Scope() {
+    current_tag = previous_tag;
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,117 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/render_statistics.h>
+#include <taichi/system/timer.h>
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+namespace {
+
+const int num_counters = (int)RenderCounter::num_counters;
+
+// The counters of live threads, and the counts of threads that exited
+struct CounterRegistry {
+    std::mutex mut;
+    std::vector<std::atomic<int64> *> threads;
+    int64 retired[num_counters] = {};
+    double start_time = Time::get_time();
+};
+
+CounterRegistry &get_registry() {
+    // Never destroyed, for threads that exit after static destruction began
+    static CounterRegistry *registry = new CounterRegistry();
+    return *registry;
+}
+
+}
+
+RenderCounters::Local::Local() {
+    for (auto &value : values) {
+        value.store(0, std::memory_order_relaxed);
+    }
+    CounterRegistry &registry = get_registry();
+    std::lock_guard<std::mutex> _(registry.mut);
+    registry.threads.push_back(values);
+}
+
+RenderCounters::Local::~Local() {
+    CounterRegistry &registry = get_registry();
+    std::lock_guard<std::mutex> _(registry.mut);
+    for (int i = 0; i < num_counters; i++) {
+        registry.retired[i] += values[i].load(std::memory_order_relaxed);
+    }
+    registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), values));
+}
+
+RenderStatistics RenderCounters::get_statistics() {
+    CounterRegistry &registry = get_registry();
+    int64 totals[num_counters];
+    {
+        std::lock_guard<std::mutex> _(registry.mut);
+        std::copy(registry.retired, registry.retired + num_counters, totals);
+        for (auto values : registry.threads) {
+            for (int i = 0; i < num_counters; i++) {
+                totals[i] += values[i].load(std::memory_order_relaxed);
+            }
+        }
+    }
+    auto total = [&](RenderCounter counter) {
+        return totals[(int)counter];
+    };
+    RenderStatistics statistics;
+    statistics.primary_rays = total(RenderCounter::primary_rays);
+    statistics.secondary_rays = total(RenderCounter::closest_hit_rays) - statistics.primary_rays;
+    statistics.shadow_rays = total(RenderCounter::shadow_rays);
+    statistics.paths = total(RenderCounter::paths);
+    statistics.path_vertices = total(RenderCounter::path_vertices);
+    statistics.splats = total(RenderCounter::splats);
+    statistics.russian_roulette_terminations = total(RenderCounter::russian_roulette_terminations);
+    statistics.seconds = Time::get_time() - registry.start_time;
+    return statistics;
+}
+
+RenderStatistics RenderStatistics::operator-(const RenderStatistics &o) const {
+    RenderStatistics d;
+    d.primary_rays = primary_rays - o.primary_rays;
+    d.secondary_rays = secondary_rays - o.secondary_rays;
+    d.shadow_rays = shadow_rays - o.shadow_rays;
+    d.paths = paths - o.paths;
+    d.path_vertices = path_vertices - o.path_vertices;
+    d.splats = splats - o.splats;
+    d.russian_roulette_terminations = russian_roulette_terminations - o.russian_roulette_terminations;
+    d.seconds = seconds - o.seconds;
+    return d;
+}
+
+RenderStatistics &RenderStatistics::operator+=(const RenderStatistics &o) {
+    primary_rays += o.primary_rays;
+    secondary_rays += o.secondary_rays;
+    shadow_rays += o.shadow_rays;
+    paths += o.paths;
+    path_vertices += o.path_vertices;
+    splats += o.splats;
+    russian_roulette_terminations += o.russian_roulette_terminations;
+    seconds += o.seconds;
+    return *this;
+}
+
+void RenderStatistics::print(const std::string &name) const {
+    printf("Rays/s [%s]: %.3gM (primary %.3gM, secondary %.3gM, shadow %.3gM), paths/s %.3gM, "
+           "average path length %.2f, splats/s %.3gM, RR terminations %lld\n", name.c_str(),
+           get_rays_per_second() * 1e-6, get_rate(primary_rays) * 1e-6, get_rate(secondary_rays) * 1e-6,
+           get_rate(shadow_rays) * 1e-6, get_paths_per_second() * 1e-6, get_average_path_length(),
+           get_splats_per_second() * 1e-6, (long long)russian_roulette_terminations);
+}
+
+TC_NAMESPACE_END
@@ -8,7 +8,355 @@
 *******************************************************************************/
 
 #include <taichi/system/threading.h>
+#include <taichi/system/timer.h>
+#include <taichi/system/tracer.h>
+#include <taichi/system/hardware_counters.h>
+#include <algorithm>
+#include <deque>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 TC_NAMESPACE_BEGIN
 
+// The part of a job's range still owned by one participant, padded to a cache line.
+// begin and end only change under lock, but may be read without it as a hint.
+struct ThreadPool::Slot {
+    Spinlock lock;
+    std::atomic<int> begin, end;
+    char padding[64 - sizeof(Spinlock) - 2 * sizeof(std::atomic<int>)];
+
+    Slot() : begin(0), end(0) {}
+
+    Slot(const Slot &o) : begin(o.begin.load()), end(o.end.load()) {}
+
+    int get_remaining() const {
+        return end.load(std::memory_order_relaxed) - begin.load(std::memory_order_relaxed);
+    }
+};
+
+struct ThreadPool::Job {
+    const RangeFunction *body;
+    int grain_size;
+    std::vector<Slot> slots;
+    // Guarded by ThreadPool::mut
+    int next_slot;
+    int users;
+};
+
+// Set while a thread executes job bodies
+static thread_local bool inside_job = false;
+
+ThreadPool &ThreadPool::get_instance() {
+    static ThreadPool pool;
+    return pool;
+}
+
+ThreadPool::ThreadPool() : nested_parallelism(true), num_grains(0), num_steals(0), busy_nanoseconds(0) {
+    statistics_start_time = Time::get_time();
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> _(mut);
+        stopping = true;
+    }
+    job_available.notify_all();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::grow(int num_workers) {
+    std::lock_guard<std::mutex> _(mut);
+    while ((int)workers.size() < num_workers) {
+        int id = (int)workers.size();
+        workers.emplace_back([this, id]() {
+            worker_loop(id);
+        });
+    }
+}
+
+void ThreadPool::pin_worker(int id) {
+#ifdef __linux__
+    int num_cores = (int)std::thread::hardware_concurrency();
+    if (num_cores <= 0) {
+        return;
+    }
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET((id + 1) % num_cores, &cpu_set);
+    pthread_setaffinity_np(workers[id].native_handle(), sizeof(cpu_set_t), &cpu_set);
+#endif
+}
+
+void ThreadPool::set_core_pinning(bool pinning) {
+    std::lock_guard<std::mutex> _(mut);
+    core_pinning = pinning;
+    if (pinning) {
+        for (int i = 0; i < (int)workers.size(); i++) {
+            pin_worker(i);
+        }
+    }
+}
+
+void ThreadPool::set_nested_parallelism(bool enabled) {
+    nested_parallelism = enabled;
+}
+
+void ThreadPool::work_on(Job &job, int slot) {
+    TC_TRACE_SCOPE("parallel_for");
+    if (HardwareCounters::is_enabled()) {
+        HardwareCounters::attach_thread();
+    }
+    bool was_inside_job = inside_job;
+    inside_job = true;
+    double start = Time::get_time();
+    int64 grains = 0, steals = 0;
+    Slot &own = job.slots[slot];
+    const int num_slots = (int)job.slots.size();
+    while (true) {
+        own.lock.lock();
+        int grain_begin = own.begin, grain_end = std::min(int(own.end), grain_begin + job.grain_size);
+        if (grain_begin < grain_end) {
+            own.begin = grain_end;
+            own.lock.unlock();
+            (*job.body)(grain_begin, grain_end);
+            grains++;
+            continue;
+        }
+        own.lock.unlock();
+        // Own range exhausted: take the upper half of the largest remaining one
+        int victim = -1, largest = 0;
+        for (int i = 1; i < num_slots; i++) {
+            int v = (slot + i) % num_slots;
+            int remaining = job.slots[v].get_remaining();
+            if (remaining > largest) {
+                largest = remaining;
+                victim = v;
+            }
+        }
+        if (victim == -1) {
+            // Whatever is left is already being executed
+            break;
+        }
+        Slot &target = job.slots[victim];
+        target.lock.lock();
+        int stolen_end = target.end;
+        int stolen_begin = stolen_end - (stolen_end - target.begin + 1) / 2;
+        target.end = stolen_begin;
+        target.lock.unlock();
+        if (stolen_begin < stolen_end) {
+            own.lock.lock();
+            own.begin = stolen_begin;
+            own.end = stolen_end;
+            own.lock.unlock();
+            steals++;
+        }
+    }
+    if (grains > 0) {
+        num_grains += grains;
+        num_steals += steals;
+        busy_nanoseconds += int64((Time::get_time() - start) * 1e9);
+    }
+    inside_job = was_inside_job;
+}
+
+ThreadPool::Job *ThreadPool::find_open_job() const {
+    // Prefer inner jobs, whose callers hold up their enclosing jobs
+    for (int i = (int)jobs.size() - 1; i >= 0; i--) {
+        if (jobs[i]->next_slot < (int)jobs[i]->slots.size()) {
+            return jobs[i];
+        }
+    }
+    return nullptr;
+}
+
+void ThreadPool::worker_loop(int id) {
+    Tracer::set_thread_name("worker " + std::to_string(id));
+    std::unique_lock<std::mutex> lock(mut);
+    if (core_pinning) {
+        pin_worker(id);
+    }
+    while (true) {
+        job_available.wait(lock, [&]() {
+            return stopping || find_open_job() != nullptr;
+        });
+        if (stopping) {
+            return;
+        }
+        Job *job = find_open_job();
+        int slot = job->next_slot++;
+        job->users++;
+        lock.unlock();
+        work_on(*job, slot);
+        lock.lock();
+        job->users--;
+        if (job->users == 0) {
+            job_finished.notify_all();
+        }
+    }
+}
+
+void ThreadPool::run(int begin, int end, int num_threads, const RangeFunction &body, int grain_size) {
+    if (end <= begin) {
+        return;
+    }
+    if (num_threads <= 1 || (inside_job && !nested_parallelism)) {
+        body(begin, end);
+        return;
+    }
+    grow(num_threads - 1);
+    int64 n = end - begin;
+    Job job;
+    job.body = &body;
+    job.grain_size = grain_size > 0 ? grain_size : (int)std::max(int64(1), n / (num_threads * 32));
+    job.slots.resize(num_threads);
+    for (int i = 0; i < num_threads; i++) {
+        job.slots[i].begin = begin + int(i * n / num_threads);
+        job.slots[i].end = begin + int((i + 1) * n / num_threads);
+    }
+    job.next_slot = 1;
+    job.users = 0;
+    {
+        std::lock_guard<std::mutex> _(mut);
+        jobs.push_back(&job);
+        num_jobs++;
+    }
+    job_available.notify_all();
+    work_on(job, 0);
+    std::unique_lock<std::mutex> lock(mut);
+    // Close the job to late workers; the ones inside must finish before it goes out of scope
+    job.next_slot = num_threads;
+    job_finished.wait(lock, [&]() {
+        return job.users == 0;
+    });
+    jobs.erase(std::find(jobs.begin(), jobs.end(), &job));
+}
+
+ThreadPool::Statistics ThreadPool::get_statistics() const {
+    std::lock_guard<std::mutex> _(mut);
+    Statistics stat;
+    stat.jobs = num_jobs;
+    stat.grains = num_grains;
+    stat.steals = num_steals;
+    stat.num_workers = (int)workers.size();
+    stat.busy_time = busy_nanoseconds * 1e-9;
+    stat.wall_time = Time::get_time() - statistics_start_time;
+    return stat;
+}
+
+void ThreadPool::reset_statistics() {
+    std::lock_guard<std::mutex> _(mut);
+    num_jobs = 0;
+    num_grains = 0;
+    num_steals = 0;
+    busy_nanoseconds = 0;
+    statistics_start_time = Time::get_time();
+}
+
+bool AsyncTask::is_done() const {
+    std::lock_guard<std::mutex> _(mut);
+    return done;
+}
+
+bool AsyncTask::wait(double timeout) {
+    std::unique_lock<std::mutex> lock(mut);
+    if (timeout < 0) {
+        finished.wait(lock, [&]() { return done; });
+        return true;
+    }
+    return finished.wait_for(lock, std::chrono::duration<double>(timeout), [&]() { return done; });
+}
+
+void AsyncTask::get() {
+    wait();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void AsyncTask::add_callback(const std::function<void()> &callback) {
+    {
+        std::lock_guard<std::mutex> _(mut);
+        if (!done) {
+            callbacks.push_back(callback);
+            return;
+        }
+    }
+    callback();
+}
+
+void AsyncTask::finish(std::exception_ptr error) {
+    std::vector<std::function<void()>> callbacks;
+    {
+        std::lock_guard<std::mutex> _(mut);
+        this->error = error;
+        done = true;
+        callbacks.swap(this->callbacks);
+    }
+    finished.notify_all();
+    for (auto &callback : callbacks) {
+        callback();
+    }
+}
+
+// Shared with the executor thread, which outlives the AsyncExecutor until the queue runs dry
+struct AsyncExecutor::Queue {
+    std::mutex mut;
+    std::condition_variable work_available;
+    std::deque<std::pair<std::function<void()>, std::shared_ptr<AsyncTask>>> work;
+    bool stopping = false;
+};
+
+AsyncExecutor::AsyncExecutor() : queue(std::make_shared<Queue>()) {
+    std::shared_ptr<Queue> queue = this->queue;
+    std::thread([queue]() {
+        Tracer::set_thread_name("async executor");
+        while (true) {
+            std::unique_lock<std::mutex> lock(queue->mut);
+            queue->work_available.wait(lock, [&]() { return queue->stopping || !queue->work.empty(); });
+            if (queue->work.empty()) {
+                return;
+            }
+            auto item = std::move(queue->work.front());
+            queue->work.pop_front();
+            lock.unlock();
+            std::exception_ptr error;
+            try {
+                item.first();
+            } catch (...) {
+                error = std::current_exception();
+            }
+            item.second->finish(error);
+        }
+    }).detach();
+}
+
+std::shared_ptr<AsyncTask> AsyncExecutor::submit(const std::function<void()> &work) {
+    auto task = std::make_shared<AsyncTask>();
+    {
+        std::lock_guard<std::mutex> _(queue->mut);
+        queue->work.emplace_back(work, task);
+    }
+    queue->work_available.notify_one();
+    return task;
+}
+
+AsyncExecutor::~AsyncExecutor() {
+    {
+        std::lock_guard<std::mutex> _(queue->mut);
+        queue->stopping = true;
+    }
+    queue->work_available.notify_one();
+}
+
+void ThreadPool::Statistics::print() const {
+    printf("Thread pool: %d workers, %lld jobs, %lld grains, %lld steals, %.3f s busy / %.3f s wall, "
+                   "utilization %.1f%%\n", num_workers, (long long)jobs, (long long)grains, (long long)steals,
+           busy_time, wall_time, 100.0 * get_utilization());
+}
+
 TC_NAMESPACE_END
@@ -8,6 +8,7 @@
 *******************************************************************************/
 
 #include <taichi/system/timer.h>
+#include <mutex>
 
 #ifndef _WIN64
 
@@ -21,6 +22,7 @@ TC_NAMESPACE_BEGIN
 using namespace std;
 
 std::map<std::string, std::pair<double, int>> Time::Timer::memo;
+static std::mutex memo_mutex;
 
 std::map<std::string, double> Time::FPSCounter::last_refresh;
 std::map<std::string, int> Time::FPSCounter::counter;
@@ -89,13 +91,15 @@ void Time::Timer::output() {
     if (left.size() < 60) {
         left += std::string(60 - left.size(), '-');
     }
-    if (memo.find(name) == memo.end()) {
-        memo.insert(make_pair(name, make_pair(0.0, 0)));
+    pair<double, int> memo_record;
+    {
+        // Timers may end on several threads at once
+        std::lock_guard<std::mutex> _(memo_mutex);
+        memo_record = memo[name];
+        memo_record.first += elapsed;
+        memo_record.second += 1;
+        memo[name] = memo_record;
     }
-    pair<double, int> memo_record = memo[name];
-    memo_record.first += elapsed;
-    memo_record.second += 1;
-    memo[name] = memo_record;
     double avg = memo_record.first / memo_record.second;
     this->print_record(left.c_str(), elapsed, avg);
 }
@@ -0,0 +1,148 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/tracer.h>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+std::atomic<bool> Tracer::enabled(false);
+const std::chrono::steady_clock::time_point Tracer::epoch = std::chrono::steady_clock::now();
+
+namespace {
+
+// The mutex is only contended while the events are read
+struct ThreadTrace {
+    std::mutex mut;
+    int tid;
+    std::string name;
+    std::vector<Tracer::Event> events;
+};
+
+// Kept after their threads exit, so that their events can still be written
+struct TraceRegistry {
+    std::mutex mut;
+    std::vector<std::shared_ptr<ThreadTrace>> threads;
+};
+
+TraceRegistry &get_registry() {
+    // Never destroyed, for threads that exit after static destruction began
+    static TraceRegistry *registry = new TraceRegistry();
+    return *registry;
+}
+
+ThreadTrace &get_local_trace() {
+    thread_local std::shared_ptr<ThreadTrace> trace;
+    if (!trace) {
+        trace = std::make_shared<ThreadTrace>();
+        TraceRegistry &registry = get_registry();
+        std::lock_guard<std::mutex> _(registry.mut);
+        trace->tid = (int)registry.threads.size();
+        registry.threads.push_back(trace);
+    }
+    return *trace;
+}
+
+void write_json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', f);
+            fputc(*s, f);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(f, "\\u%04x", (unsigned char)*s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+}
+
+void Tracer::set_enabled(bool enabled) {
+    Tracer::enabled.store(enabled, std::memory_order_relaxed);
+}
+
+void Tracer::add_event(const char *name, int64 begin, int64 end) {
+    Event event;
+    std::strncpy(event.name, name, max_name_length);
+    event.name[max_name_length] = 0;
+    event.begin = begin;
+    event.end = end;
+    ThreadTrace &trace = get_local_trace();
+    std::lock_guard<std::mutex> _(trace.mut);
+    trace.events.push_back(event);
+}
+
+void Tracer::set_thread_name(const std::string &name) {
+    ThreadTrace &trace = get_local_trace();
+    std::lock_guard<std::mutex> _(trace.mut);
+    trace.name = name;
+}
+
+void Tracer::clear() {
+    TraceRegistry &registry = get_registry();
+    std::lock_guard<std::mutex> _(registry.mut);
+    for (auto &trace : registry.threads) {
+        std::lock_guard<std::mutex> __(trace->mut);
+        std::vector<Event>().swap(trace->events);
+    }
+}
+
+int64 Tracer::get_num_events() {
+    TraceRegistry &registry = get_registry();
+    std::lock_guard<std::mutex> _(registry.mut);
+    int64 num_events = 0;
+    for (auto &trace : registry.threads) {
+        std::lock_guard<std::mutex> __(trace->mut);
+        num_events += (int64)trace->events.size();
+    }
+    return num_events;
+}
+
+void Tracer::write_chrome_trace(const std::string &filename) {
+    FILE *f = fopen(filename.c_str(), "w");
+    assert_info(f != nullptr, "Can not open " + filename + " for writing");
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    auto begin_event = [&]() {
+        fprintf(f, first ? "  {" : ",\n  {");
+        first = false;
+    };
+    TraceRegistry &registry = get_registry();
+    std::lock_guard<std::mutex> _(registry.mut);
+    for (auto &trace : registry.threads) {
+        std::lock_guard<std::mutex> __(trace->mut);
+        if (trace->events.empty()) {
+            continue;
+        }
+        const std::string name = trace->name.empty() ? "thread " + std::to_string(trace->tid) : trace->name;
+        begin_event();
+        fprintf(f, "\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": ",
+                trace->tid);
+        write_json_string(f, name.c_str());
+        fprintf(f, "}}");
+        for (auto &event : trace->events) {
+            begin_event();
+            fprintf(f, "\"name\": ");
+            write_json_string(f, event.name);
+            fprintf(f, ", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}", trace->tid,
+                    event.begin * 1e-3, (event.end - event.begin) * 1e-3);
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+}
+
+TC_NAMESPACE_END
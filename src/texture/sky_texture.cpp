@@ -8,6 +8,8 @@
 *******************************************************************************/
 
 #include <taichi/visual/texture.h>
+#include <taichi/math/array_2d.h>
+#include <taichi/system/threading.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -105,6 +107,77 @@ private:
         return ONE_OVER_FOURPI * ((1.0f - g2) * inverse);
     }
 
+    // Per sun position, see update_sun()
+    Vector3 sun_direction;
+    real sun_e;
+    Vector3 beta_r, beta_m;
+
+    // With lut_resolution > 0, the sky without the sun disk, tabulated at lut_resolution^2 texels. It depends on
+    // the view direction only through its zenith angle, clamped to the horizon, and its angle to the sun, so
+    // the table is over these: zenith angles in [0, pi / 2] along the first axis, angles to the sun in [0, pi]
+    // along the second
+    int lut_resolution;
+    Array2D<Vector3> lut;
+
+    // Combined extinction factor
+    Vector3 get_extinction(real zenith_angle) const {
+        real inverse =
+                1.0f / (std::cos(zenith_angle) + 0.15f * std::pow(93.885f - ((zenith_angle * 180.0f) / pi), -1.253f));
+        real sR = rayleighZenithLength * inverse;
+        real sM = mieZenithLength * inverse;
+        return exp(-(beta_r * sR + beta_m * sM));
+    }
+
+    // Without the sun disk
+    Vector3 get_sky(real zenith_angle, real cos_theta) const {
+        Vector3 Fex = get_extinction(zenith_angle);
+
+        // in scattering
+        real rPhase = rayleighPhase(cos_theta * 0.5f + 0.5f);
+        Vector3 betaRTheta = beta_r * rPhase;
+
+        real mPhase = hgPhase(cos_theta, mie_directional_g);
+        Vector3 betaMTheta = beta_m * mPhase;
+
+        Vector3 Lin = pow(sun_e * ((betaRTheta + betaMTheta) / (beta_r + beta_m)) * (1.0f - Fex), Vector3(1.5f));
+        Lin *= mix(Vector3(1.0f),
+                   pow(sun_e * ((betaRTheta + betaMTheta) / (beta_r + beta_m)) * Fex, Vector3(1.0f / 2.0f)),
+                   clamp(pow(1.0f - dot(up, sun_direction), 5.0f), 0.0f, 1.0f));
+
+        // nightsky
+        Vector3 L0 = Vector3(0.1f) * Fex;
+
+        return (Lin + L0) * 0.04f + Vector3(0.0f, 0.0003f, 0.00075f);
+    }
+
+    // The terms of the model that depend on the sun only, and the table, if any
+    void update_sun(int num_threads) {
+        sun_direction = normalized(sun_position);
+
+        sun_e = sunIntensity(dot(sun_direction, up));
+
+        real sunfade = 1.0f - clamp(1.0f - std::exp((sun_position.y / 450000.0f)), 0.0f, 1.0f);
+
+        real rayleighCoefficient = rayleigh - (1.0f * (1.0f - sunfade));
+
+        // extinction (absorbtion + out scattering)
+        // rayleigh coefficients
+        beta_r = totalRayleigh * rayleighCoefficient;
+
+        // mie coefficients
+        beta_m = totalMie(turbidity) * mie_coefficient;
+
+        if (lut_resolution > 0) {
+            lut.initialize(Vector2i(lut_resolution, lut_resolution));
+            parallel_for(0, lut_resolution, num_threads, [&](int i) {
+                for (int j = 0; j < lut_resolution; j++) {
+                    lut[i][j] = get_sky((i + 0.5f) / lut_resolution * (pi / 2),
+                                        std::cos((j + 0.5f) / lut_resolution * pi));
+                }
+            });
+        }
+    }
+
 public:
     void initialize(const Config &config) override {
         Texture::initialize(config);
@@ -114,75 +187,36 @@ public:
         TC_LOAD_CONFIG(mie_coefficient, 0.005f);
         TC_LOAD_CONFIG(mie_directional_g, 0.8f);
         TC_LOAD_CONFIG(cameraPos, Vector3(0.0f));
+        TC_LOAD_CONFIG(lut_resolution, 0);
         real theta = config.get("direction", 0.0f) * 2 * pi;
         real phi = (config.get("height", 0.0f) - 0.5) * pi;
         sun_position = Vector3(cos(theta) * cos(phi), sin(phi), sin(theta) * cos(phi));
+        update_sun(config.get("num_threads", 1));
     }
 
-    virtual Vector4 sample(const Vector3 &coord) const override {
-        // TODO: what is position?
-        Vector3 vWorldPosition;
-        Vector3 vSunDirection;
-        real vSunfade;
-        Vector3 vBetaR;
-        Vector3 vBetaM;
-        real vSunE;
-
-        real luminance;
-        real mieDirectionalG;
+    real get_cost() const override {
+        return lut_resolution > 0 ? 16.0f : 64.0f;
+    }
 
+    virtual Vector4 sample(const Vector3 &coord) const override {
         real theta_d = coord.x * 2 * pi, phi_d = (coord.y - 0.5f) * pi;
-        vWorldPosition = Vector3(cos(theta_d) * cos(phi_d), sin(phi_d), sin(theta_d) * cos(phi_d));
-        vSunDirection = normalized(sun_position);
-
-        vSunE = sunIntensity(dot(vSunDirection, up));
-
-        vSunfade = 1.0f - clamp(1.0f - std::exp((sun_position.y / 450000.0f)), 0.0f, 1.0f);
-
-        real rayleighCoefficient = rayleigh - (1.0f * (1.0f - vSunfade));
-
-        // extinction (absorbtion + out scattering)
-        // rayleigh coefficients
-        vBetaR = totalRayleigh * rayleighCoefficient;
-
-        // mie coefficients
-        vBetaM = totalMie(turbidity) * mie_coefficient;
-        real zenithAngle = std::acos(std::max(0.0f, dot(up, normalize(vWorldPosition - cameraPos))));
-        real inverse =
-                1.0f / (std::cos(zenithAngle) + 0.15f * std::pow(93.885f - ((zenithAngle * 180.0f) / pi), -1.253f));
-        real sR = rayleighZenithLength * inverse;
-        real sM = mieZenithLength * inverse;
-
-        // combined extinction factor
-        Vector3 Fex = exp(-(vBetaR * sR + vBetaM * sM));
-
-        // in scattering
-        real cosTheta = dot(normalize(vWorldPosition - cameraPos), vSunDirection);
-
-        real rPhase = rayleighPhase(cosTheta * 0.5f + 0.5f);
-        Vector3 betaRTheta = vBetaR * rPhase;
-
-        real mPhase = hgPhase(cosTheta, mieDirectionalG);
-        Vector3 betaMTheta = vBetaM * mPhase;
-
-        Vector3 Lin = pow(vSunE * ((betaRTheta + betaMTheta) / (vBetaR + vBetaM)) * (1.0f - Fex), Vector3(1.5f));
-        Lin *= mix(Vector3(1.0f),
-                   pow(vSunE * ((betaRTheta + betaMTheta) / (vBetaR + vBetaM)) * Fex, Vector3(1.0f / 2.0f)),
-                   clamp(pow(1.0f - dot(up, vSunDirection), 5.0f), 0.0f, 1.0f));
-
-        // nightsky
+        Vector3 vWorldPosition = Vector3(cos(theta_d) * cos(phi_d), sin(phi_d), sin(theta_d) * cos(phi_d));
         Vector3 direction = normalize(vWorldPosition - cameraPos);
-        real theta = std::acos(direction.y); // elevation --> y-axis, [-pi/2, pi/2]
-        //NOTE: changed atan to atan2
-        real phi = std::atan2(direction.z, direction.x); // azimuth --> x-axis [-pi/2, pi/2]
-        Vector2 uv = Vector2(phi, theta) / Vector2(2.0f * pi, pi) + Vector2(0.5f, 0.0f);
-        Vector3 L0 = Vector3(0.1f) * Fex;
+        real zenithAngle = std::acos(clamp(direction.y, 0.0f, 1.0f));
+        real cosTheta = clamp(dot(direction, sun_direction), -1.0f, 1.0f);
 
-        // composition + solar disc
-        real sundisk = smoothstep(sunAngularDiameterCos, sunAngularDiameterCos + 0.00002f, cosTheta);
-        L0 += (vSunE * 19000.0f * Fex) * sundisk;
+        Vector3 texColor;
+        if (lut_resolution > 0) {
+            texColor = lut.sample_relative_coord(zenithAngle / (pi / 2), std::acos(cosTheta) / pi);
+        } else {
+            texColor = get_sky(zenithAngle, cosTheta);
+        }
 
-        Vector3 texColor = (Lin + L0) * 0.04f + Vector3(0.0f, 0.0003f, 0.00075f);
+        // composition + solar disc
+        if (cosTheta > sunAngularDiameterCos) {
+            real sundisk = smoothstep(sunAngularDiameterCos, sunAngularDiameterCos + 0.00002f, cosTheta);
+            texColor += (sun_e * 19000.0f * get_extinction(zenithAngle)) * sundisk * 0.04f;
+        }
 
         //Vector3 curr = Uncharted2Tonemap( ( log2( 2.0 / pow( luminance, 4.0 ) ) ) * texColor );
         //Vector3 color = curr * whiteScale;
@@ -8,10 +8,12 @@
 *******************************************************************************/
 
 #include <taichi/visual/texture.h>
+#include <taichi/visual/texture_cache.h>
 #include <taichi/visual/scene_geometry.h>
 #include <taichi/visualization/image_buffer.h>
 #include <taichi/math/array_3d.h>
 #include <taichi/math/levelset_3d.h>
+#include <taichi/io/paged_array.h>
 #include <taichi/common/asset_manager.h>
 
 TC_NAMESPACE_BEGIN
@@ -28,6 +30,15 @@ public:
     virtual Vector4 sample(const Vector3 &coord) const override {
         return val;
     }
+
+    void sample_n(const Vector3 *coords, int count, Vector4 *values) const override {
+        std::fill(values, values + count, val);
+    }
+
+    bool get_constant(Vector4 &value) const override {
+        value = val;
+        return true;
+    }
 };
 
 TC_IMPLEMENTATION(Texture, ConstantTexture, "const");
@@ -35,14 +46,35 @@ TC_IMPLEMENTATION(Texture, ConstantTexture, "const");
 class Array3DTexture : public Texture {
 protected:
     Array3D<Vector4> arr;
+    // If "paged_file", the array is instead read out of core, within "resident_budget" bytes
+    PagedArray3D<Vector4> paged;
+    bool is_paged = false;
 public:
     void initialize(const Config &config) override {
         Texture::initialize(config);
-        arr = *config.get_ptr<Array3D<Vector4>>("array_ptr");
+        const std::string paged_file = config.get("paged_file", "");
+        if (!paged_file.empty()) {
+            paged.open(paged_file, config.get("resident_budget", PagedArray3D<Vector4>::default_budget));
+            is_paged = true;
+        } else {
+            arr = *config.get_ptr<Array3D<Vector4>>("array_ptr");
+        }
     }
 
     virtual Vector4 sample(const Vector3 &coord) const override {
-        return arr.sample_relative_coord(coord);
+        return is_paged ? paged.sample_relative_coord(coord) : arr.sample_relative_coord(coord);
+    }
+
+    void sample_n(const Vector3 *coords, int count, Vector4 *values) const override {
+        if (is_paged) {
+            for (int i = 0; i < count; i++) {
+                values[i] = paged.sample_relative_coord(coords[i]);
+            }
+            return;
+        }
+        for (int i = 0; i < count; i++) {
+            values[i] = arr.sample_relative_coord(coords[i]);
+        }
     }
 };
 
@@ -51,10 +83,16 @@ TC_IMPLEMENTATION(Texture, Array3DTexture, "array3d");
 class ImageTexture : public Texture {
 protected:
     Array2D<Vector4> image;
+    // If "tiled", the image is instead read out of core through the texture cache, mip-mapped
+    std::shared_ptr<TiledImage> tiled;
 public:
     void initialize(const Config &config) override {
         Texture::initialize(config);
-        image.load(config.get_string("filename"));
+        if (config.get("tiled", false)) {
+            tiled = TiledImage::open(config.get_string("filename"), config.get("tile_file", ""));
+        } else {
+            image.load(config.get_string("filename"));
+        }
     }
 
     bool inside(const Vector3 &coord) const {
@@ -66,10 +104,12 @@ public:
 
     virtual Vector4 sample(const Vector3 &coord_) const override {
         Vector2 coord(coord_.x - floor(coord_.x), coord_.y - floor(coord_.y));
-        if (inside(coord_))
-            return image.sample_relative_coord(coord);
-        else
+        if (!inside(coord_))
             return Vector4(0);
+        else if (tiled)
+            return tiled->sample(coord, TextureFootprint::get());
+        else
+            return image.sample_relative_coord(coord);
     }
 };
 
@@ -213,6 +253,10 @@ public:
     virtual Vector4 sample(const Vector3 &coord) const override {
         return sample(Vector2(coord.x, coord.y));
     }
+
+    real get_cost() const override {
+        return 16.0f;
+    }
 };
 
 TC_IMPLEMENTATION(Texture, TaichiTexture, "taichi");
@@ -253,6 +297,10 @@ public:
     virtual Vector4 sample(const Vector3 &coord) const override {
         return Vector4(coeff_u * coord.x + coeff_v * coord.y);
     }
+
+    real get_cost() const override {
+        return 2.0f;
+    }
 };
 
 TC_IMPLEMENTATION(Texture, UVTexture, "uv");
@@ -8,6 +8,7 @@
 *******************************************************************************/
 
 #include <taichi/visual/texture.h>
+#include <taichi/visual/compiled_texture.h>
 #include <taichi/visualization/image_buffer.h>
 #include <taichi/common/asset_manager.h>
 
@@ -34,6 +35,21 @@ public:
             c = glm::fract(c);
         return tex->sample(c);
     }
+
+    void sample_n(const Vector3 *coords, int count, Vector4 *values) const override {
+        std::vector<Vector3> c(count);
+        for (int i = 0; i < count; i++) {
+            c[i] = inv_zoom * (coords[i] - center) + center;
+            if (repeat)
+                c[i] = glm::fract(c[i]);
+        }
+        tex->sample_n(c.data(), count, values);
+    }
+
+    int compile(TextureGraph &graph) const override {
+        const Matrix3 m(inv_zoom.x, 0, 0, 0, inv_zoom.y, 0, 0, 0, inv_zoom.z);
+        return graph.add_affine(graph.compile(tex), m, center - inv_zoom * center, repeat);
+    }
 };
 
 TC_IMPLEMENTATION(Texture, ZoomingTexture, "zoom");
@@ -62,6 +78,24 @@ public:
         }
         return p;
     }
+
+    void sample_n(const Vector3 *coords, int count, Vector4 *values) const override {
+        std::vector<Vector4> values2(count);
+        tex1->sample_n(coords, count, values);
+        tex2->sample_n(coords, count, values2.data());
+        for (int i = 0; i < count; i++) {
+            values[i] = alpha * values[i] + beta * values2[i];
+            if (need_clamp) {
+                for (int k = 0; k < 3; k++) {
+                    values[i][k] = clamp(values[i][k], 0.0f, 1.0f);
+                }
+            }
+        }
+    }
+
+    int compile(TextureGraph &graph) const override {
+        return graph.add_linear(graph.compile(tex1), graph.compile(tex2), alpha, beta, need_clamp);
+    }
 };
 
 TC_IMPLEMENTATION(Texture, LinearOpTexture, "linear_op");
@@ -80,6 +114,19 @@ public:
     virtual Vector4 sample(const Vector3 &coord) const override {
         return tex1->sample(coord) * tex2->sample(coord);
     }
+
+    void sample_n(const Vector3 *coords, int count, Vector4 *values) const override {
+        std::vector<Vector4> values2(count);
+        tex1->sample_n(coords, count, values);
+        tex2->sample_n(coords, count, values2.data());
+        for (int i = 0; i < count; i++) {
+            values[i] *= values2[i];
+        }
+    }
+
+    int compile(TextureGraph &graph) const override {
+        return graph.add_mul(graph.compile(tex1), graph.compile(tex2));
+    }
 };
 
 TC_IMPLEMENTATION(Texture, MultiplicationTexture, "mul");
@@ -96,6 +143,17 @@ public:
     virtual Vector4 sample(const Vector3 &coord) const override {
         return glm::fract(tex->sample(coord));
     }
+
+    void sample_n(const Vector3 *coords, int count, Vector4 *values) const override {
+        tex->sample_n(coords, count, values);
+        for (int i = 0; i < count; i++) {
+            values[i] = glm::fract(values[i]);
+        }
+    }
+
+    int compile(TextureGraph &graph) const override {
+        return graph.add_fract(graph.compile(tex));
+    }
 };
 
 TC_IMPLEMENTATION(Texture, FractTexture, "fract");
@@ -123,6 +181,21 @@ public:
         real w = coord.z - floor(coord.z * repeat_w) * inv_repeat_w;
         return tex->sample(Vector3(u * repeat_u, v * repeat_v, w * repeat_w));
     }
+
+    void sample_n(const Vector3 *coords, int count, Vector4 *values) const override {
+        std::vector<Vector3> c(count);
+        for (int i = 0; i < count; i++) {
+            real u = coords[i].x - floor(coords[i].x * repeat_u) * inv_repeat_u;
+            real v = coords[i].y - floor(coords[i].y * repeat_v) * inv_repeat_v;
+            real w = coords[i].z - floor(coords[i].z * repeat_w) * inv_repeat_w;
+            c[i] = Vector3(u * repeat_u, v * repeat_v, w * repeat_w);
+        }
+        tex->sample_n(c.data(), count, values);
+    }
+
+    int compile(TextureGraph &graph) const override {
+        return graph.add_repeat(graph.compile(tex), Vector3(repeat_u, repeat_v, repeat_w));
+    }
 };
 
 TC_IMPLEMENTATION(Texture, RepeatedTexture, "repeat");
@@ -159,6 +232,30 @@ public:
         coord = (coord + Vector3(1.f, 1.f, 1.f)) / 2.f;
         return tex->sample(coord);
     }
+
+    // Rotations about the center, (rotation * (2 coord - 1) + 1) / 2
+    int compile(TextureGraph &graph) const override {
+        Matrix3 rotation(1.0f);
+        for (int i = 0; i < rotate_times; i++) {
+            Matrix3 r(0.0f);
+            switch (rotate_axis) {
+                case 0:
+                    r = Matrix3(1, 0, 0, 0, 0, 1, 0, -1, 0);
+                    break;
+                case 1:
+                    r = Matrix3(0, 0, -1, 0, 1, 0, 1, 0, 0);
+                    break;
+                case 2:
+                    r = Matrix3(0, 1, 0, -1, 0, 0, 0, 0, 1);
+                    break;
+                default:
+                    r = Matrix3(1.0f);
+            }
+            rotation = r * rotation;
+        }
+        return graph.add_affine(graph.compile(tex), rotation, (Vector3(1.0f) - rotation * Vector3(1.0f)) * 0.5f,
+                                false);
+    }
 };
 
 TC_IMPLEMENTATION(Texture, RotatedTexture, "rotate");
@@ -179,6 +276,22 @@ public:
         coord[flip_axis] = 1.0f - coord[flip_axis];
         return tex->sample(coord);
     }
+
+    void sample_n(const Vector3 *coords, int count, Vector4 *values) const override {
+        std::vector<Vector3> c(coords, coords + count);
+        for (int i = 0; i < count; i++) {
+            c[i][flip_axis] = 1.0f - c[i][flip_axis];
+        }
+        tex->sample_n(c.data(), count, values);
+    }
+
+    int compile(TextureGraph &graph) const override {
+        Matrix3 m(1.0f);
+        m[flip_axis][flip_axis] = -1.0f;
+        Vector3 offset(0.0f);
+        offset[flip_axis] = 1.0f;
+        return graph.add_affine(graph.compile(tex), m, offset, false);
+    }
 };
 
 TC_IMPLEMENTATION(Texture, FlippedTexture, "flip");
@@ -205,6 +318,10 @@ public:
         else
             return outside_val;
     }
+
+    int compile(TextureGraph &graph) const override {
+        return graph.add_bound(graph.compile(tex), bound_axis, bounds, outside_val);
+    }
 };
 
 TC_IMPLEMENTATION(Texture, BoundedTexture, "bound");
@@ -220,13 +337,7 @@ public:
         auto tex = AssetManager::get_asset<Texture>(config.get_int("tex"));
         resolution_x = config.get_int("resolution_x");
         resolution_y = config.get_int("resolution_y");
-        cache = Array2D<Vector4>(resolution_x, resolution_y);
-        for (int i = 0; i < resolution_x; i++) {
-            for (int j = 0; j < resolution_y; j++) {
-                cache.set(i, j, tex->sample(
-                        Vector2((i + 0.5f) / resolution_x, (j + 0.5f) / resolution_y)));
-            }
-        }
+        cache = tex->rasterize(Vector2i(resolution_x, resolution_y), config.get("num_threads", 1));
     }
 
     virtual Vector4 sample(const Vector2 &coord) const override {
@@ -236,6 +347,16 @@ public:
     virtual Vector4 sample(const Vector3 &coord) const override {
         return cache.sample_relative_coord(Vector2(coord.x, coord.y));
     }
+
+    void sample_n(const Vector3 *coords, int count, Vector4 *values) const override {
+        for (int i = 0; i < count; i++) {
+            values[i] = cache.sample_relative_coord(Vector2(coords[i].x, coords[i].y));
+        }
+    }
+
+    real get_cost() const override {
+        return TextureGraph::baked_cost;
+    }
 };
 
 TC_IMPLEMENTATION(Texture, RasterizedTexture, "rasterize");
@@ -12,6 +12,10 @@
 #include <taichi/math/array_3d.h>
 #include <taichi/math/stencils.h>
 #include <taichi/common/asset_manager.h>
+#include <taichi/io/volume_exporter.h>
+#include <taichi/io/array_file.h>
+#include <taichi/io/paged_array.h>
+#include <taichi/io/simulation_cache.h>
 #include <queue>
 
 TC_NAMESPACE_BEGIN
@@ -49,56 +53,222 @@ TC_IMPLEMENTATION(VolumeMaterial, VacuumVolumeMaterial, "vacuum");
 
 class VoxelVolumeMaterial : public VolumeMaterial {
 protected:
+    static constexpr int majorant_brick_size = 8;
+
     Array3D<real> voxels;
+    // Instead of voxels, for "paged_file"
+    std::shared_ptr<PagedArray3D<real>> paged_voxels;
     std::shared_ptr<Texture> tex;
     Vector3i resolution;
     real maximum;
+    // Per brick of majorant_brick_size^3 voxels, the maximum density trilinear lookups within it may return
+    Array3D<real> majorants;
+
+    real get_voxel(int i, int j, int k) const {
+        return paged_voxels ? paged_voxels->get(i, j, k) : voxels.get(i, j, k);
+    }
+
+    real sample_voxels(const Vector3 &coord) const {
+        return paged_voxels ? paged_voxels->sample_relative_coord(coord) : voxels.sample_relative_coord(coord);
+    }
+
+    void build_majorants() {
+        const Vector3i bricks = (resolution + Vector3i(majorant_brick_size - 1)) / majorant_brick_size;
+        majorants.initialize(bricks.x, bricks.y, bricks.z, 0.0f);
+        const Vector3 offset = paged_voxels ? paged_voxels->get_storage_offset() : voxels.get_storage_offset();
+        for (auto &ind : majorants.get_region()) {
+            const Vector3i brick(ind.i, ind.j, ind.k);
+            Vector3i lower, upper;
+            for (int a = 0; a < 3; a++) {
+                // Lookups in [brick, brick + 1) interpolate voxels from floor(brick - offset), one past the last
+                lower[a] = std::max(0, (int)std::floor(brick[a] * majorant_brick_size - offset[a]));
+                upper[a] = std::min(resolution[a] - 1,
+                                    (int)std::floor((brick[a] + 1) * majorant_brick_size - offset[a]) + 1);
+            }
+            real m = 0.0f;
+            for (int i = lower.x; i <= upper.x; i++) {
+                for (int j = lower.y; j <= upper.y; j++) {
+                    for (int k = lower.z; k <= upper.z; k++) {
+                        m = std::max(m, get_voxel(i, j, k));
+                    }
+                }
+            }
+            majorants[ind] = m;
+        }
+    }
+
+    // Calls visit(t0, t1, majorant) for the segments of orig + t * dir, for t in [0, limit), in successive
+    // majorant bricks, by a 3D DDA, until visit returns false. orig and dir are in voxel grid relative coordinates,
+    // so that t stays the world distance along an affinely transformed ray.
+    template <typename T>
+    void traverse_majorants(const Vector3 &orig, const Vector3 &dir, real limit, const T &visit) const {
+        const Vector3i bricks(majorants.get_width(), majorants.get_height(), majorants.get_depth());
+        const Vector3 scale = Vector3(resolution) * (1.0f / majorant_brick_size);
+        const Vector3 o = orig * scale, d = dir * scale;
+        real t0 = 0, t1 = limit;
+        for (int a = 0; a < 3; a++) {
+            if (d[a] == 0) {
+                if (o[a] < 0 || o[a] >= scale[a]) {
+                    return;
+                }
+                continue;
+            }
+            real ta = -o[a] / d[a], tb = (scale[a] - o[a]) / d[a];
+            if (ta > tb) {
+                std::swap(ta, tb);
+            }
+            t0 = std::max(t0, ta);
+            t1 = std::min(t1, tb);
+        }
+        if (!(t0 < t1)) {
+            return;
+        }
+        Vector3i cell, step;
+        Vector3 t_next, t_delta;
+        for (int a = 0; a < 3; a++) {
+            cell[a] = clamp((int)std::floor(o[a] + d[a] * t0), 0, bricks[a] - 1);
+            if (d[a] == 0) {
+                step[a] = 0;
+                t_next[a] = std::numeric_limits<real>::infinity();
+                t_delta[a] = 0;
+            } else {
+                step[a] = d[a] > 0 ? 1 : -1;
+                t_next[a] = (cell[a] + (d[a] > 0) - o[a]) / d[a];
+                t_delta[a] = std::abs(1 / d[a]);
+            }
+        }
+        real t = t0;
+        while (t < t1) {
+            const int a = t_next.x < t_next.y ? (t_next.x < t_next.z ? 0 : 2) : (t_next.y < t_next.z ? 1 : 2);
+            const real t_end = std::min(t_next[a], t1);
+            if (t_end > t && !visit(t, t_end, majorants.get(cell.x, cell.y, cell.z))) {
+                return;
+            }
+            t = t_end;
+            cell[a] += step[a];
+            t_next[a] += t_delta[a];
+            if (cell[a] < 0 || cell[a] >= bricks[a]) {
+                return;
+            }
+        }
+    }
 
 public:
     virtual void initialize(const Config &config) override {
         VolumeMaterial::initialize(config);
         this->volumetric_scattering = config.get_real("scattering");
         this->volumetric_absorption = config.get_real("absorption");
-        this->resolution = config.get_vec3i("resolution");
-        this->tex = AssetManager::get_asset<Texture>(config.get_int("tex"));
-        voxels.initialize(resolution.x, resolution.y, resolution.z, 1.0f);
+        const std::string sparse_volume = config.get("sparse_volume", "");
+        const std::string array_file = config.get("array_file", "");
+        const std::string paged_file = config.get("paged_file", "");
+        const std::string simulation_cache = config.get("simulation_cache", "");
+        if (!simulation_cache.empty()) {
+            // The volume of one frame of a SimulationCache
+            SimulationCacheReader cache(simulation_cache, config.get("num_threads", 1));
+            SparseVolume volume;
+            cache.read(config.get("frame", 0), nullptr, &volume);
+            load_sparse_volume(volume, simulation_cache, config.get("channel", "density"));
+        } else if (!paged_file.empty()) {
+            // A bricked array file written by write_paged_array_file, read out of core
+            paged_voxels = std::make_shared<PagedArray3D<real>>(
+                    paged_file, config.get("resident_budget", PagedArray3D<real>::default_budget));
+            this->resolution =
+                    Vector3i(paged_voxels->get_width(), paged_voxels->get_height(), paged_voxels->get_depth());
+        } else if (!array_file.empty()) {
+            // An Array3D<real> written by write_array_file
+            assert_info(read_array_file(array_file, voxels, config.get("num_threads", 1)),
+                        "Can not open " + array_file);
+            this->resolution = Vector3i(voxels.get_width(), voxels.get_height(), voxels.get_depth());
+        } else if (!sparse_volume.empty()) {
+            // A file written by Simulation3D::export_volume, instead of sampling a texture
+            load_sparse_volume(sparse_volume, config.get("channel", "density"));
+        } else {
+            this->resolution = config.get_vec3i("resolution");
+            this->tex = AssetManager::get_asset<Texture>(config.get_int("tex"));
+            voxels.initialize(resolution.x, resolution.y, resolution.z, 1.0f);
+            tex->rasterize(resolution, config.get("num_threads", 1), [&](int i, int j, int k, const Vector4 &value) {
+                voxels[i][j][k] = value.x;
+            });
+        }
         maximum = 0.0f;
-        Vector3 inv = Vector3(1.0f) / Vector3(resolution);
-        for (auto &ind : voxels.get_region()) {
-            voxels[ind] = tex->sample(ind.get_pos() * inv).x;
-            assert_info(voxels[ind] >= 0.0f, "Density can not be negative.");
-            maximum = std::max(maximum, voxels[ind]);
+        // Brick by brick, for paged voxels
+        const int brick_size = paged_voxels ? paged_voxels->get_brick_size() : 1;
+        for (auto &ind : Region3D(0, resolution.x, 0, resolution.y, 0, resolution.z, Vector3(0.5f), brick_size)) {
+            const real voxel = get_voxel(ind.i, ind.j, ind.k);
+            assert_info(voxel >= 0.0f, "Density can not be negative.");
+            maximum = std::max(maximum, voxel);
         }
+        build_majorants();
     }
 
+    void load_sparse_volume(const std::string &fn, const std::string &channel_name) {
+        SparseVolume volume;
+        assert_info(read_sparse_volume(fn, volume), fn + " is not a sparse volume");
+        load_sparse_volume(volume, fn, channel_name);
+    }
+
+    void load_sparse_volume(const SparseVolume &volume, const std::string &fn, const std::string &channel_name) {
+        const int channel = volume.get_channel(channel_name);
+        assert_info(channel != -1, "Sparse volume " + fn + " has no channel " + channel_name);
+        this->resolution = volume.res;
+        volume.to_array(channel, voxels);
+    }
+
+    // Delta tracking, against the majorant of each brick the ray passes through
     virtual real sample_free_distance(StateSequence &rand, const Ray &ray) const override {
-        int counter = 0;
-        real kill;
-        real dist = 0.0f;
-        real tot = volumetric_scattering + volumetric_absorption;
-        do {
-            counter += 1;
-            if (counter > 10000) {
-                printf("Warning: path too long\n");
-                break;
+        const real tot = volumetric_scattering + volumetric_absorption;
+        const Vector3 orig = multiply_matrix4(world2local, ray.orig, 1.0f);
+        const Vector3 dir = multiply_matrix4(world2local, ray.dir, 0.0f);
+        real dist = std::numeric_limits<real>::infinity();
+        traverse_majorants(orig, dir, ray.dist, [&](real t0, real t1, real majorant) {
+            if (majorant <= 0) {
+                return true;
             }
-            dist += -log(1 - rand()) / (maximum * tot);
-            Vector3 pos = ray.orig + ray.dir * dist;
-            pos = multiply_matrix4(world2local, pos, 1.0f);
-            if (pos.x < 0 || pos.x >= 1 || pos.y < 0 || pos.y >= 1 || pos.z < 0 || pos.z >= 1) {
-                // Outside the texture
-                dist = std::numeric_limits<real>::infinity();
-                break;
+            const real inv_majorant = 1.0f / majorant;
+            real t = t0;
+            while (true) {
+                t += -log(1 - rand()) * inv_majorant / tot;
+                if (t >= t1) {
+                    return true;
+                }
+                if (sample_voxels(orig + dir * t) * inv_majorant > rand()) {
+                    dist = t;
+                    return false;
+                }
             }
-            kill = voxels.sample_relative_coord(pos);
-        } while (maximum * rand() > kill && dist < ray.dist);
+        });
         return dist;
     }
 
+    // Ratio tracking, with Russian roulette once the transmittance gets low
     virtual real
     unbiased_sample_attenuation(const Vector3 &start, const Vector3 &end, StateSequence &rand) const override {
-        auto dir = normalized(end - start);
-        return sample_free_distance(rand, Ray(start, dir)) >= glm::length(end - start);
+        const real tot = volumetric_scattering + volumetric_absorption;
+        const Vector3 orig = multiply_matrix4(world2local, start, 1.0f);
+        const Vector3 dir = multiply_matrix4(world2local, normalized(end - start), 0.0f);
+        real transmittance = 1.0f;
+        traverse_majorants(orig, dir, glm::length(end - start), [&](real t0, real t1, real majorant) {
+            if (majorant <= 0) {
+                return true;
+            }
+            const real inv_majorant = 1.0f / majorant;
+            real t = t0;
+            while (true) {
+                t += -log(1 - rand()) * inv_majorant / tot;
+                if (t >= t1) {
+                    return true;
+                }
+                transmittance *= 1 - sample_voxels(orig + dir * t) * inv_majorant;
+                if (transmittance < 0.1f) {
+                    if (rand() * 0.1f >= transmittance) {
+                        transmittance = 0;
+                        return false;
+                    }
+                    transmittance = 0.1f;
+                }
+            }
+        });
+        return transmittance;
     }
 };
 
@@ -159,6 +329,7 @@ protected:
 public:
     virtual void initialize(const Config &config) override {
         VoxelVolumeMaterial::initialize(config);
+        assert_info(!paged_voxels, "SDF voxel volumes can not be paged");
         sdf.initialize(resolution.x, resolution.y, resolution.z, 1e30f);
         calculate_sdf();
     }
@@ -204,9 +375,9 @@ public:
 
 TC_IMPLEMENTATION(VolumeMaterial, SDFVoxelVolumeMaterial, "sdf_voxel");
 
-VolumeStack::VolumeStack() {
+VolumeStack::VolumeStack() : count(0) {
     static std::shared_ptr<VolumeMaterial> vacuum = create_instance<VolumeMaterial>("vacuum");
-    stack.push_back(vacuum.get());
+    push(vacuum.get());
 }
 
 